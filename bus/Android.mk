@@ -20,6 +20,7 @@ LOCAL_CFLAGS+=-Wno-address
 
 LOCAL_SRC_FILES:= \
 	activation.c \
+	atoms.c \
 	bus.c \
 	config-loader-expat.c \
 	config-parser.c \
@@ -30,11 +31,15 @@ LOCAL_SRC_FILES:= \
 	dispatch.c \
 	driver.c \
 	expirelist.c \
+	handoff.c \
+	logger.c \
 	main.c \
 	policy.c \
+	resolver.c \
 	selinux.c \
 	services.c \
 	signals.c \
+	stats.c \
 	utils.c
 
 LOCAL_SHARED_LIBRARIES := \
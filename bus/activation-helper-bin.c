@@ -78,17 +78,17 @@ main (int argc, char **argv)
   retval = 0;
 
   /* have we used a help option or not specified the correct arguments? */
-  if (argc != 2 ||
+  if (argc < 2 || argc > 3 ||
       strcmp (argv[1], "--help") == 0 ||
       strcmp (argv[1], "-h") == 0 ||
       strcmp (argv[1], "-?") == 0)
     {
-        fprintf (stderr, "dbus-daemon-activation-helper service.to.activate\n");
+        fprintf (stderr, "dbus-daemon-activation-helper service.to.activate [service-file]\n");
         exit (0);
     }
 
   dbus_error_init (&error);
-  if (!run_launch_helper (argv[1], &error))
+  if (!run_launch_helper (argv[1], argc == 3 ? argv[2] : NULL, &error))
     {
       /* convert error to an exit code */
       retval = convert_error_to_exit_code (&error);
@@ -43,9 +43,19 @@
 #include <dbus/dbus-shell.h>
 #include <dbus/dbus-marshal-validate.h>
 
+/*
+ * Finds and loads name.service from the configured service
+ * directories. If hint is not NULL, it is the path the daemon
+ * resolved the name to, and only a directory whose candidate path
+ * is exactly that string is tried, so the hint saves the failed
+ * opens in earlier directories without letting the daemon pick any
+ * file the scan could not have picked. If the hint matches nothing
+ * usable, the full scan runs instead.
+ */
 static BusDesktopFile *
 desktop_file_for_name (BusConfigParser *parser,
                        const char *name,
+                       const char *hint,
                        DBusError  *error)
 {
   BusDesktopFile *desktop_file;
@@ -100,6 +110,9 @@ desktop_file_for_name (BusConfigParser *parser,
           goto out;
         }
 
+      if (hint != NULL && !_dbus_string_equal_c_str (&full_path, hint))
+        continue;
+
       _dbus_verbose ("Trying to load file '%s'\n", _dbus_string_get_data (&full_path));
       desktop_file = bus_desktop_file_load (&full_path, &tmp_error);
       if (desktop_file == NULL)
@@ -124,6 +137,13 @@ desktop_file_for_name (BusConfigParser *parser,
         break;
     }
 
+  if (desktop_file == NULL && hint != NULL)
+    {
+      _dbus_verbose ("Service file hint '%s' not usable, scanning\n", hint);
+      desktop_file = desktop_file_for_name (parser, name, NULL, error);
+      goto out;
+    }
+
   /* Didn't find desktop file; set error */
   if (desktop_file == NULL)
     {
@@ -466,7 +486,10 @@ out:
 }
 
 static dbus_bool_t
-launch_bus_name (const char *bus_name, BusConfigParser *parser, DBusError *error)
+launch_bus_name (const char      *bus_name,
+                 const char      *service_file,
+                 BusConfigParser *parser,
+                 DBusError       *error)
 {
   BusDesktopFile *desktop_file;
   char *exec, *user;
@@ -477,7 +500,7 @@ launch_bus_name (const char *bus_name, BusConfigParser *parser, DBusError *error
   retval = FALSE;
 
   /* get the correct service file for the name we are trying to activate */
-  desktop_file = desktop_file_for_name (parser, bus_name, error);
+  desktop_file = desktop_file_for_name (parser, bus_name, service_file, error);
   if (desktop_file == NULL)
     return FALSE;
 
@@ -524,6 +547,7 @@ check_dbus_user (BusConfigParser *parser, DBusError *error)
 
 dbus_bool_t
 run_launch_helper (const char *bus_name,
+                   const char *service_file,
                    DBusError  *error)
 {
   BusConfigParser *parser;
@@ -549,7 +573,7 @@ run_launch_helper (const char *bus_name,
     goto error_free_parser;
 
   /* launch the bus with the service defined user */
-  if (!launch_bus_name (bus_name, parser, error))
+  if (!launch_bus_name (bus_name, service_file, parser, error))
     goto error_free_parser;
 
   /* woohoo! */
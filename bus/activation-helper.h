@@ -25,7 +25,9 @@
 #ifndef BUS_ACTIVATION_HELPER_H
 #define BUS_ACTIVATION_HELPER_H
 
-dbus_bool_t run_launch_helper (const char *bus_name, DBusError *error);
+dbus_bool_t run_launch_helper (const char *bus_name,
+                               const char *service_file,
+                               DBusError  *error);
 
 
 #endif /* BUS_ACTIVATION_HELPER_H */
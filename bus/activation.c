@@ -32,12 +32,14 @@
 #include "test.h"
 #include "utils.h"
 #include <dbus/dbus-internals.h>
+#include <dbus/dbus-file.h>
 #include <dbus/dbus-hash.h>
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-shell.h>
 #include <dbus/dbus-spawn.h>
 #include <dbus/dbus-timeout.h>
 #include <dbus/dbus-sysdeps.h>
+#include <string.h>
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
 #endif
@@ -47,6 +49,7 @@ struct BusActivation
   int refcount;
   DBusHashTable *entries;
   DBusHashTable *pending_activations;
+  DBusHashTable *systemd_units; /**< Pending activations waiting on each systemd unit, as a DBusList */
   char *server_address;
   BusContext *context;
   int n_pending_activations; /**< This is in fact the number of BusPendingActivationEntry,
@@ -55,6 +58,8 @@ struct BusActivation
                               */
   DBusHashTable *directories;
   DBusHashTable *environment;
+  DBusList *deferred_directories; /**< Directories still to be scanned on first use */
+  dbus_bool_t scan_deferred;
 };
 
 typedef struct
@@ -62,6 +67,7 @@ typedef struct
   int refcount;
   char *dir_c;
   DBusHashTable *entries;
+  int stamp;               /**< Incremented on every scan of the directory */
 } BusServiceDirectory;
 
 typedef struct
@@ -72,6 +78,9 @@ typedef struct
   char *user;
   char *systemd_service;
   unsigned long mtime;
+  unsigned long size;
+  unsigned int mtime_is_racy : 1; /**< File was modified in the second we parsed it */
+  int stamp;                      /**< s_dir->stamp of the last scan that saw the file */
   BusServiceDirectory *s_dir;
   char *filename;
 } BusActivationEntry;
@@ -97,10 +106,13 @@ typedef struct
   int n_entries;
   DBusBabysitter *babysitter;
   DBusTimeout *timeout;
+  DBusList unit_link; /**< Link in systemd_units while waiting on systemd_service */
   unsigned int timeout_added : 1;
 } BusPendingActivation;
 
-#if 0
+static void systemd_unit_remove_pending (BusActivation        *activation,
+                                         BusPendingActivation *pending_activation);
+
 static BusServiceDirectory *
 bus_service_directory_ref (BusServiceDirectory *dir)
 {
@@ -110,7 +122,6 @@ bus_service_directory_ref (BusServiceDirectory *dir)
 
   return dir;
 }
-#endif
 
 static void
 bus_service_directory_unref (BusServiceDirectory *dir)
@@ -187,6 +198,10 @@ bus_pending_activation_unref (BusPendingActivation *pending_activation)
   if (pending_activation->timeout)
     _dbus_timeout_unref (pending_activation->timeout);
 
+  if (pending_activation->unit_link.data != NULL)
+    systemd_unit_remove_pending (pending_activation->activation,
+                                 pending_activation);
+
   if (pending_activation->babysitter)
     {
       if (!_dbus_babysitter_set_watch_functions (pending_activation->babysitter,
@@ -360,7 +375,14 @@ update_desktop_file_entry (BusActivation       *activation,
   entry = _dbus_hash_table_lookup_string (s_dir->entries,
                                           _dbus_string_get_const_data (filename));
 
-  exec = strdup (_dbus_replace_install_prefix (exec_tmp));
+  exec = _dbus_strdup (_dbus_replace_install_prefix (exec_tmp));
+  dbus_free (exec_tmp);
+  exec_tmp = NULL;
+  if (exec == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
 
   if (entry == NULL) /* New file */
     {
@@ -386,6 +408,8 @@ update_desktop_file_entry (BusActivation       *activation,
       entry->user = user;
       entry->systemd_service = systemd_service;
       entry->refcount = 1;
+      /* owned by the entry now */
+      name = exec = user = systemd_service = NULL;
 
       entry->s_dir = s_dir;
       entry->filename = _dbus_strdup (_dbus_string_get_const_data (filename));
@@ -397,12 +421,14 @@ update_desktop_file_entry (BusActivation       *activation,
 
       if (!_dbus_hash_table_insert_string (activation->entries, entry->name, bus_activation_entry_ref (entry)))
         {
+          bus_activation_entry_unref (entry);
           BUS_SET_OOM (error);
           goto failed;
         }
 
       if (!_dbus_hash_table_insert_string (s_dir->entries, entry->filename, bus_activation_entry_ref (entry)))
         {
+          bus_activation_entry_unref (entry);
           /* Revert the insertion in the entries table */
           _dbus_hash_table_remove_string (activation->entries, entry->name);
           BUS_SET_OOM (error);
@@ -431,20 +457,35 @@ update_desktop_file_entry (BusActivation       *activation,
       entry->name = name;
       entry->exec = exec;
       entry->user = user;
+      name = exec = user = systemd_service = NULL;
       if (!_dbus_hash_table_insert_string (activation->entries,
                                            entry->name, bus_activation_entry_ref(entry)))
         {
+          bus_activation_entry_unref (entry);
           BUS_SET_OOM (error);
           /* Also remove path to entries hash since we want this in sync with
            * the entries hash table */
           _dbus_hash_table_remove_string (entry->s_dir->entries,
                                           entry->filename);
           bus_activation_entry_unref (entry);
+          _dbus_string_free (&file_path);
           return FALSE;
         }
     }
 
   entry->mtime = stat_buf.mtime;
+  entry->size = stat_buf.size;
+  entry->stamp = s_dir->stamp;
+
+  /* mtime only has a resolution of a second, so a write later in the
+   * same second would go unnoticed; don't trust such an entry.
+   */
+  {
+    long now;
+
+    _dbus_get_current_time (&now, NULL);
+    entry->mtime_is_racy = stat_buf.mtime >= (unsigned long) now;
+  }
 
   _dbus_string_free (&file_path);
   bus_activation_entry_unref (entry);
@@ -453,6 +494,7 @@ update_desktop_file_entry (BusActivation       *activation,
 
 failed:
   dbus_free (name);
+  dbus_free (exec);
   dbus_free (exec_tmp);
   dbus_free (user);
   dbus_free (systemd_service);
@@ -464,6 +506,18 @@ failed:
   return FALSE;
 }
 
+/* A backwards mtime is as much a change as a forward one, e.g. a
+ * package downgrade.
+ */
+static dbus_bool_t
+service_file_changed (BusActivationEntry *entry,
+                      const DBusStat     *stat_buf)
+{
+  return entry->mtime_is_racy ||
+    stat_buf->mtime != entry->mtime ||
+    stat_buf->size != entry->size;
+}
+
 static dbus_bool_t
 check_service_file (BusActivation       *activation,
                     BusActivationEntry  *entry,
@@ -509,7 +563,7 @@ check_service_file (BusActivation       *activation,
     }
   else
     {
-      if (stat_buf.mtime > entry->mtime)
+      if (service_file_changed (entry, &stat_buf))
         {
           BusDesktopFile *desktop_file;
           DBusError tmp_error;
@@ -564,6 +618,72 @@ out:
 }
 
 
+/* Drops the entries of service files that were deleted since the
+ * previous scan of the directory.
+ */
+static void
+remove_unseen_entries (BusActivation       *activation,
+                       BusServiceDirectory *s_dir)
+{
+  DBusHashIter iter;
+
+  _dbus_hash_iter_init (s_dir->entries, &iter);
+  while (_dbus_hash_iter_next (&iter))
+    {
+      BusActivationEntry *entry = _dbus_hash_iter_get_value (&iter);
+
+      if (entry->stamp == s_dir->stamp)
+        continue;
+
+      _dbus_verbose ("Service file \"%s\" is gone, removing \"%s\" from cache\n",
+                     entry->filename, entry->name);
+
+      if (_dbus_hash_table_lookup_string (activation->entries,
+                                          entry->name) == entry)
+        _dbus_hash_table_remove_string (activation->entries, entry->name);
+
+      _dbus_hash_iter_remove_entry (&iter);
+    }
+}
+
+/* Puts the entries we already parsed from s_dir back into the table
+ * of activatable names, so that the following update_directory() only
+ * has to reparse files that changed.
+ */
+static dbus_bool_t
+restore_directory_entries (BusActivation       *activation,
+                           BusServiceDirectory *s_dir,
+                           DBusError           *error)
+{
+  DBusHashIter iter;
+
+  _dbus_hash_iter_init (s_dir->entries, &iter);
+  while (_dbus_hash_iter_next (&iter))
+    {
+      BusActivationEntry *entry = _dbus_hash_iter_get_value (&iter);
+
+      /* An earlier directory now provides this name; forget the file,
+       * update_directory() will treat it as new and complain about it
+       * like it would on a fresh start.
+       */
+      if (_dbus_hash_table_lookup_string (activation->entries, entry->name))
+        {
+          _dbus_hash_iter_remove_entry (&iter);
+          continue;
+        }
+
+      if (!_dbus_hash_table_insert_string (activation->entries, entry->name,
+                                           bus_activation_entry_ref (entry)))
+        {
+          bus_activation_entry_unref (entry);
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
 /* warning: this doesn't fully "undo" itself on failure, i.e. doesn't strip
  * hash entries it already added.
  */
@@ -587,6 +707,9 @@ update_directory (BusActivation       *activation,
 
   _dbus_string_init_const (&dir, s_dir->dir_c);
 
+  /* files the scan doesn't see again are dropped at the end */
+  s_dir->stamp += 1;
+
   if (!_dbus_string_init (&filename))
     {
       BUS_SET_OOM (error);
@@ -610,6 +733,8 @@ update_directory (BusActivation       *activation,
       _dbus_verbose ("Failed to open directory %s: %s\n",
                      s_dir->dir_c,
                      error ? error->message : "unknown");
+      /* the directory went away, and its services with it */
+      remove_unseen_entries (activation, s_dir);
       goto out;
     }
 
@@ -631,9 +756,12 @@ update_directory (BusActivation       *activation,
       entry = _dbus_hash_table_lookup_string (s_dir->entries, _dbus_string_get_const_data (&filename));
       if (entry) /* Already has this service file in the cache */
         {
-          if (!check_service_file (activation, entry, NULL, error))
+          if (!check_service_file (activation, entry, &entry, error))
             goto out;
 
+          if (entry != NULL)
+            entry->stamp = s_dir->stamp;
+
           continue;
         }
 
@@ -696,6 +824,8 @@ update_directory (BusActivation       *activation,
       goto out;
     }
 
+  remove_unseen_entries (activation, s_dir);
+
   retval = TRUE;
 
  out:
@@ -712,147 +842,873 @@ update_directory (BusActivation       *activation,
   return retval;
 }
 
+/*
+ * Service index
+ *
+ * dbus-daemon --write-service-index stores the parsed contents of
+ * each service directory in a file next to it, so that a starting bus
+ * doesn't have to read and parse every service file again.  The index
+ * is only meant for the machine that wrote it: it is in native byte
+ * order and word size, and anything unexpected makes us ignore it and
+ * scan the directory as usual.
+ *
+ * The file is a ServiceIndexHeader, followed by n_entries
+ * ServiceIndexEntry, followed by a pool of nul-terminated strings the
+ * entries point into.  Offset 0 of the pool is an empty string and
+ * stands for "not set".
+ *
+ * If the directory itself hasn't changed since the index was written,
+ * no file was added or removed, so we only stat the files we know
+ * about; otherwise the index only saves the parsing of unchanged files.
+ */
+
+#define SERVICE_INDEX_SUFFIX     ".index"
+#define SERVICE_INDEX_MAGIC      "DBUSSVC"
+#define SERVICE_INDEX_VERSION    1
+#define SERVICE_INDEX_BYTE_ORDER 0x01020304
+
+/** The file was modified in the second it was parsed */
+#define SERVICE_INDEX_ENTRY_RACY (1 << 0)
+
+typedef struct
+{
+  char magic[8];                 /**< SERVICE_INDEX_MAGIC */
+  dbus_uint32_t version;         /**< SERVICE_INDEX_VERSION */
+  dbus_uint32_t byte_order;      /**< SERVICE_INDEX_BYTE_ORDER */
+  dbus_uint32_t header_size;     /**< sizeof (ServiceIndexHeader) */
+  dbus_uint32_t entry_size;      /**< sizeof (ServiceIndexEntry) */
+  dbus_uint32_t n_entries;       /**< Number of entries */
+  dbus_uint32_t strings_length;  /**< Length of the string pool */
+  dbus_uint32_t dir_stamp_valid; /**< Whether dir_stamp can be trusted */
+  DBusFileStamp dir_stamp;       /**< The directory when it was scanned */
+} ServiceIndexHeader;
+
+typedef struct
+{
+  unsigned long mtime;
+  unsigned long size;
+  dbus_uint32_t filename;
+  dbus_uint32_t name;            /**< 0 if the file couldn't be loaded */
+  dbus_uint32_t exec;
+  dbus_uint32_t user;
+  dbus_uint32_t systemd_service;
+  dbus_uint32_t flags;
+} ServiceIndexEntry;
+
 static dbus_bool_t
-populate_environment (BusActivation *activation)
+file_stamps_equal (const DBusFileStamp *a,
+                   const DBusFileStamp *b)
 {
-  DBusString   key;
-  DBusString   value;
-  int          i;
-  char       **environment;
-  dbus_bool_t  retval = FALSE;
+  return a->device == b->device &&
+    a->inode == b->inode &&
+    a->size == b->size &&
+    a->mtime == b->mtime &&
+    a->mtime_nsec == b->mtime_nsec;
+}
 
-  environment = _dbus_get_environment ();
+/* Even with sub-second mtimes the kernel only updates the clock it
+ * stamps files with every few milliseconds, so a change right after we
+ * looked could keep the same mtime; don't trust the current second.
+ */
+static dbus_bool_t
+file_stamp_is_racy (const DBusFileStamp *stamp)
+{
+  long now;
 
-  if (environment == NULL)
+  _dbus_get_current_time (&now, NULL);
+
+  return stamp->mtime >= (unsigned long) now;
+}
+
+/* The index lives next to the directory rather than in it, so that
+ * writing it doesn't change the directory it describes.
+ */
+static dbus_bool_t
+service_index_get_path (const char *dir_c,
+                        DBusString *path)
+{
+  int len;
+
+  if (!_dbus_string_append (path, dir_c))
     return FALSE;
 
-  if (!_dbus_string_init (&key))
+  len = _dbus_string_get_length (path);
+  while (len > 1 && _dbus_string_get_byte (path, len - 1) == '/')
+    len--;
+  _dbus_string_set_length (path, len);
+
+  return _dbus_string_append (path, SERVICE_INDEX_SUFFIX);
+}
+
+static const char *
+service_index_get_string (const char    *strings,
+                          dbus_uint32_t  offset)
+{
+  return offset == 0 ? NULL : strings + offset;
+}
+
+static dbus_bool_t
+service_index_parse_header (const DBusString   *contents,
+                            ServiceIndexHeader *header)
+{
+  const char *data;
+  dbus_uint32_t len;
+  dbus_uint32_t i;
+
+  data = _dbus_string_get_const_data (contents);
+  len = _dbus_string_get_length (contents);
+
+  if (len < sizeof (ServiceIndexHeader))
+    return FALSE;
+
+  memcpy (header, data, sizeof (ServiceIndexHeader));
+
+  if (memcmp (header->magic, SERVICE_INDEX_MAGIC, sizeof (header->magic)) != 0 ||
+      header->version != SERVICE_INDEX_VERSION ||
+      header->byte_order != SERVICE_INDEX_BYTE_ORDER ||
+      header->header_size != sizeof (ServiceIndexHeader) ||
+      header->entry_size != sizeof (ServiceIndexEntry))
+    return FALSE;
+
+  len -= sizeof (ServiceIndexHeader);
+  if (header->n_entries > len / sizeof (ServiceIndexEntry))
+    return FALSE;
+
+  len -= header->n_entries * sizeof (ServiceIndexEntry);
+  if (header->strings_length != len || len == 0)
+    return FALSE;
+
+  /* makes every offset inside the pool a nul-terminated string */
+  data += sizeof (ServiceIndexHeader) + header->n_entries * sizeof (ServiceIndexEntry);
+  if (data[0] != '\0' || data[len - 1] != '\0')
+    return FALSE;
+
+  data = _dbus_string_get_const_data (contents) + sizeof (ServiceIndexHeader);
+  for (i = 0; i < header->n_entries; i++)
     {
-        dbus_free_string_array (environment);
+      ServiceIndexEntry ie;
+
+      memcpy (&ie, data + i * sizeof (ServiceIndexEntry), sizeof (ServiceIndexEntry));
+
+      if (ie.filename == 0 || ie.filename >= len ||
+          ie.name >= len || ie.exec >= len ||
+          ie.user >= len || ie.systemd_service >= len ||
+          (ie.name != 0 && ie.exec == 0))
         return FALSE;
     }
 
-  if (!_dbus_string_init (&value))
+  return TRUE;
+}
+
+/* Whether a file the index couldn't load is still the same, so it
+ * would fail to load again.
+ */
+static dbus_bool_t
+service_index_file_unchanged (BusServiceDirectory *s_dir,
+                              const char          *filename_c,
+                              unsigned long        mtime,
+                              unsigned long        size,
+                              DBusError           *error)
+{
+  DBusString filename, file_path;
+  DBusStat stat_buf;
+  dbus_bool_t unchanged;
+
+  _dbus_string_init_const (&filename, filename_c);
+
+  if (!_dbus_string_init (&file_path))
     {
-      _dbus_string_free (&key);
-      dbus_free_string_array (environment);
+      BUS_SET_OOM (error);
       return FALSE;
     }
 
-  for (i = 0; environment[i] != NULL; i++)
+  if (!_dbus_string_append (&file_path, s_dir->dir_c) ||
+      !_dbus_concat_dir_and_file (&file_path, &filename))
     {
-      if (!_dbus_string_append (&key, environment[i]))
-        break;
-
-      if (_dbus_string_split_on_byte (&key, '=', &value))
-        {
-          char *hash_key, *hash_value;
-
-          if (!_dbus_string_steal_data (&key, &hash_key))
-            break;
-
-          if (!_dbus_string_steal_data (&value, &hash_value))
-            break;
-
-          if (!_dbus_hash_table_insert_string (activation->environment,
-                                               hash_key, hash_value))
-            break;
-        }
-      _dbus_string_set_length (&key, 0);
-      _dbus_string_set_length (&value, 0);
+      BUS_SET_OOM (error);
+      _dbus_string_free (&file_path);
+      return FALSE;
     }
 
-  if (environment[i] != NULL)
-    goto out;
-
-  retval = TRUE;
-out:
+  unchanged = _dbus_stat (&file_path, &stat_buf, NULL) &&
+    stat_buf.mtime == mtime && stat_buf.size == size;
 
-  _dbus_string_free (&key);
-  _dbus_string_free (&value);
-  dbus_free_string_array (environment);
+  _dbus_string_free (&file_path);
 
-  return retval;
+  return unchanged;
 }
 
-dbus_bool_t
-bus_activation_reload (BusActivation     *activation,
-                       const DBusString  *address,
-                       DBusList         **directories,
-                       DBusError         *error)
+/* Fills a new s_dir from its index, if it has a usable one.  Sets
+ * *complete if the directory is known to hold no other service files,
+ * i.e. scanning it can be skipped.  Only fails on OOM.
+ */
+static dbus_bool_t
+load_service_index (BusActivation       *activation,
+                    BusServiceDirectory *s_dir,
+                    dbus_bool_t         *complete,
+                    DBusError           *error)
 {
-  DBusList      *link;
-  char          *dir;
+  DBusString path, contents, dir;
+  DBusError tmp_error;
+  DBusFileStamp dir_stamp;
+  ServiceIndexHeader header;
+  const char *entries, *strings;
+  dbus_bool_t retval;
+  dbus_uint32_t i;
 
-  if (activation->server_address != NULL)
-    dbus_free (activation->server_address);
-  if (!_dbus_string_copy_data (address, &activation->server_address))
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  *complete = FALSE;
+  retval = FALSE;
+
+  if (!_dbus_string_init (&path))
     {
       BUS_SET_OOM (error);
-      goto failed;
+      return FALSE;
     }
 
-  if (activation->entries != NULL)
-    _dbus_hash_table_unref (activation->entries);
-  activation->entries = _dbus_hash_table_new (DBUS_HASH_STRING, NULL,
-                                             (DBusFreeFunction)bus_activation_entry_unref);
-  if (activation->entries == NULL)
+  if (!_dbus_string_init (&contents))
     {
       BUS_SET_OOM (error);
-      goto failed;
+      _dbus_string_free (&path);
+      return FALSE;
     }
 
-  if (activation->directories != NULL)
-    _dbus_hash_table_unref (activation->directories);
-  activation->directories = _dbus_hash_table_new (DBUS_HASH_STRING, NULL,
-                                                  (DBusFreeFunction)bus_service_directory_unref);
-
-  if (activation->directories == NULL)
+  if (!service_index_get_path (s_dir->dir_c, &path))
     {
       BUS_SET_OOM (error);
-      goto failed;
+      goto out;
     }
 
-  link = _dbus_list_get_first_link (directories);
-  while (link != NULL)
+  dbus_error_init (&tmp_error);
+  if (!_dbus_file_get_contents (&contents, &path, &tmp_error))
     {
-      BusServiceDirectory *s_dir;
-
-      dir = _dbus_strdup ((const char *) link->data);
-      if (!dir)
+      if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY))
         {
-          BUS_SET_OOM (error);
-          goto failed;
+          dbus_move_error (&tmp_error, error);
+          goto out;
         }
 
-      s_dir = dbus_new0 (BusServiceDirectory, 1);
-      if (!s_dir)
-        {
-          dbus_free (dir);
-          BUS_SET_OOM (error);
-          goto failed;
-        }
+      /* not having an index is the common case */
+      dbus_error_free (&tmp_error);
+      retval = TRUE;
+      goto out;
+    }
 
-      s_dir->refcount = 1;
-      s_dir->dir_c = dir;
+  if (!service_index_parse_header (&contents, &header))
+    {
+      _dbus_verbose ("Ignoring malformed service index %s\n",
+                     _dbus_string_get_const_data (&path));
+      retval = TRUE;
+      goto out;
+    }
 
-      s_dir->entries = _dbus_hash_table_new (DBUS_HASH_STRING, NULL,
-                                             (DBusFreeFunction)bus_activation_entry_unref);
+  _dbus_string_init_const (&dir, s_dir->dir_c);
+  *complete = header.dir_stamp_valid &&
+    _dbus_file_get_stamp (&dir, &dir_stamp, NULL) &&
+    file_stamps_equal (&header.dir_stamp, &dir_stamp);
 
-      if (!s_dir->entries)
+  _dbus_verbose ("Loading %u service files from index %s%s\n",
+                 header.n_entries, _dbus_string_get_const_data (&path),
+                 *complete ? "" : ", directory changed since");
+
+  entries = _dbus_string_get_const_data (&contents) + sizeof (ServiceIndexHeader);
+  strings = entries + header.n_entries * sizeof (ServiceIndexEntry);
+
+  for (i = 0; i < header.n_entries; i++)
+    {
+      ServiceIndexEntry ie;
+      BusActivationEntry *entry;
+      const char *filename;
+
+      memcpy (&ie, entries + i * sizeof (ServiceIndexEntry), sizeof (ServiceIndexEntry));
+      filename = service_index_get_string (strings, ie.filename);
+
+      if (ie.name == 0)
         {
-          bus_service_directory_unref (s_dir);
-          BUS_SET_OOM (error);
-          goto failed;
+          /* still broken?  otherwise the scan has to look at it */
+          if (*complete &&
+              !service_index_file_unchanged (s_dir, filename,
+                                             ie.mtime, ie.size, error))
+            {
+              if (dbus_error_is_set (error))
+                goto out;
+
+              *complete = FALSE;
+            }
+          continue;
         }
 
-      if (!_dbus_hash_table_insert_string (activation->directories, s_dir->dir_c, s_dir))
+      /* An earlier directory provides this name; a scan would refuse
+       * the file the same way.
+       */
+      if (_dbus_hash_table_lookup_string (activation->entries,
+                                          service_index_get_string (strings, ie.name)) ||
+          _dbus_hash_table_lookup_string (s_dir->entries, filename))
+        continue;
+
+      entry = dbus_new0 (BusActivationEntry, 1);
+      if (entry == NULL)
         {
-          bus_service_directory_unref (s_dir);
           BUS_SET_OOM (error);
-          goto failed;
+          goto out;
+        }
+
+      entry->refcount = 1;
+      entry->s_dir = s_dir;
+      entry->mtime = ie.mtime;
+      entry->size = ie.size;
+      entry->mtime_is_racy = (ie.flags & SERVICE_INDEX_ENTRY_RACY) != 0;
+      entry->stamp = s_dir->stamp;
+      entry->filename = _dbus_strdup (filename);
+      entry->name = _dbus_strdup (service_index_get_string (strings, ie.name));
+      entry->exec = _dbus_strdup (service_index_get_string (strings, ie.exec));
+
+      if (entry->filename == NULL || entry->name == NULL || entry->exec == NULL ||
+          (ie.user != 0 &&
+           (entry->user = _dbus_strdup (service_index_get_string (strings, ie.user))) == NULL) ||
+          (ie.systemd_service != 0 &&
+           (entry->systemd_service = _dbus_strdup (service_index_get_string (strings, ie.systemd_service))) == NULL))
+        {
+          bus_activation_entry_unref (entry);
+          BUS_SET_OOM (error);
+          goto out;
+        }
+
+      if (!_dbus_hash_table_insert_string (activation->entries, entry->name,
+                                           bus_activation_entry_ref (entry)))
+        {
+          bus_activation_entry_unref (entry);
+          bus_activation_entry_unref (entry);
+          BUS_SET_OOM (error);
+          goto out;
+        }
+
+      if (!_dbus_hash_table_insert_string (s_dir->entries, entry->filename,
+                                           bus_activation_entry_ref (entry)))
+        {
+          bus_activation_entry_unref (entry);
+          _dbus_hash_table_remove_string (activation->entries, entry->name);
+          bus_activation_entry_unref (entry);
+          BUS_SET_OOM (error);
+          goto out;
+        }
+
+      /* Without a scan nobody else stats the file.  This also drops
+       * the entry again if the file is gone.
+       */
+      if (*complete && !check_service_file (activation, entry, NULL, error))
+        {
+          bus_activation_entry_unref (entry);
+          goto out;
+        }
+
+      bus_activation_entry_unref (entry);
+    }
+
+  retval = TRUE;
+
+ out:
+  if (!retval)
+    _DBUS_ASSERT_ERROR_IS_SET (error);
+
+  _dbus_string_free (&path);
+  _dbus_string_free (&contents);
+
+  return retval;
+}
+
+static dbus_bool_t
+service_index_append_string (DBusString    *strings,
+                             const char    *str,
+                             dbus_uint32_t *offset)
+{
+  if (str == NULL)
+    {
+      *offset = 0;
+      return TRUE;
+    }
+
+  *offset = _dbus_string_get_length (strings);
+
+  return _dbus_string_append (strings, str) &&
+    _dbus_string_append_byte (strings, '\0');
+}
+
+/* Scans s_dir and serializes what it found; every *.service file in
+ * the directory gets an entry, the ones that didn't load without a
+ * name.
+ */
+static dbus_bool_t
+build_service_index (BusActivation       *activation,
+                     BusServiceDirectory *s_dir,
+                     DBusString          *entries,
+                     DBusString          *strings,
+                     dbus_uint32_t       *n_entries,
+                     DBusError           *error)
+{
+  DBusDirIter *iter;
+  DBusString dir, filename, file_path;
+  DBusError tmp_error;
+  dbus_bool_t retval;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  _dbus_string_set_length (entries, 0);
+  _dbus_string_set_length (strings, 0);
+  *n_entries = 0;
+
+  if (!_dbus_string_append_byte (strings, '\0'))
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  if (!update_directory (activation, s_dir, error))
+    return FALSE;
+
+  if (!_dbus_string_init (&filename))
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  if (!_dbus_string_init (&file_path))
+    {
+      BUS_SET_OOM (error);
+      _dbus_string_free (&filename);
+      return FALSE;
+    }
+
+  retval = FALSE;
+
+  _dbus_string_init_const (&dir, s_dir->dir_c);
+  iter = _dbus_directory_open (&dir, error);
+  if (iter == NULL)
+    goto out;
+
+  dbus_error_init (&tmp_error);
+  while (_dbus_directory_get_next_file (iter, &filename, &tmp_error))
+    {
+      ServiceIndexEntry ie;
+      BusActivationEntry *entry;
+
+      if (!_dbus_string_ends_with_c_str (&filename, ".service"))
+        continue;
+
+      _DBUS_ZERO (ie);
+
+      entry = _dbus_hash_table_lookup_string (s_dir->entries,
+                                              _dbus_string_get_const_data (&filename));
+      if (entry != NULL)
+        {
+          ie.mtime = entry->mtime;
+          ie.size = entry->size;
+          if (entry->mtime_is_racy)
+            ie.flags |= SERVICE_INDEX_ENTRY_RACY;
+
+          if (!service_index_append_string (strings, entry->filename, &ie.filename) ||
+              !service_index_append_string (strings, entry->name, &ie.name) ||
+              !service_index_append_string (strings, entry->exec, &ie.exec) ||
+              !service_index_append_string (strings, entry->user, &ie.user) ||
+              !service_index_append_string (strings, entry->systemd_service,
+                                            &ie.systemd_service))
+            {
+              BUS_SET_OOM (error);
+              goto out;
+            }
+        }
+      else
+        {
+          DBusStat stat_buf;
+
+          _dbus_string_set_length (&file_path, 0);
+          if (!_dbus_string_append (&file_path, s_dir->dir_c) ||
+              !_dbus_concat_dir_and_file (&file_path, &filename))
+            {
+              BUS_SET_OOM (error);
+              goto out;
+            }
+
+          if (!_dbus_stat (&file_path, &stat_buf, NULL))
+            continue;
+
+          ie.mtime = stat_buf.mtime;
+          ie.size = stat_buf.size;
+
+          if (!service_index_append_string (strings,
+                                            _dbus_string_get_const_data (&filename),
+                                            &ie.filename))
+            {
+              BUS_SET_OOM (error);
+              goto out;
+            }
+        }
+
+      if (!_dbus_string_append_len (entries, (const char *) &ie, sizeof (ie)))
+        {
+          BUS_SET_OOM (error);
+          goto out;
+        }
+
+      *n_entries += 1;
+    }
+
+  if (dbus_error_is_set (&tmp_error))
+    {
+      dbus_move_error (&tmp_error, error);
+      goto out;
+    }
+
+  retval = TRUE;
+
+ out:
+  if (!retval)
+    _DBUS_ASSERT_ERROR_IS_SET (error);
+
+  if (iter != NULL)
+    _dbus_directory_close (iter);
+  _dbus_string_free (&filename);
+  _dbus_string_free (&file_path);
+
+  return retval;
+}
+
+/**
+ * Writes the service index for a directory of service files, which
+ * lets a bus starting later skip parsing the files.  The directory is
+ * scanned until it holds still, so the index can also vouch for which
+ * files are in it.
+ *
+ * @param directory the service directory
+ * @param error return location for errors
+ * @returns #FALSE if the index couldn't be written
+ */
+dbus_bool_t
+bus_activation_write_service_index (const char *directory,
+                                    DBusError  *error)
+{
+  BusActivation activation;
+  BusServiceDirectory *s_dir;
+  ServiceIndexHeader header;
+  DBusFileStamp before, after;
+  DBusString dir, path, contents, entries, strings;
+  dbus_uint32_t n_entries;
+  dbus_bool_t retval;
+  int attempt;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  retval = FALSE;
+  s_dir = NULL;
+
+  /* only what update_directory() needs */
+  _DBUS_ZERO (activation);
+  activation.refcount = 1;
+
+  if (!_dbus_string_init (&path))
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  if (!_dbus_string_init (&contents))
+    {
+      _dbus_string_free (&path);
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  if (!_dbus_string_init (&entries))
+    {
+      _dbus_string_free (&path);
+      _dbus_string_free (&contents);
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  if (!_dbus_string_init (&strings))
+    {
+      _dbus_string_free (&path);
+      _dbus_string_free (&contents);
+      _dbus_string_free (&entries);
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  /* from this point it's safe to "goto out" */
+
+  if (!service_index_get_path (directory, &path))
+    {
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
+  activation.entries = _dbus_hash_table_new (DBUS_HASH_STRING, NULL,
+                                             (DBusFreeFunction)bus_activation_entry_unref);
+  s_dir = dbus_new0 (BusServiceDirectory, 1);
+  if (activation.entries == NULL || s_dir == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
+  s_dir->refcount = 1;
+  s_dir->dir_c = _dbus_strdup (directory);
+  s_dir->entries = _dbus_hash_table_new (DBUS_HASH_STRING, NULL,
+                                         (DBusFreeFunction)bus_activation_entry_unref);
+  if (s_dir->dir_c == NULL || s_dir->entries == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
+  _dbus_string_init_const (&dir, directory);
+
+  _DBUS_ZERO (header);
+
+  /* If something keeps changing the directory we still write the
+   * index, it just can't be trusted to list all the files.
+   */
+  for (attempt = 0; attempt < 3 && !header.dir_stamp_valid; attempt++)
+    {
+      dbus_bool_t racy;
+
+      if (!_dbus_file_get_stamp (&dir, &before, error))
+        goto out;
+
+      racy = file_stamp_is_racy (&before);
+
+      if (!build_service_index (&activation, s_dir, &entries, &strings,
+                                &n_entries, error))
+        goto out;
+
+      if (!_dbus_file_get_stamp (&dir, &after, error))
+        goto out;
+
+      if (!racy && file_stamps_equal (&before, &after))
+        {
+          header.dir_stamp = before;
+          header.dir_stamp_valid = TRUE;
+        }
+      else if (racy)
+        _dbus_sleep_milliseconds (1000);
+    }
+
+  memcpy (header.magic, SERVICE_INDEX_MAGIC, sizeof (header.magic));
+  header.version = SERVICE_INDEX_VERSION;
+  header.byte_order = SERVICE_INDEX_BYTE_ORDER;
+  header.header_size = sizeof (ServiceIndexHeader);
+  header.entry_size = sizeof (ServiceIndexEntry);
+  header.n_entries = n_entries;
+  header.strings_length = _dbus_string_get_length (&strings);
+
+  if (!_dbus_string_append_len (&contents, (const char *) &header, sizeof (header)) ||
+      !_dbus_string_copy (&entries, 0, &contents, _dbus_string_get_length (&contents)) ||
+      !_dbus_string_copy (&strings, 0, &contents, _dbus_string_get_length (&contents)))
+    {
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
+  if (!_dbus_string_save_to_file (&contents, &path, TRUE, error))
+    goto out;
+
+  _dbus_verbose ("Wrote %u service files to %s\n", n_entries,
+                 _dbus_string_get_const_data (&path));
+
+  retval = TRUE;
+
+ out:
+  if (!retval)
+    _DBUS_ASSERT_ERROR_IS_SET (error);
+
+  bus_service_directory_unref (s_dir);
+  if (activation.entries != NULL)
+    _dbus_hash_table_unref (activation.entries);
+  _dbus_string_free (&path);
+  _dbus_string_free (&contents);
+  _dbus_string_free (&entries);
+  _dbus_string_free (&strings);
+
+  return retval;
+}
+
+static dbus_bool_t
+populate_environment (BusActivation *activation)
+{
+  DBusString   key;
+  DBusString   value;
+  int          i;
+  char       **environment;
+  dbus_bool_t  retval = FALSE;
+
+  environment = _dbus_get_environment ();
+
+  if (environment == NULL)
+    return FALSE;
+
+  if (!_dbus_string_init (&key))
+    {
+        dbus_free_string_array (environment);
+        return FALSE;
+    }
+
+  if (!_dbus_string_init (&value))
+    {
+      _dbus_string_free (&key);
+      dbus_free_string_array (environment);
+      return FALSE;
+    }
+
+  for (i = 0; environment[i] != NULL; i++)
+    {
+      if (!_dbus_string_append (&key, environment[i]))
+        break;
+
+      if (_dbus_string_split_on_byte (&key, '=', &value))
+        {
+          char *hash_key, *hash_value;
+
+          if (!_dbus_string_steal_data (&key, &hash_key))
+            break;
+
+          if (!_dbus_string_steal_data (&value, &hash_value))
+            break;
+
+          if (!_dbus_hash_table_insert_string (activation->environment,
+                                               hash_key, hash_value))
+            break;
         }
+      _dbus_string_set_length (&key, 0);
+      _dbus_string_set_length (&value, 0);
+    }
+
+  if (environment[i] != NULL)
+    goto out;
+
+  retval = TRUE;
+out:
+
+  _dbus_string_free (&key);
+  _dbus_string_free (&value);
+  dbus_free_string_array (environment);
+
+  return retval;
+}
+
+static dbus_bool_t
+scan_directories (BusActivation     *activation,
+                  DBusList         **directories,
+                  DBusError         *error)
+{
+  DBusList      *link;
+  char          *dir;
+  DBusHashTable *old_directories;
+  dbus_bool_t    index_complete;
+
+  /* Directories that stay configured keep their parsed service files;
+   * only the files that changed on disk get loaded again.
+   */
+  old_directories = NULL;
+
+  if (activation->entries != NULL)
+    _dbus_hash_table_unref (activation->entries);
+  activation->entries = _dbus_hash_table_new (DBUS_HASH_STRING, NULL,
+                                             (DBusFreeFunction)bus_activation_entry_unref);
+  if (activation->entries == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
+  old_directories = activation->directories;
+  activation->directories = _dbus_hash_table_new (DBUS_HASH_STRING, NULL,
+                                                  (DBusFreeFunction)bus_service_directory_unref);
 
+  if (activation->directories == NULL)
+    {
+      activation->directories = old_directories;
+      old_directories = NULL;
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
+  link = _dbus_list_get_first_link (directories);
+  while (link != NULL)
+    {
+      BusServiceDirectory *s_dir;
+
+      s_dir = NULL;
+      if (old_directories != NULL)
+        s_dir = _dbus_hash_table_lookup_string (old_directories, link->data);
+
+      if (s_dir != NULL)
+        {
+          if (!_dbus_hash_table_insert_string (activation->directories, s_dir->dir_c,
+                                               bus_service_directory_ref (s_dir)))
+            {
+              bus_service_directory_unref (s_dir);
+              BUS_SET_OOM (error);
+              goto failed;
+            }
+
+          /* Take it out of the old table, so a directory that is
+           * listed twice gets a scan of its own as before.
+           */
+          _dbus_hash_table_remove_string (old_directories, s_dir->dir_c);
+
+          if (!restore_directory_entries (activation, s_dir, error))
+            goto failed;
+
+          goto scan;
+        }
+
+      dir = _dbus_strdup ((const char *) link->data);
+      if (!dir)
+        {
+          BUS_SET_OOM (error);
+          goto failed;
+        }
+
+      s_dir = dbus_new0 (BusServiceDirectory, 1);
+      if (!s_dir)
+        {
+          dbus_free (dir);
+          BUS_SET_OOM (error);
+          goto failed;
+        }
+
+      s_dir->refcount = 1;
+      s_dir->dir_c = dir;
+
+      s_dir->entries = _dbus_hash_table_new (DBUS_HASH_STRING, NULL,
+                                             (DBusFreeFunction)bus_activation_entry_unref);
+
+      if (!s_dir->entries)
+        {
+          bus_service_directory_unref (s_dir);
+          BUS_SET_OOM (error);
+          goto failed;
+        }
+
+      if (!_dbus_hash_table_insert_string (activation->directories, s_dir->dir_c, s_dir))
+        {
+          bus_service_directory_unref (s_dir);
+          BUS_SET_OOM (error);
+          goto failed;
+        }
+
+      if (!load_service_index (activation, s_dir, &index_complete, error))
+        goto failed;
+
+      if (index_complete)
+        {
+          link = _dbus_list_get_next_link (directories, link);
+          continue;
+        }
+
+    scan:
       /* only fail on OOM, it is ok if we can't read the directory */
       if (!update_directory (activation, s_dir, error))
         {
@@ -862,18 +1718,132 @@ bus_activation_reload (BusActivation     *activation,
             dbus_error_free (error);
         }
 
-      link = _dbus_list_get_next_link (directories, link);
-    }
+      link = _dbus_list_get_next_link (directories, link);
+    }
+
+  if (old_directories != NULL)
+    _dbus_hash_table_unref (old_directories);
+
+  return TRUE;
+ failed:
+  if (old_directories != NULL)
+    _dbus_hash_table_unref (old_directories);
+  return FALSE;
+}
+
+static void
+clear_deferred_directories (BusActivation *activation)
+{
+  DBusList *link;
+
+  for (link = _dbus_list_get_first_link (&activation->deferred_directories);
+       link != NULL;
+       link = _dbus_list_get_next_link (&activation->deferred_directories, link))
+    dbus_free (link->data);
+
+  _dbus_list_clear (&activation->deferred_directories);
+}
+
+/* Remembers the directories to scan once something needs the entries */
+static dbus_bool_t
+defer_directories (BusActivation     *activation,
+                   DBusList         **directories,
+                   DBusError         *error)
+{
+  DBusList *copy;
+  DBusList *link;
+
+  copy = NULL;
+
+  for (link = _dbus_list_get_first_link (directories);
+       link != NULL;
+       link = _dbus_list_get_next_link (directories, link))
+    {
+      char *dir;
+
+      dir = _dbus_strdup (link->data);
+      if (dir == NULL || !_dbus_list_append (&copy, dir))
+        {
+          dbus_free (dir);
+          _dbus_list_foreach (&copy, (DBusForeachFunction) dbus_free, NULL);
+          _dbus_list_clear (&copy);
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+    }
+
+  clear_deferred_directories (activation);
+  activation->deferred_directories = copy;
+  activation->scan_deferred = TRUE;
+
+  return TRUE;
+}
+
+/**
+ * Scans the service directories if that was put off when the
+ * activation was created, so the entries are there to be looked up.
+ *
+ * @param activation the activation
+ * @param error return location for errors, which are only ever OOM
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+bus_activation_ensure_scanned (BusActivation *activation,
+                               DBusError     *error)
+{
+  if (!activation->scan_deferred)
+    return TRUE;
+
+  _dbus_verbose ("Scanning service directories on first use\n");
+
+  if (!scan_directories (activation, &activation->deferred_directories, error))
+    return FALSE;
+
+  clear_deferred_directories (activation);
+  activation->scan_deferred = FALSE;
 
   return TRUE;
- failed:
-  return FALSE;
 }
 
+dbus_bool_t
+bus_activation_reload (BusActivation     *activation,
+                       const DBusString  *address,
+                       DBusList         **directories,
+                       DBusError         *error)
+{
+  if (activation->server_address != NULL)
+    dbus_free (activation->server_address);
+  if (!_dbus_string_copy_data (address, &activation->server_address))
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  /* Nothing has looked at the old directories yet, so there is
+   * nothing to keep from them either
+   */
+  if (activation->scan_deferred)
+    return defer_directories (activation, directories, error);
+
+  return scan_directories (activation, directories, error);
+}
+
+/**
+ * Creates the activation subsystem.
+ *
+ * @param context the bus context
+ * @param address the bus address to give to activated services
+ * @param directories the directories holding service files
+ * @param defer_scan #TRUE to leave the directories until something
+ *   needs them, so that the bus can start listening sooner
+ * @param error return location for errors
+ * @returns the new activation, or #NULL
+ */
 BusActivation*
 bus_activation_new (BusContext        *context,
                     const DBusString  *address,
                     DBusList         **directories,
+                    dbus_bool_t        defer_scan,
                     DBusError         *error)
 {
   BusActivation *activation;
@@ -892,6 +1862,7 @@ bus_activation_new (BusContext        *context,
   activation->refcount = 1;
   activation->context = context;
   activation->n_pending_activations = 0;
+  activation->scan_deferred = defer_scan;
 
   if (!bus_activation_reload (activation, address, directories, error))
     goto failed;
@@ -907,6 +1878,14 @@ bus_activation_new (BusContext        *context,
       goto failed;
     }
 
+  activation->systemd_units = _dbus_hash_table_new (DBUS_HASH_STRING,
+                                                    dbus_free, NULL);
+  if (activation->systemd_units == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
   activation->environment = _dbus_hash_table_new (DBUS_HASH_STRING,
                                                   (DBusFreeFunction) dbus_free,
                                                   (DBusFreeFunction) dbus_free);
@@ -955,10 +1934,13 @@ bus_activation_unref (BusActivation *activation)
     _dbus_hash_table_unref (activation->entries);
   if (activation->pending_activations)
     _dbus_hash_table_unref (activation->pending_activations);
+  if (activation->systemd_units)
+    _dbus_hash_table_unref (activation->systemd_units);
   if (activation->directories)
     _dbus_hash_table_unref (activation->directories);
   if (activation->environment)
     _dbus_hash_table_unref (activation->environment);
+  clear_deferred_directories (activation);
 
   dbus_free (activation);
 }
@@ -1142,6 +2124,18 @@ bus_activation_service_created (BusActivation  *activation,
   return FALSE;
 }
 
+/**
+ * Whether any service is being started and has yet to take its name.
+ *
+ * @param activation the activation
+ * @returns #TRUE if some activation is pending
+ */
+dbus_bool_t
+bus_activation_has_pending_activations (BusActivation *activation)
+{
+  return _dbus_hash_table_get_n_entries (activation->pending_activations) > 0;
+}
+
 dbus_bool_t
 bus_activation_send_pending_auto_activation_messages (BusActivation  *activation,
                                                       BusService     *service,
@@ -1429,6 +2423,16 @@ remove_babysitter_watch (DBusWatch      *watch,
                            watch, babysitter_watch_callback, pending_activation);
 }
 
+static void
+toggle_babysitter_watch (DBusWatch      *watch,
+                         void           *data)
+{
+  BusPendingActivation *pending_activation = data;
+
+  _dbus_loop_toggle_watch (bus_context_get_loop (pending_activation->activation->context),
+                           watch);
+}
+
 static dbus_bool_t
 pending_activation_timed_out (void *data)
 {
@@ -1531,6 +2535,9 @@ activation_find_entry (BusActivation *activation,
 {
   BusActivationEntry *entry;
 
+  if (!bus_activation_ensure_scanned (activation, error))
+    return NULL;
+
   entry = _dbus_hash_table_lookup_string (activation->entries, service_name);
   if (!entry)
     {
@@ -1647,7 +2654,325 @@ out:
       BUS_SET_OOM (error);
     }
 
-  return retval;
+  return retval;
+}
+
+static BusPendingActivation *
+pending_activation_new (BusActivation      *activation,
+                        BusActivationEntry *entry,
+                        const char         *service_name,
+                        DBusError          *error)
+{
+  BusPendingActivation *pending_activation;
+
+  pending_activation = dbus_new0 (BusPendingActivation, 1);
+  if (!pending_activation)
+    {
+      _dbus_verbose ("Failed to create pending activation\n");
+      BUS_SET_OOM (error);
+      return NULL;
+    }
+
+  pending_activation->activation = activation;
+  pending_activation->refcount = 1;
+
+  pending_activation->service_name = _dbus_strdup (service_name);
+  if (!pending_activation->service_name)
+    {
+      _dbus_verbose ("Failed to copy service name for pending activation\n");
+      goto oom;
+    }
+
+  pending_activation->exec = _dbus_strdup (entry->exec);
+  if (!pending_activation->exec)
+    {
+      _dbus_verbose ("Failed to copy service exec for pending activation\n");
+      goto oom;
+    }
+
+  if (entry->systemd_service)
+    {
+      pending_activation->systemd_service = _dbus_strdup (entry->systemd_service);
+      if (!pending_activation->systemd_service)
+        {
+          _dbus_verbose ("Failed to copy systemd service for pending activation\n");
+          goto oom;
+        }
+    }
+
+  pending_activation->timeout =
+    _dbus_timeout_new (bus_context_get_activation_timeout (activation->context),
+                       pending_activation_timed_out,
+                       pending_activation,
+                       NULL);
+  if (!pending_activation->timeout)
+    {
+      _dbus_verbose ("Failed to create timeout for pending activation\n");
+      goto oom;
+    }
+
+  if (!_dbus_loop_add_timeout (bus_context_get_loop (activation->context),
+                               pending_activation->timeout,
+                               handle_timeout_callback,
+                               pending_activation,
+                               NULL))
+    {
+      _dbus_verbose ("Failed to add timeout for pending activation\n");
+      goto oom;
+    }
+
+  pending_activation->timeout_added = TRUE;
+
+  return pending_activation;
+
+ oom:
+  BUS_SET_OOM (error);
+  bus_pending_activation_unref (pending_activation);
+  return NULL;
+}
+
+/* Whether some other pending activation already runs the same
+ * executable, in which case starting it again would be pointless.
+ */
+static dbus_bool_t
+exec_already_pending (BusActivation *activation,
+                      const char    *exec)
+{
+  DBusHashIter iter;
+
+  _dbus_hash_iter_init (activation->pending_activations, &iter);
+  while (_dbus_hash_iter_next (&iter))
+    {
+      BusPendingActivation *p = _dbus_hash_iter_get_value (&iter);
+
+      if (strcmp (p->exec, exec) == 0)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/**
+ * Adds a pending activation to the list of those waiting on its
+ * systemd unit. Names provided by one unit thus share a single
+ * ActivationRequest, and one ActivationFailure fails them all
+ * without looking at unrelated pending activations.
+ *
+ * @param already_requested_p set to whether the unit already had a
+ *   request in flight
+ * @returns #FALSE if not enough memory
+ */
+static dbus_bool_t
+systemd_unit_add_pending (BusActivation        *activation,
+                          BusPendingActivation *pending_activation,
+                          dbus_bool_t          *already_requested_p)
+{
+  DBusList *waiting;
+  char *unit;
+
+  _dbus_assert (pending_activation->systemd_service != NULL);
+  _dbus_assert (pending_activation->unit_link.data == NULL);
+
+  pending_activation->unit_link.data = pending_activation;
+
+  waiting = _dbus_hash_table_lookup_string (activation->systemd_units,
+                                            pending_activation->systemd_service);
+  *already_requested_p = waiting != NULL;
+
+  if (waiting != NULL)
+    {
+      /* Appending never moves the head we have stored */
+      _dbus_list_append_link (&waiting, &pending_activation->unit_link);
+      return TRUE;
+    }
+
+  unit = _dbus_strdup (pending_activation->systemd_service);
+  if (unit == NULL)
+    goto oom;
+
+  _dbus_list_append_link (&waiting, &pending_activation->unit_link);
+  if (!_dbus_hash_table_insert_string (activation->systemd_units, unit,
+                                       waiting))
+    {
+      dbus_free (unit);
+      goto oom;
+    }
+
+  return TRUE;
+
+ oom:
+  pending_activation->unit_link.data = NULL;
+  return FALSE;
+}
+
+static void
+systemd_unit_remove_pending (BusActivation        *activation,
+                             BusPendingActivation *pending_activation)
+{
+  DBusHashIter iter;
+  DBusList *waiting;
+
+  if (!_dbus_hash_iter_lookup (activation->systemd_units,
+                               pending_activation->systemd_service,
+                               FALSE, &iter))
+    _dbus_assert_not_reached ("pending activation missing from its unit");
+
+  waiting = _dbus_hash_iter_get_value (&iter);
+  _dbus_list_unlink (&waiting, &pending_activation->unit_link);
+  pending_activation->unit_link.data = NULL;
+
+  if (waiting == NULL)
+    _dbus_hash_iter_remove_entry (&iter);
+  else
+    _dbus_hash_iter_set_value (&iter, waiting);
+}
+
+static dbus_bool_t
+spawn_pending_activation (BusActivation        *activation,
+                          BusPendingActivation *pending_activation,
+                          BusActivationEntry   *entry,
+                          const char           *service_name,
+                          DBusError            *error)
+{
+  const char *servicehelper;
+  char **argv;
+  char **envp = NULL;
+  int argc;
+  DBusString command;
+
+  /* use command as system and session different */
+  if (!_dbus_string_init (&command))
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  /* does the bus use a helper? */
+  servicehelper = bus_context_get_servicehelper (activation->context);
+  if (servicehelper != NULL)
+    {
+      if (entry->user == NULL)
+        {
+          _dbus_string_free (&command);
+          dbus_set_error (error, DBUS_ERROR_SPAWN_FILE_INVALID,
+                          "Cannot do system-bus activation with no user\n");
+          return FALSE;
+        }
+
+      /* join the helper path and the service name */
+      if (!_dbus_string_append (&command, servicehelper))
+        {
+          _dbus_string_free (&command);
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+      if (!_dbus_string_append (&command, " "))
+        {
+          _dbus_string_free (&command);
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+      if (!_dbus_string_append (&command, service_name))
+        {
+          _dbus_string_free (&command);
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
+      /* Tell the helper which file we resolved the name to, so it
+       * can load it directly; it only trusts paths it would have
+       * tried itself. Skip the hint if it can't be single-quoted.
+       */
+      if (strchr (entry->s_dir->dir_c, '\'') == NULL &&
+          strchr (entry->filename, '\'') == NULL)
+        {
+          DBusString filename;
+
+          _dbus_string_init_const (&filename, entry->filename);
+          if (!_dbus_string_append (&command, " '") ||
+              !_dbus_string_append (&command, entry->s_dir->dir_c) ||
+              !_dbus_concat_dir_and_file (&command, &filename) ||
+              !_dbus_string_append (&command, "'"))
+            {
+              _dbus_string_free (&command);
+              BUS_SET_OOM (error);
+              return FALSE;
+            }
+        }
+    }
+  else
+    {
+      /* the bus does not use a helper, so we can append arguments with the exec line */
+      if (!_dbus_string_append (&command, entry->exec))
+        {
+          _dbus_string_free (&command);
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+    }
+
+  /* convert command into arguments */
+  if (!_dbus_shell_parse_argv (_dbus_string_get_const_data (&command), &argc, &argv, error))
+    {
+      _dbus_verbose ("Failed to parse command line: %s\n", entry->exec);
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+
+      _dbus_hash_table_remove_string (activation->pending_activations,
+                                      pending_activation->service_name);
+
+      _dbus_string_free (&command);
+      return FALSE;
+    }
+  _dbus_string_free (&command);
+
+  if (!add_bus_environment (activation, error))
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      dbus_free_string_array (argv);
+      return FALSE;
+    }
+
+  envp = bus_activation_get_environment (activation);
+
+  if (envp == NULL)
+    {
+      BUS_SET_OOM (error);
+      dbus_free_string_array (argv);
+      return FALSE;
+    }
+
+  _dbus_verbose ("Spawning %s ...\n", argv[0]);
+  if (!_dbus_spawn_async_with_babysitter (&pending_activation->babysitter, argv,
+                                          envp,
+                                          NULL, activation,
+                                          error))
+    {
+      _dbus_verbose ("Failed to spawn child\n");
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      dbus_free_string_array (argv);
+      dbus_free_string_array (envp);
+
+      return FALSE;
+    }
+
+  dbus_free_string_array (argv);
+  envp = NULL;
+
+  _dbus_assert (pending_activation->babysitter != NULL);
+
+  if (!_dbus_babysitter_set_watch_functions (pending_activation->babysitter,
+                                             add_babysitter_watch,
+                                             remove_babysitter_watch,
+                                             toggle_babysitter_watch,
+                                             pending_activation,
+                                             NULL))
+    {
+      BUS_SET_OOM (error);
+      _dbus_verbose ("Failed to set babysitter watch functions\n");
+      return FALSE;
+    }
+
+  return TRUE;
 }
 
 dbus_bool_t
@@ -1664,16 +2989,11 @@ bus_activation_activate_service (BusActivation  *activation,
   BusPendingActivationEntry *pending_activation_entry;
   DBusMessage *message;
   DBusString service_str;
-  const char *servicehelper;
-  char **argv;
-  char **envp = NULL;
-  int argc;
   dbus_bool_t retval;
-  DBusHashIter iter;
   dbus_bool_t activated;
-  DBusString command;
 
   activated = TRUE;
+  entry = NULL;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
@@ -1686,9 +3006,18 @@ bus_activation_activate_service (BusActivation  *activation,
       return FALSE;
     }
 
-  entry = activation_find_entry (activation, service_name, error);
-  if (!entry)
-    return FALSE;
+  /* If the service is already being activated, whether for another
+   * caller or because it is prewarmed, just queue up behind it; its
+   * .service file was found when the launch started, so there is no
+   * need to go looking for it again.
+   */
+  pending_activation = _dbus_hash_table_lookup_string (activation->pending_activations, service_name);
+  if (!pending_activation)
+    {
+      entry = activation_find_entry (activation, service_name, error);
+      if (!entry)
+        return FALSE;
+    }
 
   /* Bypass the registry lookup if we're auto-activating, bus_dispatch would not
    * call us if the service is already active.
@@ -1751,8 +3080,6 @@ bus_activation_activate_service (BusActivation  *activation,
   pending_activation_entry->connection = connection;
   dbus_connection_ref (connection);
 
-  /* Check if the service is being activated */
-  pending_activation = _dbus_hash_table_lookup_string (activation->pending_activations, service_name);
   if (pending_activation)
     {
       if (!_dbus_list_append (&pending_activation->entries, pending_activation_entry))
@@ -1769,84 +3096,14 @@ bus_activation_activate_service (BusActivation  *activation,
     }
   else
     {
-      pending_activation = dbus_new0 (BusPendingActivation, 1);
+      pending_activation = pending_activation_new (activation, entry,
+                                                   service_name, error);
       if (!pending_activation)
         {
-          _dbus_verbose ("Failed to create pending activation\n");
-
-          BUS_SET_OOM (error);
-          bus_pending_activation_entry_free (pending_activation_entry);
-          return FALSE;
-        }
-
-      pending_activation->activation = activation;
-      pending_activation->refcount = 1;
-
-      pending_activation->service_name = _dbus_strdup (service_name);
-      if (!pending_activation->service_name)
-        {
-          _dbus_verbose ("Failed to copy service name for pending activation\n");
-
-          BUS_SET_OOM (error);
-          bus_pending_activation_unref (pending_activation);
-          bus_pending_activation_entry_free (pending_activation_entry);
-          return FALSE;
-        }
-
-      pending_activation->exec = _dbus_strdup (entry->exec);
-      if (!pending_activation->exec)
-        {
-          _dbus_verbose ("Failed to copy service exec for pending activation\n");
-          BUS_SET_OOM (error);
-          bus_pending_activation_unref (pending_activation);
-          bus_pending_activation_entry_free (pending_activation_entry);
-          return FALSE;
-        }
-
-      if (entry->systemd_service)
-        {
-          pending_activation->systemd_service = _dbus_strdup (entry->systemd_service);
-          if (!pending_activation->systemd_service)
-            {
-              _dbus_verbose ("Failed to copy systemd service for pending activation\n");
-              BUS_SET_OOM (error);
-              bus_pending_activation_unref (pending_activation);
-              bus_pending_activation_entry_free (pending_activation_entry);
-              return FALSE;
-            }
-        }
-
-      pending_activation->timeout =
-        _dbus_timeout_new (bus_context_get_activation_timeout (activation->context),
-                           pending_activation_timed_out,
-                           pending_activation,
-                           NULL);
-      if (!pending_activation->timeout)
-        {
-          _dbus_verbose ("Failed to create timeout for pending activation\n");
-
-          BUS_SET_OOM (error);
-          bus_pending_activation_unref (pending_activation);
-          bus_pending_activation_entry_free (pending_activation_entry);
-          return FALSE;
-        }
-
-      if (!_dbus_loop_add_timeout (bus_context_get_loop (activation->context),
-                                   pending_activation->timeout,
-                                   handle_timeout_callback,
-                                   pending_activation,
-                                   NULL))
-        {
-          _dbus_verbose ("Failed to add timeout for pending activation\n");
-
-          BUS_SET_OOM (error);
-          bus_pending_activation_unref (pending_activation);
           bus_pending_activation_entry_free (pending_activation_entry);
           return FALSE;
         }
 
-      pending_activation->timeout_added = TRUE;
-
       if (!_dbus_list_append (&pending_activation->entries, pending_activation_entry))
         {
           _dbus_verbose ("Failed to add entry to just-created pending activation\n");
@@ -1860,18 +3117,23 @@ bus_activation_activate_service (BusActivation  *activation,
       pending_activation->n_entries += 1;
       pending_activation->activation->n_pending_activations += 1;
 
-      activated = FALSE;
-      _dbus_hash_iter_init (activation->pending_activations, &iter);
-      while (_dbus_hash_iter_next (&iter))
+      if (pending_activation->systemd_service != NULL &&
+          bus_context_get_systemd_activation (activation->context))
         {
-          BusPendingActivation *p = _dbus_hash_iter_get_value (&iter);
-
-          if (strcmp (p->exec, entry->exec) == 0)
+          /* systemd starts units, not Exec= lines, and systemd
+           * services commonly share a dummy Exec=; so it is the unit
+           * that must not be requested twice.
+           */
+          if (!systemd_unit_add_pending (activation, pending_activation,
+                                         &activated))
             {
-              activated = TRUE;
-              break;
+              BUS_SET_OOM (error);
+              bus_pending_activation_unref (pending_activation);
+              return FALSE;
             }
         }
+      else
+        activated = exec_already_pending (activation, entry->exec);
 
       if (!_dbus_hash_table_insert_string (activation->pending_activations,
                                            pending_activation->service_name,
@@ -1987,162 +3249,126 @@ bus_activation_activate_service (BusActivation  *activation,
          proceed with traditional activation. */
     }
 
-  /* use command as system and session different */
-  if (!_dbus_string_init (&command))
-    {
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
+  return spawn_pending_activation (activation, pending_activation, entry,
+                                   service_name, error);
+}
 
-  /* does the bus use a helper? */
-  servicehelper = bus_context_get_servicehelper (activation->context);
-  if (servicehelper != NULL)
-    {
-      if (entry->user == NULL)
-        {
-          _dbus_string_free (&command);
-          dbus_set_error (error, DBUS_ERROR_SPAWN_FILE_INVALID,
-                          "Cannot do system-bus activation with no user\n");
-          return FALSE;
-        }
+/**
+ * Starts a service before anyone asked for it, so that the first
+ * caller finds it already on its way up.  The pending activation has
+ * no entries of its own; requests arriving before the service takes
+ * its name simply queue up on it, and if it fails or times out
+ * nobody is told.
+ */
+dbus_bool_t
+bus_activation_prewarm_service (BusActivation  *activation,
+                                const char     *service_name,
+                                DBusError      *error)
+{
+  BusActivationEntry *entry;
+  BusPendingActivation *pending_activation;
+  DBusString service_str;
+  dbus_bool_t activated;
 
-      /* join the helper path and the service name */
-      if (!_dbus_string_append (&command, servicehelper))
-        {
-          _dbus_string_free (&command);
-          BUS_SET_OOM (error);
-          return FALSE;
-        }
-      if (!_dbus_string_append (&command, " "))
-        {
-          _dbus_string_free (&command);
-          BUS_SET_OOM (error);
-          return FALSE;
-        }
-      if (!_dbus_string_append (&command, service_name))
-        {
-          _dbus_string_free (&command);
-          BUS_SET_OOM (error);
-          return FALSE;
-        }
-    }
-  else
-    {
-      /* the bus does not use a helper, so we can append arguments with the exec line */
-      if (!_dbus_string_append (&command, entry->exec))
-        {
-          _dbus_string_free (&command);
-          BUS_SET_OOM (error);
-          return FALSE;
-        }
-    }
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
-  /* convert command into arguments */
-  if (!_dbus_shell_parse_argv (_dbus_string_get_const_data (&command), &argc, &argv, error))
-    {
-      _dbus_verbose ("Failed to parse command line: %s\n", entry->exec);
-      _DBUS_ASSERT_ERROR_IS_SET (error);
+  if (_dbus_hash_table_lookup_string (activation->pending_activations, service_name))
+    return TRUE;
 
-      _dbus_hash_table_remove_string (activation->pending_activations,
-                                      pending_activation->service_name);
+  _dbus_string_init_const (&service_str, service_name);
+  if (bus_registry_lookup (bus_context_get_registry (activation->context), &service_str) != NULL)
+    return TRUE;
 
-      _dbus_string_free (&command);
-      return FALSE;
-    }
-  _dbus_string_free (&command);
+  entry = activation_find_entry (activation, service_name, error);
+  if (!entry)
+    return FALSE;
 
-  if (!add_bus_environment (activation, error))
+  /* systemd starts these itself, and asking it to needs a transaction
+   * to send the request in; leave them to be activated on demand.
+   */
+  if (entry->systemd_service &&
+      bus_context_get_systemd_activation (activation->context))
     {
-      _DBUS_ASSERT_ERROR_IS_SET (error);
-      dbus_free_string_array (argv);
-      return FALSE;
+      _dbus_verbose ("Not prewarming %s, it is activated through systemd\n",
+                     service_name);
+      return TRUE;
     }
 
-  envp = bus_activation_get_environment (activation);
+  pending_activation = pending_activation_new (activation, entry,
+                                               service_name, error);
+  if (!pending_activation)
+    return FALSE;
 
-  if (envp == NULL)
+  activated = exec_already_pending (activation, entry->exec);
+
+  if (!_dbus_hash_table_insert_string (activation->pending_activations,
+                                       pending_activation->service_name,
+                                       pending_activation))
     {
       BUS_SET_OOM (error);
-      dbus_free_string_array (argv);
+      bus_pending_activation_unref (pending_activation);
       return FALSE;
     }
 
-  _dbus_verbose ("Spawning %s ...\n", argv[0]);
-  if (!_dbus_spawn_async_with_babysitter (&pending_activation->babysitter, argv,
-                                          envp,
-                                          NULL, activation,
-                                          error))
-    {
-      _dbus_verbose ("Failed to spawn child\n");
-      _DBUS_ASSERT_ERROR_IS_SET (error);
-      dbus_free_string_array (argv);
-      dbus_free_string_array (envp);
-
-      return FALSE;
-    }
+  /* Another prewarmed name is provided by the same program */
+  if (activated)
+    return TRUE;
 
-  dbus_free_string_array (argv);
-  envp = NULL;
+  _dbus_verbose ("Prewarming %s\n", service_name);
 
-  _dbus_assert (pending_activation->babysitter != NULL);
+  /* spawn_pending_activation() may drop it from the table itself */
+  bus_pending_activation_ref (pending_activation);
 
-  if (!_dbus_babysitter_set_watch_functions (pending_activation->babysitter,
-                                             add_babysitter_watch,
-                                             remove_babysitter_watch,
-                                             NULL,
-                                             pending_activation,
-                                             NULL))
+  if (!spawn_pending_activation (activation, pending_activation, entry,
+                                 service_name, error))
     {
-      BUS_SET_OOM (error);
-      _dbus_verbose ("Failed to set babysitter watch functions\n");
+      /* There is no transaction to cancel it for us */
+      if (pending_activation->babysitter)
+        _dbus_babysitter_kill_child (pending_activation->babysitter);
+      _dbus_hash_table_remove_string (activation->pending_activations,
+                                      service_name);
+      bus_pending_activation_unref (pending_activation);
       return FALSE;
     }
 
+  bus_pending_activation_unref (pending_activation);
+
   return TRUE;
 }
 
+/**
+ * Appends the name of every activatable service to an array of
+ * strings being written, straight from the activation entries.
+ *
+ * @param activation the activation
+ * @param array_iter iterator for an open array of #DBUS_TYPE_STRING
+ * @returns #FALSE if not enough memory
+ */
 dbus_bool_t
-bus_activation_list_services (BusActivation *activation,
-			      char        ***listp,
-			      int           *array_len)
+bus_activation_append_service_names (BusActivation   *activation,
+                                     DBusMessageIter *array_iter)
 {
-  int i, j, len;
-  char **retval;
   DBusHashIter iter;
+  DBusError error;
 
-  len = _dbus_hash_table_get_n_entries (activation->entries);
-  retval = dbus_new (char *, len + 1);
-
-  if (retval == NULL)
-    return FALSE;
+  dbus_error_init (&error);
+  if (!bus_activation_ensure_scanned (activation, &error))
+    {
+      dbus_error_free (&error);
+      return FALSE;
+    }
 
   _dbus_hash_iter_init (activation->entries, &iter);
-  i = 0;
   while (_dbus_hash_iter_next (&iter))
     {
       BusActivationEntry *entry = _dbus_hash_iter_get_value (&iter);
 
-      retval[i] = _dbus_strdup (entry->name);
-      if (retval[i] == NULL)
-	goto error;
-
-      i++;
+      if (!dbus_message_iter_append_basic (array_iter, DBUS_TYPE_STRING,
+                                           &entry->name))
+        return FALSE;
     }
 
-  retval[i] = NULL;
-
-  if (array_len)
-    *array_len = len;
-
-  *listp = retval;
   return TRUE;
-
- error:
-  for (j = 0; j < i; j++)
-    dbus_free (retval[i]);
-  dbus_free (retval);
-
-  return FALSE;
 }
 
 dbus_bool_t
@@ -2168,16 +3394,27 @@ dbus_activation_systemd_failure (BusActivation *activation,
   if (unit)
     {
       DBusHashIter iter;
+      DBusList *waiting;
+      DBusList *link;
 
-      _dbus_hash_iter_init (activation->pending_activations,
-                            &iter);
-
-      while (_dbus_hash_iter_next (&iter))
+      /* Take the whole list at once: failing an activation may free
+       * it, which would otherwise edit the list under us.
+       */
+      if (_dbus_hash_iter_lookup (activation->systemd_units, (char *) unit,
+                                  FALSE, &iter))
         {
-          BusPendingActivation *p = _dbus_hash_iter_get_value (&iter);
+          waiting = _dbus_hash_iter_get_value (&iter);
+          _dbus_hash_iter_remove_entry (&iter);
 
-          if (p->systemd_service && strcmp (p->systemd_service, unit) == 0)
-            pending_activation_failed(p, &error);
+          while ((link = _dbus_list_pop_first_link (&waiting)) != NULL)
+            {
+              BusPendingActivation *p = link->data;
+
+              link->data = NULL;
+              bus_pending_activation_ref (p);
+              pending_activation_failed (p, &error);
+              bus_pending_activation_unref (p);
+            }
         }
     }
 
@@ -2315,6 +3552,27 @@ out:
   return ret_val;
 }
 
+static dbus_bool_t
+test_remove_service_index (DBusString *dir)
+{
+  DBusString index_path;
+
+  if (!_dbus_string_init (&index_path))
+    return FALSE;
+
+  if (!service_index_get_path (_dbus_string_get_const_data (dir), &index_path))
+    {
+      _dbus_string_free (&index_path);
+      return FALSE;
+    }
+
+  /* there is none if the test didn't get as far as writing it */
+  _dbus_delete_file (&index_path, NULL);
+  _dbus_string_free (&index_path);
+
+  return TRUE;
+}
+
 static dbus_bool_t
 init_service_reload_test (DBusString *dir)
 {
@@ -2334,6 +3592,9 @@ init_service_reload_test (DBusString *dir)
         return FALSE;
     }
 
+  if (!test_remove_service_index (dir))
+    return FALSE;
+
   /* Create one initial file */
   if (!test_create_service_file (dir, SERVICE_FILE_1, SERVICE_NAME_1, "exec-1"))
     return FALSE;
@@ -2347,6 +3608,9 @@ cleanup_service_reload_test (DBusString *dir)
   if (!test_remove_directory (dir))
     return FALSE;
 
+  if (!test_remove_service_index (dir))
+    return FALSE;
+
   return TRUE;
 }
 
@@ -2416,6 +3680,7 @@ do_service_reload_test (DBusString *dir, dbus_bool_t oom_test)
   BusActivation *activation;
   DBusString     address;
   DBusList      *directories;
+  DBusError      error;
   CheckData      d;
 
   directories = NULL;
@@ -2424,7 +3689,7 @@ do_service_reload_test (DBusString *dir, dbus_bool_t oom_test)
   if (!_dbus_list_append (&directories, _dbus_string_get_data (dir)))
     return FALSE;
 
-  activation = bus_activation_new (NULL, &address, &directories, NULL);
+  activation = bus_activation_new (NULL, &address, &directories, FALSE, NULL);
   if (!activation)
     return FALSE;
 
@@ -2483,6 +3748,74 @@ do_service_reload_test (DBusString *dir, dbus_bool_t oom_test)
   if (!do_test ("Updated service file, part 2", oom_test, &d))
     return FALSE;
 
+  /* A reload keeps what it already parsed, but must still notice
+   * files that were removed or added since.
+   */
+  if (!test_remove_service_file (dir, SERVICE_FILE_1) ||
+      !test_create_service_file (dir, SERVICE_FILE_2, SERVICE_NAME_2, "exec-2"))
+    return FALSE;
+
+  dbus_error_init (&error);
+  if (!bus_activation_reload (activation, &address, &directories, &error))
+    {
+      dbus_error_free (&error);
+      return FALSE;
+    }
+
+  if (_dbus_hash_table_lookup_string (activation->entries, SERVICE_NAME_3) != NULL)
+    _dbus_assert_not_reached ("removed service file survived a reload");
+
+  if (_dbus_hash_table_lookup_string (activation->entries, SERVICE_NAME_2) == NULL)
+    _dbus_assert_not_reached ("added service file not seen by a reload");
+
+  /* A bus started from the index sees the same services, and still
+   * notices files that changed after it was written.
+   */
+  if (!oom_test)
+    {
+      BusActivation *indexed;
+
+      if (!bus_activation_write_service_index (_dbus_string_get_const_data (dir),
+                                               &error))
+        _dbus_assert_not_reached ("could not write service index");
+
+      indexed = bus_activation_new (NULL, &address, &directories, TRUE, &error);
+      if (indexed == NULL)
+        _dbus_assert_not_reached ("could not create deferred activation");
+
+      if (indexed->entries != NULL)
+        _dbus_assert_not_reached ("deferred activation scanned too early");
+
+      if (!bus_activation_ensure_scanned (indexed, &error) ||
+          _dbus_hash_table_lookup_string (indexed->entries, SERVICE_NAME_2) == NULL)
+        _dbus_assert_not_reached ("deferred scan did not find service file");
+
+      bus_activation_unref (indexed);
+
+      indexed = bus_activation_new (NULL, &address, &directories, FALSE, &error);
+      if (indexed == NULL)
+        _dbus_assert_not_reached ("could not load service index");
+
+      if (_dbus_hash_table_lookup_string (indexed->entries, SERVICE_NAME_2) == NULL)
+        _dbus_assert_not_reached ("indexed service file not found");
+
+      bus_activation_unref (indexed);
+
+      if (!test_remove_service_file (dir, SERVICE_FILE_2) ||
+          !test_create_service_file (dir, SERVICE_FILE_1, SERVICE_NAME_1, "exec-1"))
+        return FALSE;
+
+      indexed = bus_activation_new (NULL, &address, &directories, FALSE, &error);
+      if (indexed == NULL)
+        _dbus_assert_not_reached ("could not load stale service index");
+
+      if (_dbus_hash_table_lookup_string (indexed->entries, SERVICE_NAME_2) != NULL ||
+          _dbus_hash_table_lookup_string (indexed->entries, SERVICE_NAME_1) == NULL)
+        _dbus_assert_not_reached ("stale service index was trusted");
+
+      bus_activation_unref (indexed);
+    }
+
   bus_activation_unref (activation);
   _dbus_list_clear (&directories);
 
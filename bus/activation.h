@@ -31,11 +31,16 @@
 BusActivation* bus_activation_new              (BusContext        *context,
 						const DBusString  *address,
 						DBusList         **directories,
+						dbus_bool_t        defer_scan,
+						DBusError         *error);
+dbus_bool_t    bus_activation_ensure_scanned   (BusActivation     *activation,
 						DBusError         *error);
 dbus_bool_t bus_activation_reload           (BusActivation     *activation,
 						const DBusString  *address,
 						DBusList         **directories,
 						DBusError         *error);
+dbus_bool_t bus_activation_write_service_index (const char        *directory,
+						DBusError         *error);
 BusActivation* bus_activation_ref              (BusActivation     *activation);
 void           bus_activation_unref            (BusActivation     *activation);
 
@@ -50,13 +55,15 @@ dbus_bool_t    bus_activation_activate_service (BusActivation     *activation,
 						DBusMessage       *activation_message,
 						const char        *service_name,
 						DBusError         *error);
+dbus_bool_t    bus_activation_prewarm_service  (BusActivation     *activation,
+						const char        *service_name,
+						DBusError         *error);
 dbus_bool_t    bus_activation_service_created  (BusActivation     *activation,
 						const char        *service_name,
 						BusTransaction    *transaction,
 						DBusError         *error);
-dbus_bool_t    bus_activation_list_services    (BusActivation     *registry,
-						char            ***listp,
-						int               *array_len);
+dbus_bool_t    bus_activation_append_service_names (BusActivation   *activation,
+                                                    DBusMessageIter *array_iter);
 dbus_bool_t    dbus_activation_systemd_failure (BusActivation     *activation,
                                                 DBusMessage       *message);
 
@@ -64,6 +71,7 @@ dbus_bool_t    bus_activation_send_pending_auto_activation_messages (BusActivati
 								     BusService        *service,
 								     BusTransaction    *transaction,
 								     DBusError         *error);
+dbus_bool_t    bus_activation_has_pending_activations (BusActivation *activation);
 
 
 #endif /* BUS_ACTIVATION_H */
@@ -0,0 +1,218 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* atoms.c  Interned strings shared across the bus
+ *
+ * Copyright (C) 2003  Red Hat, Inc.
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "atoms.h"
+#include "test.h"
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-hash.h>
+#include <string.h>
+
+typedef struct
+{
+  int refcount;
+  char name[1]; /**< The string itself, allocated along with the atom */
+} BusAtom;
+
+/* Maps each string to its BusAtom; only exists while there are atoms.
+ * The daemon is single-threaded so this doesn't need a lock.
+ */
+static DBusHashTable *atoms = NULL;
+
+static BusAtom*
+atom_from_name (const char *name)
+{
+  return (BusAtom*) (name - _DBUS_STRUCT_OFFSET (BusAtom, name));
+}
+
+/**
+ * Returns the atom for the given string, creating it if needed.
+ * The caller owns a reference to the returned atom and must
+ * drop it with bus_atom_unref().
+ *
+ * @param str the string
+ * @returns the atom, or #NULL if no memory
+ */
+const char*
+bus_atom_intern (const char *str)
+{
+  BusAtom *atom;
+  size_t len;
+
+  _dbus_assert (str != NULL);
+
+  if (atoms == NULL)
+    {
+      /* the key is inside the atom, so only the value gets freed */
+      atoms = _dbus_hash_table_new_open_addressed (DBUS_HASH_STRING,
+                                                   NULL, dbus_free);
+      if (atoms == NULL)
+        return NULL;
+    }
+
+  atom = _dbus_hash_table_lookup_string (atoms, str);
+  if (atom != NULL)
+    {
+      atom->refcount += 1;
+      return atom->name;
+    }
+
+  len = strlen (str);
+  atom = dbus_malloc (_DBUS_STRUCT_OFFSET (BusAtom, name) + len + 1);
+  if (atom == NULL)
+    goto failed;
+
+  atom->refcount = 1;
+  memcpy (atom->name, str, len + 1);
+
+  if (!_dbus_hash_table_insert_string (atoms, atom->name, atom))
+    {
+      dbus_free (atom);
+      goto failed;
+    }
+
+  return atom->name;
+
+ failed:
+  if (_dbus_hash_table_get_n_entries (atoms) == 0)
+    {
+      _dbus_hash_table_unref (atoms);
+      atoms = NULL;
+    }
+  return NULL;
+}
+
+const char*
+bus_atom_ref (const char *atom)
+{
+  BusAtom *a = atom_from_name (atom);
+
+  _dbus_assert (a->refcount > 0);
+
+  a->refcount += 1;
+
+  return atom;
+}
+
+/**
+ * Drops a reference to an atom. #NULL is allowed and ignored.
+ *
+ * @param atom the atom
+ */
+void
+bus_atom_unref (const char *atom)
+{
+  BusAtom *a;
+
+  if (atom == NULL)
+    return;
+
+  a = atom_from_name (atom);
+
+  _dbus_assert (a->refcount > 0);
+  _dbus_assert (_dbus_hash_table_lookup_string (atoms, atom) == a);
+
+  a->refcount -= 1;
+  if (a->refcount > 0)
+    return;
+
+  _dbus_hash_table_remove_string (atoms, atom);
+
+  if (_dbus_hash_table_get_n_entries (atoms) == 0)
+    {
+      _dbus_hash_table_unref (atoms);
+      atoms = NULL;
+    }
+}
+
+/**
+ * Finds the atom for a string without creating one. If there is
+ * none, nothing interned can be equal to the string.
+ *
+ * @param str the string
+ * @returns the atom (with no reference added), or #NULL
+ */
+const char*
+bus_atom_lookup (const char *str)
+{
+  BusAtom *atom;
+
+  if (atoms == NULL || str == NULL)
+    return NULL;
+
+  atom = _dbus_hash_table_lookup_string (atoms, str);
+  if (atom == NULL)
+    return NULL;
+
+  return atom->name;
+}
+
+int
+bus_atom_get_n_atoms (void)
+{
+  if (atoms == NULL)
+    return 0;
+
+  return _dbus_hash_table_get_n_entries (atoms);
+}
+
+#ifdef DBUS_BUILD_TESTS
+
+dbus_bool_t
+bus_atoms_test (const DBusString *test_data_dir)
+{
+  const char *foo, *foo2, *bar;
+  char copy[4];
+
+  foo = bus_atom_intern ("foo");
+  bar = bus_atom_intern ("bar");
+  if (foo == NULL || bar == NULL)
+    _dbus_assert_not_reached ("no memory for atoms");
+
+  strcpy (copy, "foo");
+  foo2 = bus_atom_intern (copy);
+  if (foo2 == NULL)
+    _dbus_assert_not_reached ("no memory for atoms");
+
+  _dbus_assert (foo == foo2);
+  _dbus_assert (foo != bar);
+  _dbus_assert (strcmp (foo, "foo") == 0);
+  _dbus_assert (bus_atom_lookup (copy) == foo);
+  _dbus_assert (bus_atom_lookup ("baz") == NULL);
+  _dbus_assert (bus_atom_get_n_atoms () == 2);
+
+  bus_atom_unref (foo2);
+  _dbus_assert (bus_atom_lookup ("foo") == foo);
+
+  bus_atom_unref (foo);
+  _dbus_assert (bus_atom_lookup ("foo") == NULL);
+
+  _dbus_assert (bus_atom_ref (bar) == bar);
+  bus_atom_unref (bar);
+  bus_atom_unref (bar);
+  _dbus_assert (bus_atom_get_n_atoms () == 0);
+
+  return TRUE;
+}
+
+#endif /* DBUS_BUILD_TESTS */
@@ -0,0 +1,40 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* atoms.h  Interned strings shared across the bus
+ *
+ * Copyright (C) 2003  Red Hat, Inc.
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef BUS_ATOMS_H
+#define BUS_ATOMS_H
+
+#include <dbus/dbus.h>
+
+/* An atom is a string the whole bus shares a single copy of, so two
+ * atoms are equal exactly when their pointers are. Atoms are read-only
+ * and reference counted.
+ */
+
+const char* bus_atom_intern (const char *str);
+const char* bus_atom_ref    (const char *atom);
+void        bus_atom_unref  (const char *atom);
+const char* bus_atom_lookup (const char *str);
+int         bus_atom_get_n_atoms (void);
+
+#endif /* BUS_ATOMS_H */
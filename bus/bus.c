@@ -32,10 +32,16 @@
 #include "signals.h"
 #include "selinux.h"
 #include "dir-watch.h"
+#include "stats.h"
+#include "logger.h"
+#include "resolver.h"
+#include "handoff.h"
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-hash.h>
 #include <dbus/dbus-credentials.h>
 #include <dbus/dbus-internals.h>
+#include <dbus/dbus-connection-internal.h>
+#include <dbus/dbus-timeout.h>
 #ifdef DBUS_CYGWIN
 #include <signal.h>
 #endif
@@ -54,13 +60,22 @@ struct BusContext
   char *user;
   char *log_prefix;
   DBusLoop *loop;
+  BusLogger *logger;           /**< Writes the system log; NULL until we are in the background */
+  BusResolver *resolver;
   DBusList *servers;
   BusConnections *connections;
   BusActivation *activation;
   BusRegistry *registry;
   BusPolicy *policy;
+  int policy_generation;       /**< Bumped whenever policy is replaced */
   BusMatchmaker *matchmaker;
   BusLimits limits;
+  DBusList *trusted_body_uids; /**< Uids whose message bodies we don't validate */
+  DBusList *dispatch_weights;  /**< BusDispatchWeight for users with their own dispatch_weight */
+  DBusList *priority_uids;     /**< Uids whose connections have priority */
+  DBusList *priority_names;    /**< Bus names whose owners have priority */
+  BusConfigParser *config;     /**< The configuration last loaded, to skip unchanged reloads */
+  DBusTimeout *startup_timeout; /**< Finishes startup once the main loop runs */
   unsigned int fork : 1;
   unsigned int syslog : 1;
   unsigned int keep_umask : 1;
@@ -140,6 +155,18 @@ remove_server_watch (DBusWatch  *watch,
                            watch, server_watch_callback, server);
 }
 
+static void
+toggle_server_watch (DBusWatch  *watch,
+                     void       *data)
+{
+  DBusServer *server = data;
+  BusContext *context;
+
+  context = server_get_context (server);
+
+  _dbus_loop_toggle_watch (context->loop, watch);
+}
+
 
 static void
 server_timeout_callback (DBusTimeout   *timeout,
@@ -176,11 +203,32 @@ remove_server_timeout (DBusTimeout *timeout,
 }
 
 static void
-new_connection_callback (DBusServer     *server,
-                         DBusConnection *new_connection,
-                         void           *data)
+toggle_server_timeout (DBusTimeout *timeout,
+                       void        *data)
 {
-  BusContext *context = data;
+  DBusServer *server = data;
+  BusContext *context;
+
+  context = server_get_context (server);
+
+  _dbus_loop_toggle_timeout (context->loop, timeout);
+}
+
+/**
+ * Takes on a connection accepted by one of our servers, or handed
+ * over by the bus process we replaced, applying our limits to it.
+ *
+ * @param context the bus context
+ * @param connection the new connection
+ * @returns #FALSE if there was no memory, in which case the connection is closed
+ */
+dbus_bool_t
+bus_context_add_connection (BusContext     *context,
+                            DBusConnection *new_connection)
+{
+  dbus_bool_t retval;
+
+  retval = TRUE;
 
   if (!bus_connections_setup_connection (context->connections, new_connection))
     {
@@ -192,6 +240,7 @@ new_connection_callback (DBusServer     *server,
        * in general.
        */
       dbus_connection_close (new_connection);
+      retval = FALSE;
     }
 
   dbus_connection_set_max_received_size (new_connection,
@@ -206,10 +255,66 @@ new_connection_callback (DBusServer     *server,
   dbus_connection_set_max_message_unix_fds (new_connection,
                                         context->limits.max_message_unix_fds);
 
+  _dbus_connection_set_iteration_bounds (new_connection,
+                                         MAX (context->limits.min_bytes_per_iteration, 1),
+                                         MAX (context->limits.min_bytes_per_iteration,
+                                              context->limits.max_bytes_per_iteration));
+
   dbus_connection_set_allow_anonymous (new_connection,
                                        context->allow_anonymous);
 
   /* on OOM, we won't have ref'd the connection so it will die. */
+  return retval;
+}
+
+static void
+new_connection_callback (DBusServer     *server,
+                         DBusConnection *new_connection,
+                         void           *data)
+{
+  BusContext *context = data;
+
+  bus_context_add_connection (context, new_connection);
+}
+
+/**
+ * Stops or resumes accepting new connections on all our servers,
+ * by taking their watches out of the main loop or putting them back.
+ *
+ * @param context the bus context
+ * @param accepting whether to accept connections
+ * @returns #FALSE if there was no memory to resume
+ */
+dbus_bool_t
+bus_context_set_accepting (BusContext  *context,
+                           dbus_bool_t  accepting)
+{
+  DBusList *link;
+
+  for (link = _dbus_list_get_first_link (&context->servers);
+       link != NULL;
+       link = _dbus_list_get_next_link (&context->servers, link))
+    {
+      DBusServer *server = link->data;
+
+      if (accepting)
+        {
+          if (!dbus_server_set_watch_functions (server,
+                                                add_server_watch,
+                                                remove_server_watch,
+                                                toggle_server_watch,
+                                                server,
+                                                NULL))
+            return FALSE;
+        }
+      else if (!dbus_server_set_watch_functions (server,
+                                                 NULL, NULL, NULL,
+                                                 context,
+                                                 NULL))
+        _dbus_assert_not_reached ("setting watch functions to NULL failed");
+    }
+
+  return TRUE;
 }
 
 static void
@@ -253,7 +358,7 @@ setup_server (BusContext *context,
   if (!dbus_server_set_watch_functions (server,
                                         add_server_watch,
                                         remove_server_watch,
-                                        NULL,
+                                        toggle_server_watch,
                                         server,
                                         NULL))
     {
@@ -264,7 +369,7 @@ setup_server (BusContext *context,
   if (!dbus_server_set_timeout_functions (server,
                                           add_server_timeout,
                                           remove_server_timeout,
-                                          NULL,
+                                          toggle_server_timeout,
                                           server, NULL))
     {
       BUS_SET_OOM (error);
@@ -283,6 +388,7 @@ process_config_first_time_only (BusContext       *context,
 				BusConfigParser  *parser,
                                 const DBusString *address,
                                 dbus_bool_t      systemd_activation,
+                                BusHandoff       *handoff,
 				DBusError        *error)
 {
   DBusString log_prefix;
@@ -305,10 +411,11 @@ process_config_first_time_only (BusContext       *context,
   /* Check for an existing pid file. Of course this is a race;
    * we'd have to use fcntl() locks on the pid file to
    * avoid that. But we want to check for the pid file
-   * before overwriting any existing sockets, etc.
+   * before overwriting any existing sockets, etc.  A bus we are
+   * taking over from wrote it with our own pid, so that one is ours.
    */
   pidfile = bus_config_parser_get_pidfile (parser);
-  if (pidfile != NULL)
+  if (pidfile != NULL && handoff == NULL)
     {
       DBusString u;
       DBusStat stbuf;
@@ -417,7 +524,29 @@ process_config_first_time_only (BusContext       *context,
 
   /* Listen on our addresses */
 
-  if (address)
+  if (handoff != NULL)
+    {
+      /* keep listening on the sockets of the bus we replaced,
+       * whatever the configuration says now
+       */
+      if (!bus_handoff_restore_servers (handoff, &context->servers, error))
+        {
+          _DBUS_ASSERT_ERROR_IS_SET (error);
+          goto failed;
+        }
+
+      for (link = _dbus_list_get_first_link (&context->servers);
+           link != NULL;
+           link = _dbus_list_get_next_link (&context->servers, link))
+        {
+          if (!setup_server (context, link->data, auth_mechanisms, error))
+            {
+              _DBUS_ASSERT_ERROR_IS_SET (error);
+              goto failed;
+            }
+        }
+    }
+  else if (address)
     {
       DBusServer *server;
 
@@ -518,9 +647,36 @@ process_config_every_time (BusContext      *context,
   /* get our limits and timeout lengths */
   bus_config_parser_get_limits (parser, &context->limits);
 
+  /* only affects connections made from now on */
+  _dbus_list_clear (&context->trusted_body_uids);
+  while ((link = _dbus_list_pop_first_link (bus_config_parser_get_trusted_body_uids (parser))))
+    _dbus_list_append_link (&context->trusted_body_uids, link);
+
+  _dbus_list_foreach (&context->dispatch_weights,
+                      (DBusForeachFunction) dbus_free, NULL);
+  _dbus_list_clear (&context->dispatch_weights);
+  while ((link = _dbus_list_pop_first_link (bus_config_parser_get_dispatch_weights (parser))))
+    _dbus_list_append_link (&context->dispatch_weights, link);
+
+  _dbus_list_clear (&context->priority_uids);
+  while ((link = _dbus_list_pop_first_link (bus_config_parser_get_priority_uids (parser))))
+    _dbus_list_append_link (&context->priority_uids, link);
+
+  _dbus_list_foreach (&context->priority_names,
+                      (DBusForeachFunction) dbus_free, NULL);
+  _dbus_list_clear (&context->priority_names);
+  while ((link = _dbus_list_pop_first_link (bus_config_parser_get_priority_names (parser))))
+    _dbus_list_append_link (&context->priority_names, link);
+
+  /* unlike the weights, priority is taken away again at once */
+  if (is_reload)
+    bus_connections_update_priority (context->connections);
+
+  /* existing connections pick the new rules up as they're checked */
   if (context->policy)
     bus_policy_unref (context->policy);
   context->policy = bus_config_parser_steal_policy (parser);
+  context->policy_generation += 1;
   _dbus_assert (context->policy != NULL);
 
   /* We have to build the address backward, so that
@@ -592,7 +748,10 @@ process_config_every_time (BusContext      *context,
     }
   else
     {
-      context->activation = bus_activation_new (context, &full_address, dirs, error);
+      /* the service directories are scanned when first needed, so
+       * that reading them doesn't hold up the first connections */
+      context->activation = bus_activation_new (context, &full_address, dirs,
+                                                TRUE, error);
     }
 
   if (context->activation == NULL)
@@ -676,6 +835,62 @@ process_config_postinit (BusContext      *context,
   return TRUE;
 }
 
+/* Start the services listed in <prewarm>, without waiting for any of
+ * them.  A service that can't be started is logged and left to be
+ * activated on demand as usual.
+ */
+static void
+prewarm_services (BusContext      *context,
+                  BusConfigParser *parser)
+{
+  DBusList **services;
+  DBusList *link;
+
+  services = bus_config_parser_get_prewarm_services (parser);
+
+  link = _dbus_list_get_first_link (services);
+  while (link != NULL)
+    {
+      DBusError error;
+
+      dbus_error_init (&error);
+      if (!bus_activation_prewarm_service (context->activation,
+                                           link->data, &error))
+        {
+          bus_context_log (context, DBUS_SYSTEM_LOG_INFO,
+                           "Could not prewarm %s: %s",
+                           (const char *) link->data, error.message);
+          dbus_error_free (&error);
+        }
+
+      link = _dbus_list_get_next_link (services, link);
+    }
+}
+
+static void
+startup_timeout_callback (DBusTimeout *timeout,
+                          void        *data)
+{
+  dbus_timeout_handle (timeout);
+}
+
+/* The parts of startup that nobody connecting has to wait for, done
+ * on the first main loop iteration, after the listening sockets are
+ * being watched.
+ */
+static dbus_bool_t
+finish_startup (void *data)
+{
+  BusContext *context = data;
+
+  _dbus_timeout_set_enabled (context->startup_timeout, FALSE);
+  _dbus_loop_toggle_timeout (context->loop, context->startup_timeout);
+
+  prewarm_services (context, context->config);
+
+  return TRUE;
+}
+
 BusContext*
 bus_context_new (const DBusString *config_file,
                  ForceForkSetting  force_fork,
@@ -683,6 +898,7 @@ bus_context_new (const DBusString *config_file,
                  DBusPipe         *print_pid_pipe,
                  const DBusString *address,
                  dbus_bool_t      systemd_activation,
+                 BusHandoff      *handoff,
                  DBusError        *error)
 {
   DBusString log_prefix;
@@ -708,7 +924,10 @@ bus_context_new (const DBusString *config_file,
     }
   context->refcount = 1;
 
-  _dbus_generate_uuid (&context->uuid);
+  if (handoff != NULL)
+    bus_handoff_get_id (handoff, &context->uuid);
+  else
+    _dbus_generate_uuid (&context->uuid);
 
   if (!_dbus_string_copy_data (config_file, &context->config_file))
     {
@@ -723,6 +942,13 @@ bus_context_new (const DBusString *config_file,
       goto failed;
     }
 
+  context->resolver = bus_resolver_new (context->loop);
+  if (context->resolver == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
   context->registry = bus_registry_new (context);
   if (context->registry == NULL)
     {
@@ -737,7 +963,8 @@ bus_context_new (const DBusString *config_file,
       goto failed;
     }
 
-  if (!process_config_first_time_only (context, parser, address, systemd_activation, error))
+  if (!process_config_first_time_only (context, parser, address, systemd_activation,
+                                       handoff, error))
     {
       _DBUS_ASSERT_ERROR_IS_SET (error);
       goto failed;
@@ -883,10 +1110,9 @@ bus_context_new (const DBusString *config_file,
       !_dbus_pipe_is_stdout_or_stderr (print_pid_pipe))
     _dbus_pipe_close (print_pid_pipe, NULL);
 
-  if (!bus_selinux_full_init ())
-    {
-      bus_context_log (context, DBUS_SYSTEM_LOG_FATAL, "SELinux enabled but AVC initialization failed; check system log\n");
-    }
+  /* The AVC, and its netlink thread, start when the first connection
+   * or SELinux policy needs them */
+  bus_selinux_defer_full_init ();
 
   if (!process_config_postinit (context, parser, error))
     {
@@ -894,11 +1120,9 @@ bus_context_new (const DBusString *config_file,
       goto failed;
     }
 
-  if (parser != NULL)
-    {
-      bus_config_parser_unref (parser);
-      parser = NULL;
-    }
+  /* kept to tell whether a reload has anything to do */
+  context->config = parser;
+  parser = NULL;
 
   /* Here we change our credentials if required,
    * as soon as we've set up our sockets and pidfile
@@ -917,6 +1141,47 @@ bus_context_new (const DBusString *config_file,
 #endif
     }
 
+  /* Its thread would not survive the fork above */
+  if (context->syslog)
+    {
+      context->logger = bus_logger_new ();
+      if (context->logger == NULL)
+        {
+          BUS_SET_OOM (error);
+          goto failed;
+        }
+
+      bus_selinux_set_logger (context->logger);
+    }
+
+  /* Now that the policy is in place, take back the clients of the
+   * bus we replaced
+   */
+  if (handoff != NULL &&
+      !bus_handoff_restore_connections (handoff, context, error))
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      goto failed;
+    }
+
+  /* Only now, so that the services run as the bus user */
+  context->startup_timeout = _dbus_timeout_new (0, finish_startup,
+                                                context, NULL);
+  if (context->startup_timeout == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
+  if (!_dbus_loop_add_timeout (context->loop, context->startup_timeout,
+                               startup_timeout_callback, context, NULL))
+    {
+      _dbus_timeout_unref (context->startup_timeout);
+      context->startup_timeout = NULL;
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
   dbus_server_free_data_slot (&server_data_slot);
 
   return context;
@@ -952,6 +1217,31 @@ bus_context_reload_config (BusContext *context,
   _dbus_flush_caches ();
 
   ret = FALSE;
+  parser = NULL;
+
+  /* Reloads are mostly asked for after installing service files; if
+   * no configuration file, included directory or user changed, parsing
+   * would recreate what we have, so only rescan the services.
+   */
+  if (context->config != NULL &&
+      !bus_config_parser_sources_changed (context->config))
+    {
+      DBusString address;
+
+      _dbus_string_init_const (&address, context->address);
+      if (!bus_activation_reload (context->activation, &address,
+                                  bus_config_parser_get_service_dirs (context->config),
+                                  error))
+        {
+          _DBUS_ASSERT_ERROR_IS_SET (error);
+          goto failed;
+        }
+
+      bus_context_log (context, DBUS_SYSTEM_LOG_INFO,
+                       "Configuration unchanged, reloaded service files");
+      return TRUE;
+    }
+
   _dbus_string_init_const (&config_file, context->config_file);
   parser = bus_config_load (&config_file, TRUE, NULL, error);
   if (parser == NULL)
@@ -972,6 +1262,11 @@ bus_context_reload_config (BusContext *context,
     }
   ret = TRUE;
 
+  if (context->config != NULL)
+    bus_config_parser_unref (context->config);
+  context->config = parser;
+  parser = NULL;
+
   bus_context_log (context, DBUS_SYSTEM_LOG_INFO, "Reloaded configuration");
  failed:
   if (!ret)
@@ -1074,6 +1369,27 @@ bus_context_unref (BusContext *context)
           context->policy = NULL;
         }
 
+      if (context->config)
+        {
+          bus_config_parser_unref (context->config);
+          context->config = NULL;
+        }
+
+      /* after the connections, which cancel their lookups */
+      if (context->resolver)
+        {
+          bus_resolver_unref (context->resolver);
+          context->resolver = NULL;
+        }
+
+      if (context->startup_timeout)
+        {
+          _dbus_loop_remove_timeout (context->loop, context->startup_timeout,
+                                     startup_timeout_callback, context);
+          _dbus_timeout_unref (context->startup_timeout);
+          context->startup_timeout = NULL;
+        }
+
       if (context->loop)
         {
           _dbus_loop_unref (context->loop);
@@ -1086,12 +1402,27 @@ bus_context_unref (BusContext *context)
           context->matchmaker = NULL;
         }
 
+      /* last, so everything else can still log while going away */
+      if (context->logger)
+        {
+          bus_logger_unref (context->logger);
+          context->logger = NULL;
+        }
+
       dbus_free (context->config_file);
       dbus_free (context->log_prefix);
       dbus_free (context->type);
       dbus_free (context->address);
       dbus_free (context->user);
       dbus_free (context->servicehelper);
+      _dbus_list_clear (&context->trusted_body_uids);
+      _dbus_list_foreach (&context->dispatch_weights,
+                          (DBusForeachFunction) dbus_free, NULL);
+      _dbus_list_clear (&context->dispatch_weights);
+      _dbus_list_clear (&context->priority_uids);
+      _dbus_list_foreach (&context->priority_names,
+                          (DBusForeachFunction) dbus_free, NULL);
+      _dbus_list_clear (&context->priority_names);
 
 #ifdef WANT_PIDFILE
       if (context->pidfile)
@@ -1169,6 +1500,18 @@ bus_context_get_loop (BusContext *context)
   return context->loop;
 }
 
+DBusList**
+bus_context_get_servers (BusContext *context)
+{
+  return &context->servers;
+}
+
+BusResolver*
+bus_context_get_resolver (BusContext *context)
+{
+  return context->resolver;
+}
+
 dbus_bool_t
 bus_context_allow_unix_user (BusContext   *context,
                              unsigned long uid)
@@ -1195,6 +1538,19 @@ bus_context_get_policy (BusContext *context)
   return context->policy;
 }
 
+/**
+ * Tells whether the policy was replaced, by a reload, since a client
+ * policy was made from it.
+ *
+ * @param context the bus context
+ * @returns a number that changes whenever the policy is replaced
+ */
+int
+bus_context_get_policy_generation (BusContext *context)
+{
+  return context->policy_generation;
+}
+
 BusClientPolicy*
 bus_context_create_client_policy (BusContext      *context,
                                   DBusConnection  *connection,
@@ -1260,12 +1616,137 @@ bus_context_get_max_replies_per_connection (BusContext *context)
   return context->limits.max_replies_per_connection;
 }
 
+/* Whether the configuration says to pass on message bodies from this
+ * user without validating them
+ */
+dbus_bool_t
+bus_context_get_trusts_message_bodies (BusContext    *context,
+                                       unsigned long  uid)
+{
+  DBusList *link;
+
+  for (link = _dbus_list_get_first_link (&context->trusted_body_uids);
+       link != NULL;
+       link = _dbus_list_get_next_link (&context->trusted_body_uids, link))
+    {
+      if ((unsigned long) _DBUS_POINTER_TO_INT (link->data) == uid)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Whether the configuration gives connections of this user priority */
+dbus_bool_t
+bus_context_get_priority_uid (BusContext    *context,
+                              unsigned long  uid)
+{
+  DBusList *link;
+
+  for (link = _dbus_list_get_first_link (&context->priority_uids);
+       link != NULL;
+       link = _dbus_list_get_next_link (&context->priority_uids, link))
+    {
+      if ((unsigned long) _DBUS_POINTER_TO_INT (link->data) == uid)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Whether the configuration gives the owners of this name priority */
+dbus_bool_t
+bus_context_get_priority_name (BusContext *context,
+                               const char *name)
+{
+  DBusList *link;
+
+  for (link = _dbus_list_get_first_link (&context->priority_names);
+       link != NULL;
+       link = _dbus_list_get_next_link (&context->priority_names, link))
+    {
+      if (strcmp (link->data, name) == 0)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+long
+bus_context_get_max_priority_outgoing_bytes (BusContext *context)
+{
+  return context->limits.max_priority_outgoing_bytes;
+}
+
 int
 bus_context_get_reply_timeout (BusContext *context)
 {
   return context->limits.reply_timeout;
 }
 
+long
+bus_context_get_flow_control_outgoing_bytes (BusContext *context)
+{
+  return context->limits.flow_control_outgoing_bytes;
+}
+
+long
+bus_context_get_max_messages_per_second (BusContext *context)
+{
+  return context->limits.max_messages_per_second;
+}
+
+long
+bus_context_get_max_bytes_per_second (BusContext *context)
+{
+  return context->limits.max_bytes_per_second;
+}
+
+long
+bus_context_get_max_messages_per_second_per_user (BusContext *context)
+{
+  return context->limits.max_messages_per_second_per_user;
+}
+
+long
+bus_context_get_max_bytes_per_second_per_user (BusContext *context)
+{
+  return context->limits.max_bytes_per_second_per_user;
+}
+
+long
+bus_context_get_max_buffered_bytes (BusContext *context)
+{
+  return context->limits.max_buffered_bytes;
+}
+
+/* The dispatch weight for a connection of this user, or of no
+ * particular user if have_uid is FALSE
+ */
+int
+bus_context_get_dispatch_weight (BusContext    *context,
+                                 dbus_bool_t    have_uid,
+                                 unsigned long  uid)
+{
+  DBusList *link;
+
+  if (!have_uid)
+    return context->limits.dispatch_weight;
+
+  /* the last one in the configuration wins */
+  for (link = _dbus_list_get_last_link (&context->dispatch_weights);
+       link != NULL;
+       link = _dbus_list_get_prev_link (&context->dispatch_weights, link))
+    {
+      BusDispatchWeight *dw = link->data;
+
+      if (dw->uid == uid)
+        return dw->weight;
+    }
+
+  return context->limits.dispatch_weight;
+}
+
 void
 bus_context_log (BusContext *context, DBusSystemLogSeverity severity, const char *msg, ...) _DBUS_GNUC_PRINTF (3, 4);
 
@@ -1273,34 +1754,205 @@ void
 bus_context_log (BusContext *context, DBusSystemLogSeverity severity, const char *msg, ...)
 {
   va_list args;
+  DBusString full_msg;
 
   if (!context->syslog)
     return;
 
   va_start (args, msg);
 
-  if (context->log_prefix)
+  if (context->log_prefix == NULL && context->logger == NULL)
     {
-      DBusString full_msg;
+      _dbus_system_logv (severity, msg, args);
+      goto out;
+    }
 
-      if (!_dbus_string_init (&full_msg))
-        goto out;
-      if (!_dbus_string_append (&full_msg, context->log_prefix))
-        goto oom_out;
-      if (!_dbus_string_append_printf_valist (&full_msg, msg, args))
-        goto oom_out;
+  if (!_dbus_string_init (&full_msg))
+    goto out;
 
-      _dbus_system_log (severity, "%s", _dbus_string_get_const_data (&full_msg));
-    oom_out:
-      _dbus_string_free (&full_msg);
+  if ((context->log_prefix == NULL ||
+       _dbus_string_append (&full_msg, context->log_prefix)) &&
+      _dbus_string_append_printf_valist (&full_msg, msg, args))
+    {
+      if (context->logger)
+        bus_logger_log (context->logger, severity,
+                        _dbus_string_get_const_data (&full_msg));
+      else
+        _dbus_system_log (severity, "%s",
+                          _dbus_string_get_const_data (&full_msg));
     }
-  else
-    _dbus_system_logv (severity, msg, args);
+
+  _dbus_string_free (&full_msg);
 
 out:
   va_end (args);
 }
 
+/*
+ * Builds what a denial's text is made of, apart from the sender,
+ * which is fixed for the connection the key is kept on. Strings end
+ * in their nul, so no two keys run together.
+ */
+static dbus_bool_t
+append_denial_key (DBusString  *key,
+                   DBusMessage *message,
+                   dbus_bool_t  receiving,
+                   dbus_int32_t toggles,
+                   dbus_bool_t  requested_reply,
+                   const char  *dest,
+                   const char  *recipient_loginfo)
+{
+  const char *strings[5];
+  dbus_uint32_t numbers[5];
+  int i;
+
+  numbers[0] = receiving;
+  numbers[1] = toggles;
+  numbers[2] = dbus_message_get_type (message);
+  numbers[3] = requested_reply;
+  numbers[4] = receiving ? dbus_message_get_reply_serial (message) : 0;
+
+  /* these are never empty when set */
+  strings[0] = dbus_message_get_interface (message);
+  strings[1] = dbus_message_get_member (message);
+  strings[2] = dbus_message_get_error_name (message);
+  strings[3] = dest;
+  strings[4] = recipient_loginfo;
+
+  if (!_dbus_string_append_len (key, (const char *) numbers, sizeof (numbers)))
+    return FALSE;
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (strings); i++)
+    {
+      const char *str = strings[i] ? strings[i] : "";
+
+      if (!_dbus_string_append_len (key, str, strlen (str) + 1))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static dbus_bool_t
+append_denial_text (DBusString  *text,
+                    DBusMessage *message,
+                    dbus_bool_t  receiving,
+                    dbus_int32_t toggles,
+                    dbus_bool_t  requested_reply,
+                    const char  *dest,
+                    const char  *sender_name,
+                    const char  *sender_loginfo,
+                    const char  *recipient_loginfo)
+{
+  const char *type, *interface, *member, *error_name;
+
+  type = dbus_message_type_to_string (dbus_message_get_type (message));
+  interface = dbus_message_get_interface (message);
+  member = dbus_message_get_member (message);
+  error_name = dbus_message_get_error_name (message);
+
+  if (receiving)
+    return _dbus_string_append_printf (text,
+                                       "Rejected receive message, %d matched rules; "
+                                       "type=\"%s\" sender=\"%s\" (%s) interface=\"%s\" member=\"%s\" error name=\"%s\" reply serial=%u requested_reply=%d destination=\"%s\" (%s))",
+                                       toggles, type,
+                                       sender_name ? sender_name : "(unset)",
+                                       sender_loginfo,
+                                       interface ? interface : "(unset)",
+                                       member ? member : "(unset)",
+                                       error_name ? error_name : "(unset)",
+                                       dbus_message_get_reply_serial (message),
+                                       requested_reply, dest,
+                                       recipient_loginfo);
+  else
+    return _dbus_string_append_printf (text,
+                                       "Rejected send message, %d matched rules; "
+                                       "type=\"%s\", sender=\"%s\" (%s) interface=\"%s\" member=\"%s\" error name=\"%s\" requested_reply=%d destination=\"%s\" (%s))",
+                                       toggles, type,
+                                       sender_name ? sender_name : "(unset)",
+                                       sender_loginfo,
+                                       interface ? interface : "(unset)",
+                                       member ? member : "(unset)",
+                                       error_name ? error_name : "(unset)",
+                                       requested_reply, dest,
+                                       recipient_loginfo);
+}
+
+/*
+ * Sets error to the policy denial of message, and logs it if log is
+ * TRUE. The text is only formatted when someone will read it, and
+ * only once: the error and the log share it, and a sender repeating
+ * the same denied message reuses the text of the last denial.
+ */
+static void
+complain_about_message (BusContext     *context,
+                        DBusConnection *sender,
+                        DBusMessage    *message,
+                        dbus_bool_t     receiving,
+                        dbus_int32_t    toggles,
+                        dbus_bool_t     requested_reply,
+                        const char     *dest,
+                        const char     *sender_name,
+                        const char     *sender_loginfo,
+                        const char     *recipient_loginfo,
+                        dbus_bool_t     log,
+                        DBusError      *error)
+{
+  DBusString key;
+  DBusString text;
+  const char *complaint;
+
+  /* the error is only for an error reply, which this won't get */
+  if (!log && (error == NULL || dbus_message_get_no_reply (message)))
+    {
+      dbus_set_error_const (error, DBUS_ERROR_ACCESS_DENIED,
+                            "Rejected by security policy");
+      return;
+    }
+
+  if (!_dbus_string_init (&key))
+    goto oom;
+
+  if (!_dbus_string_init (&text))
+    {
+      _dbus_string_free (&key);
+      goto oom;
+    }
+
+  complaint = NULL;
+  if (sender != NULL &&
+      append_denial_key (&key, message, receiving, toggles, requested_reply,
+                         dest, recipient_loginfo))
+    complaint = bus_connection_get_denial_text (sender, &key);
+
+  if (complaint == NULL)
+    {
+      if (!append_denial_text (&text, message, receiving, toggles,
+                               requested_reply, dest, sender_name,
+                               sender_loginfo, recipient_loginfo))
+        {
+          _dbus_string_free (&text);
+          _dbus_string_free (&key);
+          goto oom;
+        }
+
+      complaint = _dbus_string_get_const_data (&text);
+      if (sender != NULL && _dbus_string_get_length (&key) > 0)
+        bus_connection_set_denial_text (sender, &key, complaint);
+    }
+
+  dbus_set_error (error, DBUS_ERROR_ACCESS_DENIED, "%s", complaint);
+  if (log)
+    bus_context_log (context, DBUS_SYSTEM_LOG_SECURITY, "%s", complaint);
+
+  _dbus_string_free (&text);
+  _dbus_string_free (&key);
+  return;
+
+ oom:
+  BUS_SET_OOM (error);
+}
+
 /*
  * addressed_recipient is the recipient specified in the message.
  *
@@ -1313,21 +1965,27 @@ out:
  *
  * NULL for addressed_recipient may mean the bus driver, or may mean
  * no destination was specified in the message (e.g. a signal).
+ *
+ * verdicts, if not NULL, holds the policy outcomes of earlier checks
+ * of the same message for other recipients found by match rules.
  */
-dbus_bool_t
-bus_context_check_security_policy (BusContext     *context,
-                                   BusTransaction *transaction,
-                                   DBusConnection *sender,
-                                   DBusConnection *addressed_recipient,
-                                   DBusConnection *proposed_recipient,
-                                   DBusMessage    *message,
-                                   DBusError      *error)
+static dbus_bool_t
+check_security_policy (BusContext        *context,
+                       BusTransaction    *transaction,
+                       DBusConnection    *sender,
+                       DBusConnection    *addressed_recipient,
+                       DBusConnection    *proposed_recipient,
+                       DBusMessage       *message,
+                       BusPolicyVerdicts *verdicts,
+                       DBusError         *error)
 {
   const char *dest;
   BusClientPolicy *sender_policy;
   BusClientPolicy *recipient_policy;
   dbus_int32_t toggles;
   dbus_bool_t log;
+  dbus_bool_t allowed;
+  int i;
   int type;
   dbus_bool_t requested_reply;
   const char *sender_name;
@@ -1515,46 +2173,43 @@ bus_context_check_security_policy (BusContext     *context,
                 (proposed_recipient == NULL && recipient_policy == NULL));
 
   log = FALSE;
-  if (sender_policy &&
-      !bus_client_policy_check_can_send (sender_policy,
-                                         context->registry,
-                                         requested_reply,
-                                         proposed_recipient,
-                                         message, &toggles, &log))
-    {
-      const char *msg = "Rejected send message, %d matched rules; "
-                        "type=\"%s\", sender=\"%s\" (%s) interface=\"%s\" member=\"%s\" error name=\"%s\" requested_reply=%d destination=\"%s\" (%s))";
-
-      dbus_set_error (error, DBUS_ERROR_ACCESS_DENIED, msg,
-                      toggles,
-                      dbus_message_type_to_string (dbus_message_get_type (message)),
-                      sender_name ? sender_name : "(unset)",
-                      sender_loginfo,
-                      dbus_message_get_interface (message) ?
-                      dbus_message_get_interface (message) : "(unset)",
-                      dbus_message_get_member (message) ?
-                      dbus_message_get_member (message) : "(unset)",
-                      dbus_message_get_error_name (message) ?
-                      dbus_message_get_error_name (message) : "(unset)",
-                      requested_reply,
-                      dest ? dest : DBUS_SERVICE_DBUS,
-                      proposed_recipient_loginfo);
-      /* Needs to be duplicated to avoid calling malloc and having to handle OOM */
-      if (addressed_recipient == proposed_recipient)
-        bus_context_log (context, DBUS_SYSTEM_LOG_SECURITY, msg,
-                                  toggles,
-                                  dbus_message_type_to_string (dbus_message_get_type (message)),
-                                  sender_name ? sender_name : "(unset)",
-                                  sender_loginfo,
-                                  dbus_message_get_interface (message) ?
-                                  dbus_message_get_interface (message) : "(unset)",
-                                  dbus_message_get_member (message) ?
-                                  dbus_message_get_member (message) : "(unset)",
-                                  dbus_message_get_error_name (message) ?
-                                  dbus_message_get_error_name (message) : "(unset)",
-                                  requested_reply,
-                                  dest ? dest : DBUS_SERVICE_DBUS,
-                                  proposed_recipient_loginfo);
+  allowed = TRUE;
+  if (sender_policy != NULL && verdicts != NULL && verdicts->have_send)
+    {
+      allowed = verdicts->send_allowed;
+      toggles = verdicts->send_toggles;
+      log = verdicts->send_log;
+    }
+  else if (sender_policy != NULL)
+    {
+      allowed = bus_client_policy_check_can_send (sender_policy,
+                                                  context->registry,
+                                                  requested_reply,
+                                                  proposed_recipient,
+                                                  message, &toggles, &log);
+
+      /* Unless a rule names a destination, who receives the message
+       * doesn't come into it
+       */
+      if (verdicts != NULL &&
+          !bus_client_policy_depends_on_names (sender_policy))
+        {
+          verdicts->have_send = TRUE;
+          verdicts->send_allowed = allowed;
+          verdicts->send_toggles = toggles;
+          verdicts->send_log = log;
+        }
+    }
+
+  if (!allowed)
+    {
+      complain_about_message (context, sender, message, FALSE, toggles,
+                              requested_reply,
+                              dest ? dest : DBUS_SERVICE_DBUS,
+                              sender_name, sender_loginfo,
+                              proposed_recipient_loginfo,
+                              addressed_recipient == proposed_recipient,
+                              error);
       _dbus_verbose ("security policy disallowing message due to sender policy\n");
       return FALSE;
     }
@@ -1577,49 +2232,54 @@ bus_context_check_security_policy (BusContext     *context,
                               dest ? dest : DBUS_SERVICE_DBUS,
                               proposed_recipient_loginfo);
 
-  if (recipient_policy &&
-      !bus_client_policy_check_can_receive (recipient_policy,
-                                            context->registry,
-                                            requested_reply,
-                                            sender,
-                                            addressed_recipient, proposed_recipient,
-                                            message, &toggles))
-    {
-      const char *msg = "Rejected receive message, %d matched rules; "
-                        "type=\"%s\" sender=\"%s\" (%s) interface=\"%s\" member=\"%s\" error name=\"%s\" reply serial=%u requested_reply=%d destination=\"%s\" (%s))";
-
-      dbus_set_error (error, DBUS_ERROR_ACCESS_DENIED, msg,
-                      toggles,
-                      dbus_message_type_to_string (dbus_message_get_type (message)),
-                      sender_name ? sender_name : "(unset)",
-                      sender_loginfo,
-                      dbus_message_get_interface (message) ?
-                      dbus_message_get_interface (message) : "(unset)",
-                      dbus_message_get_member (message) ?
-                      dbus_message_get_member (message) : "(unset)",
-                      dbus_message_get_error_name (message) ?
-                      dbus_message_get_error_name (message) : "(unset)",
-                      dbus_message_get_reply_serial (message),
-                      requested_reply,
-                      dest ? dest : DBUS_SERVICE_DBUS,
-                      proposed_recipient_loginfo);
-      /* Needs to be duplicated to avoid calling malloc and having to handle OOM */
-      if (addressed_recipient == proposed_recipient)
-        bus_context_log (context, DBUS_SYSTEM_LOG_SECURITY, msg,
-                                  toggles,
-                                  dbus_message_type_to_string (dbus_message_get_type (message)),
-                                  sender_name ? sender_name : "(unset)",
-                                  sender_loginfo,
-                                  dbus_message_get_interface (message) ?
-                                  dbus_message_get_interface (message) : "(unset)",
-                                  dbus_message_get_member (message) ?
-                                  dbus_message_get_member (message) : "(unset)",
-                                  dbus_message_get_error_name (message) ?
-                                  dbus_message_get_error_name (message) : "(unset)",
-                                  dbus_message_get_reply_serial (message),
-                                  requested_reply,
-                                  dest ? dest : DBUS_SERVICE_DBUS,
-                                  proposed_recipient_loginfo);
+  allowed = TRUE;
+  if (recipient_policy != NULL)
+    {
+      /* Recipients found by match rules all get the message the same
+       * way, so their receive rules only tell them apart by policy
+       */
+      i = 0;
+      if (verdicts != NULL)
+        {
+          while (i < verdicts->n_receivers &&
+                 verdicts->receivers[i].policy != recipient_policy)
+            i++;
+        }
+
+      if (verdicts != NULL && i < verdicts->n_receivers)
+        {
+          allowed = verdicts->receivers[i].allowed;
+          toggles = verdicts->receivers[i].toggles;
+        }
+      else
+        {
+          allowed = bus_client_policy_check_can_receive (recipient_policy,
+                                                         context->registry,
+                                                         requested_reply,
+                                                         sender,
+                                                         addressed_recipient,
+                                                         proposed_recipient,
+                                                         message, &toggles);
+
+          if (verdicts != NULL && i < BUS_POLICY_VERDICTS_MAX_RECEIVERS)
+            {
+              verdicts->receivers[i].policy = recipient_policy;
+              verdicts->receivers[i].allowed = allowed;
+              verdicts->receivers[i].toggles = toggles;
+              verdicts->n_receivers += 1;
+            }
+        }
+    }
+
+  if (!allowed)
+    {
+      complain_about_message (context, sender, message, TRUE, toggles,
+                              requested_reply,
+                              dest ? dest : DBUS_SERVICE_DBUS,
+                              sender_name, sender_loginfo,
+                              proposed_recipient_loginfo,
+                              addressed_recipient == proposed_recipient,
+                              error);
       _dbus_verbose ("security policy disallowing message due to recipient policy\n");
       return FALSE;
     }
@@ -1638,6 +2298,16 @@ bus_context_check_security_policy (BusContext     *context,
       return FALSE;
     }
 
+  /* With flow control on, hold off whoever is filling up the queue
+   * before it reaches the limit above, rather than have their messages
+   * refused once it does. Eavesdroppers don't get to slow anyone down.
+   */
+  if (proposed_recipient && sender &&
+      context->limits.flow_control_outgoing_bytes > 0 &&
+      (addressed_recipient == NULL || addressed_recipient == proposed_recipient) &&
+      dbus_connection_get_outgoing_size (proposed_recipient) >= context->limits.flow_control_outgoing_bytes)
+    bus_connection_pause_sender (proposed_recipient, sender);
+
   /* Record that we will allow a reply here in the future (don't
    * bother if the recipient is the bus or this is an eavesdropping
    * connection). Only the addressed recipient may reply.
@@ -1658,3 +2328,65 @@ bus_context_check_security_policy (BusContext     *context,
   _dbus_verbose ("security policy allowing message\n");
   return TRUE;
 }
+
+dbus_bool_t
+bus_context_check_security_policy (BusContext     *context,
+                                   BusTransaction *transaction,
+                                   DBusConnection *sender,
+                                   DBusConnection *addressed_recipient,
+                                   DBusConnection *proposed_recipient,
+                                   DBusMessage    *message,
+                                   DBusError      *error)
+{
+  BusLatencyTimer timer;
+  dbus_bool_t result;
+
+  bus_stats_latency_start (&timer);
+  result = check_security_policy (context, transaction, sender,
+                                  addressed_recipient, proposed_recipient,
+                                  message, NULL, error);
+  bus_stats_latency_stop (&timer, BUS_LATENCY_POLICY);
+
+  return result;
+}
+
+/**
+ * Checks whether a message may go to a recipient found through its
+ * match rules rather than its destination, as
+ * bus_context_check_security_policy() would, for each recipient of
+ * the message in turn. The send rules, and the receive rules of each
+ * distinct recipient policy, are evaluated once and the outcome kept
+ * in verdicts for the following recipients.
+ *
+ * @param context the bus context
+ * @param transaction the transaction the message is sent in
+ * @param sender the sender, or #NULL for the bus driver
+ * @param addressed_recipient the message's destination, or #NULL
+ * @param proposed_recipient a recipient other than addressed_recipient
+ * @param message the message
+ * @param verdicts outcomes shared by the message's recipients
+ * @returns #TRUE if the message may go to proposed_recipient
+ */
+dbus_bool_t
+bus_context_check_match_policy (BusContext        *context,
+                                BusTransaction    *transaction,
+                                DBusConnection    *sender,
+                                DBusConnection    *addressed_recipient,
+                                DBusConnection    *proposed_recipient,
+                                DBusMessage       *message,
+                                BusPolicyVerdicts *verdicts)
+{
+  BusLatencyTimer timer;
+  dbus_bool_t result;
+
+  _dbus_assert (proposed_recipient != NULL);
+  _dbus_assert (proposed_recipient != addressed_recipient);
+
+  bus_stats_latency_start (&timer);
+  result = check_security_policy (context, transaction, sender,
+                                  addressed_recipient, proposed_recipient,
+                                  message, verdicts, NULL);
+  bus_stats_latency_stop (&timer, BUS_LATENCY_POLICY);
+
+  return result;
+}
@@ -26,6 +26,7 @@
 
 #include <dbus/dbus.h>
 #include <dbus/dbus-string.h>
+#include <dbus/dbus-list.h>
 #include <dbus/dbus-mainloop.h>
 #include <dbus/dbus-pipe.h>
 #include <dbus/dbus-sysdeps.h>
@@ -33,10 +34,13 @@
 typedef struct BusActivation    BusActivation;
 typedef struct BusConnections   BusConnections;
 typedef struct BusContext       BusContext;
+typedef struct BusHandoff       BusHandoff;
 typedef struct BusPolicy        BusPolicy;
 typedef struct BusClientPolicy  BusClientPolicy;
 typedef struct BusPolicyRule    BusPolicyRule;
 typedef struct BusRegistry      BusRegistry;
+typedef struct BusLogger        BusLogger;
+typedef struct BusResolver      BusResolver;
 typedef struct BusSELinuxID     BusSELinuxID;
 typedef struct BusService       BusService;
 typedef struct BusOwner		BusOwner;
@@ -62,8 +66,41 @@ typedef struct
   int max_match_rules_per_connection; /**< Max number of match rules for a single connection */
   int max_replies_per_connection;     /**< Max number of replies that can be pending for each connection */
   int reply_timeout;                  /**< How long to wait before timing out a reply */
+  long flow_control_outgoing_bytes;   /**< Outgoing bytes at which senders to a connection are paused, or 0 */
+  int dispatch_weight;                /**< Share of the main loop's dispatching each connection gets */
+  long max_messages_per_second;       /**< Rate a single connection can send messages at, or 0 */
+  long max_bytes_per_second;          /**< Rate a single connection can send bytes at, or 0 */
+  long max_messages_per_second_per_user; /**< Rate all connections of one user together can send messages at, or 0 */
+  long max_bytes_per_second_per_user; /**< Rate all connections of one user together can send bytes at, or 0 */
+  long max_buffered_bytes;            /**< Bytes of messages the bus may hold before it stops reading, or 0 */
+  int min_bytes_per_iteration;        /**< Least a connection's reads and writes adapt down to per main loop turn */
+  int max_bytes_per_iteration;        /**< Most a connection's reads and writes adapt up to per main loop turn */
+  long max_priority_outgoing_bytes;   /**< Bytes of messages from priority senders queued ahead of others */
 } BusLimits;
 
+/** Number of distinct recipient policies a BusPolicyVerdicts remembers */
+#define BUS_POLICY_VERDICTS_MAX_RECEIVERS 8
+
+/**
+ * Policy outcomes for one message that hold for all the recipients it
+ * goes to through match rules; zero it before the first check.
+ */
+typedef struct
+{
+  dbus_bool_t have_send;         /**< Whether the send_ fields are set */
+  dbus_bool_t send_allowed;      /**< The sender's send rules allow the message */
+  dbus_int32_t send_toggles;     /**< Number of send rules that applied */
+  dbus_bool_t send_log;          /**< The last send rule that applied asks for logging */
+
+  int n_receivers;               /**< Slots in use in receivers */
+  struct
+  {
+    BusClientPolicy *policy;     /**< Policy of some recipients */
+    dbus_bool_t allowed;         /**< Its receive rules allow the message */
+    dbus_int32_t toggles;        /**< Number of its receive rules that applied */
+  } receivers[BUS_POLICY_VERDICTS_MAX_RECEIVERS];
+} BusPolicyVerdicts;
+
 typedef enum
 {
   FORK_FOLLOW_CONFIG_FILE,
@@ -77,10 +114,15 @@ BusContext*       bus_context_new                                (const DBusStri
                                                                   DBusPipe         *print_pid_pipe,
                                                                   const DBusString *address,
                                                                   dbus_bool_t      systemd_activation,
+                                                                  BusHandoff       *handoff,
                                                                   DBusError        *error);
 dbus_bool_t       bus_context_reload_config                      (BusContext       *context,
 								  DBusError        *error);
 void              bus_context_shutdown                           (BusContext       *context);
+dbus_bool_t       bus_context_add_connection                     (BusContext       *context,
+                                                                  DBusConnection   *new_connection);
+dbus_bool_t       bus_context_set_accepting                      (BusContext       *context,
+                                                                  dbus_bool_t       accepting);
 BusContext*       bus_context_ref                                (BusContext       *context);
 void              bus_context_unref                              (BusContext       *context);
 dbus_bool_t       bus_context_get_id                             (BusContext       *context,
@@ -94,11 +136,14 @@ BusConnections*   bus_context_get_connections                    (BusContext
 BusActivation*    bus_context_get_activation                     (BusContext       *context);
 BusMatchmaker*    bus_context_get_matchmaker                     (BusContext       *context);
 DBusLoop*         bus_context_get_loop                           (BusContext       *context);
+DBusList**        bus_context_get_servers                        (BusContext       *context);
+BusResolver*      bus_context_get_resolver                       (BusContext       *context);
 dbus_bool_t       bus_context_allow_unix_user                    (BusContext       *context,
                                                                   unsigned long     uid);
 dbus_bool_t       bus_context_allow_windows_user                 (BusContext       *context,
                                                                   const char       *windows_sid);
 BusPolicy*        bus_context_get_policy                         (BusContext       *context);
+int               bus_context_get_policy_generation              (BusContext       *context);
 
 BusClientPolicy*  bus_context_create_client_policy               (BusContext       *context,
                                                                   DBusConnection   *connection,
@@ -113,6 +158,22 @@ int               bus_context_get_max_services_per_connection    (BusContext
 int               bus_context_get_max_match_rules_per_connection (BusContext       *context);
 int               bus_context_get_max_replies_per_connection     (BusContext       *context);
 int               bus_context_get_reply_timeout                  (BusContext       *context);
+long              bus_context_get_flow_control_outgoing_bytes    (BusContext       *context);
+int               bus_context_get_dispatch_weight                (BusContext       *context,
+                                                                  dbus_bool_t       have_uid,
+                                                                  unsigned long     uid);
+long              bus_context_get_max_messages_per_second        (BusContext       *context);
+long              bus_context_get_max_bytes_per_second           (BusContext       *context);
+long              bus_context_get_max_messages_per_second_per_user (BusContext     *context);
+long              bus_context_get_max_bytes_per_second_per_user  (BusContext       *context);
+long              bus_context_get_max_buffered_bytes             (BusContext       *context);
+dbus_bool_t       bus_context_get_trusts_message_bodies          (BusContext       *context,
+                                                                  unsigned long     uid);
+dbus_bool_t       bus_context_get_priority_uid                   (BusContext       *context,
+                                                                  unsigned long     uid);
+dbus_bool_t       bus_context_get_priority_name                  (BusContext       *context,
+                                                                  const char       *name);
+long              bus_context_get_max_priority_outgoing_bytes    (BusContext       *context);
 void              bus_context_log                                (BusContext       *context,
                                                                   DBusSystemLogSeverity severity,
                                                                   const char       *msg,
@@ -124,5 +185,12 @@ dbus_bool_t       bus_context_check_security_policy              (BusContext
                                                                   DBusConnection   *proposed_recipient,
                                                                   DBusMessage      *message,
                                                                   DBusError        *error);
+dbus_bool_t       bus_context_check_match_policy                 (BusContext       *context,
+                                                                  BusTransaction   *transaction,
+                                                                  DBusConnection   *sender,
+                                                                  DBusConnection   *addressed_recipient,
+                                                                  DBusConnection   *proposed_recipient,
+                                                                  DBusMessage      *message,
+                                                                  BusPolicyVerdicts *verdicts);
 
 #endif /* BUS_BUS_H */
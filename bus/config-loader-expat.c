@@ -234,6 +234,8 @@ bus_config_load (const DBusString      *file,
         goto failed;
       }
 
+    bus_config_parser_record_file (parser, file);
+
     if (!_dbus_file_get_contents (&data, file, error))
       {
         _dbus_string_free (&data);
@@ -192,6 +192,8 @@ bus_config_load (const DBusString      *file,
       _DBUS_SET_OOM (error);
       goto failed;
     }
+
+  bus_config_parser_record_file (parser, file);
   
   if (!_dbus_file_get_contents (&data, file, error))
     goto failed;
@@ -127,6 +127,22 @@ bus_config_parser_element_name_to_type (const char *name)
     {
       return ELEMENT_ALLOW_ANONYMOUS;
     }
+  else if (strcmp (name, "trust_message_bodies") == 0)
+    {
+      return ELEMENT_TRUST_MESSAGE_BODIES;
+    }
+  else if (strcmp (name, "prewarm") == 0)
+    {
+      return ELEMENT_PREWARM;
+    }
+  else if (strcmp (name, "priority_user") == 0)
+    {
+      return ELEMENT_PRIORITY_USER;
+    }
+  else if (strcmp (name, "priority_name") == 0)
+    {
+      return ELEMENT_PRIORITY_NAME;
+    }
   return ELEMENT_NONE;
 }
 
@@ -181,6 +197,14 @@ bus_config_parser_element_type_to_name (ElementType type)
       return "keep_umask";
     case ELEMENT_ALLOW_ANONYMOUS:
       return "allow_anonymous";
+    case ELEMENT_TRUST_MESSAGE_BODIES:
+      return "trust_message_bodies";
+    case ELEMENT_PREWARM:
+      return "prewarm";
+    case ELEMENT_PRIORITY_USER:
+      return "priority_user";
+    case ELEMENT_PRIORITY_NAME:
+      return "priority_name";
     }
 
   _dbus_assert_not_reached ("bad element type");
@@ -48,7 +48,11 @@ typedef enum
   ELEMENT_STANDARD_SYSTEM_SERVICEDIRS,
   ELEMENT_KEEP_UMASK,
   ELEMENT_SYSLOG,
-  ELEMENT_ALLOW_ANONYMOUS
+  ELEMENT_ALLOW_ANONYMOUS,
+  ELEMENT_TRUST_MESSAGE_BODIES,
+  ELEMENT_PREWARM,
+  ELEMENT_PRIORITY_USER,
+  ELEMENT_PRIORITY_NAME
 } ElementType;
 
 ElementType bus_config_parser_element_name_to_type (const char *element_name);
@@ -28,8 +28,10 @@
 #include "utils.h"
 #include "policy.h"
 #include "selinux.h"
+#include <dbus/dbus-file.h>
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-internals.h>
+#include <dbus/dbus-marshal-validate.h>
 #include <string.h>
 
 typedef enum
@@ -69,6 +71,7 @@ typedef struct
     struct
     {
       char *name;
+      char *user;  /**< User the limit is only for, or NULL */
       long value;
     } limit;
     
@@ -97,6 +100,16 @@ struct BusConfigParser
 
   DBusList *mechanisms; /**< Auth mechanisms */
 
+  DBusList *trusted_body_uids; /**< Uids whose message bodies we don't validate */
+
+  DBusList *prewarm_services; /**< Services to activate as soon as the bus is up */
+
+  DBusList *dispatch_weights; /**< BusDispatchWeight for users given their own */
+
+  DBusList *priority_uids; /**< Uids whose connections have priority */
+
+  DBusList *priority_names; /**< Bus names whose owners have priority */
+
   DBusList *service_dirs; /**< Directories to look for session services in */
 
   DBusList *conf_dirs;   /**< Directories to look for policy configuration in */
@@ -111,6 +124,8 @@ struct BusConfigParser
 
   DBusHashTable *service_context_table; /**< Map service names to SELinux contexts */
 
+  DBusList *sources;     /**< ConfigSource for everything the result depends on */
+
   unsigned int fork : 1; /**< TRUE to fork into daemon mode */
 
   unsigned int syslog : 1; /**< TRUE to enable syslog */
@@ -119,8 +134,174 @@ struct BusConfigParser
   unsigned int is_toplevel : 1; /**< FALSE if we are a sub-config-file inside another one */
 
   unsigned int allow_anonymous : 1; /**< TRUE to allow anonymous connections */
+
+  unsigned int sources_incomplete : 1; /**< TRUE if sources can't vouch for the result */
 };
 
+typedef enum
+{
+  CONFIG_SOURCE_FILE,         /**< A file or directory we read */
+  CONFIG_SOURCE_USER,         /**< A user name we resolved */
+  CONFIG_SOURCE_GROUP,        /**< A group name we resolved */
+  CONFIG_SOURCE_SELINUX_ROOT  /**< The SELinux policy root we included from */
+} ConfigSourceType;
+
+/**
+ * Something outside the configuration files' text that parsing them
+ * depended on, and what it looked like at the time.
+ */
+typedef struct
+{
+  ConfigSourceType type;
+  char *name;             /**< Path, user or group name, or policy root */
+  dbus_bool_t found;      /**< Whether the file or name existed */
+  DBusFileStamp stamp;    /**< The file, if found */
+  unsigned long id;       /**< The uid or gid the name resolved to, if found */
+} ConfigSource;
+
+static void
+config_source_free (ConfigSource *source)
+{
+  dbus_free (source->name);
+  dbus_free (source);
+}
+
+/* Fills in found, stamp and id from the current state of the system */
+static void
+config_source_look_up (ConfigSource *source)
+{
+  DBusString name;
+  const char *root;
+
+  _dbus_string_init_const (&name, source->name);
+
+  switch (source->type)
+    {
+    case CONFIG_SOURCE_FILE:
+      source->found = _dbus_file_get_stamp (&name, &source->stamp, NULL);
+      break;
+    case CONFIG_SOURCE_USER:
+      source->found = _dbus_parse_unix_user_from_config (&name, &source->id);
+      break;
+    case CONFIG_SOURCE_GROUP:
+      source->found = _dbus_parse_unix_group_from_config (&name, &source->id);
+      break;
+    case CONFIG_SOURCE_SELINUX_ROOT:
+      root = bus_selinux_get_policy_root ();
+      source->found = root != NULL && strcmp (root, source->name) == 0;
+      break;
+    }
+}
+
+static dbus_bool_t
+config_sources_equal (const ConfigSource *a,
+                      const ConfigSource *b)
+{
+  if (a->found != b->found)
+    return FALSE;
+
+  if (!a->found)
+    return TRUE;
+
+  switch (a->type)
+    {
+    case CONFIG_SOURCE_FILE:
+      return a->stamp.device == b->stamp.device &&
+        a->stamp.inode == b->stamp.inode &&
+        a->stamp.size == b->stamp.size &&
+        a->stamp.mtime == b->stamp.mtime &&
+        a->stamp.mtime_nsec == b->stamp.mtime_nsec;
+    case CONFIG_SOURCE_USER:
+    case CONFIG_SOURCE_GROUP:
+      return a->id == b->id;
+    case CONFIG_SOURCE_SELINUX_ROOT:
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Remembers what name looks like right now.  There is no error: if we
+ * can't remember, we just won't trust the sources later.
+ */
+static void
+record_source (BusConfigParser  *parser,
+               ConfigSourceType  type,
+               const char       *name)
+{
+  ConfigSource *source;
+  DBusList *link;
+
+  /* the same user tends to show up in every fragment */
+  for (link = _dbus_list_get_first_link (&parser->sources);
+       link != NULL;
+       link = _dbus_list_get_next_link (&parser->sources, link))
+    {
+      source = link->data;
+
+      if (source->type == type && type != CONFIG_SOURCE_FILE &&
+          strcmp (source->name, name) == 0)
+        return;
+    }
+
+  source = dbus_new0 (ConfigSource, 1);
+  if (source == NULL)
+    goto incomplete;
+
+  source->type = type;
+  source->name = _dbus_strdup (name);
+  if (source->name == NULL)
+    {
+      dbus_free (source);
+      goto incomplete;
+    }
+
+  config_source_look_up (source);
+
+  if (!_dbus_list_append (&parser->sources, source))
+    {
+      config_source_free (source);
+      goto incomplete;
+    }
+
+  /* a change later in the same second would keep the stamp */
+  if (type == CONFIG_SOURCE_FILE && source->found)
+    {
+      long now;
+
+      _dbus_get_current_time (&now, NULL);
+      if (source->stamp.mtime >= (unsigned long) now)
+        parser->sources_incomplete = TRUE;
+    }
+
+  return;
+
+ incomplete:
+  parser->sources_incomplete = TRUE;
+}
+
+static dbus_bool_t
+parse_unix_user (BusConfigParser  *parser,
+                 const DBusString *username,
+                 dbus_uid_t       *uid)
+{
+  record_source (parser, CONFIG_SOURCE_USER,
+                 _dbus_string_get_const_data (username));
+
+  return _dbus_parse_unix_user_from_config (username, uid);
+}
+
+static dbus_bool_t
+parse_unix_group (BusConfigParser  *parser,
+                  const DBusString *groupname,
+                  dbus_gid_t       *gid)
+{
+  record_source (parser, CONFIG_SOURCE_GROUP,
+                 _dbus_string_get_const_data (groupname));
+
+  return _dbus_parse_unix_group_from_config (groupname, gid);
+}
+
 static Element*
 push_element (BusConfigParser *parser,
               ElementType      type)
@@ -148,7 +329,10 @@ static void
 element_free (Element *e)
 {
   if (e->type == ELEMENT_LIMIT)
-    dbus_free (e->d.limit.name);
+    {
+      dbus_free (e->d.limit.name);
+      dbus_free (e->d.limit.user);
+    }
   
   dbus_free (e);
 }
@@ -329,11 +513,32 @@ merge_included (BusConfigParser *parser,
   while ((link = _dbus_list_pop_first_link (&included->mechanisms)))
     _dbus_list_append_link (&parser->mechanisms, link);
 
+  while ((link = _dbus_list_pop_first_link (&included->trusted_body_uids)))
+    _dbus_list_append_link (&parser->trusted_body_uids, link);
+
+  while ((link = _dbus_list_pop_first_link (&included->prewarm_services)))
+    _dbus_list_append_link (&parser->prewarm_services, link);
+
+  while ((link = _dbus_list_pop_first_link (&included->dispatch_weights)))
+    _dbus_list_append_link (&parser->dispatch_weights, link);
+
+  while ((link = _dbus_list_pop_first_link (&included->priority_uids)))
+    _dbus_list_append_link (&parser->priority_uids, link);
+
+  while ((link = _dbus_list_pop_first_link (&included->priority_names)))
+    _dbus_list_append_link (&parser->priority_names, link);
+
   while ((link = _dbus_list_pop_first_link (&included->service_dirs)))
     service_dirs_append_link_unique_or_free (&parser->service_dirs, link);
 
   while ((link = _dbus_list_pop_first_link (&included->conf_dirs)))
     _dbus_list_append_link (&parser->conf_dirs, link);
+
+  while ((link = _dbus_list_pop_first_link (&included->sources)))
+    _dbus_list_append_link (&parser->sources, link);
+
+  if (included->sources_incomplete)
+    parser->sources_incomplete = TRUE;
   
   return TRUE;
 }
@@ -456,6 +661,32 @@ bus_config_parser_new (const DBusString      *basedir,
        * that require a reply
        */
       parser->limits.max_replies_per_connection = 1024*8;
+
+      /* off: senders are never paused, and messages to a full queue
+       * are refused instead
+       */
+      parser->limits.flow_control_outgoing_bytes = 0;
+
+      /* everyone takes equal turns */
+      parser->limits.dispatch_weight = 1;
+
+      /* no rate limits */
+      parser->limits.max_messages_per_second = 0;
+      parser->limits.max_bytes_per_second = 0;
+      parser->limits.max_messages_per_second_per_user = 0;
+      parser->limits.max_bytes_per_second_per_user = 0;
+
+      /* no memory budget */
+      parser->limits.max_buffered_bytes = 0;
+
+      /* busy connections get up to 32 times the turn of quiet ones */
+      parser->limits.min_bytes_per_iteration = 2048;
+      parser->limits.max_bytes_per_iteration = 64 * 1024;
+
+      /* enough for a burst of small messages from a priority_user or
+       * priority_name to jump the queue, not to starve anyone
+       */
+      parser->limits.max_priority_outgoing_bytes = 64 * 1024;
     }
       
   parser->refcount = 1;
@@ -513,6 +744,34 @@ bus_config_parser_unref (BusConfigParser *parser)
                           NULL);
 
       _dbus_list_clear (&parser->mechanisms);
+
+      _dbus_list_clear (&parser->trusted_body_uids);
+
+      _dbus_list_foreach (&parser->prewarm_services,
+                          (DBusForeachFunction) dbus_free,
+                          NULL);
+
+      _dbus_list_clear (&parser->prewarm_services);
+
+      _dbus_list_foreach (&parser->dispatch_weights,
+                          (DBusForeachFunction) dbus_free,
+                          NULL);
+
+      _dbus_list_clear (&parser->dispatch_weights);
+
+      _dbus_list_clear (&parser->priority_uids);
+
+      _dbus_list_foreach (&parser->priority_names,
+                          (DBusForeachFunction) dbus_free,
+                          NULL);
+
+      _dbus_list_clear (&parser->priority_names);
+
+      _dbus_list_foreach (&parser->sources,
+                          (DBusForeachFunction) config_source_free,
+                          NULL);
+
+      _dbus_list_clear (&parser->sources);
       
       _dbus_string_free (&parser->basedir);
 
@@ -784,6 +1043,58 @@ start_busconfig_child (BusConfigParser   *parser,
           return FALSE;
         }
       
+      return TRUE;
+    }
+  else if (element_type == ELEMENT_TRUST_MESSAGE_BODIES)
+    {
+      if (!check_no_attributes (parser, "trust_message_bodies", attribute_names, attribute_values, error))
+        return FALSE;
+
+      if (push_element (parser, ELEMENT_TRUST_MESSAGE_BODIES) == NULL)
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
+      return TRUE;
+    }
+  else if (element_type == ELEMENT_PREWARM)
+    {
+      if (!check_no_attributes (parser, "prewarm", attribute_names, attribute_values, error))
+        return FALSE;
+
+      if (push_element (parser, ELEMENT_PREWARM) == NULL)
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
+      return TRUE;
+    }
+  else if (element_type == ELEMENT_PRIORITY_USER)
+    {
+      if (!check_no_attributes (parser, "priority_user", attribute_names, attribute_values, error))
+        return FALSE;
+
+      if (push_element (parser, ELEMENT_PRIORITY_USER) == NULL)
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
+      return TRUE;
+    }
+  else if (element_type == ELEMENT_PRIORITY_NAME)
+    {
+      if (!check_no_attributes (parser, "priority_name", attribute_names, attribute_values, error))
+        return FALSE;
+
+      if (push_element (parser, ELEMENT_PRIORITY_NAME) == NULL)
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
       return TRUE;
     }
   else if (element_type == ELEMENT_SERVICEHELPER)
@@ -1027,8 +1338,8 @@ start_busconfig_child (BusConfigParser   *parser,
           DBusString username;
           _dbus_string_init_const (&username, user);
 
-          if (_dbus_parse_unix_user_from_config (&username,
-                                                 &e->d.policy.gid_uid_or_at_console))
+          if (parse_unix_user (parser, &username,
+                               &e->d.policy.gid_uid_or_at_console))
             e->d.policy.type = POLICY_USER;
           else
             _dbus_warn ("Unknown username \"%s\" in message bus configuration file\n",
@@ -1039,8 +1350,8 @@ start_busconfig_child (BusConfigParser   *parser,
           DBusString group_name;
           _dbus_string_init_const (&group_name, group);
 
-          if (_dbus_parse_unix_group_from_config (&group_name,
-                                                  &e->d.policy.gid_uid_or_at_console))
+          if (parse_unix_group (parser, &group_name,
+                                &e->d.policy.gid_uid_or_at_console))
             e->d.policy.type = POLICY_GROUP;
           else
             _dbus_warn ("Unknown group \"%s\" in message bus configuration file\n",
@@ -1075,6 +1386,7 @@ start_busconfig_child (BusConfigParser   *parser,
     {
       Element *e;
       const char *name;
+      const char *user;
 
       if ((e = push_element (parser, ELEMENT_LIMIT)) == NULL)
         {
@@ -1087,6 +1399,7 @@ start_busconfig_child (BusConfigParser   *parser,
                               attribute_values,
                               error,
                               "name", &name,
+                              "user", &user,
                               NULL))
         return FALSE;
 
@@ -1097,6 +1410,15 @@ start_busconfig_child (BusConfigParser   *parser,
           return FALSE;
         }
 
+      /* the only limit that is kept per user */
+      if (user != NULL && strcmp (name, "dispatch_weight") != 0)
+        {
+          dbus_set_error (error, DBUS_ERROR_FAILED,
+                          "<limit name=\"%s\"> can't have a \"user\" attribute",
+                          name);
+          return FALSE;
+        }
+
       e->d.limit.name = _dbus_strdup (name);
       if (e->d.limit.name == NULL)
         {
@@ -1104,6 +1426,16 @@ start_busconfig_child (BusConfigParser   *parser,
           return FALSE;
         }
 
+      if (user != NULL)
+        {
+          e->d.limit.user = _dbus_strdup (user);
+          if (e->d.limit.user == NULL)
+            {
+              BUS_SET_OOM (error);
+              return FALSE;
+            }
+        }
+
       return TRUE;
     }
   else if (element_type == ELEMENT_SELINUX)
@@ -1518,7 +1850,7 @@ append_rule_from_element (BusConfigParser   *parser,
           
           _dbus_string_init_const (&username, user);
       
-          if (_dbus_parse_unix_user_from_config (&username, &uid))
+          if (parse_unix_user (parser, &username, &uid))
             {
               rule = bus_policy_rule_new (BUS_POLICY_RULE_USER, allow); 
               if (rule == NULL)
@@ -1550,7 +1882,7 @@ append_rule_from_element (BusConfigParser   *parser,
           
           _dbus_string_init_const (&groupname, group);
           
-          if (_dbus_parse_unix_group_from_config (&groupname, &gid))
+          if (parse_unix_group (parser, &groupname, &gid))
             {
               rule = bus_policy_rule_new (BUS_POLICY_RULE_GROUP, allow); 
               if (rule == NULL)
@@ -1822,6 +2154,64 @@ bus_config_parser_start_element (BusConfigParser   *parser,
     }  
 }
 
+static dbus_bool_t
+check_dispatch_weight (long       value,
+                       DBusError *error)
+{
+  if (value < 1 || value > _DBUS_INT_MAX)
+    {
+      dbus_set_error (error, DBUS_ERROR_FAILED,
+                      "<limit name=\"dispatch_weight\"> must be a number from 1 to %d\n",
+                      _DBUS_INT_MAX);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Later weights for the same user win, see bus_context_get_dispatch_weight() */
+static dbus_bool_t
+set_user_dispatch_weight (BusConfigParser *parser,
+                          const char      *username,
+                          long             value,
+                          DBusError       *error)
+{
+  BusDispatchWeight *dw;
+  DBusString str;
+  dbus_uid_t uid;
+
+  if (!check_dispatch_weight (value, error))
+    return FALSE;
+
+  _dbus_string_init_const (&str, username);
+
+  if (!parse_unix_user (parser, &str, &uid))
+    {
+      _dbus_warn ("Unknown username \"%s\" on element <limit name=\"dispatch_weight\">\n",
+                  username);
+      return TRUE;
+    }
+
+  dw = dbus_new (BusDispatchWeight, 1);
+  if (dw == NULL)
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  dw->uid = uid;
+  dw->weight = value;
+
+  if (!_dbus_list_append (&parser->dispatch_weights, dw))
+    {
+      dbus_free (dw);
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 static dbus_bool_t
 set_limit (BusConfigParser *parser,
            const char      *name,
@@ -1924,6 +2314,59 @@ set_limit (BusConfigParser *parser,
       must_be_int = TRUE;
       parser->limits.max_replies_per_connection = value;
     }
+  else if (strcmp (name, "flow_control_outgoing_bytes") == 0)
+    {
+      must_be_positive = TRUE;
+      parser->limits.flow_control_outgoing_bytes = value;
+    }
+  else if (strcmp (name, "dispatch_weight") == 0)
+    {
+      if (!check_dispatch_weight (value, error))
+        return FALSE;
+      parser->limits.dispatch_weight = value;
+    }
+  else if (strcmp (name, "max_messages_per_second") == 0)
+    {
+      must_be_positive = TRUE;
+      parser->limits.max_messages_per_second = value;
+    }
+  else if (strcmp (name, "max_bytes_per_second") == 0)
+    {
+      must_be_positive = TRUE;
+      parser->limits.max_bytes_per_second = value;
+    }
+  else if (strcmp (name, "max_messages_per_second_per_user") == 0)
+    {
+      must_be_positive = TRUE;
+      parser->limits.max_messages_per_second_per_user = value;
+    }
+  else if (strcmp (name, "max_bytes_per_second_per_user") == 0)
+    {
+      must_be_positive = TRUE;
+      parser->limits.max_bytes_per_second_per_user = value;
+    }
+  else if (strcmp (name, "max_buffered_bytes") == 0)
+    {
+      must_be_positive = TRUE;
+      parser->limits.max_buffered_bytes = value;
+    }
+  else if (strcmp (name, "min_bytes_per_iteration") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.min_bytes_per_iteration = value;
+    }
+  else if (strcmp (name, "max_bytes_per_iteration") == 0)
+    {
+      must_be_positive = TRUE;
+      must_be_int = TRUE;
+      parser->limits.max_bytes_per_iteration = value;
+    }
+  else if (strcmp (name, "max_priority_outgoing_bytes") == 0)
+    {
+      must_be_positive = TRUE;
+      parser->limits.max_priority_outgoing_bytes = value;
+    }
   else
     {
       dbus_set_error (error, DBUS_ERROR_FAILED,
@@ -2009,6 +2452,10 @@ bus_config_parser_end_element (BusConfigParser   *parser,
     case ELEMENT_SERVICEHELPER:
     case ELEMENT_INCLUDEDIR:
     case ELEMENT_LIMIT:
+    case ELEMENT_TRUST_MESSAGE_BODIES:
+    case ELEMENT_PREWARM:
+    case ELEMENT_PRIORITY_USER:
+    case ELEMENT_PRIORITY_NAME:
       if (!e->had_content)
         {
           dbus_set_error (error, DBUS_ERROR_FAILED,
@@ -2017,7 +2464,13 @@ bus_config_parser_end_element (BusConfigParser   *parser,
           return FALSE;
         }
 
-      if (e->type == ELEMENT_LIMIT)
+      if (e->type == ELEMENT_LIMIT && e->d.limit.user != NULL)
+        {
+          if (!set_user_dispatch_weight (parser, e->d.limit.user,
+                                         e->d.limit.value, error))
+            return FALSE;
+        }
+      else if (e->type == ELEMENT_LIMIT)
         {
           if (!set_limit (parser, e->d.limit.name, e->d.limit.value,
                           error))
@@ -2123,6 +2576,8 @@ include_file (BusConfigParser   *parser,
           ignore_missing)
         {
           dbus_error_free (&tmp_error);
+          /* so that we notice when it appears */
+          record_source (parser, CONFIG_SOURCE_FILE, filename_str);
           return TRUE;
         }
       else
@@ -2201,6 +2656,10 @@ include_dir (BusConfigParser   *parser,
     }
 
   retval = FALSE;
+
+  /* before listing it, so files added meanwhile change the stamp */
+  record_source (parser, CONFIG_SOURCE_FILE,
+                 _dbus_string_get_const_data (dirname));
   
   dir = _dbus_directory_open (dirname, error);
 
@@ -2371,6 +2830,8 @@ bus_config_parser_content (BusConfigParser   *parser,
 		_dbus_string_free (&full_path);
 		return FALSE;
 	      }
+            record_source (parser, CONFIG_SOURCE_SELINUX_ROOT,
+                           bus_selinux_get_policy_root ());
             _dbus_string_init_const (&selinux_policy_root,
                                      bus_selinux_get_policy_root ());
             if (!make_full_path (&selinux_policy_root, content, &full_path))
@@ -2510,6 +2971,92 @@ bus_config_parser_content (BusConfigParser   *parser,
       }
       break;
 
+    case ELEMENT_TRUST_MESSAGE_BODIES:
+      {
+        dbus_uid_t uid;
+
+        e->had_content = TRUE;
+
+        if (parse_unix_user (parser, content, &uid))
+          {
+            if (!_dbus_list_append (&parser->trusted_body_uids,
+                                    _DBUS_INT_TO_POINTER (uid)))
+              goto nomem;
+          }
+        else
+          {
+            _dbus_warn ("Unknown username \"%s\" on element <trust_message_bodies>\n",
+                        _dbus_string_get_const_data (content));
+          }
+      }
+      break;
+
+    case ELEMENT_PREWARM:
+      {
+        char *s;
+
+        e->had_content = TRUE;
+
+        if (!_dbus_string_copy_data (content, &s))
+          goto nomem;
+
+        if (!_dbus_list_append (&parser->prewarm_services,
+                                s))
+          {
+            dbus_free (s);
+            goto nomem;
+          }
+      }
+      break;
+
+    case ELEMENT_PRIORITY_USER:
+      {
+        dbus_uid_t uid;
+
+        e->had_content = TRUE;
+
+        if (parse_unix_user (parser, content, &uid))
+          {
+            if (!_dbus_list_append (&parser->priority_uids,
+                                    _DBUS_INT_TO_POINTER (uid)))
+              goto nomem;
+          }
+        else
+          {
+            _dbus_warn ("Unknown username \"%s\" on element <priority_user>\n",
+                        _dbus_string_get_const_data (content));
+          }
+      }
+      break;
+
+    case ELEMENT_PRIORITY_NAME:
+      {
+        char *s;
+
+        e->had_content = TRUE;
+
+        if (!_dbus_validate_bus_name (content, 0,
+                                      _dbus_string_get_length (content)) ||
+            _dbus_string_starts_with_c_str (content, ":"))
+          {
+            dbus_set_error (error, DBUS_ERROR_FAILED,
+                            "<priority_name> must contain a well-known bus name, not \"%s\"",
+                            _dbus_string_get_const_data (content));
+            return FALSE;
+          }
+
+        if (!_dbus_string_copy_data (content, &s))
+          goto nomem;
+
+        if (!_dbus_list_append (&parser->priority_names,
+                                s))
+          {
+            dbus_free (s);
+            goto nomem;
+          }
+      }
+      break;
+
     case ELEMENT_SERVICEDIR:
       {
         char *s;
@@ -2625,6 +3172,36 @@ bus_config_parser_get_mechanisms (BusConfigParser *parser)
   return &parser->mechanisms;
 }
 
+DBusList**
+bus_config_parser_get_trusted_body_uids (BusConfigParser *parser)
+{
+  return &parser->trusted_body_uids;
+}
+
+DBusList**
+bus_config_parser_get_prewarm_services (BusConfigParser *parser)
+{
+  return &parser->prewarm_services;
+}
+
+DBusList**
+bus_config_parser_get_dispatch_weights (BusConfigParser *parser)
+{
+  return &parser->dispatch_weights;
+}
+
+DBusList**
+bus_config_parser_get_priority_uids (BusConfigParser *parser)
+{
+  return &parser->priority_uids;
+}
+
+DBusList**
+bus_config_parser_get_priority_names (BusConfigParser *parser)
+{
+  return &parser->priority_names;
+}
+
 DBusList**
 bus_config_parser_get_service_dirs (BusConfigParser *parser)
 {
@@ -2688,6 +3265,60 @@ bus_config_parser_steal_policy (BusConfigParser *parser)
 }
 
 /* Overwrite any limits that were set in the configuration file */
+/**
+ * Remembers the state of a configuration file about to be read, so
+ * bus_config_parser_sources_changed() can tell when it was modified.
+ * Called by the loaders for every file they parse.
+ *
+ * @param parser the parser the file's contents go to
+ * @param file the file
+ */
+void
+bus_config_parser_record_file (BusConfigParser  *parser,
+                               const DBusString *file)
+{
+  record_source (parser, CONFIG_SOURCE_FILE,
+                 _dbus_string_get_const_data (file));
+}
+
+/**
+ * Checks whether loading the same configuration again could produce a
+ * different result: whether any file or directory that was read, or
+ * any user or group name that was resolved, changed since.  Within
+ * one process the environment can't change, so that's everything the
+ * result depends on.
+ *
+ * @param parser a finished top-level parser
+ * @returns #TRUE if the configuration must be reloaded
+ */
+dbus_bool_t
+bus_config_parser_sources_changed (BusConfigParser *parser)
+{
+  DBusList *link;
+
+  if (parser->sources_incomplete)
+    return TRUE;
+
+  for (link = _dbus_list_get_first_link (&parser->sources);
+       link != NULL;
+       link = _dbus_list_get_next_link (&parser->sources, link))
+    {
+      ConfigSource *source = link->data;
+      ConfigSource current;
+
+      current = *source;
+      config_source_look_up (&current);
+
+      if (!config_sources_equal (source, &current))
+        {
+          _dbus_verbose ("Configuration source %s changed\n", source->name);
+          return TRUE;
+        }
+    }
+
+  return FALSE;
+}
+
 void
 bus_config_parser_get_limits (BusConfigParser *parser,
                               BusLimits       *limits)
@@ -3019,7 +3650,17 @@ limits_equal (const BusLimits *a,
      || a->max_services_per_connection == b->max_services_per_connection
      || a->max_match_rules_per_connection == b->max_match_rules_per_connection
      || a->max_replies_per_connection == b->max_replies_per_connection
-     || a->reply_timeout == b->reply_timeout);
+     || a->reply_timeout == b->reply_timeout
+     || a->flow_control_outgoing_bytes == b->flow_control_outgoing_bytes
+     || a->dispatch_weight == b->dispatch_weight
+     || a->max_messages_per_second == b->max_messages_per_second
+     || a->max_bytes_per_second == b->max_bytes_per_second
+     || a->max_messages_per_second_per_user == b->max_messages_per_second_per_user
+     || a->max_bytes_per_second_per_user == b->max_bytes_per_second_per_user
+     || a->max_buffered_bytes == b->max_buffered_bytes
+     || a->min_bytes_per_iteration == b->min_bytes_per_iteration
+     || a->max_bytes_per_iteration == b->max_bytes_per_iteration
+     || a->max_priority_outgoing_bytes == b->max_priority_outgoing_bytes);
 }
 
 static dbus_bool_t
@@ -3043,6 +3684,12 @@ config_parsers_equal (const BusConfigParser *a,
 
   if (!lists_of_c_strings_equal (a->service_dirs, b->service_dirs))
     return FALSE;
+
+  if (!lists_of_c_strings_equal (a->prewarm_services, b->prewarm_services))
+    return FALSE;
+
+  if (!lists_of_c_strings_equal (a->priority_names, b->priority_names))
+    return FALSE;
   
   /* FIXME: compare policy */
 
@@ -3493,6 +4140,65 @@ test_default_system_servicedirs (void)
   return TRUE;
 }
 		   
+static dbus_bool_t
+test_sources_changed (const DBusString *test_data_dir)
+{
+  BusConfigParser *parser;
+  DBusString full_path, contents;
+  DBusError error;
+
+  dbus_error_init (&error);
+
+  if (!_dbus_string_init (&full_path))
+    _dbus_assert_not_reached ("couldn't init string");
+
+  /* basic.conf has an includedir and a missing optional include */
+  if (!_dbus_string_copy (test_data_dir, 0, &full_path, 0) ||
+      !_dbus_string_append (&full_path, "/valid-config-files/basic.conf"))
+    _dbus_assert_not_reached ("couldn't build path");
+
+  parser = bus_config_load (&full_path, TRUE, NULL, &error);
+  if (parser == NULL)
+    _dbus_assert_not_reached ("couldn't load basic.conf");
+
+  if (_dbus_list_get_length (&parser->sources) < 3)
+    _dbus_assert_not_reached ("basic.conf recorded too few sources");
+
+  if (bus_config_parser_sources_changed (parser))
+    _dbus_assert_not_reached ("unmodified basic.conf seen as changed");
+
+  bus_config_parser_unref (parser);
+
+  /* a file that goes away is a change */
+  _dbus_string_set_length (&full_path, 0);
+  _dbus_string_init_const (&contents,
+                           "<busconfig><listen>unix:path=/foo/bar</listen></busconfig>");
+
+  if (!_dbus_string_append (&full_path, _dbus_get_tmpdir ()) ||
+      !_dbus_string_append (&full_path, "/dbus-config-sources-test-") ||
+      !_dbus_generate_random_ascii (&full_path, 6) ||
+      !_dbus_string_append (&full_path, ".conf"))
+    _dbus_assert_not_reached ("couldn't build path");
+
+  if (!_dbus_string_save_to_file (&contents, &full_path, FALSE, &error))
+    _dbus_assert_not_reached ("couldn't write config file");
+
+  parser = bus_config_load (&full_path, TRUE, NULL, &error);
+  if (parser == NULL)
+    _dbus_assert_not_reached ("couldn't load written config file");
+
+  if (!_dbus_delete_file (&full_path, &error))
+    _dbus_assert_not_reached ("couldn't delete config file");
+
+  if (!bus_config_parser_sources_changed (parser))
+    _dbus_assert_not_reached ("deleted config file not seen as changed");
+
+  bus_config_parser_unref (parser);
+  _dbus_string_free (&full_path);
+
+  return TRUE;
+}
+
 dbus_bool_t
 bus_config_parser_test (const DBusString *test_data_dir)
 {
@@ -3522,6 +4228,9 @@ bus_config_parser_test (const DBusString *test_data_dir)
   if (!process_test_equiv_subdir (test_data_dir, "equiv-config-files"))
     return FALSE;
 
+  if (!test_sources_changed (test_data_dir))
+    return FALSE;
+
   return TRUE;
 }
 
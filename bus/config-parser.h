@@ -34,6 +34,13 @@
 
 typedef struct BusConfigParser BusConfigParser;
 
+/** A dispatch_weight limit given for one user */
+typedef struct
+{
+  unsigned long uid; /**< User whose connections get this weight */
+  int weight;        /**< The weight */
+} BusDispatchWeight;
+
 BusConfigParser* bus_config_parser_new (const DBusString      *basedir,
                                         dbus_bool_t            is_toplevel,
                                         const BusConfigParser *parent);
@@ -62,6 +69,11 @@ const char* bus_config_parser_get_user         (BusConfigParser *parser);
 const char* bus_config_parser_get_type         (BusConfigParser *parser);
 DBusList**  bus_config_parser_get_addresses    (BusConfigParser *parser);
 DBusList**  bus_config_parser_get_mechanisms   (BusConfigParser *parser);
+DBusList**  bus_config_parser_get_trusted_body_uids (BusConfigParser *parser);
+DBusList**  bus_config_parser_get_prewarm_services (BusConfigParser *parser);
+DBusList**  bus_config_parser_get_dispatch_weights (BusConfigParser *parser);
+DBusList**  bus_config_parser_get_priority_uids (BusConfigParser *parser);
+DBusList**  bus_config_parser_get_priority_names (BusConfigParser *parser);
 dbus_bool_t bus_config_parser_get_fork         (BusConfigParser *parser);
 dbus_bool_t bus_config_parser_get_allow_anonymous (BusConfigParser *parser);
 dbus_bool_t bus_config_parser_get_syslog       (BusConfigParser *parser);
@@ -76,6 +88,10 @@ void        bus_config_parser_get_limits       (BusConfigParser *parser,
 
 DBusHashTable* bus_config_parser_steal_service_context_table (BusConfigParser *parser);
 
+dbus_bool_t bus_config_parser_sources_changed  (BusConfigParser  *parser);
+void        bus_config_parser_record_file      (BusConfigParser  *parser,
+                                                const DBusString *file);
+
 /* Loader functions (backended off one of the XML parsers).  Returns a
  * finished ConfigParser.
  */
@@ -30,16 +30,40 @@
 #include "signals.h"
 #include "expirelist.h"
 #include "selinux.h"
+#include "resolver.h"
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-hash.h>
+#include <dbus/dbus-mempool.h>
 #include <dbus/dbus-timeout.h>
+#include <dbus/dbus-connection-internal.h>
+#include <dbus/dbus-message-internal.h>
+#include <dbus/dbus-resources.h>
 
 /* Trim executed commands to this length; we want to keep logs readable */
 #define MAX_LOG_COMMAND_LEN 50
 
+/* How often to look for connections that have gone idle, and free the
+ * memory they only keep around for traffic */
+#define IDLE_COMPACT_INTERVAL (60 * 1000)
+
+/* A monitor is handed more of its queue whenever its socket has less
+ * than this waiting to be written; the rest waits on our side, where
+ * we can throw the oldest away */
+#define MONITOR_OUTGOING_BYTES (256 * 1024)
+
+/* Most that can wait on our side for a monitor before the oldest
+ * messages are dropped */
+#define MONITOR_QUEUE_MAX_BYTES (4 * _DBUS_ONE_MEGABYTE)
+
+/* How often to retry handing queued messages to monitors whose
+ * sockets were full */
+#define MONITOR_FLUSH_INTERVAL 20
+
 static void bus_connection_remove_transactions (DBusConnection *connection);
 
-typedef struct
+typedef struct BusPendingReply BusPendingReply;
+
+struct BusPendingReply
 {
   BusExpireItem expire_item;
 
@@ -47,8 +71,72 @@ typedef struct
   DBusConnection *will_send_reply;
 
   dbus_uint32_t reply_serial;
-  
-} BusPendingReply;
+
+  DBusList *expire_link;           /**< Our link in connections->pending_replies */
+  DBusList *link_in_receiver_list; /**< Link in will_get_reply's replies_to_receive */
+  DBusList *link_in_replier_list;  /**< Link in will_send_reply's replies_to_send */
+  BusPendingReply *next_with_key;  /**< Next reply in the same pending_replies_by_key entry */
+
+  unsigned int in_transaction : 1; /**< Taken off the expire list by a reply in flight */
+  unsigned int dropped : 1;        /**< Receiver went away while in_transaction */
+};
+
+/* A token bucket: it holds up to a second's worth of messages and
+ * bytes, topped up as time passes, and each message sent takes its
+ * share out of it.
+ */
+typedef struct
+{
+  double messages;  /**< Messages that can still be sent; negative once over the limit */
+  double bytes;     /**< Bytes that can still be sent, likewise */
+  long tv_sec;      /**< When the bucket was last topped up (seconds component) */
+  long tv_usec;     /**< When the bucket was last topped up (microsec component) */
+} BusRateBucket;
+
+/* A destination name a connection sent to recently, and who owned it.
+ * Entries are only good while the registry's owner generation stays
+ * what it was when they were filled in; both pointers may be stale
+ * after that.
+ */
+typedef struct
+{
+  BusService *service;     /**< The destination, or NULL if the entry is unused */
+  DBusConnection *owner;   /**< Its primary owner */
+} BusRouteCacheEntry;
+
+/* How many destinations each connection remembers */
+#define N_ROUTE_CACHE_ENTRIES 4
+
+/* Defined up here for the pools in BusConnections; the rest of the
+ * transaction code is further down.
+ */
+
+typedef struct
+{
+  BusTransaction *transaction;
+  DBusMessage    *message;
+  DBusPreallocatedSend *preallocated;
+  dbus_bool_t     conflate; /**< May take the place of a like signal still queued */
+} MessageToSend;
+
+/** Room in each transaction for bus_transaction_alloc() */
+#define TRANSACTION_SCRATCH_SIZE 256
+
+struct BusTransaction
+{
+  DBusList *connections;
+  BusContext *context;
+  DBusList *cancel_hooks;
+  DBusList *captured; /**< CapturedMessage for monitors, in order */
+  DBusList *scratch_overflow; /**< Blocks bus_transaction_alloc() had to malloc */
+  int scratch_used; /**< Bytes of scratch handed out */
+  union
+  {
+    char bytes[TRANSACTION_SCRATCH_SIZE];
+    void *align_pointer;
+    double align_double;
+  } scratch;
+};
 
 struct BusConnections
 {
@@ -59,9 +147,23 @@ struct BusConnections
   int n_incomplete;     /**< Length of incomplete list */
   BusContext *context;
   DBusHashTable *completed_by_user; /**< Number of completed connections for each UID */
+  DBusHashTable *rate_by_user; /**< BusRateBucket shared by the completed connections of each UID */
+  DBusHashTable *dispatch_by_user; /**< Microseconds spent on messages from the completed connections of each UID */
   DBusTimeout *expire_timeout; /**< Timeout for expiring incomplete connections. */
   int stamp;                   /**< Incrementing number */
   BusExpireList *pending_replies; /**< List of pending replies */
+  DBusHashTable *pending_replies_by_key; /**< Pending replies by (receiver, serial) */
+  DBusTimeout *compact_timeout; /**< Timeout for compacting idle connections */
+  DBusCounter *buffered_counter; /**< Bytes of messages read by the bus and not yet finished with */
+  long buffered_limit;          /**< max_buffered_bytes as last seen */
+  DBusTimeout *budget_timeout;  /**< Rechecks buffered_counter against the limit, outside any connection lock */
+  dbus_bool_t over_budget;      /**< TRUE while reading is paused for going over max_buffered_bytes */
+  dbus_bool_t handing_off;      /**< TRUE while reading is paused to hand connections to a new bus */
+  DBusList *monitors;           /**< Connections that called BecomeMonitor */
+  BusMatchmaker *monitor_matchmaker; /**< The monitors' match rules, kept apart from everyone else's */
+  DBusTimeout *monitor_timeout; /**< Hands queued messages to monitors as their sockets drain */
+  DBusMemPool *transaction_pool; /**< BusTransaction, one per message dispatched */
+  DBusMemPool *to_send_pool;    /**< MessageToSend, one per recipient */
 };
 
 static dbus_int32_t connection_data_slot = -1;
@@ -75,18 +177,54 @@ typedef struct
   int n_services_owned;
   DBusList *match_rules;
   int n_match_rules;
+  int n_conflating_rules;  /**< How many of match_rules have conflate='true' */
+  DBusHashTable *conflated_signals; /**< Conflation key to the latest signal sent with it */
+  char *last_denial;       /**< Key then text of the last policy denial of a message we sent */
+  int last_denial_key_len;
   char *name;
   DBusList *transaction_messages; /**< Stuff we need to send as part of a transaction */
   DBusMessage *oom_message;
   DBusPreallocatedSend *oom_preallocated;
   BusClientPolicy *policy;
+  int policy_generation;   /**< bus_context_get_policy_generation() that policy was made from */
 
   char *cached_loginfo_string;
   BusSELinuxID *selinux_id;
 
+  BusResolverRequest *groups_request; /**< Group lookup running in a resolver thread */
+  unsigned long *prefetched_groups;   /**< Result of groups_request, until the policy is built */
+  int n_prefetched_groups;
+  dbus_bool_t have_prefetched_groups;
+
   long connection_tv_sec;  /**< Time when we connected (seconds component) */
   long connection_tv_usec; /**< Time when we connected (microsec component) */
   int stamp;               /**< connections->stamp last time we were traversed */
+  DBusList *replies_to_receive; /**< Pending replies we will get */
+  int n_replies_to_receive;     /**< Length of replies_to_receive */
+  DBusList *replies_to_send;    /**< Pending replies we owe */
+
+  BusConnectionStats stats;     /**< Traffic counters for the Stats interface */
+
+  DBusList *paused_senders;     /**< Connections we stopped reading from because our queue is full */
+  DBusList *pausing_receivers;  /**< Connections whose full queues we are waiting on */
+
+  BusRateBucket rate;           /**< What's left of our max_messages_per_second and max_bytes_per_second */
+  DBusTimeout *rate_timeout;    /**< Resumes reading once we're back under our rate limits */
+  dbus_bool_t rate_limited;     /**< TRUE while we've stopped reading for going over a rate limit */
+
+  dbus_uint32_t traffic_at_sweep; /**< Messages in and out as of the last idle sweep */
+  dbus_bool_t compacted;          /**< TRUE if compacted as idle, and idle since */
+
+  dbus_bool_t trusts_bodies;      /**< TRUE if we pass on its message bodies without checking them */
+  dbus_bool_t priority;           /**< TRUE if a priority_user or priority_name, see update_priority() */
+
+  BusRouteCacheEntry route_cache[N_ROUTE_CACHE_ENTRIES]; /**< Destinations we sent to last */
+  dbus_uint32_t route_cache_generation; /**< Registry owner generation route_cache is valid for */
+  int route_cache_next;           /**< Entry in route_cache to fill in next */
+
+  DBusList *link_in_monitors;     /**< Link in connections->monitors, if we are a monitor */
+  DBusList *monitor_queue;        /**< Captured messages waiting for room in our outgoing queue */
+  long monitor_queue_bytes;       /**< Size of monitor_queue */
 } BusConnectionData;
 
 static dbus_bool_t bus_pending_reply_expired (BusExpireList *list,
@@ -98,7 +236,104 @@ static void bus_connection_drop_pending_replies (BusConnections  *connections,
 
 static dbus_bool_t expire_incomplete_timeout (void *data);
 
-#define BUS_CONNECTION_DATA(connection) (dbus_connection_get_data ((connection), connection_data_slot))
+static dbus_bool_t compact_idle_timeout (void *data);
+
+static dbus_bool_t monitor_timeout (void *data);
+
+static dbus_bool_t budget_timeout (void *data);
+
+static void call_timeout_callback (DBusTimeout *timeout,
+                                   void        *data);
+
+/* The daemon only sets its data from the main loop thread, so reading
+ * it back on every message needs no slot locks */
+#define BUS_CONNECTION_DATA(connection) (_dbus_connection_get_data_unlocked ((connection), connection_data_slot))
+
+static void
+connection_count_outgoing (BusConnectionData *d,
+                           DBusMessage       *message)
+{
+  d->stats.outgoing_messages += 1;
+  d->stats.outgoing_bytes += _dbus_message_get_network_size (message);
+}
+
+/* Reading stops while flow control, a rate limit or the memory
+ * budget holds the connection off, and while handing it over
+ */
+static void
+update_reading_paused (DBusConnection    *connection,
+                       BusConnectionData *d)
+{
+  _dbus_connection_set_reading_paused (connection,
+                                       d->pausing_receivers != NULL ||
+                                       d->rate_limited ||
+                                       d->connections->over_budget ||
+                                       d->connections->handing_off);
+}
+
+/* Start reading again from everyone the receiver's full queue held
+ * off, unless some other receiver is still holding them off too.
+ */
+static void
+resume_paused_senders (DBusConnection    *receiver,
+                       BusConnectionData *r)
+{
+  DBusConnection *sender;
+
+  while ((sender = _dbus_list_pop_first (&r->paused_senders)))
+    {
+      BusConnectionData *s;
+
+      s = BUS_CONNECTION_DATA (sender);
+      _dbus_assert (s != NULL);
+
+      _dbus_list_remove_last (&s->pausing_receivers, receiver);
+      if (s->pausing_receivers == NULL)
+        {
+          _dbus_verbose ("Resuming reading from %s\n",
+                         s->name ? s->name : "(inactive)");
+          update_reading_paused (sender, s);
+        }
+    }
+}
+
+static void
+receiver_drained (DBusConnection *connection,
+                  void           *data)
+{
+  BusConnectionData *d = data;
+
+  /* the callback is one-shot, so nothing to unset on the connection */
+  resume_paused_senders (connection, d);
+}
+
+/* Forget about flow control involving a connection that's going away */
+static void
+drop_flow_control (DBusConnection    *connection,
+                   BusConnectionData *d)
+{
+  DBusConnection *receiver;
+
+  if (d->paused_senders != NULL)
+    {
+      _dbus_connection_set_outgoing_drained_function (connection, 0,
+                                                      NULL, NULL);
+      resume_paused_senders (connection, d);
+    }
+
+  while ((receiver = _dbus_list_pop_first (&d->pausing_receivers)))
+    {
+      BusConnectionData *r;
+
+      r = BUS_CONNECTION_DATA (receiver);
+      _dbus_assert (r != NULL);
+
+      _dbus_list_remove_last (&r->paused_senders, connection);
+      if (r->paused_senders == NULL)
+        _dbus_connection_set_outgoing_drained_function (receiver, 0,
+                                                        NULL, NULL);
+    }
+}
 
 static DBusLoop*
 connection_get_loop (DBusConnection *connection)
@@ -150,6 +385,8 @@ adjust_connections_for_uid (BusConnections *connections,
   if (current_count == 0)
     {
       _dbus_hash_table_remove_uintptr (connections->completed_by_user, uid);
+      _dbus_hash_table_remove_uintptr (connections->rate_by_user, uid);
+      _dbus_hash_table_remove_uintptr (connections->dispatch_by_user, uid);
       return TRUE;
     }
   else
@@ -185,9 +422,24 @@ bus_connection_disconnected (DBusConnection *connection)
   /* Delete our match rules */
   if (d->n_match_rules > 0)
     {
-      matchmaker = bus_context_get_matchmaker (d->connections->context);
+      if (d->link_in_monitors != NULL)
+        matchmaker = d->connections->monitor_matchmaker;
+      else
+        matchmaker = bus_context_get_matchmaker (d->connections->context);
       bus_matchmaker_disconnected (matchmaker, connection);
     }
+
+  if (d->link_in_monitors != NULL)
+    {
+      DBusMessage *message;
+
+      _dbus_list_remove_link (&d->connections->monitors, d->link_in_monitors);
+      d->link_in_monitors = NULL;
+
+      while ((message = _dbus_list_pop_first (&d->monitor_queue)) != NULL)
+        dbus_message_unref (message);
+      d->monitor_queue_bytes = 0;
+    }
   
   /* Drop any service ownership. Unfortunately, this requires
    * memory allocation and there doesn't seem to be a good way to
@@ -232,6 +484,12 @@ bus_connection_disconnected (DBusConnection *connection)
     }
 
   bus_dispatch_remove_connection (connection);
+
+  if (d->groups_request != NULL)
+    {
+      bus_resolver_request_cancel (d->groups_request);
+      d->groups_request = NULL;
+    }
   
   /* no more watching */
   if (!dbus_connection_set_watch_functions (connection,
@@ -285,6 +543,17 @@ bus_connection_disconnected (DBusConnection *connection)
     }
 
   bus_connection_drop_pending_replies (d->connections, connection);
+
+  drop_flow_control (connection, d);
+
+  if (d->rate_timeout != NULL)
+    {
+      _dbus_loop_remove_timeout (bus_context_get_loop (d->connections->context),
+                                 d->rate_timeout,
+                                 call_timeout_callback, NULL);
+      _dbus_timeout_unref (d->rate_timeout);
+      d->rate_timeout = NULL;
+    }
   
   /* frees "d" as side effect */
   dbus_connection_set_data (connection,
@@ -331,6 +600,15 @@ remove_connection_watch (DBusWatch      *watch,
                            watch, connection_watch_callback, connection);
 }
 
+static void
+toggle_connection_watch (DBusWatch      *watch,
+                         void           *data)
+{
+  DBusConnection *connection = data;
+
+  _dbus_loop_toggle_watch (connection_get_loop (connection), watch);
+}
+
 static void
 connection_timeout_callback (DBusTimeout   *timeout,
                              void          *data)
@@ -361,12 +639,30 @@ remove_connection_timeout (DBusTimeout    *timeout,
                              timeout, connection_timeout_callback, connection);
 }
 
+static void
+toggle_connection_timeout (DBusTimeout    *timeout,
+                           void           *data)
+{
+  DBusConnection *connection = data;
+
+  _dbus_loop_toggle_timeout (connection_get_loop (connection), timeout);
+}
+
 static void
 dispatch_status_function (DBusConnection    *connection,
                           DBusDispatchStatus new_status,
                           void              *data)
 {
   DBusLoop *loop = data;
+  BusConnectionData *d;
+
+  /* Messages wait until our groups are known, so that the policy can
+   * be built without blocking the main loop; groups_lookup_done()
+   * queues the dispatch instead.
+   */
+  d = BUS_CONNECTION_DATA (connection);
+  if (d != NULL && d->groups_request != NULL)
+    return;
   
   if (new_status != DBUS_DISPATCH_COMPLETE)
     {
@@ -375,6 +671,37 @@ dispatch_status_function (DBusConnection    *connection,
     }
 }
 
+static void
+groups_lookup_done (dbus_bool_t    success,
+                    unsigned long *groups,
+                    int            n_groups,
+                    void          *data)
+{
+  DBusConnection *connection = data;
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+  _dbus_assert (d->groups_request != NULL);
+
+  d->groups_request = NULL;
+
+  if (success)
+    {
+      d->prefetched_groups = groups;
+      d->n_prefetched_groups = n_groups;
+      d->have_prefetched_groups = TRUE;
+    }
+
+  /* let through whatever arrived while we were waiting */
+  if (dbus_connection_get_dispatch_status (connection) != DBUS_DISPATCH_COMPLETE)
+    {
+      while (!_dbus_loop_queue_dispatch (connection_get_loop (connection),
+                                         connection))
+        _dbus_wait_for_memory ();
+    }
+}
+
 static dbus_bool_t
 allow_unix_user_function (DBusConnection *connection,
                           unsigned long   uid,
@@ -386,7 +713,19 @@ allow_unix_user_function (DBusConnection *connection,
 
   _dbus_assert (d != NULL);
   
-  return bus_context_allow_unix_user (d->connections->context, uid);
+  if (!bus_context_allow_unix_user (d->connections->context, uid))
+    return FALSE;
+
+  /* Start resolving the groups now, the policy needs them as soon as
+   * the Hello arrives.  If the resolver can't take it we just do the
+   * lookup synchronously later.
+   */
+  if (d->groups_request == NULL && !d->have_prefetched_groups)
+    d->groups_request =
+      bus_resolver_lookup_groups (bus_context_get_resolver (d->connections->context),
+                                  uid, groups_lookup_done, connection);
+
+  return TRUE;
 }
 
 static void
@@ -399,6 +738,13 @@ free_connection_data (void *data)
   _dbus_assert (d->n_services_owned == 0);
   /* similarly */
   _dbus_assert (d->transaction_messages == NULL);
+  _dbus_assert (d->replies_to_receive == NULL);
+  _dbus_assert (d->n_replies_to_receive == 0);
+  _dbus_assert (d->replies_to_send == NULL);
+  _dbus_assert (d->paused_senders == NULL);
+  _dbus_assert (d->pausing_receivers == NULL);
+  _dbus_assert (d->rate_timeout == NULL);
+  _dbus_assert (d->monitor_queue == NULL);
 
   if (d->oom_preallocated)
     dbus_connection_free_preallocated_send (d->connection, d->oom_preallocated);
@@ -409,8 +755,18 @@ free_connection_data (void *data)
   if (d->policy)
     bus_client_policy_unref (d->policy);
 
+  if (d->conflated_signals)
+    _dbus_hash_table_unref (d->conflated_signals);
+
+  dbus_free (d->last_denial);
+
   if (d->selinux_id)
     bus_selinux_id_unref (d->selinux_id);
+
+  if (d->groups_request)
+    bus_resolver_request_cancel (d->groups_request);
+
+  dbus_free (d->prefetched_groups);
   
   dbus_free (d->cached_loginfo_string);
   
@@ -444,35 +800,136 @@ bus_connections_new (BusContext *context)
   if (connections->completed_by_user == NULL)
     goto failed_2;
 
+  connections->rate_by_user = _dbus_hash_table_new (DBUS_HASH_UINTPTR,
+                                                    NULL, dbus_free);
+  if (connections->rate_by_user == NULL)
+    goto failed_3;
+
+  connections->dispatch_by_user = _dbus_hash_table_new (DBUS_HASH_UINTPTR,
+                                                        NULL, NULL);
+  if (connections->dispatch_by_user == NULL)
+    goto failed_18;
+
   connections->expire_timeout = _dbus_timeout_new (100, /* irrelevant */
                                                    expire_incomplete_timeout,
                                                    connections, NULL);
   if (connections->expire_timeout == NULL)
-    goto failed_3;
+    goto failed_7;
 
   _dbus_timeout_set_enabled (connections->expire_timeout, FALSE);
 
+  connections->compact_timeout = _dbus_timeout_new (IDLE_COMPACT_INTERVAL,
+                                                    compact_idle_timeout,
+                                                    connections, NULL);
+  if (connections->compact_timeout == NULL)
+    goto failed_8;
+
+  connections->buffered_counter = _dbus_counter_new ();
+  if (connections->buffered_counter == NULL)
+    goto failed_10;
+
+  connections->budget_timeout = _dbus_timeout_new (0, budget_timeout,
+                                                   connections, NULL);
+  if (connections->budget_timeout == NULL)
+    goto failed_11;
+
+  _dbus_timeout_set_enabled (connections->budget_timeout, FALSE);
+
+  connections->monitor_matchmaker = bus_matchmaker_new ();
+  if (connections->monitor_matchmaker == NULL)
+    goto failed_13;
+
+  connections->monitor_timeout = _dbus_timeout_new (MONITOR_FLUSH_INTERVAL,
+                                                    monitor_timeout,
+                                                    connections, NULL);
+  if (connections->monitor_timeout == NULL)
+    goto failed_14;
+
+  _dbus_timeout_set_enabled (connections->monitor_timeout, FALSE);
+
   connections->pending_replies = bus_expire_list_new (bus_context_get_loop (context),
                                                       bus_context_get_reply_timeout (context),
                                                       bus_pending_reply_expired,
                                                       connections);
   if (connections->pending_replies == NULL)
     goto failed_4;
+
+  connections->pending_replies_by_key = _dbus_hash_table_new (DBUS_HASH_UINTPTR,
+                                                              NULL, NULL);
+  if (connections->pending_replies_by_key == NULL)
+    goto failed_5;
+
+  connections->transaction_pool = _dbus_mem_pool_new (sizeof (BusTransaction),
+                                                      TRUE);
+  if (connections->transaction_pool == NULL)
+    goto failed_16;
+
+  connections->to_send_pool = _dbus_mem_pool_new (sizeof (MessageToSend),
+                                                  FALSE);
+  if (connections->to_send_pool == NULL)
+    goto failed_17;
   
   if (!_dbus_loop_add_timeout (bus_context_get_loop (context),
                                connections->expire_timeout,
                                call_timeout_callback, NULL, NULL))
-    goto failed_5;
+    goto failed_6;
+
+  if (!_dbus_loop_add_timeout (bus_context_get_loop (context),
+                               connections->compact_timeout,
+                               call_timeout_callback, NULL, NULL))
+    goto failed_9;
+
+  if (!_dbus_loop_add_timeout (bus_context_get_loop (context),
+                               connections->budget_timeout,
+                               call_timeout_callback, NULL, NULL))
+    goto failed_12;
+
+  if (!_dbus_loop_add_timeout (bus_context_get_loop (context),
+                               connections->monitor_timeout,
+                               call_timeout_callback, NULL, NULL))
+    goto failed_15;
   
   connections->refcount = 1;
   connections->context = context;
   
   return connections;
 
+ failed_15:
+  _dbus_loop_remove_timeout (bus_context_get_loop (context),
+                             connections->budget_timeout,
+                             call_timeout_callback, NULL);
+ failed_12:
+  _dbus_loop_remove_timeout (bus_context_get_loop (context),
+                             connections->compact_timeout,
+                             call_timeout_callback, NULL);
+ failed_9:
+  _dbus_loop_remove_timeout (bus_context_get_loop (context),
+                             connections->expire_timeout,
+                             call_timeout_callback, NULL);
+ failed_6:
+  _dbus_mem_pool_free (connections->to_send_pool);
+ failed_17:
+  _dbus_mem_pool_free (connections->transaction_pool);
+ failed_16:
+  _dbus_hash_table_unref (connections->pending_replies_by_key);
  failed_5:
   bus_expire_list_free (connections->pending_replies);
  failed_4:
+  _dbus_timeout_unref (connections->monitor_timeout);
+ failed_14:
+  bus_matchmaker_unref (connections->monitor_matchmaker);
+ failed_13:
+  _dbus_timeout_unref (connections->budget_timeout);
+ failed_11:
+  _dbus_counter_unref (connections->buffered_counter);
+ failed_10:
+  _dbus_timeout_unref (connections->compact_timeout);
+ failed_8:
   _dbus_timeout_unref (connections->expire_timeout);
+ failed_7:
+  _dbus_hash_table_unref (connections->dispatch_by_user);
+ failed_18:
+  _dbus_hash_table_unref (connections->rate_by_user);
  failed_3:
   _dbus_hash_table_unref (connections->completed_by_user);
  failed_2:
@@ -529,6 +986,9 @@ bus_connections_unref (BusConnections *connections)
 
       _dbus_assert (connections->n_completed == 0);
 
+      _dbus_assert (_dbus_hash_table_get_n_entries (connections->pending_replies_by_key) == 0);
+      _dbus_hash_table_unref (connections->pending_replies_by_key);
+
       bus_expire_list_free (connections->pending_replies);
       
       _dbus_loop_remove_timeout (bus_context_get_loop (connections->context),
@@ -536,8 +996,40 @@ bus_connections_unref (BusConnections *connections)
                                  call_timeout_callback, NULL);
       
       _dbus_timeout_unref (connections->expire_timeout);
+
+      _dbus_loop_remove_timeout (bus_context_get_loop (connections->context),
+                                 connections->compact_timeout,
+                                 call_timeout_callback, NULL);
+
+      _dbus_timeout_unref (connections->compact_timeout);
+
+      _dbus_loop_remove_timeout (bus_context_get_loop (connections->context),
+                                 connections->budget_timeout,
+                                 call_timeout_callback, NULL);
+
+      _dbus_timeout_unref (connections->budget_timeout);
+
+      _dbus_assert (connections->monitors == NULL);
+
+      _dbus_loop_remove_timeout (bus_context_get_loop (connections->context),
+                                 connections->monitor_timeout,
+                                 call_timeout_callback, NULL);
+
+      _dbus_timeout_unref (connections->monitor_timeout);
+
+      bus_matchmaker_unref (connections->monitor_matchmaker);
+
+      /* messages still around may outlive us */
+      _dbus_counter_set_notify (connections->buffered_counter, 0, 0,
+                                NULL, NULL);
+      _dbus_counter_unref (connections->buffered_counter);
       
       _dbus_hash_table_unref (connections->completed_by_user);
+      _dbus_hash_table_unref (connections->rate_by_user);
+      _dbus_hash_table_unref (connections->dispatch_by_user);
+
+      _dbus_mem_pool_free (connections->transaction_pool);
+      _dbus_mem_pool_free (connections->to_send_pool);
       
       dbus_free (connections);
 
@@ -634,6 +1126,11 @@ bus_connections_setup_connection (BusConnections *connections,
     }
 
   dbus_connection_set_route_peer_messages (connection, TRUE);
+
+  /* Each client's queue carries messages from many senders, so let
+   * their small messages get ahead of someone else's bulk transfer
+   */
+  _dbus_connection_set_outgoing_lanes (connection, TRUE);
   
   retval = FALSE;
 
@@ -654,15 +1151,21 @@ bus_connections_setup_connection (BusConnections *connections,
   if (!dbus_connection_set_watch_functions (connection,
                                             add_connection_watch,
                                             remove_connection_watch,
-                                            NULL,
+                                            toggle_connection_watch,
                                             connection,
                                             NULL))
     goto out;
+
+  /* The main loop serves the write watch, so a client that isn't
+   * keeping up needn't have a write attempted for every message
+   * routed to it.
+   */
+  _dbus_connection_set_edge_triggered_writes (connection, TRUE);
   
   if (!dbus_connection_set_timeout_functions (connection,
                                               add_connection_timeout,
                                               remove_connection_timeout,
-                                              NULL,
+                                              toggle_connection_timeout,
                                               connection, NULL))
     goto out;
 
@@ -699,6 +1202,9 @@ bus_connections_setup_connection (BusConnections *connections,
 
   _dbus_list_append_link (&connections->incomplete, d->link_in_connection_list);
   connections->n_incomplete += 1;
+
+  if (connections->over_budget || connections->handing_off)
+    update_reading_paused (connection, d);
   
   dbus_connection_ref (connection);
 
@@ -830,7 +1336,8 @@ bus_connections_expire_incomplete (BusConnections *connections)
         }
     }
 
-  bus_expire_timeout_set_interval (connections->expire_timeout,
+  bus_expire_timeout_set_interval (bus_context_get_loop (connections->context),
+                                   connections->expire_timeout,
                                    next_interval);
 }
 
@@ -847,59 +1354,329 @@ expire_incomplete_timeout (void *data)
   return TRUE;
 }
 
-dbus_bool_t
-bus_connection_get_unix_groups  (DBusConnection   *connection,
-                                 unsigned long   **groups,
-                                 int              *n_groups,
-                                 DBusError        *error)
+/* Frees what a connection only keeps for more traffic: spare buffer
+ * space, and the preallocated out-of-memory error, which is rebuilt
+ * before its next message is dispatched.
+ */
+static void
+compact_connection (DBusConnection    *connection,
+                    BusConnectionData *d)
 {
-  BusConnectionData *d;
-  unsigned long uid;
-  
-  d = BUS_CONNECTION_DATA (connection);
-
-  _dbus_assert (d != NULL);
+  if (d->oom_preallocated)
+    {
+      dbus_connection_free_preallocated_send (connection, d->oom_preallocated);
+      d->oom_preallocated = NULL;
+    }
 
-  *groups = NULL;
-  *n_groups = 0;
+  if (d->oom_message)
+    {
+      dbus_message_unref (d->oom_message);
+      d->oom_message = NULL;
+    }
 
-  if (dbus_connection_get_unix_user (connection, &uid))
+  /* nothing can be queued to conflate with after an idle sweep */
+  if (d->conflated_signals)
     {
-      if (!_dbus_unix_groups_from_uid (uid, groups, n_groups))
-        {
-          _dbus_verbose ("Did not get any groups for UID %lu\n",
-                         uid);
-          return FALSE;
-        }
-      else
-        {
-          _dbus_verbose ("Got %d groups for UID %lu\n",
-                         *n_groups, uid);
-          return TRUE;
-        }
+      _dbus_hash_table_unref (d->conflated_signals);
+      d->conflated_signals = NULL;
     }
-  else
-    return TRUE; /* successfully got 0 groups */
+
+  dbus_free (d->last_denial);
+  d->last_denial = NULL;
+
+  _dbus_connection_compact (connection);
 }
 
-dbus_bool_t
-bus_connection_is_in_unix_group (DBusConnection *connection,
-                                 unsigned long   gid)
+/* Compacts the connections with no traffic since the last sweep. When
+ * traffic has died down like that, the pools are also likely to have
+ * blocks that are unused since the busier time, so those go too.
+ */
+static dbus_bool_t
+compact_idle_timeout (void *data)
 {
-  int i;
-  unsigned long *group_ids;
-  int n_group_ids;
+  BusConnections *connections = data;
+  DBusList *link;
+  dbus_bool_t compacted_any;
 
-  if (!bus_connection_get_unix_groups (connection, &group_ids, &n_group_ids,
-                                       NULL))
-    return FALSE;
+  compacted_any = FALSE;
 
-  i = 0;
-  while (i < n_group_ids)
+  link = _dbus_list_get_first_link (&connections->completed);
+  while (link != NULL)
     {
-      if (group_ids[i] == gid)
+      DBusConnection *connection = link->data;
+      BusConnectionData *d;
+      dbus_uint32_t traffic;
+
+      link = _dbus_list_get_next_link (&connections->completed, link);
+
+      d = BUS_CONNECTION_DATA (connection);
+      _dbus_assert (d != NULL);
+
+      traffic = d->stats.incoming_messages + d->stats.outgoing_messages;
+
+      if (traffic != d->traffic_at_sweep)
         {
-          dbus_free (group_ids);
+          d->traffic_at_sweep = traffic;
+          d->compacted = FALSE;
+          continue;
+        }
+
+      if (d->compacted)
+        continue;
+
+      compact_connection (connection, d);
+      d->compacted = TRUE;
+      compacted_any = TRUE;
+    }
+
+  if (compacted_any)
+    {
+      _dbus_mem_pool_trim (connections->transaction_pool);
+      _dbus_mem_pool_trim (connections->to_send_pool);
+      _dbus_message_trim_pool ();
+      _dbus_list_trim_pool ();
+    }
+
+  return TRUE;
+}
+
+static void
+update_reading_paused_foreach (DBusList **list)
+{
+  DBusList *link;
+
+  for (link = _dbus_list_get_first_link (list);
+       link != NULL;
+       link = _dbus_list_get_next_link (list, link))
+    {
+      DBusConnection *connection = link->data;
+      BusConnectionData *d;
+
+      d = BUS_CONNECTION_DATA (connection);
+      _dbus_assert (d != NULL);
+
+      update_reading_paused (connection, d);
+    }
+}
+
+/* Called as buffered_counter crosses the value we are watching for.
+ * Messages are finalized, and so taken off the counter, with the lock
+ * of the connection that wrote them held, so the actual work of
+ * pausing and resuming connections waits for budget_timeout.
+ */
+static void
+buffered_counter_notify (DBusCounter *counter,
+                         void        *data)
+{
+  BusConnections *connections = data;
+
+  bus_expire_timeout_set_interval (bus_context_get_loop (connections->context),
+                                   connections->budget_timeout, 0);
+}
+
+/* Stops reading from every connection once the messages the bus holds
+ * reach max_buffered_bytes, compacting all connections to give back
+ * what memory it can, and starts reading again once they have drained
+ * to three quarters of it.
+ */
+static dbus_bool_t
+budget_timeout (void *data)
+{
+  BusConnections *connections = data;
+  long limit;
+  long buffered;
+  dbus_bool_t over_budget;
+  DBusList *link;
+
+  bus_expire_timeout_set_interval (bus_context_get_loop (connections->context),
+                                   connections->budget_timeout, -1);
+
+  limit = connections->buffered_limit;
+  buffered = _dbus_counter_get_size_value (connections->buffered_counter);
+
+  if (limit <= 0)
+    over_budget = FALSE;
+  else if (connections->over_budget)
+    over_budget = buffered >= limit / 4 * 3;
+  else
+    over_budget = buffered >= limit;
+
+  /* watch for crossing back the other way */
+  if (limit <= 0)
+    _dbus_counter_set_notify (connections->buffered_counter, 0, 0,
+                              NULL, NULL);
+  else
+    _dbus_counter_set_notify (connections->buffered_counter,
+                              over_budget ? limit / 4 * 3 : limit, 0,
+                              buffered_counter_notify, connections);
+
+  if (over_budget == connections->over_budget)
+    return TRUE;
+
+  connections->over_budget = over_budget;
+
+  if (over_budget)
+    {
+      bus_context_log (connections->context, DBUS_SYSTEM_LOG_INFO,
+                       "Holding %ld bytes of messages, over max_buffered_bytes of %ld; "
+                       "pausing reading from all connections",
+                       buffered, limit);
+
+      for (link = _dbus_list_get_first_link (&connections->completed);
+           link != NULL;
+           link = _dbus_list_get_next_link (&connections->completed, link))
+        {
+          BusConnectionData *d;
+
+          d = BUS_CONNECTION_DATA (link->data);
+          _dbus_assert (d != NULL);
+
+          compact_connection (link->data, d);
+        }
+    }
+  else
+    {
+      _dbus_verbose ("Back under max_buffered_bytes, resuming reading\n");
+    }
+
+  update_reading_paused_foreach (&connections->completed);
+  update_reading_paused_foreach (&connections->incomplete);
+
+  return TRUE;
+}
+
+/**
+ * Stops or resumes reading from every connection, so that what has
+ * been read can be dispatched and written out before the connections
+ * are handed to a new bus. Writing carries on.
+ *
+ * @param connections the connections object
+ * @param handing_off #TRUE to stop reading
+ */
+void
+bus_connections_set_handing_off (BusConnections *connections,
+                                 dbus_bool_t     handing_off)
+{
+  connections->handing_off = handing_off;
+
+  update_reading_paused_foreach (&connections->completed);
+  update_reading_paused_foreach (&connections->incomplete);
+}
+
+/**
+ * Counts a message the bus has read against max_buffered_bytes, for
+ * as long as the bus keeps it, which is usually until it has been
+ * written to all its recipients.
+ *
+ * @param connection the connection the message came from
+ * @param message the message
+ */
+void
+bus_connection_count_buffered (DBusConnection *connection,
+                               DBusMessage    *message)
+{
+  BusConnectionData *d;
+  BusConnections *connections;
+  long limit;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  connections = d->connections;
+
+  limit = bus_context_get_max_buffered_bytes (connections->context);
+  if (limit != connections->buffered_limit)
+    {
+      /* new config; let the timeout watch the new limit */
+      connections->buffered_limit = limit;
+      bus_expire_timeout_set_interval (bus_context_get_loop (connections->context),
+                                       connections->budget_timeout, 0);
+    }
+
+  /* If there's no memory for a counter link the message just goes
+   * uncounted; usually it fits in the message itself
+   */
+  if (limit > 0)
+    _dbus_message_add_counter (message, connections->buffered_counter);
+}
+
+dbus_bool_t
+bus_connection_get_unix_groups  (DBusConnection   *connection,
+                                 unsigned long   **groups,
+                                 int              *n_groups,
+                                 DBusError        *error)
+{
+  BusConnectionData *d;
+  unsigned long uid;
+  
+  d = BUS_CONNECTION_DATA (connection);
+
+  _dbus_assert (d != NULL);
+
+  *groups = NULL;
+  *n_groups = 0;
+
+  if (d->groups_request != NULL)
+    {
+      /* needed before the helper thread got to it */
+      bus_resolver_request_cancel (d->groups_request);
+      d->groups_request = NULL;
+    }
+
+  /* The groups looked up in the background at authentication time are
+   * only used once, for the initial policy; later callers such as a
+   * config reload go through the user database as before, so that they
+   * see changes to the group files.
+   */
+  if (d->have_prefetched_groups)
+    {
+      *groups = d->prefetched_groups;
+      *n_groups = d->n_prefetched_groups;
+      d->prefetched_groups = NULL;
+      d->n_prefetched_groups = 0;
+      d->have_prefetched_groups = FALSE;
+
+      _dbus_verbose ("Using %d prefetched groups\n", *n_groups);
+      return TRUE;
+    }
+
+  if (dbus_connection_get_unix_user (connection, &uid))
+    {
+      if (!_dbus_unix_groups_from_uid (uid, groups, n_groups))
+        {
+          _dbus_verbose ("Did not get any groups for UID %lu\n",
+                         uid);
+          return FALSE;
+        }
+      else
+        {
+          _dbus_verbose ("Got %d groups for UID %lu\n",
+                         *n_groups, uid);
+          return TRUE;
+        }
+    }
+  else
+    return TRUE; /* successfully got 0 groups */
+}
+
+dbus_bool_t
+bus_connection_is_in_unix_group (DBusConnection *connection,
+                                 unsigned long   gid)
+{
+  int i;
+  unsigned long *group_ids;
+  int n_group_ids;
+
+  if (!bus_connection_get_unix_groups (connection, &group_ids, &n_group_ids,
+                                       NULL))
+    return FALSE;
+
+  i = 0;
+  while (i < n_group_ids)
+    {
+      if (group_ids[i] == gid)
+        {
+          dbus_free (group_ids);
           return TRUE;
         }
       ++i;
@@ -921,15 +1698,121 @@ bus_connection_get_loginfo (DBusConnection        *connection)
   return d->cached_loginfo_string;  
 }
 
+/**
+ * Gets the text of the last policy denial of a message this
+ * connection sent, if it was made from the same key; a client that
+ * keeps sending the same forbidden message then gets the same error
+ * without the bus formatting it each time.
+ *
+ * @param connection the sender
+ * @param key what the denial text was made from
+ * @returns the text, valid until the next bus_connection_set_denial_text(), or #NULL
+ */
+const char *
+bus_connection_get_denial_text (DBusConnection   *connection,
+                                const DBusString *key)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  if (d->last_denial == NULL ||
+      d->last_denial_key_len != _dbus_string_get_length (key) ||
+      memcmp (d->last_denial, _dbus_string_get_const_data (key),
+              d->last_denial_key_len) != 0)
+    return NULL;
+
+  return d->last_denial + d->last_denial_key_len;
+}
+
+/**
+ * Remembers the text of a policy denial of a message this connection
+ * sent, for bus_connection_get_denial_text(). Only the last one is
+ * kept; if there is no memory, nothing is.
+ *
+ * @param connection the sender
+ * @param key what the denial text was made from
+ * @param text the denial text
+ */
+void
+bus_connection_set_denial_text (DBusConnection   *connection,
+                                const DBusString *key,
+                                const char       *text)
+{
+  BusConnectionData *d;
+  int key_len;
+  size_t text_len;
+  char *block;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  key_len = _dbus_string_get_length (key);
+  text_len = strlen (text);
+
+  block = dbus_realloc (d->last_denial, key_len + text_len + 1);
+  if (block == NULL)
+    {
+      dbus_free (d->last_denial);
+      d->last_denial = NULL;
+      return;
+    }
+
+  memcpy (block, _dbus_string_get_const_data (key), key_len);
+  memcpy (block + key_len, text, text_len + 1);
+  d->last_denial = block;
+  d->last_denial_key_len = key_len;
+}
+
 BusClientPolicy*
 bus_connection_get_policy (DBusConnection *connection)
 {
   BusConnectionData *d;
+  BusContext *context;
+  int generation;
     
   d = BUS_CONNECTION_DATA (connection);
 
   _dbus_assert (d != NULL);
   _dbus_assert (d->policy != NULL);
+
+  /* The configuration was reloaded since we made the policy; rather
+   * than going through every connection at reload time, each one
+   * catches up the next time it's checked.
+   */
+  context = d->connections->context;
+  generation = bus_context_get_policy_generation (context);
+  if (d->policy_generation != generation)
+    {
+      BusClientPolicy *policy;
+      DBusError error;
+
+      dbus_error_init (&error);
+      policy = bus_context_create_client_policy (context, connection, &error);
+      if (policy != NULL)
+        {
+          bus_client_policy_unref (d->policy);
+          d->policy = policy;
+          d->policy_generation = generation;
+        }
+      else
+        {
+          /* on OOM try again next time; other errors would just
+           * repeat, so stay with the old rules like before reloads
+           * updated existing connections
+           */
+          if (!dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY))
+            {
+              bus_context_log (context, DBUS_SYSTEM_LOG_INFO,
+                               "Could not update security policy of connection %s: %s",
+                               d->name, error.message);
+              d->policy_generation = generation;
+            }
+
+          dbus_error_free (&error);
+        }
+    }
   
   return d->policy;
 }
@@ -1020,6 +1903,64 @@ bus_connections_get_context (BusConnections *connections)
   return connections->context;
 }
 
+/**
+ * Counts connections and the replies the bus expects, for the Stats
+ * interface.
+ *
+ * @param connections the connections
+ * @param n_completed return location for number of active connections
+ * @param n_incomplete return location for number still authenticating
+ * @param n_pending_replies return location for number of expected replies
+ */
+void
+bus_connections_get_counts (BusConnections *connections,
+                            int            *n_completed,
+                            int            *n_incomplete,
+                            int            *n_pending_replies)
+{
+  DBusList *link;
+
+  *n_completed = connections->n_completed;
+  *n_incomplete = connections->n_incomplete;
+  *n_pending_replies = 0;
+
+  /* only active connections can be waiting for replies */
+  for (link = _dbus_list_get_first_link (&connections->completed);
+       link != NULL;
+       link = _dbus_list_get_next_link (&connections->completed, link))
+    {
+      BusConnectionData *d = BUS_CONNECTION_DATA (link->data);
+
+      *n_pending_replies += d->n_replies_to_receive;
+    }
+}
+
+/**
+ * Gets how many completed connections a user has, and how long the
+ * bus has spent handling messages from them; see
+ * bus_connection_charge_dispatch(). The time is forgotten once the
+ * user's last connection goes away.
+ *
+ * @param connections the connections
+ * @param uid the user
+ * @param n_connections return location for number of active connections
+ * @param dispatch_usec return location for microseconds spent, wrapping around
+ * @returns #FALSE if the user has no active connections
+ */
+dbus_bool_t
+bus_connections_get_user_stats (BusConnections *connections,
+                                unsigned long   uid,
+                                int            *n_connections,
+                                dbus_uint32_t  *dispatch_usec)
+{
+  *n_connections = get_connections_for_uid (connections, uid);
+  *dispatch_usec = (dbus_uint32_t)
+    _DBUS_POINTER_TO_INT (_dbus_hash_table_lookup_uintptr (connections->dispatch_by_user,
+                                                           uid));
+
+  return *n_connections > 0;
+}
+
 /*
  * This is used to avoid covering the same connection twice when
  * traversing connections. Note that it assumes we will
@@ -1090,6 +2031,69 @@ bus_connection_get_registry (DBusConnection *connection)
   return bus_context_get_registry (d->connections->context);
 }
 
+/**
+ * Finds the name a message from this connection is addressed to, and
+ * its primary owner.  Clients tend to call the same few services over
+ * and over, so the last few names each connection sent to are kept,
+ * and used without hashing as long as no name has changed owner since.
+ *
+ * @param connection the sender
+ * @param name the destination name
+ * @param owner return location for the primary owner of the name
+ * @returns the name, or #NULL if nobody owns it
+ */
+BusService*
+bus_connection_lookup_destination (DBusConnection  *connection,
+                                   const char      *name,
+                                   DBusConnection **owner)
+{
+  BusConnectionData *d;
+  BusRegistry *registry;
+  BusService *service;
+  DBusString str;
+  dbus_uint32_t generation;
+  int i;
+
+  d = BUS_CONNECTION_DATA (connection);
+
+  _dbus_assert (d != NULL);
+
+  registry = bus_context_get_registry (d->connections->context);
+  generation = bus_registry_get_owner_generation (registry);
+
+  if (d->route_cache_generation == generation)
+    {
+      for (i = 0; i < N_ROUTE_CACHE_ENTRIES; i++)
+        {
+          if (d->route_cache[i].service != NULL &&
+              strcmp (bus_service_get_name (d->route_cache[i].service),
+                      name) == 0)
+            {
+              *owner = d->route_cache[i].owner;
+              return d->route_cache[i].service;
+            }
+        }
+    }
+  else
+    {
+      _DBUS_ZERO (d->route_cache);
+      d->route_cache_generation = generation;
+    }
+
+  _dbus_string_init_const (&str, name);
+  service = bus_registry_lookup (registry, &str);
+  if (service == NULL)
+    return NULL;
+
+  *owner = bus_service_get_primary_owners_connection (service);
+
+  d->route_cache[d->route_cache_next].service = service;
+  d->route_cache[d->route_cache_next].owner = *owner;
+  d->route_cache_next = (d->route_cache_next + 1) % N_ROUTE_CACHE_ENTRIES;
+
+  return service;
+}
+
 BusActivation*
 bus_connection_get_activation (DBusConnection *connection)
 {
@@ -1142,16 +2146,240 @@ bus_connection_is_active (DBusConnection *connection)
   return d != NULL && d->name != NULL;
 }
 
+/**
+ * Checks the body of a message received from the connection before
+ * it is delivered anywhere. Bodies of messages the bus only routes
+ * are not validated when read, so that part of the work is off the
+ * path that decides where the message goes; if the peer isn't
+ * trusted to send well-formed bodies it's done here instead.
+ *
+ * @param connection the connection the message came from
+ * @param message the message
+ * @returns #FALSE if the body is corrupt
+ */
 dbus_bool_t
-bus_connection_preallocate_oom_error (DBusConnection *connection)
+bus_connection_check_message_body (DBusConnection *connection,
+                                   DBusMessage    *message)
 {
-  DBusMessage *message;
-  DBusPreallocatedSend *preallocated;
   BusConnectionData *d;
 
-  d = BUS_CONNECTION_DATA (connection);  
+  d = BUS_CONNECTION_DATA (connection);
 
-  _dbus_assert (d != NULL);
+  if (d != NULL && d->trusts_bodies)
+    return TRUE;
+
+  return _dbus_message_check_body (message);
+}
+
+/**
+ * Turns the connection into a monitor, which gets a copy of every
+ * message going through the bus that matches one of its rules, and
+ * nothing else. The well-known names it owns are released as part of
+ * the transaction, and its ordinary match rules are dropped.
+ *
+ * Captured messages bypass the security policy and are never counted
+ * against anyone's quotas. Those the monitor's socket can't take yet
+ * wait in a queue of at most #MONITOR_QUEUE_MAX_BYTES, and the oldest
+ * are dropped when it's full, so a slow monitor costs the bus neither
+ * memory nor backpressure on anyone else.
+ *
+ * @param connection the connection
+ * @param transaction the transaction
+ * @param rules the monitor's #BusMatchRule, which are added with an
+ *  extra reference
+ * @param error return location for an error
+ * @returns #FALSE with error set on failure
+ */
+dbus_bool_t
+bus_connection_become_monitor (DBusConnection  *connection,
+                               BusTransaction  *transaction,
+                               DBusList       **rules,
+                               DBusError       *error)
+{
+  BusConnectionData *d;
+  BusMatchmaker *matchmaker;
+  DBusList *monitor_link;
+  DBusList *link;
+  DBusList *owned;
+  int n_old_rules;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+  _dbus_assert (d->name != NULL);
+  _dbus_assert (d->link_in_monitors == NULL);
+
+  monitor_link = _dbus_list_alloc_link (connection);
+  if (monitor_link == NULL)
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  /* Removing owners is undone if the transaction is cancelled */
+  owned = NULL;
+  if (!_dbus_list_copy (&d->services_owned, &owned))
+    goto oom;
+
+  for (link = _dbus_list_get_first_link (&owned);
+       link != NULL;
+       link = _dbus_list_get_next_link (&owned, link))
+    {
+      BusService *service = link->data;
+
+      if (*bus_service_get_name (service) == ':')
+        continue;
+
+      if (!bus_service_remove_owner (service, connection, transaction, error))
+        {
+          _dbus_list_clear (&owned);
+          _dbus_list_free_link (monitor_link);
+          return FALSE;
+        }
+    }
+
+  _dbus_list_clear (&owned);
+
+  /* The new rules go after the old ones in d->match_rules */
+  n_old_rules = d->n_match_rules;
+
+  for (link = _dbus_list_get_first_link (rules);
+       link != NULL;
+       link = _dbus_list_get_next_link (rules, link))
+    {
+      if (!bus_matchmaker_add_rule (d->connections->monitor_matchmaker,
+                                    link->data))
+        {
+          while (d->n_match_rules > n_old_rules)
+            bus_matchmaker_remove_rule (d->connections->monitor_matchmaker,
+                                        _dbus_list_get_last (&d->match_rules));
+          goto oom;
+        }
+    }
+
+  matchmaker = bus_context_get_matchmaker (d->connections->context);
+  while (n_old_rules-- > 0)
+    bus_matchmaker_remove_rule (matchmaker,
+                                _dbus_list_get_first (&d->match_rules));
+
+  d->link_in_monitors = monitor_link;
+  _dbus_list_append_link (&d->connections->monitors, monitor_link);
+
+  return TRUE;
+
+ oom:
+  _dbus_list_free_link (monitor_link);
+  BUS_SET_OOM (error);
+  return FALSE;
+}
+
+/**
+ * Checks whether the connection has become a monitor.
+ *
+ * @param connection the connection
+ * @returns #TRUE if it called BecomeMonitor
+ */
+dbus_bool_t
+bus_connection_is_monitor (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+
+  return d != NULL && d->link_in_monitors != NULL;
+}
+
+/* Hands the monitor as much of its queue as its socket has room for.
+ * Returns TRUE if anything is left waiting.
+ */
+static dbus_bool_t
+monitor_flush (BusConnectionData *d)
+{
+  DBusMessage *message;
+
+  while ((message = _dbus_list_get_first (&d->monitor_queue)) != NULL &&
+         dbus_connection_get_outgoing_size (d->connection) < MONITOR_OUTGOING_BYTES)
+    {
+      /* no memory; leave it for the timeout */
+      if (!dbus_connection_send (d->connection, message, NULL))
+        break;
+
+      _dbus_list_pop_first (&d->monitor_queue);
+      d->monitor_queue_bytes -= _dbus_message_get_network_size (message);
+      connection_count_outgoing (d, message);
+      dbus_message_unref (message);
+    }
+
+  return d->monitor_queue != NULL;
+}
+
+static void
+monitor_queue_message (BusConnectionData *d,
+                       DBusMessage       *message)
+{
+  if (!dbus_connection_get_is_connected (d->connection))
+    return;
+
+  if (!_dbus_list_append (&d->monitor_queue, message))
+    {
+      d->stats.monitor_dropped += 1;
+      return;
+    }
+
+  dbus_message_ref (message);
+  d->monitor_queue_bytes += _dbus_message_get_network_size (message);
+
+  if (!monitor_flush (d))
+    return;
+
+  /* The newest message always stays, however big it is */
+  while (d->monitor_queue_bytes > MONITOR_QUEUE_MAX_BYTES &&
+         !_dbus_list_length_is_one (&d->monitor_queue))
+    {
+      message = _dbus_list_pop_first (&d->monitor_queue);
+      d->monitor_queue_bytes -= _dbus_message_get_network_size (message);
+      d->stats.monitor_dropped += 1;
+      dbus_message_unref (message);
+    }
+
+  bus_expire_timeout_set_interval (bus_context_get_loop (d->connections->context),
+                                   d->connections->monitor_timeout,
+                                   MONITOR_FLUSH_INTERVAL);
+}
+
+static dbus_bool_t
+monitor_timeout (void *data)
+{
+  BusConnections *connections = data;
+  dbus_bool_t pending;
+  DBusList *link;
+
+  pending = FALSE;
+
+  for (link = _dbus_list_get_first_link (&connections->monitors);
+       link != NULL;
+       link = _dbus_list_get_next_link (&connections->monitors, link))
+    {
+      if (monitor_flush (BUS_CONNECTION_DATA (link->data)))
+        pending = TRUE;
+    }
+
+  if (!pending)
+    bus_expire_timeout_set_interval (bus_context_get_loop (connections->context),
+                                     connections->monitor_timeout, -1);
+
+  return TRUE;
+}
+
+dbus_bool_t
+bus_connection_preallocate_oom_error (DBusConnection *connection)
+{
+  DBusMessage *message;
+  DBusPreallocatedSend *preallocated;
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);  
+
+  _dbus_assert (d != NULL);
 
   if (d->oom_preallocated != NULL)
     return TRUE;
@@ -1201,80 +2429,511 @@ bus_connection_send_oom_error (DBusConnection *connection,
 {
   BusConnectionData *d;
 
-  d = BUS_CONNECTION_DATA (connection);  
+  d = BUS_CONNECTION_DATA (connection);  
+
+  _dbus_assert (d != NULL);  
+  _dbus_assert (d->oom_message != NULL);
+
+  /* should always succeed since we set it to a placeholder earlier */
+  if (!dbus_message_set_reply_serial (d->oom_message,
+                                      dbus_message_get_serial (in_reply_to)))
+    _dbus_assert_not_reached ("Failed to set reply serial for preallocated oom message");
+
+  _dbus_assert (dbus_message_get_sender (d->oom_message) != NULL);
+  
+  connection_count_outgoing (d, d->oom_message);
+  dbus_connection_send_preallocated (connection, d->oom_preallocated,
+                                     d->oom_message, NULL);
+
+  dbus_message_unref (d->oom_message);
+  d->oom_message = NULL;
+  d->oom_preallocated = NULL;
+}
+
+void
+bus_connection_add_match_rule_link (DBusConnection *connection,
+                                    DBusList       *link)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  _dbus_list_append_link (&d->match_rules, link);
+
+  d->n_match_rules += 1;
+  if (bus_match_rule_get_conflate (link->data))
+    d->n_conflating_rules += 1;
+}
+
+void
+bus_connection_remove_match_rule_link (DBusConnection *connection,
+                                       DBusList       *link)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  _dbus_list_unlink (&d->match_rules, link);
+
+  d->n_match_rules -= 1;
+  _dbus_assert (d->n_match_rules >= 0);
+
+  if (bus_match_rule_get_conflate (link->data))
+    d->n_conflating_rules -= 1;
+  _dbus_assert (d->n_conflating_rules >= 0);
+}
+
+/**
+ * Notes that the bus received a message from the connection.
+ *
+ * @param connection the sending connection
+ * @param message the message
+ */
+void
+bus_connection_count_incoming (DBusConnection *connection,
+                               DBusMessage    *message)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  d->stats.incoming_messages += 1;
+  d->stats.incoming_bytes += _dbus_message_get_network_size (message);
+}
+
+/**
+ * Charges the time the bus spent handling a message, from reading it
+ * to queueing whatever it sent on as a result, to the connection that
+ * sent it and to the connection's user.
+ *
+ * @param connection the sending connection
+ * @param usec microseconds spent
+ */
+void
+bus_connection_charge_dispatch (DBusConnection *connection,
+                                long            usec)
+{
+  BusConnectionData *d;
+  unsigned long uid;
+  dbus_uint32_t total;
+
+  /* gone if handling the message disconnected it */
+  d = BUS_CONNECTION_DATA (connection);
+  if (d == NULL || usec <= 0)
+    return;
+
+  d->stats.dispatch_usec += usec;
+
+  /* only connections still counted as completed are charged to
+   * their user, so the user's entry goes when the last one does
+   */
+  if (d->name != NULL && d->link_in_connection_list != NULL &&
+      dbus_connection_get_unix_user (connection, &uid))
+    {
+      total = (dbus_uint32_t)
+        _DBUS_POINTER_TO_INT (_dbus_hash_table_lookup_uintptr (d->connections->dispatch_by_user,
+                                                               uid));
+      total += usec;
+
+      /* if we're out of memory the user just isn't charged this time */
+      _dbus_hash_table_insert_uintptr (d->connections->dispatch_by_user,
+                                       uid, _DBUS_INT_TO_POINTER (total));
+    }
+}
+
+/* Tops the bucket up for the time since it was last used, then takes
+ * n_bytes and one message out of it. Returns how many milliseconds
+ * until it's no longer overdrawn, or 0 if it isn't. A rate of 0 is
+ * no limit.
+ */
+static int
+rate_bucket_take (BusRateBucket *bucket,
+                  long           messages_per_second,
+                  long           bytes_per_second,
+                  long           n_bytes,
+                  long           tv_sec,
+                  long           tv_usec)
+{
+  double elapsed;
+  double wait;
+
+  elapsed = ELAPSED_MILLISECONDS_SINCE (bucket->tv_sec, bucket->tv_usec,
+                                        tv_sec, tv_usec);
+  /* the clock went backwards; assume no time passed */
+  if (elapsed < 0)
+    elapsed = 0;
+
+  bucket->tv_sec = tv_sec;
+  bucket->tv_usec = tv_usec;
+
+  wait = 0;
+
+  if (messages_per_second > 0)
+    {
+      bucket->messages += messages_per_second * elapsed / 1000.0;
+      if (bucket->messages > messages_per_second)
+        bucket->messages = messages_per_second;
+
+      bucket->messages -= 1;
+      if (bucket->messages < 0)
+        wait = MAX (wait, -bucket->messages * 1000.0 / messages_per_second);
+    }
+
+  if (bytes_per_second > 0)
+    {
+      bucket->bytes += bytes_per_second * elapsed / 1000.0;
+      if (bucket->bytes > bytes_per_second)
+        bucket->bytes = bytes_per_second;
+
+      bucket->bytes -= n_bytes;
+      if (bucket->bytes < 0)
+        wait = MAX (wait, -bucket->bytes * 1000.0 / bytes_per_second);
+    }
+
+  if (wait <= 0)
+    return 0;
+  else if (wait >= _DBUS_INT_MAX)
+    return _DBUS_INT_MAX;
+  else
+    return (int) wait + 1;
+}
+
+static dbus_bool_t
+rate_limit_timeout (void *data)
+{
+  DBusConnection *connection = data;
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  bus_expire_timeout_set_interval (bus_context_get_loop (d->connections->context),
+                                   d->rate_timeout, -1);
+
+  _dbus_verbose ("Resuming reading from %s, it is back under its rate limits\n",
+                 d->name ? d->name : "(inactive)");
+
+  d->rate_limited = FALSE;
+  update_reading_paused (connection, d);
+
+  return TRUE;
+}
+
+/* Stop reading from the connection for this many milliseconds. If
+ * memory runs out it simply isn't held off.
+ */
+static void
+hold_off_reading (DBusConnection    *connection,
+                  BusConnectionData *d,
+                  int                milliseconds)
+{
+  DBusLoop *loop;
+
+  loop = bus_context_get_loop (d->connections->context);
+
+  if (d->rate_timeout == NULL)
+    {
+      d->rate_timeout = _dbus_timeout_new (milliseconds, rate_limit_timeout,
+                                           connection, NULL);
+      if (d->rate_timeout == NULL)
+        return;
+
+      _dbus_timeout_set_enabled (d->rate_timeout, FALSE);
+
+      if (!_dbus_loop_add_timeout (loop, d->rate_timeout,
+                                   call_timeout_callback, NULL, NULL))
+        {
+          _dbus_timeout_unref (d->rate_timeout);
+          d->rate_timeout = NULL;
+          return;
+        }
+    }
+
+  bus_expire_timeout_set_interval (loop, d->rate_timeout, milliseconds);
+
+  if (!d->rate_limited)
+    {
+      _dbus_verbose ("Not reading from %s for %d milliseconds, it is over its rate limits\n",
+                     d->name ? d->name : "(inactive)", milliseconds);
+
+      d->rate_limited = TRUE;
+      update_reading_paused (connection, d);
+    }
+}
+
+/**
+ * Charges a message the bus received from the connection to its rate
+ * limits, and to its user's. If either is overdrawn, stops reading
+ * from the connection until they would no longer be. Messages already
+ * read still get dispatched; this just holds off any more.
+ *
+ * @param connection the sending connection
+ * @param message the message
+ */
+void
+bus_connection_limit_rate (DBusConnection *connection,
+                           DBusMessage    *message)
+{
+  BusConnectionData *d;
+  BusContext *context;
+  long messages_per_second;
+  long bytes_per_second;
+  long tv_sec, tv_usec;
+  long n_bytes;
+  int wait;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  context = d->connections->context;
+  wait = 0;
+  n_bytes = _dbus_message_get_network_size (message);
+
+  _dbus_get_current_time (&tv_sec, &tv_usec);
+
+  messages_per_second = bus_context_get_max_messages_per_second (context);
+  bytes_per_second = bus_context_get_max_bytes_per_second (context);
+
+  if (messages_per_second > 0 || bytes_per_second > 0)
+    wait = rate_bucket_take (&d->rate, messages_per_second, bytes_per_second,
+                             n_bytes, tv_sec, tv_usec);
+
+  messages_per_second = bus_context_get_max_messages_per_second_per_user (context);
+  bytes_per_second = bus_context_get_max_bytes_per_second_per_user (context);
+
+  /* only completed connections are counted against their user */
+  if ((messages_per_second > 0 || bytes_per_second > 0) &&
+      d->name != NULL)
+    {
+      BusRateBucket *bucket;
+      unsigned long uid;
+
+      if (dbus_connection_get_unix_user (connection, &uid))
+        {
+          bucket = _dbus_hash_table_lookup_uintptr (d->connections->rate_by_user,
+                                                    uid);
+          if (bucket == NULL)
+            {
+              /* starts out full, as if it had been topped up forever */
+              bucket = dbus_new0 (BusRateBucket, 1);
+              if (bucket != NULL &&
+                  !_dbus_hash_table_insert_uintptr (d->connections->rate_by_user,
+                                                    uid, bucket))
+                {
+                  dbus_free (bucket);
+                  bucket = NULL;
+                }
+            }
+
+          /* if we're out of memory the user just isn't limited this time */
+          if (bucket != NULL)
+            wait = MAX (wait,
+                        rate_bucket_take (bucket, messages_per_second,
+                                          bytes_per_second, n_bytes,
+                                          tv_sec, tv_usec));
+        }
+    }
+
+  if (wait > 0)
+    hold_off_reading (connection, d, wait);
+}
+
+/**
+ * Gets the connection's traffic counters and queue sizes.
+ *
+ * @param connection the connection
+ * @param stats return location for the counters
+ * @param n_replies_to_receive return location for number of replies it is owed
+ * @param n_replies_to_send return location for number of replies it owes
+ */
+void
+bus_connection_get_stats (DBusConnection     *connection,
+                          BusConnectionStats *stats,
+                          int                *n_replies_to_receive,
+                          int                *n_replies_to_send)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  *stats = d->stats;
+  *n_replies_to_receive = d->n_replies_to_receive;
+  *n_replies_to_send = _dbus_list_get_length (&d->replies_to_send);
+}
+
+/**
+ * Stops reading from sender until receiver has written out enough of
+ * its queue: half of the flow_control_outgoing_bytes limit. Called
+ * when sender sends to a receiver whose queue is already at that
+ * limit. If memory runs out the sender simply isn't paused.
+ *
+ * @param receiver the connection whose queue is full
+ * @param sender the connection sending to it
+ */
+void
+bus_connection_pause_sender (DBusConnection *receiver,
+                             DBusConnection *sender)
+{
+  BusConnectionData *r;
+  BusConnectionData *s;
+  long low_water;
+
+  if (receiver == sender)
+    return;
+
+  r = BUS_CONNECTION_DATA (receiver);
+  s = BUS_CONNECTION_DATA (sender);
+  _dbus_assert (r != NULL);
+  _dbus_assert (s != NULL);
+
+  if (_dbus_list_find_last (&r->paused_senders, sender) != NULL)
+    return;
+
+  if (!_dbus_list_append (&r->paused_senders, sender))
+    return;
+
+  if (!_dbus_list_append (&s->pausing_receivers, receiver))
+    {
+      _dbus_list_remove_last (&r->paused_senders, sender);
+      return;
+    }
+
+  if (r->paused_senders->next == r->paused_senders)
+    {
+      low_water = bus_context_get_flow_control_outgoing_bytes (r->connections->context) / 2;
+      _dbus_connection_set_outgoing_drained_function (receiver,
+                                                      MAX (low_water, 1),
+                                                      receiver_drained, r);
+    }
+
+  if (s->pausing_receivers->next == s->pausing_receivers)
+    {
+      _dbus_verbose ("Pausing reading from %s, %s has a full queue\n",
+                     s->name ? s->name : "(inactive)",
+                     r->name ? r->name : "(inactive)");
+      update_reading_paused (sender, s);
+    }
+}
+
+/* The returned list of BusMatchRule must not be modified by the caller */
+DBusList **
+bus_connection_get_match_rules (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
 
-  _dbus_assert (d != NULL);  
-  _dbus_assert (d->oom_message != NULL);
+  return &d->match_rules;
+}
 
-  /* should always succeed since we set it to a placeholder earlier */
-  if (!dbus_message_set_reply_serial (d->oom_message,
-                                      dbus_message_get_serial (in_reply_to)))
-    _dbus_assert_not_reached ("Failed to set reply serial for preallocated oom message");
+int
+bus_connection_get_n_match_rules (DBusConnection *connection)
+{
+  BusConnectionData *d;
 
-  _dbus_assert (dbus_message_get_sender (d->oom_message) != NULL);
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
   
-  dbus_connection_send_preallocated (connection, d->oom_preallocated,
-                                     d->oom_message, NULL);
-
-  dbus_message_unref (d->oom_message);
-  d->oom_message = NULL;
-  d->oom_preallocated = NULL;
+  return d->n_match_rules;
 }
 
-void
-bus_connection_add_match_rule_link (DBusConnection *connection,
-                                    DBusList       *link)
+dbus_bool_t
+bus_connection_has_conflating_rules (DBusConnection *connection)
 {
   BusConnectionData *d;
 
   d = BUS_CONNECTION_DATA (connection);
   _dbus_assert (d != NULL);
 
-  _dbus_list_append_link (&d->match_rules, link);
-
-  d->n_match_rules += 1;
+  return d->n_conflating_rules > 0;
 }
 
-dbus_bool_t
-bus_connection_add_match_rule (DBusConnection *connection,
-                               BusMatchRule   *rule)
+/* Gives the connection priority in the main loop and in recipients'
+ * queues if its user is a priority_user, or it owns or is queued for
+ * a priority_name, and takes it away otherwise
+ */
+static void
+update_priority (BusConnectionData *d)
 {
-    DBusList *link;
+  BusContext *context;
+  dbus_bool_t priority;
+  unsigned long uid;
+  DBusList *link;
 
-  link = _dbus_list_alloc_link (rule);
+  context = d->connections->context;
 
-  if (link == NULL)
-    return FALSE;
+  priority = dbus_connection_get_unix_user (d->connection, &uid) &&
+    bus_context_get_priority_uid (context, uid);
 
-  bus_connection_add_match_rule_link (connection, link);
+  for (link = _dbus_list_get_first_link (&d->services_owned);
+       link != NULL && !priority;
+       link = _dbus_list_get_next_link (&d->services_owned, link))
+    {
+      if (bus_context_get_priority_name (context,
+                                         bus_service_get_name (link->data)))
+        priority = TRUE;
+    }
 
-  return TRUE;
+  if (priority != d->priority)
+    {
+      _dbus_verbose ("%s %s priority\n",
+                     d->name ? d->name : "(inactive)",
+                     priority ? "gets" : "loses");
+      d->priority = priority;
+      _dbus_connection_set_priority (d->connection, priority);
+    }
 }
 
-void
-bus_connection_remove_match_rule (DBusConnection *connection,
-                                  BusMatchRule   *rule)
+static dbus_bool_t
+update_connection_priority (DBusConnection *connection,
+                            void           *data)
 {
   BusConnectionData *d;
 
   d = BUS_CONNECTION_DATA (connection);
   _dbus_assert (d != NULL);
 
-  _dbus_list_remove_last (&d->match_rules, rule);
+  _dbus_connection_set_max_priority_outgoing_size (connection,
+                                                   bus_context_get_max_priority_outgoing_bytes (d->connections->context));
+  update_priority (d);
 
-  d->n_match_rules -= 1;
-  _dbus_assert (d->n_match_rules >= 0);
+  return TRUE;
 }
 
-int
-bus_connection_get_n_match_rules (DBusConnection *connection)
+/**
+ * Applies the priority_user and priority_name elements and the
+ * max_priority_outgoing_bytes limit of a reloaded configuration to
+ * the connections already there.
+ *
+ * @param connections the connections object
+ */
+void
+bus_connections_update_priority (BusConnections *connections)
+{
+  foreach_active (connections, update_connection_priority, NULL);
+}
+
+/**
+ * Whether messages from the connection go ahead of others, because
+ * it is a priority_user or a priority_name.
+ *
+ * @param connection the connection
+ * @returns #TRUE if it has priority
+ */
+dbus_bool_t
+bus_connection_has_priority (DBusConnection *connection)
 {
   BusConnectionData *d;
 
   d = BUS_CONNECTION_DATA (connection);
   _dbus_assert (d != NULL);
-  
-  return d->n_match_rules;
+
+  return d->priority;
 }
 
 void
@@ -1289,6 +2948,9 @@ bus_connection_add_owned_service_link (DBusConnection *connection,
   _dbus_list_append_link (&d->services_owned, link);
 
   d->n_services_owned += 1;
+
+  if (!d->priority)
+    update_priority (d);
 }
 
 dbus_bool_t
@@ -1320,6 +2982,9 @@ bus_connection_remove_owned_service (DBusConnection *connection,
 
   d->n_services_owned -= 1;
   _dbus_assert (d->n_services_owned >= 0);
+
+  if (d->priority)
+    update_priority (d);
 }
 
 int
@@ -1333,12 +2998,27 @@ bus_connection_get_n_services_owned (DBusConnection *connection)
   return d->n_services_owned;
 }
 
+/* The returned list of BusService includes names the connection is only
+ * queued for, and must not be modified by the caller.
+ */
+DBusList **
+bus_connection_get_owned_services (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  return &d->services_owned;
+}
+
 dbus_bool_t
 bus_connection_complete (DBusConnection   *connection,
 			 const DBusString *name,
                          DBusError        *error)
 {
   BusConnectionData *d;
+  dbus_bool_t have_uid;
   unsigned long uid;
   
   d = BUS_CONNECTION_DATA (connection);
@@ -1358,6 +3038,7 @@ bus_connection_complete (DBusConnection   *connection,
   
   _dbus_verbose ("Name %s assigned to %p\n", d->name, connection);
 
+  d->policy_generation = bus_context_get_policy_generation (d->connections->context);
   d->policy = bus_context_create_client_policy (d->connections->context,
                                                 connection,
                                                 error);
@@ -1404,6 +3085,30 @@ bus_connection_complete (DBusConnection   *connection,
   /* See if we can remove the timeout */
   bus_connections_expire_incomplete (d->connections);
 
+  have_uid = dbus_connection_get_unix_user (connection, &uid);
+
+  d->trusts_bodies = have_uid &&
+    bus_context_get_trusts_message_bodies (d->connections->context, uid);
+
+  if (d->trusts_bodies)
+    _dbus_verbose ("Not validating message bodies from %s (uid %lu) unless we read them\n",
+                   d->name, uid);
+
+  /* Only headers are needed for routing; the bodies of messages we
+   * pass on are checked by bus_connection_check_message_body() once
+   * they have been routed, if at all
+   */
+  _dbus_connection_set_trust_message_bodies (connection, TRUE);
+
+  /* Likewise nothing needs them in our byte order */
+  _dbus_connection_set_keep_byte_order (connection, TRUE);
+
+  _dbus_connection_set_dispatch_weight (connection,
+                                        bus_context_get_dispatch_weight (d->connections->context,
+                                                                         have_uid, uid));
+
+  update_connection_priority (connection, NULL);
+
   _dbus_assert (bus_connection_is_active (connection));
   
   return TRUE;
@@ -1480,6 +3185,146 @@ bus_pending_reply_free (BusPendingReply *pending)
   dbus_free (pending);
 }
 
+/* Serials alone collide all the time, since every client counts
+ * from 1, so mix in the receiving connection.
+ */
+static uintptr_t
+pending_reply_key (DBusConnection *will_get_reply,
+                   dbus_uint32_t   reply_serial)
+{
+  return ((uintptr_t) will_get_reply) ^ ((uintptr_t) reply_serial * 2654435761u);
+}
+
+static BusPendingReply*
+bus_connections_find_pending_reply (BusConnections *connections,
+                                    DBusConnection *will_get_reply,
+                                    DBusConnection *will_send_reply,
+                                    dbus_uint32_t   reply_serial)
+{
+  BusPendingReply *pending;
+
+  pending = _dbus_hash_table_lookup_uintptr (connections->pending_replies_by_key,
+                                             pending_reply_key (will_get_reply,
+                                                                reply_serial));
+  while (pending != NULL)
+    {
+      if (pending->reply_serial == reply_serial &&
+          pending->will_get_reply == will_get_reply &&
+          pending->will_send_reply == will_send_reply &&
+          !pending->in_transaction)
+        return pending;
+
+      pending = pending->next_with_key;
+    }
+
+  return NULL;
+}
+
+/* Indexes a new pending reply by key and in both connections' lists */
+static dbus_bool_t
+bus_connections_index_pending_reply (BusConnections  *connections,
+                                     BusPendingReply *pending)
+{
+  BusConnectionData *receiver;
+  BusConnectionData *replier;
+  BusPendingReply *first;
+  uintptr_t key;
+
+  receiver = BUS_CONNECTION_DATA (pending->will_get_reply);
+  replier = BUS_CONNECTION_DATA (pending->will_send_reply);
+  _dbus_assert (receiver != NULL);
+  _dbus_assert (replier != NULL);
+
+  pending->link_in_receiver_list = _dbus_list_alloc_link (pending);
+  if (pending->link_in_receiver_list == NULL)
+    goto failed;
+
+  pending->link_in_replier_list = _dbus_list_alloc_link (pending);
+  if (pending->link_in_replier_list == NULL)
+    goto failed;
+
+  key = pending_reply_key (pending->will_get_reply, pending->reply_serial);
+  first = _dbus_hash_table_lookup_uintptr (connections->pending_replies_by_key,
+                                           key);
+  if (first != NULL)
+    {
+      pending->next_with_key = first->next_with_key;
+      first->next_with_key = pending;
+    }
+  else if (!_dbus_hash_table_insert_uintptr (connections->pending_replies_by_key,
+                                             key, pending))
+    goto failed;
+
+  _dbus_list_append_link (&receiver->replies_to_receive,
+                          pending->link_in_receiver_list);
+  receiver->n_replies_to_receive += 1;
+  _dbus_list_append_link (&replier->replies_to_send,
+                          pending->link_in_replier_list);
+
+  return TRUE;
+
+ failed:
+  if (pending->link_in_receiver_list)
+    _dbus_list_free_link (pending->link_in_receiver_list);
+  if (pending->link_in_replier_list)
+    _dbus_list_free_link (pending->link_in_replier_list);
+  pending->link_in_receiver_list = NULL;
+  pending->link_in_replier_list = NULL;
+  return FALSE;
+}
+
+/* Undoes bus_connections_index_pending_reply(); never fails */
+static void
+bus_connections_unindex_pending_reply (BusConnections  *connections,
+                                       BusPendingReply *pending)
+{
+  BusConnectionData *receiver;
+  DBusHashIter iter;
+  BusPendingReply *first;
+  uintptr_t key;
+
+  key = pending_reply_key (pending->will_get_reply, pending->reply_serial);
+  if (!_dbus_hash_iter_lookup (connections->pending_replies_by_key,
+                               (void*) key, FALSE, &iter))
+    _dbus_assert_not_reached ("pending reply was not indexed");
+
+  first = _dbus_hash_iter_get_value (&iter);
+  if (first == pending)
+    {
+      if (pending->next_with_key != NULL)
+        _dbus_hash_iter_set_value (&iter, pending->next_with_key);
+      else
+        _dbus_hash_iter_remove_entry (&iter);
+    }
+  else
+    {
+      while (first->next_with_key != pending)
+        {
+          first = first->next_with_key;
+          _dbus_assert (first != NULL);
+        }
+      first->next_with_key = pending->next_with_key;
+    }
+  pending->next_with_key = NULL;
+
+  receiver = BUS_CONNECTION_DATA (pending->will_get_reply);
+  _dbus_list_remove_link (&receiver->replies_to_receive,
+                          pending->link_in_receiver_list);
+  pending->link_in_receiver_list = NULL;
+  receiver->n_replies_to_receive -= 1;
+  _dbus_assert (receiver->n_replies_to_receive >= 0);
+
+  if (pending->link_in_replier_list != NULL)
+    {
+      BusConnectionData *replier;
+
+      replier = BUS_CONNECTION_DATA (pending->will_send_reply);
+      _dbus_list_remove_link (&replier->replies_to_send,
+                              pending->link_in_replier_list);
+      pending->link_in_replier_list = NULL;
+    }
+}
+
 static dbus_bool_t
 bus_pending_reply_send_no_reply (BusConnections  *connections,
                                  BusTransaction  *transaction,
@@ -1555,6 +3400,7 @@ bus_pending_reply_expired (BusExpireList *list,
     }
 
   bus_expire_list_remove_link (connections->pending_replies, link);
+  bus_connections_unindex_pending_reply (connections, pending);
 
   bus_pending_reply_free (pending);
   bus_transaction_execute_and_free (transaction);
@@ -1569,54 +3415,77 @@ bus_connection_drop_pending_replies (BusConnections  *connections,
   /* The DBusConnection is almost 100% finalized here, so you can't
    * do anything with it except check for pointer equality
    */
+  BusConnectionData *d;
   DBusList *link;
 
   _dbus_verbose ("Dropping pending replies that involve connection %p\n",
                  connection);
-  
-  link = bus_expire_list_get_first_link (connections->pending_replies);
-  while (link != NULL)
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  while ((link = _dbus_list_get_first_link (&d->replies_to_receive)) != NULL)
     {
-      DBusList *next;
-      BusPendingReply *pending;
+      BusPendingReply *pending = link->data;
 
-      next = bus_expire_list_get_next_link (connections->pending_replies,
-                                            link);
-      pending = link->data;
+      /* We don't need to track this pending reply anymore */
 
-      if (pending->will_get_reply == connection)
-        {
-          /* We don't need to track this pending reply anymore */
+      _dbus_verbose ("Dropping pending reply %p, replier %p receiver %p serial %u\n",
+                     pending,
+                     pending->will_send_reply,
+                     pending->will_get_reply,
+                     pending->reply_serial);
 
-          _dbus_verbose ("Dropping pending reply %p, replier %p receiver %p serial %u\n",
-                         pending,
-                         pending->will_send_reply,
-                         pending->will_get_reply,
-                         pending->reply_serial);
-          
+      bus_connections_unindex_pending_reply (connections, pending);
+
+      if (pending->in_transaction)
+        {
+          /* A reply to it is in flight; the transaction owns it, and
+           * must not put it back if it's cancelled.
+           */
+          pending->dropped = TRUE;
+        }
+      else
+        {
           bus_expire_list_remove_link (connections->pending_replies,
-                                       link);
+                                       pending->expire_link);
           bus_pending_reply_free (pending);
         }
-      else if (pending->will_send_reply == connection)
-        {
-          /* The reply isn't going to be sent, so set things
-           * up so it will be expired right away
-           */
-          _dbus_verbose ("Will expire pending reply %p, replier %p receiver %p serial %u\n",
-                         pending,
-                         pending->will_send_reply,
-                         pending->will_get_reply,
-                         pending->reply_serial);
-          
-          pending->will_send_reply = NULL;
-          pending->expire_item.added_tv_sec = 0;
-          pending->expire_item.added_tv_usec = 0;
+    }
+
+  while ((link = _dbus_list_get_first_link (&d->replies_to_send)) != NULL)
+    {
+      BusPendingReply *pending = link->data;
 
-          bus_expire_list_recheck_immediately (connections->pending_replies);
+      /* The reply isn't going to be sent, so set things
+       * up so it will be expired right away
+       */
+      _dbus_verbose ("Will expire pending reply %p, replier %p receiver %p serial %u\n",
+                     pending,
+                     pending->will_send_reply,
+                     pending->will_get_reply,
+                     pending->reply_serial);
+
+      _dbus_list_remove_link (&d->replies_to_send, link);
+      pending->link_in_replier_list = NULL;
+
+      pending->will_send_reply = NULL;
+      pending->expire_item.added_tv_sec = 0;
+      pending->expire_item.added_tv_usec = 0;
+
+      /* Move it to the front of the list, where expiring starts; if
+       * it's off the list for a reply in flight, it goes there when
+       * it's put back.
+       */
+      if (!pending->in_transaction)
+        {
+          bus_expire_list_unlink (connections->pending_replies,
+                                  pending->expire_link);
+          bus_expire_list_add_link (connections->pending_replies,
+                                    pending->expire_link);
         }
-      
-      link = next;
+
+      bus_expire_list_recheck_immediately (connections->pending_replies);
     }
 }
 
@@ -1634,26 +3503,14 @@ cancel_pending_reply (void *data)
 
   _dbus_verbose ("d = %p\n", d);
   
-  if (!bus_expire_list_remove (d->connections->pending_replies,
-                               &d->pending->expire_item))
-    _dbus_assert_not_reached ("pending reply did not exist to be cancelled");
-
-  bus_pending_reply_free (d->pending); /* since it's been cancelled */
-}
+  _dbus_assert (bus_expire_list_contains_item (d->connections->pending_replies,
+                                               &d->pending->expire_item));
 
-static void
-cancel_pending_reply_data_free (void *data)
-{
-  CancelPendingReplyData *d = data;
+  bus_expire_list_remove_link (d->connections->pending_replies,
+                               d->pending->expire_link);
+  bus_connections_unindex_pending_reply (d->connections, d->pending);
 
-  _dbus_verbose ("d = %p\n", d);
-  
-  /* d->pending should be either freed or still
-   * in the list of pending replies (owned by someone
-   * else)
-   */
-  
-  dbus_free (d);
+  bus_pending_reply_free (d->pending); /* since it's been cancelled */
 }
 
 /*
@@ -1669,9 +3526,8 @@ bus_connections_expect_reply (BusConnections  *connections,
 {
   BusPendingReply *pending;
   dbus_uint32_t reply_serial;
-  DBusList *link;
   CancelPendingReplyData *cprd;
-  int count;
+  BusConnectionData *d;
 
   _dbus_assert (will_get_reply != NULL);
   _dbus_assert (will_send_reply != NULL);
@@ -1682,28 +3538,18 @@ bus_connections_expect_reply (BusConnections  *connections,
   
   reply_serial = dbus_message_get_serial (reply_to_this);
 
-  link = bus_expire_list_get_first_link (connections->pending_replies);
-  count = 0;
-  while (link != NULL)
+  if (bus_connections_find_pending_reply (connections, will_get_reply,
+                                          will_send_reply, reply_serial))
     {
-      pending = link->data;
-
-      if (pending->reply_serial == reply_serial &&
-          pending->will_get_reply == will_get_reply &&
-          pending->will_send_reply == will_send_reply)
-        {
-          dbus_set_error (error, DBUS_ERROR_ACCESS_DENIED,
-                          "Message has the same reply serial as a currently-outstanding existing method call");
-          return FALSE;
-        }
-      
-      link = bus_expire_list_get_next_link (connections->pending_replies,
-                                            link);
-      if (pending->will_get_reply == will_get_reply)
-        ++count;
+      dbus_set_error (error, DBUS_ERROR_ACCESS_DENIED,
+                      "Message has the same reply serial as a currently-outstanding existing method call");
+      return FALSE;
     }
+
+  d = BUS_CONNECTION_DATA (will_get_reply);
+  _dbus_assert (d != NULL);
   
-  if (count >=
+  if (d->n_replies_to_receive >=
       bus_context_get_max_replies_per_connection (connections->context))
     {
       dbus_set_error (error, DBUS_ERROR_LIMITS_EXCEEDED,
@@ -1711,64 +3557,164 @@ bus_connections_expect_reply (BusConnections  *connections,
       return FALSE;
     }
 
-  pending = dbus_new0 (BusPendingReply, 1);
-  if (pending == NULL)
+  pending = dbus_new0 (BusPendingReply, 1);
+  if (pending == NULL)
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+#ifdef DBUS_ENABLE_VERBOSE_MODE
+  /* so we can see a not-yet-added pending reply */
+  pending->expire_item.added_tv_sec = 1;
+  pending->expire_item.added_tv_usec = 1;
+#endif
+
+  pending->will_get_reply = will_get_reply;
+  pending->will_send_reply = will_send_reply;
+  pending->reply_serial = reply_serial;
+  
+  cprd = bus_transaction_alloc (transaction, sizeof (CancelPendingReplyData));
+  if (cprd == NULL)
+    {
+      BUS_SET_OOM (error);
+      bus_pending_reply_free (pending);
+      return FALSE;
+    }
+  
+  pending->expire_link = _dbus_list_alloc_link (&pending->expire_item);
+  if (pending->expire_link == NULL)
+    {
+      BUS_SET_OOM (error);
+      bus_pending_reply_free (pending);
+      return FALSE;
+    }
+
+  if (!bus_connections_index_pending_reply (connections, pending))
+    {
+      BUS_SET_OOM (error);
+      _dbus_list_free_link (pending->expire_link);
+      bus_pending_reply_free (pending);
+      return FALSE;
+    }
+
+  /* the expire list is kept in the order things were added */
+  _dbus_get_current_time (&pending->expire_item.added_tv_sec,
+                          &pending->expire_item.added_tv_usec);
+
+  bus_expire_list_add_link (connections->pending_replies,
+                            pending->expire_link);
+
+  if (!bus_transaction_add_cancel_hook (transaction,
+                                        cancel_pending_reply,
+                                        cprd,
+                                        NULL))
+    {
+      BUS_SET_OOM (error);
+      bus_expire_list_remove_link (connections->pending_replies,
+                                   pending->expire_link);
+      bus_connections_unindex_pending_reply (connections, pending);
+      bus_pending_reply_free (pending);
+      return FALSE;
+    }
+                                        
+  cprd->pending = pending;
+  cprd->connections = connections;
+
+  _dbus_verbose ("Added pending reply %p, replier %p receiver %p serial %u\n",
+                 pending,
+                 pending->will_send_reply,
+                 pending->will_get_reply,
+                 pending->reply_serial);
+  
+  return TRUE;
+}
+
+/**
+ * Calls function for each reply the connection is waiting for from a
+ * connection that is still there to send it, oldest first; if the
+ * function returns #FALSE, stops iterating.
+ *
+ * @param connection the connection that will get the replies
+ * @param function the function
+ * @param data data to pass to it as the last arg
+ * @returns #FALSE if the function did
+ */
+dbus_bool_t
+bus_connection_foreach_reply_to_receive (DBusConnection                *connection,
+                                         BusPendingReplyForeachFunction function,
+                                         void                          *data)
+{
+  BusConnectionData *d;
+  DBusList *link;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  for (link = _dbus_list_get_first_link (&d->replies_to_receive);
+       link != NULL;
+       link = _dbus_list_get_next_link (&d->replies_to_receive, link))
     {
-      BUS_SET_OOM (error);
-      return FALSE;
+      BusPendingReply *pending = link->data;
+
+      /* about to be expired */
+      if (pending->will_send_reply == NULL)
+        continue;
+
+      if (!(* function) (pending->will_send_reply, pending->reply_serial, data))
+        return FALSE;
     }
 
-#ifdef DBUS_ENABLE_VERBOSE_MODE
-  /* so we can see a not-yet-added pending reply */
-  pending->expire_item.added_tv_sec = 1;
-  pending->expire_item.added_tv_usec = 1;
-#endif
+  return TRUE;
+}
+
+/**
+ * Records that a reply is allowed, outside any transaction, for a
+ * call made through a previous bus that handed both connections over
+ * to us. It times out as if the call had just been made.
+ *
+ * @param connections the connections object
+ * @param will_get_reply the connection that made the call
+ * @param will_send_reply the connection that owes the reply
+ * @param reply_serial the serial of the call
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+bus_connections_restore_reply (BusConnections *connections,
+                               DBusConnection *will_get_reply,
+                               DBusConnection *will_send_reply,
+                               dbus_uint32_t   reply_serial)
+{
+  BusPendingReply *pending;
+
+  pending = dbus_new0 (BusPendingReply, 1);
+  if (pending == NULL)
+    return FALSE;
 
   pending->will_get_reply = will_get_reply;
   pending->will_send_reply = will_send_reply;
   pending->reply_serial = reply_serial;
-  
-  cprd = dbus_new0 (CancelPendingReplyData, 1);
-  if (cprd == NULL)
-    {
-      BUS_SET_OOM (error);
-      bus_pending_reply_free (pending);
-      return FALSE;
-    }
-  
-  if (!bus_expire_list_add (connections->pending_replies,
-                            &pending->expire_item))
+
+  pending->expire_link = _dbus_list_alloc_link (&pending->expire_item);
+  if (pending->expire_link == NULL)
     {
-      BUS_SET_OOM (error);
-      dbus_free (cprd);
       bus_pending_reply_free (pending);
       return FALSE;
     }
 
-  if (!bus_transaction_add_cancel_hook (transaction,
-                                        cancel_pending_reply,
-                                        cprd,
-                                        cancel_pending_reply_data_free))
+  if (!bus_connections_index_pending_reply (connections, pending))
     {
-      BUS_SET_OOM (error);
-      bus_expire_list_remove (connections->pending_replies, &pending->expire_item);
-      dbus_free (cprd);
+      _dbus_list_free_link (pending->expire_link);
       bus_pending_reply_free (pending);
       return FALSE;
     }
-                                        
-  cprd->pending = pending;
-  cprd->connections = connections;
-  
+
   _dbus_get_current_time (&pending->expire_item.added_tv_sec,
                           &pending->expire_item.added_tv_usec);
 
-  _dbus_verbose ("Added pending reply %p, replier %p receiver %p serial %u\n",
-                 pending,
-                 pending->will_send_reply,
-                 pending->will_get_reply,
-                 pending->reply_serial);
-  
+  bus_expire_list_add_link (connections->pending_replies,
+                            pending->expire_link);
+
   return TRUE;
 }
 
@@ -1783,8 +3729,15 @@ cancel_check_pending_reply (void *data)
 {
   CheckPendingReplyData *d = data;
 
+  BusPendingReply *pending = d->link->data;
+
   _dbus_verbose ("d = %p\n",d);
 
+  /* If the receiver disconnected meanwhile, the reply is freed with d */
+  if (pending->dropped)
+    return;
+
+  pending->in_transaction = FALSE;
   bus_expire_list_add_link (d->connections->pending_replies,
                             d->link);
   d->link = NULL;
@@ -1803,12 +3756,13 @@ check_pending_reply_data_free (void *data)
       
       _dbus_assert (!bus_expire_list_contains_item (d->connections->pending_replies,
                                                     &pending->expire_item));
+
+      if (!pending->dropped)
+        bus_connections_unindex_pending_reply (d->connections, pending);
       
       bus_pending_reply_free (pending);
       _dbus_list_free_link (d->link);
     }
-  
-  dbus_free (d);
 }
 
 /*
@@ -1824,6 +3778,7 @@ bus_connections_check_reply (BusConnections *connections,
                              DBusError      *error)
 {
   CheckPendingReplyData *cprd;
+  BusPendingReply *pending;
   DBusList *link;
   dbus_uint32_t reply_serial;
   
@@ -1832,31 +3787,19 @@ bus_connections_check_reply (BusConnections *connections,
 
   reply_serial = dbus_message_get_reply_serial (reply);
 
-  link = bus_expire_list_get_first_link (connections->pending_replies);
-  while (link != NULL)
-    {
-      BusPendingReply *pending = link->data;
-
-      if (pending->reply_serial == reply_serial &&
-          pending->will_get_reply == receiving_reply &&
-          pending->will_send_reply == sending_reply)
-        {
-          _dbus_verbose ("Found pending reply with serial %u\n", reply_serial);
-          break;
-        }
-      
-      link = bus_expire_list_get_next_link (connections->pending_replies,
-                                            link);
-    }
-
-  if (link == NULL)
+  pending = bus_connections_find_pending_reply (connections, receiving_reply,
+                                                sending_reply, reply_serial);
+  if (pending == NULL)
     {
       _dbus_verbose ("No pending reply expected\n");
 
       return FALSE;
     }
 
-  cprd = dbus_new0 (CheckPendingReplyData, 1);
+  _dbus_verbose ("Found pending reply with serial %u\n", reply_serial);
+  link = pending->expire_link;
+
+  cprd = bus_transaction_alloc (transaction, sizeof (CheckPendingReplyData));
   if (cprd == NULL)
     {
       BUS_SET_OOM (error);
@@ -1869,13 +3812,13 @@ bus_connections_check_reply (BusConnections *connections,
                                         check_pending_reply_data_free))
     {
       BUS_SET_OOM (error);
-      dbus_free (cprd);
       return FALSE;
     }
 
   cprd->link = link;
   cprd->connections = connections;
   
+  pending->in_transaction = TRUE;
   bus_expire_list_unlink (connections->pending_replies,
                           link);
   
@@ -1891,13 +3834,6 @@ bus_connections_check_reply (BusConnections *connections,
  * one transaction across any main loop iterations.
  */
 
-typedef struct
-{
-  BusTransaction *transaction;
-  DBusMessage    *message;
-  DBusPreallocatedSend *preallocated;
-} MessageToSend;
-
 typedef struct
 {
   BusTransactionCancelFunction cancel_function;
@@ -1905,24 +3841,53 @@ typedef struct
   void *data;
 } CancelHook;
 
-struct BusTransaction
+/* A message for the monitors whose rules it matched, held back until
+ * the transaction is executed
+ */
+typedef struct
 {
-  DBusList *connections;
-  BusContext *context;
-  DBusList *cancel_hooks;
-};
+  DBusMessage *message;
+  DBusConnection **monitors;
+  int n_monitors;
+} CapturedMessage;
+
+static void
+captured_message_free (CapturedMessage *captured)
+{
+  int i;
+
+  for (i = 0; i < captured->n_monitors; i++)
+    dbus_connection_unref (captured->monitors[i]);
+
+  dbus_free (captured->monitors);
+  dbus_message_unref (captured->message);
+  dbus_free (captured);
+}
+
+static void
+free_captured (BusTransaction *transaction)
+{
+  CapturedMessage *captured;
+
+  while ((captured = _dbus_list_pop_first (&transaction->captured)))
+    captured_message_free (captured);
+}
 
 static void
 message_to_send_free (DBusConnection *connection,
                       MessageToSend  *to_send)
 {
+  BusConnections *connections;
+
+  connections = bus_transaction_get_connections (to_send->transaction);
+
   if (to_send->message)
     dbus_message_unref (to_send->message);
 
   if (to_send->preallocated)
     dbus_connection_free_preallocated_send (connection, to_send->preallocated);
 
-  dbus_free (to_send);
+  _dbus_mem_pool_dealloc (connections->to_send_pool, to_send);
 }
 
 static void
@@ -1945,8 +3910,6 @@ cancel_hook_free (void *element,
 
   if (ch->free_data_function)
     (* ch->free_data_function) (ch->data);
-
-  dbus_free (ch);
 }
 
 static void
@@ -1958,12 +3921,19 @@ free_cancel_hooks (BusTransaction *transaction)
   _dbus_list_clear (&transaction->cancel_hooks);
 }
 
+/* Every message dispatched gets a transaction, and every recipient a
+ * MessageToSend, so both come from pools kept by BusConnections
+ * rather than from malloc.
+ */
 BusTransaction*
 bus_transaction_new (BusContext *context)
 {
+  BusConnections *connections;
   BusTransaction *transaction;
 
-  transaction = dbus_new0 (BusTransaction, 1);
+  connections = bus_context_get_connections (context);
+
+  transaction = _dbus_mem_pool_alloc (connections->transaction_pool);
   if (transaction == NULL)
     return NULL;
 
@@ -1972,6 +3942,20 @@ bus_transaction_new (BusContext *context)
   return transaction;
 }
 
+static void
+transaction_free (BusTransaction *transaction)
+{
+  BusConnections *connections;
+
+  connections = bus_transaction_get_connections (transaction);
+
+  _dbus_list_foreach (&transaction->scratch_overflow,
+                      (DBusForeachFunction) dbus_free, NULL);
+  _dbus_list_clear (&transaction->scratch_overflow);
+
+  _dbus_mem_pool_dealloc (connections->transaction_pool, transaction);
+}
+
 BusContext*
 bus_transaction_get_context (BusTransaction  *transaction)
 {
@@ -2022,13 +4006,87 @@ bus_transaction_send_from_driver (BusTransaction *transaction,
                                           NULL, connection, connection, message, NULL))
     return TRUE;
 
+  if (!bus_transaction_capture (transaction, NULL, connection, message))
+    return FALSE;
+
   return bus_transaction_send (transaction, connection, message);
 }
 
+/**
+ * Gives a copy of a message going through the bus to each monitor
+ * whose rules match it, when the transaction is executed. Does nothing
+ * and costs nothing while there are no monitors.
+ *
+ * @param transaction the transaction
+ * @param sender the sending connection, or #NULL for the bus driver
+ * @param addressed_recipient the destination connection, which is left
+ *  out, or #NULL
+ * @param message the message
+ * @returns #FALSE if not enough memory
+ */
 dbus_bool_t
-bus_transaction_send (BusTransaction *transaction,
-                      DBusConnection *connection,
-                      DBusMessage    *message)
+bus_transaction_capture (BusTransaction *transaction,
+                         DBusConnection *sender,
+                         DBusConnection *addressed_recipient,
+                         DBusMessage    *message)
+{
+  BusConnections *connections;
+  CapturedMessage *captured;
+  DBusConnection **recipients;
+  int n_recipients;
+  int i;
+
+  connections = bus_context_get_connections (transaction->context);
+
+  if (connections->monitors == NULL)
+    return TRUE;
+
+  if (!bus_matchmaker_get_recipients (connections->monitor_matchmaker,
+                                      connections, sender,
+                                      addressed_recipient, message,
+                                      &recipients, &n_recipients))
+    return FALSE;
+
+  if (n_recipients == 0)
+    {
+      bus_matchmaker_release_recipients (connections->monitor_matchmaker,
+                                         recipients);
+      return TRUE;
+    }
+
+  captured = dbus_new0 (CapturedMessage, 1);
+  if (captured == NULL)
+    goto oom;
+
+  captured->monitors = dbus_new (DBusConnection *, n_recipients);
+  if (captured->monitors == NULL ||
+      !_dbus_list_append (&transaction->captured, captured))
+    {
+      dbus_free (captured->monitors);
+      dbus_free (captured);
+      goto oom;
+    }
+
+  for (i = 0; i < n_recipients; i++)
+    captured->monitors[i] = dbus_connection_ref (recipients[i]);
+  captured->n_monitors = n_recipients;
+  captured->message = dbus_message_ref (message);
+
+  bus_matchmaker_release_recipients (connections->monitor_matchmaker,
+                                     recipients);
+  return TRUE;
+
+ oom:
+  bus_matchmaker_release_recipients (connections->monitor_matchmaker,
+                                     recipients);
+  return FALSE;
+}
+
+static dbus_bool_t
+transaction_send (BusTransaction *transaction,
+                  DBusConnection *connection,
+                  DBusMessage    *message,
+                  dbus_bool_t     conflate)
 {
   MessageToSend *to_send;
   BusConnectionData *d;
@@ -2047,6 +4105,8 @@ bus_transaction_send (BusTransaction *transaction,
                  dbus_connection_get_is_connected (connection) ?
                  "" : " (disconnected)");
 
+  _dbus_trace2 (bus__route, connection, message);
+
   _dbus_assert (dbus_message_get_sender (message) != NULL);
   
   if (!dbus_connection_get_is_connected (connection))
@@ -2055,22 +4115,24 @@ bus_transaction_send (BusTransaction *transaction,
   d = BUS_CONNECTION_DATA (connection);
   _dbus_assert (d != NULL);
   
-  to_send = dbus_new (MessageToSend, 1);
+  to_send = _dbus_mem_pool_alloc (d->connections->to_send_pool);
   if (to_send == NULL)
     {
       return FALSE;
     }
 
+  to_send->transaction = transaction;
+  to_send->message = NULL;
+  to_send->conflate = conflate;
   to_send->preallocated = dbus_connection_preallocate_send (connection);
   if (to_send->preallocated == NULL)
     {
-      dbus_free (to_send);
+      message_to_send_free (connection, to_send);
       return FALSE;
     }  
   
   dbus_message_ref (message);
   to_send->message = message;
-  to_send->transaction = transaction;
 
   _dbus_verbose ("about to prepend message\n");
   
@@ -2113,6 +4175,141 @@ bus_transaction_send (BusTransaction *transaction,
   return TRUE;
 }
 
+dbus_bool_t
+bus_transaction_send (BusTransaction *transaction,
+                      DBusConnection *connection,
+                      DBusMessage    *message)
+{
+  return transaction_send (transaction, connection, message, FALSE);
+}
+
+/**
+ * Like bus_transaction_send(), for a signal the connection only wants
+ * the latest of: if a signal with the same sender, path, interface,
+ * member and first argument is still waiting in the connection's
+ * outgoing queue when the transaction is executed, this one takes its
+ * place instead of being queued after it.
+ *
+ * @param transaction the transaction
+ * @param connection the connection to send to
+ * @param message the signal
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+bus_transaction_send_conflated (BusTransaction *transaction,
+                                DBusConnection *connection,
+                                DBusMessage    *message)
+{
+  _dbus_assert (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_SIGNAL);
+
+  return transaction_send (transaction, connection, message, TRUE);
+}
+
+/** Conflation keys a connection remembers the latest signal for */
+#define MAX_CONFLATED_SIGNALS 32
+
+static void
+conflated_signal_free (void *data)
+{
+  /* the hash table frees the NULL value of a new entry */
+  if (data != NULL)
+    dbus_message_unref (data);
+}
+
+static dbus_bool_t
+append_conflation_key (DBusString  *key,
+                       DBusMessage *message)
+{
+  DBusMessageIter iter;
+  const char *arg0;
+
+  /* None of the header fields can contain a space, and the first
+   * argument, which could, comes last
+   */
+  if (!_dbus_string_append (key, dbus_message_get_sender (message)) ||
+      !_dbus_string_append_byte (key, ' ') ||
+      !_dbus_string_append (key, dbus_message_get_path (message)) ||
+      !_dbus_string_append_byte (key, ' ') ||
+      !_dbus_string_append (key, dbus_message_get_interface (message)) ||
+      !_dbus_string_append_byte (key, ' ') ||
+      !_dbus_string_append (key, dbus_message_get_member (message)) ||
+      !_dbus_string_append_byte (key, ' '))
+    return FALSE;
+
+  arg0 = NULL;
+  if (dbus_message_iter_init (message, &iter) &&
+      (dbus_message_iter_get_arg_type (&iter) == DBUS_TYPE_STRING ||
+       dbus_message_iter_get_arg_type (&iter) == DBUS_TYPE_OBJECT_PATH))
+    dbus_message_iter_get_basic (&iter, &arg0);
+
+  return arg0 == NULL || _dbus_string_append (key, arg0);
+}
+
+/* Puts message in the place of the latest like signal if that's still
+ * queued, returning TRUE, or else remembers message as the latest one
+ * and returns FALSE for it to be queued as usual. Running out of
+ * memory only means not conflating.
+ */
+static dbus_bool_t
+connection_conflate (BusConnectionData *d,
+                     DBusConnection    *connection,
+                     DBusMessage       *message)
+{
+  DBusString key;
+  DBusHashIter iter;
+  DBusMessage *latest;
+  char *key_data;
+  dbus_bool_t replaced;
+
+  if (d->conflated_signals == NULL)
+    {
+      d->conflated_signals = _dbus_hash_table_new (DBUS_HASH_STRING,
+                                                   dbus_free,
+                                                   conflated_signal_free);
+      if (d->conflated_signals == NULL)
+        return FALSE;
+    }
+
+  if (!_dbus_string_init (&key))
+    return FALSE;
+
+  replaced = FALSE;
+
+  if (!append_conflation_key (&key, message))
+    goto out;
+
+  if (_dbus_hash_iter_lookup (d->conflated_signals,
+                              (char *) _dbus_string_get_const_data (&key),
+                              FALSE, &iter))
+    {
+      latest = _dbus_hash_iter_get_value (&iter);
+      replaced = _dbus_connection_replace_outgoing (connection, latest,
+                                                    message);
+
+      /* drops our reference to the one it replaces */
+      _dbus_hash_iter_set_value (&iter, dbus_message_ref (message));
+      goto out;
+    }
+
+  /* forget the lot rather than keep messages for ever */
+  if (_dbus_hash_table_get_n_entries (d->conflated_signals) >=
+      MAX_CONFLATED_SIGNALS)
+    _dbus_hash_table_remove_all (d->conflated_signals);
+
+  if (!_dbus_string_steal_data (&key, &key_data))
+    goto out;
+
+  if (_dbus_hash_table_insert_string (d->conflated_signals, key_data,
+                                      message))
+    dbus_message_ref (message);
+  else
+    dbus_free (key_data);
+
+ out:
+  _dbus_string_free (&key);
+  return replaced;
+}
+
 static void
 connection_cancel_transaction (DBusConnection *connection,
                                BusTransaction *transaction)
@@ -2157,8 +4354,9 @@ bus_transaction_cancel_and_free (BusTransaction *transaction)
                       cancel_hook_cancel, NULL);
 
   free_cancel_hooks (transaction);
+  free_captured (transaction);
   
-  dbus_free (transaction);
+  transaction_free (transaction);
 }
 
 static void
@@ -2184,13 +4382,18 @@ connection_execute_transaction (DBusConnection *connection,
                                   link);
 
           _dbus_assert (dbus_message_get_sender (m->message) != NULL);
-          
-          dbus_connection_send_preallocated (connection,
-                                             m->preallocated,
-                                             m->message,
-                                             NULL);
 
-          m->preallocated = NULL; /* so we don't double-free it */
+          /* If it replaced a queued signal, that one was counted */
+          if (!(m->conflate && connection_conflate (d, connection, m->message)))
+            {
+              connection_count_outgoing (d, m->message);
+              dbus_connection_send_preallocated (connection,
+                                                 m->preallocated,
+                                                 m->message,
+                                                 NULL);
+
+              m->preallocated = NULL; /* so we don't double-free it */
+            }
           
           message_to_send_free (connection, m);
         }
@@ -2206,6 +4409,7 @@ bus_transaction_execute_and_free (BusTransaction *transaction)
    * send the messages
    */
   DBusConnection *connection;
+  CapturedMessage *captured;
 
   _dbus_verbose ("TRANSACTION: executing\n");
   
@@ -2214,9 +4418,47 @@ bus_transaction_execute_and_free (BusTransaction *transaction)
 
   _dbus_assert (transaction->connections == NULL);
 
+  while ((captured = _dbus_list_pop_first (&transaction->captured)))
+    {
+      int i;
+
+      for (i = 0; i < captured->n_monitors; i++)
+        {
+          BusConnectionData *d = BUS_CONNECTION_DATA (captured->monitors[i]);
+
+          /* it may have disconnected since */
+          if (d != NULL && d->link_in_monitors != NULL)
+            monitor_queue_message (d, captured->message);
+        }
+
+      captured_message_free (captured);
+    }
+
   free_cancel_hooks (transaction);
   
-  dbus_free (transaction);
+  transaction_free (transaction);
+}
+
+/* Keeps what the transaction did but sends nothing it queued; for
+ * changes that recreate state the peers already know about, such as
+ * a bus taking over names from its predecessor.
+ */
+void
+bus_transaction_execute_quietly_and_free (BusTransaction *transaction)
+{
+  DBusConnection *connection;
+
+  _dbus_verbose ("TRANSACTION: executing quietly\n");
+
+  while ((connection = _dbus_list_pop_first (&transaction->connections)))
+    connection_cancel_transaction (connection, transaction);
+
+  _dbus_assert (transaction->connections == NULL);
+
+  free_cancel_hooks (transaction);
+  free_captured (transaction);
+
+  transaction_free (transaction);
 }
 
 static void
@@ -2256,6 +4498,10 @@ bus_transaction_send_error_reply (BusTransaction  *transaction,
   _dbus_verbose ("Sending error reply %s \"%s\"\n",
                  error->name, error->message);
 
+  /* The sender said it won't read one */
+  if (dbus_message_get_no_reply (in_reply_to))
+    return TRUE;
+
   reply = dbus_message_new_error (in_reply_to,
                                   error->name,
                                   error->message);
@@ -2281,7 +4527,7 @@ bus_transaction_add_cancel_hook (BusTransaction               *transaction,
 {
   CancelHook *ch;
 
-  ch = dbus_new (CancelHook, 1);
+  ch = bus_transaction_alloc (transaction, sizeof (CancelHook));
   if (ch == NULL)
     return FALSE;
 
@@ -2296,10 +4542,46 @@ bus_transaction_add_cancel_hook (BusTransaction               *transaction,
    * were added
    */
   if (!_dbus_list_prepend (&transaction->cancel_hooks, ch))
+    return FALSE;
+
+  return TRUE;
+}
+
+/**
+ * Allocates zero-filled memory that lives until the transaction is
+ * executed or cancelled, for the records cancel hooks need.  It comes
+ * from room kept in the transaction itself, so it costs no malloc
+ * unless a transaction needs more than usual, and must not be freed.
+ *
+ * @param transaction the transaction
+ * @param size bytes needed
+ * @returns the memory, or #NULL if out of memory
+ */
+void*
+bus_transaction_alloc (BusTransaction *transaction,
+                       size_t          size)
+{
+  void *mem;
+
+  size = _DBUS_ALIGN_VALUE (size, sizeof (double));
+
+  if (size <= (size_t) (TRANSACTION_SCRATCH_SIZE - transaction->scratch_used))
     {
-      dbus_free (ch);
-      return FALSE;
+      /* the pool zeroed the transaction, and scratch is never reused */
+      mem = transaction->scratch.bytes + transaction->scratch_used;
+      transaction->scratch_used += size;
+      return mem;
     }
 
-  return TRUE;
+  mem = dbus_malloc0 (size);
+  if (mem == NULL)
+    return NULL;
+
+  if (!_dbus_list_prepend (&transaction->scratch_overflow, mem))
+    {
+      dbus_free (mem);
+      return NULL;
+    }
+
+  return mem;
 }
@@ -31,6 +31,23 @@
 typedef dbus_bool_t (* BusConnectionForeachFunction) (DBusConnection *connection, 
                                                       void           *data);
 
+typedef dbus_bool_t (* BusPendingReplyForeachFunction) (DBusConnection *will_send_reply,
+                                                        dbus_uint32_t   reply_serial,
+                                                        void           *data);
+
+/* Counters kept for every connection; they wrap around rather than
+ * saturate
+ */
+typedef struct
+{
+  dbus_uint32_t incoming_messages; /**< Messages the bus received from it */
+  dbus_uint32_t incoming_bytes;    /**< Bytes in those messages */
+  dbus_uint32_t outgoing_messages; /**< Messages the bus sent to it */
+  dbus_uint32_t outgoing_bytes;    /**< Bytes in those messages */
+  dbus_uint32_t monitor_dropped;   /**< Messages it missed as a monitor by falling behind */
+  dbus_uint32_t dispatch_usec;     /**< Microseconds the bus spent handling its messages */
+} BusConnectionStats;
+
 
 BusConnections* bus_connections_new               (BusContext                   *context);
 BusConnections* bus_connections_ref               (BusConnections               *connections);
@@ -44,18 +61,37 @@ void            bus_connections_foreach_active    (BusConnections
                                                    BusConnectionForeachFunction  function,
                                                    void                         *data);
 BusContext*     bus_connections_get_context       (BusConnections               *connections);
+void            bus_connections_get_counts        (BusConnections               *connections,
+                                                   int                          *n_completed,
+                                                   int                          *n_incomplete,
+                                                   int                          *n_pending_replies);
+dbus_bool_t     bus_connections_get_user_stats    (BusConnections               *connections,
+                                                   unsigned long                 uid,
+                                                   int                          *n_connections,
+                                                   dbus_uint32_t                *dispatch_usec);
 void            bus_connections_increment_stamp   (BusConnections               *connections);
+void            bus_connections_update_priority   (BusConnections               *connections);
 BusContext*     bus_connection_get_context        (DBusConnection               *connection);
 BusConnections* bus_connection_get_connections    (DBusConnection               *connection);
 BusRegistry*    bus_connection_get_registry       (DBusConnection               *connection);
+BusService*     bus_connection_lookup_destination (DBusConnection               *connection,
+                                                   const char                   *name,
+                                                   DBusConnection              **owner);
 BusActivation*  bus_connection_get_activation     (DBusConnection               *connection);
 BusMatchmaker*  bus_connection_get_matchmaker     (DBusConnection               *connection);
 const char *    bus_connection_get_loginfo        (DBusConnection        *connection);
+const char *    bus_connection_get_denial_text    (DBusConnection        *connection,
+                                                   const DBusString      *key);
+void            bus_connection_set_denial_text    (DBusConnection        *connection,
+                                                   const DBusString      *key,
+                                                   const char            *text);
 BusSELinuxID*   bus_connection_get_selinux_id     (DBusConnection               *connection);
 dbus_bool_t     bus_connections_check_limits      (BusConnections               *connections,
                                                    DBusConnection               *requesting_completion,
                                                    DBusError                    *error);
 void            bus_connections_expire_incomplete (BusConnections               *connections);
+void            bus_connections_set_handing_off   (BusConnections               *connections,
+                                                   dbus_bool_t                   handing_off);
 
 dbus_bool_t     bus_connections_expect_reply      (BusConnections               *connections,
                                                    BusTransaction               *transaction,
@@ -69,24 +105,58 @@ dbus_bool_t     bus_connections_check_reply       (BusConnections
                                                    DBusConnection               *receiving_reply,
                                                    DBusMessage                  *reply,
                                                    DBusError                    *error);
+dbus_bool_t     bus_connections_restore_reply     (BusConnections               *connections,
+                                                   DBusConnection               *will_get_reply,
+                                                   DBusConnection               *will_send_reply,
+                                                   dbus_uint32_t                 reply_serial);
+dbus_bool_t     bus_connection_foreach_reply_to_receive (DBusConnection                *connection,
+                                                         BusPendingReplyForeachFunction function,
+                                                         void                          *data);
 
 dbus_bool_t     bus_connection_mark_stamp         (DBusConnection               *connection);
 
 dbus_bool_t bus_connection_is_active (DBusConnection *connection);
 const char *bus_connection_get_name  (DBusConnection *connection);
+dbus_bool_t bus_connection_check_message_body (DBusConnection *connection,
+                                               DBusMessage    *message);
+dbus_bool_t bus_connection_become_monitor (DBusConnection  *connection,
+                                           BusTransaction  *transaction,
+                                           DBusList       **rules,
+                                           DBusError       *error);
+dbus_bool_t bus_connection_is_monitor     (DBusConnection  *connection);
 
 dbus_bool_t bus_connection_preallocate_oom_error (DBusConnection *connection);
 void        bus_connection_send_oom_error        (DBusConnection *connection,
                                                   DBusMessage    *in_reply_to);
 
 /* called by signals.c */
-dbus_bool_t bus_connection_add_match_rule      (DBusConnection *connection,
-                                                BusMatchRule   *rule);
-void        bus_connection_add_match_rule_link (DBusConnection *connection,
-                                                DBusList       *link);
-void        bus_connection_remove_match_rule   (DBusConnection *connection,
-                                                BusMatchRule   *rule);
-int         bus_connection_get_n_match_rules   (DBusConnection *connection);
+void        bus_connection_add_match_rule_link    (DBusConnection *connection,
+                                                   DBusList       *link);
+void        bus_connection_remove_match_rule_link (DBusConnection *connection,
+                                                   DBusList       *link);
+int         bus_connection_get_n_match_rules      (DBusConnection *connection);
+DBusList ** bus_connection_get_match_rules        (DBusConnection *connection);
+dbus_bool_t bus_connection_has_conflating_rules   (DBusConnection *connection);
+
+/* called by dispatch.c and stats.c */
+void        bus_connection_count_incoming      (DBusConnection     *connection,
+                                                DBusMessage        *message);
+void        bus_connection_limit_rate          (DBusConnection     *connection,
+                                                DBusMessage        *message);
+void        bus_connection_charge_dispatch     (DBusConnection     *connection,
+                                                long                usec);
+void        bus_connection_count_buffered      (DBusConnection     *connection,
+                                                DBusMessage        *message);
+void        bus_connection_get_stats           (DBusConnection     *connection,
+                                                BusConnectionStats *stats,
+                                                int                *n_replies_to_receive,
+                                                int                *n_replies_to_send);
+DBusList ** bus_connection_get_owned_services  (DBusConnection *connection);
+dbus_bool_t bus_connection_has_priority        (DBusConnection *connection);
+
+/* called by bus.c */
+void        bus_connection_pause_sender        (DBusConnection *receiver,
+                                                DBusConnection *sender);
 
 
 /* called by services.c */
@@ -121,9 +191,16 @@ typedef void (* BusTransactionCancelFunction) (void *data);
 BusTransaction* bus_transaction_new              (BusContext                   *context);
 BusContext*     bus_transaction_get_context      (BusTransaction               *transaction);
 BusConnections* bus_transaction_get_connections  (BusTransaction               *transaction);
+dbus_bool_t     bus_transaction_capture          (BusTransaction               *transaction,
+                                                  DBusConnection               *sender,
+                                                  DBusConnection               *addressed_recipient,
+                                                  DBusMessage                  *message);
 dbus_bool_t     bus_transaction_send             (BusTransaction               *transaction,
                                                   DBusConnection               *connection,
                                                   DBusMessage                  *message);
+dbus_bool_t     bus_transaction_send_conflated   (BusTransaction               *transaction,
+                                                  DBusConnection               *connection,
+                                                  DBusMessage                  *message);
 dbus_bool_t     bus_transaction_send_from_driver (BusTransaction               *transaction,
                                                   DBusConnection               *connection,
                                                   DBusMessage                  *message);
@@ -133,9 +210,12 @@ dbus_bool_t     bus_transaction_send_error_reply (BusTransaction               *
                                                   DBusMessage                  *in_reply_to);
 void            bus_transaction_cancel_and_free  (BusTransaction               *transaction);
 void            bus_transaction_execute_and_free (BusTransaction               *transaction);
+void            bus_transaction_execute_quietly_and_free (BusTransaction       *transaction);
 dbus_bool_t     bus_transaction_add_cancel_hook  (BusTransaction               *transaction,
                                                   BusTransactionCancelFunction  cancel_function,
                                                   void                         *data,
                                                   DBusFreeFunction              free_data_function);
+void*           bus_transaction_alloc            (BusTransaction               *transaction,
+                                                  size_t                        size);
 
 #endif /* BUS_CONNECTION_H */
@@ -670,7 +670,7 @@ bus_desktop_file_load (DBusString *filename,
       return NULL;
     }
   
-  parser.data = str;
+  _dbus_string_relocate (&parser.data, &str);
   parser.line_num = 1;
   parser.pos = 0;
   parser.len = _dbus_string_get_length (&parser.data);
@@ -35,9 +35,14 @@
 #include <dbus/dbus-internals.h>
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-watch.h>
+#include <dbus/dbus-timeout.h>
 #include "dir-watch.h"
 
 #define MAX_DIRS_TO_WATCH 128
+/* How long the directories must stay quiet before we reload, so a
+ * package manager installing a batch of service files costs one
+ * reload rather than one per file */
+#define RELOAD_QUIET_PERIOD 250
 #define INOTIFY_EVENT_SIZE (sizeof(struct inotify_event))
 #define INOTIFY_BUF_LEN (1024 * (INOTIFY_EVENT_SIZE + 16))
 
@@ -47,8 +52,44 @@ static char *dirs[MAX_DIRS_TO_WATCH];
 static int num_wds = 0;
 static int inotify_fd = -1;
 static DBusWatch *watch = NULL;
+static DBusTimeout *reload_timeout = NULL;
+static long last_event_sec = 0;
+static long last_event_usec = 0;
 static DBusLoop *loop = NULL;
 
+static void
+_reload_timeout_callback (DBusTimeout *timeout, void *data)
+{
+  dbus_timeout_handle (timeout);
+}
+
+/* The main loop measures our interval from when the timeout last fired,
+ * not from when it was enabled, so rather than restarting it on every
+ * event we check here how long the directories have been quiet.
+ */
+static dbus_bool_t
+_handle_reload_timeout (void *data)
+{
+  long tv_sec, tv_usec;
+  long elapsed;
+
+  _dbus_get_current_time (&tv_sec, &tv_usec);
+  elapsed = (tv_sec - last_event_sec) * 1000 +
+            (tv_usec - last_event_usec) / 1000;
+
+  /* elapsed < 0 means the clock moved backward; don't wait on it */
+  if (elapsed >= 0 && elapsed < RELOAD_QUIET_PERIOD)
+    return TRUE;
+
+  _dbus_timeout_set_enabled (reload_timeout, FALSE);
+  _dbus_loop_toggle_timeout (loop, reload_timeout);
+
+  _dbus_verbose ("Sending SIGHUP signal after inotify events settled\n");
+  (void) kill (_dbus_getpid (), SIGHUP);
+
+  return TRUE;
+}
+
 static dbus_bool_t
 _inotify_watch_callback (DBusWatch *watch, unsigned int condition, void *data)
 {
@@ -61,7 +102,6 @@ _handle_inotify_watch (DBusWatch *passed_watch, unsigned int flags, void *data)
   char buffer[INOTIFY_BUF_LEN];
   ssize_t ret = 0;
   int i = 0;
-  pid_t pid;
   dbus_bool_t have_change = FALSE;
 
   ret = read (inotify_fd, buffer, INOTIFY_BUF_LEN);
@@ -73,7 +113,6 @@ _handle_inotify_watch (DBusWatch *passed_watch, unsigned int flags, void *data)
   while (i < ret)
     {
       struct inotify_event *ev;
-      pid = _dbus_getpid ();
 
       ev = (struct inotify_event *) &buffer[i];
       i += INOTIFY_EVENT_SIZE + ev->len;
@@ -82,11 +121,24 @@ _handle_inotify_watch (DBusWatch *passed_watch, unsigned int flags, void *data)
         _dbus_verbose ("event name: '%s'\n", ev->name);
       _dbus_verbose ("inotify event: wd=%d mask=%u cookie=%u len=%u\n", ev->wd, ev->mask, ev->cookie, ev->len);
 #endif
-      _dbus_verbose ("Sending SIGHUP signal on reception of a inotify event\n");
       have_change = TRUE;
     }
-  if (have_change)
-    (void) kill (pid, SIGHUP);
+
+  if (have_change && reload_timeout == NULL)
+    {
+      _dbus_verbose ("Sending SIGHUP signal on reception of a inotify event\n");
+      (void) kill (_dbus_getpid (), SIGHUP);
+    }
+  else if (have_change)
+    {
+      _dbus_get_current_time (&last_event_sec, &last_event_usec);
+
+      if (!dbus_timeout_get_enabled (reload_timeout))
+        {
+          _dbus_timeout_set_enabled (reload_timeout, TRUE);
+          _dbus_loop_toggle_timeout (loop, reload_timeout);
+        }
+    }
 
   return TRUE;
 }
@@ -210,9 +262,17 @@ _shutdown_inotify (void *data)
     {
       _dbus_loop_remove_watch (loop, watch, _inotify_watch_callback, NULL);
       _dbus_watch_unref (watch);
-      _dbus_loop_unref (loop);
     }
+  if (reload_timeout != NULL)
+    {
+      _dbus_loop_remove_timeout (loop, reload_timeout,
+                                 _reload_timeout_callback, NULL);
+      _dbus_timeout_unref (reload_timeout);
+    }
+  if (loop != NULL)
+    _dbus_loop_unref (loop);
   watch = NULL;
+  reload_timeout = NULL;
   loop = NULL;
 }
 
@@ -259,6 +319,24 @@ _init_inotify (BusContext *context)
           goto out;
         }
 
+      /* Not fatal if this fails, we just reload on every batch of events */
+      reload_timeout = _dbus_timeout_new (RELOAD_QUIET_PERIOD,
+                                          _handle_reload_timeout, NULL, NULL);
+      if (reload_timeout != NULL)
+        {
+          _dbus_timeout_set_enabled (reload_timeout, FALSE);
+
+          if (!_dbus_loop_add_timeout (loop, reload_timeout,
+                                       _reload_timeout_callback, NULL, NULL))
+            {
+              _dbus_timeout_unref (reload_timeout);
+              reload_timeout = NULL;
+            }
+        }
+
+      if (reload_timeout == NULL)
+        _dbus_warn ("Unable to add inotify reload timeout to main loop\n");
+
       _dbus_register_shutdown_func (_shutdown_inotify, NULL);
     }
 
@@ -27,16 +27,21 @@
 #include "dispatch.h"
 #include "connection.h"
 #include "driver.h"
+#include "handoff.h"
 #include "services.h"
 #include "activation.h"
 #include "utils.h"
 #include "bus.h"
 #include "signals.h"
+#include "stats.h"
 #include "test.h"
 #include <dbus/dbus-internals.h>
+#include <dbus/dbus-connection-internal.h>
+#include <dbus/dbus-file.h>
+#include <dbus/dbus-message-internal.h>
 #include <string.h>
 
-#ifdef HAVE_UNIX_FD_PASSING
+#ifdef DBUS_UNIX
 #include <dbus/dbus-sysdeps-unix.h>
 #include <unistd.h>
 #endif
@@ -54,29 +59,38 @@
 #endif
 
 static dbus_bool_t
-send_one_message (DBusConnection *connection,
-                  BusContext     *context,
-                  DBusConnection *sender,
-                  DBusConnection *addressed_recipient,
-                  DBusMessage    *message,
-                  BusTransaction *transaction,
-                  DBusError      *error)
+send_one_message (DBusConnection    *connection,
+                  BusContext        *context,
+                  DBusConnection    *sender,
+                  DBusConnection    *addressed_recipient,
+                  DBusMessage       *message,
+                  BusTransaction    *transaction,
+                  BusPolicyVerdicts *verdicts,
+                  DBusError         *error)
 {
-  if (!bus_context_check_security_policy (context, transaction,
-                                          sender,
-                                          addressed_recipient,
-                                          connection,
-                                          message,
-                                          NULL))
+  dbus_bool_t sent;
+
+  if (!bus_context_check_match_policy (context, transaction,
+                                       sender,
+                                       addressed_recipient,
+                                       connection,
+                                       message,
+                                       verdicts))
     return TRUE; /* silently don't send it */
 
   if (dbus_message_contains_unix_fds(message) &&
       !dbus_connection_can_send_type(connection, DBUS_TYPE_UNIX_FD))
     return TRUE; /* silently don't send it */
 
-  if (!bus_transaction_send (transaction,
-                             connection,
-                             message))
+  if (bus_connection_has_conflating_rules (connection) &&
+      bus_matchmaker_conflates (bus_context_get_matchmaker (context),
+                                connection, sender, addressed_recipient,
+                                message))
+    sent = bus_transaction_send_conflated (transaction, connection, message);
+  else
+    sent = bus_transaction_send (transaction, connection, message);
+
+  if (!sent)
     {
       BUS_SET_OOM (error);
       return FALSE;
@@ -94,10 +108,14 @@ bus_dispatch_matches (BusTransaction *transaction,
 {
   DBusError tmp_error;
   BusConnections *connections;
-  DBusList *recipients;
+  DBusConnection **recipients;
+  int n_recipients;
   BusMatchmaker *matchmaker;
-  DBusList *link;
   BusContext *context;
+  BusLatencyTimer timer;
+  BusPolicyVerdicts verdicts;
+  dbus_bool_t got_recipients;
+  int i;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
@@ -110,6 +128,13 @@ bus_dispatch_matches (BusTransaction *transaction,
 
   context = bus_transaction_get_context (transaction);
 
+  if (!bus_transaction_capture (transaction, sender, addressed_recipient,
+                                message))
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
   /* First, send the message to the addressed_recipient, if there is one. */
   if (addressed_recipient != NULL)
     {
@@ -143,30 +168,33 @@ bus_dispatch_matches (BusTransaction *transaction,
   dbus_error_init (&tmp_error);
   matchmaker = bus_context_get_matchmaker (context);
 
-  recipients = NULL;
-  if (!bus_matchmaker_get_recipients (matchmaker, connections,
-                                      sender, addressed_recipient, message,
-                                      &recipients))
+  bus_stats_latency_start (&timer);
+  got_recipients = bus_matchmaker_get_recipients (matchmaker, connections,
+                                                  sender, addressed_recipient,
+                                                  message, &recipients,
+                                                  &n_recipients);
+  bus_stats_latency_stop (&timer, BUS_LATENCY_MATCHMAKER);
+
+  if (!got_recipients)
     {
       BUS_SET_OOM (error);
       return FALSE;
     }
 
-  link = _dbus_list_get_first_link (&recipients);
-  while (link != NULL)
-    {
-      DBusConnection *dest;
-
-      dest = link->data;
+  /* The recipients mostly share a handful of policies, so each policy
+   * only looks at the message once
+   */
+  _DBUS_ZERO (verdicts);
 
-      if (!send_one_message (dest, context, sender, addressed_recipient,
-                             message, transaction, &tmp_error))
+  for (i = 0; i < n_recipients; i++)
+    {
+      if (!send_one_message (recipients[i], context, sender,
+                             addressed_recipient, message, transaction,
+                             &verdicts, &tmp_error))
         break;
-
-      link = _dbus_list_get_next_link (&recipients, link);
     }
 
-  _dbus_list_clear (&recipients);
+  bus_matchmaker_release_recipients (matchmaker, recipients);
 
   if (dbus_error_is_set (&tmp_error))
     {
@@ -187,6 +215,11 @@ bus_dispatch (DBusConnection *connection,
   BusContext *context;
   DBusHandlerResult result;
   DBusConnection *addressed_recipient;
+  BusLatencyTimer dispatch_timer, execute_timer;
+  long start_sec, start_usec, end_sec, end_usec;
+
+  _dbus_get_current_time (&start_sec, &start_usec);
+  bus_stats_latency_start (&dispatch_timer);
 
   result = DBUS_HANDLER_RESULT_HANDLED;
 
@@ -208,6 +241,17 @@ bus_dispatch (DBusConnection *connection,
 
   service_name = dbus_message_get_destination (message);
 
+  /* the local Disconnected signal doesn't come from the client */
+  if (service_name != NULL ||
+      !dbus_message_is_signal (message, DBUS_INTERFACE_LOCAL, "Disconnected"))
+    {
+      bus_connection_count_incoming (connection, message);
+      bus_connection_limit_rate (connection, message);
+      bus_connection_count_buffered (connection, message);
+    }
+
+  _dbus_trace2 (bus__dispatch, connection, message);
+
 #ifdef DBUS_ENABLE_VERBOSE_MODE
   {
     const char *interface_name, *member_name, *error_name;
@@ -248,6 +292,20 @@ bus_dispatch (DBusConnection *connection,
         }
     }
 
+  /* Monitors only listen; one that says anything is misbehaving */
+  if (bus_connection_is_monitor (connection))
+    {
+      _dbus_verbose ("Received message from monitor. Disconnecting.\n");
+      dbus_connection_close (connection);
+      goto out;
+    }
+
+  /* Recipients queue what a priority_user or priority_name sends
+   * ahead of their other messages
+   */
+  if (bus_connection_has_priority (connection))
+    _dbus_message_set_priority (message, TRUE);
+
   /* Create our transaction */
   transaction = bus_transaction_new (context);
   if (transaction == NULL)
@@ -256,24 +314,33 @@ bus_dispatch (DBusConnection *connection,
       goto out;
     }
 
-  /* Assign a sender to the message */
+  /* Assign a sender to the message, unless it already has the right
+   * one; then the header goes out exactly as it was received
+   */
   if (bus_connection_is_active (connection))
     {
+      const char *claimed_sender;
+
       sender = bus_connection_get_name (connection);
       _dbus_assert (sender != NULL);
 
-      if (!dbus_message_set_sender (message, sender))
+      claimed_sender = dbus_message_get_sender (message);
+
+      if (claimed_sender == NULL || strcmp (claimed_sender, sender) != 0)
         {
-          BUS_SET_OOM (&error);
-          goto out;
-        }
+          if (!dbus_message_set_sender (message, sender))
+            {
+              BUS_SET_OOM (&error);
+              goto out;
+            }
 
-      /* We need to refetch the service name here, because
-       * dbus_message_set_sender can cause the header to be
-       * reallocated, and thus the service_name pointer will become
-       * invalid.
-       */
-      service_name = dbus_message_get_destination (message);
+          /* We need to refetch the service name here, because
+           * dbus_message_set_sender can cause the header to be
+           * reallocated, and thus the service_name pointer will become
+           * invalid.
+           */
+          service_name = dbus_message_get_destination (message);
+        }
     }
 
   if (service_name &&
@@ -286,6 +353,12 @@ bus_dispatch (DBusConnection *connection,
           goto out;
         }
 
+      if (!bus_transaction_capture (transaction, connection, NULL, message))
+        {
+          BUS_SET_OOM (&error);
+          goto out;
+        }
+
       _dbus_verbose ("Giving message to %s\n", DBUS_SERVICE_DBUS);
       if (!bus_driver_handle_message (connection, transaction, message, &error))
         goto out;
@@ -298,16 +371,12 @@ bus_dispatch (DBusConnection *connection,
     }
   else if (service_name != NULL) /* route to named service */
     {
-      DBusString service_string;
       BusService *service;
-      BusRegistry *registry;
 
       _dbus_assert (service_name != NULL);
 
-      registry = bus_connection_get_registry (connection);
-
-      _dbus_string_init_const (&service_string, service_name);
-      service = bus_registry_lookup (registry, &service_string);
+      service = bus_connection_lookup_destination (connection, service_name,
+                                                   &addressed_recipient);
 
       if (service == NULL && dbus_message_get_auto_start (message))
         {
@@ -338,7 +407,6 @@ bus_dispatch (DBusConnection *connection,
         }
       else
         {
-          addressed_recipient = bus_service_get_primary_owners_connection (service);
           _dbus_assert (addressed_recipient != NULL);
         }
     }
@@ -351,6 +419,18 @@ bus_dispatch (DBusConnection *connection,
     goto out;
 
  out:
+  /* Everything the message is to be delivered to is queued in the
+   * transaction by now; a corrupt body cancels all of it.
+   */
+  if (transaction != NULL && !dbus_error_is_set (&error) &&
+      !bus_connection_check_message_body (connection, message))
+    {
+      _dbus_verbose ("Message body is invalid. Disconnecting.\n");
+      bus_transaction_cancel_and_free (transaction);
+      transaction = NULL;
+      dbus_connection_close (connection);
+    }
+
   if (dbus_error_is_set (&error))
     {
       if (!dbus_connection_get_is_connected (connection))
@@ -397,11 +477,20 @@ bus_dispatch (DBusConnection *connection,
 
   if (transaction != NULL)
     {
+      bus_stats_latency_start (&execute_timer);
       bus_transaction_execute_and_free (transaction);
+      bus_stats_latency_stop (&execute_timer, BUS_LATENCY_EXECUTE);
     }
 
+  _dbus_get_current_time (&end_sec, &end_usec);
+  bus_connection_charge_dispatch (connection,
+                                  (end_sec - start_sec) * 1000000 +
+                                  (end_usec - start_usec));
+
   dbus_connection_unref (connection);
 
+  bus_stats_latency_stop (&dispatch_timer, BUS_LATENCY_DISPATCH);
+
   return result;
 }
 
@@ -1521,6 +1610,147 @@ check_add_match_all (BusContext     *context,
   return retval;
 }
 
+/* returns TRUE if the correct thing happens,
+ * but the correct thing may include OOM errors.
+ * AddMatches is expected to fail with error_name, or to succeed
+ * if it is NULL.
+ */
+static dbus_bool_t
+check_add_matches (BusContext     *context,
+                   DBusConnection *connection,
+                   const char    **rules,
+                   int             n_rules,
+                   const char     *error_name)
+{
+  DBusMessage *message;
+  dbus_bool_t retval;
+  dbus_uint32_t serial;
+
+  retval = FALSE;
+  message = NULL;
+
+  _dbus_verbose ("check_add_matches for %p\n", connection);
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "AddMatches");
+
+  if (message == NULL)
+    return TRUE;
+
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+                                 &rules, n_rules,
+                                 DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  if (!dbus_connection_send (connection, message, &serial))
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  dbus_message_unref (message);
+  message = NULL;
+
+  dbus_connection_ref (connection); /* because we may get disconnected */
+
+  /* send our message */
+  bus_test_run_clients_loop (SEND_PENDING (connection));
+
+  if (!dbus_connection_get_is_connected (connection))
+    {
+      _dbus_verbose ("connection was disconnected\n");
+
+      dbus_connection_unref (connection);
+
+      return TRUE;
+    }
+
+  block_connection_until_message_from_bus (context, connection, "reply to AddMatches");
+
+  if (!dbus_connection_get_is_connected (connection))
+    {
+      _dbus_verbose ("connection was disconnected\n");
+
+      dbus_connection_unref (connection);
+
+      return TRUE;
+    }
+
+  dbus_connection_unref (connection);
+
+  message = pop_message_waiting_for_memory (connection);
+  if (message == NULL)
+    {
+      _dbus_warn ("Did not receive a reply to %s %d on %p\n",
+                  "AddMatches", serial, connection);
+      goto out;
+    }
+
+  verbose_message_received (connection, message);
+
+  if (!dbus_message_has_sender (message, DBUS_SERVICE_DBUS))
+    {
+      _dbus_warn ("Message has wrong sender %s\n",
+                  dbus_message_get_sender (message) ?
+                  dbus_message_get_sender (message) : "(none)");
+      goto out;
+    }
+
+  _dbus_assert (dbus_message_get_reply_serial (message) == serial);
+
+  if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_ERROR)
+    {
+      if (dbus_message_is_error (message,
+                                 DBUS_ERROR_NO_MEMORY))
+        {
+          ; /* good, this is a valid response */
+        }
+      else if (error_name != NULL &&
+               dbus_message_is_error (message, error_name))
+        {
+          ; /* good, expected */
+        }
+      else
+        {
+          warn_unexpected (connection, message, "not this error");
+
+          goto out;
+        }
+    }
+  else
+    {
+      if (error_name == NULL &&
+          dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_METHOD_RETURN)
+        {
+          ; /* good, expected */
+        }
+      else
+        {
+          warn_unexpected (connection, message,
+                           error_name != NULL ? error_name : "method return for AddMatches");
+
+          goto out;
+        }
+    }
+
+  if (!check_no_leftovers (context))
+    goto out;
+
+  retval = TRUE;
+
+ out:
+  if (message)
+    dbus_message_unref (message);
+
+  return retval;
+}
+
 /* returns TRUE if the correct thing happens,
  * but the correct thing may include OOM errors.
  */
@@ -4764,6 +4994,2088 @@ bus_dispatch_sha1_test (const DBusString *test_data_dir)
   return TRUE;
 }
 
+#ifdef DBUS_UNIX
+dbus_bool_t
+bus_dispatch_stats_file_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *foo;
+  DBusError error;
+  DBusString filename;
+  DBusString contents;
+  const BusStatsFileHeader *header;
+  const BusStatsFileConnection *entries;
+
+  dbus_error_init (&error);
+
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/debug-allow-all.conf");
+  if (context == NULL)
+    return FALSE;
+
+  foo = dbus_connection_open_private (TEST_CONNECTION, &error);
+  if (foo == NULL)
+    _dbus_assert_not_reached ("could not alloc connection");
+
+  if (!bus_setup_debug_client (foo))
+    _dbus_assert_not_reached ("could not set up connection");
+
+  spin_connection_until_authenticated (context, foo);
+
+  if (!check_hello_message (context, foo))
+    _dbus_assert_not_reached ("hello message failed");
+
+  if (!_dbus_string_init (&filename) ||
+      !_dbus_string_init (&contents) ||
+      !_dbus_string_append (&filename, _dbus_get_tmpdir ()) ||
+      !_dbus_string_append (&filename, "/dbus-test-stats.") ||
+      !_dbus_generate_random_ascii (&filename, 8))
+    _dbus_assert_not_reached ("no memory");
+
+  if (!bus_stats_file_open (context, &filename, &error))
+    _dbus_assert_not_reached (error.message);
+
+  /* another process would map it; reading it is just as good here */
+  if (!_dbus_file_get_contents (&contents, &filename, &error))
+    _dbus_assert_not_reached (error.message);
+
+  header = (const BusStatsFileHeader *) _dbus_string_get_const_data (&contents);
+  entries = (const BusStatsFileConnection *) (header + 1);
+
+  _dbus_assert (memcmp (header->magic, BUS_STATS_FILE_MAGIC, 8) == 0);
+  _dbus_assert (header->version == BUS_STATS_FILE_VERSION);
+  _dbus_assert (header->header_size == sizeof (BusStatsFileHeader));
+  _dbus_assert (header->connection_size == sizeof (BusStatsFileConnection));
+  _dbus_assert (_dbus_string_get_length (&contents) ==
+                (int) (header->header_size +
+                       header->max_connections * header->connection_size));
+  _dbus_assert (header->sequence.value > 0 &&
+                header->sequence.value % 2 == 0);
+  _dbus_assert (header->pid == (dbus_uint32_t) _dbus_getpid ());
+  _dbus_assert (header->active_connections == 1);
+  _dbus_assert (header->n_connections == 1);
+  _dbus_assert (header->n_connections_left_out == 0);
+  _dbus_assert (strcmp (entries[0].unique_name,
+                        dbus_bus_get_unique_name (foo)) == 0);
+  _dbus_assert (entries[0].names_owned == 1);
+
+  bus_stats_file_close ();
+  _dbus_assert (!_dbus_file_exists (_dbus_string_get_const_data (&filename)));
+
+  _dbus_string_free (&contents);
+  _dbus_string_free (&filename);
+
+  kill_client_connection_unchecked (foo);
+
+  bus_context_unref (context);
+
+  return TRUE;
+}
+#endif
+
+
+/* Returns the bus side of a new client of the given address that
+ * has said Hello
+ */
+static DBusConnection *
+connect_test_client_to (BusContext      *context,
+                        const char      *address,
+                        DBusConnection **client_p)
+{
+  DBusConnection *client;
+  DBusConnection *connection;
+  DBusMessage *message;
+  BusService *service;
+  DBusString name;
+  DBusError error;
+  const char *unique_name;
+
+  dbus_error_init (&error);
+
+  client = dbus_connection_open_private (address, &error);
+  if (client == NULL)
+    _dbus_assert_not_reached ("could not alloc connection");
+
+  if (!bus_setup_debug_client (client))
+    _dbus_assert_not_reached ("could not set up connection");
+
+  spin_connection_until_authenticated (context, client);
+
+  /* check_hello_message() expects every other client to hear about the
+   * new name, which needs a match rule per client; these clients don't
+   * have any, so just say Hello and skip the checks.
+   */
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "Hello");
+  if (message == NULL || !dbus_connection_send (client, message, NULL))
+    _dbus_assert_not_reached ("no memory");
+  dbus_message_unref (message);
+
+  bus_test_run_clients_loop (SEND_PENDING (client));
+  block_connection_until_message_from_bus (context, client, "reply to Hello");
+
+  message = pop_message_waiting_for_memory (client);
+  if (message == NULL ||
+      !dbus_message_get_args (message, &error,
+                              DBUS_TYPE_STRING, &unique_name,
+                              DBUS_TYPE_INVALID) ||
+      !dbus_bus_set_unique_name (client, unique_name))
+    _dbus_assert_not_reached ("hello message failed");
+  dbus_message_unref (message);
+
+  /* throw away NameAcquired */
+  bus_test_run_everything (context);
+  while ((message = pop_message_waiting_for_memory (client)) != NULL)
+    dbus_message_unref (message);
+
+  _dbus_string_init_const (&name, dbus_bus_get_unique_name (client));
+  service = bus_registry_lookup (bus_context_get_registry (context), &name);
+  _dbus_assert (service != NULL);
+
+  connection = bus_service_get_primary_owners_connection (service);
+  _dbus_assert (bus_connection_is_active (connection));
+
+  *client_p = client;
+  return connection;
+}
+
+/* Returns the bus side of a new client that has said Hello */
+static DBusConnection *
+connect_test_client (BusContext      *context,
+                     DBusConnection **client_p)
+{
+  return connect_test_client_to (context, TEST_CONNECTION, client_p);
+}
+
+/* Sends a signal from a test client to whoever owns a name */
+static void
+send_test_signal (BusContext     *context,
+                  DBusConnection *from,
+                  const char     *name,
+                  const char     *member)
+{
+  DBusMessage *message;
+
+  message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                     "org.freedesktop.TestInterface",
+                                     member);
+  if (message == NULL ||
+      !dbus_message_set_destination (message, name) ||
+      !dbus_connection_send (from, message, NULL))
+    _dbus_assert_not_reached ("no memory");
+  dbus_message_unref (message);
+
+  bus_test_run_everything (context);
+}
+
+/* Checks the next message a test client got is the given signal */
+static void
+expect_test_signal (DBusConnection *client,
+                    const char     *member)
+{
+  DBusMessage *message;
+
+  message = pop_message_waiting_for_memory (client);
+  if (message == NULL)
+    _dbus_assert_not_reached ("signal did not arrive");
+  if (!dbus_message_has_member (message, member))
+    _dbus_assert_not_reached ("got the wrong signal");
+  dbus_message_unref (message);
+}
+
+/* Sends a signal to anyone who asked for it */
+static void
+add_matches_test_emit (BusContext     *context,
+                       DBusConnection *from,
+                       const char     *member)
+{
+  DBusMessage *message;
+
+  message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                     "org.freedesktop.TestInterface",
+                                     member);
+  if (message == NULL ||
+      !dbus_connection_send (from, message, NULL))
+    _dbus_assert_not_reached ("no memory");
+  dbus_message_unref (message);
+
+  bus_test_run_everything (context);
+}
+
+/* AddMatches installs all of its rules or none of them */
+dbus_bool_t
+bus_dispatch_add_matches_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *listener, *emitter;
+  DBusConnection *listener_side;
+  const char *good[] = {
+    "type='signal',interface='org.freedesktop.TestInterface',member='First'",
+    "type='signal',interface='org.freedesktop.TestInterface',member='Second'"
+  };
+  const char *bad[] = {
+    "type='signal',interface='org.freedesktop.TestInterface'",
+    "type='nonsense'"
+  };
+  const char **many;
+  int max_rules;
+  int i;
+
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/debug-allow-all.conf");
+  if (context == NULL)
+    return FALSE;
+
+  listener_side = connect_test_client (context, &listener);
+  connect_test_client (context, &emitter);
+
+  max_rules = bus_context_get_max_match_rules_per_connection (context);
+  many = dbus_new (const char *, max_rules + 1);
+  if (many == NULL)
+    _dbus_assert_not_reached ("no memory");
+  for (i = 0; i < max_rules + 1; i++)
+    many[i] = good[0];
+
+  /* a good rule before a bad one isn't kept */
+  if (!check_add_matches (context, listener, bad, _DBUS_N_ELEMENTS (bad),
+                          DBUS_ERROR_MATCH_RULE_INVALID))
+    _dbus_assert_not_reached ("AddMatches with a bad rule failed");
+  _dbus_assert (bus_connection_get_n_match_rules (listener_side) == 0);
+
+  if (!check_add_matches (context, listener, many, max_rules + 1,
+                          DBUS_ERROR_LIMITS_EXCEEDED))
+    _dbus_assert_not_reached ("AddMatches over the limit failed");
+  _dbus_assert (bus_connection_get_n_match_rules (listener_side) == 0);
+
+  if (!check_add_matches (context, listener, good, _DBUS_N_ELEMENTS (good),
+                          NULL))
+    _dbus_assert_not_reached ("AddMatches message failed");
+  _dbus_assert (bus_connection_get_n_match_rules (listener_side) == 2);
+
+  /* the limit counts the rules already there */
+  if (!check_add_matches (context, listener, many, max_rules - 1,
+                          DBUS_ERROR_LIMITS_EXCEEDED))
+    _dbus_assert_not_reached ("AddMatches up to the limit failed");
+  _dbus_assert (bus_connection_get_n_match_rules (listener_side) == 2);
+
+  dbus_free (many);
+
+  add_matches_test_emit (context, emitter, "First");
+  add_matches_test_emit (context, emitter, "Second");
+  add_matches_test_emit (context, emitter, "Third");
+  expect_test_signal (listener, "First");
+  expect_test_signal (listener, "Second");
+  _dbus_assert (pop_message_waiting_for_memory (listener) == NULL);
+
+  kill_client_connection_unchecked (listener);
+  kill_client_connection_unchecked (emitter);
+
+  bus_context_unref (context);
+
+  return TRUE;
+}
+
+/* Asks for or gives up a name, and throws away whatever comes back */
+static void
+call_bus_with_name (BusContext     *context,
+                    DBusConnection *client,
+                    const char     *method,
+                    const char     *name)
+{
+  DBusMessage *message;
+  dbus_uint32_t flags = 0;
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          method);
+  if (message == NULL ||
+      !dbus_message_append_args (message, DBUS_TYPE_STRING, &name,
+                                 DBUS_TYPE_INVALID) ||
+      (strcmp (method, "RequestName") == 0 &&
+       !dbus_message_append_args (message, DBUS_TYPE_UINT32, &flags,
+                                  DBUS_TYPE_INVALID)) ||
+      !dbus_connection_send (client, message, NULL))
+    _dbus_assert_not_reached ("no memory");
+  dbus_message_unref (message);
+
+  bus_test_run_everything (context);
+  while ((message = pop_message_waiting_for_memory (client)) != NULL)
+    dbus_message_unref (message);
+}
+
+#define NAME_BATCH_TEST_NAME "org.freedesktop.DBus.TestSuiteNameBatch"
+
+/* Calls a batch query with these names and returns the reply */
+static DBusMessage *
+name_batch_test_call (BusContext     *context,
+                      DBusConnection *client,
+                      const char     *method,
+                      const char    **names,
+                      int             n_names)
+{
+  DBusMessage *message;
+  dbus_uint32_t serial;
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          method);
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+                                 &names, n_names,
+                                 DBUS_TYPE_INVALID) ||
+      !dbus_connection_send (client, message, &serial))
+    _dbus_assert_not_reached ("no memory");
+  dbus_message_unref (message);
+
+  bus_test_run_everything (context);
+
+  message = pop_message_waiting_for_memory (client);
+  if (message == NULL)
+    _dbus_assert_not_reached ("no reply to a batch query");
+  _dbus_assert (dbus_message_get_reply_serial (message) == serial);
+
+  return message;
+}
+
+/* Checks the next entry of a GetNameOwners reply */
+static void
+name_batch_test_expect_owner (DBusMessageIter *dict_iter,
+                              const char      *name,
+                              const char      *owner)
+{
+  DBusMessageIter entry_iter;
+  const char *value;
+
+  _dbus_assert (dbus_message_iter_get_arg_type (dict_iter) == DBUS_TYPE_DICT_ENTRY);
+  dbus_message_iter_recurse (dict_iter, &entry_iter);
+  dbus_message_iter_get_basic (&entry_iter, &value);
+  _dbus_assert (strcmp (value, name) == 0);
+  dbus_message_iter_next (&entry_iter);
+  dbus_message_iter_get_basic (&entry_iter, &value);
+  _dbus_assert (strcmp (value, owner) == 0);
+
+  dbus_message_iter_next (dict_iter);
+}
+
+/* Checks the next entry of a GetConnectionsCredentials reply, and
+ * returns how many credentials it has
+ */
+static int
+name_batch_test_count_credentials (DBusMessageIter *dict_iter,
+                                   const char      *name)
+{
+  DBusMessageIter entry_iter, credentials_iter;
+  const char *value;
+  int n;
+
+  _dbus_assert (dbus_message_iter_get_arg_type (dict_iter) == DBUS_TYPE_DICT_ENTRY);
+  dbus_message_iter_recurse (dict_iter, &entry_iter);
+  dbus_message_iter_get_basic (&entry_iter, &value);
+  _dbus_assert (strcmp (value, name) == 0);
+  dbus_message_iter_next (&entry_iter);
+
+  n = 0;
+  dbus_message_iter_recurse (&entry_iter, &credentials_iter);
+  while (dbus_message_iter_get_arg_type (&credentials_iter) == DBUS_TYPE_DICT_ENTRY)
+    {
+      n += 1;
+      dbus_message_iter_next (&credentials_iter);
+    }
+
+  dbus_message_iter_next (dict_iter);
+  return n;
+}
+
+/* GetNameOwners and GetConnectionsCredentials answer for owned names,
+ * unowned ones and unique names nobody has, and turn away the whole
+ * batch if one of the names isn't a bus name at all
+ */
+dbus_bool_t
+bus_dispatch_name_batch_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *owner, *caller;
+  DBusConnection *owner_side;
+  DBusMessage *reply;
+  DBusMessageIter iter, dict_iter;
+  unsigned long uid;
+  const char *methods[] = { "GetNameOwners", "GetConnectionsCredentials" };
+  const char *names[5];
+  const char *invalid[2];
+  int n;
+  int i;
+
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/debug-allow-all.conf");
+  if (context == NULL)
+    return FALSE;
+
+  owner_side = connect_test_client (context, &owner);
+  connect_test_client (context, &caller);
+
+  call_bus_with_name (context, owner, "RequestName",
+                      NAME_BATCH_TEST_NAME);
+
+  names[0] = NAME_BATCH_TEST_NAME;
+  names[1] = dbus_bus_get_unique_name (owner);
+  names[2] = "org.freedesktop.DBus.TestSuiteNobody";
+  names[3] = ":1.99999";
+  names[4] = DBUS_SERVICE_DBUS;
+
+  reply = name_batch_test_call (context, caller, "GetNameOwners",
+                                names, _DBUS_N_ELEMENTS (names));
+  if (dbus_message_get_type (reply) != DBUS_MESSAGE_TYPE_METHOD_RETURN)
+    _dbus_assert_not_reached ("GetNameOwners failed");
+
+  dbus_message_iter_init (reply, &iter);
+  dbus_message_iter_recurse (&iter, &dict_iter);
+  name_batch_test_expect_owner (&dict_iter, names[0], names[1]);
+  name_batch_test_expect_owner (&dict_iter, names[1], names[1]);
+  name_batch_test_expect_owner (&dict_iter, names[2], "");
+  name_batch_test_expect_owner (&dict_iter, names[3], "");
+  name_batch_test_expect_owner (&dict_iter, names[4], DBUS_SERVICE_DBUS);
+  _dbus_assert (dbus_message_iter_get_arg_type (&dict_iter) == DBUS_TYPE_INVALID);
+  dbus_message_unref (reply);
+
+  reply = name_batch_test_call (context, caller, "GetConnectionsCredentials",
+                                names, 4);
+  if (dbus_message_get_type (reply) != DBUS_MESSAGE_TYPE_METHOD_RETURN)
+    _dbus_assert_not_reached ("GetConnectionsCredentials failed");
+
+  dbus_message_iter_init (reply, &iter);
+  dbus_message_iter_recurse (&iter, &dict_iter);
+  n = name_batch_test_count_credentials (&dict_iter, names[0]);
+  if (dbus_connection_get_unix_user (owner_side, &uid))
+    _dbus_assert (n > 0);
+  _dbus_assert (name_batch_test_count_credentials (&dict_iter, names[1]) == n);
+  _dbus_assert (name_batch_test_count_credentials (&dict_iter, names[2]) == 0);
+  _dbus_assert (name_batch_test_count_credentials (&dict_iter, names[3]) == 0);
+  _dbus_assert (dbus_message_iter_get_arg_type (&dict_iter) == DBUS_TYPE_INVALID);
+  dbus_message_unref (reply);
+
+  /* one bad name spoils the batch */
+  invalid[0] = NAME_BATCH_TEST_NAME;
+  invalid[1] = "not a bus name";
+
+  for (i = 0; i < (int) _DBUS_N_ELEMENTS (methods); i++)
+    {
+      reply = name_batch_test_call (context, caller, methods[i],
+                                    invalid, _DBUS_N_ELEMENTS (invalid));
+      if (!dbus_message_is_error (reply, DBUS_ERROR_INVALID_ARGS))
+        _dbus_assert_not_reached ("batch query took an invalid name");
+      dbus_message_unref (reply);
+    }
+
+  kill_client_connection_unchecked (owner);
+  kill_client_connection_unchecked (caller);
+
+  bus_context_unref (context);
+
+  return TRUE;
+}
+
+typedef struct
+{
+  int n_seen;       /**< Test signals the filter saw */
+  int n_no_memory;  /**< How many more to claim there was no memory for */
+} BatchTestData;
+
+static DBusHandlerResult
+batch_test_filter (DBusConnection *connection,
+                   DBusMessage    *message,
+                   void           *user_data)
+{
+  BatchTestData *d = user_data;
+
+  if (!dbus_message_has_interface (message, "org.freedesktop.TestInterface"))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  d->n_seen += 1;
+
+  if (d->n_no_memory > 0)
+    {
+      d->n_no_memory -= 1;
+      return DBUS_HANDLER_RESULT_NEED_MEMORY;
+    }
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+/* A batch dispatches no more than it is asked to, stops once the
+ * queue is empty, and stops at a handler that ran out of memory with
+ * the message put back for next time
+ */
+dbus_bool_t
+bus_dispatch_batch_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *sender, *receiver;
+  BatchTestData d;
+  const char *name;
+  int i;
+
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/debug-allow-all.conf");
+  if (context == NULL)
+    return FALSE;
+
+  connect_test_client (context, &sender);
+  connect_test_client (context, &receiver);
+  name = dbus_bus_get_unique_name (receiver);
+
+  _DBUS_ZERO (d);
+  if (!dbus_connection_add_filter (receiver, batch_test_filter, &d, NULL))
+    _dbus_assert_not_reached ("no memory");
+
+  for (i = 0; i < 5; i++)
+    send_test_signal (context, sender, name, "Batch");
+
+  _dbus_assert (dbus_connection_dispatch_batch (receiver, 3) ==
+                DBUS_DISPATCH_DATA_REMAINS);
+  _dbus_assert (d.n_seen == 3);
+
+  _dbus_assert (dbus_connection_dispatch_batch (receiver, 10) ==
+                DBUS_DISPATCH_COMPLETE);
+  _dbus_assert (d.n_seen == 5);
+
+  send_test_signal (context, sender, name, "Batch");
+  send_test_signal (context, sender, name, "Batch");
+
+  d.n_seen = 0;
+  d.n_no_memory = 1;
+  _dbus_assert (dbus_connection_dispatch_batch (receiver, 10) ==
+                DBUS_DISPATCH_DATA_REMAINS);
+  _dbus_assert (d.n_seen == 1);
+
+  /* the message that failed comes round again */
+  _dbus_assert (dbus_connection_dispatch_batch (receiver, 10) ==
+                DBUS_DISPATCH_COMPLETE);
+  _dbus_assert (d.n_seen == 3);
+
+  dbus_connection_remove_filter (receiver, batch_test_filter, &d);
+
+  kill_client_connection_unchecked (sender);
+  kill_client_connection_unchecked (receiver);
+
+  bus_context_unref (context);
+
+  return TRUE;
+}
+
+/* Messages sent while a connection is corked stay queued, and
+ * uncorking sends them in order, ahead of anything sent later
+ */
+dbus_bool_t
+bus_dispatch_cork_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *sender, *receiver;
+  DBusMessage *message;
+  const char *name;
+
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/debug-allow-all.conf");
+  if (context == NULL)
+    return FALSE;
+
+  connect_test_client (context, &sender);
+  connect_test_client (context, &receiver);
+  name = dbus_bus_get_unique_name (receiver);
+
+  dbus_connection_set_corked (sender, TRUE);
+
+  send_test_signal (context, sender, name, "Corked1");
+  send_test_signal (context, sender, name, "Corked2");
+  send_test_signal (context, sender, name, "Corked3");
+
+  /* the main loop ran, but nothing was written */
+  _dbus_assert (dbus_connection_has_messages_to_send (sender));
+  message = pop_message_waiting_for_memory (receiver);
+  if (message != NULL)
+    _dbus_assert_not_reached ("message got out of a corked connection");
+
+  dbus_connection_set_corked (sender, FALSE);
+  _dbus_assert (!dbus_connection_has_messages_to_send (sender));
+
+  send_test_signal (context, sender, name, "Uncorked");
+
+  expect_test_signal (receiver, "Corked1");
+  expect_test_signal (receiver, "Corked2");
+  expect_test_signal (receiver, "Corked3");
+  expect_test_signal (receiver, "Uncorked");
+  _dbus_assert (pop_message_waiting_for_memory (receiver) == NULL);
+
+  kill_client_connection_unchecked (sender);
+  kill_client_connection_unchecked (receiver);
+
+  bus_context_unref (context);
+
+  return TRUE;
+}
+
+#define SEND_BATCH_TEST_N_CALLS 3
+
+typedef struct
+{
+  dbus_uint32_t serials[SEND_BATCH_TEST_N_CALLS]; /**< Serials the calls went out with */
+  int n_completed;   /**< Times the batch callback ran */
+  int n_freed;       /**< Times the user data was freed */
+  dbus_bool_t failed; /**< A call had no reply, or not its own */
+} SendBatchTestData;
+
+static void
+send_batch_test_completed (DBusPendingCall **pending_calls,
+                           int               n_pending_calls,
+                           void             *user_data)
+{
+  SendBatchTestData *d = user_data;
+  DBusMessage *reply;
+  int i;
+
+  d->n_completed += 1;
+
+  if (n_pending_calls != SEND_BATCH_TEST_N_CALLS)
+    d->failed = TRUE;
+
+  for (i = 0; i < n_pending_calls; i++)
+    {
+      /* under OOM the bus may answer with NoMemory, which still counts */
+      reply = dbus_pending_call_steal_reply (pending_calls[i]);
+      if (reply == NULL ||
+          dbus_message_get_reply_serial (reply) != d->serials[i])
+        d->failed = TRUE;
+
+      if (reply)
+        dbus_message_unref (reply);
+    }
+}
+
+static void
+send_batch_test_free (void *user_data)
+{
+  SendBatchTestData *d = user_data;
+
+  d->n_freed += 1;
+}
+
+/* returns TRUE if the correct thing happens,
+ * but the correct thing may include OOM errors.
+ */
+static dbus_bool_t
+check_send_batch (BusContext     *context,
+                  DBusConnection *connection)
+{
+  DBusMessage *messages[SEND_BATCH_TEST_N_CALLS];
+  SendBatchTestData d;
+  dbus_bool_t retval;
+  int i;
+
+  retval = FALSE;
+  _DBUS_ZERO (d);
+  _DBUS_ZERO (messages);
+
+  for (i = 0; i < SEND_BATCH_TEST_N_CALLS; i++)
+    {
+      messages[i] = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                                  DBUS_PATH_DBUS,
+                                                  DBUS_INTERFACE_DBUS,
+                                                  "GetId");
+      if (messages[i] == NULL)
+        goto out;
+    }
+
+  if (!dbus_connection_send_with_reply_batch (connection, messages,
+                                              SEND_BATCH_TEST_N_CALLS, -1,
+                                              send_batch_test_completed,
+                                              &d, send_batch_test_free))
+    {
+      /* A batch that fails part-way must not leave the calls it had
+       * already set up behind: none of them may go out, so no reply
+       * comes back, and the callback and user data are left alone.
+       */
+      bus_test_run_everything (context);
+
+      if (!check_no_leftovers (context))
+        {
+          _dbus_warn ("Part of a failed batch was sent\n");
+          goto out;
+        }
+
+      _dbus_assert (d.n_completed == 0);
+      _dbus_assert (d.n_freed == 0);
+
+      retval = TRUE;
+      goto out;
+    }
+
+  for (i = 0; i < SEND_BATCH_TEST_N_CALLS; i++)
+    d.serials[i] = dbus_message_get_serial (messages[i]);
+
+  while (d.n_completed == 0)
+    {
+      bus_test_run_everything (context);
+
+      if (dbus_connection_dispatch (connection) == DBUS_DISPATCH_NEED_MEMORY)
+        _dbus_wait_for_memory ();
+    }
+
+  if (d.failed || d.n_completed != 1 || d.n_freed != 1)
+    {
+      _dbus_warn ("Batch completed %d times, freed %d times, with %s replies\n",
+                  d.n_completed, d.n_freed, d.failed ? "wrong" : "the right");
+      goto out;
+    }
+
+  retval = TRUE;
+
+ out:
+  for (i = 0; i < SEND_BATCH_TEST_N_CALLS; i++)
+    {
+      if (messages[i])
+        dbus_message_unref (messages[i]);
+    }
+
+  return retval;
+}
+
+/* A batch of calls completes once with every reply in order, and a
+ * batch that runs out of memory part-way sends none of its calls
+ */
+dbus_bool_t
+bus_dispatch_send_batch_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *client;
+
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/debug-allow-all.conf");
+  if (context == NULL)
+    return FALSE;
+
+  connect_test_client (context, &client);
+
+  check2_try_iterations (context, client, "send_batch", check_send_batch);
+
+  kill_client_connection_unchecked (client);
+
+  bus_context_unref (context);
+
+  return TRUE;
+}
+
+#define LANES_TEST_BULK_SIZE (128 * 1024)
+
+/* Queues a signal on the bus side of a connection, as if the bus were
+ * forwarding it from sender
+ */
+static void
+lanes_test_queue (DBusConnection *receiver_side,
+                  const char     *receiver,
+                  const char     *sender,
+                  const char     *member,
+                  int             size)
+{
+  DBusMessage *message;
+  unsigned char *bytes;
+
+  bytes = dbus_malloc0 (size);
+  message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                     "org.freedesktop.TestInterface",
+                                     member);
+  if (bytes == NULL ||
+      message == NULL ||
+      !dbus_message_set_destination (message, receiver) ||
+      !dbus_message_set_sender (message, sender) ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE,
+                                 &bytes, size,
+                                 DBUS_TYPE_INVALID) ||
+      !dbus_connection_send (receiver_side, message, NULL))
+    _dbus_assert_not_reached ("no memory");
+
+  dbus_message_unref (message);
+  dbus_free (bytes);
+}
+
+/* Checks the next message a test client gets is the given signal */
+static void
+lanes_test_expect (BusContext     *context,
+                   DBusConnection *receiver,
+                   const char     *sender,
+                   const char     *member)
+{
+  DBusMessage *message;
+
+  /* The bus can't finish writing a bulk message until the receiver
+   * reads some of it, so block on neither side
+   */
+  while (dbus_connection_get_dispatch_status (receiver) ==
+         DBUS_DISPATCH_COMPLETE &&
+         dbus_connection_get_is_connected (receiver))
+    bus_test_run_everything (context);
+
+  message = pop_message_waiting_for_memory (receiver);
+  if (message == NULL)
+    _dbus_assert_not_reached ("signal did not arrive");
+  if (!dbus_message_has_member (message, member) ||
+      !dbus_message_has_sender (message, sender))
+    {
+      _dbus_warn ("Expected %s from %s, got %s from %s\n", member, sender,
+                  dbus_message_get_member (message),
+                  dbus_message_get_sender (message));
+      _dbus_assert_not_reached ("signals arrived out of order");
+    }
+  dbus_message_unref (message);
+}
+
+/* On the bus, a small message from one sender overtakes a bulk message
+ * from another, but never one from its own sender
+ */
+dbus_bool_t
+bus_dispatch_outgoing_lanes_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *first, *second, *receiver;
+  DBusConnection *receiver_side;
+  const char *first_name, *second_name, *receiver_name;
+
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/debug-allow-all.conf");
+  if (context == NULL)
+    return FALSE;
+
+  connect_test_client (context, &first);
+  connect_test_client (context, &second);
+  receiver_side = connect_test_client (context, &receiver);
+  first_name = dbus_bus_get_unique_name (first);
+  second_name = dbus_bus_get_unique_name (second);
+  receiver_name = dbus_bus_get_unique_name (receiver);
+
+  /* hold everything in the queue until it is all there */
+  dbus_connection_set_corked (receiver_side, TRUE);
+
+  lanes_test_queue (receiver_side, receiver_name, first_name, "Bulk1",
+                    LANES_TEST_BULK_SIZE);
+  lanes_test_queue (receiver_side, receiver_name, first_name, "Bulk2",
+                    LANES_TEST_BULK_SIZE);
+  lanes_test_queue (receiver_side, receiver_name, second_name, "Small",
+                    16);
+  lanes_test_queue (receiver_side, receiver_name, first_name, "AfterBulk",
+                    16);
+
+  dbus_connection_set_corked (receiver_side, FALSE);
+
+  /* Bulk1 is at the head of the queue, so nothing passes it; the other
+   * sender's Small passes Bulk2, but AfterBulk doesn't
+   */
+  lanes_test_expect (context, receiver, first_name, "Bulk1");
+  lanes_test_expect (context, receiver, second_name, "Small");
+  lanes_test_expect (context, receiver, first_name, "Bulk2");
+  lanes_test_expect (context, receiver, first_name, "AfterBulk");
+  _dbus_assert (pop_message_waiting_for_memory (receiver) == NULL);
+
+  kill_client_connection_unchecked (first);
+  kill_client_connection_unchecked (second);
+  kill_client_connection_unchecked (receiver);
+
+  bus_context_unref (context);
+
+  return TRUE;
+}
+
+/* The matchmaker benchmark fills the bus with between 10^2 and 10^6
+ * rules split evenly between three shapes seen on real buses, and
+ * times how long it takes to add them, to find the recipients of a
+ * signal aimed at each shape, and to throw the rules away again as
+ * their owners disconnect.
+ */
+#define BENCHMARK_N_CONNECTIONS 32
+#define BENCHMARK_N_INTERFACES 64
+#define BENCHMARK_MAX_RULES 1000000
+#define BENCHMARK_N_SIGNALS 64
+#define BENCHMARK_ITERATIONS 10000
+
+typedef enum
+{
+  BENCHMARK_RULE_PATH,   /* interface, member and path */
+  BENCHMARK_RULE_ARG0,   /* NameOwnerChanged for one name */
+  BENCHMARK_RULE_SENDER, /* a signal from one peer */
+  BENCHMARK_N_RULE_SHAPES
+} BenchmarkRuleShape;
+
+static const char * const benchmark_rule_shape_names[BENCHMARK_N_RULE_SHAPES] = {
+  "path", "arg0", "sender"
+};
+
+static long
+benchmark_elapsed_usec (long *sec,
+                        long *usec)
+{
+  long now_sec, now_usec;
+  long elapsed;
+
+  _dbus_get_current_time (&now_sec, &now_usec);
+  elapsed = (now_sec - *sec) * 1000000 + (now_usec - *usec);
+  *sec = now_sec;
+  *usec = now_usec;
+
+  return elapsed;
+}
+
+static void
+benchmark_report (const char *operation,
+                  const char *shape,
+                  int         n_rules,
+                  int         iterations,
+                  long        usec)
+{
+  printf ("BENCH\t%s\t%s\t%d\t%d\t%ld\n", operation, shape, n_rules,
+          iterations, (long) ((double) usec * 1000 / iterations));
+}
+
+static BusMatchRule *
+benchmark_rule_new (BusMatchmaker   *matchmaker,
+                    DBusConnection **connections,
+                    int              i)
+{
+  BusMatchRule *rule;
+  DBusString str;
+  DBusError error;
+  char text[256];
+  int n;
+
+  n = i / BENCHMARK_N_RULE_SHAPES;
+
+  switch (i % BENCHMARK_N_RULE_SHAPES)
+    {
+    case BENCHMARK_RULE_PATH:
+      snprintf (text, sizeof (text),
+                "type='signal',interface='com.example.Interface%d',"
+                "member='PropertiesChanged',path='/com/example/Object%d'",
+                n % BENCHMARK_N_INTERFACES, n);
+      break;
+    case BENCHMARK_RULE_ARG0:
+      snprintf (text, sizeof (text),
+                "type='signal',sender='" DBUS_SERVICE_DBUS "',"
+                "interface='" DBUS_INTERFACE_DBUS "',"
+                "member='NameOwnerChanged',arg0='com.example.Name%d'", n);
+      break;
+    default:
+      snprintf (text, sizeof (text),
+                "type='signal',sender='%s',"
+                "interface='com.example.Interface%d',member='Ping'",
+                bus_connection_get_name (connections[(n + 1) % BENCHMARK_N_CONNECTIONS]),
+                n % BENCHMARK_N_INTERFACES);
+      break;
+    }
+
+  dbus_error_init (&error);
+  _dbus_string_init_const (&str, text);
+
+  rule = bus_matchmaker_parse_rule (matchmaker,
+                                    connections[n % BENCHMARK_N_CONNECTIONS],
+                                    &str, &error);
+  if (rule == NULL)
+    _dbus_assert_not_reached ("could not parse benchmark rule");
+
+  return rule;
+}
+
+/* A signal for the given shape, aimed at the rules of the n'th rule of
+ * that shape; *sender_p is who it comes from.
+ */
+static DBusMessage *
+benchmark_signal_new (DBusConnection    **connections,
+                      BenchmarkRuleShape  shape,
+                      int                 n,
+                      DBusConnection    **sender_p)
+{
+  DBusMessage *message;
+  char path[64], name[64], iface[64];
+  const char *p_name = name;
+  const char *empty = "";
+  const char *owner;
+  dbus_bool_t ok;
+
+  snprintf (iface, sizeof (iface), "com.example.Interface%d",
+            n % BENCHMARK_N_INTERFACES);
+
+  switch (shape)
+    {
+    case BENCHMARK_RULE_PATH:
+      snprintf (path, sizeof (path), "/com/example/Object%d", n);
+      message = dbus_message_new_signal (path, iface, "PropertiesChanged");
+      ok = message != NULL;
+      *sender_p = connections[0];
+      break;
+    case BENCHMARK_RULE_ARG0:
+      snprintf (name, sizeof (name), "com.example.Name%d", n);
+      owner = bus_connection_get_name (connections[0]);
+      message = dbus_message_new_signal (DBUS_PATH_DBUS, DBUS_INTERFACE_DBUS,
+                                         "NameOwnerChanged");
+      ok = message != NULL &&
+        dbus_message_append_args (message,
+                                  DBUS_TYPE_STRING, &p_name,
+                                  DBUS_TYPE_STRING, &empty,
+                                  DBUS_TYPE_STRING, &owner,
+                                  DBUS_TYPE_INVALID);
+      *sender_p = NULL;
+      break;
+    default:
+      message = dbus_message_new_signal ("/com/example", iface, "Ping");
+      ok = message != NULL;
+      *sender_p = connections[(n + 1) % BENCHMARK_N_CONNECTIONS];
+      break;
+    }
+
+  if (!ok)
+    _dbus_assert_not_reached ("no memory");
+
+  return message;
+}
+
+static void
+benchmark_get_recipients (BusContext      *context,
+                          DBusConnection **connections,
+                          int              n_rules)
+{
+  BusMatchmaker *matchmaker;
+  DBusMessage *messages[BENCHMARK_N_SIGNALS];
+  DBusConnection *senders[BENCHMARK_N_SIGNALS];
+  int shape;
+
+  matchmaker = bus_context_get_matchmaker (context);
+
+  for (shape = 0; shape < BENCHMARK_N_RULE_SHAPES; shape++)
+    {
+      long sec, usec;
+      int per_shape;
+      int i;
+
+      per_shape = MAX (1, n_rules / BENCHMARK_N_RULE_SHAPES);
+
+      /* spread the signals over the rules rather than hitting one */
+      for (i = 0; i < BENCHMARK_N_SIGNALS; i++)
+        messages[i] = benchmark_signal_new (connections, shape,
+                                            (int) (((long) i * 7919) % per_shape),
+                                            &senders[i]);
+
+      benchmark_elapsed_usec (&sec, &usec);
+      for (i = 0; i < BENCHMARK_ITERATIONS; i++)
+        {
+          DBusConnection **recipients;
+          int n_recipients;
+          int j = i % BENCHMARK_N_SIGNALS;
+
+          if (!bus_matchmaker_get_recipients (matchmaker,
+                                              bus_context_get_connections (context),
+                                              senders[j], NULL, messages[j],
+                                              &recipients, &n_recipients))
+            _dbus_assert_not_reached ("no memory");
+
+          bus_matchmaker_release_recipients (matchmaker, recipients);
+        }
+      benchmark_report ("get_recipients", benchmark_rule_shape_names[shape],
+                        n_rules, BENCHMARK_ITERATIONS,
+                        benchmark_elapsed_usec (&sec, &usec));
+
+      for (i = 0; i < BENCHMARK_N_SIGNALS; i++)
+        dbus_message_unref (messages[i]);
+    }
+}
+
+static void
+benchmark_matchmaker (BusContext      *context,
+                      DBusConnection **connections,
+                      int              n_rules)
+{
+  BusMatchmaker *matchmaker;
+  BusMatchRule **rules;
+  long sec, usec;
+  int n_rule_sets, n_current, n_cached, max_recipients;
+  int i;
+
+  matchmaker = bus_context_get_matchmaker (context);
+
+  rules = dbus_new (BusMatchRule *, n_rules);
+  if (rules == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  benchmark_elapsed_usec (&sec, &usec);
+  for (i = 0; i < n_rules; i++)
+    rules[i] = benchmark_rule_new (matchmaker, connections, i);
+  benchmark_report ("parse_rule", "mixed", n_rules, n_rules,
+                    benchmark_elapsed_usec (&sec, &usec));
+
+  for (i = 0; i < n_rules; i++)
+    {
+      if (!bus_matchmaker_add_rule (matchmaker, rules[i]))
+        _dbus_assert_not_reached ("no memory");
+    }
+  benchmark_report ("add_rule", "mixed", n_rules, n_rules,
+                    benchmark_elapsed_usec (&sec, &usec));
+
+  for (i = 0; i < n_rules; i++)
+    bus_match_rule_unref (rules[i]);
+  dbus_free (rules);
+
+  bus_matchmaker_get_stats (matchmaker, &n_rule_sets, &n_current, &n_cached,
+                            &max_recipients);
+  _dbus_assert (n_current == n_rules);
+
+  benchmark_get_recipients (context, connections, n_rules);
+
+  benchmark_elapsed_usec (&sec, &usec);
+  for (i = 0; i < BENCHMARK_N_CONNECTIONS; i++)
+    bus_matchmaker_disconnected (matchmaker, connections[i]);
+  benchmark_report ("disconnected", "mixed", n_rules, BENCHMARK_N_CONNECTIONS,
+                    benchmark_elapsed_usec (&sec, &usec));
+
+  bus_matchmaker_get_stats (matchmaker, &n_rule_sets, &n_current, &n_cached,
+                            &max_recipients);
+  _dbus_assert (n_current == 0);
+}
+
+dbus_bool_t
+bus_matchmaker_benchmark (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *clients[BENCHMARK_N_CONNECTIONS];
+  DBusConnection *connections[BENCHMARK_N_CONNECTIONS];
+  int n_rules;
+  int i;
+
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/debug-allow-all.conf");
+  if (context == NULL)
+    return FALSE;
+
+  for (i = 0; i < BENCHMARK_N_CONNECTIONS; i++)
+    connections[i] = connect_test_client (context, &clients[i]);
+
+  for (n_rules = 100; n_rules <= BENCHMARK_MAX_RULES; n_rules *= 10)
+    benchmark_matchmaker (context, connections, n_rules);
+
+  for (i = 0; i < BENCHMARK_N_CONNECTIONS; i++)
+    kill_client_connection_unchecked (clients[i]);
+
+  bus_context_unref (context);
+
+  return TRUE;
+}
+
+#ifdef DBUS_UNIX
+
+#define HANDOFF_TEST_NAME "org.freedesktop.DBus.TestSuiteHandoff"
+#define HANDOFF_TEST_RULE "type='signal',interface='org.freedesktop.TestInterface'"
+
+typedef struct
+{
+  DBusConnection *will_send_reply;
+  dbus_uint32_t reply_serial;
+  dbus_bool_t found;
+} HandoffTestReply;
+
+static dbus_bool_t
+handoff_test_find_reply (DBusConnection *will_send_reply,
+                         dbus_uint32_t   reply_serial,
+                         void           *data)
+{
+  HandoffTestReply *d = data;
+
+  if (will_send_reply == d->will_send_reply &&
+      reply_serial == d->reply_serial)
+    d->found = TRUE;
+
+  return TRUE;
+}
+
+/* Returns the bus side of the connection with this unique name */
+static DBusConnection *
+handoff_test_lookup (BusContext *context,
+                     const char *name)
+{
+  BusService *service;
+  DBusString str;
+
+  _dbus_string_init_const (&str, name);
+  service = bus_registry_lookup (bus_context_get_registry (context), &str);
+  if (service == NULL)
+    return NULL;
+
+  return bus_service_get_primary_owners_connection (service);
+}
+
+/* Checks state that isn't what bus_handoff_save() writes is turned
+ * away with an error
+ */
+static void
+handoff_test_load_invalid (const char *data,
+                           int         len)
+{
+  BusHandoff *handoff;
+  DBusString str;
+  DBusError error;
+  int fd;
+
+  dbus_error_init (&error);
+
+  fd = _dbus_open_unlinked_temp_file (&error);
+  if (fd < 0)
+    _dbus_assert_not_reached ("could not open a temporary file");
+
+  _dbus_string_init_const_len (&str, data, len);
+  if (_dbus_write (fd, &str, 0, len) != len ||
+      lseek (fd, 0, SEEK_SET) < 0)
+    _dbus_assert_not_reached ("could not write the state");
+
+  handoff = bus_handoff_load (fd, &error);
+  if (handoff != NULL)
+    _dbus_assert_not_reached ("invalid bus state was loaded");
+  _dbus_assert (dbus_error_is_set (&error));
+  _dbus_assert (!dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY));
+  dbus_error_free (&error);
+}
+
+/* A bus handed over to a fresh context still has its clients' names,
+ * match rules and the replies they are owed, and state that was cut
+ * short or isn't ours is refused
+ */
+dbus_bool_t
+bus_dispatch_handoff_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  BusHandoff *handoff, *loaded;
+  DBusConnection *owner, *caller;
+  DBusConnection *sides[2];
+  DBusMessage *message, *call;
+  DBusError error;
+  DBusString state;
+  HandoffTestReply reply;
+  dbus_uint32_t serial, version;
+  char *data;
+  int fds[2], saved[2];
+  int state_fd;
+  int bytes, len;
+  int i;
+
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/handoff.conf");
+  if (context == NULL)
+    return FALSE;
+
+  dbus_error_init (&error);
+
+  /* debug-pipe servers can't be handed over, so these are unix sockets */
+  sides[0] = connect_test_client_to (context, bus_context_get_address (context),
+                                     &owner);
+  sides[1] = connect_test_client_to (context, bus_context_get_address (context),
+                                     &caller);
+
+  call_bus_with_name (context, owner, "RequestName", HANDOFF_TEST_NAME);
+  call_bus_with_name (context, owner, "AddMatch", HANDOFF_TEST_RULE);
+
+  /* the owner doesn't answer until the new bus has taken over */
+  call = dbus_message_new_method_call (HANDOFF_TEST_NAME,
+                                       "/org/freedesktop/TestPath",
+                                       "org.freedesktop.TestInterface",
+                                       "Wait");
+  if (call == NULL ||
+      !dbus_connection_send (caller, call, &serial))
+    _dbus_assert_not_reached ("no memory");
+  dbus_message_unref (call);
+
+  bus_test_run_everything (context);
+
+  call = pop_message_waiting_for_memory (owner);
+  if (call == NULL || !dbus_message_has_member (call, "Wait"))
+    _dbus_assert_not_reached ("method call didn't arrive");
+
+  handoff = bus_handoff_start (context, &error);
+  if (handoff == NULL)
+    _dbus_assert_not_reached ("could not start handing the bus over");
+
+  state_fd = bus_handoff_save (handoff, &error);
+  if (state_fd < 0)
+    _dbus_assert_not_reached ("could not save the bus state");
+
+  /* bus_handoff_load() closes its copy, bus_handoff_cancel() ours */
+  loaded = bus_handoff_load (dup (state_fd), &error);
+  if (loaded == NULL)
+    _dbus_assert_not_reached ("could not load the bus state");
+
+  if (!_dbus_string_init (&state) ||
+      lseek (state_fd, 0, SEEK_SET) < 0)
+    _dbus_assert_not_reached ("could not rewind the bus state");
+
+  while ((bytes = _dbus_read (state_fd, &state, 4096)) > 0)
+    ;
+  _dbus_assert (bytes == 0);
+
+  handoff_test_load_invalid (_dbus_string_get_const_data (&state),
+                             _dbus_string_get_length (&state) / 2);
+  handoff_test_load_invalid (_dbus_string_get_const_data (&state), 0);
+  _dbus_string_free (&state);
+
+  /* well formed, but not a bus state */
+  message = dbus_message_new_signal (DBUS_PATH_DBUS, DBUS_INTERFACE_DBUS,
+                                     "Handoff");
+  version = 1;
+  if (message == NULL ||
+      !dbus_message_append_args (message, DBUS_TYPE_UINT32, &version,
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("no memory");
+  dbus_message_set_serial (message, 1);
+  if (!dbus_message_marshal (message, &data, &len))
+    _dbus_assert_not_reached ("no memory");
+  dbus_message_unref (message);
+
+  handoff_test_load_invalid (data, len);
+  dbus_free (data);
+
+  /* What exec does for us: the sockets outlive the old bus, under
+   * the same numbers
+   */
+  for (i = 0; i < (int) _DBUS_N_ELEMENTS (sides); i++)
+    {
+      if (!dbus_connection_get_socket (sides[i], &fds[i]))
+        _dbus_assert_not_reached ("bus side has no socket");
+
+      saved[i] = dup (fds[i]);
+      if (saved[i] < 0)
+        _dbus_assert_not_reached ("could not set the socket aside");
+    }
+
+  bus_handoff_cancel (handoff);
+  bus_context_unref (context);
+
+  for (i = 0; i < (int) _DBUS_N_ELEMENTS (sides); i++)
+    {
+      if (dup2 (saved[i], fds[i]) < 0)
+        _dbus_assert_not_reached ("could not put the socket back");
+      _dbus_close (saved[i], NULL);
+    }
+
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/handoff.conf");
+  if (context == NULL)
+    _dbus_assert_not_reached ("could not create the new bus");
+
+  if (!bus_handoff_restore_connections (loaded, context, &error))
+    _dbus_assert_not_reached ("could not restore the connections");
+  bus_handoff_free (loaded);
+
+  sides[0] = handoff_test_lookup (context, dbus_bus_get_unique_name (owner));
+  sides[1] = handoff_test_lookup (context, dbus_bus_get_unique_name (caller));
+  _dbus_assert (sides[0] != NULL && sides[1] != NULL);
+  _dbus_assert (handoff_test_lookup (context, HANDOFF_TEST_NAME) == sides[0]);
+  _dbus_assert (_dbus_list_get_length (bus_connection_get_match_rules (sides[0])) == 1);
+
+  reply.will_send_reply = sides[0];
+  reply.reply_serial = serial;
+  reply.found = FALSE;
+  bus_connection_foreach_reply_to_receive (sides[1], handoff_test_find_reply,
+                                           &reply);
+  _dbus_assert (reply.found);
+
+  /* the match rule still routes */
+  message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                     "org.freedesktop.TestInterface",
+                                     "Broadcast");
+  if (message == NULL ||
+      !dbus_connection_send (caller, message, NULL))
+    _dbus_assert_not_reached ("no memory");
+  dbus_message_unref (message);
+
+  bus_test_run_everything (context);
+  expect_test_signal (owner, "Broadcast");
+
+  /* and the reply still gets through */
+  message = dbus_message_new_method_return (call);
+  if (message == NULL ||
+      !dbus_connection_send (owner, message, NULL))
+    _dbus_assert_not_reached ("no memory");
+  dbus_message_unref (message);
+  dbus_message_unref (call);
+
+  bus_test_run_everything (context);
+
+  message = pop_message_waiting_for_memory (caller);
+  if (message == NULL ||
+      dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+      dbus_message_get_reply_serial (message) != serial)
+    _dbus_assert_not_reached ("reply owed before the handoff didn't arrive");
+  dbus_message_unref (message);
+
+  kill_client_connection_unchecked (owner);
+  kill_client_connection_unchecked (caller);
+
+  bus_context_unref (context);
+
+  return TRUE;
+}
+
+#endif /* DBUS_UNIX */
+
+static DBusHandlerResult
+deferred_reply_test_filter (DBusConnection *connection,
+                            DBusMessage    *message,
+                            void           *user_data)
+{
+  DBusDeferredReply **reply_p = user_data;
+
+  if (!dbus_message_is_method_call (message, "org.freedesktop.TestInterface",
+                                    "Deferred"))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  _dbus_assert (*reply_p == NULL);
+
+  *reply_p = dbus_connection_defer_reply (connection, message);
+  if (*reply_p == NULL)
+    return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+/* Has the callee defer a call from the caller, and returns the call's
+ * serial once the callee's handler has returned
+ */
+static dbus_uint32_t
+deferred_reply_test_call (BusContext         *context,
+                          DBusConnection     *caller,
+                          DBusConnection     *callee,
+                          DBusDeferredReply **reply_p)
+{
+  DBusMessage *message;
+  dbus_uint32_t serial;
+
+  message = dbus_message_new_method_call (dbus_bus_get_unique_name (callee),
+                                          "/org/freedesktop/TestPath",
+                                          "org.freedesktop.TestInterface",
+                                          "Deferred");
+  if (message == NULL ||
+      !dbus_connection_send (caller, message, &serial))
+    _dbus_assert_not_reached ("no memory");
+  dbus_message_unref (message);
+
+  bus_test_run_everything (context);
+
+  while (*reply_p == NULL)
+    {
+      if (dbus_connection_dispatch (callee) == DBUS_DISPATCH_NEED_MEMORY)
+        _dbus_wait_for_memory ();
+    }
+
+  /* nothing goes back until the reply is sent */
+  bus_test_run_everything (context);
+  _dbus_assert (pop_message_waiting_for_memory (caller) == NULL);
+
+  return serial;
+}
+
+/* A deferred reply reaches the caller when it is sent, and dropping
+ * one unsent gets the caller an error rather than a timeout
+ */
+dbus_bool_t
+bus_dispatch_deferred_reply_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *caller, *callee;
+  DBusDeferredReply *reply;
+  DBusMessage *message;
+  dbus_uint32_t serial;
+
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/debug-allow-all.conf");
+  if (context == NULL)
+    return FALSE;
+
+  connect_test_client (context, &caller);
+  connect_test_client (context, &callee);
+
+  reply = NULL;
+  if (!dbus_connection_add_filter (callee, deferred_reply_test_filter,
+                                   &reply, NULL))
+    _dbus_assert_not_reached ("no memory");
+
+  serial = deferred_reply_test_call (context, caller, callee, &reply);
+  _dbus_assert (dbus_message_get_serial (dbus_deferred_reply_get_method_call (reply)) == serial);
+
+  /* the reply serial and destination are filled in for us */
+  message = dbus_message_new (DBUS_MESSAGE_TYPE_METHOD_RETURN);
+  if (message == NULL)
+    _dbus_assert_not_reached ("no memory");
+  while (!dbus_deferred_reply_send (reply, message))
+    _dbus_wait_for_memory ();
+  dbus_message_unref (message);
+  dbus_deferred_reply_unref (reply);
+  reply = NULL;
+
+  bus_test_run_everything (context);
+
+  message = pop_message_waiting_for_memory (caller);
+  if (message == NULL ||
+      dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+      dbus_message_get_reply_serial (message) != serial)
+    _dbus_assert_not_reached ("deferred reply didn't arrive");
+  dbus_message_unref (message);
+
+  /* sending it doesn't leave an error to follow when the token goes */
+  _dbus_assert (pop_message_waiting_for_memory (caller) == NULL);
+
+  serial = deferred_reply_test_call (context, caller, callee, &reply);
+  dbus_deferred_reply_unref (reply);
+  reply = NULL;
+
+  bus_test_run_everything (context);
+
+  message = pop_message_waiting_for_memory (caller);
+  if (message == NULL ||
+      !dbus_message_is_error (message, DBUS_ERROR_FAILED) ||
+      dbus_message_get_reply_serial (message) != serial)
+    _dbus_assert_not_reached ("dropped deferred reply didn't fail the call");
+  dbus_message_unref (message);
+
+  dbus_connection_remove_filter (callee, deferred_reply_test_filter, &reply);
+
+  kill_client_connection_unchecked (caller);
+  kill_client_connection_unchecked (callee);
+
+  bus_context_unref (context);
+
+  return TRUE;
+}
+
+/* The statistics of both ends follow traffic through the bus: what
+ * is queued, what was written and read, and what was dispatched
+ */
+dbus_bool_t
+bus_dispatch_statistics_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *sender, *receiver;
+  DBusConnectionStatistics before, after;
+  DBusPendingCall *pending;
+  DBusMessage *message;
+  const char *name;
+
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/debug-allow-all.conf");
+  if (context == NULL)
+    return FALSE;
+
+  connect_test_client (context, &sender);
+  connect_test_client (context, &receiver);
+  name = dbus_bus_get_unique_name (receiver);
+
+  /* corked, the signals wait in the outgoing queue */
+  dbus_connection_get_statistics (sender, &before);
+  dbus_connection_set_corked (sender, TRUE);
+  send_test_signal (context, sender, name, "Counted1");
+  send_test_signal (context, sender, name, "Counted2");
+
+  dbus_connection_get_statistics (sender, &after);
+  _dbus_assert (after.outgoing_messages == before.outgoing_messages + 2);
+  _dbus_assert (after.outgoing_bytes > before.outgoing_bytes);
+  _dbus_assert (after.messages_sent == before.messages_sent);
+  _dbus_assert (after.bytes_sent == before.bytes_sent);
+
+  dbus_connection_set_corked (sender, FALSE);
+  bus_test_run_everything (context);
+
+  dbus_connection_get_statistics (sender, &after);
+  _dbus_assert (after.outgoing_messages == before.outgoing_messages);
+  _dbus_assert (after.outgoing_bytes == before.outgoing_bytes);
+  _dbus_assert (after.messages_sent == before.messages_sent + 2);
+  _dbus_assert (after.bytes_sent > before.bytes_sent);
+  _dbus_assert (after.writes > before.writes);
+
+  /* the receiver has them queued until it dispatches them */
+  dbus_connection_get_statistics (receiver, &before);
+  _dbus_assert (before.incoming_messages == 2);
+  _dbus_assert (before.incoming_bytes > 0);
+  _dbus_assert (before.reads > 0);
+
+  while (dbus_connection_dispatch (receiver) != DBUS_DISPATCH_COMPLETE)
+    _dbus_wait_for_memory ();
+
+  dbus_connection_get_statistics (receiver, &after);
+  _dbus_assert (after.incoming_messages == 0);
+  _dbus_assert (after.incoming_bytes == 0);
+  _dbus_assert (after.messages_received == before.messages_received);
+  _dbus_assert (after.bytes_received == before.bytes_received);
+  _dbus_assert (after.messages_dispatched == before.messages_dispatched + 2);
+
+  /* a call counts as pending until its reply is dispatched */
+  dbus_connection_get_statistics (sender, &before);
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "GetId");
+  if (message == NULL ||
+      !dbus_connection_send_with_reply (sender, message, &pending, -1) ||
+      pending == NULL)
+    _dbus_assert_not_reached ("no memory");
+  dbus_message_unref (message);
+
+  dbus_connection_get_statistics (sender, &after);
+  _dbus_assert (after.pending_calls == before.pending_calls + 1);
+
+  while (!dbus_pending_call_get_completed (pending))
+    {
+      bus_test_run_everything (context);
+
+      if (dbus_connection_dispatch (sender) == DBUS_DISPATCH_NEED_MEMORY)
+        _dbus_wait_for_memory ();
+    }
+  dbus_pending_call_unref (pending);
+
+  dbus_connection_get_statistics (sender, &after);
+  _dbus_assert (after.pending_calls == before.pending_calls);
+  _dbus_assert (after.messages_received == before.messages_received + 1);
+  _dbus_assert (after.bytes_received > before.bytes_received);
+  _dbus_assert (after.reads > before.reads);
+
+  kill_client_connection_unchecked (sender);
+  kill_client_connection_unchecked (receiver);
+
+  bus_context_unref (context);
+
+  return TRUE;
+}
+
+/* Sends a signal from one test client straight to another, padded
+ * with a string of n_bytes to make it bigger
+ */
+static void
+priority_test_send (BusContext     *context,
+                    DBusConnection *from,
+                    DBusConnection *to,
+                    const char     *member,
+                    int             n_bytes)
+{
+  DBusMessage *message;
+  char *padding;
+
+  padding = dbus_malloc (n_bytes + 1);
+  if (padding == NULL)
+    _dbus_assert_not_reached ("no memory");
+  memset (padding, 'x', n_bytes);
+  padding[n_bytes] = '\0';
+
+  message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                     "org.freedesktop.TestInterface",
+                                     member);
+  if (message == NULL ||
+      !dbus_message_set_destination (message, dbus_bus_get_unique_name (to)) ||
+      (n_bytes > 0 &&
+       !dbus_message_append_args (message, DBUS_TYPE_STRING, &padding,
+                                  DBUS_TYPE_INVALID)) ||
+      !dbus_connection_send (from, message, NULL))
+    _dbus_assert_not_reached ("no memory");
+  dbus_message_unref (message);
+  dbus_free (padding);
+
+  bus_test_run_everything (context);
+}
+
+/* Checks the signals sent by priority_test_send() arrive in this order */
+static void
+priority_test_expect (BusContext     *context,
+                      DBusConnection *client,
+                      const char    **members)
+{
+  DBusMessage *message;
+  int i;
+
+  bus_test_run_everything (context);
+
+  for (i = 0; members[i] != NULL; i++)
+    {
+      message = pop_message_waiting_for_memory (client);
+      if (message == NULL)
+        _dbus_assert_not_reached ("signal didn't arrive");
+      if (!dbus_message_has_member (message, members[i]))
+        _dbus_assert_not_reached ("signals arrived out of order");
+      dbus_message_unref (message);
+    }
+}
+
+#define PRIORITY_TEST_NAME "org.freedesktop.DBus.TestSuitePriority"
+#define PRIORITY_TEST_BUDGET 1024
+
+/* The owner of a priority_name should get priority while it owns it,
+ * and what it sends should be queued ahead of other messages waiting
+ * for the recipient, but never ahead of the first, nor of its own
+ * earlier messages, and only within the recipient's
+ * max_priority_outgoing_bytes
+ */
+dbus_bool_t
+bus_dispatch_priority_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *fast, *slow, *receiver;
+  DBusConnection *fast_side, *slow_side, *receiver_side;
+  const char *jumped[] = { "Slow1", "Fast", "Slow2", NULL };
+  const char *in_order[] = { "Slow1", "Slow2", "Fast", NULL };
+  const char *before_order[] = { "Slow1", "Slow2", "Before", "Fast", NULL };
+  const char *own_order[] = { "Slow1", "Slow2", "FastBig", "Fast", NULL };
+
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/debug-allow-all.conf");
+  if (context == NULL)
+    return FALSE;
+
+  fast_side = connect_test_client (context, &fast);
+  slow_side = connect_test_client (context, &slow);
+  receiver_side = connect_test_client (context, &receiver);
+
+  _dbus_assert (!bus_connection_has_priority (fast_side));
+
+  /* corked, the receiver's queue fills up as if it were slow to read;
+   * what Fast sends once it has priority doesn't overtake what it sent
+   * before
+   */
+  dbus_connection_set_corked (receiver_side, TRUE);
+  priority_test_send (context, slow, receiver, "Slow1", 0);
+  priority_test_send (context, slow, receiver, "Slow2", 0);
+  priority_test_send (context, fast, receiver, "Before", 0);
+
+  call_bus_with_name (context, fast, "RequestName", PRIORITY_TEST_NAME);
+  _dbus_assert (bus_connection_has_priority (fast_side));
+  _dbus_assert (_dbus_connection_get_priority (fast_side));
+  _dbus_assert (!bus_connection_has_priority (slow_side));
+
+  priority_test_send (context, fast, receiver, "Fast", 0);
+  dbus_connection_set_corked (receiver_side, FALSE);
+  priority_test_expect (context, receiver, before_order);
+
+  /* it does overtake other senders, though not the head of the queue */
+  dbus_connection_set_corked (receiver_side, TRUE);
+  priority_test_send (context, slow, receiver, "Slow1", 0);
+  priority_test_send (context, slow, receiver, "Slow2", 0);
+  priority_test_send (context, fast, receiver, "Fast", 0);
+  dbus_connection_set_corked (receiver_side, FALSE);
+  priority_test_expect (context, receiver, jumped);
+
+  /* FastBig doesn't fit the budget so waits its turn, and Fast, which
+   * would fit, mustn't overtake it
+   */
+  _dbus_connection_set_max_priority_outgoing_size (receiver_side,
+                                                   PRIORITY_TEST_BUDGET);
+  dbus_connection_set_corked (receiver_side, TRUE);
+  priority_test_send (context, slow, receiver, "Slow1", 0);
+  priority_test_send (context, slow, receiver, "Slow2", 0);
+  priority_test_send (context, fast, receiver, "FastBig",
+                      PRIORITY_TEST_BUDGET);
+  priority_test_send (context, fast, receiver, "Fast", 0);
+  dbus_connection_set_corked (receiver_side, FALSE);
+  priority_test_expect (context, receiver, own_order);
+
+  /* with no budget, priority messages wait their turn */
+  _dbus_connection_set_max_priority_outgoing_size (receiver_side, 0);
+  dbus_connection_set_corked (receiver_side, TRUE);
+  priority_test_send (context, slow, receiver, "Slow1", 0);
+  priority_test_send (context, slow, receiver, "Slow2", 0);
+  priority_test_send (context, fast, receiver, "Fast", 0);
+  dbus_connection_set_corked (receiver_side, FALSE);
+  priority_test_expect (context, receiver, in_order);
+
+  call_bus_with_name (context, fast, "ReleaseName", PRIORITY_TEST_NAME);
+  _dbus_assert (!bus_connection_has_priority (fast_side));
+  _dbus_assert (!_dbus_connection_get_priority (fast_side));
+
+  kill_client_connection_unchecked (fast);
+  kill_client_connection_unchecked (slow);
+  kill_client_connection_unchecked (receiver);
+
+  bus_context_unref (context);
+
+  return TRUE;
+}
+
+/* A message whose expiry passes while it waits in a recipient's queue
+ * is dropped there and counted, and the messages after it still go out
+ */
+dbus_bool_t
+bus_dispatch_expiry_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *sender, *receiver;
+  DBusConnection *receiver_side;
+  DBusConnectionStatistics statistics;
+  DBusMessage *message;
+  const char *members[] = { "Stale", "Fresh" };
+  int i;
+
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/debug-allow-all.conf");
+  if (context == NULL)
+    return FALSE;
+
+  connect_test_client (context, &sender);
+  receiver_side = connect_test_client (context, &receiver);
+
+  dbus_connection_set_corked (receiver_side, TRUE);
+
+  for (i = 0; i < (int) _DBUS_N_ELEMENTS (members); i++)
+    {
+      message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                         "org.freedesktop.TestInterface",
+                                         members[i]);
+      if (message == NULL ||
+          !dbus_message_set_destination (message,
+                                         dbus_bus_get_unique_name (receiver)) ||
+          (i == 0 && !dbus_message_set_expiry (message, 1)) ||
+          !dbus_connection_send (sender, message, NULL))
+        _dbus_assert_not_reached ("no memory");
+      dbus_message_unref (message);
+
+      bus_test_run_everything (context);
+    }
+
+  _dbus_sleep_milliseconds (10);
+  dbus_connection_set_corked (receiver_side, FALSE);
+  bus_test_run_everything (context);
+
+  message = pop_message_waiting_for_memory (receiver);
+  if (message == NULL)
+    _dbus_assert_not_reached ("fresh signal didn't arrive");
+  if (!dbus_message_has_member (message, "Fresh"))
+    _dbus_assert_not_reached ("stale signal wasn't dropped");
+  dbus_message_unref (message);
+
+  dbus_connection_get_statistics (receiver_side, &statistics);
+  _dbus_assert (statistics.messages_expired == 1);
+
+  kill_client_connection_unchecked (sender);
+  kill_client_connection_unchecked (receiver);
+
+  bus_context_unref (context);
+
+  return TRUE;
+}
+
+/* The time spent on a client's messages is charged to it and to its
+ * user, and the user's share is there for as long as it is connected
+ */
+dbus_bool_t
+bus_dispatch_accounting_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *client;
+  DBusConnection *client_side;
+  DBusMessage *message;
+  BusConnectionStats stats;
+  int n_replies_to_receive, n_replies_to_send;
+  int n_connections;
+  dbus_uint32_t dispatch_usec;
+  unsigned long uid;
+  int i;
+
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/debug-allow-all.conf");
+  if (context == NULL)
+    return FALSE;
+
+  client_side = connect_test_client (context, &client);
+
+  /* well over a microsecond between them, however fast the machine */
+  for (i = 0; i < 100; i++)
+    {
+      message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                              DBUS_PATH_DBUS,
+                                              DBUS_INTERFACE_DBUS,
+                                              "GetId");
+      if (message == NULL ||
+          !dbus_connection_send (client, message, NULL))
+        _dbus_assert_not_reached ("no memory");
+      dbus_message_unref (message);
+    }
+
+  bus_test_run_everything (context);
+  while ((message = pop_message_waiting_for_memory (client)) != NULL)
+    dbus_message_unref (message);
+
+  bus_connection_get_stats (client_side, &stats,
+                            &n_replies_to_receive, &n_replies_to_send);
+  _dbus_assert (stats.dispatch_usec > 0);
+
+  if (dbus_connection_get_unix_user (client_side, &uid))
+    {
+      if (!bus_connections_get_user_stats (bus_context_get_connections (context),
+                                           uid, &n_connections,
+                                           &dispatch_usec))
+        _dbus_assert_not_reached ("connected user has no statistics");
+      _dbus_assert (n_connections == 1);
+      _dbus_assert (dispatch_usec > 0);
+
+      /* the bus notices as soon as the client hangs up */
+      dbus_connection_close (client);
+      bus_test_run_everything (context);
+
+      if (bus_connections_get_user_stats (bus_context_get_connections (context),
+                                          uid, &n_connections,
+                                          &dispatch_usec))
+        _dbus_assert_not_reached ("user kept statistics after disconnecting");
+      _dbus_assert (dispatch_usec == 0);
+    }
+
+  kill_client_connection_unchecked (client);
+
+  bus_context_unref (context);
+
+  return TRUE;
+}
+
+#define ROUTE_CACHE_TEST_NAME "org.freedesktop.DBus.TestSuiteRouteCache"
+
+/* Messages to a name go to whoever owns it now, even though the
+ * sender's last destinations are remembered
+ */
+dbus_bool_t
+bus_dispatch_route_cache_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *sender, *first, *second;
+  DBusConnection *sender_side, *first_side, *second_side;
+  DBusConnection *owner;
+
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/debug-allow-all.conf");
+  if (context == NULL)
+    return FALSE;
+
+  sender_side = connect_test_client (context, &sender);
+  first_side = connect_test_client (context, &first);
+  second_side = connect_test_client (context, &second);
+
+  call_bus_with_name (context, first, "RequestName",
+                                ROUTE_CACHE_TEST_NAME);
+
+  /* the second of these comes from the cache */
+  send_test_signal (context, sender, ROUTE_CACHE_TEST_NAME, "First1");
+  send_test_signal (context, sender, ROUTE_CACHE_TEST_NAME, "First2");
+  expect_test_signal (first, "First1");
+  expect_test_signal (first, "First2");
+
+  if (bus_connection_lookup_destination (sender_side, ROUTE_CACHE_TEST_NAME,
+                                         &owner) == NULL)
+    _dbus_assert_not_reached ("name has no owner");
+  _dbus_assert (owner == first_side);
+
+  call_bus_with_name (context, first, "ReleaseName",
+                                ROUTE_CACHE_TEST_NAME);
+  call_bus_with_name (context, second, "RequestName",
+                                ROUTE_CACHE_TEST_NAME);
+
+  send_test_signal (context, sender, ROUTE_CACHE_TEST_NAME, "Second");
+  expect_test_signal (second, "Second");
+  _dbus_assert (pop_message_waiting_for_memory (first) == NULL);
+
+  if (bus_connection_lookup_destination (sender_side, ROUTE_CACHE_TEST_NAME,
+                                         &owner) == NULL)
+    _dbus_assert_not_reached ("name has no owner");
+  _dbus_assert (owner == second_side);
+
+  call_bus_with_name (context, second, "ReleaseName",
+                                ROUTE_CACHE_TEST_NAME);
+  _dbus_assert (bus_connection_lookup_destination (sender_side,
+                                                   ROUTE_CACHE_TEST_NAME,
+                                                   &owner) == NULL);
+
+  kill_client_connection_unchecked (sender);
+  kill_client_connection_unchecked (first);
+  kill_client_connection_unchecked (second);
+
+  bus_context_unref (context);
+
+  return TRUE;
+}
+
+/* A client that doesn't wait for the reply to Hello can send its
+ * next message straight away, and learns its name when it asks
+ */
+dbus_bool_t
+bus_dispatch_async_register_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *client;
+  DBusMessage *message;
+  DBusError error;
+  BusService *service;
+  DBusString name;
+  const char *unique_name;
+  dbus_uint32_t serial;
+
+  context = bus_context_new_test (test_data_dir,
+                                  "valid-config-files/debug-allow-all.conf");
+  if (context == NULL)
+    return FALSE;
+
+  dbus_error_init (&error);
+
+  client = dbus_connection_open_private (TEST_CONNECTION, &error);
+  if (client == NULL)
+    _dbus_assert_not_reached ("could not alloc connection");
+
+  if (!bus_setup_debug_client (client))
+    _dbus_assert_not_reached ("could not set up connection");
+
+  spin_connection_until_authenticated (context, client);
+
+  if (!dbus_bus_register_async (client, &error))
+    _dbus_assert_not_reached ("no memory");
+  /* a second registration would get us thrown off the bus */
+  if (!dbus_bus_register_async (client, &error))
+    _dbus_assert_not_reached ("no memory");
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "GetId");
+  if (message == NULL ||
+      !dbus_connection_send (client, message, &serial))
+    _dbus_assert_not_reached ("no memory");
+  dbus_message_unref (message);
+
+  bus_test_run_everything (context);
+
+  unique_name = dbus_bus_get_unique_name (client);
+  if (unique_name == NULL)
+    _dbus_assert_not_reached ("registration failed");
+
+  _dbus_string_init_const (&name, unique_name);
+  service = bus_registry_lookup (bus_context_get_registry (context), &name);
+  _dbus_assert (service != NULL);
+
+  /* NameAcquired comes first, then the reply to GetId */
+  while ((message = pop_message_waiting_for_memory (client)) != NULL)
+    {
+      if (dbus_message_get_reply_serial (message) == serial)
+        break;
+      dbus_message_unref (message);
+    }
+
+  if (message == NULL)
+    _dbus_assert_not_reached ("no reply to the message sent after Hello");
+  if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_METHOD_RETURN)
+    _dbus_assert_not_reached ("message sent after Hello failed");
+  dbus_message_unref (message);
+
+  kill_client_connection_unchecked (client);
+
+  bus_context_unref (context);
+
+  return TRUE;
+}
+
 #ifdef HAVE_UNIX_FD_PASSING
 
 dbus_bool_t
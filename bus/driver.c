@@ -30,11 +30,14 @@
 #include "services.h"
 #include "selinux.h"
 #include "signals.h"
+#include "stats.h"
 #include "utils.h"
 #include <dbus/dbus-string.h>
+#include <dbus/dbus-hash.h>
 #include <dbus/dbus-internals.h>
 #include <dbus/dbus-message.h>
 #include <dbus/dbus-marshal-recursive.h>
+#include <dbus/dbus-marshal-validate.h>
 #include <string.h>
 
 static dbus_bool_t bus_driver_send_welcome_message (DBusConnection *connection,
@@ -61,6 +64,11 @@ bus_driver_send_service_owner_changed (const char     *service_name,
                  old_owner ? old_owner : null_service,
                  new_owner ? new_owner : null_service);
 
+  /* Don't bother building a signal nobody listens for */
+  if (!bus_matchmaker_has_name_owner_changed_rules (bus_context_get_matchmaker (bus_transaction_get_context (transaction)),
+                                                    service_name))
+    return TRUE;
+
   message = dbus_message_new_signal (DBUS_PATH_DBUS,
                                      DBUS_INTERFACE_DBUS,
                                      "NameOwnerChanged");
@@ -180,19 +188,51 @@ bus_driver_send_service_acquired (DBusConnection *connection,
     }
 }
 
+/* We never want to use the same unique client name twice, because
+ * we want to guarantee that if you send a message to a given unique
+ * name, you always get the same application. So we use two numbers
+ * for INT_MAX * INT_MAX combinations, should be pretty safe against
+ * wraparound.
+ */
+/* FIXME these should be in BusRegistry rather than static vars */
+static int next_major_number = 0;
+static int next_minor_number = 0;
+
+/**
+ * Gets where unique names have got to, for a bus handing its
+ * connections over to its successor, which must carry on from there
+ * rather than give out the names again.
+ *
+ * @param major return location for the major number
+ * @param minor return location for the minor number
+ */
+void
+bus_driver_get_unique_name_counter (int *major,
+                                    int *minor)
+{
+  *major = next_major_number;
+  *minor = next_minor_number;
+}
+
+/**
+ * Carries on giving out unique names from where
+ * bus_driver_get_unique_name_counter() said they had got to.
+ *
+ * @param major the major number
+ * @param minor the minor number
+ */
+void
+bus_driver_set_unique_name_counter (int major,
+                                    int minor)
+{
+  next_major_number = major;
+  next_minor_number = minor;
+}
+
 static dbus_bool_t
 create_unique_client_name (BusRegistry *registry,
                            DBusString  *str)
 {
-  /* We never want to use the same unique client name twice, because
-   * we want to guarantee that if you send a message to a given unique
-   * name, you always get the same application. So we use two numbers
-   * for INT_MAX * INT_MAX combinations, should be pretty safe against
-   * wraparound.
-   */
-  /* FIXME these should be in BusRegistry rather than static vars */
-  static int next_major_number = 0;
-  static int next_minor_number = 0;
   int len;
 
   len = _dbus_string_get_length (str);
@@ -373,13 +413,11 @@ bus_driver_handle_list_services (DBusConnection *connection,
                                  DBusMessage    *message,
                                  DBusError      *error)
 {
-  DBusMessage *reply;
-  int len;
-  char **services;
   BusRegistry *registry;
-  int i;
+  DBusMessage *reply;
   DBusMessageIter iter;
   DBusMessageIter sub;
+  const char *v_STRING = DBUS_SERVICE_DBUS;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
@@ -392,72 +430,27 @@ bus_driver_handle_list_services (DBusConnection *connection,
       return FALSE;
     }
 
-  if (!bus_registry_list_services (registry, &services, &len))
-    {
-      dbus_message_unref (reply);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-
   dbus_message_iter_init_append (reply, &iter);
 
+  /* The bus driver is included in the list, ahead of the names
+   * marshalled straight out of the hash table
+   */
   if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
                                          DBUS_TYPE_STRING_AS_STRING,
-                                         &sub))
-    {
-      dbus_free_string_array (services);
-      dbus_message_unref (reply);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-
-  {
-    /* Include the bus driver in the list */
-    const char *v_STRING = DBUS_SERVICE_DBUS;
-    if (!dbus_message_iter_append_basic (&sub, DBUS_TYPE_STRING,
-                                         &v_STRING))
-      {
-        dbus_free_string_array (services);
-        dbus_message_unref (reply);
-        BUS_SET_OOM (error);
-        return FALSE;
-      }
-  }
-
-  i = 0;
-  while (i < len)
-    {
-      if (!dbus_message_iter_append_basic (&sub, DBUS_TYPE_STRING,
-                                           &services[i]))
-        {
-          dbus_free_string_array (services);
-          dbus_message_unref (reply);
-          BUS_SET_OOM (error);
-          return FALSE;
-        }
-      ++i;
-    }
-
-  dbus_free_string_array (services);
-
-  if (!dbus_message_iter_close_container (&iter, &sub))
+                                         &sub) ||
+      !dbus_message_iter_append_basic (&sub, DBUS_TYPE_STRING,
+                                       &v_STRING) ||
+      !bus_registry_append_service_names (registry, &sub) ||
+      !dbus_message_iter_close_container (&iter, &sub) ||
+      !bus_transaction_send_from_driver (transaction, connection, reply))
     {
       dbus_message_unref (reply);
       BUS_SET_OOM (error);
       return FALSE;
     }
 
-  if (!bus_transaction_send_from_driver (transaction, connection, reply))
-    {
-      dbus_message_unref (reply);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-  else
-    {
-      dbus_message_unref (reply);
-      return TRUE;
-    }
+  dbus_message_unref (reply);
+  return TRUE;
 }
 
 static dbus_bool_t
@@ -466,13 +459,11 @@ bus_driver_handle_list_activatable_services (DBusConnection *connection,
 					     DBusMessage    *message,
 					     DBusError      *error)
 {
-  DBusMessage *reply;
-  int len;
-  char **services;
   BusActivation *activation;
-  int i;
+  DBusMessage *reply;
   DBusMessageIter iter;
   DBusMessageIter sub;
+  const char *v_STRING = DBUS_SERVICE_DBUS;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
@@ -485,72 +476,27 @@ bus_driver_handle_list_activatable_services (DBusConnection *connection,
       return FALSE;
     }
 
-  if (!bus_activation_list_services (activation, &services, &len))
-    {
-      dbus_message_unref (reply);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-
   dbus_message_iter_init_append (reply, &iter);
 
+  /* The bus driver is included in the list, ahead of the names
+   * marshalled straight out of the hash table
+   */
   if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
-					 DBUS_TYPE_STRING_AS_STRING,
-					 &sub))
-    {
-      dbus_free_string_array (services);
-      dbus_message_unref (reply);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-
-  {
-    /* Include the bus driver in the list */
-    const char *v_STRING = DBUS_SERVICE_DBUS;
-    if (!dbus_message_iter_append_basic (&sub, DBUS_TYPE_STRING,
-					 &v_STRING))
-      {
-	dbus_free_string_array (services);
-	dbus_message_unref (reply);
-	BUS_SET_OOM (error);
-	return FALSE;
-      }
-  }
-
-  i = 0;
-  while (i < len)
-    {
-      if (!dbus_message_iter_append_basic (&sub, DBUS_TYPE_STRING,
-					   &services[i]))
-	{
-	  dbus_free_string_array (services);
-	  dbus_message_unref (reply);
-	  BUS_SET_OOM (error);
-	  return FALSE;
-	}
-      ++i;
-    }
-
-  dbus_free_string_array (services);
-
-  if (!dbus_message_iter_close_container (&iter, &sub))
+                                         DBUS_TYPE_STRING_AS_STRING,
+                                         &sub) ||
+      !dbus_message_iter_append_basic (&sub, DBUS_TYPE_STRING,
+                                       &v_STRING) ||
+      !bus_activation_append_service_names (activation, &sub) ||
+      !dbus_message_iter_close_container (&iter, &sub) ||
+      !bus_transaction_send_from_driver (transaction, connection, reply))
     {
       dbus_message_unref (reply);
       BUS_SET_OOM (error);
       return FALSE;
     }
 
-  if (!bus_transaction_send_from_driver (transaction, connection, reply))
-    {
-      dbus_message_unref (reply);
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-  else
-    {
-      dbus_message_unref (reply);
-      return TRUE;
-    }
+  dbus_message_unref (reply);
+  return TRUE;
 }
 
 static dbus_bool_t
@@ -980,12 +926,12 @@ bus_driver_handle_add_match (DBusConnection *connection,
 
   _dbus_string_init_const (&str, text);
 
-  rule = bus_match_rule_parse (connection, &str, error);
+  matchmaker = bus_connection_get_matchmaker (connection);
+
+  rule = bus_matchmaker_parse_rule (matchmaker, connection, &str, error);
   if (rule == NULL)
     goto failed;
 
-  matchmaker = bus_connection_get_matchmaker (connection);
-
   if (!bus_matchmaker_add_rule (matchmaker, rule))
     {
       BUS_SET_OOM (error);
@@ -1010,6 +956,114 @@ bus_driver_handle_add_match (DBusConnection *connection,
   return FALSE;
 }
 
+/* Adds every rule in an array of rule strings, or none of them, so
+ * clients with many subscriptions need only one round trip.
+ */
+static dbus_bool_t
+bus_driver_handle_add_matches (DBusConnection *connection,
+                               BusTransaction *transaction,
+                               DBusMessage    *message,
+                               DBusError      *error)
+{
+  BusMatchRule **rules;
+  char **texts;
+  int n_texts;
+  int n_added;
+  int max_rules;
+  int i;
+  BusMatchmaker *matchmaker;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  texts = NULL;
+  n_texts = 0;
+  rules = NULL;
+  n_added = 0;
+  matchmaker = bus_connection_get_matchmaker (connection);
+
+  if (!dbus_message_get_args (message, error,
+                              DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &texts, &n_texts,
+                              DBUS_TYPE_INVALID))
+    {
+      _dbus_verbose ("No memory to get arguments to AddMatches\n");
+      goto failed;
+    }
+
+  max_rules = bus_context_get_max_match_rules_per_connection (bus_transaction_get_context (transaction));
+  if (n_texts > max_rules - bus_connection_get_n_match_rules (connection))
+    {
+      dbus_set_error (error, DBUS_ERROR_LIMITS_EXCEEDED,
+                      "Connection \"%s\" is not allowed to add %d more match rules "
+                      "(increase limits in configuration file if required)",
+                      bus_connection_is_active (connection) ?
+                      bus_connection_get_name (connection) :
+                      "(inactive)",
+                      n_texts);
+      goto failed;
+    }
+
+  if (n_texts > 0)
+    {
+      rules = dbus_new0 (BusMatchRule*, n_texts);
+      if (rules == NULL)
+        {
+          BUS_SET_OOM (error);
+          goto failed;
+        }
+    }
+
+  /* Parse everything first, so a bad rule leaves nothing to undo */
+  for (i = 0; i < n_texts; i++)
+    {
+      DBusString str;
+
+      _dbus_string_init_const (&str, texts[i]);
+
+      rules[i] = bus_matchmaker_parse_rule (matchmaker, connection, &str, error);
+      if (rules[i] == NULL)
+        goto failed;
+    }
+
+  for (n_added = 0; n_added < n_texts; n_added++)
+    {
+      if (!bus_matchmaker_add_rule (matchmaker, rules[n_added]))
+        {
+          BUS_SET_OOM (error);
+          goto failed;
+        }
+    }
+
+  if (!send_ack_reply (connection, transaction,
+                       message, error))
+    goto failed;
+
+  for (i = 0; i < n_texts; i++)
+    bus_match_rule_unref (rules[i]);
+  dbus_free (rules);
+  dbus_free_string_array (texts);
+
+  return TRUE;
+
+ failed:
+  _DBUS_ASSERT_ERROR_IS_SET (error);
+  while (n_added > 0)
+    {
+      n_added -= 1;
+      bus_matchmaker_remove_rule (matchmaker, rules[n_added]);
+    }
+  if (rules)
+    {
+      for (i = 0; i < n_texts; i++)
+        {
+          if (rules[i])
+            bus_match_rule_unref (rules[i]);
+        }
+      dbus_free (rules);
+    }
+  dbus_free_string_array (texts);
+  return FALSE;
+}
+
 static dbus_bool_t
 bus_driver_handle_remove_match (DBusConnection *connection,
                                 BusTransaction *transaction,
@@ -1036,7 +1090,9 @@ bus_driver_handle_remove_match (DBusConnection *connection,
 
   _dbus_string_init_const (&str, text);
 
-  rule = bus_match_rule_parse (connection, &str, error);
+  matchmaker = bus_connection_get_matchmaker (connection);
+
+  rule = bus_matchmaker_parse_rule (matchmaker, connection, &str, error);
   if (rule == NULL)
     goto failed;
 
@@ -1047,8 +1103,6 @@ bus_driver_handle_remove_match (DBusConnection *connection,
                        message, error))
     goto failed;
 
-  matchmaker = bus_connection_get_matchmaker (connection);
-
   if (!bus_matchmaker_remove_rule_by_value (matchmaker, rule, error))
     goto failed;
 
@@ -1145,70 +1199,353 @@ bus_driver_handle_get_service_owner (DBusConnection *connection,
   return FALSE;
 }
 
+/* Checks that every name a batch query was given is a bus name, so
+ * that a mistyped name is reported rather than looking unowned
+ */
 static dbus_bool_t
-bus_driver_handle_list_queued_owners (DBusConnection *connection,
-				      BusTransaction *transaction,
-				      DBusMessage    *message,
-				      DBusError      *error)
+validate_bus_names (DBusMessage *message,
+                    DBusError   *error)
+{
+  DBusMessageIter args_iter, names_iter;
+
+  /* the signature was checked against "as" already */
+  dbus_message_iter_init (message, &args_iter);
+  dbus_message_iter_recurse (&args_iter, &names_iter);
+
+  while (dbus_message_iter_get_arg_type (&names_iter) == DBUS_TYPE_STRING)
+    {
+      const char *name;
+      DBusString str;
+
+      dbus_message_iter_get_basic (&names_iter, &name);
+      _dbus_string_init_const (&str, name);
+
+      if (!_dbus_validate_bus_name (&str, 0, _dbus_string_get_length (&str)))
+        {
+          dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                          "\"%s\" is not a valid bus name", name);
+          return FALSE;
+        }
+
+      dbus_message_iter_next (&names_iter);
+    }
+
+  return TRUE;
+}
+
+/* The owner to report for name in a batch query: its primary owner's
+ * unique name, the bus itself for the bus name, or "" if unowned
+ */
+static const char *
+get_name_owner_or_empty (BusRegistry *registry,
+                         const char  *name)
 {
-  const char *text;
-  DBusList *base_names;
-  DBusList *link;
   DBusString str;
-  BusRegistry *registry;
   BusService *service;
-  DBusMessage *reply;
-  DBusMessageIter iter, array_iter;
-  char *dbus_service_name = DBUS_SERVICE_DBUS;
+  const char *base_name;
 
-  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+  _dbus_string_init_const (&str, name);
+  service = bus_registry_lookup (registry, &str);
 
-  registry = bus_connection_get_registry (connection);
+  if (service == NULL)
+    return strcmp (name, DBUS_SERVICE_DBUS) == 0 ? DBUS_SERVICE_DBUS : "";
 
-  base_names = NULL;
-  text = NULL;
-  reply = NULL;
+  base_name = bus_connection_get_name (bus_service_get_primary_owners_connection (service));
 
-  if (! dbus_message_get_args (message, error,
-			       DBUS_TYPE_STRING, &text,
-			       DBUS_TYPE_INVALID))
-      goto failed;
+  return base_name != NULL ? base_name : "";
+}
 
-  _dbus_string_init_const (&str, text);
-  service = bus_registry_lookup (registry, &str);
-  if (service == NULL &&
-      _dbus_string_equal_c_str (&str, DBUS_SERVICE_DBUS))
-    {
-      /* ORG_FREEDESKTOP_DBUS owns itself */
-      if (! _dbus_list_append (&base_names, dbus_service_name))
-        goto oom;
-    }
-  else if (service == NULL)
-    {
-      dbus_set_error (error,
-                      DBUS_ERROR_NAME_HAS_NO_OWNER,
-                      "Could not get owners of name '%s': no such name", text);
-      goto failed;
-    }
-  else
-    {
-      if (!bus_service_list_queued_owners (service,
-                                           &base_names,
-                                           error))
-        goto failed;
-    }
+static dbus_bool_t
+bus_driver_handle_get_name_owners (DBusConnection *connection,
+                                   BusTransaction *transaction,
+                                   DBusMessage    *message,
+                                   DBusError      *error)
+{
+  BusRegistry *registry;
+  DBusMessage *reply;
+  DBusMessageIter args_iter, names_iter;
+  DBusMessageIter iter, dict_iter, entry_iter;
 
-  _dbus_assert (base_names != NULL);
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  registry = bus_connection_get_registry (connection);
+
+  if (!validate_bus_names (message, error))
+    return FALSE;
 
   reply = dbus_message_new_method_return (message);
   if (reply == NULL)
     goto oom;
 
+  /* the signature was checked against "as" already */
+  dbus_message_iter_init (message, &args_iter);
+  dbus_message_iter_recurse (&args_iter, &names_iter);
+
   dbus_message_iter_init_append (reply, &iter);
-  if (!dbus_message_iter_open_container (&iter,
-                                         DBUS_TYPE_ARRAY,
-                                         DBUS_TYPE_STRING_AS_STRING,
-                                         &array_iter))
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+                                         DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+                                         DBUS_TYPE_STRING_AS_STRING
+                                         DBUS_TYPE_STRING_AS_STRING
+                                         DBUS_DICT_ENTRY_END_CHAR_AS_STRING,
+                                         &dict_iter))
+    goto oom;
+
+  while (dbus_message_iter_get_arg_type (&names_iter) == DBUS_TYPE_STRING)
+    {
+      const char *name;
+      const char *owner;
+
+      dbus_message_iter_get_basic (&names_iter, &name);
+      owner = get_name_owner_or_empty (registry, name);
+
+      if (!dbus_message_iter_open_container (&dict_iter, DBUS_TYPE_DICT_ENTRY,
+                                             NULL, &entry_iter) ||
+          !dbus_message_iter_append_basic (&entry_iter, DBUS_TYPE_STRING,
+                                           &name) ||
+          !dbus_message_iter_append_basic (&entry_iter, DBUS_TYPE_STRING,
+                                           &owner) ||
+          !dbus_message_iter_close_container (&dict_iter, &entry_iter))
+        goto oom;
+
+      dbus_message_iter_next (&names_iter);
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &dict_iter))
+    goto oom;
+
+  if (!bus_transaction_send_from_driver (transaction, connection, reply))
+    goto oom;
+
+  dbus_message_unref (reply);
+
+  return TRUE;
+
+ oom:
+  BUS_SET_OOM (error);
+
+  if (reply)
+    dbus_message_unref (reply);
+  return FALSE;
+}
+
+static dbus_bool_t
+append_uint32_entry (DBusMessageIter *dict_iter,
+                     const char      *key,
+                     dbus_uint32_t    value)
+{
+  DBusMessageIter entry_iter, variant_iter;
+
+  return dbus_message_iter_open_container (dict_iter, DBUS_TYPE_DICT_ENTRY,
+                                           NULL, &entry_iter) &&
+    dbus_message_iter_append_basic (&entry_iter, DBUS_TYPE_STRING, &key) &&
+    dbus_message_iter_open_container (&entry_iter, DBUS_TYPE_VARIANT,
+                                      DBUS_TYPE_UINT32_AS_STRING,
+                                      &variant_iter) &&
+    dbus_message_iter_append_basic (&variant_iter, DBUS_TYPE_UINT32, &value) &&
+    dbus_message_iter_close_container (&entry_iter, &variant_iter) &&
+    dbus_message_iter_close_container (dict_iter, &entry_iter);
+}
+
+/* Appends whatever is known of the credentials of the connection
+ * owning a name, as a{sv}; the dict is empty if nobody owns it
+ */
+static dbus_bool_t
+append_name_credentials (DBusMessageIter *iter,
+                         BusRegistry     *registry,
+                         const char      *name,
+                         DBusError       *error)
+{
+  DBusMessageIter dict_iter;
+  DBusString str;
+  BusService *service;
+  DBusConnection *conn;
+  BusSELinuxID *context;
+  unsigned long ulong_value;
+
+  if (!dbus_message_iter_open_container (iter, DBUS_TYPE_ARRAY,
+                                         DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+                                         DBUS_TYPE_STRING_AS_STRING
+                                         DBUS_TYPE_VARIANT_AS_STRING
+                                         DBUS_DICT_ENTRY_END_CHAR_AS_STRING,
+                                         &dict_iter))
+    goto oom;
+
+  _dbus_string_init_const (&str, name);
+  service = bus_registry_lookup (registry, &str);
+
+  if (service != NULL)
+    {
+      conn = bus_service_get_primary_owners_connection (service);
+
+      if (dbus_connection_get_unix_user (conn, &ulong_value) &&
+          !append_uint32_entry (&dict_iter, "UnixUserID", ulong_value))
+        goto oom;
+
+      if (dbus_connection_get_unix_process_id (conn, &ulong_value) &&
+          !append_uint32_entry (&dict_iter, "ProcessID", ulong_value))
+        goto oom;
+
+      context = bus_connection_get_selinux_id (conn);
+      if (context != NULL &&
+          !bus_selinux_append_context_entry (&dict_iter, "LinuxSecurityLabel",
+                                             context, error))
+        return FALSE;
+    }
+
+  if (!dbus_message_iter_close_container (iter, &dict_iter))
+    goto oom;
+
+  return TRUE;
+
+ oom:
+  BUS_SET_OOM (error);
+  return FALSE;
+}
+
+static dbus_bool_t
+bus_driver_handle_get_connections_credentials (DBusConnection *connection,
+                                               BusTransaction *transaction,
+                                               DBusMessage    *message,
+                                               DBusError      *error)
+{
+  BusRegistry *registry;
+  DBusMessage *reply;
+  DBusMessageIter args_iter, names_iter;
+  DBusMessageIter iter, dict_iter, entry_iter;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  registry = bus_connection_get_registry (connection);
+
+  if (!validate_bus_names (message, error))
+    return FALSE;
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL)
+    goto oom;
+
+  /* the signature was checked against "as" already */
+  dbus_message_iter_init (message, &args_iter);
+  dbus_message_iter_recurse (&args_iter, &names_iter);
+
+  dbus_message_iter_init_append (reply, &iter);
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+                                         DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+                                         DBUS_TYPE_STRING_AS_STRING
+                                         DBUS_TYPE_ARRAY_AS_STRING
+                                         DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+                                         DBUS_TYPE_STRING_AS_STRING
+                                         DBUS_TYPE_VARIANT_AS_STRING
+                                         DBUS_DICT_ENTRY_END_CHAR_AS_STRING
+                                         DBUS_DICT_ENTRY_END_CHAR_AS_STRING,
+                                         &dict_iter))
+    goto oom;
+
+  while (dbus_message_iter_get_arg_type (&names_iter) == DBUS_TYPE_STRING)
+    {
+      const char *name;
+
+      dbus_message_iter_get_basic (&names_iter, &name);
+
+      if (!dbus_message_iter_open_container (&dict_iter, DBUS_TYPE_DICT_ENTRY,
+                                             NULL, &entry_iter) ||
+          !dbus_message_iter_append_basic (&entry_iter, DBUS_TYPE_STRING,
+                                           &name))
+        goto oom;
+
+      if (!append_name_credentials (&entry_iter, registry, name, error))
+        goto failed;
+
+      if (!dbus_message_iter_close_container (&dict_iter, &entry_iter))
+        goto oom;
+
+      dbus_message_iter_next (&names_iter);
+    }
+
+  if (!dbus_message_iter_close_container (&iter, &dict_iter))
+    goto oom;
+
+  if (!bus_transaction_send_from_driver (transaction, connection, reply))
+    goto oom;
+
+  dbus_message_unref (reply);
+
+  return TRUE;
+
+ oom:
+  BUS_SET_OOM (error);
+
+ failed:
+  _DBUS_ASSERT_ERROR_IS_SET (error);
+  if (reply)
+    dbus_message_unref (reply);
+  return FALSE;
+}
+
+static dbus_bool_t
+bus_driver_handle_list_queued_owners (DBusConnection *connection,
+				      BusTransaction *transaction,
+				      DBusMessage    *message,
+				      DBusError      *error)
+{
+  const char *text;
+  DBusList *base_names;
+  DBusList *link;
+  DBusString str;
+  BusRegistry *registry;
+  BusService *service;
+  DBusMessage *reply;
+  DBusMessageIter iter, array_iter;
+  char *dbus_service_name = DBUS_SERVICE_DBUS;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  registry = bus_connection_get_registry (connection);
+
+  base_names = NULL;
+  text = NULL;
+  reply = NULL;
+
+  if (! dbus_message_get_args (message, error,
+			       DBUS_TYPE_STRING, &text,
+			       DBUS_TYPE_INVALID))
+      goto failed;
+
+  _dbus_string_init_const (&str, text);
+  service = bus_registry_lookup (registry, &str);
+  if (service == NULL &&
+      _dbus_string_equal_c_str (&str, DBUS_SERVICE_DBUS))
+    {
+      /* ORG_FREEDESKTOP_DBUS owns itself */
+      if (! _dbus_list_append (&base_names, dbus_service_name))
+        goto oom;
+    }
+  else if (service == NULL)
+    {
+      dbus_set_error (error,
+                      DBUS_ERROR_NAME_HAS_NO_OWNER,
+                      "Could not get owners of name '%s': no such name", text);
+      goto failed;
+    }
+  else
+    {
+      if (!bus_service_list_queued_owners (service,
+                                           &base_names,
+                                           error))
+        goto failed;
+    }
+
+  _dbus_assert (base_names != NULL);
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL)
+    goto oom;
+
+  dbus_message_iter_init_append (reply, &iter);
+  if (!dbus_message_iter_open_container (&iter,
+                                         DBUS_TYPE_ARRAY,
+                                         DBUS_TYPE_STRING_AS_STRING,
+                                         &array_iter))
     goto oom;
 
   link = _dbus_list_get_first_link (&base_names);
@@ -1644,11 +1981,115 @@ bus_driver_handle_get_id (DBusConnection *connection,
   return FALSE;
 }
 
-/* For speed it might be useful to sort this in order of
- * frequency of use (but doesn't matter with only a few items
- * anyhow)
+/* Monitors see everyone's messages regardless of the security
+ * policy, so only root and the user the bus runs as may become one
+ */
+static dbus_bool_t
+connection_is_privileged (DBusConnection *connection)
+{
+  unsigned long uid;
+
+  if (dbus_connection_get_unix_user (connection, &uid))
+    return uid == 0 || _dbus_unix_user_is_process_owner (uid);
+
+#ifdef DBUS_WIN
+  {
+    char *windows_sid = NULL;
+    dbus_bool_t privileged = FALSE;
+
+    if (dbus_connection_get_windows_user (connection, &windows_sid))
+      privileged = _dbus_windows_user_is_process_owner (windows_sid);
+
+    dbus_free (windows_sid);
+    return privileged;
+  }
+#else
+  return FALSE;
+#endif
+}
+
+static dbus_bool_t
+bus_driver_handle_become_monitor (DBusConnection *connection,
+                                  BusTransaction *transaction,
+                                  DBusMessage    *message,
+                                  DBusError      *error)
+{
+  char **texts;
+  int n_texts;
+  dbus_uint32_t flags;
+  DBusList *rules;
+  BusMatchRule *rule;
+  DBusString str;
+  int i;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  texts = NULL;
+  rules = NULL;
+
+  if (!connection_is_privileged (connection))
+    {
+      dbus_set_error (error, DBUS_ERROR_ACCESS_DENIED,
+                      "Connection \"%s\" is not allowed to become a monitor",
+                      bus_connection_get_name (connection));
+      goto failed;
+    }
+
+  if (!dbus_message_get_args (message, error,
+                              DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &texts, &n_texts,
+                              DBUS_TYPE_UINT32, &flags,
+                              DBUS_TYPE_INVALID))
+    goto failed;
+
+  if (flags != 0)
+    {
+      dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                      "BecomeMonitor does not support flags 0x%x", flags);
+      goto failed;
+    }
+
+  /* No rules means everything, which the empty rule matches */
+  for (i = 0; i < n_texts || (i == 0 && n_texts == 0); i++)
+    {
+      _dbus_string_init_const (&str, n_texts > 0 ? texts[i] : "");
+
+      rule = bus_match_rule_parse (connection, &str, error);
+      if (rule == NULL)
+        goto failed;
+
+      if (!_dbus_list_append (&rules, rule))
+        {
+          bus_match_rule_unref (rule);
+          BUS_SET_OOM (error);
+          goto failed;
+        }
+    }
+
+  /* The reply is the last thing the connection gets as a client */
+  if (!send_ack_reply (connection, transaction, message, error))
+    goto failed;
+
+  if (!bus_connection_become_monitor (connection, transaction, &rules, error))
+    goto failed;
+
+  while ((rule = _dbus_list_pop_first (&rules)))
+    bus_match_rule_unref (rule);
+  dbus_free_string_array (texts);
+
+  return TRUE;
+
+ failed:
+  _DBUS_ASSERT_ERROR_IS_SET (error);
+  while ((rule = _dbus_list_pop_first (&rules)))
+    bus_match_rule_unref (rule);
+  dbus_free_string_array (texts);
+  return FALSE;
+}
+
+/* Looked up by name through handlers_by_name, stats_handlers_by_name
+ * and monitoring_handlers_by_name, so the order doesn't matter
  */
-static struct
+typedef struct
 {
   const char *name;
   const char *in_args;
@@ -1657,7 +2098,9 @@ static struct
                            BusTransaction *transaction,
                            DBusMessage    *message,
                            DBusError      *error);
-} message_handlers[] = {
+} MessageHandler;
+
+static const MessageHandler message_handlers[] = {
   { "Hello",
     "",
     DBUS_TYPE_STRING_AS_STRING,
@@ -1694,6 +2137,10 @@ static struct
     DBUS_TYPE_STRING_AS_STRING,
     "",
     bus_driver_handle_add_match },
+  { "AddMatches",
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING,
+    "",
+    bus_driver_handle_add_matches },
   { "RemoveMatch",
     DBUS_TYPE_STRING_AS_STRING,
     "",
@@ -1702,6 +2149,10 @@ static struct
     DBUS_TYPE_STRING_AS_STRING,
     DBUS_TYPE_STRING_AS_STRING,
     bus_driver_handle_get_service_owner },
+  { "GetNameOwners",
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING,
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_STRING_AS_STRING DBUS_DICT_ENTRY_END_CHAR_AS_STRING,
+    bus_driver_handle_get_name_owners },
   { "ListQueuedOwners",
     DBUS_TYPE_STRING_AS_STRING,
     DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING,
@@ -1722,6 +2173,10 @@ static struct
     DBUS_TYPE_STRING_AS_STRING,
     DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_BYTE_AS_STRING,
     bus_driver_handle_get_connection_selinux_security_context },
+  { "GetConnectionsCredentials",
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING,
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_ARRAY_AS_STRING DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING DBUS_DICT_ENTRY_END_CHAR_AS_STRING DBUS_DICT_ENTRY_END_CHAR_AS_STRING,
+    bus_driver_handle_get_connections_credentials },
   { "ReloadConfig",
     "",
     "",
@@ -1732,6 +2187,107 @@ static struct
     bus_driver_handle_get_id }
 };
 
+static const MessageHandler stats_message_handlers[] = {
+  { "GetStats",
+    "",
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING DBUS_DICT_ENTRY_END_CHAR_AS_STRING,
+    bus_stats_handle_get_stats },
+  { "GetConnectionStats",
+    DBUS_TYPE_STRING_AS_STRING,
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING DBUS_DICT_ENTRY_END_CHAR_AS_STRING,
+    bus_stats_handle_get_connection_stats },
+  { "GetUserStats",
+    DBUS_TYPE_UINT32_AS_STRING,
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING DBUS_DICT_ENTRY_END_CHAR_AS_STRING,
+    bus_stats_handle_get_user_stats },
+  { "GetLatencyHistograms",
+    "",
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_UINT32_AS_STRING DBUS_DICT_ENTRY_END_CHAR_AS_STRING,
+    bus_stats_handle_get_latency_histograms }
+};
+
+static const MessageHandler monitoring_message_handlers[] = {
+  { "BecomeMonitor",
+    DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_UINT32_AS_STRING,
+    "",
+    bus_driver_handle_become_monitor }
+};
+
+/* Member name to MessageHandler, for each interface; built on the
+ * first call to the driver and kept until shutdown
+ */
+static DBusHashTable *handlers_by_name = NULL;
+static DBusHashTable *stats_handlers_by_name = NULL;
+static DBusHashTable *monitoring_handlers_by_name = NULL;
+
+static void
+free_handler_tables (void *data)
+{
+  _dbus_hash_table_unref (handlers_by_name);
+  handlers_by_name = NULL;
+  _dbus_hash_table_unref (stats_handlers_by_name);
+  stats_handlers_by_name = NULL;
+  _dbus_hash_table_unref (monitoring_handlers_by_name);
+  monitoring_handlers_by_name = NULL;
+}
+
+static DBusHashTable *
+new_handler_table (const MessageHandler *handlers,
+                   int                   n_handlers)
+{
+  DBusHashTable *table;
+  int i;
+
+  table = _dbus_hash_table_new (DBUS_HASH_STRING, NULL, NULL);
+  if (table == NULL)
+    return NULL;
+
+  for (i = 0; i < n_handlers; i++)
+    {
+      if (!_dbus_hash_table_insert_string (table, (char *) handlers[i].name,
+                                           (void *) &handlers[i]))
+        {
+          _dbus_hash_table_unref (table);
+          return NULL;
+        }
+    }
+
+  return table;
+}
+
+static dbus_bool_t
+ensure_handler_tables (void)
+{
+  if (handlers_by_name != NULL)
+    return TRUE;
+
+  handlers_by_name = new_handler_table (message_handlers,
+                                        _DBUS_N_ELEMENTS (message_handlers));
+  if (handlers_by_name == NULL)
+    return FALSE;
+
+  stats_handlers_by_name = new_handler_table (stats_message_handlers,
+                                              _DBUS_N_ELEMENTS (stats_message_handlers));
+  monitoring_handlers_by_name = new_handler_table (monitoring_message_handlers,
+                                                   _DBUS_N_ELEMENTS (monitoring_message_handlers));
+  if (stats_handlers_by_name == NULL ||
+      monitoring_handlers_by_name == NULL ||
+      !_dbus_register_shutdown_func (free_handler_tables, NULL))
+    {
+      if (stats_handlers_by_name != NULL)
+        _dbus_hash_table_unref (stats_handlers_by_name);
+      stats_handlers_by_name = NULL;
+      if (monitoring_handlers_by_name != NULL)
+        _dbus_hash_table_unref (monitoring_handlers_by_name);
+      monitoring_handlers_by_name = NULL;
+      _dbus_hash_table_unref (handlers_by_name);
+      handlers_by_name = NULL;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 static dbus_bool_t
 write_args_for_direction (DBusString *xml,
 			  const char *signature,
@@ -1767,11 +2323,39 @@ write_args_for_direction (DBusString *xml,
   return FALSE;
 }
 
-dbus_bool_t
-bus_driver_generate_introspect_string (DBusString *xml)
+static dbus_bool_t
+write_methods (DBusString           *xml,
+               const MessageHandler *handlers,
+               int                   n_handlers)
 {
   int i;
 
+  i = 0;
+  while (i < n_handlers)
+    {
+
+      if (!_dbus_string_append_printf (xml, "    <method name=\"%s\">\n",
+                                       handlers[i].name))
+        return FALSE;
+
+      if (!write_args_for_direction (xml, handlers[i].in_args, TRUE))
+	return FALSE;
+
+      if (!write_args_for_direction (xml, handlers[i].out_args, FALSE))
+	return FALSE;
+
+      if (!_dbus_string_append (xml, "    </method>\n"))
+	return FALSE;
+
+      ++i;
+    }
+
+  return TRUE;
+}
+
+dbus_bool_t
+bus_driver_generate_introspect_string (DBusString *xml)
+{
   if (!_dbus_string_append (xml, DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE))
     return FALSE;
   if (!_dbus_string_append (xml, "<node>\n"))
@@ -1791,25 +2375,9 @@ bus_driver_generate_introspect_string (DBusString *xml)
                                    DBUS_INTERFACE_DBUS))
     return FALSE;
 
-  i = 0;
-  while (i < _DBUS_N_ELEMENTS (message_handlers))
-    {
-
-      if (!_dbus_string_append_printf (xml, "    <method name=\"%s\">\n",
-                                       message_handlers[i].name))
-        return FALSE;
-
-      if (!write_args_for_direction (xml, message_handlers[i].in_args, TRUE))
-	return FALSE;
-
-      if (!write_args_for_direction (xml, message_handlers[i].out_args, FALSE))
-	return FALSE;
-
-      if (!_dbus_string_append (xml, "    </method>\n"))
-	return FALSE;
-
-      ++i;
-    }
+  if (!write_methods (xml, message_handlers,
+                      _DBUS_N_ELEMENTS (message_handlers)))
+    return FALSE;
 
   if (!_dbus_string_append_printf (xml, "    <signal name=\"NameOwnerChanged\">\n"))
     return FALSE;
@@ -1851,19 +2419,74 @@ bus_driver_generate_introspect_string (DBusString *xml)
   if (!_dbus_string_append (xml, "  </interface>\n"))
     return FALSE;
 
+  if (!_dbus_string_append_printf (xml, "  <interface name=\"%s\">\n",
+                                   BUS_INTERFACE_STATS))
+    return FALSE;
+
+  if (!write_methods (xml, stats_message_handlers,
+                      _DBUS_N_ELEMENTS (stats_message_handlers)))
+    return FALSE;
+
+  if (!_dbus_string_append (xml, "  </interface>\n"))
+    return FALSE;
+
+  if (!_dbus_string_append_printf (xml, "  <interface name=\"%s\">\n",
+                                   BUS_INTERFACE_MONITORING))
+    return FALSE;
+
+  if (!write_methods (xml, monitoring_message_handlers,
+                      _DBUS_N_ELEMENTS (monitoring_message_handlers)))
+    return FALSE;
+
+  if (!_dbus_string_append (xml, "  </interface>\n"))
+    return FALSE;
+
   if (!_dbus_string_append (xml, "</node>\n"))
     return FALSE;
 
   return TRUE;
 }
 
+/* The XML only depends on the handler tables, so it is built on the
+ * first Introspect() call and kept until shutdown
+ */
+static DBusString introspect_xml;
+static dbus_bool_t introspect_xml_built = FALSE;
+
+static void
+free_introspect_xml (void *data)
+{
+  _dbus_string_free (&introspect_xml);
+  introspect_xml_built = FALSE;
+}
+
+static const char *
+get_introspect_xml (void)
+{
+  if (!introspect_xml_built)
+    {
+      if (!_dbus_string_init (&introspect_xml))
+        return NULL;
+
+      if (!bus_driver_generate_introspect_string (&introspect_xml) ||
+          !_dbus_register_shutdown_func (free_introspect_xml, NULL))
+        {
+          _dbus_string_free (&introspect_xml);
+          return NULL;
+        }
+
+      introspect_xml_built = TRUE;
+    }
+
+  return _dbus_string_get_const_data (&introspect_xml);
+}
+
 static dbus_bool_t
 bus_driver_handle_introspect (DBusConnection *connection,
                               BusTransaction *transaction,
                               DBusMessage    *message,
                               DBusError      *error)
 {
-  DBusString xml;
   DBusMessage *reply;
   const char *v_STRING;
 
@@ -1880,17 +2503,10 @@ bus_driver_handle_introspect (DBusConnection *connection,
       return FALSE;
     }
 
-  if (!_dbus_string_init (&xml))
-    {
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
-
-  if (!bus_driver_generate_introspect_string (&xml))
+  v_STRING = get_introspect_xml ();
+  if (v_STRING == NULL)
     goto oom;
 
-  v_STRING = _dbus_string_get_const_data (&xml);
-
   reply = dbus_message_new_method_return (message);
   if (reply == NULL)
     goto oom;
@@ -1904,7 +2520,6 @@ bus_driver_handle_introspect (DBusConnection *connection,
     goto oom;
 
   dbus_message_unref (reply);
-  _dbus_string_free (&xml);
 
   return TRUE;
 
@@ -1914,8 +2529,6 @@ bus_driver_handle_introspect (DBusConnection *connection,
   if (reply)
     dbus_message_unref (reply);
 
-  _dbus_string_free (&xml);
-
   return FALSE;
 }
 
@@ -1926,7 +2539,8 @@ bus_driver_handle_message (DBusConnection *connection,
                            DBusError      *error)
 {
   const char *name, *sender, *interface;
-  int i;
+  DBusHashTable *handlers;
+  const MessageHandler *handler;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
@@ -1958,8 +2572,19 @@ bus_driver_handle_message (DBusConnection *connection,
   name = dbus_message_get_member (message);
   sender = dbus_message_get_sender (message);
 
-  if (strcmp (interface,
-              DBUS_INTERFACE_DBUS) != 0)
+  if (!ensure_handler_tables ())
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  if (strcmp (interface, DBUS_INTERFACE_DBUS) == 0)
+    handlers = handlers_by_name;
+  else if (strcmp (interface, BUS_INTERFACE_STATS) == 0)
+    handlers = stats_handlers_by_name;
+  else if (strcmp (interface, BUS_INTERFACE_MONITORING) == 0)
+    handlers = monitoring_handlers_by_name;
+  else
     {
       _dbus_verbose ("Driver got message to unknown interface \"%s\"\n",
                      interface);
@@ -1972,43 +2597,38 @@ bus_driver_handle_message (DBusConnection *connection,
   /* security checks should have kept this from getting here */
   _dbus_assert (sender != NULL || strcmp (name, "Hello") == 0);
 
-  i = 0;
-  while (i < _DBUS_N_ELEMENTS (message_handlers))
+  handler = _dbus_hash_table_lookup_string (handlers, name);
+  if (handler != NULL)
     {
-      if (strcmp (message_handlers[i].name, name) == 0)
-        {
-          _dbus_verbose ("Found driver handler for %s\n", name);
-
-          if (!dbus_message_has_signature (message, message_handlers[i].in_args))
-            {
-              _DBUS_ASSERT_ERROR_IS_CLEAR (error);
-              _dbus_verbose ("Call to %s has wrong args (%s, expected %s)\n",
-                             name, dbus_message_get_signature (message),
-                             message_handlers[i].in_args);
-
-              dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
-                              "Call to %s has wrong args (%s, expected %s)\n",
-                              name, dbus_message_get_signature (message),
-                              message_handlers[i].in_args);
-              _DBUS_ASSERT_ERROR_IS_SET (error);
-              return FALSE;
-            }
+      _dbus_verbose ("Found driver handler for %s\n", name);
 
-          if ((* message_handlers[i].handler) (connection, transaction, message, error))
-            {
-              _DBUS_ASSERT_ERROR_IS_CLEAR (error);
-              _dbus_verbose ("Driver handler succeeded\n");
-              return TRUE;
-            }
-          else
-            {
-              _DBUS_ASSERT_ERROR_IS_SET (error);
-              _dbus_verbose ("Driver handler returned failure\n");
-              return FALSE;
-            }
+      if (!dbus_message_has_signature (message, handler->in_args))
+        {
+          _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+          _dbus_verbose ("Call to %s has wrong args (%s, expected %s)\n",
+                         name, dbus_message_get_signature (message),
+                         handler->in_args);
+
+          dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                          "Call to %s has wrong args (%s, expected %s)\n",
+                          name, dbus_message_get_signature (message),
+                          handler->in_args);
+          _DBUS_ASSERT_ERROR_IS_SET (error);
+          return FALSE;
         }
 
-      ++i;
+      if ((* handler->handler) (connection, transaction, message, error))
+        {
+          _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+          _dbus_verbose ("Driver handler succeeded\n");
+          return TRUE;
+        }
+      else
+        {
+          _DBUS_ASSERT_ERROR_IS_SET (error);
+          _dbus_verbose ("Driver handler returned failure\n");
+          return FALSE;
+        }
     }
 
  unknown:
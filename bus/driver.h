@@ -27,6 +27,8 @@
 #include <dbus/dbus.h>
 #include "connection.h"
 
+#define BUS_INTERFACE_MONITORING "org.freedesktop.DBus.Monitoring"
+
 void        bus_driver_remove_connection     (DBusConnection *connection);
 dbus_bool_t bus_driver_handle_message        (DBusConnection *connection,
                                               BusTransaction *transaction,
@@ -46,6 +48,10 @@ dbus_bool_t bus_driver_send_service_owner_changed  (const char     *service_name
 						    BusTransaction *transaction,
 						    DBusError      *error);
 dbus_bool_t bus_driver_generate_introspect_string  (DBusString *xml);
+void        bus_driver_get_unique_name_counter     (int        *major,
+                                                    int        *minor);
+void        bus_driver_set_unique_name_counter     (int         major,
+                                                    int         minor);
 
 
 
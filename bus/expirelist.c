@@ -28,9 +28,15 @@
 #include <dbus/dbus-mainloop.h>
 #include <dbus/dbus-timeout.h>
 
+/* Every item lives for the same expire_after, so ordering the items
+ * by when they were added also orders them by when they expire, and
+ * as they are nearly always added as they are created, keeping that
+ * order costs next to nothing. Expiring then only has to look at the
+ * items that are due, plus the one after them.
+ */
 struct BusExpireList
 {
-  DBusList      *items; /**< List of BusExpireItem */
+  DBusList      *items; /**< List of BusExpireItem, oldest first */
   DBusTimeout   *timeout;
   DBusLoop      *loop;
   BusExpireFunc  expire_func;
@@ -103,7 +109,8 @@ bus_expire_list_free (BusExpireList *list)
 }
 
 void
-bus_expire_timeout_set_interval (DBusTimeout   *timeout,
+bus_expire_timeout_set_interval (DBusLoop      *loop,
+                                 DBusTimeout   *timeout,
                                  int            next_interval)
 {
   if (next_interval >= 0)
@@ -111,6 +118,7 @@ bus_expire_timeout_set_interval (DBusTimeout   *timeout,
       _dbus_timeout_set_interval (timeout,
                                   next_interval);
       _dbus_timeout_set_enabled (timeout, TRUE);
+      _dbus_loop_toggle_timeout (loop, timeout);
 
       _dbus_verbose ("Enabled an expire timeout with interval %d\n",
                      next_interval);
@@ -118,6 +126,7 @@ bus_expire_timeout_set_interval (DBusTimeout   *timeout,
   else if (dbus_timeout_get_enabled (timeout))
     {
       _dbus_timeout_set_enabled (timeout, FALSE);
+      _dbus_loop_toggle_timeout (loop, timeout);
 
       _dbus_verbose ("Disabled an expire timeout\n");
     }
@@ -130,7 +139,45 @@ bus_expire_list_recheck_immediately (BusExpireList *list)
 {
   _dbus_verbose ("setting interval on expire list to 0 for immediate recheck\n");
 
-  bus_expire_timeout_set_interval (list->timeout, 0);
+  bus_expire_timeout_set_interval (list->loop, list->timeout, 0);
+}
+
+static dbus_bool_t
+item_added_before (BusExpireItem *a,
+                   BusExpireItem *b)
+{
+  if (a->added_tv_sec != b->added_tv_sec)
+    return a->added_tv_sec < b->added_tv_sec;
+  else
+    return a->added_tv_usec < b->added_tv_usec;
+}
+
+/* Items added now belong at the end, and items to be expired right
+ * away (added at time 0) at the front; anything else, such as an
+ * item put back after a cancelled transaction, is searched for from
+ * the end.
+ */
+static void
+insert_link_in_order (BusExpireList *list,
+                      DBusList      *link)
+{
+  BusExpireItem *item = link->data;
+  DBusList *first;
+  DBusList *after;
+
+  first = _dbus_list_get_first_link (&list->items);
+
+  if (first == NULL || item_added_before (item, first->data))
+    {
+      _dbus_list_prepend_link (&list->items, link);
+      return;
+    }
+
+  after = _dbus_list_get_last_link (&list->items);
+  while (item_added_before (item, after->data))
+    after = _dbus_list_get_prev_link (&list->items, after);
+
+  _dbus_list_insert_after_link (&list->items, after, link);
 }
 
 static int
@@ -139,11 +186,9 @@ do_expiration_with_current_time (BusExpireList *list,
                                  long           tv_usec)
 {
   DBusList *link;
-  int next_interval, min_wait_time, items_to_expire;
+  int next_interval;
 
   next_interval = -1;
-  min_wait_time = 3600 * 1000; /* this is reset anyway if used */
-  items_to_expire = 0;
   
   link = _dbus_list_get_first_link (&list->items);
   while (link != NULL)
@@ -175,22 +220,17 @@ do_expiration_with_current_time (BusExpireList *list,
               break;
             }
         }
-      else if (list->expire_after > 0)
+      else
         {
-          double to_wait;
-
-          items_to_expire = 1;
-          to_wait = (double) list->expire_after - elapsed;
-          if (min_wait_time > to_wait)
-            min_wait_time = to_wait;
+          /* Everything after this was added later, so expires later */
+          if (list->expire_after > 0)
+            next_interval = (double) list->expire_after - elapsed;
+          break;
         }
 
       link = next;
     }
 
-  if (next_interval < 0 && items_to_expire)
-    next_interval = min_wait_time;
-
   return next_interval;
 }
 
@@ -210,7 +250,7 @@ bus_expirelist_expire (BusExpireList *list)
       next_interval = do_expiration_with_current_time (list, tv_sec, tv_usec);
     }
 
-  bus_expire_timeout_set_interval (list->timeout, next_interval);
+  bus_expire_timeout_set_interval (list->loop, list->timeout, next_interval);
 }
 
 static dbus_bool_t
@@ -247,17 +287,22 @@ bus_expire_list_unlink (BusExpireList *list,
   _dbus_list_unlink (&list->items, link);
 }
 
+/* The item's added time must be set before adding it, since that's
+ * where in the list it goes.
+ */
 dbus_bool_t
 bus_expire_list_add (BusExpireList *list,
                      BusExpireItem *item)
 {
-  dbus_bool_t ret;
+  DBusList *link;
 
-  ret = _dbus_list_prepend (&list->items, item);
-  if (ret && !dbus_timeout_get_enabled (list->timeout))
-    bus_expire_timeout_set_interval (list->timeout, 0);
+  link = _dbus_list_alloc_link (item);
+  if (link == NULL)
+    return FALSE;
 
-  return ret;
+  bus_expire_list_add_link (list, link);
+
+  return TRUE;
 }
 
 void
@@ -266,10 +311,10 @@ bus_expire_list_add_link (BusExpireList *list,
 {
   _dbus_assert (link->data != NULL);
   
-  _dbus_list_prepend_link (&list->items, link);
+  insert_link_in_order (list, link);
 
   if (!dbus_timeout_get_enabled (list->timeout))
-    bus_expire_timeout_set_interval (list->timeout, 0);
+    bus_expire_timeout_set_interval (list->loop, list->timeout, 0);
 }
 
 DBusList*
@@ -400,6 +445,54 @@ bus_expire_list_test (const DBusString *test_data_dir)
 
   bus_expire_list_remove (list, &item->item);
   dbus_free (item);
+
+  /* Items come out oldest first, whatever order they went in, and
+   * expiring stops at the first one that isn't due yet.
+   */
+  {
+    TestExpireItem items[4];
+    static const int added_ms[4] = { 20, 0, 30, 10 };
+    static const int oldest_first[4] = { 1, 3, 0, 2 };
+    long tv_sec_some_expired, tv_usec_some_expired;
+    DBusList *link;
+    int i;
+
+    for (i = 0; i < 4; i++)
+      {
+        items[i].expire_count = 0;
+        items[i].item.added_tv_sec = tv_sec;
+        items[i].item.added_tv_usec = tv_usec;
+        time_add_milliseconds (&items[i].item.added_tv_sec,
+                               &items[i].item.added_tv_usec, added_ms[i]);
+        if (!bus_expire_list_add (list, &items[i].item))
+          _dbus_assert_not_reached ("out of memory");
+      }
+
+    link = bus_expire_list_get_first_link (list);
+    for (i = 0; i < 4; i++)
+      {
+        _dbus_assert (link->data == &items[oldest_first[i]].item);
+        link = bus_expire_list_get_next_link (list, link);
+      }
+    _dbus_assert (link == NULL);
+
+    tv_sec_some_expired = tv_sec;
+    tv_usec_some_expired = tv_usec;
+    time_add_milliseconds (&tv_sec_some_expired, &tv_usec_some_expired,
+                           EXPIRE_AFTER + 15);
+
+    next_interval =
+      do_expiration_with_current_time (list, tv_sec_some_expired,
+                                       tv_usec_some_expired);
+    _dbus_assert (items[1].expire_count == 1);
+    _dbus_assert (items[3].expire_count == 1);
+    _dbus_assert (items[0].expire_count == 0);
+    _dbus_assert (items[2].expire_count == 0);
+    _dbus_assert (next_interval == 5);
+
+    for (i = 0; i < 4; i++)
+      bus_expire_list_remove (list, &items[i].item);
+  }
   
   bus_expire_list_free (list);
   _dbus_loop_unref (loop);
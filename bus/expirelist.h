@@ -74,7 +74,8 @@ void           bus_expire_list_unlink              (BusExpireList *list,
  (((double) (now_tv_sec) - (double) (orig_tv_sec)) * 1000.0 +   \
  ((double) (now_tv_usec) - (double) (orig_tv_usec)) / 1000.0)
 
-void bus_expire_timeout_set_interval (DBusTimeout   *timeout,
+void bus_expire_timeout_set_interval (DBusLoop      *loop,
+                                      DBusTimeout   *timeout,
                                       int            next_interval);
 
 #endif /* BUS_EXPIRE_LIST_H */
@@ -0,0 +1,1689 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* handoff.c  Hand the bus and its clients over to a new daemon binary
+ *
+ * Copyright (C) 2003  Red Hat, Inc.
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Upgrading the daemon used to mean restarting it, which every client
+ * sees as the bus going away. Instead the running daemon can stop
+ * taking on work, wait for its connections to go quiet, write down
+ * everything a new daemon needs to carry on, and exec the new binary
+ * in its own process with the listening and connected sockets left
+ * open. The new daemon reads the state back and picks up where the
+ * old one stopped: same bus ID, same unique names, same owners, match
+ * rules and expected replies, and clients never notice.
+ *
+ * A connection that isn't quiet in time, has encoding or compression
+ * state of its own, or is a monitor isn't handed over; its socket is
+ * closed by the exec, and the new daemon tells everyone its names
+ * went away, just as if the client had disconnected.
+ */
+
+#include <config.h>
+#include "handoff.h"
+#include "activation.h"
+#include "connection.h"
+#include "driver.h"
+#include "services.h"
+#include "signals.h"
+#include "utils.h"
+#include <dbus/dbus-connection-internal.h>
+#include <dbus/dbus-credentials.h>
+#include <dbus/dbus-hash.h>
+#include <dbus/dbus-timeout.h>
+#ifdef DBUS_UNIX
+#include <dbus/dbus-server-socket.h>
+#include <dbus/dbus-sysdeps-unix.h>
+#include <errno.h>
+#include <unistd.h>
+#endif
+
+#ifdef DBUS_UNIX
+
+/* Bumped whenever the layout below changes; a daemon refuses state
+ * of any other version
+ */
+#define BUS_HANDOFF_VERSION 1
+
+/* The state is the body of a message, marshalled. In order:
+ *
+ *   u   BUS_HANDOFF_VERSION
+ *   s   the bus ID
+ *   ii  the counter unique names are made from
+ *   a(sayaisai)
+ *       listening servers: address without its GUID, the GUID, the
+ *       sockets, the socket file to unlink or "", and the
+ *       DBusTcpOptions in the order they are declared
+ *   a(isbuuayayasa(su))
+ *       connections: the socket, the unique name or "" before Hello,
+ *       whether unix fds were negotiated, uid and pid or
+ *       BUS_HANDOFF_UNSET, audit data, bytes read but not yet a whole
+ *       message, match rules, and the replies it is owed as the
+ *       replier's unique name and the serial
+ *   a(ssa(su))
+ *       well-known names: the name, its primary owner's unique name,
+ *       and the owners handed over in queue order with their flags
+ *   as  unique names of the connections that were not handed over
+ */
+#define BUS_HANDOFF_SIGNATURE \
+  "usii" \
+  "a(sayaisai)" \
+  "a(isbuuayayasa(su))" \
+  "a(ssa(su))" \
+  "as"
+
+#define BUS_HANDOFF_FIELD_SERVERS 4
+#define BUS_HANDOFF_FIELD_CONNECTIONS 5
+#define BUS_HANDOFF_FIELD_NAMES 6
+#define BUS_HANDOFF_FIELD_DROPPED 7
+
+/* Where the replies are within a connection's struct */
+#define BUS_HANDOFF_CONNECTION_FIELD_REPLIES 8
+
+/** Stands for a uid or pid the peer didn't have */
+#define BUS_HANDOFF_UNSET ((dbus_uint32_t) -1)
+
+/** Number of DBusTcpOptions fields */
+#define BUS_HANDOFF_N_TCP_OPTIONS 7
+
+struct BusHandoff
+{
+  DBusMessage *state;          /**< What the daemon we replace handed over, or #NULL */
+  DBusGUID uuid;               /**< The bus ID in state */
+
+  BusContext *context;         /**< The bus we are handing over, or #NULL */
+  DBusTimeout *drain_timeout;  /**< Looks whether the connections are quiet yet */
+  long deadline_sec;           /**< When we stop waiting for them */
+  long deadline_usec;          /**< When we stop waiting for them */
+  DBusList *kept_fds;          /**< Sockets the new daemon inherits */
+  int state_fd;                /**< File the state is written to, or -1 */
+};
+
+/* A connection we found quiet enough to hand over */
+typedef struct
+{
+  DBusConnection *connection;
+  int fd;
+  DBusString unread;
+} HandedConnection;
+
+typedef struct
+{
+  BusHandoff *handoff;
+  DBusHashTable *handed;       /**< DBusConnection to its HandedConnection */
+  DBusList *handed_list;       /**< The HandedConnection, in bus order */
+  DBusList *dropped;           /**< Unique names not handed over */
+  DBusMessageIter *iter;       /**< Where the foreach functions append */
+  DBusString scratch;
+  dbus_bool_t oom;
+} SaveData;
+
+static void
+handed_connection_free (void *data)
+{
+  HandedConnection *hc = data;
+
+  _dbus_string_free (&hc->unread);
+  dbus_free (hc);
+}
+
+static dbus_bool_t
+append_bytes (DBusMessageIter *iter,
+              const char      *bytes,
+              int              len)
+{
+  DBusMessageIter sub;
+
+  return dbus_message_iter_open_container (iter, DBUS_TYPE_ARRAY,
+                                           DBUS_TYPE_BYTE_AS_STRING, &sub) &&
+    dbus_message_iter_append_fixed_array (&sub, DBUS_TYPE_BYTE, &bytes, len) &&
+    dbus_message_iter_close_container (iter, &sub);
+}
+
+static dbus_bool_t
+append_ints (DBusMessageIter    *iter,
+             const dbus_int32_t *ints,
+             int                 n_ints)
+{
+  DBusMessageIter sub;
+
+  return dbus_message_iter_open_container (iter, DBUS_TYPE_ARRAY,
+                                           DBUS_TYPE_INT32_AS_STRING, &sub) &&
+    dbus_message_iter_append_fixed_array (&sub, DBUS_TYPE_INT32, &ints, n_ints) &&
+    dbus_message_iter_close_container (iter, &sub);
+}
+
+static dbus_bool_t
+append_string (DBusMessageIter *iter,
+               const char      *str)
+{
+  return dbus_message_iter_append_basic (iter, DBUS_TYPE_STRING, &str);
+}
+
+static dbus_bool_t
+append_uint32 (DBusMessageIter *iter,
+               dbus_uint32_t    value)
+{
+  return dbus_message_iter_append_basic (iter, DBUS_TYPE_UINT32, &value);
+}
+
+static dbus_bool_t
+save_server (DBusServer      *server,
+             DBusMessageIter *array,
+             DBusList       **kept_fds)
+{
+  DBusMessageIter entry;
+  DBusString address;
+  DBusGUID guid;
+  DBusTcpOptions options;
+  dbus_int32_t option_values[BUS_HANDOFF_N_TCP_OPTIONS];
+  int *fds;
+  int n_fds;
+  const char *socket_name;
+  dbus_bool_t retval;
+  int i;
+
+  if (!_dbus_string_init (&address))
+    return FALSE;
+
+  retval = FALSE;
+
+  if (!_dbus_server_socket_get_handoff_state (server, &address, &guid,
+                                              &fds, &n_fds, &socket_name,
+                                              &options))
+    goto out;
+
+  option_values[0] = options.nodelay;
+  option_values[1] = options.keepalive;
+  option_values[2] = options.sndbuf;
+  option_values[3] = options.rcvbuf;
+  option_values[4] = options.zerocopy;
+  option_values[5] = options.seqpacket;
+  option_values[6] = options.compress;
+
+  if (!dbus_message_iter_open_container (array, DBUS_TYPE_STRUCT, NULL,
+                                         &entry) ||
+      !append_string (&entry, _dbus_string_get_const_data (&address)) ||
+      !append_bytes (&entry, guid.as_bytes, DBUS_UUID_LENGTH_BYTES) ||
+      !append_ints (&entry, fds, n_fds) ||
+      !append_string (&entry, socket_name != NULL ? socket_name : "") ||
+      !append_ints (&entry, option_values, BUS_HANDOFF_N_TCP_OPTIONS) ||
+      !dbus_message_iter_close_container (array, &entry))
+    goto out;
+
+  for (i = 0; i < n_fds; i++)
+    {
+      if (!_dbus_list_append (kept_fds, _DBUS_INT_TO_POINTER (fds[i])))
+        goto out;
+    }
+
+  retval = TRUE;
+
+ out:
+  _dbus_string_free (&address);
+  return retval;
+}
+
+static dbus_bool_t
+collect_connection (DBusConnection *connection,
+                    void           *data)
+{
+  SaveData *d = data;
+  HandedConnection *hc;
+
+  if (bus_connection_is_monitor (connection))
+    goto dropped;
+
+  hc = dbus_new0 (HandedConnection, 1);
+  if (hc == NULL)
+    goto oom;
+
+  if (!_dbus_string_init (&hc->unread))
+    {
+      dbus_free (hc);
+      goto oom;
+    }
+
+  hc->connection = connection;
+
+  if (!_dbus_connection_get_handoff_state (connection, &hc->fd, &hc->unread))
+    {
+      handed_connection_free (hc);
+      goto dropped;
+    }
+
+  if (!_dbus_list_append (&d->handed_list, hc))
+    {
+      handed_connection_free (hc);
+      goto oom;
+    }
+
+  if (!_dbus_hash_table_insert_uintptr (d->handed, (uintptr_t) connection, hc))
+    goto oom;
+
+  return TRUE;
+
+ dropped:
+  if (bus_connection_is_active (connection) &&
+      !_dbus_list_append (&d->dropped, (char *) bus_connection_get_name (connection)))
+    goto oom;
+
+  return TRUE;
+
+ oom:
+  d->oom = TRUE;
+  return FALSE;
+}
+
+static dbus_bool_t
+save_reply (DBusConnection *will_send_reply,
+            dbus_uint32_t   reply_serial,
+            void           *data)
+{
+  SaveData *d = data;
+  DBusMessageIter entry;
+
+  /* a reply from a client that is going away is never going to come */
+  if (_dbus_hash_table_lookup_uintptr (d->handed, (uintptr_t) will_send_reply) == NULL ||
+      !bus_connection_is_active (will_send_reply))
+    return TRUE;
+
+  if (!dbus_message_iter_open_container (d->iter, DBUS_TYPE_STRUCT, NULL,
+                                         &entry) ||
+      !append_string (&entry, bus_connection_get_name (will_send_reply)) ||
+      !append_uint32 (&entry, reply_serial) ||
+      !dbus_message_iter_close_container (d->iter, &entry))
+    {
+      d->oom = TRUE;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static dbus_bool_t
+save_connection (HandedConnection *hc,
+                 DBusMessageIter  *array,
+                 SaveData         *d)
+{
+  DBusConnection *connection = hc->connection;
+  DBusMessageIter entry, rules, replies;
+  dbus_int32_t fd;
+  dbus_bool_t unix_fds;
+  unsigned long ul;
+  dbus_uint32_t uid, pid;
+  void *adt_data;
+  dbus_int32_t adt_len;
+  const char *name;
+  DBusList *link;
+  DBusList **own_rules;
+
+  fd = hc->fd;
+  unix_fds = dbus_connection_can_send_type (connection, DBUS_TYPE_UNIX_FD);
+  uid = dbus_connection_get_unix_user (connection, &ul) ? ul : BUS_HANDOFF_UNSET;
+  pid = dbus_connection_get_unix_process_id (connection, &ul) ? ul : BUS_HANDOFF_UNSET;
+
+  if (!dbus_connection_get_adt_audit_session_data (connection, &adt_data, &adt_len))
+    {
+      adt_data = NULL;
+      adt_len = 0;
+    }
+
+  name = bus_connection_get_name (connection);
+
+  if (!dbus_message_iter_open_container (array, DBUS_TYPE_STRUCT, NULL,
+                                         &entry) ||
+      !dbus_message_iter_append_basic (&entry, DBUS_TYPE_INT32, &fd) ||
+      !append_string (&entry, name != NULL ? name : "") ||
+      !dbus_message_iter_append_basic (&entry, DBUS_TYPE_BOOLEAN, &unix_fds) ||
+      !append_uint32 (&entry, uid) ||
+      !append_uint32 (&entry, pid) ||
+      !append_bytes (&entry, adt_data, adt_len) ||
+      !append_bytes (&entry, _dbus_string_get_const_data (&hc->unread),
+                     _dbus_string_get_length (&hc->unread)))
+    return FALSE;
+
+  if (!dbus_message_iter_open_container (&entry, DBUS_TYPE_ARRAY,
+                                         DBUS_TYPE_STRING_AS_STRING, &rules))
+    return FALSE;
+
+  /* only a connection that said Hello can have rules or replies */
+  own_rules = name != NULL ? bus_connection_get_match_rules (connection) : NULL;
+
+  for (link = own_rules != NULL ? _dbus_list_get_first_link (own_rules) : NULL;
+       link != NULL;
+       link = _dbus_list_get_next_link (own_rules, link))
+    {
+      _dbus_string_set_length (&d->scratch, 0);
+
+      if (!bus_match_rule_to_string (link->data, &d->scratch) ||
+          !append_string (&rules, _dbus_string_get_const_data (&d->scratch)))
+        return FALSE;
+    }
+
+  if (!dbus_message_iter_close_container (&entry, &rules) ||
+      !dbus_message_iter_open_container (&entry, DBUS_TYPE_ARRAY, "(su)",
+                                         &replies))
+    return FALSE;
+
+  d->iter = &replies;
+  if (name != NULL &&
+      !bus_connection_foreach_reply_to_receive (connection, save_reply, d))
+    return FALSE;
+
+  return dbus_message_iter_close_container (&entry, &replies) &&
+    dbus_message_iter_close_container (array, &entry);
+}
+
+static dbus_bool_t
+save_owner (DBusConnection *connection,
+            dbus_uint32_t   flags,
+            void           *data)
+{
+  SaveData *d = data;
+  DBusMessageIter entry;
+
+  if (_dbus_hash_table_lookup_uintptr (d->handed, (uintptr_t) connection) == NULL)
+    return TRUE;
+
+  if (!dbus_message_iter_open_container (d->iter, DBUS_TYPE_STRUCT, NULL,
+                                         &entry) ||
+      !append_string (&entry, bus_connection_get_name (connection)) ||
+      !append_uint32 (&entry, flags) ||
+      !dbus_message_iter_close_container (d->iter, &entry))
+    {
+      d->oom = TRUE;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+save_name (BusService *service,
+           void       *data)
+{
+  SaveData *d = data;
+  DBusMessageIter *array = d->iter;
+  DBusMessageIter entry, owners;
+  const char *name;
+
+  name = bus_service_get_name (service);
+
+  /* unique names come back with their connections */
+  if (d->oom || *name == ':')
+    return;
+
+  if (!dbus_message_iter_open_container (array, DBUS_TYPE_STRUCT, NULL,
+                                         &entry) ||
+      !append_string (&entry, name) ||
+      !append_string (&entry, bus_connection_get_name (bus_service_get_primary_owners_connection (service))) ||
+      !dbus_message_iter_open_container (&entry, DBUS_TYPE_ARRAY, "(su)",
+                                         &owners))
+    {
+      d->oom = TRUE;
+      return;
+    }
+
+  d->iter = &owners;
+  if (!bus_service_foreach_owner (service, save_owner, d))
+    return;
+  d->iter = array;
+
+  if (!dbus_message_iter_close_container (&entry, &owners) ||
+      !dbus_message_iter_close_container (array, &entry))
+    d->oom = TRUE;
+}
+
+static dbus_bool_t
+save_state (BusHandoff      *handoff,
+            SaveData        *d,
+            DBusMessageIter *iter)
+{
+  BusContext *context = handoff->context;
+  DBusMessageIter array;
+  DBusList *link;
+  DBusList **servers;
+  DBusString id;
+  dbus_uint32_t version;
+  dbus_int32_t major, minor;
+  dbus_bool_t ok;
+
+  if (!_dbus_string_init (&id))
+    return FALSE;
+
+  version = BUS_HANDOFF_VERSION;
+  bus_driver_get_unique_name_counter (&major, &minor);
+
+  ok = bus_context_get_id (context, &id) &&
+    append_uint32 (iter, version) &&
+    append_string (iter, _dbus_string_get_const_data (&id)) &&
+    dbus_message_iter_append_basic (iter, DBUS_TYPE_INT32, &major) &&
+    dbus_message_iter_append_basic (iter, DBUS_TYPE_INT32, &minor);
+  _dbus_string_free (&id);
+
+  if (!ok)
+    return FALSE;
+
+  if (!dbus_message_iter_open_container (iter, DBUS_TYPE_ARRAY,
+                                         "(sayaisai)", &array))
+    return FALSE;
+
+  servers = bus_context_get_servers (context);
+  for (link = _dbus_list_get_first_link (servers);
+       link != NULL;
+       link = _dbus_list_get_next_link (servers, link))
+    {
+      if (!save_server (link->data, &array, &handoff->kept_fds))
+        return FALSE;
+    }
+
+  if (!dbus_message_iter_close_container (iter, &array))
+    return FALSE;
+
+  bus_connections_foreach (bus_context_get_connections (context),
+                           collect_connection, d);
+  if (d->oom)
+    return FALSE;
+
+  if (!dbus_message_iter_open_container (iter, DBUS_TYPE_ARRAY,
+                                         "(isbuuayayasa(su))", &array))
+    return FALSE;
+
+  for (link = _dbus_list_get_first_link (&d->handed_list);
+       link != NULL;
+       link = _dbus_list_get_next_link (&d->handed_list, link))
+    {
+      HandedConnection *hc = link->data;
+
+      if (!save_connection (hc, &array, d) ||
+          !_dbus_list_append (&handoff->kept_fds, _DBUS_INT_TO_POINTER (hc->fd)))
+        return FALSE;
+    }
+
+  if (!dbus_message_iter_close_container (iter, &array) ||
+      !dbus_message_iter_open_container (iter, DBUS_TYPE_ARRAY,
+                                         "(ssa(su))", &array))
+    return FALSE;
+
+  d->iter = &array;
+  bus_registry_foreach (bus_context_get_registry (context), save_name, d);
+  if (d->oom)
+    return FALSE;
+
+  if (!dbus_message_iter_close_container (iter, &array) ||
+      !dbus_message_iter_open_container (iter, DBUS_TYPE_ARRAY,
+                                         DBUS_TYPE_STRING_AS_STRING, &array))
+    return FALSE;
+
+  for (link = _dbus_list_get_first_link (&d->dropped);
+       link != NULL;
+       link = _dbus_list_get_next_link (&d->dropped, link))
+    {
+      if (!append_string (&array, link->data))
+        return FALSE;
+    }
+
+  return dbus_message_iter_close_container (iter, &array);
+}
+
+static dbus_bool_t
+write_state (int          fd,
+             const char  *data,
+             int          len,
+             DBusError   *error)
+{
+  DBusString str;
+  int written;
+
+  _dbus_string_init_const_len (&str, data, len);
+
+  written = 0;
+  while (written < len)
+    {
+      int bytes;
+
+      bytes = _dbus_write (fd, &str, written, len - written);
+      if (bytes < 0)
+        {
+          dbus_set_error (error, _dbus_error_from_errno (errno),
+                          "Could not write the bus state: %s",
+                          _dbus_strerror (errno));
+          return FALSE;
+        }
+
+      written += bytes;
+    }
+
+  if (lseek (fd, 0, SEEK_SET) < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Could not rewind the bus state: %s",
+                      _dbus_strerror (errno));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * Writes down everything a new daemon needs to carry on with the bus,
+ * once bus_handoff_start() has let the main loop quit, and lets the
+ * sockets that go with it survive exec. The new daemon is then to be
+ * exec'd in this process, with the returned file descriptor given to
+ * bus_handoff_load().
+ *
+ * @param handoff the handoff
+ * @param error return location for errors
+ * @returns a file descriptor to read the state from, or -1 on error
+ */
+int
+bus_handoff_save (BusHandoff *handoff,
+                  DBusError  *error)
+{
+  SaveData d;
+  DBusMessage *message;
+  DBusMessageIter iter;
+  DBusList *link;
+  char *data;
+  int len;
+  int fd;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+  _dbus_assert (handoff->context != NULL);
+  _dbus_assert (handoff->state_fd < 0);
+
+  _DBUS_ZERO (d);
+  d.handoff = handoff;
+  data = NULL;
+  fd = -1;
+
+  message = dbus_message_new_signal (DBUS_PATH_DBUS, DBUS_INTERFACE_DBUS,
+                                     "Handoff");
+  d.handed = _dbus_hash_table_new (DBUS_HASH_UINTPTR, NULL, NULL);
+  if (message == NULL || d.handed == NULL ||
+      !_dbus_string_init (&d.scratch))
+    {
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
+  dbus_message_set_serial (message, 1);
+  dbus_message_iter_init_append (message, &iter);
+
+  if (!save_state (handoff, &d, &iter) ||
+      !dbus_message_marshal (message, &data, &len))
+    {
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
+  fd = _dbus_open_unlinked_temp_file (error);
+  if (fd < 0)
+    goto out;
+
+  if (!write_state (fd, data, len, error) ||
+      !_dbus_list_append (&handoff->kept_fds, _DBUS_INT_TO_POINTER (fd)))
+    {
+      if (!dbus_error_is_set (error))
+        BUS_SET_OOM (error);
+
+      _dbus_close (fd, NULL);
+      fd = -1;
+      goto out;
+    }
+
+  handoff->state_fd = fd;
+
+  for (link = _dbus_list_get_first_link (&handoff->kept_fds);
+       link != NULL;
+       link = _dbus_list_get_next_link (&handoff->kept_fds, link))
+    _dbus_fd_clear_close_on_exec (_DBUS_POINTER_TO_INT (link->data));
+
+ out:
+  if (fd < 0)
+    _dbus_list_clear (&handoff->kept_fds);
+
+  dbus_free (data);
+  if (message != NULL)
+    dbus_message_unref (message);
+  if (d.handed != NULL)
+    _dbus_hash_table_unref (d.handed);
+  while (d.handed_list != NULL)
+    handed_connection_free (_dbus_list_pop_first (&d.handed_list));
+  _dbus_list_clear (&d.dropped);
+  _dbus_string_free (&d.scratch);
+
+  return fd;
+}
+
+static dbus_bool_t
+count_unsettled_connection (DBusConnection *connection,
+                            void           *data)
+{
+  int *n_unsettled = data;
+  DBusString scratch;
+  int fd;
+
+  /* these are dropped whatever happens */
+  if (bus_connection_is_monitor (connection) ||
+      !dbus_connection_get_is_authenticated (connection))
+    return TRUE;
+
+  if (!_dbus_string_init (&scratch))
+    {
+      *n_unsettled += 1;
+      return TRUE;
+    }
+
+  if (!_dbus_connection_get_handoff_state (connection, &fd, &scratch))
+    *n_unsettled += 1;
+
+  _dbus_string_free (&scratch);
+  return TRUE;
+}
+
+static dbus_bool_t
+drain_timeout_handler (void *data)
+{
+  BusHandoff *handoff = data;
+  DBusLoop *loop;
+  int n_unsettled;
+  long sec, usec;
+
+  n_unsettled = 0;
+  bus_connections_foreach (bus_context_get_connections (handoff->context),
+                           count_unsettled_connection, &n_unsettled);
+
+  _dbus_get_current_time (&sec, &usec);
+
+  if (n_unsettled == 0 ||
+      sec > handoff->deadline_sec ||
+      (sec == handoff->deadline_sec && usec >= handoff->deadline_usec))
+    {
+      if (n_unsettled > 0)
+        bus_context_log (handoff->context, DBUS_SYSTEM_LOG_INFO,
+                         "%d connections still busy, dropping them from the handoff",
+                         n_unsettled);
+
+      loop = bus_context_get_loop (handoff->context);
+      _dbus_timeout_set_enabled (handoff->drain_timeout, FALSE);
+      _dbus_loop_toggle_timeout (loop, handoff->drain_timeout);
+      _dbus_loop_quit (loop);
+    }
+
+  return TRUE;
+}
+
+static void
+drain_timeout_callback (DBusTimeout *timeout,
+                        void        *data)
+{
+  dbus_timeout_handle (timeout);
+}
+
+/**
+ * Starts handing the bus over to a new daemon: stops accepting
+ * connections and reading messages, and quits the main loop once the
+ * connections have nothing in flight, or after
+ * #BUS_HANDOFF_DRAIN_TIMEOUT. The caller then goes on with
+ * bus_handoff_save(), or bus_handoff_cancel() to carry on itself.
+ *
+ * Refused while services are being activated, since the activation
+ * helpers are children we would lose track of, and for nonce-tcp
+ * servers, whose nonce file goes with the server.
+ *
+ * @param context the bus
+ * @param error return location for errors
+ * @returns the handoff, or #NULL on error
+ */
+BusHandoff*
+bus_handoff_start (BusContext *context,
+                   DBusError  *error)
+{
+  BusHandoff *handoff;
+  DBusList *link;
+  DBusList **servers;
+  DBusTcpOptions options;
+  DBusString address;
+  DBusGUID guid;
+  const char *socket_name;
+  int *fds;
+  int n_fds;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (bus_activation_has_pending_activations (bus_context_get_activation (context)))
+    {
+      dbus_set_error (error, DBUS_ERROR_FAILED,
+                      "Services are being activated; try again once they are running");
+      return NULL;
+    }
+
+  if (!_dbus_string_init (&address))
+    {
+      BUS_SET_OOM (error);
+      return NULL;
+    }
+
+  servers = bus_context_get_servers (context);
+  for (link = _dbus_list_get_first_link (servers);
+       link != NULL;
+       link = _dbus_list_get_next_link (servers, link))
+    {
+      _dbus_string_set_length (&address, 0);
+
+      if (!_dbus_server_socket_get_handoff_state (link->data, &address,
+                                                  &guid, &fds, &n_fds,
+                                                  &socket_name, &options))
+        {
+          _dbus_string_free (&address);
+          dbus_set_error (error, DBUS_ERROR_FAILED,
+                          "Only unix and tcp servers without a nonce can be handed over");
+          return NULL;
+        }
+    }
+
+  _dbus_string_free (&address);
+
+  handoff = dbus_new0 (BusHandoff, 1);
+  if (handoff == NULL)
+    {
+      BUS_SET_OOM (error);
+      return NULL;
+    }
+
+  handoff->state_fd = -1;
+
+  handoff->drain_timeout = _dbus_timeout_new (BUS_HANDOFF_POLL_INTERVAL,
+                                              drain_timeout_handler,
+                                              handoff, NULL);
+  if (handoff->drain_timeout == NULL)
+    {
+      dbus_free (handoff);
+      BUS_SET_OOM (error);
+      return NULL;
+    }
+
+  if (!_dbus_loop_add_timeout (bus_context_get_loop (context),
+                               handoff->drain_timeout,
+                               drain_timeout_callback, handoff, NULL))
+    {
+      _dbus_timeout_unref (handoff->drain_timeout);
+      dbus_free (handoff);
+      BUS_SET_OOM (error);
+      return NULL;
+    }
+
+  handoff->context = bus_context_ref (context);
+
+  _dbus_get_current_time (&handoff->deadline_sec, &handoff->deadline_usec);
+  handoff->deadline_sec += BUS_HANDOFF_DRAIN_TIMEOUT / 1000;
+  handoff->deadline_usec += (BUS_HANDOFF_DRAIN_TIMEOUT % 1000) * 1000;
+  if (handoff->deadline_usec >= 1000000)
+    {
+      handoff->deadline_sec += 1;
+      handoff->deadline_usec -= 1000000;
+    }
+
+  bus_context_set_accepting (context, FALSE);
+  bus_connections_set_handing_off (bus_context_get_connections (context), TRUE);
+
+  return handoff;
+}
+
+/**
+ * Gives up handing the bus over, after bus_handoff_start() or a
+ * bus_handoff_save() whose exec failed, and goes back to accepting
+ * connections and reading messages. Frees the handoff.
+ *
+ * @param handoff the handoff
+ */
+void
+bus_handoff_cancel (BusHandoff *handoff)
+{
+  BusContext *context = handoff->context;
+  DBusList *link;
+
+  _dbus_assert (context != NULL);
+
+  for (link = _dbus_list_get_first_link (&handoff->kept_fds);
+       link != NULL;
+       link = _dbus_list_get_next_link (&handoff->kept_fds, link))
+    {
+      int fd = _DBUS_POINTER_TO_INT (link->data);
+
+      if (fd != handoff->state_fd)
+        _dbus_fd_set_close_on_exec (fd);
+    }
+
+  if (handoff->state_fd >= 0)
+    _dbus_close (handoff->state_fd, NULL);
+
+  bus_connections_set_handing_off (bus_context_get_connections (context), FALSE);
+
+  if (!bus_context_set_accepting (context, TRUE))
+    bus_context_log (context, DBUS_SYSTEM_LOG_INFO,
+                     "No memory to start accepting connections again");
+
+  bus_handoff_free (handoff);
+}
+
+static void
+state_iter_init (BusHandoff      *handoff,
+                 DBusMessageIter *iter,
+                 int              field)
+{
+  dbus_message_iter_init (handoff->state, iter);
+
+  while (field-- > 0)
+    dbus_message_iter_next (iter);
+}
+
+static dbus_bool_t
+get_bytes (DBusMessageIter  *iter,
+           const char      **bytes_p,
+           int              *len_p)
+{
+  DBusMessageIter sub;
+
+  dbus_message_iter_recurse (iter, &sub);
+  dbus_message_iter_get_fixed_array (&sub, bytes_p, len_p);
+  return dbus_message_iter_next (iter);
+}
+
+/**
+ * Reads the state a daemon wrote with bus_handoff_save() before
+ * exec'ing us, and closes the file.
+ *
+ * @param fd the file the state was written to
+ * @param error return location for errors
+ * @returns the handoff, or #NULL on error
+ */
+BusHandoff*
+bus_handoff_load (int        fd,
+                  DBusError *error)
+{
+  BusHandoff *handoff;
+  DBusMessage *message;
+  DBusMessageIter iter;
+  DBusString data;
+  DBusString hex;
+  DBusString raw;
+  dbus_uint32_t version;
+  const char *id;
+  int needed;
+  int end;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!_dbus_string_init (&data))
+    {
+      _dbus_close (fd, NULL);
+      BUS_SET_OOM (error);
+      return NULL;
+    }
+
+  while (TRUE)
+    {
+      int bytes;
+
+      bytes = _dbus_read (fd, &data, 4096);
+      if (bytes == 0)
+        break;
+
+      if (bytes < 0)
+        {
+          dbus_set_error (error, _dbus_error_from_errno (errno),
+                          "Could not read the bus state: %s",
+                          _dbus_strerror (errno));
+          _dbus_close (fd, NULL);
+          _dbus_string_free (&data);
+          return NULL;
+        }
+    }
+
+  _dbus_close (fd, NULL);
+
+  /* a file cut short would otherwise look like we ran out of memory */
+  needed = dbus_message_demarshal_bytes_needed (_dbus_string_get_const_data (&data),
+                                                _dbus_string_get_length (&data));
+  if (needed <= 0 || needed != _dbus_string_get_length (&data))
+    {
+      _dbus_string_free (&data);
+      message = NULL;
+      goto invalid;
+    }
+
+  message = dbus_message_demarshal (_dbus_string_get_const_data (&data),
+                                    _dbus_string_get_length (&data),
+                                    error);
+  _dbus_string_free (&data);
+  if (message == NULL)
+    return NULL;
+
+  if (!dbus_message_has_signature (message, BUS_HANDOFF_SIGNATURE))
+    goto invalid;
+
+  dbus_message_iter_init (message, &iter);
+  dbus_message_iter_get_basic (&iter, &version);
+  if (version != BUS_HANDOFF_VERSION)
+    {
+      dbus_set_error (error, DBUS_ERROR_FAILED,
+                      "The bus state is version %u, we only know version %d",
+                      version, BUS_HANDOFF_VERSION);
+      dbus_message_unref (message);
+      return NULL;
+    }
+
+  handoff = dbus_new0 (BusHandoff, 1);
+  if (handoff == NULL || !_dbus_string_init (&raw))
+    {
+      dbus_free (handoff);
+      dbus_message_unref (message);
+      BUS_SET_OOM (error);
+      return NULL;
+    }
+
+  handoff->state = message;
+  handoff->state_fd = -1;
+
+  dbus_message_iter_next (&iter);
+  dbus_message_iter_get_basic (&iter, &id);
+  _dbus_string_init_const (&hex, id);
+
+  if (!_dbus_string_hex_decode (&hex, 0, &end, &raw, 0) ||
+      end != _dbus_string_get_length (&hex) ||
+      _dbus_string_get_length (&raw) != DBUS_UUID_LENGTH_BYTES)
+    {
+      _dbus_string_free (&raw);
+      bus_handoff_free (handoff);
+      message = NULL;
+      goto invalid;
+    }
+
+  memcpy (handoff->uuid.as_bytes, _dbus_string_get_const_data (&raw),
+          DBUS_UUID_LENGTH_BYTES);
+  _dbus_string_free (&raw);
+
+  return handoff;
+
+ invalid:
+  if (message != NULL)
+    dbus_message_unref (message);
+  dbus_set_error (error, DBUS_ERROR_FAILED, "The bus state is not valid");
+  return NULL;
+}
+
+/**
+ * Gets the ID of the bus we are taking over.
+ *
+ * @param handoff the handoff from bus_handoff_load()
+ * @param uuid return location for the ID
+ */
+void
+bus_handoff_get_id (BusHandoff *handoff,
+                    DBusGUID   *uuid)
+{
+  _dbus_assert (handoff->state != NULL);
+
+  *uuid = handoff->uuid;
+}
+
+/**
+ * Creates servers listening on the sockets of the bus we are taking
+ * over, with the same addresses and GUIDs, and appends them to a list.
+ *
+ * @param handoff the handoff from bus_handoff_load()
+ * @param servers the list to append the servers to
+ * @param error return location for errors
+ * @returns #FALSE on error
+ */
+dbus_bool_t
+bus_handoff_restore_servers (BusHandoff  *handoff,
+                             DBusList   **servers,
+                             DBusError   *error)
+{
+  DBusMessageIter array, entry;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+  _dbus_assert (handoff->state != NULL);
+
+  state_iter_init (handoff, &array, BUS_HANDOFF_FIELD_SERVERS);
+  dbus_message_iter_recurse (&array, &array);
+
+  while (dbus_message_iter_get_arg_type (&array) == DBUS_TYPE_STRUCT)
+    {
+      DBusServer *server;
+      DBusString address;
+      DBusTcpOptions options;
+      DBusGUID guid;
+      const char *address_str, *guid_bytes, *socket_name;
+      const dbus_int32_t *fds, *option_values;
+      int guid_len, n_fds, n_options;
+      int i;
+
+      dbus_message_iter_recurse (&array, &entry);
+      dbus_message_iter_get_basic (&entry, &address_str);
+      dbus_message_iter_next (&entry);
+      get_bytes (&entry, &guid_bytes, &guid_len);
+      get_bytes (&entry, (const char **) &fds, &n_fds);
+      dbus_message_iter_get_basic (&entry, &socket_name);
+      dbus_message_iter_next (&entry);
+      get_bytes (&entry, (const char **) &option_values, &n_options);
+
+      if (guid_len != DBUS_UUID_LENGTH_BYTES ||
+          n_options != BUS_HANDOFF_N_TCP_OPTIONS ||
+          n_fds < 1)
+        {
+          dbus_set_error (error, DBUS_ERROR_FAILED,
+                          "The bus state is not valid");
+          return FALSE;
+        }
+
+      memcpy (guid.as_bytes, guid_bytes, DBUS_UUID_LENGTH_BYTES);
+
+      options.nodelay = option_values[0];
+      options.keepalive = option_values[1];
+      options.sndbuf = option_values[2];
+      options.rcvbuf = option_values[3];
+      options.zerocopy = option_values[4];
+      options.seqpacket = option_values[5];
+      options.compress = option_values[6];
+
+      /* exec carried them over for us, but not for our children */
+      for (i = 0; i < n_fds; i++)
+        _dbus_fd_set_close_on_exec (fds[i]);
+
+      _dbus_string_init_const (&address, address_str);
+      server = _dbus_server_new_for_handed_off_socket ((int *) fds, n_fds,
+                                                       &address, &guid,
+                                                       *socket_name != '\0' ? socket_name : NULL,
+                                                       &options);
+      if (server == NULL)
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
+      if (!_dbus_list_append (servers, server))
+        {
+          dbus_server_disconnect (server);
+          dbus_server_unref (server);
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
+      dbus_message_iter_next (&array);
+    }
+
+  return TRUE;
+}
+
+static DBusConnection*
+lookup_unique_name (BusRegistry *registry,
+                    const char  *name)
+{
+  DBusString str;
+  BusService *service;
+
+  _dbus_string_init_const (&str, name);
+  service = bus_registry_lookup (registry, &str);
+  if (service == NULL)
+    return NULL;
+
+  return bus_service_get_primary_owners_connection (service);
+}
+
+static void
+drop_restored_connection (BusContext     *context,
+                          DBusConnection *connection,
+                          const char     *name,
+                          const char     *reason)
+{
+  bus_context_log (context, DBUS_SYSTEM_LOG_INFO,
+                   "Dropping connection %s handed over by the previous bus: %s",
+                   *name != '\0' ? name : "(no name yet)", reason);
+  dbus_connection_close (connection);
+  dbus_connection_unref (connection);
+}
+
+static dbus_bool_t
+restore_connection (BusContext       *context,
+                    DBusMessageIter  *entry,
+                    BusTransaction   *transaction,
+                    DBusConnection  **connection_p,
+                    DBusError        *error)
+{
+  DBusConnection *connection;
+  DBusCredentials *identity;
+  DBusMessageIter rules;
+  DBusString unread;
+  DBusString name_str;
+  DBusError tmp_error;
+  BusMatchmaker *matchmaker;
+  const char *name, *adt_data, *unread_data;
+  dbus_int32_t fd;
+  dbus_bool_t unix_fds;
+  dbus_uint32_t uid, pid;
+  int adt_len, unread_len;
+
+  *connection_p = NULL;
+
+  dbus_message_iter_get_basic (entry, &fd);
+  dbus_message_iter_next (entry);
+  dbus_message_iter_get_basic (entry, &name);
+  dbus_message_iter_next (entry);
+  dbus_message_iter_get_basic (entry, &unix_fds);
+  dbus_message_iter_next (entry);
+  dbus_message_iter_get_basic (entry, &uid);
+  dbus_message_iter_next (entry);
+  dbus_message_iter_get_basic (entry, &pid);
+  dbus_message_iter_next (entry);
+  get_bytes (entry, &adt_data, &adt_len);
+  get_bytes (entry, &unread_data, &unread_len);
+  dbus_message_iter_recurse (entry, &rules);
+
+  _dbus_fd_set_close_on_exec (fd);
+
+  identity = _dbus_credentials_new ();
+  if (identity == NULL ||
+      (uid != BUS_HANDOFF_UNSET && !_dbus_credentials_add_unix_uid (identity, uid)) ||
+      (pid != BUS_HANDOFF_UNSET && !_dbus_credentials_add_unix_pid (identity, pid)) ||
+      (adt_len > 0 && !_dbus_credentials_add_adt_audit_data (identity, (void *) adt_data, adt_len)))
+    {
+      if (identity != NULL)
+        _dbus_credentials_unref (identity);
+      _dbus_close (fd, NULL);
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  _dbus_string_init_const_len (&unread, unread_data, unread_len);
+  connection = _dbus_connection_new_for_handed_off_socket (fd, identity,
+                                                           unix_fds, &unread);
+  _dbus_credentials_unref (identity);
+
+  if (connection == NULL)
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  if (!bus_context_add_connection (context, connection))
+    {
+      dbus_connection_unref (connection);
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  /* the new configuration may not let this user in any more */
+  if (!dbus_connection_get_is_authenticated (connection))
+    {
+      drop_restored_connection (context, connection, name,
+                                "no longer allowed to connect");
+      return TRUE;
+    }
+
+  if (*name == '\0')
+    {
+      *connection_p = connection;
+      return TRUE;
+    }
+
+  _dbus_string_init_const (&name_str, name);
+  dbus_error_init (&tmp_error);
+
+  if (!bus_connection_complete (connection, &name_str, &tmp_error) ||
+      bus_registry_ensure (bus_context_get_registry (context), &name_str,
+                           connection, 0, transaction, &tmp_error) == NULL)
+    {
+      if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY))
+        {
+          dbus_move_error (&tmp_error, error);
+          dbus_connection_close (connection);
+          dbus_connection_unref (connection);
+          return FALSE;
+        }
+
+      drop_restored_connection (context, connection, name, tmp_error.message);
+      dbus_error_free (&tmp_error);
+      return TRUE;
+    }
+
+  matchmaker = bus_context_get_matchmaker (context);
+
+  while (dbus_message_iter_get_arg_type (&rules) == DBUS_TYPE_STRING)
+    {
+      BusMatchRule *rule;
+      DBusString text;
+      const char *text_str;
+
+      dbus_message_iter_get_basic (&rules, &text_str);
+      _dbus_string_init_const (&text, text_str);
+
+      rule = bus_matchmaker_parse_rule (matchmaker, connection, &text,
+                                        &tmp_error);
+      if (rule == NULL)
+        {
+          if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY))
+            {
+              dbus_move_error (&tmp_error, error);
+              dbus_connection_unref (connection);
+              return FALSE;
+            }
+
+          bus_context_log (context, DBUS_SYSTEM_LOG_INFO,
+                           "Dropping match rule \"%s\" of %s handed over by the previous bus: %s",
+                           text_str, name, tmp_error.message);
+          dbus_error_free (&tmp_error);
+        }
+      else
+        {
+          dbus_bool_t added;
+
+          added = bus_matchmaker_add_rule (matchmaker, rule);
+          bus_match_rule_unref (rule);
+
+          if (!added)
+            {
+              dbus_connection_unref (connection);
+              BUS_SET_OOM (error);
+              return FALSE;
+            }
+        }
+
+      dbus_message_iter_next (&rules);
+    }
+
+  *connection_p = connection;
+  return TRUE;
+}
+
+static dbus_bool_t
+restore_replies (BusContext      *context,
+                 DBusConnection  *connection,
+                 DBusMessageIter *entry)
+{
+  BusRegistry *registry;
+  DBusMessageIter replies, reply;
+  int i;
+
+  registry = bus_context_get_registry (context);
+
+  for (i = 0; i < BUS_HANDOFF_CONNECTION_FIELD_REPLIES; i++)
+    dbus_message_iter_next (entry);
+
+  dbus_message_iter_recurse (entry, &replies);
+  while (dbus_message_iter_get_arg_type (&replies) == DBUS_TYPE_STRUCT)
+    {
+      DBusConnection *will_send_reply;
+      const char *name;
+      dbus_uint32_t serial;
+
+      dbus_message_iter_recurse (&replies, &reply);
+      dbus_message_iter_get_basic (&reply, &name);
+      dbus_message_iter_next (&reply);
+      dbus_message_iter_get_basic (&reply, &serial);
+
+      will_send_reply = lookup_unique_name (registry, name);
+      if (will_send_reply != NULL &&
+          !bus_connections_restore_reply (bus_context_get_connections (context),
+                                          connection, will_send_reply, serial))
+        return FALSE;
+
+      dbus_message_iter_next (&replies);
+    }
+
+  return TRUE;
+}
+
+static dbus_bool_t
+restore_name (BusContext      *context,
+              DBusMessageIter *entry,
+              BusTransaction  *transaction,
+              BusTransaction  *announce,
+              DBusError       *error)
+{
+  BusRegistry *registry;
+  BusService *service;
+  DBusMessageIter owners, owner;
+  DBusString name_str;
+  DBusConnection *new_owner;
+  const char *name, *old_owner_name, *new_owner_name;
+
+  registry = bus_context_get_registry (context);
+
+  dbus_message_iter_get_basic (entry, &name);
+  dbus_message_iter_next (entry);
+  dbus_message_iter_get_basic (entry, &old_owner_name);
+  dbus_message_iter_next (entry);
+  dbus_message_iter_recurse (entry, &owners);
+
+  _dbus_string_init_const (&name_str, name);
+  service = NULL;
+
+  while (dbus_message_iter_get_arg_type (&owners) == DBUS_TYPE_STRUCT)
+    {
+      DBusConnection *connection;
+      const char *owner_name;
+      dbus_uint32_t flags;
+
+      dbus_message_iter_recurse (&owners, &owner);
+      dbus_message_iter_get_basic (&owner, &owner_name);
+      dbus_message_iter_next (&owner);
+      dbus_message_iter_get_basic (&owner, &flags);
+
+      connection = lookup_unique_name (registry, owner_name);
+      if (connection == NULL)
+        ;
+      else if (service == NULL)
+        {
+          service = bus_registry_ensure (registry, &name_str, connection,
+                                         flags, transaction, error);
+          if (service == NULL)
+            return FALSE;
+        }
+      else if (!bus_service_add_owner (service, connection, flags,
+                                       transaction, error))
+        return FALSE;
+
+      dbus_message_iter_next (&owners);
+    }
+
+  /* Tell everyone if the owner went with a connection we dropped */
+  new_owner = service != NULL ? bus_service_get_primary_owners_connection (service) : NULL;
+  new_owner_name = new_owner != NULL ? bus_connection_get_name (new_owner) : NULL;
+
+  if (new_owner_name != NULL && strcmp (new_owner_name, old_owner_name) == 0)
+    return TRUE;
+
+  if (!bus_driver_send_service_owner_changed (name, old_owner_name,
+                                              new_owner_name, announce, error))
+    return FALSE;
+
+  return new_owner == NULL ||
+    bus_driver_send_service_acquired (new_owner, name, announce, error);
+}
+
+/**
+ * Takes back the clients of the bus we are taking over, with their
+ * unique names, match rules, owned names and the replies they are
+ * owed. Clients the configuration doesn't let in any more are dropped,
+ * and everyone is told about the names of dropped clients going away.
+ * Uses the policy, so call it once the configuration is loaded.
+ *
+ * @param handoff the handoff from bus_handoff_load()
+ * @param context the new bus
+ * @param error return location for errors
+ * @returns #FALSE on error
+ */
+dbus_bool_t
+bus_handoff_restore_connections (BusHandoff *handoff,
+                                 BusContext *context,
+                                 DBusError  *error)
+{
+  BusTransaction *transaction, *announce;
+  DBusMessageIter iter, array, entry;
+  DBusList *restored, *dropped, *link;
+  dbus_int32_t major, minor;
+  dbus_bool_t retval;
+  int n_restored;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+  _dbus_assert (handoff->state != NULL);
+
+  n_restored = 0;
+  restored = NULL;
+  dropped = NULL;
+  retval = FALSE;
+
+  state_iter_init (handoff, &iter, 2);
+  dbus_message_iter_get_basic (&iter, &major);
+  dbus_message_iter_next (&iter);
+  dbus_message_iter_get_basic (&iter, &minor);
+  bus_driver_set_unique_name_counter (major, minor);
+
+  /* The clients saw all this happen already; only what changed on
+   * the way over is announced
+   */
+  transaction = bus_transaction_new (context);
+  announce = bus_transaction_new (context);
+  if (transaction == NULL || announce == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
+  state_iter_init (handoff, &array, BUS_HANDOFF_FIELD_CONNECTIONS);
+  dbus_message_iter_recurse (&array, &array);
+  while (dbus_message_iter_get_arg_type (&array) == DBUS_TYPE_STRUCT)
+    {
+      DBusConnection *connection;
+      const char *name;
+
+      dbus_message_iter_recurse (&array, &entry);
+      if (!restore_connection (context, &entry, transaction, &connection,
+                               error))
+        goto out;
+
+      /* kept in step with the array, so even the dropped ones */
+      if (!_dbus_list_append (&restored, connection))
+        {
+          if (connection != NULL)
+            dbus_connection_unref (connection);
+          BUS_SET_OOM (error);
+          goto out;
+        }
+
+      if (connection != NULL)
+        n_restored += 1;
+
+      dbus_message_iter_recurse (&array, &entry);
+      dbus_message_iter_next (&entry);
+      dbus_message_iter_get_basic (&entry, &name);
+
+      if (connection == NULL && *name != '\0' &&
+          !_dbus_list_append (&dropped, (char *) name))
+        {
+          BUS_SET_OOM (error);
+          goto out;
+        }
+
+      dbus_message_iter_next (&array);
+    }
+
+  /* Replies need the repliers restored first */
+  state_iter_init (handoff, &array, BUS_HANDOFF_FIELD_CONNECTIONS);
+  dbus_message_iter_recurse (&array, &array);
+  for (link = _dbus_list_get_first_link (&restored);
+       link != NULL;
+       link = _dbus_list_get_next_link (&restored, link))
+    {
+      dbus_message_iter_recurse (&array, &entry);
+
+      if (link->data != NULL && bus_connection_is_active (link->data) &&
+          !restore_replies (context, link->data, &entry))
+        {
+          BUS_SET_OOM (error);
+          goto out;
+        }
+
+      dbus_message_iter_next (&array);
+    }
+
+  state_iter_init (handoff, &array, BUS_HANDOFF_FIELD_NAMES);
+  dbus_message_iter_recurse (&array, &array);
+  while (dbus_message_iter_get_arg_type (&array) == DBUS_TYPE_STRUCT)
+    {
+      dbus_message_iter_recurse (&array, &entry);
+      if (!restore_name (context, &entry, transaction, announce, error))
+        goto out;
+
+      dbus_message_iter_next (&array);
+    }
+
+  state_iter_init (handoff, &array, BUS_HANDOFF_FIELD_DROPPED);
+  dbus_message_iter_recurse (&array, &array);
+  while (dbus_message_iter_get_arg_type (&array) == DBUS_TYPE_STRING)
+    {
+      const char *name;
+
+      dbus_message_iter_get_basic (&array, &name);
+      if (!_dbus_list_append (&dropped, (char *) name))
+        {
+          BUS_SET_OOM (error);
+          goto out;
+        }
+
+      dbus_message_iter_next (&array);
+    }
+
+  for (link = _dbus_list_get_first_link (&dropped);
+       link != NULL;
+       link = _dbus_list_get_next_link (&dropped, link))
+    {
+      if (!bus_driver_send_service_owner_changed (link->data, link->data,
+                                                  NULL, announce, error))
+        goto out;
+    }
+
+  bus_transaction_execute_quietly_and_free (transaction);
+  transaction = NULL;
+  bus_transaction_execute_and_free (announce);
+  announce = NULL;
+
+  bus_context_log (context, DBUS_SYSTEM_LOG_INFO,
+                   "Took over the bus with %d connections; %d others were dropped",
+                   n_restored, _dbus_list_get_length (&dropped));
+  retval = TRUE;
+
+ out:
+  if (transaction != NULL)
+    bus_transaction_cancel_and_free (transaction);
+  if (announce != NULL)
+    bus_transaction_cancel_and_free (announce);
+
+  for (link = _dbus_list_get_first_link (&restored);
+       link != NULL;
+       link = _dbus_list_get_next_link (&restored, link))
+    {
+      if (link->data != NULL)
+        dbus_connection_unref (link->data);
+    }
+
+  _dbus_list_clear (&restored);
+  _dbus_list_clear (&dropped);
+
+  return retval;
+}
+
+/**
+ * Frees a handoff.
+ *
+ * @param handoff the handoff
+ */
+void
+bus_handoff_free (BusHandoff *handoff)
+{
+  if (handoff->drain_timeout != NULL)
+    {
+      _dbus_loop_remove_timeout (bus_context_get_loop (handoff->context),
+                                 handoff->drain_timeout,
+                                 drain_timeout_callback, handoff);
+      _dbus_timeout_unref (handoff->drain_timeout);
+    }
+
+  if (handoff->context != NULL)
+    bus_context_unref (handoff->context);
+
+  if (handoff->state != NULL)
+    dbus_message_unref (handoff->state);
+
+  _dbus_list_clear (&handoff->kept_fds);
+  dbus_free (handoff);
+}
+
+#else /* !DBUS_UNIX */
+
+BusHandoff*
+bus_handoff_start (BusContext *context,
+                   DBusError  *error)
+{
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "Handing the bus over is only supported on Unix");
+  return NULL;
+}
+
+int
+bus_handoff_save (BusHandoff *handoff,
+                  DBusError  *error)
+{
+  _dbus_assert_not_reached ("no handoff to save");
+  return -1;
+}
+
+void
+bus_handoff_cancel (BusHandoff *handoff)
+{
+  _dbus_assert_not_reached ("no handoff to cancel");
+}
+
+BusHandoff*
+bus_handoff_load (int        fd,
+                  DBusError *error)
+{
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "Handing the bus over is only supported on Unix");
+  return NULL;
+}
+
+void
+bus_handoff_get_id (BusHandoff *handoff,
+                    DBusGUID   *uuid)
+{
+  _dbus_assert_not_reached ("no handoff to take over from");
+}
+
+dbus_bool_t
+bus_handoff_restore_servers (BusHandoff  *handoff,
+                             DBusList   **servers,
+                             DBusError   *error)
+{
+  _dbus_assert_not_reached ("no handoff to take over from");
+  return FALSE;
+}
+
+dbus_bool_t
+bus_handoff_restore_connections (BusHandoff *handoff,
+                                 BusContext *context,
+                                 DBusError  *error)
+{
+  _dbus_assert_not_reached ("no handoff to take over from");
+  return FALSE;
+}
+
+void
+bus_handoff_free (BusHandoff *handoff)
+{
+  _dbus_assert_not_reached ("no handoff to free");
+}
+
+#endif /* !DBUS_UNIX */
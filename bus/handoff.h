@@ -0,0 +1,60 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* handoff.h  Hand the bus and its clients over to a new daemon binary
+ *
+ * Copyright (C) 2003  Red Hat, Inc.
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef BUS_HANDOFF_H
+#define BUS_HANDOFF_H
+
+#include <dbus/dbus.h>
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-list.h>
+#include "bus.h"
+
+/** How often, in milliseconds, we look whether the connections are quiet yet */
+#define BUS_HANDOFF_POLL_INTERVAL 10
+
+/** Longest, in milliseconds, we wait for the connections to go quiet;
+ * those that still aren't are dropped and have to reconnect
+ */
+#define BUS_HANDOFF_DRAIN_TIMEOUT 1000
+
+/* Handing over, in the old daemon */
+BusHandoff* bus_handoff_start               (BusContext  *context,
+                                             DBusError   *error);
+int         bus_handoff_save                (BusHandoff  *handoff,
+                                             DBusError   *error);
+void        bus_handoff_cancel              (BusHandoff  *handoff);
+
+/* Taking over, in the new one */
+BusHandoff* bus_handoff_load                (int          fd,
+                                             DBusError   *error);
+void        bus_handoff_get_id              (BusHandoff  *handoff,
+                                             DBusGUID    *uuid);
+dbus_bool_t bus_handoff_restore_servers     (BusHandoff  *handoff,
+                                             DBusList   **servers,
+                                             DBusError   *error);
+dbus_bool_t bus_handoff_restore_connections (BusHandoff  *handoff,
+                                             BusContext  *context,
+                                             DBusError   *error);
+void        bus_handoff_free                (BusHandoff  *handoff);
+
+#endif /* BUS_HANDOFF_H */
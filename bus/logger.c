@@ -0,0 +1,573 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* logger.c  Write the system log off the main loop
+ *
+ * Copyright (C) 2003  Red Hat, Inc.
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "logger.h"
+#include "test.h"
+#include <dbus/dbus-internals.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Without threads every line is written by the caller, as it always
+ * used to be, with no deduplication or rate limit.
+ */
+#ifdef DBUS_UNIX
+#define BUS_LOGGER_USE_THREAD 1
+#endif
+
+#ifdef BUS_LOGGER_USE_THREAD
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#endif
+
+typedef struct BusLoggerLine BusLoggerLine;
+
+/* A line waiting for the helper thread.  It comes from plain malloc()
+ * because the helper thread frees it and never calls into libdbus,
+ * apart from the write function.
+ */
+struct BusLoggerLine
+{
+  BusLoggerLine *next;
+  DBusSystemLogSeverity severity;
+  int repeats_before;                    /**< Duplicates of the previous line, to report first */
+  DBusSystemLogSeverity repeated_severity;
+  char *text;                            /**< Stored just after the struct */
+};
+
+struct BusLogger
+{
+  int refcount;
+  BusLoggerWriteFunction write_function;
+
+#ifdef BUS_LOGGER_USE_THREAD
+  pthread_mutex_t lock;     /**< Protects everything below except the thread-only part */
+  pthread_cond_t cond;      /**< Signalled when a line is queued or we shut down */
+  pthread_t thread;
+  dbus_bool_t have_thread;
+  dbus_bool_t shutting_down;
+  BusLoggerLine *queued_head;
+  BusLoggerLine *queued_tail;
+  int n_queued;
+
+  char *last;                            /**< The last line queued, to spot duplicates */
+  DBusSystemLogSeverity last_severity;
+  int repeats;                           /**< Duplicates of last not yet queued or reported */
+  int dropped;                           /**< Lines lost to a full queue */
+  dbus_bool_t dropped_security;          /**< Whether any of those was a security line */
+
+  /* Only touched by the helper thread */
+  time_t window_start;
+  int written_in_window;
+  int suppressed;                        /**< Lines lost and not yet reported */
+  dbus_bool_t suppressed_security;
+#endif
+};
+
+static void
+write_to_system_log (DBusSystemLogSeverity  severity,
+                     const char            *line)
+{
+  _dbus_system_log (severity, "%s", line);
+}
+
+#ifdef BUS_LOGGER_USE_THREAD
+
+static void
+write_repeated (BusLogger             *logger,
+                DBusSystemLogSeverity  severity,
+                int                    repeats)
+{
+  char buf[64];
+
+  if (repeats == 0)
+    return;
+
+  snprintf (buf, sizeof (buf), "Last message repeated %d times", repeats);
+  (* logger->write_function) (severity, buf);
+}
+
+static void
+write_dropped (BusLogger   *logger,
+               dbus_bool_t  security,
+               int          dropped)
+{
+  char buf[64];
+
+  if (dropped == 0)
+    return;
+
+  snprintf (buf, sizeof (buf), "%d log messages were dropped", dropped);
+  (* logger->write_function) (security ? DBUS_SYSTEM_LOG_SECURITY :
+                              DBUS_SYSTEM_LOG_INFO, buf);
+}
+
+/* called from the helper thread; summaries don't count against the limit */
+static dbus_bool_t
+within_rate_limit (BusLogger *logger)
+{
+  time_t now;
+
+  now = time (NULL);
+  if (now != logger->window_start)
+    {
+      logger->window_start = now;
+      logger->written_in_window = 0;
+    }
+
+  if (logger->written_in_window >= BUS_LOGGER_MAX_PER_SECOND)
+    return FALSE;
+
+  logger->written_in_window += 1;
+  return TRUE;
+}
+
+/* called from the helper thread without the lock */
+static void
+write_line (BusLogger     *logger,
+            BusLoggerLine *line)
+{
+  write_repeated (logger, line->repeated_severity, line->repeats_before);
+
+  if (within_rate_limit (logger))
+    {
+      /* the first line of a new second reports what the last one lost */
+      write_dropped (logger, logger->suppressed_security, logger->suppressed);
+      logger->suppressed = 0;
+      logger->suppressed_security = FALSE;
+
+      (* logger->write_function) (line->severity, line->text);
+    }
+  else
+    {
+      logger->suppressed += 1;
+      if (line->severity == DBUS_SYSTEM_LOG_SECURITY)
+        logger->suppressed_security = TRUE;
+    }
+}
+
+/* called with the lock held; drops it while writing */
+static void
+flush_counts_unlocked (BusLogger *logger)
+{
+  DBusSystemLogSeverity repeated_severity;
+  dbus_bool_t dropped_security;
+  int repeats, dropped;
+
+  repeats = logger->repeats;
+  repeated_severity = logger->last_severity;
+  dropped = logger->dropped + logger->suppressed;
+  dropped_security = logger->dropped_security || logger->suppressed_security;
+
+  logger->repeats = 0;
+  logger->dropped = 0;
+  logger->dropped_security = FALSE;
+  logger->suppressed = 0;
+  logger->suppressed_security = FALSE;
+
+  pthread_mutex_unlock (&logger->lock);
+
+  write_repeated (logger, repeated_severity, repeats);
+  write_dropped (logger, dropped_security, dropped);
+
+  pthread_mutex_lock (&logger->lock);
+}
+
+static void*
+logger_thread_main (void *data)
+{
+  BusLogger *logger = data;
+
+  pthread_mutex_lock (&logger->lock);
+
+  while (TRUE)
+    {
+      BusLoggerLine *line;
+
+      while (!logger->shutting_down && logger->queued_head == NULL)
+        {
+          if (logger->repeats > 0 || logger->dropped > 0 ||
+              logger->suppressed > 0)
+            {
+              struct timespec deadline;
+
+              /* report counts once things have been quiet for a second */
+              deadline.tv_sec = time (NULL) + 1;
+              deadline.tv_nsec = 0;
+              if (pthread_cond_timedwait (&logger->cond, &logger->lock,
+                                          &deadline) == ETIMEDOUT &&
+                  logger->queued_head == NULL)
+                flush_counts_unlocked (logger);
+            }
+          else
+            pthread_cond_wait (&logger->cond, &logger->lock);
+        }
+
+      line = logger->queued_head;
+      if (line == NULL)
+        {
+          /* shutting down, and everything queued has been written */
+          flush_counts_unlocked (logger);
+          break;
+        }
+
+      logger->queued_head = line->next;
+      if (logger->queued_head == NULL)
+        logger->queued_tail = NULL;
+      logger->n_queued -= 1;
+
+      /* so that a steady flood still gets its losses reported */
+      logger->suppressed += logger->dropped;
+      logger->suppressed_security |= logger->dropped_security;
+      logger->dropped = 0;
+      logger->dropped_security = FALSE;
+
+      pthread_mutex_unlock (&logger->lock);
+
+      write_line (logger, line);
+      free (line);
+
+      pthread_mutex_lock (&logger->lock);
+    }
+
+  pthread_mutex_unlock (&logger->lock);
+
+  return NULL;
+}
+
+/* Writes out everything queued and stops the helper thread */
+static void
+stop_thread (BusLogger *logger)
+{
+  if (!logger->have_thread)
+    return;
+
+  pthread_mutex_lock (&logger->lock);
+  logger->shutting_down = TRUE;
+  pthread_cond_signal (&logger->cond);
+  pthread_mutex_unlock (&logger->lock);
+
+  pthread_join (logger->thread, NULL);
+  logger->have_thread = FALSE;
+}
+
+static void
+start_thread (BusLogger *logger)
+{
+  sigset_t all_signals;
+  sigset_t old_signals;
+  int ret;
+
+  /* Signals are for the main loop; threads inherit the mask. */
+  sigfillset (&all_signals);
+  pthread_sigmask (SIG_SETMASK, &all_signals, &old_signals);
+  ret = pthread_create (&logger->thread, NULL, logger_thread_main, logger);
+  pthread_sigmask (SIG_SETMASK, &old_signals, NULL);
+
+  if (ret != 0)
+    {
+      _dbus_verbose ("Could not start logger thread, logging synchronously: %s\n",
+                     _dbus_strerror (ret));
+      return;
+    }
+
+  logger->have_thread = TRUE;
+}
+
+#endif /* BUS_LOGGER_USE_THREAD */
+
+/**
+ * Creates a logger. Lines given to it are written by a helper
+ * thread, so a flood of them can't stall the main loop: a line
+ * identical to the one before it is only counted, and lines beyond
+ * #BUS_LOGGER_MAX_QUEUED waiting or #BUS_LOGGER_MAX_PER_SECOND
+ * written per second are dropped and counted, with the counts
+ * logged later.
+ *
+ * The thread starts at once, so create the logger only after the
+ * process has forked into the background.
+ */
+BusLogger*
+bus_logger_new (void)
+{
+  BusLogger *logger;
+
+  logger = dbus_new0 (BusLogger, 1);
+  if (logger == NULL)
+    return NULL;
+
+  logger->refcount = 1;
+  logger->write_function = write_to_system_log;
+
+#ifdef BUS_LOGGER_USE_THREAD
+  if (pthread_mutex_init (&logger->lock, NULL) != 0)
+    goto failed;
+
+  if (pthread_cond_init (&logger->cond, NULL) != 0)
+    {
+      pthread_mutex_destroy (&logger->lock);
+      goto failed;
+    }
+
+  start_thread (logger);
+#endif
+
+  return logger;
+
+#ifdef BUS_LOGGER_USE_THREAD
+ failed:
+  dbus_free (logger);
+  return NULL;
+#endif
+}
+
+BusLogger*
+bus_logger_ref (BusLogger *logger)
+{
+  _dbus_assert (logger->refcount > 0);
+  logger->refcount += 1;
+
+  return logger;
+}
+
+/**
+ * Drops a reference; the last one writes out anything still queued
+ * before freeing the logger.
+ */
+void
+bus_logger_unref (BusLogger *logger)
+{
+  _dbus_assert (logger->refcount > 0);
+  logger->refcount -= 1;
+
+  if (logger->refcount > 0)
+    return;
+
+#ifdef BUS_LOGGER_USE_THREAD
+  stop_thread (logger);
+
+  _dbus_assert (logger->queued_head == NULL);
+  free (logger->last);
+
+  pthread_cond_destroy (&logger->cond);
+  pthread_mutex_destroy (&logger->lock);
+#endif
+
+  dbus_free (logger);
+}
+
+/**
+ * Replaces the function lines are finally written with, which is
+ * _dbus_system_log() by default. Must be called before anything is
+ * logged.
+ */
+void
+bus_logger_set_write_function (BusLogger              *logger,
+                               BusLoggerWriteFunction  function)
+{
+  logger->write_function = function;
+}
+
+/**
+ * Queues a line for the system log. Safe to call from any thread.
+ * A #DBUS_SYSTEM_LOG_FATAL line first waits for everything queued
+ * to be written, then is written at once, and exits.
+ */
+void
+bus_logger_log (BusLogger             *logger,
+                DBusSystemLogSeverity  severity,
+                const char            *text)
+{
+#ifdef BUS_LOGGER_USE_THREAD
+  BusLoggerLine *line;
+  char *last;
+  size_t len;
+
+  if (severity == DBUS_SYSTEM_LOG_FATAL)
+    stop_thread (logger);
+
+  if (!logger->have_thread)
+    {
+      (* logger->write_function) (severity, text);
+      return;
+    }
+
+  len = strlen (text);
+
+  pthread_mutex_lock (&logger->lock);
+
+  if (logger->last != NULL && logger->last_severity == severity &&
+      strcmp (logger->last, text) == 0)
+    {
+      logger->repeats += 1;
+      goto out;
+    }
+
+  if (logger->n_queued >= BUS_LOGGER_MAX_QUEUED)
+    goto dropped;
+
+  line = malloc (sizeof (BusLoggerLine) + len + 1);
+  if (line == NULL)
+    goto dropped;
+
+  last = realloc (logger->last, len + 1);
+  if (last == NULL)
+    {
+      free (line);
+      goto dropped;
+    }
+
+  line->next = NULL;
+  line->severity = severity;
+  line->repeats_before = logger->repeats;
+  line->repeated_severity = logger->last_severity;
+  line->text = (char *) (line + 1);
+  memcpy (line->text, text, len + 1);
+
+  logger->last = last;
+  memcpy (logger->last, text, len + 1);
+  logger->last_severity = severity;
+  logger->repeats = 0;
+
+  if (logger->queued_tail != NULL)
+    logger->queued_tail->next = line;
+  else
+    logger->queued_head = line;
+  logger->queued_tail = line;
+  logger->n_queued += 1;
+
+  pthread_cond_signal (&logger->cond);
+  goto out;
+
+ dropped:
+  logger->dropped += 1;
+  if (severity == DBUS_SYSTEM_LOG_SECURITY)
+    logger->dropped_security = TRUE;
+
+ out:
+  pthread_mutex_unlock (&logger->lock);
+#else
+  (* logger->write_function) (severity, text);
+#endif
+}
+
+#ifdef DBUS_BUILD_TESTS
+
+#ifdef BUS_LOGGER_USE_THREAD
+
+#define TEST_MAX_LINES 1024
+
+static char *test_lines[TEST_MAX_LINES];
+static int n_test_lines;
+
+/* runs in the helper thread; only read after it has been joined */
+static void
+test_write_function (DBusSystemLogSeverity  severity,
+                     const char            *line)
+{
+  if (n_test_lines < TEST_MAX_LINES)
+    test_lines[n_test_lines++] = strdup (line);
+}
+
+static void
+test_lines_clear (void)
+{
+  while (n_test_lines > 0)
+    free (test_lines[--n_test_lines]);
+}
+
+#endif /* BUS_LOGGER_USE_THREAD */
+
+dbus_bool_t
+bus_logger_test (const DBusString *test_data_dir)
+{
+#ifdef BUS_LOGGER_USE_THREAD
+  BusLogger *logger;
+  char buf[64];
+  int i, written, n_dropped;
+  time_t started;
+
+  logger = bus_logger_new ();
+  _dbus_assert (logger != NULL);
+  bus_logger_set_write_function (logger, test_write_function);
+
+  if (!logger->have_thread)
+    {
+      _dbus_verbose ("Could not start a logger thread, skipping logger test\n");
+      bus_logger_unref (logger);
+      return TRUE;
+    }
+
+  /* Duplicates are folded into one count, reported before the next line */
+  for (i = 0; i < 5; i++)
+    bus_logger_log (logger, DBUS_SYSTEM_LOG_SECURITY, "denied");
+  bus_logger_log (logger, DBUS_SYSTEM_LOG_SECURITY, "other");
+  bus_logger_log (logger, DBUS_SYSTEM_LOG_SECURITY, "other");
+  bus_logger_unref (logger);
+
+  _dbus_assert (n_test_lines == 4);
+  _dbus_assert (strcmp (test_lines[0], "denied") == 0);
+  _dbus_assert (strcmp (test_lines[1], "Last message repeated 4 times") == 0);
+  _dbus_assert (strcmp (test_lines[2], "other") == 0);
+  _dbus_assert (strcmp (test_lines[3], "Last message repeated 1 times") == 0);
+  test_lines_clear ();
+
+  /* A flood is cut down to the queue and rate limits, and counted */
+  logger = bus_logger_new ();
+  _dbus_assert (logger != NULL);
+  bus_logger_set_write_function (logger, test_write_function);
+
+  started = time (NULL);
+  for (i = 0; i < 2000; i++)
+    {
+      snprintf (buf, sizeof (buf), "flood %d", i);
+      bus_logger_log (logger, DBUS_SYSTEM_LOG_INFO, buf);
+    }
+  bus_logger_unref (logger);
+
+  written = 0;
+  n_dropped = 0;
+  for (i = 0; i < n_test_lines; i++)
+    {
+      int n;
+
+      if (strncmp (test_lines[i], "flood ", 6) == 0)
+        written += 1;
+      else if (sscanf (test_lines[i], "%d log messages were dropped", &n) == 1)
+        n_dropped += n;
+      else
+        _dbus_assert_not_reached ("unexpected log line");
+    }
+
+  _dbus_assert (written + n_dropped == 2000);
+  _dbus_assert (written <= BUS_LOGGER_MAX_PER_SECOND * (time (NULL) - started + 1));
+  test_lines_clear ();
+#endif
+
+  return TRUE;
+}
+
+#endif /* DBUS_BUILD_TESTS */
@@ -0,0 +1,52 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* logger.h  Write the system log off the main loop
+ *
+ * Copyright (C) 2003  Red Hat, Inc.
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef BUS_LOGGER_H
+#define BUS_LOGGER_H
+
+#include <dbus/dbus.h>
+#include <dbus/dbus-sysdeps.h>
+#include "bus.h"
+
+/* Writes one finished line to the log.  Called from the logger's
+ * helper thread, so it must not touch anything but the line.
+ */
+typedef void (* BusLoggerWriteFunction) (DBusSystemLogSeverity  severity,
+                                         const char            *line);
+
+/** Most lines waiting for the helper thread; more are counted and dropped */
+#define BUS_LOGGER_MAX_QUEUED 256
+
+/** Most lines written in any one second; more are counted and dropped */
+#define BUS_LOGGER_MAX_PER_SECOND 100
+
+BusLogger* bus_logger_new                (void);
+BusLogger* bus_logger_ref                (BusLogger              *logger);
+void       bus_logger_unref              (BusLogger              *logger);
+void       bus_logger_set_write_function (BusLogger              *logger,
+                                          BusLoggerWriteFunction  function);
+void       bus_logger_log                (BusLogger              *logger,
+                                          DBusSystemLogSeverity   severity,
+                                          const char             *line);
+
+#endif /* BUS_LOGGER_H */
@@ -22,8 +22,13 @@
  */
 
 #include <config.h>
+#include "activation.h"
 #include "bus.h"
+#include "config-parser.h"
 #include "driver.h"
+#include "handoff.h"
+#include "stats.h"
+#include <dbus/dbus-file.h>
 #include <dbus/dbus-internals.h>
 #include <dbus/dbus-watch.h>
 #include <stdio.h>
@@ -35,14 +40,25 @@
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
 #endif
+#ifdef DBUS_UNIX
+#include <unistd.h>
+#endif
 #include "selinux.h"
 
 static BusContext *context;
 
+/* Set while we wait to hand the bus over to a new daemon */
+static BusHandoff *handoff;
+
 static int reload_pipe[2];
 #define RELOAD_READ_END 0
 #define RELOAD_WRITE_END 1
 
+/* The byte written to the reload pipe says what the signal asked for */
+#define RELOAD_CONFIG "r"
+#define RELOAD_LOG_LATENCY "l"
+#define RELOAD_HANDOFF "h"
+
 static void close_reload_pipe (void);
 
 static void
@@ -59,7 +75,35 @@ signal_handler (int sig)
     case SIGHUP:
       {
         DBusString str;
-        _dbus_string_init_const (&str, "foo");
+        _dbus_string_init_const (&str, RELOAD_CONFIG);
+        if ((reload_pipe[RELOAD_WRITE_END] > 0) &&
+            !_dbus_write_socket (reload_pipe[RELOAD_WRITE_END], &str, 0, 1))
+          {
+            _dbus_warn ("Unable to write to reload pipe.\n");
+            close_reload_pipe ();
+          }
+      }
+      break;
+#endif
+#ifdef SIGUSR1
+    case SIGUSR1:
+      {
+        DBusString str;
+        _dbus_string_init_const (&str, RELOAD_LOG_LATENCY);
+        if ((reload_pipe[RELOAD_WRITE_END] > 0) &&
+            !_dbus_write_socket (reload_pipe[RELOAD_WRITE_END], &str, 0, 1))
+          {
+            _dbus_warn ("Unable to write to reload pipe.\n");
+            close_reload_pipe ();
+          }
+      }
+      break;
+#endif
+#ifdef SIGUSR2
+    case SIGUSR2:
+      {
+        DBusString str;
+        _dbus_string_init_const (&str, RELOAD_HANDOFF);
         if ((reload_pipe[RELOAD_WRITE_END] > 0) &&
             !_dbus_write_socket (reload_pipe[RELOAD_WRITE_END], &str, 0, 1))
           {
@@ -75,7 +119,7 @@ signal_handler (int sig)
 static void
 usage (void)
 {
-  fprintf (stderr, DBUS_DAEMON_NAME " [--version] [--session] [--system] [--config-file=FILE] [--print-address[=DESCRIPTOR]] [--print-pid[=DESCRIPTOR]] [--fork] [--nofork] [--introspect] [--address=ADDRESS] [--systemd-activation]\n");
+  fprintf (stderr, DBUS_DAEMON_NAME " [--version] [--session] [--system] [--config-file=FILE] [--print-address[=DESCRIPTOR]] [--print-pid[=DESCRIPTOR]] [--fork] [--nofork] [--introspect] [--address=ADDRESS] [--systemd-activation] [--latency-stats] [--stats-file=FILE] [--write-service-index] [--handoff-fd=DESCRIPTOR]\n");
   exit (1);
 }
 
@@ -115,6 +159,48 @@ introspect (void)
   exit (1);
 }
 
+static void
+write_service_indexes (const DBusString *config_file)
+{
+  BusConfigParser *parser;
+  DBusList *link;
+  DBusList **dirs;
+  DBusError error;
+  int status;
+
+  dbus_error_init (&error);
+  parser = bus_config_load (config_file, TRUE, NULL, &error);
+  if (parser == NULL)
+    {
+      _dbus_warn ("Failed to load configuration: %s\n", error.message);
+      dbus_error_free (&error);
+      exit (1);
+    }
+
+  status = 0;
+  dirs = bus_config_parser_get_service_dirs (parser);
+
+  for (link = _dbus_list_get_first_link (dirs);
+       link != NULL;
+       link = _dbus_list_get_next_link (dirs, link))
+    {
+      /* missing directories are normal, e.g. in /usr/local */
+      if (!_dbus_file_exists (link->data))
+        continue;
+
+      if (!bus_activation_write_service_index (link->data, &error))
+        {
+          _dbus_warn ("Failed to write service index for %s: %s\n",
+                      (const char *) link->data, error.message);
+          dbus_error_free (&error);
+          status = 1;
+        }
+    }
+
+  bus_config_parser_unref (parser);
+  exit (status);
+}
+
 static void
 check_two_config_files (const DBusString *config_file,
                         const char       *extra_arg)
@@ -181,6 +267,32 @@ handle_reload_watch (DBusWatch    *watch,
       close_reload_pipe ();
       return TRUE;
     }
+
+  if (_dbus_string_equal_c_str (&str, RELOAD_LOG_LATENCY))
+    {
+      _dbus_string_free (&str);
+      bus_stats_log_latency (context);
+      return TRUE;
+    }
+
+  if (_dbus_string_equal_c_str (&str, RELOAD_HANDOFF))
+    {
+      _dbus_string_free (&str);
+
+      /* one is enough */
+      if (handoff != NULL)
+        return TRUE;
+
+      dbus_error_init (&error);
+      handoff = bus_handoff_start (context, &error);
+      if (handoff == NULL)
+        {
+          _DBUS_ASSERT_ERROR_IS_SET (&error);
+          _dbus_warn ("Unable to hand the bus over: %s\n", error.message);
+          dbus_error_free (&error);
+        }
+      return TRUE;
+    }
   _dbus_string_free (&str);
 
   /* this can only fail if we don't understand the config file
@@ -258,6 +370,119 @@ close_reload_pipe (void)
     reload_pipe[RELOAD_WRITE_END] = -1;
 }
 
+#ifdef DBUS_UNIX
+/** The installed daemon binary, which a handoff runs */
+#define DAEMON_PATH DBUS_DAEMONDIR "/" DBUS_DAEMON_NAME
+
+/* Replaces this process with the installed daemon binary, which may
+ * have been upgraded since we started, and has it take over the bus
+ * where we leave it. The binary is run by its absolute path since we
+ * have changed directory to / by now, so argv[0] can't be trusted to
+ * find it. Only returns if that failed, with the handoff cancelled.
+ */
+static void
+exec_new_daemon (const DBusString *config_file,
+                 const DBusString *address,
+                 dbus_bool_t       systemd_activation,
+                 dbus_bool_t       latency_stats,
+                 const DBusString *stats_file)
+{
+  DBusError error;
+  DBusString config_arg;
+  DBusString fd_arg;
+  DBusString stats_file_arg;
+  DBusString address_arg;
+  char *args[9];
+  int fd;
+  int i;
+
+  dbus_error_init (&error);
+
+  if (!_dbus_string_init (&config_arg))
+    goto out;
+
+  if (!_dbus_string_init (&fd_arg))
+    {
+      _dbus_string_free (&config_arg);
+      goto out;
+    }
+
+  if (!_dbus_string_init (&stats_file_arg))
+    {
+      _dbus_string_free (&fd_arg);
+      _dbus_string_free (&config_arg);
+      goto out;
+    }
+
+  if (!_dbus_string_init (&address_arg))
+    {
+      _dbus_string_free (&stats_file_arg);
+      _dbus_string_free (&fd_arg);
+      _dbus_string_free (&config_arg);
+      goto out;
+    }
+
+  fd = bus_handoff_save (handoff, &error);
+  if (fd < 0)
+    {
+      _dbus_warn ("Unable to save the bus state: %s\n", error.message);
+      dbus_error_free (&error);
+      goto out_free;
+    }
+
+  if (!_dbus_string_append (&config_arg, "--config-file=") ||
+      !_dbus_string_copy (config_file, 0, &config_arg,
+                          _dbus_string_get_length (&config_arg)) ||
+      !_dbus_string_append_printf (&fd_arg, "--handoff-fd=%d", fd) ||
+      (_dbus_string_get_length (stats_file) > 0 &&
+       (!_dbus_string_append (&stats_file_arg, "--stats-file=") ||
+        !_dbus_string_copy (stats_file, 0, &stats_file_arg,
+                            _dbus_string_get_length (&stats_file_arg)))) ||
+      (_dbus_string_get_length (address) > 0 &&
+       (!_dbus_string_append (&address_arg, "--address=") ||
+        !_dbus_string_copy (address, 0, &address_arg,
+                            _dbus_string_get_length (&address_arg)))))
+    {
+      _dbus_warn ("No memory to hand the bus over\n");
+      goto out_free;
+    }
+
+  i = 0;
+  args[i++] = DAEMON_PATH;
+  args[i++] = (char *) _dbus_string_get_const_data (&config_arg);
+  args[i++] = "--nofork";
+  args[i++] = (char *) _dbus_string_get_const_data (&fd_arg);
+  if (systemd_activation)
+    args[i++] = "--systemd-activation";
+  if (latency_stats)
+    args[i++] = "--latency-stats";
+  if (_dbus_string_get_length (&stats_file_arg) > 0)
+    args[i++] = (char *) _dbus_string_get_const_data (&stats_file_arg);
+  /* Start the new daemon the way we were started, so it has the
+   * same address if it ever has to listen afresh rather than take
+   * our sockets over
+   */
+  if (_dbus_string_get_length (&address_arg) > 0)
+    args[i++] = (char *) _dbus_string_get_const_data (&address_arg);
+  args[i] = NULL;
+
+  _dbus_verbose ("Handing the bus over to a new %s\n", DAEMON_PATH);
+  execv (DAEMON_PATH, args);
+
+  _dbus_warn ("Unable to run %s to hand the bus over to: %s\n",
+              DAEMON_PATH, _dbus_strerror (errno));
+
+ out_free:
+  _dbus_string_free (&address_arg);
+  _dbus_string_free (&stats_file_arg);
+  _dbus_string_free (&fd_arg);
+  _dbus_string_free (&config_arg);
+ out:
+  bus_handoff_cancel (handoff);
+  handoff = NULL;
+}
+#endif /* DBUS_UNIX */
+
 int
 main (int argc, char **argv)
 {
@@ -266,6 +491,8 @@ main (int argc, char **argv)
   DBusString address;
   DBusString addr_fd;
   DBusString pid_fd;
+  DBusString handoff_fd;
+  DBusString stats_file;
   const char *prev_arg;
   DBusPipe print_addr_pipe;
   DBusPipe print_pid_pipe;
@@ -275,6 +502,12 @@ main (int argc, char **argv)
   dbus_bool_t is_session_bus;
   int force_fork;
   dbus_bool_t systemd_activation;
+#ifdef DBUS_UNIX
+  /* Only needed to pass on to a daemon we hand the bus over to */
+  dbus_bool_t latency_stats;
+#endif
+  dbus_bool_t write_index;
+  BusHandoff *taken_over;
 
   if (!_dbus_string_init (&config_file))
     return 1;
@@ -288,11 +521,21 @@ main (int argc, char **argv)
   if (!_dbus_string_init (&pid_fd))
     return 1;
 
+  if (!_dbus_string_init (&handoff_fd))
+    return 1;
+
+  if (!_dbus_string_init (&stats_file))
+    return 1;
+
   print_address = FALSE;
   print_pid = FALSE;
   is_session_bus = FALSE;
   force_fork = FORK_FOLLOW_CONFIG_FILE;
   systemd_activation = FALSE;
+#ifdef DBUS_UNIX
+  latency_stats = FALSE;
+#endif
+  write_index = FALSE;
 
   prev_arg = NULL;
   i = 1;
@@ -314,6 +557,26 @@ main (int argc, char **argv)
         force_fork = FORK_ALWAYS;
       else if (strcmp (arg, "--systemd-activation") == 0)
         systemd_activation = TRUE;
+      else if (strcmp (arg, "--latency-stats") == 0)
+        {
+          bus_stats_set_latency_enabled (TRUE);
+#ifdef DBUS_UNIX
+          latency_stats = TRUE;
+#endif
+        }
+      else if (strstr (arg, "--stats-file=") == arg)
+        {
+          const char *file;
+
+          file = strchr (arg, '=');
+          ++file;
+
+          _dbus_string_set_length (&stats_file, 0);
+          if (!_dbus_string_append (&stats_file, file))
+            exit (1);
+        }
+      else if (strcmp (arg, "--write-service-index") == 0)
+        write_index = TRUE;
       else if (strcmp (arg, "--system") == 0)
         {
           check_two_config_files (&config_file, "system");
@@ -424,6 +687,16 @@ main (int argc, char **argv)
         }
       else if (strcmp (arg, "--print-pid") == 0)
         print_pid = TRUE; /* and we'll get the next arg if appropriate */
+      else if (strstr (arg, "--handoff-fd=") == arg)
+        {
+          const char *desc;
+
+          desc = strchr (arg, '=');
+          ++desc;
+
+          if (!_dbus_string_append (&handoff_fd, desc))
+            exit (1);
+        }
       else
         usage ();
 
@@ -438,6 +711,9 @@ main (int argc, char **argv)
       usage ();
     }
 
+  if (write_index)
+    write_service_indexes (&config_file);
+
   _dbus_pipe_invalidate (&print_addr_pipe);
   if (print_address)
     {
@@ -482,6 +758,32 @@ main (int argc, char **argv)
     }
   _dbus_string_free (&pid_fd);
 
+  taken_over = NULL;
+  if (_dbus_string_get_length (&handoff_fd) > 0)
+    {
+      long val;
+      int end;
+      if (!_dbus_string_parse_int (&handoff_fd, 0, &val, &end) ||
+          end != _dbus_string_get_length (&handoff_fd) ||
+          val < 0 || val > _DBUS_INT_MAX)
+        {
+          fprintf (stderr, "Invalid file descriptor: \"%s\"\n",
+                   _dbus_string_get_const_data (&handoff_fd));
+          exit (1);
+        }
+
+      dbus_error_init (&error);
+      taken_over = bus_handoff_load (val, &error);
+      if (taken_over == NULL)
+        {
+          _dbus_warn ("Failed to take over the message bus: %s\n",
+                      error.message);
+          dbus_error_free (&error);
+          exit (1);
+        }
+    }
+  _dbus_string_free (&handoff_fd);
+
   if (!bus_selinux_pre_init ())
     {
       _dbus_warn ("SELinux pre-initialization failed\n");
@@ -493,8 +795,10 @@ main (int argc, char **argv)
                              &print_addr_pipe, &print_pid_pipe,
                              _dbus_string_get_length(&address) > 0 ? &address : NULL,
                              systemd_activation,
+                             taken_over,
                              &error);
-  _dbus_string_free (&config_file);
+  if (taken_over != NULL)
+    bus_handoff_free (taken_over);
   if (context == NULL)
     {
       _dbus_warn ("Failed to start message bus: %s\n",
@@ -509,6 +813,14 @@ main (int argc, char **argv)
   if (is_session_bus)
     _dbus_daemon_publish_session_bus_address (bus_context_get_address (context));
 
+  if (_dbus_string_get_length (&stats_file) > 0 &&
+      !bus_stats_file_open (context, &stats_file, &error))
+    {
+      _dbus_warn ("Failed to create the stats file: %s\n", error.message);
+      dbus_error_free (&error);
+      exit (1);
+    }
+
   /* bus_context_new() closes the print_addr_pipe and
    * print_pid_pipe
    */
@@ -518,6 +830,12 @@ main (int argc, char **argv)
 #ifdef SIGHUP
   _dbus_set_signal_handler (SIGHUP, signal_handler);
 #endif
+#ifdef SIGUSR1
+  _dbus_set_signal_handler (SIGUSR1, signal_handler);
+#endif
+#ifdef SIGUSR2
+  _dbus_set_signal_handler (SIGUSR2, signal_handler);
+#endif
 #ifdef DBUS_BUS_ENABLE_DNOTIFY_ON_LINUX
   _dbus_set_signal_handler (SIGIO, signal_handler);
 #endif /* DBUS_BUS_ENABLE_DNOTIFY_ON_LINUX */
@@ -525,6 +843,21 @@ main (int argc, char **argv)
   _dbus_verbose ("We are on D-Bus...\n");
   _dbus_loop_run (bus_context_get_loop (context));
 
+  /* The loop only quits early to hand the bus over */
+  while (handoff != NULL)
+    {
+#ifdef DBUS_UNIX
+      exec_new_daemon (&config_file, &address, systemd_activation,
+                       latency_stats, &stats_file);
+#endif
+      _dbus_loop_run (bus_context_get_loop (context));
+    }
+
+  _dbus_string_free (&config_file);
+
+  bus_stats_file_close ();
+  _dbus_string_free (&stats_file);
+
   bus_context_shutdown (context);
   bus_context_unref (context);
   bus_selinux_shutdown ();
@@ -132,8 +132,12 @@ struct BusPolicy
   DBusHashTable *rules_by_gid;     /**< per-GID policy rules */
   DBusList *at_console_true_rules; /**< console user policy rules where at_console="true"*/
   DBusList *at_console_false_rules; /**< console user policy rules where at_console="false"*/
+  DBusHashTable *client_policies;  /**< client policies made so far, by the rule lists they're made of */
 };
 
+/* Distinct combinations of rule lists we share a client policy for */
+#define MAX_SHARED_CLIENT_POLICIES 64
+
 static void
 free_rule_func (void *data,
                 void *user_data)
@@ -158,6 +162,17 @@ free_rule_list_func (void *data)
   dbus_free (list);
 }
 
+static void
+free_client_policy_func (void *data)
+{
+  BusClientPolicy *client = data;
+
+  if (client == NULL) /* same as above */
+    return;
+
+  bus_client_policy_unref (client);
+}
+
 BusPolicy*
 bus_policy_new (void)
 {
@@ -181,6 +196,12 @@ bus_policy_new (void)
   if (policy->rules_by_gid == NULL)
     goto failed;
 
+  policy->client_policies = _dbus_hash_table_new (DBUS_HASH_STRING,
+                                                  dbus_free,
+                                                  free_client_policy_func);
+  if (policy->client_policies == NULL)
+    goto failed;
+
   return policy;
   
  failed:
@@ -230,6 +251,12 @@ bus_policy_unref (BusPolicy *policy)
           _dbus_hash_table_unref (policy->rules_by_gid);
           policy->rules_by_gid = NULL;
         }
+
+      if (policy->client_policies)
+        {
+          _dbus_hash_table_unref (policy->client_policies);
+          policy->client_policies = NULL;
+        }
       
       dbus_free (policy);
     }
@@ -267,107 +294,144 @@ add_list_to_client (DBusList        **list,
   return TRUE;
 }
 
+/* A client policy is made of nothing but the rules of the lists
+ * that apply to the connection, so connections that get the same
+ * lists share one, along with its cache of decisions. The BusPolicy
+ * doesn't change once connections use it; a config reload makes a new
+ * one.
+ */
 BusClientPolicy*
 bus_policy_create_client_policy (BusPolicy      *policy,
                                  DBusConnection *connection,
                                  DBusError      *error)
 {
   BusClientPolicy *client;
+  DBusList ***lists;
+  DBusList **list;
+  int n_lists;
+  unsigned long *groups;
+  int n_groups;
   dbus_uid_t uid;
   dbus_bool_t at_console;
+  DBusString key;
+  char *key_data;
+  int i;
 
   _dbus_assert (dbus_connection_get_is_authenticated (connection));
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
-  
-  client = bus_client_policy_new ();
-  if (client == NULL)
-    goto nomem;
 
-  if (!add_list_to_client (&policy->default_rules,
-                           client))
-    goto nomem;
+  client = NULL;
+  lists = NULL;
+  groups = NULL;
+  n_groups = 0;
+
+  if (!_dbus_string_init (&key))
+    {
+      BUS_SET_OOM (error);
+      return NULL;
+    }
 
   /* we avoid the overhead of looking up user's groups
    * if we don't have any group rules anyway
    */
   if (_dbus_hash_table_get_n_entries (policy->rules_by_gid) > 0)
     {
-      unsigned long *groups;
-      int n_groups;
-      int i;
-      
       if (!bus_connection_get_unix_groups (connection, &groups, &n_groups, error))
         goto failed;
-      
-      i = 0;
-      while (i < n_groups)
-        {
-          DBusList **list;
-          
-          list = _dbus_hash_table_lookup_uintptr (policy->rules_by_gid,
-                                                groups[i]);
-          
-          if (list != NULL)
-            {
-              if (!add_list_to_client (list, client))
-                {
-                  dbus_free (groups);
-                  goto nomem;
-                }
-            }
-          
-          ++i;
-        }
+    }
 
-      dbus_free (groups);
+  /* the default rules, each group's, the user's, the console ones
+   * and the mandatory ones, in that order
+   */
+  lists = dbus_new (DBusList **, n_groups + 4);
+  if (lists == NULL)
+    goto nomem;
+
+  n_lists = 0;
+  lists[n_lists++] = &policy->default_rules;
+
+  for (i = 0; i < n_groups; i++)
+    {
+      list = _dbus_hash_table_lookup_uintptr (policy->rules_by_gid,
+                                              groups[i]);
+      if (list != NULL)
+        lists[n_lists++] = list;
     }
-  
+
   if (dbus_connection_get_unix_user (connection, &uid))
     {
-      if (_dbus_hash_table_get_n_entries (policy->rules_by_uid) > 0)
-        {
-          DBusList **list;
-          
-          list = _dbus_hash_table_lookup_uintptr (policy->rules_by_uid,
-                                                uid);
-          
-          if (list != NULL)
-            {
-              if (!add_list_to_client (list, client))
-                goto nomem;
-            }
-        }
+      list = _dbus_hash_table_lookup_uintptr (policy->rules_by_uid, uid);
+      if (list != NULL)
+        lists[n_lists++] = list;
 
       /* Add console rules */
       at_console = _dbus_unix_user_is_at_console (uid, error);
       
       if (at_console)
-        {
-          if (!add_list_to_client (&policy->at_console_true_rules, client))
-            goto nomem;
-        }
+        lists[n_lists++] = &policy->at_console_true_rules;
       else if (dbus_error_is_set (error) == TRUE)
-        {
-          goto failed;
-        }
-      else if (!add_list_to_client (&policy->at_console_false_rules, client))
-        {
-          goto nomem;
-        }
+        goto failed;
+      else
+        lists[n_lists++] = &policy->at_console_false_rules;
     }
 
-  if (!add_list_to_client (&policy->mandatory_rules,
-                           client))
+  lists[n_lists++] = &policy->mandatory_rules;
+  _dbus_assert (n_lists <= n_groups + 4);
+
+  for (i = 0; i < n_lists; i++)
+    {
+      if (!_dbus_string_append_printf (&key, "%p ", lists[i]))
+        goto nomem;
+    }
+
+  client = _dbus_hash_table_lookup_string (policy->client_policies,
+                                           _dbus_string_get_const_data (&key));
+  if (client != NULL)
+    {
+      _dbus_verbose ("Sharing client policy %p\n", client);
+      bus_client_policy_ref (client);
+      goto out;
+    }
+
+  client = bus_client_policy_new ();
+  if (client == NULL)
     goto nomem;
 
+  for (i = 0; i < n_lists; i++)
+    {
+      if (!add_list_to_client (lists[i], client))
+        goto nomem;
+    }
+
   bus_client_policy_optimize (client);
-  
+
+  /* Sharing is only an optimization, so it's fine if there's no memory
+   * for it
+   */
+  if (_dbus_hash_table_get_n_entries (policy->client_policies) <
+      MAX_SHARED_CLIENT_POLICIES &&
+      _dbus_string_steal_data (&key, &key_data))
+    {
+      if (_dbus_hash_table_insert_string (policy->client_policies,
+                                          key_data, client))
+        bus_client_policy_ref (client);
+      else
+        dbus_free (key_data);
+    }
+
+ out:
+  _dbus_string_free (&key);
+  dbus_free (lists);
+  dbus_free (groups);
   return client;
 
  nomem:
   BUS_SET_OOM (error);
  failed:
   _DBUS_ASSERT_ERROR_IS_SET (error);
+  _dbus_string_free (&key);
+  dbus_free (lists);
+  dbus_free (groups);
   if (client)
     bus_client_policy_unref (client);
   return NULL;
@@ -688,11 +752,52 @@ bus_policy_merge (BusPolicy *policy,
   return TRUE;
 }
 
+/* Policies shorter than this are cheaper to walk than to look up */
+#define MIN_RULES_TO_CACHE_DECISIONS 16
+
+/* Likewise for splitting the rules up by interface */
+#define MIN_RULES_TO_INDEX 16
+
+/* Bound the memory a client sending lots of distinct messages can use */
+#define MAX_CACHED_DECISIONS 512
+
+typedef struct
+{
+  dbus_int32_t toggles;
+  unsigned int allowed : 1;
+  unsigned int log : 1;
+} BusPolicyDecision;
+
+/* Rules of one type, in the order they appear in the policy */
+typedef struct
+{
+  int n_rules;
+  BusPolicyRule **rules;
+  int *positions; /**< Index of each rule in the policy's rule list */
+} BusPolicyRuleArray;
+
+/* Send or receive rules split by the interface they name, so a check
+ * only has to look at the rules that can match the message's interface.
+ */
+typedef struct
+{
+  BusPolicyRuleArray any_interface;  /**< Rules without an interface */
+  DBusHashTable *by_interface;       /**< Interface name to BusPolicyRuleArray */
+} BusPolicyRuleIndex;
+
 struct BusClientPolicy
 {
   int refcount;
 
   DBusList *rules;
+
+  BusPolicyRuleIndex *send_index;    /**< Index of send rules, or #NULL to walk all rules */
+  BusPolicyRuleIndex *receive_index; /**< Index of receive rules, or #NULL to walk all rules */
+
+  DBusHashTable *decisions; /**< Cache of previous send/receive checks, or #NULL */
+  dbus_uint32_t decisions_owner_generation; /**< Registry owner generation the cache is valid for */
+  unsigned int decisions_checked : 1; /**< Whether we decided to create the cache yet */
+  unsigned int has_name_rules : 1; /**< Some rule depends on who owns a name */
 };
 
 BusClientPolicy*
@@ -728,6 +833,229 @@ rule_unref_foreach (void *data,
   bus_policy_rule_unref (rule);
 }
 
+static void
+rule_array_clear (BusPolicyRuleArray *array)
+{
+  dbus_free (array->rules);
+  dbus_free (array->positions);
+  array->rules = NULL;
+  array->positions = NULL;
+  array->n_rules = 0;
+}
+
+static void
+rule_array_free (void *data)
+{
+  BusPolicyRuleArray *array = data;
+
+  if (array == NULL)
+    return;
+
+  rule_array_clear (array);
+  dbus_free (array);
+}
+
+static dbus_bool_t
+rule_array_append (BusPolicyRuleArray *array,
+                   BusPolicyRule      *rule,
+                   int                 position)
+{
+  BusPolicyRule **rules;
+  int *positions;
+
+  rules = dbus_realloc (array->rules,
+                        (array->n_rules + 1) * sizeof (BusPolicyRule*));
+  if (rules == NULL)
+    return FALSE;
+  array->rules = rules;
+
+  positions = dbus_realloc (array->positions,
+                            (array->n_rules + 1) * sizeof (int));
+  if (positions == NULL)
+    return FALSE;
+  array->positions = positions;
+
+  array->rules[array->n_rules] = rule;
+  array->positions[array->n_rules] = position;
+  array->n_rules += 1;
+
+  return TRUE;
+}
+
+static void
+rule_index_free (BusPolicyRuleIndex *index)
+{
+  if (index == NULL)
+    return;
+
+  rule_array_clear (&index->any_interface);
+  if (index->by_interface)
+    _dbus_hash_table_unref (index->by_interface);
+  dbus_free (index);
+}
+
+static const char*
+rule_get_interface (BusPolicyRule *rule)
+{
+  if (rule->type == BUS_POLICY_RULE_SEND)
+    return rule->d.send.interface;
+  else
+    return rule->d.receive.interface;
+}
+
+/* Builds the index of all rules of the given type, or returns #NULL
+ * if we run out of memory, in which case checks walk every rule.
+ */
+static BusPolicyRuleIndex*
+rule_index_build (BusClientPolicy   *policy,
+                  BusPolicyRuleType  type)
+{
+  BusPolicyRuleIndex *index;
+  DBusList *link;
+  int position;
+
+  index = dbus_new0 (BusPolicyRuleIndex, 1);
+  if (index == NULL)
+    return NULL;
+
+  index->by_interface = _dbus_hash_table_new (DBUS_HASH_STRING,
+                                              NULL, rule_array_free);
+  if (index->by_interface == NULL)
+    goto failed;
+
+  position = 0;
+  link = _dbus_list_get_first_link (&policy->rules);
+  while (link != NULL)
+    {
+      BusPolicyRule *rule = link->data;
+      const char *interface;
+      BusPolicyRuleArray *array;
+
+      link = _dbus_list_get_next_link (&policy->rules, link);
+      position += 1;
+
+      if (rule->type != type)
+        continue;
+
+      interface = rule_get_interface (rule);
+      if (interface == NULL)
+        {
+          array = &index->any_interface;
+        }
+      else
+        {
+          array = _dbus_hash_table_lookup_string (index->by_interface,
+                                                  interface);
+          if (array == NULL)
+            {
+              array = dbus_new0 (BusPolicyRuleArray, 1);
+              if (array == NULL)
+                goto failed;
+
+              /* the key is owned by the rule, which outlives the index */
+              if (!_dbus_hash_table_insert_string (index->by_interface,
+                                                   (char*) interface, array))
+                {
+                  dbus_free (array);
+                  goto failed;
+                }
+            }
+        }
+
+      if (!rule_array_append (array, rule, position))
+        goto failed;
+    }
+
+  return index;
+
+ failed:
+  rule_index_free (index);
+  return NULL;
+}
+
+static void
+bus_client_policy_forget_index (BusClientPolicy *policy)
+{
+  rule_index_free (policy->send_index);
+  rule_index_free (policy->receive_index);
+  policy->send_index = NULL;
+  policy->receive_index = NULL;
+}
+
+/* Walks the rules that might apply to a message, in policy order. */
+typedef struct
+{
+  DBusList **list;                      /**< All rules, if not using an index */
+  DBusList *link;
+  const BusPolicyRuleArray *any_interface;
+  const BusPolicyRuleArray *interface;  /**< Rules for the message interface, or #NULL */
+  int any_interface_next;
+  int interface_next;
+} BusPolicyRuleCursor;
+
+static void
+rule_cursor_init (BusPolicyRuleCursor *cursor,
+                  BusClientPolicy     *policy,
+                  BusPolicyRuleIndex  *index,
+                  DBusMessage         *message)
+{
+  const char *interface;
+
+  _DBUS_ZERO (*cursor);
+
+  interface = dbus_message_get_interface (message);
+
+  /* Deny rules naming any interface apply to messages without one,
+   * so for those we have to look at everything.
+   */
+  if (index == NULL || interface == NULL)
+    {
+      cursor->list = &policy->rules;
+      cursor->link = _dbus_list_get_first_link (&policy->rules);
+      return;
+    }
+
+  cursor->any_interface = &index->any_interface;
+  cursor->interface = _dbus_hash_table_lookup_string (index->by_interface,
+                                                      interface);
+}
+
+static BusPolicyRule*
+rule_cursor_next (BusPolicyRuleCursor *cursor)
+{
+  const BusPolicyRuleArray *any = cursor->any_interface;
+  const BusPolicyRuleArray *specific = cursor->interface;
+  dbus_bool_t have_any;
+  dbus_bool_t have_specific;
+
+  if (cursor->list != NULL)
+    {
+      BusPolicyRule *rule;
+
+      if (cursor->link == NULL)
+        return NULL;
+
+      rule = cursor->link->data;
+      cursor->link = _dbus_list_get_next_link (cursor->list, cursor->link);
+      return rule;
+    }
+
+  have_any = cursor->any_interface_next < any->n_rules;
+  have_specific = specific != NULL &&
+    cursor->interface_next < specific->n_rules;
+
+  /* merge the two lists back into policy order */
+  if (have_any &&
+      (!have_specific ||
+       any->positions[cursor->any_interface_next] <
+       specific->positions[cursor->interface_next]))
+    return any->rules[cursor->any_interface_next++];
+  else if (have_specific)
+    return specific->rules[cursor->interface_next++];
+  else
+    return NULL;
+}
+
 void
 bus_client_policy_unref (BusClientPolicy *policy)
 {
@@ -743,10 +1071,111 @@ bus_client_policy_unref (BusClientPolicy *policy)
 
       _dbus_list_clear (&policy->rules);
 
+      if (policy->decisions)
+        _dbus_hash_table_unref (policy->decisions);
+
+      bus_client_policy_forget_index (policy);
+
       dbus_free (policy);
     }
 }
 
+/* Drops all cached decisions; the cache will be reconsidered on the
+ * next check.
+ */
+static void
+bus_client_policy_forget_decisions (BusClientPolicy *policy)
+{
+  if (policy->decisions)
+    _dbus_hash_table_unref (policy->decisions);
+  policy->decisions = NULL;
+  policy->decisions_checked = FALSE;
+}
+
+/* Returns the decision cache if it's worth having for this policy
+ * and still valid, or #NULL.
+ */
+static DBusHashTable*
+bus_client_policy_get_decisions (BusClientPolicy *policy,
+                                 BusRegistry     *registry)
+{
+  if (!policy->decisions_checked)
+    {
+      policy->decisions_checked = TRUE;
+
+      if (_dbus_list_get_length (&policy->rules) < MIN_RULES_TO_CACHE_DECISIONS)
+        return NULL;
+
+      /* on OOM we just don't cache */
+      policy->decisions = _dbus_hash_table_new (DBUS_HASH_STRING,
+                                                dbus_free, dbus_free);
+      policy->decisions_owner_generation =
+        bus_registry_get_owner_generation (registry);
+    }
+
+  if (policy->decisions == NULL)
+    return NULL;
+
+  /* Rules naming a destination or sender depend on who owns those
+   * names, so any name ownership change makes the cache stale.
+   */
+  if ((policy->has_name_rules &&
+       policy->decisions_owner_generation !=
+       bus_registry_get_owner_generation (registry)) ||
+      _dbus_hash_table_get_n_entries (policy->decisions) >= MAX_CACHED_DECISIONS)
+    {
+      _dbus_hash_table_remove_all (policy->decisions);
+      policy->decisions_owner_generation =
+        bus_registry_get_owner_generation (registry);
+    }
+
+  return policy->decisions;
+}
+
+static dbus_bool_t
+append_key_field (DBusString *key,
+                  const char *field)
+{
+  if (field != NULL && !_dbus_string_append (key, field))
+    return FALSE;
+
+  return _dbus_string_append_byte (key, '\n');
+}
+
+/* Builds a key from everything in the message that send or receive
+ * rules can look at. peer is the connection whose name ownership
+ * the rules check, or #NULL if they check the name in the message.
+ */
+static dbus_bool_t
+build_decision_key (DBusString      *key,
+                    BusClientPolicy *policy,
+                    char             direction,
+                    dbus_bool_t      requested_reply,
+                    dbus_bool_t      eavesdropping,
+                    DBusConnection  *peer,
+                    const char      *peer_name,
+                    DBusMessage     *message)
+{
+  if (!_dbus_string_append_byte (key, direction) ||
+      !_dbus_string_append_byte (key, '0' + dbus_message_get_type (message)) ||
+      !_dbus_string_append_byte (key, dbus_message_get_reply_serial (message) != 0 ? 'r' : '-') ||
+      !_dbus_string_append_byte (key, requested_reply ? 'q' : '-') ||
+      !_dbus_string_append_byte (key, eavesdropping ? 'e' : '-') ||
+      !append_key_field (key, dbus_message_get_path (message)) ||
+      !append_key_field (key, dbus_message_get_interface (message)) ||
+      !append_key_field (key, dbus_message_get_member (message)) ||
+      !append_key_field (key, dbus_message_get_error_name (message)))
+    return FALSE;
+
+  if (!policy->has_name_rules)
+    return TRUE;
+
+  if (peer != NULL)
+    return _dbus_string_append_printf (key, "%p", peer);
+  else
+    return append_key_field (key, peer_name);
+}
+
 static void
 remove_rules_by_type_up_to (BusClientPolicy   *policy,
                             BusPolicyRuleType  type,
@@ -843,8 +1272,18 @@ bus_client_policy_optimize (BusClientPolicy *policy)
       link = next;
     }
 
+  bus_client_policy_forget_decisions (policy);
+  bus_client_policy_forget_index (policy);
+
   _dbus_verbose ("After optimization, policy has %d rules\n",
                  _dbus_list_get_length (&policy->rules));
+
+  /* The rule list is final now, so sort it out for quick checks */
+  if (_dbus_list_get_length (&policy->rules) >= MIN_RULES_TO_INDEX)
+    {
+      policy->send_index = rule_index_build (policy, BUS_POLICY_RULE_SEND);
+      policy->receive_index = rule_index_build (policy, BUS_POLICY_RULE_RECEIVE);
+    }
 }
 
 dbus_bool_t
@@ -859,19 +1298,27 @@ bus_client_policy_append_rule (BusClientPolicy *policy,
 
   bus_policy_rule_ref (rule);
 
+  if ((rule->type == BUS_POLICY_RULE_SEND && rule->d.send.destination != NULL) ||
+      (rule->type == BUS_POLICY_RULE_RECEIVE && rule->d.receive.origin != NULL))
+    policy->has_name_rules = TRUE;
+
+  bus_client_policy_forget_decisions (policy);
+  bus_client_policy_forget_index (policy);
+
   return TRUE;
 }
 
-dbus_bool_t
-bus_client_policy_check_can_send (BusClientPolicy *policy,
-                                  BusRegistry     *registry,
-                                  dbus_bool_t      requested_reply,
-                                  DBusConnection  *receiver,
-                                  DBusMessage     *message,
-                                  dbus_int32_t    *toggles,
-                                  dbus_bool_t     *log)
+static dbus_bool_t
+check_can_send_uncached (BusClientPolicy *policy,
+                         BusRegistry     *registry,
+                         dbus_bool_t      requested_reply,
+                         DBusConnection  *receiver,
+                         DBusMessage     *message,
+                         dbus_int32_t    *toggles,
+                         dbus_bool_t     *log)
 {
-  DBusList *link;
+  BusPolicyRuleCursor cursor;
+  BusPolicyRule *rule;
   dbus_bool_t allowed;
   
   /* policy->rules is in the order the rules appeared
@@ -882,13 +1329,9 @@ bus_client_policy_check_can_send (BusClientPolicy *policy,
   *toggles = 0;
   
   allowed = FALSE;
-  link = _dbus_list_get_first_link (&policy->rules);
-  while (link != NULL)
+  rule_cursor_init (&cursor, policy, policy->send_index, message);
+  while ((rule = rule_cursor_next (&cursor)) != NULL)
     {
-      BusPolicyRule *rule = link->data;
-
-      link = _dbus_list_get_next_link (&policy->rules, link);
-      
       /* Rule is skipped if it specifies a different
        * message name from the message, or a different
        * destination from the message
@@ -1040,26 +1483,108 @@ bus_client_policy_check_can_send (BusClientPolicy *policy,
   return allowed;
 }
 
-/* See docs on what the args mean on bus_context_check_security_policy()
- * comment
- */
+/* Remembers a decision; failing to is harmless */
+static void
+cache_decision (DBusHashTable *decisions,
+                DBusString    *key,
+                dbus_bool_t    allowed,
+                dbus_int32_t   toggles,
+                dbus_bool_t    log)
+{
+  BusPolicyDecision *decision;
+  char *key_data;
+
+  decision = dbus_new (BusPolicyDecision, 1);
+  if (decision == NULL)
+    return;
+
+  decision->allowed = allowed != FALSE;
+  decision->toggles = toggles;
+  decision->log = log != FALSE;
+
+  if (!_dbus_string_steal_data (key, &key_data))
+    {
+      dbus_free (decision);
+      return;
+    }
+
+  if (!_dbus_hash_table_insert_string (decisions, key_data, decision))
+    {
+      dbus_free (key_data);
+      dbus_free (decision);
+    }
+}
+
 dbus_bool_t
-bus_client_policy_check_can_receive (BusClientPolicy *policy,
-                                     BusRegistry     *registry,
-                                     dbus_bool_t      requested_reply,
-                                     DBusConnection  *sender,
-                                     DBusConnection  *addressed_recipient,
-                                     DBusConnection  *proposed_recipient,
-                                     DBusMessage     *message,
-                                     dbus_int32_t    *toggles)
+bus_client_policy_check_can_send (BusClientPolicy *policy,
+                                  BusRegistry     *registry,
+                                  dbus_bool_t      requested_reply,
+                                  DBusConnection  *receiver,
+                                  DBusMessage     *message,
+                                  dbus_int32_t    *toggles,
+                                  dbus_bool_t     *log)
 {
-  DBusList *link;
+  DBusHashTable *decisions;
+  BusPolicyDecision *decision;
+  DBusString key;
   dbus_bool_t allowed;
-  dbus_bool_t eavesdropping;
+  dbus_bool_t rule_log;
 
-  eavesdropping =
-    addressed_recipient != proposed_recipient &&
-    dbus_message_get_destination (message) != NULL;
+  decisions = bus_client_policy_get_decisions (policy, registry);
+  if (decisions == NULL)
+    return check_can_send_uncached (policy, registry, requested_reply,
+                                    receiver, message, toggles, log);
+
+  if (!_dbus_string_init (&key))
+    return check_can_send_uncached (policy, registry, requested_reply,
+                                    receiver, message, toggles, log);
+
+  if (!build_decision_key (&key, policy, 'S', requested_reply, FALSE,
+                           receiver, dbus_message_get_destination (message),
+                           message))
+    {
+      _dbus_string_free (&key);
+      return check_can_send_uncached (policy, registry, requested_reply,
+                                      receiver, message, toggles, log);
+    }
+
+  decision = _dbus_hash_table_lookup_string (decisions,
+                                             _dbus_string_get_const_data (&key));
+  if (decision != NULL)
+    {
+      _dbus_verbose ("  (policy) using cached send decision, allow = %d\n",
+                     decision->allowed);
+      _dbus_string_free (&key);
+      *toggles = decision->toggles;
+      if (decision->toggles > 0)
+        *log = decision->log;
+      return decision->allowed;
+    }
+
+  rule_log = FALSE;
+  allowed = check_can_send_uncached (policy, registry, requested_reply,
+                                     receiver, message, toggles, &rule_log);
+  if (*toggles > 0)
+    *log = rule_log;
+
+  cache_decision (decisions, &key, allowed, *toggles, rule_log);
+  _dbus_string_free (&key);
+
+  return allowed;
+}
+
+static dbus_bool_t
+check_can_receive_uncached (BusClientPolicy *policy,
+                            BusRegistry     *registry,
+                            dbus_bool_t      requested_reply,
+                            DBusConnection  *sender,
+                            dbus_bool_t      eavesdropping,
+                            DBusMessage     *message,
+                            dbus_int32_t    *toggles)
+{
+  BusPolicyRuleCursor cursor;
+  BusPolicyRule *rule;
+  dbus_bool_t allowed;
   
   /* policy->rules is in the order the rules appeared
    * in the config file, i.e. last rule that applies wins
@@ -1069,13 +1594,9 @@ bus_client_policy_check_can_receive (BusClientPolicy *policy,
   *toggles = 0;
   
   allowed = FALSE;
-  link = _dbus_list_get_first_link (&policy->rules);
-  while (link != NULL)
+  rule_cursor_init (&cursor, policy, policy->receive_index, message);
+  while ((rule = rule_cursor_next (&cursor)) != NULL)
     {
-      BusPolicyRule *rule = link->data;
-
-      link = _dbus_list_get_next_link (&policy->rules, link);      
-      
       if (rule->type != BUS_POLICY_RULE_RECEIVE)
         {
           _dbus_verbose ("  (policy) skipping non-receive rule\n");
@@ -1240,6 +1761,81 @@ bus_client_policy_check_can_receive (BusClientPolicy *policy,
   return allowed;
 }
 
+/* See docs on what the args mean on bus_context_check_security_policy()
+ * comment
+ */
+dbus_bool_t
+bus_client_policy_check_can_receive (BusClientPolicy *policy,
+                                     BusRegistry     *registry,
+                                     dbus_bool_t      requested_reply,
+                                     DBusConnection  *sender,
+                                     DBusConnection  *addressed_recipient,
+                                     DBusConnection  *proposed_recipient,
+                                     DBusMessage     *message,
+                                     dbus_int32_t    *toggles)
+{
+  DBusHashTable *decisions;
+  BusPolicyDecision *decision;
+  DBusString key;
+  dbus_bool_t allowed;
+  dbus_bool_t eavesdropping;
+
+  eavesdropping =
+    addressed_recipient != proposed_recipient &&
+    dbus_message_get_destination (message) != NULL;
+
+  decisions = bus_client_policy_get_decisions (policy, registry);
+  if (decisions == NULL)
+    return check_can_receive_uncached (policy, registry, requested_reply,
+                                       sender, eavesdropping, message, toggles);
+
+  if (!_dbus_string_init (&key))
+    return check_can_receive_uncached (policy, registry, requested_reply,
+                                       sender, eavesdropping, message, toggles);
+
+  if (!build_decision_key (&key, policy, 'R', requested_reply, eavesdropping,
+                           sender, dbus_message_get_sender (message),
+                           message))
+    {
+      _dbus_string_free (&key);
+      return check_can_receive_uncached (policy, registry, requested_reply,
+                                         sender, eavesdropping, message, toggles);
+    }
+
+  decision = _dbus_hash_table_lookup_string (decisions,
+                                             _dbus_string_get_const_data (&key));
+  if (decision != NULL)
+    {
+      _dbus_verbose ("  (policy) using cached receive decision, allow = %d\n",
+                     decision->allowed);
+      _dbus_string_free (&key);
+      *toggles = decision->toggles;
+      return decision->allowed;
+    }
+
+  allowed = check_can_receive_uncached (policy, registry, requested_reply,
+                                        sender, eavesdropping, message, toggles);
+
+  cache_decision (decisions, &key, allowed, *toggles, FALSE);
+  _dbus_string_free (&key);
+
+  return allowed;
+}
+
+/**
+ * Whether some of the policy's rules look at who owns a name, so that
+ * a send check's outcome depends on the receiver and not only on the
+ * message.
+ *
+ * @param policy the policy
+ * @returns #TRUE if checks depend on name ownership
+ */
+dbus_bool_t
+bus_client_policy_depends_on_names (BusClientPolicy *policy)
+{
+  return policy->has_name_rules;
+}
+
 dbus_bool_t
 bus_client_policy_check_can_own (BusClientPolicy  *policy,
                                  DBusConnection   *connection,
@@ -1283,13 +1879,120 @@ bus_client_policy_check_can_own (BusClientPolicy  *policy,
 
 #ifdef DBUS_BUILD_TESTS
 
+static char*
+policy_test_interface (int i)
+{
+  DBusString name;
+  char *retval;
+
+  if (!_dbus_string_init (&name) ||
+      !_dbus_string_append (&name, "Foo.Iface") ||
+      !_dbus_string_append_int (&name, i) ||
+      !_dbus_string_steal_data (&name, &retval))
+    _dbus_assert_not_reached ("no memory for interface name");
+
+  _dbus_string_free (&name);
+  return retval;
+}
+
 dbus_bool_t
 bus_policy_test (const DBusString *test_data_dir)
 {
-  /* This doesn't do anything for now because I decided to do it in
-   * dispatch.c instead by having some of the clients in dispatch.c
-   * have particular policies applied to them.
+  /* Most policy testing is done in dispatch.c instead by having some
+   * of the clients in dispatch.c have particular policies applied to
+   * them. Their policies are too short to be cached or indexed, so
+   * check here that both agree with walking the rules.
    */
+  BusClientPolicy *policy;
+  BusPolicyRule *rule;
+  BusRegistry *registry;
+  DBusMessage *message;
+  dbus_int32_t toggles;
+  dbus_bool_t log;
+  int i, pass;
+
+  registry = bus_registry_new (NULL);
+  policy = bus_client_policy_new ();
+  if (registry == NULL || policy == NULL)
+    _dbus_assert_not_reached ("no memory for policy test");
+
+  /* allow member Baz on any interface, overridden by the rules below */
+  rule = bus_policy_rule_new (BUS_POLICY_RULE_SEND, TRUE);
+  if (rule == NULL)
+    _dbus_assert_not_reached ("no memory for policy rule");
+  rule->d.send.member = _dbus_strdup ("Baz");
+  if (rule->d.send.member == NULL ||
+      !bus_client_policy_append_rule (policy, rule))
+    _dbus_assert_not_reached ("no memory for policy rule");
+  bus_policy_rule_unref (rule);
+
+  for (i = 0; i < MIN_RULES_TO_CACHE_DECISIONS; i++)
+    {
+      /* deny Foo.N for even N, allow it for odd N */
+      rule = bus_policy_rule_new (BUS_POLICY_RULE_SEND, i % 2);
+      if (rule == NULL)
+        _dbus_assert_not_reached ("no memory for policy rule");
+
+      rule->d.send.interface = policy_test_interface (i);
+      if (!bus_client_policy_append_rule (policy, rule))
+        _dbus_assert_not_reached ("no memory for policy rule");
+      bus_policy_rule_unref (rule);
+    }
+
+  bus_client_policy_optimize (policy);
+  if (policy->send_index == NULL)
+    _dbus_assert_not_reached ("no memory for policy rule index");
+
+  for (pass = 0; pass < 2; pass++)
+    {
+      for (i = 0; i < MIN_RULES_TO_CACHE_DECISIONS; i++)
+        {
+          char *name;
+
+          name = policy_test_interface (i);
+          message = dbus_message_new_method_call (NULL, "/foo", name, "Bar");
+          dbus_free (name);
+          if (message == NULL)
+            _dbus_assert_not_reached ("no memory for policy test message");
+
+          log = FALSE;
+          if (bus_client_policy_check_can_send (policy, registry, FALSE,
+                                                NULL, message,
+                                                &toggles, &log) != (i % 2))
+            _dbus_assert_not_reached ("wrong policy decision");
+          _dbus_assert (toggles == 1);
+
+          /* the interface rule comes after the rule for any interface */
+          if (!dbus_message_set_member (message, "Baz"))
+            _dbus_assert_not_reached ("no memory for policy test message");
+          if (bus_client_policy_check_can_send (policy, registry, FALSE,
+                                                NULL, message,
+                                                &toggles, &log) != (i % 2))
+            _dbus_assert_not_reached ("wrong policy decision");
+          _dbus_assert (toggles == 2);
+
+          dbus_message_unref (message);
+        }
+
+      /* with no interface, every deny rule applies and the last wins */
+      message = dbus_message_new_method_call (NULL, "/foo", NULL, "Baz");
+      if (message == NULL)
+        _dbus_assert_not_reached ("no memory for policy test message");
+      log = FALSE;
+      if (bus_client_policy_check_can_send (policy, registry, FALSE,
+                                            NULL, message,
+                                            &toggles, &log))
+        _dbus_assert_not_reached ("wrong policy decision");
+      _dbus_assert (toggles == 1 + MIN_RULES_TO_CACHE_DECISIONS / 2);
+      dbus_message_unref (message);
+
+      _dbus_assert (policy->decisions == NULL ||
+                    _dbus_hash_table_get_n_entries (policy->decisions) ==
+                    MIN_RULES_TO_CACHE_DECISIONS * 2 + 1);
+    }
+
+  bus_client_policy_unref (policy);
+  bus_registry_unref (registry);
   
   return TRUE;
 }
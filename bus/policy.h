@@ -153,6 +153,7 @@ dbus_bool_t      bus_client_policy_check_can_receive (BusClientPolicy  *policy,
                                                       DBusConnection   *proposed_recipient,
                                                       DBusMessage      *message,
                                                       dbus_int32_t     *toggles);
+dbus_bool_t      bus_client_policy_depends_on_names  (BusClientPolicy  *policy);
 dbus_bool_t      bus_client_policy_check_can_own     (BusClientPolicy  *policy,
                                                       DBusConnection   *connection,
                                                       const DBusString *service_name);
@@ -0,0 +1,747 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* resolver.c  Resolve client credentials off the main loop
+ *
+ * Copyright (C) 2003  Red Hat, Inc.
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "resolver.h"
+#include "test.h"
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-sysdeps.h>
+#include <dbus/dbus-watch.h>
+
+/* The helper threads need reentrant NSS calls; without them every
+ * lookup stays on the main loop, as it always used to.
+ */
+#if defined (DBUS_UNIX) && defined (HAVE_GETGROUPLIST) && defined (HAVE_POSIX_GETPWNAM_R)
+#define BUS_RESOLVER_USE_THREADS 1
+#endif
+
+#ifdef BUS_RESOLVER_USE_THREADS
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sys/types.h>
+#include <dbus/dbus-sysdeps-unix.h>
+#endif
+
+/* Don't believe a user is in more groups than this, no matter what
+ * getgrouplist() claims.
+ */
+#define MAX_GROUPS_PER_USER 65536
+
+typedef enum
+{
+  REQUEST_QUEUED,   /**< Waiting for a helper thread */
+  REQUEST_RUNNING,  /**< A helper thread is doing the lookup */
+  REQUEST_FINISHED  /**< Waiting for the main loop to pick up the result */
+} BusResolverRequestState;
+
+struct BusResolverRequest
+{
+  BusResolverRequest *next;           /**< Next request in the queue it is on */
+  BusResolver *resolver;
+  unsigned long uid;
+  BusResolverGroupsFunction function;
+  void *data;
+  BusResolverRequestState state;      /**< Protected by the resolver lock */
+  dbus_bool_t cancelled;              /**< Result is dropped when it arrives */
+
+  /* Written by the helper thread before the request is moved to the
+   * finished queue.  The array comes from plain malloc() because the
+   * helper threads never call into libdbus; see resolver_thread_main().
+   */
+  dbus_bool_t success;
+#ifdef BUS_RESOLVER_USE_THREADS
+  gid_t *groups;
+#endif
+  int n_groups;
+};
+
+struct BusResolver
+{
+  int refcount;
+  DBusLoop *loop;
+  int max_threads;      /**< Zero means every lookup is done synchronously by the caller */
+
+#ifdef BUS_RESOLVER_USE_THREADS
+  pthread_mutex_t lock; /**< Protects everything below except the wake pipe */
+  pthread_cond_t cond;  /**< Signalled when a request is queued or we shut down */
+  pthread_t *threads;
+  int n_threads;
+  int n_idle_threads;
+  BusResolverRequest *queued_head;
+  BusResolverRequest *queued_tail;
+  BusResolverRequest *finished_head;
+  BusResolverRequest *finished_tail;
+  dbus_bool_t shutting_down;
+
+  int wake_pipe[2];     /**< Helper threads write a byte here when something finished */
+  DBusWatch *wake_watch;
+#endif
+};
+
+BusResolver*
+bus_resolver_new (DBusLoop *loop)
+{
+  BusResolver *resolver;
+
+  resolver = dbus_new0 (BusResolver, 1);
+  if (resolver == NULL)
+    return NULL;
+
+  resolver->refcount = 1;
+  resolver->loop = loop;
+  _dbus_loop_ref (resolver->loop);
+  resolver->max_threads = BUS_RESOLVER_DEFAULT_MAX_THREADS;
+
+#ifdef BUS_RESOLVER_USE_THREADS
+  resolver->wake_pipe[0] = -1;
+  resolver->wake_pipe[1] = -1;
+
+  if (pthread_mutex_init (&resolver->lock, NULL) != 0)
+    goto failed_0;
+
+  if (pthread_cond_init (&resolver->cond, NULL) != 0)
+    goto failed_1;
+#endif
+
+  return resolver;
+
+#ifdef BUS_RESOLVER_USE_THREADS
+ failed_1:
+  pthread_mutex_destroy (&resolver->lock);
+ failed_0:
+  _dbus_loop_unref (resolver->loop);
+  dbus_free (resolver);
+  return NULL;
+#endif
+}
+
+/**
+ * Limits the number of helper threads.  Must be called before the
+ * first lookup; zero keeps every lookup on the main loop, which the
+ * unit tests rely on to get replies in the iteration they expect.
+ */
+void
+bus_resolver_set_max_threads (BusResolver *resolver,
+                              int          max_threads)
+{
+  _dbus_assert (max_threads >= 0);
+#ifdef BUS_RESOLVER_USE_THREADS
+  _dbus_assert (resolver->threads == NULL);
+#endif
+
+  resolver->max_threads = max_threads;
+}
+
+#ifdef BUS_RESOLVER_USE_THREADS
+
+static void
+free_request (BusResolverRequest *request)
+{
+  free (request->groups);
+  dbus_free (request);
+}
+
+static void
+free_request_list (BusResolverRequest *request)
+{
+  while (request != NULL)
+    {
+      BusResolverRequest *next = request->next;
+
+      free_request (request);
+      request = next;
+    }
+}
+
+/* Runs in a helper thread, so it must not touch libdbus at all: the
+ * daemon never initializes libdbus threading, which makes its global
+ * locks no-ops, and the test builds count allocations in a way that
+ * is only meaningful on one thread.
+ */
+static void
+lookup_groups_in_thread (BusResolverRequest *request)
+{
+  struct passwd pwd;
+  struct passwd *result;
+  char *buf;
+  size_t buflen;
+  gid_t *groups;
+  int n_groups;
+  int ret;
+
+  request->success = FALSE;
+
+  buflen = 1024;
+  buf = NULL;
+  result = NULL;
+  while (TRUE)
+    {
+      char *new_buf;
+
+      new_buf = realloc (buf, buflen);
+      if (new_buf == NULL)
+        {
+          free (buf);
+          return;
+        }
+      buf = new_buf;
+
+      ret = getpwuid_r (request->uid, &pwd, buf, buflen, &result);
+      if (ret == ERANGE && buflen < 65536)
+        buflen *= 2;
+      else
+        break;
+    }
+
+  if (ret != 0 || result == NULL)
+    {
+      free (buf);
+      return;
+    }
+
+  n_groups = 17;
+  groups = NULL;
+  while (TRUE)
+    {
+      gid_t *new_groups;
+      int requested;
+
+      new_groups = realloc (groups, n_groups * sizeof (gid_t));
+      if (new_groups == NULL)
+        goto out;
+      groups = new_groups;
+
+      requested = n_groups;
+      if (getgrouplist (pwd.pw_name, pwd.pw_gid, groups, &n_groups) >= 0)
+        break;
+
+      /* See _dbus_user_info_fill_uid(): Linux tells us the size it
+       * needs, other systems leave n_groups alone.
+       */
+      if (n_groups <= requested)
+        n_groups = requested * 16;
+
+      if (n_groups > MAX_GROUPS_PER_USER)
+        goto out;
+    }
+
+  request->groups = groups;
+  request->n_groups = n_groups;
+  request->success = TRUE;
+  groups = NULL;
+
+ out:
+  free (groups);
+  free (buf);
+}
+
+static void*
+resolver_thread_main (void *data)
+{
+  BusResolver *resolver = data;
+
+  pthread_mutex_lock (&resolver->lock);
+
+  while (TRUE)
+    {
+      BusResolverRequest *request;
+      dbus_bool_t need_wakeup;
+
+      while (!resolver->shutting_down && resolver->queued_head == NULL)
+        {
+          resolver->n_idle_threads += 1;
+          pthread_cond_wait (&resolver->cond, &resolver->lock);
+          resolver->n_idle_threads -= 1;
+        }
+
+      if (resolver->shutting_down)
+        break;
+
+      request = resolver->queued_head;
+      resolver->queued_head = request->next;
+      if (resolver->queued_head == NULL)
+        resolver->queued_tail = NULL;
+      request->next = NULL;
+      request->state = REQUEST_RUNNING;
+
+      pthread_mutex_unlock (&resolver->lock);
+
+      lookup_groups_in_thread (request);
+
+      pthread_mutex_lock (&resolver->lock);
+
+      request->state = REQUEST_FINISHED;
+      need_wakeup = resolver->finished_head == NULL;
+      if (resolver->finished_tail != NULL)
+        resolver->finished_tail->next = request;
+      else
+        resolver->finished_head = request;
+      resolver->finished_tail = request;
+
+      /* One byte is enough to get the main loop to drain the whole
+       * finished queue; if the pipe is full a wakeup is already pending.
+       */
+      if (need_wakeup)
+        {
+          char c = '\0';
+
+          while (write (resolver->wake_pipe[1], &c, 1) < 0 && errno == EINTR)
+            ;
+        }
+    }
+
+  pthread_mutex_unlock (&resolver->lock);
+
+  return NULL;
+}
+
+static dbus_bool_t
+handle_wake_watch (DBusWatch    *watch,
+                   unsigned int  flags,
+                   void         *data)
+{
+  BusResolver *resolver = data;
+  BusResolverRequest *finished;
+  char buf[64];
+
+  while (read (resolver->wake_pipe[0], buf, sizeof (buf)) > 0)
+    ;
+
+  pthread_mutex_lock (&resolver->lock);
+  finished = resolver->finished_head;
+  resolver->finished_head = NULL;
+  resolver->finished_tail = NULL;
+  pthread_mutex_unlock (&resolver->lock);
+
+  while (finished != NULL)
+    {
+      BusResolverRequest *request = finished;
+      unsigned long *groups;
+      int i;
+
+      finished = request->next;
+
+      if (request->cancelled)
+        {
+          free_request (request);
+          continue;
+        }
+
+      groups = NULL;
+      if (request->success)
+        {
+          groups = dbus_new (unsigned long, request->n_groups);
+          if (groups == NULL)
+            request->success = FALSE;  /* caller falls back to a synchronous lookup */
+          else
+            {
+              for (i = 0; i < request->n_groups; i++)
+                groups[i] = request->groups[i];
+            }
+        }
+
+      _dbus_verbose ("Resolved %d groups for UID %lu in helper thread (success = %d)\n",
+                     request->n_groups, request->uid, request->success);
+
+      (* request->function) (request->success, groups, request->n_groups,
+                             request->data);
+      free_request (request);
+    }
+
+  return TRUE;
+}
+
+static dbus_bool_t
+wake_watch_callback (DBusWatch    *watch,
+                     unsigned int  condition,
+                     void         *data)
+{
+  return dbus_watch_handle (watch, condition);
+}
+
+static dbus_bool_t
+setup_wake_pipe (BusResolver *resolver)
+{
+  DBusError error;
+
+  dbus_error_init (&error);
+
+  if (!_dbus_full_duplex_pipe (&resolver->wake_pipe[0], &resolver->wake_pipe[1],
+                               FALSE, &error))
+    {
+      _dbus_verbose ("Unable to create resolver wake pipe: %s\n",
+                     error.message);
+      dbus_error_free (&error);
+      return FALSE;
+    }
+
+  resolver->wake_watch = _dbus_watch_new (resolver->wake_pipe[0],
+                                          DBUS_WATCH_READABLE, TRUE,
+                                          handle_wake_watch, resolver, NULL);
+  if (resolver->wake_watch == NULL)
+    goto failed;
+
+  if (!_dbus_loop_add_watch (resolver->loop, resolver->wake_watch,
+                             wake_watch_callback, NULL, NULL))
+    {
+      _dbus_watch_unref (resolver->wake_watch);
+      resolver->wake_watch = NULL;
+      goto failed;
+    }
+
+  return TRUE;
+
+ failed:
+  _dbus_close_socket (resolver->wake_pipe[0], NULL);
+  _dbus_close_socket (resolver->wake_pipe[1], NULL);
+  resolver->wake_pipe[0] = -1;
+  resolver->wake_pipe[1] = -1;
+  return FALSE;
+}
+
+/* called with the lock held */
+static dbus_bool_t
+start_thread_unlocked (BusResolver *resolver)
+{
+  sigset_t all_signals;
+  sigset_t old_signals;
+  int ret;
+
+  _dbus_assert (resolver->n_threads < resolver->max_threads);
+
+  /* Signals are for the main loop; threads inherit the mask. */
+  sigfillset (&all_signals);
+  pthread_sigmask (SIG_SETMASK, &all_signals, &old_signals);
+  ret = pthread_create (&resolver->threads[resolver->n_threads], NULL,
+                        resolver_thread_main, resolver);
+  pthread_sigmask (SIG_SETMASK, &old_signals, NULL);
+
+  if (ret != 0)
+    {
+      _dbus_verbose ("Could not start resolver thread: %s\n",
+                     _dbus_strerror (ret));
+      return FALSE;
+    }
+
+  resolver->n_threads += 1;
+  return TRUE;
+}
+
+#endif /* BUS_RESOLVER_USE_THREADS */
+
+void
+bus_resolver_unref (BusResolver *resolver)
+{
+  _dbus_assert (resolver->refcount > 0);
+  resolver->refcount -= 1;
+
+  if (resolver->refcount > 0)
+    return;
+
+#ifdef BUS_RESOLVER_USE_THREADS
+  if (resolver->threads != NULL)
+    {
+      int i;
+
+      /* a thread stuck in NSS delays shutdown, but we can't free the
+       * requests it is writing to until it is done
+       */
+      pthread_mutex_lock (&resolver->lock);
+      resolver->shutting_down = TRUE;
+      pthread_cond_broadcast (&resolver->cond);
+      pthread_mutex_unlock (&resolver->lock);
+
+      for (i = 0; i < resolver->n_threads; i++)
+        pthread_join (resolver->threads[i], NULL);
+
+      dbus_free (resolver->threads);
+    }
+
+  free_request_list (resolver->queued_head);
+  free_request_list (resolver->finished_head);
+
+  if (resolver->wake_watch != NULL)
+    {
+      _dbus_loop_remove_watch (resolver->loop, resolver->wake_watch,
+                               wake_watch_callback, NULL);
+      _dbus_watch_invalidate (resolver->wake_watch);
+      _dbus_watch_unref (resolver->wake_watch);
+      _dbus_close_socket (resolver->wake_pipe[0], NULL);
+      _dbus_close_socket (resolver->wake_pipe[1], NULL);
+    }
+
+  pthread_cond_destroy (&resolver->cond);
+  pthread_mutex_destroy (&resolver->lock);
+#endif
+
+  _dbus_loop_unref (resolver->loop);
+  dbus_free (resolver);
+}
+
+/**
+ * Looks up the groups of the given user in a helper thread, and calls
+ * function from the main loop with the result.
+ *
+ * Returns #NULL if the lookup can't be done asynchronously (no
+ * memory, no threads allowed, or no thread-safe NSS calls on this
+ * platform); the caller should then do a synchronous lookup when it
+ * needs the groups.  Otherwise the request stays valid until the
+ * function has been called or the request is cancelled.
+ */
+BusResolverRequest*
+bus_resolver_lookup_groups (BusResolver               *resolver,
+                            unsigned long              uid,
+                            BusResolverGroupsFunction  function,
+                            void                      *data)
+{
+#ifdef BUS_RESOLVER_USE_THREADS
+  BusResolverRequest *request;
+
+  if (resolver->max_threads == 0)
+    return NULL;
+
+  if (resolver->threads == NULL)
+    {
+      resolver->threads = dbus_new0 (pthread_t, resolver->max_threads);
+      if (resolver->threads == NULL)
+        return NULL;
+
+      if (!setup_wake_pipe (resolver))
+        {
+          dbus_free (resolver->threads);
+          resolver->threads = NULL;
+          return NULL;
+        }
+    }
+
+  request = dbus_new0 (BusResolverRequest, 1);
+  if (request == NULL)
+    return NULL;
+
+  request->resolver = resolver;
+  request->uid = uid;
+  request->function = function;
+  request->data = data;
+  request->state = REQUEST_QUEUED;
+
+  pthread_mutex_lock (&resolver->lock);
+
+  if (resolver->n_idle_threads == 0 &&
+      resolver->n_threads < resolver->max_threads)
+    start_thread_unlocked (resolver);
+
+  if (resolver->n_threads == 0)
+    {
+      pthread_mutex_unlock (&resolver->lock);
+      dbus_free (request);
+      return NULL;
+    }
+
+  if (resolver->queued_tail != NULL)
+    resolver->queued_tail->next = request;
+  else
+    resolver->queued_head = request;
+  resolver->queued_tail = request;
+
+  pthread_cond_signal (&resolver->cond);
+  pthread_mutex_unlock (&resolver->lock);
+
+  return request;
+#else
+  return NULL;
+#endif
+}
+
+/**
+ * Drops a request; its function will not be called.  A request that
+ * is already being worked on is freed once the helper thread is done
+ * with it.
+ */
+void
+bus_resolver_request_cancel (BusResolverRequest *request)
+{
+#ifdef BUS_RESOLVER_USE_THREADS
+  BusResolver *resolver = request->resolver;
+
+  _dbus_assert (!request->cancelled);
+
+  pthread_mutex_lock (&resolver->lock);
+
+  if (request->state == REQUEST_QUEUED)
+    {
+      BusResolverRequest **p;
+      BusResolverRequest *prev;
+
+      prev = NULL;
+      p = &resolver->queued_head;
+      while (*p != request)
+        {
+          prev = *p;
+          p = &(*p)->next;
+        }
+
+      *p = request->next;
+      if (resolver->queued_tail == request)
+        resolver->queued_tail = prev;
+
+      pthread_mutex_unlock (&resolver->lock);
+      free_request (request);
+      return;
+    }
+
+  request->cancelled = TRUE;
+  pthread_mutex_unlock (&resolver->lock);
+#else
+  _dbus_assert_not_reached ("no resolver requests without helper threads");
+#endif
+}
+
+#ifdef DBUS_BUILD_TESTS
+#ifdef BUS_RESOLVER_USE_THREADS
+
+typedef struct
+{
+  int n_calls;
+  dbus_bool_t success;
+  unsigned long *groups;
+  int n_groups;
+} TestLookupData;
+
+static void
+test_groups_function (dbus_bool_t    success,
+                      unsigned long *groups,
+                      int            n_groups,
+                      void          *data)
+{
+  TestLookupData *d = data;
+
+  d->n_calls += 1;
+  d->success = success;
+  d->groups = groups;
+  d->n_groups = n_groups;
+}
+
+static dbus_bool_t
+group_lists_equal (unsigned long *a,
+                   int            n_a,
+                   unsigned long *b,
+                   int            n_b)
+{
+  int i, j;
+
+  if (n_a != n_b)
+    return FALSE;
+
+  for (i = 0; i < n_a; i++)
+    {
+      for (j = 0; j < n_b; j++)
+        if (a[i] == b[j])
+          break;
+
+      if (j == n_b)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+#endif /* BUS_RESOLVER_USE_THREADS */
+
+dbus_bool_t
+bus_resolver_test (const DBusString *test_data_dir)
+{
+#ifdef BUS_RESOLVER_USE_THREADS
+  DBusLoop *loop;
+  BusResolver *resolver;
+  BusResolverRequest *request;
+  TestLookupData found, cancelled;
+  unsigned long *expected;
+  int n_expected;
+
+  loop = _dbus_loop_new ();
+  _dbus_assert (loop != NULL);
+
+  resolver = bus_resolver_new (loop);
+  _dbus_assert (resolver != NULL);
+
+  if (!_dbus_unix_groups_from_uid (_dbus_getuid (), &expected, &n_expected))
+    {
+      /* sandboxed without a passwd entry for ourselves */
+      _dbus_verbose ("Could not look up our own groups, skipping resolver test\n");
+      bus_resolver_unref (resolver);
+      _dbus_loop_unref (loop);
+      return TRUE;
+    }
+
+  _DBUS_ZERO (found);
+  _DBUS_ZERO (cancelled);
+
+  /* the first request is cancelled before or while a helper thread
+   * picks it up, and must never report back
+   */
+  request = bus_resolver_lookup_groups (resolver, _dbus_getuid (),
+                                        test_groups_function, &cancelled);
+  _dbus_assert (request != NULL);
+  bus_resolver_request_cancel (request);
+
+  request = bus_resolver_lookup_groups (resolver, _dbus_getuid (),
+                                        test_groups_function, &found);
+  _dbus_assert (request != NULL);
+
+  while (found.n_calls == 0)
+    _dbus_loop_iterate (loop, TRUE);
+
+  _dbus_assert (found.n_calls == 1);
+  _dbus_assert (cancelled.n_calls == 0);
+
+  if (!found.success)
+    _dbus_assert_not_reached ("helper thread failed to look up our groups");
+
+  if (!group_lists_equal (found.groups, found.n_groups,
+                          expected, n_expected))
+    _dbus_assert_not_reached ("helper thread found different groups");
+
+  dbus_free (found.groups);
+  dbus_free (expected);
+
+  /* a request still in flight at shutdown is simply dropped */
+  request = bus_resolver_lookup_groups (resolver, _dbus_getuid (),
+                                        test_groups_function, &cancelled);
+  _dbus_assert (request != NULL);
+  bus_resolver_request_cancel (request);
+
+  bus_resolver_unref (resolver);
+  _dbus_loop_unref (loop);
+
+  _dbus_assert (cancelled.n_calls == 0);
+#endif /* BUS_RESOLVER_USE_THREADS */
+
+  return TRUE;
+}
+
+#endif /* DBUS_BUILD_TESTS */
@@ -0,0 +1,56 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* resolver.h  Resolve client credentials off the main loop
+ *
+ * Copyright (C) 2003  Red Hat, Inc.
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef BUS_RESOLVER_H
+#define BUS_RESOLVER_H
+
+#include <dbus/dbus.h>
+#include <dbus/dbus-mainloop.h>
+#include "bus.h"
+
+typedef struct BusResolverRequest BusResolverRequest;
+
+/* Called from the main loop once the lookup finished.  On success
+ * groups is a dbus_malloc() array the callee takes ownership of; on
+ * failure groups is NULL and the caller should fall back to a
+ * synchronous lookup, which will produce the real error.
+ */
+typedef void (* BusResolverGroupsFunction) (dbus_bool_t    success,
+                                            unsigned long *groups,
+                                            int            n_groups,
+                                            void          *data);
+
+/** Number of helper threads started by default */
+#define BUS_RESOLVER_DEFAULT_MAX_THREADS 2
+
+BusResolver*        bus_resolver_new             (DBusLoop                  *loop);
+void                bus_resolver_unref           (BusResolver               *resolver);
+void                bus_resolver_set_max_threads (BusResolver               *resolver,
+                                                  int                        max_threads);
+BusResolverRequest* bus_resolver_lookup_groups   (BusResolver               *resolver,
+                                                  unsigned long              uid,
+                                                  BusResolverGroupsFunction  function,
+                                                  void                      *data);
+void                bus_resolver_request_cancel  (BusResolverRequest        *request);
+
+#endif /* BUS_RESOLVER_H */
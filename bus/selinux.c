@@ -32,6 +32,7 @@
 #include "policy.h"
 #include "utils.h"
 #include "config-parser.h"
+#include "logger.h"
 
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
@@ -49,6 +50,7 @@
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
 #include <grp.h>
 #endif /* HAVE_SELINUX */
 #ifdef HAVE_LIBAUDIT
@@ -72,6 +74,35 @@ static security_id_t bus_sid = SECSID_WILD;
 /* Thread to listen for SELinux status changes via netlink. */
 static pthread_t avc_notify_thread;
 
+/* Set while bus_selinux_full_init() is still waiting for its first
+ * caller; see bus_selinux_defer_full_init().
+ */
+static dbus_bool_t full_init_deferred = FALSE;
+
+/* Number of permission checks we remember; must be a power of two. */
+#define DECISION_CACHE_SIZE 512
+
+/**
+ * A permission the AVC granted without wanting it audited, so asking
+ * again would only cost us a libselinux call.  Denials and audited
+ * grants are never cached, they have to reach avc_audit().
+ */
+typedef struct
+{
+  security_id_t ssid;         /**< #NULL for an empty slot; we hold a reference */
+  security_id_t tsid;         /**< Target SID; we hold a reference */
+  security_class_t tclass;
+  access_vector_t requested;
+} BusSELinuxDecision;
+
+static BusSELinuxDecision decision_cache[DECISION_CACHE_SIZE];
+
+/* Bumped by policy_reload_callback() in the netlink thread; the main
+ * loop flushes the cache when it sees it change.
+ */
+static DBusAtomic decision_cache_generation;
+static dbus_int32_t decision_cache_flushed_generation;
+
 /* Prototypes for AVC callback functions.  */
 static void log_callback (const char *fmt, ...);
 static void log_audit_callback (void *data, security_class_t class, char *buf, size_t bufleft);
@@ -121,6 +152,12 @@ static const struct avc_lock_callback lock_cb =
 static int audit_fd = -1;
 #endif
 
+/* Where AVC messages go once the bus has a logger.  The AVC netlink
+ * thread logs too, which the logger allows, and can outlive the
+ * context, so we hold a reference until bus_selinux_shutdown().
+ */
+static BusLogger *avc_logger = NULL;
+
 void
 bus_selinux_audit_init(void)
 {
@@ -164,7 +201,15 @@ log_callback (const char *fmt, ...)
   }
 #endif /* HAVE_LIBAUDIT */
   
-  vsyslog (LOG_INFO, fmt, ap);
+  if (avc_logger != NULL)
+    {
+      char buf[PATH_MAX*2];
+
+      vsnprintf (buf, sizeof (buf), fmt, ap);
+      bus_logger_log (avc_logger, DBUS_SYSTEM_LOG_SECURITY, buf);
+    }
+  else
+    vsyslog (LOG_INFO, fmt, ap);
   va_end(ap);
 }
 
@@ -178,7 +223,10 @@ policy_reload_callback (u_int32_t event, security_id_t ssid,
                         access_vector_t perms, access_vector_t *out_retained)
 {
   if (event == AVC_CALLBACK_RESET)
-    return raise (SIGHUP);
+    {
+      _dbus_atomic_inc (&decision_cache_generation);
+      return raise (SIGHUP);
+    }
   
   return 0;
 }
@@ -379,6 +427,56 @@ bus_selinux_full_init (void)
   return TRUE;
 }
 
+/**
+ * Puts off bus_selinux_full_init() until the first connection or
+ * service context needs the AVC, so that starting it (and its netlink
+ * thread) doesn't hold up the bus starting to listen. It is called
+ * after any fork, so the thread always lives in the daemon itself.
+ */
+void
+bus_selinux_defer_full_init (void)
+{
+#ifdef HAVE_SELINUX
+  full_init_deferred = selinux_enabled;
+#endif /* HAVE_SELINUX */
+}
+
+/**
+ * Sends AVC denials and other AVC messages through the given logger
+ * instead of writing them to syslog from whichever thread hit them.
+ *
+ * @param logger the bus logger, or #NULL to go back to syslog
+ */
+void
+bus_selinux_set_logger (BusLogger *logger)
+{
+#ifdef HAVE_SELINUX
+  if (!selinux_enabled)
+    return;
+
+  if (logger != NULL)
+    bus_logger_ref (logger);
+  if (avc_logger != NULL)
+    bus_logger_unref (avc_logger);
+  avc_logger = logger;
+#endif /* HAVE_SELINUX */
+}
+
+#ifdef HAVE_SELINUX
+static void
+ensure_full_init (void)
+{
+  if (!full_init_deferred)
+    return;
+
+  full_init_deferred = FALSE;
+
+  if (!bus_selinux_full_init ())
+    _dbus_system_log (DBUS_SYSTEM_LOG_FATAL,
+                      "SELinux enabled but AVC initialization failed; check system log\n");
+}
+#endif /* HAVE_SELINUX */
+
 /**
  * Decrement SID reference count.
  * 
@@ -427,6 +525,114 @@ bus_selinux_id_ref (BusSELinuxID *sid)
  * @returns #TRUE if security policy allows the send.
  */
 #ifdef HAVE_SELINUX
+static unsigned int
+decision_cache_hash (security_id_t    ssid,
+                     security_id_t    tsid,
+                     security_class_t tclass,
+                     access_vector_t  requested)
+{
+  unsigned long h;
+
+  h = (unsigned long) ssid;
+  h = h * 31 + (unsigned long) tsid;
+  h = h * 31 + tclass;
+  h = h * 31 + requested;
+  h ^= h >> 16;
+  h ^= h >> 7;
+
+  return h & (DECISION_CACHE_SIZE - 1);
+}
+
+static void
+decision_cache_flush (void)
+{
+  int i;
+
+  for (i = 0; i < DECISION_CACHE_SIZE; i++)
+    {
+      if (decision_cache[i].ssid != NULL)
+        {
+          sidput (decision_cache[i].ssid);
+          sidput (decision_cache[i].tsid);
+        }
+    }
+
+  memset (decision_cache, '\0', sizeof (decision_cache));
+}
+
+static security_id_t
+target_sid (BusSELinuxID *override_sid)
+{
+  return override_sid ?
+    SELINUX_SID_FROM_BUS (override_sid) :
+    SELINUX_SID_FROM_BUS (bus_sid);
+}
+
+/**
+ * Returns #TRUE if the permission is known to be granted without
+ * auditing, in which case there's no need to build the audit data or
+ * to call into the AVC.
+ */
+static dbus_bool_t
+bus_selinux_check_cached (BusSELinuxID        *sender_sid,
+                          BusSELinuxID        *override_sid,
+                          security_class_t     target_class,
+                          access_vector_t      requested)
+{
+  BusSELinuxDecision *decision;
+  security_id_t ssid, tsid;
+  dbus_int32_t generation;
+
+  generation = decision_cache_generation.value;
+  if (generation != decision_cache_flushed_generation)
+    {
+      _dbus_verbose ("SELinux policy was reset, flushing decision cache\n");
+      decision_cache_flush ();
+      decision_cache_flushed_generation = generation;
+      return FALSE;
+    }
+
+  ssid = SELINUX_SID_FROM_BUS (sender_sid);
+  tsid = target_sid (override_sid);
+
+  decision = &decision_cache[decision_cache_hash (ssid, tsid, target_class,
+                                                  requested)];
+
+  return decision->ssid == ssid &&
+    decision->tsid == tsid &&
+    decision->tclass == target_class &&
+    decision->requested == requested;
+}
+
+static void
+bus_selinux_cache_decision (security_id_t    ssid,
+                            security_id_t    tsid,
+                            security_class_t tclass,
+                            access_vector_t  requested)
+{
+  BusSELinuxDecision *decision;
+
+  decision = &decision_cache[decision_cache_hash (ssid, tsid, tclass,
+                                                  requested)];
+
+  /* the references stop the SIDs being reused for another context
+   * while we still have them in the cache
+   */
+  sidget (ssid);
+  sidget (tsid);
+
+  if (decision->ssid != NULL)
+    {
+      sidput (decision->ssid);
+      sidput (decision->tsid);
+    }
+
+  decision->ssid = ssid;
+  decision->tsid = tsid;
+  decision->tclass = tclass;
+  decision->requested = requested;
+}
+
 static dbus_bool_t
 bus_selinux_check (BusSELinuxID        *sender_sid,
                    BusSELinuxID        *override_sid,
@@ -434,15 +640,29 @@ bus_selinux_check (BusSELinuxID        *sender_sid,
                    access_vector_t      requested,
 		   DBusString          *auxdata)
 {
+  security_id_t ssid, tsid;
+  struct av_decision avd;
+  int rc, saved_errno;
+
   if (!selinux_enabled)
     return TRUE;
 
-  /* Make the security check.  AVC checks enforcing mode here as well. */
-  if (avc_has_perm (SELINUX_SID_FROM_BUS (sender_sid),
-                    override_sid ?
-                    SELINUX_SID_FROM_BUS (override_sid) :
-                    SELINUX_SID_FROM_BUS (bus_sid), 
-                    target_class, requested, &aeref, auxdata) < 0)
+  ensure_full_init ();
+
+  ssid = SELINUX_SID_FROM_BUS (sender_sid);
+  tsid = target_sid (override_sid);
+
+  /* Make the security check.  AVC checks enforcing mode here as well.
+   * This is avc_has_perm() split in two, so we can see whether the
+   * grant was one we may remember.
+   */
+  rc = avc_has_perm_noaudit (ssid, tsid, target_class, requested,
+                             &aeref, &avd);
+  saved_errno = errno;
+  avc_audit (ssid, tsid, target_class, requested, &avd, rc, auxdata);
+  errno = saved_errno;
+
+  if (rc < 0)
     {
     switch (errno)
       {
@@ -457,8 +677,15 @@ bus_selinux_check (BusSELinuxID        *sender_sid,
         return FALSE;
       }
     }
-  else
-    return TRUE;
+
+  /* In permissive mode the AVC lets through what the policy denies;
+   * that has to keep being logged, so only cache real grants.
+   */
+  if ((avd.allowed & requested) == requested &&
+      (avd.auditallow & requested) == 0)
+    bus_selinux_cache_decision (ssid, tsid, target_class, requested);
+
+  return TRUE;
 }
 #endif /* HAVE_SELINUX */
 
@@ -486,6 +713,11 @@ bus_selinux_allows_acquire_service (DBusConnection     *connection,
     return TRUE;
   
   connection_sid = bus_connection_get_selinux_id (connection);
+
+  if (bus_selinux_check_cached (connection_sid, service_sid,
+                                SECCLASS_DBUS, DBUS__ACQUIRE_SVC))
+    return TRUE;
+
   if (!dbus_connection_get_unix_process_id (connection, &spid))
     spid = 0;
 
@@ -557,6 +789,17 @@ bus_selinux_allows_send (DBusConnection     *sender,
   if (!selinux_enabled)
     return TRUE;
 
+  sender_sid = bus_connection_get_selinux_id (sender);
+  /* A NULL proposed_recipient means the bus itself. */
+  if (proposed_recipient)
+    recipient_sid = bus_connection_get_selinux_id (proposed_recipient);
+  else
+    recipient_sid = BUS_SID_FROM_SELINUX (bus_sid);
+
+  if (bus_selinux_check_cached (sender_sid, recipient_sid,
+                                SECCLASS_DBUS, DBUS__SEND_MSG))
+    return TRUE;
+
   if (!sender || !dbus_connection_get_unix_process_id (sender, &spid))
     spid = 0;
   if (!proposed_recipient || !dbus_connection_get_unix_process_id (proposed_recipient, &tpid))
@@ -623,13 +866,6 @@ bus_selinux_allows_send (DBusConnection     *sender,
 	goto oom;
     }
 
-  sender_sid = bus_connection_get_selinux_id (sender);
-  /* A NULL proposed_recipient means the bus itself. */
-  if (proposed_recipient)
-    recipient_sid = bus_connection_get_selinux_id (proposed_recipient);
-  else
-    recipient_sid = BUS_SID_FROM_SELINUX (bus_sid);
-
   ret = bus_selinux_check (sender_sid, 
 			   recipient_sid,
 			   SECCLASS_DBUS, 
@@ -686,6 +922,66 @@ bus_selinux_append_context (DBusMessage    *message,
 #endif
 }
 
+/**
+ * Appends a dict entry mapping key to the security context of sid,
+ * as a variant holding a byte array, to an open a{sv}. Appends
+ * nothing if SELinux support isn't built in.
+ *
+ * @param dict_iter iterator for the open dict
+ * @param key the key for the entry
+ * @param sid the security ID
+ * @param error return location for errors
+ * @returns #FALSE on error
+ */
+dbus_bool_t
+bus_selinux_append_context_entry (DBusMessageIter *dict_iter,
+                                  const char      *key,
+                                  BusSELinuxID    *sid,
+                                  DBusError       *error)
+{
+#ifdef HAVE_SELINUX
+  DBusMessageIter entry_iter, variant_iter, array_iter;
+  char *context;
+
+  if (avc_sid_to_context (SELINUX_SID_FROM_BUS (sid), &context) < 0)
+    {
+      if (errno == ENOMEM)
+        BUS_SET_OOM (error);
+      else
+        dbus_set_error (error, DBUS_ERROR_FAILED,
+                        "Error getting context from SID: %s\n",
+			_dbus_strerror (errno));
+      return FALSE;
+    }
+
+  if (!dbus_message_iter_open_container (dict_iter, DBUS_TYPE_DICT_ENTRY,
+                                         NULL, &entry_iter) ||
+      !dbus_message_iter_append_basic (&entry_iter, DBUS_TYPE_STRING, &key) ||
+      !dbus_message_iter_open_container (&entry_iter, DBUS_TYPE_VARIANT,
+                                         DBUS_TYPE_ARRAY_AS_STRING
+                                         DBUS_TYPE_BYTE_AS_STRING,
+                                         &variant_iter) ||
+      !dbus_message_iter_open_container (&variant_iter, DBUS_TYPE_ARRAY,
+                                         DBUS_TYPE_BYTE_AS_STRING,
+                                         &array_iter) ||
+      !dbus_message_iter_append_fixed_array (&array_iter, DBUS_TYPE_BYTE,
+                                             &context, strlen (context)) ||
+      !dbus_message_iter_close_container (&variant_iter, &array_iter) ||
+      !dbus_message_iter_close_container (&entry_iter, &variant_iter) ||
+      !dbus_message_iter_close_container (dict_iter, &entry_iter))
+    {
+      freecon (context);
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  freecon (context);
+  return TRUE;
+#else
+  return TRUE;
+#endif
+}
+
 /**
  * Gets the security context of a connection to the bus. It is up to
  * the caller to freecon() when they are done. 
@@ -741,6 +1037,8 @@ bus_selinux_init_connection_id (DBusConnection *connection,
   if (!selinux_enabled)
     return NULL;
 
+  ensure_full_init ();
+
   if (!bus_connection_read_selinux_context (connection, &con))
     {
       dbus_set_error (error, DBUS_ERROR_FAILED,
@@ -826,6 +1124,8 @@ bus_selinux_id_table_insert (DBusHashTable *service_table,
   if (!selinux_enabled)
     return TRUE;
 
+  ensure_full_init ();
+
   sid = SECSID_WILD;
   retval = FALSE;
 
@@ -1001,6 +1301,8 @@ bus_selinux_shutdown (void)
 
   _dbus_verbose ("AVC shutdown\n");
 
+  decision_cache_flush ();
+
   if (bus_sid != SECSID_WILD)
     {
       sidput (bus_sid);
@@ -1018,6 +1320,9 @@ bus_selinux_shutdown (void)
       audit_close (audit_fd);
 #endif /* HAVE_LIBAUDIT */
     }
+
+  /* the AVC thread is gone, so nothing logs through it any more */
+  bus_selinux_set_logger (NULL);
 #endif /* HAVE_SELINUX */
 }
 
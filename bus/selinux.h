@@ -29,6 +29,8 @@
 
 dbus_bool_t bus_selinux_pre_init (void);
 dbus_bool_t bus_selinux_full_init(void);
+void        bus_selinux_defer_full_init (void);
+void        bus_selinux_set_logger (BusLogger *logger);
 void        bus_selinux_shutdown (void);
 
 dbus_bool_t bus_selinux_enabled  (void);
@@ -48,6 +50,10 @@ const char*    bus_selinux_get_policy_root (void);
 dbus_bool_t    bus_selinux_append_context      (DBusMessage    *message,
 						BusSELinuxID   *context,
 						DBusError      *error);
+dbus_bool_t    bus_selinux_append_context_entry (DBusMessageIter *dict_iter,
+                                                 const char      *key,
+                                                 BusSELinuxID    *sid,
+                                                 DBusError       *error);
 
 dbus_bool_t bus_selinux_allows_acquire_service (DBusConnection *connection,
                                                 BusSELinuxID   *service_sid,
@@ -36,6 +36,7 @@
 #include "policy.h"
 #include "bus.h"
 #include "selinux.h"
+#include <string.h>
 
 struct BusService
 {
@@ -57,6 +58,9 @@ struct BusOwner
   unsigned int do_not_queue : 1;
 };
 
+/* Number of slots in the direct table of unique names; a power of two */
+#define UNIQUE_NAME_SLOTS 1024
+
 struct BusRegistry
 {
   int refcount;
@@ -68,8 +72,89 @@ struct BusRegistry
   DBusMemPool   *owner_pool;
 
   DBusHashTable *service_sid_table;
+
+  dbus_uint32_t owner_generation; /**< Bumped whenever any name gains or loses an owner */
+
+  /* Unique names ":MAJOR.MINOR" indexed by MINOR; a cache in front of
+   * service_hash, which remains the authoritative table
+   */
+  BusService *unique_name_slots[UNIQUE_NAME_SLOTS];
 };
 
+/* Finds the direct table slot for a unique name, without hashing it,
+ * or returns NULL if the name isn't of the form the bus assigns.
+ * The slot may hold some other name with the same index.
+ */
+static BusService **
+unique_name_slot (BusRegistry *registry,
+                  const char  *name)
+{
+  const char *p;
+  unsigned long minor;
+
+  if (name[0] != ':')
+    return NULL;
+
+  p = name + 1;
+  if (*p < '0' || *p > '9')
+    return NULL;
+  while (*p >= '0' && *p <= '9')
+    ++p;
+
+  if (*p != '.')
+    return NULL;
+  ++p;
+
+  if (*p < '0' || *p > '9')
+    return NULL;
+  minor = 0;
+  while (*p >= '0' && *p <= '9')
+    {
+      minor = minor * 10 + (*p - '0');
+      ++p;
+    }
+
+  if (*p != '\0')
+    return NULL;
+
+  return &registry->unique_name_slots[minor & (UNIQUE_NAME_SLOTS - 1)];
+}
+
+static void
+unique_name_slot_set (BusRegistry *registry,
+                      BusService  *service)
+{
+  BusService **slot;
+
+  /* Unique names count upwards, so the newest name is the one to keep
+   * when two share a slot
+   */
+  slot = unique_name_slot (registry, service->name);
+  if (slot != NULL)
+    *slot = service;
+}
+
+static void
+unique_name_slot_clear (BusRegistry *registry,
+                        BusService  *service)
+{
+  BusService **slot;
+
+  slot = unique_name_slot (registry, service->name);
+  if (slot != NULL && *slot == service)
+    *slot = NULL;
+}
+
+/* Cached policy decisions and routes depend on which connections own
+ * which names, so every change in the set of a name's owners, queued
+ * or primary, or in their order, must go through here.
+ */
+static void
+bus_service_owners_changed (BusService *service)
+{
+  service->registry->owner_generation += 1;
+}
+
 BusRegistry*
 bus_registry_new (BusContext *context)
 {
@@ -82,8 +167,8 @@ bus_registry_new (BusContext *context)
   registry->refcount = 1;
   registry->context = context;
   
-  registry->service_hash = _dbus_hash_table_new (DBUS_HASH_STRING,
-                                                 NULL, NULL);
+  registry->service_hash = _dbus_hash_table_new_open_addressed (DBUS_HASH_STRING,
+                                                                NULL, NULL);
   if (registry->service_hash == NULL)
     goto failed;
   
@@ -138,14 +223,31 @@ bus_registry_unref  (BusRegistry *registry)
     }
 }
 
+/* Changes whenever the owners of any name change; see
+ * bus_service_owners_changed().
+ */
+dbus_uint32_t
+bus_registry_get_owner_generation (BusRegistry *registry)
+{
+  return registry->owner_generation;
+}
+
 BusService*
 bus_registry_lookup (BusRegistry      *registry,
                      const DBusString *service_name)
 {
   BusService *service;
+  BusService **slot;
+  const char *name;
 
-  service = _dbus_hash_table_lookup_string (registry->service_hash,
-                                            _dbus_string_get_const_data (service_name));
+  name = _dbus_string_get_const_data (service_name);
+
+  /* Most messages are addressed to unique names */
+  slot = unique_name_slot (registry, name);
+  if (slot != NULL && *slot != NULL && strcmp ((*slot)->name, name) == 0)
+    return *slot;
+
+  service = _dbus_hash_table_lookup_string (registry->service_hash, name);
 
   return service;
 }
@@ -310,6 +412,8 @@ bus_registry_ensure (BusRegistry               *registry,
       BUS_SET_OOM (error);
       return NULL;
     }
+
+  unique_name_slot_set (registry, service);
   
   return service;
 }
@@ -330,48 +434,31 @@ bus_registry_foreach (BusRegistry               *registry,
     }
 }
 
+/**
+ * Appends the name of every service in the registry to an array of
+ * strings being written, straight from the registry's own copies.
+ *
+ * @param registry the registry
+ * @param array_iter iterator for an open array of #DBUS_TYPE_STRING
+ * @returns #FALSE if not enough memory
+ */
 dbus_bool_t
-bus_registry_list_services (BusRegistry *registry,
-                            char      ***listp,
-                            int         *array_len)
+bus_registry_append_service_names (BusRegistry     *registry,
+                                   DBusMessageIter *array_iter)
 {
-  int i, j, len;
-  char **retval;
   DBusHashIter iter;
-   
-  len = _dbus_hash_table_get_n_entries (registry->service_hash);
-  retval = dbus_new (char *, len + 1);
-
-  if (retval == NULL)
-    return FALSE;
 
   _dbus_hash_iter_init (registry->service_hash, &iter);
-  i = 0;
   while (_dbus_hash_iter_next (&iter))
     {
       BusService *service = _dbus_hash_iter_get_value (&iter);
 
-      retval[i] = _dbus_strdup (service->name);
-      if (retval[i] == NULL)
-	goto error;
-
-      i++;
+      if (!dbus_message_iter_append_basic (array_iter, DBUS_TYPE_STRING,
+                                           &service->name))
+        return FALSE;
     }
 
-  retval[i] = NULL;
-  
-  if (array_len)
-    *array_len = len;
-  
-  *listp = retval;
   return TRUE;
-  
- error:
-  for (j = 0; j < i; j++)
-    dbus_free (retval[i]);
-  dbus_free (retval);
-
-  return FALSE;
 }
 
 dbus_bool_t
@@ -538,6 +625,7 @@ bus_registry_acquire_service (BusRegistry      *registry,
       if (link != NULL)
         {
           _dbus_list_unlink (&service->owners, link);
+          bus_service_owners_changed (service);
           temp_owner = (BusOwner *)link->data;
           bus_owner_unref (temp_owner); 
           _dbus_list_free_link (link);
@@ -710,6 +798,7 @@ bus_service_unlink_owner (BusService      *service,
                           BusOwner        *owner)
 {
   _dbus_list_remove_last (&service->owners, owner);
+  bus_service_owners_changed (service);
   bus_owner_unref (owner);
 }
 
@@ -724,6 +813,7 @@ bus_service_unlink (BusService *service)
    */
   _dbus_hash_table_remove_string (service->registry->service_hash,
                                   service->name);
+  unique_name_slot_clear (service->registry, service);
   
   bus_service_unref (service);
 }
@@ -739,6 +829,7 @@ bus_service_relink (BusService           *service,
                                                preallocated,
                                                service->name,
                                                service);
+  unique_name_slot_set (service->registry, service);
   
   bus_service_ref (service);
 }
@@ -863,6 +954,8 @@ bus_service_add_owner (BusService     *service,
               return FALSE;
             }
         }      
+
+      bus_service_owners_changed (service);
     } 
   else 
     {
@@ -940,6 +1033,7 @@ restore_ownership (void *data)
     }
   
   _dbus_list_insert_before_link (&d->service->owners, link, d->owner_link);
+  bus_service_owners_changed (d->service);
 
   /* Note that removing then restoring this changes the order in which
    * ServiceDeleted messages are sent on destruction of the
@@ -1099,6 +1193,7 @@ bus_service_swap_owner (BusService     *service,
   _dbus_list_insert_after_link (&service->owners,
                                 _dbus_list_get_first_link (&service->owners),
 				swap_link);
+  bus_service_owners_changed (service);
 
   return TRUE;
 }
@@ -1134,6 +1229,7 @@ bus_service_remove_owner (BusService     *service,
 
       link = _bus_service_find_owner_link (service, connection);
       _dbus_list_unlink (&service->owners, link);
+      bus_service_owners_changed (service);
       temp_owner = (BusOwner *)link->data;
       bus_owner_unref (temp_owner); 
       _dbus_list_free_link (link);
@@ -1306,3 +1402,33 @@ bus_service_list_queued_owners (BusService *service,
   BUS_SET_OOM (error);
   return FALSE;
 }
+
+dbus_bool_t
+bus_service_foreach_owner (BusService               *service,
+                           BusOwnerForeachFunction   function,
+                           void                     *data)
+{
+  DBusList *link;
+
+  link = _dbus_list_get_first_link (&service->owners);
+  while (link != NULL)
+    {
+      BusOwner *owner;
+      dbus_uint32_t flags;
+
+      owner = (BusOwner *) link->data;
+
+      flags = 0;
+      if (owner->allow_replacement)
+        flags |= DBUS_NAME_FLAG_ALLOW_REPLACEMENT;
+      if (owner->do_not_queue)
+        flags |= DBUS_NAME_FLAG_DO_NOT_QUEUE;
+
+      if (!(* function) (owner->conn, flags, data))
+        return FALSE;
+
+      link = _dbus_list_get_next_link (&service->owners, link);
+    }
+
+  return TRUE;
+}
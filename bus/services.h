@@ -32,12 +32,16 @@
 
 typedef void (* BusServiceForeachFunction) (BusService       *service,
                                             void             *data);
+typedef dbus_bool_t (* BusOwnerForeachFunction) (DBusConnection *connection,
+                                                 dbus_uint32_t   flags,
+                                                 void           *data);
 
 BusRegistry* bus_registry_new             (BusContext                  *context);
 BusRegistry* bus_registry_ref             (BusRegistry                 *registry);
 void         bus_registry_unref           (BusRegistry                 *registry);
 BusService*  bus_registry_lookup          (BusRegistry                 *registry,
                                            const DBusString            *service_name);
+dbus_uint32_t bus_registry_get_owner_generation (BusRegistry           *registry);
 BusService*  bus_registry_ensure          (BusRegistry                 *registry,
                                            const DBusString            *service_name,
                                            DBusConnection              *owner_connection_if_created,
@@ -47,9 +51,8 @@ BusService*  bus_registry_ensure          (BusRegistry                 *registry
 void         bus_registry_foreach         (BusRegistry                 *registry,
                                            BusServiceForeachFunction    function,
                                            void                        *data);
-dbus_bool_t  bus_registry_list_services   (BusRegistry                 *registry,
-                                           char                      ***listp,
-                                           int                         *array_len);
+dbus_bool_t  bus_registry_append_service_names (BusRegistry            *registry,
+                                                DBusMessageIter        *array_iter);
 dbus_bool_t  bus_registry_acquire_service (BusRegistry                 *registry,
                                            DBusConnection              *connection,
                                            const DBusString            *service_name,
@@ -89,6 +92,9 @@ const char*     bus_service_get_name                  (BusService     *service);
 dbus_bool_t     bus_service_list_queued_owners        (BusService *service,
                                                        DBusList  **return_list,
                                                        DBusError  *error);
+dbus_bool_t     bus_service_foreach_owner             (BusService              *service,
+                                                       BusOwnerForeachFunction  function,
+                                                       void                    *data);
 
 DBusConnection* bus_service_get_primary_owners_connection (BusService     *service);
 #endif /* BUS_SERVICES_H */
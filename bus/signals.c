@@ -23,28 +23,49 @@
 
 #include <config.h>
 #include "signals.h"
+#include "atoms.h"
 #include "services.h"
 #include "utils.h"
 #include <dbus/dbus-marshal-validate.h>
 
+/* Most rules match on arg0 alone, and hardly any go past arg1 */
+#define MATCH_RULE_INLINE_ARGS 2
+
+typedef struct
+{
+  const char *value; /**< Atom to match, or #NULL if the arg is unconstrained */
+  unsigned int len;  /**< Length of value, possibly with BUS_MATCH_ARG_IS_PATH */
+} MatchRuleArg;
+
 struct BusMatchRule
 {
   int refcount;       /**< reference count */
-
-  DBusConnection *matches_go_to; /**< Owner of the rule */
-
   unsigned int flags; /**< BusMatchFlags */
+  int message_type;
+  int args_len;       /**< Number of slots in use in args */
 
-  int   message_type;
-  char *interface;
-  char *member;
-  char *sender;
-  char *destination;
-  char *path;
+  DBusConnection *matches_go_to; /**< Owner of the rule */
 
-  unsigned int *arg_lens;
-  char **args;
-  int args_len;
+  /* The strings are atoms, so rules naming the same interface share
+   * one copy and can be compared by pointer.
+   */
+  const char *interface;
+  const char *member;
+  const char *sender;
+  const char *destination;
+  const char *path;
+
+  MatchRuleArg *args; /**< inline_args, or a separate block if more are needed */
+  MatchRuleArg inline_args[MATCH_RULE_INLINE_ARGS];
+
+  /* The rule sits in exactly one matchmaker list and one connection
+   * list, so it carries both links itself; data is #NULL when unlinked.
+   * value_link chains it with the rules that hash the same in the
+   * matchmaker's rules_by_value.
+   */
+  DBusList matchmaker_link;
+  DBusList connection_link;
+  DBusList value_link;
 };
 
 #define BUS_MATCH_ARG_IS_PATH  0x8000000u
@@ -86,117 +107,127 @@ bus_match_rule_unref (BusMatchRule *rule)
   rule->refcount -= 1;
   if (rule->refcount == 0)
     {
-      dbus_free (rule->interface);
-      dbus_free (rule->member);
-      dbus_free (rule->sender);
-      dbus_free (rule->destination);
-      dbus_free (rule->path);
-      dbus_free (rule->arg_lens);
+      bus_atom_unref (rule->interface);
+      bus_atom_unref (rule->member);
+      bus_atom_unref (rule->sender);
+      bus_atom_unref (rule->destination);
+      bus_atom_unref (rule->path);
+
+      _dbus_assert (rule->matchmaker_link.data == NULL);
+      _dbus_assert (rule->connection_link.data == NULL);
+      _dbus_assert (rule->value_link.data == NULL);
 
-      /* can't use dbus_free_string_array() since there
-       * are embedded NULL
-       */
       if (rule->args)
         {
           int i;
 
-          i = 0;
-          while (i < rule->args_len)
-            {
-              if (rule->args[i])
-                dbus_free (rule->args[i]);
-              ++i;
-            }
+          for (i = 0; i < rule->args_len; i++)
+            bus_atom_unref (rule->args[i].value);
 
-          dbus_free (rule->args);
+          if (rule->args != rule->inline_args)
+            dbus_free (rule->args);
         }
-      
+
       dbus_free (rule);
     }
 }
 
-#ifdef DBUS_ENABLE_VERBOSE_MODE
-/* Note this function does not do escaping, so it's only
- * good for debug spew at the moment
+/**
+ * Whether the rule was added with conflate='true', asking for only
+ * the latest of the signals it matches to be kept queued.
+ *
+ * @param rule the rule
+ * @returns #TRUE if the rule conflates
  */
-static char*
-match_rule_to_string (BusMatchRule *rule)
+dbus_bool_t
+bus_match_rule_get_conflate (BusMatchRule *rule)
 {
-  DBusString str;
-  char *ret;
-  
-  if (!_dbus_string_init (&str))
+  return (rule->flags & BUS_MATCH_CONFLATE) != 0;
+}
+
+/* Appends key='value', quoting any ' in the value the way
+ * find_value() reads it back
+ */
+static dbus_bool_t
+append_key_value (DBusString *str,
+                  const char *key,
+                  const char *value)
+{
+  const char *p;
+
+  if (_dbus_string_get_length (str) > 0 &&
+      !_dbus_string_append_byte (str, ','))
+    return FALSE;
+
+  if (!_dbus_string_append (str, key) ||
+      !_dbus_string_append (str, "='"))
+    return FALSE;
+
+  for (p = value; *p; p++)
     {
-      char *s;
-      while ((s = _dbus_strdup ("nomem")) == NULL)
-        ; /* only OK for debug spew... */
-      return s;
+      if (*p == '\'')
+        {
+          if (!_dbus_string_append (str, "'\\''"))
+            return FALSE;
+        }
+      else if (!_dbus_string_append_byte (str, *p))
+        return FALSE;
     }
-  
+
+  return _dbus_string_append_byte (str, '\'');
+}
+
+/**
+ * Writes out a rule the way bus_match_rule_parse() would read it
+ * back, which is not necessarily how it was first written.
+ *
+ * @param rule the rule
+ * @param str string to append it to
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+bus_match_rule_to_string (BusMatchRule *rule,
+                          DBusString   *str)
+{
+  DBusString key;
+  int start;
+
+  start = _dbus_string_get_length (str);
+
   if (rule->flags & BUS_MATCH_MESSAGE_TYPE)
     {
-      /* FIXME make type readable */
-      if (!_dbus_string_append_printf (&str, "type='%d'", rule->message_type))
+      if (!append_key_value (str, "type",
+                             dbus_message_type_to_string (rule->message_type)))
         goto nomem;
     }
 
   if (rule->flags & BUS_MATCH_INTERFACE)
     {
-      if (_dbus_string_get_length (&str) > 0)
-        {
-          if (!_dbus_string_append (&str, ","))
-            goto nomem;
-        }
-      
-      if (!_dbus_string_append_printf (&str, "interface='%s'", rule->interface))
+      if (!append_key_value (str, "interface", rule->interface))
         goto nomem;
     }
 
   if (rule->flags & BUS_MATCH_MEMBER)
     {
-      if (_dbus_string_get_length (&str) > 0)
-        {
-          if (!_dbus_string_append (&str, ","))
-            goto nomem;
-        }
-      
-      if (!_dbus_string_append_printf (&str, "member='%s'", rule->member))
+      if (!append_key_value (str, "member", rule->member))
         goto nomem;
     }
 
   if (rule->flags & BUS_MATCH_PATH)
     {
-      if (_dbus_string_get_length (&str) > 0)
-        {
-          if (!_dbus_string_append (&str, ","))
-            goto nomem;
-        }
-      
-      if (!_dbus_string_append_printf (&str, "path='%s'", rule->path))
+      if (!append_key_value (str, "path", rule->path))
         goto nomem;
     }
 
   if (rule->flags & BUS_MATCH_SENDER)
     {
-      if (_dbus_string_get_length (&str) > 0)
-        {
-          if (!_dbus_string_append (&str, ","))
-            goto nomem;
-        }
-      
-      if (!_dbus_string_append_printf (&str, "sender='%s'", rule->sender))
+      if (!append_key_value (str, "sender", rule->sender))
         goto nomem;
     }
 
   if (rule->flags & BUS_MATCH_DESTINATION)
     {
-      if (_dbus_string_get_length (&str) > 0)
-        {
-          if (!_dbus_string_append (&str, ","))
-            goto nomem;
-        }
-      
-      if (!_dbus_string_append_printf (&str, "destination='%s'", rule->destination))
+      if (!append_key_value (str, "destination", rule->destination))
         goto nomem;
     }
 
@@ -206,40 +237,65 @@ match_rule_to_string (BusMatchRule *rule)
       
       _dbus_assert (rule->args != NULL);
 
-      i = 0;
-      while (i < rule->args_len)
+      for (i = 0; i < rule->args_len; i++)
         {
-          if (rule->args[i] != NULL)
-            {
-              dbus_bool_t is_path;
+          dbus_bool_t is_path;
+          dbus_bool_t ok;
 
-              if (_dbus_string_get_length (&str) > 0)
-                {
-                  if (!_dbus_string_append (&str, ","))
-                    goto nomem;
-                }
+          if (rule->args[i].value == NULL)
+            continue;
 
-              is_path = (rule->arg_lens[i] & BUS_MATCH_ARG_IS_PATH) != 0;
-              
-              if (!_dbus_string_append_printf (&str,
-                                               "arg%d%s='%s'",
-                                               i, is_path ? "path" : "",
-                                               rule->args[i]))
-                goto nomem;
-            }
-          
-          ++i;
+          is_path = (rule->args[i].len & BUS_MATCH_ARG_IS_PATH) != 0;
+
+          if (!_dbus_string_init (&key))
+            goto nomem;
+
+          ok = _dbus_string_append_printf (&key, "arg%d%s",
+                                           i, is_path ? "path" : "") &&
+            append_key_value (str, _dbus_string_get_const_data (&key),
+                              rule->args[i].value);
+          _dbus_string_free (&key);
+
+          if (!ok)
+            goto nomem;
         }
     }
+
+  if (rule->flags & BUS_MATCH_CONFLATE)
+    {
+      if (!append_key_value (str, "conflate", "true"))
+        goto nomem;
+    }
+
+  return TRUE;
+
+ nomem:
+  _dbus_string_set_length (str, start);
+  return FALSE;
+}
+
+#ifdef DBUS_ENABLE_VERBOSE_MODE
+/* only good for debug spew */
+static char*
+match_rule_to_string (BusMatchRule *rule)
+{
+  DBusString str;
+  char *ret;
   
-  if (!_dbus_string_steal_data (&str, &ret))
+  if (!_dbus_string_init (&str))
     goto nomem;
 
+  if (!bus_match_rule_to_string (rule, &str) ||
+      !_dbus_string_steal_data (&str, &ret))
+    {
+      _dbus_string_free (&str);
+      goto nomem;
+    }
+
   _dbus_string_free (&str);
   return ret;
   
  nomem:
-  _dbus_string_free (&str);
   {
     char *s;
     while ((s = _dbus_strdup ("nomem")) == NULL)
@@ -264,16 +320,16 @@ dbus_bool_t
 bus_match_rule_set_interface (BusMatchRule *rule,
                               const char   *interface)
 {
-  char *new;
+  const char *new;
 
   _dbus_assert (interface != NULL);
 
-  new = _dbus_strdup (interface);
+  new = bus_atom_intern (interface);
   if (new == NULL)
     return FALSE;
 
   rule->flags |= BUS_MATCH_INTERFACE;
-  dbus_free (rule->interface);
+  bus_atom_unref (rule->interface);
   rule->interface = new;
 
   return TRUE;
@@ -283,16 +339,16 @@ dbus_bool_t
 bus_match_rule_set_member (BusMatchRule *rule,
                            const char   *member)
 {
-  char *new;
+  const char *new;
 
   _dbus_assert (member != NULL);
 
-  new = _dbus_strdup (member);
+  new = bus_atom_intern (member);
   if (new == NULL)
     return FALSE;
 
   rule->flags |= BUS_MATCH_MEMBER;
-  dbus_free (rule->member);
+  bus_atom_unref (rule->member);
   rule->member = new;
 
   return TRUE;
@@ -302,16 +358,16 @@ dbus_bool_t
 bus_match_rule_set_sender (BusMatchRule *rule,
                            const char   *sender)
 {
-  char *new;
+  const char *new;
 
   _dbus_assert (sender != NULL);
 
-  new = _dbus_strdup (sender);
+  new = bus_atom_intern (sender);
   if (new == NULL)
     return FALSE;
 
   rule->flags |= BUS_MATCH_SENDER;
-  dbus_free (rule->sender);
+  bus_atom_unref (rule->sender);
   rule->sender = new;
 
   return TRUE;
@@ -321,16 +377,16 @@ dbus_bool_t
 bus_match_rule_set_destination (BusMatchRule *rule,
                                 const char   *destination)
 {
-  char *new;
+  const char *new;
 
   _dbus_assert (destination != NULL);
 
-  new = _dbus_strdup (destination);
+  new = bus_atom_intern (destination);
   if (new == NULL)
     return FALSE;
 
   rule->flags |= BUS_MATCH_DESTINATION;
-  dbus_free (rule->destination);
+  bus_atom_unref (rule->destination);
   rule->destination = new;
 
   return TRUE;
@@ -340,16 +396,16 @@ dbus_bool_t
 bus_match_rule_set_path (BusMatchRule *rule,
                          const char   *path)
 {
-  char *new;
+  const char *new;
 
   _dbus_assert (path != NULL);
 
-  new = _dbus_strdup (path);
+  new = bus_atom_intern (path);
   if (new == NULL)
     return FALSE;
 
   rule->flags |= BUS_MATCH_PATH;
-  dbus_free (rule->path);
+  bus_atom_unref (rule->path);
   rule->path = new;
 
   return TRUE;
@@ -361,74 +417,50 @@ bus_match_rule_set_arg (BusMatchRule     *rule,
                         const DBusString *value,
                         dbus_bool_t       is_path)
 {
-  int length;
-  char *new;
+  const char *new;
 
   _dbus_assert (value != NULL);
 
-  /* args_len is the number of args not including null termination
-   * in the char**
-   */
   if (arg >= rule->args_len)
     {
-      unsigned int *new_arg_lens;
-      char **new_args;
-      int new_args_len;
-      int i;
-
-      new_args_len = arg + 1;
-
-      /* add another + 1 here for null termination */
-      new_args = dbus_realloc (rule->args,
-                               sizeof (char *) * (new_args_len + 1));
-      if (new_args == NULL)
-        return FALSE;
-
-      /* NULL the new slots */
-      i = rule->args_len;
-      while (i <= new_args_len) /* <= for null termination */
+      if (arg < MATCH_RULE_INLINE_ARGS)
         {
-          new_args[i] = NULL;
-          ++i;
+          /* slots past args_len are still zeroed from bus_match_rule_new() */
+          rule->args = rule->inline_args;
         }
-      
-      rule->args = new_args;
+      else
+        {
+          MatchRuleArg *new_args;
+
+          new_args = dbus_new0 (MatchRuleArg, arg + 1);
+          if (new_args == NULL)
+            return FALSE;
 
-      /* and now add to the lengths */
-      new_arg_lens = dbus_realloc (rule->arg_lens,
-                                   sizeof (int) * (new_args_len + 1));
+          if (rule->args_len > 0)
+            memcpy (new_args, rule->args,
+                    sizeof (MatchRuleArg) * rule->args_len);
 
-      if (new_arg_lens == NULL)
-        return FALSE;
+          if (rule->args != rule->inline_args)
+            dbus_free (rule->args);
 
-      /* zero the new slots */
-      i = rule->args_len;
-      while (i <= new_args_len) /* <= for null termination */
-        {
-          new_arg_lens[i] = 0;
-          ++i;
+          rule->args = new_args;
         }
 
-      rule->arg_lens = new_arg_lens;
-      rule->args_len = new_args_len;
+      rule->args_len = arg + 1;
     }
 
-  length = _dbus_string_get_length (value);
-  if (!_dbus_string_copy_data (value, &new))
+  new = bus_atom_intern (_dbus_string_get_const_data (value));
+  if (new == NULL)
     return FALSE;
 
   rule->flags |= BUS_MATCH_ARGS;
 
-  dbus_free (rule->args[arg]);
-  rule->arg_lens[arg] = length;
-  rule->args[arg] = new;
+  bus_atom_unref (rule->args[arg].value);
+  rule->args[arg].value = new;
+  rule->args[arg].len = _dbus_string_get_length (value);
 
   if (is_path)
-    rule->arg_lens[arg] |= BUS_MATCH_ARG_IS_PATH;
-
-  /* NULL termination didn't get busted */
-  _dbus_assert (rule->args[rule->args_len] == NULL);
-  _dbus_assert (rule->arg_lens[rule->args_len] == 0);
+    rule->args[arg].len |= BUS_MATCH_ARG_IS_PATH;
 
   return TRUE;
 }
@@ -772,7 +804,7 @@ bus_match_rule_parse_arg_match (BusMatchRule     *rule,
   
   if ((rule->flags & BUS_MATCH_ARGS) &&
       rule->args_len > (int) arg &&
-      rule->args[arg] != NULL)
+      rule->args[arg].value != NULL)
     {
       dbus_set_error (error, DBUS_ERROR_MATCH_RULE_INVALID,
                       "Argument %d matched more than once in match rule\n", key);
@@ -807,10 +839,13 @@ bus_match_rule_parse (DBusConnection   *matches_go_to,
 {
   BusMatchRule *rule;
   RuleToken tokens[MAX_RULE_TOKENS+1]; /* NULL termination + 1 */
+  dbus_bool_t seen_conflate;
   int i;
   
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
+  seen_conflate = FALSE;
+
   if (_dbus_string_get_length (rule_text) > DBUS_MAXIMUM_MATCH_RULE_LENGTH)
     {
       dbus_set_error (error, DBUS_ERROR_LIMITS_EXCEEDED,
@@ -984,6 +1019,27 @@ bus_match_rule_parse (DBusConnection   *matches_go_to,
           if (!bus_match_rule_parse_arg_match (rule, key, &tmp_str, error))
             goto failed;
         }
+      else if (strcmp (key, "conflate") == 0)
+        {
+          if (seen_conflate)
+            {
+              dbus_set_error (error, DBUS_ERROR_MATCH_RULE_INVALID,
+                              "Key %s specified twice in match rule\n", key);
+              goto failed;
+            }
+
+          seen_conflate = TRUE;
+
+          if (strcmp (value, "true") == 0)
+            rule->flags |= BUS_MATCH_CONFLATE;
+          else if (strcmp (value, "false") != 0)
+            {
+              dbus_set_error (error, DBUS_ERROR_MATCH_RULE_INVALID,
+                              "conflate must be 'true' or 'false', not '%s'\n",
+                              value);
+              goto failed;
+            }
+        }
       else
         {
           dbus_set_error (error, DBUS_ERROR_MATCH_RULE_INVALID,
@@ -1020,16 +1076,113 @@ bus_match_rule_parse (DBusConnection   *matches_go_to,
   return rule;
 }
 
+static const char *
+atom_ref_if_set (const char *atom)
+{
+  return atom != NULL ? bus_atom_ref (atom) : NULL;
+}
+
+/* Makes an unshared copy of a rule that sends matches to matches_go_to,
+ * which may be #NULL for a rule that will never be added.
+ */
+static BusMatchRule*
+match_rule_copy (BusMatchRule   *rule,
+                 DBusConnection *matches_go_to)
+{
+  BusMatchRule *copy;
+  int i;
+
+  copy = dbus_new0 (BusMatchRule, 1);
+  if (copy == NULL)
+    return NULL;
+
+  copy->refcount = 1;
+  copy->matches_go_to = matches_go_to;
+  copy->flags = rule->flags;
+  copy->message_type = rule->message_type;
+  copy->interface = atom_ref_if_set (rule->interface);
+  copy->member = atom_ref_if_set (rule->member);
+  copy->sender = atom_ref_if_set (rule->sender);
+  copy->destination = atom_ref_if_set (rule->destination);
+  copy->path = atom_ref_if_set (rule->path);
+
+  if (rule->args_len == 0)
+    return copy;
+
+  if (rule->args_len <= MATCH_RULE_INLINE_ARGS)
+    {
+      copy->args = copy->inline_args;
+    }
+  else
+    {
+      copy->args = dbus_new (MatchRuleArg, rule->args_len);
+      if (copy->args == NULL)
+        {
+          bus_match_rule_unref (copy);
+          return NULL;
+        }
+    }
+
+  copy->args_len = rule->args_len;
+
+  for (i = 0; i < rule->args_len; i++)
+    {
+      copy->args[i].value = atom_ref_if_set (rule->args[i].value);
+      copy->args[i].len = rule->args[i].len;
+    }
+
+  return copy;
+}
+
+/* Within a RuleSet, each rule is filed under at most one key, chosen from
+ * the rule itself so that the rule (or an equal one passed to
+ * bus_matchmaker_remove_rule_by_value()) always maps back to the same list.
+ * The order here is the order of preference: object paths and arg0 values
+ * tend to be the most selective, member names (think PropertiesChanged)
+ * the least.
+ */
+typedef enum
+{
+  RULE_INDEX_PATH,
+  RULE_INDEX_ARG0,
+  RULE_INDEX_SENDER,
+  RULE_INDEX_MEMBER,
+  RULE_INDEX_NONE
+} RuleIndex;
+
+#define N_RULE_INDEXES RULE_INDEX_NONE
+
+typedef struct RuleSet RuleSet;
+struct RuleSet
+{
+  /* For each RuleIndex, maps non-NULL key atoms to non-NULL (DBusList **)s.
+   * The tables are only created when a rule needs them, so may be NULL.
+   */
+  DBusHashTable *rules_by_key[N_RULE_INDEXES];
+
+  /* List of BusMatchRules which don't specify any indexed key */
+  DBusList *unindexed_rules;
+};
+
 typedef struct RulePool RulePool;
 struct RulePool
 {
-  /* Maps non-NULL interface names to non-NULL (DBusList **)s */
+  /* Maps non-NULL interface atoms to non-NULL (RuleSet *)s */
   DBusHashTable *rules_by_iface;
 
-  /* List of BusMatchRules which don't specify an interface */
-  DBusList *rules_without_iface;
+  /* Rules which don't specify an interface */
+  RuleSet rules_without_iface;
 };
 
+/** Number of slots in the matchmaker's cache of parsed rules */
+#define N_PARSED_RULES 64
+
+typedef struct
+{
+  char *text;          /**< Text the rule was parsed from */
+  BusMatchRule *rule;  /**< Parsed rule, not bound to any connection */
+} ParsedRule;
+
 struct BusMatchmaker
 {
   int refcount;
@@ -1039,8 +1192,37 @@ struct BusMatchmaker
    * type.
    */
   RulePool rules_by_type[DBUS_NUM_MESSAGE_TYPES];
+
+  /* Where bus_matchmaker_get_recipients() collects the connections a
+   * message goes to, kept between messages so fan-out doesn't
+   * allocate. Handed out to one caller at a time.
+   */
+  DBusConnection **recipients;
+  int n_recipients;
+  int max_recipients;
+  dbus_bool_t recipients_in_use;
+
+  /* Recently parsed rules, by a hash of their text, which clients
+   * asking for the same rule can get a copy of without parsing it
+   */
+  ParsedRule parsed_rules[N_PARSED_RULES];
+
+  /* Every rule, by match_rule_hash() of its owner and value, so that
+   * RemoveMatch goes straight to the connection's rule. Maps hashes to
+   * chains of value_links, which don't belong to the table.
+   */
+  DBusHashTable *rules_by_value;
 };
 
+/** Number of recipients the matchmaker has room for to begin with */
+#define INITIAL_MAX_RECIPIENTS 16
+
+static void
+atom_key_free (void *key)
+{
+  bus_atom_unref (key);
+}
+
 static void
 rule_list_free (DBusList **rules)
 {
@@ -1049,8 +1231,11 @@ rule_list_free (DBusList **rules)
       BusMatchRule *rule;
 
       rule = (*rules)->data;
+      _dbus_list_unlink (rules, &rule->matchmaker_link);
+      rule->matchmaker_link.data = NULL;
+      /* only done when the matchmaker goes away, with rules_by_value */
+      rule->value_link.data = NULL;
       bus_match_rule_unref (rule);
-      _dbus_list_remove_link (rules, *rules);
     }
 }
 
@@ -1067,126 +1252,334 @@ rule_list_ptr_free (DBusList **list)
     }
 }
 
-BusMatchmaker*
-bus_matchmaker_new (void)
+static void
+rule_set_clear (RuleSet *set)
 {
-  BusMatchmaker *matchmaker;
   int i;
 
-  matchmaker = dbus_new0 (BusMatchmaker, 1);
-  if (matchmaker == NULL)
-    return NULL;
+  for (i = 0; i < N_RULE_INDEXES; i++)
+    {
+      if (set->rules_by_key[i] != NULL)
+        {
+          _dbus_hash_table_unref (set->rules_by_key[i]);
+          set->rules_by_key[i] = NULL;
+        }
+    }
 
-  matchmaker->refcount = 1;
+  rule_list_free (&set->unindexed_rules);
+}
 
-  for (i = DBUS_MESSAGE_TYPE_INVALID; i < DBUS_NUM_MESSAGE_TYPES; i++)
+static void
+rule_set_ptr_free (RuleSet *set)
+{
+  /* NULL for the same reason as in rule_list_ptr_free() */
+  if (set != NULL)
     {
-      RulePool *p = matchmaker->rules_by_type + i;
+      rule_set_clear (set);
+      dbus_free (set);
+    }
+}
+
+static dbus_bool_t
+rule_set_is_empty (RuleSet *set)
+{
+  int i;
 
-      p->rules_by_iface = _dbus_hash_table_new (DBUS_HASH_STRING,
-          dbus_free, (DBusFreeFunction) rule_list_ptr_free);
+  if (set->unindexed_rules != NULL)
+    return FALSE;
 
-      if (p->rules_by_iface == NULL)
-        goto nomem;
+  for (i = 0; i < N_RULE_INDEXES; i++)
+    {
+      if (set->rules_by_key[i] != NULL &&
+          _dbus_hash_table_get_n_entries (set->rules_by_key[i]) > 0)
+        return FALSE;
     }
 
-  return matchmaker;
+  return TRUE;
+}
 
- nomem:
-  for (i = DBUS_MESSAGE_TYPE_INVALID; i < DBUS_NUM_MESSAGE_TYPES; i++)
+static RuleIndex
+match_rule_get_index (BusMatchRule  *rule,
+                      const char   **key)
+{
+  if (rule->flags & BUS_MATCH_PATH)
     {
-      RulePool *p = matchmaker->rules_by_type + i;
+      *key = rule->path;
+      return RULE_INDEX_PATH;
+    }
 
-      if (p->rules_by_iface == NULL)
-        break;
-      else
-        _dbus_hash_table_unref (p->rules_by_iface);
+  /* arg0path matches a whole namespace, so it can't be looked up by key */
+  if ((rule->flags & BUS_MATCH_ARGS) &&
+      rule->args_len > 0 &&
+      rule->args[0].value != NULL &&
+      (rule->args[0].len & BUS_MATCH_ARG_IS_PATH) == 0)
+    {
+      *key = rule->args[0].value;
+      return RULE_INDEX_ARG0;
     }
 
-  return NULL;
+  if (rule->flags & BUS_MATCH_SENDER)
+    {
+      *key = rule->sender;
+      return RULE_INDEX_SENDER;
+    }
+
+  if (rule->flags & BUS_MATCH_MEMBER)
+    {
+      *key = rule->member;
+      return RULE_INDEX_MEMBER;
+    }
+
+  *key = NULL;
+  return RULE_INDEX_NONE;
 }
 
 static DBusList **
-bus_matchmaker_get_rules (BusMatchmaker *matchmaker,
-                          int            message_type,
-                          const char    *interface,
-                          dbus_bool_t    create)
+rule_set_get_rules (RuleSet     *set,
+                    RuleIndex    index,
+                    const char  *key,
+                    dbus_bool_t  create)
 {
-  RulePool *p;
+  DBusHashTable *table;
+  DBusList **list;
 
-  _dbus_assert (message_type >= 0);
-  _dbus_assert (message_type < DBUS_NUM_MESSAGE_TYPES);
+  if (index == RULE_INDEX_NONE)
+    return &set->unindexed_rules;
 
-  _dbus_verbose ("Looking up rules for message_type %d, interface %s\n",
-                 message_type,
-                 interface != NULL ? interface : "<null>");
+  _dbus_assert (key != NULL);
 
-  p = matchmaker->rules_by_type + message_type;
+  table = set->rules_by_key[index];
 
-  if (interface == NULL)
+  if (table == NULL)
     {
-      return &p->rules_without_iface;
+      if (!create)
+        return NULL;
+
+      table = _dbus_hash_table_new_open_addressed (DBUS_HASH_UINTPTR,
+          atom_key_free, (DBusFreeFunction) rule_list_ptr_free);
+
+      if (table == NULL)
+        return NULL;
+
+      set->rules_by_key[index] = table;
+    }
+
+  /* every key comes from a rule, so it's an atom already */
+  list = _dbus_hash_table_lookup_uintptr (table, (uintptr_t) key);
+
+  if (list != NULL || !create)
+    return list;
+
+  list = dbus_new0 (DBusList *, 1);
+  if (list == NULL)
+    return NULL;
+
+  if (!_dbus_hash_table_insert_uintptr (table, (uintptr_t) key, list))
+    {
+      dbus_free (list);
+      return NULL;
+    }
+
+  bus_atom_ref (key);
+
+  return list;
+}
+
+/* Drops the list for the given key if it's empty, and the table holding
+ * it if that's empty too. The list may not exist at all if creating it
+ * ran out of memory.
+ */
+static void
+rule_set_gc_rules (RuleSet     *set,
+                   RuleIndex    index,
+                   const char  *key)
+{
+  DBusHashTable *table;
+  DBusList **list;
+
+  if (index == RULE_INDEX_NONE)
+    return;
+
+  table = set->rules_by_key[index];
+  if (table == NULL)
+    return;
+
+  list = _dbus_hash_table_lookup_uintptr (table, (uintptr_t) key);
+
+  if (list != NULL)
+    {
+      if (*list != NULL)
+        return;
+
+      _dbus_hash_table_remove_uintptr (table, (uintptr_t) key);
+    }
+
+  if (_dbus_hash_table_get_n_entries (table) == 0)
+    {
+      _dbus_hash_table_unref (table);
+      set->rules_by_key[index] = NULL;
+    }
+}
+
+BusMatchmaker*
+bus_matchmaker_new (void)
+{
+  BusMatchmaker *matchmaker;
+  int i;
+
+  matchmaker = dbus_new0 (BusMatchmaker, 1);
+  if (matchmaker == NULL)
+    return NULL;
+
+  matchmaker->refcount = 1;
+
+  for (i = DBUS_MESSAGE_TYPE_INVALID; i < DBUS_NUM_MESSAGE_TYPES; i++)
+    {
+      RulePool *p = matchmaker->rules_by_type + i;
+
+      p->rules_by_iface = _dbus_hash_table_new_open_addressed (DBUS_HASH_UINTPTR,
+          atom_key_free, (DBusFreeFunction) rule_set_ptr_free);
+
+      if (p->rules_by_iface == NULL)
+        goto nomem;
+    }
+
+  matchmaker->recipients = dbus_new (DBusConnection *, INITIAL_MAX_RECIPIENTS);
+  if (matchmaker->recipients == NULL)
+    goto nomem;
+  matchmaker->max_recipients = INITIAL_MAX_RECIPIENTS;
+
+  matchmaker->rules_by_value = _dbus_hash_table_new_open_addressed (DBUS_HASH_UINTPTR,
+                                                                    NULL, NULL);
+  if (matchmaker->rules_by_value == NULL)
+    goto nomem;
+
+  return matchmaker;
+
+ nomem:
+  dbus_free (matchmaker->recipients);
+
+  for (i = DBUS_MESSAGE_TYPE_INVALID; i < DBUS_NUM_MESSAGE_TYPES; i++)
+    {
+      RulePool *p = matchmaker->rules_by_type + i;
+
+      if (p->rules_by_iface == NULL)
+        break;
+      else
+        _dbus_hash_table_unref (p->rules_by_iface);
+    }
+
+  dbus_free (matchmaker);
+
+  return NULL;
+}
+
+/* interface must be an atom, or #NULL */
+static RuleSet *
+bus_matchmaker_get_rule_set (BusMatchmaker *matchmaker,
+                             int            message_type,
+                             const char    *interface,
+                             dbus_bool_t    create)
+{
+  RulePool *p;
+
+  _dbus_assert (message_type >= 0);
+  _dbus_assert (message_type < DBUS_NUM_MESSAGE_TYPES);
+
+  _dbus_verbose ("Looking up rules for message_type %d, interface %s\n",
+                 message_type,
+                 interface != NULL ? interface : "<null>");
+
+  p = matchmaker->rules_by_type + message_type;
+
+  if (interface == NULL)
+    {
+      return &p->rules_without_iface;
     }
   else
     {
-      DBusList **list;
+      RuleSet *set;
 
-      list = _dbus_hash_table_lookup_string (p->rules_by_iface, interface);
+      set = _dbus_hash_table_lookup_uintptr (p->rules_by_iface,
+                                             (uintptr_t) interface);
 
-      if (list == NULL && create)
+      if (set == NULL && create)
         {
-          char *dupped_interface;
-
-          list = dbus_new0 (DBusList *, 1);
-          if (list == NULL)
+          set = dbus_new0 (RuleSet, 1);
+          if (set == NULL)
             return NULL;
 
-          dupped_interface = _dbus_strdup (interface);
-          if (dupped_interface == NULL)
-            {
-              dbus_free (list);
-              return NULL;
-            }
+          _dbus_verbose ("Adding rule set for type %d, iface %s\n",
+                         message_type, interface);
 
-          _dbus_verbose ("Adding list for type %d, iface %s\n", message_type,
-                         interface);
-
-          if (!_dbus_hash_table_insert_string (p->rules_by_iface,
-                                               dupped_interface, list))
+          if (!_dbus_hash_table_insert_uintptr (p->rules_by_iface,
+                                                (uintptr_t) bus_atom_ref (interface),
+                                                set))
             {
-              dbus_free (list);
-              dbus_free (dupped_interface);
+              dbus_free (set);
+              bus_atom_unref (interface);
               return NULL;
             }
         }
 
-      return list;
+      return set;
     }
 }
 
 static void
 bus_matchmaker_gc_rules (BusMatchmaker *matchmaker,
-                         int            message_type,
-                         const char    *interface,
-                         DBusList     **rules)
+                         BusMatchRule  *rule)
 {
   RulePool *p;
+  RuleSet *set;
+  RuleIndex index;
+  const char *key;
 
-  if (interface == NULL)
+  set = bus_matchmaker_get_rule_set (matchmaker, rule->message_type,
+                                     rule->interface, FALSE);
+  if (set == NULL)
     return;
 
-  if (*rules != NULL)
+  index = match_rule_get_index (rule, &key);
+  rule_set_gc_rules (set, index, key);
+
+  if (rule->interface == NULL || !rule_set_is_empty (set))
     return;
 
   _dbus_verbose ("GCing HT entry for message_type %u, interface %s\n",
-                 message_type, interface);
+                 rule->message_type, rule->interface);
 
-  p = matchmaker->rules_by_type + message_type;
+  p = matchmaker->rules_by_type + rule->message_type;
+
+  _dbus_hash_table_remove_uintptr (p->rules_by_iface,
+                                   (uintptr_t) rule->interface);
+}
+
+/* Returns the list in which the given rule is (or would be) kept. If
+ * create is TRUE, returns NULL only on OOM.
+ */
+static DBusList **
+bus_matchmaker_get_rules (BusMatchmaker *matchmaker,
+                          BusMatchRule  *rule,
+                          dbus_bool_t    create)
+{
+  RuleSet *set;
+  DBusList **rules;
+  RuleIndex index;
+  const char *key;
+
+  set = bus_matchmaker_get_rule_set (matchmaker, rule->message_type,
+                                     rule->interface, create);
+  if (set == NULL)
+    return NULL;
+
+  index = match_rule_get_index (rule, &key);
+  rules = rule_set_get_rules (set, index, key, create);
 
-  _dbus_assert (_dbus_hash_table_lookup_string (p->rules_by_iface, interface)
-      == rules);
+  if (rules == NULL && create)
+    bus_matchmaker_gc_rules (matchmaker, rule);
 
-  _dbus_hash_table_remove_string (p->rules_by_iface, interface);
+  return rules;
 }
 
 BusMatchmaker *
@@ -1214,13 +1607,278 @@ bus_matchmaker_unref (BusMatchmaker *matchmaker)
           RulePool *p = matchmaker->rules_by_type + i;
 
           _dbus_hash_table_unref (p->rules_by_iface);
-          rule_list_free (&p->rules_without_iface);
+          rule_set_clear (&p->rules_without_iface);
+        }
+
+      _dbus_hash_table_unref (matchmaker->rules_by_value);
+
+      _dbus_assert (!matchmaker->recipients_in_use);
+      dbus_free (matchmaker->recipients);
+
+      for (i = 0; i < N_PARSED_RULES; i++)
+        {
+          ParsedRule *parsed = matchmaker->parsed_rules + i;
+
+          dbus_free (parsed->text);
+          if (parsed->rule != NULL)
+            bus_match_rule_unref (parsed->rule);
         }
 
       dbus_free (matchmaker);
     }
 }
 
+static ParsedRule *
+parsed_rule_slot (BusMatchmaker *matchmaker,
+                  const char    *text)
+{
+  const unsigned char *p;
+  unsigned int h;
+
+  /* FNV-1a */
+  h = 2166136261u;
+  for (p = (const unsigned char *) text; *p != '\0'; p++)
+    {
+      h ^= *p;
+      h *= 16777619u;
+    }
+
+  return matchmaker->parsed_rules + (h % N_PARSED_RULES);
+}
+
+/**
+ * Parses a rule as bus_match_rule_parse() does, but gives back a copy
+ * of an earlier rule with the same text if the matchmaker still has
+ * it. Many clients ask for byte-identical rules, and copying one is
+ * much cheaper than tokenizing it again.
+ *
+ * @param matchmaker the matchmaker
+ * @param matches_go_to the connection the rule is for
+ * @param rule_text the text of the rule
+ * @param error return location for an error
+ * @returns the new rule, or #NULL with error set
+ */
+BusMatchRule*
+bus_matchmaker_parse_rule (BusMatchmaker    *matchmaker,
+                           DBusConnection   *matches_go_to,
+                           const DBusString *rule_text,
+                           DBusError        *error)
+{
+  ParsedRule *parsed;
+  BusMatchRule *rule;
+  BusMatchRule *cached;
+  const char *text;
+  char *text_copy;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  text = _dbus_string_get_const_data (rule_text);
+
+  /* the text may have embedded nul bytes, which the cache can't tell
+   * apart, so those always get parsed (and rejected)
+   */
+  if (strlen (text) != (size_t) _dbus_string_get_length (rule_text))
+    return bus_match_rule_parse (matches_go_to, rule_text, error);
+
+  parsed = parsed_rule_slot (matchmaker, text);
+  if (parsed->rule != NULL && strcmp (parsed->text, text) == 0)
+    {
+      rule = match_rule_copy (parsed->rule, matches_go_to);
+      if (rule == NULL)
+        BUS_SET_OOM (error);
+
+      return rule;
+    }
+
+  rule = bus_match_rule_parse (matches_go_to, rule_text, error);
+  if (rule == NULL)
+    return NULL;
+
+  /* Caching is only an optimization, so running out of memory for it
+   * doesn't fail the parse
+   */
+  cached = match_rule_copy (rule, NULL);
+  text_copy = _dbus_strdup (text);
+  if (cached == NULL || text_copy == NULL)
+    {
+      if (cached != NULL)
+        bus_match_rule_unref (cached);
+      dbus_free (text_copy);
+      return rule;
+    }
+
+  dbus_free (parsed->text);
+  if (parsed->rule != NULL)
+    bus_match_rule_unref (parsed->rule);
+
+  parsed->text = text_copy;
+  parsed->rule = cached;
+
+  return rule;
+}
+
+static dbus_bool_t match_rule_equal_ignoring_owner (BusMatchRule *a,
+                                                    BusMatchRule *b);
+static dbus_bool_t match_rule_equal (BusMatchRule *a,
+                                     BusMatchRule *b);
+
+static uintptr_t
+hash_mix (uintptr_t   h,
+          const void *p)
+{
+  h ^= (uintptr_t) p;
+  h *= 16777619u;
+  return h ^ (h >> 15);
+}
+
+/* Hashes exactly what match_rule_equal() compares. Since the strings
+ * are atoms, their addresses stand in for their text, and two rules
+ * that parse the same hash the same however the text was written.
+ */
+static uintptr_t
+match_rule_hash (BusMatchRule *rule)
+{
+  uintptr_t h;
+  int i;
+
+  h = hash_mix (2166136261u, rule->matches_go_to);
+  h = hash_mix (h, (void *) (uintptr_t) rule->flags);
+
+  if (rule->flags & BUS_MATCH_MESSAGE_TYPE)
+    h = hash_mix (h, (void *) (uintptr_t) rule->message_type);
+  if (rule->flags & BUS_MATCH_MEMBER)
+    h = hash_mix (h, rule->member);
+  if (rule->flags & BUS_MATCH_PATH)
+    h = hash_mix (h, rule->path);
+  if (rule->flags & BUS_MATCH_INTERFACE)
+    h = hash_mix (h, rule->interface);
+  if (rule->flags & BUS_MATCH_SENDER)
+    h = hash_mix (h, rule->sender);
+  if (rule->flags & BUS_MATCH_DESTINATION)
+    h = hash_mix (h, rule->destination);
+
+  if (rule->flags & BUS_MATCH_ARGS)
+    {
+      for (i = 0; i < rule->args_len; i++)
+        {
+          h = hash_mix (h, rule->args[i].value);
+          h = hash_mix (h, (void *) (uintptr_t) rule->args[i].len);
+        }
+    }
+
+  return h;
+}
+
+/* Finds the most recently added rule that's equal to value, owner and
+ * all, or returns #NULL
+ */
+static BusMatchRule *
+rule_index_lookup (BusMatchmaker *matchmaker,
+                   BusMatchRule  *value)
+{
+  DBusList *chain;
+  DBusList *link;
+
+  chain = _dbus_hash_table_lookup_uintptr (matchmaker->rules_by_value,
+                                           match_rule_hash (value));
+
+  for (link = _dbus_list_get_last_link (&chain);
+       link != NULL;
+       link = _dbus_list_get_prev_link (&chain, link))
+    {
+      if (match_rule_equal (link->data, value))
+        return link->data;
+    }
+
+  return NULL;
+}
+
+/* Fails only for lack of memory, if the hash is new to the table */
+static dbus_bool_t
+rule_index_add (BusMatchmaker *matchmaker,
+                BusMatchRule  *rule)
+{
+  DBusList *chain;
+  uintptr_t h;
+
+  _dbus_assert (rule->value_link.data == NULL);
+
+  h = match_rule_hash (rule);
+  chain = _dbus_hash_table_lookup_uintptr (matchmaker->rules_by_value, h);
+
+  rule->value_link.data = rule;
+  _dbus_list_append_link (&chain, &rule->value_link);
+
+  if (!_dbus_hash_table_insert_uintptr (matchmaker->rules_by_value, h, chain))
+    {
+      _dbus_list_unlink (&chain, &rule->value_link);
+      rule->value_link.data = NULL;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+rule_index_remove (BusMatchmaker *matchmaker,
+                   BusMatchRule  *rule)
+{
+  DBusList *chain;
+  uintptr_t h;
+
+  _dbus_assert (rule->value_link.data == rule);
+
+  h = match_rule_hash (rule);
+  chain = _dbus_hash_table_lookup_uintptr (matchmaker->rules_by_value, h);
+
+  _dbus_list_unlink (&chain, &rule->value_link);
+  rule->value_link.data = NULL;
+
+  /* the entry is already there, so replacing its chain can't fail */
+  if (chain == NULL)
+    _dbus_hash_table_remove_uintptr (matchmaker->rules_by_value, h);
+  else
+    _dbus_hash_table_insert_uintptr (matchmaker->rules_by_value, h, chain);
+}
+
+/* Files a rule right after the last one that's the same but for its
+ * owner, so that get_recipients_from_list() evaluates each group of
+ * identical rules only once.
+ */
+static void
+rule_list_add (DBusList     **rules,
+               BusMatchRule  *rule)
+{
+  DBusList *link;
+
+  _dbus_assert (rule->matchmaker_link.data == NULL);
+
+  rule->matchmaker_link.data = rule;
+
+  for (link = _dbus_list_get_last_link (rules);
+       link != NULL;
+       link = _dbus_list_get_prev_link (rules, link))
+    {
+      if (match_rule_equal_ignoring_owner (link->data, rule))
+        break;
+    }
+
+  if (link != NULL)
+    _dbus_list_insert_after_link (rules, link, &rule->matchmaker_link);
+  else
+    _dbus_list_append_link (rules, &rule->matchmaker_link);
+}
+
+static void
+rule_list_remove (DBusList     **rules,
+                  BusMatchRule  *rule)
+{
+  _dbus_assert (rule->matchmaker_link.data == rule);
+
+  _dbus_list_unlink (rules, &rule->matchmaker_link);
+  rule->matchmaker_link.data = NULL;
+}
+
 /* The rule can't be modified after it's added. */
 dbus_bool_t
 bus_matchmaker_add_rule (BusMatchmaker   *matchmaker,
@@ -1234,23 +1892,24 @@ bus_matchmaker_add_rule (BusMatchmaker   *matchmaker,
                  rule->message_type,
                  rule->interface != NULL ? rule->interface : "<null>");
 
-  rules = bus_matchmaker_get_rules (matchmaker, rule->message_type,
-                                    rule->interface, TRUE);
+  rules = bus_matchmaker_get_rules (matchmaker, rule, TRUE);
 
   if (rules == NULL)
     return FALSE;
 
-  if (!_dbus_list_append (rules, rule))
-    return FALSE;
-
-  if (!bus_connection_add_match_rule (rule->matches_go_to, rule))
+  if (!rule_index_add (matchmaker, rule))
     {
-      _dbus_list_remove_last (rules, rule);
-      bus_matchmaker_gc_rules (matchmaker, rule->message_type,
-                               rule->interface, rules);
+      bus_matchmaker_gc_rules (matchmaker, rule);
       return FALSE;
     }
 
+  rule_list_add (rules, rule);
+
+  _dbus_assert (rule->connection_link.data == NULL);
+  rule->connection_link.data = rule;
+  bus_connection_add_match_rule_link (rule->matches_go_to,
+                                      &rule->connection_link);
+
   bus_match_rule_ref (rule);
 
 #ifdef DBUS_ENABLE_VERBOSE_MODE
@@ -1266,38 +1925,36 @@ bus_matchmaker_add_rule (BusMatchmaker   *matchmaker,
   return TRUE;
 }
 
+/* Whether a and b match exactly the same messages, whoever they're for */
 static dbus_bool_t
-match_rule_equal (BusMatchRule *a,
-                  BusMatchRule *b)
+match_rule_equal_ignoring_owner (BusMatchRule *a,
+                                 BusMatchRule *b)
 {
   if (a->flags != b->flags)
     return FALSE;
 
-  if (a->matches_go_to != b->matches_go_to)
-    return FALSE;
-
   if ((a->flags & BUS_MATCH_MESSAGE_TYPE) &&
       a->message_type != b->message_type)
     return FALSE;
 
   if ((a->flags & BUS_MATCH_MEMBER) &&
-      strcmp (a->member, b->member) != 0)
+      a->member != b->member)
     return FALSE;
 
   if ((a->flags & BUS_MATCH_PATH) &&
-      strcmp (a->path, b->path) != 0)
+      a->path != b->path)
     return FALSE;
   
   if ((a->flags & BUS_MATCH_INTERFACE) &&
-      strcmp (a->interface, b->interface) != 0)
+      a->interface != b->interface)
     return FALSE;
 
   if ((a->flags & BUS_MATCH_SENDER) &&
-      strcmp (a->sender, b->sender) != 0)
+      a->sender != b->sender)
     return FALSE;
 
   if ((a->flags & BUS_MATCH_DESTINATION) &&
-      strcmp (a->destination, b->destination) != 0)
+      a->destination != b->destination)
     return FALSE;
 
   if (a->flags & BUS_MATCH_ARGS)
@@ -1307,41 +1964,39 @@ match_rule_equal (BusMatchRule *a,
       if (a->args_len != b->args_len)
         return FALSE;
       
-      i = 0;
-      while (i < a->args_len)
+      for (i = 0; i < a->args_len; i++)
         {
-          int length;
-
-          if ((a->args[i] != NULL) != (b->args[i] != NULL))
-            return FALSE;
-
-          if (a->arg_lens[i] != b->arg_lens[i])
+          if (a->args[i].value != b->args[i].value ||
+              a->args[i].len != b->args[i].len)
             return FALSE;
-
-          length = a->arg_lens[i] & ~BUS_MATCH_ARG_IS_PATH;
-
-          if (a->args[i] != NULL)
-            {
-              _dbus_assert (b->args[i] != NULL);
-              if (memcmp (a->args[i], b->args[i], length) != 0)
-                return FALSE;
-            }
-          
-          ++i;
         }
     }
   
   return TRUE;
 }
 
+static dbus_bool_t
+match_rule_equal (BusMatchRule *a,
+                  BusMatchRule *b)
+{
+  return a->matches_go_to == b->matches_go_to &&
+    match_rule_equal_ignoring_owner (a, b);
+}
+
 static void
-bus_matchmaker_remove_rule_link (DBusList       **rules,
+bus_matchmaker_remove_rule_link (BusMatchmaker   *matchmaker,
+                                 DBusList       **rules,
                                  DBusList        *link)
 {
   BusMatchRule *rule = link->data;
+
+  _dbus_assert (&rule->matchmaker_link == link);
   
-  bus_connection_remove_match_rule (rule->matches_go_to, rule);
-  _dbus_list_remove_link (rules, link);
+  bus_connection_remove_match_rule_link (rule->matches_go_to,
+                                         &rule->connection_link);
+  rule->connection_link.data = NULL;
+  rule_index_remove (matchmaker, rule);
+  rule_list_remove (rules, rule);
 
 #ifdef DBUS_ENABLE_VERBOSE_MODE
   {
@@ -1366,19 +2021,20 @@ bus_matchmaker_remove_rule (BusMatchmaker   *matchmaker,
                  rule->message_type,
                  rule->interface != NULL ? rule->interface : "<null>");
 
-  bus_connection_remove_match_rule (rule->matches_go_to, rule);
+  bus_connection_remove_match_rule_link (rule->matches_go_to,
+                                         &rule->connection_link);
+  rule->connection_link.data = NULL;
 
-  rules = bus_matchmaker_get_rules (matchmaker, rule->message_type,
-                                    rule->interface, FALSE);
+  rules = bus_matchmaker_get_rules (matchmaker, rule, FALSE);
 
   /* We should only be asked to remove a rule by identity right after it was
    * added, so there should be a list for it.
    */
   _dbus_assert (rules != NULL);
 
-  _dbus_list_remove (rules, rule);
-  bus_matchmaker_gc_rules (matchmaker, rule->message_type, rule->interface,
-      rules);
+  rule_index_remove (matchmaker, rule);
+  rule_list_remove (rules, rule);
+  bus_matchmaker_gc_rules (matchmaker, rule);
 
 #ifdef DBUS_ENABLE_VERBOSE_MODE
   {
@@ -1393,62 +2049,45 @@ bus_matchmaker_remove_rule (BusMatchmaker   *matchmaker,
   bus_match_rule_unref (rule);
 }
 
-/* Remove a single rule which is equal to the given rule by value */
+/* Remove a single rule which is equal to the given rule by value; of
+ * several identical rules, the most recently added one goes first
+ */
 dbus_bool_t
 bus_matchmaker_remove_rule_by_value (BusMatchmaker   *matchmaker,
                                      BusMatchRule    *value,
                                      DBusError       *error)
 {
   DBusList **rules;
-  DBusList *link = NULL;
+  BusMatchRule *rule;
 
   _dbus_verbose ("Removing rule by value with message_type %d, interface %s\n",
                  value->message_type,
                  value->interface != NULL ? value->interface : "<null>");
 
-  rules = bus_matchmaker_get_rules (matchmaker, value->message_type,
-      value->interface, FALSE);
-
-  if (rules != NULL)
-    {
-      /* we traverse backward because bus_connection_remove_match_rule()
-       * removes the most-recently-added rule
-       */
-      link = _dbus_list_get_last_link (rules);
-      while (link != NULL)
-        {
-          BusMatchRule *rule;
-          DBusList *prev;
-
-          rule = link->data;
-          prev = _dbus_list_get_prev_link (rules, link);
-
-          if (match_rule_equal (rule, value))
-            {
-              bus_matchmaker_remove_rule_link (rules, link);
-              break;
-            }
-
-          link = prev;
-        }
-    }
-
-  if (link == NULL)
+  rule = rule_index_lookup (matchmaker, value);
+  if (rule == NULL)
     {
       dbus_set_error (error, DBUS_ERROR_MATCH_RULE_NOT_FOUND,
                       "The given match rule wasn't found and can't be removed");
       return FALSE;
     }
 
-  bus_matchmaker_gc_rules (matchmaker, value->message_type, value->interface,
-      rules);
+  rules = bus_matchmaker_get_rules (matchmaker, rule, FALSE);
+  _dbus_assert (rules != NULL);
+
+  bus_matchmaker_remove_rule_link (matchmaker, rules, &rule->matchmaker_link);
+  bus_matchmaker_gc_rules (matchmaker, value);
 
   return TRUE;
 }
 
+/* Removes the rules sending messages to or from a unique name, given
+ * as an atom, since that name will never be recycled
+ */
 static void
-rule_list_remove_by_connection (DBusList       **rules,
-                                DBusConnection  *connection)
+rule_list_remove_by_unique_name (BusMatchmaker  *matchmaker,
+                                 DBusList      **rules,
+                                 const char     *name)
 {
   DBusList *link;
 
@@ -1461,32 +2100,46 @@ rule_list_remove_by_connection (DBusList       **rules,
       rule = link->data;
       next = _dbus_list_get_next_link (rules, link);
 
-      if (rule->matches_go_to == connection)
-        {
-          bus_matchmaker_remove_rule_link (rules, link);
-        }
-      else if (((rule->flags & BUS_MATCH_SENDER) && *rule->sender == ':') ||
-               ((rule->flags & BUS_MATCH_DESTINATION) && *rule->destination == ':'))
+      if (((rule->flags & BUS_MATCH_SENDER) && rule->sender == name) ||
+          ((rule->flags & BUS_MATCH_DESTINATION) && rule->destination == name))
+        bus_matchmaker_remove_rule_link (matchmaker, rules, link);
+
+      link = next;
+    }
+}
+
+static void
+rule_set_remove_by_unique_name (BusMatchmaker *matchmaker,
+                                RuleSet       *set,
+                                const char    *name)
+{
+  int i;
+
+  rule_list_remove_by_unique_name (matchmaker, &set->unindexed_rules, name);
+
+  for (i = 0; i < N_RULE_INDEXES; i++)
+    {
+      DBusHashIter iter;
+
+      if (set->rules_by_key[i] == NULL)
+        continue;
+
+      _dbus_hash_iter_init (set->rules_by_key[i], &iter);
+      while (_dbus_hash_iter_next (&iter))
         {
-          /* The rule matches to/from a base service, see if it's the
-           * one being disconnected, since we know this service name
-           * will never be recycled.
-           */
-          const char *name;
+          DBusList **items = _dbus_hash_iter_get_value (&iter);
 
-          name = bus_connection_get_name (connection);
-          _dbus_assert (name != NULL); /* because we're an active connection */
+          rule_list_remove_by_unique_name (matchmaker, items, name);
 
-          if (((rule->flags & BUS_MATCH_SENDER) &&
-               strcmp (rule->sender, name) == 0) ||
-              ((rule->flags & BUS_MATCH_DESTINATION) &&
-               strcmp (rule->destination, name) == 0))
-            {
-              bus_matchmaker_remove_rule_link (rules, link);
-            }
+          if (*items == NULL)
+            _dbus_hash_iter_remove_entry (&iter);
         }
 
-      link = next;
+      if (_dbus_hash_table_get_n_entries (set->rules_by_key[i]) == 0)
+        {
+          _dbus_hash_table_unref (set->rules_by_key[i]);
+          set->rules_by_key[i] = NULL;
+        }
     }
 }
 
@@ -1494,35 +2147,61 @@ void
 bus_matchmaker_disconnected (BusMatchmaker   *matchmaker,
                              DBusConnection  *connection)
 {
+  DBusList **own_rules;
+  BusMatchRule *rule;
+  const char *name;
   int i;
 
-  /* FIXME
-   *
-   * This scans all match rules on the bus. We could avoid that
-   * for the rules belonging to the connection, since we keep
-   * a list of those; but for the rules that just refer to
-   * the connection we'd need to do something more elaborate.
-   */
-
   _dbus_assert (bus_connection_is_active (connection));
 
   _dbus_verbose ("Removing all rules for connection %p\n", connection);
 
+  /* The connection's own rules each know their link, so removing them
+   * costs nothing in the number of other rules on the bus
+   */
+  own_rules = bus_connection_get_match_rules (connection);
+  while ((rule = _dbus_list_get_last (own_rules)) != NULL)
+    {
+      DBusList **rules;
+
+      rules = bus_matchmaker_get_rules (matchmaker, rule, FALSE);
+      _dbus_assert (rules != NULL);
+
+      /* keep the rule alive long enough to find its list's key for gc */
+      bus_match_rule_ref (rule);
+      bus_matchmaker_remove_rule_link (matchmaker, rules, &rule->matchmaker_link);
+      bus_matchmaker_gc_rules (matchmaker, rule);
+      bus_match_rule_unref (rule);
+    }
+
+  /* Other connections' rules may name this connection's unique name
+   * as sender or destination, and these are never going to match
+   * again since unique names aren't reused. Finding them means looking
+   * at every rule, but if there's no atom for the name then no rule
+   * mentions it.
+   */
+  name = bus_connection_get_name (connection);
+  _dbus_assert (name != NULL); /* because we're an active connection */
+
+  name = bus_atom_lookup (name);
+  if (name == NULL)
+    return;
+
   for (i = DBUS_MESSAGE_TYPE_INVALID; i < DBUS_NUM_MESSAGE_TYPES; i++)
     {
       RulePool *p = matchmaker->rules_by_type + i;
       DBusHashIter iter;
 
-      rule_list_remove_by_connection (&p->rules_without_iface, connection);
+      rule_set_remove_by_unique_name (matchmaker, &p->rules_without_iface, name);
 
       _dbus_hash_iter_init (p->rules_by_iface, &iter);
       while (_dbus_hash_iter_next (&iter))
         {
-          DBusList **items = _dbus_hash_iter_get_value (&iter);
+          RuleSet *set = _dbus_hash_iter_get_value (&iter);
 
-          rule_list_remove_by_connection (items, connection);
+          rule_set_remove_by_unique_name (matchmaker, set, name);
 
-          if (*items == NULL)
+          if (rule_set_is_empty (set))
             _dbus_hash_iter_remove_entry (&iter);
         }
     }
@@ -1549,12 +2228,125 @@ connection_is_primary_owner (DBusConnection *connection,
   return bus_service_get_primary_owners_connection (service) == connection;
 }
 
+/** How many leading arguments of a message are decoded for argN rules */
+#define N_DECODED_ARGS 8
+
+/* The header fields of a message that rules compare against, as atoms.
+ * A field is #NULL if the message doesn't have it, or if no atom exists
+ * for it; either way no rule can ask for that value.
+ *
+ * The first few arguments are decoded at most once, when the first
+ * rule that needs them is looked at, rather than once per rule.
+ */
+typedef struct
+{
+  const char *interface;
+  const char *member;
+  const char *path;
+  const char *arg0;
+  dbus_bool_t arg0_checked; /**< Whether arg0 was looked up yet */
+
+  dbus_bool_t args_decoded; /**< Whether args and arg_lens are filled in */
+  const char *args[N_DECODED_ARGS]; /**< String arguments, #NULL for other types */
+  int arg_lens[N_DECODED_ARGS];
+} MessageAtoms;
+
+static void
+message_atoms_init (MessageAtoms *atoms,
+                    DBusMessage  *message)
+{
+  atoms->interface = bus_atom_lookup (dbus_message_get_interface (message));
+  atoms->member = bus_atom_lookup (dbus_message_get_member (message));
+  atoms->path = bus_atom_lookup (dbus_message_get_path (message));
+  atoms->arg0 = NULL;
+  atoms->arg0_checked = FALSE;
+  atoms->args_decoded = FALSE;
+}
+
+static void
+message_atoms_decode_args (MessageAtoms *atoms,
+                           DBusMessage  *message)
+{
+  DBusMessageIter iter;
+  int i;
+
+  if (atoms->args_decoded)
+    return;
+
+  dbus_message_iter_init (message, &iter);
+
+  for (i = 0; i < N_DECODED_ARGS; i++)
+    {
+      int current_type;
+
+      atoms->args[i] = NULL;
+      atoms->arg_lens[i] = 0;
+
+      current_type = dbus_message_iter_get_arg_type (&iter);
+
+      if (current_type == DBUS_TYPE_STRING)
+        {
+          dbus_message_iter_get_basic (&iter, &atoms->args[i]);
+          _dbus_assert (atoms->args[i] != NULL);
+          atoms->arg_lens[i] = strlen (atoms->args[i]);
+        }
+
+      if (current_type != DBUS_TYPE_INVALID)
+        dbus_message_iter_next (&iter);
+    }
+
+  atoms->args_decoded = TRUE;
+}
+
+/* Whether the given string argument, or #NULL if the message's argument
+ * isn't a string, satisfies the rule's constraint on argument i
+ */
+static dbus_bool_t
+match_rule_arg_matches (BusMatchRule *rule,
+                        int           i,
+                        const char   *actual_arg,
+                        int           actual_length)
+{
+  const char *expected_arg;
+  int expected_length;
+
+  expected_arg = rule->args[i].value;
+  expected_length = rule->args[i].len & ~BUS_MATCH_ARG_IS_PATH;
+
+  if (actual_arg == NULL)
+    return FALSE;
+
+  if (rule->args[i].len & BUS_MATCH_ARG_IS_PATH)
+    {
+      if (actual_length < expected_length &&
+          actual_arg[actual_length - 1] != '/')
+        return FALSE;
+
+      if (expected_length < actual_length &&
+          expected_arg[expected_length - 1] != '/')
+        return FALSE;
+
+      if (memcmp (actual_arg, expected_arg,
+                  MIN (actual_length, expected_length)) != 0)
+        return FALSE;
+    }
+  else
+    {
+      if (expected_length != actual_length ||
+          memcmp (expected_arg, actual_arg, expected_length) != 0)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
 static dbus_bool_t
-match_rule_matches (BusMatchRule    *rule,
-                    DBusConnection  *sender,
-                    DBusConnection  *addressed_recipient,
-                    DBusMessage     *message,
-                    BusMatchFlags    already_matched)
+match_rule_matches (BusMatchRule       *rule,
+                    DBusConnection     *sender,
+                    DBusConnection     *addressed_recipient,
+                    DBusMessage        *message,
+                    MessageAtoms       *atoms,
+                    BusMatchFlags       already_matched)
 {
   int flags;
 
@@ -1580,29 +2372,17 @@ match_rule_matches (BusMatchRule    *rule,
 
   if (flags & BUS_MATCH_INTERFACE)
     {
-      const char *iface;
-
       _dbus_assert (rule->interface != NULL);
 
-      iface = dbus_message_get_interface (message);
-      if (iface == NULL)
-        return FALSE;
-
-      if (strcmp (iface, rule->interface) != 0)
+      if (atoms->interface != rule->interface)
         return FALSE;
     }
 
   if (flags & BUS_MATCH_MEMBER)
     {
-      const char *member;
-
       _dbus_assert (rule->member != NULL);
 
-      member = dbus_message_get_member (message);
-      if (member == NULL)
-        return FALSE;
-
-      if (strcmp (member, rule->member) != 0)
+      if (atoms->member != rule->member)
         return FALSE;
     }
 
@@ -1648,104 +2428,121 @@ match_rule_matches (BusMatchRule    *rule,
 
   if (flags & BUS_MATCH_PATH)
     {
-      const char *path;
-
       _dbus_assert (rule->path != NULL);
 
-      path = dbus_message_get_path (message);
-      if (path == NULL)
-        return FALSE;
-
-      if (strcmp (path, rule->path) != 0)
+      if (atoms->path != rule->path)
         return FALSE;
     }
 
   if (flags & BUS_MATCH_ARGS)
     {
       int i;
-      DBusMessageIter iter;
       
       _dbus_assert (rule->args != NULL);
 
-      dbus_message_iter_init (message, &iter);
-      
-      i = 0;
-      while (i < rule->args_len)
+      if (rule->args_len <= N_DECODED_ARGS)
         {
-          int current_type;
-          const char *expected_arg;
-          int expected_length;
-          dbus_bool_t is_path;
+          message_atoms_decode_args (atoms, message);
 
-          expected_arg = rule->args[i];
-          expected_length = rule->arg_lens[i] & ~BUS_MATCH_ARG_IS_PATH;
-          is_path = (rule->arg_lens[i] & BUS_MATCH_ARG_IS_PATH) != 0;
-          
-          current_type = dbus_message_iter_get_arg_type (&iter);
-
-          if (expected_arg != NULL)
+          for (i = 0; i < rule->args_len; i++)
             {
-              const char *actual_arg;
-              int actual_length;
-              
-              if (current_type != DBUS_TYPE_STRING)
+              if (rule->args[i].value != NULL &&
+                  !match_rule_arg_matches (rule, i, atoms->args[i],
+                                           atoms->arg_lens[i]))
                 return FALSE;
+            }
+        }
+      else
+        {
+          /* Past the decoded ones, only look at the arguments the
+           * rule asks about, going straight to each
+           */
+          for (i = 0; i < rule->args_len; i++)
+            {
+              DBusMessageIter iter;
+              const char *actual_arg;
 
-              actual_arg = NULL;
-              dbus_message_iter_get_basic (&iter, &actual_arg);
-              _dbus_assert (actual_arg != NULL);
-
-              actual_length = strlen (actual_arg);
-
-              if (is_path)
-                {
-                  if (actual_length < expected_length &&
-                      actual_arg[actual_length - 1] != '/')
-                    return FALSE;
-
-                  if (expected_length < actual_length &&
-                      expected_arg[expected_length - 1] != '/')
-                    return FALSE;
+              if (rule->args[i].value == NULL)
+                continue;
 
-                  if (memcmp (actual_arg, expected_arg,
-                              MIN (actual_length, expected_length)) != 0)
-                    return FALSE;
-                }
-              else
+              actual_arg = NULL;
+              if (dbus_message_iter_init_at (message, &iter, i) &&
+                  dbus_message_iter_get_arg_type (&iter) == DBUS_TYPE_STRING)
                 {
-                  if (expected_length != actual_length ||
-                      memcmp (expected_arg, actual_arg, expected_length) != 0)
-                    return FALSE;
+                  dbus_message_iter_get_basic (&iter, &actual_arg);
+                  _dbus_assert (actual_arg != NULL);
                 }
 
+              if (!match_rule_arg_matches (rule, i, actual_arg,
+                                           actual_arg != NULL ?
+                                           strlen (actual_arg) : 0))
+                return FALSE;
             }
-          
-          if (current_type != DBUS_TYPE_INVALID)
-            dbus_message_iter_next (&iter);
-
-          ++i;
         }
     }
   
   return TRUE;
 }
 
+/* A growable array of the connections a message goes to */
+typedef struct
+{
+  DBusConnection **connections;
+  int n_connections;
+  int max_connections;
+} Recipients;
+
 static dbus_bool_t
-get_recipients_from_list (DBusList       **rules,
-                          DBusConnection  *sender,
-                          DBusConnection  *addressed_recipient,
-                          DBusMessage     *message,
-                          DBusList       **recipients_p)
+recipients_append (Recipients     *recipients,
+                   DBusConnection *connection)
+{
+  if (recipients->n_connections == recipients->max_connections)
+    {
+      DBusConnection **connections;
+      int new_max;
+
+      new_max = recipients->max_connections > 0 ?
+        recipients->max_connections * 2 : INITIAL_MAX_RECIPIENTS;
+
+      connections = dbus_realloc (recipients->connections,
+                                  new_max * sizeof (DBusConnection *));
+      if (connections == NULL)
+        return FALSE;
+
+      recipients->connections = connections;
+      recipients->max_connections = new_max;
+    }
+
+  recipients->connections[recipients->n_connections] = connection;
+  recipients->n_connections += 1;
+
+  return TRUE;
+}
+
+static dbus_bool_t
+get_recipients_from_list (DBusList          **rules,
+                          DBusConnection     *sender,
+                          DBusConnection     *addressed_recipient,
+                          DBusMessage        *message,
+                          MessageAtoms       *atoms,
+                          BusMatchFlags       already_matched,
+                          Recipients         *recipients)
 {
   DBusList *link;
+  BusMatchRule *previous;
+  dbus_bool_t previous_matched;
 
   if (rules == NULL)
     return TRUE;
 
+  previous = NULL;
+  previous_matched = FALSE;
+
   link = _dbus_list_get_first_link (rules);
   while (link != NULL)
     {
       BusMatchRule *rule;
+      dbus_bool_t matched;
 
       rule = link->data;
 
@@ -1759,16 +2556,31 @@ get_recipients_from_list (DBusList       **rules,
       }
 #endif
 
-      if (match_rule_matches (rule,
-                              sender, addressed_recipient, message,
-                              BUS_MATCH_MESSAGE_TYPE | BUS_MATCH_INTERFACE))
+      /* Identical rules are kept together, see rule_list_add(), and
+       * whether one matches doesn't depend on who it's for
+       */
+      if (previous != NULL && match_rule_equal_ignoring_owner (rule, previous))
+        {
+          matched = previous_matched;
+        }
+      else
+        {
+          matched = match_rule_matches (rule,
+                                        sender, addressed_recipient, message, atoms,
+                                        BUS_MATCH_MESSAGE_TYPE | BUS_MATCH_INTERFACE |
+                                        already_matched);
+          previous = rule;
+          previous_matched = matched;
+        }
+
+      if (matched)
         {
           _dbus_verbose ("Rule matched\n");
 
           /* Append to the list if we haven't already */
           if (bus_connection_mark_stamp (rule->matches_go_to))
             {
-              if (!_dbus_list_append (recipients_p, rule->matches_go_to))
+              if (!recipients_append (recipients, rule->matches_go_to))
                 return FALSE;
             }
 #ifdef DBUS_ENABLE_VERBOSE_MODE
@@ -1785,19 +2597,149 @@ get_recipients_from_list (DBusList       **rules,
   return TRUE;
 }
 
+static DBusList **
+rule_table_lookup (DBusHashTable *table,
+                   const char    *atom)
+{
+  if (atom == NULL)
+    return NULL;
+
+  return _dbus_hash_table_lookup_uintptr (table, (uintptr_t) atom);
+}
+
+static dbus_bool_t
+get_recipients_from_rule_set (RuleSet         *set,
+                              DBusConnection  *sender,
+                              DBusConnection  *addressed_recipient,
+                              DBusMessage     *message,
+                              MessageAtoms    *atoms,
+                              Recipients      *recipients)
+{
+  DBusHashTable *table;
+
+  if (set == NULL)
+    return TRUE;
+
+  if (!get_recipients_from_list (&set->unindexed_rules,
+                                 sender, addressed_recipient, message, atoms,
+                                 0, recipients))
+    return FALSE;
+
+  /* Only the lists whose key agrees with the message can hold rules that
+   * match it, so those are the only ones we need to look at.
+   */
+  table = set->rules_by_key[RULE_INDEX_PATH];
+  if (table != NULL &&
+      !get_recipients_from_list (rule_table_lookup (table, atoms->path),
+                                 sender, addressed_recipient, message, atoms,
+                                 BUS_MATCH_PATH, recipients))
+    return FALSE;
+
+  table = set->rules_by_key[RULE_INDEX_ARG0];
+  if (table != NULL)
+    {
+      if (!atoms->arg0_checked)
+        {
+          message_atoms_decode_args (atoms, message);
+          atoms->arg0 = bus_atom_lookup (atoms->args[0]);
+          atoms->arg0_checked = TRUE;
+        }
+
+      if (!get_recipients_from_list (rule_table_lookup (table, atoms->arg0),
+                                     sender, addressed_recipient, message, atoms,
+                                     0, recipients))
+        return FALSE;
+    }
+
+  table = set->rules_by_key[RULE_INDEX_SENDER];
+  if (table != NULL)
+    {
+      /* A rule's sender matches if the sending connection is the primary
+       * owner of it, so try every name the sender has; match_rule_matches()
+       * then weeds out the ones it's merely queued for.
+       */
+      if (sender == NULL)
+        {
+          if (!get_recipients_from_list (rule_table_lookup (table,
+                                                            bus_atom_lookup (DBUS_SERVICE_DBUS)),
+                                         sender, addressed_recipient, message, atoms,
+                                         0, recipients))
+            return FALSE;
+        }
+      else
+        {
+          DBusList **services;
+          DBusList *link;
+
+          services = bus_connection_get_owned_services (sender);
+
+          for (link = _dbus_list_get_first_link (services);
+               link != NULL;
+               link = _dbus_list_get_next_link (services, link))
+            {
+              const char *name = bus_service_get_name (link->data);
+
+              if (!get_recipients_from_list (rule_table_lookup (table,
+                                                                bus_atom_lookup (name)),
+                                             sender, addressed_recipient, message, atoms,
+                                             0, recipients))
+                return FALSE;
+            }
+        }
+    }
+
+  table = set->rules_by_key[RULE_INDEX_MEMBER];
+  if (table != NULL &&
+      !get_recipients_from_list (rule_table_lookup (table, atoms->member),
+                                 sender, addressed_recipient, message, atoms,
+                                 BUS_MATCH_MEMBER, recipients))
+    return FALSE;
+
+  return TRUE;
+}
+
+/**
+ * Finds the connections other than addressed_recipient whose match
+ * rules want the message, each of them once. The array belongs to
+ * the matchmaker and is reused from one message to the next, so it
+ * must be given back with bus_matchmaker_release_recipients() before
+ * recipients for another message are asked for; if they are asked
+ * for anyway, a separate array is allocated.
+ *
+ * @param matchmaker the matchmaker
+ * @param connections the connections the recipients are stamped in
+ * @param sender the sending connection, or #NULL for the bus driver
+ * @param addressed_recipient the destination connection, or #NULL
+ * @param message the message
+ * @param recipients_p return location for the recipients
+ * @param n_recipients_p return location for the number of recipients
+ * @returns #FALSE if not enough memory
+ */
 dbus_bool_t
-bus_matchmaker_get_recipients (BusMatchmaker   *matchmaker,
-                               BusConnections  *connections,
-                               DBusConnection  *sender,
-                               DBusConnection  *addressed_recipient,
-                               DBusMessage     *message,
-                               DBusList       **recipients_p)
+bus_matchmaker_get_recipients (BusMatchmaker    *matchmaker,
+                               BusConnections   *connections,
+                               DBusConnection   *sender,
+                               DBusConnection   *addressed_recipient,
+                               DBusMessage      *message,
+                               DBusConnection ***recipients_p,
+                               int              *n_recipients_p)
 {
   int type;
-  const char *interface;
-  DBusList **neither, **just_type, **just_iface, **both;
+  MessageAtoms atoms;
+  RuleSet *neither, *just_type, *just_iface, *both;
+  Recipients recipients;
 
-  _dbus_assert (*recipients_p == NULL);
+  if (matchmaker->recipients_in_use)
+    {
+      recipients.connections = NULL;
+      recipients.max_connections = 0;
+    }
+  else
+    {
+      recipients.connections = matchmaker->recipients;
+      recipients.max_connections = matchmaker->max_recipients;
+    }
+  recipients.n_connections = 0;
 
   /* This avoids sending same message to the same connection twice.
    * Purpose of the stamp instead of a bool is to avoid iterating over
@@ -1812,41 +2754,291 @@ bus_matchmaker_get_recipients (BusMatchmaker   *matchmaker,
   if (addressed_recipient != NULL)
     bus_connection_mark_stamp (addressed_recipient);
 
+  /* Rules only ever ask for strings that exist as atoms, so looking the
+   * message's fields up once lets everything below compare pointers.
+   */
   type = dbus_message_get_type (message);
-  interface = dbus_message_get_interface (message);
+  message_atoms_init (&atoms, message);
 
-  neither = bus_matchmaker_get_rules (matchmaker, DBUS_MESSAGE_TYPE_INVALID,
+  neither = bus_matchmaker_get_rule_set (matchmaker, DBUS_MESSAGE_TYPE_INVALID,
       NULL, FALSE);
   just_type = just_iface = both = NULL;
 
-  if (interface != NULL)
-    just_iface = bus_matchmaker_get_rules (matchmaker,
-        DBUS_MESSAGE_TYPE_INVALID, interface, FALSE);
+  if (atoms.interface != NULL)
+    just_iface = bus_matchmaker_get_rule_set (matchmaker,
+        DBUS_MESSAGE_TYPE_INVALID, atoms.interface, FALSE);
 
   if (type > DBUS_MESSAGE_TYPE_INVALID && type < DBUS_NUM_MESSAGE_TYPES)
     {
-      just_type = bus_matchmaker_get_rules (matchmaker, type, NULL, FALSE);
+      just_type = bus_matchmaker_get_rule_set (matchmaker, type, NULL, FALSE);
 
-      if (interface != NULL)
-        both = bus_matchmaker_get_rules (matchmaker, type, interface, FALSE);
+      if (atoms.interface != NULL)
+        both = bus_matchmaker_get_rule_set (matchmaker, type, atoms.interface,
+                                            FALSE);
     }
 
-  if (!(get_recipients_from_list (neither, sender, addressed_recipient,
-                                  message, recipients_p) &&
-        get_recipients_from_list (just_iface, sender, addressed_recipient,
-                                  message, recipients_p) &&
-        get_recipients_from_list (just_type, sender, addressed_recipient,
-                                  message, recipients_p) &&
-        get_recipients_from_list (both, sender, addressed_recipient,
-                                  message, recipients_p)))
+  if (!(get_recipients_from_rule_set (neither, sender, addressed_recipient,
+                                      message, &atoms, &recipients) &&
+        get_recipients_from_rule_set (just_iface, sender, addressed_recipient,
+                                      message, &atoms, &recipients) &&
+        get_recipients_from_rule_set (just_type, sender, addressed_recipient,
+                                      message, &atoms, &recipients) &&
+        get_recipients_from_rule_set (both, sender, addressed_recipient,
+                                      message, &atoms, &recipients)))
     {
-      _dbus_list_clear (recipients_p);
+      /* appending may have moved the shared array before running out
+       * of memory, so hang on to where it is now
+       */
+      if (matchmaker->recipients_in_use)
+        dbus_free (recipients.connections);
+      else
+        {
+          matchmaker->recipients = recipients.connections;
+          matchmaker->max_recipients = recipients.max_connections;
+        }
+
       return FALSE;
     }
 
+  if (!matchmaker->recipients_in_use)
+    {
+      matchmaker->recipients = recipients.connections;
+      matchmaker->max_recipients = recipients.max_connections;
+      matchmaker->recipients_in_use = TRUE;
+    }
+
+  *recipients_p = recipients.connections;
+  *n_recipients_p = recipients.n_connections;
+
   return TRUE;
 }
 
+/**
+ * Gives back the array bus_matchmaker_get_recipients() returned.
+ *
+ * @param matchmaker the matchmaker
+ * @param recipients the recipients
+ */
+void
+bus_matchmaker_release_recipients (BusMatchmaker   *matchmaker,
+                                   DBusConnection **recipients)
+{
+  if (recipients == matchmaker->recipients)
+    {
+      _dbus_assert (matchmaker->recipients_in_use);
+      matchmaker->recipients_in_use = FALSE;
+    }
+  else
+    dbus_free (recipients);
+}
+
+/**
+ * Whether a signal going to a connection through its match rules may
+ * replace an earlier one still waiting to be sent to it. That takes
+ * all of the connection's rules that match the signal to have been
+ * added with conflate='true'; one rule that wants every signal is
+ * enough to get every signal.
+ *
+ * This looks at each of the connection's rules, so it's only worth
+ * asking for connections that have conflating rules at all.
+ *
+ * @param matchmaker the matchmaker
+ * @param connection a recipient of the message
+ * @param sender the sending connection, or #NULL for the bus driver
+ * @param addressed_recipient the destination connection, or #NULL
+ * @param message the message
+ * @returns #TRUE if the message may be conflated for connection
+ */
+dbus_bool_t
+bus_matchmaker_conflates (BusMatchmaker   *matchmaker,
+                          DBusConnection  *connection,
+                          DBusConnection  *sender,
+                          DBusConnection  *addressed_recipient,
+                          DBusMessage     *message)
+{
+  MessageAtoms atoms;
+  DBusList **own_rules;
+  DBusList *link;
+  dbus_bool_t conflates;
+
+  if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_SIGNAL)
+    return FALSE;
+
+  message_atoms_init (&atoms, message);
+  conflates = FALSE;
+
+  own_rules = bus_connection_get_match_rules (connection);
+  for (link = _dbus_list_get_first_link (own_rules);
+       link != NULL;
+       link = _dbus_list_get_next_link (own_rules, link))
+    {
+      BusMatchRule *rule = link->data;
+
+      if (!match_rule_matches (rule, sender, addressed_recipient, message,
+                               &atoms, 0))
+        continue;
+
+      if (!(rule->flags & BUS_MATCH_CONFLATE))
+        return FALSE;
+
+      conflates = TRUE;
+    }
+
+  return conflates;
+}
+
+static int
+rule_set_count_rules (RuleSet *set)
+{
+  int n;
+  int i;
+
+  n = _dbus_list_get_length (&set->unindexed_rules);
+
+  for (i = 0; i < N_RULE_INDEXES; i++)
+    {
+      DBusHashIter iter;
+
+      if (set->rules_by_key[i] == NULL)
+        continue;
+
+      _dbus_hash_iter_init (set->rules_by_key[i], &iter);
+      while (_dbus_hash_iter_next (&iter))
+        n += _dbus_list_get_length (_dbus_hash_iter_get_value (&iter));
+    }
+
+  return n;
+}
+
+/**
+ * Reports how big the matchmaker's structures are, for the Stats
+ * interface. This walks every rule, so it's not for hot paths.
+ *
+ * @param matchmaker the matchmaker
+ * @param n_rule_sets return location for number of per-interface rule sets
+ * @param n_rules return location for number of rules
+ * @param n_cached_rules return location for number of cached parsed rules
+ * @param max_recipients return location for size of the recipients array
+ */
+void
+bus_matchmaker_get_stats (BusMatchmaker *matchmaker,
+                          int           *n_rule_sets,
+                          int           *n_rules,
+                          int           *n_cached_rules,
+                          int           *max_recipients)
+{
+  int i;
+
+  *n_rule_sets = 0;
+  *n_rules = 0;
+  *n_cached_rules = 0;
+
+  for (i = DBUS_MESSAGE_TYPE_INVALID; i < DBUS_NUM_MESSAGE_TYPES; i++)
+    {
+      RulePool *p = matchmaker->rules_by_type + i;
+      DBusHashIter iter;
+
+      *n_rules += rule_set_count_rules (&p->rules_without_iface);
+
+      _dbus_hash_iter_init (p->rules_by_iface, &iter);
+      while (_dbus_hash_iter_next (&iter))
+        {
+          *n_rule_sets += 1;
+          *n_rules += rule_set_count_rules (_dbus_hash_iter_get_value (&iter));
+        }
+    }
+
+  for (i = 0; i < N_PARSED_RULES; i++)
+    {
+      if (matchmaker->parsed_rules[i].rule != NULL)
+        *n_cached_rules += 1;
+    }
+
+  *max_recipients = matchmaker->max_recipients;
+}
+
+static dbus_bool_t
+rule_table_has_rules (DBusHashTable *table,
+                      const char    *atom)
+{
+  DBusList **list;
+
+  if (table == NULL)
+    return FALSE;
+
+  list = rule_table_lookup (table, atom);
+
+  return list != NULL && *list != NULL;
+}
+
+/* Whether set has any rule that get_recipients_from_rule_set() would
+ * look at for a signal the bus driver sends from its own path, with
+ * the given member and arg0 atoms
+ */
+static dbus_bool_t
+rule_set_has_rules_for_driver_signal (RuleSet    *set,
+                                      const char *member,
+                                      const char *arg0)
+{
+  if (set == NULL)
+    return FALSE;
+
+  return set->unindexed_rules != NULL ||
+    rule_table_has_rules (set->rules_by_key[RULE_INDEX_PATH],
+                          bus_atom_lookup (DBUS_PATH_DBUS)) ||
+    rule_table_has_rules (set->rules_by_key[RULE_INDEX_ARG0], arg0) ||
+    rule_table_has_rules (set->rules_by_key[RULE_INDEX_SENDER],
+                          bus_atom_lookup (DBUS_SERVICE_DBUS)) ||
+    rule_table_has_rules (set->rules_by_key[RULE_INDEX_MEMBER], member);
+}
+
+/**
+ * Checks whether any match rule could want the NameOwnerChanged signal
+ * for a name, without building the signal. Connection churn sends one
+ * of these for every name each client had, and usually only a few
+ * connections watch a given name or all of them. If this returns
+ * #FALSE, bus_matchmaker_get_recipients() would find no recipients.
+ *
+ * @param matchmaker the matchmaker
+ * @param name the name whose owner changed
+ * @returns #TRUE if the signal may have recipients
+ */
+dbus_bool_t
+bus_matchmaker_has_name_owner_changed_rules (BusMatchmaker *matchmaker,
+                                             const char    *name)
+{
+  const char *interface;
+  const char *member;
+  const char *arg0;
+
+  interface = bus_atom_lookup (DBUS_INTERFACE_DBUS);
+  member = bus_atom_lookup ("NameOwnerChanged");
+  arg0 = bus_atom_lookup (name);
+
+  if (rule_set_has_rules_for_driver_signal (
+          bus_matchmaker_get_rule_set (matchmaker, DBUS_MESSAGE_TYPE_INVALID,
+                                       NULL, FALSE),
+          member, arg0) ||
+      rule_set_has_rules_for_driver_signal (
+          bus_matchmaker_get_rule_set (matchmaker, DBUS_MESSAGE_TYPE_SIGNAL,
+                                       NULL, FALSE),
+          member, arg0))
+    return TRUE;
+
+  /* rules naming an interface other than ours can't match */
+  if (interface == NULL)
+    return FALSE;
+
+  return rule_set_has_rules_for_driver_signal (
+          bus_matchmaker_get_rule_set (matchmaker, DBUS_MESSAGE_TYPE_INVALID,
+                                       interface, FALSE),
+          member, arg0) ||
+    rule_set_has_rules_for_driver_signal (
+          bus_matchmaker_get_rule_set (matchmaker, DBUS_MESSAGE_TYPE_SIGNAL,
+                                       interface, FALSE),
+          member, arg0);
+}
+
 #ifdef DBUS_BUILD_TESTS
 #include "test.h"
 #include <stdlib.h>
@@ -1960,9 +3152,9 @@ test_parsing (void *data)
       _dbus_assert (rule->flags == BUS_MATCH_ARGS);
       _dbus_assert (rule->args != NULL);
       _dbus_assert (rule->args_len == 1);
-      _dbus_assert (rule->args[0] != NULL);
-      _dbus_assert (rule->args[1] == NULL);
-      _dbus_assert (strcmp (rule->args[0], "foo") == 0);
+      _dbus_assert (rule->args == rule->inline_args);
+      _dbus_assert (rule->args[0].value != NULL);
+      _dbus_assert (strcmp (rule->args[0].value, "foo") == 0);
 
       bus_match_rule_unref (rule);
     }
@@ -1973,10 +3165,10 @@ test_parsing (void *data)
       _dbus_assert (rule->flags == BUS_MATCH_ARGS);
       _dbus_assert (rule->args != NULL);
       _dbus_assert (rule->args_len == 2);
-      _dbus_assert (rule->args[0] == NULL);
-      _dbus_assert (rule->args[1] != NULL);
-      _dbus_assert (rule->args[2] == NULL);
-      _dbus_assert (strcmp (rule->args[1], "foo") == 0);
+      _dbus_assert (rule->args == rule->inline_args);
+      _dbus_assert (rule->args[0].value == NULL);
+      _dbus_assert (rule->args[1].value != NULL);
+      _dbus_assert (strcmp (rule->args[1].value, "foo") == 0);
 
       bus_match_rule_unref (rule);
     }
@@ -1987,11 +3179,11 @@ test_parsing (void *data)
       _dbus_assert (rule->flags == BUS_MATCH_ARGS);
       _dbus_assert (rule->args != NULL);
       _dbus_assert (rule->args_len == 3);
-      _dbus_assert (rule->args[0] == NULL);
-      _dbus_assert (rule->args[1] == NULL);
-      _dbus_assert (rule->args[2] != NULL);
-      _dbus_assert (rule->args[3] == NULL);
-      _dbus_assert (strcmp (rule->args[2], "foo") == 0);
+      _dbus_assert (rule->args != rule->inline_args);
+      _dbus_assert (rule->args[0].value == NULL);
+      _dbus_assert (rule->args[1].value == NULL);
+      _dbus_assert (rule->args[2].value != NULL);
+      _dbus_assert (strcmp (rule->args[2].value, "foo") == 0);
 
       bus_match_rule_unref (rule);
     }
@@ -2002,11 +3194,10 @@ test_parsing (void *data)
       _dbus_assert (rule->flags == BUS_MATCH_ARGS);
       _dbus_assert (rule->args != NULL);
       _dbus_assert (rule->args_len == 41);
-      _dbus_assert (rule->args[0] == NULL);
-      _dbus_assert (rule->args[1] == NULL);
-      _dbus_assert (rule->args[40] != NULL);
-      _dbus_assert (rule->args[41] == NULL);
-      _dbus_assert (strcmp (rule->args[40], "foo") == 0);
+      _dbus_assert (rule->args[0].value == NULL);
+      _dbus_assert (rule->args[1].value == NULL);
+      _dbus_assert (rule->args[40].value != NULL);
+      _dbus_assert (strcmp (rule->args[40].value, "foo") == 0);
 
       bus_match_rule_unref (rule);
     }
@@ -2017,11 +3208,10 @@ test_parsing (void *data)
       _dbus_assert (rule->flags == BUS_MATCH_ARGS);
       _dbus_assert (rule->args != NULL);
       _dbus_assert (rule->args_len == 64);
-      _dbus_assert (rule->args[0] == NULL);
-      _dbus_assert (rule->args[1] == NULL);
-      _dbus_assert (rule->args[63] != NULL);
-      _dbus_assert (rule->args[64] == NULL);
-      _dbus_assert (strcmp (rule->args[63], "foo") == 0);
+      _dbus_assert (rule->args[0].value == NULL);
+      _dbus_assert (rule->args[1].value == NULL);
+      _dbus_assert (rule->args[63].value != NULL);
+      _dbus_assert (strcmp (rule->args[63].value, "foo") == 0);
 
       bus_match_rule_unref (rule);
     }
@@ -2066,6 +3256,27 @@ test_parsing (void *data)
   rule = check_parse (FALSE, "service='youpi'");
   _dbus_assert (rule == NULL);
 
+  /* Conflation is a boolean, given at most once */
+  rule = check_parse (TRUE, "type='signal',conflate='true'");
+  if (rule != NULL)
+    {
+      _dbus_assert (rule->flags == (BUS_MATCH_MESSAGE_TYPE | BUS_MATCH_CONFLATE));
+      _dbus_assert (bus_match_rule_get_conflate (rule));
+
+      bus_match_rule_unref (rule);
+    }
+  rule = check_parse (TRUE, "conflate='false'");
+  if (rule != NULL)
+    {
+      _dbus_assert (!bus_match_rule_get_conflate (rule));
+
+      bus_match_rule_unref (rule);
+    }
+  rule = check_parse (FALSE, "conflate='yes'");
+  _dbus_assert (rule == NULL);
+  rule = check_parse (FALSE, "conflate='true',conflate='false'");
+  _dbus_assert (rule == NULL);
+
   /* Allow empty rule */
   rule = check_parse (TRUE, "");
   if (rule != NULL)
@@ -2134,6 +3345,9 @@ test_equality (void)
           exit (1);
         }
 
+      /* RemoveMatch finds rules by this hash */
+      _dbus_assert (match_rule_hash (first) == match_rule_hash (second));
+
       bus_match_rule_unref (second);
 
       /* Check that the rule is not equal to any of the
@@ -2203,13 +3417,15 @@ check_matches (dbus_bool_t  expected_to_match,
                const char  *rule_text)
 {
   BusMatchRule *rule;
+  MessageAtoms atoms;
   dbus_bool_t matched;
 
   rule = check_parse (TRUE, rule_text);
   _dbus_assert (rule != NULL);
 
   /* We can't test sender/destination rules since we pass NULL here */
-  matched = match_rule_matches (rule, NULL, NULL, message, 0);
+  message_atoms_init (&atoms, message);
+  matched = match_rule_matches (rule, NULL, NULL, message, &atoms, 0);
 
   if (matched != expected_to_match)
     {
@@ -2272,6 +3488,111 @@ test_matching (void)
   dbus_message_unref (message1);
 }
 
+static const struct {
+  const char *rule_text;
+  RuleIndex index;
+} index_tests[] = {
+  { "type='signal'", RULE_INDEX_NONE },
+  { "member='Frobated'", RULE_INDEX_MEMBER },
+  { "sender='foo.bar',member='Frobated'", RULE_INDEX_SENDER },
+  { "arg0='foo',sender='foo.bar',member='Frobated'", RULE_INDEX_ARG0 },
+  { "arg0path='/foo/',member='Frobated'", RULE_INDEX_MEMBER },
+  { "arg1='foo'", RULE_INDEX_NONE },
+  { "path='/foo',arg0='foo',member='Frobated'", RULE_INDEX_PATH },
+  { "path='/foo',member='Frobated'", RULE_INDEX_PATH }
+};
+
+static void
+test_indexing (void)
+{
+  RuleSet set;
+  BusMatchRule *rules[_DBUS_N_ELEMENTS (index_tests)];
+  int i;
+
+  _DBUS_ZERO (set);
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (index_tests); i++)
+    {
+      DBusList **list;
+      const char *key;
+
+      rules[i] = check_parse (TRUE, index_tests[i].rule_text);
+      _dbus_assert (rules[i] != NULL);
+
+      if (match_rule_get_index (rules[i], &key) != index_tests[i].index)
+        _dbus_assert_not_reached ("rule filed under the wrong index");
+
+      list = rule_set_get_rules (&set, index_tests[i].index, key, TRUE);
+      if (list == NULL || !_dbus_list_append (list, rules[i]))
+        _dbus_assert_not_reached ("oom");
+
+      _dbus_assert (rule_set_get_rules (&set, index_tests[i].index, key,
+                                        FALSE) == list);
+    }
+
+  _dbus_assert (!rule_set_is_empty (&set));
+  _dbus_assert (_dbus_hash_table_get_n_entries (set.rules_by_key[RULE_INDEX_PATH]) == 1);
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (index_tests); i++)
+    {
+      DBusList **list;
+      const char *key;
+      RuleIndex index;
+
+      index = match_rule_get_index (rules[i], &key);
+      list = rule_set_get_rules (&set, index, key, FALSE);
+      _dbus_assert (list != NULL);
+
+      if (!_dbus_list_remove (list, rules[i]))
+        _dbus_assert_not_reached ("rule not found in its own list");
+
+      rule_set_gc_rules (&set, index, key);
+      bus_match_rule_unref (rules[i]);
+    }
+
+  _dbus_assert (rule_set_is_empty (&set));
+
+  for (i = 0; i < N_RULE_INDEXES; i++)
+    _dbus_assert (set.rules_by_key[i] == NULL);
+}
+
+static void
+test_parse_cache (void)
+{
+  BusMatchmaker *matchmaker;
+  BusMatchRule *first, *second;
+  DBusString str;
+  DBusError error;
+
+  matchmaker = bus_matchmaker_new ();
+  if (matchmaker == NULL)
+    _dbus_assert_not_reached ("oom");
+
+  dbus_error_init (&error);
+  _dbus_string_init_const (&str, "type='signal',member='Changed',arg0='foo',arg2path='/a/'");
+
+  first = bus_matchmaker_parse_rule (matchmaker, NULL, &str, &error);
+  second = bus_matchmaker_parse_rule (matchmaker, NULL, &str, &error);
+  if (first == NULL || second == NULL)
+    _dbus_assert_not_reached ("oom");
+
+  /* the second is a copy of the cached rule, not the same rule */
+  _dbus_assert (first != second);
+  _dbus_assert (match_rule_equal (first, second));
+  _dbus_assert (first->member == second->member);
+
+  bus_match_rule_unref (first);
+  bus_match_rule_unref (second);
+
+  _dbus_string_init_const (&str, "type='signal',nonsense='x'");
+  first = bus_matchmaker_parse_rule (matchmaker, NULL, &str, &error);
+  _dbus_assert (first == NULL);
+  _dbus_assert (dbus_error_has_name (&error, DBUS_ERROR_MATCH_RULE_INVALID));
+  dbus_error_free (&error);
+
+  bus_matchmaker_unref (matchmaker);
+}
+
 dbus_bool_t
 bus_signals_test (const DBusString *test_data_dir)
 {
@@ -2288,6 +3609,10 @@ bus_signals_test (const DBusString *test_data_dir)
   test_equality ();
 
   test_matching ();
+
+  test_indexing ();
+
+  test_parse_cache ();
   
   return TRUE;
 }
@@ -37,12 +37,14 @@ typedef enum
   BUS_MATCH_SENDER       = 1 << 3,
   BUS_MATCH_DESTINATION  = 1 << 4,
   BUS_MATCH_PATH         = 1 << 5,
-  BUS_MATCH_ARGS         = 1 << 6
+  BUS_MATCH_ARGS         = 1 << 6,
+  BUS_MATCH_CONFLATE     = 1 << 7  /**< Doesn't restrict what matches; see bus_matchmaker_conflates() */
 } BusMatchFlags;
 
 BusMatchRule* bus_match_rule_new   (DBusConnection *matches_go_to);
 BusMatchRule* bus_match_rule_ref   (BusMatchRule   *rule);
 void          bus_match_rule_unref (BusMatchRule   *rule);
+dbus_bool_t   bus_match_rule_get_conflate (BusMatchRule *rule);
 
 dbus_bool_t bus_match_rule_set_message_type (BusMatchRule     *rule,
                                              int               type);
@@ -61,6 +63,9 @@ dbus_bool_t bus_match_rule_set_arg          (BusMatchRule     *rule,
                                              const DBusString *value,
                                              dbus_bool_t       is_path);
 
+dbus_bool_t   bus_match_rule_to_string (BusMatchRule *rule,
+                                        DBusString   *str);
+
 BusMatchRule* bus_match_rule_parse (DBusConnection   *matches_go_to,
                                     const DBusString *rule_text,
                                     DBusError        *error);
@@ -69,6 +74,10 @@ BusMatchmaker* bus_matchmaker_new   (void);
 BusMatchmaker* bus_matchmaker_ref   (BusMatchmaker *matchmaker);
 void           bus_matchmaker_unref (BusMatchmaker *matchmaker);
 
+BusMatchRule* bus_matchmaker_parse_rule         (BusMatchmaker    *matchmaker,
+                                                 DBusConnection   *matches_go_to,
+                                                 const DBusString *rule_text,
+                                                 DBusError        *error);
 dbus_bool_t bus_matchmaker_add_rule             (BusMatchmaker   *matchmaker,
                                                  BusMatchRule    *rule);
 dbus_bool_t bus_matchmaker_remove_rule_by_value (BusMatchmaker   *matchmaker,
@@ -78,11 +87,26 @@ void        bus_matchmaker_remove_rule          (BusMatchmaker   *matchmaker,
                                                  BusMatchRule    *rule);
 void        bus_matchmaker_disconnected         (BusMatchmaker   *matchmaker,
                                                  DBusConnection  *connection);
-dbus_bool_t bus_matchmaker_get_recipients       (BusMatchmaker   *matchmaker,
-                                                 BusConnections  *connections,
-                                                 DBusConnection  *sender,
-                                                 DBusConnection  *addressed_recipient,
-                                                 DBusMessage     *message,
-                                                 DBusList       **recipients_p);
+dbus_bool_t bus_matchmaker_get_recipients       (BusMatchmaker    *matchmaker,
+                                                 BusConnections   *connections,
+                                                 DBusConnection   *sender,
+                                                 DBusConnection   *addressed_recipient,
+                                                 DBusMessage      *message,
+                                                 DBusConnection ***recipients_p,
+                                                 int              *n_recipients_p);
+void        bus_matchmaker_release_recipients   (BusMatchmaker    *matchmaker,
+                                                 DBusConnection  **recipients);
+dbus_bool_t bus_matchmaker_conflates            (BusMatchmaker    *matchmaker,
+                                                 DBusConnection   *connection,
+                                                 DBusConnection   *sender,
+                                                 DBusConnection   *addressed_recipient,
+                                                 DBusMessage      *message);
+dbus_bool_t bus_matchmaker_has_name_owner_changed_rules (BusMatchmaker *matchmaker,
+                                                        const char    *name);
+void        bus_matchmaker_get_stats            (BusMatchmaker    *matchmaker,
+                                                 int              *n_rule_sets,
+                                                 int              *n_rules,
+                                                 int              *n_cached_rules,
+                                                 int              *max_recipients);
 
 #endif /* BUS_SIGNALS_H */
@@ -0,0 +1,814 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* stats.c  Bus statistics interface
+ *
+ * Copyright (C) 2003  Red Hat, Inc.
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "stats.h"
+#include "connection.h"
+#include "services.h"
+#include "signals.h"
+#include "utils.h"
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-connection-internal.h>
+#include <dbus/dbus-message-internal.h>
+#include <dbus/dbus-sysdeps.h>
+#include <dbus/dbus-timeout.h>
+#include <dbus/dbus-mainloop.h>
+#include <dbus/dbus-file.h>
+#ifdef DBUS_UNIX
+#include <dbus/dbus-sysdeps-unix.h>
+#endif
+#include <string.h>
+
+/* The counters are plain integers bumped on paths the bus takes anyway,
+ * so they're always on; only the code here, which runs when someone
+ * asks, walks any lists.
+ */
+
+/* Latency histograms cost two clock reads per timed stage, so unlike
+ * the counters they are off unless the daemon was started with
+ * --latency-stats.  The bus is single-threaded, so the buckets need no
+ * locking or atomics.
+ */
+static dbus_bool_t latency_enabled = FALSE;
+static dbus_uint32_t latency_buckets[BUS_N_LATENCY_STAGES][BUS_LATENCY_N_BUCKETS];
+
+static const char * const latency_stage_names[BUS_N_LATENCY_STAGES] = {
+  "Dispatch",
+  "PolicyCheck",
+  "MatchmakerLookup",
+  "TransactionExecute"
+};
+
+void
+bus_stats_set_latency_enabled (dbus_bool_t enabled)
+{
+  latency_enabled = enabled != FALSE;
+}
+
+void
+bus_stats_latency_start (BusLatencyTimer *timer)
+{
+  if (!latency_enabled)
+    {
+      timer->tv_sec = -1;
+      return;
+    }
+
+  _dbus_get_current_time (&timer->tv_sec, &timer->tv_usec);
+}
+
+void
+bus_stats_latency_stop (BusLatencyTimer *timer,
+                        BusLatencyStage  stage)
+{
+  long tv_sec, tv_usec;
+  long elapsed;
+  int bucket;
+
+  _dbus_assert (stage < BUS_N_LATENCY_STAGES);
+
+  if (timer->tv_sec < 0)
+    return;
+
+  _dbus_get_current_time (&tv_sec, &tv_usec);
+  elapsed = (tv_sec - timer->tv_sec) * 1000000 + (tv_usec - timer->tv_usec);
+
+  bucket = 0;
+  while (elapsed > 0 && bucket < BUS_LATENCY_N_BUCKETS - 1)
+    {
+      elapsed >>= 1;
+      ++bucket;
+    }
+
+  latency_buckets[stage][bucket] += 1;
+}
+
+void
+bus_stats_log_latency (BusContext *context)
+{
+  DBusString str;
+  int stage, bucket;
+
+  if (!latency_enabled)
+    {
+      bus_context_log (context, DBUS_SYSTEM_LOG_INFO,
+                       "Latency statistics are off; start the bus with --latency-stats");
+      return;
+    }
+
+  for (stage = 0; stage < BUS_N_LATENCY_STAGES; stage++)
+    {
+      if (!_dbus_string_init (&str))
+        return;
+
+      for (bucket = 0; bucket < BUS_LATENCY_N_BUCKETS; bucket++)
+        {
+          if (!_dbus_string_append_printf (&str, " %u",
+                                           latency_buckets[stage][bucket]))
+            {
+              _dbus_string_free (&str);
+              return;
+            }
+        }
+
+      bus_context_log (context, DBUS_SYSTEM_LOG_INFO,
+                       "Latency %s (log2 usec buckets):%s",
+                       latency_stage_names[stage],
+                       _dbus_string_get_const_data (&str));
+      _dbus_string_free (&str);
+    }
+}
+
+/* Reported by GetStats when the daemon runs with DBUS_MALLOC_PROFILE
+ * set, indexed by DBusAllocSubsystem
+ */
+static const char * const alloc_profile_keys[DBUS_N_ALLOC_SUBSYSTEMS][3] = {
+  { "OtherAllocations", "OtherBlocksOutstanding", "OtherBytesOutstanding" },
+  { "MessageAllocations", "MessageBlocksOutstanding", "MessageBytesOutstanding" },
+  { "StringAllocations", "StringBlocksOutstanding", "StringBytesOutstanding" },
+  { "ListAllocations", "ListBlocksOutstanding", "ListBytesOutstanding" },
+  { "HashAllocations", "HashBlocksOutstanding", "HashBytesOutstanding" },
+  { "ConnectionAllocations", "ConnectionBlocksOutstanding",
+    "ConnectionBytesOutstanding" }
+};
+
+static dbus_bool_t
+asv_open (DBusMessage     *reply,
+          DBusMessageIter *iter,
+          DBusMessageIter *arr_iter)
+{
+  dbus_message_iter_init_append (reply, iter);
+
+  return dbus_message_iter_open_container (iter, DBUS_TYPE_ARRAY,
+                                           DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+                                           DBUS_TYPE_STRING_AS_STRING
+                                           DBUS_TYPE_VARIANT_AS_STRING
+                                           DBUS_DICT_ENTRY_END_CHAR_AS_STRING,
+                                           arr_iter);
+}
+
+static dbus_bool_t
+asv_add_uint32 (DBusMessageIter *arr_iter,
+                const char      *key,
+                dbus_uint32_t    value)
+{
+  DBusMessageIter entry_iter;
+  DBusMessageIter var_iter;
+
+  if (!dbus_message_iter_open_container (arr_iter, DBUS_TYPE_DICT_ENTRY,
+                                         NULL, &entry_iter))
+    return FALSE;
+
+  if (!dbus_message_iter_append_basic (&entry_iter, DBUS_TYPE_STRING, &key))
+    goto abandon_entry;
+
+  if (!dbus_message_iter_open_container (&entry_iter, DBUS_TYPE_VARIANT,
+                                         DBUS_TYPE_UINT32_AS_STRING,
+                                         &var_iter))
+    goto abandon_entry;
+
+  if (!dbus_message_iter_append_basic (&var_iter, DBUS_TYPE_UINT32, &value))
+    {
+      dbus_message_iter_abandon_container (&entry_iter, &var_iter);
+      goto abandon_entry;
+    }
+
+  if (!dbus_message_iter_close_container (&entry_iter, &var_iter))
+    goto abandon_entry;
+
+  return dbus_message_iter_close_container (arr_iter, &entry_iter);
+
+ abandon_entry:
+  dbus_message_iter_abandon_container (arr_iter, &entry_iter);
+  return FALSE;
+}
+
+static dbus_bool_t
+close_and_send_reply (DBusMessage     *reply,
+                DBusMessageIter *iter,
+                DBusMessageIter *arr_iter,
+                DBusConnection  *connection,
+                BusTransaction  *transaction)
+{
+  if (!dbus_message_iter_close_container (iter, arr_iter))
+    return FALSE;
+
+  return bus_transaction_send_from_driver (transaction, connection, reply);
+}
+
+/* The counters GetStats reports, gathered in one place for it and for
+ * the stats file
+ */
+typedef struct
+{
+  int n_completed;
+  int n_incomplete;
+  int n_pending_replies;
+  int n_rule_sets;
+  int n_rules;
+  int n_cached_rules;
+  int max_recipients;
+  unsigned long cache_hits;
+  unsigned long cache_misses;
+} BusStatsCounts;
+
+static void
+get_counts (BusContext     *context,
+            BusStatsCounts *counts)
+{
+  bus_connections_get_counts (bus_context_get_connections (context),
+                              &counts->n_completed, &counts->n_incomplete,
+                              &counts->n_pending_replies);
+  bus_matchmaker_get_stats (bus_context_get_matchmaker (context),
+                            &counts->n_rule_sets, &counts->n_rules,
+                            &counts->n_cached_rules, &counts->max_recipients);
+  _dbus_message_cache_get_stats (&counts->cache_hits, &counts->cache_misses);
+}
+
+/* Likewise for GetConnectionStats */
+typedef struct
+{
+  BusConnectionStats stats;
+  int n_replies_to_receive;
+  int n_replies_to_send;
+  int read_budget;
+  int write_budget;
+  long outgoing_size;
+  unsigned long expired;
+} BusStatsConnectionCounts;
+
+static void
+get_connection_counts (DBusConnection           *connection,
+                       BusStatsConnectionCounts *counts)
+{
+  DBusConnectionStatistics statistics;
+
+  bus_connection_get_stats (connection, &counts->stats,
+                            &counts->n_replies_to_receive,
+                            &counts->n_replies_to_send);
+  counts->outgoing_size = dbus_connection_get_outgoing_size (connection);
+  _dbus_connection_get_iteration_budgets (connection, &counts->read_budget,
+                                          &counts->write_budget);
+  dbus_connection_get_statistics (connection, &statistics);
+  counts->expired = statistics.messages_expired;
+}
+
+dbus_bool_t
+bus_stats_handle_get_stats (DBusConnection *connection,
+                            BusTransaction *transaction,
+                            DBusMessage    *message,
+                            DBusError      *error)
+{
+  DBusMessage *reply;
+  DBusMessageIter iter, arr_iter;
+  BusStatsCounts counts;
+  int i;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  get_counts (bus_connection_get_context (connection), &counts);
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL)
+    goto oom;
+
+  if (!asv_open (reply, &iter, &arr_iter))
+    goto oom;
+
+  if (!asv_add_uint32 (&arr_iter, "ActiveConnections", counts.n_completed) ||
+      !asv_add_uint32 (&arr_iter, "IncompleteConnections", counts.n_incomplete) ||
+      !asv_add_uint32 (&arr_iter, "PendingReplies", counts.n_pending_replies) ||
+      !asv_add_uint32 (&arr_iter, "MatchRules", counts.n_rules) ||
+      !asv_add_uint32 (&arr_iter, "MatchRuleSets", counts.n_rule_sets) ||
+      !asv_add_uint32 (&arr_iter, "CachedParsedMatchRules", counts.n_cached_rules) ||
+      !asv_add_uint32 (&arr_iter, "MatchRecipientsCapacity", counts.max_recipients) ||
+      !asv_add_uint32 (&arr_iter, "MessageCacheHits", counts.cache_hits) ||
+      !asv_add_uint32 (&arr_iter, "MessageCacheMisses", counts.cache_misses))
+    {
+      dbus_message_iter_abandon_container (&iter, &arr_iter);
+      goto oom;
+    }
+
+  for (i = 0; i < DBUS_N_ALLOC_SUBSYSTEMS; i++)
+    {
+      dbus_uint32_t n_allocations, n_blocks, n_bytes;
+
+      if (!_dbus_get_alloc_profile (i, &n_allocations, &n_blocks, &n_bytes))
+        break;
+
+      if (!asv_add_uint32 (&arr_iter, alloc_profile_keys[i][0], n_allocations) ||
+          !asv_add_uint32 (&arr_iter, alloc_profile_keys[i][1], n_blocks) ||
+          !asv_add_uint32 (&arr_iter, alloc_profile_keys[i][2], n_bytes))
+        {
+          dbus_message_iter_abandon_container (&iter, &arr_iter);
+          goto oom;
+        }
+    }
+
+  if (!close_and_send_reply (reply, &iter, &arr_iter, connection, transaction))
+    goto oom;
+
+  dbus_message_unref (reply);
+  return TRUE;
+
+ oom:
+  if (reply != NULL)
+    dbus_message_unref (reply);
+  BUS_SET_OOM (error);
+  return FALSE;
+}
+
+dbus_bool_t
+bus_stats_handle_get_connection_stats (DBusConnection *caller_connection,
+                                       BusTransaction *transaction,
+                                       DBusMessage    *message,
+                                       DBusError      *error)
+{
+  const char *name;
+  DBusString str;
+  BusService *service;
+  DBusConnection *connection;
+  DBusMessage *reply;
+  DBusMessageIter iter, arr_iter;
+  BusStatsConnectionCounts counts;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!dbus_message_get_args (message, error,
+                              DBUS_TYPE_STRING, &name,
+                              DBUS_TYPE_INVALID))
+    return FALSE;
+
+  _dbus_string_init_const (&str, name);
+  service = bus_registry_lookup (bus_connection_get_registry (caller_connection),
+                                 &str);
+  if (service == NULL)
+    {
+      dbus_set_error (error, DBUS_ERROR_NAME_HAS_NO_OWNER,
+                      "Could not get statistics for name '%s': no such name",
+                      name);
+      return FALSE;
+    }
+
+  connection = bus_service_get_primary_owners_connection (service);
+
+  get_connection_counts (connection, &counts);
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL)
+    goto oom;
+
+  if (!asv_open (reply, &iter, &arr_iter))
+    goto oom;
+
+  if (!asv_add_uint32 (&arr_iter, "IncomingMessages", counts.stats.incoming_messages) ||
+      !asv_add_uint32 (&arr_iter, "IncomingBytes", counts.stats.incoming_bytes) ||
+      !asv_add_uint32 (&arr_iter, "OutgoingMessages", counts.stats.outgoing_messages) ||
+      !asv_add_uint32 (&arr_iter, "OutgoingBytes", counts.stats.outgoing_bytes) ||
+      !asv_add_uint32 (&arr_iter, "OutgoingQueueBytes", counts.outgoing_size) ||
+      !asv_add_uint32 (&arr_iter, "MatchRules",
+                       bus_connection_get_n_match_rules (connection)) ||
+      !asv_add_uint32 (&arr_iter, "NamesOwned",
+                       bus_connection_get_n_services_owned (connection)) ||
+      !asv_add_uint32 (&arr_iter, "RepliesToReceive", counts.n_replies_to_receive) ||
+      !asv_add_uint32 (&arr_iter, "RepliesToSend", counts.n_replies_to_send) ||
+      !asv_add_uint32 (&arr_iter, "ReadBytesPerIteration", counts.read_budget) ||
+      !asv_add_uint32 (&arr_iter, "WriteBytesPerIteration", counts.write_budget) ||
+      !asv_add_uint32 (&arr_iter, "ExpiredMessages", counts.expired) ||
+      !asv_add_uint32 (&arr_iter, "DispatchMicroseconds", counts.stats.dispatch_usec) ||
+      (bus_connection_is_monitor (connection) &&
+       !asv_add_uint32 (&arr_iter, "MonitorDroppedMessages",
+                        counts.stats.monitor_dropped)))
+    {
+      dbus_message_iter_abandon_container (&iter, &arr_iter);
+      goto oom;
+    }
+
+  if (!close_and_send_reply (reply, &iter, &arr_iter, caller_connection, transaction))
+    goto oom;
+
+  dbus_message_unref (reply);
+  return TRUE;
+
+ oom:
+  if (reply != NULL)
+    dbus_message_unref (reply);
+  BUS_SET_OOM (error);
+  return FALSE;
+}
+
+dbus_bool_t
+bus_stats_handle_get_user_stats (DBusConnection *connection,
+                                 BusTransaction *transaction,
+                                 DBusMessage    *message,
+                                 DBusError      *error)
+{
+  dbus_uint32_t uid;
+  int n_connections;
+  dbus_uint32_t dispatch_usec;
+  DBusMessage *reply;
+  DBusMessageIter iter, arr_iter;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!dbus_message_get_args (message, error,
+                              DBUS_TYPE_UINT32, &uid,
+                              DBUS_TYPE_INVALID))
+    return FALSE;
+
+  if (!bus_connections_get_user_stats (bus_connection_get_connections (connection),
+                                       uid, &n_connections, &dispatch_usec))
+    {
+      dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                      "Could not get statistics for uid %u: it has no connections",
+                      uid);
+      return FALSE;
+    }
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL)
+    goto oom;
+
+  if (!asv_open (reply, &iter, &arr_iter))
+    goto oom;
+
+  if (!asv_add_uint32 (&arr_iter, "ActiveConnections", n_connections) ||
+      !asv_add_uint32 (&arr_iter, "DispatchMicroseconds", dispatch_usec))
+    {
+      dbus_message_iter_abandon_container (&iter, &arr_iter);
+      goto oom;
+    }
+
+  if (!close_and_send_reply (reply, &iter, &arr_iter, connection, transaction))
+    goto oom;
+
+  dbus_message_unref (reply);
+  return TRUE;
+
+ oom:
+  if (reply != NULL)
+    dbus_message_unref (reply);
+  BUS_SET_OOM (error);
+  return FALSE;
+}
+
+dbus_bool_t
+bus_stats_handle_get_latency_histograms (DBusConnection *connection,
+                                         BusTransaction *transaction,
+                                         DBusMessage    *message,
+                                         DBusError      *error)
+{
+  DBusMessage *reply;
+  DBusMessageIter iter, arr_iter, entry_iter, buckets_iter;
+  const dbus_uint32_t *buckets;
+  int stage;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL)
+    goto oom;
+
+  dbus_message_iter_init_append (reply, &iter);
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+                                         DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+                                         DBUS_TYPE_STRING_AS_STRING
+                                         DBUS_TYPE_ARRAY_AS_STRING
+                                         DBUS_TYPE_UINT32_AS_STRING
+                                         DBUS_DICT_ENTRY_END_CHAR_AS_STRING,
+                                         &arr_iter))
+    goto oom;
+
+  /* Stay empty rather than report zeroes when nothing is measured */
+  for (stage = 0; latency_enabled && stage < BUS_N_LATENCY_STAGES; stage++)
+    {
+      if (!dbus_message_iter_open_container (&arr_iter, DBUS_TYPE_DICT_ENTRY,
+                                             NULL, &entry_iter))
+        goto abandon_array;
+
+      buckets = latency_buckets[stage];
+      if (!dbus_message_iter_append_basic (&entry_iter, DBUS_TYPE_STRING,
+                                           &latency_stage_names[stage]) ||
+          !dbus_message_iter_open_container (&entry_iter, DBUS_TYPE_ARRAY,
+                                             DBUS_TYPE_UINT32_AS_STRING,
+                                             &buckets_iter))
+        goto abandon_entry;
+
+      if (!dbus_message_iter_append_fixed_array (&buckets_iter,
+                                                 DBUS_TYPE_UINT32, &buckets,
+                                                 BUS_LATENCY_N_BUCKETS))
+        {
+          dbus_message_iter_abandon_container (&entry_iter, &buckets_iter);
+          goto abandon_entry;
+        }
+
+      if (!dbus_message_iter_close_container (&entry_iter, &buckets_iter))
+        goto abandon_entry;
+
+      if (!dbus_message_iter_close_container (&arr_iter, &entry_iter))
+        goto abandon_array;
+    }
+
+  if (!close_and_send_reply (reply, &iter, &arr_iter, connection, transaction))
+    goto oom;
+
+  dbus_message_unref (reply);
+  return TRUE;
+
+ abandon_entry:
+  dbus_message_iter_abandon_container (&arr_iter, &entry_iter);
+ abandon_array:
+  dbus_message_iter_abandon_container (&iter, &arr_iter);
+ oom:
+  if (reply != NULL)
+    dbus_message_unref (reply);
+  BUS_SET_OOM (error);
+  return FALSE;
+}
+
+#ifdef DBUS_UNIX
+
+/* The stats file is for monitoring agents that would rather not ask
+ * the bus they are measuring. Other processes read it while we write
+ * it, so each update makes the sequence number odd first and even
+ * again after; see stats.h.
+ */
+static BusContext *stats_file_context = NULL;
+static DBusString stats_file_name;
+static BusStatsFileHeader *stats_file = NULL;
+static size_t stats_file_size;
+static DBusTimeout *stats_file_timeout = NULL;
+
+typedef struct
+{
+  BusStatsFileConnection *entries;
+  dbus_uint32_t n_entries;
+  dbus_uint32_t n_left_out;
+} StatsFileConnectionsData;
+
+static dbus_bool_t
+stats_file_add_connection (DBusConnection *connection,
+                           void           *data)
+{
+  StatsFileConnectionsData *d = data;
+  BusStatsFileConnection *entry;
+  BusStatsConnectionCounts counts;
+  const char *name;
+
+  if (d->n_entries == stats_file->max_connections)
+    {
+      d->n_left_out += 1;
+      return TRUE;
+    }
+
+  entry = &d->entries[d->n_entries];
+  d->n_entries += 1;
+
+  get_connection_counts (connection, &counts);
+
+  memset (entry->unique_name, '\0', BUS_STATS_FILE_NAME_LEN);
+  name = bus_connection_get_name (connection);
+  if (name != NULL)
+    strncpy (entry->unique_name, name, BUS_STATS_FILE_NAME_LEN - 1);
+
+  entry->incoming_messages = counts.stats.incoming_messages;
+  entry->incoming_bytes = counts.stats.incoming_bytes;
+  entry->outgoing_messages = counts.stats.outgoing_messages;
+  entry->outgoing_bytes = counts.stats.outgoing_bytes;
+  entry->outgoing_queue_bytes = counts.outgoing_size;
+  entry->match_rules = bus_connection_get_n_match_rules (connection);
+  entry->names_owned = bus_connection_get_n_services_owned (connection);
+  entry->replies_to_receive = counts.n_replies_to_receive;
+  entry->replies_to_send = counts.n_replies_to_send;
+  entry->monitor_dropped = counts.stats.monitor_dropped;
+  entry->dispatch_usec = counts.stats.dispatch_usec;
+
+  return TRUE;
+}
+
+/**
+ * Writes the current counters into the stats file, if there is one.
+ * This happens every #BUS_STATS_FILE_INTERVAL milliseconds by itself.
+ */
+void
+bus_stats_file_update (void)
+{
+  BusStatsCounts counts;
+  StatsFileConnectionsData d;
+  long tv_sec, tv_usec;
+  int i;
+
+  if (stats_file == NULL)
+    return;
+
+  get_counts (stats_file_context, &counts);
+  _dbus_get_current_time (&tv_sec, &tv_usec);
+
+  /* odd while we write */
+  _dbus_atomic_inc (&stats_file->sequence);
+
+  stats_file->updated_sec = tv_sec;
+  stats_file->updated_usec = tv_usec;
+
+  stats_file->active_connections = counts.n_completed;
+  stats_file->incomplete_connections = counts.n_incomplete;
+  stats_file->pending_replies = counts.n_pending_replies;
+  stats_file->match_rules = counts.n_rules;
+  stats_file->match_rule_sets = counts.n_rule_sets;
+  stats_file->cached_parsed_match_rules = counts.n_cached_rules;
+  stats_file->match_recipients_capacity = counts.max_recipients;
+  stats_file->message_cache_hits = counts.cache_hits;
+  stats_file->message_cache_misses = counts.cache_misses;
+
+  stats_file->alloc_profile_enabled = FALSE;
+  for (i = 0; i < DBUS_N_ALLOC_SUBSYSTEMS; i++)
+    {
+      if (!_dbus_get_alloc_profile (i, &stats_file->alloc_profile[i][0],
+                                    &stats_file->alloc_profile[i][1],
+                                    &stats_file->alloc_profile[i][2]))
+        break;
+      stats_file->alloc_profile_enabled = TRUE;
+    }
+
+  stats_file->latency_enabled = latency_enabled;
+  memcpy (stats_file->latency_buckets, latency_buckets,
+          sizeof (latency_buckets));
+
+  d.entries = (BusStatsFileConnection *) (stats_file + 1);
+  d.n_entries = 0;
+  d.n_left_out = 0;
+  bus_connections_foreach_active (bus_context_get_connections (stats_file_context),
+                                  stats_file_add_connection, &d);
+  stats_file->n_connections = d.n_entries;
+  stats_file->n_connections_left_out = d.n_left_out;
+
+  _dbus_atomic_inc (&stats_file->sequence);
+}
+
+static dbus_bool_t
+stats_file_refresh (void *data)
+{
+  bus_stats_file_update ();
+  return TRUE;
+}
+
+static void
+stats_file_timeout_callback (DBusTimeout *timeout,
+                             void        *data)
+{
+  dbus_timeout_handle (timeout);
+}
+
+/**
+ * Creates the stats file, replacing any file of that name, and keeps
+ * it up to date from the bus's main loop until bus_stats_file_close().
+ * Only the user the bus runs as can read it.
+ *
+ * @param context the bus
+ * @param filename the file to create
+ * @param error return location for errors
+ * @returns #FALSE if the file could not be created
+ */
+dbus_bool_t
+bus_stats_file_open (BusContext       *context,
+                     const DBusString *filename,
+                     DBusError        *error)
+{
+  int max_connections;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+  _dbus_assert (stats_file == NULL);
+
+  max_connections = MIN (bus_context_get_max_completed_connections (context),
+                         BUS_STATS_FILE_MAX_CONNECTIONS);
+
+  if (!_dbus_string_init (&stats_file_name))
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  if (!_dbus_string_copy (filename, 0, &stats_file_name, 0))
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
+  stats_file_timeout = _dbus_timeout_new (BUS_STATS_FILE_INTERVAL,
+                                          stats_file_refresh, NULL, NULL);
+  if (stats_file_timeout == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
+  if (!_dbus_loop_add_timeout (bus_context_get_loop (context),
+                               stats_file_timeout,
+                               stats_file_timeout_callback, NULL, NULL))
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
+  stats_file_size = sizeof (BusStatsFileHeader) +
+    max_connections * sizeof (BusStatsFileConnection);
+  stats_file = _dbus_file_map_shared (filename, stats_file_size, FALSE,
+                                      error);
+  if (stats_file == NULL)
+    {
+      _dbus_loop_remove_timeout (bus_context_get_loop (context),
+                                 stats_file_timeout,
+                                 stats_file_timeout_callback, NULL);
+      goto failed;
+    }
+
+  stats_file_context = context;
+
+  memcpy (stats_file->magic, BUS_STATS_FILE_MAGIC, sizeof (stats_file->magic));
+  stats_file->version = BUS_STATS_FILE_VERSION;
+  stats_file->header_size = sizeof (BusStatsFileHeader);
+  stats_file->pid = _dbus_getpid ();
+  stats_file->interval_msec = BUS_STATS_FILE_INTERVAL;
+  stats_file->connection_size = sizeof (BusStatsFileConnection);
+  stats_file->max_connections = max_connections;
+
+  bus_stats_file_update ();
+
+  return TRUE;
+
+ failed:
+  if (stats_file_timeout != NULL)
+    {
+      _dbus_timeout_unref (stats_file_timeout);
+      stats_file_timeout = NULL;
+    }
+  _dbus_string_free (&stats_file_name);
+  return FALSE;
+}
+
+/**
+ * Stops updating the stats file and deletes it, if there is one.
+ */
+void
+bus_stats_file_close (void)
+{
+  if (stats_file == NULL)
+    return;
+
+  _dbus_loop_remove_timeout (bus_context_get_loop (stats_file_context),
+                             stats_file_timeout,
+                             stats_file_timeout_callback, NULL);
+  _dbus_timeout_unref (stats_file_timeout);
+  stats_file_timeout = NULL;
+
+  _dbus_file_unmap_shared (stats_file, stats_file_size);
+  stats_file = NULL;
+  stats_file_context = NULL;
+
+  _dbus_delete_file (&stats_file_name, NULL);
+  _dbus_string_free (&stats_file_name);
+}
+
+#else /* !DBUS_UNIX */
+
+dbus_bool_t
+bus_stats_file_open (BusContext       *context,
+                     const DBusString *filename,
+                     DBusError        *error)
+{
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "A stats file is not supported on this platform");
+  return FALSE;
+}
+
+void
+bus_stats_file_update (void)
+{
+}
+
+void
+bus_stats_file_close (void)
+{
+}
+
+#endif /* !DBUS_UNIX */
@@ -0,0 +1,160 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* stats.h  Bus statistics interface
+ *
+ * Copyright (C) 2003  Red Hat, Inc.
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef BUS_STATS_H
+#define BUS_STATS_H
+
+#include <dbus/dbus.h>
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-sysdeps.h>
+#include "connection.h"
+
+#define BUS_INTERFACE_STATS "org.freedesktop.DBus.Debug.Stats"
+
+/* The stages of routing a message that bus_stats_latency_stop() can
+ * account time to.  The names used in replies and in the log are in
+ * stats.c and must be kept in the same order.
+ */
+typedef enum
+{
+  BUS_LATENCY_DISPATCH,   /**< all of bus_dispatch() */
+  BUS_LATENCY_POLICY,     /**< one security policy check */
+  BUS_LATENCY_MATCHMAKER, /**< finding the recipients of a broadcast */
+  BUS_LATENCY_EXECUTE,    /**< queueing a transaction's messages */
+  BUS_N_LATENCY_STAGES
+} BusLatencyStage;
+
+/* Bucket 0 counts durations under a microsecond, bucket i durations
+ * in [2^(i-1), 2^i) microseconds, and the last bucket everything
+ * longer.
+ */
+#define BUS_LATENCY_N_BUCKETS 20
+
+typedef struct
+{
+  long tv_sec;  /**< -1 if latency statistics were off at start */
+  long tv_usec;
+} BusLatencyTimer;
+
+/* Layout of the file written with --stats-file, which is described
+ * in the dbus-daemon man page: a BusStatsFileHeader followed by room
+ * for max_connections BusStatsFileConnection. Everything is in the
+ * host's byte order, and a new version number goes with any change
+ * to it. Readers retry until they see the same even sequence number
+ * before and after reading.
+ */
+#define BUS_STATS_FILE_MAGIC "DBUSSTAT"
+#define BUS_STATS_FILE_VERSION 2
+
+/* Unique names get longer than this only after billions of
+ * connections; longer ones are cut short
+ */
+#define BUS_STATS_FILE_NAME_LEN 32
+
+/* However many connections the configuration allows, the file has
+ * room for no more than this
+ */
+#define BUS_STATS_FILE_MAX_CONNECTIONS 65536
+
+typedef struct
+{
+  char unique_name[BUS_STATS_FILE_NAME_LEN]; /**< nul-padded */
+  dbus_uint32_t incoming_messages;
+  dbus_uint32_t incoming_bytes;
+  dbus_uint32_t outgoing_messages;
+  dbus_uint32_t outgoing_bytes;
+  dbus_uint32_t outgoing_queue_bytes;
+  dbus_uint32_t match_rules;
+  dbus_uint32_t names_owned;
+  dbus_uint32_t replies_to_receive;
+  dbus_uint32_t replies_to_send;
+  dbus_uint32_t monitor_dropped;
+  dbus_uint32_t dispatch_usec;
+} BusStatsFileConnection;
+
+typedef struct
+{
+  char magic[8];
+  dbus_uint32_t version;
+  dbus_uint32_t header_size;
+  DBusAtomic sequence;
+  dbus_uint32_t pid;
+  dbus_uint32_t interval_msec;
+  dbus_uint32_t updated_sec;
+  dbus_uint32_t updated_usec;
+
+  dbus_uint32_t active_connections;
+  dbus_uint32_t incomplete_connections;
+  dbus_uint32_t pending_replies;
+  dbus_uint32_t match_rules;
+  dbus_uint32_t match_rule_sets;
+  dbus_uint32_t cached_parsed_match_rules;
+  dbus_uint32_t match_recipients_capacity;
+  dbus_uint32_t message_cache_hits;
+  dbus_uint32_t message_cache_misses;
+
+  dbus_uint32_t alloc_profile_enabled;
+  dbus_uint32_t alloc_profile[DBUS_N_ALLOC_SUBSYSTEMS][3];
+
+  dbus_uint32_t latency_enabled;
+  dbus_uint32_t latency_buckets[BUS_N_LATENCY_STAGES][BUS_LATENCY_N_BUCKETS];
+
+  dbus_uint32_t connection_size;
+  dbus_uint32_t max_connections;
+  dbus_uint32_t n_connections;
+  dbus_uint32_t n_connections_left_out;
+} BusStatsFileHeader;
+
+/* How often, in milliseconds, the stats file is brought up to date */
+#define BUS_STATS_FILE_INTERVAL 100
+
+void        bus_stats_set_latency_enabled (dbus_bool_t      enabled);
+void        bus_stats_latency_start       (BusLatencyTimer *timer);
+void        bus_stats_latency_stop        (BusLatencyTimer *timer,
+                                           BusLatencyStage  stage);
+void        bus_stats_log_latency         (BusContext      *context);
+
+dbus_bool_t bus_stats_file_open           (BusContext       *context,
+                                           const DBusString *filename,
+                                           DBusError        *error);
+void        bus_stats_file_update         (void);
+void        bus_stats_file_close          (void);
+
+dbus_bool_t bus_stats_handle_get_stats            (DBusConnection *connection,
+                                                   BusTransaction *transaction,
+                                                   DBusMessage    *message,
+                                                   DBusError      *error);
+dbus_bool_t bus_stats_handle_get_connection_stats (DBusConnection *connection,
+                                                   BusTransaction *transaction,
+                                                   DBusMessage    *message,
+                                                   DBusError      *error);
+dbus_bool_t bus_stats_handle_get_user_stats       (DBusConnection *connection,
+                                                   BusTransaction *transaction,
+                                                   DBusMessage    *message,
+                                                   DBusError      *error);
+dbus_bool_t bus_stats_handle_get_latency_histograms (DBusConnection *connection,
+                                                     BusTransaction *transaction,
+                                                     DBusMessage    *message,
+                                                     DBusError      *error);
+
+#endif /* BUS_STATS_H */
@@ -25,6 +25,7 @@
 #include "test.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <dbus/dbus-string.h>
 #include <dbus/dbus-sysdeps.h>
 #include <dbus/dbus-internals.h>
@@ -98,12 +99,42 @@ main (int argc, char **argv)
 
   if (!_dbus_threads_init_debug ())
     die ("initializing debug threads");
+
+  /* benchmarks measure rather than check, so only run when asked for */
+  if (argc > 2 && strcmp (argv[2], "matchmaker-benchmark") == 0)
+    {
+      test_pre_hook ();
+      printf ("%s: Running matchmaker benchmark\n", argv[0]);
+      if (!bus_matchmaker_benchmark (&test_data_dir))
+        die ("matchmaker benchmark");
+      test_post_hook ();
+
+      return 0;
+    }
  
   test_pre_hook ();
   printf ("%s: Running expire list test\n", argv[0]);
   if (!bus_expire_list_test (&test_data_dir))
     die ("expire list");
   test_post_hook ();
+
+  test_pre_hook ();
+  printf ("%s: Running atoms test\n", argv[0]);
+  if (!bus_atoms_test (&test_data_dir))
+    die ("atoms");
+  test_post_hook ();
+
+  test_pre_hook ();
+  printf ("%s: Running resolver test\n", argv[0]);
+  if (!bus_resolver_test (&test_data_dir))
+    die ("resolver");
+  test_post_hook ();
+
+  test_pre_hook ();
+  printf ("%s: Running logger test\n", argv[0]);
+  if (!bus_logger_test (&test_data_dir))
+    die ("logger");
+  test_post_hook ();
  
   test_pre_hook ();
   printf ("%s: Running config file parser test\n", argv[0]);
@@ -129,6 +160,100 @@ main (int argc, char **argv)
     die ("sha1");
   test_post_hook ();
 
+#ifdef DBUS_UNIX
+  test_pre_hook ();
+  printf ("%s: Running stats file test\n", argv[0]);
+  if (!bus_dispatch_stats_file_test (&test_data_dir))
+    die ("stats file");
+  test_post_hook ();
+#endif
+
+  test_pre_hook ();
+  printf ("%s: Running AddMatches test\n", argv[0]);
+  if (!bus_dispatch_add_matches_test (&test_data_dir))
+    die ("AddMatches");
+  test_post_hook ();
+
+  test_pre_hook ();
+  printf ("%s: Running name batch test\n", argv[0]);
+  if (!bus_dispatch_name_batch_test (&test_data_dir))
+    die ("name batch");
+  test_post_hook ();
+
+  test_pre_hook ();
+  printf ("%s: Running dispatch batch test\n", argv[0]);
+  if (!bus_dispatch_batch_test (&test_data_dir))
+    die ("dispatch batch");
+  test_post_hook ();
+
+  test_pre_hook ();
+  printf ("%s: Running cork test\n", argv[0]);
+  if (!bus_dispatch_cork_test (&test_data_dir))
+    die ("cork");
+  test_post_hook ();
+
+  test_pre_hook ();
+  printf ("%s: Running send batch test\n", argv[0]);
+  if (!bus_dispatch_send_batch_test (&test_data_dir))
+    die ("send batch");
+  test_post_hook ();
+
+  test_pre_hook ();
+  printf ("%s: Running outgoing lanes test\n", argv[0]);
+  if (!bus_dispatch_outgoing_lanes_test (&test_data_dir))
+    die ("outgoing lanes");
+  test_post_hook ();
+
+#ifdef DBUS_UNIX
+  test_pre_hook ();
+  printf ("%s: Running handoff test\n", argv[0]);
+  if (!bus_dispatch_handoff_test (&test_data_dir))
+    die ("handoff");
+  test_post_hook ();
+#endif
+
+  test_pre_hook ();
+  printf ("%s: Running deferred reply test\n", argv[0]);
+  if (!bus_dispatch_deferred_reply_test (&test_data_dir))
+    die ("deferred reply");
+  test_post_hook ();
+
+  test_pre_hook ();
+  printf ("%s: Running connection statistics test\n", argv[0]);
+  if (!bus_dispatch_statistics_test (&test_data_dir))
+    die ("connection statistics");
+  test_post_hook ();
+
+  test_pre_hook ();
+  printf ("%s: Running priority test\n", argv[0]);
+  if (!bus_dispatch_priority_test (&test_data_dir))
+    die ("priority");
+  test_post_hook ();
+
+  test_pre_hook ();
+  printf ("%s: Running expiry test\n", argv[0]);
+  if (!bus_dispatch_expiry_test (&test_data_dir))
+    die ("expiry");
+  test_post_hook ();
+
+  test_pre_hook ();
+  printf ("%s: Running dispatch accounting test\n", argv[0]);
+  if (!bus_dispatch_accounting_test (&test_data_dir))
+    die ("dispatch accounting");
+  test_post_hook ();
+
+  test_pre_hook ();
+  printf ("%s: Running route cache test\n", argv[0]);
+  if (!bus_dispatch_route_cache_test (&test_data_dir))
+    die ("route cache");
+  test_post_hook ();
+
+  test_pre_hook ();
+  printf ("%s: Running async register test\n", argv[0]);
+  if (!bus_dispatch_async_register_test (&test_data_dir))
+    die ("async register");
+  test_post_hook ();
+
   test_pre_hook ();
   printf ("%s: Running message dispatch test\n", argv[0]);
   if (!bus_dispatch_test (&test_data_dir)) 
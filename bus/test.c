@@ -25,6 +25,7 @@
 
 #ifdef DBUS_BUILD_TESTS
 #include "test.h"
+#include "resolver.h"
 #include <dbus/dbus-internals.h>
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-sysdeps.h>
@@ -70,6 +71,13 @@ remove_client_watch (DBusWatch      *watch,
                            watch, client_watch_callback, connection);
 }
 
+static void
+toggle_client_watch (DBusWatch      *watch,
+                     void           *data)
+{
+  _dbus_loop_toggle_watch (client_loop, watch);
+}
+
 static void
 client_timeout_callback (DBusTimeout   *timeout,
                          void          *data)
@@ -102,6 +110,13 @@ remove_client_timeout (DBusTimeout    *timeout,
   _dbus_loop_remove_timeout (client_loop, timeout, client_timeout_callback, connection);
 }
 
+static void
+toggle_client_timeout (DBusTimeout    *timeout,
+                       void           *data)
+{
+  _dbus_loop_toggle_timeout (client_loop, timeout);
+}
+
 static DBusHandlerResult
 client_disconnect_filter (DBusConnection     *connection,
                           DBusMessage        *message,
@@ -117,6 +132,14 @@ client_disconnect_filter (DBusConnection     *connection,
 
   _dbus_list_remove (&clients, connection);
 
+  /* A client that made method calls with replies keeps the timeout
+   * they share until it is finalized; take it out of the loop now,
+   * while there still is one
+   */
+  dbus_connection_set_timeout_functions (connection,
+                                         NULL, NULL, NULL,
+                                         NULL, NULL);
+
   dbus_connection_unref (connection);
 
   if (clients == NULL)
@@ -150,7 +173,7 @@ bus_setup_debug_client (DBusConnection *connection)
   if (!dbus_connection_set_watch_functions (connection,
                                             add_client_watch,
                                             remove_client_watch,
-                                            NULL,
+                                            toggle_client_watch,
                                             connection,
                                             NULL))
     goto out;
@@ -158,7 +181,7 @@ bus_setup_debug_client (DBusConnection *connection)
   if (!dbus_connection_set_timeout_functions (connection,
                                               add_client_timeout,
                                               remove_client_timeout,
-                                              NULL,
+                                              toggle_client_timeout,
                                               connection, NULL))
     goto out;
 
@@ -323,7 +346,7 @@ bus_context_new_test (const DBusString *test_data_dir,
     }
 
   dbus_error_init (&error);
-  context = bus_context_new (&config_file, FALSE, NULL, NULL, NULL, FALSE, &error);
+  context = bus_context_new (&config_file, FALSE, NULL, NULL, NULL, FALSE, NULL, &error);
   if (context == NULL)
     {
       _DBUS_ASSERT_ERROR_IS_SET (&error);
@@ -340,6 +363,12 @@ bus_context_new_test (const DBusString *test_data_dir,
 
   _dbus_string_free (&config_file);
 
+  /* The tests expect the reply to a Hello within the iteration that
+   * handled it, so resolve groups on the main loop as before;
+   * bus_resolver_test() covers the helper threads.
+   */
+  bus_resolver_set_max_threads (bus_context_get_resolver (context), 0);
+
   return context;
 }
 
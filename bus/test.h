@@ -32,11 +32,30 @@
 
 dbus_bool_t bus_dispatch_test         (const DBusString             *test_data_dir);
 dbus_bool_t bus_dispatch_sha1_test    (const DBusString             *test_data_dir);
+dbus_bool_t bus_dispatch_add_matches_test (const DBusString         *test_data_dir);
+dbus_bool_t bus_dispatch_name_batch_test (const DBusString          *test_data_dir);
+dbus_bool_t bus_dispatch_batch_test  (const DBusString             *test_data_dir);
+dbus_bool_t bus_dispatch_cork_test   (const DBusString             *test_data_dir);
+dbus_bool_t bus_dispatch_send_batch_test (const DBusString        *test_data_dir);
+dbus_bool_t bus_dispatch_outgoing_lanes_test (const DBusString     *test_data_dir);
+dbus_bool_t bus_dispatch_handoff_test (const DBusString             *test_data_dir);
+dbus_bool_t bus_dispatch_deferred_reply_test (const DBusString      *test_data_dir);
+dbus_bool_t bus_dispatch_statistics_test (const DBusString        *test_data_dir);
+dbus_bool_t bus_dispatch_stats_file_test (const DBusString          *test_data_dir);
+dbus_bool_t bus_dispatch_priority_test (const DBusString            *test_data_dir);
+dbus_bool_t bus_dispatch_expiry_test (const DBusString              *test_data_dir);
+dbus_bool_t bus_dispatch_accounting_test (const DBusString          *test_data_dir);
+dbus_bool_t bus_dispatch_route_cache_test (const DBusString         *test_data_dir);
+dbus_bool_t bus_dispatch_async_register_test (const DBusString      *test_data_dir);
 dbus_bool_t bus_policy_test           (const DBusString             *test_data_dir);
 dbus_bool_t bus_config_parser_test    (const DBusString             *test_data_dir);
 dbus_bool_t bus_config_parser_trivial_test (const DBusString        *test_data_dir);
 dbus_bool_t bus_signals_test          (const DBusString             *test_data_dir);
+dbus_bool_t bus_matchmaker_benchmark  (const DBusString             *test_data_dir);
 dbus_bool_t bus_expire_list_test      (const DBusString             *test_data_dir);
+dbus_bool_t bus_atoms_test            (const DBusString             *test_data_dir);
+dbus_bool_t bus_resolver_test         (const DBusString             *test_data_dir);
+dbus_bool_t bus_logger_test           (const DBusString             *test_data_dir);
 dbus_bool_t bus_activation_service_reload_test (const DBusString    *test_data_dir);
 dbus_bool_t bus_setup_debug_client    (DBusConnection               *connection);
 void        bus_test_clients_foreach  (BusConnectionForeachFunction  function,
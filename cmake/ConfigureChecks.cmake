@@ -20,6 +20,10 @@ check_include_file(signal.h     HAVE_SIGNAL_H)
 check_include_file(locale.h     HAVE_LOCALE_H)
 check_include_file(inttypes.h     HAVE_INTTYPES_H)   # dbus-pipe.h
 check_include_file(stdint.h     HAVE_STDINT_H)   # dbus-pipe.h
+check_include_file(sys/sdt.h    HAVE_SYS_SDT_H)  # dbus-internals.h
+check_include_file(linux/errqueue.h HAVE_LINUX_ERRQUEUE_H) # dbus-sysdeps-unix.c
+check_include_file(sys/eventfd.h HAVE_SYS_EVENTFD_H) # dbus-sysdeps-unix.c
+check_include_file(lz4.h        HAVE_LZ4_H)     # dbus-auth.c
 
 check_symbol_exists(backtrace    "execinfo.h"       HAVE_BACKTRACE)          #  dbus-sysdeps.c, dbus-sysdeps-win.c
 check_symbol_exists(getgrouplist "grp.h"            HAVE_GETGROUPLIST)       #  dbus-sysdeps.c
@@ -30,6 +34,7 @@ check_symbol_exists(setenv       "stdlib.h"         HAVE_SETENV)             #
 check_symbol_exists(unsetenv     "stdlib.h"         HAVE_UNSETENV)           #  dbus-sysdeps.c
 check_symbol_exists(clearenv     "stdlib.h"         HAVE_CLEARENV)           #  dbus-sysdeps.c
 check_symbol_exists(writev       "sys/uio.h"        HAVE_WRITEV)             #  dbus-sysdeps.c, dbus-sysdeps-win.c
+check_symbol_exists(epoll_create "sys/epoll.h"      DBUS_HAVE_LINUX_EPOLL)   #  dbus-socket-set-epoll.c
 check_symbol_exists(setrlimit    "sys/resource.h"   HAVE_SETRLIMIT)          #  dbus-sysdeps.c, dbus-sysdeps-win.c, test/test-segfault.c
 check_symbol_exists(socketpair   "sys/socket.h"     HAVE_SOCKETPAIR)         #  dbus-sysdeps.c
 check_symbol_exists(socklen_t    "sys/socket.h"     HAVE_SOCKLEN_T)          #  dbus-sysdeps-unix.c
@@ -37,6 +42,8 @@ check_symbol_exists(setlocale    "locale.h"         HAVE_SETLOCALE)          #
 check_symbol_exists(localeconv   "locale.h"         HAVE_LOCALECONV)         #  dbus-sysdeps.c
 check_symbol_exists(strtoll      "stdlib.h"         HAVE_STRTOLL)            #  dbus-send.c
 check_symbol_exists(strtoull     "stdlib.h"         HAVE_STRTOULL)           #  dbus-send.c
+check_symbol_exists(vfork        "unistd.h"         HAVE_VFORK)              #  dbus-spawn.c
+check_symbol_exists(mremap       "sys/mman.h"       HAVE_MREMAP)             #  dbus-sysdeps-unix.c
 
 check_struct_member(cmsgcred cmcred_pid "sys/types.h sys/socket.h" HAVE_CMSGCRED)   #  dbus-sysdeps.c
 
@@ -49,6 +49,8 @@
 #cmakedefine DBUS_BUILD_TESTS 1
 #cmakedefine DBUS_ENABLE_ANSI 1
 #cmakedefine DBUS_ENABLE_VERBOSE_MODE 1
+#cmakedefine DBUS_ENABLE_TRACEPOINTS 1
+#cmakedefine HAVE_LZ4 1
 #cmakedefine DBUS_DISABLE_ASSERTS 1
 #cmakedefine DBUS_DISABLE_CHECKS 1
 /* xmldocs */
@@ -84,6 +86,9 @@
 
 #cmakedefine DBUS_BUILD_X11 1
 
+/* Use Linux epoll in the main loop */
+#cmakedefine DBUS_HAVE_LINUX_EPOLL 1
+
 #define _DBUS_VA_COPY_ASSIGN(a1,a2) { a1 = a2; }
 
 #cmakedefine DBUS_VA_COPY_FUNC
@@ -149,6 +154,12 @@
 /* Define to 1 if you have stdint.h */
 #cmakedefine   HAVE_STDINT_H 1
 
+/* Define to 1 if you have linux/errqueue.h */
+#cmakedefine   HAVE_LINUX_ERRQUEUE_H 1
+
+/* Define to 1 if you have sys/eventfd.h */
+#cmakedefine   HAVE_SYS_EVENTFD_H 1
+
 // symbols
 /* Define to 1 if you have backtrace */
 #cmakedefine   HAVE_BACKTRACE 1
@@ -180,6 +191,12 @@
 /* Define to 1 if you have writev */
 #cmakedefine   HAVE_WRITEV 1
 
+/* Define to 1 if you have vfork */
+#cmakedefine   HAVE_VFORK 1
+
+/* Define to 1 if you have mremap */
+#cmakedefine   HAVE_MREMAP 1
+
 /* Define to 1 if you have socklen_t */
 #cmakedefine   HAVE_SOCKLEN_T 1
 
@@ -40,6 +40,9 @@
 /* Support a verbose mode */
 #undef DBUS_ENABLE_VERBOSE_MODE
 
+/* Build with static tracepoints */
+#undef DBUS_ENABLE_TRACEPOINTS
+
 /* Defined if gcov is enabled to force a rebuild due to config.h changing */
 #undef DBUS_GCOV_ENABLED
 
@@ -55,6 +58,9 @@
 /* Defined if we have gcc 3.3 and thus the new gcov format */
 #undef DBUS_HAVE_GCC33_GCOV
 
+/* Use Linux epoll in the main loop */
+#define DBUS_HAVE_LINUX_EPOLL 1
+
 /* Where per-session bus puts its sockets */
 #define DBUS_SESSION_SOCKET_DIR "/data"
 
@@ -151,9 +157,15 @@
 /* Define to 1 if you have the `socket' library (-lsocket). */
 #undef HAVE_LIBSOCKET
 
+/* Define to 1 if you have the <linux/errqueue.h> header file. */
+#define HAVE_LINUX_ERRQUEUE_H 1
+
 /* Define to 1 if you have the <memory.h> header file. */
 #define HAVE_MEMORY_H 1
 
+/* Define to 1 if you have the `mremap' function. */
+#define HAVE_MREMAP 1
+
 /* Define to 1 if you have the `nanosleep' function. */
 #define HAVE_NANOSLEEP 1
 
@@ -190,6 +202,9 @@
 /* Define to 1 if you have the <string.h> header file. */
 #define HAVE_STRING_H 1
 
+/* Define to 1 if you have the <sys/eventfd.h> header file. */
+#define HAVE_SYS_EVENTFD_H 1
+
 /* Define to 1 if you have the <sys/stat.h> header file. */
 #define HAVE_SYS_STAT_H 1
 
@@ -214,6 +229,9 @@
 /* Define to 1 if you have the `vasprintf' function. */
 #define HAVE_VASPRINTF 1
 
+/* Define to 1 if you have the `vfork' function. */
+#define HAVE_VFORK 1
+
 /* Define to 1 if you have the `vsnprintf' function. */
 #define HAVE_VSNPRINTF 1
 
@@ -34,11 +34,15 @@ dbus-pipe.c \
 dbus-pipe-unix.c \
 dbus-resources.c \
 dbus-server.c \
+dbus-server-inproc.c \
 dbus-server-socket.c \
 dbus-server-unix.c \
 dbus-sha.c \
 dbus-shell.c \
 dbus-signature.c \
+dbus-socket-set.c \
+dbus-socket-set-epoll.c \
+dbus-socket-set-poll.c \
 dbus-spawn.c \
 dbus-string.c \
 dbus-string-util.c \
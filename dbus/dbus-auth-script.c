@@ -472,6 +472,15 @@ _dbus_auth_script_run (const DBusString *filename)
           _dbus_auth_set_mechanisms (auth, (const char **) mechs);
           dbus_free_string_array (mechs);
         }
+      else if (_dbus_string_starts_with_c_str (&line,
+                                               "PIPELINE"))
+        {
+          if (!_dbus_auth_client_pipeline (auth))
+            {
+              _dbus_warn ("no memory to pipeline the handshake\n");
+              goto out;
+            }
+        }
       else if (_dbus_string_starts_with_c_str (&line,
                                                "SEND"))
         {
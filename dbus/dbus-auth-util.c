@@ -36,7 +36,11 @@
 #ifdef DBUS_BUILD_TESTS
 #include "dbus-test.h"
 #include "dbus-auth-script.h"
+#include "dbus-credentials.h"
+#include "dbus-sha.h"
+#include "dbus-sysdeps.h"
 #include <stdio.h>
+#include <string.h>
 
 static dbus_bool_t
 process_test_subdir (const DBusString          *test_base_dir,
@@ -154,6 +158,326 @@ process_test_dirs (const char *test_data_dir)
   return retval;
 }
 
+/* Moves whatever @from has to send into @to's buffer */
+static DBusAuthState
+auth_pass_bytes (DBusAuth *from,
+                 DBusAuth *to)
+{
+  DBusAuthState state;
+
+  while ((state = _dbus_auth_do_work (from)) ==
+         DBUS_AUTH_STATE_HAVE_BYTES_TO_SEND)
+    {
+      const DBusString *bytes;
+      DBusString *buffer;
+      int len;
+
+      if (!_dbus_auth_get_bytes_to_send (from, &bytes))
+        _dbus_assert_not_reached ("no bytes to send");
+
+      len = _dbus_string_get_length (bytes);
+
+      _dbus_auth_get_buffer (to, &buffer);
+      if (!_dbus_string_copy (bytes, 0, buffer,
+                              _dbus_string_get_length (buffer)))
+        _dbus_assert_not_reached ("no memory to pass bytes");
+      _dbus_auth_return_buffer (to, buffer, len);
+
+      _dbus_auth_bytes_sent (from, len);
+    }
+
+  return state;
+}
+
+/* Runs a client against a server until both are done one way or
+ * the other; returns whether both ended up authenticated.
+ */
+static dbus_bool_t
+auth_run_conversation (DBusAuth *client,
+                       DBusAuth *server)
+{
+  DBusAuthState client_state;
+  DBusAuthState server_state;
+  int i;
+
+  for (i = 0; i < 50; i++)
+    {
+      client_state = auth_pass_bytes (client, server);
+      server_state = auth_pass_bytes (server, client);
+
+      if (client_state == DBUS_AUTH_STATE_NEED_DISCONNECT ||
+          server_state == DBUS_AUTH_STATE_NEED_DISCONNECT)
+        return FALSE;
+
+      if (client_state == DBUS_AUTH_STATE_AUTHENTICATED &&
+          server_state == DBUS_AUTH_STATE_AUTHENTICATED)
+        return TRUE;
+    }
+
+  _dbus_assert_not_reached ("auth conversation never finished");
+  return FALSE;
+}
+
+static DBusAuth*
+ticket_test_server_new (const char      **mechanisms,
+                        DBusCredentials  *credentials)
+{
+  DBusString guid;
+  DBusAuth *server;
+
+  _dbus_string_init_const (&guid, "0123456789abcdef0123456789abcdef");
+
+  server = _dbus_auth_server_new (&guid);
+  if (server == NULL ||
+      (mechanisms != NULL && !_dbus_auth_set_mechanisms (server, mechanisms)) ||
+      !_dbus_auth_set_credentials (server, credentials))
+    _dbus_assert_not_reached ("no memory for auth server");
+
+  return server;
+}
+
+/* Feeds one command line to a server and returns what it says back */
+static void
+ticket_test_server_line (DBusAuth   *server,
+                         const char *line,
+                         DBusString *reply)
+{
+  DBusString *buffer;
+  int len;
+
+  _dbus_auth_get_buffer (server, &buffer);
+  len = _dbus_string_get_length (buffer);
+  if (!_dbus_string_append (buffer, line) ||
+      !_dbus_string_append (buffer, "\r\n"))
+    _dbus_assert_not_reached ("no memory for auth line");
+  len = _dbus_string_get_length (buffer) - len;
+  _dbus_auth_return_buffer (server, buffer, len);
+
+  _dbus_string_set_length (reply, 0);
+
+  while (_dbus_auth_do_work (server) == DBUS_AUTH_STATE_HAVE_BYTES_TO_SEND)
+    {
+      const DBusString *bytes;
+
+      if (!_dbus_auth_get_bytes_to_send (server, &bytes) ||
+          !_dbus_string_copy (bytes, 0, reply, _dbus_string_get_length (reply)))
+        _dbus_assert_not_reached ("no memory for auth reply");
+
+      _dbus_auth_bytes_sent (server, _dbus_string_get_length (bytes));
+    }
+}
+
+/* Authenticates with EXTERNAL and asks for a ticket; returns the
+ * TICKET line's "ID SECRET" in @ticket.
+ */
+static void
+ticket_test_get_ticket (const char **mechanisms,
+                        DBusString  *ticket)
+{
+  DBusCredentials *credentials;
+  DBusString username;
+  DBusString line;
+  DBusString reply;
+  DBusAuth *server;
+
+  credentials = _dbus_credentials_new_from_current_process ();
+  if (credentials == NULL)
+    _dbus_assert_not_reached ("no memory for credentials");
+
+  server = ticket_test_server_new (mechanisms, credentials);
+
+  if (!_dbus_string_init (&username) ||
+      !_dbus_string_init (&line) ||
+      !_dbus_string_init (&reply) ||
+      !_dbus_append_user_from_current_process (&username) ||
+      !_dbus_string_append (&line, "AUTH EXTERNAL ") ||
+      !_dbus_string_hex_encode (&username, 0, &line,
+                                _dbus_string_get_length (&line)))
+    _dbus_assert_not_reached ("no memory for AUTH line");
+
+  ticket_test_server_line (server, _dbus_string_get_const_data (&line), &reply);
+  if (!_dbus_string_starts_with_c_str (&reply, "OK "))
+    _dbus_assert_not_reached ("EXTERNAL was not accepted");
+
+  ticket_test_server_line (server, "REQUEST_TICKET", &reply);
+  if (!_dbus_string_starts_with_c_str (&reply, "TICKET "))
+    _dbus_assert_not_reached ("no ticket issued");
+
+  _dbus_string_set_length (ticket, 0);
+  if (!_dbus_string_copy_len (&reply, strlen ("TICKET "),
+                              _dbus_string_get_length (&reply) -
+                              strlen ("TICKET ") - strlen ("\r\n"),
+                              ticket, 0))
+    _dbus_assert_not_reached ("no memory for ticket");
+
+  _dbus_auth_unref (server);
+  _dbus_credentials_unref (credentials);
+  _dbus_string_free (&username);
+  _dbus_string_free (&line);
+  _dbus_string_free (&reply);
+}
+
+/* Presents @ticket ("ID SECRET") to a server that can't see who we
+ * are, as over TCP; if @right_proof, answers the challenge properly,
+ * else with a proof that doesn't use the secret. Returns whether the
+ * server said OK.
+ */
+static dbus_bool_t
+ticket_test_present (const DBusString *ticket,
+                     dbus_bool_t       right_proof)
+{
+  const char *mechanisms[] = { "DBUS_TICKET", NULL };
+  DBusCredentials *credentials;
+  DBusString line;
+  DBusString reply;
+  DBusString server_challenge;
+  DBusString to_hash;
+  DBusString response;
+  DBusAuth *server;
+  dbus_bool_t accepted;
+  int i;
+
+  credentials = _dbus_credentials_new ();
+  if (credentials == NULL)
+    _dbus_assert_not_reached ("no memory for credentials");
+
+  server = ticket_test_server_new (mechanisms, credentials);
+
+  if (!_dbus_string_init (&line) ||
+      !_dbus_string_init (&reply) ||
+      !_dbus_string_init (&server_challenge) ||
+      !_dbus_string_init (&to_hash) ||
+      !_dbus_string_init (&response))
+    _dbus_assert_not_reached ("no memory for strings");
+
+  if (!_dbus_string_find_blank (ticket, 0, &i))
+    _dbus_assert_not_reached ("ticket has no secret");
+
+  if (!_dbus_string_append (&line, "AUTH DBUS_TICKET ") ||
+      !_dbus_string_hex_encode (ticket, 0, &line,
+                                _dbus_string_get_length (&line)))
+    _dbus_assert_not_reached ("no memory for AUTH line");
+  /* only the ID goes in the AUTH */
+  _dbus_string_set_length (&line, strlen ("AUTH DBUS_TICKET ") + i * 2);
+
+  ticket_test_server_line (server, _dbus_string_get_const_data (&line), &reply);
+
+  accepted = FALSE;
+
+  if (_dbus_string_starts_with_c_str (&reply, "DATA "))
+    {
+      if (!_dbus_string_hex_decode (&reply, strlen ("DATA "), NULL,
+                                    &server_challenge, 0) ||
+          !_dbus_string_copy (&server_challenge, 0, &to_hash, 0) ||
+          !_dbus_string_append (&to_hash, ":abcd:") ||
+          !_dbus_string_copy (ticket, right_proof ? i + 1 : 0, &to_hash,
+                              _dbus_string_get_length (&to_hash)) ||
+          !_dbus_string_append (&response, "abcd ") ||
+          !_dbus_sha_compute (&to_hash, &response))
+        _dbus_assert_not_reached ("no memory for proof");
+
+      _dbus_string_set_length (&line, 0);
+      if (!_dbus_string_append (&line, "DATA ") ||
+          !_dbus_string_hex_encode (&response, 0, &line,
+                                    _dbus_string_get_length (&line)))
+        _dbus_assert_not_reached ("no memory for DATA line");
+
+      ticket_test_server_line (server, _dbus_string_get_const_data (&line),
+                               &reply);
+
+      accepted = _dbus_string_starts_with_c_str (&reply, "OK ");
+    }
+
+  if (!accepted && !_dbus_string_starts_with_c_str (&reply, "REJECTED"))
+    _dbus_assert_not_reached ("ticket neither accepted nor rejected");
+
+  _dbus_auth_unref (server);
+  _dbus_credentials_unref (credentials);
+  _dbus_string_free (&line);
+  _dbus_string_free (&reply);
+  _dbus_string_free (&server_challenge);
+  _dbus_string_free (&to_hash);
+  _dbus_string_free (&response);
+
+  return accepted;
+}
+
+static void
+ticket_test (void)
+{
+  const char *ticket_mechanisms[] = { "EXTERNAL", "DBUS_COOKIE_SHA1",
+                                      "DBUS_TICKET", NULL };
+  const char *only_ticket[] = { "DBUS_TICKET", NULL };
+  DBusCredentials *anonymous;
+  DBusString ticket;
+  DBusString address;
+  DBusAuth *client;
+  DBusAuth *server;
+
+  if (!_dbus_string_init (&ticket))
+    _dbus_assert_not_reached ("no memory for ticket");
+
+  /* Servers don't hand out tickets unless asked to */
+  ticket_test_get_ticket (ticket_mechanisms, &ticket);
+
+  /* The ticket is good, once, and only with its secret */
+  if (!ticket_test_present (&ticket, TRUE))
+    _dbus_assert_not_reached ("ticket with right proof was refused");
+  if (ticket_test_present (&ticket, TRUE))
+    _dbus_assert_not_reached ("ticket was accepted twice");
+
+  ticket_test_get_ticket (ticket_mechanisms, &ticket);
+  if (ticket_test_present (&ticket, FALSE))
+    _dbus_assert_not_reached ("ticket with wrong proof was accepted");
+  /* ...and a wrong proof uses it up */
+  if (ticket_test_present (&ticket, TRUE))
+    _dbus_assert_not_reached ("ticket was good after a wrong proof");
+
+  _dbus_string_free (&ticket);
+
+  /* A client that had to use DBUS_COOKIE_SHA1 picks up a ticket,
+   * and can then get in with nothing but the ticket
+   */
+  anonymous = _dbus_credentials_new ();
+  if (anonymous == NULL)
+    _dbus_assert_not_reached ("no memory for credentials");
+
+  _dbus_string_init_const (&address, "tcp:host=localhost,port=1,ticket-test=1");
+
+  client = _dbus_auth_client_new ();
+  if (client == NULL || !_dbus_auth_set_resume_key (client, &address))
+    _dbus_assert_not_reached ("no memory for auth client");
+  server = ticket_test_server_new (ticket_mechanisms, anonymous);
+
+  if (!auth_run_conversation (client, server))
+    {
+      /* no usable keyring in this environment */
+      _dbus_warn ("could not authenticate with DBUS_COOKIE_SHA1, skipping ticket resume test\n");
+      _dbus_auth_unref (client);
+      _dbus_auth_unref (server);
+      _dbus_credentials_unref (anonymous);
+      return;
+    }
+
+  _dbus_auth_unref (client);
+  _dbus_auth_unref (server);
+
+  client = _dbus_auth_client_new ();
+  if (client == NULL || !_dbus_auth_set_resume_key (client, &address))
+    _dbus_assert_not_reached ("no memory for auth client");
+  server = ticket_test_server_new (only_ticket, anonymous);
+
+  if (!auth_run_conversation (client, server))
+    _dbus_assert_not_reached ("client could not resume with its ticket");
+
+  if (_dbus_credentials_are_anonymous (_dbus_auth_get_identity (server)))
+    _dbus_assert_not_reached ("ticket did not carry the identity over");
+
+  _dbus_auth_unref (client);
+  _dbus_auth_unref (server);
+  _dbus_credentials_unref (anonymous);
+}
+
 dbus_bool_t
 _dbus_auth_test (const char *test_data_dir)
 {
@@ -164,6 +488,8 @@ _dbus_auth_test (const char *test_data_dir)
   if (!process_test_dirs (test_data_dir))
     return FALSE;
 
+  ticket_test ();
+
   return TRUE;
 }
 
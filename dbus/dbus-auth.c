@@ -31,6 +31,10 @@
 #include "dbus-protocol.h"
 #include "dbus-credentials.h"
 
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
 /**
  * @defgroup DBusAuth Authentication
  * @ingroup  DBusInternals
@@ -126,9 +130,16 @@ typedef enum {
   DBUS_AUTH_COMMAND_ERROR,
   DBUS_AUTH_COMMAND_UNKNOWN,
   DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD,
-  DBUS_AUTH_COMMAND_AGREE_UNIX_FD
+  DBUS_AUTH_COMMAND_AGREE_UNIX_FD,
+  DBUS_AUTH_COMMAND_REQUEST_TICKET,
+  DBUS_AUTH_COMMAND_TICKET,
+  DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION,
+  DBUS_AUTH_COMMAND_AGREE_COMPRESSION
 } DBusAuthCommand;
 
+/** A ticket for the DBUS_TICKET mechanism */
+typedef struct DBusAuthTicket DBusAuthTicket;
+
 /**
  * Auth state function, determines the reaction to incoming events for
  * a particular state. Returns whether we had enough memory to
@@ -157,6 +168,9 @@ struct DBusAuth
 
   DBusString incoming;    /**< Incoming data buffer */
   DBusString outgoing;    /**< Outgoing data buffer */
+  DBusString compressed_incoming; /**< Compressed frames received but not
+                                   *   yet complete
+                                   */
   
   const DBusAuthStateData *state;         /**< Current protocol state */
 
@@ -177,6 +191,7 @@ struct DBusAuth
   DBusKeyring *keyring;             /**< Keyring for cookie mechanism. */
   int cookie_id;                    /**< ID of cookie to use */
   DBusString challenge;             /**< Challenge sent to client */
+  DBusAuthTicket *ticket;           /**< Ticket being presented with DBUS_TICKET */
 
   char **allowed_mechs;             /**< Mechanisms we're allowed to use,
                                      * or #NULL if we can use any
@@ -191,6 +206,11 @@ struct DBusAuth
 
   unsigned int unix_fd_possible : 1;  /**< This side could do unix fd passing */
   unsigned int unix_fd_negotiated : 1; /**< Unix fd was successfully negotiated */
+  unsigned int pipelined : 1;         /**< Client sent BEGIN without waiting for OK */
+  unsigned int tickets_offered : 1;   /**< Server listed DBUS_TICKET among its mechanisms */
+  unsigned int compression_possible : 1;   /**< This side could compress the message stream */
+  unsigned int compression_negotiated : 1; /**< The message stream is compressed */
+  unsigned int decoding_failed : 1;        /**< The peer's compressed stream made no sense */
 };
 
 /**
@@ -203,6 +223,8 @@ typedef struct
   DBusList *mechs_to_try; /**< Mechanisms we got from the server that we're going to try using */
 
   DBusString guid_from_server; /**< GUID received from server */
+
+  DBusString resume_key; /**< Address tickets are kept under, empty for none */
   
 } DBusAuthClient;
 
@@ -234,6 +256,9 @@ static dbus_bool_t send_begin                (DBusAuth *auth);
 static dbus_bool_t send_cancel               (DBusAuth *auth);
 static dbus_bool_t send_negotiate_unix_fd    (DBusAuth *auth);
 static dbus_bool_t send_agree_unix_fd        (DBusAuth *auth);
+static dbus_bool_t send_request_ticket       (DBusAuth *auth);
+static dbus_bool_t send_negotiate_compression (DBusAuth *auth);
+static dbus_bool_t send_agree_compression    (DBusAuth *auth);
 
 /**
  * Client states
@@ -275,6 +300,18 @@ static dbus_bool_t handle_client_state_waiting_for_reject (DBusAuth         *aut
 static dbus_bool_t handle_client_state_waiting_for_agree_unix_fd (DBusAuth         *auth,
                                                            DBusAuthCommand   command,
                                                            const DBusString *args);
+static dbus_bool_t handle_client_state_waiting_for_ticket (DBusAuth         *auth,
+                                                           DBusAuthCommand   command,
+                                                           const DBusString *args);
+static dbus_bool_t handle_client_state_waiting_for_ok_pipelined (DBusAuth         *auth,
+                                                               DBusAuthCommand   command,
+                                                               const DBusString *args);
+static dbus_bool_t handle_client_state_waiting_for_agree_unix_fd_pipelined (DBusAuth         *auth,
+                                                                          DBusAuthCommand   command,
+                                                                          const DBusString *args);
+static dbus_bool_t handle_client_state_waiting_for_agree_compression (DBusAuth         *auth,
+                                                                    DBusAuthCommand   command,
+                                                                    const DBusString *args);
 
 static const DBusAuthStateData client_state_need_send_auth = {
   "NeedSendAuth", NULL
@@ -291,6 +328,18 @@ static const DBusAuthStateData client_state_waiting_for_reject = {
 static const DBusAuthStateData client_state_waiting_for_agree_unix_fd = {
   "WaitingForAgreeUnixFD", handle_client_state_waiting_for_agree_unix_fd
 };
+static const DBusAuthStateData client_state_waiting_for_ticket = {
+  "WaitingForTicket", handle_client_state_waiting_for_ticket
+};
+static const DBusAuthStateData client_state_waiting_for_ok_pipelined = {
+  "WaitingForOKPipelined", handle_client_state_waiting_for_ok_pipelined
+};
+static const DBusAuthStateData client_state_waiting_for_agree_unix_fd_pipelined = {
+  "WaitingForAgreeUnixFDPipelined", handle_client_state_waiting_for_agree_unix_fd_pipelined
+};
+static const DBusAuthStateData client_state_waiting_for_agree_compression = {
+  "WaitingForAgreeCompression", handle_client_state_waiting_for_agree_compression
+};
 
 /**
  * Common terminal states.  Terminal states have handler == NULL.
@@ -386,13 +435,18 @@ _dbus_auth_new (int size)
   auth->desired_identity = _dbus_credentials_new ();
   if (auth->desired_identity == NULL)
     goto enomem_8;
+
+  if (!_dbus_string_init (&auth->compressed_incoming))
+    goto enomem_9;
   
   return auth;
 
 #if 0
+ enomem_10:
+  _dbus_string_free (&auth->compressed_incoming);
+#endif
  enomem_9:
   _dbus_credentials_unref (auth->desired_identity);
-#endif
  enomem_8:
   _dbus_credentials_unref (auth->authorized_identity);
  enomem_7:
@@ -442,40 +496,22 @@ shutdown_mech (DBusAuth *auth)
  * DBUS_COOKIE_SHA1 mechanism
  */
 
-/* Returns TRUE but with an empty string hash if the
- * cookie_id isn't known. As with all this code
- * TRUE just means we had enough memory.
+/* Hashes the two challenges with a secret both sides know, the
+ * way DBUS_COOKIE_SHA1 and DBUS_TICKET prove they hold it.
  */
 static dbus_bool_t
-sha1_compute_hash (DBusAuth         *auth,
-                   int               cookie_id,
-                   const DBusString *server_challenge,
-                   const DBusString *client_challenge,
-                   DBusString       *hash)
+sha1_compute_challenge_hash (const DBusString *server_challenge,
+                             const DBusString *client_challenge,
+                             const DBusString *secret,
+                             DBusString       *hash)
 {
-  DBusString cookie;
   DBusString to_hash;
   dbus_bool_t retval;
-  
-  _dbus_assert (auth->keyring != NULL);
 
   retval = FALSE;
-  
-  if (!_dbus_string_init (&cookie))
-    return FALSE;
-
-  if (!_dbus_keyring_get_hex_key (auth->keyring, cookie_id,
-                                  &cookie))
-    goto out_0;
-
-  if (_dbus_string_get_length (&cookie) == 0)
-    {
-      retval = TRUE;
-      goto out_0;
-    }
 
   if (!_dbus_string_init (&to_hash))
-    goto out_0;
+    return FALSE;
   
   if (!_dbus_string_copy (server_challenge, 0,
                           &to_hash, _dbus_string_get_length (&to_hash)))
@@ -491,7 +527,7 @@ sha1_compute_hash (DBusAuth         *auth,
   if (!_dbus_string_append (&to_hash, ":"))
     goto out_1;
 
-  if (!_dbus_string_copy (&cookie, 0,
+  if (!_dbus_string_copy (secret, 0,
                           &to_hash, _dbus_string_get_length (&to_hash)))
     goto out_1;
 
@@ -503,6 +539,46 @@ sha1_compute_hash (DBusAuth         *auth,
  out_1:
   _dbus_string_zero (&to_hash);
   _dbus_string_free (&to_hash);
+  return retval;
+}
+
+/* Returns TRUE but with an empty string hash if the
+ * cookie_id isn't known. As with all this code
+ * TRUE just means we had enough memory.
+ */
+static dbus_bool_t
+sha1_compute_hash (DBusAuth         *auth,
+                   int               cookie_id,
+                   const DBusString *server_challenge,
+                   const DBusString *client_challenge,
+                   DBusString       *hash)
+{
+  DBusString cookie;
+  dbus_bool_t retval;
+  
+  _dbus_assert (auth->keyring != NULL);
+
+  retval = FALSE;
+  
+  if (!_dbus_string_init (&cookie))
+    return FALSE;
+
+  if (!_dbus_keyring_get_hex_key (auth->keyring, cookie_id,
+                                  &cookie))
+    goto out_0;
+
+  if (_dbus_string_get_length (&cookie) == 0)
+    {
+      retval = TRUE;
+      goto out_0;
+    }
+
+  if (!sha1_compute_challenge_hash (server_challenge, client_challenge,
+                                    &cookie, hash))
+    goto out_0;
+
+  retval = TRUE;
+
  out_0:
   _dbus_string_zero (&cookie);
   _dbus_string_free (&cookie);
@@ -1295,140 +1371,847 @@ handle_client_shutdown_anonymous_mech (DBusAuth *auth)
   
 }
 
-/* Put mechanisms here in order of preference.
- * Right now we have:
- *
- * - EXTERNAL checks socket credentials (or in the future, other info from the OS)
- * - DBUS_COOKIE_SHA1 uses a cookie in the home directory, like xauth or ICE
- * - ANONYMOUS checks nothing but doesn't auth the person as a user
+/*
+ * DBUS_TICKET mechanism
+ */
+
+/* Once a client has proven who it is the expensive way, the server
+ * can hand it a ticket on request: an ID and a secret. The next time
+ * the client connects to the same address it names the ticket with
+ * DBUS_TICKET, and proves it holds the secret by hashing it with a
+ * challenge from each side, as DBUS_COOKIE_SHA1 does with a cookie;
+ * the secret itself only crosses the wire when the ticket is issued.
+ * Tickets are random, single-use, short-lived and only good with the
+ * server (GUID) that issued them, for the user it authorized.
  *
- * We might ideally add a mechanism to chain to Cyrus SASL so we can
- * use its mechanisms as well.
- * 
+ * Since the secret is sent in the clear when the ticket is issued,
+ * servers only offer tickets when DBUS_TICKET is named in their auth
+ * mechanisms, never by default.
  */
-static const DBusAuthMechanismHandler
-all_mechanisms[] = {
-  { "EXTERNAL",
-    handle_server_data_external_mech,
-    NULL, NULL,
-    handle_server_shutdown_external_mech,
-    handle_client_initial_response_external_mech,
-    handle_client_data_external_mech,
-    NULL, NULL,
-    handle_client_shutdown_external_mech },
-  { "DBUS_COOKIE_SHA1",
-    handle_server_data_cookie_sha1_mech,
-    NULL, NULL,
-    handle_server_shutdown_cookie_sha1_mech,
-    handle_client_initial_response_cookie_sha1_mech,
-    handle_client_data_cookie_sha1_mech,
-    NULL, NULL,
-    handle_client_shutdown_cookie_sha1_mech },
-  { "ANONYMOUS",
-    handle_server_data_anonymous_mech,
-    NULL, NULL,
-    handle_server_shutdown_anonymous_mech,
-    handle_client_initial_response_anonymous_mech,
-    handle_client_data_anonymous_mech,
-    NULL, NULL,
-    handle_client_shutdown_anonymous_mech },  
-  { NULL, NULL }
+
+/** Name of the ticket mechanism */
+#define TICKET_MECHANISM "DBUS_TICKET"
+
+/** Number of random bytes in a ticket ID */
+#define N_TICKET_ID_BYTES (64/8)
+
+/** Number of random bytes in a ticket secret */
+#define N_TICKET_SECRET_BYTES (128/8)
+
+/** Seconds a ticket stays good for */
+#define TICKET_LIFETIME_SECONDS 60
+
+/** Most tickets a server process keeps outstanding */
+#define MAX_SERVER_TICKETS 64
+
+/** Most tickets a client process keeps, one per address */
+#define MAX_CLIENT_TICKETS 8
+
+/**
+ * A ticket held by the server that issued it, or by the client
+ * that got it.
+ */
+struct DBusAuthTicket
+{
+  DBusString id;              /**< Names the ticket, hex-encoded */
+  DBusString secret;          /**< Proves the ticket is held, hex-encoded */
+  DBusString bound_to;        /**< Server GUID on the server, address on the client */
+  DBusCredentials *identity;  /**< Identity the server authorized, #NULL on the client */
+  long expires;               /**< When the ticket stops being good */
 };
 
-static const DBusAuthMechanismHandler*
-find_mech (const DBusString  *name,
-           char             **allowed_mechs)
+/**
+ * Tickets, oldest first
+ */
+typedef struct
 {
-  int i;
-  
-  if (allowed_mechs != NULL &&
-      !_dbus_string_array_contains ((const char**) allowed_mechs,
-                                    _dbus_string_get_const_data (name)))
+  DBusAuthTicket *tickets[MAX_SERVER_TICKETS]; /**< The tickets */
+  int n_tickets;                               /**< Number of tickets */
+  int max_tickets;                             /**< Most tickets to keep */
+} DBusAuthTicketStore;
+
+_DBUS_DEFINE_GLOBAL_LOCK (auth_tickets);
+static DBusAuthTicketStore server_tickets = { { NULL }, 0, MAX_SERVER_TICKETS };
+static DBusAuthTicketStore client_tickets = { { NULL }, 0, MAX_CLIENT_TICKETS };
+static dbus_bool_t auth_tickets_shutdown_registered = FALSE;
+
+static DBusAuthTicket*
+ticket_new (void)
+{
+  DBusAuthTicket *ticket;
+
+  ticket = dbus_new0 (DBusAuthTicket, 1);
+  if (ticket == NULL)
     return NULL;
-  
-  i = 0;
-  while (all_mechanisms[i].mechanism != NULL)
-    {      
-      if (_dbus_string_equal_c_str (name,
-                                    all_mechanisms[i].mechanism))
 
-        return &all_mechanisms[i];
-      
-      ++i;
-    }
-  
+  if (!_dbus_string_init (&ticket->id))
+    goto failed_0;
+
+  if (!_dbus_string_init (&ticket->secret))
+    goto failed_1;
+
+  if (!_dbus_string_init (&ticket->bound_to))
+    goto failed_2;
+
+  return ticket;
+
+ failed_2:
+  _dbus_string_free (&ticket->secret);
+ failed_1:
+  _dbus_string_free (&ticket->id);
+ failed_0:
+  dbus_free (ticket);
   return NULL;
 }
 
+static void
+ticket_free (DBusAuthTicket *ticket)
+{
+  _dbus_string_free (&ticket->id);
+  _dbus_string_zero (&ticket->secret);
+  _dbus_string_free (&ticket->secret);
+  _dbus_string_free (&ticket->bound_to);
+  if (ticket->identity)
+    _dbus_credentials_unref (ticket->identity);
+  dbus_free (ticket);
+}
+
+/* Compares two strings in time that depends only on their lengths,
+ * so that timing the server doesn't tell an attacker how much of a
+ * guessed ticket ID or proof was right.
+ */
 static dbus_bool_t
-send_auth (DBusAuth *auth, const DBusAuthMechanismHandler *mech)
+ticket_strings_equal (const DBusString *a,
+                      const DBusString *b)
 {
-  DBusString auth_command;
+  const unsigned char *ap;
+  const unsigned char *bp;
+  unsigned char diff;
+  int len;
+  int i;
 
-  if (!_dbus_string_init (&auth_command))
+  len = _dbus_string_get_length (a);
+  if (len != _dbus_string_get_length (b))
     return FALSE;
-      
-  if (!_dbus_string_append (&auth_command,
-                            "AUTH "))
+
+  ap = (const unsigned char*) _dbus_string_get_const_data (a);
+  bp = (const unsigned char*) _dbus_string_get_const_data (b);
+
+  diff = 0;
+  for (i = 0; i < len; i++)
+    diff |= ap[i] ^ bp[i];
+
+  return diff == 0;
+}
+
+/* Must be called with the auth_tickets lock held */
+static DBusAuthTicket*
+ticket_store_steal_unlocked (DBusAuthTicketStore *store,
+                             int                  i)
+{
+  DBusAuthTicket *ticket;
+
+  ticket = store->tickets[i];
+
+  store->n_tickets -= 1;
+  memmove (&store->tickets[i], &store->tickets[i + 1],
+           (store->n_tickets - i) * sizeof (store->tickets[0]));
+  store->tickets[store->n_tickets] = NULL;
+
+  return ticket;
+}
+
+/* Must be called with the auth_tickets lock held */
+static void
+ticket_store_expire_unlocked (DBusAuthTicketStore *store,
+                              long                 now)
+{
+  int i;
+
+  i = 0;
+  while (i < store->n_tickets)
     {
-      _dbus_string_free (&auth_command);
-      return FALSE;
-    }  
-  
-  if (!_dbus_string_append (&auth_command,
-                            mech->mechanism))
+      if (store->tickets[i]->expires <= now)
+        ticket_free (ticket_store_steal_unlocked (store, i));
+      else
+        ++i;
+    }
+}
+
+/* Must be called with the auth_tickets lock held. Finds a ticket
+ * whose ID is @id and/or that is bound to @bound_to, whichever are
+ * non-#NULL.
+ */
+static int
+ticket_store_find_unlocked (DBusAuthTicketStore *store,
+                            const DBusString    *id,
+                            const DBusString    *bound_to)
+{
+  int i;
+
+  for (i = 0; i < store->n_tickets; i++)
     {
-      _dbus_string_free (&auth_command);
-      return FALSE;
+      if (id != NULL &&
+          !ticket_strings_equal (&store->tickets[i]->id, id))
+        continue;
+
+      if (bound_to != NULL &&
+          !_dbus_string_equal (&store->tickets[i]->bound_to, bound_to))
+        continue;
+
+      return i;
     }
 
-  if (mech->client_initial_response_func != NULL)
+  return -1;
+}
+
+static void
+auth_tickets_shutdown (void *data)
+{
+  _DBUS_LOCK (auth_tickets);
+
+  while (server_tickets.n_tickets > 0)
+    ticket_free (ticket_store_steal_unlocked (&server_tickets, 0));
+
+  while (client_tickets.n_tickets > 0)
+    ticket_free (ticket_store_steal_unlocked (&client_tickets, 0));
+
+  auth_tickets_shutdown_registered = FALSE;
+
+  _DBUS_UNLOCK (auth_tickets);
+}
+
+/**
+ * Adds a ticket to a store, dropping the oldest one if the store is
+ * full, and on the client any older ticket for the same address.
+ * Takes ownership of the ticket either way.
+ *
+ * @param store the store
+ * @param ticket the ticket
+ * @returns #FALSE if not enough memory
+ */
+static dbus_bool_t
+ticket_store_add (DBusAuthTicketStore *store,
+                  DBusAuthTicket      *ticket)
+{
+  long now;
+  int i;
+
+  _dbus_get_current_time (&now, NULL);
+
+  _DBUS_LOCK (auth_tickets);
+
+  if (!auth_tickets_shutdown_registered)
     {
-      if (!_dbus_string_append (&auth_command, " "))
-        {
-          _dbus_string_free (&auth_command);
-          return FALSE;
-        }
-      
-      if (!(* mech->client_initial_response_func) (auth, &auth_command))
+      if (!_dbus_register_shutdown_func (auth_tickets_shutdown, NULL))
         {
-          _dbus_string_free (&auth_command);
+          _DBUS_UNLOCK (auth_tickets);
+          ticket_free (ticket);
           return FALSE;
         }
-    }
-  
-  if (!_dbus_string_append (&auth_command,
-                            "\r\n"))
-    {
-      _dbus_string_free (&auth_command);
-      return FALSE;
+
+      auth_tickets_shutdown_registered = TRUE;
     }
 
-  if (!_dbus_string_copy (&auth_command, 0,
-                          &auth->outgoing,
-                          _dbus_string_get_length (&auth->outgoing)))
+  ticket_store_expire_unlocked (store, now);
+
+  if (store == &client_tickets)
     {
-      _dbus_string_free (&auth_command);
-      return FALSE;
+      i = ticket_store_find_unlocked (store, NULL, &ticket->bound_to);
+      if (i >= 0)
+        ticket_free (ticket_store_steal_unlocked (store, i));
     }
 
-  _dbus_string_free (&auth_command);
-  shutdown_mech (auth);
-  auth->mech = mech;      
-  goto_state (auth, &client_state_waiting_for_data);
+  if (store->n_tickets == store->max_tickets)
+    ticket_free (ticket_store_steal_unlocked (store, 0));
+
+  store->tickets[store->n_tickets] = ticket;
+  store->n_tickets += 1;
+
+  _DBUS_UNLOCK (auth_tickets);
 
   return TRUE;
 }
 
+/* Appends @n_bytes random bytes to @str, hex-encoded */
 static dbus_bool_t
-send_data (DBusAuth *auth, DBusString *data)
+append_random_hex (DBusString *str,
+                   int         n_bytes)
 {
-  int old_len;
+  DBusString bytes;
+  dbus_bool_t retval;
 
-  if (data == NULL || _dbus_string_get_length (data) == 0)
-    return _dbus_string_append (&auth->outgoing, "DATA\r\n");
-  else
-    {
+  if (!_dbus_string_init (&bytes))
+    return FALSE;
+
+  retval = _dbus_generate_random_bytes (&bytes, n_bytes) &&
+    _dbus_string_hex_encode (&bytes, 0, str, _dbus_string_get_length (str));
+
+  _dbus_string_zero (&bytes);
+  _dbus_string_free (&bytes);
+
+  return retval;
+}
+
+static dbus_bool_t
+send_ticket (DBusAuth *auth)
+{
+  DBusAuthTicket *ticket;
+  int orig_len;
+
+  ticket = ticket_new ();
+  if (ticket == NULL)
+    return FALSE;
+
+  if (!append_random_hex (&ticket->id, N_TICKET_ID_BYTES) ||
+      !append_random_hex (&ticket->secret, N_TICKET_SECRET_BYTES) ||
+      !_dbus_string_copy (& DBUS_AUTH_SERVER (auth)->guid, 0,
+                          &ticket->bound_to, 0))
+    goto nomem;
+
+  ticket->identity = _dbus_credentials_copy (auth->authorized_identity);
+  if (ticket->identity == NULL)
+    goto nomem;
+
+  _dbus_get_current_time (&ticket->expires, NULL);
+  ticket->expires += TICKET_LIFETIME_SECONDS;
+
+  orig_len = _dbus_string_get_length (&auth->outgoing);
+
+  if (!_dbus_string_append (&auth->outgoing, "TICKET ") ||
+      !_dbus_string_copy (&ticket->id, 0, &auth->outgoing,
+                          _dbus_string_get_length (&auth->outgoing)) ||
+      !_dbus_string_append (&auth->outgoing, " ") ||
+      !_dbus_string_copy (&ticket->secret, 0, &auth->outgoing,
+                          _dbus_string_get_length (&auth->outgoing)) ||
+      !_dbus_string_append (&auth->outgoing, "\r\n"))
+    {
+      _dbus_string_set_length (&auth->outgoing, orig_len);
+      goto nomem;
+    }
+
+  if (!ticket_store_add (&server_tickets, ticket))
+    {
+      _dbus_string_set_length (&auth->outgoing, orig_len);
+      return FALSE;
+    }
+
+  _dbus_verbose ("%s: issued a ticket\n", DBUS_AUTH_NAME (auth));
+
+  return TRUE;
+
+ nomem:
+  ticket_free (ticket);
+  return FALSE;
+}
+
+static dbus_bool_t
+ticket_handle_first_client_response (DBusAuth         *auth,
+                                     const DBusString *data)
+{
+  /* The client names its ticket; we look it up and challenge the
+   * client to prove it holds the secret that goes with it.
+   */
+  DBusAuthTicket *ticket;
+  long now;
+  int i;
+
+  _dbus_get_current_time (&now, NULL);
+
+  _DBUS_LOCK (auth_tickets);
+
+  ticket_store_expire_unlocked (&server_tickets, now);
+
+  i = ticket_store_find_unlocked (&server_tickets, data,
+                                  & DBUS_AUTH_SERVER (auth)->guid);
+  if (i < 0)
+    {
+      _DBUS_UNLOCK (auth_tickets);
+      _dbus_verbose ("%s: client named an unknown or expired ticket\n",
+                     DBUS_AUTH_NAME (auth));
+      return send_rejected (auth);
+    }
+
+  ticket = server_tickets.tickets[i];
+
+  /* If the socket says who's on the other end, it had better be who
+   * the ticket was issued to.
+   */
+  if (!_dbus_credentials_are_anonymous (auth->credentials) &&
+      !_dbus_credentials_same_user (auth->credentials, ticket->identity))
+    {
+      _DBUS_UNLOCK (auth_tickets);
+      _dbus_verbose ("%s: ticket was issued to someone else\n",
+                     DBUS_AUTH_NAME (auth));
+      return send_rejected (auth);
+    }
+
+  _dbus_string_set_length (&auth->challenge, 0);
+  if (!append_random_hex (&auth->challenge, N_CHALLENGE_BYTES) ||
+      !send_data (auth, &auth->challenge))
+    {
+      _DBUS_UNLOCK (auth_tickets);
+      _dbus_string_set_length (&auth->challenge, 0);
+      return FALSE;
+    }
+
+  /* Tickets are good for one try only, whether or not it works */
+  auth->ticket = ticket_store_steal_unlocked (&server_tickets, i);
+
+  _DBUS_UNLOCK (auth_tickets);
+
+  goto_state (auth, &server_state_waiting_for_data);
+
+  return TRUE;
+}
+
+static dbus_bool_t
+ticket_handle_second_client_response (DBusAuth         *auth,
+                                      const DBusString *data)
+{
+  /* We are expecting the client challenge, space, then the SHA-1
+   * hash of our challenge, ":", client challenge, ":", ticket
+   * secret, all hex-encoded; just as for DBUS_COOKIE_SHA1.
+   */
+  DBusString client_challenge;
+  DBusString client_hash;
+  DBusString correct_hash;
+  dbus_bool_t retval;
+  int i;
+
+  retval = FALSE;
+
+  if (!_dbus_string_find_blank (data, 0, &i))
+    {
+      _dbus_verbose ("%s: no space separator in client response\n",
+                     DBUS_AUTH_NAME (auth));
+      return send_rejected (auth);
+    }
+
+  if (!_dbus_string_init (&client_challenge))
+    goto out_0;
+
+  if (!_dbus_string_init (&client_hash))
+    goto out_1;
+
+  if (!_dbus_string_init (&correct_hash))
+    goto out_2;
+
+  if (!_dbus_string_copy_len (data, 0, i, &client_challenge, 0))
+    goto out_3;
+
+  _dbus_string_skip_blank (data, i, &i);
+
+  if (!_dbus_string_copy (data, i, &client_hash, 0))
+    goto out_3;
+
+  if (_dbus_string_get_length (&client_challenge) == 0 ||
+      _dbus_string_get_length (&client_hash) == 0)
+    {
+      _dbus_verbose ("%s: zero-length client challenge or hash\n",
+                     DBUS_AUTH_NAME (auth));
+      if (send_rejected (auth))
+        retval = TRUE;
+      goto out_3;
+    }
+
+  if (!sha1_compute_challenge_hash (&auth->challenge, &client_challenge,
+                                    &auth->ticket->secret, &correct_hash))
+    goto out_3;
+
+  if (!ticket_strings_equal (&client_hash, &correct_hash))
+    {
+      _dbus_verbose ("%s: client does not hold the ticket's secret\n",
+                     DBUS_AUTH_NAME (auth));
+      if (send_rejected (auth))
+        retval = TRUE;
+      goto out_3;
+    }
+
+  if (!_dbus_credentials_add_credentials (auth->authorized_identity,
+                                          auth->ticket->identity) ||
+      !_dbus_credentials_add_credential (auth->authorized_identity,
+                                         DBUS_CREDENTIAL_UNIX_PROCESS_ID,
+                                         auth->credentials) ||
+      !send_ok (auth))
+    {
+      _dbus_credentials_clear (auth->authorized_identity);
+      goto out_3;
+    }
+
+  _dbus_verbose ("%s: authenticated client using %s\n",
+                 DBUS_AUTH_NAME (auth), TICKET_MECHANISM);
+
+  retval = TRUE;
+
+ out_3:
+  _dbus_string_zero (&correct_hash);
+  _dbus_string_free (&correct_hash);
+ out_2:
+  _dbus_string_zero (&client_hash);
+  _dbus_string_free (&client_hash);
+ out_1:
+  _dbus_string_free (&client_challenge);
+ out_0:
+  return retval;
+}
+
+static dbus_bool_t
+handle_server_data_ticket_mech (DBusAuth         *auth,
+                                const DBusString *data)
+{
+  if (auth->ticket == NULL)
+    return ticket_handle_first_client_response (auth, data);
+  else
+    return ticket_handle_second_client_response (auth, data);
+}
+
+static void
+handle_server_shutdown_ticket_mech (DBusAuth *auth)
+{
+  if (auth->ticket != NULL)
+    {
+      ticket_free (auth->ticket);
+      auth->ticket = NULL;
+    }
+
+  _dbus_string_set_length (&auth->challenge, 0);
+}
+
+static dbus_bool_t
+handle_client_initial_response_ticket_mech (DBusAuth         *auth,
+                                            DBusString       *response)
+{
+  long now;
+  int i;
+
+  _dbus_get_current_time (&now, NULL);
+
+  _DBUS_LOCK (auth_tickets);
+
+  ticket_store_expire_unlocked (&client_tickets, now);
+
+  i = ticket_store_find_unlocked (&client_tickets, NULL,
+                                  & DBUS_AUTH_CLIENT (auth)->resume_key);
+
+  /* Without a ticket (another connection used it) the empty
+   * response just gets us REJECTED and we move on.
+   */
+  if (i < 0)
+    {
+      _DBUS_UNLOCK (auth_tickets);
+      return TRUE;
+    }
+
+  if (!_dbus_string_hex_encode (&client_tickets.tickets[i]->id, 0, response,
+                                _dbus_string_get_length (response)))
+    {
+      _DBUS_UNLOCK (auth_tickets);
+      return FALSE;
+    }
+
+  /* Keep the secret for the server's challenge */
+  if (auth->ticket != NULL)
+    ticket_free (auth->ticket);
+  auth->ticket = ticket_store_steal_unlocked (&client_tickets, i);
+
+  _DBUS_UNLOCK (auth_tickets);
+
+  return TRUE;
+}
+
+static dbus_bool_t
+handle_client_data_ticket_mech (DBusAuth         *auth,
+                                const DBusString *data)
+{
+  /* The data from the server is its challenge. We send back our
+   * own challenge and the hash that proves we hold the secret.
+   */
+  DBusString client_challenge;
+  DBusString correct_hash;
+  DBusString tmp;
+  dbus_bool_t retval;
+
+  if (auth->ticket == NULL)
+    return send_cancel (auth);
+
+  if (_dbus_string_get_length (data) == 0)
+    return send_error (auth, "Empty server challenge string");
+
+  retval = FALSE;
+
+  if (!_dbus_string_init (&client_challenge))
+    goto out_0;
+
+  if (!_dbus_string_init (&correct_hash))
+    goto out_1;
+
+  if (!_dbus_string_init (&tmp))
+    goto out_2;
+
+  if (!append_random_hex (&client_challenge, N_CHALLENGE_BYTES))
+    goto out_3;
+
+  if (!sha1_compute_challenge_hash (data, &client_challenge,
+                                    &auth->ticket->secret, &correct_hash))
+    goto out_3;
+
+  if (!_dbus_string_copy (&client_challenge, 0, &tmp, 0) ||
+      !_dbus_string_append (&tmp, " ") ||
+      !_dbus_string_copy (&correct_hash, 0, &tmp,
+                          _dbus_string_get_length (&tmp)))
+    goto out_3;
+
+  if (!send_data (auth, &tmp))
+    goto out_3;
+
+  retval = TRUE;
+
+ out_3:
+  _dbus_string_zero (&tmp);
+  _dbus_string_free (&tmp);
+ out_2:
+  _dbus_string_zero (&correct_hash);
+  _dbus_string_free (&correct_hash);
+ out_1:
+  _dbus_string_free (&client_challenge);
+ out_0:
+  return retval;
+}
+
+static void
+handle_client_shutdown_ticket_mech (DBusAuth *auth)
+{
+  if (auth->ticket != NULL)
+    {
+      ticket_free (auth->ticket);
+      auth->ticket = NULL;
+    }
+}
+
+/* Returns whether a ticket is held for the address this client is
+ * connecting to.
+ */
+static dbus_bool_t
+client_has_ticket (DBusAuth *auth)
+{
+  long now;
+  int i;
+
+  if (_dbus_string_get_length (& DBUS_AUTH_CLIENT (auth)->resume_key) == 0)
+    return FALSE;
+
+  _dbus_get_current_time (&now, NULL);
+
+  _DBUS_LOCK (auth_tickets);
+  ticket_store_expire_unlocked (&client_tickets, now);
+  i = ticket_store_find_unlocked (&client_tickets, NULL,
+                                  & DBUS_AUTH_CLIENT (auth)->resume_key);
+  _DBUS_UNLOCK (auth_tickets);
+
+  return i >= 0;
+}
+
+/* Returns FALSE on OOM; a bad ticket is just not kept */
+static dbus_bool_t
+record_ticket (DBusAuth         *auth,
+               const DBusString *args)
+{
+  DBusAuthTicket *ticket;
+  int len;
+  int i;
+
+  len = _dbus_string_get_length (args);
+
+  if (len == 0 ||
+      !_dbus_string_validate_ascii (args, 0, len) ||
+      !_dbus_string_find_blank (args, 0, &i) ||
+      i == 0 || i + 1 >= len)
+    {
+      _dbus_verbose ("%s: ignoring bad ticket from server\n",
+                     DBUS_AUTH_NAME (auth));
+      return TRUE;
+    }
+
+  ticket = ticket_new ();
+  if (ticket == NULL)
+    return FALSE;
+
+  if (!_dbus_string_copy_len (args, 0, i, &ticket->id, 0) ||
+      !_dbus_string_copy (args, i + 1, &ticket->secret, 0) ||
+      !_dbus_string_copy (& DBUS_AUTH_CLIENT (auth)->resume_key, 0,
+                          &ticket->bound_to, 0))
+    {
+      ticket_free (ticket);
+      return FALSE;
+    }
+
+  _dbus_get_current_time (&ticket->expires, NULL);
+  ticket->expires += TICKET_LIFETIME_SECONDS;
+
+  return ticket_store_add (&client_tickets, ticket);
+}
+
+/* Put mechanisms here in order of preference.
+ * Right now we have:
+ *
+ * - EXTERNAL checks socket credentials (or in the future, other info from the OS)
+ * - DBUS_COOKIE_SHA1 uses a cookie in the home directory, like xauth or ICE
+ * - ANONYMOUS checks nothing but doesn't auth the person as a user
+ * - DBUS_TICKET proves we hold a ticket from an earlier connection;
+ *   clients only try it first when they hold one, and servers only
+ *   offer it when it is named in their allowed mechanisms
+ *
+ * We might ideally add a mechanism to chain to Cyrus SASL so we can
+ * use its mechanisms as well.
+ * 
+ */
+static const DBusAuthMechanismHandler
+all_mechanisms[] = {
+  { "EXTERNAL",
+    handle_server_data_external_mech,
+    NULL, NULL,
+    handle_server_shutdown_external_mech,
+    handle_client_initial_response_external_mech,
+    handle_client_data_external_mech,
+    NULL, NULL,
+    handle_client_shutdown_external_mech },
+  { "DBUS_COOKIE_SHA1",
+    handle_server_data_cookie_sha1_mech,
+    NULL, NULL,
+    handle_server_shutdown_cookie_sha1_mech,
+    handle_client_initial_response_cookie_sha1_mech,
+    handle_client_data_cookie_sha1_mech,
+    NULL, NULL,
+    handle_client_shutdown_cookie_sha1_mech },
+  { "ANONYMOUS",
+    handle_server_data_anonymous_mech,
+    NULL, NULL,
+    handle_server_shutdown_anonymous_mech,
+    handle_client_initial_response_anonymous_mech,
+    handle_client_data_anonymous_mech,
+    NULL, NULL,
+    handle_client_shutdown_anonymous_mech },  
+  { TICKET_MECHANISM,
+    handle_server_data_ticket_mech,
+    NULL, NULL,
+    handle_server_shutdown_ticket_mech,
+    handle_client_initial_response_ticket_mech,
+    handle_client_data_ticket_mech,
+    NULL, NULL,
+    handle_client_shutdown_ticket_mech },
+  { NULL, NULL }
+};
+
+static const DBusAuthMechanismHandler*
+find_mech (const DBusString  *name,
+           char             **allowed_mechs)
+{
+  int i;
+  
+  if (allowed_mechs != NULL &&
+      !_dbus_string_array_contains ((const char**) allowed_mechs,
+                                    _dbus_string_get_const_data (name)))
+    return NULL;
+  
+  i = 0;
+  while (all_mechanisms[i].mechanism != NULL)
+    {      
+      if (_dbus_string_equal_c_str (name,
+                                    all_mechanisms[i].mechanism))
+
+        return &all_mechanisms[i];
+      
+      ++i;
+    }
+  
+  return NULL;
+}
+
+/* DBUS_TICKET is only offered by servers that ask for it by name,
+ * since its tickets are handed out in the clear.
+ */
+static dbus_bool_t
+server_mech_enabled (DBusAuth                       *auth,
+                     const DBusAuthMechanismHandler *mech)
+{
+  if (strcmp (mech->mechanism, TICKET_MECHANISM) != 0)
+    return TRUE;
+
+  return auth->allowed_mechs != NULL &&
+    _dbus_string_array_contains ((const char**) auth->allowed_mechs,
+                                 TICKET_MECHANISM);
+}
+
+static dbus_bool_t
+send_auth (DBusAuth *auth, const DBusAuthMechanismHandler *mech)
+{
+  DBusString auth_command;
+
+  if (!_dbus_string_init (&auth_command))
+    return FALSE;
+      
+  if (!_dbus_string_append (&auth_command,
+                            "AUTH "))
+    {
+      _dbus_string_free (&auth_command);
+      return FALSE;
+    }  
+  
+  if (!_dbus_string_append (&auth_command,
+                            mech->mechanism))
+    {
+      _dbus_string_free (&auth_command);
+      return FALSE;
+    }
+
+  if (mech->client_initial_response_func != NULL)
+    {
+      if (!_dbus_string_append (&auth_command, " "))
+        {
+          _dbus_string_free (&auth_command);
+          return FALSE;
+        }
+      
+      if (!(* mech->client_initial_response_func) (auth, &auth_command))
+        {
+          _dbus_string_free (&auth_command);
+          return FALSE;
+        }
+    }
+  
+  if (!_dbus_string_append (&auth_command,
+                            "\r\n"))
+    {
+      _dbus_string_free (&auth_command);
+      return FALSE;
+    }
+
+  if (!_dbus_string_copy (&auth_command, 0,
+                          &auth->outgoing,
+                          _dbus_string_get_length (&auth->outgoing)))
+    {
+      _dbus_string_free (&auth_command);
+      return FALSE;
+    }
+
+  _dbus_string_free (&auth_command);
+  shutdown_mech (auth);
+  auth->mech = mech;      
+  goto_state (auth, &client_state_waiting_for_data);
+
+  return TRUE;
+}
+
+static dbus_bool_t
+send_data (DBusAuth *auth, DBusString *data)
+{
+  int old_len;
+
+  if (data == NULL || _dbus_string_get_length (data) == 0)
+    return _dbus_string_append (&auth->outgoing, "DATA\r\n");
+  else
+    {
       old_len = _dbus_string_get_length (&auth->outgoing);
       if (!_dbus_string_append (&auth->outgoing, "DATA "))
         goto out;
@@ -1466,6 +2249,12 @@ send_rejected (DBusAuth *auth)
   i = 0;
   while (all_mechanisms[i].mechanism != NULL)
     {
+      if (!server_mech_enabled (auth, &all_mechanisms[i]))
+        {
+          ++i;
+          continue;
+        }
+
       if (!_dbus_string_append (&command,
                                 " "))
         goto nomem;
@@ -1547,10 +2336,11 @@ send_begin (DBusAuth         *auth)
   return TRUE;
 }
 
+/* Returns FALSE on OOM; a bad GUID moves us to need_disconnect */
 static dbus_bool_t
-process_ok(DBusAuth *auth,
-          const DBusString *args_from_ok) {
-
+record_guid_from_ok (DBusAuth         *auth,
+                     const DBusString *args_from_ok)
+{
   int end_of_hex;
   
   /* "args_from_ok" should be the GUID, whitespace already pulled off the front */
@@ -1583,11 +2373,80 @@ process_ok(DBusAuth *auth,
   _dbus_verbose ("Got GUID '%s' from the server\n",
                  _dbus_string_get_const_data (& DBUS_AUTH_CLIENT (auth)->guid_from_server));
 
+  return TRUE;
+}
+
+static dbus_bool_t
+ticket_mech_allowed (DBusAuth *auth)
+{
+  DBusString name;
+
+  _dbus_string_init_const (&name, TICKET_MECHANISM);
+  return find_mech (&name, auth->allowed_mechs) != NULL;
+}
+
+/* Tickets are only worth having where authenticating again would be
+ * expensive, i.e. after DBUS_COOKIE_SHA1 or an earlier ticket.
+ * EXTERNAL is already as cheap as it gets.
+ */
+static dbus_bool_t
+should_request_ticket (DBusAuth *auth)
+{
+  if (_dbus_string_get_length (& DBUS_AUTH_CLIENT (auth)->resume_key) == 0 ||
+      auth->mech == NULL)
+    return FALSE;
+
+  /* A server that took our ticket deals in them */
+  if (strcmp (auth->mech->mechanism, TICKET_MECHANISM) == 0)
+    return TRUE;
+
+  return auth->tickets_offered &&
+    strcmp (auth->mech->mechanism, "DBUS_COOKIE_SHA1") == 0 &&
+    ticket_mech_allowed (auth);
+}
+
+/* Compression is only for streams nothing else is encoding, and
+ * never alongside unix fds, which have to travel with the bytes of
+ * their own message.
+ */
+static dbus_bool_t
+compression_allowed (DBusAuth *auth)
+{
+  return auth->compression_possible &&
+    !auth->unix_fd_negotiated &&
+    auth->mech != NULL &&
+    auth->mech->client_encode_func == NULL &&
+    auth->mech->server_encode_func == NULL;
+}
+
+/* Carry on once unix fd passing is settled one way or the other */
+static dbus_bool_t
+send_after_unix_fd (DBusAuth *auth)
+{
+  if (compression_allowed (auth))
+    return send_negotiate_compression (auth);
+
+  return send_begin (auth);
+}
+
+static dbus_bool_t
+process_ok(DBusAuth *auth,
+          const DBusString *args_from_ok) {
+
+  if (!record_guid_from_ok (auth, args_from_ok))
+    return FALSE;
+
+  if (auth->state == &common_state_need_disconnect)
+    return TRUE;
+
+  if (should_request_ticket (auth))
+    return send_request_ticket (auth);
+
   if (auth->unix_fd_possible)
     return send_negotiate_unix_fd(auth);
 
   _dbus_verbose("Not negotiating unix fd passing, since not possible\n");
-  return send_begin (auth);
+  return send_after_unix_fd (auth);
 }
 
 static dbus_bool_t
@@ -1673,6 +2532,71 @@ send_agree_unix_fd (DBusAuth *auth)
   return TRUE;
 }
 
+static dbus_bool_t
+send_negotiate_compression (DBusAuth *auth)
+{
+  if (!_dbus_string_append (&auth->outgoing,
+                            "NEGOTIATE_COMPRESSION LZ4\r\n"))
+    return FALSE;
+
+  goto_state (auth, &client_state_waiting_for_agree_compression);
+  return TRUE;
+}
+
+static dbus_bool_t
+send_agree_compression (DBusAuth *auth)
+{
+  _dbus_assert (compression_allowed (auth));
+
+  if (!_dbus_string_append (&auth->outgoing,
+                            "AGREE_COMPRESSION LZ4\r\n"))
+    return FALSE;
+
+  auth->compression_negotiated = TRUE;
+  _dbus_verbose ("Agreed to compress the message stream\n");
+
+  goto_state (auth, &server_state_waiting_for_begin);
+  return TRUE;
+}
+
+static dbus_bool_t
+send_request_ticket (DBusAuth *auth)
+{
+  if (!_dbus_string_append (&auth->outgoing,
+                            "REQUEST_TICKET\r\n"))
+    return FALSE;
+
+  goto_state (auth, &client_state_waiting_for_ticket);
+  return TRUE;
+}
+
+static dbus_bool_t
+handle_request_ticket (DBusAuth *auth)
+{
+  const DBusAuthMechanismHandler *mech;
+  DBusString name;
+
+  _dbus_string_init_const (&name, TICKET_MECHANISM);
+  mech = find_mech (&name, auth->allowed_mechs);
+
+  if (mech == NULL ||
+      !server_mech_enabled (auth, mech) ||
+      _dbus_credentials_are_anonymous (auth->authorized_identity))
+    return send_error (auth, "Tickets not available");
+
+  return send_ticket (auth);
+}
+
+/* Carry on after asking for a ticket, whether or not we got one */
+static dbus_bool_t
+send_after_ticket (DBusAuth *auth)
+{
+  if (auth->unix_fd_possible)
+    return send_negotiate_unix_fd (auth);
+
+  return send_after_unix_fd (auth);
+}
+
 static dbus_bool_t
 handle_auth (DBusAuth *auth, const DBusString *args)
 {
@@ -1709,6 +2633,9 @@ handle_auth (DBusAuth *auth, const DBusString *args)
         goto failed;
      
       auth->mech = find_mech (&mech, auth->allowed_mechs);
+      if (auth->mech != NULL && !server_mech_enabled (auth, auth->mech))
+        auth->mech = NULL;
+
       if (auth->mech != NULL)
         {
           _dbus_verbose ("%s: Trying mechanism %s\n",
@@ -1765,12 +2692,16 @@ handle_server_state_waiting_for_auth  (DBusAuth         *auth,
       return send_rejected (auth);
 
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_REQUEST_TICKET:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
       return send_error (auth, "Need to authenticate first");
 
     case DBUS_AUTH_COMMAND_REJECTED:
     case DBUS_AUTH_COMMAND_OK:
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_TICKET:
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
     default:
       return send_error (auth, "Unknown command");
     }
@@ -1798,12 +2729,16 @@ handle_server_state_waiting_for_data  (DBusAuth         *auth,
       return TRUE;
 
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_REQUEST_TICKET:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
       return send_error (auth, "Need to authenticate first");
 
     case DBUS_AUTH_COMMAND_REJECTED:
     case DBUS_AUTH_COMMAND_OK:
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_TICKET:
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
     default:
       return send_error (auth, "Unknown command");
     }
@@ -1832,10 +2767,22 @@ handle_server_state_waiting_for_begin (DBusAuth         *auth,
       else
         return send_error(auth, "Unix FD passing not supported, not authenticated or otherwise not possible");
 
+    case DBUS_AUTH_COMMAND_REQUEST_TICKET:
+      return handle_request_ticket (auth);
+
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
+      if (compression_allowed (auth) &&
+          _dbus_string_equal_c_str (args, "LZ4"))
+        return send_agree_compression (auth);
+      else
+        return send_error (auth, "Compression not supported");
+
     case DBUS_AUTH_COMMAND_REJECTED:
     case DBUS_AUTH_COMMAND_OK:
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_TICKET:
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
     default:
       return send_error (auth, "Unknown command");
 
@@ -1896,7 +2843,26 @@ record_mechanisms (DBusAuth         *auth,
 
       mech = find_mech (&m, auth->allowed_mechs);
 
-      if (mech != NULL)
+      if (mech != NULL &&
+          strcmp (mech->mechanism, TICKET_MECHANISM) == 0)
+        {
+          auth->tickets_offered = TRUE;
+
+          /* A ticket is the cheapest thing to try, when we have one */
+          if (client_has_ticket (auth))
+            {
+              _dbus_verbose ("%s: Will try mechanism %s first\n",
+                             DBUS_AUTH_NAME (auth), mech->mechanism);
+
+              if (!_dbus_list_prepend (& DBUS_AUTH_CLIENT (auth)->mechs_to_try,
+                                       (void*) mech))
+                {
+                  _dbus_string_free (&m);
+                  goto nomem;
+                }
+            }
+        }
+      else if (mech != NULL)
         {
           /* FIXME right now we try mechanisms in the order
            * the server lists them; should we do them in
@@ -1907,7 +2873,7 @@ record_mechanisms (DBusAuth         *auth,
            * it lists things in that order anyhow.
            */
 
-          if (mech != &all_mechanisms[0])
+          if (mech != auth->mech)
             {
               _dbus_verbose ("%s: Adding mechanism %s to list we will try\n",
                              DBUS_AUTH_NAME (auth), mech->mechanism);
@@ -1941,6 +2907,7 @@ record_mechanisms (DBusAuth         *auth,
 
  nomem:
   _dbus_list_clear (& DBUS_AUTH_CLIENT (auth)->mechs_to_try);
+  auth->tickets_offered = FALSE;
   
   return FALSE;
 }
@@ -2011,6 +2978,10 @@ handle_client_state_waiting_for_data (DBusAuth         *auth,
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_REQUEST_TICKET:
+    case DBUS_AUTH_COMMAND_TICKET:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
     default:
       return send_error (auth, "Unknown command");
     }
@@ -2039,40 +3010,163 @@ handle_client_state_waiting_for_ok (DBusAuth         *auth,
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_REQUEST_TICKET:
+    case DBUS_AUTH_COMMAND_TICKET:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
+    default:
+      return send_error (auth, "Unknown command");
+    }
+}
+
+static dbus_bool_t
+handle_client_state_waiting_for_reject (DBusAuth         *auth,
+                                        DBusAuthCommand   command,
+                                        const DBusString *args)
+{
+  switch (command)
+    {
+    case DBUS_AUTH_COMMAND_REJECTED:
+      return process_rejected (auth, args);
+      
+    case DBUS_AUTH_COMMAND_AUTH:
+    case DBUS_AUTH_COMMAND_CANCEL:
+    case DBUS_AUTH_COMMAND_DATA:
+    case DBUS_AUTH_COMMAND_BEGIN:
+    case DBUS_AUTH_COMMAND_OK:
+    case DBUS_AUTH_COMMAND_ERROR:
+    case DBUS_AUTH_COMMAND_UNKNOWN:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_REQUEST_TICKET:
+    case DBUS_AUTH_COMMAND_TICKET:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
+    default:
+      goto_state (auth, &common_state_need_disconnect);
+      return TRUE;
+    }
+}
+
+static dbus_bool_t
+handle_client_state_waiting_for_agree_unix_fd(DBusAuth         *auth,
+                                              DBusAuthCommand   command,
+                                              const DBusString *args)
+{
+  switch (command)
+    {
+    case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+      _dbus_assert(auth->unix_fd_possible);
+      auth->unix_fd_negotiated = TRUE;
+      _dbus_verbose("Sucessfully negotiated UNIX FD passing\n");
+      return send_after_unix_fd (auth);
+
+    case DBUS_AUTH_COMMAND_ERROR:
+      _dbus_assert(auth->unix_fd_possible);
+      auth->unix_fd_negotiated = FALSE;
+      _dbus_verbose("Failed to negotiate UNIX FD passing\n");
+      return send_after_unix_fd (auth);
+
+    case DBUS_AUTH_COMMAND_OK:
+    case DBUS_AUTH_COMMAND_DATA:
+    case DBUS_AUTH_COMMAND_REJECTED:
+    case DBUS_AUTH_COMMAND_AUTH:
+    case DBUS_AUTH_COMMAND_CANCEL:
+    case DBUS_AUTH_COMMAND_BEGIN:
+    case DBUS_AUTH_COMMAND_UNKNOWN:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_REQUEST_TICKET:
+    case DBUS_AUTH_COMMAND_TICKET:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
+    default:
+      return send_error (auth, "Unknown command");
+    }
+}
+
+static dbus_bool_t
+handle_client_state_waiting_for_ticket (DBusAuth         *auth,
+                                        DBusAuthCommand   command,
+                                        const DBusString *args)
+{
+  switch (command)
+    {
+    case DBUS_AUTH_COMMAND_TICKET:
+      if (!record_ticket (auth, args))
+        return FALSE;
+      return send_after_ticket (auth);
+
+    case DBUS_AUTH_COMMAND_ERROR:
+      _dbus_verbose ("%s: server wouldn't give us a ticket\n",
+                     DBUS_AUTH_NAME (auth));
+      return send_after_ticket (auth);
+
+    case DBUS_AUTH_COMMAND_OK:
+    case DBUS_AUTH_COMMAND_DATA:
+    case DBUS_AUTH_COMMAND_REJECTED:
+    case DBUS_AUTH_COMMAND_AUTH:
+    case DBUS_AUTH_COMMAND_CANCEL:
+    case DBUS_AUTH_COMMAND_BEGIN:
+    case DBUS_AUTH_COMMAND_UNKNOWN:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_REQUEST_TICKET:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
     default:
       return send_error (auth, "Unknown command");
     }
 }
 
+/* BEGIN has already gone out from a pipelined client, so if the
+ * server doesn't take EXTERNAL there's no going back to try something
+ * else; the server will drop us when it sees the BEGIN anyway.
+ */
 static dbus_bool_t
-handle_client_state_waiting_for_reject (DBusAuth         *auth,
-                                        DBusAuthCommand   command,
-                                        const DBusString *args)
+handle_client_state_waiting_for_ok_pipelined (DBusAuth         *auth,
+                                              DBusAuthCommand   command,
+                                              const DBusString *args)
 {
   switch (command)
     {
+    case DBUS_AUTH_COMMAND_OK:
+      if (!record_guid_from_ok (auth, args))
+        return FALSE;
+
+      if (auth->state == &common_state_need_disconnect)
+        return TRUE;
+
+      if (auth->unix_fd_possible)
+        goto_state (auth, &client_state_waiting_for_agree_unix_fd_pipelined);
+      else
+        goto_state (auth, &common_state_authenticated);
+      return TRUE;
+
     case DBUS_AUTH_COMMAND_REJECTED:
-      return process_rejected (auth, args);
-      
+    case DBUS_AUTH_COMMAND_DATA:
+    case DBUS_AUTH_COMMAND_ERROR:
     case DBUS_AUTH_COMMAND_AUTH:
     case DBUS_AUTH_COMMAND_CANCEL:
-    case DBUS_AUTH_COMMAND_DATA:
     case DBUS_AUTH_COMMAND_BEGIN:
-    case DBUS_AUTH_COMMAND_OK:
-    case DBUS_AUTH_COMMAND_ERROR:
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_REQUEST_TICKET:
+    case DBUS_AUTH_COMMAND_TICKET:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
     default:
+      _dbus_verbose ("%s: server didn't accept pipelined EXTERNAL\n",
+                     DBUS_AUTH_NAME (auth));
       goto_state (auth, &common_state_need_disconnect);
       return TRUE;
     }
 }
 
 static dbus_bool_t
-handle_client_state_waiting_for_agree_unix_fd(DBusAuth         *auth,
-                                              DBusAuthCommand   command,
-                                              const DBusString *args)
+handle_client_state_waiting_for_agree_unix_fd_pipelined (DBusAuth         *auth,
+                                                         DBusAuthCommand   command,
+                                                         const DBusString *args)
 {
   switch (command)
     {
@@ -2080,12 +3174,51 @@ handle_client_state_waiting_for_agree_unix_fd(DBusAuth         *auth,
       _dbus_assert(auth->unix_fd_possible);
       auth->unix_fd_negotiated = TRUE;
       _dbus_verbose("Sucessfully negotiated UNIX FD passing\n");
-      return send_begin (auth);
+      goto_state (auth, &common_state_authenticated);
+      return TRUE;
 
     case DBUS_AUTH_COMMAND_ERROR:
       _dbus_assert(auth->unix_fd_possible);
       auth->unix_fd_negotiated = FALSE;
       _dbus_verbose("Failed to negotiate UNIX FD passing\n");
+      goto_state (auth, &common_state_authenticated);
+      return TRUE;
+
+    case DBUS_AUTH_COMMAND_OK:
+    case DBUS_AUTH_COMMAND_DATA:
+    case DBUS_AUTH_COMMAND_REJECTED:
+    case DBUS_AUTH_COMMAND_AUTH:
+    case DBUS_AUTH_COMMAND_CANCEL:
+    case DBUS_AUTH_COMMAND_BEGIN:
+    case DBUS_AUTH_COMMAND_UNKNOWN:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_REQUEST_TICKET:
+    case DBUS_AUTH_COMMAND_TICKET:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
+    default:
+      goto_state (auth, &common_state_need_disconnect);
+      return TRUE;
+    }
+}
+
+static dbus_bool_t
+handle_client_state_waiting_for_agree_compression (DBusAuth         *auth,
+                                                   DBusAuthCommand   command,
+                                                   const DBusString *args)
+{
+  switch (command)
+    {
+    case DBUS_AUTH_COMMAND_AGREE_COMPRESSION:
+      _dbus_assert (compression_allowed (auth));
+      if (!_dbus_string_equal_c_str (args, "LZ4"))
+        return send_error (auth, "Unknown compression");
+      auth->compression_negotiated = TRUE;
+      _dbus_verbose ("Successfully negotiated compression\n");
+      return send_begin (auth);
+
+    case DBUS_AUTH_COMMAND_ERROR:
+      _dbus_verbose ("Server won't compress the message stream\n");
       return send_begin (auth);
 
     case DBUS_AUTH_COMMAND_OK:
@@ -2096,6 +3229,10 @@ handle_client_state_waiting_for_agree_unix_fd(DBusAuth         *auth,
     case DBUS_AUTH_COMMAND_BEGIN:
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_REQUEST_TICKET:
+    case DBUS_AUTH_COMMAND_TICKET:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION:
     default:
       return send_error (auth, "Unknown command");
     }
@@ -2118,7 +3255,11 @@ static const DBusAuthCommandName auth_command_names[] = {
   { "OK",                DBUS_AUTH_COMMAND_OK },
   { "ERROR",             DBUS_AUTH_COMMAND_ERROR },
   { "NEGOTIATE_UNIX_FD", DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD },
-  { "AGREE_UNIX_FD",     DBUS_AUTH_COMMAND_AGREE_UNIX_FD }
+  { "AGREE_UNIX_FD",     DBUS_AUTH_COMMAND_AGREE_UNIX_FD },
+  { "REQUEST_TICKET",    DBUS_AUTH_COMMAND_REQUEST_TICKET },
+  { "TICKET",            DBUS_AUTH_COMMAND_TICKET },
+  { "NEGOTIATE_COMPRESSION", DBUS_AUTH_COMMAND_NEGOTIATE_COMPRESSION },
+  { "AGREE_COMPRESSION", DBUS_AUTH_COMMAND_AGREE_COMPRESSION }
 };
 
 static DBusAuthCommand
@@ -2145,6 +3286,8 @@ goto_state (DBusAuth *auth,
                  auth->state->name,
                  state->name);
 
+  _dbus_trace2 (auth__state, auth, state->name);
+
   auth->state = state;
 }
 
@@ -2283,7 +3426,7 @@ _dbus_auth_server_new (const DBusString *guid)
 
   server_auth = DBUS_AUTH_SERVER (auth);
 
-  server_auth->guid = guid_copy;
+  _dbus_string_relocate (&server_auth->guid, &guid_copy);
   
   /* perhaps this should be per-mechanism with a lower
    * max
@@ -2306,18 +3449,29 @@ _dbus_auth_client_new (void)
 {
   DBusAuth *auth;
   DBusString guid_str;
+  DBusString resume_key;
 
   if (!_dbus_string_init (&guid_str))
     return NULL;
 
+  if (!_dbus_string_init (&resume_key))
+    {
+      _dbus_string_free (&guid_str);
+      return NULL;
+    }
+
   auth = _dbus_auth_new (sizeof (DBusAuthClient));
   if (auth == NULL)
     {
+      _dbus_string_free (&resume_key);
       _dbus_string_free (&guid_str);
       return NULL;
     }
 
-  DBUS_AUTH_CLIENT (auth)->guid_from_server = guid_str;
+  _dbus_string_relocate (&DBUS_AUTH_CLIENT (auth)->guid_from_server,
+                         &guid_str);
+  _dbus_string_relocate (&DBUS_AUTH_CLIENT (auth)->resume_key,
+                         &resume_key);
 
   auth->side = auth_side_client;
   auth->state = &client_state_need_send_auth;
@@ -2368,6 +3522,7 @@ _dbus_auth_unref (DBusAuth *auth)
       if (DBUS_AUTH_IS_CLIENT (auth))
         {
           _dbus_string_free (& DBUS_AUTH_CLIENT (auth)->guid_from_server);
+          _dbus_string_free (& DBUS_AUTH_CLIENT (auth)->resume_key);
           _dbus_list_clear (& DBUS_AUTH_CLIENT (auth)->mechs_to_try);
         }
       else
@@ -2380,11 +3535,16 @@ _dbus_auth_unref (DBusAuth *auth)
       if (auth->keyring)
         _dbus_keyring_unref (auth->keyring);
 
+      /* A client ticket taken for an AUTH that never went out */
+      if (auth->ticket != NULL)
+        ticket_free (auth->ticket);
+
       _dbus_string_free (&auth->context);
       _dbus_string_free (&auth->challenge);
       _dbus_string_free (&auth->identity);
       _dbus_string_free (&auth->incoming);
       _dbus_string_free (&auth->outgoing);
+      _dbus_string_free (&auth->compressed_incoming);
 
       dbus_free_string_array (auth->allowed_mechs);
 
@@ -2593,6 +3753,208 @@ _dbus_auth_delete_unused_bytes (DBusAuth *auth)
   _dbus_string_set_length (&auth->incoming, 0);
 }
 
+#ifdef HAVE_LZ4
+/*
+ * A compressed stream is a series of frames, one for each block
+ * handed to _dbus_auth_encode_data(): a kind byte, then the length of
+ * the block as a little-endian uint32. A stored frame follows that
+ * with the block as it is; an LZ4 frame with the length of the
+ * compressed data, as another uint32, and the data.
+ */
+#define COMPRESSED_FRAME_STORED 0
+#define COMPRESSED_FRAME_LZ4    1
+
+/** Blocks shorter than this, such as most headers, go out stored */
+#define COMPRESS_MIN_SIZE 512
+
+static void
+set_frame_length (DBusString    *str,
+                  int            pos,
+                  dbus_uint32_t  value)
+{
+  int i;
+
+  for (i = 0; i < 4; i++)
+    _dbus_string_set_byte (str, pos + i, (value >> (8 * i)) & 0xff);
+}
+
+static dbus_uint32_t
+get_frame_length (const DBusString *str,
+                  int               pos)
+{
+  dbus_uint32_t value;
+  int i;
+
+  value = 0;
+  for (i = 0; i < 4; i++)
+    value |= ((dbus_uint32_t) _dbus_string_get_byte (str, pos + i)) << (8 * i);
+
+  return value;
+}
+
+static dbus_bool_t
+compress_frame (const DBusString *plaintext,
+                DBusString       *encoded)
+{
+  int len;
+  int orig_len;
+
+  len = _dbus_string_get_length (plaintext);
+  orig_len = _dbus_string_get_length (encoded);
+
+  if (len >= COMPRESS_MIN_SIZE)
+    {
+      int bound;
+      int packed;
+
+      bound = LZ4_compressBound (len);
+      if (!_dbus_string_lengthen (encoded, 9 + bound))
+        return FALSE;
+
+      packed = LZ4_compress_default (_dbus_string_get_const_data (plaintext),
+                                     _dbus_string_get_data_len (encoded,
+                                                                orig_len + 9,
+                                                                bound),
+                                     len, bound);
+
+      /* Incompressible data is better off stored */
+      if (packed > 0 && packed < len)
+        {
+          _dbus_string_set_byte (encoded, orig_len, COMPRESSED_FRAME_LZ4);
+          set_frame_length (encoded, orig_len + 1, len);
+          set_frame_length (encoded, orig_len + 5, packed);
+          _dbus_string_set_length (encoded, orig_len + 9 + packed);
+          return TRUE;
+        }
+
+      _dbus_string_set_length (encoded, orig_len);
+    }
+
+  if (!_dbus_string_lengthen (encoded, 5))
+    return FALSE;
+
+  _dbus_string_set_byte (encoded, orig_len, COMPRESSED_FRAME_STORED);
+  set_frame_length (encoded, orig_len + 1, len);
+
+  if (!_dbus_string_copy (plaintext, 0, encoded, orig_len + 5))
+    {
+      _dbus_string_set_length (encoded, orig_len);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Decodes every frame that's now complete, keeping the start of any
+ * that isn't for next time. On OOM nothing has changed, so the same
+ * bytes can be passed in again; on nonsense, decoding_failed is set
+ * and the rest of the stream is ignored.
+ */
+static dbus_bool_t
+decompress_frames (DBusAuth         *auth,
+                   const DBusString *encoded,
+                   DBusString       *plaintext)
+{
+  DBusString *pending;
+  int orig_pending_len;
+  int orig_plaintext_len;
+  int pos;
+
+  if (auth->decoding_failed)
+    return TRUE;
+
+  pending = &auth->compressed_incoming;
+  orig_pending_len = _dbus_string_get_length (pending);
+  orig_plaintext_len = _dbus_string_get_length (plaintext);
+
+  if (!_dbus_string_copy (encoded, 0, pending, orig_pending_len))
+    return FALSE;
+
+  pos = 0;
+  while (TRUE)
+    {
+      int available;
+      int kind;
+      int header_len;
+      dbus_uint32_t plain_len;
+      dbus_uint32_t packed_len;
+
+      available = _dbus_string_get_length (pending) - pos;
+      if (available < 5)
+        break;
+
+      kind = _dbus_string_get_byte (pending, pos);
+      plain_len = get_frame_length (pending, pos + 1);
+
+      if (plain_len > DBUS_MAXIMUM_MESSAGE_LENGTH)
+        goto failed;
+
+      if (kind == COMPRESSED_FRAME_STORED)
+        {
+          header_len = 5;
+          packed_len = plain_len;
+        }
+      else if (kind == COMPRESSED_FRAME_LZ4)
+        {
+          if (available < 9)
+            break;
+
+          header_len = 9;
+          packed_len = get_frame_length (pending, pos + 5);
+
+          if (packed_len > (dbus_uint32_t) LZ4_compressBound (plain_len))
+            goto failed;
+        }
+      else
+        goto failed;
+
+      if ((dbus_uint32_t) (available - header_len) < packed_len)
+        break;
+
+      if (kind == COMPRESSED_FRAME_STORED)
+        {
+          if (!_dbus_string_copy_len (pending, pos + header_len, plain_len,
+                                      plaintext,
+                                      _dbus_string_get_length (plaintext)))
+            goto nomem;
+        }
+      else
+        {
+          int start;
+
+          start = _dbus_string_get_length (plaintext);
+          if (!_dbus_string_lengthen (plaintext, plain_len))
+            goto nomem;
+
+          if (LZ4_decompress_safe (_dbus_string_get_const_data_len (pending,
+                                                                    pos + header_len,
+                                                                    packed_len),
+                                   _dbus_string_get_data_len (plaintext, start,
+                                                              plain_len),
+                                   packed_len, plain_len) != (int) plain_len)
+            goto failed;
+        }
+
+      pos += header_len + packed_len;
+    }
+
+  _dbus_string_delete (pending, 0, pos);
+  return TRUE;
+
+ failed:
+  _dbus_verbose ("%s: peer's compressed stream is corrupt\n",
+                 DBUS_AUTH_NAME (auth));
+  auth->decoding_failed = TRUE;
+  _dbus_string_set_length (pending, 0);
+  return TRUE;
+
+ nomem:
+  _dbus_string_set_length (pending, orig_pending_len);
+  _dbus_string_set_length (plaintext, orig_plaintext_len);
+  return FALSE;
+}
+#endif /* HAVE_LZ4 */
+
 /**
  * Called post-authentication, indicates whether we need to encode
  * the message stream with _dbus_auth_encode_data() prior to
@@ -2606,6 +3968,9 @@ _dbus_auth_needs_encoding (DBusAuth *auth)
 {
   if (auth->state != &common_state_authenticated)
     return FALSE;
+
+  if (auth->compression_negotiated)
+    return TRUE;
   
   if (auth->mech != NULL)
     {
@@ -2637,6 +4002,11 @@ _dbus_auth_encode_data (DBusAuth         *auth,
   
   if (auth->state != &common_state_authenticated)
     return FALSE;
+
+#ifdef HAVE_LZ4
+  if (auth->compression_negotiated)
+    return compress_frame (plaintext, encoded);
+#endif
   
   if (_dbus_auth_needs_encoding (auth))
     {
@@ -2665,6 +4035,9 @@ _dbus_auth_needs_decoding (DBusAuth *auth)
 {
   if (auth->state != &common_state_authenticated)
     return FALSE;
+
+  if (auth->compression_negotiated)
+    return TRUE;
     
   if (auth->mech != NULL)
     {
@@ -2686,6 +4059,9 @@ _dbus_auth_needs_decoding (DBusAuth *auth)
  * @todo 1.0? We need to be able to distinguish "out of memory" error
  * from "the data is hosed" error.
  *
+ * If the data turns out not to make sense, this still returns #TRUE;
+ * see _dbus_auth_get_decoding_failed().
+ *
  * @param auth the auth conversation
  * @param encoded the encoded data
  * @param plaintext initialized string where decoded data is appended
@@ -2700,6 +4076,11 @@ _dbus_auth_decode_data (DBusAuth         *auth,
   
   if (auth->state != &common_state_authenticated)
     return FALSE;
+
+#ifdef HAVE_LZ4
+  if (auth->compression_negotiated)
+    return decompress_frames (auth, encoded, plaintext);
+#endif
   
   if (_dbus_auth_needs_decoding (auth))
     {
@@ -2732,6 +4113,35 @@ _dbus_auth_set_credentials (DBusAuth               *auth,
                                             credentials);
 }
 
+/**
+ * Puts a server conversation straight into the authenticated state,
+ * for a connection that was authenticated by another process which
+ * has handed the socket over to us. Nothing is sent to the client,
+ * which never knows.
+ *
+ * @param auth the server auth conversation, which must not have started
+ * @param identity the identity the client was authorized as
+ * @param unix_fd_negotiated whether unix fd passing was negotiated
+ * @returns #FALSE on OOM
+ */
+dbus_bool_t
+_dbus_auth_set_handed_over (DBusAuth        *auth,
+                            DBusCredentials *identity,
+                            dbus_bool_t      unix_fd_negotiated)
+{
+  _dbus_assert (DBUS_AUTH_IS_SERVER (auth));
+  _dbus_assert (auth->state == &server_state_waiting_for_auth);
+
+  if (!_dbus_credentials_add_credentials (auth->authorized_identity,
+                                          identity))
+    return FALSE;
+
+  auth->unix_fd_negotiated = unix_fd_negotiated && auth->unix_fd_possible;
+  goto_state (auth, &common_state_authenticated);
+
+  return TRUE;
+}
+
 /**
  * Gets the identity we authorized the client as.  Apps may have
  * different policies as to what identities they allow.
@@ -2792,6 +4202,58 @@ _dbus_auth_set_context (DBusAuth               *auth,
                                    &auth->context, 0, _dbus_string_get_length (context));
 }
 
+/**
+ * Sets the address a client is connecting to, which is what tickets
+ * for skipping authentication next time are kept under. Without one
+ * the client neither asks for nor presents tickets.
+ *
+ * If a ticket is held for the address, the conversation opens with
+ * it instead of EXTERNAL, so this must be called before any of the
+ * client's bytes are sent.
+ *
+ * @param auth the client auth conversation
+ * @param address the address, or an empty string for none
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+_dbus_auth_set_resume_key (DBusAuth         *auth,
+                           const DBusString *address)
+{
+  const DBusAuthMechanismHandler *mech;
+  DBusString name;
+  int orig_len;
+
+  _dbus_assert (DBUS_AUTH_IS_CLIENT (auth));
+
+  if (!_dbus_string_replace_len (address, 0, _dbus_string_get_length (address),
+                                 & DBUS_AUTH_CLIENT (auth)->resume_key, 0,
+                                 _dbus_string_get_length (& DBUS_AUTH_CLIENT (auth)->resume_key)))
+    return FALSE;
+
+  _dbus_string_init_const (&name, TICKET_MECHANISM);
+  mech = find_mech (&name, auth->allowed_mechs);
+
+  if (mech == NULL ||
+      auth->state != &client_state_waiting_for_data ||
+      auth->mech != &all_mechanisms[0] ||
+      auth->already_got_mechanisms ||
+      !client_has_ticket (auth))
+    return TRUE;
+
+  /* Replace the AUTH EXTERNAL that's waiting to go out; if the
+   * ticket is refused, EXTERNAL is still on the list the server
+   * sends back.
+   */
+  orig_len = _dbus_string_get_length (&auth->outgoing);
+
+  if (!send_auth (auth, mech))
+    return FALSE;
+
+  _dbus_string_delete (&auth->outgoing, 0, orig_len);
+
+  return TRUE;
+}
+
 /**
  * Sets whether unix fd passing is potentially on the transport and
  * hence shall be negotiated.
@@ -2805,6 +4267,109 @@ _dbus_auth_set_unix_fd_possible(DBusAuth *auth, dbus_bool_t b)
   auth->unix_fd_possible = b;
 }
 
+/**
+ * Sends the rest of a client's side of the conversation straight
+ * after its AUTH EXTERNAL, without waiting to hear back:
+ * NEGOTIATE_UNIX_FD if unix fd passing is possible, then BEGIN. The
+ * handshake then costs a single round trip, and messages may follow
+ * these bytes straight away, see _dbus_auth_get_pipelined().
+ *
+ * This is only worth doing where the server is all but certain to
+ * accept EXTERNAL, such as a local bus: if it rejects it, the
+ * conversation can't fall back to another mechanism and the
+ * connection is dropped. Does nothing unless the client is still
+ * waiting for a reply to its first AUTH EXTERNAL.
+ *
+ * @param auth the client auth conversation
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+_dbus_auth_client_pipeline (DBusAuth *auth)
+{
+  int orig_len;
+
+  _dbus_assert (DBUS_AUTH_IS_CLIENT (auth));
+
+  if (auth->state != &client_state_waiting_for_data ||
+      auth->mech != &all_mechanisms[0] ||
+      _dbus_string_get_length (&auth->incoming) > 0)
+    return TRUE;
+
+  orig_len = _dbus_string_get_length (&auth->outgoing);
+
+  if ((auth->unix_fd_possible &&
+       !_dbus_string_append (&auth->outgoing, "NEGOTIATE_UNIX_FD\r\n")) ||
+      !_dbus_string_append (&auth->outgoing, "BEGIN\r\n"))
+    {
+      _dbus_string_set_length (&auth->outgoing, orig_len);
+      return FALSE;
+    }
+
+  auth->pipelined = TRUE;
+  goto_state (auth, &client_state_waiting_for_ok_pipelined);
+
+  return TRUE;
+}
+
+/**
+ * Whether _dbus_auth_client_pipeline() took effect on a conversation
+ * that's still going, so that the client's bytes to send end with
+ * BEGIN and messages may be written straight after them.
+ *
+ * @param auth the auth conversation
+ * @returns #TRUE if the client is pipelining
+ */
+dbus_bool_t
+_dbus_auth_get_pipelined (DBusAuth *auth)
+{
+  return auth->pipelined &&
+    auth->state != &common_state_need_disconnect;
+}
+
+/**
+ * Sets whether this side is willing to compress the message stream
+ * with LZ4 once authenticated. A client then asks for it after
+ * settling unix fd passing, and a server agrees if asked; either way
+ * it's only used if both sides want it. Has no effect unless built
+ * with LZ4 support, and a pipelined client never asks.
+ *
+ * @param auth the auth conversation
+ * @param b #TRUE to offer or accept compression
+ */
+void
+_dbus_auth_set_compression_possible (DBusAuth    *auth,
+                                     dbus_bool_t  b)
+{
+#ifdef HAVE_LZ4
+  auth->compression_possible = b;
+#endif
+}
+
+/**
+ * Queries whether the message stream is compressed.
+ *
+ * @param auth the auth conversation
+ * @returns #TRUE when compression was negotiated
+ */
+dbus_bool_t
+_dbus_auth_get_compression_negotiated (DBusAuth *auth)
+{
+  return auth->compression_negotiated;
+}
+
+/**
+ * Whether _dbus_auth_decode_data() has been given data that can't be
+ * decoded, in which case the connection is beyond saving.
+ *
+ * @param auth the auth conversation
+ * @returns #TRUE if the peer's stream is corrupt
+ */
+dbus_bool_t
+_dbus_auth_get_decoding_failed (DBusAuth *auth)
+{
+  return auth->decoding_failed;
+}
+
 /**
  * Queries whether unix fd passing was sucessfully negotiated.
  *
@@ -71,12 +71,23 @@ dbus_bool_t   _dbus_auth_decode_data         (DBusAuth               *auth,
 dbus_bool_t   _dbus_auth_set_credentials     (DBusAuth               *auth,
                                               DBusCredentials        *credentials);
 DBusCredentials* _dbus_auth_get_identity     (DBusAuth               *auth);
+dbus_bool_t   _dbus_auth_set_handed_over     (DBusAuth               *auth,
+                                              DBusCredentials        *identity,
+                                              dbus_bool_t             unix_fd_negotiated);
 dbus_bool_t   _dbus_auth_set_context         (DBusAuth               *auth,
                                               const DBusString       *context);
+dbus_bool_t   _dbus_auth_set_resume_key      (DBusAuth               *auth,
+                                              const DBusString       *address);
 const char*   _dbus_auth_get_guid_from_server(DBusAuth               *auth);
 
 void          _dbus_auth_set_unix_fd_possible(DBusAuth               *auth, dbus_bool_t b);
+dbus_bool_t   _dbus_auth_client_pipeline     (DBusAuth               *auth);
+dbus_bool_t   _dbus_auth_get_pipelined       (DBusAuth               *auth);
 dbus_bool_t   _dbus_auth_get_unix_fd_negotiated(DBusAuth             *auth);
+void          _dbus_auth_set_compression_possible (DBusAuth          *auth,
+                                                   dbus_bool_t        b);
+dbus_bool_t   _dbus_auth_get_compression_negotiated (DBusAuth        *auth);
+dbus_bool_t   _dbus_auth_get_decoding_failed (DBusAuth               *auth);
 
 DBUS_END_DECLS
 
@@ -27,10 +27,12 @@
 #include "dbus-protocol.h"
 #include "dbus-internals.h"
 #include "dbus-message.h"
+#include "dbus-pending-call.h"
 #include "dbus-marshal-validate.h"
 #include "dbus-threads-internal.h"
 #include "dbus-connection-internal.h"
 #include "dbus-string.h"
+#include "dbus-hash.h"
 
 /**
  * @defgroup DBusBus Message bus APIs
@@ -77,6 +79,8 @@ typedef struct
 {
   DBusConnection *connection; /**< Connection we're associated with */
   char *unique_name; /**< Unique name of this connection */
+  DBusPendingCall *hello_pending; /**< Hello sent by dbus_bus_register_async() that nobody has read the reply to */
+  DBusHashTable *name_owners; /**< Cached owner state by bus name, or #NULL if caching is off */
 
   unsigned int is_well_known : 1; /**< Is one of the well-known connections in our global array */
 } BusData;
@@ -89,6 +93,19 @@ static dbus_int32_t bus_data_slot = -1;
 #define N_BUS_TYPES 3
 
 static DBusConnection *bus_connections[N_BUS_TYPES];
+
+/**
+ * The shared connection dbus_bus_get() last returned for each type
+ * it was asked for, so that later calls can return it without taking
+ * the bus lock. Like bus_connections these are weak refs. They are
+ * only cleared with the bus lock held, by unpublish_connection_unlocked(),
+ * which then waits for bus_get_readers to drain, so the fast path never
+ * refs a connection after it is unpublished.
+ */
+static void * volatile published_connections[N_BUS_TYPES];
+
+/** Number of dbus_bus_get() calls currently reading published_connections */
+static DBusAtomic bus_get_readers;
 static char *bus_connection_addresses[N_BUS_TYPES] = { NULL, NULL, NULL };
 
 static DBusBusType activation_bus_type = DBUS_BUS_STARTER;
@@ -108,6 +125,36 @@ _DBUS_DEFINE_GLOBAL_LOCK (bus);
  */
 _DBUS_DEFINE_GLOBAL_LOCK (bus_datas);
 
+/*
+ * Called with the bus lock held while connection is still alive, to
+ * stop the dbus_bus_get() fast path returning it.
+ */
+static void
+unpublish_connection_unlocked (DBusConnection *connection)
+{
+  dbus_bool_t unpublished;
+  int i;
+
+  unpublished = FALSE;
+  for (i = 0; i < N_BUS_TYPES; ++i)
+    {
+      if (_dbus_atomic_pointer_get (&published_connections[i]) == connection)
+        {
+          _dbus_atomic_pointer_set (&published_connections[i], NULL);
+          unpublished = TRUE;
+        }
+    }
+
+  /* A reader that loaded the pointer before we cleared it may not
+   * have taken its reference yet; it only takes a few instructions.
+   */
+  if (unpublished)
+    {
+      while (_dbus_atomic_get (&bus_get_readers) != 0)
+        _dbus_sleep_milliseconds (0);
+    }
+}
+
 static void
 addresses_shutdown_func (void *data)
 {
@@ -118,7 +165,8 @@ addresses_shutdown_func (void *data)
     {
       if (bus_connections[i] != NULL)
         _dbus_warn_check_failed ("dbus_shutdown() called but connections were still live. This probably means the application did not drop all its references to bus connections.\n");
-      
+
+      _dbus_atomic_pointer_set (&published_connections[i], NULL);
       dbus_free (bus_connection_addresses[i]);
       bus_connection_addresses[i] = NULL;
       ++i;
@@ -344,9 +392,12 @@ bus_data_free (void *data)
           
           ++i;
         }
+      unpublish_connection_unlocked (bd->connection);
       _DBUS_UNLOCK (bus);
     }
   
+  if (bd->name_owners)
+    _dbus_hash_table_unref (bd->name_owners);
   dbus_free (bd->unique_name);
   dbus_free (bd);
 
@@ -418,22 +469,45 @@ _dbus_bus_notify_shared_connection_disconnected_unlocked (DBusConnection *connec
         }
     }
 
+  unpublish_connection_unlocked (connection);
+
   _DBUS_UNLOCK (bus);
 }
 
 static DBusConnection *
 internal_bus_get (DBusBusType  type,
                   dbus_bool_t  private,
+                  dbus_bool_t  async,
                   DBusError   *error)
 {
   const char *address;
   DBusConnection *connection;
   BusData *bd;
   DBusBusType address_type;
+  DBusBusType requested_type;
 
   _dbus_return_val_if_fail (type >= 0 && type < N_BUS_TYPES, NULL);
   _dbus_return_val_if_error_is_set (error, NULL);
 
+  /* Once the shared connection exists, most callers just want another
+   * reference to it; don't make them queue up on the bus lock for that.
+   */
+  if (!private)
+    {
+      _dbus_atomic_inc (&bus_get_readers);
+
+      connection = _dbus_atomic_pointer_get (&published_connections[type]);
+      if (connection != NULL)
+        dbus_connection_ref (connection);
+
+      _dbus_atomic_dec (&bus_get_readers);
+
+      if (connection != NULL)
+        return connection;
+    }
+
+  requested_type = type;
+
   _DBUS_LOCK (bus);
 
   if (!init_connections_unlocked ())
@@ -462,6 +536,9 @@ internal_bus_get (DBusBusType  type,
     {
       connection = bus_connections[type];
       dbus_connection_ref (connection);
+
+      _dbus_atomic_pointer_set (&published_connections[requested_type],
+                                connection);
       
       _DBUS_UNLOCK (bus);
       return connection;
@@ -488,7 +565,8 @@ internal_bus_get (DBusBusType  type,
       return NULL;
     }
 
-  if (!dbus_bus_register (connection, error))
+  if (async ? !dbus_bus_register_async (connection, error) :
+      !dbus_bus_register (connection, error))
     {
       _DBUS_ASSERT_ERROR_IS_SET (error);
       _dbus_connection_close_possibly_shared (connection);
@@ -520,6 +598,9 @@ internal_bus_get (DBusBusType  type,
   bd->is_well_known = TRUE;
   _DBUS_UNLOCK (bus_datas);
 
+  if (!private)
+    _dbus_atomic_pointer_set (&published_connections[requested_type],
+                              connection);
   
   _DBUS_UNLOCK (bus);
 
@@ -527,6 +608,86 @@ internal_bus_get (DBusBusType  type,
   return connection;
 }
 
+/*
+ * Takes the reply to the Hello sent by dbus_bus_register_async() and
+ * stores the unique name from it, unless that has been done already.
+ * Called with bus_datas held, by the pending call's notify function or
+ * by whoever finds the call complete first.
+ */
+static void
+take_hello_reply_unlocked (BusData         *bd,
+                           DBusPendingCall *pending,
+                           DBusError       *error)
+{
+  DBusMessage *reply;
+  const char *name;
+
+  if (bd->hello_pending != pending)
+    return;
+
+  bd->hello_pending = NULL;
+
+  reply = dbus_pending_call_steal_reply (pending);
+  dbus_pending_call_unref (pending);
+
+  if (reply == NULL)
+    {
+      _DBUS_SET_OOM (error);
+      return;
+    }
+
+  if (!dbus_set_error_from_message (error, reply) &&
+      dbus_message_get_args (reply, error,
+                             DBUS_TYPE_STRING, &name,
+                             DBUS_TYPE_INVALID))
+    {
+      bd->unique_name = _dbus_strdup (name);
+      if (bd->unique_name == NULL)
+        _DBUS_SET_OOM (error);
+    }
+
+  dbus_message_unref (reply);
+}
+
+static void
+hello_reply_notify (DBusPendingCall *pending,
+                    void            *data)
+{
+  /* Whoever asks for the unique name first gets to hear why it
+   * couldn't be had, if it couldn't; the bus drops clients whose Hello
+   * fails anyway
+   */
+  _DBUS_LOCK (bus_datas);
+  take_hello_reply_unlocked (data, pending, NULL);
+  _DBUS_UNLOCK (bus_datas);
+}
+
+/*
+ * Waits for the reply to a Hello sent by dbus_bus_register_async(), if
+ * there is one outstanding.  Called with bus_datas held, which is
+ * dropped while waiting.
+ */
+static void
+finish_hello_unlocked (BusData   *bd,
+                       DBusError *error)
+{
+  DBusPendingCall *pending;
+
+  pending = bd->hello_pending;
+  if (pending == NULL)
+    return;
+
+  dbus_pending_call_ref (pending);
+
+  _DBUS_UNLOCK (bus_datas);
+  dbus_pending_call_block (pending);
+  _DBUS_LOCK (bus_datas);
+
+  /* usually the notify function got there first */
+  take_hello_reply_unlocked (bd, pending, error);
+
+  dbus_pending_call_unref (pending);
+}
 
 /** @} */ /* end of implementation details docs */
 
@@ -564,7 +725,7 @@ DBusConnection *
 dbus_bus_get (DBusBusType  type,
 	      DBusError   *error)
 {
-  return internal_bus_get (type, FALSE, error);
+  return internal_bus_get (type, FALSE, FALSE, error);
 }
 
 /**
@@ -596,7 +757,31 @@ DBusConnection *
 dbus_bus_get_private (DBusBusType  type,
                       DBusError   *error)
 {
-  return internal_bus_get (type, TRUE, error);
+  return internal_bus_get (type, TRUE, FALSE, error);
+}
+
+/**
+ * Connects to a bus daemon and registers the client with it, like
+ * dbus_bus_get(), but without waiting for the bus to reply to the
+ * registration.  The registration is made with
+ * dbus_bus_register_async(), so messages can be sent on the
+ * connection straight away and go out after it, and the unique name
+ * is only waited for when dbus_bus_get_unique_name() is first called.
+ * This lets an application get on with starting up while the bus
+ * deals with the registration.
+ *
+ * If a connection to the bus already exists, it is returned as by
+ * dbus_bus_get(), whether or not it has finished registering.
+ *
+ * @param type bus type
+ * @param error address where an error can be returned.
+ * @returns a #DBusConnection with new ref
+ */
+DBusConnection *
+dbus_bus_get_async (DBusBusType  type,
+                    DBusError   *error)
+{
+  return internal_bus_get (type, FALSE, TRUE, error);
 }
 
 /**
@@ -672,6 +857,19 @@ dbus_bus_register (DBusConnection *connection,
       return FALSE;
     }
 
+  if (bd->hello_pending != NULL)
+    {
+      finish_hello_unlocked (bd, error);
+
+      retval = bd->unique_name != NULL;
+      if (!retval && !dbus_error_is_set (error))
+        dbus_set_error (error, DBUS_ERROR_FAILED,
+                        "Registration with the message bus failed");
+      _DBUS_UNLOCK (bus_datas);
+
+      return retval;
+    }
+
   if (bd->unique_name != NULL)
     {
       _dbus_verbose ("Ignoring attempt to register the same DBusConnection %s with the message bus a second time.\n",
@@ -729,6 +927,90 @@ dbus_bus_register (DBusConnection *connection,
   return retval;
 }
 
+/**
+ * Registers a connection with the bus like dbus_bus_register(), but
+ * returns as soon as the registration is queued to be sent, without
+ * waiting for the bus to reply.  Messages sent on the connection
+ * afterwards follow the registration to the bus, so they can be sent
+ * straight away.
+ *
+ * The unique name is taken from the reply when it is dispatched, or
+ * when dbus_bus_get_unique_name() or dbus_bus_register() is called,
+ * which wait for the reply if it hasn't come yet.  If registration
+ * fails, dbus_bus_get_unique_name() returns #NULL, and the bus
+ * disconnects the client.
+ *
+ * If the connection has already registered with the bus, or started
+ * to, this function does nothing.
+ *
+ * @param connection the connection
+ * @param error place to store errors
+ * @returns #TRUE on success, #FALSE if not enough memory
+ */
+dbus_bool_t
+dbus_bus_register_async (DBusConnection *connection,
+                         DBusError      *error)
+{
+  DBusMessage *message;
+  DBusPendingCall *pending;
+  BusData *bd;
+
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_error_is_set (error, FALSE);
+
+  _DBUS_LOCK (bus_datas);
+
+  bd = ensure_bus_data (connection);
+  if (bd == NULL)
+    {
+      _DBUS_SET_OOM (error);
+      _DBUS_UNLOCK (bus_datas);
+      return FALSE;
+    }
+
+  if (bd->unique_name != NULL || bd->hello_pending != NULL)
+    {
+      _DBUS_UNLOCK (bus_datas);
+      return TRUE;
+    }
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "Hello");
+  if (message == NULL)
+    {
+      _DBUS_SET_OOM (error);
+      _DBUS_UNLOCK (bus_datas);
+      return FALSE;
+    }
+
+  if (!dbus_connection_send_with_reply (connection, message, &pending, -1) ||
+      pending == NULL)
+    {
+      dbus_message_unref (message);
+      _DBUS_SET_OOM (error);
+      _DBUS_UNLOCK (bus_datas);
+      return FALSE;
+    }
+
+  dbus_message_unref (message);
+
+  bd->hello_pending = pending;
+
+  /* The reply may already have been dispatched by another thread, in
+   * which case the notify function won't be called; on failure it is
+   * taken when the unique name is asked for
+   */
+  if (dbus_pending_call_set_notify (pending, hello_reply_notify, bd, NULL) &&
+      dbus_pending_call_get_completed (pending))
+    take_hello_reply_unlocked (bd, pending, NULL);
+
+  _DBUS_UNLOCK (bus_datas);
+
+  return TRUE;
+}
+
 
 /**
  * Sets the unique name of the connection, as assigned by the message
@@ -799,9 +1081,11 @@ dbus_bus_set_unique_name (DBusConnection *connection,
  * The name remains valid until the connection is freed, and
  * should not be freed by the caller.
  *
- * Other than dbus_bus_get(), there are two ways to set the unique
- * name; one is dbus_bus_register(), the other is
- * dbus_bus_set_unique_name().  You are responsible for calling
+ * Other than dbus_bus_get(), there are three ways to set the unique
+ * name: dbus_bus_register(), dbus_bus_register_async() and
+ * dbus_bus_set_unique_name().  After dbus_bus_register_async() or
+ * dbus_bus_get_async() this function blocks until the bus has
+ * replied to the registration, if it hasn't yet.  You are responsible for calling
  * dbus_bus_set_unique_name() if you register by hand instead of using
  * dbus_bus_register().
  * 
@@ -820,7 +1104,12 @@ dbus_bus_get_unique_name (DBusConnection *connection)
   
   bd = ensure_bus_data (connection);
   if (bd == NULL)
-    return NULL;
+    {
+      _DBUS_UNLOCK (bus_datas);
+      return NULL;
+    }
+
+  finish_hello_unlocked (bd, NULL);
 
   unique_name = bd->unique_name;
 
@@ -1250,6 +1539,233 @@ dbus_bus_release_name (DBusConnection *connection,
   return result;
 }
 
+/** Most names a connection will watch through its name owner cache */
+#define MAX_CACHED_NAME_OWNERS 64
+
+/**
+ * States of a name in the owner cache. None of them is 0, so
+ * a cached state is never a #NULL hash value.
+ */
+enum
+{
+  NAME_OWNER_PENDING = 1, /**< Watch added, NameHasOwner still in flight */
+  NAME_OWNER_NONE,        /**< The name has no owner */
+  NAME_OWNER_PRESENT      /**< The name has an owner */
+};
+
+static dbus_bool_t
+append_name_owner_rule (DBusString *rule,
+                        const char *name)
+{
+  return _dbus_string_append_printf (rule,
+                                     "type='signal',"
+                                     "sender='" DBUS_SERVICE_DBUS "',"
+                                     "interface='" DBUS_INTERFACE_DBUS "',"
+                                     "member='NameOwnerChanged',"
+                                     "arg0='%s'",
+                                     name);
+}
+
+static dbus_bool_t
+watch_name_owner (DBusConnection *connection,
+                  const char     *name)
+{
+  DBusString rule;
+  DBusError error;
+  dbus_bool_t watching;
+
+  if (!_dbus_string_init (&rule))
+    return FALSE;
+
+  watching = FALSE;
+  if (append_name_owner_rule (&rule, name))
+    {
+      /* Block, so the match is in place before the bus answers the
+       * query that follows; otherwise a change in between is lost.
+       */
+      dbus_error_init (&error);
+      dbus_bus_add_match (connection, _dbus_string_get_const_data (&rule),
+                          &error);
+      watching = !dbus_error_is_set (&error);
+      dbus_error_free (&error);
+    }
+
+  _dbus_string_free (&rule);
+  return watching;
+}
+
+static void
+unwatch_name_owner (DBusConnection *connection,
+                    const char     *name)
+{
+  DBusString rule;
+
+  if (!_dbus_string_init (&rule))
+    return;
+
+  if (append_name_owner_rule (&rule, name))
+    dbus_bus_remove_match (connection, _dbus_string_get_const_data (&rule),
+                           NULL);
+
+  _dbus_string_free (&rule);
+}
+
+/**
+ * Looks up a name in the connection's owner cache. If caching is on
+ * and the name isn't cached yet, adds a pending entry and sets
+ * watch_p, and the caller must then watch the name, query it and
+ * call name_owner_cache_finish() or name_owner_cache_forget().
+ *
+ * @returns the cached state, or 0 if the bus must be asked
+ */
+static int
+name_owner_cache_begin (DBusConnection *connection,
+                        const char     *name,
+                        dbus_bool_t    *watch_p)
+{
+  BusData *bd;
+  char *key;
+  int state;
+
+  state = 0;
+  *watch_p = FALSE;
+
+  /* nothing keeps the cache current once we are cut off, so let the
+   * query fail as it would without one
+   */
+  if (!dbus_connection_get_is_connected (connection))
+    return 0;
+
+  _DBUS_LOCK (bus_datas);
+
+  bd = ensure_bus_data (connection);
+  if (bd != NULL && bd->name_owners != NULL)
+    {
+      state = _DBUS_POINTER_TO_INT (_dbus_hash_table_lookup_string (bd->name_owners,
+                                                                   name));
+      if (state == 0 &&
+          _dbus_hash_table_get_n_entries (bd->name_owners) < MAX_CACHED_NAME_OWNERS)
+        {
+          key = _dbus_strdup (name);
+          if (key != NULL &&
+              _dbus_hash_table_insert_string (bd->name_owners, key,
+                                              _DBUS_INT_TO_POINTER (NAME_OWNER_PENDING)))
+            *watch_p = TRUE;
+          else
+            dbus_free (key);
+        }
+    }
+
+  _DBUS_UNLOCK (bus_datas);
+
+  return state;
+}
+
+/**
+ * Records the answer to a query begun by name_owner_cache_begin().
+ * A NameOwnerChanged seen since the entry was added is at least as
+ * recent as the answer, so it wins. If caching was turned off
+ * meanwhile, drops the watch instead.
+ */
+static void
+name_owner_cache_finish (DBusConnection *connection,
+                         const char     *name,
+                         int             state)
+{
+  BusData *bd;
+  DBusHashIter iter;
+  dbus_bool_t cached;
+
+  cached = FALSE;
+
+  _DBUS_LOCK (bus_datas);
+
+  bd = dbus_connection_get_data (connection, bus_data_slot);
+  if (bd != NULL && bd->name_owners != NULL &&
+      _dbus_hash_iter_lookup (bd->name_owners, (char *) name, FALSE, &iter))
+    {
+      if (_DBUS_POINTER_TO_INT (_dbus_hash_iter_get_value (&iter)) == NAME_OWNER_PENDING)
+        _dbus_hash_iter_set_value (&iter, _DBUS_INT_TO_POINTER (state));
+      cached = TRUE;
+    }
+
+  _DBUS_UNLOCK (bus_datas);
+
+  if (!cached)
+    unwatch_name_owner (connection, name);
+}
+
+/**
+ * Drops the pending entry added by name_owner_cache_begin() when
+ * the name could not be watched or queried.
+ */
+static void
+name_owner_cache_forget (DBusConnection *connection,
+                         const char     *name)
+{
+  BusData *bd;
+
+  _DBUS_LOCK (bus_datas);
+
+  bd = dbus_connection_get_data (connection, bus_data_slot);
+  if (bd != NULL && bd->name_owners != NULL)
+    _dbus_hash_table_remove_string (bd->name_owners, name);
+
+  _DBUS_UNLOCK (bus_datas);
+}
+
+/**
+ * Filter keeping the name owner cache current, and emptying it when
+ * the connection is lost. It never consumes the signal, so the
+ * application's own handlers still see it.
+ */
+static DBusHandlerResult
+name_owner_cache_filter (DBusConnection *connection,
+                         DBusMessage    *message,
+                         void           *user_data)
+{
+  const char *name, *old_owner, *new_owner;
+  BusData *bd;
+  DBusHashIter iter;
+
+  if (dbus_message_is_signal (message, DBUS_INTERFACE_LOCAL, "Disconnected"))
+    {
+      _DBUS_LOCK (bus_datas);
+
+      bd = dbus_connection_get_data (connection, bus_data_slot);
+      if (bd != NULL && bd->name_owners != NULL)
+        _dbus_hash_table_remove_all (bd->name_owners);
+
+      _DBUS_UNLOCK (bus_datas);
+
+      return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    }
+
+  if (!dbus_message_is_signal (message, DBUS_INTERFACE_DBUS,
+                               "NameOwnerChanged") ||
+      !dbus_message_has_sender (message, DBUS_SERVICE_DBUS) ||
+      !dbus_message_get_args (message, NULL,
+                              DBUS_TYPE_STRING, &name,
+                              DBUS_TYPE_STRING, &old_owner,
+                              DBUS_TYPE_STRING, &new_owner,
+                              DBUS_TYPE_INVALID))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  _DBUS_LOCK (bus_datas);
+
+  bd = dbus_connection_get_data (connection, bus_data_slot);
+  if (bd != NULL && bd->name_owners != NULL &&
+      _dbus_hash_iter_lookup (bd->name_owners, (char *) name, FALSE, &iter))
+    _dbus_hash_iter_set_value (&iter,
+                               _DBUS_INT_TO_POINTER (*new_owner != '\0' ?
+                                                     NAME_OWNER_PRESENT :
+                                                     NAME_OWNER_NONE));
+
+  _DBUS_UNLOCK (bus_datas);
+
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
 /**
  * Asks the bus whether a certain name has an owner.
  *
@@ -1261,6 +1777,10 @@ dbus_bus_release_name (DBusConnection *connection,
  * if you want to avoid replacing a current owner,
  * don't specify #DBUS_NAME_FLAG_REPLACE_EXISTING and
  * you will get an error if there's already an owner.
+ *
+ * If the name owner cache is on, see
+ * dbus_bus_set_name_owner_cache(), names seen before are answered
+ * without blocking.
  * 
  * @param connection the connection
  * @param name the name
@@ -1274,11 +1794,23 @@ dbus_bus_name_has_owner (DBusConnection *connection,
 {
   DBusMessage *message, *reply;
   dbus_bool_t exists;
+  dbus_bool_t watch;
+  int state;
 
   _dbus_return_val_if_fail (connection != NULL, FALSE);
   _dbus_return_val_if_fail (name != NULL, FALSE);
   _dbus_return_val_if_fail (_dbus_check_is_valid_bus_name (name), FALSE);
   _dbus_return_val_if_error_is_set (error, FALSE);
+
+  state = name_owner_cache_begin (connection, name, &watch);
+  if (state == NAME_OWNER_PRESENT || state == NAME_OWNER_NONE)
+    return state == NAME_OWNER_PRESENT;
+
+  if (watch && !watch_name_owner (connection, name))
+    {
+      name_owner_cache_forget (connection, name);
+      watch = FALSE;
+    }
   
   message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
                                           DBUS_PATH_DBUS,
@@ -1287,7 +1819,7 @@ dbus_bus_name_has_owner (DBusConnection *connection,
   if (message == NULL)
     {
       _DBUS_SET_OOM (error);
-      return FALSE;
+      goto failed;
     }
   
   if (!dbus_message_append_args (message,
@@ -1296,7 +1828,7 @@ dbus_bus_name_has_owner (DBusConnection *connection,
     {
       dbus_message_unref (message);
       _DBUS_SET_OOM (error);
-      return FALSE;
+      goto failed;
     }
   
   reply = dbus_connection_send_with_reply_and_block (connection, message, -1, error);
@@ -1305,7 +1837,7 @@ dbus_bus_name_has_owner (DBusConnection *connection,
   if (reply == NULL)
     {
       _DBUS_ASSERT_ERROR_IS_SET (error);
-      return FALSE;
+      goto failed;
     }
 
   if (!dbus_message_get_args (reply, error,
@@ -1314,11 +1846,107 @@ dbus_bus_name_has_owner (DBusConnection *connection,
     {
       _DBUS_ASSERT_ERROR_IS_SET (error);
       dbus_message_unref (reply);
-      return FALSE;
+      goto failed;
     }
   
   dbus_message_unref (reply);
+
+  if (watch)
+    name_owner_cache_finish (connection, name,
+                             exists ? NAME_OWNER_PRESENT : NAME_OWNER_NONE);
+
   return exists;
+
+ failed:
+  if (watch)
+    {
+      name_owner_cache_forget (connection, name);
+      unwatch_name_owner (connection, name);
+    }
+  return FALSE;
+}
+
+/**
+ * Turns the name owner cache of a bus connection on or off. It is
+ * off by default.
+ *
+ * While it is on, the first dbus_bus_name_has_owner() call for a
+ * name also adds an arg0 match on that name's NameOwnerChanged
+ * signal, and later calls for the same name are answered from the
+ * cache, which a filter on the connection keeps current. The cache
+ * is only as fresh as the incoming messages the connection has
+ * dispatched, so use it only if the connection is dispatched
+ * regularly. At most 64 names are cached per connection; further
+ * names are still asked of the bus each time. Once the connection is
+ * disconnected, nothing is answered from the cache any more.
+ *
+ * Turning the cache off drops it and removes its matches.
+ *
+ * @param connection the connection to the message bus
+ * @param enabled #TRUE to cache name owners
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+dbus_bus_set_name_owner_cache (DBusConnection *connection,
+                               dbus_bool_t     enabled)
+{
+  BusData *bd;
+  DBusHashTable *dropped;
+  DBusHashIter iter;
+  dbus_bool_t success;
+
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+
+  dropped = NULL;
+  success = TRUE;
+
+  _DBUS_LOCK (bus_datas);
+
+  bd = ensure_bus_data (connection);
+  if (bd == NULL)
+    {
+      _DBUS_UNLOCK (bus_datas);
+      return FALSE;
+    }
+
+  if (enabled && bd->name_owners == NULL)
+    {
+      bd->name_owners = _dbus_hash_table_new (DBUS_HASH_STRING,
+                                              dbus_free, NULL);
+      if (bd->name_owners != NULL &&
+          !dbus_connection_add_filter (connection, name_owner_cache_filter,
+                                       NULL, NULL))
+        {
+          _dbus_hash_table_unref (bd->name_owners);
+          bd->name_owners = NULL;
+        }
+      success = bd->name_owners != NULL;
+    }
+  else if (!enabled && bd->name_owners != NULL)
+    {
+      dropped = bd->name_owners;
+      bd->name_owners = NULL;
+      dbus_connection_remove_filter (connection, name_owner_cache_filter,
+                                     NULL);
+    }
+
+  _DBUS_UNLOCK (bus_datas);
+
+  if (dropped != NULL)
+    {
+      /* Pending names are unwatched by their own query when it ends */
+      _dbus_hash_iter_init (dropped, &iter);
+      while (_dbus_hash_iter_next (&iter))
+        {
+          if (_DBUS_POINTER_TO_INT (_dbus_hash_iter_get_value (&iter)) != NAME_OWNER_PENDING)
+            unwatch_name_owner (connection,
+                                _dbus_hash_iter_get_string_key (&iter));
+        }
+
+      _dbus_hash_table_unref (dropped);
+    }
+
+  return success;
 }
 
 /**
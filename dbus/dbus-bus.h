@@ -42,11 +42,17 @@ DBusConnection *dbus_bus_get              (DBusBusType     type,
 DBUS_EXPORT
 DBusConnection *dbus_bus_get_private      (DBusBusType     type,
 					   DBusError      *error);
+DBUS_EXPORT
+DBusConnection *dbus_bus_get_async        (DBusBusType     type,
+					   DBusError      *error);
 
 DBUS_EXPORT
 dbus_bool_t     dbus_bus_register         (DBusConnection *connection,
 					   DBusError      *error);
 DBUS_EXPORT
+dbus_bool_t     dbus_bus_register_async   (DBusConnection *connection,
+					   DBusError      *error);
+DBUS_EXPORT
 dbus_bool_t     dbus_bus_set_unique_name  (DBusConnection *connection,
 					   const char     *unique_name);
 DBUS_EXPORT
@@ -72,6 +78,10 @@ dbus_bool_t     dbus_bus_name_has_owner   (DBusConnection *connection,
 					   const char     *name,
 					   DBusError      *error);
 
+DBUS_EXPORT
+dbus_bool_t     dbus_bus_set_name_owner_cache (DBusConnection *connection,
+                                               dbus_bool_t     enabled);
+
 DBUS_EXPORT
 dbus_bool_t     dbus_bus_start_service_by_name (DBusConnection *connection,
                                                 const char     *name,
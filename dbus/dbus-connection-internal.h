@@ -54,8 +54,12 @@ void              _dbus_connection_queue_received_message_link (DBusConnection
                                                                 DBusList           *link);
 dbus_bool_t       _dbus_connection_has_messages_to_send_unlocked (DBusConnection     *connection);
 DBusMessage*      _dbus_connection_get_message_to_send         (DBusConnection     *connection);
+int               _dbus_connection_get_messages_to_send        (DBusConnection     *connection,
+                                                                DBusMessage       **messages,
+                                                                int                 max_messages);
 void              _dbus_connection_message_sent                (DBusConnection     *connection,
                                                                 DBusMessage        *message);
+void              _dbus_connection_drop_expired_outgoing       (DBusConnection     *connection);
 dbus_bool_t       _dbus_connection_add_watch_unlocked          (DBusConnection     *connection,
                                                                 DBusWatch          *watch);
 void              _dbus_connection_remove_watch_unlocked       (DBusConnection     *connection,
@@ -79,7 +83,56 @@ void              _dbus_connection_do_iteration_unlocked       (DBusConnection
                                                                 unsigned int        flags,
                                                                 int                 timeout_milliseconds);
 void              _dbus_connection_close_possibly_shared       (DBusConnection     *connection);
+void              _dbus_connection_set_trust_message_bodies    (DBusConnection     *connection,
+                                                                dbus_bool_t         trust);
+void              _dbus_connection_set_outgoing_lanes          (DBusConnection     *connection,
+                                                                dbus_bool_t         enabled);
+void              _dbus_connection_set_keep_byte_order         (DBusConnection     *connection,
+                                                                dbus_bool_t         keep);
+
+/** Called once a connection's outgoing queue drops below the size
+ * given to _dbus_connection_set_outgoing_drained_function() */
+typedef void (* DBusOutgoingDrainedFunction) (DBusConnection *connection,
+                                              void           *data);
+
+void              _dbus_connection_set_outgoing_drained_function (DBusConnection     *connection,
+                                                                  long                size,
+                                                                  DBusOutgoingDrainedFunction function,
+                                                                  void               *data);
+void              _dbus_connection_set_reading_paused          (DBusConnection     *connection,
+                                                                dbus_bool_t         paused);
+dbus_bool_t       _dbus_connection_get_handoff_state           (DBusConnection     *connection,
+                                                                int                *fd_p,
+                                                                DBusString         *unread);
+DBusConnection*   _dbus_connection_new_for_handed_off_socket   (int                 fd,
+                                                                DBusCredentials    *identity,
+                                                                dbus_bool_t         unix_fd_negotiated,
+                                                                const DBusString   *unread);
+void              _dbus_connection_set_dispatch_weight         (DBusConnection     *connection,
+                                                                int                 weight);
+int               _dbus_connection_get_dispatch_weight         (DBusConnection     *connection);
+void              _dbus_connection_set_priority                (DBusConnection     *connection,
+                                                                dbus_bool_t         priority);
+dbus_bool_t       _dbus_connection_get_priority                (DBusConnection     *connection);
+void              _dbus_connection_set_max_priority_outgoing_size (DBusConnection  *connection,
+                                                                   long             size);
+void              _dbus_connection_set_iteration_bounds        (DBusConnection     *connection,
+                                                                int                 min_bytes,
+                                                                int                 max_bytes);
+void              _dbus_connection_get_iteration_budgets       (DBusConnection     *connection,
+                                                                int                *read_budget,
+                                                                int                *write_budget);
+void              _dbus_connection_set_dispatch_backlogged     (DBusConnection     *connection,
+                                                                dbus_bool_t         backlogged);
+void              _dbus_connection_set_edge_triggered_writes   (DBusConnection     *connection,
+                                                                dbus_bool_t         edge_triggered);
 void              _dbus_connection_close_if_only_one_ref       (DBusConnection     *connection);
+void              _dbus_connection_compact                     (DBusConnection     *connection);
+dbus_bool_t       _dbus_connection_replace_outgoing            (DBusConnection     *connection,
+                                                                DBusMessage        *old_message,
+                                                                DBusMessage        *new_message);
+void*             _dbus_connection_get_data_unlocked           (DBusConnection     *connection,
+                                                                dbus_int32_t        slot);
 
 DBusPendingCall*  _dbus_pending_call_new                       (DBusConnection     *connection,
                                                                 int                 timeout_milliseconds,
@@ -27,6 +27,7 @@
 #include "dbus-list.h"
 #include "dbus-timeout.h"
 #include "dbus-transport.h"
+#include "dbus-transport-socket.h"
 #include "dbus-watch.h"
 #include "dbus-connection-internal.h"
 #include "dbus-pending-call-internal.h"
@@ -43,6 +44,11 @@
 #include "dbus-threads-internal.h"
 #include "dbus-bus.h"
 #include "dbus-marshal-basic.h"
+#include "dbus-marshal-validate.h"
+
+/* Allocations made here are profiled as connections */
+#undef DBUS_ALLOC_SUBSYSTEM
+#define DBUS_ALLOC_SUBSYSTEM DBUS_ALLOC_SUBSYSTEM_CONNECTION
 
 #ifdef DBUS_DISABLE_CHECKS
 #define TOOK_LOCK_CHECK(connection)
@@ -65,7 +71,7 @@
 
 #define CONNECTION_LOCK(connection)   do {                                      \
     if (TRACE_LOCKS) { _dbus_verbose ("LOCK\n"); }   \
-    _dbus_mutex_lock ((connection)->mutex);                                      \
+    _dbus_mutex_lock_in ((connection)->mutex, DBUS_LOCK_CLASS_CONNECTION);      \
     TOOK_LOCK_CHECK (connection);                                               \
   } while (0)
 
@@ -226,11 +232,48 @@ struct DBusMessageFilter
 /**
  * Internals of DBusPreallocatedSend
  */
+/**
+ * How many spare #DBusPreallocatedSend a connection keeps.  A bus
+ * preallocates a send for every recipient of a message it routes, so
+ * each connection only needs a few to cover a transaction.
+ */
+#define PREALLOCATED_CACHE_SIZE 8
+
 struct DBusPreallocatedSend
 {
   DBusConnection *connection; /**< Connection we'd send the message to */
   DBusList *queue_link;       /**< Preallocated link in the queue */
   DBusList *counter_link;     /**< Preallocated link in the resource counter */
+  DBusList *counter_queue_link; /**< Preallocated link in outgoing_counter_links */
+};
+
+/**
+ * Internals of DBusDeferredReply
+ */
+struct DBusDeferredReply
+{
+  DBusAtomic refcount;        /**< Reference count */
+  DBusAtomic completed;       /**< Nonzero once a thread has taken on sending the reply */
+  DBusConnection *connection; /**< Connection the call came in on */
+  DBusMessage *method_call;   /**< The call to reply to */
+};
+
+/**
+ * A thread in _dbus_connection_block_pending_call() that is waiting
+ * for the io path, registered so that whichever thread reads its reply
+ * can wake it directly instead of every waiter taking a turn.
+ */
+typedef struct ReplyWaiter ReplyWaiter;
+
+/**
+ * Internals of ReplyWaiter; lives on the waiting thread's stack.
+ */
+struct ReplyWaiter
+{
+  ReplyWaiter *next;         /**< Next waiter on the connection */
+  DBusPendingCall *pending;  /**< Call whose reply this thread wants */
+  DBusCondVar *cond;         /**< Signalled when the reply is queued or the io path may be free */
+  dbus_bool_t reply_queued;  /**< The reply is in the incoming queue */
 };
 
 #ifdef HAVE_DECL_MSG_NOSIGNAL
@@ -253,7 +296,8 @@ struct DBusConnection
   DBusMutex *io_path_mutex;      /**< Protects io_path_acquired */
   DBusCondVar *io_path_cond;     /**< Notify when io_path_acquired is available */
   
-  DBusList *outgoing_messages; /**< Queue of messages we need to send, send the end of the list first. */
+  DBusList *outgoing_messages; /**< Queue of messages we need to send, send the end of the list first; with lanes, bulk messages are kept nearest the front and priority ones nearest the end. */
+  DBusList *outgoing_counter_links; /**< For each message in outgoing_messages, in the same order, its link in the message's counters list */
   DBusList *incoming_messages; /**< Queue of messages we have received, end of the list received most recently. */
 
   DBusMessage *message_borrowed; /**< Filled in if the first incoming message has been borrowed;
@@ -264,17 +308,33 @@ struct DBusConnection
   int n_incoming;              /**< Length of incoming queue. */
 
   DBusCounter *outgoing_counter; /**< Counts size of outgoing messages. */
+  DBusOutgoingDrainedFunction outgoing_drained_function; /**< Called once outgoing_counter drops below its guard */
+  void *outgoing_drained_data;   /**< Data for outgoing_drained_function */
+  long outgoing_drained_size;    /**< Size outgoing_drained_function waits for the queue to drop below */
+
+  int dispatch_weight;           /**< Share of a #DBusLoop's dispatching relative to other connections */
+  long max_priority_outgoing_size; /**< Bytes of priority messages that may be queued ahead of others */
+
+  unsigned long n_messages_sent;     /**< Messages written out in full */
+  unsigned long n_bytes_sent;        /**< Size of those messages */
+  unsigned long n_messages_received; /**< Messages read in */
+  unsigned long n_bytes_received;    /**< Size of those messages */
+  unsigned long n_dispatched;        /**< Messages dispatched */
+  unsigned long n_messages_expired;  /**< Messages dropped from either queue as expired */
   
   DBusTransport *transport;    /**< Object that sends/receives messages over network. */
   DBusWatchList *watches;      /**< Stores active watches. */
   DBusTimeoutList *timeouts;   /**< Stores active timeouts. */
   
   DBusList *filter_list;        /**< List of filters. */
+  int filter_list_serial;       /**< Changes whenever a filter is added or removed */
 
   DBusMutex *slot_mutex;        /**< Lock on slot_list so overall connection lock need not be taken */
   DBusDataSlotList slot_list;   /**< Data stored by allocated integer ID */
 
   DBusHashTable *pending_replies;  /**< Hash of message serials to #DBusPendingCall. */  
+  DBusList *pending_deadlines;     /**< #DBusPendingCall with a timeout added, earliest deadline first */
+  DBusTimeout *pending_timeout;    /**< The one timeout the application sees for all of pending_deadlines */
   
   dbus_uint32_t client_serial;       /**< Client serial. Increments each time a message is sent  */
   DBusList *disconnect_message_link; /**< Preallocated list node for queueing the disconnection message */
@@ -287,11 +347,17 @@ struct DBusConnection
   void *dispatch_status_data; /**< Application data for dispatch_status_function */
   DBusFreeFunction free_dispatch_status_data; /**< free dispatch_status_data */
 
+  DBusDispatchExecutorFunction dispatch_executor_function; /**< Hands messages to a worker pool, or #NULL to handle them in dispatch */
+  void *dispatch_executor_data; /**< Application data for dispatch_executor_function */
+  DBusFreeFunction free_dispatch_executor_data; /**< free dispatch_executor_data */
+
   DBusDispatchStatus last_dispatch_status; /**< The last dispatch status we reported to the application. */
 
   DBusList *link_cache; /**< A cache of linked list links to prevent contention
                          *   for the global linked list mempool lock
                          */
+  DBusPreallocatedSend *preallocated_cache[PREALLOCATED_CACHE_SIZE]; /**< Spare preallocated sends, some still holding their links */
+  int n_preallocated_cached; /**< Number of entries in preallocated_cache */
   DBusObjectTree *objects; /**< Object path handlers registered with this connection */
 
   char *server_guid; /**< GUID of server if we are in shared_connections, #NULL if server GUID is unknown or connection is private */
@@ -302,6 +368,8 @@ struct DBusConnection
    */
   dbus_bool_t dispatch_acquired; /**< Someone has dispatch path (can drain incoming queue) */
   dbus_bool_t io_path_acquired;  /**< Someone has transport io path (can use the transport to read/write messages) */
+  int io_path_spin;              /**< How long to spin for the io path before sleeping, adapted to recent waits; protected by io_path_mutex */
+  ReplyWaiter *reply_waiters;    /**< Threads blocked for a reply while waiting for the io path; protected by io_path_mutex */
   
   unsigned int shareable : 1; /**< #TRUE if libdbus owns a reference to the connection and can return it from dbus_connection_open() more than once */
   
@@ -316,6 +384,14 @@ struct DBusConnection
   unsigned int disconnected_message_processed : 1; /**< We did our default handling of the disconnected message,
                                                     * such as closing the connection.
                                                     */
+
+  unsigned int pending_timeout_added : 1; /**< pending_timeout has been added to the timeout list */
+
+  unsigned int corked : 1; /**< If #TRUE, sending only queues messages until uncorked or flushed */
+
+  unsigned int outgoing_lanes : 1; /**< If #TRUE, other senders' messages may overtake queued bulk messages */
+
+  unsigned int priority : 1; /**< If #TRUE, a #DBusLoop handles this connection before others */
   
 #ifndef DBUS_DISABLE_CHECKS
   unsigned int have_connection_lock : 1; /**< Used to check locking */
@@ -336,7 +412,9 @@ static DBusDispatchStatus _dbus_connection_flush_unlocked                    (DB
 static void               _dbus_connection_close_possibly_shared_and_unlock  (DBusConnection     *connection);
 static dbus_bool_t        _dbus_connection_get_is_connected_unlocked         (DBusConnection     *connection);
 static dbus_bool_t        _dbus_connection_peek_for_reply_unlocked           (DBusConnection     *connection,
-                                                                              dbus_uint32_t       client_serial);
+                                                                              DBusPendingCall    *pending);
+static void               _dbus_connection_unschedule_pending_call_unlocked  (DBusConnection     *connection,
+                                                                              DBusPendingCall    *pending);
 
 static DBusMessageFilter *
 _dbus_message_filter_ref (DBusMessageFilter *filter)
@@ -452,6 +530,77 @@ _dbus_connection_test_get_locks (DBusConnection *connection,
 }
 #endif
 
+/*
+ * Records a newly queued link on the pending call waiting for it, so
+ * that a blocked caller finds its reply without walking the incoming
+ * queue. Only the first queued reply for a serial is indexed.
+ */
+static void
+connection_index_queued_reply_unlocked (DBusConnection *connection,
+                                        DBusList       *link)
+{
+  DBusPendingCall *pending;
+  dbus_uint32_t reply_serial;
+
+  reply_serial = dbus_message_get_reply_serial (link->data);
+  if (reply_serial == 0)
+    return;
+
+  pending = _dbus_hash_table_lookup_int (connection->pending_replies,
+                                         reply_serial);
+  if (pending != NULL &&
+      _dbus_pending_call_get_reply_link_unlocked (pending) == NULL)
+    _dbus_pending_call_set_reply_link_unlocked (pending, link);
+}
+
+/*
+ * Called with the connection lock held when the reply to pending has
+ * just been queued; if a thread is waiting for the io path to read
+ * that reply, wake it to take the reply instead.
+ */
+static void
+_dbus_connection_hand_off_reply (DBusConnection  *connection,
+                                 DBusPendingCall *pending)
+{
+  ReplyWaiter *waiter;
+
+  _dbus_mutex_lock_in (connection->io_path_mutex,
+                       DBUS_LOCK_CLASS_CONNECTION_IO_PATH);
+
+  for (waiter = connection->reply_waiters; waiter != NULL; waiter = waiter->next)
+    {
+      if (waiter->pending == pending)
+        {
+          waiter->reply_queued = TRUE;
+          _dbus_condvar_wake_one (waiter->cond);
+          break;
+        }
+    }
+
+  _dbus_mutex_unlock (connection->io_path_mutex);
+}
+
+/*
+ * Forgets a link that is leaving the incoming queue.
+ */
+static void
+connection_unindex_queued_reply_unlocked (DBusConnection *connection,
+                                          DBusList       *link)
+{
+  DBusPendingCall *pending;
+  dbus_uint32_t reply_serial;
+
+  reply_serial = dbus_message_get_reply_serial (link->data);
+  if (reply_serial == 0)
+    return;
+
+  pending = _dbus_hash_table_lookup_int (connection->pending_replies,
+                                         reply_serial);
+  if (pending != NULL &&
+      _dbus_pending_call_get_reply_link_unlocked (pending) == link)
+    _dbus_pending_call_set_reply_link_unlocked (pending, NULL);
+}
+
 /**
  * Adds a message-containing list link to the incoming message queue,
  * taking ownership of the link and the message's current refcount.
@@ -474,6 +623,11 @@ _dbus_connection_queue_received_message_link (DBusConnection  *connection,
                           link);
   message = link->data;
 
+  _dbus_message_start_expiry (message);
+
+  connection->n_messages_received += 1;
+  connection->n_bytes_received += _dbus_message_get_network_size (message);
+
   /* If this is a reply we're waiting on, remove timeout for it */
   reply_serial = dbus_message_get_reply_serial (message);
   if (reply_serial != 0)
@@ -482,11 +636,12 @@ _dbus_connection_queue_received_message_link (DBusConnection  *connection,
                                              reply_serial);
       if (pending != NULL)
 	{
-	  if (_dbus_pending_call_is_timeout_added_unlocked (pending))
-            _dbus_connection_remove_timeout_unlocked (connection,
-                                                      _dbus_pending_call_get_timeout_unlocked (pending));
+          _dbus_connection_unschedule_pending_call_unlocked (connection, pending);
+
+          if (_dbus_pending_call_get_reply_link_unlocked (pending) == NULL)
+            _dbus_pending_call_set_reply_link_unlocked (pending, link);
 
-	  _dbus_pending_call_set_timeout_added_unlocked (pending, FALSE);
+          _dbus_connection_hand_off_reply (connection, pending);
 	}
     }
   
@@ -511,7 +666,11 @@ _dbus_connection_queue_received_message_link (DBusConnection  *connection,
                  dbus_message_get_signature (message),
                  dbus_message_get_reply_serial (message),
                  connection,
-                 connection->n_incoming);}
+                 connection->n_incoming);
+
+  _dbus_trace3 (message__receive, connection, message,
+                dbus_message_get_type (message));
+}
 
 /**
  * Adds a link + message to the incoming message queue.
@@ -528,6 +687,7 @@ _dbus_connection_queue_synthesized_message_link (DBusConnection *connection,
   HAVE_LOCK_CHECK (connection);
   
   _dbus_list_append_link (&connection->incoming_messages, link);
+  connection_index_queued_reply_unlocked (connection, link);
 
   connection->n_incoming += 1;
 
@@ -591,26 +751,48 @@ _dbus_connection_get_message_to_send (DBusConnection *connection)
 }
 
 /**
- * Notifies the connection that a message has been sent, so the
- * message can be removed from the outgoing queue.
- * Called with the connection lock held.
+ * Gets up to max_messages outgoing messages, in the order they will
+ * be sent, starting with the one _dbus_connection_get_message_to_send()
+ * returns. This lets the transport hand several of them to the kernel
+ * at once. The messages remain in the queue, and the caller does not
+ * own references to them.
  *
  * @param connection the connection.
- * @param message the message that was sent.
+ * @param messages array to fill in
+ * @param max_messages size of the array
+ * @returns number of messages stored in the array
  */
-void
-_dbus_connection_message_sent (DBusConnection *connection,
-                               DBusMessage    *message)
+int
+_dbus_connection_get_messages_to_send (DBusConnection *connection,
+                                       DBusMessage   **messages,
+                                       int             max_messages)
 {
   DBusList *link;
+  int n_messages;
 
   HAVE_LOCK_CHECK (connection);
-  
-  /* This can be called before we even complete authentication, since
-   * it's called on disconnect to clean up the outgoing queue.
-   * It's also called as we successfully send each message.
-   */
-  
+
+  n_messages = 0;
+  link = _dbus_list_get_last_link (&connection->outgoing_messages);
+  while (link != NULL && n_messages < max_messages)
+    {
+      messages[n_messages] = link->data;
+      n_messages += 1;
+      link = _dbus_list_get_prev_link (&connection->outgoing_messages, link);
+    }
+
+  return n_messages;
+}
+
+/* Takes the message at the head of the outgoing queue off it, whether
+ * it was sent or not, and drops the queue's reference to it.
+ */
+static void
+remove_message_to_send (DBusConnection *connection,
+                        DBusMessage    *message)
+{
+  DBusList *link;
+
   link = _dbus_list_get_last_link (&connection->outgoing_messages);
   _dbus_assert (link != NULL);
   _dbus_assert (link->data == message);
@@ -637,14 +819,83 @@ _dbus_connection_message_sent (DBusConnection *connection,
                  dbus_message_get_signature (message),
                  connection, connection->n_outgoing);
 
-  /* Save this link in the link cache also */
-  _dbus_message_remove_counter (message, connection->outgoing_counter,
-                                &link);
+  /* Save this link in the link cache also, along with the counter
+   * link it pointed to; the latter is ours too, we passed it to
+   * _dbus_message_add_counter_link() when queueing the message.
+   */
+  link = _dbus_list_get_last_link (&connection->outgoing_counter_links);
+  _dbus_assert (link != NULL);
+  _dbus_list_unlink (&connection->outgoing_counter_links,
+                     link);
+  _dbus_list_prepend_link (&connection->link_cache, link);
+
+  link = link->data;
+  _dbus_assert (link->data == connection->outgoing_counter);
+  _dbus_message_remove_counter_link (message, link);
   _dbus_list_prepend_link (&connection->link_cache, link);
   
   dbus_message_unref (message);
 }
 
+/**
+ * Notifies the connection that a message has been sent, so the
+ * message can be removed from the outgoing queue.
+ * Called with the connection lock held.
+ *
+ * @param connection the connection.
+ * @param message the message that was sent.
+ */
+void
+_dbus_connection_message_sent (DBusConnection *connection,
+                               DBusMessage    *message)
+{
+  HAVE_LOCK_CHECK (connection);
+  
+  /* This can be called before we even complete authentication, since
+   * it's called on disconnect to clean up the outgoing queue.
+   * It's also called as we successfully send each message.
+   */
+
+  /* The queue is also emptied this way on disconnection, when nothing
+   * more goes out
+   */
+  if (_dbus_transport_get_is_connected (connection->transport))
+    {
+      connection->n_messages_sent += 1;
+      connection->n_bytes_sent += _dbus_message_get_network_size (message);
+    }
+
+  _dbus_trace3 (message__sent, connection, message,
+                dbus_message_get_serial (message));
+
+  remove_message_to_send (connection, message);
+}
+
+/**
+ * Drops messages from the head of the outgoing queue, without
+ * sending them, for as long as the head is a message whose expiry
+ * has passed (see dbus_message_set_expiry()). The transport calls
+ * this before starting on the head, never while part of it has been
+ * written. Called with the connection lock held.
+ *
+ * @param connection the connection.
+ */
+void
+_dbus_connection_drop_expired_outgoing (DBusConnection *connection)
+{
+  DBusMessage *message;
+
+  HAVE_LOCK_CHECK (connection);
+
+  while ((message = _dbus_list_get_last (&connection->outgoing_messages)) != NULL &&
+         _dbus_message_has_expired (message))
+    {
+      _dbus_verbose ("Message %p expired before it was sent\n", message);
+      connection->n_messages_expired += 1;
+      remove_message_to_send (connection, message);
+    }
+}
+
 /** Function to be called in protected_change_watch() with refcount held */
 typedef dbus_bool_t (* DBusWatchAddFunction)     (DBusWatchList *list,
                                                   DBusWatch     *watch);
@@ -891,6 +1142,194 @@ _dbus_connection_toggle_timeout_unlocked (DBusConnection   *connection,
                             enabled);
 }
 
+/* Points pending_timeout at the earliest deadline, or disables it if
+ * no call has a timeout. Toggling the timeout off and on again is how
+ * a new interval reaches the application's main loop.
+ */
+static void
+_dbus_connection_reschedule_pending_timeout_unlocked (DBusConnection *connection)
+{
+  DBusList *link;
+  long tv_sec, tv_usec;
+  long deadline_sec, deadline_usec;
+  long interval;
+
+  HAVE_LOCK_CHECK (connection);
+
+  if (!connection->pending_timeout_added)
+    return;
+
+  _dbus_connection_toggle_timeout_unlocked (connection,
+                                            connection->pending_timeout,
+                                            FALSE);
+
+  link = _dbus_list_get_first_link (&connection->pending_deadlines);
+  if (link == NULL)
+    return;
+
+  _dbus_pending_call_get_deadline_unlocked (link->data,
+                                            &deadline_sec, &deadline_usec);
+  _dbus_get_current_time (&tv_sec, &tv_usec);
+
+  /* Round up, so we don't wake up just before the deadline */
+  interval = (deadline_sec - tv_sec) * 1000 +
+    (deadline_usec - tv_usec + 999) / 1000;
+  if (interval < 0)
+    interval = 0;
+
+  _dbus_timeout_set_interval (connection->pending_timeout, interval);
+  _dbus_connection_toggle_timeout_unlocked (connection,
+                                            connection->pending_timeout,
+                                            TRUE);
+}
+
+static dbus_bool_t
+pending_deadline_has_passed (DBusPendingCall *pending,
+                             long             tv_sec,
+                             long             tv_usec)
+{
+  long deadline_sec, deadline_usec;
+
+  _dbus_pending_call_get_deadline_unlocked (pending,
+                                            &deadline_sec, &deadline_usec);
+
+  return deadline_sec < tv_sec ||
+    (deadline_sec == tv_sec && deadline_usec <= tv_usec);
+}
+
+/* Handler of pending_timeout: times out every call whose deadline has
+ * passed, as reply_handler_timeout() does for one call, then waits for
+ * the next deadline.
+ */
+static dbus_bool_t
+pending_deadlines_timeout (void *data)
+{
+  DBusConnection *connection = data;
+  DBusDispatchStatus status;
+  DBusList *link;
+  long tv_sec, tv_usec;
+
+  CONNECTION_LOCK (connection);
+
+  _dbus_get_current_time (&tv_sec, &tv_usec);
+
+  while ((link = _dbus_list_get_first_link (&connection->pending_deadlines)) != NULL &&
+         pending_deadline_has_passed (link->data, tv_sec, tv_usec))
+    {
+      DBusPendingCall *pending = link->data;
+
+      _dbus_pending_call_queue_timeout_error_unlocked (pending, connection);
+      _dbus_connection_unschedule_pending_call_unlocked (connection, pending);
+    }
+
+  _dbus_connection_reschedule_pending_timeout_unlocked (connection);
+
+  status = _dbus_connection_get_dispatch_status_unlocked (connection);
+
+  /* Unlocks, and calls out to user code */
+  _dbus_connection_update_dispatch_status_and_unlock (connection, status);
+
+  return TRUE;
+}
+
+/* Adds the timeout of a pending call. Rather than giving each call's
+ * DBusTimeout to the application, the calls are kept in
+ * pending_deadlines and share pending_timeout, which only has to be
+ * moved when a call becomes the earliest deadline.
+ */
+static dbus_bool_t
+_dbus_connection_schedule_pending_call_unlocked (DBusConnection  *connection,
+                                                 DBusPendingCall *pending)
+{
+  DBusTimeout *timeout;
+  DBusList *link;
+  DBusList *before;
+  long tv_sec, tv_usec;
+  int interval;
+
+  HAVE_LOCK_CHECK (connection);
+
+  timeout = _dbus_pending_call_get_timeout_unlocked (pending);
+  _dbus_assert (timeout != NULL);
+  _dbus_assert (_dbus_pending_call_get_deadline_link_unlocked (pending) == NULL);
+
+  if (connection->pending_timeout == NULL)
+    {
+      connection->pending_timeout = _dbus_timeout_new (0,
+                                                       pending_deadlines_timeout,
+                                                       connection, NULL);
+      if (connection->pending_timeout == NULL)
+        return FALSE;
+
+      /* It's only enabled once it has a deadline to wait for */
+      _dbus_timeout_set_enabled (connection->pending_timeout, FALSE);
+    }
+
+  if (!connection->pending_timeout_added)
+    {
+      if (!_dbus_connection_add_timeout_unlocked (connection,
+                                                  connection->pending_timeout))
+        return FALSE;
+
+      connection->pending_timeout_added = TRUE;
+    }
+
+  link = _dbus_list_alloc_link (pending);
+  if (link == NULL)
+    return FALSE;
+
+  interval = dbus_timeout_get_interval (timeout);
+
+  _dbus_get_current_time (&tv_sec, &tv_usec);
+  tv_sec += interval / 1000;
+  tv_usec += (interval % 1000) * 1000;
+  if (tv_usec >= 1000000)
+    {
+      tv_usec -= 1000000;
+      tv_sec += 1;
+    }
+
+  _dbus_pending_call_set_deadline_unlocked (pending, link, tv_sec, tv_usec);
+  _dbus_pending_call_set_timeout_added_unlocked (pending, TRUE);
+
+  /* Most calls use the default timeout, so a new deadline is
+   * usually the latest one
+   */
+  before = _dbus_list_get_last_link (&connection->pending_deadlines);
+  while (before != NULL &&
+         !pending_deadline_has_passed (before->data, tv_sec, tv_usec))
+    before = _dbus_list_get_prev_link (&connection->pending_deadlines, before);
+
+  _dbus_list_insert_after_link (&connection->pending_deadlines, before, link);
+
+  if (before == NULL)
+    _dbus_connection_reschedule_pending_timeout_unlocked (connection);
+
+  return TRUE;
+}
+
+/* Removes the timeout of a pending call, if it was added. pending_timeout
+ * is left waiting for the old earliest deadline; if it fires early it
+ * just moves on, which costs the main loop less than moving it each
+ * time a reply arrives.
+ */
+static void
+_dbus_connection_unschedule_pending_call_unlocked (DBusConnection  *connection,
+                                                   DBusPendingCall *pending)
+{
+  DBusList *link;
+
+  HAVE_LOCK_CHECK (connection);
+
+  link = _dbus_pending_call_get_deadline_link_unlocked (pending);
+  if (link == NULL)
+    return;
+
+  _dbus_list_remove_link (&connection->pending_deadlines, link);
+  _dbus_pending_call_set_deadline_unlocked (pending, NULL, 0, 0);
+  _dbus_pending_call_set_timeout_added_unlocked (pending, FALSE);
+}
+
 static dbus_bool_t
 _dbus_connection_attach_pending_call_unlocked (DBusConnection  *connection,
                                                DBusPendingCall *pending)
@@ -908,21 +1347,17 @@ _dbus_connection_attach_pending_call_unlocked (DBusConnection  *connection,
 
   if (timeout)
     {
-      if (!_dbus_connection_add_timeout_unlocked (connection, timeout))
+      if (!_dbus_connection_schedule_pending_call_unlocked (connection, pending))
         return FALSE;
       
       if (!_dbus_hash_table_insert_int (connection->pending_replies,
                                         reply_serial,
                                         pending))
         {
-          _dbus_connection_remove_timeout_unlocked (connection, timeout);
-
-          _dbus_pending_call_set_timeout_added_unlocked (pending, FALSE);
+          _dbus_connection_unschedule_pending_call_unlocked (connection, pending);
           HAVE_LOCK_CHECK (connection);
           return FALSE;
         }
-      
-      _dbus_pending_call_set_timeout_added_unlocked (pending, TRUE);
     }
   else
     {
@@ -957,13 +1392,10 @@ free_pending_call_on_hash_removal (void *data)
 
   HAVE_LOCK_CHECK (connection);
   
-  if (_dbus_pending_call_is_timeout_added_unlocked (pending))
-    {
-      _dbus_connection_remove_timeout_unlocked (connection,
-                                                _dbus_pending_call_get_timeout_unlocked (pending));
-      
-      _dbus_pending_call_set_timeout_added_unlocked (pending, FALSE);
-    }
+  _dbus_connection_unschedule_pending_call_unlocked (connection, pending);
+
+  /* Once detached, nothing clears the link when it leaves the queue */
+  _dbus_pending_call_set_reply_link_unlocked (pending, NULL);
 
   /* FIXME 1.0? this is sort of dangerous and undesirable to drop the lock 
    * here, but the pending call finalizer could in principle call out to 
@@ -1002,11 +1434,7 @@ _dbus_connection_detach_pending_call_and_unlock (DBusConnection  *connection,
   _dbus_hash_table_remove_int (connection->pending_replies,
                                _dbus_pending_call_get_reply_serial_unlocked (pending));
 
-  if (_dbus_pending_call_is_timeout_added_unlocked (pending))
-      _dbus_connection_remove_timeout_unlocked (connection,
-              _dbus_pending_call_get_timeout_unlocked (pending));
-
-  _dbus_pending_call_set_timeout_added_unlocked (pending, FALSE);
+  _dbus_connection_unschedule_pending_call_unlocked (connection, pending);
 
   _dbus_pending_call_unref_and_unlock (pending);
 }
@@ -1028,46 +1456,195 @@ _dbus_connection_remove_pending_call (DBusConnection  *connection,
 }
 
 /**
- * Acquire the transporter I/O path. This must be done before
- * doing any I/O in the transporter. May sleep and drop the
- * IO path mutex while waiting for the I/O path.
- *
- * @param connection the connection.
- * @param timeout_milliseconds maximum blocking time, or -1 for no limit.
- * @returns TRUE if the I/O path was acquired.
+ * The most times a thread polls io_path_acquired before going to sleep
+ * on io_path_cond; handoffs between request/response threads are often
+ * shorter than the futex sleep and wakeup they'd otherwise cost.
+ */
+#define IO_PATH_SPIN_MAX 1000
+/** Spin count a new connection starts from */
+#define IO_PATH_SPIN_INITIAL 100
+
+/* Called with io_path_mutex held, and returns with it held. Waits a
+ * little while for the io path to be released without sleeping, and
+ * adapts how long it waits next time to how long this took. A spin
+ * count of 0 means never spin; the adjustments below don't leave it.
+ */
+static dbus_bool_t
+_dbus_connection_spin_for_io_path (DBusConnection *connection)
+{
+  int limit;
+  int n;
+
+  limit = MIN (connection->io_path_spin * 2, IO_PATH_SPIN_MAX);
+
+  _dbus_mutex_unlock (connection->io_path_mutex);
+
+  /* Only a hint; the flag is rechecked under the mutex below */
+  n = 0;
+  while (n < limit &&
+         *(volatile dbus_bool_t *) &connection->io_path_acquired)
+    ++n;
+
+  _dbus_mutex_lock_in (connection->io_path_mutex,
+                       DBUS_LOCK_CLASS_CONNECTION_IO_PATH);
+
+  if (!connection->io_path_acquired)
+    {
+      connection->io_path_spin += (n - connection->io_path_spin) / 8;
+      return TRUE;
+    }
+
+  /* The holder is probably blocked reading; spin less next time, but
+   * never so little that we stop noticing when handoffs get quick again.
+   */
+  connection->io_path_spin -= connection->io_path_spin / 8;
+  return FALSE;
+}
+
+/* Called with io_path_mutex held after the io path may have become
+ * free. Wakes one thread waiting on io_path_cond and the first thread
+ * waiting for a reply that hasn't arrived; whichever gets there first
+ * takes the io path and the other goes back to sleep.
+ */
+static void
+_dbus_connection_wake_io_path_waiters (DBusConnection *connection)
+{
+  ReplyWaiter *waiter;
+
+  _dbus_condvar_wake_one (connection->io_path_cond);
+
+  for (waiter = connection->reply_waiters; waiter != NULL; waiter = waiter->next)
+    {
+      if (!waiter->reply_queued)
+        {
+          _dbus_condvar_wake_one (waiter->cond);
+          break;
+        }
+    }
+}
+
+/* Called with io_path_mutex held */
+static void
+_dbus_connection_remove_reply_waiter (DBusConnection *connection,
+                                      ReplyWaiter    *waiter)
+{
+  ReplyWaiter **p;
+
+  for (p = &connection->reply_waiters; *p != NULL; p = &(*p)->next)
+    {
+      if (*p == waiter)
+        {
+          *p = waiter->next;
+          return;
+        }
+    }
+
+  _dbus_assert_not_reached ("reply waiter was not registered");
+}
+
+/**
+ * Acquire the transporter I/O path. This must be done before
+ * doing any I/O in the transporter. May sleep and drop the
+ * IO path mutex while waiting for the I/O path.
+ *
+ * If pending is given, the caller only wants the io path to read
+ * that call's reply, so this gives up waiting as soon as another
+ * thread queues the reply; the thread that reads it wakes this one
+ * directly.
+ *
+ * @param connection the connection.
+ * @param timeout_milliseconds maximum blocking time, or -1 for no limit.
+ * @param pending the pending call whose reply the caller blocks for, or #NULL
+ * @returns TRUE if the I/O path was acquired.
  */
 static dbus_bool_t
-_dbus_connection_acquire_io_path (DBusConnection *connection,
-				  int             timeout_milliseconds)
+_dbus_connection_acquire_io_path (DBusConnection  *connection,
+				  int              timeout_milliseconds,
+                                  DBusPendingCall *pending)
 {
   dbus_bool_t we_acquired;
+  ReplyWaiter waiter;
+  DBusCondVar *cond;
   
   HAVE_LOCK_CHECK (connection);
 
+  if (timeout_milliseconds == 0)
+    {
+      /* We won't wait, so there's no need to drop the connection lock
+       * and hand off through the condvar; this is the common case of
+       * dbus_connection_send() while another thread blocks reading.
+       * _dbus_connection_release_io_path() also takes io_path_mutex
+       * with the connection lock held, so the lock order is the same.
+       */
+      _dbus_mutex_lock_in (connection->io_path_mutex,
+                           DBUS_LOCK_CLASS_CONNECTION_IO_PATH);
+
+      we_acquired = !connection->io_path_acquired;
+      if (we_acquired)
+        connection->io_path_acquired = TRUE;
+
+      _dbus_verbose ("try connection->io_path_acquired = %d we_acquired = %d\n",
+                     connection->io_path_acquired, we_acquired);
+
+      _dbus_mutex_unlock (connection->io_path_mutex);
+
+      return we_acquired;
+    }
+
   /* We don't want the connection to vanish */
   _dbus_connection_ref_unlocked (connection);
 
+  waiter.next = NULL;
+  waiter.pending = pending;
+  waiter.cond = NULL;
+  waiter.reply_queued = FALSE;
+
+  /* If we can't get a condvar of our own, just wait our turn for the
+   * io path like everyone else.
+   */
+  if (pending != NULL)
+    waiter.cond = _dbus_condvar_new ();
+
+  /* Take io_path_mutex before dropping the connection lock, so the
+   * reply can't be queued between our caller's last look for it and
+   * our registering to be told about it. This is the same lock order
+   * as _dbus_connection_release_io_path().
+   */
+  _dbus_verbose ("locking io_path_mutex\n");
+  _dbus_mutex_lock_in (connection->io_path_mutex,
+                       DBUS_LOCK_CLASS_CONNECTION_IO_PATH);
+
+  if (waiter.cond != NULL)
+    {
+      waiter.next = connection->reply_waiters;
+      connection->reply_waiters = &waiter;
+      cond = waiter.cond;
+    }
+  else
+    cond = connection->io_path_cond;
+
   /* We will only touch io_path_acquired which is protected by our mutex */
   CONNECTION_UNLOCK (connection);
-  
-  _dbus_verbose ("locking io_path_mutex\n");
-  _dbus_mutex_lock (connection->io_path_mutex);
 
   _dbus_verbose ("start connection->io_path_acquired = %d timeout = %d\n",
                  connection->io_path_acquired, timeout_milliseconds);
 
   we_acquired = FALSE;
   
-  if (connection->io_path_acquired)
+  if (connection->io_path_acquired &&
+      (connection->io_path_spin == 0 ||
+       !_dbus_connection_spin_for_io_path (connection)) &&
+      !waiter.reply_queued)
     {
       if (timeout_milliseconds != -1)
         {
           _dbus_verbose ("waiting %d for IO path to be acquirable\n",
                          timeout_milliseconds);
 
-          if (!_dbus_condvar_wait_timeout (connection->io_path_cond,
-                                           connection->io_path_mutex,
-                                           timeout_milliseconds))
+          if (!_dbus_condvar_wait_timeout_in (cond,
+                                              connection->io_path_mutex,
+                                              timeout_milliseconds,
+                                              DBUS_LOCK_CLASS_CONNECTION_IO_PATH))
             {
               /* We timed out before anyone signaled. */
               /* (writing the loop to handle the !timedout case by
@@ -1081,19 +1658,32 @@ _dbus_connection_acquire_io_path (DBusConnection *connection,
         }
       else
         {
-          while (connection->io_path_acquired)
+          while (connection->io_path_acquired && !waiter.reply_queued)
             {
               _dbus_verbose ("waiting for IO path to be acquirable\n");
-              _dbus_condvar_wait (connection->io_path_cond, 
-                                  connection->io_path_mutex);
+              _dbus_condvar_wait_in (cond, connection->io_path_mutex,
+                                     DBUS_LOCK_CLASS_CONNECTION_IO_PATH);
             }
         }
     }
+
+  if (waiter.cond != NULL)
+    _dbus_connection_remove_reply_waiter (connection, &waiter);
   
   if (!connection->io_path_acquired)
     {
-      we_acquired = TRUE;
-      connection->io_path_acquired = TRUE;
+      if (waiter.reply_queued)
+        {
+          /* We may have been the one woken to take over the io path;
+           * pass that on, since we'd rather go and get our reply.
+           */
+          _dbus_connection_wake_io_path_waiters (connection);
+        }
+      else
+        {
+          we_acquired = TRUE;
+          connection->io_path_acquired = TRUE;
+        }
     }
   
   _dbus_verbose ("end connection->io_path_acquired = %d we_acquired = %d\n",
@@ -1102,6 +1692,9 @@ _dbus_connection_acquire_io_path (DBusConnection *connection,
   _dbus_verbose ("unlocking io_path_mutex\n");
   _dbus_mutex_unlock (connection->io_path_mutex);
 
+  if (waiter.cond != NULL)
+    _dbus_condvar_free (waiter.cond);
+
   CONNECTION_LOCK (connection);
   
   HAVE_LOCK_CHECK (connection);
@@ -1114,7 +1707,8 @@ _dbus_connection_acquire_io_path (DBusConnection *connection,
 /**
  * Release the I/O path when you're done with it. Only call
  * after you've acquired the I/O. Wakes up at most one thread
- * currently waiting to acquire the I/O path.
+ * currently waiting to acquire the I/O path, plus one waiting
+ * for a reply that is still to be read.
  *
  * @param connection the connection.
  */
@@ -1124,7 +1718,8 @@ _dbus_connection_release_io_path (DBusConnection *connection)
   HAVE_LOCK_CHECK (connection);
   
   _dbus_verbose ("locking io_path_mutex\n");
-  _dbus_mutex_lock (connection->io_path_mutex);
+  _dbus_mutex_lock_in (connection->io_path_mutex,
+                       DBUS_LOCK_CLASS_CONNECTION_IO_PATH);
   
   _dbus_assert (connection->io_path_acquired);
 
@@ -1132,7 +1727,7 @@ _dbus_connection_release_io_path (DBusConnection *connection)
                  connection->io_path_acquired);
   
   connection->io_path_acquired = FALSE;
-  _dbus_condvar_wake_one (connection->io_path_cond);
+  _dbus_connection_wake_io_path_waiters (connection);
 
   _dbus_verbose ("unlocking io_path_mutex\n");
   _dbus_mutex_unlock (connection->io_path_mutex);
@@ -1187,7 +1782,8 @@ _dbus_connection_do_iteration_unlocked (DBusConnection *connection,
     flags &= ~DBUS_ITERATION_DO_WRITING;
 
   if (_dbus_connection_acquire_io_path (connection,
-					(flags & DBUS_ITERATION_BLOCK) ? timeout_milliseconds : 0))
+					(flags & DBUS_ITERATION_BLOCK) ? timeout_milliseconds : 0,
+                                        pending))
     {
       HAVE_LOCK_CHECK (connection);
       
@@ -1196,8 +1792,7 @@ _dbus_connection_do_iteration_unlocked (DBusConnection *connection,
           _dbus_verbose ("pending call completed while acquiring I/O path");
         }
       else if ( (pending != NULL) &&
-                _dbus_connection_peek_for_reply_unlocked (connection,
-                                                          _dbus_pending_call_get_reply_serial_unlocked (pending)))
+                _dbus_connection_peek_for_reply_unlocked (connection, pending))
         {
           _dbus_verbose ("pending call completed while acquiring I/O path (reply found in queue)");
         }
@@ -1215,6 +1810,129 @@ _dbus_connection_do_iteration_unlocked (DBusConnection *connection,
   _dbus_verbose ("end\n");
 }
 
+/**
+ * How many finalized connections to keep, with their mutexes and
+ * condition variables, for the next new connection to reuse. A bus
+ * daemon serving many short-lived clients would otherwise allocate
+ * and free all of these for every one of them.
+ */
+#define MAX_CONNECTION_POOL_SIZE 16
+
+_DBUS_DEFINE_GLOBAL_LOCK (connection_pool);
+static DBusConnection *connection_pool[MAX_CONNECTION_POOL_SIZE];
+static int connection_pool_count = 0;
+static dbus_bool_t connection_pool_shutdown_registered = FALSE;
+
+static void
+connection_shell_free (DBusConnection *connection)
+{
+  _dbus_condvar_free_at_location (&connection->dispatch_cond);
+  _dbus_condvar_free_at_location (&connection->io_path_cond);
+
+  _dbus_mutex_free_at_location (&connection->io_path_mutex);
+  _dbus_mutex_free_at_location (&connection->dispatch_mutex);
+
+  _dbus_mutex_free_at_location (&connection->slot_mutex);
+
+  _dbus_mutex_free_at_location (&connection->mutex);
+
+  dbus_free (connection);
+}
+
+static void
+connection_pool_shutdown (void *data)
+{
+  _DBUS_LOCK (connection_pool);
+
+  while (connection_pool_count > 0)
+    {
+      connection_pool_count -= 1;
+      connection_shell_free (connection_pool[connection_pool_count]);
+      connection_pool[connection_pool_count] = NULL;
+    }
+
+  connection_pool_shutdown_registered = FALSE;
+
+  _DBUS_UNLOCK (connection_pool);
+}
+
+/* Returns a zeroed connection, except that its mutexes and condition
+ * variables are kept if it was recycled from the pool.
+ */
+static DBusConnection*
+connection_shell_get (void)
+{
+  DBusConnection *connection;
+  DBusMutex *mutex;
+  DBusMutex *io_path_mutex;
+  DBusMutex *dispatch_mutex;
+  DBusMutex *slot_mutex;
+  DBusCondVar *dispatch_cond;
+  DBusCondVar *io_path_cond;
+
+  connection = NULL;
+
+  _DBUS_LOCK (connection_pool);
+  if (connection_pool_count > 0)
+    {
+      connection_pool_count -= 1;
+      connection = connection_pool[connection_pool_count];
+      connection_pool[connection_pool_count] = NULL;
+    }
+  _DBUS_UNLOCK (connection_pool);
+
+  if (connection == NULL)
+    return dbus_new0 (DBusConnection, 1);
+
+  /* The mutex locations stay registered with the threads code, so
+   * they are upgraded like any other if threads are initialized later.
+   */
+  mutex = connection->mutex;
+  io_path_mutex = connection->io_path_mutex;
+  dispatch_mutex = connection->dispatch_mutex;
+  slot_mutex = connection->slot_mutex;
+  dispatch_cond = connection->dispatch_cond;
+  io_path_cond = connection->io_path_cond;
+
+  memset (connection, '\0', sizeof (DBusConnection));
+
+  connection->mutex = mutex;
+  connection->io_path_mutex = io_path_mutex;
+  connection->dispatch_mutex = dispatch_mutex;
+  connection->slot_mutex = slot_mutex;
+  connection->dispatch_cond = dispatch_cond;
+  connection->io_path_cond = io_path_cond;
+
+  return connection;
+}
+
+static void
+connection_shell_release (DBusConnection *connection)
+{
+  _DBUS_LOCK (connection_pool);
+
+  if (!connection_pool_shutdown_registered)
+    {
+      if (!_dbus_register_shutdown_func (connection_pool_shutdown, NULL))
+        goto out;
+
+      connection_pool_shutdown_registered = TRUE;
+    }
+
+  if (connection_pool_count < MAX_CONNECTION_POOL_SIZE)
+    {
+      connection_pool[connection_pool_count] = connection;
+      connection_pool_count += 1;
+      connection = NULL;
+    }
+
+ out:
+  _DBUS_UNLOCK (connection_pool);
+
+  if (connection != NULL)
+    connection_shell_free (connection);
+}
+
 /**
  * Creates a new connection for the given transport.  A transport
  * represents a message stream that uses some concrete mechanism, such
@@ -1260,31 +1978,37 @@ _dbus_connection_new_for_transport (DBusTransport *transport)
   if (pending_replies == NULL)
     goto error;
   
-  connection = dbus_new0 (DBusConnection, 1);
+  connection = connection_shell_get ();
   if (connection == NULL)
     goto error;
 
-  _dbus_mutex_new_at_location (&connection->mutex);
+  if (connection->mutex == NULL)
+    _dbus_mutex_new_at_location (&connection->mutex);
   if (connection->mutex == NULL)
     goto error;
 
-  _dbus_mutex_new_at_location (&connection->io_path_mutex);
+  if (connection->io_path_mutex == NULL)
+    _dbus_mutex_new_at_location (&connection->io_path_mutex);
   if (connection->io_path_mutex == NULL)
     goto error;
 
-  _dbus_mutex_new_at_location (&connection->dispatch_mutex);
+  if (connection->dispatch_mutex == NULL)
+    _dbus_mutex_new_at_location (&connection->dispatch_mutex);
   if (connection->dispatch_mutex == NULL)
     goto error;
   
-  _dbus_condvar_new_at_location (&connection->dispatch_cond);
+  if (connection->dispatch_cond == NULL)
+    _dbus_condvar_new_at_location (&connection->dispatch_cond);
   if (connection->dispatch_cond == NULL)
     goto error;
   
-  _dbus_condvar_new_at_location (&connection->io_path_cond);
+  if (connection->io_path_cond == NULL)
+    _dbus_condvar_new_at_location (&connection->io_path_cond);
   if (connection->io_path_cond == NULL)
     goto error;
 
-  _dbus_mutex_new_at_location (&connection->slot_mutex);
+  if (connection->slot_mutex == NULL)
+    _dbus_mutex_new_at_location (&connection->slot_mutex);
   if (connection->slot_mutex == NULL)
     goto error;
 
@@ -1322,8 +2046,15 @@ _dbus_connection_new_for_transport (DBusTransport *transport)
   connection->exit_on_disconnect = FALSE;
   connection->shareable = FALSE;
   connection->route_peer_messages = FALSE;
+  connection->corked = FALSE;
+  connection->outgoing_lanes = FALSE;
+  connection->priority = FALSE;
   connection->disconnected_message_arrived = FALSE;
   connection->disconnected_message_processed = FALSE;
+  connection->dispatch_weight = 1;
+  /* Spinning only wastes the time slice the holder needs on one CPU */
+  if (_dbus_get_n_online_cpus () > 1)
+    connection->io_path_spin = IO_PATH_SPIN_INITIAL;
   
 #ifndef DBUS_DISABLE_CHECKS
   connection->generation = _dbus_current_generation;
@@ -1358,15 +2089,7 @@ _dbus_connection_new_for_transport (DBusTransport *transport)
     _dbus_list_free_link (disconnect_link);
   
   if (connection != NULL)
-    {
-      _dbus_condvar_free_at_location (&connection->io_path_cond);
-      _dbus_condvar_free_at_location (&connection->dispatch_cond);
-      _dbus_mutex_free_at_location (&connection->mutex);
-      _dbus_mutex_free_at_location (&connection->io_path_mutex);
-      _dbus_mutex_free_at_location (&connection->dispatch_mutex);
-      _dbus_mutex_free_at_location (&connection->slot_mutex);
-      dbus_free (connection);
-    }
+    connection_shell_free (connection);
   if (pending_replies)
     _dbus_hash_table_unref (pending_replies);
   
@@ -1467,7 +2190,7 @@ _dbus_connection_handle_watch (DBusWatch                   *watch,
   
   CONNECTION_LOCK (connection);
 
-  if (!_dbus_connection_acquire_io_path (connection, 1))
+  if (!_dbus_connection_acquire_io_path (connection, 1, NULL))
     {
       /* another thread is handling the message */
       CONNECTION_UNLOCK (connection);
@@ -1900,6 +2623,77 @@ _dbus_connection_close_possibly_shared (DBusConnection *connection)
   _dbus_connection_close_possibly_shared_and_unlock (connection);
 }
 
+/* Takes a link from the connection's link cache, or allocates one */
+static DBusList *
+take_cached_link (DBusConnection *connection,
+                  void           *data)
+{
+  DBusList *link;
+
+  if (connection->link_cache == NULL)
+    return _dbus_list_alloc_link (data);
+
+  link = _dbus_list_pop_first_link (&connection->link_cache);
+  link->data = data;
+  return link;
+}
+
+/* Frees a preallocated send that holds no counter reference, along
+ * with whichever of its links it still has
+ */
+static void
+preallocated_send_free (DBusPreallocatedSend *preallocated)
+{
+  if (preallocated->queue_link != NULL)
+    _dbus_list_free_link (preallocated->queue_link);
+  if (preallocated->counter_link != NULL)
+    _dbus_list_free_link (preallocated->counter_link);
+  if (preallocated->counter_queue_link != NULL)
+    _dbus_list_free_link (preallocated->counter_queue_link);
+  dbus_free (preallocated);
+}
+
+/* Called with lock held; keeps a preallocated send that holds no
+ * counter reference for reuse, or frees it if the cache is full
+ */
+static void
+cache_preallocated_send (DBusConnection       *connection,
+                         DBusPreallocatedSend *preallocated)
+{
+  HAVE_LOCK_CHECK (connection);
+
+  if (connection->n_preallocated_cached < PREALLOCATED_CACHE_SIZE)
+    {
+      connection->preallocated_cache[connection->n_preallocated_cached] =
+        preallocated;
+      connection->n_preallocated_cached += 1;
+    }
+  else
+    {
+      preallocated_send_free (preallocated);
+    }
+}
+
+static void
+clear_preallocated_cache (DBusConnection *connection)
+{
+  while (connection->n_preallocated_cached > 0)
+    {
+      connection->n_preallocated_cached -= 1;
+      preallocated_send_free (connection->preallocated_cache[connection->n_preallocated_cached]);
+    }
+}
+
+static void
+_dbus_connection_free_preallocated_send_unlocked (DBusConnection       *connection,
+                                                  DBusPreallocatedSend *preallocated)
+{
+  HAVE_LOCK_CHECK (connection);
+
+  _dbus_counter_unref (preallocated->counter_link->data);
+  cache_preallocated_send (connection, preallocated);
+}
+
 static DBusPreallocatedSend*
 _dbus_connection_preallocate_send_unlocked (DBusConnection *connection)
 {
@@ -1908,35 +2702,46 @@ _dbus_connection_preallocate_send_unlocked (DBusConnection *connection)
   HAVE_LOCK_CHECK (connection);
   
   _dbus_assert (connection != NULL);
-  
-  preallocated = dbus_new (DBusPreallocatedSend, 1);
-  if (preallocated == NULL)
-    return NULL;
 
-  if (connection->link_cache != NULL)
+  /* A bus sends each message it routes with a preallocated send, so
+   * reuse a cached one rather than go back to malloc for it.  Cached
+   * sends that were freed unused still hold their links; those used
+   * up get theirs back from the link cache, which is refilled as the
+   * messages they carried are written out.
+   */
+  if (connection->n_preallocated_cached > 0)
     {
-      preallocated->queue_link =
-        _dbus_list_pop_first_link (&connection->link_cache);
-      preallocated->queue_link->data = NULL;
+      connection->n_preallocated_cached -= 1;
+      preallocated =
+        connection->preallocated_cache[connection->n_preallocated_cached];
     }
   else
     {
-      preallocated->queue_link = _dbus_list_alloc_link (NULL);
+      preallocated = dbus_new0 (DBusPreallocatedSend, 1);
+      if (preallocated == NULL)
+        return NULL;
+    }
+
+  if (preallocated->queue_link == NULL)
+    {
+      preallocated->queue_link = take_cached_link (connection, NULL);
       if (preallocated->queue_link == NULL)
-        goto failed_0;
+        goto failed;
     }
-  
-  if (connection->link_cache != NULL)
+
+  if (preallocated->counter_link == NULL)
     {
       preallocated->counter_link =
-        _dbus_list_pop_first_link (&connection->link_cache);
-      preallocated->counter_link->data = connection->outgoing_counter;
+        take_cached_link (connection, connection->outgoing_counter);
+      if (preallocated->counter_link == NULL)
+        goto failed;
     }
-  else
+
+  if (preallocated->counter_queue_link == NULL)
     {
-      preallocated->counter_link = _dbus_list_alloc_link (connection->outgoing_counter);
-      if (preallocated->counter_link == NULL)
-        goto failed_1;
+      preallocated->counter_queue_link = take_cached_link (connection, NULL);
+      if (preallocated->counter_queue_link == NULL)
+        goto failed;
     }
 
   _dbus_counter_ref (preallocated->counter_link->data);
@@ -1945,32 +2750,162 @@ _dbus_connection_preallocate_send_unlocked (DBusConnection *connection)
   
   return preallocated;
   
- failed_1:
-  _dbus_list_free_link (preallocated->queue_link);
- failed_0:
-  dbus_free (preallocated);
+ failed:
+  preallocated_send_free (preallocated);
   
   return NULL;
 }
 
-/* Called with lock held, does not update dispatch status */
+/**
+ * Method calls and signals at least this big are bulk messages,
+ * which messages from other senders queued after them may overtake
+ * on connections with outgoing lanes.
+ */
+#define BULK_MESSAGE_SIZE (64 * 1024)
+
+static dbus_bool_t
+message_is_bulk (DBusMessage *message)
+{
+  int type;
+
+  /* Someone is waiting on these however big they are */
+  type = dbus_message_get_type (message);
+  if (type == DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+      type == DBUS_MESSAGE_TYPE_ERROR)
+    return FALSE;
+
+  return _dbus_message_get_network_size (message) >= BULK_MESSAGE_SIZE;
+}
+
+static dbus_bool_t
+messages_have_same_sender (DBusMessage *a,
+                           DBusMessage *b)
+{
+  const char *a_sender;
+  const char *b_sender;
+
+  a_sender = dbus_message_get_sender (a);
+  b_sender = dbus_message_get_sender (b);
+
+  if (a_sender == NULL || b_sender == NULL)
+    return a_sender == b_sender;
+
+  return strcmp (a_sender, b_sender) == 0;
+}
+
+/* Whether a message marked with _dbus_message_set_priority() goes in
+ * the priority lane: only if it isn't bulk, and the priority messages
+ * waiting at the end of the queue leave room for it in the budget.
+ */
+static dbus_bool_t
+message_is_priority (DBusConnection *connection,
+                     DBusMessage    *message)
+{
+  DBusList *link;
+  long size;
+
+  if (!_dbus_message_get_priority (message) ||
+      message_is_bulk (message))
+    return FALSE;
+
+  size = _dbus_message_get_network_size (message);
+
+  /* the head of the queue goes first whatever it is */
+  link = _dbus_list_get_last_link (&connection->outgoing_messages);
+  if (link != NULL && !_dbus_message_get_priority (link->data))
+    link = _dbus_list_get_prev_link (&connection->outgoing_messages, link);
+
+  while (link != NULL &&
+         _dbus_message_get_priority (link->data) &&
+         size <= connection->max_priority_outgoing_size)
+    {
+      size += _dbus_message_get_network_size (link->data);
+      link = _dbus_list_get_prev_link (&connection->outgoing_messages, link);
+    }
+
+  return size <= connection->max_priority_outgoing_size;
+}
+
+/* The outgoing queue can have three lanes.  With outgoing lanes, a
+ * message that isn't bulk is sent ahead of bulk messages still
+ * waiting, so that replies and small messages aren't stuck behind
+ * someone else's large transfer to a slow peer.  Ahead of both go
+ * messages with priority, for as many bytes of them as the connection
+ * allows.  A message never passes one from its own sender, another
+ * message of its own lane, or the message at the head of the queue,
+ * which may be partly written already.  outgoing_counter_links is kept
+ * in step.
+ */
 static void
-_dbus_connection_send_preallocated_unlocked_no_update (DBusConnection       *connection,
-                                                       DBusPreallocatedSend *preallocated,
-                                                       DBusMessage          *message,
-                                                       dbus_uint32_t        *client_serial)
+insert_outgoing_links (DBusConnection *connection,
+                       DBusList       *queue_link,
+                       DBusList       *counter_queue_link)
+{
+  DBusList *link;
+  DBusList *counter_link;
+  DBusList *head;
+
+  /* The end of the list is sent first; new messages normally go on
+   * the front, unless there are bulk messages there to get ahead of,
+   * or they have priority and can get ahead of everything.
+   */
+  link = _dbus_list_get_first_link (&connection->outgoing_messages);
+  counter_link = _dbus_list_get_first_link (&connection->outgoing_counter_links);
+  head = _dbus_list_get_last_link (&connection->outgoing_messages);
+
+  if (message_is_priority (connection, queue_link->data))
+    {
+      while (link != head &&
+             !_dbus_message_get_priority (link->data) &&
+             !messages_have_same_sender (link->data, queue_link->data))
+        {
+          link = _dbus_list_get_next_link (&connection->outgoing_messages, link);
+          counter_link = _dbus_list_get_next_link (&connection->outgoing_counter_links,
+                                                   counter_link);
+        }
+    }
+  else if (connection->outgoing_lanes && !message_is_bulk (queue_link->data))
+    {
+      while (link != head &&
+             message_is_bulk (link->data) &&
+             !messages_have_same_sender (link->data, queue_link->data))
+        {
+          link = _dbus_list_get_next_link (&connection->outgoing_messages, link);
+          counter_link = _dbus_list_get_next_link (&connection->outgoing_counter_links,
+                                                   counter_link);
+        }
+    }
+
+  _dbus_list_insert_before_link (&connection->outgoing_messages,
+                                 link, queue_link);
+  _dbus_list_insert_before_link (&connection->outgoing_counter_links,
+                                 counter_link, counter_queue_link);
+}
+
+/* Called with lock held; queues the message without trying to write it */
+static void
+_dbus_connection_queue_preallocated_unlocked (DBusConnection       *connection,
+                                              DBusPreallocatedSend *preallocated,
+                                              DBusMessage          *message,
+                                              dbus_uint32_t        *client_serial)
 {
   dbus_uint32_t serial;
   const char *sig;
 
   preallocated->queue_link->data = message;
-  _dbus_list_prepend_link (&connection->outgoing_messages,
-                           preallocated->queue_link);
 
   _dbus_message_add_counter_link (message,
                                   preallocated->counter_link);
 
-  dbus_free (preallocated);
+  preallocated->counter_queue_link->data = preallocated->counter_link;
+  insert_outgoing_links (connection, preallocated->queue_link,
+                         preallocated->counter_queue_link);
+
+  /* The links now belong to the queues */
+  preallocated->queue_link = NULL;
+  preallocated->counter_link = NULL;
+  preallocated->counter_queue_link = NULL;
+  cache_preallocated_send (connection, preallocated);
   preallocated = NULL;
   
   dbus_message_ref (message);
@@ -2013,8 +2948,24 @@ _dbus_connection_send_preallocated_unlocked_no_update (DBusConnection       *con
 
   _dbus_verbose ("Message %p serial is %u\n",
                  message, dbus_message_get_serial (message));
+
+  _dbus_trace3 (message__queue, connection, message,
+                dbus_message_get_serial (message));
   
+  _dbus_message_start_expiry (message);
   dbus_message_lock (message);
+}
+
+/* Called with lock held, does not update dispatch status. Unless the
+ * connection is corked, tries to write out what was just queued.
+ */
+static void
+_dbus_connection_write_queued_unlocked (DBusConnection *connection)
+{
+  HAVE_LOCK_CHECK (connection);
+
+  if (connection->corked)
+    return;
 
   /* Now we need to run an iteration to hopefully just write the messages
    * out immediately, and otherwise get them queued up
@@ -2024,9 +2975,28 @@ _dbus_connection_send_preallocated_unlocked_no_update (DBusConnection       *con
                                           DBUS_ITERATION_DO_WRITING,
                                           -1);
 
-  /* If stuff is still queued up, be sure we wake up the main loop */
+  /* If stuff is still queued up, be sure we wake up the main loop,
+   * and whichever thread is blocked holding the io path, since the
+   * iteration above can't have run while it does.
+   */
   if (connection->n_outgoing > 0)
-    _dbus_connection_wakeup_mainloop (connection);
+    {
+      _dbus_transport_interrupt_iteration (connection->transport);
+      _dbus_connection_wakeup_mainloop (connection);
+    }
+}
+
+/* Called with lock held, does not update dispatch status */
+static void
+_dbus_connection_send_preallocated_unlocked_no_update (DBusConnection       *connection,
+                                                       DBusPreallocatedSend *preallocated,
+                                                       DBusMessage          *message,
+                                                       dbus_uint32_t        *client_serial)
+{
+  _dbus_connection_queue_preallocated_unlocked (connection, preallocated,
+                                                message, client_serial);
+
+  _dbus_connection_write_queued_unlocked (connection);
 }
 
 static void
@@ -2132,243 +3102,791 @@ _dbus_connection_close_if_only_one_ref (DBusConnection *connection)
     CONNECTION_UNLOCK (connection);
 }
 
-
 /**
- * When a function that blocks has been called with a timeout, and we
- * run out of memory, the time to wait for memory is based on the
- * timeout. If the caller was willing to block a long time we wait a
- * relatively long time for memory, if they were only willing to block
- * briefly then we retry for memory at a rapid rate.
+ * Sets whether bodies of messages the bus only passes on are left
+ * unvalidated when read. When they are, only the header and the
+ * bodies of messages addressed to the bus itself or broadcast are
+ * validated on the way in; for anything else it is up to the caller
+ * to check the body with _dbus_message_check_body() before passing
+ * it on, unless it trusts the peer. Only for use by the message bus.
  *
- * @timeout_milliseconds the timeout requested for blocking
+ * @param connection the connection
+ * @param trust #TRUE to skip validating bodies the bus doesn't examine
  */
-static void
-_dbus_memory_pause_based_on_timeout (int timeout_milliseconds)
+void
+_dbus_connection_set_trust_message_bodies (DBusConnection *connection,
+                                           dbus_bool_t     trust)
 {
-  if (timeout_milliseconds == -1)
-    _dbus_sleep_milliseconds (1000);
-  else if (timeout_milliseconds < 100)
-    ; /* just busy loop */
-  else if (timeout_milliseconds <= 1000)
-    _dbus_sleep_milliseconds (timeout_milliseconds / 3);
-  else
-    _dbus_sleep_milliseconds (1000);
+  _dbus_assert (connection != NULL);
+
+  CONNECTION_LOCK (connection);
+  _dbus_transport_set_trust_message_bodies (connection->transport, trust);
+  CONNECTION_UNLOCK (connection);
 }
 
-static DBusMessage *
-generate_local_error_message (dbus_uint32_t serial, 
-                              char *error_name, 
-                              char *error_msg)
+/**
+ * Sets whether messages that arrive in the other byte order are left
+ * in it, rather than swapped when first read, unless they are
+ * addressed to the bus itself. A message bus only reads header fields
+ * and string arguments of the messages it passes on, which works in
+ * either order, and the peer it passes them to can read either order
+ * too; so swapping them would be wasted work. Only for use by the
+ * message bus.
+ *
+ * @param connection the connection
+ * @param keep #TRUE to leave messages to pass on in the sender's byte order
+ */
+void
+_dbus_connection_set_keep_byte_order (DBusConnection *connection,
+                                      dbus_bool_t     keep)
 {
-  DBusMessage *message;
-  message = dbus_message_new (DBUS_MESSAGE_TYPE_ERROR);
-  if (!message)
-    goto out;
-
-  if (!dbus_message_set_error_name (message, error_name))
-    {
-      dbus_message_unref (message);
-      message = NULL;
-      goto out; 
-    }
+  _dbus_assert (connection != NULL);
 
-  dbus_message_set_no_reply (message, TRUE); 
+  CONNECTION_LOCK (connection);
+  _dbus_transport_set_keep_byte_order (connection->transport, keep);
+  CONNECTION_UNLOCK (connection);
+}
 
-  if (!dbus_message_set_reply_serial (message,
-                                      serial))
-    {
-      dbus_message_unref (message);
-      message = NULL;
-      goto out;
-    }
+/**
+ * Frees memory the connection only keeps to speed up further
+ * traffic: the unused parts of the transport's buffers and the cache
+ * of spare list links. For a bus with many idle connections; all of
+ * it is reallocated as needed once traffic resumes.
+ *
+ * @param connection the connection
+ */
+void
+_dbus_connection_compact (DBusConnection *connection)
+{
+  _dbus_assert (connection != NULL);
 
-  if (error_msg != NULL)
-    {
-      DBusMessageIter iter;
+  CONNECTION_LOCK (connection);
 
-      dbus_message_iter_init_append (message, &iter);
-      if (!dbus_message_iter_append_basic (&iter,
-                                           DBUS_TYPE_STRING,
-                                           &error_msg))
-        {
-          dbus_message_unref (message);
-          message = NULL;
-	  goto out;
-        }
-    }
+  _dbus_transport_compact (connection->transport);
+  _dbus_list_clear (&connection->link_cache);
+  clear_preallocated_cache (connection);
 
- out:
-  return message;
+  CONNECTION_UNLOCK (connection);
 }
 
-/*
- * Peek the incoming queue to see if we got reply for a specific serial
+/**
+ * Puts new_message in the outgoing queue in place of old_message, if
+ * old_message is still waiting there, so new_message goes out when
+ * old_message would have and old_message isn't sent at all. For the
+ * message bus, to keep only the latest of some signals queued for a
+ * slow connection.
+ *
+ * Fails if old_message isn't queued, or is at the head of the queue
+ * and may be partly written already, or if the two messages belong in
+ * different lanes of the queue (see insert_outgoing_links()).
+ *
+ * @param connection the connection
+ * @param old_message a message that was sent on the connection
+ * @param new_message the message to send in its place
+ * @returns #TRUE if old_message was replaced
  */
-static dbus_bool_t
-_dbus_connection_peek_for_reply_unlocked (DBusConnection *connection,
-                                          dbus_uint32_t   client_serial)
+dbus_bool_t
+_dbus_connection_replace_outgoing (DBusConnection *connection,
+                                   DBusMessage    *old_message,
+                                   DBusMessage    *new_message)
 {
   DBusList *link;
-  HAVE_LOCK_CHECK (connection);
+  DBusList *counter_link;
+  DBusList *head;
 
-  link = _dbus_list_get_first_link (&connection->incoming_messages);
+  _dbus_assert (connection != NULL);
+  _dbus_assert (old_message != new_message);
 
-  while (link != NULL)
-    {
-      DBusMessage *reply = link->data;
+  if (message_is_bulk (old_message) != message_is_bulk (new_message) ||
+      _dbus_message_get_priority (old_message) !=
+      _dbus_message_get_priority (new_message))
+    return FALSE;
 
-      if (dbus_message_get_reply_serial (reply) == client_serial)
-        {
-          _dbus_verbose ("%s reply to %d found in queue\n", _DBUS_FUNCTION_NAME, client_serial);
-          return TRUE;
-        }
-      link = _dbus_list_get_next_link (&connection->incoming_messages, link);
+  CONNECTION_LOCK (connection);
+
+  head = _dbus_list_get_last_link (&connection->outgoing_messages);
+  link = _dbus_list_get_first_link (&connection->outgoing_messages);
+  counter_link = _dbus_list_get_first_link (&connection->outgoing_counter_links);
+
+  while (link != head && link->data != old_message)
+    {
+      link = _dbus_list_get_next_link (&connection->outgoing_messages, link);
+      counter_link = _dbus_list_get_next_link (&connection->outgoing_counter_links,
+                                               counter_link);
     }
 
-  return FALSE;
-}
+  if (link == head)
+    {
+      CONNECTION_UNLOCK (connection);
+      return FALSE;
+    }
 
-/* This is slightly strange since we can pop a message here without
- * the dispatch lock.
- */
-static DBusMessage*
-check_for_reply_unlocked (DBusConnection *connection,
-                          dbus_uint32_t   client_serial)
-{
-  DBusList *link;
+  /* The counter link moves over too, so the outgoing counter goes
+   * down by the old message's size and up by the new one's
+   */
+  _dbus_message_remove_counter_link (old_message, counter_link->data);
+  _dbus_message_add_counter_link (new_message, counter_link->data);
 
-  HAVE_LOCK_CHECK (connection);
-  
-  link = _dbus_list_get_first_link (&connection->incoming_messages);
+  link->data = new_message;
+  dbus_message_ref (new_message);
 
-  while (link != NULL)
-    {
-      DBusMessage *reply = link->data;
+  if (dbus_message_get_serial (new_message) == 0)
+    dbus_message_set_serial (new_message,
+                             _dbus_connection_get_next_client_serial (connection));
 
-      if (dbus_message_get_reply_serial (reply) == client_serial)
-	{
-	  _dbus_list_remove_link (&connection->incoming_messages, link);
-	  connection->n_incoming  -= 1;
-	  return reply;
-	}
-      link = _dbus_list_get_next_link (&connection->incoming_messages, link);
-    }
+  dbus_message_lock (new_message);
 
-  return NULL;
-}
+  _dbus_verbose ("Message %p replaced %p in outgoing queue %p\n",
+                 new_message, old_message, connection);
 
-static void
-connection_timeout_and_complete_all_pending_calls_unlocked (DBusConnection *connection)
-{
-   /* We can't iterate over the hash in the normal way since we'll be
-    * dropping the lock for each item. So we restart the
-    * iter each time as we drain the hash table.
-    */
-   
-   while (_dbus_hash_table_get_n_entries (connection->pending_replies) > 0)
-    {
-      DBusPendingCall *pending;
-      DBusHashIter iter;
-      
-      _dbus_hash_iter_init (connection->pending_replies, &iter);
-      _dbus_hash_iter_next (&iter);
-       
-      pending = _dbus_hash_iter_get_value (&iter);
-      _dbus_pending_call_ref_unlocked (pending);
-       
-      _dbus_pending_call_queue_timeout_error_unlocked (pending, 
-                                                       connection);
+  CONNECTION_UNLOCK (connection);
 
-      if (_dbus_pending_call_is_timeout_added_unlocked (pending))
-          _dbus_connection_remove_timeout_unlocked (connection,
-                                                    _dbus_pending_call_get_timeout_unlocked (pending));
-      _dbus_pending_call_set_timeout_added_unlocked (pending, FALSE);       
-      _dbus_hash_iter_remove_entry (&iter);
+  dbus_message_unref (old_message);
 
-      _dbus_pending_call_unref_and_unlock (pending);
-      CONNECTION_LOCK (connection);
-    }
-  HAVE_LOCK_CHECK (connection);
+  return TRUE;
 }
 
+/* Called with the connection lock held, as a message is queued or
+ * written and the outgoing counter crosses its guard either way.
+ */
 static void
-complete_pending_call_and_unlock (DBusConnection  *connection,
-                                  DBusPendingCall *pending,
-                                  DBusMessage     *message)
-{
-  _dbus_pending_call_set_reply_unlocked (pending, message);
-  _dbus_pending_call_ref_unlocked (pending); /* in case there's no app with a ref held */
-  _dbus_connection_detach_pending_call_and_unlock (connection, pending);
- 
-  /* Must be called unlocked since it invokes app callback */
-  _dbus_pending_call_complete (pending);
-  dbus_pending_call_unref (pending);
-}
-
-static dbus_bool_t
-check_for_reply_and_update_dispatch_unlocked (DBusConnection  *connection,
-                                              DBusPendingCall *pending)
+outgoing_counter_notify (DBusCounter *counter,
+                         void        *user_data)
 {
-  DBusMessage *reply;
-  DBusDispatchStatus status;
-
-  reply = check_for_reply_unlocked (connection, 
-                                    _dbus_pending_call_get_reply_serial_unlocked (pending));
-  if (reply != NULL)
-    {
-      _dbus_verbose ("checked for reply\n");
-
-      _dbus_verbose ("dbus_connection_send_with_reply_and_block(): got reply\n");
+  DBusConnection *connection = user_data;
+  DBusOutgoingDrainedFunction function;
+  void *data;
 
-      complete_pending_call_and_unlock (connection, pending, reply);
-      dbus_message_unref (reply);
+  if (_dbus_counter_get_size_value (counter) >=
+      connection->outgoing_drained_size)
+    return;
 
-      CONNECTION_LOCK (connection);
-      status = _dbus_connection_get_dispatch_status_unlocked (connection);
-      _dbus_connection_update_dispatch_status_and_unlock (connection, status);
-      dbus_pending_call_unref (pending);
+  function = connection->outgoing_drained_function;
+  data = connection->outgoing_drained_data;
 
-      return TRUE;
-    }
+  connection->outgoing_drained_function = NULL;
+  connection->outgoing_drained_data = NULL;
+  _dbus_counter_set_notify (counter, 0, 0, NULL, NULL);
 
-  return FALSE;
+  if (function != NULL)
+    (* function) (connection, data);
 }
 
 /**
- * Blocks until a pending call times out or gets a reply.
- *
- * Does not re-enter the main loop or run filter/path-registered
- * callbacks. The reply to the message will not be seen by
- * filter callbacks.
- *
- * Returns immediately if pending call already got a reply.
- * 
- * @todo could use performance improvements (it keeps scanning
- * the whole message queue for example)
+ * Arranges for a function to be called once, the next time the
+ * outgoing queue drops below the given number of bytes. It is called
+ * from inside libdbus as a message is written or dropped, with this
+ * connection locked, so it must not call any function on this
+ * connection. Setting a new function replaces the old one; a #NULL
+ * function cancels it. Only for use by the message bus.
  *
- * @param pending the pending call we block for a reply on
+ * @param connection the connection
+ * @param size number of outgoing bytes to wait for the queue to drop below
+ * @param function function to call, or #NULL
+ * @param data data for the function
  */
 void
-_dbus_connection_block_pending_call (DBusPendingCall *pending)
+_dbus_connection_set_outgoing_drained_function (DBusConnection              *connection,
+                                                long                         size,
+                                                DBusOutgoingDrainedFunction  function,
+                                                void                        *data)
 {
-  long start_tv_sec, start_tv_usec;
-  long tv_sec, tv_usec;
-  DBusDispatchStatus status;
-  DBusConnection *connection;
-  dbus_uint32_t client_serial;
-  DBusTimeout *timeout;
-  int timeout_milliseconds, elapsed_milliseconds;
+  _dbus_assert (connection != NULL);
 
-  _dbus_assert (pending != NULL);
+  CONNECTION_LOCK (connection);
+  connection->outgoing_drained_function = function;
+  connection->outgoing_drained_data = data;
+  connection->outgoing_drained_size = size;
+  if (function != NULL)
+    _dbus_counter_set_notify (connection->outgoing_counter, size, 0,
+                              outgoing_counter_notify, connection);
+  else
+    _dbus_counter_set_notify (connection->outgoing_counter, 0, 0,
+                              NULL, NULL);
+  CONNECTION_UNLOCK (connection);
+}
 
-  if (dbus_pending_call_get_completed (pending))
-    return;
+/**
+ * Stops or resumes reading from the connection. Messages already read
+ * are still dispatched, and writing carries on as normal. Only for use
+ * by the message bus, to hold off a peer that is sending faster than
+ * its recipients can take.
+ *
+ * @param connection the connection
+ * @param paused #TRUE to stop reading
+ */
+void
+_dbus_connection_set_reading_paused (DBusConnection *connection,
+                                     dbus_bool_t     paused)
+{
+  _dbus_assert (connection != NULL);
 
-  dbus_pending_call_ref (pending); /* necessary because the call could be canceled */
+  CONNECTION_LOCK (connection);
+  _dbus_transport_set_reading_paused (connection->transport, paused);
+  CONNECTION_UNLOCK (connection);
+}
 
-  connection = _dbus_pending_call_get_connection_and_lock (pending);
-  
-  /* Flush message queue - note, can affect dispatch status */
+/**
+ * Sets whether messages from different senders may be sent out of
+ * order. When they may, a method call or signal of 64 KiB or more
+ * lets replies, errors and smaller messages from other senders that
+ * were queued after it go first, so that a large transfer to a slow
+ * peer doesn't hold up everyone else's traffic. Messages from any one
+ * sender, as given by dbus_message_get_sender(), are always sent in
+ * the order they were queued. Only for use by the message bus, which
+ * forwards messages from many senders over each connection.
+ *
+ * @param connection the connection
+ * @param enabled #TRUE to let messages from other senders overtake bulk messages
+ */
+void
+_dbus_connection_set_outgoing_lanes (DBusConnection *connection,
+                                     dbus_bool_t     enabled)
+{
+  _dbus_assert (connection != NULL);
+
+  CONNECTION_LOCK (connection);
+  connection->outgoing_lanes = enabled != FALSE;
+  CONNECTION_UNLOCK (connection);
+}
+
+/**
+ * Gets what another process would need to carry on with the server
+ * side of a connection without the peer noticing: its socket, and
+ * whatever has been read from it but isn't a whole message yet. This
+ * is only possible while the connection is quiet, with nothing queued
+ * either way and nothing part written, and only on plain sockets
+ * without encoding. Only for use by the message bus, when it hands
+ * its connections to a new instance of itself.
+ *
+ * The connection is not changed; the caller must make sure nothing
+ * more is read from or written to it before the other process takes
+ * over.
+ *
+ * @param connection the connection
+ * @param fd_p return location for the socket
+ * @param unread string the unread bytes are appended to
+ * @returns #FALSE if the connection can't be handed over as it is,
+ *   or there is no memory to copy the bytes
+ */
+dbus_bool_t
+_dbus_connection_get_handoff_state (DBusConnection *connection,
+                                    int            *fd_p,
+                                    DBusString     *unread)
+{
+  dbus_bool_t retval;
+
+  _dbus_assert (connection != NULL);
+
+  CONNECTION_LOCK (connection);
+  retval = connection->n_outgoing == 0 &&
+    connection->n_incoming == 0 &&
+    _dbus_transport_get_handoff_state (connection->transport, fd_p, unread);
+  CONNECTION_UNLOCK (connection);
+
+  return retval;
+}
+
+/**
+ * Creates the server side of a connection handed over by another
+ * process, from what _dbus_connection_get_handoff_state() gave it.
+ * The connection starts out authenticated, and reads the unread bytes
+ * before anything else from the socket.
+ *
+ * @param fd the socket, which must be nonblocking
+ * @param identity the identity the peer was authorized as
+ * @param unix_fd_negotiated whether unix fd passing was negotiated
+ * @param unread bytes read from the socket but not yet made into a message
+ * @returns the new connection, or #NULL if no memory, in which case
+ *   the socket has been closed
+ */
+DBusConnection*
+_dbus_connection_new_for_handed_off_socket (int               fd,
+                                            DBusCredentials  *identity,
+                                            dbus_bool_t       unix_fd_negotiated,
+                                            const DBusString *unread)
+{
+  DBusTransport *transport;
+  DBusConnection *connection;
+
+  transport = _dbus_transport_new_for_handed_off_socket (fd, identity,
+                                                         unix_fd_negotiated,
+                                                         unread);
+  if (transport == NULL)
+    return NULL;
+
+  connection = _dbus_connection_new_for_transport (transport);
+  _dbus_transport_unref (transport);
+
+  return connection;
+}
+
+/**
+ * Sets how many messages the main loop in dbus-mainloop.c takes from
+ * this connection each time round, relative to other connections it
+ * is dispatching: a connection of weight 2 gets twice the turn of one
+ * with the default weight of 1. Only for use by the message bus.
+ *
+ * @param connection the connection
+ * @param weight the weight, at least 1
+ */
+void
+_dbus_connection_set_dispatch_weight (DBusConnection *connection,
+                                      int             weight)
+{
+  _dbus_assert (connection != NULL);
+  _dbus_assert (weight > 0);
+
+  CONNECTION_LOCK (connection);
+  connection->dispatch_weight = weight;
+  CONNECTION_UNLOCK (connection);
+}
+
+/**
+ * Gets the weight set with _dbus_connection_set_dispatch_weight().
+ *
+ * @param connection the connection
+ * @returns the weight
+ */
+int
+_dbus_connection_get_dispatch_weight (DBusConnection *connection)
+{
+  int weight;
+
+  _dbus_assert (connection != NULL);
+
+  CONNECTION_LOCK (connection);
+  weight = connection->dispatch_weight;
+  CONNECTION_UNLOCK (connection);
+
+  return weight;
+}
+
+/**
+ * Gives the connection priority in a #DBusLoop, or takes it away:
+ * the loop handles its watches before those of connections without
+ * priority, and dispatches it first. Messages from it are not
+ * otherwise treated differently here; the message bus marks them
+ * with _dbus_message_set_priority() to send them ahead of others.
+ * Only for use by the message bus.
+ *
+ * @param connection the connection
+ * @param priority #TRUE to give it priority
+ */
+void
+_dbus_connection_set_priority (DBusConnection *connection,
+                               dbus_bool_t     priority)
+{
+  _dbus_assert (connection != NULL);
+
+  CONNECTION_LOCK (connection);
+  connection->priority = priority != FALSE;
+  /* the watch functions are called with the lock held, as in
+   * protected_change_watch()
+   */
+  if (connection->watches != NULL)
+    _dbus_watch_list_set_priority (connection->watches, priority);
+  CONNECTION_UNLOCK (connection);
+}
+
+/**
+ * Gets whether the connection was given priority with
+ * _dbus_connection_set_priority().
+ *
+ * @param connection the connection
+ * @returns #TRUE if it has priority
+ */
+dbus_bool_t
+_dbus_connection_get_priority (DBusConnection *connection)
+{
+  dbus_bool_t priority;
+
+  _dbus_assert (connection != NULL);
+
+  CONNECTION_LOCK (connection);
+  priority = connection->priority;
+  CONNECTION_UNLOCK (connection);
+
+  return priority;
+}
+
+/**
+ * Sets how many bytes of messages marked with
+ * _dbus_message_set_priority() may be waiting in the outgoing queue
+ * ahead of other messages. Any more, or any too big to fit, take
+ * their turn with everything else, so a sender with priority can't
+ * hold up other traffic for long. A priority message still never
+ * overtakes one from its own sender. The default of 0 sends messages
+ * in the order they are queued whatever their priority.
+ *
+ * @param connection the connection
+ * @param size the most bytes of priority messages to queue ahead
+ */
+void
+_dbus_connection_set_max_priority_outgoing_size (DBusConnection *connection,
+                                                 long            size)
+{
+  _dbus_assert (connection != NULL);
+  _dbus_assert (size >= 0);
+
+  CONNECTION_LOCK (connection);
+  connection->max_priority_outgoing_size = size;
+  CONNECTION_UNLOCK (connection);
+}
+
+/**
+ * Sets the range the bytes read or written per iteration of the
+ * connection's transport are kept within. Each of the two budgets
+ * starts at @min_bytes, doubles while the peer keeps an iteration
+ * busy for all of it, and halves again once it uses less than a
+ * quarter; reads stop growing while the received messages near
+ * their limit. A larger budget means fewer trips round the main
+ * loop for bulk traffic, at the cost of other connections waiting
+ * longer for their turn.
+ *
+ * @param connection the connection
+ * @param min_bytes the smallest budget, at least 1
+ * @param max_bytes the largest budget, at least @min_bytes
+ */
+void
+_dbus_connection_set_iteration_bounds (DBusConnection *connection,
+                                       int             min_bytes,
+                                       int             max_bytes)
+{
+  _dbus_assert (connection != NULL);
+
+  CONNECTION_LOCK (connection);
+  _dbus_transport_set_iteration_bounds (connection->transport,
+                                        min_bytes, max_bytes);
+  CONNECTION_UNLOCK (connection);
+}
+
+/**
+ * Gets the bytes the connection's transport currently reads and
+ * writes at most per iteration, see
+ * _dbus_connection_set_iteration_bounds(). Both are 0 for transports
+ * that don't adapt them.
+ *
+ * @param connection the connection
+ * @param read_budget return location for the read budget
+ * @param write_budget return location for the write budget
+ */
+void
+_dbus_connection_get_iteration_budgets (DBusConnection *connection,
+                                        int            *read_budget,
+                                        int            *write_budget)
+{
+  _dbus_assert (connection != NULL);
+
+  CONNECTION_LOCK (connection);
+  _dbus_transport_get_iteration_budgets (connection->transport,
+                                         read_budget, write_budget);
+  CONNECTION_UNLOCK (connection);
+}
+
+/**
+ * Stops or resumes reading while the main loop has messages from this
+ * connection left over from its turn at dispatching, so the peer
+ * can't read further ahead than it is dispatched. Independent of
+ * _dbus_connection_set_reading_paused(); reading only happens when
+ * neither has stopped it.
+ *
+ * @param connection the connection
+ * @param backlogged #TRUE to stop reading
+ */
+void
+_dbus_connection_set_dispatch_backlogged (DBusConnection *connection,
+                                          dbus_bool_t     backlogged)
+{
+  _dbus_assert (connection != NULL);
+
+  CONNECTION_LOCK (connection);
+  _dbus_transport_set_dispatch_backlogged (connection->transport, backlogged);
+  CONNECTION_UNLOCK (connection);
+}
+
+/**
+ * Makes writing wait for the write watch once the socket is full.
+ * Normally each message sent is written out straight away, even if
+ * the last write found no room and the write watch is already
+ * waiting for some. With this set, messages sent meanwhile are only
+ * queued, and go out together when the watch reports room; the watch
+ * itself stays disabled until a write leaves something behind.
+ *
+ * Only set this if the connection's watches are served by a main
+ * loop, since nothing else will write those messages.
+ *
+ * @param connection the connection
+ * @param edge_triggered #TRUE to leave a full socket to the write watch
+ */
+void
+_dbus_connection_set_edge_triggered_writes (DBusConnection *connection,
+                                            dbus_bool_t     edge_triggered)
+{
+  _dbus_assert (connection != NULL);
+
+  CONNECTION_LOCK (connection);
+  _dbus_transport_set_edge_triggered_writes (connection->transport,
+                                             edge_triggered);
+  CONNECTION_UNLOCK (connection);
+}
+
+/**
+ * When a function that blocks has been called with a timeout, and we
+ * run out of memory, the time to wait for memory is based on the
+ * timeout. If the caller was willing to block a long time we wait a
+ * relatively long time for memory, if they were only willing to block
+ * briefly then we retry for memory at a rapid rate.
+ *
+ * @timeout_milliseconds the timeout requested for blocking
+ */
+static void
+_dbus_memory_pause_based_on_timeout (int timeout_milliseconds)
+{
+  if (timeout_milliseconds == -1)
+    _dbus_sleep_milliseconds (1000);
+  else if (timeout_milliseconds < 100)
+    ; /* just busy loop */
+  else if (timeout_milliseconds <= 1000)
+    _dbus_sleep_milliseconds (timeout_milliseconds / 3);
+  else
+    _dbus_sleep_milliseconds (1000);
+}
+
+static DBusMessage *
+generate_local_error_message (dbus_uint32_t serial, 
+                              char *error_name, 
+                              char *error_msg)
+{
+  DBusMessage *message;
+  message = dbus_message_new (DBUS_MESSAGE_TYPE_ERROR);
+  if (!message)
+    goto out;
+
+  if (!dbus_message_set_error_name (message, error_name))
+    {
+      dbus_message_unref (message);
+      message = NULL;
+      goto out; 
+    }
+
+  dbus_message_set_no_reply (message, TRUE); 
+
+  if (!dbus_message_set_reply_serial (message,
+                                      serial))
+    {
+      dbus_message_unref (message);
+      message = NULL;
+      goto out;
+    }
+
+  if (error_msg != NULL)
+    {
+      DBusMessageIter iter;
+
+      dbus_message_iter_init_append (message, &iter);
+      if (!dbus_message_iter_append_basic (&iter,
+                                           DBUS_TYPE_STRING,
+                                           &error_msg))
+        {
+          dbus_message_unref (message);
+          message = NULL;
+	  goto out;
+        }
+    }
+
+ out:
+  return message;
+}
+
+/*
+ * Finds the queued reply for a pending call. A call that is still
+ * attached has its reply indexed as it is queued, so this is O(1);
+ * only a call detached from pending_replies falls back to scanning.
+ */
+static DBusList*
+find_reply_link_unlocked (DBusConnection  *connection,
+                          DBusPendingCall *pending)
+{
+  DBusList *link;
+  dbus_uint32_t client_serial;
+
+  HAVE_LOCK_CHECK (connection);
+
+  link = _dbus_pending_call_get_reply_link_unlocked (pending);
+  if (link != NULL)
+    return link;
+
+  client_serial = _dbus_pending_call_get_reply_serial_unlocked (pending);
+
+  if (_dbus_hash_table_lookup_int (connection->pending_replies,
+                                   client_serial) == pending)
+    return NULL;
+
+  link = _dbus_list_get_first_link (&connection->incoming_messages);
+
+  while (link != NULL)
+    {
+      DBusMessage *reply = link->data;
+
+      if (dbus_message_get_reply_serial (reply) == client_serial)
+        return link;
+
+      link = _dbus_list_get_next_link (&connection->incoming_messages, link);
+    }
+
+  return NULL;
+}
+
+/*
+ * Peek the incoming queue to see if we got reply for a specific pending call
+ */
+static dbus_bool_t
+_dbus_connection_peek_for_reply_unlocked (DBusConnection  *connection,
+                                          DBusPendingCall *pending)
+{
+  HAVE_LOCK_CHECK (connection);
+
+  if (find_reply_link_unlocked (connection, pending) != NULL)
+    {
+      _dbus_verbose ("%s reply to %d found in queue\n", _DBUS_FUNCTION_NAME,
+                     _dbus_pending_call_get_reply_serial_unlocked (pending));
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* This is slightly strange since we can pop a message here without
+ * the dispatch lock.
+ */
+static DBusMessage*
+check_for_reply_unlocked (DBusConnection  *connection,
+                          DBusPendingCall *pending)
+{
+  DBusList *link;
+  DBusMessage *reply;
+
+  HAVE_LOCK_CHECK (connection);
+  
+  link = find_reply_link_unlocked (connection, pending);
+  if (link == NULL)
+    return NULL;
+
+  _dbus_pending_call_set_reply_link_unlocked (pending, NULL);
+
+  reply = link->data;
+  _dbus_list_remove_link (&connection->incoming_messages, link);
+  connection->n_incoming  -= 1;
+
+  return reply;
+}
+
+static void
+connection_timeout_and_complete_all_pending_calls_unlocked (DBusConnection *connection)
+{
+   /* We can't iterate over the hash in the normal way since we'll be
+    * dropping the lock for each item. So we restart the
+    * iter each time as we drain the hash table.
+    */
+   
+   while (_dbus_hash_table_get_n_entries (connection->pending_replies) > 0)
+    {
+      DBusPendingCall *pending;
+      DBusHashIter iter;
+      
+      _dbus_hash_iter_init (connection->pending_replies, &iter);
+      _dbus_hash_iter_next (&iter);
+       
+      pending = _dbus_hash_iter_get_value (&iter);
+      _dbus_pending_call_ref_unlocked (pending);
+       
+      _dbus_pending_call_queue_timeout_error_unlocked (pending, 
+                                                       connection);
+
+      _dbus_connection_unschedule_pending_call_unlocked (connection, pending);
+      _dbus_hash_iter_remove_entry (&iter);
+
+      _dbus_pending_call_unref_and_unlock (pending);
+      CONNECTION_LOCK (connection);
+    }
+  HAVE_LOCK_CHECK (connection);
+}
+
+static void
+complete_pending_call_and_unlock (DBusConnection  *connection,
+                                  DBusPendingCall *pending,
+                                  DBusMessage     *message)
+{
+  _dbus_pending_call_set_reply_unlocked (pending, message);
+  _dbus_pending_call_ref_unlocked (pending); /* in case there's no app with a ref held */
+  _dbus_connection_detach_pending_call_and_unlock (connection, pending);
+ 
+  /* Must be called unlocked since it invokes app callback */
+  _dbus_pending_call_complete (pending);
+  dbus_pending_call_unref (pending);
+}
+
+static dbus_bool_t
+check_for_reply_and_update_dispatch_unlocked (DBusConnection  *connection,
+                                              DBusPendingCall *pending)
+{
+  DBusMessage *reply;
+  DBusDispatchStatus status;
+
+  reply = check_for_reply_unlocked (connection, pending);
+  if (reply != NULL)
+    {
+      _dbus_verbose ("checked for reply\n");
+
+      _dbus_verbose ("dbus_connection_send_with_reply_and_block(): got reply\n");
+
+      complete_pending_call_and_unlock (connection, pending, reply);
+      dbus_message_unref (reply);
+
+      CONNECTION_LOCK (connection);
+      status = _dbus_connection_get_dispatch_status_unlocked (connection);
+      _dbus_connection_update_dispatch_status_and_unlock (connection, status);
+      dbus_pending_call_unref (pending);
+
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+/**
+ * Blocks until a pending call times out or gets a reply.
+ *
+ * Does not re-enter the main loop or run filter/path-registered
+ * callbacks. The reply to the message will not be seen by
+ * filter callbacks.
+ *
+ * Returns immediately if pending call already got a reply.
+ * 
+ * @param pending the pending call we block for a reply on
+ */
+void
+_dbus_connection_block_pending_call (DBusPendingCall *pending)
+{
+  long start_tv_sec, start_tv_usec;
+  long tv_sec, tv_usec;
+  DBusDispatchStatus status;
+  DBusConnection *connection;
+  dbus_uint32_t client_serial;
+  DBusTimeout *timeout;
+  int timeout_milliseconds, elapsed_milliseconds;
+
+  _dbus_assert (pending != NULL);
+
+  if (dbus_pending_call_get_completed (pending))
+    return;
+
+  dbus_pending_call_ref (pending); /* necessary because the call could be canceled */
+
+  connection = _dbus_pending_call_get_connection_and_lock (pending);
+  
+  /* Flush message queue - note, can affect dispatch status */
   _dbus_connection_flush_unlocked (connection);
 
   client_serial = _dbus_pending_call_get_reply_serial_unlocked (pending);
@@ -2634,19 +4152,6 @@ dbus_connection_ref (DBusConnection *connection)
   return connection;
 }
 
-static void
-free_outgoing_message (void *element,
-                       void *data)
-{
-  DBusMessage *message = element;
-  DBusConnection *connection = data;
-
-  _dbus_message_remove_counter (message,
-                                connection->outgoing_counter,
-                                NULL);
-  dbus_message_unref (message);
-}
-
 /* This is run without the mutex held, but after the last reference
  * to the connection has been dropped we should have no thread-related
  * problems
@@ -2665,13 +4170,18 @@ _dbus_connection_last_unref (DBusConnection *connection)
    */
   _dbus_assert (!_dbus_transport_get_is_connected (connection->transport));
   _dbus_assert (connection->server_guid == NULL);
+
+  /* Emptying the outgoing queue below mustn't call back into the bus */
+  _dbus_counter_set_notify (connection->outgoing_counter, 0, 0, NULL, NULL);
   
   /* ---- We're going to call various application callbacks here, hope it doesn't break anything... */
   _dbus_object_tree_free_all_unlocked (connection->objects);
   
   dbus_connection_set_dispatch_status_function (connection, NULL, NULL, NULL);
+  dbus_connection_set_dispatch_executor (connection, NULL, NULL, NULL);
   dbus_connection_set_wakeup_main_function (connection, NULL, NULL, NULL);
   dbus_connection_set_unix_user_function (connection, NULL, NULL, NULL);
+  dbus_connection_set_body_chunk_function (connection, NULL, NULL, NULL);
   
   _dbus_watch_list_free (connection->watches);
   connection->watches = NULL;
@@ -2701,13 +4211,27 @@ _dbus_connection_last_unref (DBusConnection *connection)
 
   _dbus_hash_table_unref (connection->pending_replies);
   connection->pending_replies = NULL;
+
+  _dbus_assert (connection->pending_deadlines == NULL);
+  if (connection->pending_timeout)
+    _dbus_timeout_unref (connection->pending_timeout);
   
   _dbus_list_clear (&connection->filter_list);
   
-  _dbus_list_foreach (&connection->outgoing_messages,
-                      free_outgoing_message,
-		      connection);
-  _dbus_list_clear (&connection->outgoing_messages);
+  while (connection->outgoing_messages != NULL)
+    {
+      DBusMessage *message;
+      DBusList *counter_link;
+
+      message = _dbus_list_pop_last (&connection->outgoing_messages);
+      counter_link = _dbus_list_pop_last (&connection->outgoing_counter_links);
+      _dbus_assert (counter_link != NULL);
+
+      _dbus_message_remove_counter_link (message, counter_link);
+      _dbus_list_free_link (counter_link);
+      dbus_message_unref (message);
+    }
+  _dbus_assert (connection->outgoing_counter_links == NULL);
   
   _dbus_list_foreach (&connection->incoming_messages,
 		      (DBusForeachFunction) dbus_message_unref,
@@ -2725,19 +4249,10 @@ _dbus_connection_last_unref (DBusConnection *connection)
       _dbus_list_free_link (connection->disconnect_message_link);
     }
 
-  _dbus_list_clear (&connection->link_cache);
-  
-  _dbus_condvar_free_at_location (&connection->dispatch_cond);
-  _dbus_condvar_free_at_location (&connection->io_path_cond);
-
-  _dbus_mutex_free_at_location (&connection->io_path_mutex);
-  _dbus_mutex_free_at_location (&connection->dispatch_mutex);
-
-  _dbus_mutex_free_at_location (&connection->slot_mutex);
-
-  _dbus_mutex_free_at_location (&connection->mutex);
+  _dbus_list_clear (&connection->link_cache);
+  clear_preallocated_cache (connection);
   
-  dbus_free (connection);
+  connection_shell_release (connection);
 }
 
 /**
@@ -3138,10 +4653,9 @@ dbus_connection_free_preallocated_send (DBusConnection       *connection,
   _dbus_return_if_fail (preallocated != NULL);  
   _dbus_return_if_fail (connection == preallocated->connection);
 
-  _dbus_list_free_link (preallocated->queue_link);
-  _dbus_counter_unref (preallocated->counter_link->data);
-  _dbus_list_free_link (preallocated->counter_link);
-  dbus_free (preallocated);
+  CONNECTION_LOCK (connection);
+  _dbus_connection_free_preallocated_send_unlocked (connection, preallocated);
+  CONNECTION_UNLOCK (connection);
 }
 
 /**
@@ -3270,6 +4784,108 @@ dbus_connection_send (DBusConnection *connection,
 					   serial);
 }
 
+/*
+ * A set of pending calls sent with dbus_connection_send_with_reply_batch()
+ * that share one deadline and one completion callback.
+ */
+typedef struct
+{
+  DBusConnection *connection;         /**< Connection the calls were sent on */
+  DBusPendingCall **pending_calls;    /**< The calls, in the order of their messages */
+  int n_pending_calls;                /**< Number of calls */
+  DBusAtomic n_remaining;             /**< Calls that have no reply yet */
+  DBusTimeout *timeout;               /**< Shared deadline, or #NULL for none */
+  dbus_bool_t timeout_added;          /**< Whether timeout has been added */
+  DBusPendingCallBatchNotifyFunction function; /**< Called when all calls complete */
+  void *user_data;                    /**< Data for function */
+  DBusFreeFunction free_user_data;    /**< Frees user_data */
+} PendingCallBatch;
+
+static void
+pending_call_batch_free (PendingCallBatch *batch)
+{
+  int i;
+
+  if (batch->free_user_data)
+    (* batch->free_user_data) (batch->user_data);
+
+  for (i = 0; i < batch->n_pending_calls; i++)
+    {
+      if (batch->pending_calls[i] != NULL)
+        dbus_pending_call_unref (batch->pending_calls[i]);
+    }
+
+  if (batch->timeout)
+    _dbus_timeout_unref (batch->timeout);
+
+  dbus_free (batch->pending_calls);
+  dbus_free (batch);
+}
+
+/* Notify function of each call in a batch; the last one to complete
+ * runs the batch callback. Called without the lock.
+ */
+static void
+pending_call_batch_call_completed (DBusPendingCall *pending,
+                                   void            *data)
+{
+  PendingCallBatch *batch = data;
+  DBusConnection *connection;
+
+  if (_dbus_atomic_dec (&batch->n_remaining) != 1)
+    return;
+
+  connection = batch->connection;
+
+  CONNECTION_LOCK (connection);
+  if (batch->timeout_added)
+    _dbus_connection_remove_timeout_unlocked (connection, batch->timeout);
+  batch->timeout_added = FALSE;
+  CONNECTION_UNLOCK (connection);
+
+  (* batch->function) (batch->pending_calls, batch->n_pending_calls,
+                       batch->user_data);
+
+  pending_call_batch_free (batch);
+}
+
+/* The shared deadline expired: time out every call that has neither
+ * completed nor had its reply queued, as reply_handler_timeout() does
+ * for a single call.
+ */
+static dbus_bool_t
+pending_call_batch_timeout (void *data)
+{
+  PendingCallBatch *batch = data;
+  DBusConnection *connection;
+  DBusDispatchStatus status;
+  int i;
+
+  connection = batch->connection;
+
+  CONNECTION_LOCK (connection);
+
+  for (i = 0; i < batch->n_pending_calls; i++)
+    {
+      DBusPendingCall *pending = batch->pending_calls[i];
+
+      if (!_dbus_pending_call_get_completed_unlocked (pending) &&
+          _dbus_pending_call_get_reply_link_unlocked (pending) == NULL)
+        _dbus_pending_call_queue_timeout_error_unlocked (pending, connection);
+    }
+
+  if (batch->timeout_added)
+    _dbus_connection_remove_timeout_unlocked (connection, batch->timeout);
+  batch->timeout_added = FALSE;
+
+  status = _dbus_connection_get_dispatch_status_unlocked (connection);
+
+  /* Unlocks, and calls out to user code */
+  _dbus_connection_update_dispatch_status_and_unlock (connection, status);
+
+  return TRUE;
+}
+
 static dbus_bool_t
 reply_handler_timeout (void *data)
 {
@@ -3281,9 +4897,7 @@ reply_handler_timeout (void *data)
 
   _dbus_pending_call_queue_timeout_error_unlocked (pending, 
                                                    connection);
-  _dbus_connection_remove_timeout_unlocked (connection,
-				            _dbus_pending_call_get_timeout_unlocked (pending));
-  _dbus_pending_call_set_timeout_added_unlocked (pending, FALSE);
+  _dbus_connection_unschedule_pending_call_unlocked (connection, pending);
 
   _dbus_verbose ("middle\n");
   status = _dbus_connection_get_dispatch_status_unlocked (connection);
@@ -3437,6 +5051,187 @@ dbus_connection_send_with_reply (DBusConnection     *connection,
   return FALSE;
 }
 
+/**
+ * Queues a batch of method calls in one operation, and arranges for a
+ * single callback once every one of them has a reply. This is cheaper
+ * than calling dbus_connection_send_with_reply() for each message
+ * when fanning out many calls: the messages are queued under one lock
+ * and written together, and the whole batch shares one deadline, so
+ * the main loop sees one #DBusTimeout instead of one per call.
+ *
+ * The callback receives the calls in the same order as the messages;
+ * use dbus_pending_call_steal_reply() on each of them. A call that
+ * gets no reply before the deadline completes with a
+ * #DBUS_ERROR_NO_REPLY error, as with dbus_connection_send_with_reply().
+ * The calls are unreferenced after the callback returns, so reference
+ * any that must outlive it. Don't set a notify function on, cancel or
+ * block on the individual calls; the batch relies on their
+ * completion and their deadline is only enforced from the main loop.
+ *
+ * @param connection the connection
+ * @param messages the method calls to send
+ * @param n_messages number of messages, at least one
+ * @param timeout_milliseconds timeout shared by the whole batch, -1 for default or INT_MAX for no timeout
+ * @param function called when all calls have a reply
+ * @param user_data data to pass to function
+ * @param free_user_data function to free user_data
+ * @returns #FALSE if no memory, if the connection is disconnected, or if it cannot pass the unix fds in a message
+ */
+dbus_bool_t
+dbus_connection_send_with_reply_batch (DBusConnection                     *connection,
+                                       DBusMessage                       **messages,
+                                       int                                 n_messages,
+                                       int                                 timeout_milliseconds,
+                                       DBusPendingCallBatchNotifyFunction  function,
+                                       void                               *user_data,
+                                       DBusFreeFunction                    free_user_data)
+{
+  PendingCallBatch *batch;
+  DBusPreallocatedSend **preallocated;
+  DBusDispatchStatus status;
+  int n_attached;
+  int i;
+
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (messages != NULL, FALSE);
+  _dbus_return_val_if_fail (n_messages > 0, FALSE);
+  _dbus_return_val_if_fail (timeout_milliseconds >= 0 || timeout_milliseconds == -1, FALSE);
+  _dbus_return_val_if_fail (function != NULL, FALSE);
+
+  if (timeout_milliseconds == -1)
+    timeout_milliseconds = _DBUS_DEFAULT_TIMEOUT_VALUE;
+
+  batch = dbus_new0 (PendingCallBatch, 1);
+  if (batch == NULL)
+    return FALSE;
+
+  batch->pending_calls = dbus_new0 (DBusPendingCall*, n_messages);
+  preallocated = dbus_new0 (DBusPreallocatedSend*, n_messages);
+  if (batch->pending_calls == NULL || preallocated == NULL)
+    {
+      dbus_free (preallocated);
+      pending_call_batch_free (batch);
+      return FALSE;
+    }
+
+  batch->connection = connection;
+  batch->n_pending_calls = n_messages;
+  batch->n_remaining.value = n_messages;
+
+  if (timeout_milliseconds != _DBUS_INT_MAX)
+    {
+      batch->timeout = _dbus_timeout_new (timeout_milliseconds,
+                                          pending_call_batch_timeout,
+                                          batch, NULL);
+      if (batch->timeout == NULL)
+        {
+          dbus_free (preallocated);
+          pending_call_batch_free (batch);
+          return FALSE;
+        }
+    }
+
+  n_attached = 0;
+
+  CONNECTION_LOCK (connection);
+
+  if (!_dbus_connection_get_is_connected_unlocked (connection))
+    goto error;
+
+  /* Allocate everything first, so that once the first message is
+   * queued nothing can fail
+   */
+  for (i = 0; i < n_messages; i++)
+    {
+      DBusMessage *message = messages[i];
+      DBusPendingCall *pending;
+      dbus_uint32_t serial;
+
+#ifdef HAVE_UNIX_FD_PASSING
+      if (!_dbus_transport_can_pass_unix_fd(connection->transport) &&
+          message->n_unix_fds > 0)
+        goto error;
+#endif
+
+      pending = _dbus_pending_call_new_unlocked (connection,
+                                                 _DBUS_INT_MAX,
+                                                 reply_handler_timeout);
+      if (pending == NULL)
+        goto error;
+
+      batch->pending_calls[i] = pending;
+
+      serial = dbus_message_get_serial (message);
+      if (serial == 0)
+        {
+          serial = _dbus_connection_get_next_client_serial (connection);
+          dbus_message_set_serial (message, serial);
+        }
+
+      if (!_dbus_pending_call_set_timeout_error_unlocked (pending, message, serial))
+        goto error;
+
+      if (!_dbus_pending_call_set_notify_unlocked (pending,
+                                                   pending_call_batch_call_completed,
+                                                   batch))
+        goto error;
+
+      preallocated[i] = _dbus_connection_preallocate_send_unlocked (connection);
+      if (preallocated[i] == NULL)
+        goto error;
+
+      if (!_dbus_connection_attach_pending_call_unlocked (connection, pending))
+        goto error;
+
+      n_attached += 1;
+    }
+
+  if (batch->timeout)
+    {
+      if (!_dbus_connection_add_timeout_unlocked (connection, batch->timeout))
+        goto error;
+
+      batch->timeout_added = TRUE;
+    }
+
+  batch->function = function;
+  batch->user_data = user_data;
+  batch->free_user_data = free_user_data;
+
+  for (i = 0; i < n_messages; i++)
+    _dbus_connection_queue_preallocated_unlocked (connection, preallocated[i],
+                                                  messages[i], NULL);
+  dbus_free (preallocated);
+
+  _dbus_connection_write_queued_unlocked (connection);
+
+  status = _dbus_connection_get_dispatch_status_unlocked (connection);
+
+  /* this calls out to user code */
+  _dbus_connection_update_dispatch_status_and_unlock (connection, status);
+
+  return TRUE;
+
+ error:
+  for (i = 0; i < n_attached; i++)
+    _dbus_connection_detach_pending_call_unlocked (connection,
+                                                   batch->pending_calls[i]);
+
+  for (i = 0; i < n_messages; i++)
+    {
+      if (preallocated[i] != NULL)
+        _dbus_connection_free_preallocated_send_unlocked (connection,
+                                                          preallocated[i]);
+    }
+
+  CONNECTION_UNLOCK (connection);
+
+  dbus_free (preallocated);
+  pending_call_batch_free (batch);
+
+  return FALSE;
+}
+
 /**
  * Sends a message and blocks a certain time period while waiting for
  * a reply.  This function does not reenter the main loop,
@@ -3596,6 +5391,41 @@ dbus_connection_flush (DBusConnection *connection)
   _dbus_verbose ("end\n");
 }
 
+/**
+ * Corks or uncorks the connection. While a connection is corked,
+ * dbus_connection_send() and friends only add messages to the
+ * outgoing queue; they don't try to write them out or wake up the
+ * main loop. Uncorking writes out everything queued meanwhile, so a
+ * burst of small messages goes out in as few system calls as the
+ * transport can manage instead of one write per message.
+ *
+ * dbus_connection_flush() still blocks until the queue is empty while
+ * the connection is corked. Don't leave a connection corked for long;
+ * nothing sent meanwhile reaches the peer until it is uncorked or
+ * flushed.
+ *
+ * @param connection the connection
+ * @param corked #TRUE to cork, #FALSE to uncork and write out queued messages
+ */
+void
+dbus_connection_set_corked (DBusConnection *connection,
+                            dbus_bool_t     corked)
+{
+  DBusDispatchStatus status;
+
+  _dbus_return_if_fail (connection != NULL);
+
+  CONNECTION_LOCK (connection);
+
+  connection->corked = corked != FALSE;
+  _dbus_connection_write_queued_unlocked (connection);
+
+  status = _dbus_connection_get_dispatch_status_unlocked (connection);
+
+  /* Unlocks and calls out to user code */
+  _dbus_connection_update_dispatch_status_and_unlock (connection, status);
+}
+
 /**
  * This function implements dbus_connection_read_write_dispatch() and
  * dbus_connection_read_write() (they pass a different value for the
@@ -3919,6 +5749,8 @@ dbus_connection_steal_borrowed_message (DBusConnection *connection,
  
   _dbus_assert (message == connection->message_borrowed);
 
+  connection_unindex_queued_reply_unlocked (connection,
+                                            _dbus_list_get_first_link (&connection->incoming_messages));
   pop_message = _dbus_list_pop_first (&connection->incoming_messages);
   _dbus_assert (message == pop_message);
   
@@ -3935,6 +5767,33 @@ dbus_connection_steal_borrowed_message (DBusConnection *connection,
   _dbus_connection_update_dispatch_status_and_unlock (connection, status);
 }
 
+/* Drops method calls and signals from the head of the incoming queue
+ * for as long as their expiry has passed. Replies are kept, since a
+ * pending call that got one no longer times out by itself.
+ */
+static void
+_dbus_connection_drop_expired_incoming_unlocked (DBusConnection *connection)
+{
+  DBusList *link;
+
+  HAVE_LOCK_CHECK (connection);
+
+  while ((link = _dbus_list_get_first_link (&connection->incoming_messages)) != NULL &&
+         dbus_message_get_reply_serial (link->data) == 0 &&
+         _dbus_message_has_expired (link->data))
+    {
+      _dbus_list_unlink (&connection->incoming_messages, link);
+      connection->n_incoming -= 1;
+      connection->n_messages_expired += 1;
+
+      _dbus_verbose ("Message %p expired before it was dispatched, %d incoming\n",
+                     link->data, connection->n_incoming);
+
+      dbus_message_unref (link->data);
+      _dbus_list_free_link (link);
+    }
+}
+
 /* See dbus_connection_pop_message, but requires the caller to own
  * the lock before calling. May drop the lock while running.
  */
@@ -3944,6 +5803,8 @@ _dbus_connection_pop_message_link_unlocked (DBusConnection *connection)
   HAVE_LOCK_CHECK (connection);
   
   _dbus_assert (connection->message_borrowed == NULL);
+
+  _dbus_connection_drop_expired_incoming_unlocked (connection);
   
   if (connection->n_incoming > 0)
     {
@@ -3952,6 +5813,8 @@ _dbus_connection_pop_message_link_unlocked (DBusConnection *connection)
       link = _dbus_list_pop_first_link (&connection->incoming_messages);
       connection->n_incoming -= 1;
 
+      connection_unindex_queued_reply_unlocked (connection, link);
+
       _dbus_verbose ("Message %p (%s %s %s %s '%s') removed from incoming queue %p, %d incoming\n",
                      link->data,
                      dbus_message_type_to_string (dbus_message_get_type (link->data)),
@@ -4015,6 +5878,7 @@ _dbus_connection_putback_message_link_unlocked (DBusConnection *connection,
 
   _dbus_list_prepend_link (&connection->incoming_messages,
                            message_link);
+  connection_index_queued_reply_unlocked (connection, message_link);
   connection->n_incoming += 1;
 
   _dbus_verbose ("Message %p (%s %s %s '%s') put back into queue %p, %d incoming\n",
@@ -4096,13 +5960,15 @@ _dbus_connection_acquire_dispatch (DBusConnection *connection)
   CONNECTION_UNLOCK (connection);
   
   _dbus_verbose ("locking dispatch_mutex\n");
-  _dbus_mutex_lock (connection->dispatch_mutex);
+  _dbus_mutex_lock_in (connection->dispatch_mutex,
+                       DBUS_LOCK_CLASS_CONNECTION_DISPATCH);
 
   while (connection->dispatch_acquired)
     {
       _dbus_verbose ("waiting for dispatch to be acquirable\n");
-      _dbus_condvar_wait (connection->dispatch_cond, 
-                          connection->dispatch_mutex);
+      _dbus_condvar_wait_in (connection->dispatch_cond,
+                             connection->dispatch_mutex,
+                             DBUS_LOCK_CLASS_CONNECTION_DISPATCH);
     }
   
   _dbus_assert (!connection->dispatch_acquired);
@@ -4129,7 +5995,8 @@ _dbus_connection_release_dispatch (DBusConnection *connection)
   HAVE_LOCK_CHECK (connection);
   
   _dbus_verbose ("locking dispatch_mutex\n");
-  _dbus_mutex_lock (connection->dispatch_mutex);
+  _dbus_mutex_lock_in (connection->dispatch_mutex,
+                       DBUS_LOCK_CLASS_CONNECTION_DISPATCH);
   
   _dbus_assert (connection->dispatch_acquired);
 
@@ -4140,15 +6007,6 @@ _dbus_connection_release_dispatch (DBusConnection *connection)
   _dbus_mutex_unlock (connection->dispatch_mutex);
 }
 
-static void
-_dbus_connection_failed_pop (DBusConnection *connection,
-			     DBusList       *message_link)
-{
-  _dbus_list_prepend_link (&connection->incoming_messages,
-			   message_link);
-  connection->n_incoming += 1;
-}
-
 /* Note this may be called multiple times since we don't track whether we already did it */
 static void
 notify_disconnected_unlocked (DBusConnection *connection)
@@ -4466,170 +6324,111 @@ _dbus_connection_run_builtin_filters_unlocked_no_update (DBusConnection *connect
   return _dbus_connection_peer_filter_unlocked_no_update (connection, message);
 }
 
-/**
- * Processes any incoming data.
- *
- * If there's incoming raw data that has not yet been parsed, it is
- * parsed, which may or may not result in adding messages to the
- * incoming queue.
- *
- * The incoming data buffer is filled when the connection reads from
- * its underlying transport (such as a socket).  Reading usually
- * happens in dbus_watch_handle() or dbus_connection_read_write().
- * 
- * If there are complete messages in the incoming queue,
- * dbus_connection_dispatch() removes one message from the queue and
- * processes it. Processing has three steps.
- *
- * First, any method replies are passed to #DBusPendingCall or
- * dbus_connection_send_with_reply_and_block() in order to
- * complete the pending method call.
- * 
- * Second, any filters registered with dbus_connection_add_filter()
- * are run. If any filter returns #DBUS_HANDLER_RESULT_HANDLED
- * then processing stops after that filter.
- *
- * Third, if the message is a method call it is forwarded to
- * any registered object path handlers added with
- * dbus_connection_register_object_path() or
- * dbus_connection_register_fallback().
- *
- * A single call to dbus_connection_dispatch() will process at most
- * one message; it will not clear the entire message queue.
- *
- * Be careful about calling dbus_connection_dispatch() from inside a
- * message handler, i.e. calling dbus_connection_dispatch()
- * recursively.  If threads have been initialized with a recursive
- * mutex function, then this will not deadlock; however, it can
- * certainly confuse your application.
- * 
- * @todo some FIXME in here about handling DBUS_HANDLER_RESULT_NEED_MEMORY
- * 
- * @param connection the connection
- * @returns dispatch status, see dbus_connection_get_dispatch_status()
+/*
+ * A referenced copy of a connection's filter list, so filters can run
+ * without the lock. Dispatching several messages at once reuses one
+ * snapshot for as long as no filter is added or removed.
  */
-DBusDispatchStatus
-dbus_connection_dispatch (DBusConnection *connection)
+typedef struct
 {
-  DBusMessage *message;
-  DBusList *link, *filter_list_copy, *message_link;
-  DBusHandlerResult result;
-  DBusPendingCall *pending;
-  dbus_int32_t reply_serial;
-  DBusDispatchStatus status;
+  DBusList *filters;      /**< Referenced copy of filter_list */
+  DBusList *retired;      /**< Older snapshots, unreferenced by filter_snapshot_free() */
+  int serial;             /**< filter_list_serial when filters was copied */
+  dbus_bool_t valid;      /**< Whether filters has been copied at all */
+} FilterSnapshot;
 
-  _dbus_return_val_if_fail (connection != NULL, DBUS_DISPATCH_COMPLETE);
-
-  _dbus_verbose ("\n");
-  
-  CONNECTION_LOCK (connection);
-  status = _dbus_connection_get_dispatch_status_unlocked (connection);
-  if (status != DBUS_DISPATCH_DATA_REMAINS)
-    {
-      /* unlocks and calls out to user code */
-      _dbus_connection_update_dispatch_status_and_unlock (connection, status);
-      return status;
-    }
-  
-  /* We need to ref the connection since the callback could potentially
-   * drop the last ref to it
-   */
-  _dbus_connection_ref_unlocked (connection);
-
-  _dbus_connection_acquire_dispatch (connection);
-  HAVE_LOCK_CHECK (connection);
-
-  message_link = _dbus_connection_pop_message_link_unlocked (connection);
-  if (message_link == NULL)
-    {
-      /* another thread dispatched our stuff */
+static void
+filter_snapshot_init (FilterSnapshot *snapshot)
+{
+  snapshot->filters = NULL;
+  snapshot->retired = NULL;
+  snapshot->serial = 0;
+  snapshot->valid = FALSE;
+}
 
-      _dbus_verbose ("another thread dispatched message (during acquire_dispatch above)\n");
-      
-      _dbus_connection_release_dispatch (connection);
+/*
+ * Makes the snapshot match the connection's current filter list.
+ * Called with the lock held. Returns #FALSE if no memory.
+ */
+static dbus_bool_t
+filter_snapshot_update_unlocked (DBusConnection *connection,
+                                 FilterSnapshot *snapshot)
+{
+  DBusList *copy;
+  DBusList *link;
 
-      status = _dbus_connection_get_dispatch_status_unlocked (connection);
+  HAVE_LOCK_CHECK (connection);
 
-      _dbus_connection_update_dispatch_status_and_unlock (connection, status);
-      
-      dbus_connection_unref (connection);
-      
-      return status;
-    }
+  if (snapshot->valid && snapshot->serial == connection->filter_list_serial)
+    return TRUE;
 
-  message = message_link->data;
+  if (!_dbus_list_copy (&connection->filter_list, &copy))
+    return FALSE;
 
-  _dbus_verbose (" dispatching message %p (%s %s %s '%s')\n",
-                 message,
-                 dbus_message_type_to_string (dbus_message_get_type (message)),
-                 dbus_message_get_interface (message) ?
-                 dbus_message_get_interface (message) :
-                 "no interface",
-                 dbus_message_get_member (message) ?
-                 dbus_message_get_member (message) :
-                 "no member",
-                 dbus_message_get_signature (message));
+  _dbus_list_foreach (&copy,
+		      (DBusForeachFunction)_dbus_message_filter_ref,
+		      NULL);
 
-  result = DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
-  
-  /* Pending call handling must be first, because if you do
-   * dbus_connection_send_with_reply_and_block() or
-   * dbus_pending_call_block() then no handlers/filters will be run on
-   * the reply. We want consistent semantics in the case where we
-   * dbus_connection_dispatch() the reply.
+  /* The old snapshot may hold the last reference to a removed filter,
+   * whose free function can't be run with the lock held
    */
-  
-  reply_serial = dbus_message_get_reply_serial (message);
-  pending = _dbus_hash_table_lookup_int (connection->pending_replies,
-                                         reply_serial);
-  if (pending)
-    {
-      _dbus_verbose ("Dispatching a pending reply\n");
-      complete_pending_call_and_unlock (connection, pending, message);
-      pending = NULL; /* it's probably unref'd */
-      
-      CONNECTION_LOCK (connection);
-      _dbus_verbose ("pending call completed in dispatch\n");
-      result = DBUS_HANDLER_RESULT_HANDLED;
-      goto out;
-    }
+  while ((link = _dbus_list_pop_first_link (&snapshot->filters)) != NULL)
+    _dbus_list_append_link (&snapshot->retired, link);
 
-  result = _dbus_connection_run_builtin_filters_unlocked_no_update (connection, message);
-  if (result != DBUS_HANDLER_RESULT_NOT_YET_HANDLED)
-    goto out;
- 
-  if (!_dbus_list_copy (&connection->filter_list, &filter_list_copy))
-    {
-      _dbus_connection_release_dispatch (connection);
-      HAVE_LOCK_CHECK (connection);
-      
-      _dbus_connection_failed_pop (connection, message_link);
+  snapshot->filters = copy;
+  snapshot->serial = connection->filter_list_serial;
+  snapshot->valid = TRUE;
 
-      /* unlocks and calls user code */
-      _dbus_connection_update_dispatch_status_and_unlock (connection,
-                                                          DBUS_DISPATCH_NEED_MEMORY);
+  return TRUE;
+}
 
-      if (pending)
-        dbus_pending_call_unref (pending);
-      dbus_connection_unref (connection);
-      
-      return DBUS_DISPATCH_NEED_MEMORY;
-    }
-  
-  _dbus_list_foreach (&filter_list_copy,
-		      (DBusForeachFunction)_dbus_message_filter_ref,
+/*
+ * Releases a snapshot. Must be called without the lock, since this
+ * may run the free functions of removed filters.
+ */
+static void
+filter_snapshot_free (FilterSnapshot *snapshot)
+{
+  _dbus_list_foreach (&snapshot->filters,
+		      (DBusForeachFunction)_dbus_message_filter_unref,
+		      NULL);
+  _dbus_list_clear (&snapshot->filters);
+
+  _dbus_list_foreach (&snapshot->retired,
+		      (DBusForeachFunction)_dbus_message_filter_unref,
 		      NULL);
+  _dbus_list_clear (&snapshot->retired);
+}
+
+/*
+ * Runs the filters in snapshot, then the object path handlers, on a
+ * message, replying with an UnknownMethod error if nothing handled a
+ * method call. Called with the lock held and returns with it held,
+ * but drops it around application callbacks.
+ */
+static DBusHandlerResult
+_dbus_connection_run_handlers_unlocked (DBusConnection *connection,
+                                        DBusMessage    *message,
+                                        FilterSnapshot *snapshot)
+{
+  DBusList *link;
+  DBusHandlerResult result;
 
-  /* We're still protected from dispatch() reentrancy here
-   * since we acquired the dispatcher
+  HAVE_LOCK_CHECK (connection);
+
+  result = DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  /* Either we're still protected from dispatch() reentrancy here
+   * since we acquired the dispatcher, or we are running on behalf
+   * of the dispatch executor
    */
   CONNECTION_UNLOCK (connection);
   
-  link = _dbus_list_get_first_link (&filter_list_copy);
+  link = _dbus_list_get_first_link (&snapshot->filters);
   while (link != NULL)
     {
       DBusMessageFilter *filter = link->data;
-      DBusList *next = _dbus_list_get_next_link (&filter_list_copy, link);
+      DBusList *next = _dbus_list_get_next_link (&snapshot->filters, link);
 
       if (filter->function == NULL)
         {
@@ -4646,27 +6445,23 @@ dbus_connection_dispatch (DBusConnection *connection)
 
       link = next;
     }
-
-  _dbus_list_foreach (&filter_list_copy,
-		      (DBusForeachFunction)_dbus_message_filter_unref,
-		      NULL);
-  _dbus_list_clear (&filter_list_copy);
   
   CONNECTION_LOCK (connection);
 
   if (result == DBUS_HANDLER_RESULT_NEED_MEMORY)
     {
       _dbus_verbose ("No memory\n");
-      goto out;
+      return result;
     }
   else if (result == DBUS_HANDLER_RESULT_HANDLED)
     {
       _dbus_verbose ("filter handled message in dispatch\n");
-      goto out;
+      return result;
     }
 
-  /* We're still protected from dispatch() reentrancy here
-   * since we acquired the dispatcher
+  /* Either we're still protected from dispatch() reentrancy here
+   * since we acquired the dispatcher, or we are running on behalf
+   * of the dispatch executor
    */
   _dbus_verbose ("  running object path dispatch on message %p (%s %s %s '%s')\n",
                  message,
@@ -4688,7 +6483,7 @@ dbus_connection_dispatch (DBusConnection *connection)
   if (result != DBUS_HANDLER_RESULT_NOT_YET_HANDLED)
     {
       _dbus_verbose ("object tree handled message in dispatch\n");
-      goto out;
+      return result;
     }
 
   if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_METHOD_CALL)
@@ -4704,7 +6499,7 @@ dbus_connection_dispatch (DBusConnection *connection)
         {
           result = DBUS_HANDLER_RESULT_NEED_MEMORY;
           _dbus_verbose ("no memory for error string in dispatch\n");
-          goto out;
+          return result;
         }
               
       if (!_dbus_string_append_printf (&str,
@@ -4716,7 +6511,7 @@ dbus_connection_dispatch (DBusConnection *connection)
           _dbus_string_free (&str);
           result = DBUS_HANDLER_RESULT_NEED_MEMORY;
           _dbus_verbose ("no memory for error string in dispatch\n");
-          goto out;
+          return result;
         }
       
       reply = dbus_message_new_error (message,
@@ -4728,7 +6523,7 @@ dbus_connection_dispatch (DBusConnection *connection)
         {
           result = DBUS_HANDLER_RESULT_NEED_MEMORY;
           _dbus_verbose ("no memory for error reply in dispatch\n");
-          goto out;
+          return result;
         }
       
       preallocated = _dbus_connection_preallocate_send_unlocked (connection);
@@ -4738,7 +6533,7 @@ dbus_connection_dispatch (DBusConnection *connection)
           dbus_message_unref (reply);
           result = DBUS_HANDLER_RESULT_NEED_MEMORY;
           _dbus_verbose ("no memory for error send in dispatch\n");
-          goto out;
+          return result;
         }
 
       _dbus_connection_send_preallocated_unlocked_no_update (connection, preallocated,
@@ -4748,6 +6543,187 @@ dbus_connection_dispatch (DBusConnection *connection)
       
       result = DBUS_HANDLER_RESULT_HANDLED;
     }
+
+  return result;
+}
+
+/*
+ * The key under which a message is handed to the dispatch executor:
+ * messages to the same object path share a key, so keep their order.
+ * This is the same string hash as dbus-hash.c uses.
+ */
+static unsigned long
+dispatch_executor_key (DBusMessage *message)
+{
+  const char *p;
+  unsigned long h;
+
+  p = dbus_message_get_path (message);
+  if (p == NULL)
+    return 0;
+
+  h = *p;
+  if (h)
+    for (p += 1; *p != '\0'; p++)
+      h = (h << 5) - h + *p;
+
+  return h;
+}
+
+/**
+ * Processes any incoming data.
+ *
+ * If there's incoming raw data that has not yet been parsed, it is
+ * parsed, which may or may not result in adding messages to the
+ * incoming queue.
+ *
+ * The incoming data buffer is filled when the connection reads from
+ * its underlying transport (such as a socket).  Reading usually
+ * happens in dbus_watch_handle() or dbus_connection_read_write().
+ * 
+ * If there are complete messages in the incoming queue,
+ * dbus_connection_dispatch() removes one message from the queue and
+ * processes it. Processing has three steps.
+ *
+ * First, any method replies are passed to #DBusPendingCall or
+ * dbus_connection_send_with_reply_and_block() in order to
+ * complete the pending method call.
+ * 
+ * Second, any filters registered with dbus_connection_add_filter()
+ * are run. If any filter returns #DBUS_HANDLER_RESULT_HANDLED
+ * then processing stops after that filter.
+ *
+ * Third, if the message is a method call it is forwarded to
+ * any registered object path handlers added with
+ * dbus_connection_register_object_path() or
+ * dbus_connection_register_fallback().
+ *
+ * If a dispatch executor was set with
+ * dbus_connection_set_dispatch_executor(), the second and third steps
+ * are not run by dbus_connection_dispatch(); the message is handed to
+ * the executor instead, which runs them with
+ * dbus_connection_handle_message().
+ *
+ * A single call to dbus_connection_dispatch() will process at most
+ * one message; it will not clear the entire message queue.
+ *
+ * Be careful about calling dbus_connection_dispatch() from inside a
+ * message handler, i.e. calling dbus_connection_dispatch()
+ * recursively.  If threads have been initialized with a recursive
+ * mutex function, then this will not deadlock; however, it can
+ * certainly confuse your application.
+ * 
+ * @todo some FIXME in here about handling DBUS_HANDLER_RESULT_NEED_MEMORY
+ * 
+ * @param connection the connection
+ * @returns dispatch status, see dbus_connection_get_dispatch_status()
+ */
+DBusDispatchStatus
+dbus_connection_dispatch (DBusConnection *connection)
+{
+  return dbus_connection_dispatch_batch (connection, 1);
+}
+
+/*
+ * Dispatches one message popped from the incoming queue, as described
+ * for dbus_connection_dispatch(). Called with the lock held and the
+ * dispatcher acquired. If this returns #DBUS_HANDLER_RESULT_NEED_MEMORY
+ * the message has been put back, and *no_memory_for_filters says
+ * whether it was copying the filter list that failed.
+ */
+static DBusHandlerResult
+_dbus_connection_dispatch_link_unlocked (DBusConnection *connection,
+                                         DBusList       *message_link,
+                                         FilterSnapshot *snapshot,
+                                         dbus_bool_t    *no_memory_for_filters)
+{
+  DBusMessage *message;
+  DBusHandlerResult result;
+  DBusPendingCall *pending;
+  dbus_int32_t reply_serial;
+
+  HAVE_LOCK_CHECK (connection);
+
+  message = message_link->data;
+  connection->n_dispatched += 1;
+
+  _dbus_verbose (" dispatching message %p (%s %s %s '%s')\n",
+                 message,
+                 dbus_message_type_to_string (dbus_message_get_type (message)),
+                 dbus_message_get_interface (message) ?
+                 dbus_message_get_interface (message) :
+                 "no interface",
+                 dbus_message_get_member (message) ?
+                 dbus_message_get_member (message) :
+                 "no member",
+                 dbus_message_get_signature (message));
+
+  _dbus_trace3 (message__dispatch, connection, message,
+                dbus_message_get_type (message));
+
+  result = DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  
+  /* Pending call handling must be first, because if you do
+   * dbus_connection_send_with_reply_and_block() or
+   * dbus_pending_call_block() then no handlers/filters will be run on
+   * the reply. We want consistent semantics in the case where we
+   * dbus_connection_dispatch() the reply.
+   */
+  
+  reply_serial = dbus_message_get_reply_serial (message);
+  pending = _dbus_hash_table_lookup_int (connection->pending_replies,
+                                         reply_serial);
+  if (pending)
+    {
+      _dbus_verbose ("Dispatching a pending reply\n");
+      complete_pending_call_and_unlock (connection, pending, message);
+      pending = NULL; /* it's probably unref'd */
+      
+      CONNECTION_LOCK (connection);
+      _dbus_verbose ("pending call completed in dispatch\n");
+      result = DBUS_HANDLER_RESULT_HANDLED;
+      goto out;
+    }
+
+  result = _dbus_connection_run_builtin_filters_unlocked_no_update (connection, message);
+  if (result != DBUS_HANDLER_RESULT_NOT_YET_HANDLED)
+    goto out;
+
+  if (connection->dispatch_executor_function != NULL)
+    {
+      DBusDispatchExecutorFunction function;
+      void *data;
+      unsigned long key;
+
+      function = connection->dispatch_executor_function;
+      data = connection->dispatch_executor_data;
+      key = dispatch_executor_key (message);
+
+      /* The executor runs dbus_connection_handle_message() later,
+       * possibly on another thread, so calls on other object paths
+       * need not wait for this one
+       */
+      CONNECTION_UNLOCK (connection);
+
+      _dbus_verbose ("  handing message %p to the dispatch executor\n", message);
+      if ((* function) (connection, message, key, data))
+        result = DBUS_HANDLER_RESULT_HANDLED;
+      else
+        result = DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+      CONNECTION_LOCK (connection);
+      goto out;
+    }
+ 
+  if (!filter_snapshot_update_unlocked (connection, snapshot))
+    {
+      *no_memory_for_filters = TRUE;
+      result = DBUS_HANDLER_RESULT_NEED_MEMORY;
+      goto out;
+    }
+  
+  result = _dbus_connection_run_handlers_unlocked (connection, message,
+                                                   snapshot);
   
   _dbus_verbose ("  done dispatching %p (%s %s %s '%s') on connection %p\n", message,
                  dbus_message_type_to_string (dbus_message_get_type (message)),
@@ -4781,16 +6757,95 @@ dbus_connection_dispatch (DBusConnection *connection)
                                      * in computing dispatch status below
                                      */
     }
+
+  return result;
+}
+
+/**
+ * Processes up to max_messages incoming messages, as if by calling
+ * dbus_connection_dispatch() that many times, but acquiring the
+ * dispatcher only once. The filter list is copied once for the whole
+ * batch unless a filter is added or removed meanwhile, and the
+ * dispatch status function is only called at the end rather than
+ * after every message.
+ *
+ * Stops early once the incoming queue is drained, or if a handler
+ * runs out of memory. Larger batches let other threads wait longer
+ * for the dispatcher, so keep max_messages modest if several threads
+ * dispatch the same connection.
+ *
+ * @param connection the connection
+ * @param max_messages most messages to process, at least one
+ * @returns dispatch status, see dbus_connection_get_dispatch_status()
+ */
+DBusDispatchStatus
+dbus_connection_dispatch_batch (DBusConnection *connection,
+                                int             max_messages)
+{
+  FilterSnapshot snapshot;
+  DBusList *message_link;
+  DBusDispatchStatus status;
+  dbus_bool_t no_memory_for_filters;
+  int n_dispatched;
+
+  _dbus_return_val_if_fail (connection != NULL, DBUS_DISPATCH_COMPLETE);
+  _dbus_return_val_if_fail (max_messages > 0, DBUS_DISPATCH_COMPLETE);
+
+  _dbus_verbose ("\n");
+  
+  CONNECTION_LOCK (connection);
+  status = _dbus_connection_get_dispatch_status_unlocked (connection);
+  if (status != DBUS_DISPATCH_DATA_REMAINS)
+    {
+      /* unlocks and calls out to user code */
+      _dbus_connection_update_dispatch_status_and_unlock (connection, status);
+      return status;
+    }
+  
+  /* We need to ref the connection since the callback could potentially
+   * drop the last ref to it
+   */
+  _dbus_connection_ref_unlocked (connection);
+
+  _dbus_connection_acquire_dispatch (connection);
+  HAVE_LOCK_CHECK (connection);
+
+  filter_snapshot_init (&snapshot);
+  no_memory_for_filters = FALSE;
+
+  for (n_dispatched = 0; n_dispatched < max_messages; n_dispatched++)
+    {
+      if (n_dispatched > 0 &&
+          _dbus_connection_get_dispatch_status_unlocked (connection) != DBUS_DISPATCH_DATA_REMAINS)
+        break;
+
+      message_link = _dbus_connection_pop_message_link_unlocked (connection);
+      if (message_link == NULL)
+        {
+          /* another thread dispatched our stuff */
+          _dbus_verbose ("another thread dispatched message (during acquire_dispatch above)\n");
+          break;
+        }
+
+      if (_dbus_connection_dispatch_link_unlocked (connection, message_link,
+                                                   &snapshot,
+                                                   &no_memory_for_filters) == DBUS_HANDLER_RESULT_NEED_MEMORY)
+        break;
+    }
   
   _dbus_connection_release_dispatch (connection);
   HAVE_LOCK_CHECK (connection);
 
   _dbus_verbose ("before final status update\n");
-  status = _dbus_connection_get_dispatch_status_unlocked (connection);
+  if (no_memory_for_filters)
+    status = DBUS_DISPATCH_NEED_MEMORY;
+  else
+    status = _dbus_connection_get_dispatch_status_unlocked (connection);
 
   /* unlocks and calls user code */
   _dbus_connection_update_dispatch_status_and_unlock (connection, status);
-  
+
+  filter_snapshot_free (&snapshot);
   dbus_connection_unref (connection);
   
   return status;
@@ -5030,6 +7085,106 @@ dbus_connection_set_dispatch_status_function (DBusConnection             *connec
     (*old_free_data) (old_data);
 }
 
+/**
+ * Sets a function that takes over handling of incoming messages from
+ * dbus_connection_dispatch(). Replies to pending calls are still
+ * completed by dbus_connection_dispatch(), but every other message is
+ * passed to the executor function, which should take a reference to
+ * it and queue it onto a worker pool. A worker then calls
+ * dbus_connection_handle_message() to run the filters and object
+ * path handlers, and may send replies with dbus_connection_send() as
+ * usual. This lets CPU-heavy handlers use more than one thread per
+ * connection, since they no longer run under the dispatch lock.
+ *
+ * The key passed to the executor is derived from the message's object
+ * path. Messages for the same object must be handled in the order
+ * they were handed over, so the pool should serialize messages with
+ * equal keys; an executor that wants a different ordering domain may
+ * compute its own key from the message instead. The executor returns
+ * #FALSE if it ran out of memory, in which case the message is put
+ * back and dispatched again later.
+ *
+ * The executor is called without the connection lock held, but must
+ * not call dbus_connection_dispatch() itself. Filters and object path
+ * handlers may run concurrently on several threads once an executor
+ * is set, so they must be thread-safe.
+ *
+ * @param connection the connection
+ * @param function function to hand messages to, or #NULL to handle them in dispatch
+ * @param data data for function
+ * @param free_data_function free the function data
+ */
+void
+dbus_connection_set_dispatch_executor (DBusConnection               *connection,
+                                       DBusDispatchExecutorFunction  function,
+                                       void                         *data,
+                                       DBusFreeFunction              free_data_function)
+{
+  void *old_data;
+  DBusFreeFunction old_free_data;
+
+  _dbus_return_if_fail (connection != NULL);
+  
+  CONNECTION_LOCK (connection);
+  old_data = connection->dispatch_executor_data;
+  old_free_data = connection->free_dispatch_executor_data;
+
+  connection->dispatch_executor_function = function;
+  connection->dispatch_executor_data = data;
+  connection->free_dispatch_executor_data = free_data_function;
+  
+  CONNECTION_UNLOCK (connection);
+
+  /* Callback outside the lock */
+  if (old_free_data)
+    (*old_free_data) (old_data);
+}
+
+/**
+ * Runs the filters and object path handlers of a connection on a
+ * message that was handed to a dispatch executor, as
+ * dbus_connection_dispatch() would have done. If nothing handles a
+ * method call, an UnknownMethod error is sent back. May be called
+ * from any thread, and from several threads at once; see
+ * dbus_connection_set_dispatch_executor().
+ *
+ * If this returns #DBUS_HANDLER_RESULT_NEED_MEMORY the message was
+ * not handled, and the caller may retry later; handlers must be
+ * idempotent if they don't return #DBUS_HANDLER_RESULT_HANDLED, as
+ * with dbus_connection_dispatch().
+ *
+ * @param connection the connection the message was received on
+ * @param message the message
+ * @returns the result of the handler that took the message
+ */
+DBusHandlerResult
+dbus_connection_handle_message (DBusConnection *connection,
+                                DBusMessage    *message)
+{
+  FilterSnapshot snapshot;
+  DBusHandlerResult result;
+
+  _dbus_return_val_if_fail (connection != NULL, DBUS_HANDLER_RESULT_NOT_YET_HANDLED);
+  _dbus_return_val_if_fail (message != NULL, DBUS_HANDLER_RESULT_NOT_YET_HANDLED);
+
+  dbus_connection_ref (connection);
+  CONNECTION_LOCK (connection);
+
+  filter_snapshot_init (&snapshot);
+  if (!filter_snapshot_update_unlocked (connection, &snapshot))
+    result = DBUS_HANDLER_RESULT_NEED_MEMORY;
+  else
+    result = _dbus_connection_run_handlers_unlocked (connection, message,
+                                                     &snapshot);
+
+  CONNECTION_UNLOCK (connection);
+
+  filter_snapshot_free (&snapshot);
+  dbus_connection_unref (connection);
+
+  return result;
+}
+
 /**
  * Get the UNIX file descriptor of the connection, if any.  This can
  * be used for SELinux access control checks with getpeercon() for
@@ -5256,6 +7411,55 @@ dbus_connection_set_unix_user_function (DBusConnection             *connection,
     (* old_free_function) (old_data);
 }
 
+/**
+ * Sets a function to receive large byte arrays piece by piece as
+ * they are read, rather than holding the whole message in memory.
+ * This is meant for peer-to-peer connections carrying bulk data;
+ * on a bus connection it applies to messages from every peer.
+ *
+ * Once set, any received message whose body is a single byte array
+ * (signature "ay") of 64 KiB or more, and which carries no unix fds,
+ * is streamed: each piece of the array is passed to the function as
+ * soon as it is read, with its offset into the array and the array's
+ * total length, and is not kept afterwards. When the last piece has
+ * been passed, the message itself is queued and dispatched as usual,
+ * but with an empty byte array as its body. The message passed to the
+ * function is the same one that is later dispatched, so it can be
+ * used to tell transfers apart.
+ *
+ * Pieces arrive as they are read, so the function may be called for
+ * a message before messages received ahead of it have been
+ * dispatched. It is called from whichever thread is reading from
+ * the connection, with the connection's lock held, and must not call
+ * any function on the connection. If the function is unset while a
+ * body is being streamed, the rest of that body is dropped.
+ *
+ * @param connection the connection
+ * @param function the function, or #NULL to receive whole messages
+ * @param data data to pass to the function
+ * @param free_data_function function to free the data
+ */
+void
+dbus_connection_set_body_chunk_function (DBusConnection        *connection,
+                                         DBusBodyChunkFunction  function,
+                                         void                  *data,
+                                         DBusFreeFunction       free_data_function)
+{
+  void *old_data = NULL;
+  DBusFreeFunction old_free_function = NULL;
+
+  _dbus_return_if_fail (connection != NULL);
+
+  CONNECTION_LOCK (connection);
+  _dbus_transport_set_body_chunk_function (connection->transport,
+                                           function, data, free_data_function,
+                                           &old_data, &old_free_function);
+  CONNECTION_UNLOCK (connection);
+
+  if (old_free_function != NULL)
+    (* old_free_function) (old_data);
+}
+
 /**
  * Gets the Windows user SID of the connection if known.  Returns
  * #TRUE if the ID is filled in.  Always returns #FALSE on non-Windows
@@ -5420,6 +7624,33 @@ dbus_connection_set_route_peer_messages (DBusConnection             *connection,
   CONNECTION_UNLOCK (connection);
 }
 
+/**
+ * Normally the body of every incoming message is validated as soon
+ * as the message is read from the transport. If lazy body validation
+ * is enabled, the header is still validated then, but the body is
+ * only checked the first time it is read with dbus_message_iter_init()
+ * or dbus_message_get_args(); messages dropped by a filter without
+ * looking at their arguments never pay for it.
+ *
+ * A message whose body turns out to be corrupt then appears to have
+ * no arguments to dbus_message_iter_init(), and dbus_message_get_args()
+ * fails with #DBUS_ERROR_INVALID_ARGS. The connection is not
+ * disconnected, as it would be if the body were validated on receipt.
+ *
+ * @param connection the connection
+ * @param value whether to defer validating message bodies
+ */
+void
+dbus_connection_set_lazy_body_validation (DBusConnection             *connection,
+                                          dbus_bool_t                 value)
+{
+  _dbus_return_if_fail (connection != NULL);
+
+  CONNECTION_LOCK (connection);
+  _dbus_transport_set_lazy_body_validation (connection->transport, value);
+  CONNECTION_UNLOCK (connection);
+}
+
 /**
  * Adds a message filter. Filters are handlers that are run on all
  * incoming messages, prior to the objects registered with
@@ -5468,6 +7699,8 @@ dbus_connection_add_filter (DBusConnection            *connection,
       return FALSE;
     }
 
+  connection->filter_list_serial += 1;
+
   /* Fill in filter after all memory allocated,
    * so we don't run the free_user_data_function
    * if the add_filter() fails
@@ -5518,6 +7751,7 @@ dbus_connection_remove_filter (DBusConnection            *connection,
         {
           _dbus_list_remove_link (&connection->filter_list, link);
           filter->function = NULL;
+          connection->filter_list_serial += 1;
           
           break;
         }
@@ -5776,6 +8010,328 @@ dbus_connection_unregister_object_path (DBusConnection              *connection,
   return TRUE;
 }
 
+/**
+ * Registers the methods of one interface on the object at the given
+ * path. Each method is given by its member name, an optional input
+ * signature and the function to call; calls are looked up by
+ * interface and member in a hash table, so a large interface costs no
+ * more to dispatch than a small one, and a call whose arguments don't
+ * match the input signature is answered with
+ * #DBUS_ERROR_INVALID_ARGS without calling the function.
+ *
+ * Any number of interfaces can be registered on a path, either alone
+ * or together with a vtable from
+ * dbus_connection_register_object_path(). Method calls are offered to
+ * the interfaces first; if there is no matching method, or its
+ * function returns #DBUS_HANDLER_RESULT_NOT_YET_HANDLED, the message
+ * goes on to the vtables as usual. Interfaces only apply to the exact
+ * path, never as a fallback for the paths below it. A call with no
+ * interface goes to any registered interface with a method of that
+ * name.
+ *
+ * The method table is not copied and must stay valid until the
+ * interface is unregistered, so it is normally a static array.
+ *
+ * @param connection the connection
+ * @param path a '/' delimited string of path elements
+ * @param interface the interface name
+ * @param methods the methods, ending with an entry whose name is #NULL
+ * @param user_data data to pass to the method functions
+ * @param free_user_data function to free the user data when the
+ *   interface is unregistered, or #NULL
+ * @param error address where an error can be returned
+ * @returns #FALSE if an error (#DBUS_ERROR_NO_MEMORY or
+ *    #DBUS_ERROR_OBJECT_PATH_IN_USE, if the interface is already
+ *    registered at the path) is reported
+ */
+dbus_bool_t
+dbus_connection_register_object_interface (DBusConnection              *connection,
+                                           const char                  *path,
+                                           const char                  *interface,
+                                           const DBusObjectPathMethod  *methods,
+                                           void                        *user_data,
+                                           DBusFreeFunction             free_user_data,
+                                           DBusError                   *error)
+{
+  char **decomposed_path;
+  dbus_bool_t retval;
+
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (path != NULL, FALSE);
+  _dbus_return_val_if_fail (path[0] == '/', FALSE);
+  _dbus_return_val_if_fail (interface != NULL, FALSE);
+  _dbus_return_val_if_fail (methods != NULL, FALSE);
+  _dbus_return_val_if_error_is_set (error, FALSE);
+
+  if (!_dbus_decompose_path (path, strlen (path), &decomposed_path, NULL))
+    {
+      _DBUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  CONNECTION_LOCK (connection);
+
+  retval = _dbus_object_tree_register_interface (connection->objects,
+                                                 (const char **) decomposed_path,
+                                                 interface, methods,
+                                                 user_data, free_user_data,
+                                                 error);
+
+  CONNECTION_UNLOCK (connection);
+
+  dbus_free_string_array (decomposed_path);
+
+  return retval;
+}
+
+/**
+ * Unregisters an interface registered with
+ * dbus_connection_register_object_interface() at exactly the given
+ * path, freeing its user data. It's a bug to call this function for
+ * an interface that isn't registered there.
+ *
+ * @param connection the connection
+ * @param path a '/' delimited string of path elements
+ * @param interface the interface name
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+dbus_connection_unregister_object_interface (DBusConnection *connection,
+                                             const char     *path,
+                                             const char     *interface)
+{
+  char **decomposed_path;
+
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (path != NULL, FALSE);
+  _dbus_return_val_if_fail (path[0] == '/', FALSE);
+  _dbus_return_val_if_fail (interface != NULL, FALSE);
+
+  if (!_dbus_decompose_path (path, strlen (path), &decomposed_path, NULL))
+    return FALSE;
+
+  CONNECTION_LOCK (connection);
+
+  _dbus_object_tree_unregister_interface_and_unlock (connection->objects,
+                                                     (const char **) decomposed_path,
+                                                     interface);
+
+  dbus_free_string_array (decomposed_path);
+
+  return TRUE;
+}
+
+/**
+ * Takes on replying to a method call later, from outside the handler
+ * it was dispatched to. The handler returns
+ * #DBUS_HANDLER_RESULT_HANDLED straight away, so that it doesn't hold
+ * up the dispatching of other messages, and the returned token is
+ * completed with dbus_deferred_reply_send() or
+ * dbus_deferred_reply_send_error() once the answer is known, from
+ * any thread if dbus_threads_init_default() was called.
+ *
+ * The token keeps a reference to the connection and the call, and
+ * takes care of addressing the reply, so nothing else needs to be
+ * kept. If the last reference to it is dropped without a reply, the
+ * caller gets a #DBUS_ERROR_FAILED error rather than waiting for its
+ * timeout. If the caller asked for no reply, completing the token
+ * sends nothing.
+ *
+ * @param connection the connection the call came in on
+ * @param method_call the method call
+ * @returns the token, or #NULL if not enough memory
+ */
+DBusDeferredReply*
+dbus_connection_defer_reply (DBusConnection *connection,
+                             DBusMessage    *method_call)
+{
+  DBusDeferredReply *reply;
+
+  _dbus_return_val_if_fail (connection != NULL, NULL);
+  _dbus_return_val_if_fail (method_call != NULL, NULL);
+  _dbus_return_val_if_fail (dbus_message_get_type (method_call) ==
+                            DBUS_MESSAGE_TYPE_METHOD_CALL, NULL);
+
+  reply = dbus_new0 (DBusDeferredReply, 1);
+  if (reply == NULL)
+    return NULL;
+
+  reply->refcount.value = 1;
+  reply->connection = dbus_connection_ref (connection);
+  reply->method_call = dbus_message_ref (method_call);
+
+  return reply;
+}
+
+/**
+ * Increments the reference count of a deferred reply.
+ *
+ * @param reply the deferred reply
+ * @returns the deferred reply
+ */
+DBusDeferredReply*
+dbus_deferred_reply_ref (DBusDeferredReply *reply)
+{
+  _dbus_return_val_if_fail (reply != NULL, NULL);
+
+  _dbus_atomic_inc (&reply->refcount);
+
+  return reply;
+}
+
+/**
+ * Decrements the reference count of a deferred reply, freeing it if
+ * the count reaches 0. If no reply was sent, an error goes back to
+ * the caller instead.
+ *
+ * @param reply the deferred reply
+ */
+void
+dbus_deferred_reply_unref (DBusDeferredReply *reply)
+{
+  _dbus_return_if_fail (reply != NULL);
+
+  if (_dbus_atomic_dec (&reply->refcount) != 1)
+    return;
+
+  if (reply->completed.value == 0 &&
+      !dbus_message_get_no_reply (reply->method_call))
+    {
+      DBusMessage *error;
+
+      _dbus_verbose ("deferred reply to %s.%s dropped without a reply\n",
+                     dbus_message_get_interface (reply->method_call)
+                       ? dbus_message_get_interface (reply->method_call) : "(none)",
+                     dbus_message_get_member (reply->method_call));
+
+      /* Best effort; without memory the caller has to time out */
+      error = dbus_message_new_error (reply->method_call, DBUS_ERROR_FAILED,
+                                      "The method call was dropped without a reply");
+      if (error != NULL)
+        {
+          dbus_connection_send (reply->connection, error, NULL);
+          dbus_message_unref (error);
+        }
+    }
+
+  dbus_message_unref (reply->method_call);
+  dbus_connection_unref (reply->connection);
+  dbus_free (reply);
+}
+
+/**
+ * Gets the method call a deferred reply is for.
+ *
+ * @param reply the deferred reply
+ * @returns the method call, owned by the token
+ */
+DBusMessage*
+dbus_deferred_reply_get_method_call (DBusDeferredReply *reply)
+{
+  _dbus_return_val_if_fail (reply != NULL, NULL);
+
+  return reply->method_call;
+}
+
+/**
+ * Sends the reply to a deferred method call. The message must be a
+ * method return or an error; its reply serial and destination are
+ * filled in from the call if they aren't set yet, so it can be made
+ * with dbus_message_new() as well as dbus_message_new_method_return().
+ * Only one reply can be sent per token.
+ *
+ * The token still has to be unreferenced afterwards.
+ *
+ * @param reply the deferred reply
+ * @param message the reply message
+ * @returns #FALSE if not enough memory, in which case the reply can be
+ *   tried again
+ */
+dbus_bool_t
+dbus_deferred_reply_send (DBusDeferredReply *reply,
+                          DBusMessage       *message)
+{
+  DBusMessage *call;
+  const char *sender;
+
+  _dbus_return_val_if_fail (reply != NULL, FALSE);
+  _dbus_return_val_if_fail (message != NULL, FALSE);
+  _dbus_return_val_if_fail (dbus_message_get_type (message) ==
+                            DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+                            dbus_message_get_type (message) ==
+                            DBUS_MESSAGE_TYPE_ERROR, FALSE);
+
+  call = reply->method_call;
+
+  _dbus_return_val_if_fail (dbus_message_get_reply_serial (message) == 0 ||
+                            dbus_message_get_reply_serial (message) ==
+                            dbus_message_get_serial (call), FALSE);
+
+  /* Whichever thread gets here first sends the reply */
+  if (_dbus_atomic_inc (&reply->completed) != 0)
+    {
+      _dbus_warn_check_failed ("The reply to %s.%s has already been sent\n",
+                               dbus_message_get_interface (call)
+                                 ? dbus_message_get_interface (call) : "(none)",
+                               dbus_message_get_member (call));
+      return FALSE;
+    }
+
+  if (dbus_message_get_no_reply (call))
+    return TRUE;
+
+  if (dbus_message_get_reply_serial (message) == 0 &&
+      !dbus_message_set_reply_serial (message, dbus_message_get_serial (call)))
+    goto oom;
+
+  sender = dbus_message_get_sender (call);
+  if (sender != NULL && dbus_message_get_destination (message) == NULL &&
+      !dbus_message_set_destination (message, sender))
+    goto oom;
+
+  if (!dbus_connection_send (reply->connection, message, NULL))
+    goto oom;
+
+  return TRUE;
+
+ oom:
+  _dbus_atomic_dec (&reply->completed);
+  return FALSE;
+}
+
+/**
+ * Sends an error as the reply to a deferred method call, like
+ * dbus_deferred_reply_send() with a message from
+ * dbus_message_new_error().
+ *
+ * @param reply the deferred reply
+ * @param error_name the error name
+ * @param error_message the error message, or #NULL
+ * @returns #FALSE if not enough memory, in which case the reply can be
+ *   tried again
+ */
+dbus_bool_t
+dbus_deferred_reply_send_error (DBusDeferredReply *reply,
+                                const char        *error_name,
+                                const char        *error_message)
+{
+  DBusMessage *error;
+  dbus_bool_t retval;
+
+  _dbus_return_val_if_fail (reply != NULL, FALSE);
+  _dbus_return_val_if_fail (error_name != NULL, FALSE);
+
+  error = dbus_message_new_error (reply->method_call, error_name,
+                                  error_message);
+  if (error == NULL)
+    return FALSE;
+
+  retval = dbus_deferred_reply_send (reply, error);
+  dbus_message_unref (error);
+
+  return retval;
+}
+
 /**
  * Gets the user data passed to dbus_connection_register_object_path()
  * or dbus_connection_register_fallback(). If nothing was registered
@@ -5848,6 +8404,44 @@ dbus_connection_list_registered (DBusConnection              *connection,
   return retval;
 }
 
+/**
+ * Calls a function with each child of the given parent_path that
+ * dbus_connection_list_registered() would list, in sorted order,
+ * without allocating anything: not the array, the names, nor a copy
+ * of the path. This is the one to use for containers with a great
+ * many children.
+ *
+ * The function is called with the connection locked, so it must not
+ * use the connection (or anything that does, such as sending a
+ * message), and the child name is only valid during the call. It can
+ * return #FALSE to stop early.
+ *
+ * @param connection the connection
+ * @param parent_path the path to list the child handlers of
+ * @param function the function to call for each child
+ * @param user_data data to pass to the function
+ * @returns #TRUE (it can't fail)
+ */
+dbus_bool_t
+dbus_connection_foreach_registered (DBusConnection              *connection,
+                                    const char                  *parent_path,
+                                    DBusObjectPathChildFunction  function,
+                                    void                        *user_data)
+{
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (parent_path != NULL, FALSE);
+  _dbus_return_val_if_fail (_dbus_check_is_valid_path (parent_path), FALSE);
+  _dbus_return_val_if_fail (function != NULL, FALSE);
+
+  CONNECTION_LOCK (connection);
+
+  _dbus_object_tree_foreach_child_and_unlock (connection->objects,
+                                              parent_path,
+                                              function, user_data);
+
+  return TRUE;
+}
+
 static DBusDataSlotAllocator slot_allocator;
 _DBUS_DEFINE_GLOBAL_LOCK (connection_slots);
 
@@ -5982,6 +8576,24 @@ dbus_connection_get_data (DBusConnection   *connection,
   return res;
 }
 
+/**
+ * Like dbus_connection_get_data(), but takes neither the connection's
+ * slot lock nor the slot allocator lock. Only safe when no other
+ * thread can set data on the connection concurrently and the slot
+ * stays allocated, as for the bus daemon's own per-connection data,
+ * which it reads for every message it routes.
+ *
+ * @param connection the connection
+ * @param slot the slot to get data from
+ * @returns the data, or #NULL if not found
+ */
+void*
+_dbus_connection_get_data_unlocked (DBusConnection *connection,
+                                    dbus_int32_t    slot)
+{
+  return _dbus_data_slot_list_peek (&connection->slot_list, slot);
+}
+
 /**
  * This function sets a global flag for whether dbus_connection_new()
  * will set SIGPIPE behavior to SIG_IGN.
@@ -6213,4 +8825,47 @@ dbus_connection_get_outgoing_unix_fds (DBusConnection *connection)
   return res;
 }
 
+/**
+ * Gets counters describing the connection's queues and traffic so
+ * far, for an application to keep an eye on its own health; a queue
+ * that keeps growing means the application or its peer is falling
+ * behind. All of them are read together with the connection locked,
+ * so they agree with each other. The running totals wrap around
+ * rather than overflow.
+ *
+ * @param connection the connection
+ * @param statistics return location for the counters
+ */
+void
+dbus_connection_get_statistics (DBusConnection           *connection,
+                                DBusConnectionStatistics *statistics)
+{
+  _dbus_return_if_fail (connection != NULL);
+  _dbus_return_if_fail (statistics != NULL);
+
+  _DBUS_ZERO (*statistics);
+
+  CONNECTION_LOCK (connection);
+
+  statistics->incoming_messages = connection->n_incoming;
+  statistics->outgoing_messages = connection->n_outgoing;
+  statistics->outgoing_bytes =
+    _dbus_counter_get_size_value (connection->outgoing_counter);
+  statistics->pending_calls =
+    _dbus_hash_table_get_n_entries (connection->pending_replies);
+  statistics->messages_sent = connection->n_messages_sent;
+  statistics->bytes_sent = connection->n_bytes_sent;
+  statistics->messages_received = connection->n_messages_received;
+  statistics->bytes_received = connection->n_bytes_received;
+  statistics->messages_dispatched = connection->n_dispatched;
+  statistics->messages_expired = connection->n_messages_expired;
+
+  _dbus_transport_get_statistics (connection->transport,
+                                  &statistics->incoming_bytes,
+                                  &statistics->reads,
+                                  &statistics->writes);
+
+  CONNECTION_UNLOCK (connection);
+}
+
 /** @} */
@@ -45,6 +45,8 @@ typedef struct DBusWatch DBusWatch;
 typedef struct DBusTimeout DBusTimeout;
 /** Opaque type representing preallocated resources so a message can be sent without further memory allocation. */
 typedef struct DBusPreallocatedSend DBusPreallocatedSend;
+/** Opaque type representing a method call to be replied to later, outside its handler. */
+typedef struct DBusDeferredReply DBusDeferredReply;
 /** Opaque type representing a method call that has not yet received a reply. */
 typedef struct DBusPendingCall DBusPendingCall;
 /** Opaque type representing a connection to a remote application and associated incoming/outgoing message queues. */
@@ -161,6 +163,14 @@ typedef dbus_bool_t (* DBusAllowWindowsUserFunction)  (DBusConnection *connectio
 typedef void (* DBusPendingCallNotifyFunction) (DBusPendingCall *pending,
                                                 void            *user_data);
 
+/**
+ * Called once every call in a batch sent with
+ * dbus_connection_send_with_reply_batch() has a reply available.
+ */
+typedef void (* DBusPendingCallBatchNotifyFunction) (DBusPendingCall **pending_calls,
+                                                     int               n_pending_calls,
+                                                     void             *user_data);
+
 /**
  * Called when a message needs to be handled. The result indicates whether or
  * not more handlers should be run. Set with dbus_connection_add_filter().
@@ -168,6 +178,29 @@ typedef void (* DBusPendingCallNotifyFunction) (DBusPendingCall *pending,
 typedef DBusHandlerResult (* DBusHandleMessageFunction) (DBusConnection     *connection,
                                                          DBusMessage        *message,
                                                          void               *user_data);
+/**
+ * Called by dbus_connection_dispatch() to hand a message over to an
+ * application-supplied worker pool, instead of running filters and
+ * object path handlers on the dispatching thread. Messages with the
+ * same key must be handled in the order they were handed over. Set
+ * with dbus_connection_set_dispatch_executor().
+ */
+typedef dbus_bool_t (* DBusDispatchExecutorFunction) (DBusConnection *connection,
+                                                      DBusMessage    *message,
+                                                      unsigned long   key,
+                                                      void           *data);
+/**
+ * Called with each piece of a large byte array as it is received,
+ * instead of buffering the whole message. Set with
+ * dbus_connection_set_body_chunk_function().
+ */
+typedef void        (* DBusBodyChunkFunction)      (DBusConnection      *connection,
+                                                    DBusMessage         *message,
+                                                    const unsigned char *chunk,
+                                                    int                  len,
+                                                    dbus_uint32_t        offset,
+                                                    dbus_uint32_t        total_len,
+                                                    void                *data);
 DBUS_EXPORT
 DBusConnection*    dbus_connection_open                         (const char                 *address,
                                                                  DBusError                  *error);
@@ -198,6 +231,9 @@ void               dbus_connection_set_exit_on_disconnect       (DBusConnection
 DBUS_EXPORT
 void               dbus_connection_flush                        (DBusConnection             *connection);
 DBUS_EXPORT
+void               dbus_connection_set_corked                   (DBusConnection             *connection,
+                                                                 dbus_bool_t                 corked);
+DBUS_EXPORT
 dbus_bool_t        dbus_connection_read_write_dispatch          (DBusConnection             *connection,
                                                                  int                         timeout_milliseconds);
 DBUS_EXPORT
@@ -221,6 +257,9 @@ DBusDispatchStatus dbus_connection_get_dispatch_status          (DBusConnection
 DBUS_EXPORT
 DBusDispatchStatus dbus_connection_dispatch                     (DBusConnection             *connection);
 DBUS_EXPORT
+DBusDispatchStatus dbus_connection_dispatch_batch               (DBusConnection             *connection,
+                                                                 int                         max_messages);
+DBUS_EXPORT
 dbus_bool_t        dbus_connection_has_messages_to_send         (DBusConnection *connection);
 DBUS_EXPORT
 dbus_bool_t        dbus_connection_send                         (DBusConnection             *connection,
@@ -232,6 +271,14 @@ dbus_bool_t        dbus_connection_send_with_reply              (DBusConnection
                                                                  DBusPendingCall           **pending_return,
                                                                  int                         timeout_milliseconds);
 DBUS_EXPORT
+dbus_bool_t        dbus_connection_send_with_reply_batch        (DBusConnection             *connection,
+                                                                 DBusMessage               **messages,
+                                                                 int                         n_messages,
+                                                                 int                         timeout_milliseconds,
+                                                                 DBusPendingCallBatchNotifyFunction function,
+                                                                 void                       *user_data,
+                                                                 DBusFreeFunction            free_user_data);
+DBUS_EXPORT
 DBusMessage *      dbus_connection_send_with_reply_and_block    (DBusConnection             *connection,
                                                                  DBusMessage                *message,
                                                                  int                         timeout_milliseconds,
@@ -261,6 +308,19 @@ void               dbus_connection_set_dispatch_status_function (DBusConnection
                                                                  void                       *data,
                                                                  DBusFreeFunction            free_data_function);
 DBUS_EXPORT
+void               dbus_connection_set_dispatch_executor        (DBusConnection             *connection,
+                                                                 DBusDispatchExecutorFunction function,
+                                                                 void                       *data,
+                                                                 DBusFreeFunction            free_data_function);
+DBUS_EXPORT
+void               dbus_connection_set_body_chunk_function      (DBusConnection             *connection,
+                                                                 DBusBodyChunkFunction       function,
+                                                                 void                       *data,
+                                                                 DBusFreeFunction            free_data_function);
+DBUS_EXPORT
+DBusHandlerResult  dbus_connection_handle_message               (DBusConnection             *connection,
+                                                                 DBusMessage                *message);
+DBUS_EXPORT
 dbus_bool_t        dbus_connection_get_unix_user                (DBusConnection             *connection,
                                                                  unsigned long              *uid);
 DBUS_EXPORT
@@ -289,6 +349,9 @@ void               dbus_connection_set_allow_anonymous          (DBusConnection
 DBUS_EXPORT
 void               dbus_connection_set_route_peer_messages      (DBusConnection             *connection,
                                                                  dbus_bool_t                 value);
+DBUS_EXPORT
+void               dbus_connection_set_lazy_body_validation     (DBusConnection             *connection,
+                                                                 dbus_bool_t                 value);
 
 
 /* Filters */
@@ -348,6 +411,34 @@ long dbus_connection_get_outgoing_size     (DBusConnection *connection);
 DBUS_EXPORT
 long dbus_connection_get_outgoing_unix_fds (DBusConnection *connection);
 
+/**
+ * Counters filled in by dbus_connection_get_statistics().
+ */
+typedef struct
+{
+  unsigned long incoming_messages;   /**< Messages received and not yet dispatched */
+  unsigned long incoming_bytes;      /**< Size of the received messages still in memory, dispatched or not */
+  unsigned long outgoing_messages;   /**< Messages queued to be sent */
+  unsigned long outgoing_bytes;      /**< Size of the messages queued to be sent */
+  unsigned long pending_calls;       /**< Method calls still waiting for their reply */
+  unsigned long messages_sent;       /**< Messages sent so far */
+  unsigned long bytes_sent;          /**< Size of the messages sent so far */
+  unsigned long messages_received;   /**< Messages received so far */
+  unsigned long bytes_received;      /**< Size of the messages received so far */
+  unsigned long messages_dispatched; /**< Messages dispatched so far */
+  unsigned long reads;               /**< Read system calls made so far */
+  unsigned long writes;              /**< Write system calls made so far */
+  unsigned long messages_expired;    /**< Messages dropped from either queue when their expiry passed */
+
+  unsigned long dbus_internal_pad2;  /**< Reserved for future expansion */
+  unsigned long dbus_internal_pad3;  /**< Reserved for future expansion */
+  unsigned long dbus_internal_pad4;  /**< Reserved for future expansion */
+} DBusConnectionStatistics;
+
+DBUS_EXPORT
+void dbus_connection_get_statistics        (DBusConnection           *connection,
+                                            DBusConnectionStatistics *statistics);
+
 DBUS_EXPORT
 DBusPreallocatedSend* dbus_connection_preallocate_send       (DBusConnection       *connection);
 DBUS_EXPORT
@@ -423,6 +514,48 @@ DBUS_EXPORT
 dbus_bool_t dbus_connection_unregister_object_path (DBusConnection              *connection,
                                                     const char                  *path);
 
+/**
+ * One method of an interface registered on an object with
+ * dbus_connection_register_object_interface(). A table of these ends
+ * with an entry whose name is #NULL.
+ */
+typedef struct
+{
+  const char                    *name;         /**< Member name */
+  const char                    *in_signature; /**< Signature the arguments must have, or #NULL to take any */
+  DBusObjectPathMessageFunction  function;     /**< Function to handle calls */
+} DBusObjectPathMethod;
+
+DBUS_EXPORT
+dbus_bool_t dbus_connection_register_object_interface   (DBusConnection              *connection,
+                                                         const char                  *path,
+                                                         const char                  *interface,
+                                                         const DBusObjectPathMethod  *methods,
+                                                         void                        *user_data,
+                                                         DBusFreeFunction             free_user_data,
+                                                         DBusError                   *error);
+DBUS_EXPORT
+dbus_bool_t dbus_connection_unregister_object_interface (DBusConnection              *connection,
+                                                         const char                  *path,
+                                                         const char                  *interface);
+
+DBUS_EXPORT
+DBusDeferredReply* dbus_connection_defer_reply         (DBusConnection    *connection,
+                                                        DBusMessage       *method_call);
+DBUS_EXPORT
+DBusDeferredReply* dbus_deferred_reply_ref             (DBusDeferredReply *reply);
+DBUS_EXPORT
+void               dbus_deferred_reply_unref           (DBusDeferredReply *reply);
+DBUS_EXPORT
+DBusMessage*       dbus_deferred_reply_get_method_call (DBusDeferredReply *reply);
+DBUS_EXPORT
+dbus_bool_t        dbus_deferred_reply_send            (DBusDeferredReply *reply,
+                                                        DBusMessage       *message);
+DBUS_EXPORT
+dbus_bool_t        dbus_deferred_reply_send_error      (DBusDeferredReply *reply,
+                                                        const char        *error_name,
+                                                        const char        *error_message);
+
 DBUS_EXPORT
 dbus_bool_t dbus_connection_get_object_path_data   (DBusConnection              *connection,
                                                     const char                  *path,
@@ -433,6 +566,19 @@ dbus_bool_t dbus_connection_list_registered        (DBusConnection
                                                     const char                  *parent_path,
                                                     char                      ***child_entries);
 
+/**
+ * Called for each child path element by
+ * dbus_connection_foreach_registered(); returns #FALSE to stop.
+ */
+typedef dbus_bool_t (* DBusObjectPathChildFunction) (const char *child,
+                                                     void       *user_data);
+
+DBUS_EXPORT
+dbus_bool_t dbus_connection_foreach_registered     (DBusConnection              *connection,
+                                                    const char                  *parent_path,
+                                                    DBusObjectPathChildFunction  function,
+                                                    void                        *user_data);
+
 DBUS_EXPORT
 dbus_bool_t dbus_connection_get_unix_fd            (DBusConnection              *connection,
                                                     int                         *fd);
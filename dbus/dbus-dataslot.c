@@ -124,7 +124,14 @@ _dbus_data_slot_allocator_alloc (DBusDataSlotAllocator *allocator,
       tmp = dbus_realloc (allocator->allocated_slots,
                           sizeof (DBusAllocatedSlot) * (allocator->n_allocated_slots + 1));
       if (tmp == NULL)
-        goto out;
+        {
+          /* the allocator is still unused, so don't keep it tied to
+           * this lock
+           */
+          if (allocator->n_allocated_slots == 0)
+            allocator->lock_loc = NULL;
+          goto out;
+        }
 
       allocator->allocated_slots = tmp;
       slot = allocator->n_allocated_slots;
@@ -146,7 +153,7 @@ _dbus_data_slot_allocator_alloc (DBusDataSlotAllocator *allocator,
                  slot, allocator, allocator->n_allocated_slots, allocator->n_used_slots);
   
  out:
-  _dbus_mutex_unlock (*(allocator->lock_loc));
+  _dbus_mutex_unlock (*mutex_loc);
   return slot >= 0;
 }
 
@@ -317,6 +324,28 @@ _dbus_data_slot_list_get  (DBusDataSlotAllocator *allocator,
     return list->slots[slot].data;
 }
 
+/**
+ * Like _dbus_data_slot_list_get(), but without checking the slot
+ * against its allocator, so the allocator lock is never taken even
+ * when assertions are enabled. For hot paths whose slot is known to
+ * stay allocated for the lifetime of the list.
+ *
+ * @param list the data slot list
+ * @param slot the slot to get data from
+ * @returns the data, or #NULL if not found
+ */
+void*
+_dbus_data_slot_list_peek (DBusDataSlotList *list,
+                           int               slot)
+{
+  _dbus_assert (slot >= 0);
+
+  if (slot >= list->n_slots)
+    return NULL;
+  else
+    return list->slots[slot].data;
+}
+
 /**
  * Frees all data slots contained in the list, calling
  * application-provided free functions if they exist.
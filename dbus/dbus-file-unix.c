@@ -150,6 +150,47 @@ _dbus_file_get_contents (DBusString       *str,
     }
 }
 
+/**
+ * Gets a stamp identifying the current version of the file. Since
+ * _dbus_string_save_to_file() replaces files by renaming a new one
+ * over them, the inode changes on every save even if the size and
+ * modification time happen not to.
+ *
+ * @param filename the file to look at
+ * @param stamp return location for the stamp
+ * @param error place to set an error
+ * @returns #FALSE if error was set
+ */
+dbus_bool_t
+_dbus_file_get_stamp (const DBusString *filename,
+                      DBusFileStamp    *stamp,
+                      DBusError        *error)
+{
+  struct stat sb;
+  const char *filename_c;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  filename_c = _dbus_string_get_const_data (filename);
+
+  if (stat (filename_c, &sb) < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to stat \"%s\": %s",
+                      filename_c,
+                      _dbus_strerror (errno));
+      return FALSE;
+    }
+
+  stamp->device = sb.st_dev;
+  stamp->inode = sb.st_ino;
+  stamp->size = sb.st_size;
+  stamp->mtime = sb.st_mtime;
+  stamp->mtime_nsec = 0;
+
+  return TRUE;
+}
+
 /**
  * Writes a string out to a file. If the file exists,
  * it will be atomically overwritten by the new data.
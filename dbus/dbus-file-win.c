@@ -197,6 +197,51 @@ _dbus_file_get_contents (DBusString       *str,
     }
 }
 
+/**
+ * Gets a stamp identifying the current version of the file. Windows
+ * has no inode numbers, so this relies on the size and the
+ * last-write time, which has 100ns resolution.
+ *
+ * @param filename the file to look at
+ * @param stamp return location for the stamp
+ * @param error place to set an error
+ * @returns #FALSE if error was set
+ */
+dbus_bool_t
+_dbus_file_get_stamp (const DBusString *filename,
+                      DBusFileStamp    *stamp,
+                      DBusError        *error)
+{
+  WIN32_FILE_ATTRIBUTE_DATA wfad;
+  ULARGE_INTEGER ticks;
+  const char *filename_c;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  filename_c = _dbus_string_get_const_data (filename);
+
+  if (!GetFileAttributesExA (filename_c, GetFileExInfoStandard, &wfad))
+    {
+      char *emsg = _dbus_win_error_string (GetLastError ());
+      dbus_set_error (error, _dbus_win_error_from_last_error (),
+                      "Failed to stat \"%s\": %s",
+                      filename_c, emsg);
+      _dbus_win_free_error_string (emsg);
+      return FALSE;
+    }
+
+  /* FILETIME counts 100ns intervals */
+  ticks.LowPart = wfad.ftLastWriteTime.dwLowDateTime;
+  ticks.HighPart = wfad.ftLastWriteTime.dwHighDateTime;
+
+  stamp->device = 0;
+  stamp->inode = 0;
+  stamp->size = wfad.nFileSizeLow;
+  stamp->mtime = (unsigned long) (ticks.QuadPart / 10000000);
+  stamp->mtime_nsec = (unsigned long) (ticks.QuadPart % 10000000) * 100;
+
+  return TRUE;
+}
 
 /**
  * Writes a string out to a file. If the file exists,
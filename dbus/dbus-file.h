@@ -36,6 +36,19 @@ DBUS_BEGIN_DECLS
  * @{
  */
 
+/**
+ * Identifies one version of a file, so that a caller can tell whether
+ * it has been rewritten or replaced since it was last read.
+ */
+typedef struct
+{
+  unsigned long device;     /**< Device the file lives on, or 0 */
+  unsigned long inode;      /**< Inode number, or 0 */
+  unsigned long size;       /**< Size of the file */
+  unsigned long mtime;      /**< Modification time, in seconds */
+  unsigned long mtime_nsec; /**< Sub-second part of mtime, or 0 */
+} DBusFileStamp;
+
 /**
  * File interface
  */
@@ -43,6 +56,9 @@ dbus_bool_t _dbus_file_exists         (const char       *file);
 dbus_bool_t _dbus_file_get_contents   (DBusString       *str,
                                        const DBusString *filename,
                                        DBusError        *error);
+dbus_bool_t _dbus_file_get_stamp      (const DBusString *filename,
+                                       DBusFileStamp    *stamp,
+                                       DBusError        *error);
 dbus_bool_t _dbus_string_save_to_file (const DBusString *str,
                                        const DBusString *filename,
                                        dbus_bool_t       world_readable,
@@ -79,6 +79,10 @@
 #include "dbus-internals.h"
 #include "dbus-mempool.h"
 
+/* Allocations made here are profiled as hash tables */
+#undef DBUS_ALLOC_SUBSYSTEM
+#define DBUS_ALLOC_SUBSYSTEM DBUS_ALLOC_SUBSYSTEM_HASH
+
 /**
  * @defgroup DBusHashTable Hash table
  * @ingroup  DBusInternals
@@ -103,6 +107,15 @@
  */
 #define REBUILD_MULTIPLIER  3
 
+/**
+ * How many of the old bucket chains each insertion moves over while
+ * a chained table is being resized. Resizing quadruples or quarters
+ * the number of buckets, so even one per insertion would finish long
+ * before the next resize is due; a few more keep the time spent
+ * looking in two places short.
+ */
+#define REHASH_BUCKETS_PER_INSERT 4
+
 /**
  * Takes a preliminary integer hash value and produces an index into a
  * hash tables bucket list.  The idea is to make it so that
@@ -129,6 +142,25 @@
  */
 #define DBUS_SMALL_HASH_TABLE 4
 
+/**
+ * Number of slots an open-addressed table starts with, and the
+ * fewest it shrinks to; a power of two like all its sizes.
+ */
+#define DBUS_SMALL_OPEN_HASH_TABLE 8
+
+/** Control byte of an open-addressed slot that has never been used */
+#define SLOT_EMPTY   0x80
+/** Control byte of an open-addressed slot whose entry was removed */
+#define SLOT_REMOVED 0xfe
+/** Whether a control byte is for a slot holding an entry */
+#define SLOT_IS_FULL(ctrl) (((ctrl) & 0x80) == 0)
+/**
+ * Control byte of a slot holding an entry with this hash: its top
+ * seven bits, so most non-matching entries are skipped without a key
+ * comparison. The low bits pick the slot to start probing at.
+ */
+#define SLOT_TAG(hash) ((unsigned char) ((hash) >> 25))
+
 /**
  * Typedef for DBusHashEntry
  */
@@ -195,6 +227,17 @@ struct DBusHashTable {
   int mask;                            /**< Mask value used in hashing
                                         * function.
                                         */
+
+  DBusHashEntry **old_buckets;         /**< While a chained table is being
+                                        * resized, the previous bucket
+                                        * array, whose chains from
+                                        * rehash_index on have yet to be
+                                        * moved over; otherwise #NULL.
+                                        */
+  int old_n_buckets;                   /**< Number of buckets at old_buckets */
+  int old_down_shift;                  /**< down_shift for old_buckets */
+  int old_mask;                        /**< mask for old_buckets */
+  int rehash_index;                    /**< First old bucket not moved yet */
   DBusHashType key_type;               /**< Type of keys used in this table */
 
 
@@ -204,6 +247,22 @@ struct DBusHashTable {
   DBusFreeFunction free_value_function; /**< Function to free values */
 
   DBusMemPool *entry_pool;              /**< Memory pool for hash entries */
+
+  unsigned char *ctrl;                  /**< For open-addressed tables, one
+                                         * control byte per slot saying
+                                         * whether it is empty, removed or
+                                         * full; #NULL for chained tables.
+                                         */
+  DBusHashEntry *slots;                 /**< For open-addressed tables, the
+                                         * n_buckets entries themselves,
+                                         * whose next field is unused.
+                                         */
+  int n_removed;                        /**< Open-addressed slots marked
+                                         * removed, until the next rebuild.
+                                         */
+  int n_reserved;                       /**< Open-addressed slots promised
+                                         * to preallocated entries.
+                                         */
 };
 
 /** 
@@ -239,11 +298,37 @@ static DBusHashEntry* find_two_strings_function (DBusHashTable          *table,
                                                  DBusHashEntry        ***bucket,
                                                  DBusPreallocatedHash   *preallocated);
 #endif
+static DBusHashEntry* find_open_direct_function (DBusHashTable          *table,
+                                                 void                   *key,
+                                                 dbus_bool_t             create_if_not_found,
+                                                 DBusHashEntry        ***bucket,
+                                                 DBusPreallocatedHash   *preallocated);
+static DBusHashEntry* find_open_string_function (DBusHashTable          *table,
+                                                 void                   *key,
+                                                 dbus_bool_t             create_if_not_found,
+                                                 DBusHashEntry        ***bucket,
+                                                 DBusPreallocatedHash   *preallocated);
+#ifdef DBUS_BUILD_TESTS
+static DBusHashEntry* find_open_two_strings_function (DBusHashTable          *table,
+                                                      void                   *key,
+                                                      dbus_bool_t             create_if_not_found,
+                                                      DBusHashEntry        ***bucket,
+                                                      DBusPreallocatedHash   *preallocated);
+#endif
+static dbus_bool_t    reserve_open_slot         (DBusHashTable          *table);
+static void           remove_open_entry         (DBusHashTable          *table,
+                                                 DBusHashEntry          *entry);
 static unsigned int   string_hash               (const char             *str);
 #ifdef DBUS_BUILD_TESTS
 static unsigned int   two_strings_hash          (const char             *str);
 #endif
 static void           rebuild_table             (DBusHashTable          *table);
+static void           rehash_some_buckets       (DBusHashTable          *table,
+                                                 int                     n_buckets);
+static unsigned int   chain_index               (DBusHashTable          *table,
+                                                 const void             *key,
+                                                 int                     down_shift,
+                                                 int                     mask);
 static DBusHashEntry* alloc_entry               (DBusHashTable          *table);
 static void           remove_entry              (DBusHashTable          *table,
                                                  DBusHashEntry         **bucket,
@@ -350,6 +435,78 @@ _dbus_hash_table_new (DBusHashType     type,
   return table;
 }
 
+/**
+ * Like _dbus_hash_table_new(), but the table stores its entries in a
+ * single array, probed linearly from the slot the key hashes to,
+ * rather than in a separately allocated entry per key chained off
+ * each bucket. A lookup then usually touches one or two cache lines
+ * instead of following a chain, which suits tables that are looked
+ * up far more often than they change. The two kinds of table work
+ * the same through the rest of the API.
+ *
+ * @param type the type of hash key to use.
+ * @param key_free_function function to free hash keys.
+ * @param value_free_function function to free hash values.
+ * @returns a new DBusHashTable or #NULL if no memory.
+ */
+DBusHashTable*
+_dbus_hash_table_new_open_addressed (DBusHashType     type,
+                                     DBusFreeFunction key_free_function,
+                                     DBusFreeFunction value_free_function)
+{
+  DBusHashTable *table;
+
+  table = dbus_new0 (DBusHashTable, 1);
+  if (table == NULL)
+    return NULL;
+
+  table->ctrl = dbus_malloc (DBUS_SMALL_OPEN_HASH_TABLE);
+  table->slots = dbus_new (DBusHashEntry, DBUS_SMALL_OPEN_HASH_TABLE);
+  if (table->ctrl == NULL || table->slots == NULL)
+    {
+      dbus_free (table->ctrl);
+      dbus_free (table->slots);
+      dbus_free (table);
+      return NULL;
+    }
+
+  memset (table->ctrl, SLOT_EMPTY, DBUS_SMALL_OPEN_HASH_TABLE);
+
+  table->refcount = 1;
+  table->buckets = NULL;
+  table->n_buckets = DBUS_SMALL_OPEN_HASH_TABLE;
+  table->mask = DBUS_SMALL_OPEN_HASH_TABLE - 1;
+  table->n_entries = 0;
+  table->n_removed = 0;
+  table->n_reserved = 0;
+  table->key_type = type;
+
+  switch (table->key_type)
+    {
+    case DBUS_HASH_INT:
+    case DBUS_HASH_POINTER:
+    case DBUS_HASH_UINTPTR:
+      table->find_function = find_open_direct_function;
+      break;
+    case DBUS_HASH_STRING:
+      table->find_function = find_open_string_function;
+      break;
+    case DBUS_HASH_TWO_STRINGS:
+#ifdef DBUS_BUILD_TESTS
+      table->find_function = find_open_two_strings_function;
+#endif
+      break;
+    default:
+      _dbus_assert_not_reached ("Unknown hash table type");
+      break;
+    }
+
+  table->free_key_function = key_free_function;
+  table->free_value_function = value_free_function;
+
+  return table;
+}
+
 
 /**
  * Increments the reference count for a hash table.
@@ -400,6 +557,20 @@ _dbus_hash_table_unref (DBusHashTable *table)
       DBusHashEntry *entry;
       int i;
 
+      if (table->ctrl != NULL)
+        {
+          for (i = 0; i < table->n_buckets; i++)
+            {
+              if (SLOT_IS_FULL (table->ctrl[i]))
+                free_entry_data (table, &table->slots[i]);
+            }
+
+          dbus_free (table->ctrl);
+          dbus_free (table->slots);
+          dbus_free (table);
+          return;
+        }
+
       /* Free the entries in the table. */
       for (i = 0; i < table->n_buckets; i++)
         {
@@ -411,6 +582,19 @@ _dbus_hash_table_unref (DBusHashTable *table)
               entry = entry->next;
             }
         }
+
+      if (table->old_buckets != NULL)
+        {
+          for (i = table->rehash_index; i < table->old_n_buckets; i++)
+            {
+              for (entry = table->old_buckets[i]; entry != NULL; entry = entry->next)
+                free_entry_data (table, entry);
+            }
+
+          if (table->old_buckets != table->static_buckets)
+            dbus_free (table->old_buckets);
+        }
+
       /* We can do this very quickly with memory pools ;-) */
       _dbus_mem_pool_free (table->entry_pool);
 #endif
@@ -473,6 +657,13 @@ remove_entry (DBusHashTable  *table,
               DBusHashEntry  *entry)
 {
   _dbus_assert (table != NULL);
+
+  if (table->ctrl != NULL)
+    {
+      remove_open_entry (table, entry);
+      return;
+    }
+
   _dbus_assert (bucket != NULL);
   _dbus_assert (*bucket != NULL);  
   _dbus_assert (entry != NULL);
@@ -566,12 +757,48 @@ _dbus_hash_iter_next (DBusHashIter  *iter)
    * during iteration, which is bad.
    */
   _dbus_assert (real->n_entries_on_init >= real->table->n_entries);
+
+  if (real->table->ctrl != NULL)
+    {
+      /* Removing entries never moves the others, so carrying on from
+       * the next slot visits each remaining entry once.
+       */
+      while (real->next_bucket < real->table->n_buckets &&
+             !SLOT_IS_FULL (real->table->ctrl[real->next_bucket]))
+        real->next_bucket += 1;
+
+      if (real->next_bucket >= real->table->n_buckets)
+        {
+          real->entry = NULL;
+          real->table = NULL;
+          return FALSE;
+        }
+
+      real->entry = &real->table->slots[real->next_bucket];
+      real->next_bucket += 1;
+      return TRUE;
+    }
   
   /* Remember that real->entry may have been deleted */
   
+  /* While the table is being resized, the buckets not moved over
+   * yet count as coming after the new ones; the ones that have been
+   * are empty. Only inserting moves buckets, so none move under us.
+   */
   while (real->next_entry == NULL)
     {
-      if (real->next_bucket >= real->table->n_buckets)
+      DBusHashTable *table = real->table;
+
+      if (real->next_bucket < table->n_buckets)
+        {
+          real->bucket = &(table->buckets[real->next_bucket]);
+        }
+      else if (table->old_buckets != NULL &&
+               real->next_bucket < table->n_buckets + table->old_n_buckets)
+        {
+          real->bucket = &(table->old_buckets[real->next_bucket - table->n_buckets]);
+        }
+      else
         {
           /* invalidate iter and return false */
           real->entry = NULL;
@@ -580,7 +807,6 @@ _dbus_hash_iter_next (DBusHashIter  *iter)
           return FALSE;
         }
 
-      real->bucket = &(real->table->buckets[real->next_bucket]);
       real->next_entry = *(real->bucket);
       real->next_bucket += 1;
     }
@@ -611,7 +837,7 @@ _dbus_hash_iter_remove_entry (DBusHashIter *iter)
 
   _dbus_assert (real->table != NULL);
   _dbus_assert (real->entry != NULL);
-  _dbus_assert (real->bucket != NULL);
+  _dbus_assert (real->bucket != NULL || real->table->ctrl != NULL);
   
   remove_entry (real->table, real->bucket, real->entry);
 
@@ -792,9 +1018,26 @@ _dbus_hash_iter_lookup (DBusHashTable *table,
   real->table = table;
   real->bucket = bucket;
   real->entry = entry;
+  real->n_entries_on_init = table->n_entries; 
+
+  if (table->ctrl != NULL)
+    {
+      real->next_entry = NULL;
+      real->next_bucket = (entry - table->slots) + 1;
+      return TRUE;
+    }
+
   real->next_entry = entry->next;
+
+  if (table->old_buckets != NULL &&
+      bucket >= table->old_buckets &&
+      bucket < table->old_buckets + table->old_n_buckets)
+    {
+      real->next_bucket = table->n_buckets + (bucket - table->old_buckets) + 1;
+      return TRUE;
+    }
+
   real->next_bucket = (bucket - table->buckets) + 1;
-  real->n_entries_on_init = table->n_entries; 
 
   _dbus_assert (&(table->buckets[real->next_bucket-1]) == real->bucket);
   
@@ -809,6 +1052,10 @@ add_allocated_entry (DBusHashTable   *table,
                      DBusHashEntry ***bucket)
 {
   DBusHashEntry **b;  
+
+  /* moving old chains leaves the new array, and so idx, alone */
+  if (table->old_buckets != NULL)
+    rehash_some_buckets (table, REHASH_BUCKETS_PER_INSERT);
   
   entry->key = key;
   
@@ -822,10 +1069,15 @@ add_allocated_entry (DBusHashTable   *table,
   table->n_entries += 1;
 
   /* note we ONLY rebuild when ADDING - because you can iterate over a
-   * table and remove entries safely.
+   * table and remove entries safely. A table still being resized
+   * carries on as it is until that's done.
+   *
+   * Rebuilding only sets up a new bucket array; the one b points
+   * into stays around as old_buckets, so b is still right.
    */
-  if (table->n_entries >= table->hi_rebuild_size ||
-      table->n_entries < table->lo_rebuild_size)
+  if (table->old_buckets == NULL &&
+      (table->n_entries >= table->hi_rebuild_size ||
+       table->n_entries < table->lo_rebuild_size))
     rebuild_table (table);
 }
 
@@ -931,6 +1183,35 @@ find_generic_function (DBusHashTable        *table,
       entry = entry->next;
     }
 
+  /* The key may also be in a chain that's not moved over yet */
+  if (table->old_buckets != NULL)
+    {
+      unsigned int old_idx;
+
+      old_idx = chain_index (table, key, table->old_down_shift,
+                             table->old_mask);
+
+      if ((int) old_idx >= table->rehash_index)
+        {
+          for (entry = table->old_buckets[old_idx];
+               entry != NULL;
+               entry = entry->next)
+            {
+              if ((compare_func == NULL && key == entry->key) ||
+                  (compare_func != NULL && (* compare_func) (key, entry->key) == 0))
+                {
+                  if (bucket)
+                    *bucket = &(table->old_buckets[old_idx]);
+
+                  if (preallocated)
+                    _dbus_hash_table_free_preallocated_entry (table, preallocated);
+
+                  return entry;
+                }
+            }
+        }
+    }
+
   if (create_if_not_found)
     entry = add_entry (table, idx, key, bucket, preallocated);
   else if (preallocated)
@@ -1010,15 +1291,93 @@ find_direct_function (DBusHashTable        *table,
                                 preallocated);
 }
 
+/* The bucket a key belongs in, for a chained table of the size that
+ * down_shift and mask are for
+ */
+static unsigned int
+chain_index (DBusHashTable *table,
+             const void    *key,
+             int            down_shift,
+             int            mask)
+{
+  switch (table->key_type)
+    {
+    case DBUS_HASH_STRING:
+      return string_hash (key) & mask;
+    case DBUS_HASH_TWO_STRINGS:
+#ifdef DBUS_BUILD_TESTS
+      return two_strings_hash (key) & mask;
+#else
+      _dbus_assert_not_reached ("two-strings is not enabled");
+      return 0;
+#endif
+    case DBUS_HASH_INT:
+    case DBUS_HASH_UINTPTR:
+    case DBUS_HASH_POINTER:
+      return ((((intptr_t) key) * 1103515245) >> down_shift) & mask;
+    default:
+      _dbus_assert_not_reached ("Unknown hash table type");
+      return 0;
+    }
+}
+
+/* Moves up to n_buckets of the old chains into the new bucket array,
+ * and drops the old array once they're all moved.
+ */
+static void
+rehash_some_buckets (DBusHashTable *table,
+                     int            n_buckets)
+{
+  _dbus_assert (table->old_buckets != NULL);
+
+  while (n_buckets > 0 && table->rehash_index < table->old_n_buckets)
+    {
+      DBusHashEntry **old_chain;
+      DBusHashEntry *entry;
+
+      old_chain = &(table->old_buckets[table->rehash_index]);
+
+      for (entry = *old_chain; entry != NULL; entry = *old_chain)
+        {
+          DBusHashEntry **bucket;
+
+          *old_chain = entry->next;
+
+          bucket = &(table->buckets[chain_index (table, entry->key,
+                                                 table->down_shift,
+                                                 table->mask)]);
+          entry->next = *bucket;
+          *bucket = entry;
+        }
+
+      table->rehash_index += 1;
+      n_buckets -= 1;
+    }
+
+  if (table->rehash_index == table->old_n_buckets)
+    {
+      if (table->old_buckets != table->static_buckets)
+        dbus_free (table->old_buckets);
+
+      table->old_buckets = NULL;
+      table->old_n_buckets = 0;
+      table->rehash_index = 0;
+    }
+}
+
+/* Switches to a bigger or smaller bucket array. The entries move over
+ * a few chains at a time as more are inserted, see
+ * rehash_some_buckets(), so that no single insertion has to rehash
+ * the whole table; lookups meanwhile check both arrays.
+ */
 static void
 rebuild_table (DBusHashTable *table)
 {
-  int old_size;
   int new_buckets;
   DBusHashEntry **old_buckets;
-  DBusHashEntry **old_chain;
-  DBusHashEntry *entry;
   dbus_bool_t growing;
+
+  _dbus_assert (table->old_buckets == NULL);
   
   /*
    * Allocate and initialize the new bucket array, and set up
@@ -1027,7 +1386,6 @@ rebuild_table (DBusHashTable *table)
 
   growing = table->n_entries >= table->hi_rebuild_size;
   
-  old_size = table->n_buckets;
   old_buckets = table->buckets;
 
   if (growing)
@@ -1056,6 +1414,12 @@ rebuild_table (DBusHashTable *table)
       return;
     }
 
+  table->old_buckets = old_buckets;
+  table->old_n_buckets = table->n_buckets;
+  table->old_down_shift = table->down_shift;
+  table->old_mask = table->mask;
+  table->rehash_index = 0;
+
   table->n_buckets = new_buckets;
   
   if (growing)
@@ -1089,53 +1453,305 @@ rebuild_table (DBusHashTable *table)
   _dbus_assert (table->mask != 0);
   /* the mask is essentially the max index */
   _dbus_assert (table->mask < table->n_buckets);
-  
-  /*
-   * Rehash all of the existing entries into the new bucket array.
+}
+
+/* The finalizer from MurmurHash3, so every bit of the key affects
+ * both the slot index (low bits) and the tag (high bits).
+ */
+static unsigned int
+mix_hash (unsigned int h)
+{
+  h ^= h >> 16;
+  h *= 0x85ebca6bU;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35U;
+  h ^= h >> 16;
+
+  return h;
+}
+
+static unsigned int
+direct_hash (void *key)
+{
+  uintptr_t k;
+
+  /* fold in the high half of 64-bit keys; shifting in two steps
+   * keeps this well-defined where uintptr_t is 32 bits
    */
+  k = (uintptr_t) key;
+  return mix_hash ((unsigned int) k ^ (unsigned int) ((k >> 16) >> 16));
+}
 
-  for (old_chain = old_buckets; old_size > 0; old_size--, old_chain++)
+static unsigned int
+open_hash (DBusHashTable *table,
+           void          *key)
+{
+  switch (table->key_type)
     {
-      for (entry = *old_chain; entry != NULL; entry = *old_chain)
-        {
-          unsigned int idx;
-          DBusHashEntry **bucket;
-          
-          *old_chain = entry->next;
-          switch (table->key_type)
-            {
-            case DBUS_HASH_STRING:
-              idx = string_hash (entry->key) & table->mask;
-              break;
-            case DBUS_HASH_TWO_STRINGS:
+    case DBUS_HASH_STRING:
+      return mix_hash (string_hash (key));
+    case DBUS_HASH_TWO_STRINGS:
 #ifdef DBUS_BUILD_TESTS
-              idx = two_strings_hash (entry->key) & table->mask;
+      return mix_hash (two_strings_hash (key));
 #else
-              idx = 0;
-              _dbus_assert_not_reached ("two-strings is not enabled");
+      _dbus_assert_not_reached ("two-strings is not enabled");
+      return 0;
 #endif
-              break;
-            case DBUS_HASH_INT:
-            case DBUS_HASH_UINTPTR:
-            case DBUS_HASH_POINTER:
-              idx = RANDOM_INDEX (table, entry->key);
-              break;
-            default:
-              idx = 0;
-              _dbus_assert_not_reached ("Unknown hash table type");
-              break;
+    case DBUS_HASH_INT:
+    case DBUS_HASH_UINTPTR:
+    case DBUS_HASH_POINTER:
+      return direct_hash (key);
+    default:
+      _dbus_assert_not_reached ("Unknown hash table type");
+      return 0;
+    }
+}
+
+/* Where an entry with this hash would go: the first slot along its
+ * probe sequence that is not full.
+ */
+static int
+find_open_insert_slot (DBusHashTable *table,
+                       unsigned int   hash)
+{
+  int idx;
+
+  idx = hash & table->mask;
+  while (SLOT_IS_FULL (table->ctrl[idx]))
+    idx = (idx + 1) & table->mask;
+
+  return idx;
+}
+
+/* Rehashes into a new slot array big enough for n_wanted entries at
+ * no more than half full, dropping removed markers on the way. As for
+ * chained tables, failing to allocate just leaves things as they are.
+ */
+static void
+rebuild_open_table (DBusHashTable *table,
+                    int            n_wanted)
+{
+  unsigned char *old_ctrl;
+  DBusHashEntry *old_slots;
+  int old_size;
+  int new_size;
+  int i;
+
+  new_size = DBUS_SMALL_OPEN_HASH_TABLE;
+  while (new_size / 2 < n_wanted)
+    {
+      /* overflow paranoia */
+      if (new_size > _DBUS_INT_MAX / 4)
+        return;
+      new_size *= 2;
+    }
+
+  if (new_size == table->n_buckets && table->n_removed == 0)
+    return;
+
+  old_ctrl = table->ctrl;
+  old_slots = table->slots;
+  old_size = table->n_buckets;
+
+  table->ctrl = dbus_malloc (new_size);
+  table->slots = dbus_new (DBusHashEntry, new_size);
+  if (table->ctrl == NULL || table->slots == NULL)
+    {
+      dbus_free (table->ctrl);
+      dbus_free (table->slots);
+      table->ctrl = old_ctrl;
+      table->slots = old_slots;
+      return;
+    }
+
+  memset (table->ctrl, SLOT_EMPTY, new_size);
+  table->n_buckets = new_size;
+  table->mask = new_size - 1;
+  table->n_removed = 0;
+
+  for (i = 0; i < old_size; i++)
+    {
+      unsigned int hash;
+      int idx;
+
+      if (!SLOT_IS_FULL (old_ctrl[i]))
+        continue;
+
+      hash = open_hash (table, old_slots[i].key);
+      idx = find_open_insert_slot (table, hash);
+
+      table->ctrl[idx] = SLOT_TAG (hash);
+      table->slots[idx] = old_slots[i];
+    }
+
+  dbus_free (old_ctrl);
+  dbus_free (old_slots);
+}
+
+/* Sets aside a slot for an entry about to be added, so that adding it
+ * can't fail. A slot is always left empty, since that is what ends an
+ * unsuccessful probe. Rebuilds first if more than three quarters of
+ * the slots are taken by entries and removed markers, since probes
+ * get long past that, or if the table is mostly empty; like chained
+ * tables, only ever when adding, so removing while iterating stays
+ * safe.
+ */
+static dbus_bool_t
+reserve_open_slot (DBusHashTable *table)
+{
+  int n_used;
+
+  n_used = table->n_entries + table->n_removed + table->n_reserved + 1;
+
+  if (n_used > table->n_buckets - table->n_buckets / 4 ||
+      (table->n_buckets > DBUS_SMALL_OPEN_HASH_TABLE &&
+       n_used < table->n_buckets / 8))
+    rebuild_open_table (table, table->n_entries + table->n_reserved + 1);
+
+  if (table->n_entries + table->n_removed + table->n_reserved + 1 >=
+      table->n_buckets)
+    return FALSE;
+
+  table->n_reserved += 1;
+  return TRUE;
+}
+
+static DBusHashEntry*
+find_open_generic_function (DBusHashTable        *table,
+                            void                 *key,
+                            unsigned int          hash,
+                            KeyCompareFunc        compare_func,
+                            dbus_bool_t           create_if_not_found,
+                            DBusHashEntry      ***bucket,
+                            DBusPreallocatedHash *preallocated)
+{
+  DBusHashEntry *entry;
+  unsigned char tag;
+  int idx;
+
+  if (bucket)
+    *bucket = NULL;
+
+  tag = SLOT_TAG (hash);
+
+  /* There is always an empty slot, so this ends */
+  idx = hash & table->mask;
+  while (table->ctrl[idx] != SLOT_EMPTY)
+    {
+      if (table->ctrl[idx] == tag)
+        {
+          entry = &table->slots[idx];
+
+          if ((compare_func == NULL && key == entry->key) ||
+              (compare_func != NULL && (* compare_func) (key, entry->key) == 0))
+            {
+              if (preallocated)
+                _dbus_hash_table_free_preallocated_entry (table, preallocated);
+
+              return entry;
             }
-          
-          bucket = &(table->buckets[idx]);
-          entry->next = *bucket;
-          *bucket = entry;
         }
+
+      idx = (idx + 1) & table->mask;
+    }
+
+  if (!create_if_not_found)
+    {
+      if (preallocated)
+        _dbus_hash_table_free_preallocated_entry (table, preallocated);
+
+      return NULL;
+    }
+
+  if (preallocated == NULL && !reserve_open_slot (table))
+    return NULL;
+
+  /* reuse a removed slot along the way if there was one; this also
+   * copes with reserve_open_slot() having rebuilt the table
+   */
+  idx = find_open_insert_slot (table, hash);
+
+  if (table->ctrl[idx] == SLOT_REMOVED)
+    table->n_removed -= 1;
+
+  table->ctrl[idx] = tag;
+  table->n_reserved -= 1;
+  table->n_entries += 1;
+
+  entry = &table->slots[idx];
+  entry->next = NULL;
+  entry->key = key;
+  entry->value = NULL;
+
+  return entry;
+}
+
+static DBusHashEntry*
+find_open_string_function (DBusHashTable        *table,
+                           void                 *key,
+                           dbus_bool_t           create_if_not_found,
+                           DBusHashEntry      ***bucket,
+                           DBusPreallocatedHash *preallocated)
+{
+  return find_open_generic_function (table, key,
+                                     mix_hash (string_hash (key)),
+                                     (KeyCompareFunc) strcmp,
+                                     create_if_not_found, bucket,
+                                     preallocated);
+}
+
+#ifdef DBUS_BUILD_TESTS
+static DBusHashEntry*
+find_open_two_strings_function (DBusHashTable        *table,
+                                void                 *key,
+                                dbus_bool_t           create_if_not_found,
+                                DBusHashEntry      ***bucket,
+                                DBusPreallocatedHash *preallocated)
+{
+  return find_open_generic_function (table, key,
+                                     mix_hash (two_strings_hash (key)),
+                                     (KeyCompareFunc) two_strings_cmp,
+                                     create_if_not_found, bucket,
+                                     preallocated);
+}
+#endif /* DBUS_BUILD_TESTS */
+
+static DBusHashEntry*
+find_open_direct_function (DBusHashTable        *table,
+                           void                 *key,
+                           dbus_bool_t           create_if_not_found,
+                           DBusHashEntry      ***bucket,
+                           DBusPreallocatedHash *preallocated)
+{
+  return find_open_generic_function (table, key, direct_hash (key), NULL,
+                                     create_if_not_found, bucket,
+                                     preallocated);
+}
+
+static void
+remove_open_entry (DBusHashTable *table,
+                   DBusHashEntry *entry)
+{
+  int idx;
+
+  idx = entry - table->slots;
+
+  _dbus_assert (idx >= 0 && idx < table->n_buckets);
+  _dbus_assert (SLOT_IS_FULL (table->ctrl[idx]));
+
+  /* Other entries may have probed past this slot, so it normally has
+   * to stay non-empty; but if the next slot is empty, nothing did.
+   */
+  if (table->ctrl[(idx + 1) & table->mask] == SLOT_EMPTY)
+    table->ctrl[idx] = SLOT_EMPTY;
+  else
+    {
+      table->ctrl[idx] = SLOT_REMOVED;
+      table->n_removed += 1;
     }
-  
-  /* Free the old bucket array, if it was dynamically allocated. */
 
-  if (old_buckets != table->static_buckets)
-    dbus_free (old_buckets);
+  table->n_entries -= 1;
+  free_entry_data (table, entry);
 }
 
 /**
@@ -1627,6 +2243,17 @@ DBusPreallocatedHash*
 _dbus_hash_table_preallocate_entry (DBusHashTable *table)
 {
   DBusHashEntry *entry;
+
+  /* For open-addressed tables what's preallocated is a slot; the
+   * handle itself doesn't matter as long as it isn't #NULL.
+   */
+  if (table->ctrl != NULL)
+    {
+      if (!reserve_open_slot (table))
+        return NULL;
+
+      return (DBusPreallocatedHash*) table;
+    }
   
   entry = alloc_entry (table);
 
@@ -1647,6 +2274,13 @@ _dbus_hash_table_free_preallocated_entry (DBusHashTable        *table,
   DBusHashEntry *entry;
 
   _dbus_assert (preallocated != NULL);
+
+  if (table->ctrl != NULL)
+    {
+      _dbus_assert (table->n_reserved > 0);
+      table->n_reserved -= 1;
+      return;
+    }
   
   entry = (DBusHashEntry*) preallocated;
   
@@ -1730,6 +2364,64 @@ count_entries (DBusHashTable *table)
   return count;
 }
 
+/* Every key stays visible, to lookups and iteration, and removable
+ * while a resize is spread over later insertions
+ */
+static void
+check_incremental_rehash (void)
+{
+/* a little past the resize at 12288 entries, so it's still going */
+#define N_REHASH_KEYS 12400
+  DBusHashTable *table;
+  dbus_bool_t saw_resize;
+  int i;
+
+  table = _dbus_hash_table_new (DBUS_HASH_INT, NULL, NULL);
+  if (table == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  saw_resize = FALSE;
+  for (i = 0; i < N_REHASH_KEYS; i++)
+    {
+      if (!_dbus_hash_table_insert_int (table, i, _DBUS_INT_TO_POINTER (i + 1)))
+        _dbus_assert_not_reached ("no memory");
+
+      if (table->old_buckets != NULL)
+        {
+          int j;
+
+          saw_resize = TRUE;
+
+          /* a full check at every step would be quadratic */
+          if (i % 97 == 0)
+            {
+              for (j = 0; j <= i; j++)
+                _dbus_assert (_dbus_hash_table_lookup_int (table, j) ==
+                              _DBUS_INT_TO_POINTER (j + 1));
+
+              _dbus_assert (count_entries (table) == i + 1);
+            }
+        }
+    }
+
+  _dbus_assert (saw_resize);
+  _dbus_assert (table->old_buckets != NULL);
+
+  /* removing never moves chains, so this finds some in each array */
+  for (i = 0; i < N_REHASH_KEYS; i += 2)
+    {
+      if (!_dbus_hash_table_remove_int (table, i))
+        _dbus_assert_not_reached ("entry went missing");
+    }
+
+  for (i = 0; i < N_REHASH_KEYS; i++)
+    _dbus_assert ((_dbus_hash_table_lookup_int (table, i) != NULL) == (i % 2 == 1));
+
+  _dbus_assert (count_entries (table) == N_REHASH_KEYS / 2);
+
+  _dbus_hash_table_unref (table);
+}
+
 /* Copy the foo\0bar\0 double string thing */
 static char*
 _dbus_strdup2 (const char *str)
@@ -1752,13 +2444,24 @@ _dbus_strdup2 (const char *str)
   return copy;
 }
 
-/**
- * @ingroup DBusHashTableInternals
- * Unit test for DBusHashTable
- * @returns #TRUE on success.
- */
-dbus_bool_t
-_dbus_hash_test (void)
+static DBusHashTable*
+test_table_new (dbus_bool_t      open_addressed,
+                DBusHashType     type,
+                DBusFreeFunction key_free_function,
+                DBusFreeFunction value_free_function)
+{
+  if (open_addressed)
+    return _dbus_hash_table_new_open_addressed (type, key_free_function,
+                                                value_free_function);
+  else
+    return _dbus_hash_table_new (type, key_free_function,
+                                 value_free_function);
+}
+
+/* The same checks run against both kinds of table */
+static dbus_bool_t
+test_tables (char        **keys,
+             dbus_bool_t   open_addressed)
 {
   int i;
   DBusHashTable *table1;
@@ -1766,57 +2469,25 @@ _dbus_hash_test (void)
   DBusHashTable *table3;
   DBusHashTable *table4;
   DBusHashIter iter;
-#define N_HASH_KEYS 5000
-  char **keys;
   dbus_bool_t ret = FALSE;
 
-  keys = dbus_new (char *, N_HASH_KEYS);
-  if (keys == NULL)
-    _dbus_assert_not_reached ("no memory");
-
-  for (i = 0; i < N_HASH_KEYS; i++)
-    {
-      keys[i] = dbus_malloc (128);
-
-      if (keys[i] == NULL)
-	_dbus_assert_not_reached ("no memory");
-    }
-
-  printf ("Computing test hash keys...\n");
-  i = 0;
-  while (i < N_HASH_KEYS)
-    {
-      int len;
-
-      /* all the hash keys are TWO_STRINGS, but
-       * then we can also use those as regular strings.
-       */
-      
-      len = sprintf (keys[i], "Hash key %d", i);
-      sprintf (keys[i] + len + 1, "Two string %d", i);
-      _dbus_assert (*(keys[i] + len) == '\0');
-      _dbus_assert (*(keys[i] + len + 1) != '\0');
-      ++i;
-    }
-  printf ("... done.\n");
-  
-  table1 = _dbus_hash_table_new (DBUS_HASH_STRING,
-                                 dbus_free, dbus_free);
+  table1 = test_table_new (open_addressed, DBUS_HASH_STRING,
+                           dbus_free, dbus_free);
   if (table1 == NULL)
     goto out;
 
-  table2 = _dbus_hash_table_new (DBUS_HASH_INT,
-                                 NULL, dbus_free);
+  table2 = test_table_new (open_addressed, DBUS_HASH_INT,
+                           NULL, dbus_free);
   if (table2 == NULL)
     goto out;
 
-  table3 = _dbus_hash_table_new (DBUS_HASH_UINTPTR,
-                                 NULL, dbus_free);
+  table3 = test_table_new (open_addressed, DBUS_HASH_UINTPTR,
+                           NULL, dbus_free);
   if (table3 == NULL)
     goto out;
 
-  table4 = _dbus_hash_table_new (DBUS_HASH_TWO_STRINGS,
-                                 dbus_free, dbus_free);
+  table4 = test_table_new (open_addressed, DBUS_HASH_TWO_STRINGS,
+                           dbus_free, dbus_free);
   if (table4 == NULL)
     goto out;
 
@@ -1931,13 +2602,13 @@ _dbus_hash_test (void)
    * that iteration works correctly (finds the right
    * values, iter_set_value works, etc.)
    */
-  table1 = _dbus_hash_table_new (DBUS_HASH_STRING,
-                                 dbus_free, dbus_free);
+  table1 = test_table_new (open_addressed, DBUS_HASH_STRING,
+                           dbus_free, dbus_free);
   if (table1 == NULL)
     goto out;
   
-  table2 = _dbus_hash_table_new (DBUS_HASH_INT,
-                                 NULL, dbus_free);
+  table2 = test_table_new (open_addressed, DBUS_HASH_INT,
+                           NULL, dbus_free);
   if (table2 == NULL)
     goto out;
   
@@ -2089,13 +2760,13 @@ _dbus_hash_test (void)
   /* Now do a bunch of things again using _dbus_hash_iter_lookup() to
    * be sure that interface works.
    */
-  table1 = _dbus_hash_table_new (DBUS_HASH_STRING,
-                                 dbus_free, dbus_free);
+  table1 = test_table_new (open_addressed, DBUS_HASH_STRING,
+                           dbus_free, dbus_free);
   if (table1 == NULL)
     goto out;
   
-  table2 = _dbus_hash_table_new (DBUS_HASH_INT,
-                                 NULL, dbus_free);
+  table2 = test_table_new (open_addressed, DBUS_HASH_INT,
+                           NULL, dbus_free);
   if (table2 == NULL)
     goto out;
   
@@ -2183,10 +2854,179 @@ _dbus_hash_test (void)
   ret = TRUE;
 
  out:
+  return ret;
+}
+
+#define N_BENCHMARK_KEYS 100000
+/* visits every key once, but not in the order they were inserted */
+#define BENCHMARK_KEY(i) (((i) * 7919) % N_BENCHMARK_KEYS)
+
+static long
+elapsed_usec (long *sec,
+              long *usec)
+{
+  long now_sec, now_usec;
+  long elapsed;
+
+  _dbus_get_current_time (&now_sec, &now_usec);
+  elapsed = (now_sec - *sec) * 1000000 + (now_usec - *usec);
+  *sec = now_sec;
+  *usec = now_usec;
+
+  return elapsed;
+}
+
+static void
+benchmark_table (dbus_bool_t   open_addressed,
+                 DBusHashType  type,
+                 char        **keys)
+{
+  DBusHashTable *table;
+  long sec, usec;
+  long insert_usec, lookup_usec, remove_usec;
+  int i;
+  int round;
+
+  table = test_table_new (open_addressed, type, NULL, NULL);
+  if (table == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  elapsed_usec (&sec, &usec);
+
+  for (i = 0; i < N_BENCHMARK_KEYS; i++)
+    {
+      if (type == DBUS_HASH_STRING ?
+          !_dbus_hash_table_insert_string (table, keys[i], keys[i]) :
+          !_dbus_hash_table_insert_uintptr (table, i, keys[i]))
+        _dbus_assert_not_reached ("no memory");
+    }
+
+  insert_usec = elapsed_usec (&sec, &usec);
+
+  for (round = 0; round < 10; round++)
+    {
+      for (i = 0; i < N_BENCHMARK_KEYS; i++)
+        {
+          int k = BENCHMARK_KEY (i);
+          void *value;
+
+          if (type == DBUS_HASH_STRING)
+            value = _dbus_hash_table_lookup_string (table, keys[k]);
+          else
+            value = _dbus_hash_table_lookup_uintptr (table, k);
+
+          if (value != keys[k])
+            _dbus_assert_not_reached ("benchmark key missing");
+        }
+    }
+
+  lookup_usec = elapsed_usec (&sec, &usec);
+
+  for (i = 0; i < N_BENCHMARK_KEYS; i++)
+    {
+      int k = BENCHMARK_KEY (i);
+
+      if (type == DBUS_HASH_STRING ?
+          !_dbus_hash_table_remove_string (table, keys[k]) :
+          !_dbus_hash_table_remove_uintptr (table, k))
+        _dbus_assert_not_reached ("benchmark key missing");
+    }
+
+  remove_usec = elapsed_usec (&sec, &usec);
+
+  _dbus_assert (_dbus_hash_table_get_n_entries (table) == 0);
+  _dbus_hash_table_unref (table);
+
+  printf ("%s %s table, %d keys: insert %ld ms, 10x lookup %ld ms, remove %ld ms\n",
+          open_addressed ? "Open-addressed" : "Chained",
+          type == DBUS_HASH_STRING ? "string" : "uintptr",
+          N_BENCHMARK_KEYS, insert_usec / 1000, lookup_usec / 1000,
+          remove_usec / 1000);
+}
+
+static void
+benchmark_tables (void)
+{
+  char **keys;
+  int i;
+
+  keys = dbus_new (char *, N_BENCHMARK_KEYS);
+  if (keys == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  for (i = 0; i < N_BENCHMARK_KEYS; i++)
+    {
+      keys[i] = dbus_malloc (32);
+      if (keys[i] == NULL)
+        _dbus_assert_not_reached ("no memory");
+      sprintf (keys[i], "Benchmark key %d", i);
+    }
+
+  benchmark_table (FALSE, DBUS_HASH_STRING, keys);
+  benchmark_table (TRUE, DBUS_HASH_STRING, keys);
+  benchmark_table (FALSE, DBUS_HASH_UINTPTR, keys);
+  benchmark_table (TRUE, DBUS_HASH_UINTPTR, keys);
+
+  for (i = 0; i < N_BENCHMARK_KEYS; i++)
+    dbus_free (keys[i]);
+  dbus_free (keys);
+}
+
+/**
+ * @ingroup DBusHashTableInternals
+ * Unit test for DBusHashTable
+ * @returns #TRUE on success.
+ */
+dbus_bool_t
+_dbus_hash_test (void)
+{
+  int i;
+#define N_HASH_KEYS 5000
+  char **keys;
+  dbus_bool_t ret;
+
+  keys = dbus_new (char *, N_HASH_KEYS);
+  if (keys == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  for (i = 0; i < N_HASH_KEYS; i++)
+    {
+      keys[i] = dbus_malloc (128);
+
+      if (keys[i] == NULL)
+	_dbus_assert_not_reached ("no memory");
+    }
+
+  printf ("Computing test hash keys...\n");
+  i = 0;
+  while (i < N_HASH_KEYS)
+    {
+      int len;
+
+      /* all the hash keys are TWO_STRINGS, but
+       * then we can also use those as regular strings.
+       */
+      
+      len = sprintf (keys[i], "Hash key %d", i);
+      sprintf (keys[i] + len + 1, "Two string %d", i);
+      _dbus_assert (*(keys[i] + len) == '\0');
+      _dbus_assert (*(keys[i] + len + 1) != '\0');
+      ++i;
+    }
+  printf ("... done.\n");
+
+  ret = test_tables (keys, FALSE) && test_tables (keys, TRUE);
+
+  if (ret)
+    check_incremental_rehash ();
+
   for (i = 0; i < N_HASH_KEYS; i++)
     dbus_free (keys[i]);
 
   dbus_free (keys);
+
+  if (ret)
+    benchmark_tables ();
   
   return ret;
 }
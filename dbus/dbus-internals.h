@@ -118,6 +118,22 @@ static void _dbus_verbose(const char * x,...) {;}
 #  define _dbus_is_verbose() FALSE 
 #endif /* !DBUS_ENABLE_VERBOSE_MODE */
 
+/* Static tracepoints for perf, SystemTap or bpftrace, in the "dbus"
+ * provider; a double underscore in the name becomes a dash in the
+ * probe.  While nothing is attached each one is a single nop, so
+ * unlike _dbus_verbose() they can stay in production builds.
+ */
+#ifdef DBUS_ENABLE_TRACEPOINTS
+#include <sys/sdt.h>
+#  define _dbus_trace1(name, a)       DTRACE_PROBE1 (dbus, name, a)
+#  define _dbus_trace2(name, a, b)    DTRACE_PROBE2 (dbus, name, a, b)
+#  define _dbus_trace3(name, a, b, c) DTRACE_PROBE3 (dbus, name, a, b, c)
+#else
+#  define _dbus_trace1(name, a)
+#  define _dbus_trace2(name, a, b)
+#  define _dbus_trace3(name, a, b, c)
+#endif /* !DBUS_ENABLE_TRACEPOINTS */
+
 const char* _dbus_strerror (int error_number);
 
 #ifdef DBUS_DISABLE_ASSERT
@@ -294,6 +310,40 @@ dbus_bool_t _dbus_test_oom_handling (const char             *description,
 #define _dbus_get_malloc_blocks_outstanding  (0)
 #endif /* !DBUS_BUILD_TESTS */
 
+/* Allocation profiling, enabled by DBUS_MALLOC_PROFILE in the
+ * environment.  Allocations are counted against the subsystem of the
+ * file they are made in; a file says which one it belongs to by
+ * redefining DBUS_ALLOC_SUBSYSTEM after its includes.
+ */
+typedef enum
+{
+  DBUS_ALLOC_SUBSYSTEM_OTHER,
+  DBUS_ALLOC_SUBSYSTEM_MESSAGE,
+  DBUS_ALLOC_SUBSYSTEM_STRING,
+  DBUS_ALLOC_SUBSYSTEM_LIST,
+  DBUS_ALLOC_SUBSYSTEM_HASH,
+  DBUS_ALLOC_SUBSYSTEM_CONNECTION,
+  DBUS_N_ALLOC_SUBSYSTEMS
+} DBusAllocSubsystem;
+
+#define DBUS_ALLOC_SUBSYSTEM DBUS_ALLOC_SUBSYSTEM_OTHER
+
+void*       _dbus_malloc_in                     (size_t              bytes,
+                                                 DBusAllocSubsystem  subsystem);
+void*       _dbus_malloc0_in                    (size_t              bytes,
+                                                 DBusAllocSubsystem  subsystem);
+void*       _dbus_realloc_in                    (void               *memory,
+                                                 size_t              bytes,
+                                                 DBusAllocSubsystem  subsystem);
+dbus_bool_t _dbus_get_alloc_profile             (DBusAllocSubsystem  subsystem,
+                                                 dbus_uint32_t      *n_allocations,
+                                                 dbus_uint32_t      *n_blocks,
+                                                 dbus_uint32_t      *n_bytes);
+
+#define dbus_malloc(bytes)          _dbus_malloc_in ((bytes), DBUS_ALLOC_SUBSYSTEM)
+#define dbus_malloc0(bytes)         _dbus_malloc0_in ((bytes), DBUS_ALLOC_SUBSYSTEM)
+#define dbus_realloc(memory, bytes) _dbus_realloc_in ((memory), (bytes), DBUS_ALLOC_SUBSYSTEM)
+
 typedef void (* DBusShutdownFunction) (void *data);
 dbus_bool_t _dbus_register_shutdown_func (DBusShutdownFunction  function,
                                           void                 *data);
@@ -319,17 +369,23 @@ _DBUS_DECLARE_GLOBAL_LOCK (bus_datas);
 _DBUS_DECLARE_GLOBAL_LOCK (shutdown_funcs);
 _DBUS_DECLARE_GLOBAL_LOCK (system_users);
 _DBUS_DECLARE_GLOBAL_LOCK (message_cache);
-/* 10-14 */
+/* 10-19 */
 _DBUS_DECLARE_GLOBAL_LOCK (shared_connections);
 _DBUS_DECLARE_GLOBAL_LOCK (win_fds);
 _DBUS_DECLARE_GLOBAL_LOCK (sid_atom_cache);
 _DBUS_DECLARE_GLOBAL_LOCK (machine_uuid);
-
-#if !DBUS_USE_SYNC
+_DBUS_DECLARE_GLOBAL_LOCK (message_pool);
+_DBUS_DECLARE_GLOBAL_LOCK (keyring_cache);
+_DBUS_DECLARE_GLOBAL_LOCK (spawn);
+_DBUS_DECLARE_GLOBAL_LOCK (connection_pool);
+_DBUS_DECLARE_GLOBAL_LOCK (auth_tickets);
+_DBUS_DECLARE_GLOBAL_LOCK (inproc_servers);
+
+#ifdef DBUS_ATOMIC_NEEDS_LOCK
 _DBUS_DECLARE_GLOBAL_LOCK (atomic);
-#define _DBUS_N_GLOBAL_LOCKS (15)
+#define _DBUS_N_GLOBAL_LOCKS (21)
 #else
-#define _DBUS_N_GLOBAL_LOCKS (14)
+#define _DBUS_N_GLOBAL_LOCKS (20)
 #endif
 
 dbus_bool_t _dbus_threads_init_debug (void);
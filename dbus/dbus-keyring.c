@@ -173,6 +173,317 @@ free_keys (DBusKey *keys,
   dbus_free (keys);
 }
 
+/* Makes room for one more key. The secrets may be stored inside the
+ * DBusKey structs themselves, so they are relocated into a new array
+ * rather than moved around by dbus_realloc().
+ */
+static DBusKey*
+grow_keys (DBusKey *keys,
+           int      n_keys)
+{
+  DBusKey *new;
+  int i;
+
+  new = dbus_new (DBusKey, n_keys + 1);
+  if (new == NULL)
+    return NULL;
+
+  for (i = 0; i < n_keys; i++)
+    {
+      new[i].id = keys[i].id;
+      new[i].creation_time = keys[i].creation_time;
+      _dbus_string_relocate (&new[i].secret, &keys[i].secret);
+    }
+
+  dbus_free (keys);
+
+  return new;
+}
+
+static dbus_bool_t
+key_timestamp_is_valid (long timestamp,
+                        long now)
+{
+  return !(timestamp < 0 ||
+           (now + MAX_TIME_TRAVEL_SECONDS) < timestamp ||
+           (now - EXPIRE_KEYS_TIMEOUT_SECONDS) > timestamp);
+}
+
+static void
+zero_and_free_keys (DBusKey *keys,
+                    int      n_keys)
+{
+  int i;
+
+  for (i = 0; i < n_keys; i++)
+    _dbus_string_zero (&keys[i].secret);
+
+  free_keys (keys, n_keys);
+}
+
+/* Copies the keys that haven't expired by @now into a new array. */
+static dbus_bool_t
+copy_keys (const DBusKey  *keys,
+           int             n_keys,
+           long            now,
+           DBusKey       **copy_p,
+           int            *n_copied_p)
+{
+  DBusKey *copy;
+  int n_copied;
+  int i;
+
+  *copy_p = NULL;
+  *n_copied_p = 0;
+
+  if (n_keys == 0)
+    return TRUE;
+
+  copy = dbus_new (DBusKey, n_keys);
+  if (copy == NULL)
+    return FALSE;
+
+  n_copied = 0;
+  for (i = 0; i < n_keys; i++)
+    {
+      if (!key_timestamp_is_valid (keys[i].creation_time, now))
+        continue;
+
+      if (!_dbus_string_init (&copy[n_copied].secret))
+        goto nomem;
+
+      if (!_dbus_string_copy (&keys[i].secret, 0,
+                              &copy[n_copied].secret, 0))
+        {
+          _dbus_string_free (&copy[n_copied].secret);
+          goto nomem;
+        }
+
+      copy[n_copied].id = keys[i].id;
+      copy[n_copied].creation_time = keys[i].creation_time;
+      n_copied += 1;
+    }
+
+  *copy_p = copy;
+  *n_copied_p = n_copied;
+  return TRUE;
+
+ nomem:
+  zero_and_free_keys (copy, n_copied);
+  return FALSE;
+}
+
+/* Every DBusAuth using DBUS_COOKIE_SHA1 creates its own DBusKeyring,
+ * so without this each authentication re-reads and re-parses the
+ * keyring file. Instead, the keys parsed from each file are kept
+ * along with a stamp of the file they came from, and reused until
+ * the file changes.
+ */
+
+/**
+ * Keys parsed from one keyring file
+ */
+typedef struct
+{
+  DBusString filename; /**< Keyring file the keys came from */
+  DBusFileStamp stamp; /**< The file when the keys were parsed */
+  DBusKey *keys;       /**< Keys found in the file */
+  int n_keys;          /**< Number of keys */
+} DBusKeyringCacheEntry;
+
+/** Number of keyring files whose keys are cached */
+#define MAX_CACHED_KEYRINGS 8
+
+_DBUS_DEFINE_GLOBAL_LOCK (keyring_cache);
+static DBusKeyringCacheEntry *keyring_cache[MAX_CACHED_KEYRINGS];
+static int keyring_cache_count = 0;
+static dbus_bool_t keyring_cache_shutdown_registered = FALSE;
+
+static dbus_bool_t
+file_stamps_equal (const DBusFileStamp *a,
+                   const DBusFileStamp *b)
+{
+  return a->device == b->device &&
+    a->inode == b->inode &&
+    a->size == b->size &&
+    a->mtime == b->mtime &&
+    a->mtime_nsec == b->mtime_nsec;
+}
+
+static void
+keyring_cache_entry_free (DBusKeyringCacheEntry *entry)
+{
+  zero_and_free_keys (entry->keys, entry->n_keys);
+  _dbus_string_free (&entry->filename);
+  dbus_free (entry);
+}
+
+/* Must be called with the keyring_cache lock held */
+static int
+keyring_cache_find_unlocked (const DBusString *filename)
+{
+  int i;
+
+  for (i = 0; i < keyring_cache_count; i++)
+    {
+      if (_dbus_string_equal (&keyring_cache[i]->filename, filename))
+        return i;
+    }
+
+  return -1;
+}
+
+/* Must be called with the keyring_cache lock held */
+static void
+keyring_cache_remove_unlocked (int i)
+{
+  keyring_cache_entry_free (keyring_cache[i]);
+
+  keyring_cache_count -= 1;
+  memmove (&keyring_cache[i], &keyring_cache[i + 1],
+           (keyring_cache_count - i) * sizeof (keyring_cache[0]));
+}
+
+static void
+keyring_cache_shutdown (void *data)
+{
+  _DBUS_LOCK (keyring_cache);
+
+  while (keyring_cache_count > 0)
+    keyring_cache_remove_unlocked (keyring_cache_count - 1);
+
+  keyring_cache_shutdown_registered = FALSE;
+
+  _DBUS_UNLOCK (keyring_cache);
+}
+
+/**
+ * Copies the cached keys for a keyring file, if they were parsed
+ * from the same version of the file as @stamp describes.
+ *
+ * @param filename the keyring file
+ * @param stamp the file as it is now
+ * @param now the current time, for dropping expired keys
+ * @param keys_p return location for the keys, or #NULL on a miss
+ * @param n_keys_p return location for the number of keys
+ * @param hit_p return location for whether the cache had the file
+ * @returns #FALSE if not enough memory
+ */
+static dbus_bool_t
+keyring_cache_get (const DBusString    *filename,
+                   const DBusFileStamp *stamp,
+                   long                 now,
+                   DBusKey            **keys_p,
+                   int                 *n_keys_p,
+                   dbus_bool_t         *hit_p)
+{
+  dbus_bool_t retval;
+  int i;
+
+  *keys_p = NULL;
+  *n_keys_p = 0;
+  *hit_p = FALSE;
+  retval = TRUE;
+
+  _DBUS_LOCK (keyring_cache);
+
+  i = keyring_cache_find_unlocked (filename);
+  if (i >= 0 && file_stamps_equal (&keyring_cache[i]->stamp, stamp))
+    {
+      retval = copy_keys (keyring_cache[i]->keys, keyring_cache[i]->n_keys,
+                          now, keys_p, n_keys_p);
+      *hit_p = retval;
+    }
+
+  _DBUS_UNLOCK (keyring_cache);
+
+  return retval;
+}
+
+/**
+ * Remembers the keys parsed from a keyring file, replacing any
+ * older version of the same file. Failing to cache isn't an
+ * error, the file will just be parsed again next time.
+ *
+ * @param filename the keyring file
+ * @param stamp the file the keys were parsed from
+ * @param keys the keys
+ * @param n_keys number of keys
+ */
+static void
+keyring_cache_put (const DBusString    *filename,
+                   const DBusFileStamp *stamp,
+                   const DBusKey       *keys,
+                   int                  n_keys)
+{
+  DBusKeyringCacheEntry *entry;
+  long now;
+  int i;
+
+  entry = dbus_new0 (DBusKeyringCacheEntry, 1);
+  if (entry == NULL)
+    return;
+
+  if (!_dbus_string_init (&entry->filename))
+    {
+      dbus_free (entry);
+      return;
+    }
+
+  _dbus_get_current_time (&now, NULL);
+
+  if (!_dbus_string_copy (filename, 0, &entry->filename, 0) ||
+      !copy_keys (keys, n_keys, now, &entry->keys, &entry->n_keys))
+    {
+      keyring_cache_entry_free (entry);
+      return;
+    }
+
+  entry->stamp = *stamp;
+
+  _DBUS_LOCK (keyring_cache);
+
+  if (!keyring_cache_shutdown_registered)
+    {
+      if (!_dbus_register_shutdown_func (keyring_cache_shutdown, NULL))
+        {
+          _DBUS_UNLOCK (keyring_cache);
+          keyring_cache_entry_free (entry);
+          return;
+        }
+
+      keyring_cache_shutdown_registered = TRUE;
+    }
+
+  i = keyring_cache_find_unlocked (filename);
+  if (i >= 0)
+    keyring_cache_remove_unlocked (i);
+  else if (keyring_cache_count == MAX_CACHED_KEYRINGS)
+    keyring_cache_remove_unlocked (keyring_cache_count - 1);
+
+  /* most recently loaded first */
+  memmove (&keyring_cache[1], &keyring_cache[0],
+           keyring_cache_count * sizeof (keyring_cache[0]));
+  keyring_cache[0] = entry;
+  keyring_cache_count += 1;
+
+  _DBUS_UNLOCK (keyring_cache);
+}
+
+static void
+keyring_cache_forget (const DBusString *filename)
+{
+  int i;
+
+  _DBUS_LOCK (keyring_cache);
+
+  i = keyring_cache_find_unlocked (filename);
+  if (i >= 0)
+    keyring_cache_remove_unlocked (i);
+
+  _DBUS_UNLOCK (keyring_cache);
+}
+
 /* Our locking scheme is highly unreliable.  However, there is
  * unfortunately no reliable locking scheme in user home directories;
  * between bugs in Linux NFS, people using Tru64 or other total crap
@@ -277,6 +588,32 @@ find_key_by_id (DBusKey *keys,
   return NULL;
 }
 
+static DBusKey*
+find_recent_key (DBusKey *keys,
+                 int      n_keys)
+{
+  int i;
+  long tv_sec, tv_usec;
+
+  _dbus_get_current_time (&tv_sec, &tv_usec);
+  
+  i = 0;
+  while (i < n_keys)
+    {
+      DBusKey *key = &keys[i];
+
+      _dbus_verbose ("Key %d is %ld seconds old\n",
+                     i, tv_sec - key->creation_time);
+      
+      if ((tv_sec - NEW_KEY_TIMEOUT_SECONDS) < key->creation_time)
+        return key;
+      
+      ++i;
+    }
+
+  return NULL;
+}
+
 static dbus_bool_t
 add_new_key (DBusKey  **keys_p,
              int       *n_keys_p,
@@ -337,7 +674,7 @@ add_new_key (DBusKey  **keys_p,
       goto out;
     }
 
-  new = dbus_realloc (keys, sizeof (DBusKey) * (n_keys + 1));
+  new = grow_keys (keys, n_keys);
   if (new == NULL)
     {
       dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
@@ -387,6 +724,12 @@ add_new_key (DBusKey  **keys_p,
  * lock it, which avoids a lot of lock contention at login time and
  * such.
  *
+ * Without add_new, the keys are taken from the keyring cache if the
+ * file hasn't changed since it was last parsed. With add_new, no key
+ * is added if the file already has a recent one, which happens when
+ * several servers find their keys stale at once and queue up on the
+ * lock file: only the first one to get it has to write.
+ *
  * @param keyring the keyring
  * @param add_new #TRUE to add a new key to the file, expire keys, and resave
  * @param error return location for errors
@@ -406,6 +749,9 @@ _dbus_keyring_reload (DBusKeyring *keyring,
   int i;
   long now;
   DBusError tmp_error;
+  DBusFileStamp stamp;
+  dbus_bool_t have_stamp;
+  dbus_bool_t cached;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
   
@@ -444,6 +790,29 @@ _dbus_keyring_reload (DBusKeyring *keyring,
       have_lock = TRUE;
     }
 
+  /* Stamp the file before reading it, so that if it's replaced in
+   * between, the cache entry is merely out of date and will be
+   * replaced next time rather than used for the wrong contents.
+   */
+  have_stamp = _dbus_file_get_stamp (&keyring->filename, &stamp, NULL);
+
+  if (have_stamp && !add_new)
+    {
+      if (!keyring_cache_get (&keyring->filename, &stamp, now,
+                              &keys, &n_keys, &cached))
+        {
+          dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+          goto out;
+        }
+
+      if (cached)
+        {
+          _dbus_verbose ("Keyring file unchanged, using %d cached keys\n",
+                         n_keys);
+          goto loaded;
+        }
+    }
+
   dbus_error_init (&tmp_error);
   if (!_dbus_file_get_contents (&contents, 
                                 &keyring->filename,
@@ -502,9 +871,7 @@ _dbus_keyring_reload (DBusKeyring *keyring,
           continue;
         }
 
-      if (timestamp < 0 ||
-          (now + MAX_TIME_TRAVEL_SECONDS) < timestamp ||
-          (now - EXPIRE_KEYS_TIMEOUT_SECONDS) > timestamp)
+      if (!key_timestamp_is_valid (timestamp, now))
         {
           _dbus_verbose ("dropping/ignoring %ld-seconds old key with timestamp %ld as current time is %ld\n",
                          now - timestamp, timestamp, now);
@@ -522,7 +889,7 @@ _dbus_keyring_reload (DBusKeyring *keyring,
         }
       
       /* We have all three parts */
-      new = dbus_realloc (keys, sizeof (DBusKey) * (n_keys + 1));
+      new = grow_keys (keys, n_keys);
       if (new == NULL)
         {
           dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
@@ -560,6 +927,16 @@ _dbus_keyring_reload (DBusKeyring *keyring,
   _dbus_verbose ("Successfully loaded %d existing keys\n",
                  n_keys);
 
+  if (have_stamp && !add_new)
+    keyring_cache_put (&keyring->filename, &stamp, keys, n_keys);
+
+ loaded:
+  if (add_new && find_recent_key (keys, n_keys) != NULL)
+    {
+      _dbus_verbose ("Keyring file already has a recent key, not adding one\n");
+      add_new = FALSE;
+    }
+
   if (add_new)
     {
       if (!add_new_key (&keys, &n_keys, error))
@@ -607,6 +984,12 @@ _dbus_keyring_reload (DBusKeyring *keyring,
       if (!_dbus_string_save_to_file (&contents, &keyring->filename,
                                       FALSE, error))
         goto out;
+
+      /* We still hold the lock, so nobody else can have replaced it */
+      if (_dbus_file_get_stamp (&keyring->filename, &stamp, NULL))
+        keyring_cache_put (&keyring->filename, &stamp, keys, n_keys);
+      else
+        keyring_cache_forget (&keyring->filename);
     }
 
   if (keyring->keys)
@@ -904,31 +1287,6 @@ _dbus_keyring_validate_context (const DBusString *context)
   return TRUE;
 }
 
-static DBusKey*
-find_recent_key (DBusKeyring *keyring)
-{
-  int i;
-  long tv_sec, tv_usec;
-
-  _dbus_get_current_time (&tv_sec, &tv_usec);
-  
-  i = 0;
-  while (i < keyring->n_keys)
-    {
-      DBusKey *key = &keyring->keys[i];
-
-      _dbus_verbose ("Key %d is %ld seconds old\n",
-                     i, tv_sec - key->creation_time);
-      
-      if ((tv_sec - NEW_KEY_TIMEOUT_SECONDS) < key->creation_time)
-        return key;
-      
-      ++i;
-    }
-
-  return NULL;
-}
-
 /**
  * Gets a recent key to use for authentication.
  * If no recent key exists, creates one. Returns
@@ -948,7 +1306,7 @@ _dbus_keyring_get_best_key (DBusKeyring  *keyring,
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
   
-  key = find_recent_key (keyring);
+  key = find_recent_key (keyring->keys, keyring->n_keys);
   if (key)
     return key->id;
 
@@ -959,7 +1317,7 @@ _dbus_keyring_get_best_key (DBusKeyring  *keyring,
                              error))
     return -1;
 
-  key = find_recent_key (keyring);
+  key = find_recent_key (keyring->keys, keyring->n_keys);
   if (key)
     return key->id;
   else
@@ -1009,7 +1367,28 @@ _dbus_keyring_get_hex_key (DBusKeyring       *keyring,
                         keyring->n_keys,
                         key_id);
   if (key == NULL)
-    return TRUE; /* had enough memory, so TRUE */
+    {
+      DBusError error = DBUS_ERROR_INIT;
+      dbus_bool_t oom;
+
+      /* The server may have written the key since we loaded the
+       * keyring; in case the cache missed that, read the file itself.
+       */
+      keyring_cache_forget (&keyring->filename);
+
+      if (!_dbus_keyring_reload (keyring, FALSE, &error))
+        {
+          oom = dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY);
+          dbus_error_free (&error);
+          return !oom;
+        }
+
+      key = find_key_by_id (keyring->keys,
+                            keyring->n_keys,
+                            key_id);
+      if (key == NULL)
+        return TRUE; /* had enough memory, so TRUE */
+    }
 
   return _dbus_string_hex_encode (&key->secret, 0,
                                   hex_key,
@@ -1028,12 +1407,18 @@ _dbus_keyring_test (void)
   DBusString context;
   DBusKeyring *ring1;
   DBusKeyring *ring2;
+  DBusKeyring *ring3;
+  DBusString contents;
+  DBusString hex_key;
   int id;
+  int new_id;
+  long now;
   DBusError error;
   int i;
 
   ring1 = NULL;
   ring2 = NULL;
+  ring3 = NULL;
   
   /* Context validation */
   
@@ -1129,6 +1514,60 @@ _dbus_keyring_test (void)
 
   printf (" %d keys in test\n", ring1->n_keys);
 
+  /* Replace the file behind the keyrings' backs, as another process
+   * would, and check that the cached keys aren't used for it
+   */
+  new_id = id + 1;
+  while (find_key_by_id (ring1->keys, ring1->n_keys, new_id) != NULL)
+    ++new_id;
+
+  _dbus_get_current_time (&now, NULL);
+
+  if (!_dbus_string_init (&contents))
+    _dbus_assert_not_reached ("no memory");
+  if (!_dbus_string_append_int (&contents, new_id) ||
+      !_dbus_string_append_byte (&contents, ' ') ||
+      !_dbus_string_append_int (&contents, now) ||
+      !_dbus_string_append (&contents, " 00112233\n"))
+    _dbus_assert_not_reached ("no memory");
+
+  if (!_dbus_string_save_to_file (&contents, &ring1->filename,
+                                  FALSE, &error))
+    {
+      fprintf (stderr, "Could not rewrite keyring: %s\n", error.message);
+      dbus_error_free (&error);
+      _dbus_string_free (&contents);
+      goto failure;
+    }
+  _dbus_string_free (&contents);
+
+  ring3 = _dbus_keyring_new_for_credentials (NULL, &context, &error);
+  _dbus_assert (ring3 != NULL);
+  _dbus_assert (error.name == NULL);
+
+  if (ring3->n_keys != 1 || ring3->keys[0].id != new_id)
+    {
+      fprintf (stderr, "Keyring 3 did not see the rewritten keyring file\n");
+      goto failure;
+    }
+
+  /* ring1 still has the old keys, but should find the new one on demand */
+  if (!_dbus_string_init (&hex_key))
+    _dbus_assert_not_reached ("no memory");
+  if (!_dbus_keyring_get_hex_key (ring1, new_id, &hex_key))
+    _dbus_assert_not_reached ("no memory");
+
+  if (!_dbus_string_equal_c_str (&hex_key, "00112233"))
+    {
+      fprintf (stderr, "Keyring 1 did not reload to find key %d\n", new_id);
+      _dbus_string_free (&hex_key);
+      goto failure;
+    }
+  _dbus_string_free (&hex_key);
+
+  _dbus_keyring_unref (ring3);
+  ring3 = NULL;
+
   /* Test ref/unref */
   _dbus_keyring_ref (ring1);
   _dbus_keyring_ref (ring2);
@@ -1147,6 +1586,8 @@ _dbus_keyring_test (void)
     _dbus_keyring_unref (ring1);
   if (ring2)
     _dbus_keyring_unref (ring2);
+  if (ring3)
+    _dbus_keyring_unref (ring3);
 
   return FALSE;
 }
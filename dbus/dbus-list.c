@@ -27,6 +27,10 @@
 #include "dbus-mempool.h"
 #include "dbus-threads-internal.h"
 
+/* Allocations made here are profiled as lists */
+#undef DBUS_ALLOC_SUBSYSTEM
+#define DBUS_ALLOC_SUBSYSTEM DBUS_ALLOC_SUBSYSTEM_LIST
+
 /**
  * @defgroup DBusList Linked list
  * @ingroup  DBusInternals
@@ -48,32 +52,49 @@ _DBUS_DEFINE_GLOBAL_LOCK (list);
  * @{
  */
 
+/** Number of links a thread moves to or from the shared pool at once */
+#define LIST_THREAD_CACHE_BATCH 32
+
+typedef struct DBusListThreadCache DBusListThreadCache;
+
+/**
+ * Links set aside for one thread, so that it can allocate and free
+ * them without taking the list lock every time. The cached links
+ * are still allocated as far as list_pool knows. Only the owning
+ * thread touches the free links; the cache's own prev/next are
+ * covered by the list lock.
+ */
+struct DBusListThreadCache
+{
+  DBusListThreadCache *prev; /**< previous cache of all threads */
+  DBusListThreadCache *next; /**< next cache of all threads */
+  DBusList *free_links;      /**< free links, chained through next */
+  int n_free_links;          /**< number of free links */
+};
+
+static DBusThreadLocal *list_cache_tls = NULL;
+static DBusListThreadCache *list_thread_caches = NULL;
+
 /* the mem pool is probably a speed hit, with the thread
  * lock, though it does still save memory - unknown.
  */
 static DBusList*
-alloc_link (void *data)
+pool_alloc_link (void)
 {
   DBusList *link;
 
-  _DBUS_LOCK (list);
-
   if (list_pool == NULL)
     {      
       list_pool = _dbus_mem_pool_new (sizeof (DBusList), TRUE);
 
       if (list_pool == NULL)
-        {
-          _DBUS_UNLOCK (list);
-          return NULL;
-        }
+        return NULL;
 
       link = _dbus_mem_pool_alloc (list_pool);
       if (link == NULL)
         {
           _dbus_mem_pool_free (list_pool);
           list_pool = NULL;
-          _DBUS_UNLOCK (list);
           return NULL;
         }
     }
@@ -82,6 +103,200 @@ alloc_link (void *data)
       link = _dbus_mem_pool_alloc (list_pool);
     }
 
+  return link;
+}
+
+static void
+pool_free_link (DBusList *link)
+{
+  if (_dbus_mem_pool_dealloc (list_pool, link))
+    {
+      _dbus_mem_pool_free (list_pool);
+      list_pool = NULL;
+    }
+}
+
+/* Gives back up to n_links of the cache's free links, with the list
+ * lock held.
+ */
+static void
+thread_cache_release_links (DBusListThreadCache *cache,
+                            int                  n_links)
+{
+  while (n_links > 0 && cache->free_links != NULL)
+    {
+      DBusList *link = cache->free_links;
+
+      cache->free_links = link->next;
+      cache->n_free_links -= 1;
+      pool_free_link (link);
+      n_links -= 1;
+    }
+}
+
+/* Called by the thread library as a thread exits */
+static void
+thread_cache_destroy (void *data)
+{
+  DBusListThreadCache *cache = data;
+
+  _DBUS_LOCK (list);
+
+  if (cache->prev)
+    cache->prev->next = cache->next;
+  else
+    list_thread_caches = cache->next;
+  if (cache->next)
+    cache->next->prev = cache->prev;
+
+  thread_cache_release_links (cache, cache->n_free_links);
+
+  _DBUS_UNLOCK (list);
+
+  dbus_free (cache);
+}
+
+static void
+thread_caches_shutdown (void *data)
+{
+  _DBUS_LOCK (list);
+
+  while (list_thread_caches != NULL)
+    {
+      DBusListThreadCache *cache = list_thread_caches;
+
+      list_thread_caches = cache->next;
+      thread_cache_release_links (cache, cache->n_free_links);
+      dbus_free (cache);
+    }
+
+  _dbus_thread_local_free (list_cache_tls);
+  list_cache_tls = NULL;
+
+  _DBUS_UNLOCK (list);
+}
+
+/**
+ * Sets up per-thread link caches. Called from dbus_threads_init(),
+ * like _dbus_message_cache_init_threads(), and before it so that the
+ * caches are shut down after anything that frees links on shutdown.
+ * If the platform has no thread-local storage, every link keeps
+ * coming straight from the shared pool.
+ *
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+_dbus_list_init_threads (void)
+{
+  if (list_cache_tls != NULL)
+    return TRUE;
+
+  list_cache_tls = _dbus_thread_local_new (thread_cache_destroy);
+  if (list_cache_tls == NULL)
+    return TRUE;
+
+  if (!_dbus_register_shutdown_func (thread_caches_shutdown, NULL))
+    {
+      _dbus_thread_local_free (list_cache_tls);
+      list_cache_tls = NULL;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * Gives back the memory of links that are no longer in use, see
+ * _dbus_mem_pool_trim(). Links sitting in a thread's cache count as
+ * in use.
+ */
+void
+_dbus_list_trim_pool (void)
+{
+  _DBUS_LOCK (list);
+
+  if (list_pool != NULL)
+    _dbus_mem_pool_trim (list_pool);
+
+  _DBUS_UNLOCK (list);
+}
+
+/* Gets the calling thread's link cache, creating it on first use */
+static DBusListThreadCache*
+get_thread_cache (void)
+{
+  DBusListThreadCache *cache;
+
+  cache = _dbus_thread_local_get (list_cache_tls);
+  if (cache != NULL)
+    return cache;
+
+  cache = dbus_new0 (DBusListThreadCache, 1);
+  if (cache == NULL)
+    return NULL;
+
+  if (!_dbus_thread_local_set (list_cache_tls, cache))
+    {
+      dbus_free (cache);
+      return NULL;
+    }
+
+  _DBUS_LOCK (list);
+  cache->next = list_thread_caches;
+  if (list_thread_caches)
+    list_thread_caches->prev = cache;
+  list_thread_caches = cache;
+  _DBUS_UNLOCK (list);
+
+  return cache;
+}
+
+static DBusList*
+alloc_link (void *data)
+{
+  DBusListThreadCache *cache;
+  DBusList *link;
+
+  /* If the cache can't be created, fall back to the shared pool */
+  cache = list_cache_tls != NULL ? get_thread_cache () : NULL;
+
+  if (cache != NULL)
+    {
+      if (cache->free_links == NULL)
+        {
+          /* Refill with a batch under one lock; a partial batch is
+           * fine if memory runs out part way.
+           */
+          _DBUS_LOCK (list);
+          while (cache->n_free_links < LIST_THREAD_CACHE_BATCH)
+            {
+              link = pool_alloc_link ();
+              if (link == NULL)
+                break;
+
+              link->next = cache->free_links;
+              cache->free_links = link;
+              cache->n_free_links += 1;
+            }
+          _DBUS_UNLOCK (list);
+        }
+
+      if (cache->free_links == NULL)
+        return NULL;
+
+      link = cache->free_links;
+      cache->free_links = link->next;
+      cache->n_free_links -= 1;
+
+      link->data = data;
+
+      return link;
+    }
+
+  _DBUS_LOCK (list);
+
+  link = pool_alloc_link ();
+
   if (link)
     link->data = data;
   
@@ -92,14 +307,36 @@ alloc_link (void *data)
 
 static void
 free_link (DBusList *link)
-{  
-  _DBUS_LOCK (list);
-  if (_dbus_mem_pool_dealloc (list_pool, link))
+{
+  if (list_cache_tls != NULL)
     {
-      _dbus_mem_pool_free (list_pool);
-      list_pool = NULL;
+      DBusListThreadCache *cache;
+
+      /* Links may be freed by another thread than the one that
+       * allocated them, since they all come from the same pool. A
+       * thread that only frees links doesn't get a cache.
+       */
+      cache = _dbus_thread_local_get (list_cache_tls);
+
+      if (cache != NULL)
+        {
+          link->next = cache->free_links;
+          cache->free_links = link;
+          cache->n_free_links += 1;
+
+          if (cache->n_free_links >= 2 * LIST_THREAD_CACHE_BATCH)
+            {
+              _DBUS_LOCK (list);
+              thread_cache_release_links (cache, LIST_THREAD_CACHE_BATCH);
+              _DBUS_UNLOCK (list);
+            }
+
+          return;
+        }
     }
-  
+
+  _DBUS_LOCK (list);
+  pool_free_link (link);
   _DBUS_UNLOCK (list);
 }
 
@@ -90,6 +90,9 @@ void _dbus_list_foreach (DBusList            **list,
                          DBusForeachFunction   function,
                          void                 *data);
 
+dbus_bool_t _dbus_list_init_threads (void);
+void        _dbus_list_trim_pool    (void);
+
 #define _dbus_list_get_next_link(list, link) ((link)->next == *(list) ? NULL : (link)->next)
 #define _dbus_list_get_prev_link(list, link) ((link) == *(list) ? NULL : (link)->prev)
 
@@ -26,8 +26,14 @@
 
 #ifndef DOXYGEN_SHOULD_SKIP_THIS
 
+#include <dbus/dbus-connection-internal.h>
+#include <dbus/dbus-hash.h>
 #include <dbus/dbus-list.h>
+#include <dbus/dbus-socket-set.h>
 #include <dbus/dbus-sysdeps.h>
+#include <dbus/dbus-watch.h>
+
+#include <string.h>
 
 #define MAINLOOP_SPEW 0
 
@@ -52,17 +58,6 @@ watch_flags_to_string (int flags)
 #endif /* DBUS_ENABLE_VERBOSE_MODE */
 #endif /* MAINLOOP_SPEW */
 
-struct DBusLoop
-{
-  int refcount;
-  DBusList *callbacks;
-  int callback_list_serial;
-  int watch_count;
-  int timeout_count;
-  int depth; /**< number of recursive runs */
-  DBusList *need_dispatch;
-};
-
 typedef enum
 {
   CALLBACK_WATCH,
@@ -84,6 +79,8 @@ typedef struct
   DBusWatch *watch;
   /* last watch handle failed due to OOM */
   unsigned int last_iteration_oom : 1;
+  /* _dbus_watch_get_priority() when we last looked */
+  unsigned int priority : 1;
 } WatchCallback;
 
 typedef struct
@@ -93,8 +90,41 @@ typedef struct
   DBusTimeoutFunction function;
   unsigned long last_tv_sec;
   unsigned long last_tv_usec;
+  /* The heap key. These are cached from the DBusTimeout, since the heap
+   * has to stay ordered even if the timeout changes behind our back;
+   * _dbus_loop_toggle_timeout() refreshes them.
+   */
+  unsigned long expiration_tv_sec;
+  unsigned long expiration_tv_usec;
+  unsigned int enabled : 1;
+  int heap_index; /* position in loop->timeout_heap */
+  unsigned int fired_generation; /* loop->timeout_generation when last fired */
 } TimeoutCallback;
 
+struct DBusLoop
+{
+  int refcount;
+  /** fd => DBusList** of WatchCallback; at least one per fd in socket_set */
+  DBusHashTable *watches;
+  DBusSocketSet *socket_set;
+  /** DBusTimeout => TimeoutCallback, for removal and toggling */
+  DBusHashTable *timeouts;
+  /** binary min-heap of TimeoutCallback, soonest expiry first;
+   * disabled timeouts sort after all enabled ones */
+  TimeoutCallback **timeout_heap;
+  int timeout_heap_size; /**< allocated length of timeout_heap */
+  unsigned int timeout_generation; /**< bumped each time we fire timeouts */
+  int callback_list_serial;
+  int watch_count;
+  int priority_watch_count; /**< watches with priority, see _dbus_watch_list_set_priority() */
+  int timeout_count;
+  int depth; /**< number of recursive runs */
+  DBusList *need_dispatch;
+  /** TRUE if we will skip a watch next time because it was OOM; becomes
+   * FALSE between polling, and dealing with the results of the poll */
+  unsigned oom_watch_pending : 1;
+};
+
 #define WATCH_CALLBACK(callback)   ((WatchCallback*)callback)
 #define TIMEOUT_CALLBACK(callback) ((TimeoutCallback*)callback)
 
@@ -121,6 +151,34 @@ watch_callback_new (DBusWatch         *watch,
   return cb;
 }
 
+/* Recomputes the cached heap key of a timeout */
+static void
+timeout_callback_update (TimeoutCallback *tcb)
+{
+  int interval;
+
+  interval = dbus_timeout_get_interval (tcb->timeout);
+
+  tcb->enabled = dbus_timeout_get_enabled (tcb->timeout) != FALSE;
+  tcb->expiration_tv_sec = tcb->last_tv_sec + interval / 1000L;
+  tcb->expiration_tv_usec = tcb->last_tv_usec + (interval % 1000L) * 1000;
+  if (tcb->expiration_tv_usec >= 1000000)
+    {
+      tcb->expiration_tv_usec -= 1000000;
+      tcb->expiration_tv_sec += 1;
+    }
+}
+
+static void
+timeout_callback_set_last_time (TimeoutCallback *tcb,
+                                unsigned long    tv_sec,
+                                unsigned long    tv_usec)
+{
+  tcb->last_tv_sec = tv_sec;
+  tcb->last_tv_usec = tv_usec;
+  timeout_callback_update (tcb);
+}
+
 static TimeoutCallback*
 timeout_callback_new (DBusTimeout         *timeout,
                       DBusTimeoutFunction  function,
@@ -137,6 +195,9 @@ timeout_callback_new (DBusTimeout         *timeout,
   cb->function = function;
   _dbus_get_current_time (&cb->last_tv_sec,
                           &cb->last_tv_usec);
+  timeout_callback_update (cb);
+  cb->heap_index = -1;
+  cb->fired_generation = 0;
   cb->callback.refcount = 1;    
   cb->callback.type = CALLBACK_TIMEOUT;
   cb->callback.data = data;
@@ -171,47 +232,26 @@ callback_unref (Callback *cb)
     }
 }
 
-static dbus_bool_t
-add_callback (DBusLoop  *loop,
-              Callback *cb)
+static void
+free_watch_table_entry (void *data)
 {
-  if (!_dbus_list_append (&loop->callbacks, cb))
-    return FALSE;
+  DBusList **watches = data;
+  Callback *cb;
 
-  loop->callback_list_serial += 1;
+  /* DBusHashTable calls free_function(NULL) for the previous value when
+   * inserting a new key, even though we never store NULL */
+  if (watches == NULL)
+    return;
 
-  switch (cb->type)
+  for (cb = _dbus_list_pop_first (watches);
+       cb != NULL;
+       cb = _dbus_list_pop_first (watches))
     {
-    case CALLBACK_WATCH:
-      loop->watch_count += 1;
-      break;
-    case CALLBACK_TIMEOUT:
-      loop->timeout_count += 1;
-      break;
+      callback_unref (cb);
     }
-  
-  return TRUE;
-}
 
-static void
-remove_callback (DBusLoop  *loop,
-                 DBusList *link)
-{
-  Callback *cb = link->data;
-  
-  switch (cb->type)
-    {
-    case CALLBACK_WATCH:
-      loop->watch_count -= 1;
-      break;
-    case CALLBACK_TIMEOUT:
-      loop->timeout_count -= 1;
-      break;
-    }
-  
-  callback_unref (cb);
-  _dbus_list_remove_link (&loop->callbacks, link);
-  loop->callback_list_serial += 1;
+  _dbus_assert (*watches == NULL);
+  dbus_free (watches);
 }
 
 DBusLoop*
@@ -223,6 +263,29 @@ _dbus_loop_new (void)
   if (loop == NULL)
     return NULL;
 
+  loop->watches = _dbus_hash_table_new (DBUS_HASH_INT, NULL,
+                                        free_watch_table_entry);
+
+  loop->socket_set = _dbus_socket_set_new (0);
+
+  loop->timeouts = _dbus_hash_table_new (DBUS_HASH_UINTPTR, NULL, NULL);
+
+  if (loop->watches == NULL || loop->socket_set == NULL ||
+      loop->timeouts == NULL)
+    {
+      if (loop->watches != NULL)
+        _dbus_hash_table_unref (loop->watches);
+
+      if (loop->socket_set != NULL)
+        _dbus_socket_set_free (loop->socket_set);
+
+      if (loop->timeouts != NULL)
+        _dbus_hash_table_unref (loop->timeouts);
+
+      dbus_free (loop);
+      return NULL;
+    }
+
   loop->refcount = 1;
   
   return loop;
@@ -254,11 +317,108 @@ _dbus_loop_unref (DBusLoop *loop)
 
           dbus_connection_unref (connection);
         }
-      
+
+      while (loop->timeout_count > 0)
+        {
+          loop->timeout_count -= 1;
+          callback_unref ((Callback *) loop->timeout_heap[loop->timeout_count]);
+        }
+
+      _dbus_hash_table_unref (loop->watches);
+      _dbus_socket_set_free (loop->socket_set);
+      _dbus_hash_table_unref (loop->timeouts);
+      dbus_free (loop->timeout_heap);
       dbus_free (loop);
     }
 }
 
+static DBusList **
+ensure_watch_table_entry (DBusLoop *loop,
+                          int       fd)
+{
+  DBusList **watches;
+
+  watches = _dbus_hash_table_lookup_int (loop->watches, fd);
+
+  if (watches == NULL)
+    {
+      watches = dbus_new0 (DBusList *, 1);
+
+      if (watches == NULL)
+        return watches;
+
+      if (!_dbus_hash_table_insert_int (loop->watches, fd, watches))
+        {
+          dbus_free (watches);
+          watches = NULL;
+        }
+    }
+
+  return watches;
+}
+
+/* The socket set only knows about fds, so it wants the union of what
+ * the enabled watches on this fd are interested in. A watch that ran
+ * out of memory last time is left out until the next iteration.
+ */
+static void
+refresh_watches_for_fd (DBusLoop  *loop,
+                        DBusList **watches,
+                        int        fd)
+{
+  DBusList *link;
+  unsigned int flags = 0;
+  dbus_bool_t interested = FALSE;
+
+  _dbus_assert (fd != -1);
+
+  if (watches == NULL)
+    watches = _dbus_hash_table_lookup_int (loop->watches, fd);
+
+  /* we allocated this in the first _dbus_loop_add_watch for the fd, and keep
+   * it until there are none left */
+  _dbus_assert (watches != NULL);
+
+  for (link = _dbus_list_get_first_link (watches);
+      link != NULL;
+      link = _dbus_list_get_next_link (watches, link))
+    {
+      WatchCallback *wcb = link->data;
+
+      if (dbus_watch_get_enabled (wcb->watch) &&
+          !wcb->last_iteration_oom)
+        {
+          flags |= dbus_watch_get_flags (wcb->watch);
+          interested = TRUE;
+        }
+    }
+
+  if (interested)
+    _dbus_socket_set_enable (loop->socket_set, fd, flags);
+  else
+    _dbus_socket_set_disable (loop->socket_set, fd);
+}
+
+/* Drops the table entry once the last watch on its fd has gone.
+ * Returns TRUE if it did so.
+ */
+static dbus_bool_t
+gc_watch_table_entry (DBusLoop  *loop,
+                      DBusList **watches,
+                      int        fd)
+{
+  /* If watches is already NULL we have nothing to do */
+  if (watches == NULL)
+    return FALSE;
+
+  /* We can't GC hash table entries if they're non-empty lists */
+  if (*watches != NULL)
+    return FALSE;
+
+  _dbus_hash_table_remove_int (loop->watches, fd);
+  return TRUE;
+}
+
 dbus_bool_t
 _dbus_loop_add_watch (DBusLoop          *loop,
                       DBusWatch        *watch,
@@ -267,19 +427,142 @@ _dbus_loop_add_watch (DBusLoop          *loop,
                       DBusFreeFunction  free_data_func)
 {
   WatchCallback *wcb;
+  DBusList **watches;
+  dbus_bool_t new_fd;
+  int fd;
+
+  fd = dbus_watch_get_socket (watch);
+  _dbus_assert (fd != -1);
 
   wcb = watch_callback_new (watch, function, data, free_data_func);
   if (wcb == NULL)
     return FALSE;
 
-  if (!add_callback (loop, (Callback*) wcb))
+  watches = ensure_watch_table_entry (loop, fd);
+
+  if (watches == NULL)
+    goto oom;
+
+  new_fd = (*watches == NULL);
+
+  if (!_dbus_list_append (watches, wcb))
+    goto oom;
+
+  if (new_fd)
     {
-      wcb->callback.free_data_func = NULL; /* don't want to have this side effect */
-      callback_unref ((Callback*) wcb);
-      return FALSE;
+      if (!_dbus_socket_set_add (loop->socket_set, fd,
+                                 dbus_watch_get_flags (watch),
+                                 dbus_watch_get_enabled (watch)))
+        {
+          _dbus_list_remove_last (watches, wcb);
+          goto oom;
+        }
     }
-  
+  else
+    {
+      /* we're modifying, not adding, which can't fail with OOM */
+      refresh_watches_for_fd (loop, watches, fd);
+    }
+
+  loop->callback_list_serial += 1;
+  loop->watch_count += 1;
+
+  if (_dbus_watch_get_priority (watch))
+    {
+      wcb->priority = TRUE;
+      loop->priority_watch_count += 1;
+    }
+
   return TRUE;
+
+ oom:
+  gc_watch_table_entry (loop, watches, fd);
+  wcb->callback.free_data_func = NULL; /* don't want to have this side effect */
+  callback_unref ((Callback*) wcb);
+  return FALSE;
+}
+
+void
+_dbus_loop_toggle_watch (DBusLoop          *loop,
+                         DBusWatch         *watch)
+{
+  DBusList **watches;
+  DBusList *link;
+  int fd;
+
+  fd = dbus_watch_get_socket (watch);
+
+  /* The watch may be toggled on its way to being invalidated, when
+   * there is nothing left for us to update */
+  if (fd == -1)
+    return;
+
+  watches = _dbus_hash_table_lookup_int (loop->watches, fd);
+  if (watches == NULL)
+    return;
+
+  /* toggling is also how we hear that the priority changed */
+  for (link = _dbus_list_get_first_link (watches);
+       link != NULL;
+       link = _dbus_list_get_next_link (watches, link))
+    {
+      WatchCallback *wcb = link->data;
+
+      if (wcb->watch == watch &&
+          wcb->priority != _dbus_watch_get_priority (watch))
+        {
+          wcb->priority = !wcb->priority;
+          loop->priority_watch_count += wcb->priority ? 1 : -1;
+        }
+    }
+
+  refresh_watches_for_fd (loop, watches, fd);
+}
+
+static dbus_bool_t
+remove_watch_from_list (DBusLoop          *loop,
+                        DBusList         **watches,
+                        int                fd,
+                        DBusWatch         *watch,
+                        DBusWatchFunction  function,
+                        void              *data)
+{
+  DBusList *link;
+
+  for (link = _dbus_list_get_first_link (watches);
+       link != NULL;
+       link = _dbus_list_get_next_link (watches, link))
+    {
+      WatchCallback *this = link->data;
+
+      if (this->watch == watch &&
+          this->callback.data == data &&
+          this->function == function)
+        {
+          _dbus_list_remove_link (watches, link);
+          loop->callback_list_serial += 1;
+          loop->watch_count -= 1;
+          if (this->priority)
+            loop->priority_watch_count -= 1;
+          callback_unref ((Callback *) this);
+
+          /* if that was the last watch for that fd, drop the hash table
+           * entry, and stop reserving space for it in the socket set */
+          if (*watches == NULL)
+            {
+              _dbus_socket_set_remove (loop->socket_set, fd);
+              gc_watch_table_entry (loop, watches, fd);
+            }
+          else
+            {
+              refresh_watches_for_fd (loop, watches, fd);
+            }
+
+          return TRUE;
+        }
+    }
+
+  return FALSE;
 }
 
 void
@@ -288,31 +571,147 @@ _dbus_loop_remove_watch (DBusLoop          *loop,
                          DBusWatchFunction  function,
                          void             *data)
 {
-  DBusList *link;
-  
-  link = _dbus_list_get_first_link (&loop->callbacks);
-  while (link != NULL)
+  DBusList **watches;
+  DBusHashIter iter;
+  int fd;
+
+  /* fd must be the same as it was on add, unless the watch has already
+   * been invalidated, in which case each fd has to be searched */
+  fd = dbus_watch_get_socket (watch);
+
+  if (fd != -1)
     {
-      DBusList *next = _dbus_list_get_next_link (&loop->callbacks, link);
-      Callback *this = link->data;
+      watches = _dbus_hash_table_lookup_int (loop->watches, fd);
 
-      if (this->type == CALLBACK_WATCH &&
-          WATCH_CALLBACK (this)->watch == watch &&
-          this->data == data &&
-          WATCH_CALLBACK (this)->function == function)
+      if (watches != NULL &&
+          remove_watch_from_list (loop, watches, fd, watch, function, data))
+        return;
+    }
+  else
+    {
+      _dbus_hash_iter_init (loop->watches, &iter);
+
+      while (_dbus_hash_iter_next (&iter))
         {
-          remove_callback (loop, link);
-          
-          return;
+          watches = _dbus_hash_iter_get_value (&iter);
+          fd = _dbus_hash_iter_get_int_key (&iter);
+
+          /* this may remove the entry we're on, so stop right after */
+          if (remove_watch_from_list (loop, watches, fd, watch, function, data))
+            return;
         }
-      
-      link = next;
     }
 
   _dbus_warn ("could not find watch %p function %p data %p to remove\n",
               watch, (void *)function, data);
 }
 
+/* TRUE if a should fire before b */
+static dbus_bool_t
+timeout_callback_precedes (TimeoutCallback *a,
+                           TimeoutCallback *b)
+{
+  if (a->enabled != b->enabled)
+    return a->enabled;
+
+  if (!a->enabled)
+    return FALSE;
+
+  if (a->expiration_tv_sec != b->expiration_tv_sec)
+    return a->expiration_tv_sec < b->expiration_tv_sec;
+
+  return a->expiration_tv_usec < b->expiration_tv_usec;
+}
+
+static void
+timeout_heap_set (DBusLoop        *loop,
+                  int              i,
+                  TimeoutCallback *tcb)
+{
+  loop->timeout_heap[i] = tcb;
+  tcb->heap_index = i;
+}
+
+static void
+timeout_heap_sift_up (DBusLoop *loop,
+                      int       i)
+{
+  TimeoutCallback *tcb = loop->timeout_heap[i];
+
+  while (i > 0)
+    {
+      int parent = (i - 1) / 2;
+
+      if (!timeout_callback_precedes (tcb, loop->timeout_heap[parent]))
+        break;
+
+      timeout_heap_set (loop, i, loop->timeout_heap[parent]);
+      i = parent;
+    }
+
+  timeout_heap_set (loop, i, tcb);
+}
+
+static void
+timeout_heap_sift_down (DBusLoop *loop,
+                        int       i)
+{
+  TimeoutCallback *tcb = loop->timeout_heap[i];
+
+  while (TRUE)
+    {
+      int child = 2 * i + 1;
+
+      if (child >= loop->timeout_count)
+        break;
+
+      if (child + 1 < loop->timeout_count &&
+          timeout_callback_precedes (loop->timeout_heap[child + 1],
+                                     loop->timeout_heap[child]))
+        child += 1;
+
+      if (!timeout_callback_precedes (loop->timeout_heap[child], tcb))
+        break;
+
+      timeout_heap_set (loop, i, loop->timeout_heap[child]);
+      i = child;
+    }
+
+  timeout_heap_set (loop, i, tcb);
+}
+
+/* Restores the heap order after the key of the entry at i changed */
+static void
+timeout_heap_fix (DBusLoop *loop,
+                  int       i)
+{
+  if (i > 0 &&
+      timeout_callback_precedes (loop->timeout_heap[i],
+                                 loop->timeout_heap[(i - 1) / 2]))
+    timeout_heap_sift_up (loop, i);
+  else
+    timeout_heap_sift_down (loop, i);
+}
+
+static void
+timeout_heap_remove (DBusLoop        *loop,
+                     TimeoutCallback *tcb)
+{
+  int i = tcb->heap_index;
+
+  _dbus_assert (i >= 0 && i < loop->timeout_count);
+  _dbus_assert (loop->timeout_heap[i] == tcb);
+
+  loop->timeout_count -= 1;
+  tcb->heap_index = -1;
+
+  if (i != loop->timeout_count)
+    {
+      timeout_heap_set (loop, i, loop->timeout_heap[loop->timeout_count]);
+      timeout_heap_fix (loop, i);
+    }
+}
+
 dbus_bool_t
 _dbus_loop_add_timeout (DBusLoop            *loop,
                         DBusTimeout        *timeout,
@@ -322,45 +721,79 @@ _dbus_loop_add_timeout (DBusLoop            *loop,
 {
   TimeoutCallback *tcb;
 
+  _dbus_assert (_dbus_hash_table_lookup_uintptr (loop->timeouts,
+                                                 (uintptr_t) timeout) == NULL);
+
+  if (loop->timeout_count == loop->timeout_heap_size)
+    {
+      TimeoutCallback **new_heap;
+      int new_size;
+
+      new_size = loop->timeout_heap_size == 0 ? 8 : loop->timeout_heap_size * 2;
+      new_heap = dbus_realloc (loop->timeout_heap,
+                               sizeof (TimeoutCallback *) * new_size);
+      if (new_heap == NULL)
+        return FALSE;
+
+      loop->timeout_heap = new_heap;
+      loop->timeout_heap_size = new_size;
+    }
+
   tcb = timeout_callback_new (timeout, function, data, free_data_func);
   if (tcb == NULL)
     return FALSE;
 
-  if (!add_callback (loop, (Callback*) tcb))
+  if (!_dbus_hash_table_insert_uintptr (loop->timeouts, (uintptr_t) timeout,
+                                        tcb))
     {
       tcb->callback.free_data_func = NULL; /* don't want to have this side effect */
       callback_unref ((Callback*) tcb);
       return FALSE;
     }
-  
+
+  timeout_heap_set (loop, loop->timeout_count, tcb);
+  loop->timeout_count += 1;
+  timeout_heap_sift_up (loop, tcb->heap_index);
+
+  loop->callback_list_serial += 1;
   return TRUE;
 }
 
+void
+_dbus_loop_toggle_timeout (DBusLoop            *loop,
+                           DBusTimeout         *timeout)
+{
+  TimeoutCallback *tcb;
+
+  tcb = _dbus_hash_table_lookup_uintptr (loop->timeouts, (uintptr_t) timeout);
+
+  if (tcb == NULL)
+    return;
+
+  timeout_callback_update (tcb);
+  timeout_heap_fix (loop, tcb->heap_index);
+}
+
 void
 _dbus_loop_remove_timeout (DBusLoop            *loop,
-                           DBusTimeout        *timeout,
+                           DBusTimeout         *timeout,
                            DBusTimeoutFunction  function,
                            void               *data)
 {
-  DBusList *link;
-  
-  link = _dbus_list_get_first_link (&loop->callbacks);
-  while (link != NULL)
+  TimeoutCallback *tcb;
+
+  tcb = _dbus_hash_table_lookup_uintptr (loop->timeouts, (uintptr_t) timeout);
+
+  if (tcb != NULL &&
+      tcb->callback.data == data &&
+      tcb->function == function)
     {
-      DBusList *next = _dbus_list_get_next_link (&loop->callbacks, link);
-      Callback *this = link->data;
+      _dbus_hash_table_remove_uintptr (loop->timeouts, (uintptr_t) timeout);
+      timeout_heap_remove (loop, tcb);
+      loop->callback_list_serial += 1;
+      callback_unref ((Callback *) tcb);
 
-      if (this->type == CALLBACK_TIMEOUT &&
-          TIMEOUT_CALLBACK (this)->timeout == timeout &&
-          this->data == data &&
-          TIMEOUT_CALLBACK (this)->function == function)
-        {
-          remove_callback (loop, link);
-          
-          return;
-        }
-      
-      link = next;
+      return;
     }
 
   _dbus_warn ("could not find timeout %p function %p data %p to remove\n",
@@ -378,43 +811,26 @@ check_timeout (unsigned long    tv_sec,
 {
   long sec_remaining;
   long msec_remaining;
-  unsigned long expiration_tv_sec;
-  unsigned long expiration_tv_usec;
-  long interval_seconds;
-  long interval_milliseconds;
   int interval;
 
   /* I'm pretty sure this function could suck (a lot) less */
   
   interval = dbus_timeout_get_interval (tcb->timeout);
   
-  interval_seconds = interval / 1000L;
-  interval_milliseconds = interval % 1000L;
-  
-  expiration_tv_sec = tcb->last_tv_sec + interval_seconds;
-  expiration_tv_usec = tcb->last_tv_usec + interval_milliseconds * 1000;
-  if (expiration_tv_usec >= 1000000)
-    {
-      expiration_tv_usec -= 1000000;
-      expiration_tv_sec += 1;
-    }
-  
-  sec_remaining = expiration_tv_sec - tv_sec;
+  sec_remaining = tcb->expiration_tv_sec - tv_sec;
   /* need to force this to be signed, as it is intended to sometimes
    * produce a negative result
    */
-  msec_remaining = ((long) expiration_tv_usec - (long) tv_usec) / 1000L;
+  msec_remaining = ((long) tcb->expiration_tv_usec - (long) tv_usec) / 1000L;
 
 #if MAINLOOP_SPEW
-  _dbus_verbose ("Interval is %ld seconds %ld msecs\n",
-                 interval_seconds,
-                 interval_milliseconds);
+  _dbus_verbose ("Interval is %d msecs\n", interval);
   _dbus_verbose ("Now is  %lu seconds %lu usecs\n",
                  tv_sec, tv_usec);
   _dbus_verbose ("Last is %lu seconds %lu usecs\n",
                  tcb->last_tv_sec, tcb->last_tv_usec);
   _dbus_verbose ("Exp is  %lu seconds %lu usecs\n",
-                 expiration_tv_sec, expiration_tv_usec);
+                 tcb->expiration_tv_sec, tcb->expiration_tv_usec);
   _dbus_verbose ("Pre-correction, sec_remaining %ld msec_remaining %ld\n",
                  sec_remaining, msec_remaining);
 #endif
@@ -447,8 +863,7 @@ check_timeout (unsigned long    tv_sec,
       /* This indicates that the system clock probably moved backward */
       _dbus_verbose ("System clock set backward! Resetting timeout.\n");
       
-      tcb->last_tv_sec = tv_sec;
-      tcb->last_tv_usec = tv_usec;
+      timeout_callback_set_last_time (tcb, tv_sec, tv_usec);
 
       *timeout = interval;
     }
@@ -460,9 +875,18 @@ check_timeout (unsigned long    tv_sec,
   return *timeout == 0;
 }
 
+/* How many messages a connection of dispatch weight 1 gets handled
+ * each time round; one with more queued than its turn goes to the back
+ * of the line until the next iteration, so a peer flooding us with
+ * messages has to take turns with everyone else rather than holding
+ * up the whole loop until it is drained.
+ */
+#define MAX_MESSAGES_PER_DISPATCH 64
+
 dbus_bool_t
 _dbus_loop_dispatch (DBusLoop *loop)
 {
+  DBusList *round;
 
 #if MAINLOOP_SPEW
   _dbus_verbose ("  %d connections to dispatch\n", _dbus_list_get_length (&loop->need_dispatch));
@@ -470,39 +894,72 @@ _dbus_loop_dispatch (DBusLoop *loop)
   
   if (loop->need_dispatch == NULL)
     return FALSE;
-  
- next:
-  while (loop->need_dispatch != NULL)
+
+  /* Connections we put back, or that are queued while we dispatch,
+   * wait for the next round, after we have polled again.
+   */
+  round = loop->need_dispatch;
+  loop->need_dispatch = NULL;
+
+  while (round != NULL)
     {
-      DBusConnection *connection = _dbus_list_pop_first (&loop->need_dispatch);
-      
-      while (TRUE)
+      DBusList *link = _dbus_list_pop_first_link (&round);
+      DBusConnection *connection = link->data;
+      DBusDispatchStatus status;
+      int weight;
+      int quantum;
+
+      weight = _dbus_connection_get_dispatch_weight (connection);
+      if (weight > _DBUS_INT_MAX / MAX_MESSAGES_PER_DISPATCH)
+        quantum = _DBUS_INT_MAX;
+      else
+        quantum = weight * MAX_MESSAGES_PER_DISPATCH;
+
+      status = dbus_connection_dispatch_batch (connection, quantum);
+
+      /* Don't read more from a connection until we've caught up with
+       * what we already have, or it would just pile up
+       */
+      _dbus_connection_set_dispatch_backlogged (connection,
+                                                status == DBUS_DISPATCH_DATA_REMAINS);
+
+      if (status == DBUS_DISPATCH_COMPLETE)
+        {
+          _dbus_list_free_link (link);
+          dbus_connection_unref (connection);
+        }
+      else
         {
-          DBusDispatchStatus status;
-          
-          status = dbus_connection_dispatch (connection);
+          if (status == DBUS_DISPATCH_NEED_MEMORY)
+            _dbus_wait_for_memory ();
 
-          if (status == DBUS_DISPATCH_COMPLETE)
-            {
-              dbus_connection_unref (connection);
-              goto next;
-            }
+          /* keeps the ref the queue holds */
+          if (_dbus_connection_get_priority (connection))
+            _dbus_list_prepend_link (&loop->need_dispatch, link);
           else
-            {
-              if (status == DBUS_DISPATCH_NEED_MEMORY)
-                _dbus_wait_for_memory ();
-            }
+            _dbus_list_append_link (&loop->need_dispatch, link);
         }
     }
 
   return TRUE;
 }
 
+/* Connections with priority (see _dbus_connection_set_priority()) go
+ * to the front of the line, so their messages are handled before
+ * those of everyone else waiting.
+ */
 dbus_bool_t
 _dbus_loop_queue_dispatch (DBusLoop       *loop,
                            DBusConnection *connection)
 {
-  if (_dbus_list_append (&loop->need_dispatch, connection))
+  dbus_bool_t queued;
+
+  if (_dbus_connection_get_priority (connection))
+    queued = _dbus_list_prepend (&loop->need_dispatch, connection);
+  else
+    queued = _dbus_list_append (&loop->need_dispatch, connection);
+
+  if (queued)
     {
       dbus_connection_ref (connection);
       return TRUE;
@@ -511,6 +968,61 @@ _dbus_loop_queue_dispatch (DBusLoop       *loop,
     return FALSE;
 }
 
+#define N_STACK_DESCRIPTORS 64
+
+/* Whether any watch on a descriptor has priority */
+static dbus_bool_t
+fd_has_priority (DBusLoop *loop,
+                 int       fd)
+{
+  DBusList **watches;
+  DBusList *link;
+
+  watches = _dbus_hash_table_lookup_int (loop->watches, fd);
+  if (watches == NULL)
+    return FALSE;
+
+  for (link = _dbus_list_get_first_link (watches);
+       link != NULL;
+       link = _dbus_list_get_next_link (watches, link))
+    {
+      if (WATCH_CALLBACK (link->data)->priority)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Moves the ready descriptors with a priority watch to the front,
+ * otherwise keeping the order, so they are handled first and aren't
+ * among those put off if the watches change under us.
+ */
+static void
+prioritize_ready_fds (DBusLoop        *loop,
+                      DBusSocketEvent *ready_fds,
+                      int              n_ready)
+{
+  DBusSocketEvent rest[N_STACK_DESCRIPTORS];
+  int n_first;
+  int n_rest;
+  int i;
+
+  _dbus_assert (n_ready <= N_STACK_DESCRIPTORS);
+
+  n_first = 0;
+  n_rest = 0;
+
+  for (i = 0; i < n_ready; i++)
+    {
+      if (fd_has_priority (loop, ready_fds[i].fd))
+        ready_fds[n_first++] = ready_fds[i];
+      else
+        rest[n_rest++] = ready_fds[i];
+    }
+
+  memcpy (ready_fds + n_first, rest, n_rest * sizeof (DBusSocketEvent));
+}
+
 /* Returns TRUE if we invoked any timeouts or have ready file
  * descriptors, which is just used in test code as a debug hack
  */
@@ -519,27 +1031,17 @@ dbus_bool_t
 _dbus_loop_iterate (DBusLoop     *loop,
                     dbus_bool_t   block)
 {  
-#define N_STACK_DESCRIPTORS 64
   dbus_bool_t retval;
-  DBusPollFD *fds;
-  DBusPollFD stack_fds[N_STACK_DESCRIPTORS];
-  int n_fds;
-  WatchCallback **watches_for_fds;
-  WatchCallback *stack_watches_for_fds[N_STACK_DESCRIPTORS];
+  DBusSocketEvent ready_fds[N_STACK_DESCRIPTORS];
   int i;
   DBusList *link;
   int n_ready;
   int initial_serial;
   long timeout;
-  dbus_bool_t oom_watch_pending;
   int orig_depth;
   
   retval = FALSE;      
 
-  fds = NULL;
-  watches_for_fds = NULL;
-  n_fds = 0;
-  oom_watch_pending = FALSE;
   orig_depth = loop->depth;
   
 #if MAINLOOP_SPEW
@@ -547,97 +1049,9 @@ _dbus_loop_iterate (DBusLoop     *loop,
                  block, loop->depth, loop->timeout_count, loop->watch_count);
 #endif
   
-  if (loop->callbacks == NULL)
+  if (loop->watch_count == 0 && loop->timeout_count == 0)
     goto next_iteration;
 
-  if (loop->watch_count > N_STACK_DESCRIPTORS)
-    {
-      fds = dbus_new0 (DBusPollFD, loop->watch_count);
-      
-      while (fds == NULL)
-        {
-          _dbus_wait_for_memory ();
-          fds = dbus_new0 (DBusPollFD, loop->watch_count);
-        }
-      
-      watches_for_fds = dbus_new (WatchCallback*, loop->watch_count);
-      while (watches_for_fds == NULL)
-        {
-          _dbus_wait_for_memory ();
-          watches_for_fds = dbus_new (WatchCallback*, loop->watch_count);
-        }
-    }
-  else
-    {      
-      fds = stack_fds;
-      watches_for_fds = stack_watches_for_fds;
-    }
-
-  /* fill our array of fds and watches */
-  n_fds = 0;
-  link = _dbus_list_get_first_link (&loop->callbacks);
-  while (link != NULL)
-    {
-      DBusList *next = _dbus_list_get_next_link (&loop->callbacks, link);
-      Callback *cb = link->data;
-      if (cb->type == CALLBACK_WATCH)
-        {
-          unsigned int flags;
-          WatchCallback *wcb = WATCH_CALLBACK (cb);
-
-          if (wcb->last_iteration_oom)
-            {
-              /* we skip this one this time, but reenable it next time,
-               * and have a timeout on this iteration
-               */
-              wcb->last_iteration_oom = FALSE;
-              oom_watch_pending = TRUE;
-              
-              retval = TRUE; /* return TRUE here to keep the loop going,
-                              * since we don't know the watch is inactive
-                              */
-
-#if MAINLOOP_SPEW
-              _dbus_verbose ("  skipping watch on fd %d as it was out of memory last time\n",
-                             dbus_watch_get_socket (wcb->watch));
-#endif
-            }
-          else if (dbus_watch_get_enabled (wcb->watch))
-            {
-              watches_for_fds[n_fds] = wcb;
-
-              callback_ref (cb);
-                  
-              flags = dbus_watch_get_flags (wcb->watch);
-                  
-              fds[n_fds].fd = dbus_watch_get_socket (wcb->watch);
-              fds[n_fds].revents = 0;
-              fds[n_fds].events = 0;
-              if (flags & DBUS_WATCH_READABLE)
-                fds[n_fds].events |= _DBUS_POLLIN;
-              if (flags & DBUS_WATCH_WRITABLE)
-                fds[n_fds].events |= _DBUS_POLLOUT;
-
-#if MAINLOOP_SPEW
-              _dbus_verbose ("  polling watch on fd %d  %s\n",
-                             fds[n_fds].fd, watch_flags_to_string (flags));
-#endif
-
-              n_fds += 1;
-            }
-          else
-            {
-#if MAINLOOP_SPEW
-              _dbus_verbose ("  skipping disabled watch on fd %d  %s\n",
-                             dbus_watch_get_socket (wcb->watch),
-                             watch_flags_to_string (dbus_watch_get_flags (wcb->watch)));
-#endif
-            }
-        }
-              
-      link = next;
-    }
-  
   timeout = -1;
   if (loop->timeout_count > 0)
     {
@@ -645,44 +1059,36 @@ _dbus_loop_iterate (DBusLoop     *loop,
       unsigned long tv_usec;
       
       _dbus_get_current_time (&tv_sec, &tv_usec);
-          
-      link = _dbus_list_get_first_link (&loop->callbacks);
-      while (link != NULL)
+
+      /* The soonest enabled timeout is at the top of the heap, unless
+       * check_timeout() had to push it back because the clock moved
+       */
+      while (loop->timeout_count > 0)
         {
-          DBusList *next = _dbus_list_get_next_link (&loop->callbacks, link);
-          Callback *cb = link->data;
+          TimeoutCallback *tcb = loop->timeout_heap[0];
+          int msecs_remaining;
 
-          if (cb->type == CALLBACK_TIMEOUT &&
-              dbus_timeout_get_enabled (TIMEOUT_CALLBACK (cb)->timeout))
+          if (!tcb->enabled)
             {
-              TimeoutCallback *tcb = TIMEOUT_CALLBACK (cb);
-              int msecs_remaining;
+#if MAINLOOP_SPEW
+              _dbus_verbose ("  all timeouts are disabled\n");
+#endif
+              break;
+            }
 
-              check_timeout (tv_sec, tv_usec, tcb, &msecs_remaining);
+          check_timeout (tv_sec, tv_usec, tcb, &msecs_remaining);
+          timeout_heap_fix (loop, 0);
 
-              if (timeout < 0)
-                timeout = msecs_remaining;
-              else
-                timeout = MIN (msecs_remaining, timeout);
+          if (loop->timeout_heap[0] == tcb)
+            {
+              timeout = msecs_remaining;
 
 #if MAINLOOP_SPEW
-              _dbus_verbose ("  timeout added, %d remaining, aggregate timeout %ld\n",
-                             msecs_remaining, timeout);
+              _dbus_verbose ("  next timeout expires in %d milliseconds\n",
+                             msecs_remaining);
 #endif
-              
-              _dbus_assert (timeout >= 0);
-                  
-              if (timeout == 0)
-                break; /* it's not going to get shorter... */
+              break;
             }
-#if MAINLOOP_SPEW
-          else if (cb->type == CALLBACK_TIMEOUT)
-            {
-              _dbus_verbose ("  skipping disabled timeout\n");
-            }
-#endif
-          
-          link = next;
         }
     }
 
@@ -695,17 +1101,62 @@ _dbus_loop_iterate (DBusLoop     *loop,
 #endif
     }
 
-  /* if a watch is OOM, don't wait longer than the OOM
+  /* if a watch was OOM last time, don't wait longer than the OOM
    * wait to re-enable it
    */
-  if (oom_watch_pending)
-    timeout = MIN (timeout, _dbus_get_oom_wait ());
+  if (loop->oom_watch_pending &&
+      (timeout < 0 || timeout > _dbus_get_oom_wait ()))
+    timeout = _dbus_get_oom_wait ();
 
 #if MAINLOOP_SPEW
-  _dbus_verbose ("  polling on %d descriptors timeout %ld\n", n_fds, timeout);
+  _dbus_verbose ("  polling on %d descriptors timeout %ld\n", loop->watch_count, timeout);
 #endif
   
-  n_ready = _dbus_poll (fds, n_fds, timeout);
+  n_ready = _dbus_socket_set_poll (loop->socket_set, ready_fds,
+                                   _DBUS_N_ELEMENTS (ready_fds), timeout);
+
+  if (loop->priority_watch_count > 0 && n_ready > 1)
+    prioritize_ready_fds (loop, ready_fds, n_ready);
+
+  /* re-enable any watches we skipped this time */
+  if (loop->oom_watch_pending)
+    {
+      DBusHashIter hash_iter;
+
+      loop->oom_watch_pending = FALSE;
+
+      _dbus_hash_iter_init (loop->watches, &hash_iter);
+
+      while (_dbus_hash_iter_next (&hash_iter))
+        {
+          DBusList **watches;
+          int fd;
+          dbus_bool_t changed;
+
+          changed = FALSE;
+          fd = _dbus_hash_iter_get_int_key (&hash_iter);
+          watches = _dbus_hash_iter_get_value (&hash_iter);
+
+          for (link = _dbus_list_get_first_link (watches);
+              link != NULL;
+              link = _dbus_list_get_next_link (watches, link))
+            {
+              WatchCallback *wcb = link->data;
+
+              if (wcb->last_iteration_oom)
+                {
+                  wcb->last_iteration_oom = FALSE;
+                  changed = TRUE;
+                }
+            }
+
+          if (changed)
+            refresh_watches_for_fd (loop, watches, fd);
+        }
+
+      retval = TRUE; /* return TRUE here to keep the loop going,
+                      * since we don't know the watch was inactive */
+    }
 
   initial_serial = loop->callback_list_serial;
 
@@ -716,114 +1167,144 @@ _dbus_loop_iterate (DBusLoop     *loop,
 
       _dbus_get_current_time (&tv_sec, &tv_usec);
 
-      /* It'd be nice to avoid this O(n) thingy here */
-      link = _dbus_list_get_first_link (&loop->callbacks);
-      while (link != NULL)
+      /* Each expired timeout fires at most once per iteration, even if
+       * its interval is so short that it has expired again by the time
+       * it's back in the heap.
+       */
+      loop->timeout_generation += 1;
+
+      while (loop->timeout_count > 0)
         {
-          DBusList *next = _dbus_list_get_next_link (&loop->callbacks, link);
-          Callback *cb = link->data;
+          TimeoutCallback *tcb = loop->timeout_heap[0];
+          int msecs_remaining;
 
           if (initial_serial != loop->callback_list_serial)
             goto next_iteration;
 
           if (loop->depth != orig_depth)
             goto next_iteration;
-              
-          if (cb->type == CALLBACK_TIMEOUT &&
-              dbus_timeout_get_enabled (TIMEOUT_CALLBACK (cb)->timeout))
-            {
-              TimeoutCallback *tcb = TIMEOUT_CALLBACK (cb);
-              int msecs_remaining;
-              
-              if (check_timeout (tv_sec, tv_usec,
-                                 tcb, &msecs_remaining))
-                {
-                  /* Save last callback time and fire this timeout */
-                  tcb->last_tv_sec = tv_sec;
-                  tcb->last_tv_usec = tv_usec;
 
-#if MAINLOOP_SPEW
-                  _dbus_verbose ("  invoking timeout\n");
-#endif
-                  
-                  (* tcb->function) (tcb->timeout,
-                                     cb->data);
+          if (!tcb->enabled ||
+              tcb->fired_generation == loop->timeout_generation)
+            break;
 
-                  retval = TRUE;
-                }
-              else
+          if (!check_timeout (tv_sec, tv_usec, tcb, &msecs_remaining))
+            {
+              /* the clock may have moved, making some other timeout due */
+              timeout_heap_fix (loop, 0);
+              if (loop->timeout_heap[0] == tcb)
                 {
 #if MAINLOOP_SPEW
                   _dbus_verbose ("  timeout has not expired\n");
 #endif
+                  break;
                 }
+              continue;
             }
+
+          /* Save last callback time and fire this timeout */
+          tcb->fired_generation = loop->timeout_generation;
+          timeout_callback_set_last_time (tcb, tv_sec, tv_usec);
+          timeout_heap_fix (loop, 0);
+
+          /* A timeout we were never told had been disabled; it will be
+           * back in the right place in the heap now */
+          if (!tcb->enabled)
+            continue;
+
 #if MAINLOOP_SPEW
-          else if (cb->type == CALLBACK_TIMEOUT)
-            {
-              _dbus_verbose ("  skipping invocation of disabled timeout\n");
-            }
+          _dbus_verbose ("  invoking timeout\n");
 #endif
 
-          link = next;
+          (* tcb->function) (tcb->timeout,
+                             tcb->callback.data);
+
+          retval = TRUE;
         }
     }
       
-  if (n_ready > 0)
+  for (i = 0; i < n_ready; i++)
     {
-      i = 0;
-      while (i < n_fds)
+      DBusList **watches;
+      int fd;
+      dbus_bool_t any_oom;
+
+      /* FIXME I think this "restart if we change the watches"
+       * approach could result in starving watches
+       * toward the end of the list.
+       */
+      if (initial_serial != loop->callback_list_serial)
+        goto next_iteration;
+
+      if (loop->depth != orig_depth)
+        goto next_iteration;
+
+      fd = ready_fds[i].fd;
+      watches = _dbus_hash_table_lookup_int (loop->watches, fd);
+
+      if (watches == NULL)
+        continue;
+
+      any_oom = FALSE;
+
+      for (link = _dbus_list_get_first_link (watches);
+          link != NULL;
+          link = _dbus_list_get_next_link (watches, link))
         {
-          /* FIXME I think this "restart if we change the watches"
-           * approach could result in starving watches
-           * toward the end of the list.
+          WatchCallback *wcb = link->data;
+          unsigned int condition;
+
+          if (!dbus_watch_get_enabled (wcb->watch) || wcb->last_iteration_oom)
+            continue;
+
+          /* Several watches can share an fd (typically one for reading
+           * and one for writing), so only hand each of them the
+           * conditions it asked for; HANGUP and ERROR go to everyone.
            */
-          if (initial_serial != loop->callback_list_serial)
-            goto next_iteration;
+          condition = ready_fds[i].flags &
+            (dbus_watch_get_flags (wcb->watch) |
+             DBUS_WATCH_HANGUP | DBUS_WATCH_ERROR);
 
-          if (loop->depth != orig_depth)
-            goto next_iteration;
+          if (condition == 0)
+            continue;
+
+          callback_ref ((Callback *) wcb);
 
-          if (fds[i].revents != 0)
+          if (!(* wcb->function) (wcb->watch,
+                                  condition,
+                                  ((Callback*)wcb)->data))
             {
-              WatchCallback *wcb;
-              unsigned int condition;
-                  
-              wcb = watches_for_fds[i];
-              
-              condition = 0;
-              if (fds[i].revents & _DBUS_POLLIN)
-                condition |= DBUS_WATCH_READABLE;
-              if (fds[i].revents & _DBUS_POLLOUT)
-                condition |= DBUS_WATCH_WRITABLE;
-              if (fds[i].revents & _DBUS_POLLHUP)
-                condition |= DBUS_WATCH_HANGUP;
-              if (fds[i].revents & _DBUS_POLLERR)
-                condition |= DBUS_WATCH_ERROR;
-
-              /* condition may still be 0 if we got some
-               * weird POLLFOO thing like POLLWRBAND
-               */
-                  
-              if (condition != 0 &&
-                  dbus_watch_get_enabled (wcb->watch))
-                {
-                  if (!(* wcb->function) (wcb->watch,
-                                          condition,
-                                          ((Callback*)wcb)->data))
-                    wcb->last_iteration_oom = TRUE;
+              wcb->last_iteration_oom = TRUE;
+              loop->oom_watch_pending = TRUE;
+              any_oom = TRUE;
+            }
 
 #if MAINLOOP_SPEW
-                  _dbus_verbose ("  Invoked watch, oom = %d\n",
-                                 wcb->last_iteration_oom);
+          _dbus_verbose ("  Invoked watch, oom = %d\n",
+                         wcb->last_iteration_oom);
 #endif
-                  
-                  retval = TRUE;
-                }
+
+          callback_unref ((Callback *) wcb);
+
+          retval = TRUE;
+
+          /* The callback may have removed watches, or the whole fd, so
+           * none of the list links can be trusted any more.
+           */
+          if (initial_serial != loop->callback_list_serial ||
+              loop->depth != orig_depth)
+            {
+              if (any_oom &&
+                  _dbus_hash_table_lookup_int (loop->watches, fd) != NULL)
+                refresh_watches_for_fd (loop, NULL, fd);
+
+              goto next_iteration;
             }
-              
-          ++i;
         }
+
+      /* Stop polling the OOM watches until the next iteration */
+      if (any_oom)
+        refresh_watches_for_fd (loop, watches, fd);
     }
       
  next_iteration:
@@ -831,21 +1312,6 @@ _dbus_loop_iterate (DBusLoop     *loop,
   _dbus_verbose ("  moving to next iteration\n");
 #endif
   
-  if (fds && fds != stack_fds)
-    dbus_free (fds);
-  if (watches_for_fds)
-    {
-      i = 0;
-      while (i < n_fds)
-        {
-          callback_unref (&watches_for_fds[i]->callback);
-          ++i;
-        }
-      
-      if (watches_for_fds != stack_watches_for_fds)
-        dbus_free (watches_for_fds);
-    }
-  
   if (_dbus_loop_dispatch (loop))
     retval = TRUE;
   
@@ -48,6 +48,8 @@ void        _dbus_loop_remove_watch   (DBusLoop            *loop,
                                        DBusWatch           *watch,
                                        DBusWatchFunction    function,
                                        void                *data);
+void        _dbus_loop_toggle_watch   (DBusLoop            *loop,
+                                       DBusWatch           *watch);
 dbus_bool_t _dbus_loop_add_timeout    (DBusLoop            *loop,
                                        DBusTimeout         *timeout,
                                        DBusTimeoutFunction  function,
@@ -57,6 +59,8 @@ void        _dbus_loop_remove_timeout (DBusLoop            *loop,
                                        DBusTimeout         *timeout,
                                        DBusTimeoutFunction  function,
                                        void                *data);
+void        _dbus_loop_toggle_timeout (DBusLoop            *loop,
+                                       DBusTimeout         *timeout);
 
 dbus_bool_t _dbus_loop_queue_dispatch (DBusLoop            *loop,
                                        DBusConnection      *connection);
@@ -917,7 +917,28 @@ _dbus_swap_array (unsigned char *data,
    */
   d = data;
   end = d + (n_elements * alignment);
-  
+
+#ifdef DBUS_HAVE_INT64
+  /* Swap 2-byte elements four at a time by trading neighbouring bytes
+   * of a 64-bit word, which works whatever the host byte order. 4- and
+   * 8-byte elements are already a single bswap each. The array is only
+   * 2-aligned, so go through memcpy; the loop below does any tail.
+   */
+  if (alignment == 2)
+    {
+      while (end - d >= 8)
+        {
+          dbus_uint64_t w;
+
+          memcpy (&w, d, 8);
+          w = ((w & DBUS_UINT64_CONSTANT (0x00ff00ff00ff00ff)) << 8) |
+            ((w >> 8) & DBUS_UINT64_CONSTANT (0x00ff00ff00ff00ff));
+          memcpy (d, &w, 8);
+          d += 8;
+        }
+    }
+#endif /* DBUS_HAVE_INT64 */
+
   if (alignment == 8)
     {
       while (d != end)
@@ -1087,6 +1108,68 @@ _dbus_marshal_write_fixed_multi (DBusString *str,
   return FALSE;
 }
 
+/**
+ * Opens up space for a block of values of fixed-length type, padded
+ * to the alignment _dbus_marshal_write_fixed_multi() would use, and
+ * returns where the block starts so the caller can fill it in place
+ * rather than marshaling from a separate buffer. The block is zeroed.
+ * The caller writes the values in the byte order of the string.
+ *
+ * The returned pointer is only good until the string is next
+ * modified.
+ *
+ * @param str string to insert into
+ * @param insert_at where to insert the block
+ * @param element_type type of the array elements
+ * @param n_elements number of elements to make space for
+ * @param data_p return location for the start of the block
+ * @param pos_after return location for position after the block
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+_dbus_marshal_reserve_fixed_multi (DBusString *str,
+                                   int         insert_at,
+                                   int         element_type,
+                                   int         n_elements,
+                                   void      **data_p,
+                                   int        *pos_after)
+{
+  int old_string_len;
+  int array_start;
+  int alignment;
+  int len_in_bytes;
+
+  _dbus_assert (dbus_type_is_fixed (element_type));
+  _dbus_assert (n_elements >= 0);
+
+  alignment = _dbus_type_get_alignment (element_type);
+
+  _dbus_assert (n_elements <= DBUS_MAXIMUM_ARRAY_LENGTH / alignment);
+
+  old_string_len = _dbus_string_get_length (str);
+
+  len_in_bytes = n_elements * alignment;
+  array_start = insert_at;
+
+  /* pad unconditionally, as marshal_fixed_multi() does */
+  if (!_dbus_string_insert_alignment (str, &array_start, alignment))
+    return FALSE;
+
+  if (!_dbus_string_insert_bytes (str, array_start, len_in_bytes, '\0'))
+    {
+      _dbus_string_delete (str, insert_at,
+                           _dbus_string_get_length (str) - old_string_len);
+      return FALSE;
+    }
+
+  *data_p = _dbus_string_get_data_len (str, array_start, len_in_bytes);
+
+  if (pos_after)
+    *pos_after = array_start + len_in_bytes;
+
+  return TRUE;
+}
+
 
 /**
  * Skips over a basic-typed value, reporting the following position.
@@ -1642,7 +1725,7 @@ swap_test_array (void *array,
 #define DEMARSHAL_FIXED_ARRAY_AND_CHECK(typename, byte_order, literal)                  \
   do {                                                                                  \
     DEMARSHAL_FIXED_ARRAY (typename, byte_order);                                       \
-    if (memcmp (literal, v_ARRAY_##typename, sizeof (literal) != 0))                    \
+    if (memcmp (literal, v_ARRAY_##typename, sizeof (literal)) != 0)                    \
       {                                                                                 \
         _dbus_verbose ("MARSHALED DATA\n");                                             \
         _dbus_verbose_bytes_of_string (&str, dump_pos,                                  \
@@ -1669,7 +1752,7 @@ _dbus_marshal_test (void)
   DBusString str;
   int pos, dump_pos;
   unsigned char array1[5] = { 3, 4, 0, 1, 9 };
-  dbus_int16_t array2[3] = { 124, 457, 780 };
+  dbus_int16_t array2[7] = { 124, 457, 780, -1, 0x1234, 9, 32000 };
   dbus_int32_t array4[3] = { 123, 456, 789 };
 #ifdef DBUS_HAVE_INT64
   dbus_int64_t array8[3] = { DBUS_INT64_CONSTANT (0x123ffffffff),
@@ -225,6 +225,12 @@ dbus_bool_t   _dbus_marshal_write_fixed_multi (DBusString       *str,
                                                int               n_elements,
                                                int               byte_order,
                                                int              *pos_after);
+dbus_bool_t   _dbus_marshal_reserve_fixed_multi (DBusString     *str,
+                                                 int             insert_at,
+                                                 int             element_type,
+                                                 int             n_elements,
+                                                 void          **data_p,
+                                                 int            *pos_after);
 void          _dbus_marshal_read_basic        (const DBusString *str,
                                                int               pos,
                                                int               type,
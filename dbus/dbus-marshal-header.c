@@ -26,6 +26,7 @@
 #include "dbus-marshal-header.h"
 #include "dbus-marshal-recursive.h"
 #include "dbus-marshal-byteswap.h"
+#include "dbus-signature.h"
 
 /**
  * @addtogroup DBusMarshal
@@ -83,7 +84,8 @@ _dbus_header_field_types[DBUS_HEADER_FIELD_LAST+1] = {
   { DBUS_HEADER_FIELD_DESTINATION, DBUS_TYPE_STRING },
   { DBUS_HEADER_FIELD_SENDER, DBUS_TYPE_STRING },
   { DBUS_HEADER_FIELD_SIGNATURE, DBUS_TYPE_SIGNATURE },
-  { DBUS_HEADER_FIELD_UNIX_FDS, DBUS_TYPE_UINT32 }
+  { DBUS_HEADER_FIELD_UNIX_FDS, DBUS_TYPE_UINT32 },
+  { DBUS_HEADER_FIELD_EXPIRY, DBUS_TYPE_UINT32 }
 };
 
 /** Macro to look up the correct type for a field */
@@ -91,6 +93,12 @@ _dbus_header_field_types[DBUS_HEADER_FIELD_LAST+1] = {
 
 /** The most padding we could ever need for a header */
 #define MAX_POSSIBLE_HEADER_PADDING 7
+
+/** Room left in a loaded header for the bus to add a typical unique
+ * name as the sender, with its alignment and the header padding,
+ * without reallocating
+ */
+#define SENDER_FIELD_ROOM 48
 static dbus_bool_t
 reserve_header_padding (DBusHeader *header)
 {
@@ -155,8 +163,34 @@ _dbus_header_cache_one (DBusHeader     *header,
                         int             field_code,
                         DBusTypeReader *variant_reader)
 {
-  header->fields[field_code].value_pos =
-    _dbus_type_reader_get_value_pos (variant_reader);
+  DBusHeaderField *field = &header->fields[field_code];
+  int type;
+
+  field->value_pos = _dbus_type_reader_get_value_pos (variant_reader);
+
+  /* Remember where string values start, so getting them later is just
+   * pointer arithmetic instead of demarshaling.
+   */
+  type = _dbus_type_reader_get_current_type (variant_reader);
+  if (type == DBUS_TYPE_STRING ||
+      type == DBUS_TYPE_OBJECT_PATH ||
+      type == DBUS_TYPE_SIGNATURE)
+    {
+      const char *v;
+      int end;
+
+      _dbus_marshal_read_basic (&header->data, field->value_pos,
+                                type, (void *) &v, header->byte_order,
+                                &end);
+
+      field->str_pos = v - _dbus_string_get_const_data (&header->data);
+      field->str_len = end - field->str_pos - 1;
+    }
+  else
+    {
+      field->str_pos = -1;
+      field->str_len = 0;
+    }
 
 #if 0
   _dbus_verbose ("cached value_pos %d for field %d\n",
@@ -219,6 +253,39 @@ _dbus_header_cache_revalidate (DBusHeader *header)
     }
 }
 
+/**
+ * Caches a field whose { byte, variant } struct starts at the given
+ * position, without looking through the other fields.
+ *
+ * @param header the header
+ * @param field_code the field
+ * @param pos where the field starts
+ */
+static void
+_dbus_header_cache_field_at (DBusHeader *header,
+                             int         field_code,
+                             int         pos)
+{
+  DBusTypeReader reader;
+  DBusTypeReader sub;
+  DBusTypeReader variant;
+
+  _dbus_type_reader_init (&reader,
+                          header->byte_order,
+                          &_dbus_header_signature_str,
+                          FIELDS_ARRAY_ELEMENT_SIGNATURE_OFFSET,
+                          &header->data,
+                          pos);
+
+  _dbus_type_reader_recurse (&reader, &sub);
+  _dbus_type_reader_next (&sub);
+
+  _dbus_assert (_dbus_type_reader_get_current_type (&sub) == DBUS_TYPE_VARIANT);
+  _dbus_type_reader_recurse (&sub, &variant);
+
+  _dbus_header_cache_one (header, field_code, &variant);
+}
+
 /**
  * Checks for a field, updating the cache if required.
  *
@@ -497,6 +564,36 @@ _dbus_header_copy (const DBusHeader *header,
   return TRUE;
 }
 
+/**
+ * Like _dbus_header_copy(), but copies into a header that was already
+ * initialized, such as one being reused, replacing what was in it.
+ * Resets the message serial to 0 on the copy.
+ *
+ * @param header header to copy
+ * @param dest initialized header to copy into
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+_dbus_header_copy_into (const DBusHeader *header,
+                        DBusHeader       *dest)
+{
+  int i;
+
+  _dbus_string_set_length (&dest->data, 0);
+
+  if (!_dbus_string_copy (&header->data, 0, &dest->data, 0))
+    return FALSE;
+
+  for (i = 0; i <= DBUS_HEADER_FIELD_LAST; i++)
+    dest->fields[i] = header->fields[i];
+  dest->padding = header->padding;
+  dest->byte_order = header->byte_order;
+
+  _dbus_header_set_serial (dest, 0);
+
+  return TRUE;
+}
+
 /**
  * Fills in the primary fields of the header, so the header is ready
  * for use. #NULL may be specified for some or all of the fields to
@@ -891,6 +988,7 @@ load_and_validate_field (DBusHeader     *header,
       break;
 
     case DBUS_HEADER_FIELD_UNIX_FDS:
+    case DBUS_HEADER_FIELD_EXPIRY:
       /* Every value makes sense */
       break;
 
@@ -977,7 +1075,8 @@ _dbus_header_load (DBusHeader        *header,
   _dbus_assert (header_len <= len);
   _dbus_assert (_dbus_string_get_length (&header->data) == 0);
 
-  if (!_dbus_string_copy_len (str, start, header_len, &header->data, 0))
+  if (!_dbus_string_alloc_space (&header->data, header_len + SENDER_FIELD_ROOM) ||
+      !_dbus_string_copy_len (str, start, header_len, &header->data, 0))
     {
       _dbus_verbose ("Failed to copy buffer into new header\n");
       *validity = DBUS_VALIDITY_UNKNOWN_OOM_ERROR;
@@ -1027,13 +1126,14 @@ _dbus_header_load (DBusHeader        *header,
     }
 
   /* We now know the data is well-formed, but we have to check that
-   * it's valid.
+   * it's valid. Read from our own copy so the field positions we
+   * cache are relative to header->data, whatever start was.
    */
 
   _dbus_type_reader_init (&reader,
                           byte_order,
                           &_dbus_header_signature_str, 0,
-                          str, start);
+                          &header->data, 0);
 
   /* BYTE ORDER */
   _dbus_assert (_dbus_type_reader_get_current_type (&reader) == DBUS_TYPE_BYTE);
@@ -1247,8 +1347,42 @@ _dbus_header_set_field_basic (DBusHeader       *header,
                               int               type,
                               const void       *value)
 {
+  int field_start;
+
   _dbus_assert (field <= DBUS_HEADER_FIELD_LAST);
 
+  /* A value as long as the one it replaces, such as the sender the
+   * bus stamps on a message that claimed one, is written in place
+   */
+  if (_dbus_header_cache_check (header, field) &&
+      (dbus_type_is_fixed (type) ||
+       strlen (*(const char **) value) == (size_t) header->fields[field].str_len))
+    {
+      /* Strings are copied over directly, since replacing them would
+       * grow the header for a moment, which can fail
+       */
+      if (dbus_type_is_fixed (type))
+        {
+          if (!_dbus_marshal_set_basic (&header->data,
+                                        header->fields[field].value_pos,
+                                        type, value, header->byte_order,
+                                        NULL, NULL))
+            _dbus_assert_not_reached ("setting a fixed-size value used memory");
+        }
+      else
+        {
+          _dbus_assert (header->fields[field].str_pos >= 0);
+
+          memcpy (_dbus_string_get_data_len (&header->data,
+                                             header->fields[field].str_pos,
+                                             header->fields[field].str_len),
+                  *(const char **) value,
+                  header->fields[field].str_len);
+        }
+
+      return TRUE;
+    }
+
   if (!reserve_header_padding (header))
     return FALSE;
 
@@ -1290,19 +1424,27 @@ _dbus_header_set_field_basic (DBusHeader       *header,
       _dbus_assert (array.u.array.start_pos == FIRST_FIELD_OFFSET);
       _dbus_assert (array.value_pos == HEADER_END_BEFORE_PADDING (header));
 
+      field_start = _DBUS_ALIGN_VALUE (array.value_pos, 8);
+
       if (!write_basic_field (&array,
                               field, type, value))
         return FALSE;
 
       if (!_dbus_type_writer_unrecurse (&writer, &array))
         _dbus_assert_not_reached ("unrecurse from ARRAY should not have used memory");
+
+      correct_header_padding (header);
+
+      /* The fields before it haven't moved */
+      _dbus_header_cache_field_at (header, field, field_start);
+
+      return TRUE;
     }
 
   correct_header_padding (header);
 
   /* We could be smarter about this (only invalidate fields after the
-   * one we modified, or even only if the one we modified changed
-   * length). But this hack is a start.
+   * one we modified). But this hack is a start.
    */
   _dbus_header_cache_invalidate_all (header);
 
@@ -1347,6 +1489,39 @@ _dbus_header_get_field_basic (DBusHeader    *header,
   return TRUE;
 }
 
+/**
+ * Gets the value of a string, object path or signature field without
+ * demarshaling it. The value points into the header data, so it's
+ * only valid until the header is modified.
+ *
+ * @param header the header
+ * @param field the field to get
+ * @param value return location for the nul-terminated value
+ * @param len return location for the value's length, or #NULL
+ * @returns #FALSE if the field doesn't exist
+ */
+dbus_bool_t
+_dbus_header_get_field_string (DBusHeader    *header,
+                               int            field,
+                               const char   **value,
+                               int           *len)
+{
+  _dbus_assert (field != DBUS_HEADER_FIELD_INVALID);
+  _dbus_assert (field <= DBUS_HEADER_FIELD_LAST);
+
+  if (!_dbus_header_cache_check (header, field))
+    return FALSE;
+
+  _dbus_assert (header->fields[field].str_pos >= 0);
+
+  *value = _dbus_string_get_const_data (&header->data) +
+    header->fields[field].str_pos;
+  if (len != NULL)
+    *len = header->fields[field].str_len;
+
+  return TRUE;
+}
+
 /**
  * Gets the raw marshaled data for a field. If the field doesn't
  * exist, returns #FALSE, otherwise returns #TRUE.  Returns the start
@@ -1476,6 +1651,9 @@ _dbus_header_byteswap (DBusHeader *header,
                           new_order,
                           &header->data, 0);
 
+  /* the byte order flag itself is a byte, so isn't swapped */
+  _dbus_string_set_byte (&header->data, BYTE_ORDER_OFFSET, new_order);
+
   header->byte_order = new_order;
 }
 
@@ -39,6 +39,8 @@ typedef struct DBusHeaderField DBusHeaderField;
 struct DBusHeaderField
 {
   int            value_pos; /**< Position of field value, or -1/-2 */
+  int            str_pos;   /**< For string-typed fields, position of the string itself */
+  int            str_len;   /**< For string-typed fields, length of the string */
 };
 
 /**
@@ -73,6 +75,8 @@ dbus_bool_t   _dbus_header_create                 (DBusHeader        *header,
                                                    const char        *error_name);
 dbus_bool_t   _dbus_header_copy                   (const DBusHeader  *header,
                                                    DBusHeader        *dest);
+dbus_bool_t   _dbus_header_copy_into              (const DBusHeader  *header,
+                                                   DBusHeader        *dest);
 int           _dbus_header_get_message_type       (DBusHeader        *header);
 void          _dbus_header_set_serial             (DBusHeader        *header,
                                                    dbus_uint32_t      serial);
@@ -87,6 +91,10 @@ dbus_bool_t   _dbus_header_get_field_basic        (DBusHeader        *header,
                                                    int                field,
                                                    int                type,
                                                    void              *value);
+dbus_bool_t   _dbus_header_get_field_string       (DBusHeader        *header,
+                                                   int                field,
+                                                   const char       **value,
+                                                   int               *len);
 dbus_bool_t   _dbus_header_get_field_raw          (DBusHeader        *header,
                                                    int                field,
                                                    const DBusString **str,
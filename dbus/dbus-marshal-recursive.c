@@ -27,6 +27,8 @@
 #include "dbus-signature.h"
 #include "dbus-internals.h"
 
+#include <string.h>
+
 /**
  * @addtogroup DBusMarshal
  * @{
@@ -129,6 +131,198 @@ element_type_get_alignment (const DBusString *str,
   return _dbus_type_get_alignment (_dbus_first_type_in_signature (str, pos));
 }
 
+/* Returns how many bytes a struct or dict entry takes up if it's made
+ * only of fixed-length basic types and such structs, or -1 otherwise.
+ * The size doesn't depend on where the value is since it starts on an
+ * 8-byte boundary, so a value can be skipped without walking it.
+ */
+static int
+find_fixed_size_of_struct (const DBusString *type_str,
+                           int               type_pos)
+{
+  int size;
+  int t;
+
+  _dbus_assert (_dbus_string_get_byte (type_str, type_pos) == DBUS_STRUCT_BEGIN_CHAR ||
+                _dbus_string_get_byte (type_str, type_pos) == DBUS_DICT_ENTRY_BEGIN_CHAR);
+
+  size = 0;
+  type_pos += 1;
+
+  while (TRUE)
+    {
+      t = _dbus_string_get_byte (type_str, type_pos);
+
+      if (t == DBUS_STRUCT_END_CHAR || t == DBUS_DICT_ENTRY_END_CHAR)
+        return size;
+
+      if (t == DBUS_STRUCT_BEGIN_CHAR || t == DBUS_DICT_ENTRY_BEGIN_CHAR)
+        {
+          int sub_size;
+
+          sub_size = find_fixed_size_of_struct (type_str, type_pos);
+          if (sub_size < 0)
+            return -1;
+
+          size = _DBUS_ALIGN_VALUE (size, 8) + sub_size;
+          _dbus_type_signature_next (_dbus_string_get_const_data (type_str),
+                                     &type_pos);
+        }
+      else if (dbus_type_is_fixed (t))
+        {
+          int alignment;
+
+          /* fixed-length basic types are as long as their alignment */
+          alignment = _dbus_type_get_alignment (t);
+          size = _DBUS_ALIGN_VALUE (size, alignment) + alignment;
+          type_pos += 1;
+        }
+      else
+        return -1;
+    }
+}
+
+
+/* One basic-typed member of a fixed-layout struct, flattened out of
+ * any nested structs: where it starts relative to the start of the
+ * outermost struct, and how wide it is.
+ */
+typedef struct
+{
+  int offset; /**< byte offset from the start of the struct */
+  int size;   /**< size of the member, which is also its alignment */
+} FixedStructMember;
+
+/* Flattens a struct or dict entry made only of fixed-length basic
+ * types other than UNIX_FD (and such structs) into the list of its
+ * members, starting at the 8-aligned offset start. Returns the offset
+ * just after the struct, or -1 if it isn't of that shape. At most one
+ * member per signature byte, so members needs room for
+ * DBUS_MAXIMUM_SIGNATURE_LENGTH.
+ */
+static int
+get_fixed_struct_layout (const DBusString  *type_str,
+                         int                type_pos,
+                         int                start,
+                         FixedStructMember *members,
+                         int               *n_members)
+{
+  int pos;
+  int t;
+
+  _dbus_assert (_DBUS_ALIGN_VALUE (start, 8) == start);
+
+  t = _dbus_string_get_byte (type_str, type_pos);
+  if (t != DBUS_STRUCT_BEGIN_CHAR && t != DBUS_DICT_ENTRY_BEGIN_CHAR)
+    return -1;
+
+  pos = start;
+  type_pos += 1;
+
+  while (TRUE)
+    {
+      t = _dbus_string_get_byte (type_str, type_pos);
+
+      if (t == DBUS_STRUCT_END_CHAR || t == DBUS_DICT_ENTRY_END_CHAR)
+        return pos;
+
+      if (t == DBUS_STRUCT_BEGIN_CHAR || t == DBUS_DICT_ENTRY_BEGIN_CHAR)
+        {
+          pos = get_fixed_struct_layout (type_str, type_pos,
+                                         _DBUS_ALIGN_VALUE (pos, 8),
+                                         members, n_members);
+          if (pos < 0)
+            return -1;
+
+          _dbus_type_signature_next (_dbus_string_get_const_data (type_str),
+                                     &type_pos);
+        }
+      else if (dbus_type_is_fixed (t) && t != DBUS_TYPE_UNIX_FD)
+        {
+          int alignment;
+
+          _dbus_assert (*n_members < DBUS_MAXIMUM_SIGNATURE_LENGTH);
+
+          alignment = _dbus_type_get_alignment (t);
+          pos = _DBUS_ALIGN_VALUE (pos, alignment);
+          members[*n_members].offset = pos;
+          members[*n_members].size = alignment;
+          *n_members += 1;
+          pos += alignment;
+          type_pos += 1;
+        }
+      else
+        return -1;
+    }
+}
+
+/**
+ * Gets the marshalled size of a struct or dict entry made only of
+ * fixed-length basic types other than #DBUS_TYPE_UNIX_FD, and of
+ * such structs, e.g. "(iid)". Arrays of these can be copied in bulk
+ * with _dbus_type_reader_read_fixed_struct_multi() and
+ * _dbus_type_writer_write_fixed_struct_multi().
+ *
+ * @param type_str string containing the type
+ * @param type_pos where the type starts
+ * @returns the size, not counting padding after the struct, or -1
+ */
+int
+_dbus_type_get_fixed_struct_size (const DBusString *type_str,
+                                  int               type_pos)
+{
+  FixedStructMember members[DBUS_MAXIMUM_SIGNATURE_LENGTH];
+  int n_members;
+
+  n_members = 0;
+  return get_fixed_struct_layout (type_str, type_pos, 0,
+                                  members, &n_members);
+}
+
+/* Swaps each member of n_elements structs laid out stride bytes
+ * apart to the opposite byte order. Members of each struct are next
+ * to each other, so this goes struct by struct.
+ */
+static void
+swap_fixed_structs (unsigned char           *data,
+                    int                      stride,
+                    int                      n_elements,
+                    const FixedStructMember *members,
+                    int                      n_members)
+{
+  int i;
+  int j;
+
+  for (i = 0; i < n_elements; i++)
+    {
+      unsigned char *element = data + i * stride;
+
+      for (j = 0; j < n_members; j++)
+        {
+          unsigned char *d = element + members[j].offset;
+
+          switch (members[j].size)
+            {
+            case 2:
+              *((dbus_uint16_t*)d) = DBUS_UINT16_SWAP_LE_BE (*((dbus_uint16_t*)d));
+              break;
+            case 4:
+              *((dbus_uint32_t*)d) = DBUS_UINT32_SWAP_LE_BE (*((dbus_uint32_t*)d));
+              break;
+            case 8:
+#ifdef DBUS_HAVE_INT64
+              *((dbus_uint64_t*)d) = DBUS_UINT64_SWAP_LE_BE (*((dbus_uint64_t*)d));
+#else
+              _dbus_swap_array (d, 1, 8);
+#endif
+              break;
+            default:
+              break;
+            }
+        }
+    }
+}
+
 static void
 reader_init (DBusTypeReader    *reader,
              int                byte_order,
@@ -193,6 +387,7 @@ array_types_only_reader_recurse (DBusTypeReader *sub,
 
   /* Init with values likely to crash things if misused */
   sub->u.array.start_pos = _DBUS_INT_MAX;
+  sub->u.array.element_fixed_size = -1;
   sub->array_len_offset = 7;
 }
 
@@ -247,6 +442,19 @@ array_reader_recurse (DBusTypeReader *sub,
   _dbus_assert ((sub->u.array.start_pos - (len_pos + 4)) < 8); /* only 3 bits in array_len_offset */
   sub->array_len_offset = sub->u.array.start_pos - (len_pos + 4);
 
+  /* Work out once per array whether its elements can be skipped
+   * without recursing into each of them.
+   */
+  if (alignment == 8)
+    {
+      int t;
+
+      t = _dbus_first_type_in_signature (sub->type_str, sub->type_pos);
+      if (t == DBUS_TYPE_STRUCT || t == DBUS_TYPE_DICT_ENTRY)
+        sub->u.array.element_fixed_size =
+          find_fixed_size_of_struct (sub->type_str, sub->type_pos);
+    }
+
 #if RECURSIVE_MARSHAL_READ_TRACE
   _dbus_verbose ("    type reader %p array start = %d len_offset = %d array len = %d array element type = %s\n",
                  sub,
@@ -433,6 +641,17 @@ base_reader_next (DBusTypeReader *reader,
       /* Scan forward over the entire container contents */
       {
         DBusTypeReader sub;
+        int fixed_size;
+
+        if (current_type != DBUS_TYPE_VARIANT &&
+            !reader->klass->types_only &&
+            (fixed_size = find_fixed_size_of_struct (reader->type_str,
+                                                     reader->type_pos)) >= 0)
+          {
+            reader->value_pos = _DBUS_ALIGN_VALUE (reader->value_pos, 8) + fixed_size;
+            skip_one_complete_type (reader->type_str, &reader->type_pos);
+            break;
+          }
 
         if (reader->klass->types_only && current_type == DBUS_TYPE_VARIANT)
           ;
@@ -569,6 +788,13 @@ array_reader_next (DBusTypeReader *reader,
       {
         DBusTypeReader sub;
 
+        if (reader->u.array.element_fixed_size >= 0)
+          {
+            reader->value_pos = _DBUS_ALIGN_VALUE (reader->value_pos, 8) +
+              reader->u.array.element_fixed_size;
+            break;
+          }
+
         /* Recurse into the struct or variant */
         _dbus_type_reader_recurse (reader, &sub);
 
@@ -960,6 +1186,252 @@ _dbus_type_reader_read_fixed_multi (const DBusTypeReader  *reader,
 #endif
 }
 
+/**
+ * Copies the structs in an array of fixed-layout structs (see
+ * _dbus_type_get_fixed_struct_size()) from the current position to
+ * the end of the array out into a C array, swapping them to native
+ * byte order. Each element is laid out as on the wire, with its
+ * members at the same offsets from the start of the element; elements
+ * are element_size bytes apart, which must be at least the size of
+ * the struct. Does not move the reader.
+ *
+ * On entry n_elements is how many elements there is room for. If
+ * there are more than that, nothing is copied, n_elements is set to
+ * how many there are and #FALSE is returned.
+ *
+ * @param reader the array reader
+ * @param elements where to copy the elements
+ * @param element_size distance between elements in the C array
+ * @param n_elements room in the C array; returns number of elements
+ * @returns #FALSE if there wasn't room
+ */
+dbus_bool_t
+_dbus_type_reader_read_fixed_struct_multi (const DBusTypeReader  *reader,
+                                           void                  *elements,
+                                           int                    element_size,
+                                           int                   *n_elements)
+{
+  FixedStructMember members[DBUS_MAXIMUM_SIGNATURE_LENGTH];
+  int n_members;
+  int size;
+  int stride;
+  int start;
+  int end_pos;
+  int n_available;
+  int len;
+  const unsigned char *src;
+  unsigned char *dest;
+
+  _dbus_assert (!reader->klass->types_only);
+  _dbus_assert (reader->klass == &array_reader_class);
+
+  n_members = 0;
+  size = get_fixed_struct_layout (reader->type_str, reader->type_pos, 0,
+                                  members, &n_members);
+
+  _dbus_assert (size > 0);
+  _dbus_assert (element_size >= size);
+
+  stride = _DBUS_ALIGN_VALUE (size, 8);
+  end_pos = reader->u.array.start_pos + array_reader_get_array_len (reader);
+  start = _DBUS_ALIGN_VALUE (reader->value_pos, 8);
+
+  /* the last element isn't followed by padding */
+  if (start >= end_pos)
+    n_available = 0;
+  else
+    n_available = (end_pos - start + stride - size) / stride;
+
+  if (n_available > *n_elements)
+    {
+      *n_elements = n_available;
+      return FALSE;
+    }
+
+  *n_elements = n_available;
+
+  if (n_available == 0)
+    return TRUE;
+
+  len = (n_available - 1) * stride + size;
+  _dbus_assert (start + len == end_pos);
+
+  src = (const unsigned char *)
+    _dbus_string_get_const_data_len (reader->value_str, start, len);
+  dest = elements;
+
+  if (element_size == stride)
+    {
+      memcpy (dest, src, len);
+    }
+  else
+    {
+      int i;
+
+      for (i = 0; i < n_available; i++)
+        memcpy (dest + i * element_size, src + i * stride, size);
+    }
+
+  if (reader->byte_order != DBUS_COMPILER_BYTE_ORDER)
+    swap_fixed_structs (dest, element_size, n_available, members, n_members);
+
+  return TRUE;
+}
+
+/**
+ * Stores pointers to the strings in an array of string, object path
+ * or signature, from the current position to the end of the array,
+ * without copying them. The pointers point into the value string, so
+ * they are only valid as long as it is not modified. Does not move
+ * the reader.
+ *
+ * On entry n_elements is how many pointers there is room for. If
+ * there are more strings than that, only the first n_elements are
+ * stored, n_elements is set to how many there are and #FALSE is
+ * returned.
+ *
+ * @param reader the array reader
+ * @param elements where to store the pointers
+ * @param n_elements room in elements; returns number of strings
+ * @returns #FALSE if there wasn't room
+ */
+dbus_bool_t
+_dbus_type_reader_read_string_multi (const DBusTypeReader  *reader,
+                                     const char           **elements,
+                                     int                   *n_elements)
+{
+  const unsigned char *data;
+  int element_type;
+  int end_pos;
+  int pos;
+  int room;
+  int i;
+
+  _dbus_assert (!reader->klass->types_only);
+  _dbus_assert (reader->klass == &array_reader_class);
+
+  element_type = _dbus_first_type_in_signature (reader->type_str,
+                                                reader->type_pos);
+
+  _dbus_assert (element_type == DBUS_TYPE_STRING ||
+                element_type == DBUS_TYPE_OBJECT_PATH ||
+                element_type == DBUS_TYPE_SIGNATURE);
+
+  data = (const unsigned char *) _dbus_string_get_const_data (reader->value_str);
+  end_pos = reader->u.array.start_pos + array_reader_get_array_len (reader);
+  pos = reader->value_pos;
+  room = *n_elements;
+  i = 0;
+
+  while (pos < end_pos)
+    {
+      int len;
+
+      if (element_type == DBUS_TYPE_SIGNATURE)
+        {
+          len = data[pos];
+          pos += 1;
+        }
+      else
+        {
+          pos = _DBUS_ALIGN_VALUE (pos, 4);
+          len = _dbus_unpack_uint32 (reader->byte_order, data + pos);
+          pos += 4;
+        }
+
+      if (i < room)
+        elements[i] = (const char *) data + pos;
+
+      pos += len + 1;
+      ++i;
+    }
+
+  _dbus_assert (pos == end_pos);
+
+  *n_elements = i;
+  return i <= room;
+}
+
+/* Whether the type at type_pos is "{sv}" */
+static dbus_bool_t
+is_string_variant_entry (const DBusString *type_str,
+                         int               type_pos)
+{
+  return _dbus_string_get_byte (type_str, type_pos) == DBUS_DICT_ENTRY_BEGIN_CHAR &&
+    _dbus_string_get_byte (type_str, type_pos + 1) == DBUS_TYPE_STRING &&
+    _dbus_string_get_byte (type_str, type_pos + 2) == DBUS_TYPE_VARIANT &&
+    _dbus_string_get_byte (type_str, type_pos + 3) == DBUS_DICT_ENTRY_END_CHAR;
+}
+
+/**
+ * Looks up a key in an array of "{sv}" dict entries, from the
+ * reader's position to the end of the array, comparing keys in place
+ * and stepping over variants holding a basic type without recursing
+ * into them. On success value_reader is left pointing at the value
+ * inside the matching entry's variant. The reader is not moved.
+ *
+ * @param reader the array reader
+ * @param key the key to look for
+ * @param value_reader reader to init at the value
+ * @returns #FALSE if the key isn't there
+ */
+dbus_bool_t
+_dbus_type_reader_find_variant_entry (const DBusTypeReader *reader,
+                                      const char           *key,
+                                      DBusTypeReader       *value_reader)
+{
+  DBusTypeReader array;
+  const unsigned char *data;
+  int key_len;
+
+  _dbus_assert (!reader->klass->types_only);
+  _dbus_assert (reader->klass == &array_reader_class);
+  _dbus_assert (is_string_variant_entry (reader->type_str, reader->type_pos));
+
+  array = *reader;
+  data = (const unsigned char *) _dbus_string_get_const_data (array.value_str);
+  key_len = strlen (key);
+
+  while (!array_reader_check_finished (&array))
+    {
+      int pos;
+      int len;
+      int sig_pos;
+      int value_type;
+
+      pos = _DBUS_ALIGN_VALUE (array.value_pos, 8);
+      len = _dbus_unpack_uint32 (array.byte_order, data + pos);
+
+      if (len == key_len && memcmp (data + pos + 4, key, len) == 0)
+        {
+          DBusTypeReader entry;
+
+          _dbus_type_reader_recurse (&array, &entry);
+          _dbus_type_reader_next (&entry);
+          _dbus_type_reader_recurse (&entry, value_reader);
+          return TRUE;
+        }
+
+      /* the variant's signature follows the key's nul */
+      sig_pos = pos + 4 + len + 1;
+      value_type = data[sig_pos + 1];
+
+      if (data[sig_pos] == 1 && dbus_type_is_basic (value_type))
+        {
+          pos = sig_pos + 3;
+          _dbus_marshal_skip_basic (array.value_str, value_type,
+                                    array.byte_order, &pos);
+          array.value_pos = pos;
+        }
+      else
+        {
+          _dbus_type_reader_next (&array);
+        }
+    }
+
+  return FALSE;
+}
+
 /**
  * Initialize a new reader pointing to the first type and
  * corresponding value that's a child of the current container. It's
@@ -2379,6 +2851,223 @@ _dbus_type_writer_write_fixed_multi (DBusTypeWriter        *writer,
   return TRUE;
 }
 
+/**
+ * Like _dbus_type_writer_write_fixed_multi(), but rather than copying
+ * the values in, makes zeroed space for them and returns a pointer to
+ * it so the caller can write them in place, in the writer's byte
+ * order. The pointer is only valid until the value string is next
+ * modified. If the writer is disabled, no space is made and the
+ * pointer is set to #NULL.
+ *
+ * @param writer the writer
+ * @param element_type type of stuff in the array
+ * @param n_elements number of elements to make space for
+ * @param data_p return location for the space
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+_dbus_type_writer_reserve_fixed_multi (DBusTypeWriter        *writer,
+                                       int                    element_type,
+                                       int                    n_elements,
+                                       void                 **data_p)
+{
+  _dbus_assert (writer->container_type == DBUS_TYPE_ARRAY);
+  _dbus_assert (dbus_type_is_fixed (element_type));
+  _dbus_assert (writer->type_pos_is_expectation);
+  _dbus_assert (n_elements >= 0);
+
+  if (!write_or_verify_typecode (writer, element_type))
+    _dbus_assert_not_reached ("OOM should not happen if only verifying typecode");
+
+  *data_p = NULL;
+
+  if (writer->enabled)
+    {
+      if (!_dbus_marshal_reserve_fixed_multi (writer->value_str,
+                                              writer->value_pos,
+                                              element_type,
+                                              n_elements,
+                                              data_p,
+                                              &writer->value_pos))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * Writes a block of fixed-layout structs (see
+ * _dbus_type_get_fixed_struct_size()) from a C array into an array
+ * of them, in the writer's byte order. Each element must be laid out
+ * as on the wire, with its members at the same offsets from the start
+ * of the element; elements are element_size bytes apart, which must
+ * be at least the size of the struct. Padding is always written as
+ * zeros, whatever is in the padding of the C structs.
+ *
+ * @param writer the array writer
+ * @param elements the C array
+ * @param element_size distance between elements in the C array
+ * @param n_elements number of elements to write
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+_dbus_type_writer_write_fixed_struct_multi (DBusTypeWriter        *writer,
+                                            const void            *elements,
+                                            int                    element_size,
+                                            int                    n_elements)
+{
+  FixedStructMember members[DBUS_MAXIMUM_SIGNATURE_LENGTH];
+  int n_members;
+  int size;
+  int stride;
+  int members_size;
+  int old_string_len;
+  int start;
+  int len;
+  int i;
+  const unsigned char *src;
+  unsigned char *dest;
+
+  _dbus_assert (writer->container_type == DBUS_TYPE_ARRAY);
+  _dbus_assert (writer->type_pos_is_expectation);
+  _dbus_assert (writer->type_str != NULL);
+  _dbus_assert (n_elements >= 0);
+
+  n_members = 0;
+  size = get_fixed_struct_layout (writer->type_str, writer->type_pos, 0,
+                                  members, &n_members);
+
+  _dbus_assert (size > 0);
+  _dbus_assert (element_size >= size);
+
+  if (!writer->enabled || n_elements == 0)
+    return TRUE;
+
+  stride = _DBUS_ALIGN_VALUE (size, 8);
+  len = (n_elements - 1) * stride + size;
+
+  old_string_len = _dbus_string_get_length (writer->value_str);
+  start = writer->value_pos;
+
+  if (!_dbus_string_insert_alignment (writer->value_str, &start, 8))
+    return FALSE;
+
+  if (!_dbus_string_insert_bytes (writer->value_str, start, len, '\0'))
+    {
+      _dbus_string_delete (writer->value_str, writer->value_pos,
+                           _dbus_string_get_length (writer->value_str) - old_string_len);
+      return FALSE;
+    }
+
+  dest = (unsigned char *)
+    _dbus_string_get_data_len (writer->value_str, start, len);
+  src = elements;
+
+  members_size = 0;
+  for (i = 0; i < n_members; i++)
+    members_size += members[i].size;
+
+  /* Padding must go out as zeros, so whole structs can only be
+   * copied if there is none inside them; the padding between them
+   * is already zero.
+   */
+  if (members_size == size && element_size == stride && size == stride)
+    {
+      memcpy (dest, src, len);
+    }
+  else if (members_size == size)
+    {
+      for (i = 0; i < n_elements; i++)
+        memcpy (dest + i * stride, src + i * element_size, size);
+    }
+  else
+    {
+      for (i = 0; i < n_elements; i++)
+        {
+          int j;
+
+          for (j = 0; j < n_members; j++)
+            memcpy (dest + i * stride + members[j].offset,
+                    src + i * element_size + members[j].offset,
+                    members[j].size);
+        }
+    }
+
+  if (writer->byte_order != DBUS_COMPILER_BYTE_ORDER)
+    swap_fixed_structs (dest, stride, n_elements, members, n_members);
+
+  writer->value_pos = start + len;
+
+#if RECURSIVE_MARSHAL_WRITE_TRACE
+  _dbus_verbose ("  type writer %p fixed struct multi written new type_pos = %d new value_pos = %d n_elements %d\n",
+                 writer, writer->type_pos, writer->value_pos, n_elements);
+#endif
+
+  return TRUE;
+}
+
+/**
+ * Writes one "{sv}" dict entry holding a basic-typed value into an
+ * array of them, marshalling the key, the one-type variant signature
+ * and the value straight into place rather than recursing into the
+ * dict entry and the variant.
+ *
+ * @param writer the array writer
+ * @param key the entry's key
+ * @param type the type of the value
+ * @param value the address of the value, as for _dbus_type_writer_write_basic()
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+_dbus_type_writer_write_variant_entry (DBusTypeWriter *writer,
+                                       const char     *key,
+                                       int             type,
+                                       const void     *value)
+{
+  char signature[2];
+  const char *signature_p;
+  int old_string_len;
+  int pos;
+
+  _dbus_assert (writer->container_type == DBUS_TYPE_ARRAY);
+  _dbus_assert (writer->type_pos_is_expectation);
+  _dbus_assert (writer->type_str != NULL);
+  _dbus_assert (is_string_variant_entry (writer->type_str, writer->type_pos));
+  _dbus_assert (dbus_type_is_basic (type));
+
+  if (!writer->enabled)
+    return TRUE;
+
+  signature[0] = type;
+  signature[1] = '\0';
+  signature_p = signature;
+
+  old_string_len = _dbus_string_get_length (writer->value_str);
+  pos = writer->value_pos;
+
+  if (!_dbus_string_insert_alignment (writer->value_str, &pos, 8) ||
+      !_dbus_marshal_write_basic (writer->value_str, pos, DBUS_TYPE_STRING,
+                                  &key, writer->byte_order, &pos) ||
+      !_dbus_marshal_write_basic (writer->value_str, pos, DBUS_TYPE_SIGNATURE,
+                                  &signature_p, writer->byte_order, &pos) ||
+      !_dbus_marshal_write_basic (writer->value_str, pos, type,
+                                  value, writer->byte_order, &pos))
+    {
+      _dbus_string_delete (writer->value_str, writer->value_pos,
+                           _dbus_string_get_length (writer->value_str) - old_string_len);
+      return FALSE;
+    }
+
+  writer->value_pos = pos;
+
+#if RECURSIVE_MARSHAL_WRITE_TRACE
+  _dbus_verbose ("  type writer %p variant entry written new value_pos = %d\n",
+                 writer, writer->value_pos);
+#endif
+
+  return TRUE;
+}
+
 static void
 enable_if_after (DBusTypeWriter       *writer,
                  DBusTypeReader       *reader,
@@ -54,6 +54,8 @@ struct DBusTypeReader
   {
     struct {
       int start_pos;                /**< for array readers, the start of the array values */
+      int element_fixed_size;       /**< size of each struct or dict entry element if
+                                     *   they're all the same, or -1 */
     } array;
   } u; /**< class-specific data */
 };
@@ -114,6 +116,16 @@ int         _dbus_type_reader_get_array_length          (const DBusTypeReader  *
 void        _dbus_type_reader_read_fixed_multi          (const DBusTypeReader  *reader,
                                                          void                  *value,
                                                          int                   *n_elements);
+dbus_bool_t _dbus_type_reader_read_fixed_struct_multi   (const DBusTypeReader  *reader,
+                                                         void                  *elements,
+                                                         int                    element_size,
+                                                         int                   *n_elements);
+dbus_bool_t _dbus_type_reader_read_string_multi         (const DBusTypeReader  *reader,
+                                                         const char           **elements,
+                                                         int                   *n_elements);
+dbus_bool_t _dbus_type_reader_find_variant_entry        (const DBusTypeReader  *reader,
+                                                         const char            *key,
+                                                         DBusTypeReader        *value_reader);
 void        _dbus_type_reader_read_raw                  (const DBusTypeReader  *reader,
                                                          const unsigned char  **value_location);
 void        _dbus_type_reader_recurse                   (DBusTypeReader        *reader,
@@ -137,6 +149,8 @@ dbus_bool_t _dbus_type_reader_equal_values              (const DBusTypeReader *l
 
 void        _dbus_type_signature_next                   (const char            *signature,
 							 int                   *type_pos);
+int         _dbus_type_get_fixed_struct_size            (const DBusString      *type_str,
+                                                         int                    type_pos);
 
 void        _dbus_type_writer_init                 (DBusTypeWriter        *writer,
                                                     int                    byte_order,
@@ -165,6 +179,18 @@ dbus_bool_t _dbus_type_writer_write_fixed_multi    (DBusTypeWriter        *write
                                                     int                    element_type,
                                                     const void            *value,
                                                     int                    n_elements);
+dbus_bool_t _dbus_type_writer_reserve_fixed_multi  (DBusTypeWriter        *writer,
+                                                    int                    element_type,
+                                                    int                    n_elements,
+                                                    void                 **data_p);
+dbus_bool_t _dbus_type_writer_write_fixed_struct_multi (DBusTypeWriter        *writer,
+                                                        const void            *elements,
+                                                        int                    element_size,
+                                                        int                    n_elements);
+dbus_bool_t _dbus_type_writer_write_variant_entry  (DBusTypeWriter        *writer,
+                                                    const char            *key,
+                                                    int                    type,
+                                                    const void            *value);
 dbus_bool_t _dbus_type_writer_recurse              (DBusTypeWriter        *writer,
                                                     int                    container_type,
                                                     const DBusString      *contained_type,
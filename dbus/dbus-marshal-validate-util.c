@@ -583,6 +583,194 @@ _dbus_marshal_validate_test (void)
   return TRUE;
 }
 
+/* The benchmark prints one tab-separated line per measurement,
+ *
+ *   BENCH <operation> <input> <bytes> <iterations> <ns per iteration>
+ *
+ * and runs a fixed number of iterations of each, so the output only
+ * changes when the code's speed does.
+ */
+#define BENCHMARK_BYTES_PER_OPERATION (4 * 1024 * 1024)
+
+typedef dbus_bool_t (* BenchmarkValidator) (const DBusString *str,
+                                            int               start,
+                                            int               len);
+
+typedef struct
+{
+  const char         *operation;
+  const char         *input;
+  BenchmarkValidator  validator;
+  const char         *text;
+} BenchmarkName;
+
+static const BenchmarkName benchmark_names[] = {
+  { "validate-path", "short", _dbus_validate_path, "/" },
+  { "validate-path", "long", _dbus_validate_path,
+    "/org/freedesktop/NetworkManager/Devices/Wireless/AccessPoint/42" },
+  { "validate-interface", "short", _dbus_validate_interface, "a.b" },
+  { "validate-interface", "long", _dbus_validate_interface,
+    "org.freedesktop.NetworkManager.Device.Wireless" },
+  { "validate-member", "short", _dbus_validate_member, "Get" },
+  { "validate-member", "long", _dbus_validate_member,
+    "GetConnectionUnixProcessID" },
+  { "validate-bus-name", "unique", _dbus_validate_bus_name, ":1.42" },
+  { "validate-bus-name", "well-known", _dbus_validate_bus_name,
+    "org.freedesktop.NetworkManager" }
+};
+
+static const int benchmark_text_sizes[] = { 16, 256, 4096, 65536 };
+
+static long
+elapsed_usec (long *sec,
+              long *usec)
+{
+  long now_sec, now_usec;
+  long elapsed;
+
+  _dbus_get_current_time (&now_sec, &now_usec);
+  elapsed = (now_sec - *sec) * 1000000 + (now_usec - *usec);
+  *sec = now_sec;
+  *usec = now_usec;
+
+  return elapsed;
+}
+
+/* Enough iterations to push BENCHMARK_BYTES_PER_OPERATION through,
+ * which keeps short names from being lost in timer resolution.
+ */
+static int
+benchmark_iterations (int bytes)
+{
+  return MAX (16, BENCHMARK_BYTES_PER_OPERATION / (bytes + 64));
+}
+
+static void
+benchmark_report (const char *operation,
+                  const char *input,
+                  int         bytes,
+                  int         iterations,
+                  long        usec)
+{
+  printf ("BENCH\t%s\t%s\t%d\t%d\t%ld\n", operation, input, bytes,
+          iterations, (long) ((double) usec * 1000 / iterations));
+}
+
+/* Times validator over the whole of str, failing if it ever rejects it */
+static dbus_bool_t
+benchmark_validator (const char         *operation,
+                     const char         *input,
+                     BenchmarkValidator  validator,
+                     const DBusString   *str)
+{
+  long sec, usec;
+  int len;
+  int iterations;
+  int i;
+
+  len = _dbus_string_get_length (str);
+  iterations = benchmark_iterations (len);
+
+  _dbus_get_current_time (&sec, &usec);
+  for (i = 0; i < iterations; i++)
+    {
+      if (!(* validator) (str, 0, len))
+        {
+          _dbus_warn ("%s rejected the %s input\n", operation, input);
+          return FALSE;
+        }
+    }
+
+  benchmark_report (operation, input, len, iterations,
+                    elapsed_usec (&sec, &usec));
+  return TRUE;
+}
+
+/* Fills str with size bytes of text; if accented, every eighth
+ * character is the two-byte U+00E9 so the UTF-8 validator keeps
+ * leaving its ASCII fast path.
+ */
+static dbus_bool_t
+benchmark_fill_text (DBusString  *str,
+                     int          size,
+                     dbus_bool_t  accented)
+{
+  int i;
+
+  _dbus_string_set_length (str, 0);
+
+  i = 0;
+  while (i < size)
+    {
+      if (accented && (i % 8) == 6 && i + 2 <= size)
+        {
+          if (!_dbus_string_append_byte (str, 0xc3) ||
+              !_dbus_string_append_byte (str, 0xa9))
+            return FALSE;
+          i += 2;
+        }
+      else
+        {
+          if (!_dbus_string_append_byte (str, 'a' + (i % 26)))
+            return FALSE;
+          i += 1;
+        }
+    }
+
+  return TRUE;
+}
+
+/**
+ * Prints how long UTF-8 text and object path, interface, member and
+ * bus name validation take; see the comment above for the format.
+ *
+ * @returns #TRUE unless a validator rejected valid input
+ */
+dbus_bool_t
+_dbus_marshal_validate_benchmark (void)
+{
+  DBusString str;
+  dbus_bool_t retval;
+  int i;
+
+  if (!_dbus_string_init (&str))
+    _dbus_assert_not_reached ("no memory");
+
+  retval = FALSE;
+
+  for (i = 0; i < (int) _DBUS_N_ELEMENTS (benchmark_text_sizes); i++)
+    {
+      if (!benchmark_fill_text (&str, benchmark_text_sizes[i], FALSE))
+        _dbus_assert_not_reached ("no memory");
+      if (!benchmark_validator ("validate-utf8", "ascii",
+                                _dbus_string_validate_utf8, &str))
+        goto out;
+
+      if (!benchmark_fill_text (&str, benchmark_text_sizes[i], TRUE))
+        _dbus_assert_not_reached ("no memory");
+      if (!benchmark_validator ("validate-utf8", "accented",
+                                _dbus_string_validate_utf8, &str))
+        goto out;
+    }
+
+  for (i = 0; i < (int) _DBUS_N_ELEMENTS (benchmark_names); i++)
+    {
+      DBusString name;
+
+      _dbus_string_init_const (&name, benchmark_names[i].text);
+      if (!benchmark_validator (benchmark_names[i].operation,
+                                benchmark_names[i].input,
+                                benchmark_names[i].validator, &name))
+        goto out;
+    }
+
+  retval = TRUE;
+
+ out:
+  _dbus_string_free (&str);
+  return retval;
+}
+
 #endif /* !DOXYGEN_SHOULD_SKIP_THIS */
 
 #endif /* DBUS_BUILD_TESTS */
@@ -60,17 +60,18 @@ _dbus_validate_signature_with_reason (const DBusString *type_str,
   int dict_entry_depth;
   DBusValidity result;
 
-  int element_count;
-  DBusList *element_count_stack;
+  /* Fields seen so far in each struct or dict entry being parsed,
+   * innermost last, after a slot for the top level. The depth limits
+   * are checked before anything is pushed, so this can't overflow,
+   * and signatures get validated for every message received without
+   * allocating anything.
+   */
+  int element_counts[2 * DBUS_MAXIMUM_TYPE_RECURSION_DEPTH + 1];
+  int n_element_counts;
 
   result = DBUS_VALID;
-  element_count_stack = NULL;
-
-  if (!_dbus_list_append (&element_count_stack, _DBUS_INT_TO_POINTER (0)))
-    {
-      result = DBUS_VALIDITY_UNKNOWN_OOM_ERROR;
-      goto out;
-    }
+  element_counts[0] = 0;
+  n_element_counts = 1;
 
   _dbus_assert (type_str != NULL);
   _dbus_assert (type_pos < _DBUS_INT32_MAX - len);
@@ -128,14 +129,9 @@ _dbus_validate_signature_with_reason (const DBusString *type_str,
               result = DBUS_INVALID_EXCEEDED_MAXIMUM_STRUCT_RECURSION;
               goto out;
             }
-          
-          if (!_dbus_list_append (&element_count_stack, 
-                             _DBUS_INT_TO_POINTER (0)))
-            {
-              result = DBUS_VALIDITY_UNKNOWN_OOM_ERROR;
-              goto out;
-            }
 
+          _dbus_assert (n_element_counts < _DBUS_N_ELEMENTS (element_counts));
+          element_counts[n_element_counts++] = 0;
           break;
 
         case DBUS_STRUCT_END_CHAR:
@@ -151,7 +147,7 @@ _dbus_validate_signature_with_reason (const DBusString *type_str,
               goto out;
             }
 
-          _dbus_list_pop_last (&element_count_stack);
+          n_element_counts -= 1;
 
           struct_depth -= 1;
           break;
@@ -171,13 +167,8 @@ _dbus_validate_signature_with_reason (const DBusString *type_str,
               goto out;
             }
 
-          if (!_dbus_list_append (&element_count_stack, 
-                             _DBUS_INT_TO_POINTER (0)))
-            {
-              result = DBUS_VALIDITY_UNKNOWN_OOM_ERROR;
-              goto out;
-            }
-
+          _dbus_assert (n_element_counts < _DBUS_N_ELEMENTS (element_counts));
+          element_counts[n_element_counts++] = 0;
           break;
 
         case DBUS_DICT_ENTRY_END_CHAR:
@@ -189,14 +180,13 @@ _dbus_validate_signature_with_reason (const DBusString *type_str,
             
           dict_entry_depth -= 1;
 
-          element_count = 
-            _DBUS_POINTER_TO_INT (_dbus_list_pop_last (&element_count_stack));
+          n_element_counts -= 1;
 
-          if (element_count != 2)
+          if (element_counts[n_element_counts] != 2)
             {
-              if (element_count == 0)
+              if (element_counts[n_element_counts] == 0)
                 result = DBUS_INVALID_DICT_ENTRY_HAS_NO_FIELDS;
-              else if (element_count == 1)
+              else if (element_counts[n_element_counts] == 1)
                 result = DBUS_INVALID_DICT_ENTRY_HAS_ONLY_ONE_FIELD;
               else
                 result = DBUS_INVALID_DICT_ENTRY_HAS_TOO_MANY_FIELDS;
@@ -216,17 +206,8 @@ _dbus_validate_signature_with_reason (const DBusString *type_str,
           *p != DBUS_DICT_ENTRY_BEGIN_CHAR && 
 	  *p != DBUS_STRUCT_BEGIN_CHAR) 
         {
-          element_count = 
-            _DBUS_POINTER_TO_INT (_dbus_list_pop_last (&element_count_stack));
-
-          ++element_count;
-
-          if (!_dbus_list_append (&element_count_stack, 
-                             _DBUS_INT_TO_POINTER (element_count)))
-            {
-              result = DBUS_VALIDITY_UNKNOWN_OOM_ERROR;
-              goto out;
-            }
+          _dbus_assert (n_element_counts > 0);
+          element_counts[n_element_counts - 1] += 1;
         }
       
       if (array_depth > 0)
@@ -287,7 +268,6 @@ _dbus_validate_signature_with_reason (const DBusString *type_str,
   result = DBUS_VALID;
 
 out:
-  _dbus_list_clear (&element_count_stack);
   return result;
 }
 
@@ -746,24 +726,46 @@ _dbus_validate_body_with_reason (const DBusString *expected_signature,
     }
 }
 
+/** Character may start a name */
+#define NAME_CLASS_INITIAL          0x01
+/** Character may appear after the start of a name */
+#define NAME_CLASS_LATER            0x02
+/** Character may start a bus name */
+#define NAME_CLASS_BUS_INITIAL      0x04
+/** Character may appear after the start of a bus name */
+#define NAME_CLASS_BUS_LATER        0x08
+
+/**
+ * Which kinds of name each byte can appear in. Looking this up is
+ * cheaper than the chain of range comparisons it replaces, and names
+ * get validated for every message we receive.
+ */
+static const unsigned char name_char_classes[256] = {
+  /* 0x00 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  /* 0x10 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  /* 0x20 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xc, 0, 0,
+  /* 0x30 */ 0xa, 0xa, 0xa, 0xa, 0xa, 0xa, 0xa, 0xa, 0xa, 0xa, 0, 0, 0, 0, 0, 0,
+  /* 0x40 */ 0, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf,
+  /* 0x50 */ 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0, 0, 0, 0, 0xf,
+  /* 0x60 */ 0, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf,
+  /* 0x70 */ 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0xf, 0, 0, 0, 0, 0
+  /* 0x80 - 0xff are all 0 */
+};
+
+#define NAME_CHARACTER_IS(c, class) \
+  ((name_char_classes[(unsigned char) (c)] & (class)) != 0)
+
 /**
  * Determine wether the given character is valid as the first character
  * in a name.
  */
-#define VALID_INITIAL_NAME_CHARACTER(c)         \
-  ( ((c) >= 'A' && (c) <= 'Z') ||               \
-    ((c) >= 'a' && (c) <= 'z') ||               \
-    ((c) == '_') )
+#define VALID_INITIAL_NAME_CHARACTER(c) NAME_CHARACTER_IS (c, NAME_CLASS_INITIAL)
 
 /**
  * Determine wether the given character is valid as a second or later
  * character in a name
  */
-#define VALID_NAME_CHARACTER(c)                 \
-  ( ((c) >= '0' && (c) <= '9') ||               \
-    ((c) >= 'A' && (c) <= 'Z') ||               \
-    ((c) >= 'a' && (c) <= 'z') ||               \
-    ((c) == '_') )
+#define VALID_NAME_CHARACTER(c) NAME_CHARACTER_IS (c, NAME_CLASS_LATER)
 
 /**
  * Checks that the given range of the string is a valid object path
@@ -1067,20 +1069,13 @@ _dbus_validate_error_name (const DBusString  *str,
  * Determine wether the given character is valid as the first character
  * in a bus name.
  */
-#define VALID_INITIAL_BUS_NAME_CHARACTER(c)         \
-  ( ((c) >= 'A' && (c) <= 'Z') ||               \
-    ((c) >= 'a' && (c) <= 'z') ||               \
-    ((c) == '_') || ((c) == '-'))
+#define VALID_INITIAL_BUS_NAME_CHARACTER(c) NAME_CHARACTER_IS (c, NAME_CLASS_BUS_INITIAL)
 
 /**
  * Determine wether the given character is valid as a second or later
  * character in a bus name
  */
-#define VALID_BUS_NAME_CHARACTER(c)                 \
-  ( ((c) >= '0' && (c) <= '9') ||               \
-    ((c) >= 'A' && (c) <= 'Z') ||               \
-    ((c) >= 'a' && (c) <= 'z') ||               \
-    ((c) == '_') || ((c) == '-'))
+#define VALID_BUS_NAME_CHARACTER(c) NAME_CHARACTER_IS (c, NAME_CLASS_BUS_LATER)
 
 /**
  * Checks that the given range of the string is a valid bus name in
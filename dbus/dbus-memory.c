@@ -27,6 +27,7 @@
 #include "dbus-sysdeps.h"
 #include "dbus-list.h"
 #include <stdlib.h>
+#include <string.h>
 
 /**
  * @defgroup DBusMemory Memory Allocation
@@ -96,6 +97,48 @@
  * @{
  */
 
+static void*
+system_malloc0 (size_t bytes)
+{
+  return calloc (bytes, 1);
+}
+
+/* Where memory comes from, see dbus_set_memory_functions() */
+static DBusMemoryFunctions mem_functions = {
+  malloc,
+  system_malloc0,
+  realloc,
+  free,
+  NULL,
+  NULL
+};
+
+/* For allocators without a malloc0_function of their own */
+static void*
+malloc_and_clear (size_t bytes)
+{
+  void *mem;
+
+  mem = mem_functions.malloc_function (bytes);
+  if (mem != NULL)
+    memset (mem, 0, bytes);
+
+  return mem;
+}
+
+static void
+install_memory_functions (const DBusMemoryFunctions *functions)
+{
+  mem_functions.malloc_function = functions->malloc_function;
+  mem_functions.realloc_function = functions->realloc_function;
+  mem_functions.free_function = functions->free_function;
+
+  if (functions->malloc0_function != NULL)
+    mem_functions.malloc0_function = functions->malloc0_function;
+  else
+    mem_functions.malloc0_function = malloc_and_clear;
+}
+
 #ifdef DBUS_BUILD_TESTS
 static dbus_bool_t debug_initialized = FALSE;
 static int fail_nth = -1;
@@ -427,29 +470,11 @@ set_guards (void       *real_block,
 
 #endif
 
-/** @} */ /* End of internals docs */
-
+static void free_block (void *memory);
 
-/**
- * @addtogroup DBusMemory
- *
- * @{
- */
-
-/**
- * Allocates the given number of bytes, as with standard
- * malloc(). Guaranteed to return #NULL if bytes is zero
- * on all platforms. Returns #NULL if the allocation fails.
- * The memory must be released with dbus_free().
- *
- * dbus_malloc() memory is NOT safe to free with regular free() from
- * the C library. Free it with dbus_free() only.
- *
- * @param bytes number of bytes to allocate
- * @return allocated memory, or #NULL if the allocation fails.
- */
-void*
-dbus_malloc (size_t bytes)
+/* dbus_malloc() without profiling */
+static void*
+malloc_block (size_t bytes)
 {
 #ifdef DBUS_BUILD_TESTS
   _dbus_initialize_malloc_debug ();
@@ -470,7 +495,7 @@ dbus_malloc (size_t bytes)
     {
       void *block;
 
-      block = malloc (bytes + GUARD_EXTRA_SIZE);
+      block = mem_functions.malloc_function (bytes + GUARD_EXTRA_SIZE);
       if (block)
 	_dbus_atomic_inc (&n_blocks_outstanding);
       
@@ -480,7 +505,7 @@ dbus_malloc (size_t bytes)
   else
     {
       void *mem;
-      mem = malloc (bytes);
+      mem = mem_functions.malloc_function (bytes);
 #ifdef DBUS_BUILD_TESTS
       if (mem)
 	_dbus_atomic_inc (&n_blocks_outstanding);
@@ -489,20 +514,9 @@ dbus_malloc (size_t bytes)
     }
 }
 
-/**
- * Allocates the given number of bytes, as with standard malloc(), but
- * all bytes are initialized to zero as with calloc(). Guaranteed to
- * return #NULL if bytes is zero on all platforms. Returns #NULL if the
- * allocation fails.  The memory must be released with dbus_free().
- *
- * dbus_malloc0() memory is NOT safe to free with regular free() from
- * the C library. Free it with dbus_free() only.
- *
- * @param bytes number of bytes to allocate
- * @return allocated memory, or #NULL if the allocation fails.
- */
-void*
-dbus_malloc0 (size_t bytes)
+/* dbus_malloc0() without profiling */
+static void*
+malloc0_block (size_t bytes)
 {
 #ifdef DBUS_BUILD_TESTS
   _dbus_initialize_malloc_debug ();
@@ -524,7 +538,7 @@ dbus_malloc0 (size_t bytes)
     {
       void *block;
 
-      block = calloc (bytes + GUARD_EXTRA_SIZE, 1);
+      block = mem_functions.malloc0_function (bytes + GUARD_EXTRA_SIZE);
       if (block)
 	_dbus_atomic_inc (&n_blocks_outstanding);
       return set_guards (block, bytes, SOURCE_MALLOC_ZERO);
@@ -533,7 +547,7 @@ dbus_malloc0 (size_t bytes)
   else
     {
       void *mem;
-      mem = calloc (bytes, 1);
+      mem = mem_functions.malloc0_function (bytes);
 #ifdef DBUS_BUILD_TESTS
       if (mem)
 	_dbus_atomic_inc (&n_blocks_outstanding);
@@ -542,19 +556,10 @@ dbus_malloc0 (size_t bytes)
     }
 }
 
-/**
- * Resizes a block of memory previously allocated by dbus_malloc() or
- * dbus_malloc0(). Guaranteed to free the memory and return #NULL if bytes
- * is zero on all platforms. Returns #NULL if the resize fails.
- * If the resize fails, the memory is not freed.
- *
- * @param memory block to be resized
- * @param bytes new size of the memory block
- * @return allocated memory, or #NULL if the resize fails.
- */
-void*
-dbus_realloc (void  *memory,
-              size_t bytes)
+/* dbus_realloc() without profiling */
+static void*
+realloc_block (void  *memory,
+               size_t bytes)
 {
 #ifdef DBUS_BUILD_TESTS
   _dbus_initialize_malloc_debug ();
@@ -569,7 +574,7 @@ dbus_realloc (void  *memory,
   
   if (bytes == 0) /* guarantee this is safe */
     {
-      dbus_free (memory);
+      free_block (memory);
       return NULL;
     }
 #ifdef DBUS_BUILD_TESTS
@@ -584,8 +589,8 @@ dbus_realloc (void  *memory,
           
           check_guards (memory, FALSE);
           
-          block = realloc (((unsigned char*)memory) - GUARD_START_OFFSET,
-                           bytes + GUARD_EXTRA_SIZE);
+          block = mem_functions.realloc_function (((unsigned char*)memory) - GUARD_START_OFFSET,
+                                                  bytes + GUARD_EXTRA_SIZE);
 
 	  old_bytes = *(dbus_uint32_t*)block;
           if (block && bytes >= old_bytes)
@@ -598,7 +603,7 @@ dbus_realloc (void  *memory,
         {
           void *block;
           
-          block = malloc (bytes + GUARD_EXTRA_SIZE);
+          block = mem_functions.malloc_function (bytes + GUARD_EXTRA_SIZE);
 
           if (block)
 	    _dbus_atomic_inc (&n_blocks_outstanding);
@@ -610,7 +615,7 @@ dbus_realloc (void  *memory,
   else
     {
       void *mem;
-      mem = realloc (memory, bytes);
+      mem = mem_functions.realloc_function (memory, bytes);
 #ifdef DBUS_BUILD_TESTS
       if (memory == NULL && mem != NULL)
 	    _dbus_atomic_inc (&n_blocks_outstanding);
@@ -619,14 +624,9 @@ dbus_realloc (void  *memory,
     }
 }
 
-/**
- * Frees a block of memory previously allocated by dbus_malloc() or
- * dbus_malloc0(). If passed #NULL, does nothing.
- * 
- * @param memory block to be freed
- */
-void
-dbus_free (void  *memory)
+/* dbus_free() without profiling */
+static void
+free_block (void  *memory)
 {
 #ifdef DBUS_BUILD_TESTS
   if (guards)
@@ -638,7 +638,7 @@ dbus_free (void  *memory)
           
 	  _dbus_assert (n_blocks_outstanding.value >= 0);
           
-          free (((unsigned char*)memory) - GUARD_START_OFFSET);
+          mem_functions.free_function (((unsigned char*)memory) - GUARD_START_OFFSET);
         }
       
       return;
@@ -653,10 +653,316 @@ dbus_free (void  *memory)
       _dbus_assert (n_blocks_outstanding.value >= 0);
 #endif
 
-      free (memory);
+      mem_functions.free_function (memory);
     }
 }
 
+/* Allocation profiling puts a header in front of each block to say
+ * how big it is and which subsystem it belongs to, so that dbus_free()
+ * can take it off the counts.  Blocks with and without a header can't
+ * be told apart, so whether to profile is decided once, at the first
+ * allocation, and not changed afterwards.
+ */
+
+/** room for a ProfileHeader, keeping blocks as aligned as malloc() made them */
+#define PROFILE_HEADER_SIZE 16
+
+typedef struct
+{
+  size_t bytes;                 /**< size the caller asked for */
+  DBusAllocSubsystem subsystem; /**< subsystem the block is counted against */
+} ProfileHeader;
+
+typedef struct
+{
+  DBusAtomic n_allocations;     /**< allocations and resizes so far */
+  DBusAtomic n_blocks;          /**< blocks not yet freed */
+  DBusAtomic n_bytes;           /**< bytes in blocks not yet freed */
+} AllocCounts;
+
+static int profile_mode = -1;
+static AllocCounts alloc_counts[DBUS_N_ALLOC_SUBSYSTEMS];
+
+static dbus_bool_t
+profiling_enabled (void)
+{
+  /* Threads racing through here all read the same environment, so
+   * checking it needs no lock
+   */
+  if (_DBUS_UNLIKELY (profile_mode < 0))
+    profile_mode = _dbus_getenv ("DBUS_MALLOC_PROFILE") != NULL;
+
+  return profile_mode;
+}
+
+static void*
+profile_block (void               *block,
+               size_t              bytes,
+               DBusAllocSubsystem  subsystem)
+{
+  ProfileHeader *header;
+
+  if (block == NULL)
+    return NULL;
+
+  header = block;
+  header->bytes = bytes;
+  header->subsystem = subsystem;
+
+  _dbus_atomic_inc (&alloc_counts[subsystem].n_allocations);
+  _dbus_atomic_inc (&alloc_counts[subsystem].n_blocks);
+  _dbus_atomic_add (&alloc_counts[subsystem].n_bytes, bytes);
+
+  return ((unsigned char*) block) + PROFILE_HEADER_SIZE;
+}
+
+static ProfileHeader*
+get_profile_header (void *memory)
+{
+  return (ProfileHeader*) (((unsigned char*) memory) - PROFILE_HEADER_SIZE);
+}
+
+/**
+ * Does the work of dbus_malloc(), counting the block against the given
+ * subsystem if allocations are being profiled.  Internal code reaches
+ * this through the dbus_malloc() macro in dbus-internals.h.
+ *
+ * @param bytes number of bytes to allocate
+ * @param subsystem the subsystem the allocation is made for
+ * @return allocated memory, or #NULL if the allocation fails.
+ */
+void*
+_dbus_malloc_in (size_t              bytes,
+                 DBusAllocSubsystem  subsystem)
+{
+  if (!profiling_enabled () || bytes == 0)
+    return malloc_block (bytes);
+
+  return profile_block (malloc_block (bytes + PROFILE_HEADER_SIZE),
+                        bytes, subsystem);
+}
+
+/**
+ * Does the work of dbus_malloc0(), counting the block against the
+ * given subsystem if allocations are being profiled.
+ *
+ * @param bytes number of bytes to allocate
+ * @param subsystem the subsystem the allocation is made for
+ * @return allocated memory, or #NULL if the allocation fails.
+ */
+void*
+_dbus_malloc0_in (size_t              bytes,
+                  DBusAllocSubsystem  subsystem)
+{
+  if (!profiling_enabled () || bytes == 0)
+    return malloc0_block (bytes);
+
+  return profile_block (malloc0_block (bytes + PROFILE_HEADER_SIZE),
+                        bytes, subsystem);
+}
+
+/**
+ * Does the work of dbus_realloc().  A resized block stays counted
+ * against the subsystem it was first allocated for.
+ *
+ * @param memory block to be resized
+ * @param bytes new size of the memory block
+ * @param subsystem the subsystem a new block is allocated for
+ * @return allocated memory, or #NULL if the resize fails.
+ */
+void*
+_dbus_realloc_in (void               *memory,
+                  size_t              bytes,
+                  DBusAllocSubsystem  subsystem)
+{
+  ProfileHeader *header;
+  size_t old_bytes;
+
+  if (!profiling_enabled ())
+    return realloc_block (memory, bytes);
+
+  if (memory == NULL)
+    return _dbus_malloc_in (bytes, subsystem);
+
+  if (bytes == 0)
+    {
+      dbus_free (memory);
+      return NULL;
+    }
+
+  header = realloc_block (get_profile_header (memory),
+                          bytes + PROFILE_HEADER_SIZE);
+  if (header == NULL)
+    return NULL;
+
+  old_bytes = header->bytes;
+  header->bytes = bytes;
+
+  _dbus_atomic_inc (&alloc_counts[header->subsystem].n_allocations);
+  _dbus_atomic_add (&alloc_counts[header->subsystem].n_bytes,
+                    (dbus_int32_t) bytes - (dbus_int32_t) old_bytes);
+
+  return ((unsigned char*) header) + PROFILE_HEADER_SIZE;
+}
+
+/**
+ * Gets the allocation counts for one subsystem.  The counts are 32
+ * bits and the number of allocations wraps around on a busy process.
+ *
+ * @param subsystem the subsystem
+ * @param n_allocations return location for the number of allocations
+ *  and resizes made so far
+ * @param n_blocks return location for the number of blocks not yet freed
+ * @param n_bytes return location for the bytes in those blocks
+ * @returns #FALSE if allocations aren't being profiled
+ */
+dbus_bool_t
+_dbus_get_alloc_profile (DBusAllocSubsystem  subsystem,
+                         dbus_uint32_t      *n_allocations,
+                         dbus_uint32_t      *n_blocks,
+                         dbus_uint32_t      *n_bytes)
+{
+  _dbus_assert (subsystem < DBUS_N_ALLOC_SUBSYSTEMS);
+
+  if (!profiling_enabled ())
+    return FALSE;
+
+  *n_allocations = _dbus_atomic_get (&alloc_counts[subsystem].n_allocations);
+  *n_blocks = _dbus_atomic_get (&alloc_counts[subsystem].n_blocks);
+  *n_bytes = _dbus_atomic_get (&alloc_counts[subsystem].n_bytes);
+
+  return TRUE;
+}
+
+/** @} */ /* End of internals docs */
+
+
+/**
+ * @addtogroup DBusMemory
+ *
+ * @{
+ */
+
+/* The macros internal code uses to reach _dbus_malloc_in() and friends */
+#undef dbus_malloc
+#undef dbus_malloc0
+#undef dbus_realloc
+
+/**
+ * Allocates the given number of bytes, as with standard
+ * malloc(). Guaranteed to return #NULL if bytes is zero
+ * on all platforms. Returns #NULL if the allocation fails.
+ * The memory must be released with dbus_free().
+ *
+ * dbus_malloc() memory is NOT safe to free with regular free() from
+ * the C library. Free it with dbus_free() only.
+ *
+ * @param bytes number of bytes to allocate
+ * @return allocated memory, or #NULL if the allocation fails.
+ */
+void*
+dbus_malloc (size_t bytes)
+{
+  return _dbus_malloc_in (bytes, DBUS_ALLOC_SUBSYSTEM_OTHER);
+}
+
+/**
+ * Allocates the given number of bytes, as with standard malloc(), but
+ * all bytes are initialized to zero as with calloc(). Guaranteed to
+ * return #NULL if bytes is zero on all platforms. Returns #NULL if the
+ * allocation fails.  The memory must be released with dbus_free().
+ *
+ * dbus_malloc0() memory is NOT safe to free with regular free() from
+ * the C library. Free it with dbus_free() only.
+ *
+ * @param bytes number of bytes to allocate
+ * @return allocated memory, or #NULL if the allocation fails.
+ */
+void*
+dbus_malloc0 (size_t bytes)
+{
+  return _dbus_malloc0_in (bytes, DBUS_ALLOC_SUBSYSTEM_OTHER);
+}
+
+/**
+ * Resizes a block of memory previously allocated by dbus_malloc() or
+ * dbus_malloc0(). Guaranteed to free the memory and return #NULL if bytes
+ * is zero on all platforms. Returns #NULL if the resize fails.
+ * If the resize fails, the memory is not freed.
+ *
+ * @param memory block to be resized
+ * @param bytes new size of the memory block
+ * @return allocated memory, or #NULL if the resize fails.
+ */
+void*
+dbus_realloc (void  *memory,
+              size_t bytes)
+{
+  return _dbus_realloc_in (memory, bytes, DBUS_ALLOC_SUBSYSTEM_OTHER);
+}
+
+/**
+ * Frees a block of memory previously allocated by dbus_malloc() or
+ * dbus_malloc0(). If passed #NULL, does nothing.
+ * 
+ * @param memory block to be freed
+ */
+void
+dbus_free (void  *memory)
+{
+  if (memory != NULL && profiling_enabled ())
+    {
+      ProfileHeader *header;
+
+      header = get_profile_header (memory);
+      _dbus_atomic_dec (&alloc_counts[header->subsystem].n_blocks);
+      _dbus_atomic_add (&alloc_counts[header->subsystem].n_bytes,
+                        - (dbus_int32_t) header->bytes);
+      memory = header;
+    }
+
+  free_block (memory);
+}
+
+/**
+ * Makes libdbus get its memory from the given functions instead of
+ * malloc(), realloc() and free() from the C library, for example to
+ * keep it in a jemalloc or tcmalloc arena of its own.  The functions
+ * must be safe to call from any thread libdbus is used in.
+ *
+ * This must be called before anything else in libdbus, since memory
+ * can only be given back to the allocator it came from.  Once
+ * libdbus has allocated anything it fails and leaves the functions
+ * alone; in particular, dbus_shutdown() does not make it possible
+ * again.
+ *
+ * Sizes are passed to the functions as libdbus asks for them.
+ * libdbus doesn't remember how big each block is, so free_function
+ * gets no size.
+ *
+ * @param functions the functions to use; copied, so they need not
+ *  outlive the call
+ * @returns #FALSE if libdbus has already allocated memory
+ */
+dbus_bool_t
+dbus_set_memory_functions (const DBusMemoryFunctions *functions)
+{
+  _dbus_return_val_if_fail (functions != NULL, FALSE);
+  _dbus_return_val_if_fail (functions->malloc_function != NULL, FALSE);
+  _dbus_return_val_if_fail (functions->realloc_function != NULL, FALSE);
+  _dbus_return_val_if_fail (functions->free_function != NULL, FALSE);
+
+  /* Whether to profile is decided at the first allocation, so this
+   * is also how we know none has happened yet
+   */
+  if (profile_mode >= 0)
+    return FALSE;
+
+  install_memory_functions (functions);
+
+  return TRUE;
+}
+
 /**
  * Frees a #NULL-terminated array of strings.
  * If passed #NULL, does nothing.
@@ -817,6 +1123,101 @@ dbus_shutdown (void)
 #ifdef DBUS_BUILD_TESTS
 #include "dbus-test.h"
 
+static int n_test_mallocs = 0;
+static int n_test_reallocs = 0;
+static int n_test_frees = 0;
+
+static void*
+counting_malloc (size_t bytes)
+{
+  n_test_mallocs += 1;
+  return malloc (bytes);
+}
+
+static void*
+counting_realloc (void  *memory,
+                  size_t bytes)
+{
+  n_test_reallocs += 1;
+  return realloc (memory, bytes);
+}
+
+static void
+counting_free (void *memory)
+{
+  n_test_frees += 1;
+  free (memory);
+}
+
+/* Checks allocations go through the functions the application
+ * supplied, and stop doing so once the old ones are put back
+ */
+static void
+check_memory_functions (void)
+{
+  DBusMemoryFunctions saved;
+  DBusMemoryFunctions counting;
+  unsigned char *p;
+  int i;
+
+  saved = mem_functions;
+
+  _DBUS_ZERO (counting);
+  counting.malloc_function = counting_malloc;
+  counting.realloc_function = counting_realloc;
+  counting.free_function = counting_free;
+
+  /* too late, something has been allocated */
+  dbus_free (dbus_malloc (1));
+  if (dbus_set_memory_functions (&counting))
+    _dbus_assert_not_reached ("memory functions replaced after allocating");
+  _dbus_assert (mem_functions.malloc_function == saved.malloc_function);
+  _dbus_assert (mem_functions.free_function == saved.free_function);
+
+  /* The counting functions hand out blocks from the C library just
+   * as the defaults do, so swapping them in now is safe
+   */
+  n_test_mallocs = n_test_reallocs = n_test_frees = 0;
+  install_memory_functions (&counting);
+
+  p = dbus_malloc (8);
+  if (p == NULL)
+    _dbus_assert_not_reached ("no memory");
+  _dbus_assert (n_test_mallocs == 1);
+
+  p = dbus_realloc (p, 16);
+  if (p == NULL)
+    _dbus_assert_not_reached ("no memory");
+  _dbus_assert (n_test_reallocs == 1);
+
+  dbus_free (p);
+  _dbus_assert (n_test_frees == 1);
+
+  /* without a malloc0_function, malloc_function is used and cleared */
+  p = dbus_malloc0 (8);
+  if (p == NULL)
+    _dbus_assert_not_reached ("no memory");
+  _dbus_assert (n_test_mallocs == 2);
+  for (i = 0; i < 8; i++)
+    _dbus_assert (p[i] == 0);
+
+  dbus_free (p);
+  _dbus_assert (n_test_frees == 2);
+
+  install_memory_functions (&saved);
+  _dbus_assert (mem_functions.malloc_function == saved.malloc_function);
+  _dbus_assert (mem_functions.malloc0_function == saved.malloc0_function);
+  _dbus_assert (mem_functions.realloc_function == saved.realloc_function);
+  _dbus_assert (mem_functions.free_function == saved.free_function);
+
+  p = dbus_malloc (8);
+  if (p == NULL)
+    _dbus_assert_not_reached ("no memory");
+  dbus_free (p);
+  _dbus_assert (n_test_mallocs == 2);
+  _dbus_assert (n_test_frees == 2);
+}
+
 /**
  * @ingroup DBusMemoryInternals
  * Unit test for DBusMemory
@@ -848,6 +1249,9 @@ _dbus_memory_test (void)
     }
   dbus_free (p);
   guards = old_guards;
+
+  check_memory_functions ();
+
   return TRUE;
 }
 
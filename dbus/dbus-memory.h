@@ -28,6 +28,7 @@
 #define DBUS_MEMORY_H
 
 #include <dbus/dbus-macros.h>
+#include <dbus/dbus-types.h>
 #include <stddef.h>
 
 DBUS_BEGIN_DECLS
@@ -55,6 +56,23 @@ void dbus_free_string_array (char **str_array);
 
 typedef void (* DBusFreeFunction) (void *memory);
 
+/**
+ * Functions libdbus gets its memory from, see dbus_set_memory_functions().
+ */
+typedef struct
+{
+  void* (* malloc_function)  (size_t  bytes);  /**< like malloc() */
+  void* (* malloc0_function) (size_t  bytes);  /**< returns zeroed memory, or #NULL to use malloc_function and clear it */
+  void* (* realloc_function) (void   *memory,
+                              size_t  bytes);  /**< like realloc() */
+  void  (* free_function)    (void   *memory); /**< like free() */
+  void (* padding1) (void); /**< Reserved for future expansion */
+  void (* padding2) (void); /**< Reserved for future expansion */
+} DBusMemoryFunctions;
+
+DBUS_EXPORT
+dbus_bool_t dbus_set_memory_functions (const DBusMemoryFunctions *functions);
+
 DBUS_EXPORT
 void dbus_shutdown (void);
 
@@ -68,6 +68,13 @@ struct DBusFreedElement
  */
 #define ELEMENT_PADDING 4
 
+/**
+ * Blocks stop doubling in size once they reach this many bytes, so
+ * that a pool which grew large can still find whole blocks to give
+ * back in _dbus_mem_pool_trim().
+ */
+#define MAX_BLOCK_SIZE (64 * 1024)
+
 /**
  * Typedef for DBusMemBlock so the struct can recursively
  * point to itself.
@@ -98,11 +105,14 @@ struct DBusMemPool
 {
   int element_size;                /**< size of a single object in the pool */
   int block_size;                  /**< size of most recently allocated block */
-  unsigned int zero_elements : 1;  /**< whether to zero-init allocated elements */
+  unsigned int zero_elements : 1;  /**< whether to zero-init allocated elements;
+                                    *   done as each element is handed out, so
+                                    *   blocks aren't cleared up front */
 
   DBusFreedElement *free_elements; /**< a free list of elements to recycle */
   DBusMemBlock *blocks;            /**< blocks of memory from malloc() */
   int allocated_elements;          /**< Count of outstanding allocated elements */
+  DBusAllocSubsystem subsystem;    /**< Subsystem the blocks are profiled against */
 };
 
 /** @} */
@@ -129,13 +139,18 @@ struct DBusMemPool
  * least 8 bytes on all platforms, unless you are 4 bytes on 32-bit
  * and 8 bytes on 64-bit.
  *
+ * Called through the _dbus_mem_pool_new() macro, which passes the
+ * allocation profiling subsystem of the file creating the pool.
+ *
  * @param element_size size of an element allocated from the pool.
  * @param zero_elements whether to zero-initialize elements
+ * @param subsystem subsystem the pool's blocks are profiled against
  * @returns the new pool or #NULL
  */
 DBusMemPool*
-_dbus_mem_pool_new (int element_size,
-                    dbus_bool_t zero_elements)
+_dbus_mem_pool_new_in (int                 element_size,
+                       dbus_bool_t         zero_elements,
+                       DBusAllocSubsystem  subsystem)
 {
   DBusMemPool *pool;
 
@@ -160,6 +175,8 @@ _dbus_mem_pool_new (int element_size,
 
   pool->zero_elements = zero_elements != FALSE;
 
+  pool->subsystem = subsystem;
+
   pool->allocated_elements = 0;
   
   /* pick a size for the first block; it increases
@@ -225,9 +242,9 @@ _dbus_mem_pool_alloc (DBusMemPool *pool)
         pool->element_size;
       
       if (pool->zero_elements)
-        block = dbus_malloc0 (alloc_size);
+        block = _dbus_malloc0_in (alloc_size, pool->subsystem);
       else
-        block = dbus_malloc (alloc_size);
+        block = _dbus_malloc_in (alloc_size, pool->subsystem);
 
       if (block != NULL)
         {
@@ -275,7 +292,7 @@ _dbus_mem_pool_alloc (DBusMemPool *pool)
               int saved_counter;
 #endif
           
-              if (pool->block_size <= _DBUS_INT_MAX / 4) /* avoid overflow */
+              if (pool->block_size <= MAX_BLOCK_SIZE / 2)
                 {
                   /* use a larger block size for our next block */
                   pool->block_size *= 2;
@@ -296,10 +313,7 @@ _dbus_mem_pool_alloc (DBusMemPool *pool)
               _dbus_set_fail_alloc_counter (_DBUS_INT_MAX);
 #endif
           
-              if (pool->zero_elements)
-                block = dbus_malloc0 (alloc_size);
-              else
-                block = dbus_malloc (alloc_size);
+              block = _dbus_malloc_in (alloc_size, pool->subsystem);
 
 #ifdef DBUS_BUILD_TESTS
               _dbus_set_fail_alloc_counter (saved_counter);
@@ -318,6 +332,9 @@ _dbus_mem_pool_alloc (DBusMemPool *pool)
           
           pool->blocks->used_so_far += pool->element_size;
 
+          if (pool->zero_elements)
+            memset (element, '\0', pool->element_size);
+
           pool->allocated_elements += 1;
           
           return element;
@@ -390,6 +407,137 @@ _dbus_mem_pool_dealloc (DBusMemPool *pool,
     }
 }
 
+/* Finds the block holding element, in blocks sorted by address */
+static int
+find_block (DBusMemBlock **blocks,
+            int            n_blocks,
+            const void    *element)
+{
+  int low, high;
+
+  low = 0;
+  high = n_blocks - 1;
+  while (low < high)
+    {
+      int mid = (low + high + 1) / 2;
+
+      if ((const unsigned char *) blocks[mid] <= (const unsigned char *) element)
+        low = mid;
+      else
+        high = mid - 1;
+    }
+
+  _dbus_assert ((const unsigned char *) element >= blocks[low]->elements);
+  _dbus_assert ((const unsigned char *) element <
+                blocks[low]->elements + blocks[low]->used_so_far);
+
+  return low;
+}
+
+/**
+ * Gives back to the allocator every block of the pool that has no
+ * allocated elements left. Freed elements are otherwise only ever
+ * recycled, so without this a pool stays at its largest size until
+ * the pool itself is freed. Meant for when memory is short or a
+ * burst of use is over, since it goes through the whole free list.
+ *
+ * Does nothing if there isn't the memory to sort out which blocks
+ * are unused.
+ *
+ * @param pool the memory pool
+ */
+void
+_dbus_mem_pool_trim (DBusMemPool *pool)
+{
+  DBusMemBlock **blocks;
+  DBusMemBlock *block;
+  DBusMemBlock **block_p;
+  DBusFreedElement **element_p;
+  int *n_free;
+  int n_blocks;
+  int i;
+
+#ifdef DBUS_BUILD_TESTS
+  /* each element is its own block, already freed with it */
+  if (_dbus_disable_mem_pools ())
+    return;
+#endif
+
+  if (pool->free_elements == NULL)
+    return;
+
+  n_blocks = 0;
+  for (block = pool->blocks; block != NULL; block = block->next)
+    n_blocks += 1;
+
+  blocks = dbus_new (DBusMemBlock *, n_blocks);
+  n_free = dbus_new0 (int, n_blocks);
+  if (blocks == NULL || n_free == NULL)
+    goto out;
+
+  /* Insertion sort by address; capping the block size keeps the
+   * number of blocks modest compared to the free list walked below.
+   */
+  i = 0;
+  for (block = pool->blocks; block != NULL; block = block->next)
+    {
+      int j;
+
+      for (j = i; j > 0 && blocks[j - 1] > block; j--)
+        blocks[j] = blocks[j - 1];
+      blocks[j] = block;
+      i += 1;
+    }
+
+  for (element_p = &pool->free_elements;
+       *element_p != NULL;
+       element_p = &(*element_p)->next)
+    n_free[find_block (blocks, n_blocks, *element_p)] += 1;
+
+  /* n_free now counts elements for the blocks that are wholly free */
+  for (i = 0; i < n_blocks; i++)
+    {
+      if (n_free[i] * pool->element_size != blocks[i]->used_so_far)
+        n_free[i] = 0;
+    }
+
+  /* The newest block is the one still being carved up, and the
+   * blocks behind it are full but may be smaller than block_size,
+   * so it stays to keep _dbus_mem_pool_alloc() from misreading one
+   * of those as having room.
+   */
+  n_free[find_block (blocks, n_blocks, pool->blocks->elements)] = 0;
+
+  element_p = &pool->free_elements;
+  while (*element_p != NULL)
+    {
+      if (n_free[find_block (blocks, n_blocks, *element_p)] > 0)
+        *element_p = (*element_p)->next;
+      else
+        element_p = &(*element_p)->next;
+    }
+
+  block_p = &pool->blocks;
+  while (*block_p != NULL)
+    {
+      block = *block_p;
+
+      if (n_free[find_block (blocks, n_blocks, block->elements)] > 0)
+        {
+          *block_p = block->next;
+          dbus_free (block);
+        }
+      else
+        {
+          block_p = &block->next;
+        }
+    }
+
+ out:
+  dbus_free (blocks);
+  dbus_free (n_free);
+}
+
 /** @} */
 
 #ifdef DBUS_BUILD_TESTS
@@ -554,6 +702,86 @@ time_for_size (int size)
                  N_ITERATIONS, (end - start) / (double) CLOCKS_PER_SEC);
 }
 
+static int
+count_blocks (DBusMemPool *pool)
+{
+  DBusMemBlock *block;
+  int n;
+
+  n = 0;
+  for (block = pool->blocks; block != NULL; block = block->next)
+    n += 1;
+
+  return n;
+}
+
+static void
+check_trim (void)
+{
+#define N_TRIM_ELEMENTS 10000
+  void **elements;
+  DBusMemPool *pool;
+  int n_blocks;
+  int i;
+
+  pool = _dbus_mem_pool_new (24, TRUE);
+  elements = dbus_new (void *, N_TRIM_ELEMENTS);
+  if (pool == NULL || elements == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  for (i = 0; i < N_TRIM_ELEMENTS; i++)
+    {
+      elements[i] = _dbus_mem_pool_alloc (pool);
+      _dbus_assert (elements[i] != NULL);
+      memset (elements[i], 'x', 24);
+    }
+
+  n_blocks = count_blocks (pool);
+
+  /* Keep the first and every 1000th element, so only the blocks
+   * holding those can't go
+   */
+  for (i = 1; i < N_TRIM_ELEMENTS; i++)
+    {
+      if (i % 1000 != 0)
+        _dbus_mem_pool_dealloc (pool, elements[i]);
+    }
+
+  _dbus_mem_pool_trim (pool);
+
+  if (!_dbus_disable_mem_pools ())
+    {
+      _dbus_assert (count_blocks (pool) < n_blocks);
+      _dbus_assert (count_blocks (pool) <= N_TRIM_ELEMENTS / 1000 + 1);
+    }
+
+  /* the pool works as before, and recycled elements are zeroed */
+  for (i = 1; i < N_TRIM_ELEMENTS; i++)
+    {
+      if (i % 1000 != 0)
+        {
+          int j;
+
+          elements[i] = _dbus_mem_pool_alloc (pool);
+          _dbus_assert (elements[i] != NULL);
+
+          for (j = 0; j < 24; j++)
+            _dbus_assert (((unsigned char *) elements[i])[j] == '\0');
+        }
+    }
+
+  for (i = 0; i < N_TRIM_ELEMENTS; i++)
+    _dbus_mem_pool_dealloc (pool, elements[i]);
+
+  _dbus_mem_pool_trim (pool);
+
+  if (!_dbus_disable_mem_pools ())
+    _dbus_assert (count_blocks (pool) == 1);
+
+  _dbus_mem_pool_free (pool);
+  dbus_free (elements);
+}
+
 /**
  * @ingroup DBusMemPoolInternals
  * Unit test for DBusMemPool
@@ -571,6 +799,8 @@ _dbus_mem_pool_test (void)
       time_for_size (element_sizes[i]);
       ++i;
     }
+
+  check_trim ();
   
   return TRUE;
 }
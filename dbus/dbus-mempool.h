@@ -32,12 +32,17 @@ DBUS_BEGIN_DECLS
 
 typedef struct DBusMemPool DBusMemPool;
 
-DBusMemPool* _dbus_mem_pool_new     (int          element_size,
-                                     dbus_bool_t  zero_elements);
+DBusMemPool* _dbus_mem_pool_new_in  (int                 element_size,
+                                     dbus_bool_t         zero_elements,
+                                     DBusAllocSubsystem  subsystem);
 void         _dbus_mem_pool_free    (DBusMemPool *pool);
 void*        _dbus_mem_pool_alloc   (DBusMemPool *pool);
 dbus_bool_t  _dbus_mem_pool_dealloc (DBusMemPool *pool,
                                      void        *element);
+void         _dbus_mem_pool_trim    (DBusMemPool *pool);
+
+#define _dbus_mem_pool_new(element_size, zero_elements) \
+  _dbus_mem_pool_new_in ((element_size), (zero_elements), DBUS_ALLOC_SUBSYSTEM)
 
 DBUS_END_DECLS
 
@@ -32,13 +32,34 @@ DBUS_BEGIN_DECLS
 
 typedef struct DBusMessageLoader DBusMessageLoader;
 
+/**
+ * Called by the loader with each piece of a streamed byte array body
+ * as it is read. Set with _dbus_message_loader_set_chunk_function().
+ */
+typedef void (* DBusMessageLoaderChunkFunction) (DBusMessage         *message,
+                                                 const unsigned char *chunk,
+                                                 int                  len,
+                                                 dbus_uint32_t        offset,
+                                                 dbus_uint32_t        total_len,
+                                                 void                *data);
+
 void _dbus_message_get_network_data  (DBusMessage       *message,
 				      const DBusString **header,
 				      const DBusString **body);
+int  _dbus_message_get_network_size  (DBusMessage       *message);
+void _dbus_message_set_priority      (DBusMessage       *message,
+                                      dbus_bool_t        priority);
+dbus_bool_t _dbus_message_get_priority (DBusMessage     *message);
+void _dbus_message_start_expiry      (DBusMessage       *message);
+dbus_bool_t _dbus_message_has_expired  (DBusMessage     *message);
+dbus_bool_t _dbus_message_check_body (DBusMessage       *message);
 void _dbus_message_get_unix_fds      (DBusMessage *message,
                                       const int **fds,
                                       unsigned *n_fds);
 
+void _dbus_object_path_iter_init     (DBusObjectPathIter *iter,
+                                      const char         *path);
+
 void        _dbus_message_lock                  (DBusMessage  *message);
 void        _dbus_message_unlock                (DBusMessage  *message);
 dbus_bool_t _dbus_message_add_counter           (DBusMessage  *message,
@@ -48,6 +69,8 @@ void        _dbus_message_add_counter_link      (DBusMessage  *message,
 void        _dbus_message_remove_counter        (DBusMessage  *message,
                                                  DBusCounter  *counter,
                                                  DBusList    **link_return);
+void        _dbus_message_remove_counter_link   (DBusMessage  *message,
+                                                 DBusList     *link);
 
 DBusMessageLoader* _dbus_message_loader_new                   (void);
 DBusMessageLoader* _dbus_message_loader_ref                   (DBusMessageLoader  *loader);
@@ -59,11 +82,11 @@ void               _dbus_message_loader_return_buffer         (DBusMessageLoader
                                                                DBusString         *buffer,
                                                                int                 bytes_read);
 
-dbus_bool_t        _dbus_message_loader_get_unix_fds          (DBusMessageLoader  *loader,
-                                                               int               **fds,
+void               _dbus_message_loader_get_unix_fds          (DBusMessageLoader  *loader,
+                                                               DBusString        **fds,
                                                                unsigned           *max_n_fds);
 void               _dbus_message_loader_return_unix_fds       (DBusMessageLoader  *loader,
-                                                               int                *fds,
+                                                               DBusString         *fds,
                                                                unsigned            n_fds);
 
 dbus_bool_t        _dbus_message_loader_queue_messages        (DBusMessageLoader  *loader);
@@ -72,7 +95,10 @@ DBusMessage*       _dbus_message_loader_pop_message           (DBusMessageLoader
 DBusList*          _dbus_message_loader_pop_message_link      (DBusMessageLoader  *loader);
 void               _dbus_message_loader_putback_message_link  (DBusMessageLoader  *loader,
                                                                DBusList           *link);
+dbus_bool_t        _dbus_message_loader_queue_handed_off      (DBusMessageLoader  *loader,
+                                                               DBusList           *link);
 
+const DBusString*  _dbus_message_loader_get_unread            (DBusMessageLoader  *loader);
 dbus_bool_t        _dbus_message_loader_get_is_corrupted      (DBusMessageLoader  *loader);
 DBusValidity       _dbus_message_loader_get_corruption_reason (DBusMessageLoader  *loader);
 
@@ -84,6 +110,24 @@ void               _dbus_message_loader_set_max_message_unix_fds(DBusMessageLoad
                                                                  long                n);
 long               _dbus_message_loader_get_max_message_unix_fds(DBusMessageLoader  *loader);
 
+void               _dbus_message_loader_set_trust_bodies      (DBusMessageLoader  *loader,
+                                                               dbus_bool_t         trust);
+void               _dbus_message_loader_set_lazy_bodies       (DBusMessageLoader  *loader,
+                                                               dbus_bool_t         lazy);
+void               _dbus_message_loader_set_keep_byte_order   (DBusMessageLoader  *loader,
+                                                               dbus_bool_t         keep);
+void               _dbus_message_loader_set_max_buffer_waste  (DBusMessageLoader  *loader,
+                                                               int                 max_waste);
+void               _dbus_message_loader_set_chunk_function    (DBusMessageLoader  *loader,
+                                                               DBusMessageLoaderChunkFunction function,
+                                                               void               *data);
+void               _dbus_message_loader_compact               (DBusMessageLoader  *loader);
+
+dbus_bool_t        _dbus_message_cache_init_threads           (void);
+void               _dbus_message_cache_get_stats              (unsigned long      *hits,
+                                                               unsigned long      *misses);
+void               _dbus_message_trim_pool                    (void);
+
 DBUS_END_DECLS
 
 #endif /* DBUS_MESSAGE_INTERNAL_H */
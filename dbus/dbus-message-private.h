@@ -53,6 +53,21 @@ DBUS_BEGIN_DECLS
  *
  */
 
+/**
+ * Body data shared by a message and its copies until one of them
+ * changes it. Their bodies are constant strings pointing into str.
+ * A body loaded from memory owned by the application is a constant
+ * string too, released with free_function when the last message
+ * lets go of it.
+ */
+typedef struct
+{
+  DBusAtomic refcount; /**< Number of messages sharing the body */
+  DBusString str;      /**< The body data */
+  DBusFreeFunction free_function; /**< Releases memory owned by the application, or #NULL */
+  void *free_data;                /**< Argument to free_function */
+} DBusMessageSharedBody;
+
 /**
  * Implementation details of DBusMessageLoader.
  * All members are private.
@@ -63,23 +78,40 @@ struct DBusMessageLoader
 
   DBusString data;     /**< Buffered data */
 
+  DBusString aligned;  /**< Scratch copy of a message not 8-aligned in data */
+
+  DBusString large_body; /**< Body of a large message being read, which becomes the message's body */
+  int large_body_len;    /**< Length large_body will have when complete, or 0 if none is being read */
+
+  DBusMessageLoaderChunkFunction chunk_function; /**< Streams large byte array bodies if set */
+  void *chunk_data;                 /**< Data for chunk_function */
+  DBusMessage *streamed_message;    /**< Message whose body is being streamed, or #NULL */
+  int streamed_len;                 /**< Bytes of the streamed body handed out so far */
+
   DBusList *messages;  /**< Complete messages. */
 
   long max_message_size; /**< Maximum size of a message */
   long max_message_unix_fds; /**< Maximum unix fds in a message */
+  int max_buffer_waste; /**< Unused buffer space kept after compacting */
 
   DBusValidity corruption_reason; /**< why we were corrupted */
 
   unsigned int corrupted : 1; /**< We got broken data, and are no longer working */
 
+  unsigned int trust_bodies : 1; /**< Only validate bodies the bus itself will look at */
+
+  unsigned int lazy_bodies : 1; /**< Validate bodies when first read rather than on load */
+
+  unsigned int keep_byte_order : 1; /**< Leave messages not for the bus in the sender's byte order */
+
   unsigned int buffer_outstanding : 1; /**< Someone is using the buffer to read */
 
 #ifdef HAVE_UNIX_FD_PASSING
   unsigned int unix_fds_outstanding : 1; /**< Someone is using the unix fd array to read */
 
-  int *unix_fds; /**< File descriptors that have been read from the transport but not yet been handed to any message. Array will be allocated at first use. */
-  unsigned n_unix_fds_allocated; /**< Number of file descriptors this array has space for */
-  unsigned n_unix_fds; /**< Number of valid file descriptors in array */
+  DBusString unix_fds; /**< File descriptors that have been read from the transport but not yet
+                        *   been handed to any message, as an array of int. Only grows when
+                        *   fds actually arrive. */
 #endif
 };
 
@@ -87,6 +119,13 @@ struct DBusMessageLoader
 /** How many bits are in the changed_stamp used to validate iterators */
 #define CHANGED_STAMP_BITS 21
 
+/**
+ * Number of counters a message can be added to without allocating a
+ * list link. A received message normally has one, the live messages
+ * counter of the transport it came in on.
+ */
+#define N_INLINE_COUNTERS 2
+
 /**
  * @brief Internals of DBusMessage
  *
@@ -101,20 +140,37 @@ struct DBusMessage
   DBusHeader header; /**< Header network data and associated cache */
 
   DBusString body;   /**< Body network data. */
+  DBusMessageSharedBody *shared_body; /**< Where body points into if shared with copies, or #NULL */
 
   char byte_order; /**< Message byte order. */
 
   unsigned int locked : 1; /**< Message being sent, no modifications allowed. */
 
+  unsigned int body_validation_pending : 1; /**< Body was loaded without being validated */
+  unsigned int body_invalid : 1; /**< Deferred validation found the body to be corrupt */
+  unsigned int keep_byte_order : 1; /**< Reading doesn't swap the message into our byte order */
+  unsigned int priority : 1; /**< Queued ahead of other messages, see _dbus_message_set_priority() */
+  unsigned int expiry_started : 1; /**< expiry_tv_sec and expiry_tv_usec are set, see _dbus_message_start_expiry() */
+
 #ifndef DBUS_DISABLE_CHECKS
   unsigned int in_cache : 1; /**< Has been "freed" since it's in the cache (this is a debug feature) */
 #endif
 
-  DBusList *counters;   /**< 0-N DBusCounter used to track message size/unix fds. */
+  DBusCounter *inline_counters[N_INLINE_COUNTERS]; /**< First counters, stored without a list link */
+  DBusList *counters;   /**< Further DBusCounter used to track message size/unix fds. */
   long size_counter_delta;   /**< Size we incremented the size counters by.   */
 
+  long expiry_tv_sec;  /**< When the message expires, if expiry_started */
+  long expiry_tv_usec; /**< Microseconds part of expiry_tv_sec */
+
   dbus_uint32_t changed_stamp : CHANGED_STAMP_BITS; /**< Incremented when iterators are invalidated. */
 
+  int *arg_offsets; /**< Signature and body offset of each argument, built when first needed */
+  int n_args;       /**< Number of arguments in arg_offsets, or -1 if not built */
+
+  DBusString *append_signature; /**< Copy of the header's signature kept from the last
+                                 *   append for the next one, or #NULL */
+
   DBusDataSlotList slot_list;   /**< Data stored by allocated integer ID */
 
 #ifndef DBUS_DISABLE_CHECKS
@@ -83,6 +83,7 @@ dbus_message_iter_get_args (DBusMessageIter *iter,
 #ifdef DBUS_BUILD_TESTS
 #include "dbus-test.h"
 #include "dbus-message-factory.h"
+#include "dbus-marshal-byteswap.h"
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -942,532 +943,2989 @@ verify_test_message (DBusMessage *message)
     _dbus_assert_not_reached ("Didn't reach end of arguments");
 }
 
-/**
- * @ingroup DBusMessageInternals
- * Unit test for DBusMessage.
- *
- * @returns #TRUE on success.
+/* Feed several small messages to the loader in a single buffer, so
+ * they sit at both aligned and unaligned offsets past the first, and
+ * check they all come back out intact.
  */
-dbus_bool_t
-_dbus_message_test (const char *test_data_dir)
+static void
+check_loader_batch (void)
 {
-  DBusMessage *message, *message_without_unix_fds;
+  static const char *strings[] = { "abc", "a", "bc", "def", "ghij", "klmno" };
   DBusMessageLoader *loader;
-  int i;
-  const char *data;
-  DBusMessage *copy;
-  const char *name1;
-  const char *name2;
-  const dbus_uint32_t our_uint32_array[] =
-    { 0x12345678, 0x23456781, 0x34567812, 0x45678123 };
-  const dbus_int32_t our_int32_array[] =
-    { 0x12345678, -0x23456781, 0x34567812, -0x45678123 };
-  const dbus_uint32_t *v_ARRAY_UINT32 = our_uint32_array;
-  const dbus_int32_t *v_ARRAY_INT32 = our_int32_array;
-#ifdef DBUS_HAVE_INT64
-  const dbus_uint64_t our_uint64_array[] =
-    { 0x12345678, 0x23456781, 0x34567812, 0x45678123 };
-  const dbus_int64_t our_int64_array[] =
-    { 0x12345678, -0x23456781, 0x34567812, -0x45678123 };
-  const dbus_uint64_t *v_ARRAY_UINT64 = our_uint64_array;
-  const dbus_int64_t *v_ARRAY_INT64 = our_int64_array;
-#endif
-  const char *our_string_array[] = { "Foo", "bar", "", "woo woo woo woo" };
-  const char **v_ARRAY_STRING = our_string_array;
-  const double our_double_array[] = { 0.1234, 9876.54321, -300.0 };
-  const double *v_ARRAY_DOUBLE = our_double_array;
-  const unsigned char our_byte_array[] = { 'a', 'b', 'c', 234 };
-  const unsigned char *v_ARRAY_BYTE = our_byte_array;
-  const dbus_bool_t our_boolean_array[] = { TRUE, FALSE, TRUE, TRUE, FALSE };
-  const dbus_bool_t *v_ARRAY_BOOLEAN = our_boolean_array;
-  char sig[64];
-  const char *s;
-  const char *v_STRING;
-  double v_DOUBLE;
-  dbus_int16_t v_INT16;
-  dbus_uint16_t v_UINT16;
-  dbus_int32_t v_INT32;
-  dbus_uint32_t v_UINT32;
-#ifdef DBUS_HAVE_INT64
-  dbus_int64_t v_INT64;
-  dbus_uint64_t v_UINT64;
-#endif
-  unsigned char v_BYTE;
-  unsigned char v2_BYTE;
-  dbus_bool_t v_BOOLEAN;
-  DBusMessageIter iter, array_iter, struct_iter;
-#ifdef HAVE_UNIX_FD_PASSING
-  int v_UNIX_FD;
-#endif
-  char **decomposed;
+  DBusString *buffer;
+  int i, j;
 
-  message = dbus_message_new_method_call ("org.freedesktop.DBus.TestService",
-                                          "/org/freedesktop/TestPath",
-                                          "Foo.TestInterface",
-                                          "TestMethod");
-  _dbus_assert (dbus_message_has_destination (message, "org.freedesktop.DBus.TestService"));
-  _dbus_assert (dbus_message_is_method_call (message, "Foo.TestInterface",
-                                             "TestMethod"));
-  _dbus_assert (strcmp (dbus_message_get_path (message),
-                        "/org/freedesktop/TestPath") == 0);
-  dbus_message_set_serial (message, 1234);
+  loader = _dbus_message_loader_new ();
+  if (loader == NULL)
+    _dbus_assert_not_reached ("no memory for loader");
 
-  /* string length including nul byte not a multiple of 4 */
-  if (!dbus_message_set_sender (message, "org.foo.bar1"))
-    _dbus_assert_not_reached ("out of memory");
+  _dbus_message_loader_get_buffer (loader, &buffer);
 
-  _dbus_assert (dbus_message_has_sender (message, "org.foo.bar1"));
-  dbus_message_set_reply_serial (message, 5678);
+  for (i = 0; i < (int) _DBUS_N_ELEMENTS (strings); i++)
+    {
+      DBusMessage *message;
+
+      message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                         "Foo.TestInterface",
+                                         "TestSignal");
+      if (message == NULL ||
+          !dbus_message_append_args (message,
+                                     DBUS_TYPE_STRING, &strings[i],
+                                     DBUS_TYPE_INVALID))
+        _dbus_assert_not_reached ("no memory for test message");
+
+      dbus_message_set_serial (message, i + 1);
+      dbus_message_lock (message);
+
+      if (!_dbus_string_copy (&message->header.data, 0, buffer,
+                              _dbus_string_get_length (buffer)) ||
+          !_dbus_string_copy (&message->body, 0, buffer,
+                              _dbus_string_get_length (buffer)))
+        _dbus_assert_not_reached ("no memory to buffer test message");
+
+      dbus_message_unref (message);
+    }
 
-  _dbus_verbose_bytes_of_string (&message->header.data, 0,
-                                 _dbus_string_get_length (&message->header.data));
-  _dbus_verbose_bytes_of_string (&message->body, 0,
-                                 _dbus_string_get_length (&message->body));
+  /* leave a partial message behind the complete ones */
+  if (!_dbus_string_append_len (buffer, "l", 1))
+    _dbus_assert_not_reached ("no memory to buffer partial message");
 
-  if (!dbus_message_set_sender (message, NULL))
-    _dbus_assert_not_reached ("out of memory");
+  _dbus_message_loader_return_buffer (loader, buffer,
+                                      _dbus_string_get_length (buffer));
 
+  if (!_dbus_message_loader_queue_messages (loader))
+    _dbus_assert_not_reached ("no memory to queue messages");
 
-  _dbus_verbose_bytes_of_string (&message->header.data, 0,
-                                 _dbus_string_get_length (&message->header.data));
-  _dbus_verbose_bytes_of_string (&message->body, 0,
-                                 _dbus_string_get_length (&message->body));
+  if (_dbus_message_loader_get_is_corrupted (loader))
+    _dbus_assert_not_reached ("message loader corrupted");
 
+  for (j = 0; j < i; j++)
+    {
+      DBusMessage *message;
+      const char *s;
 
-  _dbus_assert (!dbus_message_has_sender (message, "org.foo.bar1"));
-  _dbus_assert (dbus_message_get_serial (message) == 1234);
-  _dbus_assert (dbus_message_get_reply_serial (message) == 5678);
-  _dbus_assert (dbus_message_has_destination (message, "org.freedesktop.DBus.TestService"));
+      message = _dbus_message_loader_pop_message (loader);
+      if (message == NULL)
+        _dbus_assert_not_reached ("batch lost a message");
 
-  _dbus_assert (dbus_message_get_no_reply (message) == FALSE);
-  dbus_message_set_no_reply (message, TRUE);
-  _dbus_assert (dbus_message_get_no_reply (message) == TRUE);
-  dbus_message_set_no_reply (message, FALSE);
-  _dbus_assert (dbus_message_get_no_reply (message) == FALSE);
+      _dbus_assert (dbus_message_get_serial (message) == (dbus_uint32_t) j + 1);
 
-  /* Set/get some header fields */
+      if (!dbus_message_get_args (message, NULL,
+                                  DBUS_TYPE_STRING, &s,
+                                  DBUS_TYPE_INVALID))
+        _dbus_assert_not_reached ("could not read back batched message");
 
-  if (!dbus_message_set_path (message, "/foo"))
-    _dbus_assert_not_reached ("out of memory");
-  _dbus_assert (strcmp (dbus_message_get_path (message),
-                        "/foo") == 0);
+      _dbus_assert (strcmp (s, strings[j]) == 0);
 
-  if (!dbus_message_set_interface (message, "org.Foo"))
-    _dbus_assert_not_reached ("out of memory");
-  _dbus_assert (strcmp (dbus_message_get_interface (message),
-                        "org.Foo") == 0);
+      dbus_message_unref (message);
+    }
 
-  if (!dbus_message_set_member (message, "Bar"))
-    _dbus_assert_not_reached ("out of memory");
-  _dbus_assert (strcmp (dbus_message_get_member (message),
-                        "Bar") == 0);
+  _dbus_assert (_dbus_message_loader_pop_message (loader) == NULL);
+  _dbus_assert (_dbus_string_get_length (&loader->data) == 1);
 
-  /* Set/get them with longer values */
-  if (!dbus_message_set_path (message, "/foo/bar"))
-    _dbus_assert_not_reached ("out of memory");
-  _dbus_assert (strcmp (dbus_message_get_path (message),
-                        "/foo/bar") == 0);
+  _dbus_message_loader_unref (loader);
+}
 
-  if (!dbus_message_set_interface (message, "org.Foo.Bar"))
-    _dbus_assert_not_reached ("out of memory");
-  _dbus_assert (strcmp (dbus_message_get_interface (message),
-                        "org.Foo.Bar") == 0);
+/* Loads a method call whose string argument has a nul byte in it,
+ * and returns whether the loader accepted it
+ */
+static dbus_bool_t
+check_loader_trusts_body (dbus_bool_t  trust,
+                          const char  *destination)
+{
+  const char *arg = "abc";
+  DBusMessageLoader *loader;
+  DBusMessage *message;
+  DBusString *buffer;
+  dbus_bool_t loaded;
 
-  if (!dbus_message_set_member (message, "BarFoo"))
-    _dbus_assert_not_reached ("out of memory");
-  _dbus_assert (strcmp (dbus_message_get_member (message),
-                        "BarFoo") == 0);
+  loader = _dbus_message_loader_new ();
+  if (loader == NULL)
+    _dbus_assert_not_reached ("no memory for loader");
 
-  /* Realloc shorter again */
+  _dbus_message_loader_set_trust_bodies (loader, trust);
 
-  if (!dbus_message_set_path (message, "/foo"))
-    _dbus_assert_not_reached ("out of memory");
-  _dbus_assert (strcmp (dbus_message_get_path (message),
-                        "/foo") == 0);
+  message = dbus_message_new_method_call (destination,
+                                          "/org/freedesktop/TestPath",
+                                          "Foo.TestInterface",
+                                          "TestMethod");
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &arg,
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("no memory for test message");
 
-  if (!dbus_message_set_interface (message, "org.Foo"))
-    _dbus_assert_not_reached ("out of memory");
-  _dbus_assert (strcmp (dbus_message_get_interface (message),
-                        "org.Foo") == 0);
+  dbus_message_set_serial (message, 1);
+  dbus_message_lock (message);
 
-  if (!dbus_message_set_member (message, "Bar"))
-    _dbus_assert_not_reached ("out of memory");
-  _dbus_assert (strcmp (dbus_message_get_member (message),
-                        "Bar") == 0);
+  /* skip the length, and break the string */
+  _dbus_string_set_byte (&message->body, 4, '\0');
+
+  _dbus_message_loader_get_buffer (loader, &buffer);
+  if (!_dbus_string_copy (&message->header.data, 0, buffer,
+                          _dbus_string_get_length (buffer)) ||
+      !_dbus_string_copy (&message->body, 0, buffer,
+                          _dbus_string_get_length (buffer)))
+    _dbus_assert_not_reached ("no memory to buffer test message");
+  _dbus_message_loader_return_buffer (loader, buffer,
+                                      _dbus_string_get_length (buffer));
+  dbus_message_unref (message);
 
-  /* Path decomposing */
-  dbus_message_set_path (message, NULL);
-  dbus_message_get_path_decomposed (message, &decomposed);
-  _dbus_assert (decomposed == NULL);
-  dbus_free_string_array (decomposed);
+  if (!_dbus_message_loader_queue_messages (loader))
+    _dbus_assert_not_reached ("no memory to queue messages");
 
-  dbus_message_set_path (message, "/");
-  dbus_message_get_path_decomposed (message, &decomposed);
-  _dbus_assert (decomposed != NULL);
-  _dbus_assert (decomposed[0] == NULL);
-  dbus_free_string_array (decomposed);
+  message = _dbus_message_loader_pop_message (loader);
+  loaded = message != NULL;
+  _dbus_assert (loaded == !_dbus_message_loader_get_is_corrupted (loader));
 
-  dbus_message_set_path (message, "/a/b");
-  dbus_message_get_path_decomposed (message, &decomposed);
-  _dbus_assert (decomposed != NULL);
-  _dbus_assert (strcmp (decomposed[0], "a") == 0);
-  _dbus_assert (strcmp (decomposed[1], "b") == 0);
-  _dbus_assert (decomposed[2] == NULL);
-  dbus_free_string_array (decomposed);
+  /* what the bus checks once the message is routed */
+  if (message != NULL)
+    {
+      _dbus_assert (!_dbus_message_check_body (message));
+      dbus_message_unref (message);
+    }
+  _dbus_message_loader_unref (loader);
 
-  dbus_message_set_path (message, "/spam/eggs");
-  dbus_message_get_path_decomposed (message, &decomposed);
-  _dbus_assert (decomposed != NULL);
-  _dbus_assert (strcmp (decomposed[0], "spam") == 0);
-  _dbus_assert (strcmp (decomposed[1], "eggs") == 0);
-  _dbus_assert (decomposed[2] == NULL);
-  dbus_free_string_array (decomposed);
+  return loaded;
+}
 
-  dbus_message_unref (message);
+static void
+check_loader_trust_bodies (void)
+{
+  if (check_loader_trusts_body (FALSE, "org.freedesktop.DBus.TestDestination"))
+    _dbus_assert_not_reached ("loaded a bad body without trusting it");
 
-  /* Test the vararg functions */
-  message = dbus_message_new_method_call ("org.freedesktop.DBus.TestService",
+  if (!check_loader_trusts_body (TRUE, "org.freedesktop.DBus.TestDestination"))
+    _dbus_assert_not_reached ("validated a trusted body");
+
+  /* the bus reads messages sent to itself, so checks those anyway */
+  if (check_loader_trusts_body (TRUE, DBUS_SERVICE_DBUS))
+    _dbus_assert_not_reached ("loaded a bad body sent to the bus");
+}
+
+/* A message in the other byte order is passed on as it is when the
+ * loader keeps the order, but still reads right
+ */
+static void
+check_loader_keep_byte_order (void)
+{
+  DBusMessageLoader *loader;
+  DBusMessage *message;
+  DBusMessage *copy;
+  DBusMessageIter iter;
+  DBusString *buffer;
+  DBusString signature;
+  DBusError error;
+  const char *arg = "Test string";
+  dbus_int32_t number = 0x12345678;
+  dbus_int32_t ints[3] = { 1, 2, 3 };
+  const dbus_int32_t *ints_p = ints;
+  const char *read_arg;
+  dbus_int32_t read_number;
+  char *marshalled;
+  int len;
+  int n_read;
+  int opposite;
+
+  opposite = DBUS_COMPILER_BYTE_ORDER == DBUS_LITTLE_ENDIAN ?
+    DBUS_BIG_ENDIAN : DBUS_LITTLE_ENDIAN;
+
+  loader = _dbus_message_loader_new ();
+  if (loader == NULL)
+    _dbus_assert_not_reached ("no memory for loader");
+
+  _dbus_message_loader_set_keep_byte_order (loader, TRUE);
+
+  message = dbus_message_new_method_call ("org.freedesktop.DBus.TestDestination",
                                           "/org/freedesktop/TestPath",
                                           "Foo.TestInterface",
                                           "TestMethod");
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &arg,
+                                 DBUS_TYPE_INT32, &number,
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_INT32, &ints_p, 3,
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("no memory for test message");
+
   dbus_message_set_serial (message, 1);
-  dbus_message_set_reply_serial (message, 5678);
+  dbus_message_lock (message);
 
-  v_INT16 = -0x123;
-  v_UINT16 = 0x123;
-  v_INT32 = -0x12345678;
-  v_UINT32 = 0x12300042;
-#ifdef DBUS_HAVE_INT64
-  v_INT64 = DBUS_INT64_CONSTANT (-0x123456789abcd);
-  v_UINT64 = DBUS_UINT64_CONSTANT (0x123456789abcd);
-#endif
-  v_STRING = "Test string";
-  v_DOUBLE = 3.14159;
-  v_BOOLEAN = TRUE;
-  v_BYTE = 42;
-  v2_BYTE = 24;
-#ifdef HAVE_UNIX_FD_PASSING
-  v_UNIX_FD = 1;
-#endif
+  _dbus_string_init_const (&signature, dbus_message_get_signature (message));
+  _dbus_marshal_byteswap (&signature, 0, DBUS_COMPILER_BYTE_ORDER, opposite,
+                          &message->body, 0);
+  _dbus_header_byteswap (&message->header, opposite);
+
+  _dbus_message_loader_get_buffer (loader, &buffer);
+  if (!_dbus_string_copy (&message->header.data, 0, buffer,
+                          _dbus_string_get_length (buffer)) ||
+      !_dbus_string_copy (&message->body, 0, buffer,
+                          _dbus_string_get_length (buffer)))
+    _dbus_assert_not_reached ("no memory to buffer test message");
+  _dbus_message_loader_return_buffer (loader, buffer,
+                                      _dbus_string_get_length (buffer));
+  dbus_message_unref (message);
 
-  dbus_message_append_args (message,
-                            DBUS_TYPE_INT16, &v_INT16,
-                            DBUS_TYPE_UINT16, &v_UINT16,
-			    DBUS_TYPE_INT32, &v_INT32,
-                            DBUS_TYPE_UINT32, &v_UINT32,
-#ifdef DBUS_HAVE_INT64
-                            DBUS_TYPE_INT64, &v_INT64,
-                            DBUS_TYPE_UINT64, &v_UINT64,
-#endif
-			    DBUS_TYPE_STRING, &v_STRING,
-			    DBUS_TYPE_DOUBLE, &v_DOUBLE,
-			    DBUS_TYPE_BOOLEAN, &v_BOOLEAN,
-			    DBUS_TYPE_BYTE, &v_BYTE,
-			    DBUS_TYPE_BYTE, &v2_BYTE,
-			    DBUS_TYPE_ARRAY, DBUS_TYPE_UINT32, &v_ARRAY_UINT32,
-                            _DBUS_N_ELEMENTS (our_uint32_array),
-                            DBUS_TYPE_ARRAY, DBUS_TYPE_INT32, &v_ARRAY_INT32,
-                            _DBUS_N_ELEMENTS (our_int32_array),
-#ifdef DBUS_HAVE_INT64
-                            DBUS_TYPE_ARRAY, DBUS_TYPE_UINT64, &v_ARRAY_UINT64,
-                            _DBUS_N_ELEMENTS (our_uint64_array),
-                            DBUS_TYPE_ARRAY, DBUS_TYPE_INT64, &v_ARRAY_INT64,
-                            _DBUS_N_ELEMENTS (our_int64_array),
-#endif
-                            DBUS_TYPE_ARRAY, DBUS_TYPE_DOUBLE, &v_ARRAY_DOUBLE,
-                            _DBUS_N_ELEMENTS (our_double_array),
-                            DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &v_ARRAY_BYTE,
-                            _DBUS_N_ELEMENTS (our_byte_array),
-                            DBUS_TYPE_ARRAY, DBUS_TYPE_BOOLEAN, &v_ARRAY_BOOLEAN,
-                            _DBUS_N_ELEMENTS (our_boolean_array),
-                            DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &v_ARRAY_STRING,
+  if (!_dbus_message_loader_queue_messages (loader))
+    _dbus_assert_not_reached ("no memory to queue messages");
+
+  message = _dbus_message_loader_pop_message (loader);
+  if (message == NULL)
+    _dbus_assert_not_reached ("message in the other byte order did not load");
+  _dbus_assert (message->byte_order == opposite);
+
+  /* reading it, and routing it, leave it as it is */
+  dbus_error_init (&error);
+  if (!dbus_message_get_args (message, &error,
+                              DBUS_TYPE_STRING, &read_arg,
+                              DBUS_TYPE_INT32, &read_number,
+                              DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached (error.message);
+  _dbus_assert (strcmp (read_arg, arg) == 0);
+  _dbus_assert (read_number == number);
+
+  if (!dbus_message_set_sender (message, ":1.10"))
+    _dbus_assert_not_reached ("no memory");
+  _dbus_assert (message->byte_order == opposite);
+
+  if (!dbus_message_marshal (message, &marshalled, &len))
+    _dbus_assert_not_reached ("no memory");
+  _dbus_assert (marshalled[0] == opposite);
+
+  copy = dbus_message_demarshal (marshalled, len, &error);
+  if (copy == NULL)
+    _dbus_assert_not_reached (error.message);
+  _dbus_assert (strcmp (dbus_message_get_sender (copy), ":1.10") == 0);
+  if (!dbus_message_get_args (copy, &error,
+                              DBUS_TYPE_STRING, &read_arg,
+                              DBUS_TYPE_INT32, &read_number,
+                              DBUS_TYPE_ARRAY, DBUS_TYPE_INT32, &ints_p, &n_read,
+                              DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached (error.message);
+  _dbus_assert (read_number == number);
+  _dbus_assert (n_read == 3 && ints_p[2] == 3);
+  dbus_message_unref (copy);
+  dbus_free (marshalled);
+
+  /* an array can't be pointed at in the other byte order */
+  if (dbus_message_get_args (message, &error,
+                             DBUS_TYPE_STRING, &read_arg,
+                             DBUS_TYPE_INT32, &read_number,
+                             DBUS_TYPE_ARRAY, DBUS_TYPE_INT32, &ints_p, &n_read,
+                             DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("got a fixed array in the other byte order");
+  dbus_error_free (&error);
+
+  /* appending swaps it, flag and all */
+  dbus_message_iter_init_append (message, &iter);
+  _dbus_assert (message->byte_order == DBUS_COMPILER_BYTE_ORDER);
+  _dbus_assert (_dbus_string_get_byte (&message->header.data, 0) ==
+                DBUS_COMPILER_BYTE_ORDER);
+
+  dbus_message_unref (message);
+  _dbus_message_loader_unref (loader);
+}
+
+static void
+check_loader_lazy_bodies (void)
+{
+  DBusMessageLoader *loader;
+  DBusMessage *message;
+  DBusMessageIter iter;
+  DBusString *buffer;
+  DBusError error;
+  const char *arg = "Test string";
+  const char *value;
+
+  loader = _dbus_message_loader_new ();
+  if (loader == NULL)
+    _dbus_assert_not_reached ("no memory for loader");
+
+  _dbus_message_loader_set_lazy_bodies (loader, TRUE);
+
+  message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                     "Foo.TestInterface",
+                                     "TestSignal");
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &arg,
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("no memory for test message");
+
+  dbus_message_set_serial (message, 1);
+  dbus_message_lock (message);
+
+  /* skip the length, and break the string */
+  _dbus_string_set_byte (&message->body, 4, '\0');
+
+  _dbus_message_loader_get_buffer (loader, &buffer);
+  if (!_dbus_string_copy (&message->header.data, 0, buffer,
+                          _dbus_string_get_length (buffer)) ||
+      !_dbus_string_copy (&message->body, 0, buffer,
+                          _dbus_string_get_length (buffer)))
+    _dbus_assert_not_reached ("no memory to buffer test message");
+  _dbus_message_loader_return_buffer (loader, buffer,
+                                      _dbus_string_get_length (buffer));
+  dbus_message_unref (message);
+
+  if (!_dbus_message_loader_queue_messages (loader))
+    _dbus_assert_not_reached ("no memory to queue messages");
+
+  message = _dbus_message_loader_pop_message (loader);
+  if (message == NULL || _dbus_message_loader_get_is_corrupted (loader))
+    _dbus_assert_not_reached ("validated a body before it was read");
+
+  _dbus_assert (dbus_message_is_signal (message, "Foo.TestInterface",
+                                        "TestSignal"));
+
+  if (dbus_message_iter_init (message, &iter))
+    _dbus_assert_not_reached ("read arguments from a corrupt body");
+
+  dbus_error_init (&error);
+  if (dbus_message_get_args (message, &error,
+                             DBUS_TYPE_STRING, &value,
+                             DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("got arguments from a corrupt body");
+  _dbus_assert (dbus_error_has_name (&error, DBUS_ERROR_INVALID_ARGS));
+  dbus_error_free (&error);
+
+  dbus_message_unref (message);
+  _dbus_message_loader_unref (loader);
+}
+
+static void
+append_message_to_string (DBusMessage *message,
+                          DBusString  *str)
+{
+  dbus_message_set_serial (message, 1);
+  dbus_message_lock (message);
+
+  if (!_dbus_string_copy (&message->header.data, 0, str,
+                          _dbus_string_get_length (str)) ||
+      !_dbus_string_copy (&message->body, 0, str,
+                          _dbus_string_get_length (str)))
+    _dbus_assert_not_reached ("no memory to serialize test message");
+}
+
+/* Feed a message with a body big enough to be read into its own
+ * buffer, followed by a small one, in chunks that split both
+ */
+static void
+check_loader_large_body (void)
+{
+  DBusMessageLoader *loader;
+  DBusMessage *message;
+  DBusString data;
+  DBusString *buffer;
+  unsigned char *payload;
+  const unsigned char *read_payload;
+  int payload_len = 100003;
+  int n_read;
+  int pos;
+  int i;
+
+  if (!_dbus_string_init (&data))
+    _dbus_assert_not_reached ("no memory");
+
+  payload = dbus_malloc (payload_len);
+  if (payload == NULL)
+    _dbus_assert_not_reached ("no memory");
+  for (i = 0; i < payload_len; i++)
+    payload[i] = i % 251;
+
+  message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                     "Foo.TestInterface",
+                                     "Large");
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE,
+                                 &payload, payload_len,
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("no memory for test message");
+  append_message_to_string (message, &data);
+  dbus_message_unref (message);
+
+  message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                     "Foo.TestInterface",
+                                     "Small");
+  if (message == NULL)
+    _dbus_assert_not_reached ("no memory for test message");
+  append_message_to_string (message, &data);
+  dbus_message_unref (message);
+
+  loader = _dbus_message_loader_new ();
+  if (loader == NULL)
+    _dbus_assert_not_reached ("no memory for loader");
+
+  for (pos = 0; pos < _dbus_string_get_length (&data); pos += 3001)
+    {
+      int len;
+
+      len = MIN (3001, _dbus_string_get_length (&data) - pos);
+
+      _dbus_message_loader_get_buffer (loader, &buffer);
+      if (!_dbus_string_copy_len (&data, pos, len, buffer,
+                                  _dbus_string_get_length (buffer)))
+        _dbus_assert_not_reached ("no memory to buffer test message");
+      _dbus_message_loader_return_buffer (loader, buffer, len);
+
+      if (!_dbus_message_loader_queue_messages (loader))
+        _dbus_assert_not_reached ("no memory to queue messages");
+      _dbus_assert (!_dbus_message_loader_get_is_corrupted (loader));
+    }
+
+  message = _dbus_message_loader_pop_message (loader);
+  _dbus_assert (message != NULL);
+  _dbus_assert (dbus_message_is_signal (message, "Foo.TestInterface", "Large"));
+  if (!dbus_message_get_args (message, NULL,
+                              DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE,
+                              &read_payload, &n_read,
+                              DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("could not read large body");
+  _dbus_assert (n_read == payload_len);
+  _dbus_assert (memcmp (read_payload, payload, payload_len) == 0);
+  dbus_message_unref (message);
+
+  message = _dbus_message_loader_pop_message (loader);
+  _dbus_assert (message != NULL);
+  _dbus_assert (dbus_message_is_signal (message, "Foo.TestInterface", "Small"));
+  dbus_message_unref (message);
+
+  _dbus_assert (_dbus_message_loader_pop_message (loader) == NULL);
+
+  _dbus_message_loader_unref (loader);
+  dbus_free (payload);
+  _dbus_string_free (&data);
+}
+
+typedef struct
+{
+  DBusMessage *message;
+  DBusString received;
+  dbus_uint32_t total_len;
+} StreamedBody;
+
+static void
+collect_body_chunk (DBusMessage         *message,
+                    const unsigned char *chunk,
+                    int                  len,
+                    dbus_uint32_t        offset,
+                    dbus_uint32_t        total_len,
+                    void                *data)
+{
+  StreamedBody *streamed = data;
+
+  _dbus_assert (streamed->message == NULL || streamed->message == message);
+  _dbus_assert (offset == (dbus_uint32_t) _dbus_string_get_length (&streamed->received));
+  _dbus_assert (offset + len <= total_len);
+
+  streamed->message = message;
+  streamed->total_len = total_len;
+
+  if (!_dbus_string_append_len (&streamed->received, (const char *) chunk, len))
+    _dbus_assert_not_reached ("no memory to collect chunk");
+}
+
+/* With a chunk function set, a large byte array should come out in
+ * pieces without the loader ever buffering all of it, and the message
+ * after it should be unaffected
+ */
+static void
+check_loader_streamed_body (void)
+{
+  DBusMessageLoader *loader;
+  DBusMessage *message;
+  DBusString data;
+  DBusString *buffer;
+  StreamedBody streamed;
+  unsigned char *payload;
+  const unsigned char *read_payload;
+  int payload_len = 100003;
+  int n_read;
+  int pos;
+  int i;
+
+  if (!_dbus_string_init (&data) ||
+      !_dbus_string_init (&streamed.received))
+    _dbus_assert_not_reached ("no memory");
+  streamed.message = NULL;
+  streamed.total_len = 0;
+
+  payload = dbus_malloc (payload_len);
+  if (payload == NULL)
+    _dbus_assert_not_reached ("no memory");
+  for (i = 0; i < payload_len; i++)
+    payload[i] = i % 251;
+
+  message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                     "Foo.TestInterface",
+                                     "Large");
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE,
+                                 &payload, payload_len,
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("no memory for test message");
+  append_message_to_string (message, &data);
+  dbus_message_unref (message);
+
+  message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                     "Foo.TestInterface",
+                                     "Small");
+  if (message == NULL)
+    _dbus_assert_not_reached ("no memory for test message");
+  append_message_to_string (message, &data);
+  dbus_message_unref (message);
+
+  loader = _dbus_message_loader_new ();
+  if (loader == NULL)
+    _dbus_assert_not_reached ("no memory for loader");
+  _dbus_message_loader_set_chunk_function (loader, collect_body_chunk,
+                                           &streamed);
+
+  for (pos = 0; pos < _dbus_string_get_length (&data); pos += 3001)
+    {
+      int len;
+
+      len = MIN (3001, _dbus_string_get_length (&data) - pos);
+
+      _dbus_message_loader_get_buffer (loader, &buffer);
+      if (!_dbus_string_copy_len (&data, pos, len, buffer,
+                                  _dbus_string_get_length (buffer)))
+        _dbus_assert_not_reached ("no memory to buffer test message");
+      _dbus_message_loader_return_buffer (loader, buffer, len);
+
+      if (!_dbus_message_loader_queue_messages (loader))
+        _dbus_assert_not_reached ("no memory to queue messages");
+      _dbus_assert (!_dbus_message_loader_get_is_corrupted (loader));
+      _dbus_assert (_dbus_string_get_length (&loader->large_body) <= 3001);
+    }
+
+  _dbus_assert (streamed.total_len == (dbus_uint32_t) payload_len);
+  _dbus_assert (_dbus_string_get_length (&streamed.received) == payload_len);
+  _dbus_assert (memcmp (_dbus_string_get_const_data (&streamed.received),
+                        payload, payload_len) == 0);
+
+  message = _dbus_message_loader_pop_message (loader);
+  _dbus_assert (message != NULL);
+  _dbus_assert (message == streamed.message);
+  _dbus_assert (dbus_message_is_signal (message, "Foo.TestInterface", "Large"));
+  if (!dbus_message_get_args (message, NULL,
+                              DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE,
+                              &read_payload, &n_read,
+                              DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("could not read streamed message");
+  _dbus_assert (n_read == 0);
+  dbus_message_unref (message);
+
+  message = _dbus_message_loader_pop_message (loader);
+  _dbus_assert (message != NULL);
+  _dbus_assert (dbus_message_is_signal (message, "Foo.TestInterface", "Small"));
+  dbus_message_unref (message);
+
+  _dbus_assert (_dbus_message_loader_pop_message (loader) == NULL);
+
+  _dbus_message_loader_unref (loader);
+  dbus_free (payload);
+  _dbus_string_free (&streamed.received);
+  _dbus_string_free (&data);
+}
+
+/* Copies of a message with a large body share it until one of them
+ * appends to it, and each should then see only its own arguments
+ */
+static void
+check_copy_shares_body (void)
+{
+  DBusMessage *message;
+  DBusMessage *copy;
+  DBusMessage *second_copy;
+  DBusMessageIter iter;
+  unsigned char payload[4096];
+  const unsigned char *v_ARRAY_BYTE = payload;
+  const unsigned char *read_payload;
+  const char *v_STRING;
+  int n_read;
+
+  memset (payload, 'x', sizeof (payload));
+
+  message = dbus_message_new_method_call ("org.freedesktop.DBus.TestService",
+                                          "/org/freedesktop/TestPath",
+                                          "Foo.TestInterface",
+                                          "Method");
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE,
+                                 &v_ARRAY_BYTE, (int) sizeof (payload),
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("no memory");
+
+  copy = dbus_message_copy (message);
+  second_copy = dbus_message_copy (copy);
+  if (copy == NULL || second_copy == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  _dbus_assert (message->shared_body != NULL);
+  _dbus_assert (message->shared_body == copy->shared_body);
+  _dbus_assert (copy->shared_body == second_copy->shared_body);
+
+  v_STRING = "copy";
+  if (!dbus_message_append_args (copy,
+                                 DBUS_TYPE_STRING, &v_STRING,
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("no memory");
+  _dbus_assert (copy->shared_body == NULL);
+  _dbus_assert (message->shared_body == second_copy->shared_body);
+
+  /* the original keeps its own arguments */
+  dbus_message_iter_init (message, &iter);
+  _dbus_assert (!dbus_message_iter_has_next (&iter));
+  if (!dbus_message_get_args (message, NULL,
+                              DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &read_payload, &n_read,
+                              DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("could not read shared body");
+  _dbus_assert (n_read == (int) sizeof (payload));
+  _dbus_assert (memcmp (read_payload, payload, sizeof (payload)) == 0);
+
+  v_STRING = NULL;
+  if (!dbus_message_get_args (copy, NULL,
+                              DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &read_payload, &n_read,
+                              DBUS_TYPE_STRING, &v_STRING,
+                              DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("could not read unshared copy");
+  _dbus_assert (n_read == (int) sizeof (payload));
+  _dbus_assert (strcmp (v_STRING, "copy") == 0);
+
+  dbus_message_unref (message);
+
+  /* the last one sharing the body takes it back */
+  v_STRING = "second";
+  if (!dbus_message_append_args (second_copy,
+                                 DBUS_TYPE_STRING, &v_STRING,
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("no memory");
+  _dbus_assert (second_copy->shared_body == NULL);
+
+  v_STRING = NULL;
+  if (!dbus_message_get_args (second_copy, NULL,
+                              DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &read_payload, &n_read,
+                              DBUS_TYPE_STRING, &v_STRING,
+                              DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("could not read taken back body");
+  _dbus_assert (memcmp (read_payload, payload, sizeof (payload)) == 0);
+  _dbus_assert (strcmp (v_STRING, "second") == 0);
+
+  dbus_message_unref (copy);
+  dbus_message_unref (second_copy);
+}
+
+/* Setting the sender the ways the bus does should leave a header
+ * that reads back right, both from the field cache and from scratch
+ */
+static void
+check_set_sender (void)
+{
+  DBusMessage *message;
+  DBusMessage *copy;
+  char *marshalled;
+  int marshalled_len;
+  const char *senders[] = { ":1.10", ":1.20", ":1.300" };
+  int i;
+
+  message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                     "Foo.TestInterface",
+                                     "TestSignal");
+  if (message == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  /* added, then overwritten in place, then replaced by a longer one */
+  for (i = 0; i < (int) _DBUS_N_ELEMENTS (senders); i++)
+    {
+      if (!dbus_message_set_sender (message, senders[i]))
+        _dbus_assert_not_reached ("no memory");
+
+      _dbus_assert (strcmp (dbus_message_get_sender (message), senders[i]) == 0);
+      _dbus_assert (strcmp (dbus_message_get_member (message), "TestSignal") == 0);
+      _dbus_assert (strcmp (dbus_message_get_path (message), "/org/freedesktop/TestPath") == 0);
+    }
+
+  if (!dbus_message_set_destination (message, "org.freedesktop.DBus.TestService"))
+    _dbus_assert_not_reached ("no memory");
+
+  dbus_message_set_serial (message, 1);
+
+  if (!dbus_message_marshal (message, &marshalled, &marshalled_len))
+    _dbus_assert_not_reached ("no memory");
+
+  copy = dbus_message_demarshal (marshalled, marshalled_len, NULL);
+  if (copy == NULL)
+    _dbus_assert_not_reached ("header with sender set did not validate");
+
+  _dbus_assert (strcmp (dbus_message_get_sender (copy), ":1.300") == 0);
+  _dbus_assert (strcmp (dbus_message_get_destination (copy),
+                        "org.freedesktop.DBus.TestService") == 0);
+
+  if (!dbus_message_set_sender (copy, ":1.301"))
+    _dbus_assert_not_reached ("no memory");
+  _dbus_assert (strcmp (dbus_message_get_sender (copy), ":1.301") == 0);
+  _dbus_assert (strcmp (dbus_message_get_destination (copy),
+                        "org.freedesktop.DBus.TestService") == 0);
+
+  dbus_free (marshalled);
+  dbus_message_unref (copy);
+  dbus_message_unref (message);
+}
+
+/* The expiry survives marshalling, and a message only expires once
+ * it has been queued, and then waited that long
+ */
+static void
+check_expiry (void)
+{
+  DBusMessage *message;
+  DBusMessage *copy;
+  char *marshalled;
+  int marshalled_len;
+
+  message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                     "Foo.TestInterface",
+                                     "TestSignal");
+  if (message == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  _dbus_assert (dbus_message_get_expiry (message) == 0);
+
+  if (!dbus_message_set_expiry (message, 60000))
+    _dbus_assert_not_reached ("no memory");
+  _dbus_assert (dbus_message_get_expiry (message) == 60000);
+  _dbus_assert (!_dbus_message_has_expired (message));
+
+  dbus_message_set_serial (message, 1);
+
+  if (!dbus_message_marshal (message, &marshalled, &marshalled_len))
+    _dbus_assert_not_reached ("no memory");
+
+  copy = dbus_message_demarshal (marshalled, marshalled_len, NULL);
+  if (copy == NULL)
+    _dbus_assert_not_reached ("header with expiry set did not validate");
+  _dbus_assert (dbus_message_get_expiry (copy) == 60000);
+
+  _dbus_message_start_expiry (copy);
+  _dbus_assert (!_dbus_message_has_expired (copy));
+
+  dbus_free (marshalled);
+  dbus_message_unref (copy);
+
+  if (!dbus_message_set_expiry (message, 0))
+    _dbus_assert_not_reached ("no memory");
+  _dbus_assert (dbus_message_get_expiry (message) == 0);
+  _dbus_message_start_expiry (message);
+  _dbus_assert (!_dbus_message_has_expired (message));
+
+  if (!dbus_message_set_expiry (message, 1))
+    _dbus_assert_not_reached ("no memory");
+  _dbus_message_start_expiry (message);
+  _dbus_sleep_milliseconds (5);
+  _dbus_assert (_dbus_message_has_expired (message));
+
+  dbus_message_unref (message);
+}
+
+static void
+count_release (void *data)
+{
+  *(int *) data += 1;
+}
+
+/* Marshalling into a buffer gives the same bytes as allocating one,
+ * and a message loaded in place keeps the buffer until the last copy
+ * of it lets go
+ */
+static void
+check_marshal_in_place (void)
+{
+  DBusMessage *message;
+  DBusMessage *loaded;
+  DBusMessage *copy;
+  DBusError error = DBUS_ERROR_INIT;
+  DBusMessageIter iter;
+  char *marshalled;
+  int marshalled_len;
+  char *buffer;
+  int len;
+  const char *header, *body;
+  int header_len, body_len;
+  const char *str = "Hello world";
+  dbus_int32_t ints[64];
+  const dbus_int32_t *ints_p = ints;
+  const dbus_int32_t *read_ints;
+  int n_read;
+  int released;
+  int i;
+
+  for (i = 0; i < (int) _DBUS_N_ELEMENTS (ints); i++)
+    ints[i] = i * 3;
+
+  message = dbus_message_new_method_call ("org.freedesktop.DBus.TestService",
+                                          "/org/freedesktop/TestPath",
+                                          "Foo.TestInterface",
+                                          "TestMethod");
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &str,
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_INT32, &ints_p,
+                                 (int) _DBUS_N_ELEMENTS (ints),
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("no memory");
+
+  dbus_message_set_serial (message, 1);
+
+  if (!dbus_message_marshal (message, &marshalled, &marshalled_len))
+    _dbus_assert_not_reached ("no memory");
+
+  dbus_message_get_marshalled_blocks (message, &header, &header_len,
+                                      &body, &body_len);
+  _dbus_assert (header_len + body_len == marshalled_len);
+  _dbus_assert (memcmp (header, marshalled, header_len) == 0);
+  _dbus_assert (memcmp (body, marshalled + header_len, body_len) == 0);
+
+  buffer = dbus_malloc (marshalled_len);
+  if (buffer == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  _dbus_assert (!dbus_message_marshal_into (message, buffer,
+                                            marshalled_len - 1, &len));
+  _dbus_assert (len == marshalled_len);
+  _dbus_assert (dbus_message_marshal_into (message, buffer,
+                                           marshalled_len, &len));
+  _dbus_assert (len == marshalled_len);
+  _dbus_assert (memcmp (buffer, marshalled, len) == 0);
+
+  /* Extra bytes after the message aren't part of it */
+  _dbus_assert (dbus_message_demarshal_static (marshalled, marshalled_len - 1,
+                                               NULL, NULL, &error) == NULL);
+  _dbus_assert (dbus_error_is_set (&error));
+  dbus_error_free (&error);
+
+  released = 0;
+  loaded = dbus_message_demarshal_static (buffer, len,
+                                          count_release, &released,
+                                          &error);
+  if (loaded == NULL)
+    _dbus_assert_not_reached (error.message);
+
+  copy = dbus_message_copy (loaded);
+  if (copy == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  dbus_message_unref (loaded);
+
+  if (!dbus_message_get_args (copy, &error,
+                              DBUS_TYPE_STRING, &str,
+                              DBUS_TYPE_ARRAY, DBUS_TYPE_INT32, &read_ints, &n_read,
+                              DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached (error.message);
+
+  _dbus_assert (strcmp (str, "Hello world") == 0);
+  _dbus_assert (n_read == (int) _DBUS_N_ELEMENTS (ints));
+  _dbus_assert (memcmp (read_ints, ints, sizeof (ints)) == 0);
+
+  /* malloc() aligns to 8, so the body was used in place */
+  _dbus_assert (released == 0);
+  _dbus_assert (read_ints > (const dbus_int32_t *) buffer &&
+                read_ints < (const dbus_int32_t *) (buffer + len));
+
+  /* Changing the copy gives it a body of its own */
+  dbus_message_iter_init_append (copy, &iter);
+  if (!dbus_message_iter_append_basic (&iter, DBUS_TYPE_STRING, &str))
+    _dbus_assert_not_reached ("no memory");
+  _dbus_assert (released == 1);
+
+  dbus_message_unref (copy);
+  _dbus_assert (released == 1);
+
+  dbus_free (buffer);
+  dbus_free (marshalled);
+  dbus_message_unref (message);
+}
+
+/* Messages made from a template should have its header and be
+ * complete messages of their own
+ */
+static void
+check_message_template (void)
+{
+  DBusMessage *template_message;
+  DBusMessage *message;
+  DBusMessage *copy;
+  dbus_int32_t v_INT32;
+  char *marshalled;
+  int marshalled_len;
+  int i;
+
+  template_message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                              "Foo.TestInterface",
+                                              "TestSignal");
+  if (template_message == NULL ||
+      !dbus_message_set_destination (template_message, "org.freedesktop.DBus.TestService"))
+    _dbus_assert_not_reached ("no memory");
+
+  /* sending it gives it a serial, which the copies must not keep */
+  dbus_message_set_serial (template_message, 1234);
+  dbus_message_lock (template_message);
+
+  for (i = 0; i < 2; i++)
+    {
+      message = dbus_message_new_from_template (template_message);
+      if (message == NULL)
+        _dbus_assert_not_reached ("no memory");
+
+      _dbus_assert (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_SIGNAL);
+      _dbus_assert (dbus_message_get_serial (message) == 0);
+      _dbus_assert (dbus_message_get_no_reply (message));
+      _dbus_assert (strcmp (dbus_message_get_path (message), "/org/freedesktop/TestPath") == 0);
+      _dbus_assert (strcmp (dbus_message_get_interface (message), "Foo.TestInterface") == 0);
+      _dbus_assert (strcmp (dbus_message_get_member (message), "TestSignal") == 0);
+      _dbus_assert (strcmp (dbus_message_get_destination (message),
+                            "org.freedesktop.DBus.TestService") == 0);
+
+      v_INT32 = i;
+      if (!dbus_message_append_args (message,
+                                     DBUS_TYPE_INT32, &v_INT32,
+                                     DBUS_TYPE_INVALID))
+        _dbus_assert_not_reached ("no memory");
+
+      dbus_message_set_serial (message, i + 1);
+
+      if (!dbus_message_marshal (message, &marshalled, &marshalled_len))
+        _dbus_assert_not_reached ("no memory");
+
+      copy = dbus_message_demarshal (marshalled, marshalled_len, NULL);
+      if (copy == NULL)
+        _dbus_assert_not_reached ("message from template did not validate");
+
+      v_INT32 = -1;
+      if (!dbus_message_get_args (copy, NULL,
+                                  DBUS_TYPE_INT32, &v_INT32,
+                                  DBUS_TYPE_INVALID))
+        _dbus_assert_not_reached ("could not read message from template");
+      _dbus_assert (v_INT32 == i);
+      _dbus_assert (dbus_message_get_serial (copy) == (dbus_uint32_t) i + 1);
+
+      dbus_free (marshalled);
+      dbus_message_unref (copy);
+      dbus_message_unref (message);
+    }
+
+  _dbus_assert (dbus_message_get_serial (template_message) == 1234);
+
+  dbus_message_unref (template_message);
+}
+
+/* Starting an iterator at each argument should land where walking
+ * to it does, and appending must not leave stale offsets behind
+ */
+static void
+check_iter_init_at (void)
+{
+  DBusMessage *message;
+  DBusMessageIter iter, walked;
+  dbus_int32_t v_INT32;
+  const char *v_STRING;
+  const char *read_string;
+  const dbus_int32_t ints[] = { 1, 2, 3 };
+  const dbus_int32_t *v_ARRAY_INT32 = ints;
+  int i;
+
+  message = dbus_message_new_method_call ("org.freedesktop.DBus.TestService",
+                                          "/org/freedesktop/TestPath",
+                                          "Foo.TestInterface",
+                                          "Method");
+  if (message == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  v_INT32 = 42;
+  v_STRING = "hello";
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_BYTE, &v_STRING[0],
+                                 DBUS_TYPE_STRING, &v_STRING,
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_INT32, &v_ARRAY_INT32, 3,
+                                 DBUS_TYPE_INT32, &v_INT32,
+                                 DBUS_TYPE_STRING, &v_STRING,
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("no memory");
+
+  dbus_message_iter_init (message, &walked);
+  for (i = 0; i < 5; i++)
+    {
+      if (!dbus_message_iter_init_at (message, &iter, i))
+        _dbus_assert_not_reached ("argument not found");
+
+      _dbus_assert (dbus_message_iter_get_arg_type (&iter) ==
+                    dbus_message_iter_get_arg_type (&walked));
+      _dbus_assert (dbus_message_iter_has_next (&iter) ==
+                    dbus_message_iter_has_next (&walked));
+
+      if (dbus_message_iter_get_arg_type (&iter) == DBUS_TYPE_STRING)
+        {
+          dbus_message_iter_get_basic (&iter, &read_string);
+          _dbus_assert (strcmp (read_string, "hello") == 0);
+        }
+
+      dbus_message_iter_next (&walked);
+    }
+
+  _dbus_assert (!dbus_message_iter_init_at (message, &iter, 5));
+  _dbus_assert (dbus_message_iter_get_arg_type (&iter) == DBUS_TYPE_INVALID);
+  _dbus_assert (!dbus_message_iter_init_at (message, &iter, 100));
+
+  v_STRING = "appended";
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &v_STRING,
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("no memory");
+
+  if (!dbus_message_iter_init_at (message, &iter, 5))
+    _dbus_assert_not_reached ("appended argument not found");
+  dbus_message_iter_get_basic (&iter, &read_string);
+  _dbus_assert (strcmp (read_string, "appended") == 0);
+
+  dbus_message_iter_init_at (message, &iter, 3);
+  dbus_message_iter_get_basic (&iter, &v_INT32);
+  _dbus_assert (v_INT32 == 42);
+
+  dbus_message_unref (message);
+}
+
+typedef struct
+{
+  dbus_int32_t id;
+  dbus_int32_t flags;
+  double       value;
+} FixedStructSample;            /* "(iid)", no padding anywhere */
+
+typedef struct
+{
+  unsigned char tag;
+  dbus_uint16_t count;
+} FixedStructPadded;            /* "(yq)", padded inside and between */
+
+static void
+check_fixed_struct_samples (const FixedStructSample *expected,
+                            const FixedStructSample *got,
+                            int                      n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    _dbus_assert (got[i].id == expected[i].id &&
+                  got[i].flags == expected[i].flags &&
+                  got[i].value == expected[i].value);
+}
+
+/* Arrays of fixed-layout structs copied in bulk should read back the
+ * same and go on the wire with zeroed padding, so they validate;
+ * through the message API in native byte order and through the
+ * marshaller in the other one
+ */
+static void
+check_fixed_struct_arrays (void)
+{
+  const FixedStructSample samples[3] =
+    { { 1, -2, 0.5 }, { 3, -4, 1.5 }, { 5, -6, 2.5 } };
+  FixedStructPadded padded[2];
+  FixedStructSample read_samples[3];
+  FixedStructPadded read_padded[2];
+  DBusMessage *message;
+  DBusMessage *copy;
+  DBusMessageIter iter, array_iter, struct_iter;
+  unsigned char tag;
+  dbus_uint16_t count;
+  char *marshalled;
+  int marshalled_len;
+  int n;
+
+  /* garbage in the C padding must not reach the wire */
+  memset (padded, 0xff, sizeof (padded));
+  padded[0].tag = 'a';
+  padded[0].count = 0x1234;
+  padded[1].tag = 'b';
+  padded[1].count = 0x5678;
+
+  message = dbus_message_new_method_call ("org.freedesktop.DBus.TestService",
+                                          "/org/freedesktop/TestPath",
+                                          "Foo.TestInterface",
+                                          "Method");
+  if (message == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  dbus_message_iter_init_append (message, &iter);
+
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "(iid)",
+                                         &array_iter) ||
+      !dbus_message_iter_append_fixed_struct_array (&array_iter, samples,
+                                                    sizeof (FixedStructSample),
+                                                    3) ||
+      !dbus_message_iter_close_container (&iter, &array_iter))
+    _dbus_assert_not_reached ("no memory");
+
+  /* one element the slow way first, so the block needs padding */
+  tag = padded[0].tag;
+  count = padded[0].count;
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "(yq)",
+                                         &array_iter) ||
+      !dbus_message_iter_open_container (&array_iter, DBUS_TYPE_STRUCT, NULL,
+                                         &struct_iter) ||
+      !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_BYTE, &tag) ||
+      !dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_UINT16, &count) ||
+      !dbus_message_iter_close_container (&array_iter, &struct_iter) ||
+      !dbus_message_iter_append_fixed_struct_array (&array_iter, &padded[1],
+                                                    sizeof (FixedStructPadded),
+                                                    1) ||
+      !dbus_message_iter_close_container (&iter, &array_iter))
+    _dbus_assert_not_reached ("no memory");
+
+  dbus_message_set_serial (message, 1);
+
+  if (!dbus_message_marshal (message, &marshalled, &marshalled_len))
+    _dbus_assert_not_reached ("no memory");
+
+  copy = dbus_message_demarshal (marshalled, marshalled_len, NULL);
+  if (copy == NULL)
+    _dbus_assert_not_reached ("bulk-written structs did not validate");
+
+  dbus_free (marshalled);
+  dbus_message_unref (message);
+
+  dbus_message_iter_init (copy, &iter);
+  dbus_message_iter_recurse (&iter, &array_iter);
+
+  n = 0;
+  if (dbus_message_iter_get_fixed_struct_array (&array_iter, NULL,
+                                                sizeof (FixedStructSample), &n))
+    _dbus_assert_not_reached ("three structs fit in no room");
+  _dbus_assert (n == 3);
+
+  if (!dbus_message_iter_get_fixed_struct_array (&array_iter, read_samples,
+                                                 sizeof (FixedStructSample), &n))
+    _dbus_assert_not_reached ("three structs did not fit in three");
+  _dbus_assert (n == 3);
+  check_fixed_struct_samples (samples, read_samples, 3);
+
+  dbus_message_iter_next (&iter);
+  dbus_message_iter_recurse (&iter, &array_iter);
+
+  n = 2;
+  if (!dbus_message_iter_get_fixed_struct_array (&array_iter, read_padded,
+                                                 sizeof (FixedStructPadded), &n))
+    _dbus_assert_not_reached ("two structs did not fit in two");
+  _dbus_assert (n == 2);
+  _dbus_assert (read_padded[0].tag == 'a' && read_padded[0].count == 0x1234);
+  _dbus_assert (read_padded[1].tag == 'b' && read_padded[1].count == 0x5678);
+
+  /* from part way through the array */
+  dbus_message_iter_next (&array_iter);
+  n = 2;
+  if (!dbus_message_iter_get_fixed_struct_array (&array_iter, read_padded,
+                                                 sizeof (FixedStructPadded), &n))
+    _dbus_assert_not_reached ("one struct did not fit in two");
+  _dbus_assert (n == 1);
+  _dbus_assert (read_padded[0].tag == 'b' && read_padded[0].count == 0x5678);
+
+  dbus_message_unref (copy);
+
+  /* in the other byte order, checking against reading value by value */
+  {
+    DBusString types, values, element_type;
+    DBusTypeWriter writer, sub_writer;
+    DBusTypeReader reader, sub_reader, struct_reader;
+    int byte_order;
+    dbus_int32_t id;
+
+    byte_order = DBUS_COMPILER_BYTE_ORDER == DBUS_LITTLE_ENDIAN ?
+      DBUS_BIG_ENDIAN : DBUS_LITTLE_ENDIAN;
+
+    if (!_dbus_string_init (&types) || !_dbus_string_init (&values))
+      _dbus_assert_not_reached ("no memory");
+    _dbus_string_init_const (&element_type, "(iid)");
+
+    _dbus_type_writer_init (&writer, byte_order, &types, 0, &values, 0);
+    if (!_dbus_type_writer_recurse (&writer, DBUS_TYPE_ARRAY, &element_type, 0,
+                                    &sub_writer) ||
+        !_dbus_type_writer_write_fixed_struct_multi (&sub_writer, samples,
+                                                     sizeof (FixedStructSample),
+                                                     3) ||
+        !_dbus_type_writer_unrecurse (&writer, &sub_writer))
+      _dbus_assert_not_reached ("no memory");
+
+    _dbus_type_reader_init (&reader, byte_order, &types, 0, &values, 0);
+    _dbus_type_reader_recurse (&reader, &sub_reader);
+
+    n = 3;
+    if (!_dbus_type_reader_read_fixed_struct_multi (&sub_reader, read_samples,
+                                                    sizeof (FixedStructSample), &n))
+      _dbus_assert_not_reached ("three structs did not fit in three");
+    _dbus_assert (n == 3);
+    check_fixed_struct_samples (samples, read_samples, 3);
+
+    _dbus_type_reader_next (&sub_reader);
+    _dbus_type_reader_recurse (&sub_reader, &struct_reader);
+    _dbus_type_reader_read_basic (&struct_reader, &id);
+    _dbus_assert (id == samples[1].id);
+
+    _dbus_string_free (&types);
+    _dbus_string_free (&values);
+  }
+}
+
+/* Appends the test dictionary with containers, entry by entry */
+static void
+append_variant_dict_slowly (DBusMessageIter *iter)
+{
+  DBusMessageIter dict_iter, entry_iter, variant_iter, array_iter;
+  const char *v_STRING;
+  dbus_uint32_t v_UINT32;
+  dbus_bool_t v_BOOLEAN;
+  double v_DOUBLE;
+  const dbus_int32_t ints[] = { 7, 8, 9 };
+  const dbus_int32_t *ints_p = ints;
+
+  if (!dbus_message_iter_open_container (iter, DBUS_TYPE_ARRAY, "{sv}",
+                                         &dict_iter))
+    _dbus_assert_not_reached ("no memory");
+
+#define APPEND_ENTRY(key, type, sig, value_p)                                     \
+  v_STRING = key;                                                               \
+  if (!dbus_message_iter_open_container (&dict_iter, DBUS_TYPE_DICT_ENTRY, NULL, \
+                                         &entry_iter) ||                        \
+      !dbus_message_iter_append_basic (&entry_iter, DBUS_TYPE_STRING, &v_STRING) || \
+      !dbus_message_iter_open_container (&entry_iter, DBUS_TYPE_VARIANT, sig,   \
+                                         &variant_iter) ||                      \
+      !dbus_message_iter_append_basic (&variant_iter, type, value_p) ||         \
+      !dbus_message_iter_close_container (&entry_iter, &variant_iter) ||        \
+      !dbus_message_iter_close_container (&dict_iter, &entry_iter))             \
+    _dbus_assert_not_reached ("no memory");
+
+  v_BOOLEAN = TRUE;
+  APPEND_ENTRY ("Online", DBUS_TYPE_BOOLEAN, "b", &v_BOOLEAN);
+
+  v_STRING = "Ints";
+  if (!dbus_message_iter_open_container (&dict_iter, DBUS_TYPE_DICT_ENTRY, NULL,
+                                         &entry_iter) ||
+      !dbus_message_iter_append_basic (&entry_iter, DBUS_TYPE_STRING, &v_STRING) ||
+      !dbus_message_iter_open_container (&entry_iter, DBUS_TYPE_VARIANT, "ai",
+                                         &variant_iter) ||
+      !dbus_message_iter_open_container (&variant_iter, DBUS_TYPE_ARRAY, "i",
+                                         &array_iter) ||
+      !dbus_message_iter_append_fixed_array (&array_iter, DBUS_TYPE_INT32,
+                                             &ints_p, 3) ||
+      !dbus_message_iter_close_container (&variant_iter, &array_iter) ||
+      !dbus_message_iter_close_container (&entry_iter, &variant_iter) ||
+      !dbus_message_iter_close_container (&dict_iter, &entry_iter))
+    _dbus_assert_not_reached ("no memory");
+
+  {
+    const char *v_NAME = "Test";
+    APPEND_ENTRY ("Name", DBUS_TYPE_STRING, "s", &v_NAME);
+  }
+
+  v_DOUBLE = 2.5;
+  APPEND_ENTRY ("Level", DBUS_TYPE_DOUBLE, "d", &v_DOUBLE);
+
+  v_UINT32 = 42;
+  APPEND_ENTRY ("Count", DBUS_TYPE_UINT32, "u", &v_UINT32);
+
+#undef APPEND_ENTRY
+
+  if (!dbus_message_iter_close_container (iter, &dict_iter))
+    _dbus_assert_not_reached ("no memory");
+}
+
+/* The same dictionary with the basic-typed entries written directly */
+static void
+append_variant_dict_quickly (DBusMessageIter *iter)
+{
+  DBusMessageIter dict_iter, entry_iter, variant_iter, array_iter;
+  const char *v_STRING;
+  dbus_uint32_t v_UINT32;
+  dbus_bool_t v_BOOLEAN;
+  double v_DOUBLE;
+  const dbus_int32_t ints[] = { 7, 8, 9 };
+  const dbus_int32_t *ints_p = ints;
+
+  v_BOOLEAN = TRUE;
+  if (!dbus_message_iter_open_container (iter, DBUS_TYPE_ARRAY, "{sv}",
+                                         &dict_iter) ||
+      !dbus_message_iter_append_variant_entry (&dict_iter, "Online",
+                                               DBUS_TYPE_BOOLEAN, &v_BOOLEAN))
+    _dbus_assert_not_reached ("no memory");
+
+  /* a container-typed value goes in the usual way, in between */
+  v_STRING = "Ints";
+  if (!dbus_message_iter_open_container (&dict_iter, DBUS_TYPE_DICT_ENTRY, NULL,
+                                         &entry_iter) ||
+      !dbus_message_iter_append_basic (&entry_iter, DBUS_TYPE_STRING, &v_STRING) ||
+      !dbus_message_iter_open_container (&entry_iter, DBUS_TYPE_VARIANT, "ai",
+                                         &variant_iter) ||
+      !dbus_message_iter_open_container (&variant_iter, DBUS_TYPE_ARRAY, "i",
+                                         &array_iter) ||
+      !dbus_message_iter_append_fixed_array (&array_iter, DBUS_TYPE_INT32,
+                                             &ints_p, 3) ||
+      !dbus_message_iter_close_container (&variant_iter, &array_iter) ||
+      !dbus_message_iter_close_container (&entry_iter, &variant_iter) ||
+      !dbus_message_iter_close_container (&dict_iter, &entry_iter))
+    _dbus_assert_not_reached ("no memory");
+
+  v_STRING = "Test";
+  v_DOUBLE = 2.5;
+  v_UINT32 = 42;
+  if (!dbus_message_iter_append_variant_entry (&dict_iter, "Name",
+                                               DBUS_TYPE_STRING, &v_STRING) ||
+      !dbus_message_iter_append_variant_entry (&dict_iter, "Level",
+                                               DBUS_TYPE_DOUBLE, &v_DOUBLE) ||
+      !dbus_message_iter_append_variant_entry (&dict_iter, "Count",
+                                               DBUS_TYPE_UINT32, &v_UINT32) ||
+      !dbus_message_iter_close_container (iter, &dict_iter))
+    _dbus_assert_not_reached ("no memory");
+}
+
+/* String arrays should be readable in place, in either byte order,
+ * and dbus_message_get_args() should still hand out copies of them
+ */
+static void
+check_string_arrays (void)
+{
+  static const char *strings[] = { "", "a", "bc", "def", "ghij", "klmno" };
+  const char *read_strings[_DBUS_N_ELEMENTS (strings)];
+  const char **v_ARRAY;
+  char **copied;
+  int n_copied;
+  DBusMessage *message;
+  DBusMessageIter iter, array_iter;
+  DBusString signature;
+  unsigned char v_BYTE;
+  int n;
+  int i;
+
+  i = 0;
+  while (i < 2)
+    {
+      message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                         "Foo.TestInterface", "TestSignal");
+      if (message == NULL)
+        _dbus_assert_not_reached ("no memory");
+
+      /* a one-byte argument first, so the arrays need padding */
+      v_BYTE = 42;
+      v_ARRAY = strings;
+      if (!dbus_message_append_args (message,
+                                     DBUS_TYPE_BYTE, &v_BYTE,
+                                     DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+                                     &v_ARRAY, _DBUS_N_ELEMENTS (strings),
+                                     DBUS_TYPE_ARRAY, DBUS_TYPE_OBJECT_PATH,
+                                     &v_ARRAY, 0,
+                                     DBUS_TYPE_INVALID))
+        _dbus_assert_not_reached ("no memory");
+
+      /* the second time round, left in the other byte order as if
+       * passed on by the bus
+       */
+      if (i == 1)
+        {
+          int opposite;
+
+          opposite = DBUS_COMPILER_BYTE_ORDER == DBUS_LITTLE_ENDIAN ?
+            DBUS_BIG_ENDIAN : DBUS_LITTLE_ENDIAN;
+
+          dbus_message_set_serial (message, 1);
+          dbus_message_lock (message);
+
+          _dbus_string_init_const (&signature,
+                                   dbus_message_get_signature (message));
+          _dbus_marshal_byteswap (&signature, 0, DBUS_COMPILER_BYTE_ORDER,
+                                  opposite, &message->body, 0);
+          _dbus_header_byteswap (&message->header, opposite);
+          message->byte_order = opposite;
+          message->keep_byte_order = TRUE;
+        }
+
+      dbus_message_iter_init (message, &iter);
+      dbus_message_iter_next (&iter);
+      dbus_message_iter_recurse (&iter, &array_iter);
+
+      n = 0;
+      _dbus_assert (!dbus_message_iter_get_string_array (&array_iter, NULL, &n));
+      _dbus_assert (n == _DBUS_N_ELEMENTS (strings));
+
+      n = 3;
+      _dbus_assert (!dbus_message_iter_get_string_array (&array_iter,
+                                                         read_strings, &n));
+      _dbus_assert (n == _DBUS_N_ELEMENTS (strings));
+      _dbus_assert (strcmp (read_strings[2], "bc") == 0);
+
+      if (!dbus_message_iter_get_string_array (&array_iter, read_strings, &n))
+        _dbus_assert_not_reached ("strings didn't fit");
+      _dbus_assert (n == _DBUS_N_ELEMENTS (strings));
+      for (n = 0; n < (int) _DBUS_N_ELEMENTS (strings); n++)
+        _dbus_assert (strcmp (read_strings[n], strings[n]) == 0);
+
+      /* from the current element on */
+      dbus_message_iter_next (&array_iter);
+      dbus_message_iter_next (&array_iter);
+      n = _DBUS_N_ELEMENTS (strings);
+      if (!dbus_message_iter_get_string_array (&array_iter, read_strings, &n))
+        _dbus_assert_not_reached ("strings didn't fit");
+      _dbus_assert (n == _DBUS_N_ELEMENTS (strings) - 2);
+      _dbus_assert (strcmp (read_strings[0], "bc") == 0);
+      _dbus_assert (strcmp (read_strings[n - 1], "klmno") == 0);
+
+      dbus_message_iter_next (&iter);
+      dbus_message_iter_recurse (&iter, &array_iter);
+      n = 1;
+      if (!dbus_message_iter_get_string_array (&array_iter, read_strings, &n))
+        _dbus_assert_not_reached ("empty array didn't fit");
+      _dbus_assert (n == 0);
+
+      if (!dbus_message_get_args (message, NULL,
+                                  DBUS_TYPE_BYTE, &v_BYTE,
+                                  DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+                                  &copied, &n_copied,
+                                  DBUS_TYPE_INVALID))
+        _dbus_assert_not_reached ("no memory");
+      _dbus_assert (v_BYTE == 42);
+      _dbus_assert (n_copied == _DBUS_N_ELEMENTS (strings));
+      for (n = 0; n < n_copied; n++)
+        _dbus_assert (strcmp (copied[n], strings[n]) == 0);
+      _dbus_assert (copied[n_copied] == NULL);
+      dbus_free_string_array (copied);
+
+      dbus_message_unref (message);
+      i++;
+    }
+}
+
+/* Dictionary entries written directly should come out byte for byte
+ * as the containers would write them, and be found by key whatever
+ * comes before them
+ */
+static void
+check_variant_dicts (void)
+{
+  DBusMessage *slow;
+  DBusMessage *quick;
+  DBusMessage *copy;
+  DBusMessageIter iter, dict_iter, value_iter;
+  const char *v_STRING;
+  dbus_uint32_t v_UINT32;
+  double v_DOUBLE;
+  char *marshalled;
+  int marshalled_len;
+
+  slow = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                  "Foo.TestInterface", "TestSignal");
+  quick = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                   "Foo.TestInterface", "TestSignal");
+  if (slow == NULL || quick == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  /* a short argument first, so the dictionary needs padding */
+  v_STRING = "x";
+  if (!dbus_message_append_args (slow, DBUS_TYPE_SIGNATURE, &v_STRING,
+                                 DBUS_TYPE_INVALID) ||
+      !dbus_message_append_args (quick, DBUS_TYPE_SIGNATURE, &v_STRING,
+                                 DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("no memory");
+
+  dbus_message_iter_init_append (slow, &iter);
+  append_variant_dict_slowly (&iter);
+  dbus_message_iter_init_append (quick, &iter);
+  append_variant_dict_quickly (&iter);
+
+  _dbus_assert (strcmp (dbus_message_get_signature (quick), "ga{sv}") == 0);
+  _dbus_assert (_dbus_string_equal (&slow->body, &quick->body));
+  dbus_message_unref (slow);
+
+  dbus_message_set_serial (quick, 1);
+  if (!dbus_message_marshal (quick, &marshalled, &marshalled_len))
+    _dbus_assert_not_reached ("no memory");
+
+  copy = dbus_message_demarshal (marshalled, marshalled_len, NULL);
+  if (copy == NULL)
+    _dbus_assert_not_reached ("directly written dict entries did not validate");
+
+  dbus_free (marshalled);
+  dbus_message_unref (quick);
+
+  dbus_message_iter_init (copy, &iter);
+  dbus_message_iter_next (&iter);
+  dbus_message_iter_recurse (&iter, &dict_iter);
+
+  if (!dbus_message_iter_find_variant_entry (&dict_iter, "Count", &value_iter))
+    _dbus_assert_not_reached ("Count not found");
+  _dbus_assert (dbus_message_iter_get_arg_type (&value_iter) == DBUS_TYPE_UINT32);
+  dbus_message_iter_get_basic (&value_iter, &v_UINT32);
+  _dbus_assert (v_UINT32 == 42);
+
+  if (!dbus_message_iter_find_variant_entry (&dict_iter, "Level", &value_iter))
+    _dbus_assert_not_reached ("Level not found");
+  dbus_message_iter_get_basic (&value_iter, &v_DOUBLE);
+  _dbus_assert (v_DOUBLE == 2.5);
+
+  if (!dbus_message_iter_find_variant_entry (&dict_iter, "Ints", &value_iter))
+    _dbus_assert_not_reached ("Ints not found");
+  _dbus_assert (dbus_message_iter_get_arg_type (&value_iter) == DBUS_TYPE_ARRAY);
+
+  _dbus_assert (!dbus_message_iter_find_variant_entry (&dict_iter, "Nam", &value_iter));
+  _dbus_assert (!dbus_message_iter_find_variant_entry (&dict_iter, "Names", &value_iter));
+
+  /* only from the current entry on */
+  dbus_message_iter_next (&dict_iter);
+  _dbus_assert (!dbus_message_iter_find_variant_entry (&dict_iter, "Online", &value_iter));
+  if (!dbus_message_iter_find_variant_entry (&dict_iter, "Name", &value_iter))
+    _dbus_assert_not_reached ("Name not found");
+  dbus_message_iter_get_basic (&value_iter, &v_STRING);
+  _dbus_assert (strcmp (v_STRING, "Test") == 0);
+
+  dbus_message_unref (copy);
+
+  /* in the other byte order, through the marshaller */
+  {
+    DBusString types, values, element_type;
+    DBusTypeWriter writer, sub_writer;
+    DBusTypeReader reader, sub_reader, value_reader;
+    int byte_order;
+
+    byte_order = DBUS_COMPILER_BYTE_ORDER == DBUS_LITTLE_ENDIAN ?
+      DBUS_BIG_ENDIAN : DBUS_LITTLE_ENDIAN;
+
+    if (!_dbus_string_init (&types) || !_dbus_string_init (&values))
+      _dbus_assert_not_reached ("no memory");
+    _dbus_string_init_const (&element_type, "{sv}");
+
+    v_STRING = "Test";
+    v_UINT32 = 42;
+    _dbus_type_writer_init (&writer, byte_order, &types, 0, &values, 0);
+    if (!_dbus_type_writer_recurse (&writer, DBUS_TYPE_ARRAY, &element_type, 0,
+                                    &sub_writer) ||
+        !_dbus_type_writer_write_variant_entry (&sub_writer, "Name",
+                                                DBUS_TYPE_STRING, &v_STRING) ||
+        !_dbus_type_writer_write_variant_entry (&sub_writer, "Count",
+                                                DBUS_TYPE_UINT32, &v_UINT32) ||
+        !_dbus_type_writer_unrecurse (&writer, &sub_writer))
+      _dbus_assert_not_reached ("no memory");
+
+    _dbus_type_reader_init (&reader, byte_order, &types, 0, &values, 0);
+    _dbus_type_reader_recurse (&reader, &sub_reader);
+
+    v_UINT32 = 0;
+    if (!_dbus_type_reader_find_variant_entry (&sub_reader, "Count", &value_reader))
+      _dbus_assert_not_reached ("Count not found");
+    _dbus_type_reader_read_basic (&value_reader, &v_UINT32);
+    _dbus_assert (v_UINT32 == 42);
+
+    _dbus_string_free (&types);
+    _dbus_string_free (&values);
+  }
+}
+
+/**
+ * @ingroup DBusMessageInternals
+ * Unit test for DBusMessage.
+ *
+ * @returns #TRUE on success.
+ */
+dbus_bool_t
+_dbus_message_test (const char *test_data_dir)
+{
+  DBusMessage *message, *message_without_unix_fds;
+  DBusMessageLoader *loader;
+  int i;
+  const char *data;
+  DBusMessage *copy;
+  const char *name1;
+  const char *name2;
+  const dbus_uint32_t our_uint32_array[] =
+    { 0x12345678, 0x23456781, 0x34567812, 0x45678123 };
+  const dbus_int32_t our_int32_array[] =
+    { 0x12345678, -0x23456781, 0x34567812, -0x45678123 };
+  const dbus_uint32_t *v_ARRAY_UINT32 = our_uint32_array;
+  const dbus_int32_t *v_ARRAY_INT32 = our_int32_array;
+#ifdef DBUS_HAVE_INT64
+  const dbus_uint64_t our_uint64_array[] =
+    { 0x12345678, 0x23456781, 0x34567812, 0x45678123 };
+  const dbus_int64_t our_int64_array[] =
+    { 0x12345678, -0x23456781, 0x34567812, -0x45678123 };
+  const dbus_uint64_t *v_ARRAY_UINT64 = our_uint64_array;
+  const dbus_int64_t *v_ARRAY_INT64 = our_int64_array;
+#endif
+  const char *our_string_array[] = { "Foo", "bar", "", "woo woo woo woo" };
+  const char **v_ARRAY_STRING = our_string_array;
+  const double our_double_array[] = { 0.1234, 9876.54321, -300.0 };
+  const double *v_ARRAY_DOUBLE = our_double_array;
+  const unsigned char our_byte_array[] = { 'a', 'b', 'c', 234 };
+  const unsigned char *v_ARRAY_BYTE = our_byte_array;
+  const dbus_bool_t our_boolean_array[] = { TRUE, FALSE, TRUE, TRUE, FALSE };
+  const dbus_bool_t *v_ARRAY_BOOLEAN = our_boolean_array;
+  char sig[64];
+  const char *s;
+  const char *v_STRING;
+  double v_DOUBLE;
+  dbus_int16_t v_INT16;
+  dbus_uint16_t v_UINT16;
+  dbus_int32_t v_INT32;
+  dbus_uint32_t v_UINT32;
+#ifdef DBUS_HAVE_INT64
+  dbus_int64_t v_INT64;
+  dbus_uint64_t v_UINT64;
+#endif
+  unsigned char v_BYTE;
+  unsigned char v2_BYTE;
+  dbus_bool_t v_BOOLEAN;
+  DBusMessageIter iter, array_iter, struct_iter;
+#ifdef HAVE_UNIX_FD_PASSING
+  int v_UNIX_FD;
+#endif
+  char **decomposed;
+
+  message = dbus_message_new_method_call ("org.freedesktop.DBus.TestService",
+                                          "/org/freedesktop/TestPath",
+                                          "Foo.TestInterface",
+                                          "TestMethod");
+  _dbus_assert (dbus_message_has_destination (message, "org.freedesktop.DBus.TestService"));
+  _dbus_assert (dbus_message_is_method_call (message, "Foo.TestInterface",
+                                             "TestMethod"));
+  _dbus_assert (strcmp (dbus_message_get_path (message),
+                        "/org/freedesktop/TestPath") == 0);
+  dbus_message_set_serial (message, 1234);
+
+  /* string length including nul byte not a multiple of 4 */
+  if (!dbus_message_set_sender (message, "org.foo.bar1"))
+    _dbus_assert_not_reached ("out of memory");
+
+  _dbus_assert (dbus_message_has_sender (message, "org.foo.bar1"));
+  dbus_message_set_reply_serial (message, 5678);
+
+  _dbus_verbose_bytes_of_string (&message->header.data, 0,
+                                 _dbus_string_get_length (&message->header.data));
+  _dbus_verbose_bytes_of_string (&message->body, 0,
+                                 _dbus_string_get_length (&message->body));
+
+  if (!dbus_message_set_sender (message, NULL))
+    _dbus_assert_not_reached ("out of memory");
+
+
+  _dbus_verbose_bytes_of_string (&message->header.data, 0,
+                                 _dbus_string_get_length (&message->header.data));
+  _dbus_verbose_bytes_of_string (&message->body, 0,
+                                 _dbus_string_get_length (&message->body));
+
+
+  _dbus_assert (!dbus_message_has_sender (message, "org.foo.bar1"));
+  _dbus_assert (dbus_message_get_serial (message) == 1234);
+  _dbus_assert (dbus_message_get_reply_serial (message) == 5678);
+  _dbus_assert (dbus_message_has_destination (message, "org.freedesktop.DBus.TestService"));
+
+  _dbus_assert (dbus_message_get_no_reply (message) == FALSE);
+  dbus_message_set_no_reply (message, TRUE);
+  _dbus_assert (dbus_message_get_no_reply (message) == TRUE);
+  dbus_message_set_no_reply (message, FALSE);
+  _dbus_assert (dbus_message_get_no_reply (message) == FALSE);
+
+  /* Set/get some header fields */
+
+  if (!dbus_message_set_path (message, "/foo"))
+    _dbus_assert_not_reached ("out of memory");
+  _dbus_assert (strcmp (dbus_message_get_path (message),
+                        "/foo") == 0);
+
+  if (!dbus_message_set_interface (message, "org.Foo"))
+    _dbus_assert_not_reached ("out of memory");
+  _dbus_assert (strcmp (dbus_message_get_interface (message),
+                        "org.Foo") == 0);
+
+  if (!dbus_message_set_member (message, "Bar"))
+    _dbus_assert_not_reached ("out of memory");
+  _dbus_assert (strcmp (dbus_message_get_member (message),
+                        "Bar") == 0);
+
+  /* Set/get them with longer values */
+  if (!dbus_message_set_path (message, "/foo/bar"))
+    _dbus_assert_not_reached ("out of memory");
+  _dbus_assert (strcmp (dbus_message_get_path (message),
+                        "/foo/bar") == 0);
+
+  if (!dbus_message_set_interface (message, "org.Foo.Bar"))
+    _dbus_assert_not_reached ("out of memory");
+  _dbus_assert (strcmp (dbus_message_get_interface (message),
+                        "org.Foo.Bar") == 0);
+
+  if (!dbus_message_set_member (message, "BarFoo"))
+    _dbus_assert_not_reached ("out of memory");
+  _dbus_assert (strcmp (dbus_message_get_member (message),
+                        "BarFoo") == 0);
+
+  /* Realloc shorter again */
+
+  if (!dbus_message_set_path (message, "/foo"))
+    _dbus_assert_not_reached ("out of memory");
+  _dbus_assert (strcmp (dbus_message_get_path (message),
+                        "/foo") == 0);
+
+  if (!dbus_message_set_interface (message, "org.Foo"))
+    _dbus_assert_not_reached ("out of memory");
+  _dbus_assert (strcmp (dbus_message_get_interface (message),
+                        "org.Foo") == 0);
+
+  if (!dbus_message_set_member (message, "Bar"))
+    _dbus_assert_not_reached ("out of memory");
+  _dbus_assert (strcmp (dbus_message_get_member (message),
+                        "Bar") == 0);
+
+  /* Path decomposing */
+  dbus_message_set_path (message, NULL);
+  dbus_message_get_path_decomposed (message, &decomposed);
+  _dbus_assert (decomposed == NULL);
+  dbus_free_string_array (decomposed);
+
+  dbus_message_set_path (message, "/");
+  dbus_message_get_path_decomposed (message, &decomposed);
+  _dbus_assert (decomposed != NULL);
+  _dbus_assert (decomposed[0] == NULL);
+  dbus_free_string_array (decomposed);
+
+  dbus_message_set_path (message, "/a/b");
+  dbus_message_get_path_decomposed (message, &decomposed);
+  _dbus_assert (decomposed != NULL);
+  _dbus_assert (strcmp (decomposed[0], "a") == 0);
+  _dbus_assert (strcmp (decomposed[1], "b") == 0);
+  _dbus_assert (decomposed[2] == NULL);
+  dbus_free_string_array (decomposed);
+
+  dbus_message_set_path (message, "/spam/eggs");
+  dbus_message_get_path_decomposed (message, &decomposed);
+  _dbus_assert (decomposed != NULL);
+  _dbus_assert (strcmp (decomposed[0], "spam") == 0);
+  _dbus_assert (strcmp (decomposed[1], "eggs") == 0);
+  _dbus_assert (decomposed[2] == NULL);
+  dbus_free_string_array (decomposed);
+
+  /* Path iterating */
+  {
+    DBusObjectPathIter path_iter;
+    const char *element;
+    int len;
+
+    _dbus_assert (dbus_message_path_iter_init (message, &path_iter));
+    _dbus_assert (dbus_message_path_iter_next (&path_iter, &element, &len));
+    _dbus_assert (len == 4 && strncmp (element, "spam", len) == 0);
+    _dbus_assert (dbus_message_path_iter_next (&path_iter, &element, &len));
+    _dbus_assert (len == 4 && strncmp (element, "eggs", len) == 0);
+    _dbus_assert (!dbus_message_path_iter_next (&path_iter, &element, &len));
+
+    dbus_message_set_path (message, "/");
+    _dbus_assert (dbus_message_path_iter_init (message, &path_iter));
+    _dbus_assert (!dbus_message_path_iter_next (&path_iter, &element, &len));
+
+    dbus_message_set_path (message, NULL);
+    _dbus_assert (!dbus_message_path_iter_init (message, &path_iter));
+  }
+
+  dbus_message_unref (message);
+
+  /* Test the vararg functions */
+  message = dbus_message_new_method_call ("org.freedesktop.DBus.TestService",
+                                          "/org/freedesktop/TestPath",
+                                          "Foo.TestInterface",
+                                          "TestMethod");
+  dbus_message_set_serial (message, 1);
+  dbus_message_set_reply_serial (message, 5678);
+
+  v_INT16 = -0x123;
+  v_UINT16 = 0x123;
+  v_INT32 = -0x12345678;
+  v_UINT32 = 0x12300042;
+#ifdef DBUS_HAVE_INT64
+  v_INT64 = DBUS_INT64_CONSTANT (-0x123456789abcd);
+  v_UINT64 = DBUS_UINT64_CONSTANT (0x123456789abcd);
+#endif
+  v_STRING = "Test string";
+  v_DOUBLE = 3.14159;
+  v_BOOLEAN = TRUE;
+  v_BYTE = 42;
+  v2_BYTE = 24;
+#ifdef HAVE_UNIX_FD_PASSING
+  v_UNIX_FD = 1;
+#endif
+
+  dbus_message_append_args (message,
+                            DBUS_TYPE_INT16, &v_INT16,
+                            DBUS_TYPE_UINT16, &v_UINT16,
+			    DBUS_TYPE_INT32, &v_INT32,
+                            DBUS_TYPE_UINT32, &v_UINT32,
+#ifdef DBUS_HAVE_INT64
+                            DBUS_TYPE_INT64, &v_INT64,
+                            DBUS_TYPE_UINT64, &v_UINT64,
+#endif
+			    DBUS_TYPE_STRING, &v_STRING,
+			    DBUS_TYPE_DOUBLE, &v_DOUBLE,
+			    DBUS_TYPE_BOOLEAN, &v_BOOLEAN,
+			    DBUS_TYPE_BYTE, &v_BYTE,
+			    DBUS_TYPE_BYTE, &v2_BYTE,
+			    DBUS_TYPE_ARRAY, DBUS_TYPE_UINT32, &v_ARRAY_UINT32,
+                            _DBUS_N_ELEMENTS (our_uint32_array),
+                            DBUS_TYPE_ARRAY, DBUS_TYPE_INT32, &v_ARRAY_INT32,
+                            _DBUS_N_ELEMENTS (our_int32_array),
+#ifdef DBUS_HAVE_INT64
+                            DBUS_TYPE_ARRAY, DBUS_TYPE_UINT64, &v_ARRAY_UINT64,
+                            _DBUS_N_ELEMENTS (our_uint64_array),
+                            DBUS_TYPE_ARRAY, DBUS_TYPE_INT64, &v_ARRAY_INT64,
+                            _DBUS_N_ELEMENTS (our_int64_array),
+#endif
+                            DBUS_TYPE_ARRAY, DBUS_TYPE_DOUBLE, &v_ARRAY_DOUBLE,
+                            _DBUS_N_ELEMENTS (our_double_array),
+                            DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &v_ARRAY_BYTE,
+                            _DBUS_N_ELEMENTS (our_byte_array),
+                            DBUS_TYPE_ARRAY, DBUS_TYPE_BOOLEAN, &v_ARRAY_BOOLEAN,
+                            _DBUS_N_ELEMENTS (our_boolean_array),
+                            DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &v_ARRAY_STRING,
                             _DBUS_N_ELEMENTS (our_string_array),
 
-			    DBUS_TYPE_INVALID);
+			    DBUS_TYPE_INVALID);
+
+  i = 0;
+  sig[i++] = DBUS_TYPE_INT16;
+  sig[i++] = DBUS_TYPE_UINT16;
+  sig[i++] = DBUS_TYPE_INT32;
+  sig[i++] = DBUS_TYPE_UINT32;
+#ifdef DBUS_HAVE_INT64
+  sig[i++] = DBUS_TYPE_INT64;
+  sig[i++] = DBUS_TYPE_UINT64;
+#endif
+  sig[i++] = DBUS_TYPE_STRING;
+  sig[i++] = DBUS_TYPE_DOUBLE;
+  sig[i++] = DBUS_TYPE_BOOLEAN;
+  sig[i++] = DBUS_TYPE_BYTE;
+  sig[i++] = DBUS_TYPE_BYTE;
+  sig[i++] = DBUS_TYPE_ARRAY;
+  sig[i++] = DBUS_TYPE_UINT32;
+  sig[i++] = DBUS_TYPE_ARRAY;
+  sig[i++] = DBUS_TYPE_INT32;
+#ifdef DBUS_HAVE_INT64
+  sig[i++] = DBUS_TYPE_ARRAY;
+  sig[i++] = DBUS_TYPE_UINT64;
+  sig[i++] = DBUS_TYPE_ARRAY;
+  sig[i++] = DBUS_TYPE_INT64;
+#endif
+  sig[i++] = DBUS_TYPE_ARRAY;
+  sig[i++] = DBUS_TYPE_DOUBLE;
+  sig[i++] = DBUS_TYPE_ARRAY;
+  sig[i++] = DBUS_TYPE_BYTE;
+  sig[i++] = DBUS_TYPE_ARRAY;
+  sig[i++] = DBUS_TYPE_BOOLEAN;
+  sig[i++] = DBUS_TYPE_ARRAY;
+  sig[i++] = DBUS_TYPE_STRING;
+
+  message_without_unix_fds = dbus_message_copy(message);
+  _dbus_assert(message_without_unix_fds);
+#ifdef HAVE_UNIX_FD_PASSING
+  dbus_message_append_args (message,
+                            DBUS_TYPE_UNIX_FD, &v_UNIX_FD,
+			    DBUS_TYPE_INVALID);
+  sig[i++] = DBUS_TYPE_UNIX_FD;
+#endif
+  sig[i++] = DBUS_TYPE_INVALID;
+
+  _dbus_assert (i < (int) _DBUS_N_ELEMENTS (sig));
+
+  _dbus_verbose ("HEADER\n");
+  _dbus_verbose_bytes_of_string (&message->header.data, 0,
+                                 _dbus_string_get_length (&message->header.data));
+  _dbus_verbose ("BODY\n");
+  _dbus_verbose_bytes_of_string (&message->body, 0,
+                                 _dbus_string_get_length (&message->body));
+
+  _dbus_verbose ("Signature expected \"%s\" actual \"%s\"\n",
+                 sig, dbus_message_get_signature (message));
+
+  s = dbus_message_get_signature (message);
+
+  _dbus_assert (dbus_message_has_signature (message, sig));
+  _dbus_assert (strcmp (s, sig) == 0);
+
+  verify_test_message (message);
+
+  copy = dbus_message_copy (message);
+
+  _dbus_assert (dbus_message_get_reply_serial (message) ==
+                dbus_message_get_reply_serial (copy));
+  _dbus_assert (message->header.padding == copy->header.padding);
+
+  _dbus_assert (_dbus_string_get_length (&message->header.data) ==
+                _dbus_string_get_length (&copy->header.data));
+
+  _dbus_assert (_dbus_string_get_length (&message->body) ==
+                _dbus_string_get_length (&copy->body));
+
+  verify_test_message (copy);
+
+  name1 = dbus_message_get_interface (message);
+  name2 = dbus_message_get_interface (copy);
+
+  _dbus_assert (strcmp (name1, name2) == 0);
+
+  name1 = dbus_message_get_member (message);
+  name2 = dbus_message_get_member (copy);
+
+  _dbus_assert (strcmp (name1, name2) == 0);
+
+  dbus_message_unref (copy);
+
+  /* Message loader test */
+  dbus_message_lock (message);
+  loader = _dbus_message_loader_new ();
+  
+  /* check ref/unref */
+  _dbus_message_loader_ref (loader);
+  _dbus_message_loader_unref (loader);
+
+  /* Write the header data one byte at a time */
+  data = _dbus_string_get_const_data (&message->header.data);
+  for (i = 0; i < _dbus_string_get_length (&message->header.data); i++)
+    {
+      DBusString *buffer;
+
+      _dbus_message_loader_get_buffer (loader, &buffer);
+      _dbus_string_append_byte (buffer, data[i]);
+      _dbus_message_loader_return_buffer (loader, buffer, 1);
+    }
+
+  /* Write the body data one byte at a time */
+  data = _dbus_string_get_const_data (&message->body);
+  for (i = 0; i < _dbus_string_get_length (&message->body); i++)
+    {
+      DBusString *buffer;
+
+      _dbus_message_loader_get_buffer (loader, &buffer);
+      _dbus_string_append_byte (buffer, data[i]);
+      _dbus_message_loader_return_buffer (loader, buffer, 1);
+    }
+
+#ifdef HAVE_UNIX_FD_PASSING
+  {
+    DBusString *unix_fds;
+    unsigned n_unix_fds;
+    int fd;
+    /* Write unix fd */
+    _dbus_message_loader_get_unix_fds(loader, &unix_fds, &n_unix_fds);
+    _dbus_assert(n_unix_fds > 0);
+    _dbus_assert(message->n_unix_fds == 1);
+    fd = _dbus_dup(message->unix_fds[0], NULL);
+    _dbus_assert(fd >= 0);
+    if (!_dbus_string_append_len (unix_fds, (const char *) &fd, sizeof (fd)))
+      _dbus_assert_not_reached ("no memory");
+    _dbus_message_loader_return_unix_fds(loader, unix_fds, 1);
+  }
+#endif
+
+  dbus_message_unref (message);
+
+  /* Now pop back the message */
+  if (!_dbus_message_loader_queue_messages (loader))
+    _dbus_assert_not_reached ("no memory to queue messages");
+
+  if (_dbus_message_loader_get_is_corrupted (loader))
+    _dbus_assert_not_reached ("message loader corrupted");
+
+  message = _dbus_message_loader_pop_message (loader);
+  if (!message)
+    _dbus_assert_not_reached ("received a NULL message");
+
+  if (dbus_message_get_reply_serial (message) != 5678)
+    _dbus_assert_not_reached ("reply serial fields differ");
+
+  dbus_message_unref (message);
+
+  check_loader_batch ();
+  check_loader_trust_bodies ();
+  check_loader_lazy_bodies ();
+  check_loader_keep_byte_order ();
+  check_loader_large_body ();
+  check_loader_streamed_body ();
+  check_fixed_struct_arrays ();
+  check_string_arrays ();
+  check_variant_dicts ();
+  check_iter_init_at ();
+  check_message_template ();
+  check_set_sender ();
+  check_expiry ();
+  check_marshal_in_place ();
+  check_copy_shares_body ();
+
+  {
+    /* A message freed and then re-created should come from the cache */
+    unsigned long hits, misses, new_hits, new_misses;
+
+    message = dbus_message_new_method_call ("org.freedesktop.DBus.TestService",
+                                            "/org/freedesktop/TestPath",
+                                            "Foo.TestInterface",
+                                            "TestMethod");
+    _dbus_assert (message != NULL);
+    dbus_message_unref (message);
+
+    _dbus_message_cache_get_stats (&hits, &misses);
+
+    message = dbus_message_new_method_call ("org.freedesktop.DBus.TestService",
+                                            "/org/freedesktop/TestPath",
+                                            "Foo.TestInterface",
+                                            "TestMethod");
+    _dbus_assert (message != NULL);
+
+    _dbus_message_cache_get_stats (&new_hits, &new_misses);
+    _dbus_assert (new_hits == hits + 1);
+    _dbus_assert (new_misses == misses);
+
+    dbus_message_unref (message);
+  }
+
+  /* ovveride the serial, since it was reset by dbus_message_copy() */
+  dbus_message_set_serial(message_without_unix_fds, 8901);
+
+  dbus_message_lock (message_without_unix_fds);
+
+  verify_test_message (message_without_unix_fds);
+
+    {
+      /* Marshal and demarshal the message. */
+
+      DBusMessage *message2;
+      DBusError error = DBUS_ERROR_INIT;
+      char *marshalled = NULL;
+      int len = 0;
+      char garbage_header[DBUS_MINIMUM_HEADER_SIZE] = "xxx";
+
+      if (!dbus_message_marshal (message_without_unix_fds, &marshalled, &len))
+        _dbus_assert_not_reached ("failed to marshal message");
+
+      _dbus_assert (len != 0);
+      _dbus_assert (marshalled != NULL);
+
+      _dbus_assert (dbus_message_demarshal_bytes_needed (marshalled, len) == len);
+      message2 = dbus_message_demarshal (marshalled, len, &error);
+
+      _dbus_assert (message2 != NULL);
+      _dbus_assert (!dbus_error_is_set (&error));
+      verify_test_message (message2);
+
+      dbus_message_unref (message2);
+      dbus_free (marshalled);
+
+      /* Demarshal invalid message. */
+
+      message2 = dbus_message_demarshal ("invalid", 7, &error);
+      _dbus_assert (message2 == NULL);
+      _dbus_assert (dbus_error_is_set (&error));
+      dbus_error_free (&error);
+
+      /* Demarshal invalid (empty) message. */
+
+      message2 = dbus_message_demarshal ("", 0, &error);
+      _dbus_assert (message2 == NULL);
+      _dbus_assert (dbus_error_is_set (&error));
+      dbus_error_free (&error);
+
+      /* Bytes needed to demarshal empty message: 0 (more) */
+
+      _dbus_assert (dbus_message_demarshal_bytes_needed ("", 0) == 0);
+      
+      /* Bytes needed to demarshal invalid message: -1 (error). */
+
+      _dbus_assert (dbus_message_demarshal_bytes_needed (garbage_header, DBUS_MINIMUM_HEADER_SIZE) == -1);
+    }
 
-  i = 0;
-  sig[i++] = DBUS_TYPE_INT16;
-  sig[i++] = DBUS_TYPE_UINT16;
-  sig[i++] = DBUS_TYPE_INT32;
-  sig[i++] = DBUS_TYPE_UINT32;
-#ifdef DBUS_HAVE_INT64
-  sig[i++] = DBUS_TYPE_INT64;
-  sig[i++] = DBUS_TYPE_UINT64;
-#endif
-  sig[i++] = DBUS_TYPE_STRING;
-  sig[i++] = DBUS_TYPE_DOUBLE;
-  sig[i++] = DBUS_TYPE_BOOLEAN;
-  sig[i++] = DBUS_TYPE_BYTE;
-  sig[i++] = DBUS_TYPE_BYTE;
-  sig[i++] = DBUS_TYPE_ARRAY;
-  sig[i++] = DBUS_TYPE_UINT32;
-  sig[i++] = DBUS_TYPE_ARRAY;
-  sig[i++] = DBUS_TYPE_INT32;
-#ifdef DBUS_HAVE_INT64
-  sig[i++] = DBUS_TYPE_ARRAY;
-  sig[i++] = DBUS_TYPE_UINT64;
-  sig[i++] = DBUS_TYPE_ARRAY;
-  sig[i++] = DBUS_TYPE_INT64;
-#endif
-  sig[i++] = DBUS_TYPE_ARRAY;
-  sig[i++] = DBUS_TYPE_DOUBLE;
-  sig[i++] = DBUS_TYPE_ARRAY;
-  sig[i++] = DBUS_TYPE_BYTE;
-  sig[i++] = DBUS_TYPE_ARRAY;
-  sig[i++] = DBUS_TYPE_BOOLEAN;
-  sig[i++] = DBUS_TYPE_ARRAY;
-  sig[i++] = DBUS_TYPE_STRING;
+  dbus_message_unref (message_without_unix_fds);
+  _dbus_message_loader_unref (loader);
 
-  message_without_unix_fds = dbus_message_copy(message);
-  _dbus_assert(message_without_unix_fds);
-#ifdef HAVE_UNIX_FD_PASSING
-  dbus_message_append_args (message,
-                            DBUS_TYPE_UNIX_FD, &v_UNIX_FD,
-			    DBUS_TYPE_INVALID);
-  sig[i++] = DBUS_TYPE_UNIX_FD;
-#endif
-  sig[i++] = DBUS_TYPE_INVALID;
+  check_memleaks ();
+  _dbus_check_fdleaks();
 
-  _dbus_assert (i < (int) _DBUS_N_ELEMENTS (sig));
+  /* Check that we can abandon a container */
+  message = dbus_message_new_method_call ("org.freedesktop.DBus.TestService",
+		  			  "/org/freedesktop/TestPath",
+					  "Foo.TestInterface",
+					  "Method");
 
-  _dbus_verbose ("HEADER\n");
-  _dbus_verbose_bytes_of_string (&message->header.data, 0,
-                                 _dbus_string_get_length (&message->header.data));
-  _dbus_verbose ("BODY\n");
-  _dbus_verbose_bytes_of_string (&message->body, 0,
-                                 _dbus_string_get_length (&message->body));
+  dbus_message_iter_init_append (message, &iter);
+
+  _dbus_assert (dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+			  			  (DBUS_STRUCT_BEGIN_CHAR_AS_STRING
+						   DBUS_TYPE_STRING_AS_STRING
+						   DBUS_TYPE_STRING_AS_STRING
+						   DBUS_STRUCT_END_CHAR_AS_STRING),
+						  &array_iter));
+  _dbus_assert (dbus_message_iter_open_container (&array_iter, DBUS_TYPE_STRUCT,
+			  			  NULL, &struct_iter));
+
+  s = "peaches";
+  _dbus_assert (dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
+			  			&s));
+
+  /* uh-oh, error, try and unwind */
+
+  dbus_message_iter_abandon_container (&array_iter, &struct_iter);
+  dbus_message_iter_abandon_container (&array_iter, &iter);
+
+  dbus_message_unref (message);
+
+  /* Check that we can fill arrays in place */
+  {
+    unsigned char *bytes;
+    dbus_int32_t *ints;
+    const unsigned char *read_bytes;
+    const dbus_int32_t *read_ints;
+    int n_read;
+
+    message = dbus_message_new_method_call ("org.freedesktop.DBus.TestService",
+                                            "/org/freedesktop/TestPath",
+                                            "Foo.TestInterface",
+                                            "Method");
+    if (message == NULL)
+      _dbus_assert_not_reached ("no memory");
+
+    dbus_message_iter_init_append (message, &iter);
+
+    if (!dbus_message_iter_reserve_space (&iter, 256) ||
+        !dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+                                           DBUS_TYPE_BYTE_AS_STRING,
+                                           &array_iter) ||
+        !dbus_message_iter_reserve_fixed_array (&array_iter, DBUS_TYPE_BYTE,
+                                                3, (void **) &bytes))
+      _dbus_assert_not_reached ("no memory");
+    memcpy (bytes, "abc", 3);
+    if (!dbus_message_iter_close_container (&iter, &array_iter))
+      _dbus_assert_not_reached ("no memory");
+
+    /* misaligned after the byte array, so this needs padding */
+    if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+                                           DBUS_TYPE_INT32_AS_STRING,
+                                           &array_iter) ||
+        !dbus_message_iter_reserve_fixed_array (&array_iter, DBUS_TYPE_INT32,
+                                                2, (void **) &ints))
+      _dbus_assert_not_reached ("no memory");
+    _dbus_assert (_DBUS_ALIGN_ADDRESS (ints, 4) == (void *) ints);
+    _dbus_assert (ints[0] == 0 && ints[1] == 0);
+    ints[0] = 42;
+    ints[1] = -7;
+    if (!dbus_message_iter_close_container (&iter, &array_iter))
+      _dbus_assert_not_reached ("no memory");
+
+    if (!dbus_message_get_args (message, NULL,
+                                DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &read_bytes, &n_read,
+                                DBUS_TYPE_ARRAY, DBUS_TYPE_INT32, &read_ints, &i,
+                                DBUS_TYPE_INVALID))
+      _dbus_assert_not_reached ("could not read arrays filled in place");
+
+    _dbus_assert (n_read == 3 && memcmp (read_bytes, "abc", 3) == 0);
+    _dbus_assert (i == 2 && read_ints[0] == 42 && read_ints[1] == -7);
+
+    dbus_message_unref (message);
+  }
+
+  /* Load all the sample messages from the message factory */
+  {
+    DBusMessageDataIter diter;
+    DBusMessageData mdata;
+    int count;
+
+    reset_validities_seen ();
+    
+    count = 0;
+    _dbus_message_data_iter_init (&diter);
+    
+    while (_dbus_message_data_iter_get_and_next (&diter,
+                                                 &mdata))
+      {
+        if (!dbus_internal_do_not_use_try_message_data (&mdata.data,
+                                                        mdata.expected_validity))
+          {
+            _dbus_warn ("expected validity %d and did not get it\n",
+                        mdata.expected_validity);
+            _dbus_assert_not_reached ("message data failed");
+          }
+
+        _dbus_message_data_free (&mdata);
+
+        count += 1;
+      }
+
+    printf ("%d sample messages tested\n", count);
+
+    print_validities_seen (FALSE);
+    print_validities_seen (TRUE);
+  }
+
+  check_memleaks ();
+  _dbus_check_fdleaks();
+
+  /* Now load every message in test_data_dir if we have one */
+  if (test_data_dir == NULL)
+    return TRUE;
+
+  return dbus_internal_do_not_use_foreach_message_file (test_data_dir,
+                                                        (DBusForeachMessageFileFunc)
+                                                        dbus_internal_do_not_use_try_message_file,
+                                                        NULL);  
+}
+
+
+/* The benchmark prints one tab-separated line per measurement,
+ *
+ *   BENCH <operation> <shape> <bytes> <iterations> <ns per iteration>
+ *
+ * and runs a fixed number of iterations of each, so the output only
+ * changes when the code's speed does.
+ */
+typedef struct
+{
+  const char *name;
+  int         type;     /**< type of each argument or array element */
+  dbus_bool_t is_array;
+  int         size;     /**< string length, or number of array elements */
+} BenchmarkShape;
+
+static const BenchmarkShape benchmark_shapes[] = {
+  { "uint32x8", DBUS_TYPE_UINT32, FALSE, 0 },
+  { "string16x8", DBUS_TYPE_STRING, FALSE, 16 },
+  { "string1024x8", DBUS_TYPE_STRING, FALSE, 1024 },
+  { "int32-array16", DBUS_TYPE_INT32, TRUE, 16 },
+  { "int32-array4096", DBUS_TYPE_INT32, TRUE, 4096 },
+  { "byte-array65536", DBUS_TYPE_BYTE, TRUE, 65536 }
+};
+
+#define BENCHMARK_BYTES_PER_OPERATION (4 * 1024 * 1024)
+
+static long
+elapsed_usec (long *sec,
+              long *usec)
+{
+  long now_sec, now_usec;
+  long elapsed;
+
+  _dbus_get_current_time (&now_sec, &now_usec);
+  elapsed = (now_sec - *sec) * 1000000 + (now_usec - *usec);
+  *sec = now_sec;
+  *usec = now_usec;
+
+  return elapsed;
+}
+
+/* Enough iterations to push BENCHMARK_BYTES_PER_OPERATION through,
+ * which keeps small shapes from being lost in timer resolution.
+ */
+static int
+benchmark_iterations (int bytes)
+{
+  return MAX (16, BENCHMARK_BYTES_PER_OPERATION / (bytes + 64));
+}
+
+static void
+benchmark_report (const char *operation,
+                  const char *shape,
+                  int         bytes,
+                  int         iterations,
+                  long        usec)
+{
+  printf ("BENCH\t%s\t%s\t%d\t%d\t%ld\n", operation, shape, bytes,
+          iterations, (long) ((double) usec * 1000 / iterations));
+}
+
+static DBusMessage *
+benchmark_message_new (const BenchmarkShape *shape,
+                       const char           *str,
+                       const void           *array)
+{
+  DBusMessage *message;
+  dbus_uint32_t v_UINT32;
+  dbus_bool_t ok;
+
+  message = dbus_message_new_signal ("/org/freedesktop/Benchmark",
+                                     "org.freedesktop.Benchmark",
+                                     "Shape");
+  if (message == NULL)
+    _dbus_assert_not_reached ("no memory");
+
+  v_UINT32 = 42;
+
+  if (shape->is_array)
+    ok = dbus_message_append_args (message,
+                                   DBUS_TYPE_ARRAY, shape->type, &array,
+                                   shape->size,
+                                   DBUS_TYPE_INVALID);
+  else if (shape->type == DBUS_TYPE_STRING)
+    ok = dbus_message_append_args (message,
+                                   DBUS_TYPE_STRING, &str,
+                                   DBUS_TYPE_STRING, &str,
+                                   DBUS_TYPE_STRING, &str,
+                                   DBUS_TYPE_STRING, &str,
+                                   DBUS_TYPE_STRING, &str,
+                                   DBUS_TYPE_STRING, &str,
+                                   DBUS_TYPE_STRING, &str,
+                                   DBUS_TYPE_STRING, &str,
+                                   DBUS_TYPE_INVALID);
+  else
+    ok = dbus_message_append_args (message,
+                                   DBUS_TYPE_UINT32, &v_UINT32,
+                                   DBUS_TYPE_UINT32, &v_UINT32,
+                                   DBUS_TYPE_UINT32, &v_UINT32,
+                                   DBUS_TYPE_UINT32, &v_UINT32,
+                                   DBUS_TYPE_UINT32, &v_UINT32,
+                                   DBUS_TYPE_UINT32, &v_UINT32,
+                                   DBUS_TYPE_UINT32, &v_UINT32,
+                                   DBUS_TYPE_UINT32, &v_UINT32,
+                                   DBUS_TYPE_INVALID);
+
+  if (!ok)
+    _dbus_assert_not_reached ("no memory");
+
+  return message;
+}
+
+static void
+benchmark_read_args (DBusMessage *message)
+{
+  DBusMessageIter iter, array_iter;
+  DBusBasicValue value;
+
+  dbus_message_iter_init (message, &iter);
+
+  do
+    {
+      if (dbus_message_iter_get_arg_type (&iter) == DBUS_TYPE_ARRAY)
+        {
+          dbus_message_iter_recurse (&iter, &array_iter);
+          while (dbus_message_iter_get_arg_type (&array_iter) != DBUS_TYPE_INVALID)
+            {
+              dbus_message_iter_get_basic (&array_iter, &value);
+              dbus_message_iter_next (&array_iter);
+            }
+        }
+      else
+        dbus_message_iter_get_basic (&iter, &value);
+    }
+  while (dbus_message_iter_next (&iter));
+}
+
+/* Swaps str back and forth, starting from the native byte order */
+static void
+benchmark_byteswap (const DBusString *signature,
+                    DBusString       *str,
+                    int               iterations)
+{
+  int byte_order, opposite_order;
+  int i;
+
+  byte_order = DBUS_COMPILER_BYTE_ORDER;
+
+  for (i = 0; i < iterations; i++)
+    {
+      opposite_order = byte_order == DBUS_LITTLE_ENDIAN ?
+        DBUS_BIG_ENDIAN : DBUS_LITTLE_ENDIAN;
+      _dbus_marshal_byteswap (signature, 0, byte_order, opposite_order,
+                              str, 0);
+      byte_order = opposite_order;
+    }
+}
+
+static void
+benchmark_body (const char       *shape,
+                const DBusString *signature,
+                const DBusString *body)
+{
+  DBusString copy;
+  long sec, usec;
+  int bytes, iterations;
+  int i;
+
+  bytes = _dbus_string_get_length (body);
+  iterations = benchmark_iterations (bytes);
+
+  elapsed_usec (&sec, &usec);
+  for (i = 0; i < iterations; i++)
+    {
+      if (_dbus_validate_body_with_reason (signature, 0,
+                                           DBUS_COMPILER_BYTE_ORDER, NULL,
+                                           body, 0, bytes) != DBUS_VALID)
+        _dbus_assert_not_reached ("benchmark body is invalid");
+    }
+  benchmark_report ("validate_body", shape, bytes, iterations,
+                    elapsed_usec (&sec, &usec));
+
+  if (!_dbus_string_init (&copy) ||
+      !_dbus_string_copy (body, 0, &copy, 0))
+    _dbus_assert_not_reached ("no memory");
+
+  elapsed_usec (&sec, &usec);
+  benchmark_byteswap (signature, &copy, iterations);
+  benchmark_report ("byteswap", shape, bytes, iterations,
+                    elapsed_usec (&sec, &usec));
+
+  _dbus_string_free (&copy);
+}
+
+static void
+benchmark_header (const char  *shape,
+                  DBusMessage *message)
+{
+  const DBusString *header_str, *body_str;
+  DBusString data;
+  DBusHeader header;
+  DBusValidity validity;
+  int byte_order, fields_array_len, header_len, body_len;
+  long sec, usec;
+  int iterations;
+  int i;
+
+  /* an unsent message has no serial, which the loader would reject */
+  dbus_message_set_serial (message, 1);
+  dbus_message_lock (message);
+  _dbus_message_get_network_data (message, &header_str, &body_str);
+
+  if (!_dbus_string_init (&data) ||
+      !_dbus_string_copy (header_str, 0, &data, 0) ||
+      !_dbus_string_copy (body_str, 0, &data, _dbus_string_get_length (&data)))
+    _dbus_assert_not_reached ("no memory");
+
+  if (!_dbus_header_have_message_untrusted (DBUS_MAXIMUM_MESSAGE_LENGTH,
+                                            &validity, &byte_order,
+                                            &fields_array_len, &header_len,
+                                            &body_len, &data, 0,
+                                            _dbus_string_get_length (&data)))
+    _dbus_assert_not_reached ("benchmark header is invalid");
+
+  if (!_dbus_header_init (&header, byte_order))
+    _dbus_assert_not_reached ("no memory");
+
+  iterations = benchmark_iterations (header_len);
+
+  elapsed_usec (&sec, &usec);
+  for (i = 0; i < iterations; i++)
+    {
+      _dbus_header_reinit (&header, byte_order);
+      if (!_dbus_header_load (&header, DBUS_VALIDATION_MODE_DATA_IS_UNTRUSTED,
+                              &validity, byte_order, fields_array_len,
+                              header_len, body_len, &data, 0,
+                              _dbus_string_get_length (&data)))
+        _dbus_assert_not_reached ("benchmark header failed to load");
+    }
+  benchmark_report ("header_load", shape, header_len, iterations,
+                    elapsed_usec (&sec, &usec));
+
+  _dbus_header_free (&header);
+  _dbus_string_free (&data);
+}
+
+static void
+benchmark_shape (const BenchmarkShape *shape)
+{
+  DBusMessage *message;
+  const DBusString *header_str, *body_str;
+  DBusString signature;
+  char *str;
+  void *array;
+  long sec, usec;
+  int bytes, iterations;
+  int i;
+
+  str = dbus_malloc (shape->size + 1);
+  array = dbus_malloc0 (MAX (shape->size, 1) * sizeof (dbus_uint32_t));
+  if (str == NULL || array == NULL)
+    _dbus_assert_not_reached ("no memory");
+  memset (str, 'x', shape->size);
+  str[shape->size] = '\0';
+
+  message = benchmark_message_new (shape, str, array);
+  bytes = _dbus_string_get_length (&message->body);
+  iterations = benchmark_iterations (bytes);
+  dbus_message_unref (message);
+
+  /* includes creating and freeing the message, which the message
+   * cache keeps cheap
+   */
+  elapsed_usec (&sec, &usec);
+  for (i = 0; i < iterations; i++)
+    dbus_message_unref (benchmark_message_new (shape, str, array));
+  benchmark_report ("append_args", shape->name, bytes, iterations,
+                    elapsed_usec (&sec, &usec));
+
+  message = benchmark_message_new (shape, str, array);
+
+  elapsed_usec (&sec, &usec);
+  for (i = 0; i < iterations; i++)
+    benchmark_read_args (message);
+  benchmark_report ("iter_get_basic", shape->name, bytes, iterations,
+                    elapsed_usec (&sec, &usec));
+
+  benchmark_header (shape->name, message);
+
+  _dbus_message_get_network_data (message, &header_str, &body_str);
+  _dbus_string_init_const (&signature, dbus_message_get_signature (message));
+  benchmark_body (shape->name, &signature, body_str);
+
+  dbus_message_unref (message);
+  dbus_free (array);
+  dbus_free (str);
+}
+
+/* The generated bodies cover every type and nesting the marshalling
+ * tests know about; they are each small, so they're reported together.
+ */
+static void
+benchmark_generated_bodies (void)
+{
+  DBusString signature, body;
+  long sec, usec;
+  long validate_usec, byteswap_usec;
+  int bytes, iterations;
+  int sequence;
+  int i;
+
+  if (!_dbus_string_init (&signature) || !_dbus_string_init (&body))
+    _dbus_assert_not_reached ("no memory");
+
+  validate_usec = 0;
+  byteswap_usec = 0;
+  bytes = 0;
+  iterations = 64;
+
+  sequence = 0;
+  while (dbus_internal_do_not_use_generate_bodies (sequence,
+                                                   DBUS_COMPILER_BYTE_ORDER,
+                                                   &signature, &body))
+    {
+      int len = _dbus_string_get_length (&body);
+
+      elapsed_usec (&sec, &usec);
+      for (i = 0; i < iterations; i++)
+        {
+          if (_dbus_validate_body_with_reason (&signature, 0,
+                                               DBUS_COMPILER_BYTE_ORDER, NULL,
+                                               &body, 0, len) != DBUS_VALID)
+            _dbus_assert_not_reached ("generated body is invalid");
+        }
+      validate_usec += elapsed_usec (&sec, &usec);
+
+      benchmark_byteswap (&signature, &body, iterations);
+      byteswap_usec += elapsed_usec (&sec, &usec);
+
+      bytes += len;
+      _dbus_string_set_length (&signature, 0);
+      _dbus_string_set_length (&body, 0);
+      ++sequence;
+    }
+
+  benchmark_report ("validate_body", "generated", bytes, iterations,
+                    validate_usec);
+  benchmark_report ("byteswap", "generated", bytes, iterations,
+                    byteswap_usec);
+
+  _dbus_string_free (&signature);
+  _dbus_string_free (&body);
+}
+
+/**
+ * @ingroup DBusMessageInternals
+ * Times the marshalling, demarshalling, validation and byteswapping
+ * paths for a fixed set of message shapes. Not part of the normal
+ * test run; ask for "message-benchmark" by name.
+ *
+ * @returns #TRUE on success.
+ */
+dbus_bool_t
+_dbus_message_benchmark (void)
+{
+  int i;
 
-  _dbus_verbose ("Signature expected \"%s\" actual \"%s\"\n",
-                 sig, dbus_message_get_signature (message));
+  for (i = 0; i < _DBUS_N_ELEMENTS (benchmark_shapes); i++)
+    benchmark_shape (&benchmark_shapes[i]);
 
-  s = dbus_message_get_signature (message);
+  benchmark_generated_bodies ();
 
-  _dbus_assert (dbus_message_has_signature (message, sig));
-  _dbus_assert (strcmp (s, sig) == 0);
+  return TRUE;
+}
 
-  verify_test_message (message);
+/* The loader benchmark feeds a corpus of whole messages, back to back,
+ * through the loader the way a transport does: a chunk of bytes into
+ * the buffer, then queue whatever messages are complete. Its lines add
+ * the allocations per iteration to the ones above, or "-" unless
+ * DBUS_MALLOC_PROFILE is set.
+ */
+typedef struct
+{
+  DBusString data;      /**< the messages, back to back */
+  int *lengths;         /**< length of each message in data */
+  int n_messages;       /**< number of messages */
+  int n_allocated;      /**< allocated length of lengths */
+} BenchmarkCorpus;
+
+/* Chunk sizes standing in for what reads off a socket return; 0 means
+ * a whole message at a time
+ */
+static const int benchmark_chunks[] = { 1, 64, 4096, 0 };
 
-  copy = dbus_message_copy (message);
+static void
+benchmark_corpus_init (BenchmarkCorpus *corpus)
+{
+  if (!_dbus_string_init (&corpus->data))
+    _dbus_assert_not_reached ("no memory");
 
-  _dbus_assert (dbus_message_get_reply_serial (message) ==
-                dbus_message_get_reply_serial (copy));
-  _dbus_assert (message->header.padding == copy->header.padding);
+  corpus->lengths = NULL;
+  corpus->n_messages = 0;
+  corpus->n_allocated = 0;
+}
 
-  _dbus_assert (_dbus_string_get_length (&message->header.data) ==
-                _dbus_string_get_length (&copy->header.data));
+static void
+benchmark_corpus_free (BenchmarkCorpus *corpus)
+{
+  _dbus_string_free (&corpus->data);
+  dbus_free (corpus->lengths);
+}
 
-  _dbus_assert (_dbus_string_get_length (&message->body) ==
-                _dbus_string_get_length (&copy->body));
+static void
+benchmark_corpus_add (BenchmarkCorpus  *corpus,
+                      const DBusString *message)
+{
+  if (corpus->n_messages == corpus->n_allocated)
+    {
+      corpus->n_allocated = MAX (64, corpus->n_allocated * 2);
+      corpus->lengths = dbus_realloc (corpus->lengths,
+                                      corpus->n_allocated * sizeof (int));
+      if (corpus->lengths == NULL)
+        _dbus_assert_not_reached ("no memory");
+    }
 
-  verify_test_message (copy);
+  if (!_dbus_string_copy (message, 0, &corpus->data,
+                          _dbus_string_get_length (&corpus->data)))
+    _dbus_assert_not_reached ("no memory");
 
-  name1 = dbus_message_get_interface (message);
-  name2 = dbus_message_get_interface (copy);
+  corpus->lengths[corpus->n_messages] = _dbus_string_get_length (message);
+  corpus->n_messages += 1;
+}
 
-  _dbus_assert (strcmp (name1, name2) == 0);
+/* Adds the .message-raw files in one of the test data directories */
+static void
+benchmark_corpus_add_dir (BenchmarkCorpus *corpus,
+                          const char      *test_data_dir,
+                          const char      *subdir)
+{
+  DBusString directory, filename, path, message;
+  DBusDirIter *dir;
+  DBusError error = DBUS_ERROR_INIT;
 
-  name1 = dbus_message_get_member (message);
-  name2 = dbus_message_get_member (copy);
+  if (!_dbus_string_init (&directory) ||
+      !_dbus_string_append (&directory, test_data_dir))
+    _dbus_assert_not_reached ("no memory");
 
-  _dbus_assert (strcmp (name1, name2) == 0);
+  _dbus_string_init_const (&filename, subdir);
+  if (!_dbus_concat_dir_and_file (&directory, &filename))
+    _dbus_assert_not_reached ("no memory");
 
-  dbus_message_unref (copy);
+  dir = _dbus_directory_open (&directory, &error);
+  if (dir == NULL)
+    {
+      _dbus_warn ("Could not open %s: %s\n",
+                  _dbus_string_get_const_data (&directory), error.message);
+      dbus_error_free (&error);
+      _dbus_string_free (&directory);
+      return;
+    }
 
-  /* Message loader test */
-  dbus_message_lock (message);
-  loader = _dbus_message_loader_new ();
-  
-  /* check ref/unref */
-  _dbus_message_loader_ref (loader);
-  _dbus_message_loader_unref (loader);
+  if (!_dbus_string_init (&filename))
+    _dbus_assert_not_reached ("no memory");
 
-  /* Write the header data one byte at a time */
-  data = _dbus_string_get_const_data (&message->header.data);
-  for (i = 0; i < _dbus_string_get_length (&message->header.data); i++)
+  while (_dbus_directory_get_next_file (dir, &filename, &error))
     {
-      DBusString *buffer;
+      if (!_dbus_string_ends_with_c_str (&filename, ".message-raw"))
+        continue;
 
-      _dbus_message_loader_get_buffer (loader, &buffer);
-      _dbus_string_append_byte (buffer, data[i]);
-      _dbus_message_loader_return_buffer (loader, buffer, 1);
-    }
+      if (!_dbus_string_init (&path) ||
+          !_dbus_string_copy (&directory, 0, &path, 0) ||
+          !_dbus_concat_dir_and_file (&path, &filename) ||
+          !_dbus_string_init (&message))
+        _dbus_assert_not_reached ("no memory");
 
-  /* Write the body data one byte at a time */
-  data = _dbus_string_get_const_data (&message->body);
-  for (i = 0; i < _dbus_string_get_length (&message->body); i++)
-    {
-      DBusString *buffer;
+      if (dbus_internal_do_not_use_load_message_file (&path, &message))
+        benchmark_corpus_add (corpus, &message);
 
-      _dbus_message_loader_get_buffer (loader, &buffer);
-      _dbus_string_append_byte (buffer, data[i]);
-      _dbus_message_loader_return_buffer (loader, buffer, 1);
+      _dbus_string_free (&message);
+      _dbus_string_free (&path);
     }
 
-#ifdef HAVE_UNIX_FD_PASSING
-  {
-    int *unix_fds;
-    unsigned n_unix_fds;
-    /* Write unix fd */
-    _dbus_message_loader_get_unix_fds(loader, &unix_fds, &n_unix_fds);
-    _dbus_assert(n_unix_fds > 0);
-    _dbus_assert(message->n_unix_fds == 1);
-    unix_fds[0] = _dbus_dup(message->unix_fds[0], NULL);
-    _dbus_assert(unix_fds[0] >= 0);
-    _dbus_message_loader_return_unix_fds(loader, unix_fds, 1);
-  }
-#endif
+  dbus_error_free (&error);
+  _dbus_directory_close (dir);
+  _dbus_string_free (&filename);
+  _dbus_string_free (&directory);
+}
 
-  dbus_message_unref (message);
+/* Total allocations so far, or -1 if they aren't being counted */
+static long
+benchmark_allocations (void)
+{
+  dbus_uint32_t n_allocations, n_blocks, n_bytes;
+  long total;
+  int i;
 
-  /* Now pop back the message */
-  if (!_dbus_message_loader_queue_messages (loader))
-    _dbus_assert_not_reached ("no memory to queue messages");
+  total = 0;
+  for (i = 0; i < DBUS_N_ALLOC_SUBSYSTEMS; i++)
+    {
+      if (!_dbus_get_alloc_profile (i, &n_allocations, &n_blocks, &n_bytes))
+        return -1;
+      total += n_allocations;
+    }
 
-  if (_dbus_message_loader_get_is_corrupted (loader))
-    _dbus_assert_not_reached ("message loader corrupted");
+  return total;
+}
 
-  message = _dbus_message_loader_pop_message (loader);
-  if (!message)
-    _dbus_assert_not_reached ("received a NULL message");
+static void
+benchmark_report_loader (const char *operation,
+                         const char *corpus,
+                         int         chunk,
+                         int         bytes,
+                         int         iterations,
+                         long        usec,
+                         long        allocations)
+{
+  char shape[64];
 
-  if (dbus_message_get_reply_serial (message) != 5678)
-    _dbus_assert_not_reached ("reply serial fields differ");
+  if (chunk > 0)
+    snprintf (shape, sizeof (shape), "%s/%d", corpus, chunk);
+  else
+    snprintf (shape, sizeof (shape), "%s/message", corpus);
 
-  dbus_message_unref (message);
+  printf ("BENCH\t%s\t%s\t%d\t%d\t%ld\t", operation, shape, bytes,
+          iterations, (long) ((double) usec * 1000 / iterations));
 
-  /* ovveride the serial, since it was reset by dbus_message_copy() */
-  dbus_message_set_serial(message_without_unix_fds, 8901);
+  if (allocations < 0)
+    printf ("-\n");
+  else
+    printf ("%ld\n", allocations / iterations);
+}
 
-  dbus_message_lock (message_without_unix_fds);
+/* Feeds len bytes of data from start to the loader, chunk bytes at a
+ * time, queueing and freeing the messages after each chunk; returns how
+ * many messages came out
+ */
+static int
+benchmark_feed (DBusMessageLoader *loader,
+                const DBusString  *data,
+                int                start,
+                int                len,
+                int                chunk)
+{
+  DBusMessage *message;
+  DBusString *buffer;
+  int n_messages;
+  int pos, n;
 
-  verify_test_message (message_without_unix_fds);
+  n_messages = 0;
 
+  for (pos = start; pos < start + len; pos += n)
     {
-      /* Marshal and demarshal the message. */
-
-      DBusMessage *message2;
-      DBusError error = DBUS_ERROR_INIT;
-      char *marshalled = NULL;
-      int len = 0;
-      char garbage_header[DBUS_MINIMUM_HEADER_SIZE] = "xxx";
+      n = MIN (chunk, start + len - pos);
 
-      if (!dbus_message_marshal (message_without_unix_fds, &marshalled, &len))
-        _dbus_assert_not_reached ("failed to marshal message");
+      _dbus_message_loader_get_buffer (loader, &buffer);
+      if (!_dbus_string_copy_len (data, pos, n, buffer,
+                                  _dbus_string_get_length (buffer)))
+        _dbus_assert_not_reached ("no memory");
+      _dbus_message_loader_return_buffer (loader, buffer, n);
 
-      _dbus_assert (len != 0);
-      _dbus_assert (marshalled != NULL);
+      if (!_dbus_message_loader_queue_messages (loader))
+        _dbus_assert_not_reached ("no memory");
 
-      _dbus_assert (dbus_message_demarshal_bytes_needed (marshalled, len) == len);
-      message2 = dbus_message_demarshal (marshalled, len, &error);
+      while ((message = _dbus_message_loader_pop_message (loader)) != NULL)
+        {
+          dbus_message_unref (message);
+          n_messages += 1;
+        }
+    }
 
-      _dbus_assert (message2 != NULL);
-      _dbus_assert (!dbus_error_is_set (&error));
-      verify_test_message (message2);
+  return n_messages;
+}
 
-      dbus_message_unref (message2);
-      dbus_free (marshalled);
+/* Pushes the whole corpus through one loader, as one connection would
+ * see it
+ */
+static void
+benchmark_loader_stream (const char      *name,
+                         BenchmarkCorpus *corpus,
+                         int              chunk)
+{
+  DBusMessageLoader *loader;
+  long sec, usec, allocations;
+  int bytes, iterations;
+  int i, j, pos, n_messages;
 
-      /* Demarshal invalid message. */
+  bytes = _dbus_string_get_length (&corpus->data);
+  iterations = benchmark_iterations (bytes);
 
-      message2 = dbus_message_demarshal ("invalid", 7, &error);
-      _dbus_assert (message2 == NULL);
-      _dbus_assert (dbus_error_is_set (&error));
-      dbus_error_free (&error);
+  loader = _dbus_message_loader_new ();
+  if (loader == NULL)
+    _dbus_assert_not_reached ("no memory");
 
-      /* Demarshal invalid (empty) message. */
+  allocations = benchmark_allocations ();
+  elapsed_usec (&sec, &usec);
 
-      message2 = dbus_message_demarshal ("", 0, &error);
-      _dbus_assert (message2 == NULL);
-      _dbus_assert (dbus_error_is_set (&error));
-      dbus_error_free (&error);
+  for (i = 0; i < iterations; i++)
+    {
+      if (chunk > 0)
+        n_messages = benchmark_feed (loader, &corpus->data, 0, bytes, chunk);
+      else
+        {
+          n_messages = 0;
+          for (j = 0, pos = 0; j < corpus->n_messages; pos += corpus->lengths[j++])
+            n_messages += benchmark_feed (loader, &corpus->data, pos,
+                                          corpus->lengths[j],
+                                          corpus->lengths[j]);
+        }
 
-      /* Bytes needed to demarshal empty message: 0 (more) */
+      if (n_messages != corpus->n_messages)
+        _dbus_assert_not_reached ("loader lost messages from the corpus");
+    }
 
-      _dbus_assert (dbus_message_demarshal_bytes_needed ("", 0) == 0);
-      
-      /* Bytes needed to demarshal invalid message: -1 (error). */
+  usec = elapsed_usec (&sec, &usec);
+  if (allocations >= 0)
+    allocations = benchmark_allocations () - allocations;
 
-      _dbus_assert (dbus_message_demarshal_bytes_needed (garbage_header, DBUS_MINIMUM_HEADER_SIZE) == -1);
-    }
+  benchmark_report_loader ("loader_stream", name, chunk, bytes, iterations,
+                           usec, allocations);
 
-  dbus_message_unref (message_without_unix_fds);
+  _dbus_assert (!_dbus_message_loader_get_is_corrupted (loader));
   _dbus_message_loader_unref (loader);
+}
 
-  check_memleaks ();
-  _dbus_check_fdleaks();
+/* Gives each message of the corpus a loader of its own, for messages
+ * that leave it incomplete or corrupted
+ */
+static void
+benchmark_loader_each (const char      *name,
+                       BenchmarkCorpus *corpus,
+                       int              chunk,
+                       dbus_bool_t      corrupted)
+{
+  DBusMessageLoader *loader;
+  long sec, usec, allocations;
+  int bytes, iterations;
+  int i, j, pos;
 
-  /* Check that we can abandon a container */
-  message = dbus_message_new_method_call ("org.freedesktop.DBus.TestService",
-		  			  "/org/freedesktop/TestPath",
-					  "Foo.TestInterface",
-					  "Method");
+  bytes = _dbus_string_get_length (&corpus->data);
+  iterations = benchmark_iterations (bytes);
 
-  dbus_message_iter_init_append (message, &iter);
+  allocations = benchmark_allocations ();
+  elapsed_usec (&sec, &usec);
 
-  _dbus_assert (dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
-			  			  (DBUS_STRUCT_BEGIN_CHAR_AS_STRING
-						   DBUS_TYPE_STRING_AS_STRING
-						   DBUS_TYPE_STRING_AS_STRING
-						   DBUS_STRUCT_END_CHAR_AS_STRING),
-						  &array_iter));
-  _dbus_assert (dbus_message_iter_open_container (&array_iter, DBUS_TYPE_STRUCT,
-			  			  NULL, &struct_iter));
+  for (i = 0; i < iterations; i++)
+    {
+      for (j = 0, pos = 0; j < corpus->n_messages; pos += corpus->lengths[j++])
+        {
+          loader = _dbus_message_loader_new ();
+          if (loader == NULL)
+            _dbus_assert_not_reached ("no memory");
 
-  s = "peaches";
-  _dbus_assert (dbus_message_iter_append_basic (&struct_iter, DBUS_TYPE_STRING,
-			  			&s));
+          if (benchmark_feed (loader, &corpus->data, pos, corpus->lengths[j],
+                              chunk > 0 ? chunk : corpus->lengths[j]) != 0 ||
+              _dbus_message_loader_get_is_corrupted (loader) != corrupted)
+            _dbus_assert_not_reached ("loader disagreed with the corpus");
 
-  /* uh-oh, error, try and unwind */
+          _dbus_message_loader_unref (loader);
+        }
+    }
 
-  dbus_message_iter_abandon_container (&array_iter, &struct_iter);
-  dbus_message_iter_abandon_container (&array_iter, &iter);
+  usec = elapsed_usec (&sec, &usec);
+  if (allocations >= 0)
+    allocations = benchmark_allocations () - allocations;
 
-  dbus_message_unref (message);
+  benchmark_report_loader (corrupted ? "loader_reject" : "loader_incomplete",
+                           name, chunk, bytes, iterations, usec, allocations);
+}
 
-  /* Load all the sample messages from the message factory */
-  {
-    DBusMessageDataIter diter;
-    DBusMessageData mdata;
-    int count;
+/**
+ * @ingroup DBusMessageInternals
+ * Times DBusMessageLoader decoding the raw messages in the test data
+ * directories and those the message factory generates, fed in chunks
+ * of various sizes as reads from a socket would be. Not part of the
+ * normal test run; ask for "loader-benchmark" by name.
+ *
+ * @param test_data_dir the test/data directory, or "" for just the
+ *  generated messages
+ * @returns #TRUE on success.
+ */
+dbus_bool_t
+_dbus_message_loader_benchmark (const char *test_data_dir)
+{
+  BenchmarkCorpus valid, incomplete, invalid;
+  DBusMessageDataIter diter;
+  DBusMessageData mdata;
+  int i;
 
-    reset_validities_seen ();
-    
-    count = 0;
-    _dbus_message_data_iter_init (&diter);
-    
-    while (_dbus_message_data_iter_get_and_next (&diter,
-                                                 &mdata))
-      {
-        if (!dbus_internal_do_not_use_try_message_data (&mdata.data,
-                                                        mdata.expected_validity))
-          {
-            _dbus_warn ("expected validity %d and did not get it\n",
-                        mdata.expected_validity);
-            _dbus_assert_not_reached ("message data failed");
-          }
+  benchmark_corpus_init (&valid);
+  benchmark_corpus_init (&incomplete);
+  benchmark_corpus_init (&invalid);
 
-        _dbus_message_data_free (&mdata);
+  if (test_data_dir != NULL && *test_data_dir != '\0')
+    {
+      benchmark_corpus_add_dir (&valid, test_data_dir, "valid-messages");
+      benchmark_corpus_add_dir (&incomplete, test_data_dir,
+                                "incomplete-messages");
+    }
 
-        count += 1;
-      }
+  _dbus_message_data_iter_init (&diter);
+  while (_dbus_message_data_iter_get_and_next (&diter, &mdata))
+    {
+      if (mdata.expected_validity == DBUS_VALID)
+        benchmark_corpus_add (&valid, &mdata.data);
+      else if (mdata.expected_validity == DBUS_VALID_BUT_INCOMPLETE)
+        benchmark_corpus_add (&incomplete, &mdata.data);
+      else if (mdata.expected_validity != DBUS_VALIDITY_UNKNOWN)
+        benchmark_corpus_add (&invalid, &mdata.data);
+
+      _dbus_message_data_free (&mdata);
+    }
 
-    printf ("%d sample messages tested\n", count);
+  /* The factory generates no incomplete messages, so the first half of
+   * each valid one stands in for them
+   */
+  if (incomplete.n_messages == 0)
+    {
+      int pos;
 
-    print_validities_seen (FALSE);
-    print_validities_seen (TRUE);
-  }
+      for (i = 0, pos = 0; i < valid.n_messages; pos += valid.lengths[i++])
+        {
+          DBusString half;
 
-  check_memleaks ();
-  _dbus_check_fdleaks();
+          _dbus_string_init_const_len (&half,
+                                       _dbus_string_get_const_data_len (&valid.data, pos,
+                                                                        valid.lengths[i]),
+                                       valid.lengths[i] / 2);
+          benchmark_corpus_add (&incomplete, &half);
+        }
+    }
 
-  /* Now load every message in test_data_dir if we have one */
-  if (test_data_dir == NULL)
-    return TRUE;
+  for (i = 0; i < _DBUS_N_ELEMENTS (benchmark_chunks); i++)
+    {
+      if (valid.n_messages > 0)
+        benchmark_loader_stream ("valid", &valid, benchmark_chunks[i]);
 
-  return dbus_internal_do_not_use_foreach_message_file (test_data_dir,
-                                                        (DBusForeachMessageFileFunc)
-                                                        dbus_internal_do_not_use_try_message_file,
-                                                        NULL);  
+      if (incomplete.n_messages > 0)
+        benchmark_loader_each ("incomplete", &incomplete, benchmark_chunks[i],
+                               FALSE);
+    }
+
+  if (invalid.n_messages > 0)
+    benchmark_loader_each ("invalid", &invalid, 0, TRUE);
+
+  benchmark_corpus_free (&valid);
+  benchmark_corpus_free (&incomplete);
+  benchmark_corpus_free (&invalid);
+
+  return TRUE;
 }
 
 #endif /* DBUS_BUILD_TESTS */
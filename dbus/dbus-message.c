@@ -32,6 +32,7 @@
 #include "dbus-message-private.h"
 #include "dbus-object-tree.h"
 #include "dbus-memory.h"
+#include "dbus-mempool.h"
 #include "dbus-list.h"
 #include "dbus-threads-internal.h"
 #ifdef HAVE_UNIX_FD_PASSING
@@ -40,6 +41,10 @@
 
 #include <string.h>
 
+/* Allocations made here are profiled as messages */
+#undef DBUS_ALLOC_SUBSYSTEM
+#define DBUS_ALLOC_SUBSYSTEM DBUS_ALLOC_SUBSYSTEM_MESSAGE
+
 static void dbus_message_finalize (DBusMessage *message);
 
 /**
@@ -86,6 +91,22 @@ struct DBusMessageRealIter
   } u; /**< the type writer or reader that does all the work */
 };
 
+/** typedef for internals of object path iterator */
+typedef struct DBusObjectPathRealIter DBusObjectPathRealIter;
+
+/**
+ * @brief Internals of DBusObjectPathIter
+ *
+ * Position in an object path string. All fields are internal.
+ */
+struct DBusObjectPathRealIter
+{
+  const char *next; /**< Start of the next element, or the terminating nul */
+};
+
+static dbus_bool_t _dbus_message_iter_open_signature  (DBusMessageRealIter *real);
+static dbus_bool_t _dbus_message_iter_close_signature (DBusMessageRealIter *real);
+
 static void
 get_const_signature (DBusHeader        *header,
                      const DBusString **type_str_p,
@@ -119,6 +140,9 @@ _dbus_message_byteswap (DBusMessage *message)
   if (message->byte_order == DBUS_COMPILER_BYTE_ORDER)
     return;
 
+  /* only bodies already in our byte order are shared */
+  _dbus_assert (message->shared_body == NULL);
+
   _dbus_verbose ("Swapping message into compiler byte order\n");
   
   get_const_signature (&message->header, &type_str, &type_pos);
@@ -143,6 +167,226 @@ _dbus_message_byteswap (DBusMessage *message)
  if (message->byte_order != DBUS_COMPILER_BYTE_ORDER)   \
    _dbus_message_byteswap (message)
 
+/** Validates the body of a message that was loaded without having
+ *  it checked, the first time anything reads it. Returns #FALSE if the
+ *  body turned out to be corrupt, in which case it must not be read
+ *  or byteswapped.
+ */
+static dbus_bool_t
+ensure_body_validated (DBusMessage *message)
+{
+  const DBusString *type_str;
+  int type_pos;
+  DBusValidity validity;
+
+  if (message->body_validation_pending)
+    {
+      get_const_signature (&message->header, &type_str, &type_pos);
+
+      validity = _dbus_validate_body_with_reason (type_str,
+                                                  type_pos,
+                                                  message->byte_order,
+                                                  NULL,
+                                                  &message->body,
+                                                  0,
+                                                  _dbus_string_get_length (&message->body));
+      if (validity != DBUS_VALID)
+        {
+          _dbus_verbose ("Deferred validation of message body failed code %d\n",
+                         validity);
+          message->body_invalid = TRUE;
+        }
+
+      message->body_validation_pending = FALSE;
+    }
+
+  return !message->body_invalid;
+}
+
+/** Throws away the argument offsets, when arguments are added or the
+ *  message is freed.
+ */
+static void
+free_arg_offsets (DBusMessage *message)
+{
+  dbus_free (message->arg_offsets);
+  message->arg_offsets = NULL;
+  message->n_args = -1;
+}
+
+/** Drops the signature kept for the next append, see
+ *  _dbus_message_iter_open_signature()
+ */
+static void
+free_append_signature (DBusMessage *message)
+{
+  if (message->append_signature != NULL)
+    {
+      _dbus_string_free (message->append_signature);
+      dbus_free (message->append_signature);
+      message->append_signature = NULL;
+    }
+}
+
+/** Bodies shorter than this are copied rather than shared by
+ *  dbus_message_copy()
+ */
+#define MIN_SHARED_BODY_LENGTH 512
+
+/** Makes the message's body sharable by copies, by moving its data
+ *  into a #DBusMessageSharedBody and pointing the body at it. The
+ *  data doesn't move, so readers don't notice.
+ *
+ *  @returns #FALSE if no memory
+ */
+static dbus_bool_t
+share_body (DBusMessage *message)
+{
+  DBusMessageSharedBody *shared;
+
+  if (message->shared_body != NULL)
+    return TRUE;
+
+  shared = dbus_new (DBusMessageSharedBody, 1);
+  if (shared == NULL)
+    return FALSE;
+
+  shared->refcount.value = 1;
+  shared->free_function = NULL;
+  shared->free_data = NULL;
+  _dbus_string_relocate (&shared->str, &message->body);
+  _dbus_string_init_const_len (&message->body,
+                               _dbus_string_get_const_data (&shared->str),
+                               _dbus_string_get_length (&shared->str));
+  message->shared_body = shared;
+
+  return TRUE;
+}
+
+/** Stops the message using a shared body, freeing it if this was the
+ *  last message using it. Leaves the body as a constant string that
+ *  must not be read any more.
+ */
+static void
+release_shared_body (DBusMessage *message)
+{
+  if (message->shared_body == NULL)
+    return;
+
+  if (_dbus_atomic_dec (&message->shared_body->refcount) == 1)
+    {
+      if (message->shared_body->free_function != NULL)
+        (* message->shared_body->free_function) (message->shared_body->free_data);
+
+      _dbus_string_free (&message->shared_body->str);
+      dbus_free (message->shared_body);
+    }
+
+  message->shared_body = NULL;
+}
+
+/** Gives the message a body of its own before it is changed, taking
+ *  over the shared one if no other message is using it any more.
+ *
+ *  @returns #FALSE if no memory
+ */
+static dbus_bool_t
+unshare_body (DBusMessage *message)
+{
+  DBusString own;
+
+  if (message->shared_body == NULL)
+    return TRUE;
+
+  /* There's no atomic get; the increment returns the count before
+   * it. Once we're the only user, no other message can start sharing
+   * the body, so it can be taken back; unless it belongs to the
+   * application, in which case it is always copied.
+   */
+  if (message->shared_body->free_function == NULL)
+    {
+      if (_dbus_atomic_inc (&message->shared_body->refcount) == 1)
+        {
+          _dbus_string_relocate (&message->body, &message->shared_body->str);
+          dbus_free (message->shared_body);
+          message->shared_body = NULL;
+          return TRUE;
+        }
+      _dbus_atomic_dec (&message->shared_body->refcount);
+    }
+
+  if (!_dbus_string_init_preallocated (&own, _dbus_string_get_length (&message->body)))
+    return FALSE;
+
+  if (!_dbus_string_copy (&message->body, 0, &own, 0))
+    {
+      _dbus_string_free (&own);
+      return FALSE;
+    }
+
+  release_shared_body (message);
+  _dbus_string_relocate (&message->body, &own);
+
+  return TRUE;
+}
+
+/** Finds where each argument starts, both in the signature (relative
+ *  to its start) and in the body, so dbus_message_iter_init_at() can
+ *  go straight to one. Done the first time it's needed; the body must
+ *  already be known to be valid.
+ *
+ *  @returns #FALSE if no memory
+ */
+static dbus_bool_t
+ensure_arg_offsets (DBusMessage *message)
+{
+  const DBusString *type_str;
+  int type_pos;
+  const char *signature;
+  DBusTypeReader reader;
+  int n_args;
+  int pos;
+  int i;
+
+  if (message->n_args >= 0)
+    return TRUE;
+
+  _dbus_assert (message->arg_offsets == NULL);
+  _dbus_assert (!message->body_validation_pending && !message->body_invalid);
+
+  get_const_signature (&message->header, &type_str, &type_pos);
+
+  signature = _dbus_string_get_const_data (type_str);
+  n_args = 0;
+  pos = type_pos;
+  while (signature[pos] != DBUS_TYPE_INVALID)
+    {
+      _dbus_type_signature_next (signature, &pos);
+      n_args += 1;
+    }
+
+  if (n_args > 0)
+    {
+      message->arg_offsets = dbus_new (int, n_args * 2);
+      if (message->arg_offsets == NULL)
+        return FALSE;
+    }
+
+  _dbus_type_reader_init (&reader, message->byte_order,
+                          type_str, type_pos, &message->body, 0);
+
+  for (i = 0; i < n_args; i++)
+    {
+      message->arg_offsets[i * 2] = reader.type_pos - type_pos;
+      message->arg_offsets[i * 2 + 1] = reader.value_pos;
+      _dbus_type_reader_next (&reader);
+    }
+
+  message->n_args = n_args;
+
+  return TRUE;
+}
+
 /**
  * Gets the data to be sent over the network for this message.
  * The header and then the body should be written out.
@@ -164,6 +408,118 @@ _dbus_message_get_network_data (DBusMessage          *message,
   *body = &message->body;
 }
 
+/**
+ * Gets the number of bytes the message's header and body take up
+ * on the wire. Unlike _dbus_message_get_network_data() this works on
+ * unlocked messages too, such as those fresh from the loader; the
+ * size is only final once the message is locked.
+ *
+ * @param message the message.
+ * @returns size of header plus body
+ */
+int
+_dbus_message_get_network_size (DBusMessage *message)
+{
+  return _dbus_string_get_length (&message->header.data) +
+    _dbus_string_get_length (&message->body);
+}
+
+/**
+ * Marks a message as one that a #DBusConnection queueing it to send
+ * should put ahead of any other messages waiting, within the budget
+ * set with _dbus_connection_set_max_priority_outgoing_size(). The
+ * message bus uses this for messages from connections with priority.
+ *
+ * @param message the message
+ * @param priority #TRUE to send it ahead of others
+ */
+void
+_dbus_message_set_priority (DBusMessage *message,
+                            dbus_bool_t  priority)
+{
+  message->priority = priority != FALSE;
+}
+
+/**
+ * Gets whether the message was marked with _dbus_message_set_priority().
+ *
+ * @param message the message
+ * @returns #TRUE if the message goes ahead of others
+ */
+dbus_bool_t
+_dbus_message_get_priority (DBusMessage *message)
+{
+  return message->priority;
+}
+
+/**
+ * Starts the clock on a message with an expiry (see
+ * dbus_message_set_expiry()), as it is queued to be sent or received.
+ * Does nothing if the message has no expiry, or its clock was already
+ * started, as it is for a message the bus received and passes on.
+ *
+ * @param message the message
+ */
+void
+_dbus_message_start_expiry (DBusMessage *message)
+{
+  dbus_uint32_t expiry;
+
+  if (message->expiry_started ||
+      !_dbus_header_get_field_basic (&message->header,
+                                     DBUS_HEADER_FIELD_EXPIRY,
+                                     DBUS_TYPE_UINT32,
+                                     &expiry))
+    return;
+
+  _dbus_get_current_time (&message->expiry_tv_sec, &message->expiry_tv_usec);
+  message->expiry_tv_sec += expiry / 1000;
+  message->expiry_tv_usec += (expiry % 1000) * 1000;
+  if (message->expiry_tv_usec >= 1000000)
+    {
+      message->expiry_tv_usec -= 1000000;
+      message->expiry_tv_sec += 1;
+    }
+
+  message->expiry_started = TRUE;
+}
+
+/**
+ * Checks whether a message started with _dbus_message_start_expiry()
+ * has been waiting longer than its expiry allows.
+ *
+ * @param message the message
+ * @returns #TRUE if the message should be dropped undelivered
+ */
+dbus_bool_t
+_dbus_message_has_expired (DBusMessage *message)
+{
+  long tv_sec, tv_usec;
+
+  if (!message->expiry_started)
+    return FALSE;
+
+  _dbus_get_current_time (&tv_sec, &tv_usec);
+
+  return message->expiry_tv_sec < tv_sec ||
+    (message->expiry_tv_sec == tv_sec && message->expiry_tv_usec <= tv_usec);
+}
+
+/**
+ * Validates the body of a message whose check was put off when it
+ * was loaded, if nothing has read it since. The message bus calls
+ * this once it has routed a message, before delivering it, so that
+ * only the header is checked on the way in.
+ *
+ * @param message the message
+ * @returns #FALSE if the body is corrupt and the message must not be passed on
+ */
+dbus_bool_t
+_dbus_message_check_body (DBusMessage *message)
+{
+  return ensure_body_validated (message);
+}
+
 /**
  * Gets the unix fds to be sent over the network for this message.
  * This function is guaranteed to always return the same data once a
@@ -209,20 +565,24 @@ dbus_message_set_serial (DBusMessage   *message,
   _dbus_header_set_serial (&message->header, serial);
 }
 
-/**
- * Adds a counter to be incremented immediately with the size/unix fds
- * of this message, and decremented by the size/unix fds of this
- * message when this message if finalized.  The link contains a
- * counter with its refcount already incremented, but the counter
- * itself not incremented.  Ownership of link and counter refcount is
- * passed to the message.
- *
- * @param message the message
- * @param link link with counter as data
+static dbus_bool_t
+message_has_counters (DBusMessage *message)
+{
+  int i;
+
+  for (i = 0; i < N_INLINE_COUNTERS; i++)
+    if (message->inline_counters[i] != NULL)
+      return TRUE;
+
+  return message->counters != NULL;
+}
+
+/* Adds the size/unix fds of the message to the counter, and
+ * computes them first if nothing is counting the message yet.
  */
-void
-_dbus_message_add_counter_link (DBusMessage  *message,
-                                DBusList     *link)
+static void
+message_count (DBusMessage *message,
+               DBusCounter *counter)
 {
   /* right now we don't recompute the delta when message
    * size changes, and that's OK for current purposes
@@ -230,7 +590,7 @@ _dbus_message_add_counter_link (DBusMessage  *message,
    * Do recompute it whenever there are no outstanding counters,
    * since it's basically free.
    */
-  if (message->counters == NULL)
+  if (!message_has_counters (message))
     {
       message->size_counter_delta =
         _dbus_string_get_length (&message->header.data) +
@@ -246,13 +606,44 @@ _dbus_message_add_counter_link (DBusMessage  *message,
 #endif
     }
 
-  _dbus_list_append_link (&message->counters, link);
+  _dbus_counter_adjust_size (counter, message->size_counter_delta);
 
-  _dbus_counter_adjust_size (link->data, message->size_counter_delta);
+#ifdef HAVE_UNIX_FD_PASSING
+  _dbus_counter_adjust_unix_fd (counter, message->unix_fd_counter_delta);
+#endif
+}
+
+static void
+message_uncount (DBusMessage *message,
+                 DBusCounter *counter)
+{
+  _dbus_counter_adjust_size (counter, - message->size_counter_delta);
 
 #ifdef HAVE_UNIX_FD_PASSING
-  _dbus_counter_adjust_unix_fd (link->data, message->unix_fd_counter_delta);
+  _dbus_counter_adjust_unix_fd (counter, - message->unix_fd_counter_delta);
 #endif
+
+  _dbus_counter_unref (counter);
+}
+
+/**
+ * Adds a counter to be incremented immediately with the size/unix fds
+ * of this message, and decremented by the size/unix fds of this
+ * message when this message if finalized.  The link contains a
+ * counter with its refcount already incremented, but the counter
+ * itself not incremented.  Ownership of link and counter refcount is
+ * passed to the message.
+ *
+ * @param message the message
+ * @param link link with counter as data
+ */
+void
+_dbus_message_add_counter_link (DBusMessage  *message,
+                                DBusList     *link)
+{
+  message_count (message, link->data);
+
+  _dbus_list_append_link (&message->counters, link);
 }
 
 /**
@@ -260,6 +651,9 @@ _dbus_message_add_counter_link (DBusMessage  *message,
  * of this message, and decremented by the size/unix fds of this
  * message when this message if finalized.
  *
+ * The first #N_INLINE_COUNTERS counters are kept in the message
+ * itself, so this only allocates when a message has more than that.
+ *
  * @param message the message
  * @param counter the counter
  * @returns #FALSE if no memory
@@ -269,6 +663,17 @@ _dbus_message_add_counter (DBusMessage *message,
                            DBusCounter *counter)
 {
   DBusList *link;
+  int i;
+
+  for (i = 0; i < N_INLINE_COUNTERS; i++)
+    {
+      if (message->inline_counters[i] == NULL)
+        {
+          message_count (message, counter);
+          message->inline_counters[i] = _dbus_counter_ref (counter);
+          return TRUE;
+        }
+    }
 
   link = _dbus_list_alloc_link (counter);
   if (link == NULL)
@@ -285,7 +690,8 @@ _dbus_message_add_counter (DBusMessage *message,
  * decrements the counter by the size/unix fds of this message.
  *
  * @param message the message
- * @param link_return return the link used
+ * @param link_return return the link used, or #NULL if the counter
+ *   was stored in the message itself
  * @param counter the counter
  */
 void
@@ -294,25 +700,56 @@ _dbus_message_remove_counter (DBusMessage  *message,
                               DBusList    **link_return)
 {
   DBusList *link;
+  int i;
+
+  for (i = N_INLINE_COUNTERS - 1; i >= 0; i--)
+    {
+      if (message->inline_counters[i] == counter)
+        {
+          message->inline_counters[i] = NULL;
+          message_uncount (message, counter);
+
+          if (link_return)
+            *link_return = NULL;
+          return;
+        }
+    }
 
   link = _dbus_list_find_last (&message->counters,
                                counter);
   _dbus_assert (link != NULL);
 
-  _dbus_list_unlink (&message->counters,
-                     link);
+  _dbus_message_remove_counter_link (message, link);
+
   if (link_return)
     *link_return = link;
   else
     _dbus_list_free_link (link);
+}
 
-  _dbus_counter_adjust_size (counter, - message->size_counter_delta);
+/**
+ * Like _dbus_message_remove_counter(), but for a caller that kept the
+ * link it passed to _dbus_message_add_counter_link(), so the counter
+ * does not have to be searched for. A broadcast message has one
+ * counter per recipient connection, so the search would otherwise
+ * make delivering it quadratic in the number of recipients.
+ *
+ * The link is unlinked but not freed; its data is still the (now
+ * unreferenced) counter.
+ *
+ * @param message the message
+ * @param link the link holding the counter
+ */
+void
+_dbus_message_remove_counter_link (DBusMessage  *message,
+                                   DBusList     *link)
+{
+  DBusCounter *counter = link->data;
 
-#ifdef HAVE_UNIX_FD_PASSING
-  _dbus_counter_adjust_unix_fd (counter, - message->unix_fd_counter_delta);
-#endif
+  _dbus_list_unlink (&message->counters,
+                     link);
 
-  _dbus_counter_unref (counter);
+  message_uncount (message, counter);
 }
 
 /**
@@ -337,6 +774,9 @@ dbus_message_lock (DBusMessage  *message)
       _dbus_assert (_dbus_string_get_length (&message->body) == 0 ||
                     dbus_message_get_signature (message) != NULL);
 
+      /* nothing more can be appended */
+      free_append_signature (message);
+
       message->locked = TRUE;
     }
 }
@@ -444,6 +884,14 @@ _dbus_message_set_signature (DBusMessage *message,
  * If you implement the message_cache with a list, the primary reason
  * it's slower is that you add another thread lock (on the DBusList
  * mempool).
+ *
+ * Once threads are initialized, the message_cache lock is a real
+ * mutex that every thread creating or freeing messages contends on,
+ * so each thread then gets its own small cache in thread-local
+ * storage instead. Only creating or destroying a thread's cache (and
+ * reading the statistics) takes the lock. The shared array above is
+ * still used when threads are off, or thread-local storage isn't
+ * available.
  */
 
 /** Avoid caching huge messages */
@@ -456,6 +904,104 @@ _DBUS_DEFINE_GLOBAL_LOCK (message_cache);
 static DBusMessage *message_cache[MAX_MESSAGE_CACHE_SIZE];
 static int message_cache_count = 0;
 static dbus_bool_t message_cache_shutdown_registered = FALSE;
+static unsigned long message_cache_hits = 0;
+static unsigned long message_cache_misses = 0;
+
+/** Avoid caching too many messages in each thread */
+#define MAX_THREAD_MESSAGE_CACHE_SIZE 8
+
+typedef struct DBusMessageThreadCache DBusMessageThreadCache;
+
+/**
+ * One thread's private message cache. Only the owning thread touches
+ * the messages; the list links and counters are read by others with
+ * the message_cache lock held.
+ */
+struct DBusMessageThreadCache
+{
+  DBusMessageThreadCache *prev; /**< previous cache of all threads */
+  DBusMessageThreadCache *next; /**< next cache of all threads */
+  DBusMessage *messages[MAX_THREAD_MESSAGE_CACHE_SIZE]; /**< cached messages */
+  int n_messages;               /**< number of cached messages */
+  unsigned long hits;           /**< allocations served from the cache */
+  unsigned long misses;         /**< allocations that had to malloc */
+};
+
+static DBusThreadLocal *message_cache_tls = NULL;
+static DBusMessageThreadCache *thread_caches = NULL;
+
+/* The DBusMessage structs themselves come from a pool, so creating
+ * a message that misses the cache costs a free-list pop rather than
+ * a trip through malloc, and messages routed together tend to sit
+ * next to each other in memory. Like the DBusList pool, it is freed
+ * when its last element is.
+ */
+_DBUS_DEFINE_GLOBAL_LOCK (message_pool);
+static DBusMemPool *message_pool = NULL;
+
+static DBusMessage*
+message_alloc (void)
+{
+  DBusMessage *message;
+
+  _DBUS_LOCK (message_pool);
+
+  if (message_pool == NULL)
+    {
+      message_pool = _dbus_mem_pool_new (sizeof (DBusMessage), FALSE);
+
+      if (message_pool == NULL)
+        {
+          _DBUS_UNLOCK (message_pool);
+          return NULL;
+        }
+
+      message = _dbus_mem_pool_alloc (message_pool);
+      if (message == NULL)
+        {
+          _dbus_mem_pool_free (message_pool);
+          message_pool = NULL;
+          _DBUS_UNLOCK (message_pool);
+          return NULL;
+        }
+    }
+  else
+    {
+      message = _dbus_mem_pool_alloc (message_pool);
+    }
+
+  _DBUS_UNLOCK (message_pool);
+
+  return message;
+}
+
+static void
+message_free (DBusMessage *message)
+{
+  _DBUS_LOCK (message_pool);
+  if (_dbus_mem_pool_dealloc (message_pool, message))
+    {
+      _dbus_mem_pool_free (message_pool);
+      message_pool = NULL;
+    }
+  _DBUS_UNLOCK (message_pool);
+}
+
+/**
+ * Gives back the memory of DBusMessage structs that are no longer in
+ * use, see _dbus_mem_pool_trim(). Messages in the message cache
+ * count as in use.
+ */
+void
+_dbus_message_trim_pool (void)
+{
+  _DBUS_LOCK (message_pool);
+
+  if (message_pool != NULL)
+    _dbus_mem_pool_trim (message_pool);
+
+  _DBUS_UNLOCK (message_pool);
+}
 
 static void
 dbus_message_cache_shutdown (void *data)
@@ -479,6 +1025,154 @@ dbus_message_cache_shutdown (void *data)
   _DBUS_UNLOCK (message_cache);
 }
 
+static void
+thread_cache_free (DBusMessageThreadCache *cache)
+{
+  int i;
+
+  for (i = 0; i < cache->n_messages; i++)
+    dbus_message_finalize (cache->messages[i]);
+
+  dbus_free (cache);
+}
+
+/* Called by the thread library as a thread exits */
+static void
+thread_cache_destroy (void *data)
+{
+  DBusMessageThreadCache *cache = data;
+
+  _DBUS_LOCK (message_cache);
+
+  if (cache->prev)
+    cache->prev->next = cache->next;
+  else
+    thread_caches = cache->next;
+  if (cache->next)
+    cache->next->prev = cache->prev;
+
+  message_cache_hits += cache->hits;
+  message_cache_misses += cache->misses;
+
+  _DBUS_UNLOCK (message_cache);
+
+  thread_cache_free (cache);
+}
+
+static void
+thread_caches_shutdown (void *data)
+{
+  _DBUS_LOCK (message_cache);
+
+  while (thread_caches != NULL)
+    {
+      DBusMessageThreadCache *cache = thread_caches;
+
+      thread_caches = cache->next;
+      thread_cache_free (cache);
+    }
+
+  /* Values other threads still hold are simply forgotten with the
+   * key; nobody may be using libdbus while it shuts down.
+   */
+  _dbus_thread_local_free (message_cache_tls);
+  message_cache_tls = NULL;
+
+  message_cache_hits = 0;
+  message_cache_misses = 0;
+
+  _DBUS_UNLOCK (message_cache);
+}
+
+/**
+ * Sets up per-thread message caches. Called from dbus_threads_init(),
+ * before any other thread can be using libdbus, so the thread-local
+ * slot can afterwards be read without locking. If the platform has
+ * no thread-local storage, the shared cache keeps being used.
+ *
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+_dbus_message_cache_init_threads (void)
+{
+  if (message_cache_tls != NULL)
+    return TRUE;
+
+  message_cache_tls = _dbus_thread_local_new (thread_cache_destroy);
+  if (message_cache_tls == NULL)
+    return TRUE;
+
+  if (!_dbus_register_shutdown_func (thread_caches_shutdown, NULL))
+    {
+      _dbus_thread_local_free (message_cache_tls);
+      message_cache_tls = NULL;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * Gets the calling thread's message cache, creating it on first use.
+ *
+ * @returns the cache, or #NULL if not enough memory
+ */
+static DBusMessageThreadCache*
+get_thread_cache (void)
+{
+  DBusMessageThreadCache *cache;
+
+  cache = _dbus_thread_local_get (message_cache_tls);
+  if (cache != NULL)
+    return cache;
+
+  cache = dbus_new0 (DBusMessageThreadCache, 1);
+  if (cache == NULL)
+    return NULL;
+
+  if (!_dbus_thread_local_set (message_cache_tls, cache))
+    {
+      dbus_free (cache);
+      return NULL;
+    }
+
+  _DBUS_LOCK (message_cache);
+  cache->next = thread_caches;
+  if (thread_caches)
+    thread_caches->prev = cache;
+  thread_caches = cache;
+  _DBUS_UNLOCK (message_cache);
+
+  return cache;
+}
+
+/**
+ * Reports how often new messages were recycled from the message
+ * cache rather than allocated, summed over all threads.
+ *
+ * @param hits return location for number of cache hits
+ * @param misses return location for number of cache misses
+ */
+void
+_dbus_message_cache_get_stats (unsigned long *hits,
+                               unsigned long *misses)
+{
+  DBusMessageThreadCache *cache;
+
+  _DBUS_LOCK (message_cache);
+
+  *hits = message_cache_hits;
+  *misses = message_cache_misses;
+
+  for (cache = thread_caches; cache != NULL; cache = cache->next)
+    {
+      *hits += cache->hits;
+      *misses += cache->misses;
+    }
+
+  _DBUS_UNLOCK (message_cache);
+}
+
 /**
  * Tries to get a message from the message cache.  The retrieved
  * message will have junk in it, so it still needs to be cleared out
@@ -492,7 +1186,31 @@ dbus_message_get_cached (void)
   DBusMessage *message;
   int i;
 
-  message = NULL;
+  message = NULL;
+
+  if (message_cache_tls != NULL)
+    {
+      DBusMessageThreadCache *cache;
+
+      cache = get_thread_cache ();
+      if (cache == NULL)
+        return NULL;
+
+      if (cache->n_messages == 0)
+        {
+          cache->misses += 1;
+          return NULL;
+        }
+
+      cache->hits += 1;
+      cache->n_messages -= 1;
+      message = cache->messages[cache->n_messages];
+
+      _dbus_assert (message->refcount.value == 0);
+      _dbus_assert (!message_has_counters (message));
+
+      return message;
+    }
 
   _DBUS_LOCK (message_cache);
 
@@ -500,10 +1218,13 @@ dbus_message_get_cached (void)
 
   if (message_cache_count == 0)
     {
+      message_cache_misses += 1;
       _DBUS_UNLOCK (message_cache);
       return NULL;
     }
 
+  message_cache_hits += 1;
+
   /* This is not necessarily true unless count > 0, and
    * message_cache is uninitialized until the shutdown is
    * registered
@@ -527,7 +1248,7 @@ dbus_message_get_cached (void)
   _dbus_assert (message != NULL);
 
   _dbus_assert (message->refcount.value == 0);
-  _dbus_assert (message->counters == NULL);
+  _dbus_assert (!message_has_counters (message));
   
   _DBUS_UNLOCK (message_cache);
 
@@ -535,6 +1256,17 @@ dbus_message_get_cached (void)
 }
 
 #ifdef HAVE_UNIX_FD_PASSING
+/** Bytes of room the loader keeps for received unix fds once they
+ *  have all been handed to messages
+ */
+#define MAX_UNIX_FDS_WASTE (64 * sizeof (int))
+
+/** Number of unix fds the loader has read but not handed to a
+ *  message yet
+ */
+#define loader_get_n_unix_fds(loader) \
+  ((unsigned) (_dbus_string_get_length (&(loader)->unix_fds) / sizeof (int)))
+
 static void
 close_unix_fds(int *fds, unsigned *n_fds)
 {
@@ -565,15 +1297,26 @@ static void
 free_counter (void *element,
               void *data)
 {
-  DBusCounter *counter = element;
-  DBusMessage *message = data;
+  message_uncount (data, element);
+}
 
-  _dbus_counter_adjust_size (counter, - message->size_counter_delta);
-#ifdef HAVE_UNIX_FD_PASSING
-  _dbus_counter_adjust_unix_fd (counter, - message->unix_fd_counter_delta);
-#endif
+static void
+free_counters (DBusMessage *message)
+{
+  int i;
 
-  _dbus_counter_unref (counter);
+  for (i = 0; i < N_INLINE_COUNTERS; i++)
+    {
+      if (message->inline_counters[i] != NULL)
+        {
+          message_uncount (message, message->inline_counters[i]);
+          message->inline_counters[i] = NULL;
+        }
+    }
+
+  _dbus_list_foreach (&message->counters,
+                      free_counter, message);
+  _dbus_list_clear (&message->counters);
 }
 
 /**
@@ -594,16 +1337,48 @@ dbus_message_cache_or_finalize (DBusMessage *message)
    */
   _dbus_data_slot_list_clear (&message->slot_list);
 
-  _dbus_list_foreach (&message->counters,
-                      free_counter, message);
-  _dbus_list_clear (&message->counters);
+  free_counters (message);
+  free_arg_offsets (message);
+  free_append_signature (message);
 
 #ifdef HAVE_UNIX_FD_PASSING
   close_unix_fds(message->unix_fds, &message->n_unix_fds);
 #endif
 
+  /* A shared body can't be emptied for reuse */
+  if (message->shared_body != NULL)
+    {
+      dbus_message_finalize (message);
+      return;
+    }
+
   was_cached = FALSE;
 
+  if (message_cache_tls != NULL)
+    {
+      DBusMessageThreadCache *cache;
+
+      /* Don't create a cache for a thread that only frees messages */
+      cache = _dbus_thread_local_get (message_cache_tls);
+
+      if (cache != NULL &&
+          cache->n_messages < MAX_THREAD_MESSAGE_CACHE_SIZE &&
+          (_dbus_string_get_length (&message->header.data) +
+           _dbus_string_get_length (&message->body)) <=
+          MAX_MESSAGE_SIZE_TO_CACHE)
+        {
+          cache->messages[cache->n_messages] = message;
+          cache->n_messages += 1;
+#ifndef DBUS_DISABLE_CHECKS
+          message->in_cache = TRUE;
+#endif
+        }
+      else
+        dbus_message_finalize (message);
+
+      return;
+    }
+
   _DBUS_LOCK (message_cache);
 
   if (!message_cache_shutdown_registered)
@@ -675,7 +1450,8 @@ _dbus_message_iter_check (DBusMessageRealIter *iter)
           return FALSE;
         }
       /* because we swap the message into compiler order when you init an iter */
-      _dbus_assert (iter->u.reader.byte_order == DBUS_COMPILER_BYTE_ORDER);
+      _dbus_assert (iter->u.reader.byte_order == DBUS_COMPILER_BYTE_ORDER ||
+                    iter->message->keep_byte_order);
     }
   else if (iter->iter_type == DBUS_MESSAGE_ITER_TYPE_WRITER)
     {
@@ -823,6 +1599,15 @@ _dbus_message_iter_get_args_valist (DBusMessageIter *iter,
               _dbus_assert (ptr != NULL);
               _dbus_assert (n_elements_p != NULL);
 
+              if (real->u.reader.byte_order != DBUS_COMPILER_BYTE_ORDER)
+                {
+                  dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                                  "Argument %d is an array that can't be read "
+                                  "in place, since the message was left in "
+                                  "the other byte order\n", i);
+                  goto out;
+                }
+
               _dbus_type_reader_recurse (&real->u.reader, &array);
 
               _dbus_type_reader_read_fixed_multi (&array,
@@ -842,15 +1627,13 @@ _dbus_message_iter_get_args_valist (DBusMessageIter *iter,
               _dbus_assert (str_array_p != NULL);
               _dbus_assert (n_elements_p != NULL);
 
-              /* Count elements in the array */
+              /* Count elements in the array, then point at them all
+               * in the message and dup each one in place
+               */
               _dbus_type_reader_recurse (&real->u.reader, &array);
 
               n_elements = 0;
-              while (_dbus_type_reader_get_current_type (&array) != DBUS_TYPE_INVALID)
-                {
-                  ++n_elements;
-                  _dbus_type_reader_next (&array);
-                }
+              _dbus_type_reader_read_string_multi (&array, NULL, &n_elements);
 
               str_array = dbus_new0 (char*, n_elements + 1);
               if (str_array == NULL)
@@ -859,32 +1642,26 @@ _dbus_message_iter_get_args_valist (DBusMessageIter *iter,
                   goto out;
                 }
 
-              /* Now go through and dup each string */
-              _dbus_type_reader_recurse (&real->u.reader, &array);
+              if (n_elements > 0)
+                _dbus_type_reader_read_string_multi (&array,
+                                                     (const char **) str_array,
+                                                     &n_elements);
 
               i = 0;
               while (i < n_elements)
                 {
-                  const char *s;
-                  _dbus_type_reader_read_basic (&array,
-                                                (void *) &s);
-                  
-                  str_array[i] = _dbus_strdup (s);
+                  str_array[i] = _dbus_strdup (str_array[i]);
                   if (str_array[i] == NULL)
                     {
+                      /* frees the copies made so far, which end here */
                       dbus_free_string_array (str_array);
                       _DBUS_SET_OOM (error);
                       goto out;
                     }
-                  
+
                   ++i;
-                  
-                  if (!_dbus_type_reader_next (&array))
-                    _dbus_assert (i == n_elements);
                 }
 
-              _dbus_assert (_dbus_type_reader_get_current_type (&array) == DBUS_TYPE_INVALID);
-              _dbus_assert (i == n_elements);
               _dbus_assert (str_array[i] == NULL);
 
               *str_array_p = str_array;
@@ -926,6 +1703,26 @@ _dbus_message_iter_get_args_valist (DBusMessageIter *iter,
   return retval;
 }
 
+/**
+ * Initializes an iterator over the elements of an object path,
+ * without copying the path. The path must be valid and must stay
+ * alive and unmodified while the iterator is in use.
+ *
+ * @param iter the iterator to initialize
+ * @param path a valid object path
+ */
+void
+_dbus_object_path_iter_init (DBusObjectPathIter *iter,
+                             const char         *path)
+{
+  DBusObjectPathRealIter *real = (DBusObjectPathRealIter *) iter;
+
+  _dbus_assert (sizeof (DBusObjectPathRealIter) <= sizeof (DBusObjectPathIter));
+  _dbus_assert (path[0] == '/');
+
+  real->next = path + 1;
+}
+
 /** @} */
 
 /**
@@ -1050,6 +1847,9 @@ dbus_message_finalize (DBusMessage *message)
 
   _dbus_header_free (&message->header);
   _dbus_string_free (&message->body);
+  release_shared_body (message);
+  free_arg_offsets (message);
+  free_append_signature (message);
 
 #ifdef HAVE_UNIX_FD_PASSING
   close_unix_fds(message->unix_fds, &message->n_unix_fds);
@@ -1058,7 +1858,7 @@ dbus_message_finalize (DBusMessage *message)
 
   _dbus_assert (message->refcount.value == 0);
   
-  dbus_free (message);
+  message_free (message);
 }
 
 static DBusMessage*
@@ -1066,6 +1866,7 @@ dbus_message_new_empty_header (void)
 {
   DBusMessage *message;
   dbus_bool_t from_cache;
+  int i;
 
   message = dbus_message_get_cached ();
 
@@ -1076,7 +1877,7 @@ dbus_message_new_empty_header (void)
   else
     {
       from_cache = FALSE;
-      message = dbus_new (DBusMessage, 1);
+      message = message_alloc ();
       if (message == NULL)
         return NULL;
 #ifndef DBUS_DISABLE_CHECKS
@@ -1092,12 +1893,23 @@ dbus_message_new_empty_header (void)
   message->refcount.value = 1;
   message->byte_order = DBUS_COMPILER_BYTE_ORDER;
   message->locked = FALSE;
+  message->body_validation_pending = FALSE;
+  message->body_invalid = FALSE;
+  message->keep_byte_order = FALSE;
+  message->priority = FALSE;
+  message->expiry_started = FALSE;
 #ifndef DBUS_DISABLE_CHECKS
   message->in_cache = FALSE;
 #endif
+  for (i = 0; i < N_INLINE_COUNTERS; i++)
+    message->inline_counters[i] = NULL;
   message->counters = NULL;
   message->size_counter_delta = 0;
   message->changed_stamp = 0;
+  message->arg_offsets = NULL;
+  message->n_args = -1;
+  message->append_signature = NULL;
+  message->shared_body = NULL;
 
 #ifdef HAVE_UNIX_FD_PASSING
   message->n_unix_fds = 0;
@@ -1117,14 +1929,14 @@ dbus_message_new_empty_header (void)
     {
       if (!_dbus_header_init (&message->header, message->byte_order))
         {
-          dbus_free (message);
+          message_free (message);
           return NULL;
         }
 
       if (!_dbus_string_init_preallocated (&message->body, 32))
         {
           _dbus_header_free (&message->header);
-          dbus_free (message);
+          message_free (message);
           return NULL;
         }
     }
@@ -1307,6 +2119,52 @@ dbus_message_new_signal (const char *path,
   return message;
 }
 
+/**
+ * Constructs a new message with the same header as another message
+ * that has no arguments: the same type, flags, path, interface,
+ * member, destination and so on, but with no serial. Returns #NULL if
+ * memory can't be allocated for the message.
+ *
+ * The header is copied as it is rather than built up field by field,
+ * so this is a cheap way to send the same signal over and over: make
+ * the template once with dbus_message_new_signal(), and each message
+ * to send from it.
+ *
+ * @code
+ * template = dbus_message_new_signal ("/org/example/Sensor",
+ *                                     "org.example.Sensor", "Reading");
+ * ...
+ * message = dbus_message_new_from_template (template);
+ * dbus_message_append_args (message, DBUS_TYPE_DOUBLE, &reading,
+ *                           DBUS_TYPE_INVALID);
+ * @endcode
+ *
+ * @param template_message the message to copy the header of
+ * @returns a new DBusMessage, free with dbus_message_unref()
+ */
+DBusMessage*
+dbus_message_new_from_template (DBusMessage *template_message)
+{
+  DBusMessage *message;
+
+  _dbus_return_val_if_fail (template_message != NULL, NULL);
+  _dbus_return_val_if_fail (_dbus_string_get_length (&template_message->body) == 0, NULL);
+
+  message = dbus_message_new_empty_header ();
+  if (message == NULL)
+    return NULL;
+
+  if (!_dbus_header_copy_into (&template_message->header, &message->header))
+    {
+      dbus_message_unref (message);
+      return NULL;
+    }
+
+  message->byte_order = template_message->byte_order;
+
+  return message;
+}
+
 /**
  * Creates a new message that is an error reply to another message.
  * Error replies are most common in response to method calls, but
@@ -1432,6 +2290,10 @@ dbus_message_new_error_printf (DBusMessage *reply_to,
  * outgoing message queue and thus not modifiable) the new message
  * will not be locked.
  *
+ * A large body isn't copied straight away: the two messages share it
+ * until either has arguments appended, so copying a message only to
+ * change its header is cheap.
+ *
  * @todo This function can't be used in programs that try to recover from OOM errors.
  *
  * @param message the message
@@ -1444,34 +2306,57 @@ dbus_message_copy (const DBusMessage *message)
 
   _dbus_return_val_if_fail (message != NULL, NULL);
 
-  retval = dbus_new0 (DBusMessage, 1);
+  retval = message_alloc ();
   if (retval == NULL)
     return NULL;
 
+  _DBUS_ZERO (*retval);
+
   retval->refcount.value = 1;
   retval->byte_order = message->byte_order;
   retval->locked = FALSE;
+  retval->body_validation_pending = message->body_validation_pending;
+  retval->body_invalid = message->body_invalid;
+  retval->n_args = -1;
 #ifndef DBUS_DISABLE_CHECKS
   retval->generation = message->generation;
 #endif
 
   if (!_dbus_header_copy (&message->header, &retval->header))
     {
-      dbus_free (retval);
+      message_free (retval);
       return NULL;
     }
 
-  if (!_dbus_string_init_preallocated (&retval->body,
-                                       _dbus_string_get_length (&message->body)))
+  /* Share a large body until one of the messages changes it, or any
+   * body that is already shared. Only bodies in our byte order, since
+   * reading swaps a body in place.
+   */
+  if (message->byte_order == DBUS_COMPILER_BYTE_ORDER &&
+      (message->shared_body != NULL ||
+       _dbus_string_get_length (&message->body) >= MIN_SHARED_BODY_LENGTH) &&
+      share_body ((DBusMessage *) message))
     {
-      _dbus_header_free (&retval->header);
-      dbus_free (retval);
-      return NULL;
+      _dbus_atomic_inc (&message->shared_body->refcount);
+      retval->shared_body = message->shared_body;
+      _dbus_string_init_const_len (&retval->body,
+                                   _dbus_string_get_const_data (&message->body),
+                                   _dbus_string_get_length (&message->body));
     }
+  else
+    {
+      if (!_dbus_string_init_preallocated (&retval->body,
+                                           _dbus_string_get_length (&message->body)))
+        {
+          _dbus_header_free (&retval->header);
+          message_free (retval);
+          return NULL;
+        }
 
-  if (!_dbus_string_copy (&message->body, 0,
-			  &retval->body, 0))
-    goto failed_copy;
+      if (!_dbus_string_copy (&message->body, 0,
+                              &retval->body, 0))
+        goto failed_copy;
+    }
 
 #ifdef HAVE_UNIX_FD_PASSING
   retval->unix_fds = dbus_new(int, message->n_unix_fds);
@@ -1497,13 +2382,14 @@ dbus_message_copy (const DBusMessage *message)
  failed_copy:
   _dbus_header_free (&retval->header);
   _dbus_string_free (&retval->body);
+  release_shared_body (retval);
 
 #ifdef HAVE_UNIX_FD_PASSING
   close_unix_fds(retval->unix_fds, &retval->n_unix_fds);
   dbus_free(retval->unix_fds);
 #endif
 
-  dbus_free (retval);
+  message_free (retval);
 
   return NULL;
 }
@@ -1677,6 +2563,7 @@ dbus_message_append_args_valist (DBusMessage *message,
 {
   int type;
   DBusMessageIter iter;
+  DBusMessageRealIter *real;
 
   _dbus_return_val_if_fail (message != NULL, FALSE);
 
@@ -1684,6 +2571,13 @@ dbus_message_append_args_valist (DBusMessage *message,
 
   dbus_message_iter_init_append (message, &iter);
 
+  /* Hold the signature open across all the arguments, so the header
+   * is only rewritten once at the end rather than after each one
+   */
+  real = (DBusMessageRealIter *) &iter;
+  if (!_dbus_message_iter_open_signature (real))
+    return FALSE;
+
   while (type != DBUS_TYPE_INVALID)
     {
       if (dbus_type_is_basic (type))
@@ -1778,9 +2672,11 @@ dbus_message_append_args_valist (DBusMessage *message,
       type = va_arg (var_args, int);
     }
 
-  return TRUE;
+  return _dbus_message_iter_close_signature (real);
 
  failed:
+  /* keep the header in step with whatever did get appended */
+  _dbus_message_iter_close_signature (real);
   return FALSE;
 }
 
@@ -1796,7 +2692,9 @@ dbus_message_append_args_valist (DBusMessage *message,
  * signature are supported; but these are returned as allocated memory
  * and must be freed with dbus_free_string_array(), while the other
  * types are returned as const references. To get a string array
- * pass in "char ***array_location" and "int *n_elements".
+ * pass in "char ***array_location" and "int *n_elements". To avoid
+ * copying every string of a long array, use
+ * dbus_message_iter_get_string_array() instead.
  *
  * Similar to dbus_message_get_fixed_array() this function does not
  * support arrays of type DBUS_TYPE_UNIX_FD. If you need to parse
@@ -1868,6 +2766,13 @@ dbus_message_get_args_valist (DBusMessage     *message,
   _dbus_return_val_if_fail (message != NULL, FALSE);
   _dbus_return_val_if_error_is_set (error, FALSE);
 
+  if (!ensure_body_validated (message))
+    {
+      dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                      "Message body is invalid");
+      return FALSE;
+    }
+
   dbus_message_iter_init (message, &iter);
   return _dbus_message_iter_get_args_valist (&iter, error, first_arg_type, var_args);
 }
@@ -1880,9 +2785,14 @@ _dbus_message_iter_init_common (DBusMessage         *message,
   _dbus_assert (sizeof (DBusMessageRealIter) <= sizeof (DBusMessageIter));
 
   /* Since the iterator will read or write who-knows-what from the
-   * message, we need to get in the right byte order
+   * message, we need to get in the right byte order; a body that
+   * hasn't been validated can't safely be swapped, though. A message
+   * that is only being passed on can be read in either order, as
+   * long as nothing asks for a pointer to a fixed-length array.
    */
-  ensure_byte_order (message);
+  if (ensure_body_validated (message) &&
+      (iter_type == DBUS_MESSAGE_ITER_TYPE_WRITER || !message->keep_byte_order))
+    ensure_byte_order (message);
   
   real->message = message;
   real->changed_stamp = message->changed_stamp;
@@ -1923,11 +2833,18 @@ dbus_message_iter_init (DBusMessage     *message,
   _dbus_return_val_if_fail (message != NULL, FALSE);
   _dbus_return_val_if_fail (iter != NULL, FALSE);
 
-  get_const_signature (&message->header, &type_str, &type_pos);
-
   _dbus_message_iter_init_common (message, real,
                                   DBUS_MESSAGE_ITER_TYPE_READER);
 
+  /* Read a corrupt body as if it were empty */
+  if (message->body_invalid)
+    {
+      type_str = &_dbus_empty_signature_str;
+      type_pos = 0;
+    }
+  else
+    get_const_signature (&message->header, &type_str, &type_pos);
+
   _dbus_type_reader_init (&real->u.reader,
                           message->byte_order,
                           type_str, type_pos,
@@ -1937,6 +2854,69 @@ dbus_message_iter_init (DBusMessage     *message,
   return _dbus_type_reader_get_current_type (&real->u.reader) != DBUS_TYPE_INVALID;
 }
 
+/**
+ * Like dbus_message_iter_init(), but starts the iterator at argument
+ * n of the message (counting from 0) rather than the first one, as if
+ * dbus_message_iter_next() had been called n times, but without
+ * stepping over the arguments before it. The first call for a message
+ * walks the arguments once to find where each one starts; later calls
+ * go straight to the argument.
+ *
+ * @param message the message
+ * @param iter pointer to an iterator to initialize
+ * @param n the index of the argument to start at
+ * @returns #FALSE if the message has fewer than n + 1 arguments
+ */
+dbus_bool_t
+dbus_message_iter_init_at (DBusMessage     *message,
+                           DBusMessageIter *iter,
+                           int              n)
+{
+  DBusMessageRealIter *real = (DBusMessageRealIter *)iter;
+  const DBusString *type_str;
+  int type_pos;
+
+  _dbus_return_val_if_fail (message != NULL, FALSE);
+  _dbus_return_val_if_fail (iter != NULL, FALSE);
+  _dbus_return_val_if_fail (n >= 0, FALSE);
+
+  if (!dbus_message_iter_init (message, iter))
+    return FALSE;
+
+  if (n == 0)
+    return TRUE;
+
+  /* Without memory for the offsets, walking to it still works */
+  if (!ensure_arg_offsets (message))
+    {
+      while (n > 0)
+        {
+          if (!_dbus_type_reader_next (&real->u.reader))
+            return FALSE;
+          n -= 1;
+        }
+      return TRUE;
+    }
+
+  get_const_signature (&message->header, &type_str, &type_pos);
+
+  /* past the end, leave it after the last argument */
+  _dbus_type_reader_init (&real->u.reader,
+                          message->byte_order,
+                          type_str,
+                          type_pos + message->arg_offsets[MIN (n, message->n_args - 1) * 2],
+                          &message->body,
+                          message->arg_offsets[MIN (n, message->n_args - 1) * 2 + 1]);
+
+  if (n >= message->n_args)
+    {
+      _dbus_type_reader_next (&real->u.reader);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 /**
  * Checks if an iterator has any more fields.
  *
@@ -2201,59 +3181,256 @@ dbus_message_iter_get_array_len (DBusMessageIter *iter)
 
   _dbus_return_val_if_fail (_dbus_message_iter_check (real), 0);
 
-  return _dbus_type_reader_get_array_length (&real->u.reader);
+  return _dbus_type_reader_get_array_length (&real->u.reader);
+}
+
+/**
+ * Reads a block of fixed-length values from the message iterator.
+ * Fixed-length values are those basic types that are not string-like,
+ * such as integers, bool, double. The returned block will be from the
+ * current position in the array until the end of the array.
+ *
+ * There is one exception here: although DBUS_TYPE_UNIX_FD is
+ * considered a 'fixed' type arrays of this type may not be read with
+ * this function.
+ *
+ * The message iter should be "in" the array (that is, you recurse into the
+ * array, and then you call dbus_message_iter_get_fixed_array() on the
+ * "sub-iterator" created by dbus_message_iter_recurse()).
+ *
+ * The value argument should be the address of a location to store the
+ * returned array. So for int32 it should be a "const dbus_int32_t**"
+ * The returned value is by reference and should not be freed.
+ * 
+ * This function should only be used if dbus_type_is_fixed() returns
+ * #TRUE for the element type.
+ *
+ * If an array's elements are not fixed in size, you have to recurse
+ * into the array with dbus_message_iter_recurse() and read the
+ * elements one by one.
+ * 
+ * Because the array is not copied, this function runs in constant
+ * time and is fast; it's much preferred over walking the entire array
+ * with an iterator. (However, you can always use
+ * dbus_message_iter_recurse(), even for fixed-length types;
+ * dbus_message_iter_get_fixed_array() is just an optimization.)
+ * 
+ * @param iter the iterator
+ * @param value location to store the block
+ * @param n_elements number of elements in the block
+ */
+void
+dbus_message_iter_get_fixed_array (DBusMessageIter  *iter,
+                                   void             *value,
+                                   int              *n_elements)
+{
+  DBusMessageRealIter *real = (DBusMessageRealIter *)iter;
+  int subtype = _dbus_type_reader_get_current_type(&real->u.reader);
+
+  _dbus_return_if_fail (_dbus_message_iter_check (real));
+  _dbus_return_if_fail (value != NULL);
+  _dbus_return_if_fail ((subtype == DBUS_TYPE_INVALID) ||
+                        (dbus_type_is_fixed (subtype) && subtype != DBUS_TYPE_UNIX_FD));
+  _dbus_return_if_fail (real->u.reader.byte_order == DBUS_COMPILER_BYTE_ORDER);
+
+  _dbus_type_reader_read_fixed_multi (&real->u.reader,
+                                      value, n_elements);
+}
+
+/**
+ * Copies an array of structs made only of fixed-length values, such
+ * as "a(iid)", out of the message into a C array of structs, saving
+ * a dbus_message_iter_recurse() and a dbus_message_iter_get_basic()
+ * per member. Fixed-length values are those basic types that are not
+ * string-like; as with dbus_message_iter_get_fixed_array(),
+ * #DBUS_TYPE_UNIX_FD is not allowed. Nested structs of such values
+ * are fine. The copied elements are from the current position in the
+ * array until the end of the array, and are in native byte order.
+ *
+ * As with dbus_message_iter_get_fixed_array(), the message iter
+ * should be "in" the array, and is not moved.
+ *
+ * The C struct must have its members in the same order, of the same
+ * sizes and at the same offsets as D-Bus lays them out: each member
+ * aligned to its own size from the start of the struct, and nested
+ * structs to 8 bytes. Most ABIs lay out C structs that way, but some
+ * 32-bit ones only align 8-byte members to 4 bytes, so check before
+ * relying on it. Pass sizeof the struct as element_size.
+ *
+ * @code
+ * struct sample { dbus_int32_t id; dbus_int32_t flags; double value; };
+ * struct sample samples[64];
+ * int n_samples = 64;
+ * if (!dbus_message_iter_get_fixed_struct_array (&array_iter, samples,
+ *                                                sizeof (struct sample),
+ *                                                &n_samples))
+ *   fprintf (stderr, "%d samples don't fit\n", n_samples);
+ * @endcode
+ *
+ * On entry n_elements is how many elements there is room for in the
+ * C array. If there are more than that in the message, nothing is
+ * copied, the number there are is stored in n_elements and #FALSE is
+ * returned; so you can pass 0 and #NULL to find out how many there
+ * are.
+ *
+ * @param iter the iterator
+ * @param elements the C array to copy into
+ * @param element_size the size of each element of the C array
+ * @param n_elements room in the C array; returns number of elements
+ * @returns #FALSE if there wasn't room for all the elements
+ */
+dbus_bool_t
+dbus_message_iter_get_fixed_struct_array (DBusMessageIter *iter,
+                                          void            *elements,
+                                          int              element_size,
+                                          int             *n_elements)
+{
+  DBusMessageRealIter *real = (DBusMessageRealIter *)iter;
+  int size;
+
+  _dbus_return_val_if_fail (_dbus_message_iter_check (real), FALSE);
+  _dbus_return_val_if_fail (real->iter_type == DBUS_MESSAGE_ITER_TYPE_READER, FALSE);
+
+  size = _dbus_type_get_fixed_struct_size (real->u.reader.type_str,
+                                           real->u.reader.type_pos);
+
+  _dbus_return_val_if_fail (size > 0, FALSE);
+  _dbus_return_val_if_fail (element_size >= size, FALSE);
+  _dbus_return_val_if_fail (n_elements != NULL, FALSE);
+  _dbus_return_val_if_fail (*n_elements >= 0, FALSE);
+  _dbus_return_val_if_fail (elements != NULL || *n_elements == 0, FALSE);
+
+  return _dbus_type_reader_read_fixed_struct_multi (&real->u.reader, elements,
+                                                    element_size, n_elements);
+}
+
+/**
+ * Gets pointers to the strings in an array of #DBUS_TYPE_STRING,
+ * #DBUS_TYPE_OBJECT_PATH or #DBUS_TYPE_SIGNATURE, from the current
+ * position to the end of the array. Unlike dbus_message_get_args(),
+ * which returns a newly-allocated copy of each string, the strings are
+ * not copied: like the one from dbus_message_iter_get_basic(), each
+ * pointer points into the message and is valid as long as the message
+ * is not modified or freed. For arrays with many elements this saves
+ * an allocation per element.
+ *
+ * As with dbus_message_iter_get_fixed_array(), the message iter
+ * should be "in" the array, and is not moved.
+ *
+ * @code
+ * const char **names;
+ * int n_names = 0;
+ * dbus_message_iter_get_string_array (&array_iter, NULL, &n_names);
+ * names = dbus_new (const char *, n_names);
+ * if (names != NULL)
+ *   dbus_message_iter_get_string_array (&array_iter, names, &n_names);
+ * @endcode
+ *
+ * On entry n_elements is how many pointers there is room for in the
+ * C array. If there are more strings than that in the message, only
+ * the first n_elements are stored, the number there are is stored in
+ * n_elements and #FALSE is returned; so you can pass 0 and #NULL to
+ * find out how many there are.
+ *
+ * @param iter the iterator
+ * @param elements the C array to store the pointers in
+ * @param n_elements room in the C array; returns number of strings
+ * @returns #FALSE if there wasn't room for all the strings
+ */
+dbus_bool_t
+dbus_message_iter_get_string_array (DBusMessageIter  *iter,
+                                    const char      **elements,
+                                    int              *n_elements)
+{
+  DBusMessageRealIter *real = (DBusMessageRealIter *)iter;
+  int subtype;
+
+  _dbus_return_val_if_fail (_dbus_message_iter_check (real), FALSE);
+  _dbus_return_val_if_fail (real->iter_type == DBUS_MESSAGE_ITER_TYPE_READER, FALSE);
+  _dbus_return_val_if_fail (n_elements != NULL, FALSE);
+  _dbus_return_val_if_fail (*n_elements >= 0, FALSE);
+  _dbus_return_val_if_fail (elements != NULL || *n_elements == 0, FALSE);
+
+  subtype = _dbus_type_reader_get_current_type (&real->u.reader);
+
+  /* an empty array can't be recursed into, so there is no array reader */
+  if (subtype == DBUS_TYPE_INVALID)
+    {
+      *n_elements = 0;
+      return TRUE;
+    }
+
+  _dbus_return_val_if_fail (subtype == DBUS_TYPE_STRING ||
+                            subtype == DBUS_TYPE_OBJECT_PATH ||
+                            subtype == DBUS_TYPE_SIGNATURE, FALSE);
+
+  return _dbus_type_reader_read_string_multi (&real->u.reader, elements,
+                                              n_elements);
+}
+
+/* Whether the signature has a "{sv}" at type_pos */
+static dbus_bool_t
+is_variant_dict_entry (const DBusString *type_str,
+                       int               type_pos)
+{
+  return _dbus_string_get_length (type_str) >= type_pos + 4 &&
+    memcmp (_dbus_string_get_const_data_len (type_str, type_pos, 4),
+            DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+            DBUS_TYPE_STRING_AS_STRING
+            DBUS_TYPE_VARIANT_AS_STRING
+            DBUS_DICT_ENTRY_END_CHAR_AS_STRING, 4) == 0;
 }
 
 /**
- * Reads a block of fixed-length values from the message iterator.
- * Fixed-length values are those basic types that are not string-like,
- * such as integers, bool, double. The returned block will be from the
- * current position in the array until the end of the array.
- *
- * There is one exception here: although DBUS_TYPE_UNIX_FD is
- * considered a 'fixed' type arrays of this type may not be read with
- * this function.
- *
- * The message iter should be "in" the array (that is, you recurse into the
- * array, and then you call dbus_message_iter_get_fixed_array() on the
- * "sub-iterator" created by dbus_message_iter_recurse()).
+ * Looks up a key in a dictionary of variants, "a{sv}", such as the
+ * properties in a PropertiesChanged signal or a GetAll reply, without
+ * walking each entry with dbus_message_iter_recurse() and
+ * dbus_message_iter_get_basic(). Keys are compared byte for byte and
+ * the search runs from the current entry to the end of the array; if
+ * a key appears more than once, the first one found wins.
+ *
+ * As with dbus_message_iter_get_fixed_array(), the message iter
+ * should be "in" the array, and is not moved. If the key is found,
+ * value is initialized to point at the value inside the entry's
+ * variant, as if by recursing into the variant.
  *
- * The value argument should be the address of a location to store the
- * returned array. So for int32 it should be a "const dbus_int32_t**"
- * The returned value is by reference and should not be freed.
- * 
- * This function should only be used if dbus_type_is_fixed() returns
- * #TRUE for the element type.
+ * @code
+ * DBusMessageIter value_iter;
+ * const char *name;
+ * if (dbus_message_iter_find_variant_entry (&dict_iter, "Name", &value_iter) &&
+ *     dbus_message_iter_get_arg_type (&value_iter) == DBUS_TYPE_STRING)
+ *   dbus_message_iter_get_basic (&value_iter, &name);
+ * @endcode
  *
- * If an array's elements are not fixed in size, you have to recurse
- * into the array with dbus_message_iter_recurse() and read the
- * elements one by one.
- * 
- * Because the array is not copied, this function runs in constant
- * time and is fast; it's much preferred over walking the entire array
- * with an iterator. (However, you can always use
- * dbus_message_iter_recurse(), even for fixed-length types;
- * dbus_message_iter_get_fixed_array() is just an optimization.)
- * 
- * @param iter the iterator
- * @param value location to store the block
- * @param n_elements number of elements in the block
+ * @param iter the iterator, in an array of "{sv}"
+ * @param key the key to look for
+ * @param value iterator to initialize at the value
+ * @returns #FALSE if the key isn't there
  */
-void
-dbus_message_iter_get_fixed_array (DBusMessageIter  *iter,
-                                   void             *value,
-                                   int              *n_elements)
+dbus_bool_t
+dbus_message_iter_find_variant_entry (DBusMessageIter *iter,
+                                      const char      *key,
+                                      DBusMessageIter *value)
 {
   DBusMessageRealIter *real = (DBusMessageRealIter *)iter;
-  int subtype = _dbus_type_reader_get_current_type(&real->u.reader);
+  DBusMessageRealIter *real_value = (DBusMessageRealIter *)value;
 
-  _dbus_return_if_fail (_dbus_message_iter_check (real));
-  _dbus_return_if_fail (value != NULL);
-  _dbus_return_if_fail ((subtype == DBUS_TYPE_INVALID) ||
-                        (dbus_type_is_fixed (subtype) && subtype != DBUS_TYPE_UNIX_FD));
+  _dbus_return_val_if_fail (_dbus_message_iter_check (real), FALSE);
+  _dbus_return_val_if_fail (real->iter_type == DBUS_MESSAGE_ITER_TYPE_READER, FALSE);
+  _dbus_return_val_if_fail (key != NULL, FALSE);
+  _dbus_return_val_if_fail (value != NULL, FALSE);
 
-  _dbus_type_reader_read_fixed_multi (&real->u.reader,
-                                      value, n_elements);
+  /* an empty array can't be recursed into, so there is no array reader */
+  if (dbus_message_iter_get_arg_type (iter) == DBUS_TYPE_INVALID)
+    return FALSE;
+
+  _dbus_return_val_if_fail (is_variant_dict_entry (real->u.reader.type_str,
+                                                   real->u.reader.type_pos),
+                            FALSE);
+
+  *real_value = *real;
+  return _dbus_type_reader_find_variant_entry (&real->u.reader, key,
+                                               &real_value->u.reader);
 }
 
 /**
@@ -2294,6 +3471,10 @@ dbus_message_iter_init_append (DBusMessage     *message,
  * signature, stores it in the iterator, and points the iterator to
  * the end of it. Used any time we write to the message.
  *
+ * The string left by the last append that closed its signature
+ * successfully is the same as the header's, so it's taken over
+ * rather than copied again.
+ *
  * @param real an iterator without a type_str
  * @returns #FALSE if no memory
  */
@@ -2306,6 +3487,11 @@ _dbus_message_iter_open_signature (DBusMessageRealIter *real)
 
   _dbus_assert (real->iter_type == DBUS_MESSAGE_ITER_TYPE_WRITER);
 
+  free_arg_offsets (real->message);
+
+  if (!unshare_body (real->message))
+    return FALSE;
+
   if (real->u.writer.type_str != NULL)
     {
       _dbus_assert (real->sig_refcount > 0);
@@ -2313,6 +3499,18 @@ _dbus_message_iter_open_signature (DBusMessageRealIter *real)
       return TRUE;
     }
 
+  if (real->message->append_signature != NULL)
+    {
+      str = real->message->append_signature;
+      real->message->append_signature = NULL;
+
+      real->sig_refcount = 1;
+
+      _dbus_type_writer_add_types (&real->u.writer,
+                                   str, _dbus_string_get_length (str));
+      return TRUE;
+    }
+
   str = dbus_new (DBusString, 1);
   if (str == NULL)
     return FALSE;
@@ -2365,6 +3563,9 @@ _dbus_message_iter_open_signature (DBusMessageRealIter *real)
  * anymore. Frees the signature even if it fails, so you can't
  * really recover from failure. Kinda busted.
  *
+ * On success the string is kept in the message for the next append
+ * instead of being freed.
+ *
  * @param real an iterator without a type_str
  * @returns #FALSE if no memory
  */
@@ -2397,8 +3598,16 @@ _dbus_message_iter_close_signature (DBusMessageRealIter *real)
     retval = FALSE;
 
   _dbus_type_writer_remove_types (&real->u.writer);
-  _dbus_string_free (str);
-  dbus_free (str);
+
+  if (retval && real->message->append_signature == NULL)
+    {
+      real->message->append_signature = str;
+    }
+  else
+    {
+      _dbus_string_free (str);
+      dbus_free (str);
+    }
 
   return retval;
 }
@@ -2627,11 +3836,215 @@ dbus_message_iter_append_fixed_array (DBusMessageIter *iter,
                             DBUS_MAXIMUM_ARRAY_LENGTH / _dbus_type_get_alignment (element_type),
                             FALSE);
 
+  if (!unshare_body (real->message))
+    return FALSE;
+
   ret = _dbus_type_writer_write_fixed_multi (&real->u.writer, element_type, value, n_elements);
 
   return ret;
 }
 
+/**
+ * Like dbus_message_iter_append_fixed_array(), but instead of copying
+ * the elements from a buffer of yours, makes room for them in the
+ * message and returns a pointer to it, so you can fill the array in
+ * place. The space is zero-filled; elements wider than a byte are
+ * written in native byte order.
+ *
+ * The returned pointer is only valid until the next change to the
+ * message, so fill it in before appending anything else.
+ *
+ * @code
+ * unsigned char *bytes;
+ * if (!dbus_message_iter_reserve_fixed_array (&array_iter, DBUS_TYPE_BYTE,
+ *                                             len, (void **) &bytes))
+ *   fprintf (stderr, "No memory!\n");
+ * read_payload_into (bytes, len);
+ * @endcode
+ *
+ * @param iter the append iterator
+ * @param element_type the type of the array elements
+ * @param n_elements the number of elements to make room for
+ * @param data_p return location for the start of the elements
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+dbus_message_iter_reserve_fixed_array (DBusMessageIter *iter,
+                                       int              element_type,
+                                       int              n_elements,
+                                       void           **data_p)
+{
+  DBusMessageRealIter *real = (DBusMessageRealIter *)iter;
+
+  _dbus_return_val_if_fail (_dbus_message_iter_append_check (real), FALSE);
+  _dbus_return_val_if_fail (real->iter_type == DBUS_MESSAGE_ITER_TYPE_WRITER, FALSE);
+  _dbus_return_val_if_fail (dbus_type_is_fixed (element_type) && element_type != DBUS_TYPE_UNIX_FD, FALSE);
+  _dbus_return_val_if_fail (real->u.writer.container_type == DBUS_TYPE_ARRAY, FALSE);
+  _dbus_return_val_if_fail (real->u.writer.byte_order == DBUS_COMPILER_BYTE_ORDER, FALSE);
+  _dbus_return_val_if_fail (data_p != NULL, FALSE);
+  _dbus_return_val_if_fail (n_elements >= 0, FALSE);
+  _dbus_return_val_if_fail (n_elements <=
+                            DBUS_MAXIMUM_ARRAY_LENGTH / _dbus_type_get_alignment (element_type),
+                            FALSE);
+
+  if (!unshare_body (real->message))
+    return FALSE;
+
+  return _dbus_type_writer_reserve_fixed_multi (&real->u.writer, element_type,
+                                                n_elements, data_p);
+}
+
+/**
+ * Appends a C array of structs made only of fixed-length values to
+ * an array of such structs, such as "a(iid)", in one go rather than
+ * with a dbus_message_iter_open_container() and a
+ * dbus_message_iter_append_basic() per member. See
+ * dbus_message_iter_get_fixed_struct_array() for which structs are
+ * allowed and how the C struct must be laid out. Padding is always
+ * sent as zeros, whatever is in the padding of the C structs.
+ *
+ * You must call dbus_message_iter_open_container() to open an array
+ * of the struct type before calling this function. You may call this
+ * function multiple times for the same array.
+ *
+ * @code
+ * struct sample { dbus_int32_t id; dbus_int32_t flags; double value; };
+ * if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "(iid)",
+ *                                        &array_iter) ||
+ *     !dbus_message_iter_append_fixed_struct_array (&array_iter, samples,
+ *                                                   sizeof (struct sample),
+ *                                                   n_samples) ||
+ *     !dbus_message_iter_close_container (&iter, &array_iter))
+ *   fprintf (stderr, "No memory!\n");
+ * @endcode
+ *
+ * @todo If this fails due to lack of memory, the message is hosed and
+ * you have to start over building the whole message.
+ *
+ * @param iter the append iterator
+ * @param elements the C array of structs
+ * @param element_size the size of each element of the C array
+ * @param n_elements the number of elements to append
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+dbus_message_iter_append_fixed_struct_array (DBusMessageIter *iter,
+                                             const void      *elements,
+                                             int              element_size,
+                                             int              n_elements)
+{
+  DBusMessageRealIter *real = (DBusMessageRealIter *)iter;
+  int size;
+
+  _dbus_return_val_if_fail (_dbus_message_iter_append_check (real), FALSE);
+  _dbus_return_val_if_fail (real->iter_type == DBUS_MESSAGE_ITER_TYPE_WRITER, FALSE);
+  _dbus_return_val_if_fail (real->u.writer.container_type == DBUS_TYPE_ARRAY, FALSE);
+  _dbus_return_val_if_fail (real->u.writer.type_str != NULL, FALSE);
+
+  size = _dbus_type_get_fixed_struct_size (real->u.writer.type_str,
+                                           real->u.writer.type_pos);
+
+  _dbus_return_val_if_fail (size > 0, FALSE);
+  _dbus_return_val_if_fail (element_size >= size, FALSE);
+  _dbus_return_val_if_fail (elements != NULL || n_elements == 0, FALSE);
+  _dbus_return_val_if_fail (n_elements >= 0, FALSE);
+  _dbus_return_val_if_fail (n_elements <=
+                            DBUS_MAXIMUM_ARRAY_LENGTH / _DBUS_ALIGN_VALUE (size, 8),
+                            FALSE);
+
+  if (!unshare_body (real->message))
+    return FALSE;
+
+  return _dbus_type_writer_write_fixed_struct_multi (&real->u.writer, elements,
+                                                     element_size, n_elements);
+}
+
+/**
+ * Appends one entry holding a basic-typed value to a dictionary of
+ * variants, "a{sv}", such as the properties in a PropertiesChanged
+ * signal or a GetAll reply. Equivalent to opening the dict entry,
+ * appending the key, opening a variant of the value's type,
+ * appending the value and closing both again, but marshals the
+ * entry straight into place without the bookkeeping of the two
+ * containers.
+ *
+ * You must call dbus_message_iter_open_container() to open an array
+ * of "{sv}" before calling this function. Entries written this way
+ * and with dbus_message_iter_open_container() may be mixed in the
+ * same array, for values that aren't of a basic type.
+ * #DBUS_TYPE_UNIX_FD values are not supported.
+ *
+ * @code
+ * dbus_bool_t online = TRUE;
+ * if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY, "{sv}",
+ *                                        &dict_iter) ||
+ *     !dbus_message_iter_append_variant_entry (&dict_iter, "Online",
+ *                                              DBUS_TYPE_BOOLEAN, &online) ||
+ *     !dbus_message_iter_close_container (&iter, &dict_iter))
+ *   fprintf (stderr, "No memory!\n");
+ * @endcode
+ *
+ * @param iter the append iterator, in an array of "{sv}"
+ * @param key the entry's key
+ * @param type the type of the value
+ * @param value the address of the value, as for dbus_message_iter_append_basic()
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+dbus_message_iter_append_variant_entry (DBusMessageIter *iter,
+                                        const char      *key,
+                                        int              type,
+                                        const void      *value)
+{
+  DBusMessageRealIter *real = (DBusMessageRealIter *)iter;
+
+  _dbus_return_val_if_fail (_dbus_message_iter_append_check (real), FALSE);
+  _dbus_return_val_if_fail (real->iter_type == DBUS_MESSAGE_ITER_TYPE_WRITER, FALSE);
+  _dbus_return_val_if_fail (real->u.writer.container_type == DBUS_TYPE_ARRAY, FALSE);
+  _dbus_return_val_if_fail (real->u.writer.type_str != NULL, FALSE);
+  _dbus_return_val_if_fail (key != NULL, FALSE);
+  _dbus_return_val_if_fail (dbus_type_is_basic (type), FALSE);
+  _dbus_return_val_if_fail (type != DBUS_TYPE_UNIX_FD, FALSE);
+  _dbus_return_val_if_fail (value != NULL, FALSE);
+
+  _dbus_return_val_if_fail (is_variant_dict_entry (real->u.writer.type_str,
+                                                   real->u.writer.type_pos),
+                            FALSE);
+
+  if (!unshare_body (real->message))
+    return FALSE;
+
+  return _dbus_type_writer_write_variant_entry (&real->u.writer, key,
+                                                type, value);
+}
+
+/**
+ * Hints that about n_bytes more will be appended to the message, so
+ * that its buffer can be grown once up front rather than repeatedly
+ * as values are appended. Worth calling before appending large
+ * arrays in several pieces; allow a few bytes over the payload for
+ * the array length and alignment padding.
+ *
+ * @param iter the append iterator
+ * @param n_bytes number of bytes about to be appended
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+dbus_message_iter_reserve_space (DBusMessageIter *iter,
+                                 int              n_bytes)
+{
+  DBusMessageRealIter *real = (DBusMessageRealIter *)iter;
+
+  _dbus_return_val_if_fail (_dbus_message_iter_append_check (real), FALSE);
+  _dbus_return_val_if_fail (real->iter_type == DBUS_MESSAGE_ITER_TYPE_WRITER, FALSE);
+  _dbus_return_val_if_fail (n_bytes >= 0, FALSE);
+
+  if (!unshare_body (real->message))
+    return FALSE;
+
+  return _dbus_string_alloc_space (&real->message->body, n_bytes);
+}
+
 /**
  * Appends a container-typed value to the message; you are required to
  * append the contents of the container using the returned
@@ -2735,8 +4148,12 @@ dbus_message_iter_close_container (DBusMessageIter *iter,
   _dbus_return_val_if_fail (_dbus_message_iter_append_check (real_sub), FALSE);
   _dbus_return_val_if_fail (real_sub->iter_type == DBUS_MESSAGE_ITER_TYPE_WRITER, FALSE);
 
-  ret = _dbus_type_writer_unrecurse (&real->u.writer,
-                                     &real_sub->u.writer);
+  /* the message may have been copied since the container was opened */
+  if (!unshare_body (real->message))
+    ret = FALSE;
+  else
+    ret = _dbus_type_writer_unrecurse (&real->u.writer,
+                                       &real_sub->u.writer);
 
   if (!_dbus_message_iter_close_signature (real))
     ret = FALSE;
@@ -2856,6 +4273,66 @@ dbus_message_get_auto_start (DBusMessage *message)
                                  DBUS_HEADER_FLAG_NO_AUTO_START);
 }
 
+/**
+ * Sets how long the message may wait to be delivered. Once it has
+ * been queued that many milliseconds, in the sender's outgoing
+ * queue, on the message bus, or in the recipient's incoming queue,
+ * it is dropped there rather than sent on or dispatched; each of
+ * them counts from when the message reached it. Use this for
+ * messages that are worthless once stale, such as frequent status
+ * updates to a peer that may be falling behind.
+ *
+ * A method call that expires gets no reply; the caller sees its own
+ * timeout instead.
+ *
+ * On the protocol level this sets #DBUS_HEADER_FIELD_EXPIRY.
+ *
+ * @param message the message
+ * @param milliseconds how long the message may wait, or 0 for no limit
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+dbus_message_set_expiry (DBusMessage   *message,
+                         dbus_uint32_t  milliseconds)
+{
+  _dbus_return_val_if_fail (message != NULL, FALSE);
+  _dbus_return_val_if_fail (!message->locked, FALSE);
+
+  message->expiry_started = FALSE;
+
+  if (milliseconds == 0)
+    return _dbus_header_delete_field (&message->header,
+                                      DBUS_HEADER_FIELD_EXPIRY);
+  else
+    return _dbus_header_set_field_basic (&message->header,
+                                         DBUS_HEADER_FIELD_EXPIRY,
+                                         DBUS_TYPE_UINT32,
+                                         &milliseconds);
+}
+
+/**
+ * Gets the expiry set with dbus_message_set_expiry(), or 0 if the
+ * message doesn't have one.
+ *
+ * @param message the message
+ * @returns how many milliseconds the message may wait, or 0
+ */
+dbus_uint32_t
+dbus_message_get_expiry (DBusMessage *message)
+{
+  dbus_uint32_t v_UINT32;
+
+  _dbus_return_val_if_fail (message != NULL, 0);
+
+  if (_dbus_header_get_field_basic (&message->header,
+                                    DBUS_HEADER_FIELD_EXPIRY,
+                                    DBUS_TYPE_UINT32,
+                                    &v_UINT32))
+    return v_UINT32;
+  else
+    return 0;
+}
+
 
 /**
  * Sets the object path this message is being sent to (for
@@ -2906,10 +4383,9 @@ dbus_message_get_path (DBusMessage   *message)
   _dbus_return_val_if_fail (message != NULL, NULL);
 
   v = NULL; /* in case field doesn't exist */
-  _dbus_header_get_field_basic (&message->header,
-                                DBUS_HEADER_FIELD_PATH,
-                                DBUS_TYPE_OBJECT_PATH,
-                                (void *) &v);
+  _dbus_header_get_field_string (&message->header,
+                                 DBUS_HEADER_FIELD_PATH,
+                                 &v, NULL);
   return v;
 }
 
@@ -2972,18 +4448,86 @@ dbus_message_get_path_decomposed (DBusMessage   *message,
 {
   const char *v;
 
-  _dbus_return_val_if_fail (message != NULL, FALSE);
-  _dbus_return_val_if_fail (path != NULL, FALSE);
+  _dbus_return_val_if_fail (message != NULL, FALSE);
+  _dbus_return_val_if_fail (path != NULL, FALSE);
+
+  *path = NULL;
+
+  v = dbus_message_get_path (message);
+  if (v != NULL)
+    {
+      if (!_dbus_decompose_path (v, strlen (v),
+                                 path, NULL))
+        return FALSE;
+    }
+  return TRUE;
+}
+
+/**
+ * Initializes an iterator over the components of the object path
+ * this message is being sent to or emitted from. Unlike
+ * dbus_message_get_path_decomposed() nothing is allocated: each
+ * call to dbus_message_path_iter_next() returns a slice of the
+ * wire-marshaled path, so the iterator becomes invalid if the
+ * message is modified.
+ *
+ * The path "/" has no components, and "/foo/bar" has two
+ * components "foo" and "bar".
+ *
+ * @param message the message
+ * @param iter the iterator to initialize
+ * @returns #FALSE if the message has no path field
+ */
+dbus_bool_t
+dbus_message_path_iter_init (DBusMessage        *message,
+                             DBusObjectPathIter *iter)
+{
+  const char *v;
+
+  _dbus_return_val_if_fail (message != NULL, FALSE);
+  _dbus_return_val_if_fail (iter != NULL, FALSE);
+
+  v = dbus_message_get_path (message);
+  if (v == NULL)
+    return FALSE;
+
+  _dbus_object_path_iter_init (iter, v);
+  return TRUE;
+}
+
+/**
+ * Moves to the next component of an object path. The component is
+ * not nul terminated; it is the len bytes starting at element.
+ *
+ * @param iter the iterator from dbus_message_path_iter_init()
+ * @param element return location for the start of the component
+ * @param len return location for the length of the component
+ * @returns #FALSE if there are no more components
+ */
+dbus_bool_t
+dbus_message_path_iter_next (DBusObjectPathIter *iter,
+                             const char        **element,
+                             int                *len)
+{
+  DBusObjectPathRealIter *real = (DBusObjectPathRealIter *) iter;
+  const char *end;
+
+  _dbus_return_val_if_fail (iter != NULL, FALSE);
+  _dbus_return_val_if_fail (element != NULL, FALSE);
+  _dbus_return_val_if_fail (len != NULL, FALSE);
+
+  if (*real->next == '\0')
+    return FALSE;
+
+  end = strchr (real->next, '/');
+  if (end == NULL)
+    end = real->next + strlen (real->next);
 
-  *path = NULL;
+  *element = real->next;
+  *len = end - real->next;
+
+  real->next = *end == '/' ? end + 1 : end;
 
-  v = dbus_message_get_path (message);
-  if (v != NULL)
-    {
-      if (!_dbus_decompose_path (v, strlen (v),
-                                 path, NULL))
-        return FALSE;
-    }
   return TRUE;
 }
 
@@ -3037,10 +4581,9 @@ dbus_message_get_interface (DBusMessage *message)
   _dbus_return_val_if_fail (message != NULL, NULL);
 
   v = NULL; /* in case field doesn't exist */
-  _dbus_header_get_field_basic (&message->header,
-                                DBUS_HEADER_FIELD_INTERFACE,
-                                DBUS_TYPE_STRING,
-                                (void *) &v);
+  _dbus_header_get_field_string (&message->header,
+                                 DBUS_HEADER_FIELD_INTERFACE,
+                                 &v, NULL);
   return v;
 }
 
@@ -3123,10 +4666,9 @@ dbus_message_get_member (DBusMessage *message)
   _dbus_return_val_if_fail (message != NULL, NULL);
 
   v = NULL; /* in case field doesn't exist */
-  _dbus_header_get_field_basic (&message->header,
-                                DBUS_HEADER_FIELD_MEMBER,
-                                DBUS_TYPE_STRING,
-                                (void *) &v);
+  _dbus_header_get_field_string (&message->header,
+                                 DBUS_HEADER_FIELD_MEMBER,
+                                 &v, NULL);
   return v;
 }
 
@@ -3207,10 +4749,9 @@ dbus_message_get_error_name (DBusMessage *message)
   _dbus_return_val_if_fail (message != NULL, NULL);
 
   v = NULL; /* in case field doesn't exist */
-  _dbus_header_get_field_basic (&message->header,
-                                DBUS_HEADER_FIELD_ERROR_NAME,
-                                DBUS_TYPE_STRING,
-                                (void *) &v);
+  _dbus_header_get_field_string (&message->header,
+                                 DBUS_HEADER_FIELD_ERROR_NAME,
+                                 &v, NULL);
   return v;
 }
 
@@ -3260,10 +4801,9 @@ dbus_message_get_destination (DBusMessage *message)
   _dbus_return_val_if_fail (message != NULL, NULL);
 
   v = NULL; /* in case field doesn't exist */
-  _dbus_header_get_field_basic (&message->header,
-                                DBUS_HEADER_FIELD_DESTINATION,
-                                DBUS_TYPE_STRING,
-                                (void *) &v);
+  _dbus_header_get_field_string (&message->header,
+                                 DBUS_HEADER_FIELD_DESTINATION,
+                                 &v, NULL);
   return v;
 }
 
@@ -3320,10 +4860,9 @@ dbus_message_get_sender (DBusMessage *message)
   _dbus_return_val_if_fail (message != NULL, NULL);
 
   v = NULL; /* in case field doesn't exist */
-  _dbus_header_get_field_basic (&message->header,
-                                DBUS_HEADER_FIELD_SENDER,
-                                DBUS_TYPE_STRING,
-                                (void *) &v);
+  _dbus_header_get_field_string (&message->header,
+                                 DBUS_HEADER_FIELD_SENDER,
+                                 &v, NULL);
   return v;
 }
 
@@ -3659,6 +5198,14 @@ dbus_message_contains_unix_fds(DBusMessage *message)
  */
 #define INITIAL_LOADER_DATA_LEN 32
 
+/**
+ * Bodies at least this long are read into a buffer of their own,
+ * which is handed over to the message rather than copied out of the
+ * loader's buffer. Well above the transports' read sizes, so that
+ * such a body almost never arrives in one read.
+ */
+#define LARGE_BODY_LEN (64 * 1024)
+
 /**
  * Creates a new message loader. Returns #NULL if memory can't
  * be allocated.
@@ -3683,24 +5230,51 @@ _dbus_message_loader_new (void)
   loader->max_message_size = DBUS_MAXIMUM_MESSAGE_LENGTH;
 
   /* We set a very relatively conservative default here since due to how
-  SCM_RIGHTS works we need to preallocate an fd array of the maximum
+  SCM_RIGHTS works each read needs control message space for the maximum
   number of unix fds we want to receive in advance. A
   try-and-reallocate loop is not possible. */
   loader->max_message_unix_fds = 1024;
 
+  /* don't waste more than 2k of memory unless the transport asks */
+  loader->max_buffer_waste = 2048;
+
   if (!_dbus_string_init (&loader->data))
     {
       dbus_free (loader);
       return NULL;
     }
 
+  if (!_dbus_string_init (&loader->aligned))
+    {
+      _dbus_string_free (&loader->data);
+      dbus_free (loader);
+      return NULL;
+    }
+
+  if (!_dbus_string_init (&loader->large_body))
+    {
+      _dbus_string_free (&loader->aligned);
+      _dbus_string_free (&loader->data);
+      dbus_free (loader);
+      return NULL;
+    }
+
+#ifdef HAVE_UNIX_FD_PASSING
+  if (!_dbus_string_init (&loader->unix_fds))
+    {
+      _dbus_string_free (&loader->large_body);
+      _dbus_string_free (&loader->aligned);
+      _dbus_string_free (&loader->data);
+      dbus_free (loader);
+      return NULL;
+    }
+#endif
+
   /* preallocate the buffer for speed, ignore failure */
   _dbus_string_set_length (&loader->data, INITIAL_LOADER_DATA_LEN);
   _dbus_string_set_length (&loader->data, 0);
 
 #ifdef HAVE_UNIX_FD_PASSING
-  loader->unix_fds = NULL;
-  loader->n_unix_fds = loader->n_unix_fds_allocated = 0;
   loader->unix_fds_outstanding = FALSE;
 #endif
 
@@ -3734,14 +5308,23 @@ _dbus_message_loader_unref (DBusMessageLoader *loader)
   if (loader->refcount == 0)
     {
 #ifdef HAVE_UNIX_FD_PASSING
-      close_unix_fds(loader->unix_fds, &loader->n_unix_fds);
-      dbus_free(loader->unix_fds);
+      {
+        unsigned n_unix_fds = loader_get_n_unix_fds (loader);
+
+        close_unix_fds ((int *) _dbus_string_get_data (&loader->unix_fds),
+                        &n_unix_fds);
+        _dbus_string_free (&loader->unix_fds);
+      }
 #endif
       _dbus_list_foreach (&loader->messages,
                           (DBusForeachFunction) dbus_message_unref,
                           NULL);
       _dbus_list_clear (&loader->messages);
+      if (loader->streamed_message != NULL)
+        dbus_message_unref (loader->streamed_message);
       _dbus_string_free (&loader->data);
+      _dbus_string_free (&loader->aligned);
+      _dbus_string_free (&loader->large_body);
       dbus_free (loader);
     }
 }
@@ -3770,7 +5353,11 @@ _dbus_message_loader_get_buffer (DBusMessageLoader  *loader,
 {
   _dbus_assert (!loader->buffer_outstanding);
 
-  *buffer = &loader->data;
+  /* While a large body is coming in, read straight into it */
+  if (loader->large_body_len > 0)
+    *buffer = &loader->large_body;
+  else
+    *buffer = &loader->data;
 
   loader->buffer_outstanding = TRUE;
 }
@@ -3791,57 +5378,44 @@ _dbus_message_loader_return_buffer (DBusMessageLoader  *loader,
                                     int                 bytes_read)
 {
   _dbus_assert (loader->buffer_outstanding);
-  _dbus_assert (buffer == &loader->data);
+  _dbus_assert (buffer == &loader->data ||
+                (loader->large_body_len > 0 && buffer == &loader->large_body));
 
   loader->buffer_outstanding = FALSE;
 }
 
 /**
- * Gets the buffer to use for reading unix fds from the network.
+ * Gets the buffer to append unix fds read from the network to, as
+ * ints.
  *
- * This works similar to _dbus_message_loader_get_buffer()
+ * This works similar to _dbus_message_loader_get_buffer(). The
+ * buffer is only grown as fds are appended to it, so a connection
+ * that never receives any doesn't pay for room for the maximum
+ * number a message may carry.
  *
  * @param loader the message loader.
- * @param fds the array to read fds into
+ * @param fds the buffer to append fds to
  * @param max_n_fds how many fds to read at most
- * @return TRUE on success, FALSE on OOM
  */
-dbus_bool_t
+void
 _dbus_message_loader_get_unix_fds(DBusMessageLoader  *loader,
-                                  int               **fds,
+                                  DBusString        **fds,
                                   unsigned           *max_n_fds)
 {
 #ifdef HAVE_UNIX_FD_PASSING
-  _dbus_assert (!loader->unix_fds_outstanding);
-
-  /* Allocate space where we can put the fds we read. We allocate
-     space for max_message_unix_fds since this is an
-     upper limit how many fds can be received within a single
-     message. Since SCM_RIGHTS doesn't allow a reallocate+retry logic
-     we are allocating the maximum possible array size right from the
-     beginning. This sucks a bit, however unless SCM_RIGHTS is fixed
-     there is no better way. */
+  unsigned n_unix_fds;
 
-  if (loader->n_unix_fds_allocated < loader->max_message_unix_fds)
-    {
-      int *a = dbus_realloc(loader->unix_fds,
-                            loader->max_message_unix_fds * sizeof(loader->unix_fds[0]));
-
-      if (!a)
-        return FALSE;
+  _dbus_assert (!loader->unix_fds_outstanding);
 
-      loader->unix_fds = a;
-      loader->n_unix_fds_allocated = loader->max_message_unix_fds;
-    }
+  n_unix_fds = loader_get_n_unix_fds (loader);
 
-  *fds = loader->unix_fds + loader->n_unix_fds;
-  *max_n_fds = loader->n_unix_fds_allocated - loader->n_unix_fds;
+  *fds = &loader->unix_fds;
+  *max_n_fds = (unsigned) loader->max_message_unix_fds > n_unix_fds ?
+    loader->max_message_unix_fds - n_unix_fds : 0;
 
   loader->unix_fds_outstanding = TRUE;
-  return TRUE;
 #else
   _dbus_assert_not_reached("Platform doesn't support unix fd passing");
-  return FALSE;
 #endif
 }
 
@@ -3851,21 +5425,20 @@ _dbus_message_loader_get_unix_fds(DBusMessageLoader  *loader,
  * This works similar to _dbus_message_loader_return_buffer()
  *
  * @param loader the message loader.
- * @param fds the array fds were read into
- * @param max_n_fds how many fds were read
+ * @param fds the buffer fds were appended to
+ * @param n_fds how many fds were read
  */
 
 void
 _dbus_message_loader_return_unix_fds(DBusMessageLoader  *loader,
-                                     int                *fds,
+                                     DBusString         *fds,
                                      unsigned            n_fds)
 {
 #ifdef HAVE_UNIX_FD_PASSING
   _dbus_assert(loader->unix_fds_outstanding);
-  _dbus_assert(loader->unix_fds + loader->n_unix_fds == fds);
-  _dbus_assert(loader->n_unix_fds + n_fds <= loader->n_unix_fds_allocated);
+  _dbus_assert(fds == &loader->unix_fds);
+  _dbus_assert(loader_get_n_unix_fds (loader) >= n_fds);
 
-  loader->n_unix_fds += n_fds;
   loader->unix_fds_outstanding = FALSE;
 #else
   _dbus_assert_not_reached("Platform doesn't support unix fd passing");
@@ -3892,24 +5465,50 @@ _dbus_message_loader_return_unix_fds(DBusMessageLoader  *loader,
  * memmoved. Though I suppose we also don't have a chance of reading a
  * bunch of small messages at once, so the optimization may be stupid.
  *
- * Another approach would be to keep a "start" index into
- * loader->data and only delete it occasionally, instead of after
- * each message is loaded.
+ * The caller keeps a "start" index into loader->data and only
+ * deletes the consumed bytes once per batch of messages, instead of
+ * after each message is loaded; so a single read containing many
+ * small messages costs one memmove rather than one per message.
+ *
+ * A large body that has been read into loader->large_body rather than
+ * following its header in data is passed as large_body, and handed
+ * over to the message without a copy.
  *
  * load_message() returns FALSE if not enough memory OR the loader was corrupted
  */
+/* Whether a message bus looks inside the body of this message, rather
+ * than just passing it on: it does for method calls to the bus itself,
+ * and for anything without a destination since match rules can check
+ * the arguments of broadcasts.
+ */
+static dbus_bool_t
+message_body_is_examined (DBusMessage *message)
+{
+  const char *destination;
+
+  destination = dbus_message_get_destination (message);
+
+  return destination == NULL ||
+    strcmp (destination, DBUS_SERVICE_DBUS) == 0;
+}
+
 static dbus_bool_t
 load_message (DBusMessageLoader *loader,
               DBusMessage       *message,
+              const DBusString  *data,
+              int                start,
               int                byte_order,
               int                fields_array_len,
               int                header_len,
-              int                body_len)
+              int                body_len,
+              DBusString        *large_body)
 {
   dbus_bool_t oom;
   DBusValidity validity;
   const DBusString *type_str;
   int type_pos;
+  const DBusString *body_str;
+  int body_start;
   DBusValidationMode mode;
   dbus_uint32_t n_unix_fds = 0;
 
@@ -3918,12 +5517,26 @@ load_message (DBusMessageLoader *loader,
   oom = FALSE;
 
 #if 0
-  _dbus_verbose_bytes_of_string (&loader->data, 0, header_len /* + body_len */);
+  _dbus_verbose_bytes_of_string (data, start, header_len /* + body_len */);
 #endif
 
   /* 1. VALIDATE AND COPY OVER HEADER */
   _dbus_assert (_dbus_string_get_length (&message->header.data) == 0);
-  _dbus_assert ((header_len + body_len) <= _dbus_string_get_length (&loader->data));
+  _dbus_assert (start == (int) _DBUS_ALIGN_VALUE (start, 8));
+
+  if (large_body != NULL)
+    {
+      _dbus_assert ((start + header_len) <= _dbus_string_get_length (data));
+      _dbus_assert (_dbus_string_get_length (large_body) == body_len);
+      body_str = large_body;
+      body_start = 0;
+    }
+  else
+    {
+      _dbus_assert ((start + header_len + body_len) <= _dbus_string_get_length (data));
+      body_str = data;
+      body_start = start + header_len;
+    }
 
   if (!_dbus_header_load (&message->header,
                           mode,
@@ -3932,8 +5545,8 @@ load_message (DBusMessageLoader *loader,
                           fields_array_len,
                           header_len,
                           body_len,
-                          &loader->data, 0,
-                          _dbus_string_get_length (&loader->data)))
+                          data, start,
+                          _dbus_string_get_length (data) - start))
     {
       _dbus_verbose ("Failed to load header for new message code %d\n", validity);
 
@@ -3955,8 +5568,28 @@ load_message (DBusMessageLoader *loader,
 
   message->byte_order = byte_order;
 
+  /* Only the bus reads fixed-length arrays out of messages it gets;
+   * anything else it routes on reads fine in either byte order, and
+   * is passed on as it came
+   */
+  if (loader->keep_byte_order && byte_order != DBUS_COMPILER_BYTE_ORDER)
+    {
+      const char *destination;
+
+      destination = dbus_message_get_destination (message);
+      message->keep_byte_order = destination == NULL ||
+        strcmp (destination, DBUS_SERVICE_DBUS) != 0;
+    }
+
   /* 2. VALIDATE BODY */
-  if (mode != DBUS_VALIDATION_MODE_WE_TRUST_THIS_DATA_ABSOLUTELY)
+  if (mode != DBUS_VALIDATION_MODE_WE_TRUST_THIS_DATA_ABSOLUTELY &&
+      (loader->lazy_bodies ||
+       (loader->trust_bodies && !message_body_is_examined (message))))
+    {
+      /* Checked by ensure_body_validated() if anyone reads it */
+      message->body_validation_pending = TRUE;
+    }
+  else if (mode != DBUS_VALIDATION_MODE_WE_TRUST_THIS_DATA_ABSOLUTELY)
     {
       get_const_signature (&message->header, &type_str, &type_pos);
       
@@ -3967,8 +5600,8 @@ load_message (DBusMessageLoader *loader,
                                                   type_pos,
                                                   byte_order,
                                                   NULL,
-                                                  &loader->data,
-                                                  header_len,
+                                                  body_str,
+                                                  body_start,
                                                   body_len);
       if (validity != DBUS_VALID)
         {
@@ -3989,10 +5622,10 @@ load_message (DBusMessageLoader *loader,
 
 #ifdef HAVE_UNIX_FD_PASSING
 
-  if (n_unix_fds > loader->n_unix_fds)
+  if (n_unix_fds > loader_get_n_unix_fds (loader))
     {
       _dbus_verbose("Message contains references to more unix fds than were sent %u != %u\n",
-                    n_unix_fds, loader->n_unix_fds);
+                    n_unix_fds, loader_get_n_unix_fds (loader));
 
       loader->corrupted = TRUE;
       loader->corruption_reason = DBUS_INVALID_MISSING_UNIX_FDS;
@@ -4005,7 +5638,8 @@ load_message (DBusMessageLoader *loader,
 
   if (n_unix_fds > 0)
     {
-      message->unix_fds = _dbus_memdup(loader->unix_fds, n_unix_fds * sizeof(message->unix_fds[0]));
+      message->unix_fds = _dbus_memdup(_dbus_string_get_const_data (&loader->unix_fds),
+                                       n_unix_fds * sizeof(message->unix_fds[0]));
       if (message->unix_fds == NULL)
         {
           _dbus_verbose ("Failed to allocate file descriptor array\n");
@@ -4014,8 +5648,12 @@ load_message (DBusMessageLoader *loader,
         }
 
       message->n_unix_fds_allocated = message->n_unix_fds = n_unix_fds;
-      loader->n_unix_fds -= n_unix_fds;
-      memmove(loader->unix_fds + n_unix_fds, loader->unix_fds, loader->n_unix_fds);
+      _dbus_string_delete (&loader->unix_fds, 0,
+                           n_unix_fds * sizeof(message->unix_fds[0]));
+
+      /* give back the room after a burst of fds */
+      if (_dbus_string_get_length (&loader->unix_fds) == 0)
+        _dbus_string_compact (&loader->unix_fds, MAX_UNIX_FDS_WASTE);
     }
   else
     message->unix_fds = NULL;
@@ -4044,21 +5682,22 @@ load_message (DBusMessageLoader *loader,
     }
 
   _dbus_assert (_dbus_string_get_length (&message->body) == 0);
-  _dbus_assert (_dbus_string_get_length (&loader->data) >=
-                (header_len + body_len));
 
-  if (!_dbus_string_copy_len (&loader->data, header_len, body_len, &message->body, 0))
+  /* Moving the whole of large_body into the empty body just swaps
+   * the buffers, so this can't fail
+   */
+  if (large_body != NULL)
+    {
+      if (!_dbus_string_move (large_body, 0, &message->body, 0))
+        _dbus_assert_not_reached ("moving a whole string into an empty one failed");
+    }
+  else if (!_dbus_string_copy_len (data, start + header_len, body_len, &message->body, 0))
     {
       _dbus_verbose ("Failed to move body into new message\n");
       oom = TRUE;
       goto failed;
     }
 
-  _dbus_string_delete (&loader->data, 0, header_len + body_len);
-
-  /* don't waste more than 2k of memory */
-  _dbus_string_compact (&loader->data, 2048);
-
   _dbus_assert (_dbus_string_get_length (&message->header.data) == header_len);
   _dbus_assert (_dbus_string_get_length (&message->body) == body_len);
 
@@ -4071,27 +5710,372 @@ load_message (DBusMessageLoader *loader,
 
   return TRUE;
 
- failed:
-
-  /* Clean up */
+ failed:
+
+  /* Clean up */
+
+  /* does nothing if the message isn't in the list */
+  _dbus_list_remove_last (&loader->messages, message);
+  
+  if (oom)
+    _dbus_assert (!loader->corrupted);
+  else
+    _dbus_assert (loader->corrupted);
+
+  _dbus_verbose_bytes_of_string (data, start, _dbus_string_get_length (data) - start);
+
+  return FALSE;
+}
+
+/**
+ * Starts reading the body of a large message into loader->large_body,
+ * once its header is in loader->data. Whatever part of the body has
+ * already arrived is moved over, and the buffer is sized for the
+ * whole body plus a read's worth of whatever follows it, so the
+ * transport can read the rest straight into it without reallocating.
+ *
+ * @param loader the loader
+ * @param consumed bytes of loader->data already made into messages
+ * @param header_len length of the large message's header
+ * @param body_len length of the large message's body
+ * @returns #FALSE if not enough memory
+ */
+static dbus_bool_t
+start_large_body (DBusMessageLoader *loader,
+                  int                consumed,
+                  int                header_len,
+                  int                body_len)
+{
+  int body_start;
+
+  _dbus_assert (loader->large_body_len == 0);
+
+  body_start = consumed + header_len;
+
+  _dbus_string_set_length (&loader->large_body, 0);
+
+  if (!_dbus_string_alloc_space (&loader->large_body,
+                                 body_len + loader->max_buffer_waste) ||
+      !_dbus_string_copy (&loader->data, body_start,
+                          &loader->large_body, 0))
+    {
+      _dbus_string_set_length (&loader->large_body, 0);
+      _dbus_string_compact (&loader->large_body, 0);
+      return FALSE;
+    }
+
+  _dbus_verbose ("Reading %d byte body into its own buffer, %d bytes so far\n",
+                 body_len, _dbus_string_get_length (&loader->large_body));
+
+  _dbus_string_set_length (&loader->data, body_start);
+  loader->large_body_len = body_len;
+
+  return TRUE;
+}
+
+/**
+ * Loads the large message whose header is at the start of
+ * loader->data, once loader->large_body is complete. Bytes read past
+ * the end of the body go back to loader->data, after the header.
+ *
+ * @param loader the loader
+ * @param consumed return location for how much of loader->data was used
+ * @returns #FALSE if not enough memory or the message was corrupt
+ */
+static dbus_bool_t
+finish_large_body (DBusMessageLoader *loader,
+                   int               *consumed)
+{
+  DBusValidity validity;
+  DBusMessage *message;
+  int byte_order, fields_array_len, header_len, body_len;
+  int excess;
+  dbus_bool_t have_message;
+
+  *consumed = 0;
+
+  excess = _dbus_string_get_length (&loader->large_body) - loader->large_body_len;
+  if (excess < 0)
+    return TRUE;
+
+  if (excess > 0)
+    {
+      if (!_dbus_string_copy_len (&loader->large_body, loader->large_body_len,
+                                  excess, &loader->data,
+                                  _dbus_string_get_length (&loader->data)))
+        return FALSE;
+
+      _dbus_string_set_length (&loader->large_body, loader->large_body_len);
+    }
+
+  /* The header was checked before we started on the body; this just
+   * recovers its lengths. The body counts as available though it's
+   * in the other buffer.
+   */
+  have_message = _dbus_header_have_message_untrusted (loader->max_message_size,
+                                                      &validity,
+                                                      &byte_order,
+                                                      &fields_array_len,
+                                                      &header_len,
+                                                      &body_len,
+                                                      &loader->data, 0,
+                                                      _dbus_string_get_length (&loader->data) +
+                                                      loader->large_body_len);
+  _dbus_assert (have_message);
+  _dbus_assert (validity == DBUS_VALID);
+  _dbus_assert (body_len == loader->large_body_len);
+
+  message = dbus_message_new_empty_header ();
+  if (message == NULL)
+    return FALSE;
+
+  if (!load_message (loader, message, &loader->data, 0,
+                     byte_order, fields_array_len,
+                     header_len, body_len, &loader->large_body))
+    {
+      dbus_message_unref (message);
+      return FALSE;
+    }
+
+  /* large_body now has the new message's empty buffer */
+  loader->large_body_len = 0;
+  *consumed = header_len;
+
+  return TRUE;
+}
+
+/**
+ * Starts streaming the body of a large message to the loader's chunk
+ * function instead of buffering it, once its header is at the start
+ * of loader->data. Only a body that is a single byte array, with no
+ * unix fds, is streamed; anything else is left for
+ * start_large_body().
+ *
+ * The header is loaded into a message straight away, and whatever
+ * part of the body has already arrived goes to loader->large_body,
+ * which from then on only ever holds what has been read but not yet
+ * handed out.
+ *
+ * @param loader the loader
+ * @param byte_order byte order of the message
+ * @param fields_array_len length of the header fields array
+ * @param header_len length of the header
+ * @param body_len length of the body
+ * @param streamed return location for whether the body is streamed
+ * @returns #FALSE if not enough memory or the header was corrupt
+ */
+static dbus_bool_t
+start_streamed_body (DBusMessageLoader *loader,
+                     int                byte_order,
+                     int                fields_array_len,
+                     int                header_len,
+                     int                body_len,
+                     dbus_bool_t       *streamed)
+{
+  DBusMessage *message;
+  DBusValidity validity;
+  dbus_uint32_t n_unix_fds = 0;
+
+  _dbus_assert (loader->large_body_len == 0);
+  _dbus_assert (loader->streamed_message == NULL);
+
+  *streamed = FALSE;
+
+  message = dbus_message_new_empty_header ();
+  if (message == NULL)
+    return FALSE;
+
+  if (!_dbus_header_load (&message->header,
+                          DBUS_VALIDATION_MODE_DATA_IS_UNTRUSTED,
+                          &validity,
+                          byte_order,
+                          fields_array_len,
+                          header_len,
+                          body_len,
+                          &loader->data, 0,
+                          _dbus_string_get_length (&loader->data)))
+    {
+      _dbus_assert (validity != DBUS_VALID);
+
+      if (validity != DBUS_VALIDITY_UNKNOWN_OOM_ERROR)
+        {
+          loader->corrupted = TRUE;
+          loader->corruption_reason = validity;
+        }
+
+      dbus_message_unref (message);
+      return FALSE;
+    }
+
+  message->byte_order = byte_order;
+
+  _dbus_header_get_field_basic (&message->header,
+                                DBUS_HEADER_FIELD_UNIX_FDS,
+                                DBUS_TYPE_UINT32,
+                                &n_unix_fds);
+
+  if (n_unix_fds > 0 ||
+      strcmp (dbus_message_get_signature (message),
+              DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_BYTE_AS_STRING) != 0)
+    {
+      dbus_message_unref (message);
+      return TRUE;
+    }
+
+  _dbus_string_set_length (&loader->large_body, 0);
+
+  if (!_dbus_string_copy (&loader->data, header_len,
+                          &loader->large_body, 0))
+    {
+      dbus_message_unref (message);
+      return FALSE;
+    }
+
+  _dbus_verbose ("Streaming %d byte body of message %p, %d bytes so far\n",
+                 body_len, message,
+                 _dbus_string_get_length (&loader->large_body));
+
+  _dbus_string_set_length (&loader->data, 0);
+  _dbus_string_compact (&loader->data, loader->max_buffer_waste);
+
+  loader->streamed_message = message;
+  loader->streamed_len = 0;
+  loader->large_body_len = body_len;
+  *streamed = TRUE;
+
+  return TRUE;
+}
+
+/**
+ * Hands whatever has been read of a streamed body to the chunk
+ * function, and queues the message once the body is complete. The
+ * queued message carries an empty byte array in place of the one
+ * handed out. Bytes read past the end of the body go to
+ * loader->data.
+ *
+ * @param loader the loader
+ * @returns #FALSE if not enough memory; the loader may instead be corrupted
+ */
+static dbus_bool_t
+continue_streamed_body (DBusMessageLoader *loader)
+{
+  DBusMessage *message;
+  int available;
+  int wanted;
+
+  message = loader->streamed_message;
+  available = _dbus_string_get_length (&loader->large_body);
+
+  if (loader->streamed_len == 0)
+    {
+      dbus_uint32_t array_len;
+
+      if (available < 4)
+        return TRUE;
+
+      array_len = _dbus_marshal_read_uint32 (&loader->large_body, 0,
+                                             message->byte_order, NULL);
+      if (array_len != (dbus_uint32_t) (loader->large_body_len - 4))
+        {
+          loader->corrupted = TRUE;
+          loader->corruption_reason = DBUS_INVALID_ARRAY_LENGTH_INCORRECT;
+          return TRUE;
+        }
+
+      _dbus_string_delete (&loader->large_body, 0, 4);
+      loader->streamed_len = 4;
+      available -= 4;
+    }
+
+  wanted = loader->large_body_len - loader->streamed_len;
+
+  if (available > wanted)
+    {
+      if (!_dbus_string_copy_len (&loader->large_body, wanted,
+                                  available - wanted, &loader->data,
+                                  _dbus_string_get_length (&loader->data)))
+        return FALSE;
+
+      _dbus_string_set_length (&loader->large_body, wanted);
+      available = wanted;
+    }
+
+  if (available > 0)
+    {
+      /* With no chunk function any more, the rest is dropped */
+      if (loader->chunk_function != NULL)
+        (* loader->chunk_function) (message,
+                                    (const unsigned char *)
+                                    _dbus_string_get_const_data (&loader->large_body),
+                                    available,
+                                    loader->streamed_len - 4,
+                                    loader->large_body_len - 4,
+                                    loader->chunk_data);
+
+      loader->streamed_len += available;
+      _dbus_string_set_length (&loader->large_body, 0);
+    }
+
+  if (loader->streamed_len < loader->large_body_len)
+    return TRUE;
+
+  if (_dbus_string_get_length (&message->body) == 0)
+    {
+      if (!_dbus_string_set_length (&message->body, 4))
+        return FALSE;
+
+      _dbus_marshal_set_uint32 (&message->body, 0, 0, message->byte_order);
+      _dbus_header_update_lengths (&message->header, 4);
+    }
+
+  if (!_dbus_list_append (&loader->messages, message))
+    return FALSE;
+
+  _dbus_verbose ("Finished streaming message %p\n", message);
+
+  loader->streamed_message = NULL;
+  loader->streamed_len = 0;
+  loader->large_body_len = 0;
+  _dbus_string_compact (&loader->large_body, loader->max_buffer_waste);
+
+  return TRUE;
+}
+
+/**
+ * Drops the bytes of loader->data that have already been turned
+ * into messages, and gives back excess memory.
+ *
+ * @param loader the loader
+ * @param consumed number of bytes at the start of the buffer to drop
+ */
+static void
+discard_consumed_data (DBusMessageLoader *loader,
+                       int                consumed)
+{
+  if (consumed == 0)
+    return;
 
-  /* does nothing if the message isn't in the list */
-  _dbus_list_remove_last (&loader->messages, message);
-  
-  if (oom)
-    _dbus_assert (!loader->corrupted);
+  if (consumed == _dbus_string_get_length (&loader->data))
+    _dbus_string_set_length (&loader->data, 0);
   else
-    _dbus_assert (loader->corrupted);
-
-  _dbus_verbose_bytes_of_string (&loader->data, 0, _dbus_string_get_length (&loader->data));
+    _dbus_string_delete (&loader->data, 0, consumed);
 
-  return FALSE;
+  _dbus_string_compact (&loader->data, loader->max_buffer_waste);
+  _dbus_string_set_length (&loader->aligned, 0);
+  _dbus_string_compact (&loader->aligned, 2048);
 }
 
 /**
  * Converts buffered data into messages, if we have enough data.  If
  * we don't have enough data, does nothing.
  *
+ * Messages are decoded in place from loader->data; the consumed
+ * bytes are only deleted once, after the whole batch. Since the
+ * header must be 8-aligned, a message that follows a body whose
+ * length is not a multiple of 8 is first copied on its own into
+ * loader->aligned, which costs the length of that message rather
+ * than a memmove of everything after it.
+ *
  * @todo we need to check that the proper named header fields exist
  * for each message type.
  *
@@ -4105,11 +6089,61 @@ load_message (DBusMessageLoader *loader,
 dbus_bool_t
 _dbus_message_loader_queue_messages (DBusMessageLoader *loader)
 {
+  int consumed;
+
+  consumed = 0;
+
+  if (loader->large_body_len > 0 && !loader->corrupted)
+    {
+      if (loader->streamed_message != NULL)
+        {
+          if (!continue_streamed_body (loader))
+            return FALSE;
+        }
+      else if (!finish_large_body (loader, &consumed))
+        return loader->corrupted;
+
+      if (loader->corrupted)
+        return TRUE;
+
+      /* still waiting for the rest of the body */
+      if (loader->large_body_len > 0)
+        return TRUE;
+    }
+
   while (!loader->corrupted &&
-         _dbus_string_get_length (&loader->data) >= DBUS_MINIMUM_HEADER_SIZE)
+         _dbus_string_get_length (&loader->data) - consumed >= DBUS_MINIMUM_HEADER_SIZE)
     {
       DBusValidity validity;
       int byte_order, fields_array_len, header_len, body_len;
+      const DBusString *data;
+      int start;
+      int remaining;
+
+      remaining = _dbus_string_get_length (&loader->data) - consumed;
+
+      if (consumed == (int) _DBUS_ALIGN_VALUE (consumed, 8))
+        {
+          data = &loader->data;
+          start = consumed;
+        }
+      else
+        {
+          /* Only the fixed part of the header is needed to learn
+           * the message length; copy the rest once we know it's all here.
+           */
+          _dbus_string_set_length (&loader->aligned, 0);
+          if (!_dbus_string_copy_len (&loader->data, consumed,
+                                      DBUS_MINIMUM_HEADER_SIZE,
+                                      &loader->aligned, 0))
+            {
+              discard_consumed_data (loader, consumed);
+              return FALSE;
+            }
+
+          data = &loader->aligned;
+          start = 0;
+        }
 
       if (_dbus_header_have_message_untrusted (loader->max_message_size,
                                                &validity,
@@ -4117,22 +6151,38 @@ _dbus_message_loader_queue_messages (DBusMessageLoader *loader)
                                                &fields_array_len,
                                                &header_len,
                                                &body_len,
-                                               &loader->data, 0,
-                                               _dbus_string_get_length (&loader->data)))
+                                               data, start,
+                                               remaining))
         {
           DBusMessage *message;
 
           _dbus_assert (validity == DBUS_VALID);
 
+          if (data == &loader->aligned)
+            {
+              _dbus_string_set_length (&loader->aligned, 0);
+              if (!_dbus_string_copy_len (&loader->data, consumed,
+                                          header_len + body_len,
+                                          &loader->aligned, 0))
+                {
+                  discard_consumed_data (loader, consumed);
+                  return FALSE;
+                }
+            }
+
           message = dbus_message_new_empty_header ();
           if (message == NULL)
-            return FALSE;
+            {
+              discard_consumed_data (loader, consumed);
+              return FALSE;
+            }
 
-          if (!load_message (loader, message,
+          if (!load_message (loader, message, data, start,
                              byte_order, fields_array_len,
-                             header_len, body_len))
+                             header_len, body_len, NULL))
             {
               dbus_message_unref (message);
+              discard_consumed_data (loader, consumed);
               /* load_message() returns false if corrupted or OOM; if
                * corrupted then return TRUE for not OOM
                */
@@ -4141,6 +6191,8 @@ _dbus_message_loader_queue_messages (DBusMessageLoader *loader)
 
           _dbus_assert (loader->messages != NULL);
           _dbus_assert (_dbus_list_find_last (&loader->messages, message) != NULL);
+
+          consumed += header_len + body_len;
 	}
       else
         {
@@ -4151,10 +6203,29 @@ _dbus_message_loader_queue_messages (DBusMessageLoader *loader)
               loader->corrupted = TRUE;
               loader->corruption_reason = validity;
             }
+          else if (body_len >= LARGE_BODY_LEN && remaining >= header_len)
+            {
+              dbus_bool_t streamed = FALSE;
+
+              /* Both paths want the header at the start of the buffer */
+              discard_consumed_data (loader, consumed);
+              consumed = 0;
+
+              if (loader->chunk_function != NULL &&
+                  !start_streamed_body (loader, byte_order, fields_array_len,
+                                        header_len, body_len, &streamed))
+                return loader->corrupted;
+
+              if (!streamed &&
+                  !start_large_body (loader, 0, header_len, body_len))
+                return FALSE;
+            }
+          discard_consumed_data (loader, consumed);
           return TRUE;
         }
     }
 
+  discard_consumed_data (loader, consumed);
   return TRUE;
 }
 
@@ -4215,6 +6286,88 @@ _dbus_message_loader_putback_message_link (DBusMessageLoader  *loader,
   _dbus_list_prepend_link (&loader->messages, link);
 }
 
+/**
+ * Queues a message that another connection in this process handed
+ * over whole, as though it had just been read from the wire. Such a
+ * message was built through the API rather than parsed, so it isn't
+ * validated. If nobody else holds a reference, the message itself is
+ * unlocked and queued; otherwise a copy is, so that the receiver can
+ * modify it as it can any message it reads.
+ *
+ * @param loader the loader
+ * @param link link holding the message, both taken on success
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+_dbus_message_loader_queue_handed_off (DBusMessageLoader  *loader,
+                                       DBusList           *link)
+{
+  DBusMessage *message;
+  dbus_bool_t counted;
+  int i;
+
+  message = link->data;
+
+  /* a counter still charged for it belongs to someone else, too */
+  counted = message->counters != NULL;
+  for (i = 0; i < N_INLINE_COUNTERS; i++)
+    if (message->inline_counters[i] != NULL)
+      counted = TRUE;
+
+  if (_dbus_atomic_get (&message->refcount) == 1 && !counted)
+    {
+      /* the sender's data is no business of the receiver's */
+      _dbus_data_slot_list_clear (&message->slot_list);
+      message->locked = FALSE;
+    }
+  else
+    {
+      DBusMessage *copy;
+
+      copy = dbus_message_copy (message);
+      if (copy == NULL)
+        return FALSE;
+
+      /* a copy starts without a serial, but this one was sent */
+      dbus_message_set_serial (copy, dbus_message_get_serial (message));
+
+      dbus_message_unref (message);
+      link->data = copy;
+    }
+
+  _dbus_list_append_link (&loader->messages, link);
+
+  return TRUE;
+}
+
+/**
+ * Gets the bytes read but not yet made into a message, if that is all
+ * the loader holds. It isn't if a large or streamed body is part way
+ * through, if file descriptors are waiting for a message, or if it
+ * has complete messages not yet popped.
+ *
+ * @param loader the loader
+ * @returns the bytes, or #NULL if they don't describe the loader
+ */
+const DBusString*
+_dbus_message_loader_get_unread (DBusMessageLoader *loader)
+{
+  if (loader->corrupted ||
+      loader->buffer_outstanding ||
+      loader->messages != NULL ||
+      loader->large_body_len > 0 ||
+      loader->streamed_message != NULL)
+    return NULL;
+
+#ifdef HAVE_UNIX_FD_PASSING
+  if (loader->unix_fds_outstanding ||
+      loader_get_n_unix_fds (loader) > 0)
+    return NULL;
+#endif
+
+  return &loader->data;
+}
+
 /**
  * Checks whether the loader is confused due to bad data.
  * If messages are received that are invalid, the
@@ -4309,6 +6462,114 @@ _dbus_message_loader_get_max_message_unix_fds (DBusMessageLoader  *loader)
   return loader->max_message_unix_fds;
 }
 
+/**
+ * Sets whether the loader trusts the peer to send well-formed message
+ * bodies. Headers are always validated, since we route on them, as
+ * are the bodies of messages a message bus examines itself; other
+ * bodies are passed through unchecked.
+ *
+ * @param loader the loader
+ * @param trust #TRUE to stop validating bodies of messages we just pass on
+ */
+void
+_dbus_message_loader_set_trust_bodies (DBusMessageLoader  *loader,
+                                       dbus_bool_t         trust)
+{
+  loader->trust_bodies = trust != FALSE;
+}
+
+/**
+ * Sets whether messages in the other byte order that aren't addressed
+ * to a message bus itself are left in that order, rather than swapped
+ * into ours the first time anything reads them. Reading them still
+ * works, except that fixed-length arrays can't be got as a pointer
+ * with dbus_message_iter_get_fixed_array(); and appending arguments
+ * still swaps them first.
+ *
+ * @param loader the loader
+ * @param keep #TRUE to leave messages to pass on in the sender's byte order
+ */
+void
+_dbus_message_loader_set_keep_byte_order (DBusMessageLoader  *loader,
+                                          dbus_bool_t         keep)
+{
+  loader->keep_byte_order = keep != FALSE;
+}
+
+/**
+ * Sets whether the loader defers validating message bodies until
+ * something first reads them with dbus_message_iter_init() or
+ * dbus_message_get_args(). Headers are validated as usual.
+ *
+ * @param loader the loader
+ * @param lazy #TRUE to validate bodies on first use
+ */
+void
+_dbus_message_loader_set_lazy_bodies (DBusMessageLoader  *loader,
+                                      dbus_bool_t         lazy)
+{
+  loader->lazy_bodies = lazy != FALSE;
+}
+
+/**
+ * Sets a function to stream large byte array bodies to. A message
+ * whose body is a single byte array of at least #LARGE_BODY_LEN bytes
+ * is then not buffered whole: each piece of the array is passed to
+ * the function as it is read and then dropped, and the message is
+ * queued afterwards with an empty array for a body. The function is
+ * called from _dbus_message_loader_queue_messages().
+ *
+ * @param loader the loader
+ * @param function the function, or #NULL to buffer bodies as usual
+ * @param data data to pass to the function
+ */
+void
+_dbus_message_loader_set_chunk_function (DBusMessageLoader              *loader,
+                                         DBusMessageLoaderChunkFunction  function,
+                                         void                           *data)
+{
+  loader->chunk_function = function;
+  loader->chunk_data = data;
+}
+
+/**
+ * Sets how much unused space the loader may keep allocated in its
+ * buffer after queueing messages. A transport that reads in large
+ * chunks should raise this to its read size, so the buffer is not
+ * shrunk and regrown around every read.
+ *
+ * @param loader the loader
+ * @param max_waste max unused bytes to keep around
+ */
+void
+_dbus_message_loader_set_max_buffer_waste (DBusMessageLoader  *loader,
+                                           int                 max_waste)
+{
+  loader->max_buffer_waste = max_waste;
+}
+
+/**
+ * Frees the memory the loader only keeps in case more data arrives
+ * soon: the unused end of its buffer, and its scratch buffers. For
+ * connections that have gone idle; the buffers grow back on demand.
+ *
+ * @param loader the loader
+ */
+void
+_dbus_message_loader_compact (DBusMessageLoader *loader)
+{
+  if (loader->buffer_outstanding)
+    return;
+
+  _dbus_string_compact (&loader->data, 0);
+
+  _dbus_string_set_length (&loader->aligned, 0);
+  _dbus_string_compact (&loader->aligned, 0);
+
+  if (loader->large_body_len == 0)
+    _dbus_string_compact (&loader->large_body, 0);
+}
+
 static DBusDataSlotAllocator slot_allocator;
 _DBUS_DEFINE_GLOBAL_LOCK (message_slots);
 
@@ -4538,6 +6799,96 @@ dbus_message_marshal (DBusMessage  *msg,
   return FALSE;
 }
 
+/**
+ * Gets the marshalled form of a message, as described in the D-Bus
+ * specification, without copying it: the header and the body, which
+ * written out one after the other make up the message. They can be
+ * handed straight to writev() or a similar gather-write function.
+ *
+ * The returned pointers point into the message, and stay valid until
+ * the message is modified or freed.
+ *
+ * @param msg the DBusMessage
+ * @param header_p return location for the start of the header
+ * @param header_len_p return location for the length of the header
+ * @param body_p return location for the start of the body
+ * @param body_len_p return location for the length of the body, which may be 0
+ */
+void
+dbus_message_get_marshalled_blocks (DBusMessage  *msg,
+                                    const char  **header_p,
+                                    int          *header_len_p,
+                                    const char  **body_p,
+                                    int          *body_len_p)
+{
+  dbus_bool_t was_locked;
+
+  _dbus_return_if_fail (msg != NULL);
+  _dbus_return_if_fail (header_p != NULL);
+  _dbus_return_if_fail (header_len_p != NULL);
+  _dbus_return_if_fail (body_p != NULL);
+  _dbus_return_if_fail (body_len_p != NULL);
+
+  /* Locking fills in the length header; see dbus_message_marshal() */
+  was_locked = msg->locked;
+
+  if (!was_locked)
+    dbus_message_lock (msg);
+
+  *header_p = _dbus_string_get_const_data (&msg->header.data);
+  *header_len_p = _dbus_string_get_length (&msg->header.data);
+  *body_p = _dbus_string_get_const_data (&msg->body);
+  *body_len_p = _dbus_string_get_length (&msg->body);
+
+  if (!was_locked)
+    msg->locked = FALSE;
+}
+
+/**
+ * Turn a DBusMessage into the marshalled form as described in the D-Bus
+ * specification, in a buffer provided by the caller; so unlike
+ * dbus_message_marshal() it doesn't allocate, and many messages can be
+ * written one after the other into the same buffer.
+ *
+ * If the buffer is too small, nothing is written to it, and the
+ * length it needs to be is still returned.
+ *
+ * @param msg the DBusMessage
+ * @param buffer where to write the marshalled form
+ * @param buffer_len the number of bytes available at buffer
+ * @param len_p the location to save the length of the marshalled form to
+ * @returns #FALSE if the buffer was too small
+ */
+dbus_bool_t
+dbus_message_marshal_into (DBusMessage  *msg,
+                           char         *buffer,
+                           int           buffer_len,
+                           int          *len_p)
+{
+  const char *header;
+  const char *body;
+  int header_len;
+  int body_len;
+
+  _dbus_return_val_if_fail (msg != NULL, FALSE);
+  _dbus_return_val_if_fail (buffer != NULL || buffer_len == 0, FALSE);
+  _dbus_return_val_if_fail (buffer_len >= 0, FALSE);
+  _dbus_return_val_if_fail (len_p != NULL, FALSE);
+
+  dbus_message_get_marshalled_blocks (msg, &header, &header_len,
+                                      &body, &body_len);
+
+  *len_p = header_len + body_len;
+
+  if (*len_p > buffer_len)
+    return FALSE;
+
+  memcpy (buffer, header, header_len);
+  memcpy (buffer + header_len, body, body_len);
+
+  return TRUE;
+}
+
 /**
  * Demarshal a D-Bus message from the format described in the D-Bus
  * specification.
@@ -4596,6 +6947,166 @@ dbus_message_demarshal (const char *str,
   return NULL;
 }
 
+/**
+ * Demarshal a D-Bus message from the format described in the D-Bus
+ * specification, like dbus_message_demarshal(), but without copying
+ * the body: the message reads it straight from str, which must stay
+ * valid and unchanged until free_function is called. The message and
+ * any copies made of it with dbus_message_copy() share it, and
+ * free_function is called with user_data when the last of them is
+ * freed or modified.
+ *
+ * The body can only be used in place if str is aligned to 8 bytes and
+ * the message is in the byte order of this machine; otherwise it is
+ * copied, and free_function is called before this function returns.
+ *
+ * If #NULL is returned, free_function is not called, and the caller
+ * still owns str.
+ *
+ * @param str the marshalled DBusMessage
+ * @param len the length of str, which must be exactly one message
+ * @param free_function function to release str, or #NULL
+ * @param user_data argument to free_function
+ * @param error the location to save errors to
+ * @returns #NULL if there was an error
+ */
+DBusMessage *
+dbus_message_demarshal_static (const char       *str,
+                               int               len,
+                               DBusFreeFunction  free_function,
+                               void             *user_data,
+                               DBusError        *error)
+{
+  DBusString data;
+  DBusMessage *msg;
+  DBusValidity validity;
+  const DBusString *type_str;
+  int type_pos;
+  int byte_order, fields_array_len, header_len, body_len;
+  dbus_uint32_t n_unix_fds;
+  DBusMessageSharedBody *shared;
+
+  _dbus_return_val_if_fail (str != NULL, NULL);
+  _dbus_return_val_if_fail (len >= 0, NULL);
+  _dbus_return_val_if_error_is_set (error, NULL);
+
+  if (len < DBUS_MINIMUM_HEADER_SIZE || len > DBUS_MAXIMUM_MESSAGE_LENGTH)
+    {
+      dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                      "Message is corrupted (%d bytes is not a valid message length)",
+                      len);
+      return NULL;
+    }
+
+  _dbus_string_init_const_len (&data, str, len);
+
+  validity = DBUS_VALID;
+  if (!_dbus_header_have_message_untrusted (DBUS_MAXIMUM_MESSAGE_LENGTH,
+                                            &validity, &byte_order,
+                                            &fields_array_len,
+                                            &header_len, &body_len,
+                                            &data, 0, len))
+    {
+      if (validity == DBUS_VALID)
+        dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                        "Message is incomplete");
+      else
+        dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                        "Message is corrupted (%s)",
+                        _dbus_validity_to_error_message (validity));
+      return NULL;
+    }
+
+  if (header_len + body_len != len)
+    {
+      dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                      "Message is corrupted (%d bytes of trailing data)",
+                      len - header_len - body_len);
+      return NULL;
+    }
+
+  msg = dbus_message_new_empty_header ();
+  if (msg == NULL)
+    goto fail_oom;
+
+  if (!_dbus_header_load (&msg->header,
+                          DBUS_VALIDATION_MODE_DATA_IS_UNTRUSTED,
+                          &validity, byte_order, fields_array_len,
+                          header_len, body_len, &data, 0, len))
+    {
+      if (validity == DBUS_VALIDITY_UNKNOWN_OOM_ERROR)
+        goto fail_oom;
+      goto fail_corrupt;
+    }
+
+  msg->byte_order = byte_order;
+
+  get_const_signature (&msg->header, &type_str, &type_pos);
+  validity = _dbus_validate_body_with_reason (type_str, type_pos,
+                                              byte_order, NULL,
+                                              &data, header_len, body_len);
+  if (validity != DBUS_VALID)
+    goto fail_corrupt;
+
+  /* There's nowhere for file descriptors to come from */
+  n_unix_fds = 0;
+  _dbus_header_get_field_basic (&msg->header,
+                                DBUS_HEADER_FIELD_UNIX_FDS,
+                                DBUS_TYPE_UINT32,
+                                &n_unix_fds);
+  if (n_unix_fds > 0)
+    {
+      validity = DBUS_INVALID_MISSING_UNIX_FDS;
+      goto fail_corrupt;
+    }
+
+  _dbus_assert (_dbus_string_get_length (&msg->body) == 0);
+
+  /* Reading swaps a body in place, and fixed-length arrays are
+   * returned as pointers into it, so only a body that needs neither
+   * can be left where it is.
+   */
+  if (byte_order == DBUS_COMPILER_BYTE_ORDER &&
+      body_len > 0 &&
+      str == (const char *) _DBUS_ALIGN_ADDRESS (str, 8))
+    {
+      shared = dbus_new (DBusMessageSharedBody, 1);
+      if (shared == NULL)
+        goto fail_oom;
+
+      shared->refcount.value = 1;
+      _dbus_string_init_const_len (&shared->str, str + header_len, body_len);
+      shared->free_function = free_function;
+      shared->free_data = user_data;
+
+      _dbus_string_free (&msg->body);
+      _dbus_string_init_const_len (&msg->body, str + header_len, body_len);
+      msg->shared_body = shared;
+    }
+  else
+    {
+      if (!_dbus_string_copy_len (&data, header_len, body_len, &msg->body, 0))
+        goto fail_oom;
+
+      if (free_function != NULL)
+        (* free_function) (user_data);
+    }
+
+  return msg;
+
+ fail_corrupt:
+  dbus_set_error (error, DBUS_ERROR_INVALID_ARGS, "Message is corrupted (%s)",
+                  _dbus_validity_to_error_message (validity));
+  dbus_message_unref (msg);
+  return NULL;
+
+ fail_oom:
+  _DBUS_SET_OOM (error);
+  if (msg != NULL)
+    dbus_message_unref (msg);
+  return NULL;
+}
+
 /**
  * Returns the number of bytes required to be in the buffer to demarshal a
  * D-Bus message.
@@ -4638,7 +7149,8 @@ dbus_message_demarshal_bytes_needed(const char *buf,
 
   if (validity == DBUS_VALID)
     {
-      _dbus_assert(have_message);
+      /* the header can be valid with the body still to come */
+      _dbus_assert (have_message || (header_len + body_len) > len);
       return header_len + body_len;
     }
   else
@@ -66,6 +66,18 @@ struct DBusMessageIter
   void *pad3;           /**< Don't use this */
 };
 
+typedef struct DBusObjectPathIter DBusObjectPathIter;
+
+/**
+ * DBusObjectPathIter struct; contains no public fields.
+ */
+struct DBusObjectPathIter
+{
+  const char *dummy1;   /**< Don't use this */
+  void *pad1;           /**< Don't use this */
+  void *pad2;           /**< Don't use this */
+};
+
 DBUS_EXPORT
 DBusMessage* dbus_message_new               (int          message_type);
 DBUS_EXPORT
@@ -80,6 +92,8 @@ DBusMessage* dbus_message_new_signal        (const char  *path,
                                              const char  *interface,
                                              const char  *name);
 DBUS_EXPORT
+DBusMessage* dbus_message_new_from_template (DBusMessage *template_message);
+DBUS_EXPORT
 DBusMessage* dbus_message_new_error         (DBusMessage *reply_to,
                                              const char  *error_name,
                                              const char  *error_message);
@@ -180,10 +194,22 @@ void          dbus_message_set_auto_start   (DBusMessage   *message,
                                              dbus_bool_t    auto_start);
 DBUS_EXPORT
 dbus_bool_t   dbus_message_get_auto_start   (DBusMessage   *message);
+DBUS_EXPORT
+dbus_bool_t   dbus_message_set_expiry       (DBusMessage   *message,
+                                             dbus_uint32_t  milliseconds);
+DBUS_EXPORT
+dbus_uint32_t dbus_message_get_expiry       (DBusMessage   *message);
 
 DBUS_EXPORT
 dbus_bool_t   dbus_message_get_path_decomposed (DBusMessage   *message,
                                                 char        ***path);
+DBUS_EXPORT
+dbus_bool_t   dbus_message_path_iter_init   (DBusMessage        *message,
+                                             DBusObjectPathIter *iter);
+DBUS_EXPORT
+dbus_bool_t   dbus_message_path_iter_next   (DBusObjectPathIter *iter,
+                                             const char        **element,
+                                             int                *len);
 
 DBUS_EXPORT
 dbus_bool_t dbus_message_append_args          (DBusMessage     *message,
@@ -211,6 +237,10 @@ DBUS_EXPORT
 dbus_bool_t dbus_message_iter_init             (DBusMessage     *message,
                                                 DBusMessageIter *iter);
 DBUS_EXPORT
+dbus_bool_t dbus_message_iter_init_at          (DBusMessage     *message,
+                                                DBusMessageIter *iter,
+                                                int              n);
+DBUS_EXPORT
 dbus_bool_t dbus_message_iter_has_next         (DBusMessageIter *iter);
 DBUS_EXPORT
 dbus_bool_t dbus_message_iter_next             (DBusMessageIter *iter);
@@ -237,6 +267,19 @@ DBUS_EXPORT
 void        dbus_message_iter_get_fixed_array  (DBusMessageIter *iter,
                                                 void            *value,
                                                 int             *n_elements);
+DBUS_EXPORT
+dbus_bool_t dbus_message_iter_get_fixed_struct_array (DBusMessageIter *iter,
+                                                      void            *elements,
+                                                      int              element_size,
+                                                      int             *n_elements);
+DBUS_EXPORT
+dbus_bool_t dbus_message_iter_get_string_array (DBusMessageIter  *iter,
+                                                const char      **elements,
+                                                int              *n_elements);
+DBUS_EXPORT
+dbus_bool_t dbus_message_iter_find_variant_entry (DBusMessageIter *iter,
+                                                  const char      *key,
+                                                  DBusMessageIter *value);
 
 
 DBUS_EXPORT
@@ -252,6 +295,24 @@ dbus_bool_t dbus_message_iter_append_fixed_array (DBusMessageIter *iter,
                                                   const void      *value,
                                                   int              n_elements);
 DBUS_EXPORT
+dbus_bool_t dbus_message_iter_reserve_fixed_array (DBusMessageIter *iter,
+                                                   int              element_type,
+                                                   int              n_elements,
+                                                   void           **data_p);
+DBUS_EXPORT
+dbus_bool_t dbus_message_iter_append_fixed_struct_array (DBusMessageIter *iter,
+                                                         const void      *elements,
+                                                         int              element_size,
+                                                         int              n_elements);
+DBUS_EXPORT
+dbus_bool_t dbus_message_iter_append_variant_entry (DBusMessageIter *iter,
+                                                    const char      *key,
+                                                    int              type,
+                                                    const void      *value);
+DBUS_EXPORT
+dbus_bool_t dbus_message_iter_reserve_space      (DBusMessageIter *iter,
+                                                  int              n_bytes);
+DBUS_EXPORT
 dbus_bool_t dbus_message_iter_open_container     (DBusMessageIter *iter,
                                                   int              type,
                                                   const char      *contained_signature,
@@ -294,9 +355,26 @@ dbus_bool_t  dbus_message_marshal   (DBusMessage  *msg,
                                      char        **marshalled_data_p,
                                      int          *len_p);
 DBUS_EXPORT
+void         dbus_message_get_marshalled_blocks (DBusMessage  *msg,
+                                                 const char  **header_p,
+                                                 int          *header_len_p,
+                                                 const char  **body_p,
+                                                 int          *body_len_p);
+DBUS_EXPORT
+dbus_bool_t  dbus_message_marshal_into (DBusMessage  *msg,
+                                        char         *buffer,
+                                        int           buffer_len,
+                                        int          *len_p);
+DBUS_EXPORT
 DBusMessage* dbus_message_demarshal (const char *str,
                                      int         len,
                                      DBusError  *error);
+DBUS_EXPORT
+DBusMessage* dbus_message_demarshal_static (const char       *str,
+                                            int               len,
+                                            DBusFreeFunction  free_function,
+                                            void             *user_data,
+                                            DBusError        *error);
 
 DBUS_EXPORT
 int          dbus_message_demarshal_bytes_needed (const char *str, 
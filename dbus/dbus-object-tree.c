@@ -24,9 +24,11 @@
 #include <config.h>
 #include "dbus-object-tree.h"
 #include "dbus-connection-internal.h"
+#include "dbus-message-internal.h"
 #include "dbus-internals.h"
 #include "dbus-hash.h"
 #include "dbus-protocol.h"
+#include "dbus-signature.h"
 #include "dbus-string.h"
 #include <string.h>
 #include <stdlib.h>
@@ -51,6 +53,18 @@ static DBusObjectSubtree* _dbus_object_subtree_new   (const char
 static DBusObjectSubtree* _dbus_object_subtree_ref   (DBusObjectSubtree           *subtree);
 static void               _dbus_object_subtree_unref (DBusObjectSubtree           *subtree);
 
+/**
+ * An interface registered on a single object, with its methods
+ * hashed by member name
+ */
+typedef struct
+{
+  char                        *name;           /**< Interface name; key in the subtree's table */
+  DBusHashTable               *methods;        /**< Member name => #DBusObjectPathMethod, not owned */
+  void                        *user_data;      /**< Data for the method functions */
+  DBusFreeFunction             free_user_data; /**< Function to free user_data */
+} DBusObjectInterface;
+
 /**
  * Internals of DBusObjectTree
  */
@@ -60,6 +74,10 @@ struct DBusObjectTree
   DBusConnection     *connection; /**< Connection this tree belongs to */
 
   DBusObjectSubtree  *root;       /**< Root of the tree ("/" node) */
+
+  DBusString          last_path;        /**< Path last looked up in dispatch, empty if the cache is invalid */
+  DBusObjectSubtree  *last_handler;     /**< Deepest handler found for last_path */
+  dbus_bool_t         last_exact_match; /**< Whether last_handler is an exact match for last_path */
 };
 
 /**
@@ -74,6 +92,7 @@ struct DBusObjectSubtree
   DBusObjectPathUnregisterFunction   unregister_function; /**< Function to call on unregister */
   DBusObjectPathMessageFunction      message_function;    /**< Function to handle messages */
   void                              *user_data;           /**< Data for functions */
+  DBusHashTable                     *interfaces;          /**< Interface name => DBusObjectInterface, or #NULL */
   DBusObjectSubtree                **subtrees;            /**< Child nodes */
   int                                n_subtrees;          /**< Number of child nodes */
   int                                max_subtrees;        /**< Number of allocated entries in subtrees */
@@ -102,6 +121,13 @@ _dbus_object_tree_new (DBusConnection *connection)
   if (tree == NULL)
     goto oom;
 
+  if (!_dbus_string_init (&tree->last_path))
+    {
+      dbus_free (tree);
+      tree = NULL;
+      goto oom;
+    }
+
   tree->refcount = 1;
   tree->connection = connection;
   tree->root = _dbus_object_subtree_new ("/", NULL, NULL);
@@ -114,6 +140,7 @@ _dbus_object_tree_new (DBusConnection *connection)
  oom:
   if (tree)
     {
+      _dbus_string_free (&tree->last_path);
       dbus_free (tree);
     }
 
@@ -150,6 +177,7 @@ _dbus_object_tree_unref (DBusObjectTree *tree)
     {
       _dbus_object_tree_free_all_unlocked (tree);
 
+      _dbus_string_free (&tree->last_path);
       dbus_free (tree);
     }
 }
@@ -373,8 +401,192 @@ ensure_subtree (DBusObjectTree *tree,
   return find_subtree_recurse (tree->root, path, TRUE, NULL, NULL);
 }
 
+/**
+ * Binary-searches the children of a subtree for the path element
+ * of length len starting at element, which need not be nul
+ * terminated. Children are kept sorted by strcmp(), and comparing
+ * at most len bytes and then checking for the end of the child's
+ * name gives the same ordering.
+ */
+static DBusObjectSubtree*
+find_child_len (DBusObjectSubtree *subtree,
+                const char        *element,
+                int                len)
+{
+  int i, j;
+
+  i = 0;
+  j = subtree->n_subtrees;
+  while (i < j)
+    {
+      DBusObjectSubtree *child;
+      int k, v;
+
+      k = (i + j) / 2;
+      child = subtree->subtrees[k];
+
+      v = strncmp (element, child->name, len);
+      if (v == 0 && child->name[len] != '\0')
+        v = -1;
+
+      if (v == 0)
+        return child;
+      else if (v < 0)
+        j = k;
+      else
+        i = k + 1;
+    }
+
+  return NULL;
+}
+
+/**
+ * Like find_subtree_recurse() without create_if_not_found, but walks
+ * a valid object path string directly instead of a decomposed path,
+ * so it never allocates. If exact_match is #NULL only an exact match
+ * is returned, otherwise the deepest node covering the path (either
+ * the exact node or its nearest fallback ancestor).
+ */
+static DBusObjectSubtree*
+find_subtree_by_path_string (DBusObjectTree *tree,
+                             const char     *path,
+                             dbus_bool_t    *exact_match)
+{
+  DBusObjectSubtree *subtree;
+  DBusObjectSubtree *fallback;
+  DBusObjectPathIter iter;
+  const char *element;
+  int len;
+
+  subtree = tree->root;
+  fallback = subtree->invoke_as_fallback ? subtree : NULL;
+
+  _dbus_object_path_iter_init (&iter, path);
+  while (dbus_message_path_iter_next (&iter, &element, &len))
+    {
+      subtree = find_child_len (subtree, element, len);
+      if (subtree == NULL)
+        {
+          if (exact_match == NULL)
+            return NULL;
+
+          *exact_match = FALSE;
+          return fallback;
+        }
+
+      if (subtree->invoke_as_fallback)
+        fallback = subtree;
+    }
+
+  if (exact_match != NULL)
+    *exact_match = TRUE;
+  return subtree;
+}
+
+/**
+ * Forgets the result of the last dispatch lookup; must be called
+ * whenever the shape of the tree or the fallback flags change.
+ */
+static void
+invalidate_handler_cache (DBusObjectTree *tree)
+{
+  _dbus_string_set_length (&tree->last_path, 0);
+  tree->last_handler = NULL;
+}
+
+/**
+ * find_handler() for a path string, remembering the answer so that
+ * a run of messages to the same object skips the tree walk.
+ */
+static DBusObjectSubtree*
+find_handler_cached (DBusObjectTree *tree,
+                     const char     *path,
+                     dbus_bool_t    *exact_match)
+{
+  DBusObjectSubtree *subtree;
+  int len;
+
+  len = strlen (path);
+  if (len == _dbus_string_get_length (&tree->last_path) &&
+      memcmp (path, _dbus_string_get_const_data (&tree->last_path), len) == 0)
+    {
+      *exact_match = tree->last_exact_match;
+      return tree->last_handler;
+    }
+
+  *exact_match = FALSE;
+  subtree = find_subtree_by_path_string (tree, path, exact_match);
+
+  /* Failing to remember the path just leaves the cache empty */
+  _dbus_string_set_length (&tree->last_path, 0);
+  if (_dbus_string_append_len (&tree->last_path, path, len))
+    {
+      tree->last_handler = subtree;
+      tree->last_exact_match = *exact_match;
+    }
+  else
+    invalidate_handler_cache (tree);
+
+  return subtree;
+}
+
 static char *flatten_path (const char **path);
 
+static void
+free_interface (DBusObjectInterface *object_interface)
+{
+  if (object_interface->methods != NULL)
+    _dbus_hash_table_unref (object_interface->methods);
+
+  dbus_free (object_interface->name);
+  dbus_free (object_interface);
+}
+
+static dbus_bool_t
+subtree_has_interfaces (DBusObjectSubtree *subtree)
+{
+  return subtree->interfaces != NULL &&
+    _dbus_hash_table_get_n_entries (subtree->interfaces) > 0;
+}
+
+/**
+ * If nothing is registered at a subtree and it has no subtrees of its
+ * own, removes it from its parent (FIXME could also be more aggressive
+ * and remove our parent if it becomes empty)
+ *
+ * @param subtree the subtree
+ * @param index_in_parent its index in its parent's subtrees
+ */
+static void
+detach_if_unused (DBusObjectSubtree *subtree,
+                  int                index_in_parent)
+{
+  int i = index_in_parent;
+
+  if (subtree->parent == NULL || subtree->n_subtrees > 0 ||
+      subtree->message_function != NULL || subtree_has_interfaces (subtree))
+    return;
+
+  _dbus_assert (subtree->parent->subtrees[i] == subtree);
+
+  /* assumes a 0-byte memmove is OK */
+  memmove (&subtree->parent->subtrees[i],
+           &subtree->parent->subtrees[i+1],
+           (subtree->parent->n_subtrees - i - 1) *
+           sizeof (subtree->parent->subtrees[0]));
+  subtree->parent->n_subtrees -= 1;
+
+  subtree->parent = NULL;
+
+  if (subtree->interfaces != NULL)
+    {
+      _dbus_hash_table_unref (subtree->interfaces);
+      subtree->interfaces = NULL;
+    }
+
+  _dbus_object_subtree_unref (subtree);
+}
+
 /**
  * Registers a new subtree in the global object tree.
  *
@@ -401,6 +613,8 @@ _dbus_object_tree_register (DBusObjectTree              *tree,
   _dbus_assert (vtable->message_function != NULL);
   _dbus_assert (path != NULL);
 
+  invalidate_handler_cache (tree);
+
   subtree = ensure_subtree (tree, path);
   if (subtree == NULL)
     {
@@ -433,6 +647,182 @@ _dbus_object_tree_register (DBusObjectTree              *tree,
   return TRUE;
 }
 
+/**
+ * Registers the methods of one interface on a single object. Calls
+ * to them are dispatched through a hash on interface and member,
+ * before any vtable registered at (or as a fallback above) the same
+ * path sees the message.
+ *
+ * @param tree the global object tree
+ * @param path NULL-terminated array of path elements giving path to the object
+ * @param interface the interface name
+ * @param methods the methods, terminated by one with a #NULL name;
+ *   not copied, so it must stay valid until unregistered
+ * @param user_data user data to pass to the method functions
+ * @param free_user_data function to free user_data when unregistered, or #NULL
+ * @param error address where an error can be returned
+ * @returns #FALSE if an error (#DBUS_ERROR_NO_MEMORY or
+ *    #DBUS_ERROR_OBJECT_PATH_IN_USE) is reported
+ */
+dbus_bool_t
+_dbus_object_tree_register_interface (DBusObjectTree              *tree,
+                                      const char                 **path,
+                                      const char                  *interface,
+                                      const DBusObjectPathMethod  *methods,
+                                      void                        *user_data,
+                                      DBusFreeFunction             free_user_data,
+                                      DBusError                   *error)
+{
+  DBusObjectSubtree *subtree;
+  DBusObjectInterface *object_interface;
+  int i;
+
+  _dbus_assert (tree != NULL);
+  _dbus_assert (path != NULL);
+  _dbus_assert (interface != NULL);
+  _dbus_assert (methods != NULL);
+
+  invalidate_handler_cache (tree);
+
+  subtree = ensure_subtree (tree, path);
+  if (subtree == NULL)
+    goto oom;
+
+  if (subtree->interfaces == NULL)
+    {
+      subtree->interfaces = _dbus_hash_table_new (DBUS_HASH_STRING,
+                                                  NULL, NULL);
+      if (subtree->interfaces == NULL)
+        goto oom;
+    }
+
+  if (_dbus_hash_table_lookup_string (subtree->interfaces, interface) != NULL)
+    {
+      if (error != NULL)
+        {
+          char *complete_path = flatten_path (path);
+
+          dbus_set_error (error, DBUS_ERROR_OBJECT_PATH_IN_USE,
+                          "Interface %s is already registered for %s",
+                          interface,
+                          complete_path ? complete_path
+                                        : "(cannot represent path: out of memory!)");
+
+          dbus_free (complete_path);
+        }
+
+      return FALSE;
+    }
+
+  object_interface = dbus_new0 (DBusObjectInterface, 1);
+  if (object_interface == NULL)
+    goto oom;
+
+  object_interface->name = _dbus_strdup (interface);
+  object_interface->methods = _dbus_hash_table_new (DBUS_HASH_STRING,
+                                                    NULL, NULL);
+  if (object_interface->name == NULL || object_interface->methods == NULL)
+    goto oom_free_interface;
+
+  for (i = 0; methods[i].name != NULL; i++)
+    {
+      _dbus_assert (methods[i].function != NULL);
+
+      if (!_dbus_hash_table_insert_string (object_interface->methods,
+                                           (char *) methods[i].name,
+                                           (void *) &methods[i]))
+        goto oom_free_interface;
+    }
+
+  if (!_dbus_hash_table_insert_string (subtree->interfaces,
+                                       object_interface->name,
+                                       object_interface))
+    goto oom_free_interface;
+
+  object_interface->user_data = user_data;
+  object_interface->free_user_data = free_user_data;
+
+  return TRUE;
+
+ oom_free_interface:
+  free_interface (object_interface);
+ oom:
+  _DBUS_SET_OOM (error);
+  return FALSE;
+}
+
+/**
+ * Unregisters an interface registered with
+ * _dbus_object_tree_register_interface() at the same path.
+ *
+ * @param tree the global object tree
+ * @param path path to the object
+ * @param interface the interface name
+ */
+void
+_dbus_object_tree_unregister_interface_and_unlock (DBusObjectTree  *tree,
+                                                   const char     **path,
+                                                   const char      *interface)
+{
+  DBusObjectSubtree *subtree;
+  DBusObjectInterface *object_interface;
+  DBusConnection *connection;
+  int i;
+
+  _dbus_assert (path != NULL);
+  _dbus_assert (interface != NULL);
+
+  invalidate_handler_cache (tree);
+
+  object_interface = NULL;
+  subtree = find_subtree_recurse (tree->root, path, FALSE, &i, NULL);
+  if (subtree != NULL && subtree->interfaces != NULL)
+    object_interface = _dbus_hash_table_lookup_string (subtree->interfaces,
+                                                       interface);
+
+#ifndef DBUS_DISABLE_CHECKS
+  if (object_interface == NULL)
+    {
+      _dbus_warn ("Attempted to unregister interface %s on path (path[0] = %s path[1] = %s) where it isn't registered\n",
+                  interface,
+                  path[0] ? path[0] : "null",
+                  path[1] ? path[1] : "null");
+      goto unlock;
+    }
+#else
+  _dbus_assert (object_interface != NULL);
+#endif
+
+  _dbus_hash_table_remove_string (subtree->interfaces, interface);
+  detach_if_unused (subtree, i);
+
+unlock:
+  connection = tree->connection;
+
+  /* Unlock and call application code */
+#ifdef DBUS_BUILD_TESTS
+  if (connection)
+#endif
+    {
+      _dbus_connection_ref_unlocked (connection);
+      _dbus_verbose ("unlock\n");
+      _dbus_connection_unlock (connection);
+    }
+
+  if (object_interface != NULL)
+    {
+      if (object_interface->free_user_data)
+        (* object_interface->free_user_data) (object_interface->user_data);
+
+      free_interface (object_interface);
+    }
+
+#ifdef DBUS_BUILD_TESTS
+  if (connection)
+#endif
+    dbus_connection_unref (connection);
+}
+
 /**
  * Unregisters an object subtree that was registered with the
  * same path.
@@ -455,6 +845,8 @@ _dbus_object_tree_unregister_and_unlock (DBusObjectTree          *tree,
   unregister_function = NULL;
   user_data = NULL;
 
+  invalidate_handler_cache (tree);
+
   subtree = find_subtree (tree, path, &i);
 
 #ifndef DBUS_DISABLE_CHECKS
@@ -480,23 +872,7 @@ _dbus_object_tree_unregister_and_unlock (DBusObjectTree          *tree,
   subtree->unregister_function = NULL;
   subtree->user_data = NULL;
 
-  /* If we have no subtrees of our own, remove from
-   * our parent (FIXME could also be more aggressive
-   * and remove our parent if it becomes empty)
-   */
-  if (subtree->parent && subtree->n_subtrees == 0)
-    {
-      /* assumes a 0-byte memmove is OK */
-      memmove (&subtree->parent->subtrees[i],
-               &subtree->parent->subtrees[i+1],
-               (subtree->parent->n_subtrees - i - 1) *
-               sizeof (subtree->parent->subtrees[0]));
-      subtree->parent->n_subtrees -= 1;
-
-      subtree->parent = NULL;
-
-      _dbus_object_subtree_unref (subtree);
-    }
+  detach_if_unused (subtree, i);
   subtree = NULL;
 
 unlock:
@@ -549,6 +925,28 @@ free_subtree_recurse (DBusConnection    *connection,
   subtree->unregister_function = NULL;
   subtree->user_data = NULL;
 
+  if (subtree->interfaces != NULL)
+    {
+      DBusHashIter iter;
+
+      _dbus_hash_iter_init (subtree->interfaces, &iter);
+      while (_dbus_hash_iter_next (&iter))
+        {
+          DBusObjectInterface *object_interface;
+
+          object_interface = _dbus_hash_iter_get_value (&iter);
+          _dbus_hash_iter_remove_entry (&iter);
+
+          if (object_interface->free_user_data)
+            (* object_interface->free_user_data) (object_interface->user_data);
+
+          free_interface (object_interface);
+        }
+
+      _dbus_hash_table_unref (subtree->interfaces);
+      subtree->interfaces = NULL;
+    }
+
   /* Now free ourselves */
   _dbus_object_subtree_unref (subtree);
 }
@@ -562,6 +960,8 @@ free_subtree_recurse (DBusConnection    *connection,
 void
 _dbus_object_tree_free_all_unlocked (DBusObjectTree *tree)
 {
+  invalidate_handler_cache (tree);
+
   if (tree->root)
     free_subtree_recurse (tree->connection,
                           tree->root);
@@ -569,19 +969,15 @@ _dbus_object_tree_free_all_unlocked (DBusObjectTree *tree)
 }
 
 static dbus_bool_t
-_dbus_object_tree_list_registered_unlocked (DBusObjectTree *tree,
-                                            const char    **parent_path,
-                                            char         ***child_entries)
+list_subtree_children (DBusObjectSubtree *subtree,
+                       char            ***child_entries)
 {
-  DBusObjectSubtree *subtree;
   char **retval;
   
-  _dbus_assert (parent_path != NULL);
   _dbus_assert (child_entries != NULL);
 
   *child_entries = NULL;
   
-  subtree = lookup_subtree (tree, parent_path);
   if (subtree == NULL)
     {
       retval = dbus_new0 (char *, 1);
@@ -612,14 +1008,102 @@ _dbus_object_tree_list_registered_unlocked (DBusObjectTree *tree,
   return retval != NULL;
 }
 
+static dbus_bool_t
+_dbus_object_tree_list_registered_unlocked (DBusObjectTree *tree,
+                                            const char    **parent_path,
+                                            char         ***child_entries)
+{
+  _dbus_assert (parent_path != NULL);
+
+  return list_subtree_children (lookup_subtree (tree, parent_path),
+                                child_entries);
+}
+
+static dbus_bool_t
+append_method_introspection (const DBusObjectPathMethod *method,
+                             DBusString                 *xml)
+{
+  DBusSignatureIter iter;
+
+  if (method->in_signature == NULL || method->in_signature[0] == '\0')
+    return _dbus_string_append_printf (xml, "    <method name=\"%s\"/>\n",
+                                       method->name);
+
+  if (!_dbus_string_append_printf (xml, "    <method name=\"%s\">\n",
+                                   method->name))
+    return FALSE;
+
+  dbus_signature_iter_init (&iter, method->in_signature);
+  do
+    {
+      char *type;
+      dbus_bool_t appended;
+
+      type = dbus_signature_iter_get_signature (&iter);
+      if (type == NULL)
+        return FALSE;
+
+      appended = _dbus_string_append_printf (xml,
+                                             "      <arg type=\"%s\" direction=\"in\"/>\n",
+                                             type);
+      dbus_free (type);
+
+      if (!appended)
+        return FALSE;
+    }
+  while (dbus_signature_iter_next (&iter));
+
+  return _dbus_string_append (xml, "    </method>\n");
+}
+
+/**
+ * Describes the interfaces registered on an object, as far as their
+ * method tables can: there are no argument names or return values.
+ */
+static dbus_bool_t
+append_interfaces_introspection (DBusObjectSubtree *subtree,
+                                 DBusString        *xml)
+{
+  DBusHashIter iter;
+
+  if (subtree == NULL || subtree->interfaces == NULL)
+    return TRUE;
+
+  _dbus_hash_iter_init (subtree->interfaces, &iter);
+  while (_dbus_hash_iter_next (&iter))
+    {
+      DBusObjectInterface *object_interface;
+      DBusHashIter method_iter;
+
+      object_interface = _dbus_hash_iter_get_value (&iter);
+
+      if (!_dbus_string_append_printf (xml, "  <interface name=\"%s\">\n",
+                                       object_interface->name))
+        return FALSE;
+
+      _dbus_hash_iter_init (object_interface->methods, &method_iter);
+      while (_dbus_hash_iter_next (&method_iter))
+        {
+          if (!append_method_introspection (_dbus_hash_iter_get_value (&method_iter),
+                                            xml))
+            return FALSE;
+        }
+
+      if (!_dbus_string_append (xml, "  </interface>\n"))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
 static DBusHandlerResult
 handle_default_introspect_and_unlock (DBusObjectTree          *tree,
                                       DBusMessage             *message,
-                                      const char             **path)
+                                      const char              *path)
 {
   DBusString xml;
   DBusHandlerResult result;
-  char **children;
+  DBusObjectSubtree *subtree;
   int i;
   DBusMessage *reply;
   DBusMessageIter iter;
@@ -666,9 +1150,7 @@ handle_default_introspect_and_unlock (DBusObjectTree          *tree,
 
   result = DBUS_HANDLER_RESULT_NEED_MEMORY;
 
-  children = NULL;
-  if (!_dbus_object_tree_list_registered_unlocked (tree, path, &children))
-    goto out;
+  subtree = find_subtree_by_path_string (tree, path, NULL);
 
   if (!_dbus_string_append (&xml, DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE))
     goto out;
@@ -676,14 +1158,18 @@ handle_default_introspect_and_unlock (DBusObjectTree          *tree,
   if (!_dbus_string_append (&xml, "<node>\n"))
     goto out;
 
-  i = 0;
-  while (children[i] != NULL)
+  if (!append_interfaces_introspection (subtree, &xml))
+    goto out;
+
+  /* The children are read in place, since we hold the lock, rather
+   * than copied out first: a container can have a great many
+   */
+  for (i = 0; subtree != NULL && i < subtree->n_subtrees; i++)
     {
-      if (!_dbus_string_append_printf (&xml, "  <node name=\"%s\"/>\n",
-                                       children[i]))
+      if (!_dbus_string_append (&xml, "  <node name=\"") ||
+          !_dbus_string_append (&xml, subtree->subtrees[i]->name) ||
+          !_dbus_string_append (&xml, "\"/>\n"))
         goto out;
-
-      ++i;
     }
 
   if (!_dbus_string_append (&xml, "</node>\n"))
@@ -723,13 +1209,124 @@ handle_default_introspect_and_unlock (DBusObjectTree          *tree,
     }
   
   _dbus_string_free (&xml);
-  dbus_free_string_array (children);
   if (reply)
     dbus_message_unref (reply);
   
   return result;
 }
 
+/**
+ * Looks up the method a call is for among the interfaces registered
+ * on an object. A call without an interface goes to whichever
+ * interface has a method of that name, as the specification allows.
+ */
+static const DBusObjectPathMethod*
+find_method (DBusObjectSubtree    *subtree,
+             DBusMessage          *message,
+             DBusObjectInterface **interface_p)
+{
+  const char *interface;
+  const char *member;
+  DBusObjectInterface *object_interface;
+  DBusHashIter iter;
+
+  member = dbus_message_get_member (message);
+  interface = dbus_message_get_interface (message);
+
+  if (interface != NULL)
+    {
+      object_interface = _dbus_hash_table_lookup_string (subtree->interfaces,
+                                                         interface);
+      if (object_interface == NULL)
+        return NULL;
+
+      *interface_p = object_interface;
+      return _dbus_hash_table_lookup_string (object_interface->methods,
+                                             member);
+    }
+
+  _dbus_hash_iter_init (subtree->interfaces, &iter);
+  while (_dbus_hash_iter_next (&iter))
+    {
+      const DBusObjectPathMethod *method;
+
+      object_interface = _dbus_hash_iter_get_value (&iter);
+      method = _dbus_hash_table_lookup_string (object_interface->methods,
+                                               member);
+      if (method != NULL)
+        {
+          *interface_p = object_interface;
+          return method;
+        }
+    }
+
+  return NULL;
+}
+
+/**
+ * Replies to a call whose arguments don't match the signature its
+ * method was registered with.
+ */
+static DBusHandlerResult
+reply_invalid_args_and_unlock (DBusObjectTree             *tree,
+                               DBusMessage                *message,
+                               DBusObjectInterface        *object_interface,
+                               const DBusObjectPathMethod *method)
+{
+  DBusMessage *reply;
+  DBusHandlerResult result;
+  dbus_bool_t already_unlocked;
+
+  _dbus_verbose (" arguments \"%s\" don't match \"%s\" for %s.%s\n",
+                 dbus_message_get_signature (message), method->in_signature,
+                 object_interface->name, method->name);
+
+  already_unlocked = FALSE;
+  result = DBUS_HANDLER_RESULT_HANDLED;
+  reply = NULL;
+
+  if (dbus_message_get_no_reply (message))
+    goto out;
+
+  reply = dbus_message_new_error_printf (message, DBUS_ERROR_INVALID_ARGS,
+                                         "Call to %s.%s has arguments \"%s\" but expects \"%s\"",
+                                         object_interface->name, method->name,
+                                         dbus_message_get_signature (message),
+                                         method->in_signature);
+  if (reply == NULL)
+    {
+      result = DBUS_HANDLER_RESULT_NEED_MEMORY;
+      goto out;
+    }
+
+#ifdef DBUS_BUILD_TESTS
+  if (tree->connection)
+#endif
+    {
+      already_unlocked = TRUE;
+
+      if (!_dbus_connection_send_and_unlock (tree->connection, reply, NULL))
+        result = DBUS_HANDLER_RESULT_NEED_MEMORY;
+    }
+
+ out:
+#ifdef DBUS_BUILD_TESTS
+  if (tree->connection)
+#endif
+    {
+      if (!already_unlocked)
+        {
+          _dbus_verbose ("unlock\n");
+          _dbus_connection_unlock (tree->connection);
+        }
+    }
+
+  if (reply)
+    dbus_message_unref (reply);
+
+  return result;
+}
+
 /**
  * Tries to dispatch a message by directing it to handler for the
  * object path listed in the message header, if any. Messages are
@@ -747,7 +1344,7 @@ DBusHandlerResult
 _dbus_object_tree_dispatch_and_unlock (DBusObjectTree          *tree,
                                        DBusMessage             *message)
 {
-  char **path;
+  const char *path;
   dbus_bool_t exact_match;
   DBusList *list;
   DBusList *link;
@@ -758,8 +1355,11 @@ _dbus_object_tree_dispatch_and_unlock (DBusObjectTree          *tree,
   _dbus_verbose ("Dispatch of message by object path\n");
 #endif
   
-  path = NULL;
-  if (!dbus_message_get_path_decomposed (message, &path))
+  /* The path is validated on load, so it can be walked in place
+   * without decomposing it into a newly-allocated array
+   */
+  path = dbus_message_get_path (message);
+  if (path == NULL)
     {
 #ifdef DBUS_BUILD_TESTS
       if (tree->connection)
@@ -769,28 +1369,62 @@ _dbus_object_tree_dispatch_and_unlock (DBusObjectTree          *tree,
           _dbus_connection_unlock (tree->connection);
         }
       
-      _dbus_verbose ("No memory to get decomposed path\n");
-
-      return DBUS_HANDLER_RESULT_NEED_MEMORY;
+      _dbus_verbose ("No path field in message\n");
+      return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
     }
+  
+  /* Find the deepest path that covers the path in the message */
+  subtree = find_handler_cached (tree, path, &exact_match);
 
-  if (path == NULL)
+  /* Methods registered by interface only belong to the object itself,
+   * and get the call before any vtable
+   */
+  if (exact_match && subtree != NULL && subtree->interfaces != NULL &&
+      dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_METHOD_CALL)
     {
+      const DBusObjectPathMethod *method;
+      DBusObjectInterface *object_interface;
+
+      method = find_method (subtree, message, &object_interface);
+      if (method != NULL)
+        {
+          DBusObjectPathMessageFunction function;
+          void *user_data;
+
+          if (method->in_signature != NULL &&
+              !dbus_message_has_signature (message, method->in_signature))
+            return reply_invalid_args_and_unlock (tree, message,
+                                                  object_interface, method);
+
+          function = method->function;
+          user_data = object_interface->user_data;
+
 #ifdef DBUS_BUILD_TESTS
-      if (tree->connection)
+          if (tree->connection)
 #endif
-        {
-          _dbus_verbose ("unlock\n");
-          _dbus_connection_unlock (tree->connection);
+            {
+              _dbus_verbose ("unlock\n");
+              _dbus_connection_unlock (tree->connection);
+            }
+
+          /* FIXME as below, the interface could be unregistered in
+           * another thread before we invoke the callback
+           */
+          result = (* function) (tree->connection, message, user_data);
+
+          if (result != DBUS_HANDLER_RESULT_NOT_YET_HANDLED)
+            return result;
+
+#ifdef DBUS_BUILD_TESTS
+          if (tree->connection)
+#endif
+            _dbus_connection_lock (tree->connection);
+
+          /* The tree may have changed while it was unlocked */
+          subtree = find_handler_cached (tree, path, &exact_match);
         }
-      
-      _dbus_verbose ("No path field in message\n");
-      return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
     }
-  
-  /* Find the deepest path that covers the path in the message */
-  subtree = find_handler (tree, (const char**) path, &exact_match);
-  
+
   /* Build a list of all paths that cover the path in the message */
 
   list = NULL;
@@ -877,8 +1511,7 @@ _dbus_object_tree_dispatch_and_unlock (DBusObjectTree          *tree,
     {
       /* This hardcoded default handler does a minimal Introspect()
        */
-      result = handle_default_introspect_and_unlock (tree, message,
-                                                     (const char**) path);
+      result = handle_default_introspect_and_unlock (tree, message, path);
     }
   else
     {
@@ -897,8 +1530,6 @@ _dbus_object_tree_dispatch_and_unlock (DBusObjectTree          *tree,
       _dbus_object_subtree_unref (link->data);
       _dbus_list_remove_link (&list, link);
     }
-  
-  dbus_free_string_array (path);
 
   return result;
 }
@@ -987,6 +1618,7 @@ _dbus_object_subtree_new (const char                  *name,
     }
 
   subtree->user_data = user_data;
+  subtree->interfaces = NULL;
   subtree->refcount.value = 1;
   subtree->subtrees = NULL;
   subtree->n_subtrees = 0;
@@ -1017,12 +1649,52 @@ _dbus_object_subtree_unref (DBusObjectSubtree *subtree)
     {
       _dbus_assert (subtree->unregister_function == NULL);
       _dbus_assert (subtree->message_function == NULL);
+      _dbus_assert (subtree->interfaces == NULL);
 
       dbus_free (subtree->subtrees);
       dbus_free (subtree);
     }
 }
 
+/**
+ * Calls a function with the name of each child of the node at
+ * parent_path, in sorted order, stopping early if it returns #FALSE.
+ * Nothing is allocated: every node keeps its children sorted (for the
+ * binary search in lookups), and the names are passed straight from
+ * there, so the function is called with the connection locked and
+ * must not use the connection.
+ *
+ * @param tree the object tree
+ * @param parent_path the path, which must be a valid object path
+ * @param function the function to call
+ * @param data data to pass to the function
+ */
+void
+_dbus_object_tree_foreach_child_and_unlock (DBusObjectTree              *tree,
+                                            const char                  *parent_path,
+                                            DBusObjectPathChildFunction  function,
+                                            void                        *data)
+{
+  DBusObjectSubtree *subtree;
+  int i;
+
+  subtree = find_subtree_by_path_string (tree, parent_path, NULL);
+
+  for (i = 0; subtree != NULL && i < subtree->n_subtrees; i++)
+    {
+      if (!(* function) (subtree->subtrees[i]->name, data))
+        break;
+    }
+
+#ifdef DBUS_BUILD_TESTS
+  if (tree->connection)
+#endif
+    {
+      _dbus_verbose ("unlock\n");
+      _dbus_connection_unlock (tree->connection);
+    }
+}
+
 /**
  * Lists the registered fallback handlers and object path handlers at
  * the given parent_path. The returned array should be freed with
@@ -1322,6 +1994,90 @@ test_message_function (DBusConnection  *connection,
   return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 }
 
+typedef struct
+{
+  const char **expected; /**< Children in the order they should be seen */
+  int n_seen;            /**< How many were seen */
+  int stop_after;        /**< How many to see before stopping, or -1 */
+} ChildTestData;
+
+static dbus_bool_t
+test_child_function (const char *child,
+                     void       *user_data)
+{
+  ChildTestData *ctd = user_data;
+
+  _dbus_assert (ctd->expected == NULL ||
+                strcmp (ctd->expected[ctd->n_seen], child) == 0);
+  ctd->n_seen += 1;
+
+  return ctd->n_seen != ctd->stop_after;
+}
+
+typedef struct
+{
+  const char *called;  /**< Member of the last call a method function got */
+  dbus_bool_t freed;   /**< Gets set to true when the user data is freed */
+} InterfaceTestData;
+
+static DBusHandlerResult
+test_method_function (DBusConnection  *connection,
+                      DBusMessage     *message,
+                      void            *user_data)
+{
+  InterfaceTestData *itd = user_data;
+
+  itd->called = dbus_message_get_member (message);
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static void
+test_free_interface_data (void *user_data)
+{
+  InterfaceTestData *itd = user_data;
+
+  itd->freed = TRUE;
+}
+
+static DBusHandlerResult
+do_test_method_call (DBusObjectTree    *tree,
+                     const char        *path,
+                     const char        *interface,
+                     const char        *member,
+                     dbus_bool_t        with_args,
+                     InterfaceTestData *itd)
+{
+  DBusMessage *message;
+  DBusHandlerResult result;
+  const char *v_STRING = "x";
+  dbus_uint32_t v_UINT32 = 1;
+
+  itd->called = NULL;
+
+  message = dbus_message_new_method_call (NULL, path, interface, member);
+  if (message == NULL)
+    return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+  /* As if it had been received, so that it can be replied to */
+  dbus_message_set_serial (message, 1);
+
+  if (with_args &&
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &v_STRING,
+                                 DBUS_TYPE_UINT32, &v_UINT32,
+                                 DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref (message);
+      return DBUS_HANDLER_RESULT_NEED_MEMORY;
+    }
+
+  result = _dbus_object_tree_dispatch_and_unlock (tree, message);
+  dbus_message_unref (message);
+
+  return result;
+}
+
 static dbus_bool_t
 do_register (DBusObjectTree *tree,
              const char    **path,
@@ -1494,6 +2250,30 @@ run_decompose_tests (void)
   return TRUE;
 }
 
+static void
+check_path_string_lookup (DBusObjectTree *tree,
+                          const char    **path)
+{
+  DBusObjectSubtree *subtree;
+  dbus_bool_t exact_match;
+  dbus_bool_t string_exact_match;
+  char *flat;
+
+  flat = flatten_path (path);
+  if (flat == NULL)
+    return;
+
+  subtree = find_handler (tree, path, &exact_match);
+  _dbus_assert (find_subtree_by_path_string (tree, flat,
+                                             &string_exact_match) == subtree);
+  _dbus_assert (string_exact_match == exact_match);
+
+  _dbus_assert (find_subtree_by_path_string (tree, flat, NULL) ==
+                lookup_subtree (tree, path));
+
+  dbus_free (flat);
+}
+
 static dbus_bool_t
 object_tree_test_iteration (void *data)
 {
@@ -1919,6 +2699,200 @@ object_tree_test_iteration (void *data)
     goto out;
   if (!do_test_dispatch (tree, path8, 8, tree_test_data, _DBUS_N_ELEMENTS (tree_test_data)))
     goto out;
+
+  /* The allocation-free string lookup agrees with the decomposed one,
+   * including for elements that are prefixes or extensions of
+   * registered ones
+   */
+  {
+    const char *prefix[] = { "foo", "ba", NULL };
+    const char *extension[] = { "foo", "barn", NULL };
+    const char *below[] = { "foo", "bar", "boo", "x", NULL };
+    const char *below_exact[] = { "foo", "x", NULL };
+
+    check_path_string_lookup (tree, path0);
+    check_path_string_lookup (tree, path1);
+    check_path_string_lookup (tree, path2);
+    check_path_string_lookup (tree, path3);
+    check_path_string_lookup (tree, path4);
+    check_path_string_lookup (tree, path5);
+    check_path_string_lookup (tree, path6);
+    check_path_string_lookup (tree, path7);
+    check_path_string_lookup (tree, path8);
+    check_path_string_lookup (tree, prefix);
+    check_path_string_lookup (tree, extension);
+    check_path_string_lookup (tree, below);
+    check_path_string_lookup (tree, below_exact);
+  }
+
+  /* The dispatch cache must not outlive a change to the tree */
+  {
+    DBusObjectSubtree *handler;
+
+    handler = find_handler (tree, path3, &exact_match);
+    _dbus_assert (find_handler_cached (tree, "/foo/bar/baz", &exact_match) == handler);
+    _dbus_assert (exact_match);
+    _dbus_assert (find_handler_cached (tree, "/foo/bar/baz", &exact_match) == handler);
+    _dbus_assert (exact_match);
+
+    _dbus_object_tree_unregister_and_unlock (tree, path3);
+
+    handler = find_handler (tree, path2, &exact_match);
+    _dbus_assert (find_handler_cached (tree, "/foo/bar/baz", &exact_match) == handler);
+    _dbus_assert (!exact_match);
+
+    if (!do_register (tree, path3, TRUE, 3, tree_test_data))
+      goto out;
+
+    handler = find_handler (tree, path3, &exact_match);
+    _dbus_assert (find_handler_cached (tree, "/foo/bar/baz", &exact_match) == handler);
+    _dbus_assert (exact_match);
+  }
+
+  /* Walking the children in place agrees with copying them out */
+  {
+    char **children;
+    ChildTestData ctd;
+
+    if (!_dbus_object_tree_list_registered_unlocked (tree, path1, &children))
+      goto out;
+
+    ctd.expected = (const char **) children;
+    ctd.n_seen = 0;
+    ctd.stop_after = -1;
+    _dbus_object_tree_foreach_child_and_unlock (tree, "/foo", test_child_function,
+                                                &ctd);
+    _dbus_assert (children[ctd.n_seen] == NULL);
+
+    ctd.n_seen = 0;
+    ctd.stop_after = 1;
+    _dbus_object_tree_foreach_child_and_unlock (tree, "/foo", test_child_function,
+                                                &ctd);
+    _dbus_assert (ctd.n_seen == 1);
+
+    ctd.n_seen = 0;
+    _dbus_object_tree_foreach_child_and_unlock (tree, "/nowhere", test_child_function,
+                                                &ctd);
+    _dbus_assert (ctd.n_seen == 0);
+
+    dbus_free_string_array (children);
+  }
+
+  /* Methods registered by interface get calls to the exact path
+   * before its vtable, and only if the arguments match
+   */
+  {
+    static const DBusObjectPathMethod methods[] = {
+      { "Foo", NULL, test_method_function },
+      { "Bar", "su", test_method_function },
+      { NULL, NULL, NULL }
+    };
+    const char *only[] = { "interface", "only", NULL };
+    InterfaceTestData itd = { NULL, FALSE };
+    DBusError error;
+    DBusHandlerResult result;
+
+    if (!_dbus_object_tree_register_interface (tree, path2,
+                                               "org.freedesktop.TestInterface",
+                                               methods, &itd,
+                                               test_free_interface_data,
+                                               NULL))
+      goto out;
+
+    tree_test_data[2].message_handled = FALSE;
+    result = do_test_method_call (tree, "/foo/bar",
+                                  "org.freedesktop.TestInterface", "Foo",
+                                  FALSE, &itd);
+    if (result == DBUS_HANDLER_RESULT_NEED_MEMORY)
+      goto out;
+    _dbus_assert (result == DBUS_HANDLER_RESULT_HANDLED);
+    _dbus_assert (itd.called != NULL && strcmp (itd.called, "Foo") == 0);
+    _dbus_assert (!tree_test_data[2].message_handled);
+
+    /* The interface is optional in calls */
+    result = do_test_method_call (tree, "/foo/bar", NULL, "Foo", FALSE, &itd);
+    if (result == DBUS_HANDLER_RESULT_NEED_MEMORY)
+      goto out;
+    _dbus_assert (itd.called != NULL && strcmp (itd.called, "Foo") == 0);
+
+    /* Wrong arguments are answered without calling the method */
+    result = do_test_method_call (tree, "/foo/bar",
+                                  "org.freedesktop.TestInterface", "Bar",
+                                  FALSE, &itd);
+    if (result == DBUS_HANDLER_RESULT_NEED_MEMORY)
+      goto out;
+    _dbus_assert (result == DBUS_HANDLER_RESULT_HANDLED);
+    _dbus_assert (itd.called == NULL);
+
+    result = do_test_method_call (tree, "/foo/bar",
+                                  "org.freedesktop.TestInterface", "Bar",
+                                  TRUE, &itd);
+    if (result == DBUS_HANDLER_RESULT_NEED_MEMORY)
+      goto out;
+    _dbus_assert (itd.called != NULL && strcmp (itd.called, "Bar") == 0);
+
+    /* Unknown members go on to the vtable */
+    result = do_test_method_call (tree, "/foo/bar",
+                                  "org.freedesktop.TestInterface", "Baz",
+                                  FALSE, &itd);
+    if (result == DBUS_HANDLER_RESULT_NEED_MEMORY)
+      goto out;
+    _dbus_assert (itd.called == NULL);
+    _dbus_assert (tree_test_data[2].message_handled);
+
+    /* Interfaces are never a fallback for the paths below */
+    result = do_test_method_call (tree, "/foo/bar/boo",
+                                  "org.freedesktop.TestInterface", "Foo",
+                                  FALSE, &itd);
+    if (result == DBUS_HANDLER_RESULT_NEED_MEMORY)
+      goto out;
+    _dbus_assert (itd.called == NULL);
+
+    dbus_error_init (&error);
+    _dbus_assert (!_dbus_object_tree_register_interface (tree, path2,
+                                                         "org.freedesktop.TestInterface",
+                                                         methods, &itd, NULL,
+                                                         &error));
+    _dbus_assert (dbus_error_is_set (&error));
+    dbus_error_free (&error);
+
+    _dbus_object_tree_unregister_interface_and_unlock (tree, path2,
+                                                       "org.freedesktop.TestInterface");
+    _dbus_assert (itd.freed);
+    _dbus_assert (_dbus_object_tree_get_user_data_unlocked (tree, path2) ==
+                  &tree_test_data[2]);
+
+    tree_test_data[2].message_handled = FALSE;
+    result = do_test_method_call (tree, "/foo/bar",
+                                  "org.freedesktop.TestInterface", "Foo",
+                                  FALSE, &itd);
+    if (result == DBUS_HANDLER_RESULT_NEED_MEMORY)
+      goto out;
+    _dbus_assert (itd.called == NULL);
+    _dbus_assert (tree_test_data[2].message_handled);
+
+    /* A path with nothing but an interface goes away with it */
+    itd.freed = FALSE;
+    if (!_dbus_object_tree_register_interface (tree, only,
+                                               "org.freedesktop.TestInterface",
+                                               methods, &itd,
+                                               test_free_interface_data,
+                                               NULL))
+      goto out;
+    _dbus_assert (lookup_subtree (tree, only) != NULL);
+
+    result = do_test_method_call (tree, "/interface/only",
+                                  "org.freedesktop.TestInterface", "Foo",
+                                  FALSE, &itd);
+    if (result == DBUS_HANDLER_RESULT_NEED_MEMORY)
+      goto out;
+    _dbus_assert (itd.called != NULL && strcmp (itd.called, "Foo") == 0);
+
+    _dbus_object_tree_unregister_interface_and_unlock (tree, only,
+                                                       "org.freedesktop.TestInterface");
+    _dbus_assert (itd.freed);
+    _dbus_assert (lookup_subtree (tree, only) == NULL);
+  }
   
  out:
   if (tree)
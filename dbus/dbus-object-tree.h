@@ -41,6 +41,16 @@ dbus_bool_t       _dbus_object_tree_register               (DBusObjectTree
                                                             DBusError                   *error);
 void              _dbus_object_tree_unregister_and_unlock  (DBusObjectTree              *tree,
                                                             const char                 **path);
+dbus_bool_t       _dbus_object_tree_register_interface     (DBusObjectTree              *tree,
+                                                            const char                 **path,
+                                                            const char                  *interface,
+                                                            const DBusObjectPathMethod  *methods,
+                                                            void                        *user_data,
+                                                            DBusFreeFunction             free_user_data,
+                                                            DBusError                   *error);
+void              _dbus_object_tree_unregister_interface_and_unlock (DBusObjectTree     *tree,
+                                                                     const char        **path,
+                                                                     const char         *interface);
 DBusHandlerResult _dbus_object_tree_dispatch_and_unlock    (DBusObjectTree              *tree,
                                                             DBusMessage                 *message);
 void*             _dbus_object_tree_get_user_data_unlocked (DBusObjectTree              *tree,
@@ -51,6 +61,10 @@ void              _dbus_object_tree_free_all_unlocked      (DBusObjectTree
 dbus_bool_t _dbus_object_tree_list_registered_and_unlock (DBusObjectTree *tree,
                                                           const char    **parent_path,
                                                           char         ***child_entries);
+void        _dbus_object_tree_foreach_child_and_unlock   (DBusObjectTree              *tree,
+                                                          const char                  *parent_path,
+                                                          DBusObjectPathChildFunction  function,
+                                                          void                        *data);
 
 dbus_bool_t _dbus_decompose_path (const char   *data,
                                   int           len,
@@ -38,6 +38,20 @@ DBusTimeout    * _dbus_pending_call_get_timeout_unlocked         (DBusPendingCal
 dbus_uint32_t    _dbus_pending_call_get_reply_serial_unlocked    (DBusPendingCall    *pending);
 void             _dbus_pending_call_set_reply_serial_unlocked    (DBusPendingCall    *pending,
                                                                   dbus_uint32_t       serial);
+dbus_bool_t      _dbus_pending_call_set_notify_unlocked          (DBusPendingCall    *pending,
+                                                                  DBusPendingCallNotifyFunction function,
+                                                                  void               *user_data);
+DBusList *       _dbus_pending_call_get_deadline_link_unlocked   (DBusPendingCall    *pending);
+void             _dbus_pending_call_set_deadline_unlocked        (DBusPendingCall    *pending,
+                                                                  DBusList           *link,
+                                                                  long                tv_sec,
+                                                                  long                tv_usec);
+void             _dbus_pending_call_get_deadline_unlocked        (DBusPendingCall    *pending,
+                                                                  long               *tv_sec,
+                                                                  long               *tv_usec);
+DBusList *       _dbus_pending_call_get_reply_link_unlocked      (DBusPendingCall    *pending);
+void             _dbus_pending_call_set_reply_link_unlocked      (DBusPendingCall    *pending,
+                                                                  DBusList           *link);
 DBusConnection * _dbus_pending_call_get_connection_and_lock      (DBusPendingCall    *pending);
 DBusConnection * _dbus_pending_call_get_connection_unlocked      (DBusPendingCall    *pending);
 dbus_bool_t      _dbus_pending_call_get_completed_unlocked       (DBusPendingCall    *pending);
@@ -30,6 +30,10 @@
 #include "dbus-threads.h"
 #include "dbus-test.h"
 
+/* Allocations made here are profiled as connections */
+#undef DBUS_ALLOC_SUBSYSTEM
+#define DBUS_ALLOC_SUBSYSTEM DBUS_ALLOC_SUBSYSTEM_CONNECTION
+
 /**
  * @defgroup DBusPendingCallInternals DBusPendingCall implementation details
  * @ingroup DBusInternals
@@ -71,6 +75,10 @@ struct DBusPendingCall
   DBusTimeout *timeout;                           /**< Timeout */
 
   DBusList *timeout_link;                         /**< Preallocated timeout response */
+  DBusList *reply_link;                           /**< Link of the reply in the connection's incoming queue, if queued */
+  DBusList *deadline_link;                        /**< Link in the connection's deadline list, if the timeout is added */
+  long deadline_tv_sec;                           /**< Seconds part of the time the timeout expires */
+  long deadline_tv_usec;                          /**< Microseconds part of the time the timeout expires */
   
   dbus_uint32_t reply_serial;                     /**< Expected serial of reply */
 
@@ -188,6 +196,8 @@ _dbus_pending_call_complete (DBusPendingCall *pending)
   
   pending->completed = TRUE;
 
+  _dbus_trace2 (pending__complete, pending, pending->reply_serial);
+
   if (pending->function)
     {
       void *user_data;
@@ -294,6 +304,120 @@ _dbus_pending_call_set_reply_serial_unlocked  (DBusPendingCall *pending,
   pending->reply_serial = serial;
 }
 
+/**
+ * Sets the notify function of a pending call that has no notify
+ * function or data yet, without taking the connection lock.
+ *
+ * @param pending the pending call
+ * @param function notifier function
+ * @param user_data data to pass to notifier function
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+_dbus_pending_call_set_notify_unlocked (DBusPendingCall              *pending,
+                                        DBusPendingCallNotifyFunction function,
+                                        void                         *user_data)
+{
+  _dbus_assert (pending != NULL);
+  _dbus_assert (pending->function == NULL);
+
+  if (!_dbus_pending_call_set_data_unlocked (pending, notify_user_data_slot,
+                                             user_data, NULL))
+    return FALSE;
+
+  pending->function = function;
+
+  return TRUE;
+}
+
+/**
+ * Gets the link of this call in the connection's list of deadlines,
+ * which is non-#NULL while its timeout is added.
+ *
+ * @param pending the pending_call
+ * @returns the deadline link, or #NULL
+ */
+DBusList *
+_dbus_pending_call_get_deadline_link_unlocked (DBusPendingCall *pending)
+{
+  _dbus_assert (pending != NULL);
+
+  return pending->deadline_link;
+}
+
+/**
+ * Sets the link of this call in the connection's list of deadlines,
+ * and the time its timeout expires.
+ *
+ * @param pending the pending_call
+ * @param link the deadline link, or #NULL
+ * @param tv_sec seconds part of the expiry time
+ * @param tv_usec microseconds part of the expiry time
+ */
+void
+_dbus_pending_call_set_deadline_unlocked (DBusPendingCall *pending,
+                                          DBusList        *link,
+                                          long             tv_sec,
+                                          long             tv_usec)
+{
+  _dbus_assert (pending != NULL);
+
+  pending->deadline_link = link;
+  pending->deadline_tv_sec = tv_sec;
+  pending->deadline_tv_usec = tv_usec;
+}
+
+/**
+ * Gets the time the timeout of this call expires, as set with
+ * _dbus_pending_call_set_deadline_unlocked().
+ *
+ * @param pending the pending_call
+ * @param tv_sec return location for the seconds part
+ * @param tv_usec return location for the microseconds part
+ */
+void
+_dbus_pending_call_get_deadline_unlocked (DBusPendingCall *pending,
+                                          long            *tv_sec,
+                                          long            *tv_usec)
+{
+  _dbus_assert (pending != NULL);
+
+  *tv_sec = pending->deadline_tv_sec;
+  *tv_usec = pending->deadline_tv_usec;
+}
+
+/**
+ * Gets the link holding this call's reply in the connection's
+ * incoming message queue, if the reply has been queued.
+ *
+ * @param pending the pending_call
+ * @returns the queued reply's link, or #NULL
+ */
+DBusList *
+_dbus_pending_call_get_reply_link_unlocked (DBusPendingCall *pending)
+{
+  _dbus_assert (pending != NULL);
+
+  return pending->reply_link;
+}
+
+/**
+ * Records the link holding this call's reply in the connection's
+ * incoming message queue. The connection clears it again when the
+ * link leaves the queue or the call is detached.
+ *
+ * @param pending the pending_call
+ * @param link the queued reply's link, or #NULL
+ */
+void
+_dbus_pending_call_set_reply_link_unlocked (DBusPendingCall *pending,
+                                            DBusList        *link)
+{
+  _dbus_assert (pending != NULL);
+
+  pending->reply_link = link;
+}
+
 /**
  * Gets the connection associated with this pending call.
  *
@@ -295,6 +295,11 @@ extern "C" {
  * with this message.
  */
 #define DBUS_HEADER_FIELD_UNIX_FDS       9
+/**
+ * Header field code for how many milliseconds a message may wait in
+ * queues before it is dropped undelivered. See dbus_message_set_expiry().
+ */
+#define DBUS_HEADER_FIELD_EXPIRY         10
 
 
 /**
@@ -303,7 +308,7 @@ extern "C" {
  * that unknown codes must be ignored, so check for that before
  * indexing the array.
  */
-#define DBUS_HEADER_FIELD_LAST DBUS_HEADER_FIELD_UNIX_FDS
+#define DBUS_HEADER_FIELD_LAST DBUS_HEADER_FIELD_EXPIRY
 
 /** Header format is defined as a signature:
  *   byte                            byte order
@@ -50,13 +50,19 @@
  * 
  * DBusCounter internals. DBusCounter is an opaque object, it must be
  * used via accessor functions.
+ *
+ * The refcount and values are atomic, since a message can be
+ * finalized, and so taken off its counters, by whichever thread drops
+ * the last reference to it, without holding the lock of the
+ * connection that owns the counter. Like any #DBusAtomic they only
+ * hold 32 bits.
  */
 struct DBusCounter
 {
-  int refcount;  /**< reference count */
+  DBusAtomic refcount;  /**< reference count */
 
-  long size_value;       /**< current size counter value */
-  long unix_fd_value;    /**< current unix fd counter value */
+  DBusAtomic size_value;       /**< current size counter value */
+  DBusAtomic unix_fd_value;    /**< current unix fd counter value */
 
   long notify_size_guard_value;    /**< call notify function when crossing this size value */
   long notify_unix_fd_guard_value; /**< call notify function when crossing this unix fd value */
@@ -87,9 +93,9 @@ _dbus_counter_new (void)
   if (counter == NULL)
     return NULL;
   
-  counter->refcount = 1;
-  counter->size_value = 0;
-  counter->unix_fd_value = 0;
+  counter->refcount.value = 1;
+  counter->size_value.value = 0;
+  counter->unix_fd_value.value = 0;
 
   counter->notify_size_guard_value = 0;
   counter->notify_unix_fd_guard_value = 0;
@@ -108,9 +114,10 @@ _dbus_counter_new (void)
 DBusCounter *
 _dbus_counter_ref (DBusCounter *counter)
 {
-  _dbus_assert (counter->refcount > 0);
-  
-  counter->refcount += 1;
+  dbus_int32_t old_refcount;
+
+  old_refcount = _dbus_atomic_inc (&counter->refcount);
+  _dbus_assert (old_refcount > 0);
 
   return counter;
 }
@@ -124,15 +131,13 @@ _dbus_counter_ref (DBusCounter *counter)
 void
 _dbus_counter_unref (DBusCounter *counter)
 {
-  _dbus_assert (counter->refcount > 0);
+  dbus_int32_t old_refcount;
 
-  counter->refcount -= 1;
+  old_refcount = _dbus_atomic_dec (&counter->refcount);
+  _dbus_assert (old_refcount > 0);
 
-  if (counter->refcount == 0)
-    {
-      
-      dbus_free (counter);
-    }
+  if (old_refcount == 1)
+    dbus_free (counter);
 }
 
 /**
@@ -148,20 +153,22 @@ void
 _dbus_counter_adjust_size (DBusCounter *counter,
                            long         delta)
 {
-  long old = counter->size_value;
+  long old;
+  long new;
 
-  counter->size_value += delta;
+  old = _dbus_atomic_add (&counter->size_value, delta);
+  new = old + delta;
 
 #if 0
   _dbus_verbose ("Adjusting counter %ld by %ld = %ld\n",
-                 old, delta, counter->size_value);
+                 old, delta, new);
 #endif
 
   if (counter->notify_function != NULL &&
       ((old < counter->notify_size_guard_value &&
-        counter->size_value >= counter->notify_size_guard_value) ||
+        new >= counter->notify_size_guard_value) ||
        (old >= counter->notify_size_guard_value &&
-        counter->size_value < counter->notify_size_guard_value)))
+        new < counter->notify_size_guard_value)))
     (* counter->notify_function) (counter, counter->notify_data);
 }
 
@@ -178,20 +185,22 @@ void
 _dbus_counter_adjust_unix_fd (DBusCounter *counter,
                               long         delta)
 {
-  long old = counter->unix_fd_value;
-  
-  counter->unix_fd_value += delta;
+  long old;
+  long new;
+
+  old = _dbus_atomic_add (&counter->unix_fd_value, delta);
+  new = old + delta;
 
 #if 0
   _dbus_verbose ("Adjusting counter %ld by %ld = %ld\n",
-                 old, delta, counter->unix_fd_value);
+                 old, delta, new);
 #endif
   
   if (counter->notify_function != NULL &&
       ((old < counter->notify_unix_fd_guard_value &&
-        counter->unix_fd_value >= counter->notify_unix_fd_guard_value) ||
+        new >= counter->notify_unix_fd_guard_value) ||
        (old >= counter->notify_unix_fd_guard_value &&
-        counter->unix_fd_value < counter->notify_unix_fd_guard_value)))
+        new < counter->notify_unix_fd_guard_value)))
     (* counter->notify_function) (counter, counter->notify_data);
 }
 
@@ -204,7 +213,7 @@ _dbus_counter_adjust_unix_fd (DBusCounter *counter,
 long
 _dbus_counter_get_size_value (DBusCounter *counter)
 {
-  return counter->size_value;
+  return counter->size_value.value;
 }
 
 /**
@@ -216,7 +225,7 @@ _dbus_counter_get_size_value (DBusCounter *counter)
 long
 _dbus_counter_get_unix_fd_value (DBusCounter *counter)
 {
-  return counter->unix_fd_value;
+  return counter->unix_fd_value.value;
 }
 
 /**
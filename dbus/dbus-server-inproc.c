@@ -0,0 +1,413 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-server-inproc.c Server for connections within one process
+ *
+ * Copyright (C) 2003  CodeFactory AB
+ * Copyright (C) 2003, 2004  Red Hat, Inc.
+ *
+ * Licensed under the Academic Free License version 2.1
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "dbus-internals.h"
+#include "dbus-server-inproc.h"
+#include "dbus-transport-socket.h"
+#include "dbus-connection-internal.h"
+#include "dbus-hash.h"
+#include "dbus-string.h"
+#include "dbus-protocol.h"
+
+/**
+ * @defgroup DBusServerInproc DBusServerInproc
+ * @ingroup  DBusInternals
+ * @brief Server for connections within one process
+ *
+ * An inproc: server is only reachable from the process that created
+ * it, by name. Its connections hand messages over as they are, see
+ * _dbus_transport_new_inproc_pair(), so components sharing a process
+ * talk D-Bus to each other without marshalling or validation.
+ *
+ * @{
+ */
+
+/**
+ * Opaque object representing an inproc server implementation.
+ */
+typedef struct DBusServerInproc DBusServerInproc;
+
+/**
+ * Implementation details of DBusServerInproc. All members
+ * are private.
+ */
+struct DBusServerInproc
+{
+  DBusServer base;  /**< Parent class members. */
+
+  char *name; /**< Server name. */
+};
+
+/* Listening servers by name; each holds a reference to its server
+ * until it's disconnected. Taken after a server's own lock.
+ */
+_DBUS_DEFINE_GLOBAL_LOCK (inproc_servers);
+static DBusHashTable *inproc_servers = NULL;
+
+static void
+inproc_finalize (DBusServer *server)
+{
+  DBusServerInproc *inproc_server = (DBusServerInproc*) server;
+
+  _dbus_server_finalize_base (server);
+
+  dbus_free (inproc_server->name);
+  dbus_free (server);
+}
+
+static void
+inproc_disconnect (DBusServer *server)
+{
+  DBusServerInproc *inproc_server = (DBusServerInproc*) server;
+
+  _DBUS_LOCK (inproc_servers);
+
+  _dbus_hash_table_remove_string (inproc_servers, inproc_server->name);
+  if (_dbus_hash_table_get_n_entries (inproc_servers) == 0)
+    {
+      _dbus_hash_table_unref (inproc_servers);
+      inproc_servers = NULL;
+    }
+
+  _DBUS_UNLOCK (inproc_servers);
+
+  /* dbus_server_disconnect() holds a reference of its own */
+  _dbus_server_unref_unlocked (server);
+}
+
+static DBusServerVTable inproc_vtable = {
+  inproc_finalize,
+  inproc_disconnect
+};
+
+/**
+ * Creates a new server for connections from within this process.
+ *
+ * @param server_name the name of the server.
+ * @param error address where an error can be returned.
+ * @returns a new server, or #NULL on failure.
+ */
+DBusServer*
+_dbus_server_inproc_new (const char     *server_name,
+                         DBusError      *error)
+{
+  DBusServerInproc *inproc_server;
+  DBusString address;
+  DBusString name_str;
+  
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+  
+  inproc_server = dbus_new0 (DBusServerInproc, 1);
+  if (inproc_server == NULL)
+    goto nomem_0;
+
+  if (!_dbus_string_init (&address))
+    goto nomem_1;
+
+  _dbus_string_init_const (&name_str, server_name);
+  if (!_dbus_string_append (&address, "inproc:name=") ||
+      !_dbus_address_append_escaped (&address, &name_str))
+    goto nomem_2;
+  
+  inproc_server->name = _dbus_strdup (server_name);
+  if (inproc_server->name == NULL)
+    goto nomem_2;
+  
+  if (!_dbus_server_init_base (&inproc_server->base,
+                               &inproc_vtable, &address))
+    goto nomem_3;
+
+  _dbus_string_free (&address);
+
+  _DBUS_LOCK (inproc_servers);
+
+  if (inproc_servers == NULL)
+    {
+      inproc_servers = _dbus_hash_table_new (DBUS_HASH_STRING, NULL, NULL);
+      if (inproc_servers == NULL)
+        goto nomem_4;
+    }
+
+  if (_dbus_hash_table_lookup_string (inproc_servers, server_name) != NULL)
+    {
+      _DBUS_UNLOCK (inproc_servers);
+      dbus_set_error (error, DBUS_ERROR_ADDRESS_IN_USE,
+                      "An inproc server named \"%s\" already exists",
+                      server_name);
+      goto failed;
+    }
+
+  if (!_dbus_hash_table_insert_string (inproc_servers,
+                                       inproc_server->name,
+                                       inproc_server))
+    goto nomem_4;
+
+  /* the table's reference */
+  dbus_server_ref (&inproc_server->base);
+
+  _DBUS_UNLOCK (inproc_servers);
+
+  return (DBusServer *)inproc_server;
+
+ nomem_4:
+  if (inproc_servers != NULL &&
+      _dbus_hash_table_get_n_entries (inproc_servers) == 0)
+    {
+      _dbus_hash_table_unref (inproc_servers);
+      inproc_servers = NULL;
+    }
+  _DBUS_UNLOCK (inproc_servers);
+  _DBUS_SET_OOM (error);
+ failed:
+  inproc_server->base.disconnected = TRUE;
+  _dbus_server_finalize_base (&inproc_server->base);
+  dbus_free (inproc_server->name);
+  dbus_free (inproc_server);
+  return NULL;
+
+ nomem_3:
+  dbus_free (inproc_server->name);
+ nomem_2:
+  _dbus_string_free (&address);
+ nomem_1:
+  dbus_free (inproc_server);
+ nomem_0:
+  _DBUS_SET_OOM (error);
+  return NULL;
+}
+
+/**
+ * Creates the client-side transport for a connection to the inproc
+ * server of the given name. The server's new connection function is
+ * called for the other end before this returns, in this thread.
+ * 
+ * @param server_name name of server to connect to
+ * @param error address where an error can be returned.
+ * @returns #NULL on no memory or transport
+ */
+DBusTransport*
+_dbus_transport_inproc_new (const char     *server_name,
+                            DBusError      *error)
+{
+  DBusTransport *client_transport;
+  DBusTransport *server_transport;
+  DBusConnection *connection;
+  DBusServer *server;
+  DBusString address;
+  DBusString name_str;
+  DBusNewConnectionFunction new_connection_function;
+  void *new_connection_data;
+  
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  server = NULL;
+
+  _DBUS_LOCK (inproc_servers);
+  if (inproc_servers != NULL)
+    server = _dbus_hash_table_lookup_string (inproc_servers, server_name);
+  if (server != NULL)
+    dbus_server_ref (server);
+  _DBUS_UNLOCK (inproc_servers);
+
+  if (server == NULL)
+    {
+      dbus_set_error (error, DBUS_ERROR_NO_SERVER,
+                      "No inproc server named \"%s\" in this process",
+                      server_name);
+      return NULL;
+    }
+
+  if (!_dbus_string_init (&address))
+    {
+      dbus_server_unref (server);
+      _DBUS_SET_OOM (error);
+      return NULL;
+    }
+
+  _dbus_string_init_const (&name_str, server_name);
+  if (!_dbus_string_append (&address, "inproc:name=") ||
+      !_dbus_address_append_escaped (&address, &name_str))
+    {
+      _dbus_string_free (&address);
+      dbus_server_unref (server);
+      _DBUS_SET_OOM (error);
+      return NULL;
+    }
+
+  if (!_dbus_transport_new_inproc_pair (&server->guid_hex, &address,
+                                        &client_transport, &server_transport,
+                                        error))
+    {
+      _dbus_string_free (&address);
+      dbus_server_unref (server);
+      return NULL;
+    }
+
+  _dbus_string_free (&address);
+
+  if (!_dbus_transport_set_auth_mechanisms (server_transport,
+                                            (const char**) server->auth_mechanisms))
+    {
+      _dbus_transport_unref (server_transport);
+      _dbus_transport_unref (client_transport);
+      dbus_server_unref (server);
+      _DBUS_SET_OOM (error);
+      return NULL;
+    }
+  
+  connection = _dbus_connection_new_for_transport (server_transport);
+  _dbus_transport_unref (server_transport);
+  server_transport = NULL;
+  
+  if (connection == NULL)
+    {
+      _dbus_transport_unref (client_transport);
+      dbus_server_unref (server);
+      _DBUS_SET_OOM (error);
+      return NULL;
+    }
+
+  SERVER_LOCK (server);
+  new_connection_function = server->new_connection_function;
+  new_connection_data = server->new_connection_data;
+  SERVER_UNLOCK (server);
+
+  if (new_connection_function)
+    (* new_connection_function) (server, connection, new_connection_data);
+
+  dbus_server_unref (server);
+  
+  /* If no one grabbed a reference, the connection will die,
+   * and the client transport will get an immediate disconnect
+   */
+  _dbus_connection_close_if_only_one_ref (connection);
+  dbus_connection_unref (connection);
+
+  return client_transport;
+}
+
+/**
+ * Tries to interpret the address entry as an inproc entry.
+ * 
+ * Sets error if the result is not OK.
+ * 
+ * @param entry an address entry
+ * @param server_p location to store a new DBusServer, or #NULL on failure.
+ * @param error location to store rationale for failure on bad address
+ * @returns the outcome
+ * 
+ */
+DBusServerListenResult
+_dbus_server_listen_inproc (DBusAddressEntry *entry,
+                            DBusServer      **server_p,
+                            DBusError        *error)
+{
+  const char *method;
+
+  *server_p = NULL;
+  
+  method = dbus_address_entry_get_method (entry);
+  
+  if (strcmp (method, "inproc") == 0)
+    {
+      const char *name = dbus_address_entry_get_value (entry, "name");
+      
+      if (name == NULL)
+        {
+          _dbus_set_bad_address(error, "inproc", "name",
+                                NULL);
+          return DBUS_SERVER_LISTEN_BAD_ADDRESS;
+        }
+
+      *server_p = _dbus_server_inproc_new (name, error);
+      
+      if (*server_p)
+        {
+          _DBUS_ASSERT_ERROR_IS_CLEAR(error);
+          return DBUS_SERVER_LISTEN_OK;
+        }
+      else
+        {
+          _DBUS_ASSERT_ERROR_IS_SET(error);
+          return DBUS_SERVER_LISTEN_DID_NOT_CONNECT;
+        }
+    }
+  else
+    {
+      _DBUS_ASSERT_ERROR_IS_CLEAR(error);
+      return DBUS_SERVER_LISTEN_NOT_HANDLED;
+    }
+}
+
+/**
+ * Opens an inproc transport.
+ * 
+ * @param entry the address entry to try opening as inproc
+ * @param transport_p return location for the opened transport
+ * @param error error to be set
+ * @returns result of the attempt
+ */
+DBusTransportOpenResult
+_dbus_transport_open_inproc (DBusAddressEntry  *entry,
+                             DBusTransport    **transport_p,
+                             DBusError         *error)
+{
+  const char *method;
+  
+  method = dbus_address_entry_get_method (entry);
+  _dbus_assert (method != NULL);
+
+  if (strcmp (method, "inproc") == 0)
+    {
+      const char *name = dbus_address_entry_get_value (entry, "name");
+
+      if (name == NULL)
+        {
+          _dbus_set_bad_address (error, "inproc", "name",
+                                 NULL);
+          return DBUS_TRANSPORT_OPEN_BAD_ADDRESS;
+        }
+          
+      *transport_p = _dbus_transport_inproc_new (name, error);
+
+      if (*transport_p == NULL)
+        {
+          _DBUS_ASSERT_ERROR_IS_SET (error);
+          return DBUS_TRANSPORT_OPEN_DID_NOT_CONNECT;
+        }
+      else
+        {
+          _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+          return DBUS_TRANSPORT_OPEN_OK;
+        }      
+    }
+  else
+    {
+      _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+      return DBUS_TRANSPORT_OPEN_NOT_HANDLED;
+    }
+}
+
+/** @} */
@@ -93,6 +93,8 @@ dbus_bool_t _dbus_server_init_base      (DBusServer             *server,
                                          const DBusServerVTable *vtable,
                                          const DBusString       *address);
 void        _dbus_server_finalize_base  (DBusServer             *server);
+dbus_bool_t _dbus_server_set_guid       (DBusServer             *server,
+                                         const DBusGUID         *guid);
 dbus_bool_t _dbus_server_add_watch      (DBusServer             *server,
                                          DBusWatch              *watch);
 void        _dbus_server_remove_watch   (DBusServer             *server,
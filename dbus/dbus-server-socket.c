@@ -55,8 +55,21 @@ struct DBusServerSocket
   DBusWatch **watch; /**< File descriptor watch. */
   char *socket_name; /**< Name of domain socket, to unlink if appropriate */
   DBusNonceFile *noncefile; /**< Nonce file used to authenticate clients */
+  DBusTcpOptions tcp_options; /**< Socket options for accepted clients */
 };
 
+/**
+ * How many clients to accept each time a listening socket becomes
+ * readable, before letting the main loop run again.
+ */
+#define MAX_ACCEPTS_PER_WATCH 32
+
+/**
+ * Upper bound on the listeners= key of a tcp address, the number of
+ * listening sockets sharing each address and port.
+ */
+#define MAX_TCP_LISTENERS 64
+
 static void
 socket_finalize (DBusServer *server)
 {
@@ -81,7 +94,8 @@ socket_finalize (DBusServer *server)
   dbus_free (server);
 }
 
-/* Return value is just for memory, not other failures. */
+/* Return value is just for memory, not other failures. client_fd
+ * must already be nonblocking. */
 static dbus_bool_t
 handle_new_client_fd_and_unlock (DBusServer *server,
                                  int         client_fd)
@@ -91,16 +105,18 @@ handle_new_client_fd_and_unlock (DBusServer *server,
   DBusNewConnectionFunction new_connection_function;
   DBusServerSocket* socket_server;
   void *new_connection_data;
+  DBusError error = DBUS_ERROR_INIT;
 
   socket_server = (DBusServerSocket*)server;
   _dbus_verbose ("Creating new client connection with fd %d\n", client_fd);
 
   HAVE_LOCK_CHECK (server);
 
-  if (!_dbus_set_fd_nonblocking (client_fd, NULL))
+  if (!_dbus_set_tcp_socket_options (client_fd, &socket_server->tcp_options, &error))
     {
-      SERVER_UNLOCK (server);
-      return TRUE;
+      /* The connection still works, just untuned */
+      _dbus_verbose ("%s\n", error.message);
+      dbus_error_free (&error);
     }
 
   transport = _dbus_transport_new_for_socket (client_fd, &server->guid_hex, FALSE);
@@ -119,6 +135,9 @@ handle_new_client_fd_and_unlock (DBusServer *server,
       return FALSE;
     }
 
+  if (socket_server->tcp_options.compress > 0)
+    _dbus_transport_set_compression_possible (transport, TRUE);
+
   /* note that client_fd is now owned by the transport, and will be
    * closed on transport disconnection/finalization
    */
@@ -186,31 +205,68 @@ socket_handle_watch (DBusWatch    *watch,
     {
       int client_fd;
       int listen_fd;
+      int n_accepted;
 
       listen_fd = dbus_watch_get_socket (watch);
 
-      if (socket_server->noncefile)
-          client_fd = _dbus_accept_with_noncefile (listen_fd, socket_server->noncefile);
-      else 
-          client_fd = _dbus_accept (listen_fd);
+      /* Accepting every pending client from one wakeup saves a trip
+       * through the main loop per client when many connect at once.
+       * The new connection function runs without the lock and may
+       * disconnect the server, which closes listen_fd.
+       */
+      _dbus_server_ref_unlocked (server);
 
-      if (client_fd < 0)
+      for (n_accepted = 0; n_accepted < MAX_ACCEPTS_PER_WATCH; n_accepted++)
         {
-          /* EINTR handled for us */
-
-          if (_dbus_get_is_errno_eagain_or_ewouldblock ())
-            _dbus_verbose ("No client available to accept after all\n");
+          if (n_accepted > 0)
+            {
+              SERVER_LOCK (server);
+
+              if (server->disconnected)
+                {
+                  SERVER_UNLOCK (server);
+                  break;
+                }
+            }
+
+          if (socket_server->noncefile)
+            {
+              client_fd = _dbus_accept_with_noncefile (listen_fd, socket_server->noncefile);
+
+              if (client_fd >= 0 &&
+                  !_dbus_set_fd_nonblocking (client_fd, NULL))
+                {
+                  _dbus_close_socket (client_fd, NULL);
+                  SERVER_UNLOCK (server);
+                  continue;
+                }
+            }
           else
-            _dbus_verbose ("Failed to accept a client connection: %s\n",
-                           _dbus_strerror_from_errno ());
+            client_fd = _dbus_accept_nonblocking (listen_fd);
+
+          if (client_fd < 0)
+            {
+              /* EINTR handled for us */
+
+              if (_dbus_get_is_errno_eagain_or_ewouldblock ())
+                _dbus_verbose ("No client available to accept after all\n");
+              else
+                _dbus_verbose ("Failed to accept a client connection: %s\n",
+                               _dbus_strerror_from_errno ());
+
+              SERVER_UNLOCK (server);
+              break;
+            }
 
-          SERVER_UNLOCK (server);
-        }
-      else
-        {
           if (!handle_new_client_fd_and_unlock (server, client_fd))
-            _dbus_verbose ("Rejected client connection due to lack of memory\n");
+            {
+              /* Leave the rest for when the watch fires again */
+              _dbus_verbose ("Rejected client connection due to lack of memory\n");
+              break;
+            }
         }
+
+      dbus_server_unref (server);
     }
 
   if (flags & DBUS_WATCH_ERROR)
@@ -289,6 +345,11 @@ _dbus_server_new_for_socket (int              *fds,
     return NULL;
 
   socket_server->noncefile = noncefile;
+  socket_server->tcp_options.nodelay = -1;
+  socket_server->tcp_options.keepalive = -1;
+  socket_server->tcp_options.zerocopy = -1;
+  socket_server->tcp_options.seqpacket = -1;
+  socket_server->tcp_options.compress = -1;
 
   socket_server->fds = dbus_new (int, n_fds);
   if (!socket_server->fds)
@@ -368,6 +429,55 @@ _dbus_server_new_for_socket (int              *fds,
   return NULL;
 }
 
+/* Opens one more listening socket per address on a port already
+ * listened on with SO_REUSEPORT, appending them to *fds_p. */
+static dbus_bool_t
+add_tcp_listeners (const char  *bind,
+                   const char  *port,
+                   const char  *family,
+                   int        **fds_p,
+                   int         *n_fds_p,
+                   DBusError   *error)
+{
+  DBusString unused_port_str;
+  int *new_fds;
+  int n_new_fds;
+  int *fds;
+  int i;
+
+  if (!_dbus_string_init (&unused_port_str))
+    {
+      dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+      return FALSE;
+    }
+
+  n_new_fds = _dbus_listen_tcp_socket (bind, port, family, TRUE,
+                                       &unused_port_str, &new_fds, error);
+  _dbus_string_free (&unused_port_str);
+
+  if (n_new_fds <= 0)
+    return FALSE;
+
+  fds = dbus_realloc (*fds_p, sizeof (int) * (*n_fds_p + n_new_fds));
+  if (fds == NULL)
+    {
+      for (i = 0; i < n_new_fds; i++)
+        _dbus_close_socket (new_fds[i], NULL);
+      dbus_free (new_fds);
+      dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+      return FALSE;
+    }
+
+  for (i = 0; i < n_new_fds; i++)
+    fds[*n_fds_p + i] = new_fds[i];
+
+  *fds_p = fds;
+  *n_fds_p += n_new_fds;
+  dbus_free (new_fds);
+
+  return TRUE;
+}
+
 /**
  * Creates a new server listening on TCP.
  * If host is NULL, it will default to localhost.
@@ -383,6 +493,10 @@ _dbus_server_new_for_socket (int              *fds,
  * @param bind the hostname to listen on
  * @param port the port to listen on or 0 to let the OS choose
  * @param family
+ * @param n_listeners how many listening sockets to open on each
+ *   address, sharing the port with SO_REUSEPORT when more than one
+ * @param options socket options to apply to each accepted client,
+ *   or #NULL
  * @param error location to store reason for failure.
  * @param use_nonce whether to use a nonce for low-level authentication (nonce-tcp transport) or not (tcp transport)
  * @returns the new server, or #NULL on failure.
@@ -392,6 +506,8 @@ _dbus_server_new_for_tcp_socket (const char     *host,
                                  const char     *bind,
                                  const char     *port,
                                  const char     *family,
+                                 int             n_listeners,
+                                 const DBusTcpOptions *options,
                                  DBusError      *error,
                                  dbus_bool_t    use_nonce)
 {
@@ -430,7 +546,10 @@ _dbus_server_new_for_tcp_socket (const char     *host,
   else if (strcmp (bind, "*") == 0)
     bind = NULL;
 
+  _dbus_assert (n_listeners >= 1);
+
   nlisten_fds =_dbus_listen_tcp_socket (bind, port, family,
+                                        n_listeners > 1,
                                         &port_str,
                                         &listen_fds, error);
   if (nlisten_fds <= 0)
@@ -439,6 +558,16 @@ _dbus_server_new_for_tcp_socket (const char     *host,
       goto failed_1;
     }
 
+  for (i = 1; i < n_listeners; i++)
+    {
+      if (!add_tcp_listeners (bind, _dbus_string_get_const_data (&port_str),
+                              family, &listen_fds, &nlisten_fds, error))
+        {
+          _DBUS_ASSERT_ERROR_IS_SET(error);
+          goto failed_2;
+        }
+    }
+
   _dbus_string_init_const (&host_str, host);
   if (!_dbus_string_append (&address, use_nonce ? "nonce-tcp:host=" : "tcp:host=") ||
       !_dbus_address_append_escaped (&address, &host_str) ||
@@ -456,6 +585,14 @@ _dbus_server_new_for_tcp_socket (const char     *host,
       goto failed_2;
     }
 
+  /* Clients told this address offer compression as well */
+  if (options != NULL && options->compress > 0 &&
+      !_dbus_string_append (&address, ",compress=true"))
+    {
+      dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+      goto failed_2;
+    }
+
   if (use_nonce)
     {
       noncefile = dbus_new0 (DBusNonceFile, 1);
@@ -482,6 +619,9 @@ _dbus_server_new_for_tcp_socket (const char     *host,
       goto failed_2;
     }
 
+  if (options != NULL)
+    _dbus_server_socket_set_client_options (server, options);
+
   _dbus_string_free (&port_str);
   _dbus_string_free (&address);
   dbus_free(listen_fds);
@@ -531,14 +671,39 @@ _dbus_server_listen_socket (DBusAddressEntry *entry,
       const char *port;
       const char *bind;
       const char *family;
+      const char *listeners;
+      long n_listeners;
+      DBusTcpOptions options;
 
       host = dbus_address_entry_get_value (entry, "host");
       bind = dbus_address_entry_get_value (entry, "bind");
       port = dbus_address_entry_get_value (entry, "port");
       family = dbus_address_entry_get_value (entry, "family");
+      listeners = dbus_address_entry_get_value (entry, "listeners");
+
+      n_listeners = 1;
+      if (listeners != NULL)
+        {
+          DBusString str;
+          int end;
+
+          _dbus_string_init_const (&str, listeners);
+          if (!_dbus_string_parse_int (&str, 0, &n_listeners, &end) ||
+              end != _dbus_string_get_length (&str) ||
+              n_listeners < 1 || n_listeners > MAX_TCP_LISTENERS)
+            {
+              _dbus_set_bad_address (error, NULL, NULL,
+                                     "listeners must be a number from 1 to 64");
+              return DBUS_SERVER_LISTEN_BAD_ADDRESS;
+            }
+        }
+
+      if (!_dbus_transport_get_tcp_options (entry, &options, error))
+        return DBUS_SERVER_LISTEN_BAD_ADDRESS;
 
       *server_p = _dbus_server_new_for_tcp_socket (host, bind, port,
-                                                   family, error, strcmp (method, "nonce-tcp") == 0 ? TRUE : FALSE);
+                                                   family, n_listeners, &options,
+                                                   error, strcmp (method, "nonce-tcp") == 0 ? TRUE : FALSE);
 
       if (*server_p)
         {
@@ -576,6 +741,142 @@ _dbus_server_socket_own_filename (DBusServer *server,
   socket_server->socket_name = filename;
 }
 
+/**
+ * Sets the socket options to apply to each client the server
+ * accepts from now on.
+ *
+ * @param server a socket server
+ * @param options the options
+ */
+void
+_dbus_server_socket_set_client_options (DBusServer           *server,
+                                        const DBusTcpOptions *options)
+{
+  DBusServerSocket *socket_server = (DBusServerSocket*) server;
+
+  socket_server->tcp_options = *options;
+}
+
+/**
+ * Gets what another process needs to carry on listening where the
+ * server does, so that clients never find the address unanswered:
+ * the address without its GUID, the GUID, and the listening sockets
+ * along with how they were set up. Only plain socket servers can be
+ * handed over; one with a nonce file can't, since the nonce is
+ * deleted along with the server.
+ *
+ * The sockets and name are returned by reference and belong to the
+ * server.
+ *
+ * @param server the server
+ * @param address string the address without its GUID is appended to
+ * @param guid return location for the GUID
+ * @param fds_p return location for the listening sockets
+ * @param n_fds_p return location for the number of sockets
+ * @param socket_name_p return location for the name to unlink on
+ *   disconnection, or #NULL
+ * @param options return location for the options applied to clients
+ * @returns #FALSE if the server can't be handed over, or no memory
+ */
+dbus_bool_t
+_dbus_server_socket_get_handoff_state (DBusServer      *server,
+                                       DBusString      *address,
+                                       DBusGUID        *guid,
+                                       int            **fds_p,
+                                       int             *n_fds_p,
+                                       const char     **socket_name_p,
+                                       DBusTcpOptions  *options)
+{
+  DBusServerSocket *socket_server = (DBusServerSocket*) server;
+  DBusString full_address;
+  int guid_len;
+  dbus_bool_t retval;
+
+  if (server->vtable != &socket_vtable)
+    return FALSE;
+
+  SERVER_LOCK (server);
+
+  retval = FALSE;
+
+  if (server->disconnected || socket_server->noncefile != NULL)
+    goto out;
+
+  /* _dbus_server_init_base() appended ",guid=" and the GUID */
+  guid_len = strlen (",guid=") + DBUS_UUID_LENGTH_HEX;
+  _dbus_string_init_const (&full_address, server->address);
+  _dbus_assert (_dbus_string_get_length (&full_address) > guid_len);
+
+  if (!_dbus_string_copy_len (&full_address, 0,
+                              _dbus_string_get_length (&full_address) - guid_len,
+                              address, _dbus_string_get_length (address)))
+    goto out;
+
+  *guid = server->guid;
+  *fds_p = socket_server->fds;
+  *n_fds_p = socket_server->n_fds;
+  *socket_name_p = socket_server->socket_name;
+  *options = socket_server->tcp_options;
+  retval = TRUE;
+
+ out:
+  SERVER_UNLOCK (server);
+  return retval;
+}
+
+/**
+ * Creates a server listening on sockets handed over by another
+ * process, from what _dbus_server_socket_get_handoff_state() gave
+ * it, with the same address and GUID.
+ *
+ * @param fds the listening sockets, which must be nonblocking
+ * @param n_fds the number of sockets
+ * @param address the address without its GUID
+ * @param guid the GUID
+ * @param socket_name the name to unlink on disconnection, or #NULL
+ * @param options the options to apply to clients
+ * @returns the new server, or #NULL if no memory
+ */
+DBusServer*
+_dbus_server_new_for_handed_off_socket (int                  *fds,
+                                        int                   n_fds,
+                                        const DBusString     *address,
+                                        const DBusGUID       *guid,
+                                        const char           *socket_name,
+                                        const DBusTcpOptions *options)
+{
+  DBusServer *server;
+  char *name_copy;
+
+  name_copy = NULL;
+  if (socket_name != NULL)
+    {
+      name_copy = _dbus_strdup (socket_name);
+      if (name_copy == NULL)
+        return NULL;
+    }
+
+  server = _dbus_server_new_for_socket (fds, n_fds, address, NULL);
+  if (server == NULL)
+    {
+      dbus_free (name_copy);
+      return NULL;
+    }
+
+  if (!_dbus_server_set_guid (server, guid))
+    {
+      dbus_free (name_copy);
+      dbus_server_disconnect (server);
+      dbus_server_unref (server);
+      return NULL;
+    }
+
+  _dbus_server_socket_own_filename (server, name_copy);
+  _dbus_server_socket_set_client_options (server, options);
+
+  return server;
+}
+
 
 /** @} */
 
@@ -37,6 +37,8 @@ DBusServer* _dbus_server_new_for_tcp_socket       (const char       *host,
                                                    const char       *bind,
                                                    const char       *port,
                                                    const char       *family,
+                                                   int               n_listeners,
+                                                   const DBusTcpOptions *options,
                                                    DBusError        *error,
                                                    dbus_bool_t      use_nonce);
 DBusServerListenResult _dbus_server_listen_socket (DBusAddressEntry  *entry,
@@ -46,6 +48,21 @@ DBusServerListenResult _dbus_server_listen_socket (DBusAddressEntry  *entry,
 
 void _dbus_server_socket_own_filename (DBusServer *server,
                                        char       *filename);
+void _dbus_server_socket_set_client_options (DBusServer           *server,
+                                             const DBusTcpOptions *options);
+dbus_bool_t _dbus_server_socket_get_handoff_state (DBusServer           *server,
+                                                   DBusString           *address,
+                                                   DBusGUID             *guid,
+                                                   int                 **fds_p,
+                                                   int                  *n_fds_p,
+                                                   const char          **socket_name_p,
+                                                   DBusTcpOptions       *options);
+DBusServer* _dbus_server_new_for_handed_off_socket (int                  *fds,
+                                                    int                   n_fds,
+                                                    const DBusString     *address,
+                                                    const DBusGUID       *guid,
+                                                    const char           *socket_name,
+                                                    const DBusTcpOptions *options);
 
 DBUS_END_DECLS
 
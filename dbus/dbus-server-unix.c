@@ -26,6 +26,7 @@
 #include "dbus-server-unix.h"
 #include "dbus-server-socket.h"
 #include "dbus-transport-unix.h"
+#include "dbus-transport-socket.h"
 #include "dbus-connection-internal.h"
 #include "dbus-sysdeps-unix.h"
 #include "dbus-string.h"
@@ -65,6 +66,7 @@ _dbus_server_listen_platform_specific (DBusAddressEntry *entry,
       const char *path = dbus_address_entry_get_value (entry, "path");
       const char *tmpdir = dbus_address_entry_get_value (entry, "tmpdir");
       const char *abstract = dbus_address_entry_get_value (entry, "abstract");
+      DBusTcpOptions options;
 
       if (path == NULL && tmpdir == NULL && abstract == NULL)
         {
@@ -83,6 +85,9 @@ _dbus_server_listen_platform_specific (DBusAddressEntry *entry,
           return DBUS_SERVER_LISTEN_BAD_ADDRESS;
         }
 
+      if (!_dbus_transport_get_unix_options (entry, &options, error))
+        return DBUS_SERVER_LISTEN_BAD_ADDRESS;
+
       if (tmpdir != NULL)
         {
           DBusString full_path;
@@ -122,6 +127,7 @@ _dbus_server_listen_platform_specific (DBusAddressEntry *entry,
 #else
                                                 FALSE,
 #endif
+                                                options.seqpacket > 0,
                                                 error);
 
           _dbus_string_free (&full_path);
@@ -130,14 +136,19 @@ _dbus_server_listen_platform_specific (DBusAddressEntry *entry,
       else
         {
           if (path)
-            *server_p = _dbus_server_new_for_domain_socket (path, FALSE, error);
+            *server_p = _dbus_server_new_for_domain_socket (path, FALSE,
+                                                            options.seqpacket > 0,
+                                                            error);
           else
-            *server_p = _dbus_server_new_for_domain_socket (abstract, TRUE, error);
+            *server_p = _dbus_server_new_for_domain_socket (abstract, TRUE,
+                                                            options.seqpacket > 0,
+                                                            error);
         }
 
       if (*server_p != NULL)
         {
           _DBUS_ASSERT_ERROR_IS_CLEAR(error);
+          _dbus_server_socket_set_client_options (*server_p, &options);
           return DBUS_SERVER_LISTEN_OK;
         }
       else
@@ -148,7 +159,7 @@ _dbus_server_listen_platform_specific (DBusAddressEntry *entry,
     }
   else if (strcmp (method, "systemd") == 0)
     {
-      int n, *fds;
+      int i, n, *fds;
       DBusString address;
 
       n = _dbus_listen_systemd_sockets (&fds, error);
@@ -158,13 +169,23 @@ _dbus_server_listen_platform_specific (DBusAddressEntry *entry,
           return DBUS_SERVER_LISTEN_DID_NOT_CONNECT;
         }
 
-      _dbus_string_init_const (&address, "systemd:");
+      *server_p = NULL;
 
-      *server_p = _dbus_server_new_for_socket (fds, n, &address, NULL);
-      if (*server_p == NULL)
+      /* With one named socket, advertise where it actually is, so that
+       * activated services and printed addresses can be connected to
+       */
+      if (_dbus_string_init (&address))
         {
-          int i;
+          if ((n == 1 && _dbus_append_address_from_socket (fds[0], &address)) ||
+              (_dbus_string_set_length (&address, 0) &&
+               _dbus_string_append (&address, "systemd:")))
+            *server_p = _dbus_server_new_for_socket (fds, n, &address, NULL);
 
+          _dbus_string_free (&address);
+        }
+
+      if (*server_p == NULL)
+        {
           for (i = 0; i < n; i++)
             {
               _dbus_close_socket (fds[i], NULL);
@@ -194,12 +215,14 @@ _dbus_server_listen_platform_specific (DBusAddressEntry *entry,
  *
  * @param path the path for the domain socket.
  * @param abstract #TRUE to use abstract socket namespace
+ * @param seqpacket #TRUE to use a SOCK_SEQPACKET socket
  * @param error location to store reason for failure.
  * @returns the new server, or #NULL on failure.
  */
 DBusServer*
 _dbus_server_new_for_domain_socket (const char     *path,
                                     dbus_bool_t     abstract,
+                                    dbus_bool_t     seqpacket,
                                     DBusError      *error)
 {
   DBusServer *server;
@@ -221,7 +244,9 @@ _dbus_server_new_for_domain_socket (const char     *path,
        !_dbus_string_append (&address, "unix:abstract=")) ||
       (!abstract &&
        !_dbus_string_append (&address, "unix:path=")) ||
-      !_dbus_address_append_escaped (&address, &path_str))
+      !_dbus_address_append_escaped (&address, &path_str) ||
+      (seqpacket &&
+       !_dbus_string_append (&address, ",seqpacket=true")))
     {
       dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
       goto failed_0;
@@ -234,7 +259,7 @@ _dbus_server_new_for_domain_socket (const char     *path,
       goto failed_0;
     }
 
-  listen_fd = _dbus_listen_unix_socket (path, abstract, error);
+  listen_fd = _dbus_listen_unix_socket (path, abstract, seqpacket, error);
 
   if (listen_fd < 0)
     {
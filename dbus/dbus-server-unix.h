@@ -30,6 +30,7 @@ DBUS_BEGIN_DECLS
 
 DBusServer* _dbus_server_new_for_domain_socket (const char       *path,
                                                 dbus_bool_t       abstract,
+                                                dbus_bool_t       seqpacket,
                                                 DBusError        *error);
 
 DBUS_END_DECLS
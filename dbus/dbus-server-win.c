@@ -26,6 +26,7 @@
 #include "dbus-internals.h"
 #include "dbus-server-win.h"
 #include "dbus-server-socket.h"
+#include "dbus-transport-socket.h"
 
 /**
  * @defgroup DBusServerWin DBusServer implementations for Windows
@@ -63,14 +64,19 @@ _dbus_server_listen_platform_specific (DBusAddressEntry *entry,
       const char *port;
       const char *bind;
       const char *family;
+      DBusTcpOptions options;
 
       host = dbus_address_entry_get_value (entry, "host");
       bind = dbus_address_entry_get_value (entry, "bind");
       port = dbus_address_entry_get_value (entry, "port");
       family = dbus_address_entry_get_value (entry, "family");
 
+      if (!_dbus_transport_get_tcp_options (entry, &options, error))
+        return DBUS_SERVER_LISTEN_BAD_ADDRESS;
+
       *server_p = _dbus_server_new_for_tcp_socket (host, bind, port,
-                                                   family, error, TRUE);
+                                                   family, 1, &options,
+                                                   error, TRUE);
 
       if (*server_p)
         {
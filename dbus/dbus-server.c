@@ -25,6 +25,7 @@
 #include "dbus-server.h"
 #include "dbus-server-unix.h"
 #include "dbus-server-socket.h"
+#include "dbus-server-inproc.h"
 #include "dbus-string.h"
 #ifdef DBUS_BUILD_TESTS
 #include "dbus-server-debug-pipe.h"
@@ -159,6 +160,51 @@ _dbus_server_init_base (DBusServer             *server,
   return FALSE;
 }
 
+/**
+ * Replaces the GUID made up for a new server, for a server taking
+ * over the listening sockets of another, whose clients may already
+ * have the old GUID in their addresses.
+ *
+ * @param server the server, not yet in use
+ * @param guid the GUID to have
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+_dbus_server_set_guid (DBusServer     *server,
+                       const DBusGUID *guid)
+{
+  DBusString guid_hex;
+  size_t address_len;
+
+  if (!_dbus_string_init (&guid_hex))
+    return FALSE;
+
+  if (!_dbus_uuid_encode (guid, &guid_hex))
+    {
+      _dbus_string_free (&guid_hex);
+      return FALSE;
+    }
+
+  /* copy_address_with_guid_appended() put the GUID last */
+  address_len = strlen (server->address);
+  _dbus_assert (address_len > DBUS_UUID_LENGTH_HEX);
+  _dbus_assert (strcmp (server->address + address_len - DBUS_UUID_LENGTH_HEX,
+                        _dbus_string_get_const_data (&server->guid_hex)) == 0);
+
+  /* Both hex forms have the same length, so overwrite them in place
+   * rather than replacing the DBusString itself
+   */
+  memcpy (server->address + address_len - DBUS_UUID_LENGTH_HEX,
+          _dbus_string_get_const_data (&guid_hex), DBUS_UUID_LENGTH_HEX);
+  memcpy (_dbus_string_get_data (&server->guid_hex),
+          _dbus_string_get_const_data (&guid_hex), DBUS_UUID_LENGTH_HEX);
+
+  server->guid = *guid;
+  _dbus_string_free (&guid_hex);
+
+  return TRUE;
+}
+
 /**
  * Finalizes the members of the DBusServer base class.
  * Chained up to by subclass finalizers.
@@ -512,6 +558,7 @@ static const struct {
 } listen_funcs[] = {
   { _dbus_server_listen_socket }
   , { _dbus_server_listen_platform_specific }
+  , { _dbus_server_listen_inproc }
 #ifdef DBUS_BUILD_TESTS
   , { _dbus_server_listen_debug_pipe }
 #endif
@@ -1148,6 +1195,238 @@ dbus_server_get_data (DBusServer   *server,
 #include "dbus-test.h"
 #include <string.h>
 
+static void
+keep_new_connection (DBusServer     *server,
+                     DBusConnection *connection,
+                     void           *data)
+{
+  DBusConnection **connection_p = data;
+
+  _dbus_assert (*connection_p == NULL);
+  *connection_p = dbus_connection_ref (connection);
+}
+
+/* Messages are handed over as they are; the receiver gets the
+ * sender's message if nobody else holds it, and a copy if they do,
+ * modifiable either way.
+ */
+static void
+check_inproc_round_trip (void)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  DBusServer *server;
+  DBusConnection *client;
+  DBusConnection *server_end;
+  DBusMessage *message;
+  DBusMessage *kept;
+  int n_received;
+  int i;
+
+  server = dbus_server_listen ("inproc:name=test-inproc", &error);
+  if (server == NULL)
+    _dbus_assert_not_reached ("could not listen on inproc address");
+
+  _dbus_assert (dbus_server_listen ("inproc:name=test-inproc", &error) == NULL);
+  _dbus_assert (dbus_error_has_name (&error, DBUS_ERROR_ADDRESS_IN_USE));
+  dbus_error_free (&error);
+
+  server_end = NULL;
+  dbus_server_set_new_connection_function (server, keep_new_connection,
+                                           &server_end, NULL);
+
+  client = dbus_connection_open_private ("inproc:name=test-inproc", &error);
+  if (client == NULL)
+    _dbus_assert_not_reached ("could not connect to inproc server");
+  _dbus_assert (server_end != NULL);
+
+  message = dbus_message_new_signal ("/", "org.freedesktop.DBus.Test", "Given");
+  _dbus_assert (message != NULL);
+  _dbus_assert (dbus_connection_send (client, message, NULL));
+  dbus_message_unref (message);
+
+  kept = dbus_message_new_signal ("/", "org.freedesktop.DBus.Test", "Kept");
+  _dbus_assert (kept != NULL);
+  _dbus_assert (dbus_connection_send (client, kept, NULL));
+
+  n_received = 0;
+  for (i = 0; i < 1000 && n_received < 2; i++)
+    {
+      dbus_connection_read_write (client, 0);
+      dbus_connection_read_write (server_end, 0);
+
+      while ((message = dbus_connection_pop_message (server_end)) != NULL)
+        {
+          _dbus_assert (dbus_message_is_signal (message,
+                                                "org.freedesktop.DBus.Test",
+                                                n_received == 0 ? "Given" : "Kept"));
+          _dbus_assert (dbus_message_set_sender (message, ":1.1"));
+
+          if (n_received == 1)
+            {
+              _dbus_assert (message != kept);
+              _dbus_assert (dbus_message_get_serial (message) ==
+                            dbus_message_get_serial (kept));
+              _dbus_assert (dbus_message_get_sender (kept) == NULL);
+            }
+
+          dbus_message_unref (message);
+          n_received += 1;
+        }
+    }
+
+  _dbus_assert (n_received == 2);
+  dbus_message_unref (kept);
+
+  dbus_connection_close (client);
+  dbus_connection_unref (client);
+  dbus_connection_close (server_end);
+  dbus_connection_unref (server_end);
+
+  dbus_server_disconnect (server);
+  dbus_server_unref (server);
+
+  /* the name is free again */
+  server = dbus_server_listen ("inproc:name=test-inproc", &error);
+  if (server == NULL)
+    _dbus_assert_not_reached ("inproc name not released on disconnect");
+  dbus_server_disconnect (server);
+  dbus_server_unref (server);
+}
+
+static dbus_bool_t
+keep_listen_watch (DBusWatch *watch,
+                   void      *data)
+{
+  DBusWatch **watch_p = data;
+
+  *watch_p = watch;
+  return TRUE;
+}
+
+static void
+forget_listen_watch (DBusWatch *watch,
+                     void      *data)
+{
+  DBusWatch **watch_p = data;
+
+  if (*watch_p == watch)
+    *watch_p = NULL;
+}
+
+/* Sends a big message and a few small ones from a client of a server
+ * listening on listen_address, which must accept on a single socket,
+ * and checks they all arrive intact. The server's address has to
+ * mention option, so that the client uses it too.
+ */
+static void
+check_big_message_round_trip (const char *listen_address,
+                              const char *option)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  DBusServer *server;
+  DBusWatch *watch;
+  DBusConnection *client;
+  DBusConnection *server_end;
+  DBusMessage *message;
+  char *address;
+  char *payload;
+  int payload_len;
+  int n_received;
+  int i;
+
+  server = dbus_server_listen (listen_address, &error);
+  if (server == NULL)
+    {
+      _dbus_warn ("server listen error: %s: %s\n", error.name, error.message);
+      _dbus_assert_not_reached ("could not listen for big message test");
+    }
+
+  watch = NULL;
+  _dbus_assert (dbus_server_set_watch_functions (server, keep_listen_watch,
+                                                 forget_listen_watch, NULL,
+                                                 &watch, NULL));
+  _dbus_assert (watch != NULL);
+
+  server_end = NULL;
+  dbus_server_set_new_connection_function (server, keep_new_connection,
+                                           &server_end, NULL);
+
+  address = dbus_server_get_address (server);
+  _dbus_assert (strstr (address, option) != NULL);
+  client = dbus_connection_open_private (address, &error);
+  if (client == NULL)
+    _dbus_assert_not_reached ("could not connect for big message test");
+  dbus_free (address);
+
+  dbus_watch_handle (watch, DBUS_WATCH_READABLE);
+  _dbus_assert (server_end != NULL);
+
+  payload_len = 1024 * 1024;
+  payload = dbus_malloc0 (payload_len);
+  _dbus_assert (payload != NULL);
+
+  message = dbus_message_new_signal ("/", "org.freedesktop.DBus.Test", "Big");
+  _dbus_assert (message != NULL);
+  _dbus_assert (dbus_message_append_args (message,
+                                          DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE,
+                                          &payload, payload_len,
+                                          DBUS_TYPE_INVALID));
+  _dbus_assert (dbus_connection_send (client, message, NULL));
+  dbus_message_unref (message);
+  dbus_free (payload);
+
+  for (i = 0; i < 3; i++)
+    {
+      message = dbus_message_new_signal ("/", "org.freedesktop.DBus.Test", "Small");
+      _dbus_assert (message != NULL);
+      _dbus_assert (dbus_connection_send (client, message, NULL));
+      dbus_message_unref (message);
+    }
+
+  n_received = 0;
+  for (i = 0; i < 10000 && n_received < 4; i++)
+    {
+      dbus_connection_read_write (client, 0);
+      /* TCP may hold back small segments for a moment */
+      dbus_connection_read_write (server_end, 10);
+
+      while ((message = dbus_connection_pop_message (server_end)) != NULL)
+        {
+          if (n_received == 0)
+            {
+              const char *received;
+              int received_len;
+
+              _dbus_assert (dbus_message_is_signal (message,
+                                                    "org.freedesktop.DBus.Test",
+                                                    "Big"));
+              _dbus_assert (dbus_message_get_args (message, NULL,
+                                                   DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE,
+                                                   &received, &received_len,
+                                                   DBUS_TYPE_INVALID));
+              _dbus_assert (received_len == payload_len);
+            }
+          else
+            _dbus_assert (dbus_message_is_signal (message,
+                                                  "org.freedesktop.DBus.Test",
+                                                  "Small"));
+
+          dbus_message_unref (message);
+          n_received += 1;
+        }
+    }
+
+  _dbus_assert (n_received == 4);
+
+  dbus_connection_close (client);
+  dbus_connection_unref (client);
+  dbus_connection_close (server_end);
+  dbus_connection_unref (server_end);
+
+  dbus_server_disconnect (server);
+  dbus_server_unref (server);
+}
+
 dbus_bool_t
 _dbus_server_test (void)
 {
@@ -1158,7 +1437,9 @@ _dbus_server_test (void)
 #ifdef DBUS_UNIX
     "unix:path=./boogie",
     "tcp:port=1234;unix:path=./boogie",
+    "unix:path=./boogie,seqpacket=true",
 #endif
+    "inproc:name=boogie",
   };
 
   DBusServer *server;
@@ -1197,6 +1478,17 @@ _dbus_server_test (void)
       dbus_server_unref (server);
     }
 
+  check_inproc_round_trip ();
+#ifdef DBUS_UNIX
+  /* A message too big for one packet is split over several */
+  check_big_message_round_trip ("unix:tmpdir=/tmp,seqpacket=true",
+                                "seqpacket=true");
+#endif
+#ifdef HAVE_LZ4
+  check_big_message_round_trip ("tcp:host=localhost,port=0,compress=true",
+                                "compress=true");
+#endif
+
   return TRUE;
 }
 
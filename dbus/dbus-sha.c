@@ -158,6 +158,14 @@ effort (for example the reengineering of a great many Capstone chips).
 #define subRound(a, b, c, d, e, f, k, data) \
    ( e += ROTL( 5, a ) + f( b, c, d ) + k + data, b = ROTL( 30, b ) )
 
+/* SHA works on big-endian words; this stores one a byte at a time, so
+   the destination needs no particular alignment */
+
+#define PUT_BE32(p, v) ( ( p )[ 0 ] = ( unsigned char) ( ( v ) >> 24 ), \
+                         ( p )[ 1 ] = ( unsigned char) ( ( v ) >> 16 ), \
+                         ( p )[ 2 ] = ( unsigned char) ( ( v ) >> 8 ), \
+                         ( p )[ 3 ] = ( unsigned char) ( v ) )
+
 #endif /* !DOXYGEN_SHOULD_SKIP_THIS */
 
 /* Perform the SHA transformation.  Note that this code, like MD5, seems to
@@ -165,13 +173,15 @@ effort (for example the reengineering of a great many Capstone chips).
    and the size of the basic block.  It may be necessary to split it into
    sections, e.g. based on the four subrounds
 
-   Note that this corrupts the context->data area */
+   The block is read directly from its (possibly unaligned) bytes, so
+   whole blocks can be hashed straight from the caller's buffer */
 
 static void
-SHATransform(dbus_uint32_t *digest, dbus_uint32_t *data)
+SHATransform(dbus_uint32_t *digest, const unsigned char *block)
 {
   dbus_uint32_t A, B, C, D, E;     /* Local vars */
   dbus_uint32_t eData[16];       /* Expanded data */
+  int i;
 
   /* Set up first buffer and local data buffer */
   A = digest[0];
@@ -179,7 +189,9 @@ SHATransform(dbus_uint32_t *digest, dbus_uint32_t *data)
   C = digest[2];
   D = digest[3];
   E = digest[4];
-  memmove (eData, data, SHA_DATASIZE);
+  memcpy (eData, block, SHA_DATASIZE);
+  for (i = 0; i < 16; i++)
+    eData[i] = DBUS_UINT32_FROM_BE (eData[i]);
 
   /* Heavy mangling, in 4 sub-rounds of 20 interations each. */
   subRound (A, B, C, D, E, f1, K1, eData[0]);
@@ -274,25 +286,6 @@ SHATransform(dbus_uint32_t *digest, dbus_uint32_t *data)
   digest[4] += E;
 }
 
-/* When run on a little-endian CPU we need to perform byte reversal on an
-   array of longwords. */
-
-#ifdef WORDS_BIGENDIAN
-#define swap_words(buffer, byte_count)
-#else
-static void
-swap_words (dbus_uint32_t *buffer,
-            int            byte_count)
-{
-  byte_count /= sizeof (dbus_uint32_t);
-  while (byte_count--)
-    {
-      *buffer = DBUS_UINT32_SWAP_LE_BE (*buffer);
-      ++buffer;
-    }
-}
-#endif
-
 static void
 sha_init (DBusSHAContext *context)
 {
@@ -336,18 +329,15 @@ sha_append (DBusSHAContext      *context,
           return;
         }
       memmove (p, buffer, dataCount);
-      swap_words (context->data, SHA_DATASIZE);
-      SHATransform (context->digest, context->data);
+      SHATransform (context->digest, (unsigned char *) context->data);
       buffer += dataCount;
       count -= dataCount;
     }
 
-  /* Process data in SHA_DATASIZE chunks */
+  /* Process data in SHA_DATASIZE chunks, without copying it */
   while (count >= SHA_DATASIZE)
     {
-      memmove (context->data, buffer, SHA_DATASIZE);
-      swap_words (context->data, SHA_DATASIZE);
-      SHATransform (context->digest, context->data);
+      SHATransform (context->digest, buffer);
       buffer += SHA_DATASIZE;
       count -= SHA_DATASIZE;
     }
@@ -364,6 +354,7 @@ static void
 sha_finish (DBusSHAContext *context, unsigned char digest[20])
 {
   int count;
+  int i;
   unsigned char *data_p;
 
   /* Compute number of bytes mod 64 */
@@ -383,8 +374,7 @@ sha_finish (DBusSHAContext *context, unsigned char digest[20])
     {
       /* Two lots of padding:  Pad the first block to 64 bytes */
       memset (data_p, 0, count);
-      swap_words (context->data, SHA_DATASIZE);
-      SHATransform (context->digest, context->data);
+      SHATransform (context->digest, (unsigned char *) context->data);
 
       /* Now fill the next block with 56 bytes */
       memset (context->data, 0, SHA_DATASIZE - 8);
@@ -394,13 +384,14 @@ sha_finish (DBusSHAContext *context, unsigned char digest[20])
     memset (data_p, 0, count - 8);
 
   /* Append length in bits and transform */
-  context->data[14] = context->count_hi;
-  context->data[15] = context->count_lo;
+  data_p = (unsigned char *) context->data + SHA_DATASIZE - 8;
+  PUT_BE32 (data_p, context->count_hi);
+  PUT_BE32 (data_p + 4, context->count_lo);
+
+  SHATransform (context->digest, (unsigned char *) context->data);
 
-  swap_words (context->data, SHA_DATASIZE - 8);
-  SHATransform (context->digest, context->data);
-  swap_words (context->digest, SHA_DIGESTSIZE);
-  memmove (digest, context->digest, SHA_DIGESTSIZE);
+  for (i = 0; i < SHA_DIGESTSIZE / 4; i++)
+    PUT_BE32 (digest + i * 4, context->digest[i]);
 }
 
 /** @} */ /* End of internals */
@@ -484,29 +475,29 @@ _dbus_sha_compute (const DBusString *data,
                    DBusString       *ascii_output)
 {
   DBusSHAContext context;
+  unsigned char digest_bytes[SHA_DIGESTSIZE];
   DBusString digest;
+  dbus_bool_t retval;
 
   _dbus_sha_init (&context);
 
   _dbus_sha_update (&context, data);
 
-  if (!_dbus_string_init (&digest))
-    return FALSE;
+  /* The digest is fixed-size, so keep it on the stack rather than
+   * allocating a string just to hex-encode it.
+   */
+  sha_finish (&context, digest_bytes);
+  _DBUS_ZERO (context);
 
-  if (!_dbus_sha_final (&context, &digest))
-    goto error;
+  _dbus_string_init_const_len (&digest, (const char *) digest_bytes,
+                               SHA_DIGESTSIZE);
 
-  if (!_dbus_string_hex_encode (&digest, 0, ascii_output,
-                                _dbus_string_get_length (ascii_output)))
-    goto error;
+  retval = _dbus_string_hex_encode (&digest, 0, ascii_output,
+                                    _dbus_string_get_length (ascii_output));
 
-  _dbus_string_free (&digest);
-  
-  return TRUE;
+  memset (digest_bytes, 0, sizeof (digest_bytes));
 
- error:
-  _dbus_string_free (&digest);
-  return FALSE;
+  return retval;
 }
 
 /** @} */ /* end of exported functions */
@@ -920,6 +911,79 @@ process_test_data (const char *test_data_dir)
   return retval;
 }
 
+#define N_BENCHMARK_ROUNDS 100000
+
+static long
+elapsed_usec (long *sec,
+              long *usec)
+{
+  long now_sec, now_usec;
+  long elapsed;
+
+  _dbus_get_current_time (&now_sec, &now_usec);
+  elapsed = (now_sec - *sec) * 1000000 + (now_usec - *usec);
+  *sec = now_sec;
+  *usec = now_usec;
+
+  return elapsed;
+}
+
+/* Times _dbus_sha_compute() on a DBUS_COOKIE_SHA1-sized input (server
+ * challenge, client challenge and a 24-byte cookie, hex-encoded and
+ * colon-separated) and on a larger buffer, so changes to the block
+ * function can be compared before and after.
+ */
+static void
+benchmark_sha (void)
+{
+  DBusString input;
+  DBusString results;
+  long sec, usec;
+  long cookie_usec, bulk_usec;
+  int i;
+
+  if (!_dbus_string_init (&input) ||
+      !_dbus_string_init (&results))
+    _dbus_assert_not_reached ("no memory for SHA-1 benchmark");
+
+  if (!_dbus_string_insert_bytes (&input, 0, 64 + 1 + 64 + 1 + 48, 'a'))
+    _dbus_assert_not_reached ("no memory for SHA-1 benchmark");
+
+  elapsed_usec (&sec, &usec);
+
+  for (i = 0; i < N_BENCHMARK_ROUNDS; i++)
+    {
+      _dbus_string_set_length (&results, 0);
+      if (!_dbus_sha_compute (&input, &results))
+        _dbus_assert_not_reached ("no memory for SHA-1 benchmark");
+    }
+
+  cookie_usec = elapsed_usec (&sec, &usec);
+
+  if (!_dbus_string_insert_bytes (&input, 0,
+                                  64 * 1024 - _dbus_string_get_length (&input),
+                                  'a'))
+    _dbus_assert_not_reached ("no memory for SHA-1 benchmark");
+
+  elapsed_usec (&sec, &usec);
+
+  for (i = 0; i < N_BENCHMARK_ROUNDS / 1000; i++)
+    {
+      _dbus_string_set_length (&results, 0);
+      if (!_dbus_sha_compute (&input, &results))
+        _dbus_assert_not_reached ("no memory for SHA-1 benchmark");
+    }
+
+  bulk_usec = elapsed_usec (&sec, &usec);
+
+  printf ("SHA-1: %d cookie-sized hashes %ld ms, %d x 64 KiB %ld ms\n",
+          N_BENCHMARK_ROUNDS, cookie_usec / 1000,
+          N_BENCHMARK_ROUNDS / 1000, bulk_usec / 1000);
+
+  _dbus_string_free (&input);
+  _dbus_string_free (&results);
+}
+
 /**
  * @ingroup DBusSHAInternals
  * Unit test for SHA computation.
@@ -963,6 +1027,8 @@ _dbus_sha_test (const char *test_data_dir)
   CHECK ("12345678901234567890123456789012345678901234567890123456789012345678901234567890",
          "50abf5706a150990a08b2c5ea40fa0e585554732");
 
+  benchmark_sha ();
+
   return TRUE;
 }
 
@@ -0,0 +1,261 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-socket-set-epoll.c  DBusSocketSet backed by Linux epoll
+ *
+ * Copyright (C) 2003, 2004  Red Hat, Inc.
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "dbus-socket-set.h"
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-sysdeps.h>
+#include <dbus/dbus-sysdeps-unix.h>
+
+#ifdef DBUS_HAVE_LINUX_EPOLL
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+/* The kernel keeps the interest list, so the set itself is just the
+ * epoll fd.
+ */
+typedef struct
+{
+  DBusSocketSet parent;
+  int epfd;
+} DBusSocketSetEpoll;
+
+/* How many events we fetch per epoll_wait(); anything beyond this is
+ * picked up on the next iteration, since enabled fds are level-triggered.
+ */
+#define N_EPOLL_EVENTS 64
+
+static uint32_t
+watch_flags_to_epoll_events (unsigned int flags)
+{
+  uint32_t events = 0;
+
+  if (flags & DBUS_WATCH_READABLE)
+    events |= EPOLLIN;
+  if (flags & DBUS_WATCH_WRITABLE)
+    events |= EPOLLOUT;
+
+  return events;
+}
+
+static unsigned int
+watch_flags_from_epoll_events (uint32_t events)
+{
+  unsigned int condition = 0;
+
+  if (events & EPOLLIN)
+    condition |= DBUS_WATCH_READABLE;
+  if (events & EPOLLOUT)
+    condition |= DBUS_WATCH_WRITABLE;
+  if (events & EPOLLHUP)
+    condition |= DBUS_WATCH_HANGUP;
+  if (events & EPOLLERR)
+    condition |= DBUS_WATCH_ERROR;
+
+  return condition;
+}
+
+/* epoll always reports EPOLLHUP and EPOLLERR, even with no events
+ * requested, so a disabled fd whose peer has gone away would wake us
+ * up on every iteration. Making it edge-triggered limits that to a
+ * single spurious HANGUP/ERROR event, which the main loop ignores
+ * because no enabled watch wants it.
+ */
+static void
+fill_epoll_event (struct epoll_event *event,
+                  int                 fd,
+                  unsigned int        flags,
+                  dbus_bool_t         enabled)
+{
+  memset (event, 0, sizeof (*event));
+
+  if (enabled)
+    event->events = watch_flags_to_epoll_events (flags);
+  else
+    event->events = EPOLLET;
+
+  event->data.fd = fd;
+}
+
+static void
+socket_set_epoll_free (DBusSocketSet *set)
+{
+  DBusSocketSetEpoll *self = (DBusSocketSetEpoll *) set;
+
+  if (self->epfd >= 0)
+    close (self->epfd);
+
+  dbus_free (self);
+}
+
+static dbus_bool_t
+socket_set_epoll_add (DBusSocketSet *set,
+                      int            fd,
+                      unsigned int   flags,
+                      dbus_bool_t    enabled)
+{
+  DBusSocketSetEpoll *self = (DBusSocketSetEpoll *) set;
+  struct epoll_event event;
+
+  fill_epoll_event (&event, fd, flags, enabled);
+
+  if (epoll_ctl (self->epfd, EPOLL_CTL_ADD, fd, &event) == 0)
+    return TRUE;
+
+  /* The only failure callers can do anything about is running out of
+   * memory (or of the per-user epoll watch limit, which is the same
+   * thing as far as they're concerned).
+   */
+  _dbus_verbose ("epoll_ctl ADD of fd %d failed: %s\n",
+                 fd, _dbus_strerror (errno));
+  return FALSE;
+}
+
+static void
+socket_set_epoll_remove (DBusSocketSet *set,
+                         int            fd)
+{
+  DBusSocketSetEpoll *self = (DBusSocketSetEpoll *) set;
+  struct epoll_event dummy;
+
+  /* Kernels before 2.6.9 insist on a non-NULL event. The fd may
+   * already have been closed, in which case the kernel dropped it from
+   * the set itself and this fails harmlessly.
+   */
+  memset (&dummy, 0, sizeof (dummy));
+  epoll_ctl (self->epfd, EPOLL_CTL_DEL, fd, &dummy);
+}
+
+static void
+socket_set_epoll_enable (DBusSocketSet *set,
+                         int            fd,
+                         unsigned int   flags)
+{
+  DBusSocketSetEpoll *self = (DBusSocketSetEpoll *) set;
+  struct epoll_event event;
+
+  fill_epoll_event (&event, fd, flags, TRUE);
+
+  /* MOD never allocates, so can only fail if the fd isn't in the set */
+  if (epoll_ctl (self->epfd, EPOLL_CTL_MOD, fd, &event) != 0)
+    _dbus_warn_check_failed ("epoll_ctl MOD of fd %d failed: %s\n",
+                             fd, _dbus_strerror (errno));
+}
+
+static void
+socket_set_epoll_disable (DBusSocketSet *set,
+                          int            fd)
+{
+  DBusSocketSetEpoll *self = (DBusSocketSetEpoll *) set;
+  struct epoll_event event;
+
+  fill_epoll_event (&event, fd, 0, FALSE);
+
+  if (epoll_ctl (self->epfd, EPOLL_CTL_MOD, fd, &event) != 0)
+    _dbus_warn_check_failed ("epoll_ctl MOD of fd %d failed: %s\n",
+                             fd, _dbus_strerror (errno));
+}
+
+static int
+socket_set_epoll_poll (DBusSocketSet   *set,
+                       DBusSocketEvent *revents,
+                       int              max_events,
+                       int              timeout_milliseconds)
+{
+  DBusSocketSetEpoll *self = (DBusSocketSetEpoll *) set;
+  struct epoll_event events[N_EPOLL_EVENTS];
+  int n_ready;
+  int n_events;
+  int i;
+
+  if (max_events > N_EPOLL_EVENTS)
+    max_events = N_EPOLL_EVENTS;
+
+  n_ready = epoll_wait (self->epfd, events, max_events, timeout_milliseconds);
+
+  if (n_ready < 0)
+    {
+      /* Same contract as _dbus_poll(): the caller looks at errno */
+      return -1;
+    }
+
+  n_events = 0;
+  for (i = 0; i < n_ready; i++)
+    {
+      unsigned int condition;
+
+      condition = watch_flags_from_epoll_events (events[i].events);
+      if (condition == 0)
+        continue;
+
+      revents[n_events].fd = events[i].data.fd;
+      revents[n_events].flags = condition;
+      n_events += 1;
+    }
+
+  return n_events;
+}
+
+static const DBusSocketSetClass socket_set_epoll_class = {
+  socket_set_epoll_free,
+  socket_set_epoll_add,
+  socket_set_epoll_remove,
+  socket_set_epoll_enable,
+  socket_set_epoll_disable,
+  socket_set_epoll_poll
+};
+
+DBusSocketSet *
+_dbus_socket_set_epoll_new (void)
+{
+  DBusSocketSetEpoll *self;
+
+  self = dbus_new0 (DBusSocketSetEpoll, 1);
+  if (self == NULL)
+    return NULL;
+
+  self->parent.cls = &socket_set_epoll_class;
+
+  /* The size argument is only a hint, and ignored since Linux 2.6.8 */
+  self->epfd = epoll_create (N_EPOLL_EVENTS);
+  if (self->epfd < 0)
+    {
+      _dbus_verbose ("epoll_create failed: %s\n", _dbus_strerror (errno));
+      socket_set_epoll_free ((DBusSocketSet *) self);
+      return NULL;
+    }
+
+  _dbus_fd_set_close_on_exec (self->epfd);
+
+  return (DBusSocketSet *) self;
+}
+
+#endif /* DBUS_HAVE_LINUX_EPOLL */
+
+#endif /* !DOXYGEN_SHOULD_SKIP_THIS */
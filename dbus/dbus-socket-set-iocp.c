@@ -0,0 +1,662 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-socket-set-iocp.c  DBusSocketSet backed by a Windows I/O completion port
+ *
+ * Copyright (C) 2003, 2004  Red Hat, Inc.
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "dbus-socket-set.h"
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-hash.h>
+#include <dbus/dbus-list.h>
+#include <dbus/dbus-sysdeps.h>
+
+#ifdef DBUS_HAVE_IOCP
+
+#include "dbus-sockets-win.h"
+
+#include <windows.h>
+
+/* The transports only know how to react to readiness, so rather than
+ * reading and writing through the port we use it to learn readiness,
+ * the same way as other completion-based loops do: a zero-byte
+ * overlapped WSARecv() completes as soon as there is something to read
+ * (or the peer has gone), and a zero-byte WSASend() as soon as there
+ * is room to write. Unlike select() this has no limit on the number of
+ * sockets and costs nothing per socket that isn't ready.
+ *
+ * Such an operation is only armed while its socket is enabled for that
+ * condition, and re-armed each time round after being reported, which
+ * makes the set level-triggered like the others: if data is still
+ * waiting, the new read completes straight away.
+ *
+ * Listening sockets can't be read from; for those, FD_ACCEPT is
+ * selected on an event and a thread-pool wait posts to the port when
+ * it's signalled. A bus has only a handful of them.
+ *
+ * Everything but those waits runs in the thread calling poll(), which
+ * is why CancelIo() is enough to cancel a socket's operations.
+ */
+
+typedef struct DBusSocketSetIocp DBusSocketSetIocp;
+typedef struct IocpEntry IocpEntry;
+
+typedef struct
+{
+  OVERLAPPED overlapped;  /**< First, so the completion can find us */
+  IocpEntry *entry;
+  unsigned int condition; /**< DBUS_WATCH_READABLE or DBUS_WATCH_WRITABLE */
+  dbus_bool_t pending;    /**< Armed and not yet dequeued */
+  int error;              /**< WSA error found when arming, posted by hand */
+} IocpOperation;
+
+struct IocpEntry
+{
+  DBusSocketSetIocp *set;
+  int fd;
+  unsigned int flags;
+  dbus_bool_t enabled;
+  dbus_bool_t removed;    /**< Out of the table, freed once nothing is pending */
+  dbus_bool_t listening;  /**< Readiness comes from accept_event instead */
+  WSAEVENT accept_event;
+  HANDLE accept_wait;
+  LONG accept_posted;     /**< Set by the wait callback, in another thread */
+  IocpOperation read_op;
+  IocpOperation write_op;
+};
+
+struct DBusSocketSetIocp
+{
+  DBusSocketSet parent;
+  HANDLE port;
+  DBusHashTable *entries; /**< fd => IocpEntry */
+  DBusList *unarmed;      /**< Enabled entries that may have something to arm */
+  int n_pending;          /**< Completions still to come, removed entries included */
+};
+
+static dbus_bool_t
+operation_is_wanted (IocpOperation *op)
+{
+  IocpEntry *entry = op->entry;
+
+  return !entry->removed && entry->enabled &&
+    (entry->flags & op->condition) != 0;
+}
+
+static dbus_bool_t
+entry_is_idle (IocpEntry *entry)
+{
+  return !entry->read_op.pending && !entry->write_op.pending;
+}
+
+static void
+stop_accept_wait (IocpEntry *entry)
+{
+  if (entry->accept_wait == NULL)
+    return;
+
+  /* Waits for the callback if it is running, so afterwards
+   * accept_posted says for sure whether a completion is on its way
+   */
+  UnregisterWaitEx (entry->accept_wait, INVALID_HANDLE_VALUE);
+  entry->accept_wait = NULL;
+}
+
+static void
+free_entry (IocpEntry *entry)
+{
+  _dbus_assert (entry_is_idle (entry));
+
+  stop_accept_wait (entry);
+
+  if (entry->accept_event != WSA_INVALID_EVENT)
+    WSACloseEvent (entry->accept_event);
+
+  dbus_free (entry);
+}
+
+static void
+entry_needs_arming (IocpEntry *entry)
+{
+  DBusSocketSetIocp *self = entry->set;
+
+  if (_dbus_list_find_last (&self->unarmed, entry) != NULL)
+    return;
+
+  /* If this fails we just don't hear about the socket until the next
+   * time it is enabled, much like a watch that ran out of memory in
+   * the other backends.
+   */
+  if (!_dbus_list_append (&self->unarmed, entry))
+    _dbus_verbose ("no memory to arm socket %d\n", entry->fd);
+}
+
+static void
+operation_completed (IocpOperation *op)
+{
+  _dbus_assert (op->pending);
+
+  op->pending = FALSE;
+  op->entry->set->n_pending -= 1;
+}
+
+static void CALLBACK
+accept_wait_callback (void    *data,
+                      BOOLEAN  timed_out)
+{
+  IocpOperation *op = data;
+
+  InterlockedExchange (&op->entry->accept_posted, 1);
+  PostQueuedCompletionStatus (op->entry->set->port, 0, 0, &op->overlapped);
+}
+
+static dbus_bool_t
+arm_accept (IocpOperation *op)
+{
+  IocpEntry *entry = op->entry;
+
+  if (entry->accept_event == WSA_INVALID_EVENT)
+    {
+      entry->accept_event = WSACreateEvent ();
+      if (entry->accept_event == WSA_INVALID_EVENT)
+        return FALSE;
+
+      if (WSAEventSelect (entry->fd, entry->accept_event, FD_ACCEPT) != 0)
+        return FALSE;
+    }
+
+  stop_accept_wait (entry);
+  entry->accept_posted = 0;
+
+  if (!RegisterWaitForSingleObject (&entry->accept_wait, entry->accept_event,
+                                    accept_wait_callback, op,
+                                    INFINITE, WT_EXECUTEONLYONCE))
+    {
+      entry->accept_wait = NULL;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+arm_operation (IocpOperation *op)
+{
+  DBusSocketSetIocp *self = op->entry->set;
+  IocpEntry *entry = op->entry;
+  WSABUF buf;
+  DWORD bytes;
+  DWORD flags;
+  int status;
+
+  _dbus_assert (!op->pending);
+
+  memset (&op->overlapped, 0, sizeof (op->overlapped));
+  op->error = 0;
+
+  if (op->condition == DBUS_WATCH_READABLE && entry->listening)
+    {
+      if (!arm_accept (op))
+        {
+          _dbus_verbose ("could not wait for connections on socket %d\n",
+                         entry->fd);
+          return;
+        }
+
+      op->pending = TRUE;
+      self->n_pending += 1;
+      return;
+    }
+
+  buf.buf = NULL;
+  buf.len = 0;
+  flags = 0;
+
+  if (op->condition == DBUS_WATCH_READABLE)
+    status = WSARecv (entry->fd, &buf, 1, &bytes, &flags,
+                      &op->overlapped, NULL);
+  else
+    status = WSASend (entry->fd, &buf, 1, &bytes, 0,
+                      &op->overlapped, NULL);
+
+  op->pending = TRUE;
+  self->n_pending += 1;
+
+  /* Success and WSA_IO_PENDING both mean a completion is on its way */
+  if (status == 0 || WSAGetLastError () == WSA_IO_PENDING)
+    return;
+
+  op->error = WSAGetLastError ();
+
+  if (op->condition == DBUS_WATCH_READABLE && op->error == WSAENOTCONN)
+    {
+      op->pending = FALSE;
+      self->n_pending -= 1;
+      entry->listening = TRUE;
+      arm_operation (op);
+      return;
+    }
+
+  /* Nothing is queued for an operation that failed at once, but the
+   * caller still has to hear about it, so queue it ourselves
+   */
+  if (!PostQueuedCompletionStatus (self->port, 0, 0, &op->overlapped))
+    {
+      _dbus_verbose ("could not arm socket %d: %d\n", entry->fd, op->error);
+      op->pending = FALSE;
+      self->n_pending -= 1;
+    }
+}
+
+static void
+arm_entry (IocpEntry *entry)
+{
+  if (!entry->read_op.pending && operation_is_wanted (&entry->read_op))
+    arm_operation (&entry->read_op);
+
+  if (!entry->write_op.pending && operation_is_wanted (&entry->write_op))
+    arm_operation (&entry->write_op);
+}
+
+static void
+cancel_entry (IocpEntry *entry)
+{
+  /* If the socket is already closed this fails, but then closing it
+   * cancelled everything anyway
+   */
+  CancelIo ((HANDLE) entry->fd);
+
+  if (entry->listening && entry->read_op.pending)
+    {
+      stop_accept_wait (entry);
+
+      if (!entry->accept_posted)
+        operation_completed (&entry->read_op);
+    }
+}
+
+/* Whether the operation found the socket ready, and how */
+static unsigned int
+completion_condition (IocpOperation *op,
+                      DWORD          error)
+{
+  IocpEntry *entry = op->entry;
+  WSANETWORKEVENTS network_events;
+
+  if (error == ERROR_OPERATION_ABORTED)
+    return 0;
+
+  /* Reset, aborted by the peer and the like; saying it is readable or
+   * writable as well makes the transport try, and find out why
+   */
+  if (error != 0)
+    return op->condition | DBUS_WATCH_HANGUP;
+
+  if (entry->listening && op == &entry->read_op)
+    {
+      /* Resets the event; accept() makes FD_ACCEPT happen again */
+      if (WSAEnumNetworkEvents (entry->fd, entry->accept_event,
+                                &network_events) != 0)
+        return DBUS_WATCH_ERROR;
+
+      if ((network_events.lNetworkEvents & FD_ACCEPT) == 0)
+        return 0;
+    }
+
+  return op->condition;
+}
+
+/* Dequeues one completion. Returns the operation if it is one to look
+ * at, or NULL if it was for something no longer in the set or there
+ * was nothing; *done_p says which.
+ */
+static IocpOperation *
+dequeue_completion (DBusSocketSetIocp *self,
+                    DWORD              timeout,
+                    DWORD             *error_p,
+                    dbus_bool_t       *done_p)
+{
+  DWORD bytes;
+  ULONG_PTR key;
+  OVERLAPPED *overlapped;
+  IocpOperation *op;
+  IocpEntry *entry;
+
+  *done_p = FALSE;
+
+  if (GetQueuedCompletionStatus (self->port, &bytes, &key, &overlapped,
+                                 timeout))
+    *error_p = 0;
+  else
+    *error_p = GetLastError ();
+
+  if (overlapped == NULL)
+    {
+      *done_p = TRUE;
+      return NULL;
+    }
+
+  op = (IocpOperation *) overlapped;
+  entry = op->entry;
+  operation_completed (op);
+
+  if (*error_p == 0)
+    *error_p = op->error;
+
+  if (entry->removed)
+    {
+      if (entry_is_idle (entry))
+        free_entry (entry);
+      return NULL;
+    }
+
+  return op;
+}
+
+static void
+socket_set_iocp_free (DBusSocketSet *set)
+{
+  DBusSocketSetIocp *self = (DBusSocketSetIocp *) set;
+
+  _dbus_list_clear (&self->unarmed);
+
+  if (self->entries != NULL)
+    {
+      DBusHashIter iter;
+
+      _dbus_hash_iter_init (self->entries, &iter);
+      while (_dbus_hash_iter_next (&iter))
+        {
+          IocpEntry *entry = _dbus_hash_iter_get_value (&iter);
+
+          entry->removed = TRUE;
+          cancel_entry (entry);
+          _dbus_hash_iter_remove_entry (&iter);
+
+          if (entry_is_idle (entry))
+            free_entry (entry);
+        }
+
+      _dbus_hash_table_unref (self->entries);
+    }
+
+  /* Everything cancelled (or removed earlier and still pending) will
+   * complete into memory we are about to free, so wait for all of it
+   */
+  while (self->n_pending > 0)
+    {
+      DWORD error;
+      dbus_bool_t done;
+
+      dequeue_completion (self, INFINITE, &error, &done);
+      if (done)
+        {
+          _dbus_warn ("lost track of %d socket operations\n",
+                      self->n_pending);
+          break;
+        }
+    }
+
+  if (self->port != NULL)
+    CloseHandle (self->port);
+
+  dbus_free (self);
+}
+
+static dbus_bool_t
+socket_set_iocp_add (DBusSocketSet *set,
+                     int            fd,
+                     unsigned int   flags,
+                     dbus_bool_t    enabled)
+{
+  DBusSocketSetIocp *self = (DBusSocketSetIocp *) set;
+  IocpEntry *entry;
+
+  entry = dbus_new0 (IocpEntry, 1);
+  if (entry == NULL)
+    return FALSE;
+
+  entry->set = self;
+  entry->fd = fd;
+  entry->flags = flags;
+  entry->enabled = enabled;
+  entry->accept_event = WSA_INVALID_EVENT;
+  entry->read_op.entry = entry;
+  entry->read_op.condition = DBUS_WATCH_READABLE;
+  entry->write_op.entry = entry;
+  entry->write_op.condition = DBUS_WATCH_WRITABLE;
+
+  /* A socket can't be taken off a port, so one that was in the set
+   * before is still associated with it, which is fine: completions
+   * find their entry through the OVERLAPPED, not the key.
+   */
+  if (CreateIoCompletionPort ((HANDLE) fd, self->port, 0, 0) == NULL &&
+      GetLastError () != ERROR_INVALID_PARAMETER)
+    {
+      _dbus_verbose ("could not add socket %d to the completion port: %lu\n",
+                     fd, GetLastError ());
+      dbus_free (entry);
+      return FALSE;
+    }
+
+  if (!_dbus_hash_table_insert_int (self->entries, fd, entry))
+    {
+      dbus_free (entry);
+      return FALSE;
+    }
+
+  if (enabled)
+    entry_needs_arming (entry);
+
+  return TRUE;
+}
+
+static void
+socket_set_iocp_remove (DBusSocketSet *set,
+                        int            fd)
+{
+  DBusSocketSetIocp *self = (DBusSocketSetIocp *) set;
+  IocpEntry *entry;
+
+  entry = _dbus_hash_table_lookup_int (self->entries, fd);
+  if (entry == NULL)
+    return;
+
+  entry->removed = TRUE;
+  _dbus_list_remove (&self->unarmed, entry);
+  _dbus_hash_table_remove_int (self->entries, fd);
+
+  /* An entry with something still pending is freed when the
+   * completion comes in
+   */
+  if (!entry_is_idle (entry))
+    cancel_entry (entry);
+
+  if (entry_is_idle (entry))
+    free_entry (entry);
+}
+
+static void
+socket_set_iocp_enable (DBusSocketSet *set,
+                        int            fd,
+                        unsigned int   flags)
+{
+  DBusSocketSetIocp *self = (DBusSocketSetIocp *) set;
+  IocpEntry *entry;
+
+  entry = _dbus_hash_table_lookup_int (self->entries, fd);
+  if (entry == NULL)
+    {
+      _dbus_warn_check_failed ("socket %d is not in the set\n", fd);
+      return;
+    }
+
+  entry->flags = flags;
+  entry->enabled = TRUE;
+  entry_needs_arming (entry);
+}
+
+static void
+socket_set_iocp_disable (DBusSocketSet *set,
+                         int            fd)
+{
+  DBusSocketSetIocp *self = (DBusSocketSetIocp *) set;
+  IocpEntry *entry;
+
+  entry = _dbus_hash_table_lookup_int (self->entries, fd);
+  if (entry == NULL)
+    {
+      _dbus_warn_check_failed ("socket %d is not in the set\n", fd);
+      return;
+    }
+
+  /* Whatever is armed stays armed; if it completes in the meantime it
+   * just isn't reported, and it is armed again when the socket is
+   * enabled, which finds out whether the socket is still ready.
+   */
+  entry->enabled = FALSE;
+  _dbus_list_remove (&self->unarmed, entry);
+}
+
+static int
+socket_set_iocp_poll (DBusSocketSet   *set,
+                      DBusSocketEvent *revents,
+                      int              max_events,
+                      int              timeout_milliseconds)
+{
+  DBusSocketSetIocp *self = (DBusSocketSetIocp *) set;
+  DWORD timeout;
+  int n_events;
+
+  while (self->unarmed != NULL)
+    arm_entry (_dbus_list_pop_first (&self->unarmed));
+
+  timeout = timeout_milliseconds < 0 ? INFINITE : timeout_milliseconds;
+  n_events = 0;
+
+  while (n_events < max_events)
+    {
+      IocpOperation *op;
+      IocpEntry *entry;
+      unsigned int condition;
+      DWORD error;
+      dbus_bool_t done;
+      int i;
+
+      op = dequeue_completion (self, timeout, &error, &done);
+
+      if (done)
+        {
+          if (error == WAIT_TIMEOUT || n_events > 0)
+            break;
+
+          /* Same contract as _dbus_poll(): the caller looks at errno */
+          _dbus_verbose ("GetQueuedCompletionStatus failed: %lu\n", error);
+          errno = EINVAL;
+          return -1;
+        }
+
+      /* Only block for the first one, then take whatever else is
+       * already there
+       */
+      timeout = 0;
+
+      if (op == NULL || !operation_is_wanted (op))
+        continue;
+
+      entry = op->entry;
+
+      condition = completion_condition (op, error);
+      if (condition == 0)
+        {
+          /* Nothing after all; wait again */
+          arm_operation (op);
+          continue;
+        }
+
+      /* Reported operations are armed again next time round, after
+       * the caller has had its chance to read or write
+       */
+      entry_needs_arming (entry);
+
+      for (i = 0; i < n_events; i++)
+        {
+          if (revents[i].fd == entry->fd)
+            break;
+        }
+
+      if (i == n_events)
+        {
+          revents[i].fd = entry->fd;
+          revents[i].flags = 0;
+          n_events += 1;
+        }
+
+      revents[i].flags |= condition;
+    }
+
+  return n_events;
+}
+
+static const DBusSocketSetClass socket_set_iocp_class = {
+  socket_set_iocp_free,
+  socket_set_iocp_add,
+  socket_set_iocp_remove,
+  socket_set_iocp_enable,
+  socket_set_iocp_disable,
+  socket_set_iocp_poll
+};
+
+DBusSocketSet *
+_dbus_socket_set_iocp_new (void)
+{
+  DBusSocketSetIocp *self;
+
+  self = dbus_new0 (DBusSocketSetIocp, 1);
+  if (self == NULL)
+    return NULL;
+
+  self->parent.cls = &socket_set_iocp_class;
+
+  self->entries = _dbus_hash_table_new (DBUS_HASH_INT, NULL, NULL);
+  if (self->entries == NULL)
+    {
+      socket_set_iocp_free ((DBusSocketSet *) self);
+      return NULL;
+    }
+
+  /* Only the thread running the loop ever dequeues */
+  self->port = CreateIoCompletionPort (INVALID_HANDLE_VALUE, NULL, 0, 1);
+  if (self->port == NULL)
+    {
+      _dbus_verbose ("CreateIoCompletionPort failed: %lu\n", GetLastError ());
+      socket_set_iocp_free ((DBusSocketSet *) self);
+      return NULL;
+    }
+
+  return (DBusSocketSet *) self;
+}
+
+#endif /* DBUS_HAVE_IOCP */
+
+#endif /* !DOXYGEN_SHOULD_SKIP_THIS */
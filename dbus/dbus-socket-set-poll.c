@@ -0,0 +1,277 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-socket-set-poll.c  DBusSocketSet backed by poll()
+ *
+ * Copyright (C) 2003, 2004  Red Hat, Inc.
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "dbus-socket-set.h"
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-sysdeps.h>
+
+/* poll() is O(n) in the number of descriptors anyway, so this backend
+ * just keeps a flat array; what it saves over the old main loop is
+ * re-reading every DBusWatch on each iteration.
+ */
+typedef struct
+{
+  DBusSocketSet parent;
+
+  /* Every fd in the set; events is 0 for disabled ones */
+  DBusPollFD *fds;
+  /* Scratch array holding just the enabled fds, passed to _dbus_poll() */
+  DBusPollFD *polled;
+  int n_fds;
+  int n_allocated;
+} DBusSocketSetPoll;
+
+#define MINIMUM_SIZE 8
+
+static short
+watch_flags_to_poll_events (unsigned int flags)
+{
+  short events = 0;
+
+  if (flags & DBUS_WATCH_READABLE)
+    events |= _DBUS_POLLIN;
+  if (flags & DBUS_WATCH_WRITABLE)
+    events |= _DBUS_POLLOUT;
+
+  return events;
+}
+
+static unsigned int
+watch_flags_from_poll_revents (short revents)
+{
+  unsigned int condition = 0;
+
+  if (revents & _DBUS_POLLIN)
+    condition |= DBUS_WATCH_READABLE;
+  if (revents & _DBUS_POLLOUT)
+    condition |= DBUS_WATCH_WRITABLE;
+  if (revents & _DBUS_POLLHUP)
+    condition |= DBUS_WATCH_HANGUP;
+  if (revents & _DBUS_POLLERR)
+    condition |= DBUS_WATCH_ERROR;
+
+  /* condition may still be 0 if we got some
+   * weird POLLFOO thing like POLLWRBAND
+   */
+  return condition;
+}
+
+static DBusPollFD *
+socket_set_poll_find (DBusSocketSetPoll *self,
+                      int                fd)
+{
+  int i;
+
+  for (i = 0; i < self->n_fds; i++)
+    {
+      if (self->fds[i].fd == fd)
+        return self->fds + i;
+    }
+
+  return NULL;
+}
+
+static void
+socket_set_poll_free (DBusSocketSet *set)
+{
+  DBusSocketSetPoll *self = (DBusSocketSetPoll *) set;
+
+  dbus_free (self->fds);
+  dbus_free (self->polled);
+  dbus_free (self);
+}
+
+static dbus_bool_t
+socket_set_poll_add (DBusSocketSet *set,
+                     int            fd,
+                     unsigned int   flags,
+                     dbus_bool_t    enabled)
+{
+  DBusSocketSetPoll *self = (DBusSocketSetPoll *) set;
+
+  _dbus_assert (socket_set_poll_find (self, fd) == NULL);
+
+  if (self->n_fds == self->n_allocated)
+    {
+      int new_size = self->n_allocated * 2;
+      DBusPollFD *new_fds;
+
+      new_fds = dbus_realloc (self->fds, sizeof (DBusPollFD) * new_size);
+      if (new_fds == NULL)
+        return FALSE;
+      self->fds = new_fds;
+
+      new_fds = dbus_realloc (self->polled, sizeof (DBusPollFD) * new_size);
+      if (new_fds == NULL)
+        return FALSE;
+      self->polled = new_fds;
+
+      self->n_allocated = new_size;
+    }
+
+  self->fds[self->n_fds].fd = fd;
+  self->fds[self->n_fds].events =
+    enabled ? watch_flags_to_poll_events (flags) : 0;
+  self->fds[self->n_fds].revents = 0;
+  self->n_fds += 1;
+
+  return TRUE;
+}
+
+static void
+socket_set_poll_remove (DBusSocketSet *set,
+                        int            fd)
+{
+  DBusSocketSetPoll *self = (DBusSocketSetPoll *) set;
+  DBusPollFD *pfd;
+
+  pfd = socket_set_poll_find (self, fd);
+  _dbus_assert (pfd != NULL);
+
+  /* order doesn't matter, so fill the hole with the last entry */
+  self->n_fds -= 1;
+  *pfd = self->fds[self->n_fds];
+}
+
+static void
+socket_set_poll_enable (DBusSocketSet *set,
+                        int            fd,
+                        unsigned int   flags)
+{
+  DBusSocketSetPoll *self = (DBusSocketSetPoll *) set;
+  DBusPollFD *pfd;
+
+  pfd = socket_set_poll_find (self, fd);
+  _dbus_assert (pfd != NULL);
+
+  pfd->events = watch_flags_to_poll_events (flags);
+}
+
+static void
+socket_set_poll_disable (DBusSocketSet *set,
+                         int            fd)
+{
+  DBusSocketSetPoll *self = (DBusSocketSetPoll *) set;
+  DBusPollFD *pfd;
+
+  pfd = socket_set_poll_find (self, fd);
+  _dbus_assert (pfd != NULL);
+
+  pfd->events = 0;
+}
+
+static int
+socket_set_poll_poll (DBusSocketSet   *set,
+                      DBusSocketEvent *revents,
+                      int              max_events,
+                      int              timeout_milliseconds)
+{
+  DBusSocketSetPoll *self = (DBusSocketSetPoll *) set;
+  int n_polled;
+  int n_ready;
+  int n_events;
+  int i;
+
+  /* Disabled fds are left out entirely; poll() would otherwise still
+   * report POLLHUP/POLLERR on them, and nobody would handle it.
+   */
+  n_polled = 0;
+  for (i = 0; i < self->n_fds; i++)
+    {
+      if (self->fds[i].events != 0)
+        {
+          self->polled[n_polled] = self->fds[i];
+          self->polled[n_polled].revents = 0;
+          n_polled += 1;
+        }
+    }
+
+  n_ready = _dbus_poll (self->polled, n_polled, timeout_milliseconds);
+
+  if (n_ready <= 0)
+    return n_ready;
+
+  n_events = 0;
+  for (i = 0; i < n_polled && n_events < max_events; i++)
+    {
+      unsigned int condition;
+
+      if (self->polled[i].revents == 0)
+        continue;
+
+      condition = watch_flags_from_poll_revents (self->polled[i].revents);
+      if (condition == 0)
+        continue;
+
+      /* Anything past max_events is reported next time round, since
+       * poll() is level-triggered.
+       */
+      revents[n_events].fd = self->polled[i].fd;
+      revents[n_events].flags = condition;
+      n_events += 1;
+    }
+
+  return n_events;
+}
+
+static const DBusSocketSetClass socket_set_poll_class = {
+  socket_set_poll_free,
+  socket_set_poll_add,
+  socket_set_poll_remove,
+  socket_set_poll_enable,
+  socket_set_poll_disable,
+  socket_set_poll_poll
+};
+
+DBusSocketSet *
+_dbus_socket_set_poll_new (int size_hint)
+{
+  DBusSocketSetPoll *self;
+
+  if (size_hint < MINIMUM_SIZE)
+    size_hint = MINIMUM_SIZE;
+
+  self = dbus_new0 (DBusSocketSetPoll, 1);
+  if (self == NULL)
+    return NULL;
+
+  self->parent.cls = &socket_set_poll_class;
+  self->n_allocated = size_hint;
+
+  self->fds = dbus_new0 (DBusPollFD, size_hint);
+  self->polled = dbus_new0 (DBusPollFD, size_hint);
+
+  if (self->fds == NULL || self->polled == NULL)
+    {
+      socket_set_poll_free ((DBusSocketSet *) self);
+      return NULL;
+    }
+
+  return (DBusSocketSet *) self;
+}
+
+#endif /* !DOXYGEN_SHOULD_SKIP_THIS */
@@ -0,0 +1,218 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-socket-set.c  Sets of file descriptors to wait on, for DBusLoop
+ *
+ * Copyright (C) 2003, 2004  Red Hat, Inc.
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <config.h>
+#include "dbus-socket-set.h"
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-sysdeps.h>
+
+DBusSocketSet *
+_dbus_socket_set_new (int size_hint)
+{
+  DBusSocketSet *set;
+
+#ifdef DBUS_HAVE_LINUX_EPOLL
+  /* epoll_create() can fail at runtime even where it was available at
+   * build time (old kernel, fd limit), so poll() is always the fallback.
+   */
+  set = _dbus_socket_set_epoll_new ();
+  if (set != NULL)
+    return set;
+#endif
+
+#ifdef DBUS_HAVE_IOCP
+  /* select() can only wait for FD_SETSIZE sockets at once */
+  set = _dbus_socket_set_iocp_new ();
+  if (set != NULL)
+    return set;
+#endif
+
+  set = _dbus_socket_set_poll_new (size_hint);
+
+  return set;
+}
+
+void
+_dbus_socket_set_free (DBusSocketSet *set)
+{
+  (* set->cls->free) (set);
+}
+
+dbus_bool_t
+_dbus_socket_set_add (DBusSocketSet *set,
+                      int            fd,
+                      unsigned int   flags,
+                      dbus_bool_t    enabled)
+{
+  return (* set->cls->add) (set, fd, flags, enabled);
+}
+
+void
+_dbus_socket_set_remove (DBusSocketSet *set,
+                         int            fd)
+{
+  (* set->cls->remove) (set, fd);
+}
+
+void
+_dbus_socket_set_enable (DBusSocketSet *set,
+                         int            fd,
+                         unsigned int   flags)
+{
+  (* set->cls->enable) (set, fd, flags);
+}
+
+void
+_dbus_socket_set_disable (DBusSocketSet *set,
+                          int            fd)
+{
+  (* set->cls->disable) (set, fd);
+}
+
+int
+_dbus_socket_set_poll (DBusSocketSet   *set,
+                       DBusSocketEvent *revents,
+                       int              max_events,
+                       int              timeout_milliseconds)
+{
+  _dbus_assert (max_events > 0);
+
+  return (* set->cls->poll) (set, revents, max_events, timeout_milliseconds);
+}
+
+#ifdef DBUS_BUILD_TESTS
+#include "dbus-test.h"
+#include <stdio.h>
+
+#ifdef DBUS_UNIX
+static dbus_bool_t
+find_event (DBusSocketEvent *events,
+            int              n_events,
+            int              fd,
+            unsigned int     flags)
+{
+  int i;
+
+  for (i = 0; i < n_events; i++)
+    {
+      if (events[i].fd == fd)
+        return (events[i].flags & flags) == flags;
+    }
+
+  return FALSE;
+}
+
+static void
+check_socket_set (DBusSocketSet *set)
+{
+  DBusSocketEvent events[8];
+  DBusString buf;
+  int a, b;
+  int n;
+
+  if (!_dbus_full_duplex_pipe (&a, &b, FALSE, NULL))
+    _dbus_assert_not_reached ("could not create socket pair");
+
+  if (!_dbus_socket_set_add (set, a, DBUS_WATCH_READABLE, TRUE) ||
+      !_dbus_socket_set_add (set, b, DBUS_WATCH_WRITABLE, FALSE))
+    _dbus_assert_not_reached ("no memory to add fds");
+
+  /* nothing to read, and b isn't enabled */
+  n = _dbus_socket_set_poll (set, events, _DBUS_N_ELEMENTS (events), 0);
+  _dbus_assert (n == 0);
+
+  _dbus_socket_set_enable (set, b, DBUS_WATCH_WRITABLE);
+  n = _dbus_socket_set_poll (set, events, _DBUS_N_ELEMENTS (events), 0);
+  _dbus_assert (n == 1);
+  _dbus_assert (find_event (events, n, b, DBUS_WATCH_WRITABLE));
+
+  _dbus_string_init_const (&buf, "x");
+  if (_dbus_write_socket (b, &buf, 0, 1) != 1)
+    _dbus_assert_not_reached ("could not write to socket pair");
+
+  n = _dbus_socket_set_poll (set, events, _DBUS_N_ELEMENTS (events), -1);
+  _dbus_assert (n == 2);
+  _dbus_assert (find_event (events, n, a, DBUS_WATCH_READABLE));
+
+  /* level-triggered: still readable, but only one slot to report it */
+  n = _dbus_socket_set_poll (set, events, 1, 0);
+  _dbus_assert (n == 1);
+
+  _dbus_socket_set_disable (set, b);
+  n = _dbus_socket_set_poll (set, events, _DBUS_N_ELEMENTS (events), 0);
+  _dbus_assert (n == 1);
+  _dbus_assert (find_event (events, n, a, DBUS_WATCH_READABLE));
+
+  /* a disabled fd must not be reported even when its peer hangs up */
+  _dbus_socket_set_disable (set, a);
+  _dbus_close_socket (b, NULL);
+  _dbus_socket_set_remove (set, b);
+  n = _dbus_socket_set_poll (set, events, _DBUS_N_ELEMENTS (events), 0);
+  _dbus_assert (n == 0 || (n == 1 && events[0].fd == a));
+  n = _dbus_socket_set_poll (set, events, _DBUS_N_ELEMENTS (events), 0);
+  _dbus_assert (n == 0);
+
+  _dbus_socket_set_enable (set, a, DBUS_WATCH_READABLE);
+  n = _dbus_socket_set_poll (set, events, _DBUS_N_ELEMENTS (events), 0);
+  _dbus_assert (n == 1);
+  _dbus_assert (find_event (events, n, a, DBUS_WATCH_READABLE));
+
+  _dbus_socket_set_remove (set, a);
+  _dbus_close_socket (a, NULL);
+
+  n = _dbus_socket_set_poll (set, events, _DBUS_N_ELEMENTS (events), 0);
+  _dbus_assert (n == 0);
+
+  _dbus_socket_set_free (set);
+}
+#endif /* DBUS_UNIX */
+
+dbus_bool_t
+_dbus_socket_set_test (void)
+{
+#ifdef DBUS_UNIX
+  DBusSocketSet *set;
+
+  set = _dbus_socket_set_poll_new (0);
+  if (set == NULL)
+    _dbus_assert_not_reached ("no memory for poll socket set");
+  check_socket_set (set);
+
+#ifdef DBUS_HAVE_LINUX_EPOLL
+  set = _dbus_socket_set_epoll_new ();
+  if (set != NULL)
+    check_socket_set (set);
+  else
+    printf ("  epoll not available, only tested poll\n");
+#endif
+#endif /* DBUS_UNIX */
+
+  return TRUE;
+}
+
+#endif /* DBUS_BUILD_TESTS */
+
+#endif /* !DOXYGEN_SHOULD_SKIP_THIS */
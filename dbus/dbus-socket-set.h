@@ -0,0 +1,106 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus-socket-set.h  Sets of file descriptors to wait on, for DBusLoop
+ *
+ * Copyright (C) 2003, 2004  Red Hat, Inc.
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef DBUS_SOCKET_SET_H
+#define DBUS_SOCKET_SET_H
+
+#ifndef DOXYGEN_SHOULD_SKIP_THIS
+
+#include <dbus/dbus.h>
+
+/* I/O completion ports need Windows NT; CE doesn't have them */
+#if defined(DBUS_WIN) && !defined(DBUS_WINCE)
+#define DBUS_HAVE_IOCP 1
+#endif
+
+/* One ready file descriptor, as reported by _dbus_socket_set_poll();
+ * flags are DBusWatchFlags.
+ */
+typedef struct
+{
+  int fd;
+  unsigned int flags;
+} DBusSocketEvent;
+
+typedef struct DBusSocketSet DBusSocketSet;
+
+/* A backend. The set keeps, for each fd, the DBusWatchFlags it is
+ * interested in, so that waiting doesn't require walking every watch.
+ * A disabled fd stays in the set (so re-enabling it can't fail) but is
+ * never reported.
+ */
+typedef struct
+{
+  void        (* free)    (DBusSocketSet   *set);
+  dbus_bool_t (* add)     (DBusSocketSet   *set,
+                           int              fd,
+                           unsigned int     flags,
+                           dbus_bool_t      enabled);
+  void        (* remove)  (DBusSocketSet   *set,
+                           int              fd);
+  void        (* enable)  (DBusSocketSet   *set,
+                           int              fd,
+                           unsigned int     flags);
+  void        (* disable) (DBusSocketSet   *set,
+                           int              fd);
+  int         (* poll)    (DBusSocketSet   *set,
+                           DBusSocketEvent *revents,
+                           int              max_events,
+                           int              timeout_milliseconds);
+} DBusSocketSetClass;
+
+struct DBusSocketSet
+{
+  const DBusSocketSetClass *cls;
+};
+
+DBusSocketSet *_dbus_socket_set_new     (int              size_hint);
+void           _dbus_socket_set_free    (DBusSocketSet   *set);
+dbus_bool_t    _dbus_socket_set_add     (DBusSocketSet   *set,
+                                         int              fd,
+                                         unsigned int     flags,
+                                         dbus_bool_t      enabled);
+void           _dbus_socket_set_remove  (DBusSocketSet   *set,
+                                         int              fd);
+void           _dbus_socket_set_enable  (DBusSocketSet   *set,
+                                         int              fd,
+                                         unsigned int     flags);
+void           _dbus_socket_set_disable (DBusSocketSet   *set,
+                                         int              fd);
+int            _dbus_socket_set_poll    (DBusSocketSet   *set,
+                                         DBusSocketEvent *revents,
+                                         int              max_events,
+                                         int              timeout_milliseconds);
+
+/* The individual backends, exposed for the benefit of the tests */
+DBusSocketSet *_dbus_socket_set_poll_new  (int size_hint);
+#ifdef DBUS_HAVE_LINUX_EPOLL
+DBusSocketSet *_dbus_socket_set_epoll_new (void);
+#endif
+#ifdef DBUS_HAVE_IOCP
+DBusSocketSet *_dbus_socket_set_iocp_new  (void);
+#endif
+
+#endif /* !DOXYGEN_SHOULD_SKIP_THIS */
+
+#endif /* DBUS_SOCKET_SET_H */
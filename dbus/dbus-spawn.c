@@ -29,6 +29,7 @@
 #include "dbus-internals.h"
 #include "dbus-test.h"
 #include "dbus-protocol.h"
+#include "dbus-list.h"
 
 #include <unistd.h>
 #include <fcntl.h>
@@ -118,72 +119,24 @@ read_ints (int        fd,
   return retval;
 }
 
-static ReadStatus
-read_pid (int        fd,
-          pid_t     *buf,
-          DBusError *error)
-{
-  size_t bytes = 0;    
-  ReadStatus retval;
-  
-  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
-
-  retval = READ_STATUS_OK;
-  
-  while (TRUE)
-    {
-      ssize_t chunk;
-      size_t to_read;
-
-      to_read = sizeof (pid_t) - bytes;
-
-      if (to_read == 0)
-        break;
-
-    again:
-      
-      chunk = read (fd,
-                    ((char*)buf) + bytes,
-                    to_read);
-      if (chunk < 0 && errno == EINTR)
-        goto again;
-          
-      if (chunk < 0)
-        {
-          dbus_set_error (error,
-			  DBUS_ERROR_SPAWN_FAILED,
-			  "Failed to read from child pipe (%s)",
-			  _dbus_strerror (errno));
-
-          retval = READ_STATUS_ERROR;
-          break;
-        }
-      else if (chunk == 0)
-        {
-          retval = READ_STATUS_EOF;
-          break; /* EOF */
-        }
-      else /* chunk > 0 */
-	bytes += chunk;
-    }
-
-  return retval;
-}
-
-/* The implementation uses an intermediate child between the main process
- * and the grandchild. The grandchild is our spawned process. The intermediate
- * child is a babysitter process; it keeps track of when the grandchild
- * exits/crashes, and reaps the grandchild.
+/* The spawned process is a direct child of the calling process, which
+ * acts as its babysitter; it keeps track of when the child
+ * exits/crashes, and reaps it. Where possible the child is created with
+ * vfork(), so the cost of launching it does not grow with the size of
+ * the calling process.
+ *
+ * All children share a single SIGCHLD handler, which writes to a pipe
+ * that every babysitter watches. Whichever babysitter is woken up by
+ * it checks on the children of all of them, once per wakeup. A vfork()
+ * child shares our memory until it exec()s, so it reports exec()
+ * failure by storing errno for us; only a forked child needs its own
+ * error pipe.
  */
 
-/* Messages from children to parents */
-enum
-{
-  CHILD_EXITED,            /* This message is followed by the exit status int */
-  CHILD_FORK_FAILED,       /* Followed by errno */
-  CHILD_EXEC_FAILED,       /* Followed by errno */
-  CHILD_PID                /* Followed by pid_t */
-};
+/** Helps remember which end of the pipe is which */
+#define READ_END 0
+/** Helps remember which end of the pipe is which */
+#define WRITE_END 1
 
 /**
  * Babysitter implementation details
@@ -193,25 +146,37 @@ struct DBusBabysitter
   int refcount; /**< Reference count */
 
   char *executable; /**< executable name to use in error messages */
-  
-  int socket_to_babysitter; /**< Connection to the babysitter process */
+
   int error_pipe_from_child; /**< Connection to the process that does the exec() */
-  
-  pid_t sitter_pid;  /**< PID Of the babysitter */
-  pid_t grandchild_pid; /**< PID of the grandchild */
+
+  pid_t child_pid; /**< PID of the child */
+
+  DBusList *child_link; /**< Link in the list of children whose exit has not been noticed */
 
   DBusWatchList *watches; /**< Watches */
 
   DBusWatch *error_watch; /**< Error pipe watch */
-  DBusWatch *sitter_watch; /**< Sitter pipe watch */
+  DBusWatch *sigchld_watch; /**< SIGCHLD pipe watch */
 
   int errnum; /**< Error number */
   int status; /**< Exit status code */
   unsigned int have_child_status : 1; /**< True if child status has been reaped */
-  unsigned int have_fork_errnum : 1; /**< True if we have an error code from fork() */
   unsigned int have_exec_errnum : 1; /**< True if we have an error code from exec() */
+  unsigned int child_reaped : 1; /**< True if the child is gone, even if we got no status */
 };
 
+/* All of these are protected by the spawn lock, except that the
+ * signal handler writes to sigchld_pipe[WRITE_END] without it.
+ */
+static int sigchld_pipe[2] = { -1, -1 };
+static struct sigaction old_sigchld_action;
+/* Babysitters whose child has not exited, or has exited
+ * without the babysitter noticing yet
+ */
+static DBusList *unnoticed_children = NULL;
+/* PIDs of children whose babysitter went away before they exited */
+static DBusList *orphaned_children = NULL;
+
 static DBusBabysitter*
 _dbus_babysitter_new (void)
 {
@@ -223,16 +188,14 @@ _dbus_babysitter_new (void)
 
   sitter->refcount = 1;
 
-  sitter->socket_to_babysitter = -1;
   sitter->error_pipe_from_child = -1;
-  
-  sitter->sitter_pid = -1;
-  sitter->grandchild_pid = -1;
+
+  sitter->child_pid = -1;
 
   sitter->watches = _dbus_watch_list_new ();
   if (sitter->watches == NULL)
     goto failed;
-  
+
   return sitter;
 
  failed:
@@ -251,17 +214,68 @@ _dbus_babysitter_ref (DBusBabysitter *sitter)
 {
   _dbus_assert (sitter != NULL);
   _dbus_assert (sitter->refcount > 0);
-  
+
   sitter->refcount += 1;
 
   return sitter;
 }
 
+static void
+close_error_pipe_from_child (DBusBabysitter *sitter)
+{
+  _dbus_verbose ("Closing child error\n");
+
+  /* Stop watching the fd before it can be reused for another child */
+  if (sitter->error_watch != NULL)
+    _dbus_watch_list_remove_watch (sitter->watches, sitter->error_watch);
+
+  _dbus_close_socket (sitter->error_pipe_from_child, NULL);
+  sitter->error_pipe_from_child = -1;
+}
+
+/* Returns TRUE if the child is gone; *have_status says whether
+ * we were the ones to reap it, in which case *status is set.
+ */
+static dbus_bool_t
+try_reap_child (pid_t        pid,
+                int         *status,
+                dbus_bool_t *have_status)
+{
+  pid_t ret;
+
+  do
+    {
+      ret = waitpid (pid, status, WNOHANG);
+      /* The man page says EINTR can't happen with WNOHANG,
+       * but there are reports of it (maybe only with valgrind?)
+       */
+    }
+  while (ret < 0 && errno == EINTR);
+
+  if (ret == 0)
+    return FALSE;
+
+  if (ret < 0)
+    {
+      /* Somebody else reaped it, e.g. because SIGCHLD is ignored */
+      _dbus_warn ("unexpected waitpid() failure for child %ld: %s\n",
+                  (long) pid, _dbus_strerror (errno));
+      *have_status = FALSE;
+    }
+  else
+    {
+      _dbus_verbose ("reaped child pid %ld\n", (long) ret);
+      *have_status = TRUE;
+    }
+
+  return TRUE;
+}
+
 /**
  * Decrement the reference count on the babysitter object.
  * When the reference count of the babysitter object reaches
- * zero, the babysitter is killed and the child that was being
- * babysat gets emancipated.
+ * zero, the child that was being babysat gets emancipated;
+ * it is still reaped when it exits.
  *
  * @param sitter the babysitter
  */
@@ -270,78 +284,39 @@ _dbus_babysitter_unref (DBusBabysitter *sitter)
 {
   _dbus_assert (sitter != NULL);
   _dbus_assert (sitter->refcount > 0);
-  
+
   sitter->refcount -= 1;
   if (sitter->refcount == 0)
-    {      
-      if (sitter->socket_to_babysitter >= 0)
-        {
-          /* If we haven't forked other babysitters
-           * since this babysitter and socket were
-           * created then this close will cause the
-           * babysitter to wake up from poll with
-           * a hangup and then the babysitter will
-           * quit itself.
-           */
-          _dbus_close_socket (sitter->socket_to_babysitter, NULL);
-          sitter->socket_to_babysitter = -1;
-        }
-
+    {
       if (sitter->error_pipe_from_child >= 0)
-        {
-          _dbus_close_socket (sitter->error_pipe_from_child, NULL);
-          sitter->error_pipe_from_child = -1;
-        }
+        close_error_pipe_from_child (sitter);
 
-      if (sitter->sitter_pid > 0)
+      if (sitter->child_link != NULL)
         {
           int status;
-          int ret;
+          dbus_bool_t have_status;
 
-          /* It's possible the babysitter died on its own above 
-           * from the close, or was killed randomly
-           * by some other process, so first try to reap it
-           */
-          ret = waitpid (sitter->sitter_pid, &status, WNOHANG);
+          _DBUS_LOCK (spawn);
 
-          /* If we couldn't reap the child then kill it, and
-           * try again
-           */
-          if (ret == 0)
-            kill (sitter->sitter_pid, SIGKILL);
+          _dbus_list_unlink (&unnoticed_children, sitter->child_link);
 
-        again:
-          if (ret == 0)
-            ret = waitpid (sitter->sitter_pid, &status, 0);
-
-          if (ret < 0)
+          if (sitter->child_reaped ||
+              try_reap_child (sitter->child_pid, &status, &have_status))
             {
-              if (errno == EINTR)
-                goto again;
-              else if (errno == ECHILD)
-                _dbus_warn ("Babysitter process not available to be reaped; should not happen\n");
-              else
-                _dbus_warn ("Unexpected error %d in waitpid() for babysitter: %s\n",
-                            errno, _dbus_strerror (errno));
+              _dbus_list_free_link (sitter->child_link);
             }
           else
             {
-              _dbus_verbose ("Reaped %ld, waiting for babysitter %ld\n",
-                             (long) ret, (long) sitter->sitter_pid);
-              
-              if (WIFEXITED (sitter->status))
-                _dbus_verbose ("Babysitter exited with status %d\n",
-                               WEXITSTATUS (sitter->status));
-              else if (WIFSIGNALED (sitter->status))
-                _dbus_verbose ("Babysitter received signal %d\n",
-                               WTERMSIG (sitter->status));
-              else
-                _dbus_verbose ("Babysitter exited abnormally\n");
+              /* Reuse the link, so this can't fail */
+              sitter->child_link->data = _DBUS_INT_TO_POINTER (sitter->child_pid);
+              _dbus_list_append_link (&orphaned_children, sitter->child_link);
             }
 
-          sitter->sitter_pid = -1;
+          _DBUS_UNLOCK (spawn);
+
+          sitter->child_link = NULL;
         }
-      
+
       if (sitter->error_watch)
         {
           _dbus_watch_invalidate (sitter->error_watch);
@@ -349,18 +324,18 @@ _dbus_babysitter_unref (DBusBabysitter *sitter)
           sitter->error_watch = NULL;
         }
 
-      if (sitter->sitter_watch)
+      if (sitter->sigchld_watch)
         {
-          _dbus_watch_invalidate (sitter->sitter_watch);
-          _dbus_watch_unref (sitter->sitter_watch);
-          sitter->sitter_watch = NULL;
+          _dbus_watch_invalidate (sitter->sigchld_watch);
+          _dbus_watch_unref (sitter->sigchld_watch);
+          sitter->sigchld_watch = NULL;
         }
-      
+
       if (sitter->watches)
         _dbus_watch_list_free (sitter->watches);
 
       dbus_free (sitter->executable);
-      
+
       dbus_free (sitter);
     }
 }
@@ -369,12 +344,13 @@ static ReadStatus
 read_data (DBusBabysitter *sitter,
            int             fd)
 {
-  int what;
+  int errnum;
   int got;
   DBusError error = DBUS_ERROR_INIT;
   ReadStatus r;
 
-  r = read_ints (fd, &what, 1, &got, &error);
+  /* The child only ever sends us the errno of a failed exec() */
+  r = read_ints (fd, &errnum, 1, &got, &error);
 
   switch (r)
     {
@@ -389,152 +365,309 @@ read_data (DBusBabysitter *sitter,
     case READ_STATUS_OK:
       break;
     }
-  
+
   if (got == 1)
     {
-      switch (what)
-        {
-        case CHILD_EXITED:
-        case CHILD_FORK_FAILED:
-        case CHILD_EXEC_FAILED:
-          {
-            int arg;
-            
-            r = read_ints (fd, &arg, 1, &got, &error);
-
-            switch (r)
-              {
-              case READ_STATUS_ERROR:
-                _dbus_warn ("Failed to read arg from fd %d: %s\n", fd, error.message);
-                dbus_error_free (&error);
-                return r;
-              case READ_STATUS_EOF:
-                return r;
-              case READ_STATUS_OK:
-                break;
-              }
-            
-            if (got == 1)
-              {
-                if (what == CHILD_EXITED)
-                  {
-                    sitter->have_child_status = TRUE;
-                    sitter->status = arg;
-                    sitter->errnum = 0;
-                    _dbus_verbose ("recorded child status exited = %d signaled = %d exitstatus = %d termsig = %d\n",
-                                   WIFEXITED (sitter->status), WIFSIGNALED (sitter->status),
-                                   WEXITSTATUS (sitter->status), WTERMSIG (sitter->status));
-                  }
-                else if (what == CHILD_FORK_FAILED)
-                  {
-                    sitter->have_fork_errnum = TRUE;
-                    sitter->errnum = arg;
-                    _dbus_verbose ("recorded fork errnum %d\n", sitter->errnum);
-                  }
-                else if (what == CHILD_EXEC_FAILED)
-                  {
-                    sitter->have_exec_errnum = TRUE;
-                    sitter->errnum = arg;
-                    _dbus_verbose ("recorded exec errnum %d\n", sitter->errnum);
-                  }
-              }
-          }
-          break;
-        case CHILD_PID:
-          {
-            pid_t pid = -1;
-
-            r = read_pid (fd, &pid, &error);
-            
-            switch (r)
-              {
-              case READ_STATUS_ERROR:
-                _dbus_warn ("Failed to read PID from fd %d: %s\n", fd, error.message);
-                dbus_error_free (&error);
-                return r;
-              case READ_STATUS_EOF:
-                return r;
-              case READ_STATUS_OK:
-                break;
-              }
-            
-            sitter->grandchild_pid = pid;
-            
-            _dbus_verbose ("recorded grandchild pid %d\n", sitter->grandchild_pid);
-          }
-          break;
-        default:
-          _dbus_warn ("Unknown message received from babysitter process\n");
-          break;
-        }
+      sitter->have_exec_errnum = TRUE;
+      sitter->errnum = errnum;
+      _dbus_verbose ("recorded exec errnum %d\n", sitter->errnum);
     }
 
   return r;
 }
 
 static void
-close_socket_to_babysitter (DBusBabysitter *sitter)
+handle_error_pipe (DBusBabysitter *sitter,
+                   int             revents)
 {
-  _dbus_verbose ("Closing babysitter\n");
-  _dbus_close_socket (sitter->socket_to_babysitter, NULL);
-  sitter->socket_to_babysitter = -1;
+  /* Even if we have POLLHUP, we want to keep reading
+   * data until POLLIN goes away; so this function only
+   * looks at HUP/ERR if no IN is set.
+   */
+  if (revents & _DBUS_POLLIN)
+    {
+      _dbus_verbose ("Reading data from child error\n");
+      if (read_data (sitter, sitter->error_pipe_from_child) != READ_STATUS_OK)
+        close_error_pipe_from_child (sitter);
+    }
+  else if (revents & (_DBUS_POLLERR | _DBUS_POLLHUP))
+    {
+      close_error_pipe_from_child (sitter);
+    }
 }
 
 static void
-close_error_pipe_from_child (DBusBabysitter *sitter)
+wake_sigchld_pipe (void)
 {
-  _dbus_verbose ("Closing child error\n");
-  _dbus_close_socket (sitter->error_pipe_from_child, NULL);
-  sitter->error_pipe_from_child = -1;
+  char b = '\0';
+
+  /* The pipe is nonblocking; if it's full, a wakeup is pending anyway */
+ again:
+  if (write (sigchld_pipe[WRITE_END], &b, 1) < 0)
+    if (errno == EINTR)
+      goto again;
 }
 
 static void
-handle_babysitter_socket (DBusBabysitter *sitter,
-                          int             revents)
+sigchld_handler (int        signo,
+                 siginfo_t *info,
+                 void      *context)
 {
-  /* Even if we have POLLHUP, we want to keep reading
-   * data until POLLIN goes away; so this function only
-   * looks at HUP/ERR if no IN is set.
-   */
-  if (revents & _DBUS_POLLIN)
+  int saved_errno = errno;
+
+  wake_sigchld_pipe ();
+
+  if (old_sigchld_action.sa_flags & SA_SIGINFO)
+    (* old_sigchld_action.sa_sigaction) (signo, info, context);
+  else if (old_sigchld_action.sa_handler != SIG_DFL &&
+           old_sigchld_action.sa_handler != SIG_IGN)
+    (* old_sigchld_action.sa_handler) (signo);
+
+  errno = saved_errno;
+}
+
+/* Avoids a danger in threaded situations (calling close()
+ * on a file descriptor twice, and another thread has
+ * re-opened it since the first close)
+ */
+static int
+close_and_invalidate (int *fd)
+{
+  int ret;
+
+  if (*fd < 0)
+    return -1;
+  else
     {
-      _dbus_verbose ("Reading data from babysitter\n");
-      if (read_data (sitter, sitter->socket_to_babysitter) != READ_STATUS_OK)
-        close_socket_to_babysitter (sitter);
+      ret = _dbus_close_socket (*fd, NULL);
+      *fd = -1;
     }
-  else if (revents & (_DBUS_POLLERR | _DBUS_POLLHUP))
+
+  return ret;
+}
+
+static dbus_bool_t
+make_pipe (int         p[2],
+           DBusError  *error)
+{
+  int retval;
+
+#ifdef HAVE_PIPE2
+  dbus_bool_t cloexec_done;
+
+  retval = pipe2 (p, O_CLOEXEC);
+  cloexec_done = retval >= 0;
+
+  /* Check if kernel seems to be too old to know pipe2(). We assume
+     that if pipe2 is available, O_CLOEXEC is too.  */
+  if (retval < 0 && errno == ENOSYS)
+#endif
     {
-      close_socket_to_babysitter (sitter);
+      retval = pipe(p);
     }
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (retval < 0)
+    {
+      dbus_set_error (error,
+		      DBUS_ERROR_SPAWN_FAILED,
+		      "Failed to create pipe for communicating with child process (%s)",
+		      _dbus_strerror (errno));
+      return FALSE;
+    }
+
+#ifdef HAVE_PIPE2
+  if (!cloexec_done)
+#endif
+    {
+      _dbus_fd_set_close_on_exec (p[0]);
+      _dbus_fd_set_close_on_exec (p[1]);
+    }
+
+  return TRUE;
 }
 
 static void
-handle_error_pipe (DBusBabysitter *sitter,
-                   int             revents)
+shutdown_sigchld_pipe (void *data)
 {
-  if (revents & _DBUS_POLLIN)
+  _DBUS_LOCK (spawn);
+
+  /* Children still running now are left for init to reap */
+  _dbus_list_clear (&orphaned_children);
+
+  sigaction (SIGCHLD, &old_sigchld_action, NULL);
+
+  close_and_invalidate (&sigchld_pipe[READ_END]);
+  close_and_invalidate (&sigchld_pipe[WRITE_END]);
+
+  _DBUS_UNLOCK (spawn);
+}
+
+/* Called with the spawn lock held */
+static dbus_bool_t
+ensure_sigchld_pipe (DBusError *error)
+{
+  struct sigaction act;
+
+  if (sigchld_pipe[READ_END] >= 0)
+    return TRUE;
+
+  if (!make_pipe (sigchld_pipe, error))
+    return FALSE;
+
+  if (!_dbus_set_fd_nonblocking (sigchld_pipe[READ_END], error) ||
+      !_dbus_set_fd_nonblocking (sigchld_pipe[WRITE_END], error))
+    goto failed;
+
+  if (!_dbus_register_shutdown_func (shutdown_sigchld_pipe, NULL))
     {
-      _dbus_verbose ("Reading data from child error\n");
-      if (read_data (sitter, sitter->error_pipe_from_child) != READ_STATUS_OK)
-        close_error_pipe_from_child (sitter);
+      dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+      goto failed;
     }
-  else if (revents & (_DBUS_POLLERR | _DBUS_POLLHUP))
+
+  /* If SIGCHLD was being ignored, our own children would
+   * have been reaped by the kernel before we could get
+   * their status, so that is replaced as well.
+   */
+  sigemptyset (&act.sa_mask);
+  act.sa_sigaction = sigchld_handler;
+  act.sa_flags = SA_SIGINFO | SA_RESTART | SA_NOCLDSTOP;
+  sigaction (SIGCHLD, &act, &old_sigchld_action);
+
+  return TRUE;
+
+ failed:
+  close_and_invalidate (&sigchld_pipe[READ_END]);
+  close_and_invalidate (&sigchld_pipe[WRITE_END]);
+  return FALSE;
+}
+
+/* Called with the spawn lock held */
+static void
+reap_children_unlocked (void)
+{
+  DBusList *link;
+  char buf[16];
+  ssize_t chunk;
+  size_t n_read;
+  dbus_bool_t have_unnoticed_exits;
+
+  /* Drain the pipe before looking at the children, so a SIGCHLD
+   * that arrives while we do leaves it readable again
+   */
+  n_read = 0;
+  while ((chunk = read (sigchld_pipe[READ_END], buf, sizeof (buf))) > 0)
+    n_read += chunk;
+
+  /* Children are only reaped after a SIGCHLD; if another babysitter
+   * already drained the pipe, it also looked at ours
+   */
+  if (n_read == 0)
+    return;
+
+  have_unnoticed_exits = FALSE;
+
+  link = _dbus_list_get_first_link (&unnoticed_children);
+  while (link != NULL)
     {
-      close_error_pipe_from_child (sitter);
+      DBusBabysitter *sitter = link->data;
+      int status;
+      dbus_bool_t have_status;
+
+      if (!sitter->child_reaped &&
+          try_reap_child (sitter->child_pid, &status, &have_status))
+        {
+          sitter->child_reaped = TRUE;
+
+          if (have_status)
+            {
+              sitter->have_child_status = TRUE;
+              sitter->status = status;
+              _dbus_verbose ("recorded child status exited = %d signaled = %d exitstatus = %d termsig = %d\n",
+                             WIFEXITED (sitter->status), WIFSIGNALED (sitter->status),
+                             WEXITSTATUS (sitter->status), WTERMSIG (sitter->status));
+            }
+        }
+
+      if (sitter->child_reaped)
+        have_unnoticed_exits = TRUE;
+
+      link = _dbus_list_get_next_link (&unnoticed_children, link);
     }
+
+  link = _dbus_list_get_first_link (&orphaned_children);
+  while (link != NULL)
+    {
+      DBusList *next = _dbus_list_get_next_link (&orphaned_children, link);
+      int status;
+      dbus_bool_t have_status;
+
+      if (try_reap_child (_DBUS_POINTER_TO_INT (link->data),
+                          &status, &have_status))
+        _dbus_list_remove_link (&orphaned_children, link);
+
+      link = next;
+    }
+
+  /* The watch that woke us up may have belonged to a different
+   * babysitter, so keep the pipe readable until each one whose
+   * child exited has had a chance to look
+   */
+  if (have_unnoticed_exits)
+    wake_sigchld_pipe ();
 }
 
-/* returns whether there were any poll events handled */
+/* Reaps any children that have exited, and if ours is one of
+ * them, stops watching for further exits.
+ */
+static void
+check_child_exited (DBusBabysitter *sitter)
+{
+  dbus_bool_t noticed;
+
+  if (sitter->child_link == NULL)
+    return;
+
+  noticed = FALSE;
+
+  _DBUS_LOCK (spawn);
+
+  reap_children_unlocked ();
+
+  if (sitter->child_reaped)
+    {
+      _dbus_list_unlink (&unnoticed_children, sitter->child_link);
+      _dbus_list_free_link (sitter->child_link);
+      sitter->child_link = NULL;
+      noticed = TRUE;
+    }
+
+  _DBUS_UNLOCK (spawn);
+
+  if (noticed && sitter->sigchld_watch != NULL)
+    _dbus_watch_list_toggle_watch (sitter->watches, sitter->sigchld_watch, FALSE);
+}
+
+/* returns whether there was any progress on this babysitter */
 static dbus_bool_t
 babysitter_iteration (DBusBabysitter *sitter,
                       dbus_bool_t     block)
 {
   DBusPollFD fds[2];
   int i;
-  dbus_bool_t descriptors_ready;
+  dbus_bool_t progress;
+
+  progress = FALSE;
+
+  /* Be sure we don't block for an exit that already happened */
+  if (sitter->child_link != NULL)
+    {
+      check_child_exited (sitter);
+      if (sitter->child_link == NULL)
+        progress = TRUE;
+    }
 
-  descriptors_ready = FALSE;
-  
   i = 0;
 
   if (sitter->error_pipe_from_child >= 0)
@@ -544,10 +677,10 @@ babysitter_iteration (DBusBabysitter *sitter,
       fds[i].revents = 0;
       ++i;
     }
-  
-  if (sitter->socket_to_babysitter >= 0)
+
+  if (sitter->child_link != NULL)
     {
-      fds[i].fd = sitter->socket_to_babysitter;
+      fds[i].fd = sigchld_pipe[READ_END];
       fds[i].events = _DBUS_POLLIN;
       fds[i].revents = 0;
       ++i;
@@ -563,7 +696,7 @@ babysitter_iteration (DBusBabysitter *sitter,
         }
       while (ret < 0 && errno == EINTR);
 
-      if (ret == 0 && block)
+      if (ret == 0 && block && !progress)
         {
           do
             {
@@ -574,49 +707,54 @@ babysitter_iteration (DBusBabysitter *sitter,
 
       if (ret > 0)
         {
-          descriptors_ready = TRUE;
-          
           while (i > 0)
             {
               --i;
+              if (fds[i].revents == 0)
+                continue;
+
               if (fds[i].fd == sitter->error_pipe_from_child)
-                handle_error_pipe (sitter, fds[i].revents);
-              else if (fds[i].fd == sitter->socket_to_babysitter)
-                handle_babysitter_socket (sitter, fds[i].revents);
+                {
+                  handle_error_pipe (sitter, fds[i].revents);
+                  progress = TRUE;
+                }
+              else if (sitter->child_link != NULL)
+                {
+                  /* Readable on behalf of some other babysitter's
+                   * child is not progress for us
+                   */
+                  check_child_exited (sitter);
+                  if (sitter->child_link == NULL)
+                    progress = TRUE;
+                }
             }
         }
     }
 
-  return descriptors_ready;
+  return progress;
 }
 
 /**
- * Macro returns #TRUE if the babysitter still has live sockets open to the
- * babysitter child or the grandchild.
+ * Macro returns #TRUE if the child is still running, or might
+ * still report an exec() error.
  */
-#define LIVE_CHILDREN(sitter) ((sitter)->socket_to_babysitter >= 0 || (sitter)->error_pipe_from_child >= 0)
+#define LIVE_CHILDREN(sitter) ((sitter)->child_link != NULL || (sitter)->error_pipe_from_child >= 0)
 
 /**
- * Blocks until the babysitter process gives us the PID of the spawned grandchild,
- * then kills the spawned grandchild.
+ * Kills the spawned child, unless it has already been reaped.
  *
  * @param sitter the babysitter object
  */
 void
 _dbus_babysitter_kill_child (DBusBabysitter *sitter)
 {
-  /* be sure we have the PID of the child */
-  while (LIVE_CHILDREN (sitter) &&
-         sitter->grandchild_pid == -1)
-    babysitter_iteration (sitter, TRUE);
-
   _dbus_verbose ("Got child PID %ld for killing\n",
-                 (long) sitter->grandchild_pid);
-  
-  if (sitter->grandchild_pid == -1)
-    return; /* child is already dead, or we're so hosed we'll never recover */
+                 (long) sitter->child_pid);
+
+  if (sitter->child_reaped)
+    return; /* child is already dead, and the PID may be reused */
 
-  kill (sitter->grandchild_pid, SIGKILL);
+  kill (sitter->child_pid, SIGKILL);
 }
 
 /**
@@ -633,8 +771,10 @@ _dbus_babysitter_get_child_exited (DBusBabysitter *sitter)
          babysitter_iteration (sitter, FALSE))
     ;
 
-  /* We will have exited the babysitter when the child has exited */
-  return sitter->socket_to_babysitter < 0;
+  /* The child writes an exec() error before it exits, so once
+   * it is gone and the pipe is closed we know everything
+   */
+  return !LIVE_CHILDREN (sitter);
 }
 
 /**
@@ -655,7 +795,7 @@ _dbus_babysitter_get_child_exit_status (DBusBabysitter *sitter,
 {
   if (!_dbus_babysitter_get_child_exited (sitter))
     _dbus_assert_not_reached ("Child has not exited");
-  
+
   if (!sitter->have_child_status ||
       !(WIFEXITED (sitter->status)))
     return FALSE;
@@ -681,8 +821,8 @@ _dbus_babysitter_set_child_exit_error (DBusBabysitter *sitter,
     return;
 
   /* Note that if exec fails, we will also get a child status
-   * from the babysitter saying the child exited,
-   * so we need to give priority to the exec error
+   * saying the child exited, so we need to give priority to
+   * the exec error
    */
   if (sitter->have_exec_errnum)
     {
@@ -690,12 +830,6 @@ _dbus_babysitter_set_child_exit_error (DBusBabysitter *sitter,
                       "Failed to execute program %s: %s",
                       sitter->executable, _dbus_strerror (sitter->errnum));
     }
-  else if (sitter->have_fork_errnum)
-    {
-      dbus_set_error (error, DBUS_ERROR_NO_MEMORY,
-                      "Failed to fork a new process %s: %s",
-                      sitter->executable, _dbus_strerror (sitter->errnum));
-    }
   else if (sitter->have_child_status)
     {
       if (WIFEXITED (sitter->status))
@@ -705,395 +839,151 @@ _dbus_babysitter_set_child_exit_error (DBusBabysitter *sitter,
       else if (WIFSIGNALED (sitter->status))
         dbus_set_error (error, DBUS_ERROR_SPAWN_CHILD_SIGNALED,
                         "Process %s received signal %d",
-                        sitter->executable, WTERMSIG (sitter->status));
-      else
-        dbus_set_error (error, DBUS_ERROR_FAILED,
-                        "Process %s exited abnormally",
-                        sitter->executable);
-    }
-  else
-    {
-      dbus_set_error (error, DBUS_ERROR_FAILED,
-                      "Process %s exited, reason unknown",
-                      sitter->executable);
-    }
-}
-
-/**
- * Sets watch functions to notify us when the
- * babysitter object needs to read/write file descriptors.
- *
- * @param sitter the babysitter
- * @param add_function function to begin monitoring a new descriptor.
- * @param remove_function function to stop monitoring a descriptor.
- * @param toggled_function function to notify when the watch is enabled/disabled
- * @param data data to pass to add_function and remove_function.
- * @param free_data_function function to be called to free the data.
- * @returns #FALSE on failure (no memory)
- */
-dbus_bool_t
-_dbus_babysitter_set_watch_functions (DBusBabysitter            *sitter,
-                                      DBusAddWatchFunction       add_function,
-                                      DBusRemoveWatchFunction    remove_function,
-                                      DBusWatchToggledFunction   toggled_function,
-                                      void                      *data,
-                                      DBusFreeFunction           free_data_function)
-{
-  return _dbus_watch_list_set_functions (sitter->watches,
-                                         add_function,
-                                         remove_function,
-                                         toggled_function,
-                                         data,
-                                         free_data_function);
-}
-
-static dbus_bool_t
-handle_watch (DBusWatch       *watch,
-              unsigned int     condition,
-              void            *data)
-{
-  DBusBabysitter *sitter = data;
-  int revents;
-  int fd;
-  
-  revents = 0;
-  if (condition & DBUS_WATCH_READABLE)
-    revents |= _DBUS_POLLIN;
-  if (condition & DBUS_WATCH_ERROR)
-    revents |= _DBUS_POLLERR;
-  if (condition & DBUS_WATCH_HANGUP)
-    revents |= _DBUS_POLLHUP;
-
-  fd = dbus_watch_get_socket (watch);
-
-  if (fd == sitter->error_pipe_from_child)
-    handle_error_pipe (sitter, revents);
-  else if (fd == sitter->socket_to_babysitter)
-    handle_babysitter_socket (sitter, revents);
-
-  while (LIVE_CHILDREN (sitter) &&
-         babysitter_iteration (sitter, FALSE))
-    ;
-  
-  return TRUE;
-}
-
-/** Helps remember which end of the pipe is which */
-#define READ_END 0
-/** Helps remember which end of the pipe is which */
-#define WRITE_END 1
-
-
-/* Avoids a danger in threaded situations (calling close()
- * on a file descriptor twice, and another thread has
- * re-opened it since the first close)
- */
-static int
-close_and_invalidate (int *fd)
-{
-  int ret;
-
-  if (*fd < 0)
-    return -1;
-  else
-    {
-      ret = _dbus_close_socket (*fd, NULL);
-      *fd = -1;
-    }
-
-  return ret;
-}
-
-static dbus_bool_t
-make_pipe (int         p[2],
-           DBusError  *error)
-{
-  int retval;
-
-#ifdef HAVE_PIPE2
-  dbus_bool_t cloexec_done;
-
-  retval = pipe2 (p, O_CLOEXEC);
-  cloexec_done = retval >= 0;
-
-  /* Check if kernel seems to be too old to know pipe2(). We assume
-     that if pipe2 is available, O_CLOEXEC is too.  */
-  if (retval < 0 && errno == ENOSYS)
-#endif
-    {
-      retval = pipe(p);
-    }
-
-  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
-
-  if (retval < 0)
-    {
-      dbus_set_error (error,
-		      DBUS_ERROR_SPAWN_FAILED,
-		      "Failed to create pipe for communicating with child process (%s)",
-		      _dbus_strerror (errno));
-      return FALSE;
-    }
-
-#ifdef HAVE_PIPE2
-  if (!cloexec_done)
-#endif
-    {
-      _dbus_fd_set_close_on_exec (p[0]);
-      _dbus_fd_set_close_on_exec (p[1]);
-    }
-
-  return TRUE;
-}
-
-static void
-do_write (int fd, const void *buf, size_t count)
-{
-  size_t bytes_written;
-  int ret;
-  
-  bytes_written = 0;
-  
- again:
-  
-  ret = write (fd, ((const char*)buf) + bytes_written, count - bytes_written);
-
-  if (ret < 0)
-    {
-      if (errno == EINTR)
-        goto again;
+                        sitter->executable, WTERMSIG (sitter->status));
       else
-        {
-          _dbus_warn ("Failed to write data to pipe!\n");
-          exit (1); /* give up, we suck */
-        }
+        dbus_set_error (error, DBUS_ERROR_FAILED,
+                        "Process %s exited abnormally",
+                        sitter->executable);
     }
   else
-    bytes_written += ret;
-  
-  if (bytes_written < count)
-    goto again;
+    {
+      dbus_set_error (error, DBUS_ERROR_FAILED,
+                      "Process %s exited, reason unknown",
+                      sitter->executable);
+    }
 }
 
-static void
-write_err_and_exit (int fd, int msg)
+/**
+ * Sets watch functions to notify us when the
+ * babysitter object needs to read/write file descriptors.
+ *
+ * @param sitter the babysitter
+ * @param add_function function to begin monitoring a new descriptor.
+ * @param remove_function function to stop monitoring a descriptor.
+ * @param toggled_function function to notify when the watch is enabled/disabled
+ * @param data data to pass to add_function and remove_function.
+ * @param free_data_function function to be called to free the data.
+ * @returns #FALSE on failure (no memory)
+ */
+dbus_bool_t
+_dbus_babysitter_set_watch_functions (DBusBabysitter            *sitter,
+                                      DBusAddWatchFunction       add_function,
+                                      DBusRemoveWatchFunction    remove_function,
+                                      DBusWatchToggledFunction   toggled_function,
+                                      void                      *data,
+                                      DBusFreeFunction           free_data_function)
 {
-  int en = errno;
-
-  do_write (fd, &msg, sizeof (msg));
-  do_write (fd, &en, sizeof (en));
-  
-  exit (1);
+  return _dbus_watch_list_set_functions (sitter->watches,
+                                         add_function,
+                                         remove_function,
+                                         toggled_function,
+                                         data,
+                                         free_data_function);
 }
 
-static void
-write_pid (int fd, pid_t pid)
+static dbus_bool_t
+handle_watch (DBusWatch       *watch,
+              unsigned int     condition,
+              void            *data)
 {
-  int msg = CHILD_PID;
-  
-  do_write (fd, &msg, sizeof (msg));
-  do_write (fd, &pid, sizeof (pid));
-}
+  DBusBabysitter *sitter = data;
+  int revents;
 
-static void
-write_status_and_exit (int fd, int status)
-{
-  int msg = CHILD_EXITED;
-  
-  do_write (fd, &msg, sizeof (msg));
-  do_write (fd, &status, sizeof (status));
-  
-  exit (0);
+  revents = 0;
+  if (condition & DBUS_WATCH_READABLE)
+    revents |= _DBUS_POLLIN;
+  if (condition & DBUS_WATCH_ERROR)
+    revents |= _DBUS_POLLERR;
+  if (condition & DBUS_WATCH_HANGUP)
+    revents |= _DBUS_POLLHUP;
+
+  if (watch == sitter->error_watch)
+    {
+      if (sitter->error_pipe_from_child >= 0)
+        handle_error_pipe (sitter, revents);
+    }
+  else if (watch == sitter->sigchld_watch)
+    check_child_exited (sitter);
+
+  while (LIVE_CHILDREN (sitter) &&
+         babysitter_iteration (sitter, FALSE))
+    ;
+
+  return TRUE;
 }
 
+#ifdef DBUS_BUILD_TESTS
 static void
-do_exec (int                       child_err_report_fd,
-	 char                    **argv,
-	 char                    **envp,
-	 DBusSpawnChildSetupFunc   child_setup,
-	 void                     *user_data)
+check_close_on_exec (int child_err_report_fd)
 {
-#ifdef DBUS_BUILD_TESTS
   int i, max_open;
-#endif
-
-  _dbus_verbose_reset ();
-  _dbus_verbose ("Child process has PID " DBUS_PID_FORMAT "\n",
-                 _dbus_getpid ());
-  
-  if (child_setup)
-    (* child_setup) (user_data);
 
-#ifdef DBUS_BUILD_TESTS
   max_open = sysconf (_SC_OPEN_MAX);
-  
+
   for (i = 3; i < max_open; i++)
     {
       int retval;
 
       if (i == child_err_report_fd)
         continue;
-      
+
       retval = fcntl (i, F_GETFD);
 
       if (retval != -1 && !(retval & FD_CLOEXEC))
 	_dbus_warn ("Fd %d did not have the close-on-exec flag set!\n", i);
     }
-#endif
-
-  if (envp == NULL)
-    {
-      _dbus_assert (environ != NULL);
-
-      envp = environ;
-    }
-  
-  execve (argv[0], argv, envp);
-  
-  /* Exec failed */
-  write_err_and_exit (child_err_report_fd,
-                      CHILD_EXEC_FAILED);
 }
+#endif
 
+/* This may run in a vfork() child sharing our memory, so unless
+ * there's a child_setup function it must stick to async-signal-safe
+ * calls, and it must never return. A vfork() child passes exec_errnum
+ * to report exec() failure in, anything else the error pipe.
+ */
 static void
-check_babysit_events (pid_t grandchild_pid,
-                      int   parent_pipe,
-                      int   revents)
+do_exec (int                       child_err_report_fd,
+         volatile int             *exec_errnum,
+	 char                    **argv,
+	 char                    **envp,
+	 DBusSpawnChildSetupFunc   child_setup,
+	 void                     *user_data)
 {
-  pid_t ret;
-  int status;
-  
-  do
-    {
-      ret = waitpid (grandchild_pid, &status, WNOHANG);
-      /* The man page says EINTR can't happen with WNOHANG,
-       * but there are reports of it (maybe only with valgrind?)
-       */
-    }
-  while (ret < 0 && errno == EINTR);
+  int en;
 
-  if (ret == 0)
-    {
-      _dbus_verbose ("no child exited\n");
-      
-      ; /* no child exited */
-    }
-  else if (ret < 0)
-    {
-      /* This isn't supposed to happen. */
-      _dbus_warn ("unexpected waitpid() failure in check_babysit_events(): %s\n",
-                  _dbus_strerror (errno));
-      exit (1);
-    }
-  else if (ret == grandchild_pid)
-    {
-      /* Child exited */
-      _dbus_verbose ("reaped child pid %ld\n", (long) ret);
-      
-      write_status_and_exit (parent_pipe, status);
-    }
-  else
-    {
-      _dbus_warn ("waitpid() reaped pid %d that we've never heard of\n",
-                  (int) ret);
-      exit (1);
-    }
+  /* Don't pass on our SIGPIPE disposition to the child */
+  signal (SIGPIPE, SIG_DFL);
 
-  if (revents & _DBUS_POLLIN)
-    {
-      _dbus_verbose ("babysitter got POLLIN from parent pipe\n");
-    }
+  if (child_setup)
+    (* child_setup) (user_data);
 
-  if (revents & (_DBUS_POLLERR | _DBUS_POLLHUP))
+  if (envp == NULL)
     {
-      /* Parent is gone, so we just exit */
-      _dbus_verbose ("babysitter got POLLERR or POLLHUP from parent\n");
-      exit (0);
-    }
-}
-
-static int babysit_sigchld_pipe = -1;
-
-static void
-babysit_signal_handler (int signo)
-{
-  char b = '\0';
- again:
-  if (write (babysit_sigchld_pipe, &b, 1) <= 0) 
-    if (errno == EINTR)
-      goto again;
-}
-
-static void
-babysit (pid_t grandchild_pid,
-         int   parent_pipe)
-{
-  int sigchld_pipe[2];
+      _dbus_assert (environ != NULL);
 
-  /* We don't exec, so we keep parent state, such as the pid that
-   * _dbus_verbose() uses. Reset the pid here.
-   */
-  _dbus_verbose_reset ();
-  
-  /* I thought SIGCHLD would just wake up the poll, but
-   * that didn't seem to work, so added this pipe.
-   * Probably the pipe is more likely to work on busted
-   * operating systems anyhow.
-   */
-  if (pipe (sigchld_pipe) < 0)
-    {
-      _dbus_warn ("Not enough file descriptors to create pipe in babysitter process\n");
-      exit (1);
+      envp = environ;
     }
 
-  babysit_sigchld_pipe = sigchld_pipe[WRITE_END];
-
-  _dbus_set_signal_handler (SIGCHLD, babysit_signal_handler);
-  
-  write_pid (parent_pipe, grandchild_pid);
-
-  check_babysit_events (grandchild_pid, parent_pipe, 0);
-
-  while (TRUE)
-    {
-      DBusPollFD pfds[2];
-      
-      pfds[0].fd = parent_pipe;
-      pfds[0].events = _DBUS_POLLIN;
-      pfds[0].revents = 0;
+  execve (argv[0], argv, envp);
 
-      pfds[1].fd = sigchld_pipe[READ_END];
-      pfds[1].events = _DBUS_POLLIN;
-      pfds[1].revents = 0;
-      
-      if (_dbus_poll (pfds, _DBUS_N_ELEMENTS (pfds), -1) < 0 && errno != EINTR)
-        {
-          _dbus_warn ("_dbus_poll() error: %s\n", strerror (errno));
-          exit (1);
-        }
+  /* Exec failed; an int is written atomically to a pipe */
+  en = errno;
+  if (exec_errnum != NULL)
+    *exec_errnum = en;
+  else
+    while (write (child_err_report_fd, &en, sizeof (en)) < 0 &&
+           errno == EINTR)
+      ;
 
-      if (pfds[0].revents != 0)
-        {
-          check_babysit_events (grandchild_pid, parent_pipe, pfds[0].revents);
-        }
-      else if (pfds[1].revents & _DBUS_POLLIN)
-        {
-          char b;
-          if (read (sigchld_pipe[READ_END], &b, 1) == -1)
-            /* ignore */;
-          /* do waitpid check */
-          check_babysit_events (grandchild_pid, parent_pipe, 0);
-        }
-    }
-  
-  exit (1);
+  _exit (1);
 }
 
 /**
  * Spawns a new process. The executable name and argv[0]
  * are the same, both are provided in argv[0]. The child_setup
  * function is passed the given user_data and is run in the child
- * just before calling exec().
+ * just before calling exec(). Without a child_setup function,
+ * the child is created with vfork() where available; exec() failure
+ * is then reported by this function rather than by the babysitter.
  *
  * Also creates a "babysitter" which tracks the status of the
  * child process, advising the parent if the child exits.
@@ -1118,15 +1008,31 @@ _dbus_spawn_async_with_babysitter (DBusBabysitter          **sitter_p,
 {
   DBusBabysitter *sitter;
   int child_err_report_pipe[2] = { -1, -1 };
-  int babysitter_pipe[2] = { -1, -1 };
+  /* Written by the vfork() child behind the compiler's back */
+  volatile int exec_errnum;
+  dbus_bool_t use_vfork;
+  DBusList *child_link;
+  int sigchld_fd;
   pid_t pid;
-  
+
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
   if (sitter_p != NULL)
     *sitter_p = NULL;
 
   sitter = NULL;
+  child_link = NULL;
+  exec_errnum = 0;
+
+#ifdef HAVE_VFORK
+  /* A child_setup function could do anything, so it gets its own
+   * copy of our memory; otherwise the child just exec()s, and there's
+   * no need to copy the page tables of a possibly large process.
+   */
+  use_vfork = child_setup == NULL;
+#else
+  use_vfork = FALSE;
+#endif
 
   sitter = _dbus_babysitter_new ();
   if (sitter == NULL)
@@ -1141,52 +1047,80 @@ _dbus_spawn_async_with_babysitter (DBusBabysitter          **sitter_p,
       dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
       goto cleanup_and_fail;
     }
-  
-  if (!make_pipe (child_err_report_pipe, error))
-    goto cleanup_and_fail;
 
-  if (!_dbus_full_duplex_pipe (&babysitter_pipe[0], &babysitter_pipe[1], TRUE, error))
+  if (!use_vfork && !make_pipe (child_err_report_pipe, error))
     goto cleanup_and_fail;
 
+  _DBUS_LOCK (spawn);
+  if (!ensure_sigchld_pipe (error))
+    {
+      _DBUS_UNLOCK (spawn);
+      goto cleanup_and_fail;
+    }
+  sigchld_fd = sigchld_pipe[READ_END];
+  _DBUS_UNLOCK (spawn);
+
   /* Setting up the babysitter is only useful in the parent,
    * but we don't want to run out of memory and fail
    * after we've already forked, since then we'd leak
    * child processes everywhere.
    */
-  sitter->error_watch = _dbus_watch_new (child_err_report_pipe[READ_END],
-                                         DBUS_WATCH_READABLE,
-                                         TRUE, handle_watch, sitter, NULL);
-  if (sitter->error_watch == NULL)
+  child_link = _dbus_list_alloc_link (sitter);
+  if (child_link == NULL)
     {
       dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
       goto cleanup_and_fail;
     }
-        
-  if (!_dbus_watch_list_add_watch (sitter->watches,  sitter->error_watch))
+
+  if (!use_vfork)
     {
-      dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
-      goto cleanup_and_fail;
+      sitter->error_watch = _dbus_watch_new (child_err_report_pipe[READ_END],
+                                             DBUS_WATCH_READABLE,
+                                             TRUE, handle_watch, sitter, NULL);
+      if (sitter->error_watch == NULL)
+        {
+          dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+          goto cleanup_and_fail;
+        }
+
+      if (!_dbus_watch_list_add_watch (sitter->watches,  sitter->error_watch))
+        {
+          dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+          goto cleanup_and_fail;
+        }
     }
-      
-  sitter->sitter_watch = _dbus_watch_new (babysitter_pipe[0],
-                                          DBUS_WATCH_READABLE,
-                                          TRUE, handle_watch, sitter, NULL);
-  if (sitter->sitter_watch == NULL)
+
+  sitter->sigchld_watch = _dbus_watch_new (sigchld_fd,
+                                           DBUS_WATCH_READABLE,
+                                           TRUE, handle_watch, sitter, NULL);
+  if (sitter->sigchld_watch == NULL)
     {
       dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
       goto cleanup_and_fail;
     }
-      
-  if (!_dbus_watch_list_add_watch (sitter->watches,  sitter->sitter_watch))
+
+  if (!_dbus_watch_list_add_watch (sitter->watches,  sitter->sigchld_watch))
     {
       dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
       goto cleanup_and_fail;
     }
 
+#ifdef DBUS_BUILD_TESTS
+  /* The child inherits exactly our descriptors, and may not be
+   * able to complain about them itself
+   */
+  check_close_on_exec (child_err_report_pipe[WRITE_END]);
+#endif
+
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
-  
-  pid = fork ();
-  
+
+#ifdef HAVE_VFORK
+  if (use_vfork)
+    pid = vfork ();
+  else
+#endif
+    pid = fork ();
+
   if (pid < 0)
     {
       dbus_set_error (error,
@@ -1197,54 +1131,44 @@ _dbus_spawn_async_with_babysitter (DBusBabysitter          **sitter_p,
     }
   else if (pid == 0)
     {
-      /* Immediate child, this is the babysitter process. */
-      int grandchild_pid;
-      
-      /* Be sure we crash if the parent exits
-       * and we write to the err_report_pipe
-       */
-      signal (SIGPIPE, SIG_DFL);
+      do_exec (child_err_report_pipe[WRITE_END],
+               use_vfork ? &exec_errnum : NULL,
+               argv,
+               env,
+               child_setup, user_data);
+      _dbus_assert_not_reached ("Got to code after exec() - should have exited on error");
+    }
+  else if (exec_errnum != 0)
+    {
+      /* The vfork() child has already given up and is exiting */
+      int status;
 
-      /* Close the parent's end of the pipes. */
-      close_and_invalidate (&child_err_report_pipe[READ_END]);
-      close_and_invalidate (&babysitter_pipe[0]);
-      
-      /* Create the child that will exec () */
-      grandchild_pid = fork ();
-      
-      if (grandchild_pid < 0)
-	{
-	  write_err_and_exit (babysitter_pipe[1],
-			      CHILD_FORK_FAILED);
-          _dbus_assert_not_reached ("Got to code after write_err_and_exit()");
-	}
-      else if (grandchild_pid == 0)
-	{
-	  do_exec (child_err_report_pipe[WRITE_END],
-		   argv,
-		   env,
-		   child_setup, user_data);
-          _dbus_assert_not_reached ("Got to code after exec() - should have exited on error");
-	}
-      else
-	{
-          babysit (grandchild_pid, babysitter_pipe[1]);
-          _dbus_assert_not_reached ("Got to code after babysit()");
-	}
+      while (waitpid (pid, &status, 0) < 0 && errno == EINTR)
+        ;
+
+      dbus_set_error (error, DBUS_ERROR_SPAWN_EXEC_FAILED,
+                      "Failed to execute program %s: %s",
+                      sitter->executable, _dbus_strerror (exec_errnum));
+      goto cleanup_and_fail;
     }
   else
-    {      
-      /* Close the uncared-about ends of the pipes */
+    {
+      /* Close the uncared-about end of the pipe */
       close_and_invalidate (&child_err_report_pipe[WRITE_END]);
-      close_and_invalidate (&babysitter_pipe[1]);
 
-      sitter->socket_to_babysitter = babysitter_pipe[0];
-      babysitter_pipe[0] = -1;
-      
       sitter->error_pipe_from_child = child_err_report_pipe[READ_END];
       child_err_report_pipe[READ_END] = -1;
 
-      sitter->sitter_pid = pid;
+      sitter->child_pid = pid;
+      _dbus_verbose ("Spawned %s as pid %ld\n", sitter->executable, (long) pid);
+
+      /* If it already exited, the SIGCHLD pipe is readable and
+       * the exit will be picked up from there
+       */
+      _DBUS_LOCK (spawn);
+      _dbus_list_append_link (&unnoticed_children, child_link);
+      sitter->child_link = child_link;
+      _DBUS_UNLOCK (spawn);
 
       if (sitter_p != NULL)
         *sitter_p = sitter;
@@ -1254,22 +1178,23 @@ _dbus_spawn_async_with_babysitter (DBusBabysitter          **sitter_p,
       dbus_free_string_array (env);
 
       _DBUS_ASSERT_ERROR_IS_CLEAR (error);
-      
+
       return TRUE;
     }
 
  cleanup_and_fail:
 
   _DBUS_ASSERT_ERROR_IS_SET (error);
-  
+
   close_and_invalidate (&child_err_report_pipe[READ_END]);
   close_and_invalidate (&child_err_report_pipe[WRITE_END]);
-  close_and_invalidate (&babysitter_pipe[0]);
-  close_and_invalidate (&babysitter_pipe[1]);
+
+  if (child_link != NULL)
+    _dbus_list_free_link (child_link);
 
   if (sitter != NULL)
     _dbus_babysitter_unref (sitter);
-  
+
   return FALSE;
 }
 
@@ -1451,6 +1376,85 @@ check_spawn_and_kill (void *data)
   return TRUE;
 }
 
+static dbus_bool_t
+check_spawn_concurrent (void *data)
+{
+  char *exit_argv[4] = { NULL, NULL, NULL, NULL };
+  char *sleep_argv[4] = { NULL, NULL, NULL, NULL };
+  DBusBabysitter *exit_sitter = NULL;
+  DBusBabysitter *sleep_sitter = NULL;
+  DBusError exit_error = DBUS_ERROR_INIT;
+  DBusError sleep_error = DBUS_ERROR_INIT;
+  dbus_bool_t retval;
+
+  /*** Test that children sharing the SIGCHLD pipe are told apart */
+
+  retval = FALSE;
+
+  sleep_argv[0] = TEST_SLEEP_FOREVER_BINARY;
+  if (!_dbus_spawn_async_with_babysitter (&sleep_sitter, sleep_argv,
+                                          NULL, NULL, NULL,
+                                          &sleep_error))
+    goto out;
+
+  exit_argv[0] = TEST_EXIT_BINARY;
+  if (!_dbus_spawn_async_with_babysitter (&exit_sitter, exit_argv,
+                                          NULL, NULL, NULL,
+                                          &exit_error))
+    goto out;
+
+  _dbus_babysitter_block_for_child_exit (exit_sitter);
+
+  if (_dbus_babysitter_get_child_exited (sleep_sitter))
+    {
+      _dbus_warn ("Sleeping child was reported as exited with its sibling\n");
+      goto out;
+    }
+
+  _dbus_babysitter_kill_child (sleep_sitter);
+  _dbus_babysitter_block_for_child_exit (sleep_sitter);
+
+  _dbus_babysitter_set_child_exit_error (exit_sitter, &exit_error);
+  _dbus_babysitter_set_child_exit_error (sleep_sitter, &sleep_error);
+
+  if (dbus_error_has_name (&exit_error, DBUS_ERROR_NO_MEMORY) ||
+      dbus_error_has_name (&sleep_error, DBUS_ERROR_NO_MEMORY))
+    goto out;
+
+  if (!dbus_error_has_name (&exit_error, DBUS_ERROR_SPAWN_CHILD_EXITED) ||
+      !dbus_error_has_name (&sleep_error, DBUS_ERROR_SPAWN_CHILD_SIGNALED))
+    {
+      _dbus_warn ("Not expecting errors from concurrent children: %s, %s\n",
+                  exit_error.name ? exit_error.name : "(none)",
+                  sleep_error.name ? sleep_error.name : "(none)");
+      goto out;
+    }
+
+  retval = TRUE;
+
+ out:
+  if (exit_sitter)
+    _dbus_babysitter_unref (exit_sitter);
+
+  if (sleep_sitter)
+    {
+      _dbus_babysitter_kill_child (sleep_sitter);
+      _dbus_babysitter_block_for_child_exit (sleep_sitter);
+      _dbus_babysitter_unref (sleep_sitter);
+    }
+
+  /* Running out of memory while spawning is fine */
+  if (!retval &&
+      (dbus_error_has_name (&exit_error, DBUS_ERROR_NO_MEMORY) ||
+       dbus_error_has_name (&sleep_error, DBUS_ERROR_NO_MEMORY)))
+    retval = TRUE;
+
+  dbus_error_free (&exit_error);
+  dbus_error_free (&sleep_error);
+
+  return retval;
+}
+
 dbus_bool_t
 _dbus_spawn_test (const char *test_data_dir)
 {
@@ -1473,6 +1477,11 @@ _dbus_spawn_test (const char *test_data_dir)
                                 check_spawn_and_kill,
                                 NULL))
     return FALSE;
+
+  if (!_dbus_test_oom_handling ("spawn_concurrent",
+                                check_spawn_concurrent,
+                                NULL))
+    return FALSE;
   
   return TRUE;
 }
@@ -38,6 +38,10 @@ DBUS_BEGIN_DECLS
  * 
  * DBusString internals. DBusString is an opaque objects, it must be
  * used via accessor functions.
+ *
+ * Short strings keep their data in inline_buf, so str points into the
+ * DBusString itself; an initialized DBusString must therefore never
+ * be moved or copied as a struct.
  */
 typedef struct
 {
@@ -49,6 +53,8 @@ typedef struct
   unsigned int   locked : 1;     /**< DBusString has been locked and can't be changed */
   unsigned int   invalid : 1;    /**< DBusString is invalid (e.g. already freed) */
   unsigned int   align_offset : 3; /**< str - align_offset is the actual malloc block */
+  unsigned int   inline_data : 1; /**< str - align_offset is inline_buf, not malloc'd */
+  unsigned char  inline_buf[_DBUS_STRING_INLINE_SIZE]; /**< Storage for short strings */
 } DBusRealString;
 
 
@@ -68,12 +74,19 @@ typedef struct
  */
 #define _DBUS_STRING_MAX_MAX_LENGTH (_DBUS_INT32_MAX - _DBUS_STRING_ALLOCATION_PADDING)
 
+/**
+ * Allocations of at least this many bytes are mapped pages of their
+ * own rather than heap blocks, where the system supports resizing
+ * those without copying; see _dbus_pages_remap().
+ */
+#define _DBUS_STRING_MAP_THRESHOLD (1024 * 1024)
+
 /**
  * Checks a bunch of assertions about a string object
  *
  * @param real the DBusRealString
  */
-#define DBUS_GENERIC_STRING_PREAMBLE(real) _dbus_assert ((real) != NULL); _dbus_assert (!(real)->invalid); _dbus_assert ((real)->len >= 0); _dbus_assert ((real)->allocated >= 0); _dbus_assert ((real)->max_length >= 0); _dbus_assert ((real)->len <= ((real)->allocated - _DBUS_STRING_ALLOCATION_PADDING)); _dbus_assert ((real)->len <= (real)->max_length)
+#define DBUS_GENERIC_STRING_PREAMBLE(real) _dbus_assert ((real) != NULL); _dbus_assert (!(real)->invalid); _dbus_assert ((real)->len >= 0); _dbus_assert ((real)->allocated >= 0); _dbus_assert ((real)->max_length >= 0); _dbus_assert ((real)->len <= ((real)->allocated - _DBUS_STRING_ALLOCATION_PADDING)); _dbus_assert ((real)->len <= (real)->max_length); _dbus_assert (!(real)->inline_data || (real)->str - (real)->align_offset == (real)->inline_buf)
 
 /**
  * Checks assertions about a string object that needs to be
@@ -698,6 +698,29 @@ _dbus_string_test (void)
     _dbus_assert_not_reached ("deccoded bogus hex string with no error");
 
   _dbus_assert (end == 8);
+  _dbus_assert (_dbus_string_get_length (&other) == 4);
+  _dbus_assert (_dbus_string_get_byte (&other, 0) == 0xca);
+
+  _dbus_string_free (&other);
+
+  /* Upper case digits, and an odd digit out that only sets high bits */
+  _dbus_string_init_const (&str, "CAFEBAB!");
+  if (!_dbus_string_init (&other))
+    _dbus_assert_not_reached ("could not init string");
+
+  if (!_dbus_string_append (&other, "<>"))
+    _dbus_assert_not_reached ("could not append to string");
+
+  if (!_dbus_string_hex_decode (&str, 0, &end, &other, 1))
+    _dbus_assert_not_reached ("could not decode hex string");
+
+  _dbus_assert (end == 7);
+  _dbus_assert (_dbus_string_get_length (&other) == 6);
+  _dbus_assert (_dbus_string_get_byte (&other, 0) == '<');
+  _dbus_assert (_dbus_string_get_byte (&other, 1) == 0xca);
+  _dbus_assert (_dbus_string_get_byte (&other, 3) == 0xba);
+  _dbus_assert (_dbus_string_get_byte (&other, 4) == 0xb0);
+  _dbus_assert (_dbus_string_get_byte (&other, 5) == '>');
 
   _dbus_string_free (&other);
 
@@ -848,6 +871,54 @@ _dbus_string_test (void)
     _dbus_string_free (&str);
   }
 
+  /* Strings past _DBUS_STRING_MAP_THRESHOLD move into mapped pages and
+   * back out again when compacted; their contents have to survive both
+   */
+  {
+    const int chunk = 64 * 1024;
+    char *stolen;
+    int len;
+
+    if (!_dbus_string_init (&str) ||
+        !_dbus_string_init (&other))
+      _dbus_assert_not_reached ("no memory");
+
+    for (len = 0; len < 3 * _DBUS_STRING_MAP_THRESHOLD; len += chunk)
+      {
+        if (!_dbus_string_lengthen (&str, chunk))
+          _dbus_assert_not_reached ("failed to lengthen");
+        memset (_dbus_string_get_data_len (&str, len, chunk),
+                'a' + (len / chunk) % 26, chunk);
+      }
+
+    for (len = 0; len < 3 * _DBUS_STRING_MAP_THRESHOLD; len += chunk)
+      _dbus_assert (_dbus_string_get_byte (&str, len + chunk - 1) ==
+                    'a' + (len / chunk) % 26);
+
+    _dbus_string_shorten (&str, 2 * _DBUS_STRING_MAP_THRESHOLD + 1);
+    if (!_dbus_string_compact (&str, 0))
+      _dbus_assert_not_reached ("failed to compact mapped string");
+    _dbus_assert (((DBusRealString *)&str)->allocated ==
+                  _DBUS_STRING_MAP_THRESHOLD - 1 + _DBUS_STRING_ALLOCATION_PADDING);
+    _dbus_assert (_dbus_string_get_byte (&str, _DBUS_STRING_MAP_THRESHOLD - 2) ==
+                  'a' + (_DBUS_STRING_MAP_THRESHOLD / chunk - 1) % 26);
+
+    if (!_dbus_string_lengthen (&str, _DBUS_STRING_MAP_THRESHOLD) ||
+        !_dbus_string_move (&str, 0, &other, 0))
+      _dbus_assert_not_reached ("failed to regrow and move");
+    _dbus_assert (_dbus_string_get_length (&other) ==
+                  2 * _DBUS_STRING_MAP_THRESHOLD - 1);
+
+    if (!_dbus_string_steal_data (&other, &stolen))
+      _dbus_assert_not_reached ("failed to steal mapped string");
+    _dbus_assert (stolen[0] == 'a');
+    _dbus_assert (_dbus_string_get_length (&other) == 0);
+    dbus_free (stolen);
+
+    _dbus_string_free (&str);
+    _dbus_string_free (&other);
+  }
+
   {
     const char two_strings[] = "one\ttwo";
 
@@ -937,6 +1008,102 @@ _dbus_string_test (void)
     _dbus_string_free (&str);
   }
 
+  /* UTF-8 validation skips ASCII a word at a time, so make sure
+   * it still notices bad bytes wherever they are in a word
+   */
+  {
+    char buf[41];
+
+    i = 0;
+    while (i < 39)
+      {
+        memset (buf, 'a', 40);
+        buf[40] = '\0';
+        _dbus_string_init_const_len (&str, buf, 40);
+
+        if (!_dbus_string_validate_utf8 (&str, 0, 40))
+          _dbus_assert_not_reached ("ASCII should be valid UTF-8");
+
+        buf[i] = '\0';
+        if (_dbus_string_validate_utf8 (&str, 0, 40))
+          _dbus_assert_not_reached ("nul byte should be invalid UTF-8");
+
+        buf[i] = '\x80';
+        if (_dbus_string_validate_utf8 (&str, 0, 40))
+          _dbus_assert_not_reached ("lone continuation byte should be invalid UTF-8");
+
+        buf[i] = '\xc3';
+        buf[i + 1] = '\xa9';
+        if (!_dbus_string_validate_utf8 (&str, 0, 40))
+          _dbus_assert_not_reached ("two-byte character should be valid UTF-8");
+
+        if (_dbus_string_validate_utf8 (&str, 0, i + 1))
+          _dbus_assert_not_reached ("truncated character should be invalid UTF-8");
+
+        ++i;
+      }
+  }
+
+  /* The line scanning and ASCII checks also go a word at a time, and
+   * substring search jumps between first-byte candidates
+   */
+  {
+    char buf[41];
+    int found, found_len;
+
+    i = 0;
+    while (i < 39)
+      {
+        memset (buf, 'a', 40);
+        buf[40] = '\0';
+        _dbus_string_init_const_len (&str, buf, 40);
+
+        if (!_dbus_string_validate_ascii (&str, 0, 40))
+          _dbus_assert_not_reached ("letters should be valid ASCII");
+        if (_dbus_string_find_blank (&str, 0, &found) || found != 40)
+          _dbus_assert_not_reached ("found a blank in letters");
+        if (_dbus_string_find_eol (&str, 0, &found, &found_len) ||
+            found != 40 || found_len != 0)
+          _dbus_assert_not_reached ("found an eol in letters");
+
+        buf[i] = '\t';
+        if (!_dbus_string_find_blank (&str, 0, &found) || found != i)
+          _dbus_assert_not_reached ("did not find tab");
+
+        buf[i] = '\r';
+        buf[i + 1] = '\n';
+        if (!_dbus_string_find_eol (&str, 0, &found, &found_len) ||
+            found != i || found_len != 2)
+          _dbus_assert_not_reached ("did not find '\\r\\n'");
+
+        buf[i + 1] = 'a';
+        if (!_dbus_string_find_eol (&str, 0, &found, &found_len) ||
+            found != i || found_len != 1)
+          _dbus_assert_not_reached ("did not find '\\r'");
+
+        buf[i] = '\0';
+        if (_dbus_string_validate_ascii (&str, 0, 40))
+          _dbus_assert_not_reached ("nul byte should be invalid ASCII");
+        if (!_dbus_string_validate_ascii (&str, 0, i))
+          _dbus_assert_not_reached ("bytes before nul should be valid ASCII");
+
+        buf[i] = '\x80';
+        if (_dbus_string_validate_ascii (&str, 0, 40))
+          _dbus_assert_not_reached ("high byte should be invalid ASCII");
+
+        buf[i] = 'x';
+        buf[i + 1] = 'y';
+        if (!_dbus_string_find (&str, 0, "xy", &found) || found != i)
+          _dbus_assert_not_reached ("did not find 'xy'");
+        if (_dbus_string_find_to (&str, 0, i + 1, "xy", NULL))
+          _dbus_assert_not_reached ("found 'xy' past the end");
+        if (_dbus_string_find (&str, 0, "xz", NULL))
+          _dbus_assert_not_reached ("found 'xz'");
+
+        ++i;
+      }
+  }
+
   return TRUE;
 }
 
@@ -37,6 +37,10 @@
 /* for DBUS_VA_COPY */
 #include "dbus-sysdeps.h"
 
+/* Allocations made here are profiled as strings */
+#undef DBUS_ALLOC_SUBSYSTEM
+#define DBUS_ALLOC_SUBSYSTEM DBUS_ALLOC_SUBSYSTEM_STRING
+
 /**
  * @defgroup DBusString DBusString class
  * @ingroup  DBusInternals
@@ -119,6 +123,73 @@ undo_alignment (DBusRealString *real)
     }
 }
 
+/* Whether a string's block, when it isn't inline or constant, is
+ * mapped pages rather than a heap block; it is exactly when it's big
+ * enough. Growing those by remapping moves pages instead of copying
+ * megabytes, and freeing them returns the memory to the system at once.
+ */
+#ifdef HAVE_MREMAP
+#define BLOCK_IS_MAPPED(allocated) ((allocated) >= _DBUS_STRING_MAP_THRESHOLD)
+#else
+#define BLOCK_IS_MAPPED(allocated) FALSE
+#endif
+
+static unsigned char*
+alloc_block (int allocated)
+{
+#ifdef HAVE_MREMAP
+  if (BLOCK_IS_MAPPED (allocated))
+    return _dbus_pages_map (allocated);
+#endif
+
+  return dbus_malloc (allocated);
+}
+
+static void
+free_block (unsigned char *block,
+            int            allocated)
+{
+#ifdef HAVE_MREMAP
+  if (BLOCK_IS_MAPPED (allocated))
+    {
+      _dbus_pages_unmap (block, allocated);
+      return;
+    }
+#endif
+
+  dbus_free (block);
+}
+
+/* Like realloc(), but the block moves between the heap and mapped
+ * pages as it crosses the threshold, which costs one copy
+ */
+static unsigned char*
+realloc_block (unsigned char *block,
+               int            old_allocated,
+               int            new_allocated)
+{
+#ifdef HAVE_MREMAP
+  unsigned char *new_block;
+
+  if (BLOCK_IS_MAPPED (old_allocated) && BLOCK_IS_MAPPED (new_allocated))
+    return _dbus_pages_remap (block, old_allocated, new_allocated);
+
+  if (BLOCK_IS_MAPPED (old_allocated) || BLOCK_IS_MAPPED (new_allocated))
+    {
+      new_block = alloc_block (new_allocated);
+      if (new_block == NULL)
+        return NULL;
+
+      memcpy (new_block, block, MIN (old_allocated, new_allocated));
+      free_block (block, old_allocated);
+
+      return new_block;
+    }
+#endif
+
+  return dbus_realloc (block, new_allocated);
+}
+
 /**
  * Initializes a string that can be up to the given allocation size
  * before it has to realloc. The string starts life with zero length.
@@ -146,11 +217,22 @@ _dbus_string_init_preallocated (DBusString *str,
    * an existing string, e.g. in _dbus_string_steal_data()
    */
   
-  real->str = dbus_malloc (_DBUS_STRING_ALLOCATION_PADDING + allocate_size);
-  if (real->str == NULL)
-    return FALSE;  
-  
-  real->allocated = _DBUS_STRING_ALLOCATION_PADDING + allocate_size;
+  if (allocate_size <= _DBUS_STRING_INLINE_SIZE - _DBUS_STRING_ALLOCATION_PADDING)
+    {
+      real->str = real->inline_buf;
+      real->allocated = _DBUS_STRING_INLINE_SIZE;
+      real->inline_data = TRUE;
+    }
+  else
+    {
+      real->str = alloc_block (_DBUS_STRING_ALLOCATION_PADDING + allocate_size);
+      if (real->str == NULL)
+        return FALSE;  
+
+      real->allocated = _DBUS_STRING_ALLOCATION_PADDING + allocate_size;
+      real->inline_data = FALSE;
+    }
+
   real->len = 0;
   real->str[real->len] = '\0';
   
@@ -248,6 +330,7 @@ _dbus_string_init_const_len (DBusString *str,
   real->locked = TRUE;
   real->invalid = FALSE;
   real->align_offset = 0;
+  real->inline_data = FALSE;
 
   /* We don't require const strings to be 8-byte aligned as the
    * memory is coming from elsewhere.
@@ -267,7 +350,37 @@ _dbus_string_free (DBusString *str)
   
   if (real->constant)
     return;
-  dbus_free (real->str - real->align_offset);
+  if (!real->inline_data)
+    free_block (real->str - real->align_offset, real->allocated);
+
+  real->invalid = TRUE;
+}
+
+/**
+ * Moves a string to another DBusString struct, leaving the source
+ * as if freed with _dbus_string_free(). A string may be keeping its
+ * data inside the DBusString itself, so this has to be used instead
+ * of assigning or copying the struct. It does no allocation, so it
+ * can't fail.
+ *
+ * @param dest uninitialized memory for the string
+ * @param source the string to move
+ */
+void
+_dbus_string_relocate (DBusString *dest,
+                       DBusString *source)
+{
+  DBusRealString *real_dest = (DBusRealString*) dest;
+  DBusRealString *real = (DBusRealString*) source;
+  DBUS_GENERIC_STRING_PREAMBLE (real);
+
+  *real_dest = *real;
+
+  if (real->inline_data)
+    {
+      real_dest->str = real_dest->inline_buf + real->align_offset;
+      fixup_alignment (real_dest);
+    }
 
   real->invalid = TRUE;
 }
@@ -282,12 +395,13 @@ compact (DBusRealString *real,
 
   waste = real->allocated - (real->len + _DBUS_STRING_ALLOCATION_PADDING);
 
-  if (waste <= max_waste)
+  if (waste <= max_waste || real->inline_data)
     return TRUE;
 
   new_allocated = real->len + _DBUS_STRING_ALLOCATION_PADDING;
 
-  new_str = dbus_realloc (real->str - real->align_offset, new_allocated);
+  new_str = realloc_block (real->str - real->align_offset, real->allocated,
+                           new_allocated);
   if (_DBUS_UNLIKELY (new_str == NULL))
     return FALSE;
 
@@ -362,9 +476,26 @@ reallocate_for_length (DBusRealString *real,
                        new_length + _DBUS_STRING_ALLOCATION_PADDING);
 
   _dbus_assert (new_allocated >= real->allocated); /* code relies on this */
-  new_str = dbus_realloc (real->str - real->align_offset, new_allocated);
-  if (_DBUS_UNLIKELY (new_str == NULL))
-    return FALSE;
+
+  if (real->inline_data)
+    {
+      /* Moving out of inline_buf; the copy keeps the same offset from
+       * the start of the block, which fixup_alignment() then corrects.
+       */
+      new_str = alloc_block (new_allocated);
+      if (_DBUS_UNLIKELY (new_str == NULL))
+        return FALSE;
+
+      memcpy (new_str, real->inline_buf, real->allocated);
+      real->inline_data = FALSE;
+    }
+  else
+    {
+      new_str = realloc_block (real->str - real->align_offset,
+                               real->allocated, new_allocated);
+      if (_DBUS_UNLIKELY (new_str == NULL))
+        return FALSE;
+    }
 
   real->str = new_str + real->align_offset;
   real->allocated = new_allocated;
@@ -644,6 +775,34 @@ _dbus_string_steal_data (DBusString        *str,
   DBUS_STRING_PREAMBLE (str);
   _dbus_assert (data_return != NULL);
 
+  if (real->inline_data || BLOCK_IS_MAPPED (real->allocated))
+    {
+      /* The caller gets to free the data with dbus_free(), so it has
+       * to be malloc'd
+       */
+      *data_return = dbus_malloc (real->len + 1);
+      if (*data_return == NULL)
+        return FALSE;
+
+      memcpy (*data_return, real->str, real->len + 1);
+
+      if (real->inline_data)
+        {
+          real->len = 0;
+          real->str[0] = '\0';
+          return TRUE;
+        }
+
+      old_max_length = real->max_length;
+      free_block (real->str - real->align_offset, real->allocated);
+
+      /* can't fail, an empty string is inline */
+      _dbus_string_init (str);
+      real->max_length = old_max_length;
+
+      return TRUE;
+    }
+
   undo_alignment (real);
   
   *data_return = (char*) real->str;
@@ -1571,10 +1730,12 @@ _dbus_string_move_len (DBusString       *source,
     }
   else if (start == 0 &&
            len == real_source->len &&
-           real_dest->len == 0)
+           real_dest->len == 0 &&
+           !real_source->inline_data)
     {
       /* Short-circuit moving an entire existing string to an empty string
-       * by just swapping the buffers.
+       * by just swapping the buffers. A source in its inline buffer is
+       * short enough to just be copied below.
        */
       /* we assume ->constant doesn't matter as you can't have
        * a constant string involved in a move.
@@ -1588,6 +1749,25 @@ _dbus_string_move_len (DBusString       *source,
       
       DBusRealString tmp;
 
+      if (real_dest->inline_data)
+        {
+          /* dest's inline buffer can't move to source, but source
+           * can use its own instead
+           */
+          ASSIGN_DATA (real_dest, real_source);
+          real_dest->inline_data = FALSE;
+
+          real_source->str = real_source->inline_buf;
+          real_source->len = 0;
+          real_source->allocated = _DBUS_STRING_INLINE_SIZE;
+          real_source->align_offset = 0;
+          real_source->inline_data = TRUE;
+          real_source->str[0] = '\0';
+          fixup_alignment (real_source);
+
+          return TRUE;
+        }
+
       ASSIGN_DATA (&tmp, real_source);
       ASSIGN_DATA (real_source, real_dest);
       ASSIGN_DATA (real_dest, &tmp);
@@ -1874,6 +2054,52 @@ _dbus_string_get_unichar (const DBusString *str,
 }
 #endif /* DBUS_BUILD_TESTS */
 
+/** 0x01 in every byte of an unsigned long */
+#define WORD_LOW_BITS (((unsigned long) -1) / 0xff)
+/** 0x80 in every byte of an unsigned long */
+#define WORD_HIGH_BITS (WORD_LOW_BITS * 0x80)
+/** Nonzero if some byte of the unsigned long is nul */
+#define WORD_HAS_ZERO(word) \
+  (((word) - WORD_LOW_BITS) & ~(word) & WORD_HIGH_BITS)
+/** Nonzero if some byte of the unsigned long equals b */
+#define WORD_HAS_BYTE(word, b) \
+  WORD_HAS_ZERO ((word) ^ (WORD_LOW_BITS * (unsigned char) (b)))
+
+/**
+ * Returns the first byte in [p, end) that is either a or b, or end
+ * if there is none. The lines we scan are mostly text without
+ * either byte, so test a word at a time and only go byte by byte
+ * through the word that has a hit.
+ *
+ * @param p where to start looking
+ * @param end where to stop looking
+ * @param a a byte to look for
+ * @param b another byte to look for
+ * @returns the first a or b, or end
+ */
+static const unsigned char*
+find_either_byte (const unsigned char *p,
+                  const unsigned char *end,
+                  unsigned char        a,
+                  unsigned char        b)
+{
+  while (end - p >= (int) sizeof (unsigned long))
+    {
+      unsigned long word;
+
+      memcpy (&word, p, sizeof (word));
+      if (WORD_HAS_BYTE (word, a) || WORD_HAS_BYTE (word, b))
+        break;
+
+      p += sizeof (word);
+    }
+
+  while (p != end && *p != a && *p != b)
+    ++p;
+
+  return p;
+}
+
 /**
  * Finds the given substring in the string,
  * returning #TRUE and filling in the byte index
@@ -1923,37 +2149,21 @@ _dbus_string_find_eol (const DBusString *str,
   _dbus_assert (start <= real->len);
   _dbus_assert (start >= 0);
   
-  i = start;
-  while (i < real->len)
+  i = find_either_byte (real->str + start, real->str + real->len,
+                        '\r', '\n') - real->str;
+  if (i < real->len)
     {
-      if (real->str[i] == '\r') 
-        {
-          if ((i+1) < real->len && real->str[i+1] == '\n') /* "\r\n" */
-            {
-              if (found) 
-                *found = i;
-              if (found_len)
-                *found_len = 2;
-              return TRUE;
-            } 
-          else /* only "\r" */
-            {
-              if (found) 
-                *found = i;
-              if (found_len)
-                *found_len = 1;
-              return TRUE;
-            }
-        } 
-      else if (real->str[i] == '\n')  /* only "\n" */
+      if (found)
+        *found = i;
+      if (found_len)
         {
-          if (found) 
-            *found = i;
-          if (found_len)
+          if (real->str[i] == '\r' &&
+              (i + 1) < real->len && real->str[i + 1] == '\n') /* "\r\n" */
+            *found_len = 2;
+          else /* only "\r" or "\n" */
             *found_len = 1;
-          return TRUE;
         }
-      ++i;
+      return TRUE;
     }
 
   if (found)
@@ -1988,7 +2198,7 @@ _dbus_string_find_to (const DBusString *str,
 		      const char       *substr,
 		      int              *found)
 {
-  int i;
+  size_t substr_len;
   DBUS_CONST_STRING_PREAMBLE (str);
   _dbus_assert (substr != NULL);
   _dbus_assert (start <= real->len);
@@ -2005,32 +2215,32 @@ _dbus_string_find_to (const DBusString *str,
       return TRUE;
     }
 
-  i = start;
-  while (i < end)
+  /* Let memchr() find candidates for the first byte; the C library
+   * has a vectorized version of it for the machine we are on.
+   */
+  substr_len = strlen (substr);
+  if (substr_len <= (size_t) (end - start))
     {
-      if (real->str[i] == substr[0])
+      const unsigned char *p;
+      const unsigned char *last;
+
+      p = real->str + start;
+      last = real->str + end - substr_len;
+      while (p <= last)
         {
-          int j = i + 1;
-          
-          while (j < end)
-            {
-              if (substr[j - i] == '\0')
-                break;
-              else if (real->str[j] != substr[j - i])
-                break;
-              
-              ++j;
-            }
+          p = memchr (p, substr[0], last - p + 1);
+          if (p == NULL)
+            break;
 
-          if (substr[j - i] == '\0')
+          if (memcmp (p + 1, substr + 1, substr_len - 1) == 0)
             {
               if (found)
-                *found = i;
+                *found = p - real->str;
               return TRUE;
             }
+
+          ++p;
         }
-      
-      ++i;
     }
 
   if (found)
@@ -2059,18 +2269,13 @@ _dbus_string_find_blank (const DBusString *str,
   _dbus_assert (start <= real->len);
   _dbus_assert (start >= 0);
   
-  i = start;
-  while (i < real->len)
+  i = find_either_byte (real->str + start, real->str + real->len,
+                        ' ', '\t') - real->str;
+  if (i < real->len)
     {
-      if (real->str[i] == ' ' ||
-          real->str[i] == '\t')
-        {
-          if (found)
-            *found = i;
-          return TRUE;
-        }
-      
-      ++i;
+      if (found)
+        *found = i;
+      return TRUE;
     }
 
   if (found)
@@ -2551,39 +2756,57 @@ _dbus_string_hex_encode (const DBusString *source,
                          DBusString       *dest,
                          int               insert_at)
 {
-  DBusString result;
+  const char hexdigits[16] = {
+    '0', '1', '2', '3', '4', '5', '6', '7', '8', '9',
+    'a', 'b', 'c', 'd', 'e', 'f'
+  };
   const unsigned char *p;
   const unsigned char *end;
-  dbus_bool_t retval;
-  
+  char *out;
+  int len;
+
+  _dbus_assert (source != dest);
   _dbus_assert (start <= _dbus_string_get_length (source));
 
-  if (!_dbus_string_init (&result))
+  len = _dbus_string_get_length (source) - start;
+
+  /* Open the gap once and encode into it, rather than building
+   * the result a byte at a time in a temporary string.
+   */
+  if (!_dbus_string_insert_bytes (dest, insert_at, len * 2, '\0'))
     return FALSE;
 
-  retval = FALSE;
-  
-  p = (const unsigned char*) _dbus_string_get_const_data (source);
-  end = p + _dbus_string_get_length (source);
-  p += start;
-  
+  p = (const unsigned char*) _dbus_string_get_const_data (source) + start;
+  end = p + len;
+  out = _dbus_string_get_data_len (dest, insert_at, len * 2);
+
   while (p != end)
     {
-      if (!_dbus_string_append_byte_as_hex (&result, *p))
-        goto out;
-      
+      *out++ = hexdigits[(*p >> 4)];
+      *out++ = hexdigits[(*p & 0x0f)];
       ++p;
     }
 
-  if (!_dbus_string_move (&result, 0, dest, insert_at))
-    goto out;
+  return TRUE;
+}
 
-  retval = TRUE;
+/**
+ * The value of each hex digit plus one, or 0 for bytes that are not
+ * hex digits. Bytes from 0x80 up are never hex digits.
+ */
+static const unsigned char hex_digit_values[128] = {
+  /* 0x00 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  /* 0x10 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  /* 0x20 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  /* 0x30 */ 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 0, 0, 0, 0, 0, 0,
+  /* 0x40 */ 0, 11, 12, 13, 14, 15, 16, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  /* 0x50 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  /* 0x60 */ 0, 11, 12, 13, 14, 15, 16, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  /* 0x70 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
 
- out:
-  _dbus_string_free (&result);
-  return retval;
-}
+#define HEX_DIGIT_VALUE(c) \
+  ((c) < 128 ? hex_digit_values[(c)] - 1 : -1)
 
 /**
  * Decodes a string from hex encoding.
@@ -2602,125 +2825,47 @@ _dbus_string_hex_decode (const DBusString *source,
                          DBusString       *dest,
                          int               insert_at)
 {
-  DBusString result;
+  const unsigned char *data;
   const unsigned char *p;
   const unsigned char *end;
-  dbus_bool_t retval;
-  dbus_bool_t high_bits;
-  
+  unsigned char *out;
+  int len;
+
+  _dbus_assert (source != dest);
   _dbus_assert (start <= _dbus_string_get_length (source));
 
-  if (!_dbus_string_init (&result))
+  data = (const unsigned char*) _dbus_string_get_const_data (source);
+  p = data + start;
+  end = data + _dbus_string_get_length (source);
+
+  /* Find where the hex data stops first, so the gap in dest can be
+   * opened once and decoded into, as _dbus_string_hex_encode() does.
+   */
+  while (p != end && HEX_DIGIT_VALUE (*p) >= 0)
+    ++p;
+  end = p;
+  p = data + start;
+
+  /* An odd digit out at the end fills only the high bits of a byte */
+  len = ((end - p) + 1) / 2;
+  if (!_dbus_string_insert_bytes (dest, insert_at, len, '\0'))
     return FALSE;
 
-  retval = FALSE;
+  out = (unsigned char*) _dbus_string_get_data_len (dest, insert_at, len);
 
-  high_bits = TRUE;
-  p = (const unsigned char*) _dbus_string_get_const_data (source);
-  end = p + _dbus_string_get_length (source);
-  p += start;
-  
-  while (p != end)
+  while (end - p >= 2)
     {
-      unsigned int val;
-
-      switch (*p)
-        {
-        case '0':
-          val = 0;
-          break;
-        case '1':
-          val = 1;
-          break;
-        case '2':
-          val = 2;
-          break;
-        case '3':
-          val = 3;
-          break;
-        case '4':
-          val = 4;
-          break;
-        case '5':
-          val = 5;
-          break;
-        case '6':
-          val = 6;
-          break;
-        case '7':
-          val = 7;
-          break;
-        case '8':
-          val = 8;
-          break;
-        case '9':
-          val = 9;
-          break;
-        case 'a':
-        case 'A':
-          val = 10;
-          break;
-        case 'b':
-        case 'B':
-          val = 11;
-          break;
-        case 'c':
-        case 'C':
-          val = 12;
-          break;
-        case 'd':
-        case 'D':
-          val = 13;
-          break;
-        case 'e':
-        case 'E':
-          val = 14;
-          break;
-        case 'f':
-        case 'F':
-          val = 15;
-          break;
-        default:
-          goto done;
-        }
-
-      if (high_bits)
-        {
-          if (!_dbus_string_append_byte (&result,
-                                         val << 4))
-	    goto out;
-        }
-      else
-        {
-          int len;
-          unsigned char b;
-
-          len = _dbus_string_get_length (&result);
-          
-          b = _dbus_string_get_byte (&result, len - 1);
-
-          b |= val;
-
-          _dbus_string_set_byte (&result, len - 1, b);
-        }
-
-      high_bits = !high_bits;
-
-      ++p;
+      *out++ = (HEX_DIGIT_VALUE (p[0]) << 4) | HEX_DIGIT_VALUE (p[1]);
+      p += 2;
     }
 
- done:
-  if (!_dbus_string_move (&result, 0, dest, insert_at))
-    goto out;
+  if (p != end)
+    *out = HEX_DIGIT_VALUE (*p) << 4;
 
   if (end_return)
-    *end_return = p - (const unsigned char*) _dbus_string_get_const_data (source);
+    *end_return = end - data;
 
-  retval = TRUE;
-  
- out:
-  _dbus_string_free (&result);  
-  return retval;
+  return TRUE;
 }
 
 /**
@@ -2753,6 +2898,21 @@ _dbus_string_validate_ascii (const DBusString *str,
   
   s = real->str + start;
   end = s + len;
+
+  /* Keyring and auth lines are long runs of ASCII; check a word at a
+   * time, and only go byte by byte at the end of the range.
+   */
+  while (end - s >= (int) sizeof (unsigned long))
+    {
+      unsigned long word;
+
+      memcpy (&word, s, sizeof (word));
+      if (_DBUS_UNLIKELY ((word & WORD_HIGH_BITS) || WORD_HAS_ZERO (word)))
+        return FALSE;
+
+      s += sizeof (word);
+    }
+
   while (s != end)
     {
       if (_DBUS_UNLIKELY (!_DBUS_ISASCII (*s)))
@@ -2885,6 +3045,21 @@ _dbus_string_validate_utf8  (const DBusString *str,
       if (*p < 128)
         {
           ++p;
+
+          /* Runs of ASCII are common, so skip them a word at a time
+           * until a word has a nul or a byte with the high bit set.
+           */
+          while (end - p >= (int) sizeof (unsigned long))
+            {
+              unsigned long word;
+
+              memcpy (&word, p, sizeof (word));
+              if ((word & WORD_HIGH_BITS) || WORD_HAS_ZERO (word))
+                break;
+
+              p += sizeof (word);
+            }
+
           continue;
         }
       
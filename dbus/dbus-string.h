@@ -33,6 +33,19 @@
 
 DBUS_BEGIN_DECLS
 
+/**
+ * We allocate 1 byte for nul termination, plus 7 bytes for possible
+ * align_offset, so we always need 8 bytes on top of the string's
+ * length to be in the allocated block.
+ */
+#define _DBUS_STRING_ALLOCATION_PADDING 8
+
+/**
+ * Size of the buffer inside each DBusString, so that strings of up
+ * to 32 bytes need no separate allocation.
+ */
+#define _DBUS_STRING_INLINE_SIZE (32 + _DBUS_STRING_ALLOCATION_PADDING)
+
 /**
  * DBusString object
  */
@@ -53,6 +66,8 @@ struct DBusString
   unsigned int dummy6 : 1; /**< placeholder */
   unsigned int dummy7 : 1; /**< placeholder */
   unsigned int dummy8 : 3; /**< placeholder */
+  unsigned int dummy9 : 1; /**< placeholder */
+  unsigned char dummy10[_DBUS_STRING_INLINE_SIZE]; /**< placeholder */
 };
 
 #ifdef DBUS_DISABLE_ASSERT
@@ -77,6 +92,8 @@ void          _dbus_string_init_const_len        (DBusString        *str,
 dbus_bool_t   _dbus_string_init_preallocated     (DBusString        *str,
                                                   int                allocate_size);
 void          _dbus_string_free                  (DBusString        *str);
+void          _dbus_string_relocate              (DBusString        *dest,
+                                                  DBusString        *source);
 void          _dbus_string_lock                  (DBusString        *str);
 dbus_bool_t   _dbus_string_compact               (DBusString        *str,
                                                   int                max_waste);
@@ -304,13 +321,6 @@ dbus_bool_t   _dbus_string_validate_nul          (const DBusString  *str,
 void          _dbus_string_zero                  (DBusString        *str);
 
 
-/**
- * We allocate 1 byte for nul termination, plus 7 bytes for possible
- * align_offset, so we always need 8 bytes on top of the string's
- * length to be in the allocated block.
- */
-#define _DBUS_STRING_ALLOCATION_PADDING 8
-
 /**
  * Defines a static const variable with type #DBusString called "name"
  * containing the given string literal.
@@ -25,6 +25,7 @@
 #include "dbus-internals.h"
 #include "dbus-sysdeps.h"
 #include "dbus-threads.h"
+#include "dbus-threads-internal.h"
 
 #include <sys/time.h>
 #include <pthread.h>
@@ -175,6 +176,32 @@ _dbus_pthread_mutex_lock (DBusMutex *mutex)
     }
 }
 
+static dbus_bool_t
+_dbus_pthread_mutex_trylock (DBusMutex *mutex)
+{
+  DBusMutexPThread *pmutex = DBUS_MUTEX_PTHREAD (mutex);
+  pthread_t self = pthread_self ();
+
+  /* As in _dbus_pthread_mutex_lock(), holder is only ourselves while
+   * count is > 0 if we really have the lock
+   */
+  if (pmutex->count > 0 && pthread_equal (pmutex->holder, self))
+    {
+      pmutex->count += 1;
+      return TRUE;
+    }
+
+  if (pthread_mutex_trylock (&pmutex->lock) != 0)
+    return FALSE;
+
+  _dbus_assert (pmutex->count == 0);
+
+  pmutex->holder = self;
+  pmutex->count = 1;
+
+  return TRUE;
+}
+
 static void
 _dbus_pthread_mutex_unlock (DBusMutex *mutex)
 {
@@ -369,5 +396,84 @@ dbus_bool_t
 _dbus_threads_init_platform_specific (void)
 {
   check_monotonic_clock ();
-  return dbus_threads_init (&pthread_functions);
+
+  if (!dbus_threads_init (&pthread_functions))
+    return FALSE;
+
+  _dbus_threads_set_mutex_trylock (&pthread_functions,
+                                   _dbus_pthread_mutex_trylock);
+  return TRUE;
+}
+
+/**
+ * A thread-local storage slot, wrapping a pthread key.
+ */
+struct DBusThreadLocal
+{
+  pthread_key_t key; /**< the key */
+};
+
+/**
+ * Allocates a thread-local storage slot. Each thread sees its own
+ * value in the slot, initially #NULL. When a thread exits with a
+ * non-#NULL value, the destructor is called on that value.
+ *
+ * @param destructor function to free a thread's value, or #NULL
+ * @returns the new slot, or #NULL if no memory or no keys are left
+ */
+DBusThreadLocal*
+_dbus_thread_local_new (DBusFreeFunction destructor)
+{
+  DBusThreadLocal *tls;
+
+  tls = dbus_new (DBusThreadLocal, 1);
+  if (tls == NULL)
+    return NULL;
+
+  if (pthread_key_create (&tls->key, destructor) != 0)
+    {
+      dbus_free (tls);
+      return NULL;
+    }
+
+  return tls;
+}
+
+/**
+ * Frees a thread-local storage slot. Destructors are not called for
+ * values still stored in it, so the caller must have freed them.
+ *
+ * @param tls the slot
+ */
+void
+_dbus_thread_local_free (DBusThreadLocal *tls)
+{
+  pthread_key_delete (tls->key);
+  dbus_free (tls);
+}
+
+/**
+ * Gets the calling thread's value in a thread-local storage slot.
+ *
+ * @param tls the slot
+ * @returns the value, or #NULL if none was set
+ */
+void*
+_dbus_thread_local_get (DBusThreadLocal *tls)
+{
+  return pthread_getspecific (tls->key);
+}
+
+/**
+ * Sets the calling thread's value in a thread-local storage slot.
+ *
+ * @param tls the slot
+ * @param value the new value
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+_dbus_thread_local_set (DBusThreadLocal *tls,
+                        void            *value)
+{
+  return pthread_setspecific (tls->key, value) == 0;
 }
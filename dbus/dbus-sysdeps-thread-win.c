@@ -275,3 +275,34 @@ _dbus_threads_init_platform_specific (void)
   return dbus_threads_init (&windows_functions);
 }
 
+/* Windows TLS slots have no per-thread destructor, so values would
+ * leak when a thread exits; report thread-local storage as
+ * unavailable and let callers fall back to shared state.
+ */
+DBusThreadLocal*
+_dbus_thread_local_new (DBusFreeFunction destructor)
+{
+  return NULL;
+}
+
+void
+_dbus_thread_local_free (DBusThreadLocal *tls)
+{
+  _dbus_assert_not_reached ("no thread-local storage on this platform");
+}
+
+void*
+_dbus_thread_local_get (DBusThreadLocal *tls)
+{
+  _dbus_assert_not_reached ("no thread-local storage on this platform");
+  return NULL;
+}
+
+dbus_bool_t
+_dbus_thread_local_set (DBusThreadLocal *tls,
+                        void            *value)
+{
+  _dbus_assert_not_reached ("no thread-local storage on this platform");
+  return FALSE;
+}
+
@@ -35,6 +35,7 @@
 #include "dbus-list.h"
 #include "dbus-credentials.h"
 #include "dbus-nonce.h"
+#include "dbus-address.h"
 
 #include <sys/types.h>
 #include <stdlib.h>
@@ -53,6 +54,7 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <grp.h>
 #include <cutils/sockets.h>
@@ -69,9 +71,18 @@
 #ifdef HAVE_BACKTRACE
 #include <execinfo.h>
 #endif
+#ifdef HAVE_MREMAP
+#include <sys/mman.h>
+#endif
 #ifdef HAVE_GETPEERUCRED
 #include <ucred.h>
 #endif
+#ifdef HAVE_LINUX_ERRQUEUE_H
+#include <linux/errqueue.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
 
 #ifdef HAVE_ADT
 #include <bsm/adt.h>
@@ -96,6 +107,10 @@
 #define socklen_t int
 #endif
 
+#if defined(HAVE_LINUX_ERRQUEUE_H) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define CAN_SEND_ZEROCOPY 1
+#endif
+
 static dbus_bool_t
 _dbus_open_socket (int              *fd_p,
                    int               domain,
@@ -230,23 +245,198 @@ _dbus_write_socket (int               fd,
 #endif
 }
 
+/**
+ * Checks whether SO_ZEROCOPY is set on a socket, in which case large
+ * buffers can be written with _dbus_write_socket_zerocopy().
+ *
+ * @param fd the socket
+ * @returns #TRUE if zero-copy sends are enabled
+ */
+dbus_bool_t
+_dbus_socket_get_zerocopy (int fd)
+{
+#ifdef CAN_SEND_ZEROCOPY
+  int value;
+  socklen_t len = sizeof (value);
+
+  if (getsockopt (fd, SOL_SOCKET, SO_ZEROCOPY, &value, &len) < 0)
+    return FALSE;
+
+  return value != 0;
+#else
+  return FALSE;
+#endif
+}
+
+/**
+ * Checks whether a socket is of type SOCK_SEQPACKET, in which case
+ * every write is one packet, and a read takes one packet, losing any
+ * of it that doesn't fit.
+ *
+ * @param fd the socket
+ * @returns #TRUE if the socket is a seqpacket socket
+ */
+dbus_bool_t
+_dbus_socket_get_seqpacket (int fd)
+{
+  int type;
+  socklen_t len = sizeof (type);
+
+  if (getsockopt (fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0)
+    return FALSE;
+
+  return type == SOCK_SEQPACKET;
+}
+
+/**
+ * Gets the size of the next packet waiting on a seqpacket socket,
+ * without reading it, so that it can be read whole into a buffer of
+ * exactly that size.
+ *
+ * @param fd the socket
+ * @returns the size, 0 at end of file, or -1 with errno set
+ */
+int
+_dbus_socket_peek_packet_size (int fd)
+{
+  int size;
+
+ again:
+  size = recv (fd, NULL, 0, MSG_PEEK | MSG_TRUNC | MSG_DONTWAIT);
+
+  if (size < 0 && errno == EINTR)
+    goto again;
+
+  return size;
+}
+
+/**
+ * Like _dbus_write_socket() but with MSG_ZEROCOPY: the kernel sends
+ * straight from the pages of the buffer instead of copying them.
+ * Every call that writes anything is numbered, counting up from 0
+ * for each socket, and the buffer must stay allocated and unchanged
+ * until _dbus_read_zerocopy_completion() has reported that number.
+ * Only usable if _dbus_socket_get_zerocopy() returned #TRUE.
+ *
+ * @param fd the socket
+ * @param buffer the buffer to write data from
+ * @param start the first byte in the buffer to write
+ * @param len the number of bytes to try to write
+ * @returns the number of bytes written or -1 on error
+ */
+int
+_dbus_write_socket_zerocopy (int               fd,
+                             const DBusString *buffer,
+                             int               start,
+                             int               len)
+{
+#ifdef CAN_SEND_ZEROCOPY
+  const char *data;
+  int bytes_written;
+
+  data = _dbus_string_get_const_data_len (buffer, start, len);
+
+ again:
+
+  bytes_written = send (fd, data, len, MSG_NOSIGNAL | MSG_ZEROCOPY);
+
+  if (bytes_written < 0 && errno == EINTR)
+    goto again;
+
+  return bytes_written;
+#else
+  _dbus_assert_not_reached ("zero-copy sends are never enabled here");
+  return -1;
+#endif
+}
+
+/**
+ * Reads one completion from the socket's error queue, saying the
+ * kernel no longer needs the buffers of the zero-copy sends numbered
+ * first to last inclusive. Completions can cover several sends and
+ * need not arrive in order. Any other error queue entries are
+ * skipped.
+ *
+ * @param fd the socket
+ * @param first_p return location for the first send completed
+ * @param last_p return location for the last send completed
+ * @returns 1 if a completion was read, 0 if none is pending, -1 on error
+ */
+int
+_dbus_read_zerocopy_completion (int            fd,
+                                dbus_uint32_t *first_p,
+                                dbus_uint32_t *last_p)
+{
+#ifdef CAN_SEND_ZEROCOPY
+  struct msghdr m;
+  struct cmsghdr *cm;
+  union {
+    struct cmsghdr cm;
+    char space[CMSG_SPACE (sizeof (struct sock_extended_err)) + 64];
+  } control;
+
+  while (TRUE)
+    {
+      _DBUS_ZERO (m);
+      m.msg_control = &control;
+      m.msg_controllen = sizeof (control);
+
+      if (recvmsg (fd, &m, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+        {
+          if (errno == EINTR)
+            continue;
+
+          if (_dbus_get_is_errno_eagain_or_ewouldblock ())
+            return 0;
+
+          return -1;
+        }
+
+      for (cm = CMSG_FIRSTHDR (&m); cm != NULL; cm = CMSG_NXTHDR (&m, cm))
+        {
+          struct sock_extended_err *serr;
+
+          if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+            continue;
+
+          serr = (struct sock_extended_err *) CMSG_DATA (cm);
+          if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+            continue;
+
+          *first_p = serr->ee_info;
+          *last_p = serr->ee_data;
+          return 1;
+        }
+    }
+#else
+  return 0;
+#endif
+}
+
 /**
  * Like _dbus_read_socket() but also tries to read unix fds from the
- * socket. When there are more fds to read than space in the array
- * passed this function will fail with ENOSPC.
+ * socket. When there are more fds to read than n_fds allows this
+ * function will fail with ENOSPC.
+ *
+ * The fds are appended to a string as an array of int, which only
+ * grows when fds actually arrive. If there is no memory to store
+ * them, they are closed and the data is returned as if they had
+ * never been sent, so the message they belonged to fails to load
+ * rather than the stream losing its place.
  *
  * @param fd the socket
  * @param buffer string to append data to
  * @param count max amount of data to read
- * @param fds array to place read file descriptors in
- * @param n_fds on input space in fds array, on output how many fds actually got read
+ * @param fds string to append read file descriptors to
+ * @param n_fds on input how many fds to read at most, on output how many fds actually got read
  * @returns number of bytes appended to string
  */
 int
 _dbus_read_socket_with_unix_fds (int               fd,
                                  DBusString       *buffer,
                                  int               count,
-                                 int              *fds,
+                                 DBusString       *fds,
                                  int              *n_fds) {
 #ifndef HAVE_UNIX_FD_PASSING
   int r;
@@ -289,9 +479,10 @@ _dbus_read_socket_with_unix_fds (int               fd,
   m.msg_controllen = CMSG_SPACE(*n_fds * sizeof(int));
 
   /* It's probably safe to assume that systems with SCM_RIGHTS also
-     know alloca() */
+     know alloca(). The kernel sets msg_controllen to what it filled
+     in, and only that much is looked at, so the space doesn't need
+     clearing on every read. */
   m.msg_control = alloca(m.msg_controllen);
-  memset(m.msg_control, 0, m.msg_controllen);
 
  again:
 
@@ -334,17 +525,30 @@ _dbus_read_socket_with_unix_fds (int               fd,
           {
             unsigned i;
 
+            int *received;
+
             _dbus_assert(cm->cmsg_len <= CMSG_LEN(*n_fds * sizeof(int)));
             *n_fds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
-
-            memcpy(fds, CMSG_DATA(cm), *n_fds * sizeof(int));
+            received = (int *) CMSG_DATA(cm);
             found = TRUE;
 
             /* Linux doesn't tell us whether MSG_CMSG_CLOEXEC actually
                worked, hence we need to go through this list and set
                CLOEXEC everywhere in any case */
             for (i = 0; i < *n_fds; i++)
-              _dbus_fd_set_close_on_exec(fds[i]);
+              _dbus_fd_set_close_on_exec(received[i]);
+
+            if (!_dbus_string_append_len (fds, (const char *) received,
+                                          *n_fds * sizeof(int)))
+              {
+                _dbus_verbose ("No memory to keep %d received unix fds, closing them\n",
+                               *n_fds);
+
+                for (i = 0; i < *n_fds; i++)
+                  _dbus_close (received[i], NULL);
+
+                *n_fds = 0;
+              }
 
             break;
           }
@@ -535,6 +739,92 @@ _dbus_write_socket_two (int               fd,
 #endif
 }
 
+/**
+ * Writes the concatenation of several buffers to a socket with a
+ * single system call, skipping the first @p skip bytes (which were
+ * written by an earlier, partial call). Used to send several small
+ * messages at once. Like the other socket write functions this may
+ * write fewer bytes than requested; the caller must keep track.
+ *
+ * @param fd the file descriptor
+ * @param buffers the buffers, at most #_DBUS_MAX_SOCKET_WRITE_BUFFERS
+ * @param n_buffers number of buffers
+ * @param skip number of leading bytes already written
+ * @returns total bytes written, or -1 on error
+ */
+int
+_dbus_write_socket_many (int                fd,
+                         const DBusString **buffers,
+                         int                n_buffers,
+                         int                skip)
+{
+  struct iovec vectors[_DBUS_MAX_SOCKET_WRITE_BUFFERS];
+  int n_vectors;
+  int bytes_written;
+  int i;
+
+  _dbus_assert (n_buffers > 0);
+  _dbus_assert (n_buffers <= _DBUS_MAX_SOCKET_WRITE_BUFFERS);
+  _dbus_assert (skip >= 0);
+
+  n_vectors = 0;
+  for (i = 0; i < n_buffers; i++)
+    {
+      int len = _dbus_string_get_length (buffers[i]);
+
+      if (skip >= len)
+        {
+          skip -= len;
+          continue;
+        }
+
+      vectors[n_vectors].iov_base =
+        (char*) _dbus_string_get_const_data_len (buffers[i], skip, len - skip);
+      vectors[n_vectors].iov_len = len - skip;
+      n_vectors += 1;
+      skip = 0;
+    }
+
+  _dbus_assert (skip == 0);
+
+  if (n_vectors == 0)
+    return 0;
+
+#ifdef MSG_NOSIGNAL
+  {
+    struct msghdr m;
+
+    _DBUS_ZERO(m);
+    m.msg_iov = vectors;
+    m.msg_iovlen = n_vectors;
+
+  again:
+
+    bytes_written = sendmsg (fd, &m, MSG_NOSIGNAL);
+
+    if (bytes_written < 0 && errno == EINTR)
+      goto again;
+  }
+#elif defined (HAVE_WRITEV)
+ again:
+
+  bytes_written = writev (fd, vectors, n_vectors);
+
+  if (bytes_written < 0 && errno == EINTR)
+    goto again;
+#else
+  /* A short write is allowed, so just send the first buffer */
+ again:
+
+  bytes_written = write (fd, vectors[0].iov_base, vectors[0].iov_len);
+
+  if (bytes_written < 0 && errno == EINTR)
+    goto again;
+#endif
+
+  return bytes_written;
+}
+
 dbus_bool_t
 _dbus_socket_is_invalid (int fd)
 {
@@ -759,12 +1049,14 @@ _dbus_write_two (int               fd,
  *
  * @param path the path to UNIX domain socket
  * @param abstract #TRUE to use abstract namespace
+ * @param seqpacket #TRUE for a SOCK_SEQPACKET socket rather than a stream
  * @param error return location for error code
  * @returns connection file descriptor or -1 on error
  */
 int
 _dbus_connect_unix_socket (const char     *path,
                            dbus_bool_t     abstract,
+                           dbus_bool_t     seqpacket,
                            DBusError      *error)
 {
   int fd;
@@ -777,7 +1069,9 @@ _dbus_connect_unix_socket (const char     *path,
                  path, abstract);
 
 
-  if (!_dbus_open_unix_socket (&fd, error))
+  if (!_dbus_open_socket (&fd, PF_UNIX,
+                          seqpacket ? SOCK_SEQPACKET : SOCK_STREAM, 0,
+                          error))
     {
       _DBUS_ASSERT_ERROR_IS_SET(error);
       return -1;
@@ -897,12 +1191,14 @@ _dbus_set_local_creds (int fd, dbus_bool_t on)
  *
  * @param path the socket name
  * @param abstract #TRUE to use abstract namespace
+ * @param seqpacket #TRUE for a SOCK_SEQPACKET socket rather than a stream
  * @param error return location for errors
  * @returns the listening file descriptor or -1 on error
  */
 int
 _dbus_listen_unix_socket (const char     *path,
                           dbus_bool_t     abstract,
+                          dbus_bool_t     seqpacket,
                           DBusError      *error)
 {
   int listen_fd;
@@ -938,7 +1234,9 @@ _dbus_listen_unix_socket (const char     *path,
     }
 #else
 
-  if (!_dbus_open_unix_socket (&listen_fd, error))
+  if (!_dbus_open_socket (&listen_fd, PF_UNIX,
+                          seqpacket ? SOCK_SEQPACKET : SOCK_STREAM, 0,
+                          error))
     {
       _DBUS_ASSERT_ERROR_IS_SET(error);
       return -1;
@@ -1160,6 +1458,54 @@ _dbus_listen_systemd_sockets (int       **fds,
   return -1;
 }
 
+/**
+ * Appends the address a client would use to reach a Unix domain
+ * socket we were handed already listening, such as one passed in
+ * from systemd, so that it can be advertised in place of the
+ * unhelpful "systemd:".
+ *
+ * @param fd the listening socket
+ * @param address the string to append the address to
+ * @returns #FALSE if the socket is not a named Unix socket, or on OOM
+ */
+dbus_bool_t
+_dbus_append_address_from_socket (int         fd,
+                                  DBusString *address)
+{
+  struct sockaddr_un addr;
+  socklen_t len = sizeof (addr);
+  DBusString path;
+  int path_len;
+
+  _DBUS_ZERO (addr);
+
+  if (getsockname (fd, (struct sockaddr *) &addr, &len) < 0 ||
+      addr.sun_family != AF_UNIX ||
+      len <= offsetof (struct sockaddr_un, sun_path))
+    return FALSE;
+
+  path_len = len - offsetof (struct sockaddr_un, sun_path);
+
+  if (addr.sun_path[0] == '\0')
+    {
+#ifdef HAVE_ABSTRACT_SOCKETS
+      _dbus_string_init_const_len (&path, addr.sun_path + 1, path_len - 1);
+      return _dbus_string_append (address, "unix:abstract=") &&
+        _dbus_address_append_escaped (address, &path);
+#else
+      return FALSE;
+#endif
+    }
+
+  /* some platforms count the trailing nul, some don't */
+  if (memchr (addr.sun_path, '\0', path_len) != NULL)
+    path_len = strlen (addr.sun_path);
+
+  _dbus_string_init_const_len (&path, addr.sun_path, path_len);
+  return _dbus_string_append (address, "unix:path=") &&
+    _dbus_address_append_escaped (address, &path);
+}
+
 /**
  * Creates a socket and connects to a socket at the given host
  * and port. The connection fd is returned, and is set up as
@@ -1182,6 +1528,207 @@ _dbus_connect_tcp_socket (const char     *host,
     return _dbus_connect_tcp_socket_with_nonce (host, port, family, (const char*)NULL, error);
 }
 
+/**
+ * How long to give one address to connect before also trying the
+ * next, as RFC 8305 ("Happy Eyeballs") recommends.
+ */
+#define CONNECT_ATTEMPT_DELAY_MS 250
+
+/* Fills in the n results of getaddrinfo() in the order to try them:
+ * alternating between address families, starting with the family
+ * of the first result, so one unreachable family costs at most one
+ * attempt delay.
+ */
+static void
+order_addresses_for_connect (struct addrinfo  *ai,
+                             struct addrinfo **ordered)
+{
+  struct addrinfo *same;
+  struct addrinfo *other;
+  int family;
+  int i;
+
+  family = ai->ai_family;
+  same = ai;
+  other = ai;
+  i = 0;
+
+  while (same != NULL || other != NULL)
+    {
+      while (same != NULL && same->ai_family != family)
+        same = same->ai_next;
+      if (same != NULL)
+        {
+          ordered[i++] = same;
+          same = same->ai_next;
+        }
+
+      while (other != NULL && other->ai_family == family)
+        other = other->ai_next;
+      if (other != NULL)
+        {
+          ordered[i++] = other;
+          other = other->ai_next;
+        }
+    }
+}
+
+/* Connects to one of the addresses in ai, starting a nonblocking
+ * connect to the next one every CONNECT_ATTEMPT_DELAY_MS while the
+ * earlier ones are still in progress, or straight away when one fails,
+ * and keeping whichever connects first. Returns the connected socket,
+ * which is nonblocking, or -1 with *saved_errno set to why the last
+ * attempt failed. Only sets error on OOM.
+ */
+static int
+connect_to_first_answering (struct addrinfo *ai,
+                            int             *saved_errno,
+                            DBusError       *error)
+{
+  struct addrinfo *tmp;
+  struct addrinfo **ordered;
+  DBusPollFD *pending;
+  int n_addresses, n_started, n_pending;
+  long last_start_sec, last_start_usec;
+  int winner;
+  int i;
+
+  n_addresses = 0;
+  for (tmp = ai; tmp != NULL; tmp = tmp->ai_next)
+    ++n_addresses;
+
+  ordered = dbus_new (struct addrinfo *, n_addresses);
+  pending = dbus_new (DBusPollFD, n_addresses);
+  if (ordered == NULL || pending == NULL)
+    {
+      dbus_free (ordered);
+      dbus_free (pending);
+      _DBUS_SET_OOM (error);
+      return -1;
+    }
+
+  order_addresses_for_connect (ai, ordered);
+
+  n_started = 0;
+  n_pending = 0;
+  last_start_sec = 0;
+  last_start_usec = 0;
+  winner = -1;
+
+  while (winner < 0)
+    {
+      long now_sec, now_usec;
+      int elapsed, poll_timeout, poll_res;
+
+      _dbus_get_current_time (&now_sec, &now_usec);
+      elapsed = (now_sec - last_start_sec) * 1000 +
+        (now_usec - last_start_usec) / 1000;
+
+      if (n_started < n_addresses &&
+          (n_pending == 0 || elapsed >= CONNECT_ATTEMPT_DELAY_MS ||
+           elapsed < 0))
+        {
+          int fd;
+
+          tmp = ordered[n_started++];
+          last_start_sec = now_sec;
+          last_start_usec = now_usec;
+
+          if (!_dbus_open_socket (&fd, tmp->ai_family, SOCK_STREAM, 0, NULL))
+            {
+              *saved_errno = errno;
+              continue;
+            }
+
+          if (!_dbus_set_fd_nonblocking (fd, NULL))
+            {
+              *saved_errno = errno;
+              _dbus_close (fd, NULL);
+              continue;
+            }
+
+          if (connect (fd, (struct sockaddr*) tmp->ai_addr, tmp->ai_addrlen) == 0)
+            {
+              winner = fd;
+              break;
+            }
+
+          if (errno != EINPROGRESS)
+            {
+              *saved_errno = errno;
+              _dbus_close (fd, NULL);
+              continue;
+            }
+
+          _dbus_verbose ("connecting to address %d of %d on fd %d\n",
+                         n_started, n_addresses, fd);
+
+          pending[n_pending].fd = fd;
+          pending[n_pending].events = _DBUS_POLLOUT;
+          pending[n_pending].revents = 0;
+          ++n_pending;
+          continue;
+        }
+
+      /* Nothing in progress and nothing left to try */
+      if (n_pending == 0)
+        break;
+
+      if (n_started < n_addresses)
+        poll_timeout = CONNECT_ATTEMPT_DELAY_MS - elapsed;
+      else
+        poll_timeout = -1;
+
+      poll_res = _dbus_poll (pending, n_pending, poll_timeout);
+      if (poll_res < 0)
+        {
+          if (_dbus_get_is_errno_eintr ())
+            continue;
+
+          *saved_errno = errno;
+          break;
+        }
+
+      i = 0;
+      while (i < n_pending)
+        {
+          int so_error;
+          socklen_t len;
+
+          if (pending[i].revents == 0)
+            {
+              ++i;
+              continue;
+            }
+
+          so_error = 0;
+          len = sizeof (so_error);
+          if (getsockopt (pending[i].fd, SOL_SOCKET, SO_ERROR,
+                          &so_error, &len) < 0)
+            so_error = errno;
+
+          if (so_error == 0)
+            {
+              winner = pending[i].fd;
+              pending[i] = pending[--n_pending];
+              break;
+            }
+
+          *saved_errno = so_error;
+          _dbus_close (pending[i].fd, NULL);
+          pending[i] = pending[--n_pending];
+        }
+    }
+
+  for (i = 0; i < n_pending; ++i)
+    _dbus_close (pending[i].fd, NULL);
+
+  dbus_free (ordered);
+  dbus_free (pending);
+
+  return winner;
+}
+
 int
 _dbus_connect_tcp_socket_with_nonce (const char     *host,
                                      const char     *port,
@@ -1192,18 +1739,10 @@ _dbus_connect_tcp_socket_with_nonce (const char     *host,
   int saved_errno = 0;
   int fd = -1, res;
   struct addrinfo hints;
-  struct addrinfo *ai, *tmp;
+  struct addrinfo *ai;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
-  if (!_dbus_open_tcp_socket (&fd, error))
-    {
-      _DBUS_ASSERT_ERROR_IS_SET(error);
-      return -1;
-    }
-
-  _DBUS_ASSERT_ERROR_IS_CLEAR(error);
-
   _DBUS_ZERO (hints);
 
   if (!family)
@@ -1229,34 +1768,18 @@ _dbus_connect_tcp_socket_with_nonce (const char     *host,
                       _dbus_error_from_errno (errno),
                       "Failed to lookup host/port: \"%s:%s\": %s (%d)",
                       host, port, gai_strerror(res), res);
-      _dbus_close (fd, NULL);
       return -1;
     }
 
-  tmp = ai;
-  while (tmp)
-    {
-      if (!_dbus_open_socket (&fd, tmp->ai_family, SOCK_STREAM, 0, error))
-        {
-          freeaddrinfo(ai);
-          _DBUS_ASSERT_ERROR_IS_SET(error);
-          return -1;
-        }
-      _DBUS_ASSERT_ERROR_IS_CLEAR(error);
-
-      if (connect (fd, (struct sockaddr*) tmp->ai_addr, tmp->ai_addrlen) < 0)
-        {
-          saved_errno = errno;
-          _dbus_close(fd, NULL);
-          fd = -1;
-          tmp = tmp->ai_next;
-          continue;
-        }
-
-      break;
-    }
+  /* Rather than wait out a full TCP timeout on each address that
+   * doesn't answer, race them, giving each a head start on the next.
+   */
+  fd = connect_to_first_answering (ai, &saved_errno, error);
   freeaddrinfo(ai);
 
+  if (fd == -1 && dbus_error_is_set (error))
+    return -1;
+
   if (fd == -1)
     {
       dbus_set_error (error,
@@ -1290,6 +1813,75 @@ _dbus_connect_tcp_socket_with_nonce (const char     *host,
   return fd;
 }
 
+static dbus_bool_t
+set_socket_option (int         fd,
+                   int         level,
+                   int         option,
+                   const char *option_name,
+                   int         value,
+                   DBusError  *error)
+{
+  if (setsockopt (fd, level, option, &value, sizeof (value)) < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to set %s on socket: %s",
+                      option_name, _dbus_strerror (errno));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * Applies the options given in a TCP address to a connected socket.
+ *
+ * @param fd the socket
+ * @param options the options
+ * @param error return location for errors
+ * @returns #FALSE if an option could not be set
+ */
+dbus_bool_t
+_dbus_set_tcp_socket_options (int                   fd,
+                              const DBusTcpOptions *options,
+                              DBusError            *error)
+{
+  if (options->nodelay >= 0 &&
+      !set_socket_option (fd, IPPROTO_TCP, TCP_NODELAY, "TCP_NODELAY",
+                          options->nodelay, error))
+    return FALSE;
+
+  if (options->keepalive >= 0 &&
+      !set_socket_option (fd, SOL_SOCKET, SO_KEEPALIVE, "SO_KEEPALIVE",
+                          options->keepalive, error))
+    return FALSE;
+
+  if (options->sndbuf > 0 &&
+      !set_socket_option (fd, SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF",
+                          options->sndbuf, error))
+    return FALSE;
+
+  if (options->rcvbuf > 0 &&
+      !set_socket_option (fd, SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF",
+                          options->rcvbuf, error))
+    return FALSE;
+
+#ifdef CAN_SEND_ZEROCOPY
+  if (options->zerocopy >= 0 &&
+      !set_socket_option (fd, SOL_SOCKET, SO_ZEROCOPY, "SO_ZEROCOPY",
+                          options->zerocopy, error))
+    return FALSE;
+#else
+  if (options->zerocopy > 0)
+    {
+      dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                      "Zero-copy sends are not supported on this platform");
+      return FALSE;
+    }
+#endif
+
+  return TRUE;
+}
+
 /**
  * Creates a socket and binds it to the given path, then listens on
  * the socket. The socket is set to be nonblocking.  In case of port=0
@@ -1301,6 +1893,14 @@ _dbus_connect_tcp_socket_with_nonce (const char     *host,
  * @param host the host name to listen on
  * @param port the port to listen on, if zero a free port will be used
  * @param family the address family to listen on, NULL for all
+ * If reuse_port is #TRUE the sockets are bound with SO_REUSEPORT,
+ * so that calling this again with the same port opens further
+ * listeners the kernel spreads incoming connections across.
+ *
+ * @param host the host name to listen on
+ * @param port the port to listen on, if zero a free port will be used
+ * @param family the address family to listen on, NULL for all
+ * @param reuse_port whether to allow other sockets to bind the same port
  * @param retport string to return the actual port listened on
  * @param fds_p location to store returned file descriptors
  * @param error return location for errors
@@ -1310,6 +1910,7 @@ int
 _dbus_listen_tcp_socket (const char     *host,
                          const char     *port,
                          const char     *family,
+                         dbus_bool_t     reuse_port,
                          DBusString     *retport,
                          int           **fds_p,
                          DBusError      *error)
@@ -1319,6 +1920,8 @@ _dbus_listen_tcp_socket (const char     *host,
   struct addrinfo hints;
   struct addrinfo *ai, *tmp;
   unsigned int reuseaddr;
+  struct sockaddr_storage first_addr;
+  socklen_t first_addrlen = 0;
 
   *fds_p = NULL;
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
@@ -1339,6 +1942,15 @@ _dbus_listen_tcp_socket (const char     *host,
       return -1;
     }
 
+#ifndef SO_REUSEPORT
+  if (reuse_port)
+    {
+      dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                      "Sharing a port between listening sockets is not supported on this platform");
+      return -1;
+    }
+#endif
+
   hints.ai_protocol = IPPROTO_TCP;
   hints.ai_socktype = SOCK_STREAM;
   hints.ai_flags = AI_ADDRCONFIG | AI_PASSIVE;
@@ -1357,6 +1969,18 @@ _dbus_listen_tcp_socket (const char     *host,
   while (tmp)
     {
       int fd = -1, *newlisten_fd;
+
+      /* After a redo with the chosen port, the address we already
+       * bound would normally fail with EADDRINUSE and be skipped
+       * below; with SO_REUSEPORT it would be bound twice instead. */
+      if (first_addrlen != 0 &&
+          tmp->ai_addrlen == first_addrlen &&
+          memcmp (tmp->ai_addr, &first_addr, first_addrlen) == 0)
+        {
+          tmp = tmp->ai_next;
+          continue;
+        }
+
       if (!_dbus_open_socket (&fd, tmp->ai_family, SOCK_STREAM, 0, error))
         {
           _DBUS_ASSERT_ERROR_IS_SET(error);
@@ -1371,6 +1995,23 @@ _dbus_listen_tcp_socket (const char     *host,
                       host ? host : "*", port, _dbus_strerror (errno));
         }
 
+#ifdef SO_REUSEPORT
+      if (reuse_port)
+        {
+          unsigned int reuseport = 1;
+
+          if (setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, &reuseport, sizeof(reuseport))==-1)
+            {
+              saved_errno = errno;
+              _dbus_close (fd, NULL);
+              dbus_set_error (error, _dbus_error_from_errno (saved_errno),
+                              "Failed to set SO_REUSEPORT on socket \"%s:%s\": %s",
+                              host ? host : "*", port, _dbus_strerror (saved_errno));
+              goto failed;
+            }
+        }
+#endif
+
       if (bind (fd, (struct sockaddr*) tmp->ai_addr, tmp->ai_addrlen) < 0)
         {
           saved_errno = errno;
@@ -1444,6 +2085,8 @@ _dbus_listen_tcp_socket (const char     *host,
                 }
 
               /* Release current address list & redo lookup */
+              memcpy (&first_addr, &addr, addrlen);
+              first_addrlen = addrlen;
               port = _dbus_string_get_const_data(retport);
               freeaddrinfo(ai);
               goto redo_lookup_with_port;
@@ -1689,8 +2332,13 @@ _dbus_read_credentials_socket  (int              client_fd,
     if (getsockopt (client_fd, SOL_SOCKET, SO_PEERCRED, &cr, &cr_len) == 0 &&
 	cr_len == sizeof (cr))
       {
-	pid_read = cr.pid;
-	uid_read = cr.uid;
+        /* Sockets with no peer process behind them, such as TCP
+         * ones, report pid 0 and uid -1; those aren't credentials.
+         */
+        if (cr.pid != 0)
+          pid_read = cr.pid;
+        if (cr.uid != (uid_t) -1)
+          uid_read = cr.uid;
       }
     else
       {
@@ -1826,6 +2474,23 @@ _dbus_send_credentials_socket  (int              server_fd,
     return FALSE;
 }
 
+/**
+ * Whether the byte _dbus_send_credentials_socket() writes is just a
+ * nul byte, with no credentials attached to it, in which case it can
+ * go out in the same write as the data following it.
+ *
+ * @returns #TRUE if the credentials byte is an ordinary byte
+ */
+dbus_bool_t
+_dbus_credentials_byte_is_plain (void)
+{
+#if defined(HAVE_CMSGCRED)
+  return FALSE;
+#else
+  return TRUE;
+#endif
+}
+
 /**
  * Accepts a connection on a listening socket.
  * Handles EINTR for you.
@@ -1878,6 +2543,57 @@ _dbus_accept  (int listen_fd)
   return client_fd;
 }
 
+/**
+ * Like _dbus_accept(), but the returned socket is also nonblocking.
+ * Where accept4() is available this takes a single system call
+ * instead of three.
+ *
+ * @param listen_fd the listen file descriptor
+ * @returns the connection fd of the client, or -1 on error
+ */
+int
+_dbus_accept_nonblocking (int listen_fd)
+{
+  int client_fd;
+  int saved_errno;
+
+#if defined(HAVE_ACCEPT4) && defined(SOCK_NONBLOCK)
+  struct sockaddr addr;
+  socklen_t addrlen;
+
+ retry:
+  addrlen = sizeof (addr);
+  client_fd = accept4 (listen_fd, &addr, &addrlen,
+                       SOCK_CLOEXEC | SOCK_NONBLOCK);
+
+  if (client_fd >= 0)
+    {
+      _dbus_verbose ("client fd %d accepted\n", client_fd);
+      return client_fd;
+    }
+
+  if (errno == EINTR)
+    goto retry;
+
+  if (errno != ENOSYS)
+    return -1;
+#endif
+
+  client_fd = _dbus_accept (listen_fd);
+  if (client_fd < 0)
+    return -1;
+
+  if (!_dbus_set_fd_nonblocking (client_fd, NULL))
+    {
+      saved_errno = errno;
+      _dbus_close (client_fd, NULL);
+      errno = saved_errno;
+      return -1;
+    }
+
+  return client_fd;
+}
+
 /**
  * Checks to make sure the given directory is
  * private to the user
@@ -2269,6 +2985,25 @@ _dbus_getpid (void)
   return getpid ();
 }
 
+/**
+ * Gets the number of processors currently online, for deciding
+ * whether busy-waiting for another thread can ever pay off.
+ *
+ * @returns the number of online processors, at least 1
+ */
+int
+_dbus_get_n_online_cpus (void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+  long n = sysconf (_SC_NPROCESSORS_ONLN);
+
+  if (n > 1)
+    return n;
+#endif
+
+  return 1;
+}
+
 /** Gets our UID
  * @returns process UID
  */
@@ -2339,7 +3074,7 @@ _dbus_parse_uid (const DBusString      *uid_str,
   return TRUE;
 }
 
-#if !DBUS_USE_SYNC
+#ifdef DBUS_ATOMIC_NEEDS_LOCK
 _DBUS_DEFINE_GLOBAL_LOCK (atomic);
 #endif
 
@@ -2352,8 +3087,10 @@ _DBUS_DEFINE_GLOBAL_LOCK (atomic);
 dbus_int32_t
 _dbus_atomic_inc (DBusAtomic *atomic)
 {
-#if DBUS_USE_SYNC
-  return __sync_add_and_fetch(&atomic->value, 1)-1;
+#if defined(DBUS_USE_ATOMIC_BUILTINS)
+  return __atomic_fetch_add (&atomic->value, 1, __ATOMIC_SEQ_CST);
+#elif defined(DBUS_USE_SYNC_BUILTINS)
+  return __sync_fetch_and_add (&atomic->value, 1);
 #elif defined(ANDROID_ATOMIC)
   return android_atomic_inc (&(atomic->value));
 #else
@@ -2375,8 +3112,10 @@ _dbus_atomic_inc (DBusAtomic *atomic)
 dbus_int32_t
 _dbus_atomic_dec (DBusAtomic *atomic)
 {
-#if DBUS_USE_SYNC
-  return __sync_sub_and_fetch(&atomic->value, 1)+1;
+#if defined(DBUS_USE_ATOMIC_BUILTINS)
+  return __atomic_fetch_sub (&atomic->value, 1, __ATOMIC_SEQ_CST);
+#elif defined(DBUS_USE_SYNC_BUILTINS)
+  return __sync_fetch_and_sub (&atomic->value, 1);
 #elif defined(ANDROID_ATOMIC)
   return android_atomic_dec (&(atomic->value));
 #else
@@ -2390,6 +3129,126 @@ _dbus_atomic_dec (DBusAtomic *atomic)
 #endif
 }
 
+/**
+ * Atomically add to an integer
+ *
+ * @param atomic pointer to the integer to add to
+ * @param delta amount to add, may be negative
+ * @returns the value before adding
+ */
+dbus_int32_t
+_dbus_atomic_add (DBusAtomic   *atomic,
+                  dbus_int32_t  delta)
+{
+#if defined(DBUS_USE_ATOMIC_BUILTINS)
+  return __atomic_fetch_add (&atomic->value, delta, __ATOMIC_SEQ_CST);
+#elif defined(DBUS_USE_SYNC_BUILTINS)
+  return __sync_fetch_and_add (&atomic->value, delta);
+#elif defined(ANDROID_ATOMIC)
+  return android_atomic_add (delta, &(atomic->value));
+#else
+  dbus_int32_t res;
+
+  _DBUS_LOCK (atomic);
+  res = atomic->value;
+  atomic->value += delta;
+  _DBUS_UNLOCK (atomic);
+  return res;
+#endif
+}
+
+/**
+ * Atomically get the value of an integer. Like the functions that
+ * modify it, this is a full memory barrier.
+ *
+ * @param atomic pointer to the integer to get
+ * @returns the value
+ */
+dbus_int32_t
+_dbus_atomic_get (DBusAtomic *atomic)
+{
+#if defined(DBUS_USE_ATOMIC_BUILTINS)
+  return __atomic_load_n (&atomic->value, __ATOMIC_SEQ_CST);
+#elif defined(DBUS_USE_SYNC_BUILTINS)
+  return __sync_add_and_fetch (&atomic->value, 0);
+#elif defined(ANDROID_ATOMIC)
+  return android_atomic_add (0, &(atomic->value));
+#else
+  dbus_int32_t res;
+
+  _DBUS_LOCK (atomic);
+  res = atomic->value;
+  _DBUS_UNLOCK (atomic);
+  return res;
+#endif
+}
+
+/**
+ * Atomically loads a pointer that another thread may store with
+ * _dbus_atomic_pointer_set(). This is a full memory barrier, so
+ * whatever the storing thread wrote before storing the pointer is
+ * visible once the pointer is.
+ *
+ * @param location the pointer to load
+ * @returns its value
+ */
+void *
+_dbus_atomic_pointer_get (void * volatile *location)
+{
+#if defined(DBUS_USE_ATOMIC_BUILTINS)
+  return __atomic_load_n (location, __ATOMIC_SEQ_CST);
+#elif defined(DBUS_USE_SYNC_BUILTINS)
+  void *value;
+
+  __sync_synchronize ();
+  value = *location;
+  __sync_synchronize ();
+  return value;
+#elif defined(ANDROID_ATOMIC)
+  void *value;
+
+  android_memory_barrier ();
+  value = *location;
+  android_memory_barrier ();
+  return value;
+#else
+  void *value;
+
+  _DBUS_LOCK (atomic);
+  value = *location;
+  _DBUS_UNLOCK (atomic);
+  return value;
+#endif
+}
+
+/**
+ * Atomically stores a pointer for _dbus_atomic_pointer_get(). This is
+ * a full memory barrier.
+ *
+ * @param location the pointer to store
+ * @param value the value to store in it
+ */
+void
+_dbus_atomic_pointer_set (void * volatile *location,
+                          void            *value)
+{
+#if defined(DBUS_USE_ATOMIC_BUILTINS)
+  __atomic_store_n (location, value, __ATOMIC_SEQ_CST);
+#elif defined(DBUS_USE_SYNC_BUILTINS)
+  __sync_synchronize ();
+  *location = value;
+  __sync_synchronize ();
+#elif defined(ANDROID_ATOMIC)
+  android_memory_barrier ();
+  *location = value;
+  android_memory_barrier ();
+#else
+  _DBUS_LOCK (atomic);
+  *location = value;
+  _DBUS_UNLOCK (atomic);
+#endif
+}
+
 #ifdef DBUS_BUILD_TESTS
 /** Gets our GID
  * @returns process GID
@@ -2501,6 +3360,61 @@ _dbus_poll (DBusPollFD *fds,
 #endif
 }
 
+#ifdef HAVE_MREMAP
+/**
+ * Maps fresh zeroed pages of memory, for a buffer too large to keep
+ * in the heap; see _dbus_pages_remap().
+ *
+ * @param bytes size of the block
+ * @returns the block, or #NULL if no memory
+ */
+void*
+_dbus_pages_map (size_t bytes)
+{
+  void *block;
+
+  block = mmap (NULL, bytes, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  return block == MAP_FAILED ? NULL : block;
+}
+
+/**
+ * Resizes a block from _dbus_pages_map(). The kernel moves the pages
+ * rather than their contents, so unlike realloc() this never copies.
+ *
+ * @param block the block
+ * @param old_bytes its size
+ * @param new_bytes the size it should be
+ * @returns the resized block, or #NULL if no memory (the old block is
+ *  then left alone)
+ */
+void*
+_dbus_pages_remap (void   *block,
+                   size_t  old_bytes,
+                   size_t  new_bytes)
+{
+  block = mremap (block, old_bytes, new_bytes, MREMAP_MAYMOVE);
+
+  return block == MAP_FAILED ? NULL : block;
+}
+
+/**
+ * Returns a block from _dbus_pages_map() to the system.
+ *
+ * @param block the block
+ * @param bytes its size
+ */
+void
+_dbus_pages_unmap (void   *block,
+                   size_t  bytes)
+{
+  if (munmap (block, bytes) < 0)
+    _dbus_warn ("Failed to unmap %lu bytes: %s\n", (unsigned long) bytes,
+                _dbus_strerror (errno));
+}
+#endif /* HAVE_MREMAP */
+
 /**
  * Get current time, as in gettimeofday(). Use the monotonic clock if
  * available, to avoid problems when the system time changes.
@@ -2767,6 +3681,28 @@ _dbus_fd_set_close_on_exec (intptr_t fd)
   fcntl (fd, F_SETFD, val);
 }
 
+/**
+ * Lets the file descriptor be inherited across exec, undoing
+ * _dbus_fd_set_close_on_exec(); for a process handing descriptors
+ * to the program it is about to become.
+ *
+ * @param fd the file descriptor
+ */
+void
+_dbus_fd_clear_close_on_exec (int fd)
+{
+  int val;
+
+  val = fcntl (fd, F_GETFD, 0);
+
+  if (val < 0)
+    return;
+
+  val &= ~FD_CLOEXEC;
+
+  fcntl (fd, F_SETFD, val);
+}
+
 /**
  * Closes a file descriptor.
  *
@@ -2995,6 +3931,110 @@ _dbus_full_duplex_pipe (int        *fd1,
 #endif
 }
 
+/**
+ * Creates a wakeup channel one thread can use to interrupt another
+ * thread's poll(). Uses an eventfd where available, in which case
+ * both returned descriptors are the same, and a pipe otherwise.
+ * Both ends are nonblocking and close-on-exec.
+ *
+ * @param read_fd return location for the end to poll and drain
+ * @param write_fd return location for the end to signal
+ * @returns #FALSE if the channel could not be created
+ */
+dbus_bool_t
+_dbus_wakeup_new (int *read_fd,
+                  int *write_fd)
+{
+  int fds[2];
+
+#ifdef HAVE_SYS_EVENTFD_H
+  fds[0] = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fds[0] >= 0)
+    {
+      *read_fd = fds[0];
+      *write_fd = fds[0];
+      return TRUE;
+    }
+#endif
+
+  if (pipe (fds) < 0)
+    {
+      _dbus_verbose ("Failed to create wakeup pipe: %s\n",
+                     _dbus_strerror (errno));
+      return FALSE;
+    }
+
+  _dbus_fd_set_close_on_exec (fds[0]);
+  _dbus_fd_set_close_on_exec (fds[1]);
+
+  if (!_dbus_set_fd_nonblocking (fds[0], NULL) ||
+      !_dbus_set_fd_nonblocking (fds[1], NULL))
+    {
+      _dbus_close (fds[0], NULL);
+      _dbus_close (fds[1], NULL);
+      return FALSE;
+    }
+
+  *read_fd = fds[0];
+  *write_fd = fds[1];
+  return TRUE;
+}
+
+/**
+ * Makes the read end of a wakeup channel readable. Signalling a
+ * channel that is already readable is harmless.
+ *
+ * @param write_fd the write end from _dbus_wakeup_new()
+ */
+void
+_dbus_wakeup_signal (int write_fd)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+  dbus_uint64_t one = 1;
+  const void *buf = &one;
+  size_t len = sizeof (one);
+#else
+  const void *buf = "";
+  size_t len = 1;
+#endif
+
+  /* EAGAIN means the channel is already readable, which is all we want */
+  while (write (write_fd, buf, len) < 0 && errno == EINTR)
+    ;
+}
+
+/**
+ * Consumes every pending signal on a wakeup channel so that its read
+ * end stops polling readable.
+ *
+ * @param read_fd the read end from _dbus_wakeup_new()
+ */
+void
+_dbus_wakeup_drain (int read_fd)
+{
+  char buf[64];
+  int n;
+
+  do
+    n = read (read_fd, buf, sizeof (buf));
+  while (n > 0 || (n < 0 && errno == EINTR));
+}
+
+/**
+ * Closes both ends of a wakeup channel.
+ *
+ * @param read_fd the read end from _dbus_wakeup_new()
+ * @param write_fd the write end from _dbus_wakeup_new()
+ */
+void
+_dbus_wakeup_free (int read_fd,
+                   int write_fd)
+{
+  _dbus_close (read_fd, NULL);
+  if (write_fd != read_fd)
+    _dbus_close (write_fd, NULL);
+}
+
 /**
  * Measure the length of the given format string and arguments,
  * not including the terminating nul.
@@ -3049,6 +4089,55 @@ _dbus_get_tmpdir(void)
   return tmpdir;
 }
 
+/**
+ * Creates a file in the temporary files directory and unlinks it at
+ * once, so that nothing but the returned descriptor reaches it and it
+ * is gone when the last descriptor to it is closed. The descriptor is
+ * close-on-exec.
+ *
+ * @param error return location for an error
+ * @returns the file descriptor, or -1 with error set
+ */
+int
+_dbus_open_unlinked_temp_file (DBusError *error)
+{
+  DBusString filename;
+  int fd;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!_dbus_string_init (&filename))
+    {
+      _DBUS_SET_OOM (error);
+      return -1;
+    }
+
+  if (!_dbus_string_append (&filename, _dbus_get_tmpdir ()) ||
+      !_dbus_string_append (&filename, "/dbus-XXXXXX"))
+    {
+      _dbus_string_free (&filename);
+      _DBUS_SET_OOM (error);
+      return -1;
+    }
+
+  fd = mkstemp (_dbus_string_get_data (&filename));
+  if (fd < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Could not create temporary file in %s: %s",
+                      _dbus_get_tmpdir (), _dbus_strerror (errno));
+      _dbus_string_free (&filename);
+      return -1;
+    }
+
+  unlink (_dbus_string_get_const_data (&filename));
+  _dbus_string_free (&filename);
+
+  _dbus_fd_set_close_on_exec (fd);
+
+  return fd;
+}
+
 /**
  * Execute a subprocess, returning up to 1024 bytes of output
  * into @p result.
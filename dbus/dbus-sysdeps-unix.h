@@ -67,19 +67,34 @@ dbus_bool_t _dbus_open_unix_socket (int              *fd,
                                     DBusError        *error);
 int _dbus_connect_unix_socket (const char     *path,
                                dbus_bool_t     abstract,
+                               dbus_bool_t     seqpacket,
                                DBusError      *error);
 int _dbus_listen_unix_socket  (const char     *path,
                                dbus_bool_t     abstract,
+                               dbus_bool_t     seqpacket,
                                DBusError      *error);
 
 int _dbus_listen_systemd_sockets (int       **fd,
                                  DBusError *error);
+dbus_bool_t _dbus_append_address_from_socket (int         fd,
+                                              DBusString *address);
+
+dbus_bool_t _dbus_wakeup_new    (int *read_fd,
+                                 int *write_fd);
+void        _dbus_wakeup_signal (int  write_fd);
+void        _dbus_wakeup_drain  (int  read_fd);
+void        _dbus_wakeup_free   (int  read_fd,
+                                 int  write_fd);
+
+void _dbus_fd_clear_close_on_exec  (int        fd);
+int  _dbus_open_unlinked_temp_file (DBusError *error);
 
 dbus_bool_t _dbus_read_credentials (int               client_fd,
                                     DBusCredentials  *credentials,
                                     DBusError        *error);
 dbus_bool_t _dbus_send_credentials (int              server_fd,
                                     DBusError       *error);
+dbus_bool_t _dbus_credentials_byte_is_plain (void);
 
 /** Information about a UNIX user */
 typedef struct DBusUserInfo  DBusUserInfo;
@@ -131,6 +146,13 @@ dbus_gid_t    _dbus_getgid (void);
 dbus_bool_t _dbus_parse_uid (const DBusString  *uid_str,
                              dbus_uid_t        *uid);
 
+void*       _dbus_file_map_shared   (const DBusString *filename,
+                                     size_t            size,
+                                     dbus_bool_t       world_readable,
+                                     DBusError        *error);
+void        _dbus_file_unmap_shared (void             *block,
+                                     size_t            size);
+
 /** @} */
 
 DBUS_END_DECLS
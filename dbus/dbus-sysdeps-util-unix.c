@@ -42,6 +42,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <grp.h>
 #include <sys/socket.h>
 #include <dirent.h>
@@ -212,6 +213,132 @@ _dbus_write_pid_file (const DBusString *filename,
   return TRUE;
 }
 
+/**
+ * Creates a file of the given size, filled with zeroes, and maps it
+ * into memory shared with every process that maps the file, so that
+ * they see what is stored there without anything being written out.
+ * The file is created under a temporary name and renamed into place
+ * once it is ready, so it atomically replaces any file of the same
+ * name; whoever still has that one mapped keeps seeing it.
+ *
+ * @param filename the file to create
+ * @param size its size
+ * @param world_readable if set, anyone may read the file, otherwise only its owner
+ * @param error error to be filled in on failure
+ * @returns the mapped file, or #NULL on failure
+ */
+void*
+_dbus_file_map_shared (const DBusString *filename,
+                       size_t            size,
+                       dbus_bool_t       world_readable,
+                       DBusError        *error)
+{
+  DBusString tmp_filename;
+  const char *filename_c;
+  const char *tmp_filename_c;
+  void *block;
+  int fd;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  block = NULL;
+  fd = -1;
+
+  if (!_dbus_string_init (&tmp_filename))
+    {
+      _DBUS_SET_OOM (error);
+      return NULL;
+    }
+
+  if (!_dbus_string_copy (filename, 0, &tmp_filename, 0) ||
+      !_dbus_string_append (&tmp_filename, ".") ||
+      !_dbus_generate_random_ascii (&tmp_filename, 8))
+    {
+      _DBUS_SET_OOM (error);
+      _dbus_string_free (&tmp_filename);
+      return NULL;
+    }
+
+  filename_c = _dbus_string_get_const_data (filename);
+  tmp_filename_c = _dbus_string_get_const_data (&tmp_filename);
+
+  fd = open (tmp_filename_c, O_RDWR | O_CREAT | O_EXCL,
+             world_readable ? 0644 : 0600);
+  if (fd < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Could not create %s: %s", tmp_filename_c,
+                      _dbus_strerror (errno));
+      _dbus_string_free (&tmp_filename);
+      return NULL;
+    }
+
+  /* as in _dbus_string_save_to_file(), despite the umask */
+  if (world_readable && fchmod (fd, 0644) < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Could not chmod %s: %s", tmp_filename_c,
+                      _dbus_strerror (errno));
+      goto failed;
+    }
+
+  if (ftruncate (fd, size) < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Could not make %s %lu bytes long: %s", tmp_filename_c,
+                      (unsigned long) size, _dbus_strerror (errno));
+      goto failed;
+    }
+
+  block = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (block == MAP_FAILED)
+    {
+      block = NULL;
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Could not map %s: %s", tmp_filename_c,
+                      _dbus_strerror (errno));
+      goto failed;
+    }
+
+  if (rename (tmp_filename_c, filename_c) < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Could not rename %s to %s: %s",
+                      tmp_filename_c, filename_c,
+                      _dbus_strerror (errno));
+      munmap (block, size);
+      block = NULL;
+      goto failed;
+    }
+
+  /* the mapping keeps the file open */
+  _dbus_close (fd, NULL);
+  _dbus_string_free (&tmp_filename);
+  return block;
+
+ failed:
+  _dbus_close (fd, NULL);
+  unlink (tmp_filename_c);
+  _dbus_string_free (&tmp_filename);
+  return NULL;
+}
+
+/**
+ * Unmaps a file mapped with _dbus_file_map_shared(). The file itself
+ * is left alone.
+ *
+ * @param block the mapped file
+ * @param size its size
+ */
+void
+_dbus_file_unmap_shared (void   *block,
+                         size_t  size)
+{
+  if (munmap (block, size) < 0)
+    _dbus_warn ("Failed to unmap %lu bytes: %s\n", (unsigned long) size,
+                _dbus_strerror (errno));
+}
+
 /**
  * Writes the given pid_to_write to a pidfile (if non-NULL) and/or to a
  * pipe (if non-NULL). Does nothing if pidfile and print_pid_pipe are both
@@ -72,6 +72,48 @@ check_path_absolute (const char *path,
     }
 }
 
+#ifdef DBUS_UNIX
+static void
+check_write_socket_many (void)
+{
+  DBusString a, empty, b, c, received;
+  const DBusString *buffers[4];
+  int fds[2];
+  int n;
+
+  if (!_dbus_full_duplex_pipe (&fds[0], &fds[1], TRUE, NULL))
+    _dbus_assert_not_reached ("could not create socket pair");
+
+  _dbus_string_init_const (&a, "ab");
+  _dbus_string_init_const (&empty, "");
+  _dbus_string_init_const (&b, "cde");
+  _dbus_string_init_const (&c, "f");
+  buffers[0] = &a;
+  buffers[1] = &empty;
+  buffers[2] = &b;
+  buffers[3] = &c;
+
+  /* as if a previous write had stopped part way through the first buffer */
+  n = _dbus_write_socket_many (fds[0], buffers, 4, 1);
+  _dbus_assert (n == 5);
+
+  /* nothing left after skipping everything */
+  n = _dbus_write_socket_many (fds[0], buffers, 4, 6);
+  _dbus_assert (n == 0);
+
+  if (!_dbus_string_init (&received))
+    _dbus_assert_not_reached ("no memory");
+
+  n = _dbus_read_socket (fds[1], &received, 16);
+  _dbus_assert (n == 5);
+  _dbus_assert (_dbus_string_equal_c_str (&received, "bcdef"));
+
+  _dbus_string_free (&received);
+  _dbus_close_socket (fds[0], NULL);
+  _dbus_close_socket (fds[1], NULL);
+}
+#endif
+
 /**
  * Unit test for dbus-sysdeps.c.
  * 
@@ -172,6 +214,10 @@ _dbus_sysdeps_test (void)
   check_path_absolute ("foo", FALSE);
   check_path_absolute ("foo/bar", FALSE);
 #endif
+
+#ifdef DBUS_UNIX
+  check_write_socket_many ();
+#endif
   
   return TRUE;
 }
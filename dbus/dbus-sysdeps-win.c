@@ -362,6 +362,79 @@ _dbus_set_fd_nonblocking (int             handle,
   return TRUE;
 }
 
+/**
+ * Zero-copy sends are not supported on Windows.
+ *
+ * @param fd the socket
+ * @returns #FALSE
+ */
+dbus_bool_t
+_dbus_socket_get_zerocopy (int fd)
+{
+  return FALSE;
+}
+
+/**
+ * Sockets made by D-Bus on Windows are always streams.
+ *
+ * @param fd the socket
+ * @returns #FALSE
+ */
+dbus_bool_t
+_dbus_socket_get_seqpacket (int fd)
+{
+  return FALSE;
+}
+
+/**
+ * Never called, since _dbus_socket_get_seqpacket() always fails.
+ *
+ * @param fd the socket
+ * @returns -1
+ */
+int
+_dbus_socket_peek_packet_size (int fd)
+{
+  return -1;
+}
+
+/**
+ * Zero-copy sends are not supported on Windows; this is never
+ * called, since _dbus_socket_get_zerocopy() always fails.
+ *
+ * @param fd the socket
+ * @param buffer the buffer to write data from
+ * @param start the first byte in the buffer to write
+ * @param len the number of bytes to try to write
+ * @returns the number of bytes written or -1 on error
+ */
+int
+_dbus_write_socket_zerocopy (int               fd,
+                             const DBusString *buffer,
+                             int               start,
+                             int               len)
+{
+  _dbus_assert_not_reached ("zero-copy sends are never enabled here");
+  return -1;
+}
+
+/**
+ * Zero-copy sends are not supported on Windows, so there are never
+ * any completions.
+ *
+ * @param fd the socket
+ * @param first_p unused
+ * @param last_p unused
+ * @returns 0
+ */
+int
+_dbus_read_zerocopy_completion (int            fd,
+                                dbus_uint32_t *first_p,
+                                dbus_uint32_t *last_p)
+{
+  return 0;
+}
+
 
 /**
  * Like _dbus_write() but will use writev() if possible
@@ -447,6 +520,77 @@ _dbus_write_socket_two (int               fd,
   return bytes_written;
 }
 
+/**
+ * Writes the concatenation of several buffers to a socket with a
+ * single call, skipping the first @p skip bytes (which were written
+ * by an earlier, partial call). May write fewer bytes than requested.
+ *
+ * @param fd the file descriptor
+ * @param buffers the buffers, at most #_DBUS_MAX_SOCKET_WRITE_BUFFERS
+ * @param n_buffers number of buffers
+ * @param skip number of leading bytes already written
+ * @returns total bytes written, or -1 on error
+ */
+int
+_dbus_write_socket_many (int                fd,
+                         const DBusString **buffers,
+                         int                n_buffers,
+                         int                skip)
+{
+  WSABUF vectors[_DBUS_MAX_SOCKET_WRITE_BUFFERS];
+  int n_vectors;
+  int rc;
+  DWORD bytes_written;
+  int i;
+
+  _dbus_assert (n_buffers > 0);
+  _dbus_assert (n_buffers <= _DBUS_MAX_SOCKET_WRITE_BUFFERS);
+  _dbus_assert (skip >= 0);
+
+  n_vectors = 0;
+  for (i = 0; i < n_buffers; i++)
+    {
+      int len = _dbus_string_get_length (buffers[i]);
+
+      if (skip >= len)
+        {
+          skip -= len;
+          continue;
+        }
+
+      vectors[n_vectors].buf =
+        (char*) _dbus_string_get_const_data_len (buffers[i], skip, len - skip);
+      vectors[n_vectors].len = len - skip;
+      n_vectors += 1;
+      skip = 0;
+    }
+
+  _dbus_assert (skip == 0);
+
+  if (n_vectors == 0)
+    return 0;
+
+  _dbus_verbose ("WSASend: %d buffers fd=%d\n", n_vectors, fd);
+  rc = WSASend (fd, 
+                vectors,
+                n_vectors, 
+                &bytes_written,
+                0, 
+                NULL, 
+                NULL);
+                
+  if (rc == SOCKET_ERROR)
+    {
+      DBUS_SOCKET_SET_ERRNO ();
+      _dbus_verbose ("WSASend: failed: %s\n", _dbus_strerror_from_errno ());
+      bytes_written = -1;
+    }
+  else
+    _dbus_verbose ("WSASend: = %ld\n", bytes_written);
+
+  return bytes_written;
+}
+
 dbus_bool_t
 _dbus_socket_is_invalid (int fd)
 {
@@ -1368,6 +1512,69 @@ _dbus_connect_tcp_socket_with_nonce (const char     *host,
   return fd;
 }
 
+static dbus_bool_t
+set_socket_option (int         fd,
+                   int         level,
+                   int         option,
+                   const char *option_name,
+                   int         value,
+                   DBusError  *error)
+{
+  if (setsockopt (fd, level, option, (const char *) &value, sizeof (value)) == SOCKET_ERROR)
+    {
+      DBUS_SOCKET_SET_ERRNO ();
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to set %s on socket: %s",
+                      option_name, _dbus_strerror (errno));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * Applies the options given in a TCP address to a connected socket.
+ *
+ * @param fd the socket
+ * @param options the options
+ * @param error return location for errors
+ * @returns #FALSE if an option could not be set
+ */
+dbus_bool_t
+_dbus_set_tcp_socket_options (int                   fd,
+                              const DBusTcpOptions *options,
+                              DBusError            *error)
+{
+  if (options->nodelay >= 0 &&
+      !set_socket_option (fd, IPPROTO_TCP, TCP_NODELAY, "TCP_NODELAY",
+                          options->nodelay, error))
+    return FALSE;
+
+  if (options->keepalive >= 0 &&
+      !set_socket_option (fd, SOL_SOCKET, SO_KEEPALIVE, "SO_KEEPALIVE",
+                          options->keepalive, error))
+    return FALSE;
+
+  if (options->sndbuf > 0 &&
+      !set_socket_option (fd, SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF",
+                          options->sndbuf, error))
+    return FALSE;
+
+  if (options->rcvbuf > 0 &&
+      !set_socket_option (fd, SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF",
+                          options->rcvbuf, error))
+    return FALSE;
+
+  if (options->zerocopy > 0)
+    {
+      dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                      "Zero-copy sends are not supported on this platform");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 /**
  * Creates a socket and binds it to the given path, then listens on
  * the socket. The socket is set to be nonblocking.  In case of port=0
@@ -1377,6 +1584,7 @@ _dbus_connect_tcp_socket_with_nonce (const char     *host,
  * @param host the host name to listen on
  * @param port the port to listen on, if zero a free port will be used 
  * @param family the address family to listen on, NULL for all
+ * @param reuse_port must be #FALSE, sharing a port is not supported
  * @param retport string to return the actual port listened on
  * @param fds_p location to store returned file descriptors
  * @param error return location for errors
@@ -1387,6 +1595,7 @@ int
 _dbus_listen_tcp_socket (const char     *host,
                          const char     *port,
                          const char     *family,
+                         dbus_bool_t     reuse_port,
                          DBusString     *retport,
                          int           **fds_p,
                          DBusError      *error)
@@ -1426,6 +1635,13 @@ _dbus_listen_tcp_socket (const char     *host,
       return -1;
     }
 
+  if (reuse_port)
+    {
+      dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                      "Sharing a port between listening sockets is not supported on this platform");
+      return -1;
+    }
+
   hints.ai_protocol = IPPROTO_TCP;
   hints.ai_socktype = SOCK_STREAM;
 #ifdef AI_ADDRCONFIG
@@ -1598,6 +1814,30 @@ _dbus_accept  (int listen_fd)
   return client_fd;
 }
 
+/**
+ * Like _dbus_accept(), but the returned socket is also nonblocking.
+ *
+ * @param listen_fd the listen file descriptor
+ * @returns the connection fd of the client, or -1 on error
+ */
+int
+_dbus_accept_nonblocking (int listen_fd)
+{
+  int client_fd;
+
+  client_fd = _dbus_accept (listen_fd);
+  if (DBUS_SOCKET_IS_INVALID (client_fd))
+    return -1;
+
+  if (!_dbus_set_fd_nonblocking (client_fd, NULL))
+    {
+      closesocket (client_fd);
+      return -1;
+    }
+
+  return client_fd;
+}
+
 
 
 
@@ -1851,6 +2091,22 @@ _dbus_getpid (void)
   return GetCurrentProcessId ();
 }
 
+/**
+ * Gets the number of processors currently online, for deciding
+ * whether busy-waiting for another thread can ever pay off.
+ *
+ * @returns the number of online processors, at least 1
+ */
+int
+_dbus_get_n_online_cpus (void)
+{
+  SYSTEM_INFO info;
+
+  GetSystemInfo (&info);
+
+  return info.dwNumberOfProcessors > 1 ? (int) info.dwNumberOfProcessors : 1;
+}
+
 /** nanoseconds in a second */
 #define NANOSECONDS_PER_SECOND       1000000000
 /** microseconds in a second */
@@ -2860,8 +3116,6 @@ _dbus_get_standard_system_servicedirs (DBusList **dirs)
   return TRUE;
 }
 
-_DBUS_DEFINE_GLOBAL_LOCK (atomic);
-
 /**
  * Atomically increments an integer
  *
@@ -2892,6 +3146,63 @@ _dbus_atomic_dec (DBusAtomic *atomic)
   return InterlockedDecrement (&atomic->value) + 1;
 }
 
+/**
+ * Atomically add to an integer
+ *
+ * @param atomic pointer to the integer to add to
+ * @param delta amount to add, may be negative
+ * @returns the value before adding
+ *
+ */
+dbus_int32_t
+_dbus_atomic_add (DBusAtomic   *atomic,
+                  dbus_int32_t  delta)
+{
+  // no volatile argument with mingw
+  return InterlockedExchangeAdd (&atomic->value, delta);
+}
+
+/**
+ * Atomically get the value of an integer. Like the functions that
+ * modify it, this is a full memory barrier.
+ *
+ * @param atomic pointer to the integer to get
+ * @returns the value
+ */
+dbus_int32_t
+_dbus_atomic_get (DBusAtomic *atomic)
+{
+  return InterlockedExchangeAdd (&atomic->value, 0);
+}
+
+/**
+ * Atomically loads a pointer that another thread may store with
+ * _dbus_atomic_pointer_set(). This is a full memory barrier.
+ *
+ * @param location the pointer to load
+ * @returns its value
+ */
+void *
+_dbus_atomic_pointer_get (void * volatile *location)
+{
+  return InterlockedCompareExchangePointer ((PVOID volatile *) location,
+                                            NULL, NULL);
+}
+
+/**
+ * Atomically stores a pointer for _dbus_atomic_pointer_get(). This is
+ * a full memory barrier.
+ *
+ * @param location the pointer to store
+ * @param value the value to store in it
+ */
+void
+_dbus_atomic_pointer_set (void * volatile *location,
+                          void            *value)
+{
+  InterlockedExchangePointer ((PVOID volatile *) location, value);
+}
+
 /**
  * Called when the bus daemon is signaled to reload its configuration; any
  * caches should be nuked. Of course any caches that need explicit reload
@@ -49,6 +49,7 @@
 _DBUS_DEFINE_GLOBAL_LOCK (win_fds);
 _DBUS_DEFINE_GLOBAL_LOCK (sid_atom_cache);
 _DBUS_DEFINE_GLOBAL_LOCK (system_users);
+_DBUS_DEFINE_GLOBAL_LOCK (spawn);
 
 #ifdef DBUS_WIN
   #include <stdlib.h>
@@ -1057,6 +1058,16 @@ _dbus_get_is_errno_epipe (void)
   return errno == EPIPE;
 }
 
+/**
+ * See if errno is EMSGSIZE
+ * @returns #TRUE if errno == EMSGSIZE
+ */
+dbus_bool_t
+_dbus_get_is_errno_emsgsize (void)
+{
+  return errno == EMSGSIZE;
+}
+
 /**
  * Get error message from errno
  * @returns _dbus_strerror(errno)
@@ -140,10 +140,31 @@ int         _dbus_write_socket_two (int               fd,
                                     int               start2,
                                     int               len2);
 
+/** Most buffers _dbus_write_socket_many() accepts; no more than the
+ * smallest IOV_MAX POSIX allows.
+ */
+#define _DBUS_MAX_SOCKET_WRITE_BUFFERS 16
+
+int         _dbus_write_socket_many (int                fd,
+                                     const DBusString **buffers,
+                                     int                n_buffers,
+                                     int                skip);
+
+dbus_bool_t _dbus_socket_get_zerocopy       (int               fd);
+dbus_bool_t _dbus_socket_get_seqpacket      (int               fd);
+int         _dbus_socket_peek_packet_size   (int               fd);
+int         _dbus_write_socket_zerocopy     (int               fd,
+                                             const DBusString *buffer,
+                                             int               start,
+                                             int               len);
+int         _dbus_read_zerocopy_completion  (int               fd,
+                                             dbus_uint32_t    *first_p,
+                                             dbus_uint32_t    *last_p);
+
 int _dbus_read_socket_with_unix_fds      (int               fd,
                                           DBusString       *buffer,
                                           int               count,
-                                          int              *fds,
+                                          DBusString       *fds,
                                           int              *n_fds);
 int _dbus_write_socket_with_unix_fds     (int               fd,
                                           const DBusString *buffer,
@@ -172,13 +193,38 @@ int _dbus_connect_tcp_socket_with_nonce  (const char     *host,
                                           const char     *family,
                                           const char     *noncefile,
                                           DBusError      *error);
+/**
+ * Socket options for a TCP connection, from the keys of a tcp: or
+ * nonce-tcp: address.
+ */
+typedef struct
+{
+  int nodelay;   /**< 1 to set TCP_NODELAY, 0 to clear it, -1 to leave it alone */
+  int keepalive; /**< 1 to set SO_KEEPALIVE, 0 to clear it, -1 to leave it alone */
+  int sndbuf;    /**< SO_SNDBUF in bytes, or 0 to leave it alone */
+  int rcvbuf;    /**< SO_RCVBUF in bytes, or 0 to leave it alone */
+  int zerocopy;  /**< 1 to set SO_ZEROCOPY, 0 to clear it, -1 to leave it alone */
+  int seqpacket; /**< 1 for a unix socket of type SOCK_SEQPACKET rather than a
+                  *   stream; chosen when the socket is made, not applied after
+                  */
+  int compress;  /**< 1 to offer LZ4 compression of the message stream;
+                  *   negotiated during auth, not a socket option at all
+                  */
+} DBusTcpOptions;
+
+dbus_bool_t _dbus_set_tcp_socket_options (int                   fd,
+                                          const DBusTcpOptions *options,
+                                          DBusError            *error);
+
 int _dbus_listen_tcp_socket   (const char     *host,
                                const char     *port,
                                const char     *family,
+                               dbus_bool_t     reuse_port,
                                DBusString     *retport,
                                int           **fds_p,
                                DBusError      *error);
 int _dbus_accept              (int             listen_fd);
+int _dbus_accept_nonblocking  (int             listen_fd);
 
 
 dbus_bool_t _dbus_read_credentials_socket (int               client_fd,
@@ -240,8 +286,28 @@ struct DBusAtomic
 #   undef DBUS_HAVE_ATOMIC_INT
 #endif
 
+/* Pick the implementation of _dbus_atomic_inc() and friends on Unix:
+ * the __atomic builtins where the compiler has them (gcc >= 4.7,
+ * clang, including the Android toolchains), else the older __sync
+ * builtins, else libcutils on Android. Only when none of these exists
+ * do they fall back to taking the global atomic lock. */
+#if defined(__ATOMIC_SEQ_CST)
+#   define DBUS_USE_ATOMIC_BUILTINS 1
+#elif DBUS_USE_SYNC || defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_4)
+#   define DBUS_USE_SYNC_BUILTINS 1
+#elif !defined(DBUS_WIN) && !defined(ANDROID_ATOMIC)
+#   define DBUS_ATOMIC_NEEDS_LOCK 1
+#endif
+
 dbus_int32_t _dbus_atomic_inc (DBusAtomic *atomic);
 dbus_int32_t _dbus_atomic_dec (DBusAtomic *atomic);
+dbus_int32_t _dbus_atomic_add (DBusAtomic   *atomic,
+                               dbus_int32_t  delta);
+dbus_int32_t _dbus_atomic_get (DBusAtomic *atomic);
+
+void *_dbus_atomic_pointer_get (void * volatile *location);
+void  _dbus_atomic_pointer_set (void * volatile *location,
+                                void            *value);
 
 
 /* AIX uses different values for poll */
@@ -306,6 +372,15 @@ void _dbus_sleep_milliseconds (int milliseconds);
 void _dbus_get_current_time (long *tv_sec,
                              long *tv_usec);
 
+#ifdef HAVE_MREMAP
+void* _dbus_pages_map   (size_t  bytes);
+void* _dbus_pages_remap (void   *block,
+                         size_t  old_bytes,
+                         size_t  new_bytes);
+void  _dbus_pages_unmap (void   *block,
+                         size_t  bytes);
+#endif
+
 /**
  * directory interface
  */
@@ -364,6 +439,7 @@ dbus_bool_t _dbus_get_is_errno_eagain_or_ewouldblock (void);
 dbus_bool_t _dbus_get_is_errno_enomem                (void);
 dbus_bool_t _dbus_get_is_errno_eintr                 (void);
 dbus_bool_t _dbus_get_is_errno_epipe                 (void);
+dbus_bool_t _dbus_get_is_errno_emsgsize              (void);
 const char* _dbus_strerror_from_errno                (void);
 
 void _dbus_disable_sigpipe (void);
@@ -497,6 +573,17 @@ dbus_bool_t _dbus_read_local_machine_uuid   (DBusGUID         *machine_id,
  */
 dbus_bool_t _dbus_threads_init_platform_specific (void);
 
+/**
+ * Opaque handle to a thread-local storage slot.
+ */
+typedef struct DBusThreadLocal DBusThreadLocal;
+
+DBusThreadLocal* _dbus_thread_local_new  (DBusFreeFunction  destructor);
+void             _dbus_thread_local_free (DBusThreadLocal  *tls);
+void*            _dbus_thread_local_get  (DBusThreadLocal  *tls);
+dbus_bool_t      _dbus_thread_local_set  (DBusThreadLocal  *tls,
+                                          void             *value);
+
 dbus_bool_t _dbus_split_paths_and_append (DBusString *dirs, 
                                           const char *suffix, 
                                           DBusList **dir_list);
@@ -509,6 +596,8 @@ unsigned long _dbus_pid_for_log (void);
  */
 dbus_pid_t    _dbus_getpid (void);
 
+int           _dbus_get_n_online_cpus (void);
+
 dbus_bool_t _dbus_change_to_daemon_user (const char *user,
                                          DBusError  *error);
 
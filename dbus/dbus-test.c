@@ -68,6 +68,40 @@ run_test (const char             *test_name,
   check_memleaks ();
 }
 
+/* Benchmarks measure rather than check and take a while, so they only
+ * run when asked for by name.
+ */
+static void
+run_benchmark (const char             *test_name,
+               const char             *specific_test,
+               TestFunc                test)
+{
+  if (specific_test && strcmp (specific_test, test_name) == 0)
+    {
+      printf ("%s: running %s\n", "dbus-test", test_name);
+      if (!test ())
+        die (test_name);
+
+      check_memleaks ();
+    }
+}
+
+static void
+run_data_benchmark (const char             *test_name,
+                    const char             *specific_test,
+                    TestDataFunc            test,
+                    const char             *test_data_dir)
+{
+  if (specific_test && strcmp (specific_test, test_name) == 0)
+    {
+      printf ("%s: running %s\n", "dbus-test", test_name);
+      if (!test (test_data_dir))
+        die (test_name);
+
+      check_memleaks ();
+    }
+}
+
 static void
 run_data_test (const char             *test_name,
 	       const char             *specific_test,
@@ -156,6 +190,8 @@ dbus_internal_do_not_use_run_tests (const char *test_data_dir, const char *speci
   
   run_test ("hash", specific_test, _dbus_hash_test);
 
+  run_test ("socket-set", specific_test, _dbus_socket_set_test);
+
 #if !defined(DBUS_WINCE)
   run_data_test ("spawn", specific_test, _dbus_spawn_test, test_data_dir);
 #endif
@@ -181,6 +217,13 @@ dbus_internal_do_not_use_run_tests (const char *test_data_dir, const char *speci
   run_data_test ("auth", specific_test, _dbus_auth_test, test_data_dir);
 
   run_data_test ("pending-call", specific_test, _dbus_pending_call_test, test_data_dir);
+
+  run_benchmark ("validate-benchmark", specific_test, _dbus_marshal_validate_benchmark);
+
+  run_benchmark ("message-benchmark", specific_test, _dbus_message_benchmark);
+
+  run_data_benchmark ("loader-benchmark", specific_test,
+                      _dbus_message_loader_benchmark, test_data_dir);
   
   printf ("%s: completed successfully\n", "dbus-test");
 #else
@@ -29,6 +29,7 @@
 #include <dbus/dbus-marshal-validate.h>
 
 dbus_bool_t _dbus_hash_test              (void);
+dbus_bool_t _dbus_socket_set_test        (void);
 dbus_bool_t _dbus_dict_test              (void);
 dbus_bool_t _dbus_list_test              (void);
 dbus_bool_t _dbus_marshal_test           (void);
@@ -36,6 +37,7 @@ dbus_bool_t _dbus_marshal_recursive_test (void);
 dbus_bool_t _dbus_marshal_byteswap_test  (void);
 dbus_bool_t _dbus_marshal_header_test    (void);
 dbus_bool_t _dbus_marshal_validate_test  (void);
+dbus_bool_t _dbus_marshal_validate_benchmark (void);
 dbus_bool_t _dbus_misc_test              (void);
 dbus_bool_t _dbus_signature_test         (void);
 dbus_bool_t _dbus_mem_pool_test          (void);
@@ -43,6 +45,8 @@ dbus_bool_t _dbus_string_test            (void);
 dbus_bool_t _dbus_address_test           (void);
 dbus_bool_t _dbus_server_test            (void);
 dbus_bool_t _dbus_message_test           (const char *test_data_dir);
+dbus_bool_t _dbus_message_benchmark      (void);
+dbus_bool_t _dbus_message_loader_benchmark (const char *test_data_dir);
 dbus_bool_t _dbus_auth_test              (const char *test_data_dir);
 dbus_bool_t _dbus_md5_test               (void);
 dbus_bool_t _dbus_sha_test               (const char *test_data_dir);
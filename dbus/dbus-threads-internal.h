@@ -29,9 +29,28 @@
 
 DBUS_BEGIN_DECLS
 
+/* Lock contention profiling, enabled by DBUS_LOCK_PROFILE in the
+ * environment.  Each global lock is counted on its own; other locks
+ * are counted against the class their callers give to
+ * _dbus_mutex_lock_in() and _dbus_condvar_wait_in().
+ */
+typedef enum
+{
+  DBUS_LOCK_CLASS_OTHER,
+  DBUS_LOCK_CLASS_CONNECTION,          /**< DBusConnection::mutex */
+  DBUS_LOCK_CLASS_CONNECTION_IO_PATH,  /**< the io path mutex and condvar */
+  DBUS_LOCK_CLASS_CONNECTION_DISPATCH, /**< the dispatch mutex and condvar */
+  DBUS_N_LOCK_CLASSES
+} DBusLockClass;
+
+/** Takes a mutex without blocking, returning #FALSE if it is held elsewhere */
+typedef dbus_bool_t (* DBusMutexTryLockFunction) (DBusMutex *mutex);
+
 DBusMutex*   _dbus_mutex_new                 (void);
 void         _dbus_mutex_free                (DBusMutex         *mutex);
 void         _dbus_mutex_lock                (DBusMutex         *mutex);
+void         _dbus_mutex_lock_in             (DBusMutex         *mutex,
+                                              DBusLockClass      klass);
 void         _dbus_mutex_unlock              (DBusMutex         *mutex);
 void         _dbus_mutex_new_at_location     (DBusMutex        **location_p);
 void         _dbus_mutex_free_at_location    (DBusMutex        **location_p);
@@ -40,14 +59,31 @@ DBusCondVar* _dbus_condvar_new               (void);
 void         _dbus_condvar_free              (DBusCondVar       *cond);
 void         _dbus_condvar_wait              (DBusCondVar       *cond,
                                               DBusMutex         *mutex);
+void         _dbus_condvar_wait_in           (DBusCondVar       *cond,
+                                              DBusMutex         *mutex,
+                                              DBusLockClass      klass);
 dbus_bool_t  _dbus_condvar_wait_timeout      (DBusCondVar       *cond,
                                               DBusMutex         *mutex,
                                               int                timeout_milliseconds);
+dbus_bool_t  _dbus_condvar_wait_timeout_in   (DBusCondVar       *cond,
+                                              DBusMutex         *mutex,
+                                              int                timeout_milliseconds,
+                                              DBusLockClass      klass);
 void         _dbus_condvar_wake_one          (DBusCondVar       *cond);
 void         _dbus_condvar_wake_all          (DBusCondVar       *cond);
 void         _dbus_condvar_new_at_location   (DBusCondVar      **location_p);
 void         _dbus_condvar_free_at_location  (DBusCondVar      **location_p);
 
+void         _dbus_threads_set_mutex_trylock (const DBusThreadFunctions *functions,
+                                              DBusMutexTryLockFunction   trylock);
+dbus_bool_t  _dbus_get_lock_profile          (int                i,
+                                              const char       **name,
+                                              dbus_uint32_t     *n_acquisitions,
+                                              dbus_uint32_t     *n_contended,
+                                              dbus_uint32_t     *total_wait_usec,
+                                              dbus_uint32_t     *max_wait_usec);
+void         _dbus_dump_lock_profile         (void);
+
 DBUS_END_DECLS
 
 #endif /* DBUS_THREADS_INTERNAL_H */
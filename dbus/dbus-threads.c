@@ -25,6 +25,15 @@
 #include "dbus-internals.h"
 #include "dbus-threads-internal.h"
 #include "dbus-list.h"
+#include "dbus-message-internal.h"
+#include "dbus-sysdeps.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef DBUS_ANDROID_LOG
+#define LOG_TAG "libdbus"
+#include <cutils/log.h>
+#endif /* DBUS_ANDROID_LOG */
 
 static DBusThreadFunctions thread_functions =
 {
@@ -47,6 +56,71 @@ static DBusList *uninitialized_condvar_list = NULL;
 /** This is used for the no-op default mutex pointer, just to be distinct from #NULL */
 #define _DBUS_DUMMY_CONDVAR ((DBusCondVar*)0xABCDEF2)
 
+/** A global lock, and the name it is reported under when profiling */
+typedef struct
+{
+  DBusMutex **location; /**< the variable holding the lock */
+  const char *name;     /**< name of the lock */
+} GlobalLock;
+
+static const GlobalLock global_locks[] = {
+#define GLOBAL_LOCK(name) { & _dbus_lock_##name, #name }
+  GLOBAL_LOCK (win_fds),
+  GLOBAL_LOCK (sid_atom_cache),
+  GLOBAL_LOCK (list),
+  GLOBAL_LOCK (connection_slots),
+  GLOBAL_LOCK (pending_call_slots),
+  GLOBAL_LOCK (server_slots),
+  GLOBAL_LOCK (message_slots),
+#ifdef DBUS_ATOMIC_NEEDS_LOCK
+  GLOBAL_LOCK (atomic),
+#endif
+  GLOBAL_LOCK (bus),
+  GLOBAL_LOCK (bus_datas),
+  GLOBAL_LOCK (shutdown_funcs),
+  GLOBAL_LOCK (system_users),
+  GLOBAL_LOCK (message_cache),
+  GLOBAL_LOCK (shared_connections),
+  GLOBAL_LOCK (machine_uuid),
+  GLOBAL_LOCK (message_pool),
+  GLOBAL_LOCK (keyring_cache),
+  GLOBAL_LOCK (spawn),
+  GLOBAL_LOCK (connection_pool),
+  GLOBAL_LOCK (auth_tickets),
+  GLOBAL_LOCK (inproc_servers)
+#undef GLOBAL_LOCK
+};
+
+/* Lock contention profiling.  An acquisition is contended if the lock
+ * couldn't be taken straight away.  With the default thread
+ * implementation that is known exactly, by trying the lock first;
+ * with thread functions of the application's own, a lock is taken to
+ * have been contended if the clock moved while waiting for it.  Waits
+ * on a condition variable always count as contended.
+ */
+typedef struct
+{
+  DBusAtomic n_acquisitions;  /**< times the lock was taken */
+  DBusAtomic n_contended;     /**< times it had to be waited for */
+  DBusAtomic total_wait_usec; /**< microseconds spent waiting for it */
+  DBusAtomic max_wait_usec;   /**< the longest single wait */
+} LockProfile;
+
+/** Number of locks and classes of lock with counts of their own */
+#define N_LOCK_PROFILES (DBUS_N_LOCK_CLASSES + _DBUS_N_GLOBAL_LOCKS)
+
+static const char * const lock_class_names[DBUS_N_LOCK_CLASSES] = {
+  "other",
+  "connection",
+  "connection_io_path",
+  "connection_dispatch"
+};
+
+static int lock_profile_mode = -1;
+static dbus_bool_t lock_profile_dump_at_exit = FALSE;
+static LockProfile lock_profiles[N_LOCK_PROFILES];
+static DBusMutexTryLockFunction mutex_trylock = NULL;
+
 /**
  * @defgroup DBusThreadsInternals Thread functions
  * @ingroup  DBusInternals
@@ -143,13 +217,141 @@ _dbus_mutex_free_at_location (DBusMutex **location_p)
 void
 _dbus_mutex_lock (DBusMutex *mutex)
 {
-  if (mutex) 
+  _dbus_mutex_lock_in (mutex, DBUS_LOCK_CLASS_OTHER);
+}
+
+static void
+mutex_lock (DBusMutex *mutex)
+{
+  if (thread_functions.recursive_mutex_lock)
+    (* thread_functions.recursive_mutex_lock) (mutex);
+  else if (thread_functions.mutex_lock)
+    (* thread_functions.mutex_lock) (mutex);
+}
+
+static dbus_bool_t
+lock_profiling_enabled (void)
+{
+  /* Threads racing through here all read the same environment, so
+   * checking it needs no lock
+   */
+  if (_DBUS_UNLIKELY (lock_profile_mode < 0))
+    lock_profile_mode = _dbus_getenv ("DBUS_LOCK_PROFILE") != NULL;
+
+  /* Without thread functions locks do nothing, so there's nothing
+   * to count
+   */
+  return lock_profile_mode && thread_functions.mask != 0;
+}
+
+/* The counts a lock is kept in, or NULL if it mustn't be counted */
+static LockProfile*
+find_lock_profile (DBusMutex     *mutex,
+                   DBusLockClass  klass)
+{
+  int i;
+
+  if (klass != DBUS_LOCK_CLASS_OTHER)
+    return &lock_profiles[klass];
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (global_locks); i++)
+    {
+      if (*global_locks[i].location != mutex)
+        continue;
+
+#ifdef DBUS_ATOMIC_NEEDS_LOCK
+      /* counting takes this lock itself */
+      if (global_locks[i].location == &_DBUS_LOCK_NAME (atomic))
+        return NULL;
+#endif
+
+      return &lock_profiles[DBUS_N_LOCK_CLASSES + i];
+    }
+
+  return &lock_profiles[DBUS_LOCK_CLASS_OTHER];
+}
+
+static long
+usec_since (long start_tv_sec,
+            long start_tv_usec)
+{
+  long tv_sec, tv_usec;
+  long usec;
+
+  _dbus_get_current_time (&tv_sec, &tv_usec);
+
+  usec = (tv_sec - start_tv_sec) * 1000000 + (tv_usec - start_tv_usec);
+
+  if (usec < 0)
+    return 0;
+  else if (usec > _DBUS_INT32_MAX)
+    return _DBUS_INT32_MAX;
+  else
+    return usec;
+}
+
+static void
+lock_profile_add (LockProfile *profile,
+                  dbus_bool_t  contended,
+                  long         wait_usec)
+{
+  dbus_int32_t max_wait_usec;
+
+  _dbus_atomic_inc (&profile->n_acquisitions);
+
+  if (!contended)
+    return;
+
+  _dbus_atomic_inc (&profile->n_contended);
+  _dbus_atomic_add (&profile->total_wait_usec, wait_usec);
+
+  /* Two threads raising the maximum at once can lose one of the
+   * raises; it is only a guide
+   */
+  max_wait_usec = _dbus_atomic_get (&profile->max_wait_usec);
+  if (wait_usec > max_wait_usec)
+    _dbus_atomic_add (&profile->max_wait_usec, wait_usec - max_wait_usec);
+}
+
+/**
+ * Locks a mutex, counting the acquisition against the given class of
+ * lock if lock contention is being profiled.  Global locks are
+ * always counted on their own, whatever class is given.  Does
+ * nothing if passed a #NULL pointer.
+ *
+ * @param mutex the mutex
+ * @param klass the class of lock it is
+ */
+void
+_dbus_mutex_lock_in (DBusMutex     *mutex,
+                     DBusLockClass  klass)
+{
+  LockProfile *profile;
+  long tv_sec, tv_usec;
+  long wait_usec;
+
+  if (mutex == NULL)
+    return;
+
+  if (!lock_profiling_enabled () ||
+      (profile = find_lock_profile (mutex, klass)) == NULL)
+    {
+      mutex_lock (mutex);
+      return;
+    }
+
+  if (mutex_trylock != NULL && (* mutex_trylock) (mutex))
     {
-      if (thread_functions.recursive_mutex_lock)
-        (* thread_functions.recursive_mutex_lock) (mutex);
-      else if (thread_functions.mutex_lock)
-        (* thread_functions.mutex_lock) (mutex);
+      lock_profile_add (profile, FALSE, 0);
+      return;
     }
+
+  _dbus_get_current_time (&tv_sec, &tv_usec);
+  mutex_lock (mutex);
+  wait_usec = usec_since (tv_sec, tv_usec);
+
+  lock_profile_add (profile, mutex_trylock != NULL || wait_usec > 0,
+                    wait_usec);
 }
 
 /**
@@ -251,8 +453,38 @@ void
 _dbus_condvar_wait (DBusCondVar *cond,
                     DBusMutex   *mutex)
 {
-  if (cond && mutex && thread_functions.condvar_wait)
-    (* thread_functions.condvar_wait) (cond, mutex);
+  _dbus_condvar_wait_in (cond, mutex, DBUS_LOCK_CLASS_OTHER);
+}
+
+/**
+ * Does the work of _dbus_condvar_wait(), counting the wait against
+ * the given class of lock if lock contention is being profiled.
+ *
+ * @param cond the condition variable
+ * @param mutex the mutex
+ * @param klass the class of lock the mutex is
+ */
+void
+_dbus_condvar_wait_in (DBusCondVar   *cond,
+                       DBusMutex     *mutex,
+                       DBusLockClass  klass)
+{
+  LockProfile *profile;
+  long tv_sec, tv_usec;
+
+  if (!(cond && mutex && thread_functions.condvar_wait))
+    return;
+
+  if (!lock_profiling_enabled () ||
+      (profile = find_lock_profile (mutex, klass)) == NULL)
+    {
+      (* thread_functions.condvar_wait) (cond, mutex);
+      return;
+    }
+
+  _dbus_get_current_time (&tv_sec, &tv_usec);
+  (* thread_functions.condvar_wait) (cond, mutex);
+  lock_profile_add (profile, TRUE, usec_since (tv_sec, tv_usec));
 }
 
 /**
@@ -271,10 +503,45 @@ _dbus_condvar_wait_timeout (DBusCondVar               *cond,
                             DBusMutex                 *mutex,
                             int                        timeout_milliseconds)
 {
-  if (cond && mutex && thread_functions.condvar_wait)
-    return (* thread_functions.condvar_wait_timeout) (cond, mutex, timeout_milliseconds);
-  else
+  return _dbus_condvar_wait_timeout_in (cond, mutex, timeout_milliseconds,
+                                        DBUS_LOCK_CLASS_OTHER);
+}
+
+/**
+ * Does the work of _dbus_condvar_wait_timeout(), counting the wait
+ * against the given class of lock if lock contention is being
+ * profiled.
+ *
+ * @param cond the condition variable
+ * @param mutex the mutex
+ * @param timeout_milliseconds the maximum time to wait
+ * @param klass the class of lock the mutex is
+ * @returns #FALSE if the timeout occurred, #TRUE if not
+ */
+dbus_bool_t
+_dbus_condvar_wait_timeout_in (DBusCondVar   *cond,
+                               DBusMutex     *mutex,
+                               int            timeout_milliseconds,
+                               DBusLockClass  klass)
+{
+  LockProfile *profile;
+  long tv_sec, tv_usec;
+  dbus_bool_t woken;
+
+  if (!(cond && mutex && thread_functions.condvar_wait))
     return TRUE;
+
+  if (!lock_profiling_enabled () ||
+      (profile = find_lock_profile (mutex, klass)) == NULL)
+    return (* thread_functions.condvar_wait_timeout) (cond, mutex,
+                                                      timeout_milliseconds);
+
+  _dbus_get_current_time (&tv_sec, &tv_usec);
+  woken = (* thread_functions.condvar_wait_timeout) (cond, mutex,
+                                                     timeout_milliseconds);
+  lock_profile_add (profile, TRUE, usec_since (tv_sec, tv_usec));
+
+  return woken;
 }
 
 /**
@@ -415,28 +682,6 @@ init_locks (void)
 {
   int i;
   DBusMutex ***dynamic_global_locks;
-  
-  DBusMutex **global_locks[] = {
-#define LOCK_ADDR(name) (& _dbus_lock_##name)
-    LOCK_ADDR (win_fds),
-    LOCK_ADDR (sid_atom_cache),
-    LOCK_ADDR (list),
-    LOCK_ADDR (connection_slots),
-    LOCK_ADDR (pending_call_slots),
-    LOCK_ADDR (server_slots),
-    LOCK_ADDR (message_slots),
-#if !DBUS_USE_SYNC
-    LOCK_ADDR (atomic),
-#endif
-    LOCK_ADDR (bus),
-    LOCK_ADDR (bus_datas),
-    LOCK_ADDR (shutdown_funcs),
-    LOCK_ADDR (system_users),
-    LOCK_ADDR (message_cache),
-    LOCK_ADDR (shared_connections),
-    LOCK_ADDR (machine_uuid)
-#undef LOCK_ADDR
-  };
 
   _dbus_assert (_DBUS_N_ELEMENTS (global_locks) ==
                 _DBUS_N_GLOBAL_LOCKS);
@@ -449,12 +694,12 @@ init_locks (void)
   
   while (i < _DBUS_N_ELEMENTS (global_locks))
     {
-      *global_locks[i] = _dbus_mutex_new ();
+      *global_locks[i].location = _dbus_mutex_new ();
       
-      if (*global_locks[i] == NULL)
+      if (*global_locks[i].location == NULL)
         goto failed;
 
-      dynamic_global_locks[i] = global_locks[i];
+      dynamic_global_locks[i] = global_locks[i].location;
 
       ++i;
     }
@@ -473,12 +718,115 @@ init_locks (void)
                                      
   for (i = i - 1; i >= 0; i--)
     {
-      _dbus_mutex_free (*global_locks[i]);
-      *global_locks[i] = NULL;
+      _dbus_mutex_free (*global_locks[i].location);
+      *global_locks[i].location = NULL;
     }
   return FALSE;
 }
 
+/**
+ * Tells the lock profiler how to take a mutex without blocking, so
+ * that it can count contention exactly.  The function is only used if
+ * the given thread functions are the ones in use; it must know how
+ * mutexes from those functions work.
+ *
+ * @param functions the thread functions trylock goes with
+ * @param trylock the function to take a mutex without blocking
+ */
+void
+_dbus_threads_set_mutex_trylock (const DBusThreadFunctions *functions,
+                                 DBusMutexTryLockFunction   trylock)
+{
+  if (thread_functions.recursive_mutex_lock == functions->recursive_mutex_lock &&
+      thread_functions.mutex_lock == functions->mutex_lock)
+    mutex_trylock = trylock;
+}
+
+/**
+ * Gets the contention counts for one lock or class of locks.  The
+ * classes in #DBusLockClass come first, then the global locks; call
+ * with i counting up from 0 until this returns #FALSE.  The counts are
+ * 32 bits and wrap around on a busy process.
+ *
+ * @param i which lock to get the counts for
+ * @param name return location for the name of the lock
+ * @param n_acquisitions return location for the times it was taken
+ * @param n_contended return location for the times it was waited for
+ * @param total_wait_usec return location for the microseconds spent
+ *  waiting for it
+ * @param max_wait_usec return location for the longest single wait
+ * @returns #FALSE if i is past the last lock or lock contention isn't
+ *  being profiled
+ */
+dbus_bool_t
+_dbus_get_lock_profile (int             i,
+                        const char    **name,
+                        dbus_uint32_t  *n_acquisitions,
+                        dbus_uint32_t  *n_contended,
+                        dbus_uint32_t  *total_wait_usec,
+                        dbus_uint32_t  *max_wait_usec)
+{
+  _dbus_assert (i >= 0);
+
+  if (i >= N_LOCK_PROFILES || !lock_profiling_enabled ())
+    return FALSE;
+
+  if (i < DBUS_N_LOCK_CLASSES)
+    *name = lock_class_names[i];
+  else
+    *name = global_locks[i - DBUS_N_LOCK_CLASSES].name;
+
+  *n_acquisitions = _dbus_atomic_get (&lock_profiles[i].n_acquisitions);
+  *n_contended = _dbus_atomic_get (&lock_profiles[i].n_contended);
+  *total_wait_usec = _dbus_atomic_get (&lock_profiles[i].total_wait_usec);
+  *max_wait_usec = _dbus_atomic_get (&lock_profiles[i].max_wait_usec);
+
+  return TRUE;
+}
+
+#define LOCK_PROFILE_FORMAT \
+  "dbus lock %s: %u acquisitions, %u contended, " \
+  "%u usec waiting, %u usec longest wait\n"
+
+/**
+ * Writes the contention counts of every lock that has been taken to
+ * stderr, or to the system log on Android.  Does nothing if lock
+ * contention isn't being profiled.  This happens by itself at exit
+ * when profiling is on, but can be called at any time.
+ */
+void
+_dbus_dump_lock_profile (void)
+{
+  const char *name;
+  dbus_uint32_t n_acquisitions, n_contended, total_wait_usec, max_wait_usec;
+  int i;
+
+  for (i = 0;
+       _dbus_get_lock_profile (i, &name, &n_acquisitions, &n_contended,
+                               &total_wait_usec, &max_wait_usec);
+       i++)
+    {
+      if (n_acquisitions == 0)
+        continue;
+
+#ifdef DBUS_ANDROID_LOG
+      LOG_PRI (ANDROID_LOG_INFO, LOG_TAG, LOCK_PROFILE_FORMAT,
+               name, n_acquisitions, n_contended,
+               total_wait_usec, max_wait_usec);
+#else
+      fprintf (stderr, LOCK_PROFILE_FORMAT,
+               name, n_acquisitions, n_contended,
+               total_wait_usec, max_wait_usec);
+#endif
+    }
+}
+
+static void
+dump_lock_profile_at_exit (void)
+{
+  _dbus_dump_lock_profile ();
+}
+
 /** @} */ /* end of internals */
 
 /**
@@ -497,6 +845,13 @@ init_locks (void)
  * used from a single thread at a time, unless you lock them yourself.
  * For example, a #DBusMessage can't be modified from two threads
  * at once.
+ *
+ * To find out which of these locks threads spend their time waiting
+ * for, run the application with DBUS_LOCK_PROFILE=1 in its
+ * environment.  For each global lock, and for the connection locks
+ * taken together, libdbus then counts how often the lock was taken,
+ * how often it had to be waited for and for how long in all and at
+ * most, and writes the counts to stderr at exit.
  * 
  * @{
  */
@@ -642,10 +997,24 @@ dbus_threads_init (const DBusThreadFunctions *functions)
     thread_functions.recursive_mutex_unlock = functions->recursive_mutex_unlock;
 
   thread_functions.mask = functions->mask;
+  mutex_trylock = NULL;
 
   if (!init_locks ())
     return FALSE;
 
+  /* Threads aren't running yet, so this can't race */
+  if (lock_profiling_enabled () && !lock_profile_dump_at_exit)
+    {
+      atexit (dump_lock_profile_at_exit);
+      lock_profile_dump_at_exit = TRUE;
+    }
+
+  if (!_dbus_list_init_threads ())
+    return FALSE;
+
+  if (!_dbus_message_cache_init_threads ())
+    return FALSE;
+
   thread_init_generation = _dbus_current_generation;
   
   return TRUE;
@@ -69,6 +69,28 @@ struct DBusTransportVTable
   dbus_bool_t (* get_socket_fd) (DBusTransport *transport,
                                  int           *fd_p);
   /**< Get socket file descriptor */
+
+  void        (* compact)               (DBusTransport *transport);
+  /**< Free buffers kept around for traffic, may be #NULL */
+
+  void        (* interrupt_iteration)   (DBusTransport *transport);
+  /**< Wake up another thread blocked in do_iteration, may be #NULL */
+
+  void        (* get_iteration_budgets) (DBusTransport *transport,
+                                         int           *read_budget,
+                                         int           *write_budget);
+  /**< Get the bytes currently read and written per iteration, may be #NULL */
+
+  dbus_bool_t (* collect_handed_off)    (DBusTransport *transport);
+  /**< Move messages handed over from within the process to the loader,
+   * returning #FALSE if not enough memory; may be #NULL
+   */
+
+  dbus_bool_t (* can_hand_off)          (DBusTransport *transport);
+  /**< Whether the socket and the loader's bytes are all there is to the
+   * connection, so another process could carry on with it; may be
+   * #NULL for never
+   */
 };
 
 /**
@@ -94,8 +116,14 @@ struct DBusTransport
   long max_live_messages_size;                /**< Max total size of received messages. */
   long max_live_messages_unix_fds;            /**< Max total unix fds of received messages. */
 
+  int min_bytes_per_iteration;                /**< Least the transport may read or write per iteration */
+  int max_bytes_per_iteration;                /**< Most the transport may read or write per iteration */
+
   DBusCounter *live_messages;                 /**< Counter for size/unix fds of all live messages. */
 
+  unsigned long n_reads;                      /**< Read system calls made on the connection */
+  unsigned long n_writes;                     /**< Write system calls made on the connection */
+
   char *address;                              /**< Address of the server we are connecting to (#NULL for the server side of a transport) */
 
   char *expected_guid;                        /**< GUID we expect the server to have, #NULL on server side or if we don't have an expectation */
@@ -109,6 +137,11 @@ struct DBusTransport
   void *windows_user_data;                            /**< Data for windows_user_function */
   
   DBusFreeFunction free_windows_user_data;            /**< Function to free windows_user_data */
+
+  DBusBodyChunkFunction body_chunk_function;  /**< Function streamed byte array bodies are passed to */
+  void *body_chunk_data;                      /**< Data for body_chunk_function */
+
+  DBusFreeFunction free_body_chunk_data;      /**< Function to free body_chunk_data */
   
   unsigned int disconnected : 1;              /**< #TRUE if we are disconnected. */
   unsigned int authenticated : 1;             /**< Cache of auth state; use _dbus_transport_get_is_authenticated() to query value */
@@ -117,6 +150,9 @@ struct DBusTransport
   unsigned int is_server : 1;                 /**< #TRUE if on the server side */
   unsigned int unused_bytes_recovered : 1;    /**< #TRUE if we've recovered unused bytes from auth */
   unsigned int allow_anonymous : 1;           /**< #TRUE if an anonymous client can connect */
+  unsigned int reading_paused : 1;            /**< #TRUE if we've been asked not to read for now */
+  unsigned int dispatch_backlogged : 1;       /**< #TRUE while more has been read than the main loop will dispatch this round */
+  unsigned int edge_triggered_writes : 1;     /**< #TRUE if a full socket is left to the write watch rather than retried */
 };
 
 dbus_bool_t _dbus_transport_init_base     (DBusTransport             *transport,
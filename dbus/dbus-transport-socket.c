@@ -29,6 +29,13 @@
 #include "dbus-transport-protected.h"
 #include "dbus-watch.h"
 #include "dbus-credentials.h"
+#ifdef DBUS_UNIX
+#include "dbus-sysdeps-unix.h"
+#endif
+
+/* Allocations made here are profiled as connections */
+#undef DBUS_ALLOC_SUBSYSTEM
+#define DBUS_ALLOC_SUBSYSTEM DBUS_ALLOC_SUBSYSTEM_CONNECTION
 
 /**
  * @defgroup DBusTransportSocket DBusTransport implementations for sockets
@@ -43,6 +50,32 @@
  */
 typedef struct DBusTransportSocket DBusTransportSocket;
 
+/**
+ * What the two ends of an in-process connection share: the messages
+ * each has handed the other, waiting to be collected. The ends may
+ * be used from different threads, so the queues are under a lock.
+ */
+typedef struct
+{
+  DBusAtomic refcount;   /**< One for each end */
+  DBusMutex *lock;       /**< Protects the queues */
+  DBusList *queues[2];   /**< Messages for the client end, then for the
+                          *   server end
+                          */
+} InprocChannel;
+
+/**
+ * Upper bound on the adaptive read size, so one busy peer can't
+ * make us buffer unboundedly far ahead of the live message limits.
+ */
+#define MAX_READ_SIZE (32 * 1024)
+
+/**
+ * Smallest packet we'll shrink to before deciding a seqpacket socket
+ * that keeps refusing them is simply broken.
+ */
+#define MIN_PACKET_SIZE 512
+
 /**
  * Implementation details of DBusTransportSocket. All members are private.
  */
@@ -53,8 +86,15 @@ struct DBusTransportSocket
   DBusWatch *read_watch;                /**< Watch for readability. */
   DBusWatch *write_watch;               /**< Watch for writability. */
 
-  int max_bytes_read_per_iteration;     /**< To avoid blocking too long. */
-  int max_bytes_written_per_iteration;  /**< To avoid blocking too long. */
+  int max_bytes_read_per_iteration;     /**< To avoid blocking too long;
+                                         *   adapts to the traffic, see
+                                         *   adapt_iteration_budget()
+                                         */
+  int read_size;                        /**< Bytes asked for per read;
+                                         *   grows while the peer keeps
+                                         *   the socket full.
+                                         */
+  int max_bytes_written_per_iteration;  /**< Likewise for writing */
 
   int message_bytes_written;            /**< Number of bytes of current
                                          *   outgoing message that have
@@ -66,8 +106,180 @@ struct DBusTransportSocket
   DBusString encoded_incoming;          /**< Encoded version of current
                                          *   incoming data.
                                          */
+  dbus_bool_t credentials_byte_inline;  /**< The credentials byte goes out
+                                         *   in the same write as the
+                                         *   auth conversation
+                                         */
+  dbus_bool_t write_blocked;            /**< The last write found the
+                                         *   socket full, and it hasn't
+                                         *   been reported writable since
+                                         */
+  dbus_bool_t seqpacket;                /**< The socket keeps each write as
+                                         *   a packet, and a read takes
+                                         *   one whole or loses the rest
+                                         */
+  int max_packet_size;                  /**< Biggest write a seqpacket
+                                         *   socket is asked to take;
+                                         *   shrinks on EMSGSIZE
+                                         */
+  dbus_bool_t zerocopy;                 /**< SO_ZEROCOPY is set, so large
+                                         *   bodies go out with MSG_ZEROCOPY
+                                         */
+  dbus_uint32_t zerocopy_next_send;     /**< Number the kernel will give
+                                         *   the next zero-copy send
+                                         */
+  DBusList *zerocopy_pending;           /**< ZerocopySend for each message
+                                         *   the kernel may still be
+                                         *   reading, oldest first
+                                         */
+  InprocChannel *inproc;                /**< Shared with the other end if it
+                                         *   is in this process, so messages
+                                         *   are handed over rather than
+                                         *   written, or #NULL
+                                         */
+#ifdef DBUS_UNIX
+  int wakeup_read_fd;                   /**< Polled next to fd so another
+                                         *   thread can interrupt a
+                                         *   blocking iteration, or -1
+                                         */
+  int wakeup_write_fd;                  /**< Signalled to interrupt it */
+  dbus_bool_t in_blocking_poll;         /**< A thread is blocked in poll()
+                                         *   with the connection unlocked
+                                         */
+#endif
 };
 
+/**
+ * Bodies smaller than this are cheaper to copy into the kernel than
+ * to pin and wait for a completion for.
+ */
+#define ZEROCOPY_MIN_BODY_SIZE (128 * 1024)
+
+/**
+ * The zero-copy sends of one message's body. The message is kept
+ * alive until the kernel has reported all of them complete, since
+ * it sends from the body's own memory.
+ */
+typedef struct
+{
+  DBusMessage *message;      /**< Message whose body was sent */
+  dbus_uint32_t first_send;  /**< Number of the first send */
+  int n_sends;               /**< How many sends followed it */
+  int n_completed;           /**< How many of them are complete */
+} ZerocopySend;
+
+static void
+free_zerocopy_sends (DBusTransportSocket *socket_transport)
+{
+  DBusList *link;
+
+  while ((link = _dbus_list_pop_first_link (&socket_transport->zerocopy_pending)))
+    {
+      ZerocopySend *pending = link->data;
+
+      dbus_message_unref (pending->message);
+      dbus_free (pending);
+      _dbus_list_free_link (link);
+    }
+}
+
+/* Counts the sends first..last that belong to pending; numbers wrap
+ * only after 2^32 sends of at least ZEROCOPY_MIN_BODY_SIZE each.
+ */
+static int
+count_completed_sends (const ZerocopySend *pending,
+                       dbus_uint32_t       first,
+                       dbus_uint32_t       last)
+{
+  dbus_uint32_t send_last;
+
+  if (pending->n_sends == 0)
+    return 0;
+
+  send_last = pending->first_send + pending->n_sends - 1;
+
+  if (first < pending->first_send)
+    first = pending->first_send;
+  if (last > send_last)
+    last = send_last;
+
+  return last >= first ? (int) (last - first + 1) : 0;
+}
+
+/* Drops the messages the kernel is done sending from; returns
+ * whether there were any completions to read.
+ */
+static dbus_bool_t
+reap_zerocopy_sends (DBusTransportSocket *socket_transport)
+{
+  dbus_uint32_t first, last;
+  dbus_bool_t reaped;
+
+  reaped = FALSE;
+
+  while (_dbus_read_zerocopy_completion (socket_transport->fd,
+                                         &first, &last) > 0)
+    {
+      DBusList *link;
+
+      reaped = TRUE;
+
+      link = _dbus_list_get_first_link (&socket_transport->zerocopy_pending);
+      while (link != NULL)
+        {
+          DBusList *next = _dbus_list_get_next_link (&socket_transport->zerocopy_pending, link);
+          ZerocopySend *pending = link->data;
+
+          pending->n_completed += count_completed_sends (pending, first, last);
+
+          if (pending->n_completed == pending->n_sends)
+            {
+              _dbus_list_unlink (&socket_transport->zerocopy_pending, link);
+              _dbus_list_free_link (link);
+              dbus_message_unref (pending->message);
+              dbus_free (pending);
+            }
+
+          link = next;
+        }
+    }
+
+  return reaped;
+}
+
+/* Makes sure there's a ZerocopySend for message at the end of the
+ * pending list to count its next send in, before the send is made,
+ * so that one that succeeds can always be tracked.
+ */
+static dbus_bool_t
+prepare_zerocopy_send (DBusTransportSocket *socket_transport,
+                       DBusMessage         *message)
+{
+  DBusList *link;
+  ZerocopySend *pending;
+
+  link = _dbus_list_get_last_link (&socket_transport->zerocopy_pending);
+  if (link != NULL && ((ZerocopySend *) link->data)->message == message)
+    return TRUE;
+
+  pending = dbus_new0 (ZerocopySend, 1);
+  if (pending == NULL)
+    return FALSE;
+
+  link = _dbus_list_alloc_link (pending);
+  if (link == NULL)
+    {
+      dbus_free (pending);
+      return FALSE;
+    }
+
+  pending->message = dbus_message_ref (message);
+  pending->first_send = socket_transport->zerocopy_next_send;
+  _dbus_list_append_link (&socket_transport->zerocopy_pending, link);
+
+  return TRUE;
+}
+
 static void
 free_watches (DBusTransport *transport)
 {
@@ -98,6 +310,26 @@ free_watches (DBusTransport *transport)
   _dbus_verbose ("end\n");
 }
 
+static void
+inproc_channel_unref (InprocChannel *channel)
+{
+  int i;
+
+  if (_dbus_atomic_dec (&channel->refcount) != 1)
+    return;
+
+  for (i = 0; i < _DBUS_N_ELEMENTS (channel->queues); i++)
+    {
+      _dbus_list_foreach (&channel->queues[i],
+                          (DBusForeachFunction) dbus_message_unref,
+                          NULL);
+      _dbus_list_clear (&channel->queues[i]);
+    }
+
+  _dbus_mutex_free_at_location (&channel->lock);
+  dbus_free (channel);
+}
+
 static void
 socket_finalize (DBusTransport *transport)
 {
@@ -106,6 +338,16 @@ socket_finalize (DBusTransport *transport)
   _dbus_verbose ("\n");
   
   free_watches (transport);
+  free_zerocopy_sends (socket_transport);
+
+#ifdef DBUS_UNIX
+  if (socket_transport->wakeup_read_fd >= 0)
+    _dbus_wakeup_free (socket_transport->wakeup_read_fd,
+                       socket_transport->wakeup_write_fd);
+#endif
+
+  if (socket_transport->inproc != NULL)
+    inproc_channel_unref (socket_transport->inproc);
 
   _dbus_string_free (&socket_transport->encoded_outgoing);
   _dbus_string_free (&socket_transport->encoded_incoming);
@@ -191,7 +433,8 @@ check_read_watch (DBusTransport *transport)
   _dbus_transport_ref (transport);
 
   if (_dbus_transport_get_is_authenticated (transport))
-    need_read_watch =
+    need_read_watch = !transport->reading_paused &&
+      !transport->dispatch_backlogged &&
       (_dbus_counter_get_size_value (transport->live_messages) < transport->max_live_messages_size) &&
       (_dbus_counter_get_unix_fd_value (transport->live_messages) < transport->max_live_messages_unix_fds);
   else
@@ -239,6 +482,63 @@ do_io_error (DBusTransport *transport)
   _dbus_transport_unref (transport);
 }
 
+/* On a seqpacket socket a read takes one whole packet and throws away
+ * whatever didn't fit, so it has to ask for exactly the size of the
+ * next one; a stream is happy with anything.
+ */
+static int
+next_read_size (DBusTransportSocket *socket_transport,
+                int                  wanted)
+{
+  int size;
+
+  if (!socket_transport->seqpacket)
+    return wanted;
+
+  /* Errors, EAGAIN included, and end of file are for the read itself
+   * to find out about.
+   */
+  size = _dbus_socket_peek_packet_size (socket_transport->fd);
+
+  return size > 0 ? size : wanted;
+}
+
+/* Caps a write at what one packet may carry; the loader at the other
+ * end puts a message split over several packets back together.
+ */
+static int
+packet_room (DBusTransportSocket *socket_transport,
+             int                  len)
+{
+  if (socket_transport->seqpacket &&
+      len > socket_transport->max_packet_size)
+    return socket_transport->max_packet_size;
+
+  return len;
+}
+
+/* A seqpacket socket refuses a packet bigger than its send buffer with
+ * EMSGSIZE rather than taking part of it. If that's what the last
+ * write got, shrink max_packet_size below what was refused and return
+ * TRUE to have the write tried again.
+ */
+static dbus_bool_t
+shrink_packet_size (DBusTransportSocket *socket_transport,
+                    int                  refused)
+{
+  if (!socket_transport->seqpacket ||
+      !_dbus_get_is_errno_emsgsize () ||
+      refused <= MIN_PACKET_SIZE)
+    return FALSE;
+
+  socket_transport->max_packet_size = MAX (refused / 2, MIN_PACKET_SIZE);
+
+  _dbus_verbose ("packet of %d bytes refused, now writing at most %d\n",
+                 refused, socket_transport->max_packet_size);
+
+  return TRUE;
+}
+
 /* return value is whether we successfully read any new data. */
 static dbus_bool_t
 read_data_into_auth (DBusTransport *transport,
@@ -252,8 +552,10 @@ read_data_into_auth (DBusTransport *transport,
 
   _dbus_auth_get_buffer (transport->auth, &buffer);
   
-  bytes_read = _dbus_read_socket (socket_transport->fd,
-                                  buffer, socket_transport->max_bytes_read_per_iteration);
+  bytes_read = _dbus_read_socket (socket_transport->fd, buffer,
+                                  next_read_size (socket_transport,
+                                                  socket_transport->max_bytes_read_per_iteration));
+  transport->n_reads += 1;
 
   _dbus_auth_return_buffer (transport->auth, buffer,
                             bytes_read > 0 ? bytes_read : 0);
@@ -294,25 +596,165 @@ read_data_into_auth (DBusTransport *transport,
     }
 }
 
+/** Most messages do_writing() hands to a single system call */
+#define MAX_MESSAGES_PER_WRITE (_DBUS_MAX_SOCKET_WRITE_BUFFERS / 2)
+
+#ifdef HAVE_UNIX_FD_PASSING
+static dbus_bool_t
+message_has_unix_fds (DBusMessage *message)
+{
+  const int *unix_fds;
+  unsigned n;
+
+  _dbus_message_get_unix_fds (message, &unix_fds, &n);
+
+  return n > 0;
+}
+#endif
+
+/* Retire every message a write got all the way through;
+ * message_bytes_written is left as the progress into the first one
+ * it didn't.
+ */
+static void
+retire_written_messages (DBusTransport  *transport,
+                         DBusMessage   **messages,
+                         const int      *message_lens,
+                         int             n_messages)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+  int i;
+
+  for (i = 0; i < n_messages; i++)
+    {
+      if (socket_transport->message_bytes_written < message_lens[i])
+        break;
+
+      socket_transport->message_bytes_written -= message_lens[i];
+      _dbus_string_set_length (&socket_transport->encoded_outgoing, 0);
+      _dbus_string_compact (&socket_transport->encoded_outgoing, 2048);
+
+      _dbus_connection_message_sent (transport->connection,
+                                     messages[i]);
+    }
+
+  _dbus_assert (i < n_messages ||
+                socket_transport->message_bytes_written == 0);
+}
+
 /* Return value is whether we successfully wrote any bytes */
 static dbus_bool_t
 write_data_from_auth (DBusTransport *transport)
 {
   DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+  const DBusString *buffers[_DBUS_MAX_SOCKET_WRITE_BUFFERS];
+  DBusMessage *messages[MAX_MESSAGES_PER_WRITE];
+  int message_lens[MAX_MESSAGES_PER_WRITE];
+  DBusString credentials_byte;
+  dbus_bool_t with_credentials_byte;
+  int n_buffers;
+  int n_messages;
+  int auth_len;
+  int batch_len;
   int bytes_written;
   const DBusString *buffer;
 
   if (!_dbus_auth_get_bytes_to_send (transport->auth,
                                      &buffer))
     return FALSE;
-  
-  bytes_written = _dbus_write_socket (socket_transport->fd,
-                                      buffer,
-                                      0, _dbus_string_get_length (buffer));
+
+ again:
+  n_buffers = 0;
+  n_messages = 0;
+
+  with_credentials_byte = transport->send_credentials_pending &&
+    socket_transport->credentials_byte_inline;
+  if (with_credentials_byte)
+    {
+      _dbus_string_init_const_len (&credentials_byte, "", 1);
+      buffers[n_buffers++] = &credentials_byte;
+    }
+
+  buffers[n_buffers++] = buffer;
+  auth_len = _dbus_string_get_length (buffer);
+  batch_len = auth_len;
+
+  /* A pipelined client has sent its lot once these bytes are out, so
+   * the first messages (most likely Hello) can ride along with them.
+   * Anything carrying unix fds waits until passing them's agreed on.
+   */
+  if (_dbus_auth_get_pipelined (transport->auth) &&
+      transport->connection != NULL &&
+      socket_transport->message_bytes_written == 0)
+    {
+      DBusMessage *queued[MAX_MESSAGES_PER_WRITE];
+      int n_queued;
+      int i;
+
+      n_queued = _dbus_connection_get_messages_to_send (transport->connection,
+                                                        queued,
+                                                        MAX_MESSAGES_PER_WRITE);
+
+      for (i = 0; i < n_queued; i++)
+        {
+          if (n_buffers + 2 > _DBUS_MAX_SOCKET_WRITE_BUFFERS ||
+              batch_len >= socket_transport->max_bytes_written_per_iteration)
+            break;
+
+#ifdef HAVE_UNIX_FD_PASSING
+          if (message_has_unix_fds (queued[i]))
+            break;
+#endif
+
+          dbus_message_lock (queued[i]);
+          _dbus_message_get_network_data (queued[i],
+                                          &buffers[n_buffers],
+                                          &buffers[n_buffers + 1]);
+          message_lens[n_messages] =
+            _dbus_string_get_length (buffers[n_buffers]) +
+            _dbus_string_get_length (buffers[n_buffers + 1]);
+
+          /* Only whole messages ride along, in a single packet */
+          if (packet_room (socket_transport,
+                           batch_len + message_lens[n_messages]) <
+              batch_len + message_lens[n_messages])
+            break;
+
+          batch_len += message_lens[n_messages];
+
+          messages[n_messages] = queued[i];
+          n_messages += 1;
+          n_buffers += 2;
+        }
+    }
+
+  if (n_buffers == 1)
+    bytes_written = _dbus_write_socket (socket_transport->fd,
+                                        buffer,
+                                        0, auth_len);
+  else
+    bytes_written = _dbus_write_socket_many (socket_transport->fd,
+                                             buffers, n_buffers, 0);
+  transport->n_writes += 1;
 
   if (bytes_written > 0)
     {
-      _dbus_auth_bytes_sent (transport->auth, bytes_written);
+      if (with_credentials_byte)
+        {
+          transport->send_credentials_pending = FALSE;
+          bytes_written -= 1;
+        }
+
+      if (bytes_written > 0)
+        _dbus_auth_bytes_sent (transport->auth, MIN (bytes_written, auth_len));
+
+      if (bytes_written > auth_len)
+        {
+          socket_transport->message_bytes_written = bytes_written - auth_len;
+          retire_written_messages (transport, messages, message_lens,
+                                   n_messages);
+        }
+
       return TRUE;
     }
   else if (bytes_written < 0)
@@ -321,6 +763,9 @@ write_data_from_auth (DBusTransport *transport)
       
       if (_dbus_get_is_errno_eagain_or_ewouldblock ())
         ;
+      else if (n_messages > 0 &&
+               shrink_packet_size (socket_transport, batch_len))
+        goto again;
       else
         {
           _dbus_verbose ("Error writing to remote app: %s\n",
@@ -344,7 +789,8 @@ exchange_credentials (DBusTransport *transport,
   _dbus_verbose ("exchange_credentials: do_reading = %d, do_writing = %d\n",
                   do_reading, do_writing);
 
-  if (do_writing && transport->send_credentials_pending)
+  if (do_writing && transport->send_credentials_pending &&
+      !socket_transport->credentials_byte_inline)
     {
       if (_dbus_send_credentials_socket (socket_transport->fd,
                                          &error))
@@ -399,6 +845,7 @@ do_authentication (DBusTransport *transport,
                    dbus_bool_t    do_writing,
 		   dbus_bool_t   *auth_completed)
 {
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
   dbus_bool_t oom;
   dbus_bool_t orig_auth_state;
 
@@ -429,7 +876,8 @@ do_authentication (DBusTransport *transport,
           goto out;
         }
       
-      if (transport->send_credentials_pending ||
+      if ((transport->send_credentials_pending &&
+           !socket_transport->credentials_byte_inline) ||
           transport->receive_credentials_pending)
         {
           _dbus_verbose ("send_credentials_pending = %d receive_credentials_pending = %d\n",
@@ -489,12 +937,149 @@ do_authentication (DBusTransport *transport,
     return TRUE;
 }
 
+/* Double a per-iteration budget while iterations keep using all of
+ * it, and halve it once they use less than a quarter, within the
+ * transport's bounds. Bulk peers then get through more per trip
+ * round the main loop, while quiet ones can't hold it up for long
+ * if they suddenly burst.
+ */
+static int
+adapt_iteration_budget (DBusTransport *transport,
+                        int            budget,
+                        int            total,
+                        dbus_bool_t    budget_spent,
+                        dbus_bool_t    may_grow)
+{
+  int new_budget;
+
+  new_budget = budget;
+
+  if (budget_spent && may_grow)
+    new_budget = budget > transport->max_bytes_per_iteration / 2 ?
+      transport->max_bytes_per_iteration : budget * 2;
+  else if (!budget_spent && total < budget / 4)
+    new_budget = budget / 2;
+
+  if (new_budget > transport->max_bytes_per_iteration)
+    new_budget = transport->max_bytes_per_iteration;
+  if (new_budget < transport->min_bytes_per_iteration)
+    new_budget = transport->min_bytes_per_iteration;
+
+  if (new_budget != budget)
+    _dbus_verbose ("bytes per iteration %d -> %d\n", budget, new_budget);
+
+  return new_budget;
+}
+
+/**
+ * What an in-process end writes to wake the other, a byte per
+ * message handed over.
+ */
+static const char inproc_doorbells[MAX_MESSAGES_PER_WRITE] = { 0 };
+
+/* Hands the queued messages to the other end, writing it a byte for
+ * each so it wakes up. The bytes carry nothing, but while it leaves
+ * them unread the socket fills, which holds us back just as it would
+ * if we were writing the messages themselves.
+ */
+static dbus_bool_t
+do_inproc_writing (DBusTransport *transport)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+  InprocChannel *channel = socket_transport->inproc;
+  DBusList **queue;
+  int total;
+
+  queue = &channel->queues[!transport->is_server];
+  total = 0;
+
+  while (!transport->disconnected &&
+         _dbus_connection_has_messages_to_send_unlocked (transport->connection))
+    {
+      DBusMessage *messages[MAX_MESSAGES_PER_WRITE];
+      DBusList *links[MAX_MESSAGES_PER_WRITE];
+      DBusString doorbells;
+      int n_messages;
+      int bytes_written;
+      int i;
+
+      if (total > socket_transport->max_bytes_written_per_iteration)
+        break;
+
+      n_messages = _dbus_connection_get_messages_to_send (transport->connection,
+                                                          messages,
+                                                          MAX_MESSAGES_PER_WRITE);
+
+      for (i = 0; i < n_messages; i++)
+        {
+          links[i] = _dbus_list_alloc_link (messages[i]);
+          if (links[i] == NULL)
+            {
+              while (i-- > 0)
+                _dbus_list_free_link (links[i]);
+              return FALSE;
+            }
+        }
+
+      /* Done with them before the other end sees them, so that
+       * usually it holds the only reference and can take the
+       * message itself rather than a copy.
+       */
+      for (i = 0; i < n_messages; i++)
+        {
+          const DBusString *header;
+          const DBusString *body;
+
+          dbus_message_lock (messages[i]);
+          _dbus_message_get_network_data (messages[i], &header, &body);
+          total += _dbus_string_get_length (header) + _dbus_string_get_length (body);
+
+          dbus_message_ref (messages[i]);
+          _dbus_connection_message_sent (transport->connection, messages[i]);
+        }
+
+      _dbus_mutex_lock (channel->lock);
+      for (i = 0; i < n_messages; i++)
+        _dbus_list_append_link (queue, links[i]);
+      _dbus_mutex_unlock (channel->lock);
+
+      _dbus_string_init_const_len (&doorbells, inproc_doorbells, n_messages);
+      bytes_written = _dbus_write_socket (socket_transport->fd, &doorbells,
+                                          0, n_messages);
+      transport->n_writes += 1;
+
+      /* If the socket is full, the other end has waking up to do
+       * already; it collects these along with the rest.
+       */
+      if (bytes_written < 0)
+        {
+          if (_dbus_get_is_errno_eagain_or_ewouldblock ())
+            socket_transport->write_blocked = TRUE;
+          else if (!_dbus_get_is_errno_epipe ())
+            {
+              _dbus_verbose ("Error writing to remote app: %s\n",
+                             _dbus_strerror_from_errno ());
+              do_io_error (transport);
+            }
+          break;
+        }
+      else if (bytes_written < n_messages)
+        {
+          socket_transport->write_blocked = TRUE;
+          break;
+        }
+    }
+
+  return TRUE;
+}
+
 /* returns false on oom */
 static dbus_bool_t
 do_writing (DBusTransport *transport)
 {
   int total;
   DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+  dbus_bool_t budget_spent;
   dbus_bool_t oom;
   
   /* No messages without authentication! */
@@ -510,6 +1095,9 @@ do_writing (DBusTransport *transport)
       return TRUE;
     }
 
+  if (socket_transport->inproc != NULL)
+    return do_inproc_writing (transport);
+
 #if 1
   _dbus_verbose ("do_writing(), have_messages = %d, fd = %d\n",
                  _dbus_connection_has_messages_to_send_unlocked (transport->connection),
@@ -517,24 +1105,46 @@ do_writing (DBusTransport *transport)
 #endif
   
   oom = FALSE;
+  budget_spent = FALSE;
   total = 0;
 
+  if (socket_transport->zerocopy_pending != NULL)
+    reap_zerocopy_sends (socket_transport);
+
   while (!transport->disconnected &&
          _dbus_connection_has_messages_to_send_unlocked (transport->connection))
     {
       int bytes_written;
+      int bytes_requested;
       DBusMessage *message;
       const DBusString *header;
       const DBusString *body;
       int header_len, body_len;
       int total_bytes_to_write;
+      /* Several small messages can go out in one system call; these
+       * are the ones handed to the socket by this iteration, in order.
+       */
+      DBusMessage *messages[MAX_MESSAGES_PER_WRITE];
+      int message_lens[MAX_MESSAGES_PER_WRITE];
+      int n_messages;
+      int i;
       
       if (total > socket_transport->max_bytes_written_per_iteration)
         {
           _dbus_verbose ("%d bytes exceeds %d bytes written per iteration, returning\n",
                          total, socket_transport->max_bytes_written_per_iteration);
+          budget_spent = TRUE;
           goto out;
         }
+
+      /* Nothing of the head is out yet, so it can still be dropped */
+      if (socket_transport->message_bytes_written == 0 &&
+          _dbus_string_get_length (&socket_transport->encoded_outgoing) == 0)
+        {
+          _dbus_connection_drop_expired_outgoing (transport->connection);
+          if (!_dbus_connection_has_messages_to_send_unlocked (transport->connection))
+            break;
+        }
       
       message = _dbus_connection_get_message_to_send (transport->connection);
       _dbus_assert (message != NULL);
@@ -550,6 +1160,9 @@ do_writing (DBusTransport *transport)
       header_len = _dbus_string_get_length (header);
       body_len = _dbus_string_get_length (body);
 
+      messages[0] = message;
+      n_messages = 1;
+
       if (_dbus_auth_needs_encoding (transport->auth))
         {
           /* Does fd passing even make sense with encoded data? */
@@ -580,55 +1193,176 @@ do_writing (DBusTransport *transport)
                          total_bytes_to_write);
 #endif
           
+          bytes_requested =
+            packet_room (socket_transport,
+                         total_bytes_to_write - socket_transport->message_bytes_written);
           bytes_written =
             _dbus_write_socket (socket_transport->fd,
                                 &socket_transport->encoded_outgoing,
                                 socket_transport->message_bytes_written,
-                                total_bytes_to_write - socket_transport->message_bytes_written);
+                                bytes_requested);
         }
-      else
+#ifdef HAVE_UNIX_FD_PASSING
+      else if (socket_transport->message_bytes_written <= 0 &&
+               DBUS_TRANSPORT_CAN_SEND_UNIX_FD(transport) &&
+               message_has_unix_fds (message))
         {
+          /* Send the fds along with the first byte of the message, and
+           * don't batch it with others: the fds are only guaranteed to
+           * arrive with the bytes sendmsg() wrote them alongside.
+           */
+          const int *unix_fds;
+          unsigned n;
+          int header_part;
+
           total_bytes_to_write = header_len + body_len;
 
-#if 0
-          _dbus_verbose ("message is %d bytes\n",
-                         total_bytes_to_write);
+          _dbus_message_get_unix_fds(message, &unix_fds, &n);
+
+          bytes_requested =
+            packet_room (socket_transport,
+                         total_bytes_to_write - socket_transport->message_bytes_written);
+          header_part = MIN (header_len - socket_transport->message_bytes_written,
+                             bytes_requested);
+          bytes_written =
+            _dbus_write_socket_with_unix_fds_two (socket_transport->fd,
+                                                  header,
+                                                  socket_transport->message_bytes_written,
+                                                  header_part,
+                                                  body,
+                                                  0, bytes_requested - header_part,
+                                                  unix_fds,
+                                                  n);
+
+          if (bytes_written > 0 && n > 0)
+            _dbus_verbose("Wrote %i unix fds\n", n);
+        }
 #endif
+      else if (socket_transport->zerocopy &&
+               body_len >= ZEROCOPY_MIN_BODY_SIZE)
+        {
+          /* The header goes out as usual; the body is sent from the
+           * message's own memory, so the message is kept until the
+           * kernel reports it's done with it.
+           */
+          total_bytes_to_write = header_len + body_len;
 
-#ifdef HAVE_UNIX_FD_PASSING
-          if (socket_transport->message_bytes_written <= 0 && DBUS_TRANSPORT_CAN_SEND_UNIX_FD(transport))
+          if (socket_transport->message_bytes_written < header_len)
+            {
+              bytes_requested = header_len - socket_transport->message_bytes_written;
+              bytes_written =
+                _dbus_write_socket (socket_transport->fd,
+                                    header,
+                                    socket_transport->message_bytes_written,
+                                    bytes_requested);
+            }
+          else
             {
-              /* Send the fds along with the first byte of the message */
-              const int *unix_fds;
-              unsigned n;
+              ZerocopySend *pending;
 
-              _dbus_message_get_unix_fds(message, &unix_fds, &n);
+              if (!prepare_zerocopy_send (socket_transport, message))
+                {
+                  oom = TRUE;
+                  goto out;
+                }
 
+              bytes_requested = total_bytes_to_write - socket_transport->message_bytes_written;
               bytes_written =
-                _dbus_write_socket_with_unix_fds_two (socket_transport->fd,
-                                                      header,
-                                                      socket_transport->message_bytes_written,
-                                                      header_len - socket_transport->message_bytes_written,
-                                                      body,
-                                                      0, body_len,
-                                                      unix_fds,
-                                                      n);
-
-              if (bytes_written > 0 && n > 0)
-                _dbus_verbose("Wrote %i unix fds\n", n);
+                _dbus_write_socket_zerocopy (socket_transport->fd,
+                                             body,
+                                             (socket_transport->message_bytes_written - header_len),
+                                             bytes_requested);
+
+              if (bytes_written > 0)
+                {
+                  pending = _dbus_list_get_last (&socket_transport->zerocopy_pending);
+                  pending->n_sends += 1;
+                  socket_transport->zerocopy_next_send += 1;
+                }
             }
-          else
+        }
+      else
+        {
+          const DBusString *buffers[MAX_MESSAGES_PER_WRITE * 2];
+          int batch_len;
+
+          total_bytes_to_write = header_len + body_len;
+
+          buffers[0] = header;
+          buffers[1] = body;
+          batch_len = total_bytes_to_write - socket_transport->message_bytes_written;
+
+          /* Append as many of the following messages as fit in what
+           * we're still allowed to write this iteration.
+           */
+          if (batch_len + total < socket_transport->max_bytes_written_per_iteration)
+            {
+              DBusMessage *more[MAX_MESSAGES_PER_WRITE];
+              int n_more;
+
+              n_more = _dbus_connection_get_messages_to_send (transport->connection,
+                                                              more,
+                                                              MAX_MESSAGES_PER_WRITE);
+              _dbus_assert (n_more >= 1 && more[0] == message);
+
+              for (i = 1; i < n_more; i++)
+                {
+                  if (batch_len + total >= socket_transport->max_bytes_written_per_iteration)
+                    break;
+
+#ifdef HAVE_UNIX_FD_PASSING
+                  if (DBUS_TRANSPORT_CAN_SEND_UNIX_FD(transport) &&
+                      message_has_unix_fds (more[i]))
+                    break;
+#endif
+
+                  /* left for the next turn of the loop to drop */
+                  if (_dbus_message_has_expired (more[i]))
+                    break;
+
+                  dbus_message_lock (more[i]);
+                  _dbus_message_get_network_data (more[i],
+                                                  &buffers[n_messages * 2],
+                                                  &buffers[n_messages * 2 + 1]);
+                  message_lens[n_messages] =
+                    _dbus_string_get_length (buffers[n_messages * 2]) +
+                    _dbus_string_get_length (buffers[n_messages * 2 + 1]);
+
+                  /* A packet carries whole messages after the first */
+                  if (packet_room (socket_transport,
+                                   batch_len + message_lens[n_messages]) <
+                      batch_len + message_lens[n_messages])
+                    break;
+
+                  batch_len += message_lens[n_messages];
+
+                  messages[n_messages] = more[i];
+                  n_messages += 1;
+                }
+            }
+
+#if 0
+          _dbus_verbose ("message is %d bytes, %d messages in this write\n",
+                         total_bytes_to_write, n_messages);
 #endif
+
+          bytes_requested = packet_room (socket_transport, batch_len);
+
+          if (n_messages == 1)
             {
               if (socket_transport->message_bytes_written < header_len)
                 {
+                  int header_part;
+
+                  header_part = MIN (header_len - socket_transport->message_bytes_written,
+                                     bytes_requested);
                   bytes_written =
                     _dbus_write_socket_two (socket_transport->fd,
                                             header,
                                             socket_transport->message_bytes_written,
-                                            header_len - socket_transport->message_bytes_written,
+                                            header_part,
                                             body,
-                                            0, body_len);
+                                            0, bytes_requested - header_part);
                 }
               else
                 {
@@ -636,12 +1370,22 @@ do_writing (DBusTransport *transport)
                     _dbus_write_socket (socket_transport->fd,
                                         body,
                                         (socket_transport->message_bytes_written - header_len),
-                                        body_len -
-                                        (socket_transport->message_bytes_written - header_len));
+                                        bytes_requested);
                 }
             }
+          else
+            {
+              bytes_written =
+                _dbus_write_socket_many (socket_transport->fd,
+                                         buffers,
+                                         n_messages * 2,
+                                         socket_transport->message_bytes_written);
+            }
         }
 
+      message_lens[0] = total_bytes_to_write;
+      transport->n_writes += 1;
+
       if (bytes_written < 0)
         {
           /* EINTR already handled for us */
@@ -650,8 +1394,15 @@ do_writing (DBusTransport *transport)
            * http://lists.freedesktop.org/archives/dbus/2008-March/009526.html
            */
           
-          if (_dbus_get_is_errno_eagain_or_ewouldblock () || _dbus_get_is_errno_epipe ())
+          if (_dbus_get_is_errno_eagain_or_ewouldblock ())
+            {
+              socket_transport->write_blocked = TRUE;
+              goto out;
+            }
+          else if (_dbus_get_is_errno_epipe ())
             goto out;
+          else if (shrink_packet_size (socket_transport, bytes_requested))
+            continue;
           else
             {
               _dbus_verbose ("Error writing to remote app: %s\n",
@@ -668,28 +1419,113 @@ do_writing (DBusTransport *transport)
           total += bytes_written;
           socket_transport->message_bytes_written += bytes_written;
 
-          _dbus_assert (socket_transport->message_bytes_written <=
-                        total_bytes_to_write);
-          
-          if (socket_transport->message_bytes_written == total_bytes_to_write)
-            {
-              socket_transport->message_bytes_written = 0;
-              _dbus_string_set_length (&socket_transport->encoded_outgoing, 0);
-              _dbus_string_compact (&socket_transport->encoded_outgoing, 2048);
+          retire_written_messages (transport, messages, message_lens,
+                                   n_messages);
 
-              _dbus_connection_message_sent (transport->connection,
-                                             message);
+          /* A short write means the socket buffer is full, so another
+           * write before the write watch fires would only say EAGAIN.
+           */
+          if (bytes_written < bytes_requested)
+            {
+              socket_transport->write_blocked = TRUE;
+              goto out;
             }
         }
     }
 
- out:
+ out:
+  /* Grow while there's more queued than we may write in one go, and
+   * shrink once the queue empties well within it; a full socket
+   * says nothing about either.
+   */
+  if (!oom &&
+      (budget_spent ||
+       !_dbus_connection_has_messages_to_send_unlocked (transport->connection)))
+    socket_transport->max_bytes_written_per_iteration =
+      adapt_iteration_budget (transport,
+                              socket_transport->max_bytes_written_per_iteration,
+                              total, budget_spent, TRUE);
+
   if (oom)
     return FALSE;
   else
     return TRUE;
 }
 
+/* Grow the read size while reads keep filling it, and fall back
+ * toward the per-iteration default once the peer calms down, so a
+ * burst of small messages is pulled in and decoded with few reads.
+ */
+static void
+adapt_read_size (DBusTransportSocket *socket_transport,
+                 int                  bytes_read)
+{
+  int read_size;
+
+  read_size = socket_transport->read_size;
+
+  if (bytes_read >= read_size && read_size < MAX_READ_SIZE)
+    read_size *= 2;
+  else if (bytes_read < read_size / 4 &&
+           read_size > socket_transport->max_bytes_read_per_iteration)
+    read_size /= 2;
+
+  if (read_size == socket_transport->read_size)
+    return;
+
+  _dbus_verbose ("read size %d -> %d\n", socket_transport->read_size, read_size);
+
+  socket_transport->read_size = read_size;
+  _dbus_message_loader_set_max_buffer_waste (socket_transport->base.loader,
+                                             read_size);
+}
+
+/* Drains the bytes the other end wrote to wake us. The messages
+ * themselves are collected by socket_collect_handed_off(), on the
+ * way to queueing them.
+ */
+static dbus_bool_t
+do_inproc_reading (DBusTransport *transport)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+  int bytes_read;
+
+  check_read_watch (transport);
+
+  if (transport->disconnected ||
+      !dbus_watch_get_enabled (socket_transport->read_watch))
+    return TRUE;
+
+  /* encoded_incoming is never needed for decoding in-process */
+  bytes_read = _dbus_read_socket (socket_transport->fd,
+                                  &socket_transport->encoded_incoming,
+                                  socket_transport->read_size);
+  _dbus_string_set_length (&socket_transport->encoded_incoming, 0);
+  transport->n_reads += 1;
+
+  if (bytes_read < 0 && _dbus_get_is_errno_enomem ())
+    return FALSE;
+
+  /* Whatever was handed over before a hangup still arrives */
+  if (!_dbus_transport_queue_messages (transport))
+    return FALSE;
+
+  if (bytes_read == 0)
+    {
+      _dbus_verbose ("Disconnected from remote app\n");
+      do_io_error (transport);
+    }
+  else if (bytes_read < 0 &&
+           !_dbus_get_is_errno_eagain_or_ewouldblock ())
+    {
+      _dbus_verbose ("Error reading from remote app: %s\n",
+                     _dbus_strerror_from_errno ());
+      do_io_error (transport);
+    }
+
+  return TRUE;
+}
+
 /* returns false on out-of-memory */
 static dbus_bool_t
 do_reading (DBusTransport *transport)
@@ -698,6 +1534,9 @@ do_reading (DBusTransport *transport)
   DBusString *buffer;
   int bytes_read;
   int total;
+  int read_size;
+  dbus_bool_t drained;
+  dbus_bool_t budget_spent;
   dbus_bool_t oom;
 
   _dbus_verbose ("fd = %d\n",socket_transport->fd);
@@ -706,7 +1545,11 @@ do_reading (DBusTransport *transport)
   if (!_dbus_transport_get_is_authenticated (transport))
     return TRUE;
 
+  if (socket_transport->inproc != NULL)
+    return do_inproc_reading (transport);
+
   oom = FALSE;
+  budget_spent = FALSE;
   
   total = 0;
 
@@ -719,6 +1562,7 @@ do_reading (DBusTransport *transport)
     {
       _dbus_verbose ("%d bytes exceeds %d bytes read per iteration, returning\n",
                      total, socket_transport->max_bytes_read_per_iteration);
+      budget_spent = TRUE;
       goto out;
     }
 
@@ -730,6 +1574,8 @@ do_reading (DBusTransport *transport)
 
   if (!dbus_watch_get_enabled (socket_transport->read_watch))
     return TRUE;
+
+  read_size = next_read_size (socket_transport, socket_transport->read_size);
   
   if (_dbus_auth_needs_decoding (transport->auth))
     {
@@ -739,9 +1585,12 @@ do_reading (DBusTransport *transport)
       if (_dbus_string_get_length (&socket_transport->encoded_incoming) > 0)
         bytes_read = _dbus_string_get_length (&socket_transport->encoded_incoming);
       else
-        bytes_read = _dbus_read_socket (socket_transport->fd,
-                                        &socket_transport->encoded_incoming,
-                                        socket_transport->max_bytes_read_per_iteration);
+        {
+          bytes_read = _dbus_read_socket (socket_transport->fd,
+                                          &socket_transport->encoded_incoming,
+                                          read_size);
+          transport->n_reads += 1;
+        }
 
       _dbus_assert (_dbus_string_get_length (&socket_transport->encoded_incoming) ==
                     bytes_read);
@@ -784,19 +1633,14 @@ do_reading (DBusTransport *transport)
 #ifdef HAVE_UNIX_FD_PASSING
       if (DBUS_TRANSPORT_CAN_SEND_UNIX_FD(transport))
         {
-          int *fds, n_fds;
+          DBusString *fds;
+          int n_fds;
 
-          if (!_dbus_message_loader_get_unix_fds(transport->loader, &fds, &n_fds))
-            {
-              _dbus_verbose ("Out of memory reading file descriptors\n");
-              _dbus_message_loader_return_buffer (transport->loader, buffer, 0);
-              oom = TRUE;
-              goto out;
-            }
+          _dbus_message_loader_get_unix_fds(transport->loader, &fds, &n_fds);
 
           bytes_read = _dbus_read_socket_with_unix_fds(socket_transport->fd,
                                                        buffer,
-                                                       socket_transport->max_bytes_read_per_iteration,
+                                                       read_size,
                                                        fds, &n_fds);
 
           if (bytes_read >= 0 && n_fds > 0)
@@ -808,12 +1652,13 @@ do_reading (DBusTransport *transport)
 #endif
         {
           bytes_read = _dbus_read_socket (socket_transport->fd,
-                                          buffer, socket_transport->max_bytes_read_per_iteration);
+                                          buffer, read_size);
         }
 
       _dbus_message_loader_return_buffer (transport->loader,
                                           buffer,
                                           bytes_read < 0 ? 0 : bytes_read);
+      transport->n_reads += 1;
     }
   
   if (bytes_read < 0)
@@ -848,6 +1693,17 @@ do_reading (DBusTransport *transport)
       
       total += bytes_read;      
 
+      /* Every read of a seqpacket socket is exactly one packet, so
+       * its size says nothing about what's left.
+       */
+      if (socket_transport->seqpacket)
+        drained = FALSE;
+      else
+        {
+          drained = bytes_read < socket_transport->read_size;
+          adapt_read_size (socket_transport, bytes_read);
+        }
+
       if (!_dbus_transport_queue_messages (transport))
         {
           oom = TRUE;
@@ -855,14 +1711,31 @@ do_reading (DBusTransport *transport)
           goto out;
         }
       
-      /* Try reading more data until we get EAGAIN and return, or
+      /* A short read means we've drained the socket, so another read
+       * before the read watch fires would only say EAGAIN. Otherwise
+       * try reading more data until we get EAGAIN and return, or
        * exceed max bytes per iteration.  If in blocking mode of
        * course we'll block instead of returning.
        */
+      if (drained)
+        goto out;
+
       goto again;
     }
 
  out:
+  /* Reading more per iteration only helps while there's room for
+   * what we read; past half the limit on received messages, reading
+   * is about to stop anyway.
+   */
+  if (!oom)
+    socket_transport->max_bytes_read_per_iteration =
+      adapt_iteration_budget (transport,
+                              socket_transport->max_bytes_read_per_iteration,
+                              total, budget_spent,
+                              _dbus_counter_get_size_value (transport->live_messages) <
+                              transport->max_live_messages_size / 2);
+
   if (oom)
     return FALSE;
   else
@@ -898,6 +1771,13 @@ socket_handle_watch (DBusTransport *transport,
   _dbus_assert (watch == socket_transport->read_watch ||
                 watch == socket_transport->write_watch);
   _dbus_assert (watch != NULL);
+
+  /* Zero-copy completions are queued as socket errors; they're not
+   * a reason to disconnect.
+   */
+  if (socket_transport->zerocopy && (flags & DBUS_WATCH_ERROR) &&
+      reap_zerocopy_sends (socket_transport))
+    flags &= ~DBUS_WATCH_ERROR;
   
   /* If we hit an error here on a write watch, don't disconnect the transport yet because data can
    * still be in the buffer and do_reading may need several iteration to read
@@ -947,6 +1827,8 @@ socket_handle_watch (DBusTransport *transport,
       _dbus_verbose ("handling write watch, have_outgoing_messages = %d\n",
                      _dbus_connection_has_messages_to_send_unlocked (transport->connection));
 #endif
+      socket_transport->write_blocked = FALSE;
+
       if (!do_authentication (transport, FALSE, TRUE, NULL))
         return FALSE;
       
@@ -988,6 +1870,8 @@ socket_disconnect (DBusTransport *transport)
   
   _dbus_close_socket (socket_transport->fd, NULL);
   socket_transport->fd = -1;
+
+  free_zerocopy_sends (socket_transport);
 }
 
 static dbus_bool_t
@@ -1034,9 +1918,12 @@ socket_do_iteration (DBusTransport *transport,
                    int            timeout_milliseconds)
 {
   DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
-  DBusPollFD poll_fd;
+  DBusPollFD poll_fds[2];
+  DBusPollFD *poll_fd = &poll_fds[0];
+  int n_poll_fds;
   int poll_res;
   int poll_timeout;
+  dbus_bool_t woken = FALSE;
 
   _dbus_verbose (" iteration flags = %s%s timeout = %d read_watch = %p write_watch = %p fd = %d\n",
                  flags & DBUS_ITERATION_DO_READING ? "read" : "",
@@ -1052,8 +1939,8 @@ socket_do_iteration (DBusTransport *transport,
    * we don't want to read any messages yet if not given DO_READING.
    */
 
-  poll_fd.fd = socket_transport->fd;
-  poll_fd.events = 0;
+  poll_fd->fd = socket_transport->fd;
+  poll_fd->events = 0;
   
   if (_dbus_transport_get_is_authenticated (transport))
     {
@@ -1072,6 +1959,13 @@ socket_do_iteration (DBusTransport *transport,
           !transport->disconnected &&
           _dbus_connection_has_messages_to_send_unlocked (transport->connection))
         {
+          /* The write watch is already waiting for room; writing now
+           * would only be told there is none.
+           */
+          if (transport->edge_triggered_writes &&
+              socket_transport->write_blocked)
+            goto out;
+
           do_writing (transport);
 
           if (transport->disconnected ||
@@ -1082,11 +1976,11 @@ socket_do_iteration (DBusTransport *transport,
       /* If we get here, we decided to do the poll() after all */
       _dbus_assert (socket_transport->read_watch);
       if (flags & DBUS_ITERATION_DO_READING)
-	poll_fd.events |= _DBUS_POLLIN;
+	poll_fd->events |= _DBUS_POLLIN;
 
       _dbus_assert (socket_transport->write_watch);
       if (flags & DBUS_ITERATION_DO_WRITING)
-        poll_fd.events |= _DBUS_POLLOUT;
+        poll_fd->events |= _DBUS_POLLOUT;
     }
   else
     {
@@ -1096,20 +1990,58 @@ socket_do_iteration (DBusTransport *transport,
 
       if (transport->receive_credentials_pending ||
           auth_state == DBUS_AUTH_STATE_WAITING_FOR_INPUT)
-	poll_fd.events |= _DBUS_POLLIN;
+	poll_fd->events |= _DBUS_POLLIN;
 
       if (transport->send_credentials_pending ||
           auth_state == DBUS_AUTH_STATE_HAVE_BYTES_TO_SEND)
-	poll_fd.events |= _DBUS_POLLOUT;
+	poll_fd->events |= _DBUS_POLLOUT;
     }
 
-  if (poll_fd.events)
+  if (poll_fd->events)
     {
       if (flags & DBUS_ITERATION_BLOCK)
 	poll_timeout = timeout_milliseconds;
       else
 	poll_timeout = 0;
 
+      n_poll_fds = 1;
+
+#ifdef DBUS_UNIX
+      /* While we block, another thread can only queue messages, not
+       * write them, since we own the io path; poll a wakeup channel
+       * too so it can get us to write them right away instead of
+       * whenever the socket next becomes readable.
+       */
+      if ((flags & DBUS_ITERATION_BLOCK) && poll_timeout != 0)
+        {
+          if (socket_transport->wakeup_read_fd < 0 &&
+              !_dbus_wakeup_new (&socket_transport->wakeup_read_fd,
+                                 &socket_transport->wakeup_write_fd))
+            socket_transport->wakeup_read_fd = -1;
+
+          if (socket_transport->wakeup_read_fd >= 0)
+            {
+              poll_fds[1].fd = socket_transport->wakeup_read_fd;
+              poll_fds[1].events = _DBUS_POLLIN;
+              poll_fds[1].revents = 0;
+              n_poll_fds = 2;
+              socket_transport->in_blocking_poll = TRUE;
+            }
+
+          /* Other threads only interrupt us once in_blocking_poll is
+           * set, so pick up whatever they queued before that, including
+           * while we waited for the io path after our caller decided
+           * there was nothing to write.
+           */
+          if (_dbus_transport_get_is_authenticated (transport) &&
+              _dbus_connection_has_messages_to_send_unlocked (transport->connection))
+            {
+              poll_fd->events |= _DBUS_POLLOUT;
+              flags |= DBUS_ITERATION_DO_WRITING;
+            }
+        }
+#endif
+
       /* For blocking selects we drop the connection lock here
        * to avoid blocking out connection access during a potentially
        * indefinite blocking call. The io path is still protected
@@ -1122,7 +2054,7 @@ socket_do_iteration (DBusTransport *transport,
         }
       
     again:
-      poll_res = _dbus_poll (&poll_fd, 1, poll_timeout);
+      poll_res = _dbus_poll (poll_fds, n_poll_fds, poll_timeout);
 
       if (poll_res < 0 && _dbus_get_is_errno_eintr ())
 	goto again;
@@ -1132,25 +2064,41 @@ socket_do_iteration (DBusTransport *transport,
           _dbus_verbose ("lock post poll\n");
           _dbus_connection_lock (transport->connection);
         }
+
+#ifdef DBUS_UNIX
+      socket_transport->in_blocking_poll = FALSE;
+
+      if (n_poll_fds > 1 && poll_res > 0 &&
+          (poll_fds[1].revents & _DBUS_POLLIN))
+        {
+          _dbus_verbose ("woken up by another thread\n");
+          _dbus_wakeup_drain (socket_transport->wakeup_read_fd);
+          woken = TRUE;
+        }
+#endif
       
       if (poll_res >= 0)
         {
           if (poll_res == 0)
-            poll_fd.revents = 0; /* some concern that posix does not guarantee this;
+            poll_fd->revents = 0; /* some concern that posix does not guarantee this;
                                   * valgrind flags it as an error. though it probably
                                   * is guaranteed on linux at least.
                                   */
           
-          if (poll_fd.revents & _DBUS_POLLERR)
+          if (poll_fd->revents & _DBUS_POLLERR)
             do_io_error (transport);
           else
             {
-              dbus_bool_t need_read = (poll_fd.revents & _DBUS_POLLIN) > 0;
-              dbus_bool_t need_write = (poll_fd.revents & _DBUS_POLLOUT) > 0;
+              dbus_bool_t need_read = (poll_fd->revents & _DBUS_POLLIN) > 0;
+              dbus_bool_t need_write = (poll_fd->revents & _DBUS_POLLOUT) > 0;
 	      dbus_bool_t authentication_completed;
 
               _dbus_verbose ("in iteration, need_read=%d need_write=%d\n",
                              need_read, need_write);
+
+              if (need_write)
+                socket_transport->write_blocked = FALSE;
+
               do_authentication (transport, need_read, need_write,
 				 &authentication_completed);
 
@@ -1160,7 +2108,11 @@ socket_do_iteration (DBusTransport *transport,
                                  
               if (need_read && (flags & DBUS_ITERATION_DO_READING))
                 do_reading (transport);
-              if (need_write && (flags & DBUS_ITERATION_DO_WRITING))
+              /* Whatever another thread queued while we slept hasn't
+               * been tried yet, whether or not we came in to write.
+               */
+              if ((need_write && (flags & DBUS_ITERATION_DO_WRITING)) ||
+                  woken)
                 do_writing (transport);
             }
         }
@@ -1207,6 +2159,99 @@ socket_get_socket_fd (DBusTransport *transport,
   return TRUE;
 }
 
+static void
+socket_compact (DBusTransport *transport)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+
+  /* Start over at the smallest reads and budgets; a busy peer grows
+   * them again
+   */
+  socket_transport->max_bytes_read_per_iteration = transport->min_bytes_per_iteration;
+  socket_transport->max_bytes_written_per_iteration = transport->min_bytes_per_iteration;
+  socket_transport->read_size = socket_transport->max_bytes_read_per_iteration;
+  _dbus_message_loader_set_max_buffer_waste (transport->loader,
+                                             socket_transport->read_size);
+
+  if (_dbus_string_get_length (&socket_transport->encoded_outgoing) == 0)
+    _dbus_string_compact (&socket_transport->encoded_outgoing, 0);
+
+  if (_dbus_string_get_length (&socket_transport->encoded_incoming) == 0)
+    _dbus_string_compact (&socket_transport->encoded_incoming, 0);
+}
+
+static void
+socket_interrupt_iteration (DBusTransport *transport)
+{
+#ifdef DBUS_UNIX
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+
+  if (socket_transport->in_blocking_poll)
+    _dbus_wakeup_signal (socket_transport->wakeup_write_fd);
+#endif
+}
+
+static void
+socket_get_iteration_budgets (DBusTransport *transport,
+                              int           *read_budget,
+                              int           *write_budget)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+
+  *read_budget = socket_transport->max_bytes_read_per_iteration;
+  *write_budget = socket_transport->max_bytes_written_per_iteration;
+}
+
+static dbus_bool_t
+socket_collect_handed_off (DBusTransport *transport)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+  InprocChannel *channel = socket_transport->inproc;
+  DBusList *received;
+  DBusList *link;
+
+  if (channel == NULL)
+    return TRUE;
+
+  _dbus_mutex_lock (channel->lock);
+  received = channel->queues[transport->is_server];
+  channel->queues[transport->is_server] = NULL;
+  _dbus_mutex_unlock (channel->lock);
+
+  while ((link = _dbus_list_pop_first_link (&received)) != NULL)
+    {
+      if (!_dbus_message_loader_queue_handed_off (transport->loader, link))
+        {
+          /* Put what's left back ahead of anything handed over since */
+          _dbus_list_prepend_link (&received, link);
+
+          _dbus_mutex_lock (channel->lock);
+          while ((link = _dbus_list_pop_last_link (&received)) != NULL)
+            _dbus_list_prepend_link (&channel->queues[transport->is_server],
+                                     link);
+          _dbus_mutex_unlock (channel->lock);
+
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+static dbus_bool_t
+socket_can_hand_off (DBusTransport *transport)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+
+  /* Anything encoded or part written is state only we could finish */
+  return socket_transport->inproc == NULL &&
+    !_dbus_auth_needs_encoding (transport->auth) &&
+    !_dbus_auth_needs_decoding (transport->auth) &&
+    _dbus_string_get_length (&socket_transport->encoded_incoming) == 0 &&
+    socket_transport->message_bytes_written == 0 &&
+    socket_transport->zerocopy_pending == NULL;
+}
+
 static const DBusTransportVTable socket_vtable = {
   socket_finalize,
   socket_handle_watch,
@@ -1214,7 +2259,12 @@ static const DBusTransportVTable socket_vtable = {
   socket_connection_set,
   socket_do_iteration,
   socket_live_messages_changed,
-  socket_get_socket_fd
+  socket_get_socket_fd,
+  socket_compact,
+  socket_interrupt_iteration,
+  socket_get_iteration_budgets,
+  socket_collect_handed_off,
+  socket_can_hand_off
 };
 
 /**
@@ -1270,10 +2320,19 @@ _dbus_transport_new_for_socket (int               fd,
 
   socket_transport->fd = fd;
   socket_transport->message_bytes_written = 0;
+  socket_transport->zerocopy = _dbus_socket_get_zerocopy (fd);
+  socket_transport->seqpacket = _dbus_socket_get_seqpacket (fd);
+  socket_transport->max_packet_size = _DBUS_INT_MAX;
+#ifdef DBUS_UNIX
+  socket_transport->wakeup_read_fd = -1;
+  socket_transport->wakeup_write_fd = -1;
+#endif
   
-  /* These values should probably be tunable or something. */     
-  socket_transport->max_bytes_read_per_iteration = 2048;
-  socket_transport->max_bytes_written_per_iteration = 2048;
+  socket_transport->max_bytes_read_per_iteration =
+    socket_transport->base.min_bytes_per_iteration;
+  socket_transport->max_bytes_written_per_iteration =
+    socket_transport->base.min_bytes_per_iteration;
+  socket_transport->read_size = socket_transport->max_bytes_read_per_iteration;
   
   return (DBusTransport*) socket_transport;
 
@@ -1290,6 +2349,180 @@ _dbus_transport_new_for_socket (int               fd,
   return NULL;
 }
 
+/**
+ * Creates a server-side transport for a socket whose connection was
+ * authenticated by another process, which handed the socket and
+ * whatever it had read of the next message over to us. The transport
+ * starts out authenticated as the given identity, and the client
+ * carries on as if nothing happened.
+ *
+ * @param fd the socket, which must be nonblocking
+ * @param identity the identity the client was authorized as
+ * @param unix_fd_negotiated whether unix fd passing was negotiated
+ * @param unread bytes read from the socket but not yet made into a message
+ * @returns the new transport, or #NULL if no memory, in which case
+ *   the socket has been closed
+ */
+DBusTransport*
+_dbus_transport_new_for_handed_off_socket (int               fd,
+                                           DBusCredentials  *identity,
+                                           dbus_bool_t       unix_fd_negotiated,
+                                           const DBusString *unread)
+{
+  DBusTransport *transport;
+  DBusString guid;
+  DBusString *buffer;
+  int orig_len;
+  dbus_bool_t succeeded;
+
+  /* The GUID only goes out in the OK of an auth conversation, which
+   * this transport has already had
+   */
+  _dbus_string_init_const (&guid, "");
+
+  transport = _dbus_transport_new_for_socket (fd, &guid, NULL);
+  if (transport == NULL)
+    {
+      _dbus_close_socket (fd, NULL);
+      return NULL;
+    }
+
+  transport->send_credentials_pending = FALSE;
+  transport->receive_credentials_pending = FALSE;
+
+  if (!_dbus_auth_set_handed_over (transport->auth, identity,
+                                   unix_fd_negotiated))
+    goto failed;
+
+  _dbus_message_loader_get_buffer (transport->loader, &buffer);
+  orig_len = _dbus_string_get_length (buffer);
+  succeeded = _dbus_string_copy (unread, 0, buffer, orig_len);
+  _dbus_message_loader_return_buffer (transport->loader, buffer,
+                                      _dbus_string_get_length (buffer) - orig_len);
+  if (!succeeded)
+    goto failed;
+
+  transport->unused_bytes_recovered = TRUE;
+
+  return transport;
+
+ failed:
+  _dbus_transport_unref (transport);
+  return NULL;
+}
+
+/**
+ * Makes a client transport send its whole side of the handshake
+ * without waiting for the server: the credentials byte, AUTH EXTERNAL,
+ * NEGOTIATE_UNIX_FD and BEGIN, followed by whatever messages are
+ * queued by the time it's written, all in one write. See
+ * _dbus_auth_client_pipeline() for when this is a good idea.
+ *
+ * @param transport the client transport
+ * @param credentials_byte_inline #TRUE if the credentials byte is an
+ *   ordinary byte that may share the write
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+_dbus_transport_socket_pipeline_handshake (DBusTransport *transport,
+                                           dbus_bool_t    credentials_byte_inline)
+{
+  DBusTransportSocket *socket_transport = (DBusTransportSocket*) transport;
+
+  _dbus_assert (!transport->is_server);
+
+  if (!_dbus_auth_client_pipeline (transport->auth))
+    return FALSE;
+
+  socket_transport->credentials_byte_inline = credentials_byte_inline;
+
+  return TRUE;
+}
+
+/**
+ * Creates the two ends of a connection within this process. They
+ * authenticate over a socket pair like any other connection, but
+ * after that a message is handed to the other end as it is, without
+ * being marshalled, written, read back or validated; the socket only
+ * carries a byte per message to wake the receiver.
+ *
+ * @param server_guid the server's GUID
+ * @param address the client's address
+ * @param client_p return location for the client end
+ * @param server_p return location for the server end
+ * @param error return location for an error
+ * @returns #FALSE on failure
+ */
+dbus_bool_t
+_dbus_transport_new_inproc_pair (const DBusString  *server_guid,
+                                 const DBusString  *address,
+                                 DBusTransport    **client_p,
+                                 DBusTransport    **server_p,
+                                 DBusError         *error)
+{
+  DBusTransportSocket *client;
+  DBusTransportSocket *server;
+  InprocChannel *channel;
+  int client_fd, server_fd;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  channel = dbus_new0 (InprocChannel, 1);
+  if (channel == NULL)
+    goto nomem_0;
+
+  _dbus_mutex_new_at_location (&channel->lock);
+  if (channel->lock == NULL)
+    goto nomem_1;
+
+  if (!_dbus_full_duplex_pipe (&client_fd, &server_fd, FALSE, error))
+    {
+      _dbus_mutex_free_at_location (&channel->lock);
+      dbus_free (channel);
+      return FALSE;
+    }
+
+  client = (DBusTransportSocket*) _dbus_transport_new_for_socket (client_fd,
+                                                                 NULL, address);
+  if (client == NULL)
+    {
+      _dbus_close_socket (client_fd, NULL);
+      _dbus_close_socket (server_fd, NULL);
+      goto nomem_2;
+    }
+
+  server = (DBusTransportSocket*) _dbus_transport_new_for_socket (server_fd,
+                                                                 server_guid, NULL);
+  if (server == NULL)
+    {
+      _dbus_transport_unref (&client->base);
+      _dbus_close_socket (server_fd, NULL);
+      goto nomem_2;
+    }
+
+  /* Anything in the auth conversation's unused bytes is just the
+   * first doorbells, not the start of a message.
+   */
+  channel->refcount.value = 2;
+  client->inproc = channel;
+  client->base.unused_bytes_recovered = TRUE;
+  server->inproc = channel;
+  server->base.unused_bytes_recovered = TRUE;
+
+  *client_p = &client->base;
+  *server_p = &server->base;
+
+  return TRUE;
+
+ nomem_2:
+  _dbus_mutex_free_at_location (&channel->lock);
+ nomem_1:
+  dbus_free (channel);
+ nomem_0:
+  _DBUS_SET_OOM (error);
+  return FALSE;
+}
+
 /**
  * Creates a new transport for the given hostname and port.
  * If host is NULL, it will default to localhost
@@ -1298,6 +2531,7 @@ _dbus_transport_new_for_socket (int               fd,
  * @param port the port to connect to
  * @param family the address family to connect to
  * @param path to nonce file
+ * @param options socket options to apply once connected, or #NULL
  * @param error location to store reason for failure.
  * @returns a new transport, or #NULL on failure.
  */
@@ -1306,6 +2540,7 @@ _dbus_transport_new_for_tcp_socket (const char     *host,
                                     const char     *port,
                                     const char     *family,
                                     const char     *noncefile,
+                                    const DBusTcpOptions *options,
                                     DBusError      *error)
 {
   int fd;
@@ -1344,6 +2579,10 @@ _dbus_transport_new_for_tcp_socket (const char     *host,
        !_dbus_string_append (&address, noncefile)))
     goto error;
 
+  if (options != NULL && options->compress > 0 &&
+      !_dbus_string_append (&address, ",compress=true"))
+    goto error;
+
   fd = _dbus_connect_tcp_socket_with_nonce (host, port, family, noncefile, error);
   if (fd < 0)
     {
@@ -1352,6 +2591,14 @@ _dbus_transport_new_for_tcp_socket (const char     *host,
       return NULL;
     }
 
+  if (options != NULL && !_dbus_set_tcp_socket_options (fd, options, error))
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      _dbus_close_socket (fd, NULL);
+      _dbus_string_free (&address);
+      return NULL;
+    }
+
   _dbus_verbose ("Successfully connected to tcp socket %s:%s\n",
                  host, port);
   
@@ -1363,6 +2610,8 @@ _dbus_transport_new_for_tcp_socket (const char     *host,
       _dbus_close_socket (fd, NULL);
       fd = -1;
     }
+  else if (options != NULL && options->compress > 0)
+    _dbus_transport_set_compression_possible (transport, TRUE);
 
   return transport;
 
@@ -1372,6 +2621,144 @@ error:
   return NULL;
 }
 
+static dbus_bool_t
+get_tcp_bool_option (DBusAddressEntry *entry,
+                     const char       *key,
+                     int              *value_p,
+                     DBusError        *error)
+{
+  const char *value = dbus_address_entry_get_value (entry, key);
+
+  if (value == NULL)
+    *value_p = -1;
+  else if (strcmp (value, "true") == 0)
+    *value_p = 1;
+  else if (strcmp (value, "false") == 0)
+    *value_p = 0;
+  else
+    {
+      dbus_set_error (error, DBUS_ERROR_BAD_ADDRESS,
+                      "Could not parse server address: %s must be true or false",
+                      key);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static dbus_bool_t
+get_tcp_size_option (DBusAddressEntry *entry,
+                     const char       *key,
+                     int              *value_p,
+                     DBusError        *error)
+{
+  const char *value = dbus_address_entry_get_value (entry, key);
+  DBusString str;
+  long size;
+  int end;
+
+  *value_p = 0;
+
+  if (value == NULL)
+    return TRUE;
+
+  _dbus_string_init_const (&str, value);
+  if (!_dbus_string_parse_int (&str, 0, &size, &end) ||
+      end != _dbus_string_get_length (&str) ||
+      size < 1 || size > _DBUS_INT_MAX)
+    {
+      dbus_set_error (error, DBUS_ERROR_BAD_ADDRESS,
+                      "Could not parse server address: %s must be a positive number of bytes",
+                      key);
+      return FALSE;
+    }
+
+  *value_p = size;
+  return TRUE;
+}
+
+/**
+ * Reads the buffer size keys of an address, sndbuf and rcvbuf (a
+ * size in bytes), which apply to any stream socket. The TCP-only
+ * options are set to leave the system default alone.
+ *
+ * @param entry the address entry
+ * @param options return location for the options
+ * @param error error to set if a key has a bad value
+ * @returns #FALSE if a key has a bad value
+ */
+dbus_bool_t
+_dbus_transport_get_buffer_options (DBusAddressEntry *entry,
+                                    DBusTcpOptions   *options,
+                                    DBusError        *error)
+{
+  options->nodelay = -1;
+  options->keepalive = -1;
+  options->zerocopy = -1;
+  options->seqpacket = -1;
+  options->compress = -1;
+
+  return get_tcp_size_option (entry, "sndbuf", &options->sndbuf, error) &&
+         get_tcp_size_option (entry, "rcvbuf", &options->rcvbuf, error);
+}
+
+/**
+ * Reads the keys of a unix address that shape its socket: the buffer
+ * sizes as for _dbus_transport_get_buffer_options(), and seqpacket
+ * (true or false), which asks for a socket that keeps each write as
+ * one packet instead of a byte stream.
+ *
+ * @param entry the address entry
+ * @param options return location for the options
+ * @param error error to set if a key has a bad value
+ * @returns #FALSE if a key has a bad value
+ */
+dbus_bool_t
+_dbus_transport_get_unix_options (DBusAddressEntry *entry,
+                                  DBusTcpOptions   *options,
+                                  DBusError        *error)
+{
+  return _dbus_transport_get_buffer_options (entry, options, error) &&
+         get_tcp_bool_option (entry, "seqpacket", &options->seqpacket, error);
+}
+
+/**
+ * Reads the socket tuning keys of a tcp or nonce-tcp address:
+ * nodelay, keepalive and zerocopy (true or false) and sndbuf and rcvbuf
+ * (a size in bytes). Keys that are absent leave the corresponding
+ * socket option at the system default. Also reads compress (true or
+ * false), which offers to compress the message stream once
+ * authenticated and is an error if built without LZ4.
+ *
+ * @param entry the address entry
+ * @param options return location for the options
+ * @param error error to set if a key has a bad value
+ * @returns #FALSE if a key has a bad value
+ */
+dbus_bool_t
+_dbus_transport_get_tcp_options (DBusAddressEntry *entry,
+                                 DBusTcpOptions   *options,
+                                 DBusError        *error)
+{
+  if (!_dbus_transport_get_buffer_options (entry, options, error) ||
+      !get_tcp_bool_option (entry, "nodelay", &options->nodelay, error) ||
+      !get_tcp_bool_option (entry, "keepalive", &options->keepalive, error) ||
+      !get_tcp_bool_option (entry, "zerocopy", &options->zerocopy, error) ||
+      !get_tcp_bool_option (entry, "compress", &options->compress, error))
+    return FALSE;
+
+#ifndef HAVE_LZ4
+  if (options->compress > 0)
+    {
+      dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                      "Compression is not supported in this build");
+      return FALSE;
+    }
+#endif
+
+  return TRUE;
+}
+
 /**
  * Opens a TCP socket transport.
  * 
@@ -1401,6 +2788,7 @@ _dbus_transport_open_socket(DBusAddressEntry  *entry,
       const char *port = dbus_address_entry_get_value (entry, "port");
       const char *family = dbus_address_entry_get_value (entry, "family");
       const char *noncefile = dbus_address_entry_get_value (entry, "noncefile");
+      DBusTcpOptions options;
 
       if ((isNonceTcp == TRUE) != (noncefile != NULL)) {
           _dbus_set_bad_address (error, method, "noncefile", NULL);
@@ -1413,7 +2801,11 @@ _dbus_transport_open_socket(DBusAddressEntry  *entry,
           return DBUS_TRANSPORT_OPEN_BAD_ADDRESS;
         }
 
-      *transport_p = _dbus_transport_new_for_tcp_socket (host, port, family, noncefile, error);
+      if (!_dbus_transport_get_tcp_options (entry, &options, error))
+        return DBUS_TRANSPORT_OPEN_BAD_ADDRESS;
+
+      *transport_p = _dbus_transport_new_for_tcp_socket (host, port, family, noncefile,
+                                                         &options, error);
       if (*transport_p == NULL)
         {
           _DBUS_ASSERT_ERROR_IS_SET (error);
@@ -30,14 +30,35 @@ DBUS_BEGIN_DECLS
 DBusTransport*          _dbus_transport_new_for_socket     (int                fd,
                                                             const DBusString  *server_guid,
                                                             const DBusString  *address);
+DBusTransport*          _dbus_transport_new_for_handed_off_socket (int               fd,
+                                                                   DBusCredentials  *identity,
+                                                                   dbus_bool_t       unix_fd_negotiated,
+                                                                   const DBusString *unread);
 DBusTransport*          _dbus_transport_new_for_tcp_socket (const char        *host,
                                                             const char        *port,
                                                             const char        *family,
                                                             const char        *noncefile,
+                                                            const DBusTcpOptions *options,
+                                                            DBusError         *error);
+dbus_bool_t             _dbus_transport_get_tcp_options    (DBusAddressEntry  *entry,
+                                                            DBusTcpOptions    *options,
+                                                            DBusError         *error);
+dbus_bool_t             _dbus_transport_get_buffer_options (DBusAddressEntry  *entry,
+                                                            DBusTcpOptions    *options,
+                                                            DBusError         *error);
+dbus_bool_t             _dbus_transport_get_unix_options   (DBusAddressEntry  *entry,
+                                                            DBusTcpOptions    *options,
                                                             DBusError         *error);
 DBusTransportOpenResult _dbus_transport_open_socket        (DBusAddressEntry  *entry,
                                                             DBusTransport    **transport_p,
                                                             DBusError         *error);
+dbus_bool_t             _dbus_transport_socket_pipeline_handshake (DBusTransport *transport,
+                                                                   dbus_bool_t    credentials_byte_inline);
+dbus_bool_t             _dbus_transport_new_inproc_pair    (const DBusString  *server_guid,
+                                                            const DBusString  *address,
+                                                            DBusTransport    **client_p,
+                                                            DBusTransport    **server_p,
+                                                            DBusError         *error);
 
 
 
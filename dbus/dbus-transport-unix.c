@@ -47,20 +47,25 @@
  *
  * @param path the path to the domain socket.
  * @param abstract #TRUE to use abstract socket namespace
+ * @param options socket options to apply once connected, or #NULL
  * @param error address where an error can be returned.
  * @returns a new transport, or #NULL on failure.
  */
 DBusTransport*
 _dbus_transport_new_for_domain_socket (const char     *path,
                                        dbus_bool_t     abstract,
+                                       const DBusTcpOptions *options,
                                        DBusError      *error)
 {
   int fd;
   DBusTransport *transport;
   DBusString address;
+  dbus_bool_t seqpacket;
   
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
+  seqpacket = options != NULL && options->seqpacket > 0;
+
   if (!_dbus_string_init (&address))
     {
       dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
@@ -73,19 +78,27 @@ _dbus_transport_new_for_domain_socket (const char     *path,
        !_dbus_string_append (&address, "unix:abstract=")) ||
       (!abstract &&
        !_dbus_string_append (&address, "unix:path=")) ||
-      !_dbus_string_append (&address, path))
+      !_dbus_string_append (&address, path) ||
+      (seqpacket &&
+       !_dbus_string_append (&address, ",seqpacket=true")))
     {
       dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
       goto failed_0;
     }
   
-  fd = _dbus_connect_unix_socket (path, abstract, error);
+  fd = _dbus_connect_unix_socket (path, abstract, seqpacket, error);
   if (fd < 0)
     {
       _DBUS_ASSERT_ERROR_IS_SET (error);
       goto failed_0;
     }
 
+  if (options != NULL && !_dbus_set_tcp_socket_options (fd, options, error))
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      goto failed_1;
+    }
+
   _dbus_verbose ("Successfully connected to unix socket %s\n",
                  path);
 
@@ -95,6 +108,20 @@ _dbus_transport_new_for_domain_socket (const char     *path,
       dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
       goto failed_1;
     }
+
+  /* Whoever is listening on a local socket can see who we are, so
+   * EXTERNAL is as good as certain to work; don't wait to be told.
+   * On a seqpacket socket the credentials byte has to be a packet of
+   * its own, or the server's first read would swallow the AUTH line.
+   */
+  if (!_dbus_transport_socket_pipeline_handshake (transport,
+                                                  !seqpacket &&
+                                                  _dbus_credentials_byte_is_plain ()))
+    {
+      dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+      _dbus_transport_unref (transport);
+      goto failed_0;
+    }
   
   _dbus_string_free (&address);
   
@@ -130,6 +157,7 @@ _dbus_transport_open_platform_specific (DBusAddressEntry  *entry,
       const char *path = dbus_address_entry_get_value (entry, "path");
       const char *tmpdir = dbus_address_entry_get_value (entry, "tmpdir");
       const char *abstract = dbus_address_entry_get_value (entry, "abstract");
+      DBusTcpOptions options;
           
       if (tmpdir != NULL)
         {
@@ -153,12 +181,15 @@ _dbus_transport_open_platform_specific (DBusAddressEntry  *entry,
           return DBUS_TRANSPORT_OPEN_BAD_ADDRESS;
         }
 
+      if (!_dbus_transport_get_unix_options (entry, &options, error))
+        return DBUS_TRANSPORT_OPEN_BAD_ADDRESS;
+
       if (path)
         *transport_p = _dbus_transport_new_for_domain_socket (path, FALSE,
-                                                           error);
+                                                           &options, error);
       else
         *transport_p = _dbus_transport_new_for_domain_socket (abstract, TRUE,
-                                                           error);
+                                                           &options, error);
       if (*transport_p == NULL)
         {
           _DBUS_ASSERT_ERROR_IS_SET (error);
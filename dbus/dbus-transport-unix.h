@@ -29,6 +29,7 @@ DBUS_BEGIN_DECLS
 
 DBusTransport* _dbus_transport_new_for_domain_socket (const char       *path,
                                                       dbus_bool_t       abstract,
+                                                      const DBusTcpOptions *options,
                                                       DBusError        *error);
 
 
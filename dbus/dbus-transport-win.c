@@ -57,6 +57,7 @@ _dbus_transport_open_platform_specific (DBusAddressEntry  *entry,
   const char *port = dbus_address_entry_get_value (entry, "port");
   const char *family = dbus_address_entry_get_value (entry, "family");
   const char *noncefile = dbus_address_entry_get_value (entry, "noncefile");
+  DBusTcpOptions options;
 
   method = dbus_address_entry_get_method (entry);
   _dbus_assert (method != NULL);
@@ -73,7 +74,11 @@ _dbus_transport_open_platform_specific (DBusAddressEntry  *entry,
       return DBUS_TRANSPORT_OPEN_BAD_ADDRESS;
     }
 
-  *transport_p = _dbus_transport_new_for_tcp_socket (host, port, family, noncefile, error);
+  if (!_dbus_transport_get_tcp_options (entry, &options, error))
+    return DBUS_TRANSPORT_OPEN_BAD_ADDRESS;
+
+  *transport_p = _dbus_transport_new_for_tcp_socket (host, port, family, noncefile,
+                                                     &options, error);
   if (*transport_p == NULL)
     {
       _DBUS_ASSERT_ERROR_IS_SET (error);
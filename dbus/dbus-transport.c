@@ -32,10 +32,15 @@
 #include "dbus-credentials.h"
 #include "dbus-message-private.h"
 #include "dbus-marshal-header.h"
+#include "dbus-server-inproc.h"
 #ifdef DBUS_BUILD_TESTS
 #include "dbus-server-debug-pipe.h"
 #endif
 
+/* Allocations made here are profiled as connections */
+#undef DBUS_ALLOC_SUBSYSTEM
+#define DBUS_ALLOC_SUBSYSTEM DBUS_ALLOC_SUBSYSTEM_CONNECTION
+
 /**
  * @defgroup DBusTransport DBusTransport object
  * @ingroup  DBusInternals
@@ -146,7 +151,8 @@ _dbus_transport_init_base (DBusTransport             *transport,
     {
       _dbus_assert (address != NULL);
 
-      if (!_dbus_string_copy_data (address, &address_copy))
+      if (!_dbus_auth_set_resume_key (auth, address) ||
+          !_dbus_string_copy_data (address, &address_copy))
         {
           _dbus_credentials_unref (creds);
           _dbus_counter_unref (counter);
@@ -175,6 +181,10 @@ _dbus_transport_init_base (DBusTransport             *transport,
   transport->windows_user_function = NULL;
   transport->windows_user_data = NULL;
   transport->free_windows_user_data = NULL;
+
+  transport->body_chunk_function = NULL;
+  transport->body_chunk_data = NULL;
+  transport->free_body_chunk_data = NULL;
   
   transport->expected_guid = NULL;
   
@@ -187,6 +197,12 @@ _dbus_transport_init_base (DBusTransport             *transport,
      should be more than enough */
   transport->max_live_messages_unix_fds = 4096;
 
+  /* Socket transports start at the bottom and grow toward the top
+   * while a peer keeps them busy
+   */
+  transport->min_bytes_per_iteration = 2048;
+  transport->max_bytes_per_iteration = 64 * 1024;
+
   /* credentials read from socket if any */
   transport->credentials = creds;
 
@@ -219,6 +235,9 @@ _dbus_transport_finalize_base (DBusTransport *transport)
 
   if (transport->free_windows_user_data != NULL)
     (* transport->free_windows_user_data) (transport->windows_user_data);
+
+  if (transport->free_body_chunk_data != NULL)
+    (* transport->free_body_chunk_data) (transport->body_chunk_data);
   
   _dbus_message_loader_unref (transport->loader);
   _dbus_auth_unref (transport->auth);
@@ -342,7 +361,8 @@ static const struct {
 } open_funcs[] = {
   { _dbus_transport_open_socket },
   { _dbus_transport_open_platform_specific },
-  { _dbus_transport_open_autolaunch }
+  { _dbus_transport_open_autolaunch },
+  { _dbus_transport_open_inproc }
 #ifdef DBUS_BUILD_TESTS
   , { _dbus_transport_open_debug_pipe }
 #endif
@@ -747,6 +767,7 @@ _dbus_transport_get_is_authenticated (DBusTransport *transport)
               if (transport->expected_guid == NULL)
                 {
                   _dbus_verbose ("No memory to complete auth\n");
+                  _dbus_connection_unref_unlocked (transport->connection);
                   return FALSE;
                 }
             }
@@ -1105,6 +1126,10 @@ _dbus_transport_get_dispatch_status (DBusTransport *transport)
   if (!_dbus_message_loader_queue_messages (transport->loader))
     return DBUS_DISPATCH_NEED_MEMORY;
 
+  if (transport->vtable->collect_handed_off != NULL &&
+      !(* transport->vtable->collect_handed_off) (transport))
+    return DBUS_DISPATCH_NEED_MEMORY;
+
   if (_dbus_message_loader_peek_message (transport->loader) != NULL)
     return DBUS_DISPATCH_DATA_REMAINS;
   else
@@ -1156,7 +1181,8 @@ _dbus_transport_queue_messages (DBusTransport *transport)
         }
     }
 
-  if (_dbus_message_loader_get_is_corrupted (transport->loader))
+  if (_dbus_message_loader_get_is_corrupted (transport->loader) ||
+      _dbus_auth_get_decoding_failed (transport->auth))
     {
       _dbus_verbose ("Corrupted message stream, disconnecting\n");
       _dbus_transport_disconnect (transport);
@@ -1178,6 +1204,208 @@ _dbus_transport_set_max_message_size (DBusTransport  *transport,
   _dbus_message_loader_set_max_message_size (transport->loader, size);
 }
 
+/**
+ * Frees memory the transport keeps around only to speed up further
+ * traffic, such as the unused parts of its buffers. See
+ * _dbus_connection_compact().
+ *
+ * @param transport the transport
+ */
+void
+_dbus_transport_compact (DBusTransport *transport)
+{
+  _dbus_message_loader_compact (transport->loader);
+
+  if (transport->vtable->compact)
+    (* transport->vtable->compact) (transport);
+}
+
+/**
+ * Wakes up a thread that is blocked in an iteration of this
+ * transport, so that it notices messages queued since it started
+ * waiting. Does nothing if no thread is blocked, or if the
+ * transport has no way to interrupt its iterations.
+ *
+ * @param transport the transport
+ */
+void
+_dbus_transport_interrupt_iteration (DBusTransport *transport)
+{
+  if (transport->vtable->interrupt_iteration)
+    (* transport->vtable->interrupt_iteration) (transport);
+}
+
+/**
+ * See _dbus_connection_set_iteration_bounds().
+ *
+ * @param transport the transport
+ * @param min_bytes least bytes to read or write per iteration
+ * @param max_bytes most bytes to read or write per iteration
+ */
+void
+_dbus_transport_set_iteration_bounds (DBusTransport *transport,
+                                      int            min_bytes,
+                                      int            max_bytes)
+{
+  _dbus_assert (min_bytes > 0);
+  _dbus_assert (min_bytes <= max_bytes);
+
+  transport->min_bytes_per_iteration = min_bytes;
+  transport->max_bytes_per_iteration = max_bytes;
+}
+
+/**
+ * See _dbus_connection_get_iteration_budgets().
+ *
+ * @param transport the transport
+ * @param read_budget return location for bytes read per iteration
+ * @param write_budget return location for bytes written per iteration
+ */
+void
+_dbus_transport_get_iteration_budgets (DBusTransport *transport,
+                                       int           *read_budget,
+                                       int           *write_budget)
+{
+  if (transport->vtable->get_iteration_budgets)
+    {
+      (* transport->vtable->get_iteration_budgets) (transport, read_budget,
+                                                    write_budget);
+    }
+  else
+    {
+      *read_budget = 0;
+      *write_budget = 0;
+    }
+}
+
+/**
+ * See _dbus_connection_set_trust_message_bodies().
+ *
+ * @param transport the transport
+ * @param trust whether to trust message bodies
+ */
+void
+_dbus_transport_set_trust_message_bodies (DBusTransport  *transport,
+                                          dbus_bool_t     trust)
+{
+  _dbus_message_loader_set_trust_bodies (transport->loader, trust);
+}
+
+/**
+ * See _dbus_connection_set_keep_byte_order().
+ *
+ * @param transport the transport
+ * @param keep whether to leave messages in the sender's byte order
+ */
+void
+_dbus_transport_set_keep_byte_order (DBusTransport  *transport,
+                                     dbus_bool_t     keep)
+{
+  _dbus_message_loader_set_keep_byte_order (transport->loader, keep);
+}
+
+/**
+ * See _dbus_connection_set_reading_paused().
+ *
+ * @param transport the transport
+ * @param paused whether to stop reading
+ */
+void
+_dbus_transport_set_reading_paused (DBusTransport  *transport,
+                                    dbus_bool_t     paused)
+{
+  if (transport->reading_paused == (paused != FALSE))
+    return;
+
+  transport->reading_paused = (paused != FALSE);
+
+  /* the read watch is worked out the same way as for live messages */
+  if (transport->vtable->live_messages_changed)
+    (* transport->vtable->live_messages_changed) (transport);
+}
+
+/**
+ * Gets what another process would need to carry on with a server-side
+ * transport: the socket, and the bytes read from it that aren't a
+ * whole message yet. See _dbus_connection_get_handoff_state().
+ *
+ * @param transport the transport
+ * @param fd_p return location for the socket
+ * @param unread string the unread bytes are appended to
+ * @returns #FALSE if the transport has state that can't be handed
+ *   over, or there is no memory to copy the bytes
+ */
+dbus_bool_t
+_dbus_transport_get_handoff_state (DBusTransport *transport,
+                                   int           *fd_p,
+                                   DBusString    *unread)
+{
+  const DBusString *bytes;
+
+  if (!transport->is_server ||
+      transport->disconnected ||
+      !transport->authenticated ||
+      !transport->unused_bytes_recovered ||
+      transport->vtable->can_hand_off == NULL ||
+      !(* transport->vtable->can_hand_off) (transport))
+    return FALSE;
+
+  bytes = _dbus_message_loader_get_unread (transport->loader);
+  if (bytes == NULL)
+    return FALSE;
+
+  if (!_dbus_transport_get_socket_fd (transport, fd_p))
+    return FALSE;
+
+  return _dbus_string_copy (bytes, 0, unread,
+                            _dbus_string_get_length (unread));
+}
+
+/**
+ * See _dbus_connection_set_dispatch_backlogged().
+ *
+ * @param transport the transport
+ * @param backlogged whether to hold off reading
+ */
+void
+_dbus_transport_set_dispatch_backlogged (DBusTransport  *transport,
+                                         dbus_bool_t     backlogged)
+{
+  if (transport->dispatch_backlogged == (backlogged != FALSE))
+    return;
+
+  transport->dispatch_backlogged = (backlogged != FALSE);
+
+  if (transport->vtable->live_messages_changed)
+    (* transport->vtable->live_messages_changed) (transport);
+}
+
+/**
+ * See _dbus_connection_set_edge_triggered_writes().
+ *
+ * @param transport the transport
+ * @param edge_triggered whether to leave a full socket to the write watch
+ */
+void
+_dbus_transport_set_edge_triggered_writes (DBusTransport  *transport,
+                                           dbus_bool_t     edge_triggered)
+{
+  transport->edge_triggered_writes = (edge_triggered != FALSE);
+}
+
+/**
+ * See dbus_connection_set_lazy_body_validation().
+ *
+ * @param transport the transport
+ * @param lazy whether to validate message bodies on first use
+ */
+void
+_dbus_transport_set_lazy_body_validation (DBusTransport  *transport,
+                                          dbus_bool_t     lazy)
+{
+  _dbus_message_loader_set_lazy_bodies (transport->loader, lazy);
+}
+
 /**
  * See dbus_connection_set_max_message_unix_fds().
  *
@@ -1275,6 +1503,26 @@ _dbus_transport_get_max_received_unix_fds (DBusTransport  *transport)
   return transport->max_live_messages_unix_fds;
 }
 
+/**
+ * See dbus_connection_get_statistics().
+ *
+ * @param transport the transport
+ * @param live_messages_size return location for the size of all
+ *  received messages still alive
+ * @param n_reads return location for the read system calls made
+ * @param n_writes return location for the write system calls made
+ */
+void
+_dbus_transport_get_statistics (DBusTransport *transport,
+                                unsigned long *live_messages_size,
+                                unsigned long *n_reads,
+                                unsigned long *n_writes)
+{
+  *live_messages_size = _dbus_counter_get_size_value (transport->live_messages);
+  *n_reads = transport->n_reads;
+  *n_writes = transport->n_writes;
+}
+
 /**
  * See dbus_connection_get_unix_user().
  *
@@ -1401,6 +1649,51 @@ _dbus_transport_set_unix_user_function (DBusTransport             *transport,
   transport->free_unix_user_data = free_data_function;
 }
 
+static void
+pass_body_chunk (DBusMessage         *message,
+                 const unsigned char *chunk,
+                 int                  len,
+                 dbus_uint32_t        offset,
+                 dbus_uint32_t        total_len,
+                 void                *data)
+{
+  DBusTransport *transport = data;
+
+  (* transport->body_chunk_function) (transport->connection, message,
+                                      chunk, len, offset, total_len,
+                                      transport->body_chunk_data);
+}
+
+/**
+ * See dbus_connection_set_body_chunk_function().
+ *
+ * @param transport the transport
+ * @param function the function, or #NULL
+ * @param data data to pass to the function
+ * @param free_data_function function to free the data
+ * @param old_data the old data to be freed
+ * @param old_free_data_function old free data function to free it with
+ */
+void
+_dbus_transport_set_body_chunk_function (DBusTransport             *transport,
+                                         DBusBodyChunkFunction      function,
+                                         void                      *data,
+                                         DBusFreeFunction           free_data_function,
+                                         void                     **old_data,
+                                         DBusFreeFunction          *old_free_data_function)
+{
+  *old_data = transport->body_chunk_data;
+  *old_free_data_function = transport->free_body_chunk_data;
+
+  transport->body_chunk_function = function;
+  transport->body_chunk_data = data;
+  transport->free_body_chunk_data = free_data_function;
+
+  _dbus_message_loader_set_chunk_function (transport->loader,
+                                           function != NULL ? pass_body_chunk : NULL,
+                                           transport);
+}
+
 /**
  * See dbus_connection_get_windows_user().
  *
@@ -1475,6 +1768,20 @@ _dbus_transport_set_auth_mechanisms (DBusTransport  *transport,
   return _dbus_auth_set_mechanisms (transport->auth, mechanisms);
 }
 
+/**
+ * Sets whether this end offers, or as a server accepts, compressing
+ * the message stream. See _dbus_auth_set_compression_possible().
+ *
+ * @param transport the transport
+ * @param value #TRUE to compress if the other end agrees
+ */
+void
+_dbus_transport_set_compression_possible (DBusTransport *transport,
+                                          dbus_bool_t    value)
+{
+  _dbus_auth_set_compression_possible (transport->auth, value);
+}
+
 /**
  * See dbus_connection_set_allow_anonymous()
  *
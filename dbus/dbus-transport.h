@@ -55,6 +55,29 @@ void               _dbus_transport_do_iteration           (DBusTransport
 DBusDispatchStatus _dbus_transport_get_dispatch_status    (DBusTransport              *transport);
 dbus_bool_t        _dbus_transport_queue_messages         (DBusTransport              *transport);
 
+void               _dbus_transport_set_trust_message_bodies (DBusTransport            *transport,
+                                                            dbus_bool_t               trust);
+void               _dbus_transport_set_keep_byte_order      (DBusTransport            *transport,
+                                                             dbus_bool_t               keep);
+void               _dbus_transport_compact                  (DBusTransport            *transport);
+void               _dbus_transport_interrupt_iteration      (DBusTransport            *transport);
+void               _dbus_transport_set_iteration_bounds     (DBusTransport            *transport,
+                                                             int                       min_bytes,
+                                                             int                       max_bytes);
+void               _dbus_transport_get_iteration_budgets    (DBusTransport            *transport,
+                                                             int                      *read_budget,
+                                                             int                      *write_budget);
+void               _dbus_transport_set_lazy_body_validation (DBusTransport            *transport,
+                                                            dbus_bool_t               lazy);
+void               _dbus_transport_set_reading_paused       (DBusTransport            *transport,
+                                                            dbus_bool_t               paused);
+dbus_bool_t        _dbus_transport_get_handoff_state        (DBusTransport            *transport,
+                                                             int                      *fd_p,
+                                                             DBusString               *unread);
+void               _dbus_transport_set_dispatch_backlogged  (DBusTransport            *transport,
+                                                            dbus_bool_t               backlogged);
+void               _dbus_transport_set_edge_triggered_writes (DBusTransport           *transport,
+                                                             dbus_bool_t              edge_triggered);
 void               _dbus_transport_set_max_message_size   (DBusTransport              *transport,
                                                            long                        size);
 long               _dbus_transport_get_max_message_size   (DBusTransport              *transport);
@@ -68,6 +91,10 @@ long               _dbus_transport_get_max_message_unix_fds (DBusTransport
 void               _dbus_transport_set_max_received_unix_fds(DBusTransport              *transport,
                                                              long                        n);
 long               _dbus_transport_get_max_received_unix_fds(DBusTransport              *transport);
+void               _dbus_transport_get_statistics         (DBusTransport              *transport,
+                                                           unsigned long              *live_messages_size,
+                                                           unsigned long              *n_reads,
+                                                           unsigned long              *n_writes);
 
 dbus_bool_t        _dbus_transport_get_socket_fd          (DBusTransport              *transport,
                                                            int                        *fd_p);
@@ -84,6 +111,12 @@ void               _dbus_transport_set_unix_user_function (DBusTransport
                                                            DBusFreeFunction            free_data_function,
                                                            void                      **old_data,
                                                            DBusFreeFunction           *old_free_data_function);
+void               _dbus_transport_set_body_chunk_function (DBusTransport             *transport,
+                                                            DBusBodyChunkFunction      function,
+                                                            void                      *data,
+                                                            DBusFreeFunction           free_data_function,
+                                                            void                     **old_data,
+                                                            DBusFreeFunction          *old_free_data_function);
 dbus_bool_t        _dbus_transport_get_windows_user       (DBusTransport              *transport,
                                                            char                      **windows_sid_p);
 void               _dbus_transport_set_windows_user_function (DBusTransport              *transport,
@@ -94,6 +127,8 @@ void               _dbus_transport_set_windows_user_function (DBusTransport
                                                               DBusFreeFunction           *old_free_data_function);
 dbus_bool_t        _dbus_transport_set_auth_mechanisms    (DBusTransport              *transport,
                                                            const char                **mechanisms);
+void               _dbus_transport_set_compression_possible (DBusTransport            *transport,
+                                                           dbus_bool_t                 value);
 void               _dbus_transport_set_allow_anonymous    (DBusTransport              *transport,
                                                            dbus_bool_t                 value);
 
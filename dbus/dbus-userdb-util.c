@@ -212,6 +212,8 @@ _dbus_user_database_lookup_group (DBusUserDatabase *db,
                                   DBusError        *error)
 {
   DBusGroupInfo *info;
+  DBusCachedGroupInfo *cached;
+  long now;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
@@ -230,6 +232,21 @@ _dbus_user_database_lookup_group (DBusUserDatabase *db,
   else
     info = _dbus_hash_table_lookup_string (db->groups_by_name,
                                            _dbus_string_get_const_data (groupname));
+
+  if (info &&
+      _dbus_user_database_is_expired (((DBusCachedGroupInfo *) info)->expires,
+                                      DBUS_USERDB_CACHE_TTL_SECONDS))
+    {
+      _dbus_verbose ("Cached GID "DBUS_GID_FORMAT" information has expired\n",
+                     info->gid);
+
+      if (_dbus_hash_table_lookup_string (db->groups_by_name,
+                                          info->groupname) == info)
+        _dbus_hash_table_remove_string (db->groups_by_name, info->groupname);
+      _dbus_hash_table_remove_uintptr (db->groups, info->gid);
+      info = NULL;
+    }
+
   if (info)
     {
       _dbus_verbose ("Using cache for GID "DBUS_GID_FORMAT" information\n",
@@ -248,12 +265,13 @@ _dbus_user_database_lookup_group (DBusUserDatabase *db,
 	_dbus_verbose ("No cache for groupname \"%s\"\n",
 		       _dbus_string_get_const_data (groupname));
       
-      info = dbus_new0 (DBusGroupInfo, 1);
-      if (info == NULL)
+      cached = dbus_new0 (DBusCachedGroupInfo, 1);
+      if (cached == NULL)
         {
           dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
           return NULL;
         }
+      info = &cached->info;
 
       if (gid != DBUS_GID_UNSET)
         {
@@ -274,6 +292,9 @@ _dbus_user_database_lookup_group (DBusUserDatabase *db,
             }
         }
 
+      _dbus_get_current_time (&now, NULL);
+      cached->expires = now + DBUS_USERDB_CACHE_TTL_SECONDS;
+
       /* don't use these past here */
       gid = DBUS_GID_UNSET;
       groupname = NULL;
@@ -438,6 +459,61 @@ _dbus_userdb_test (const char *test_data_dir)
  
   dbus_free (group_ids);
 
+#ifdef DBUS_ENABLE_USERDB_CACHE
+  {
+    DBusUserDatabase *db;
+    DBusCachedUserInfo *cached;
+    DBusMissingUser *missing;
+    const DBusUserInfo *info;
+    dbus_uid_t missing_uid;
+    DBusError error = DBUS_ERROR_INIT;
+
+    _dbus_user_database_lock_system ();
+
+    db = _dbus_user_database_get_system ();
+    if (db == NULL)
+      _dbus_assert_not_reached ("no memory");
+
+    /* An expired entry is looked up again */
+    if (!_dbus_user_database_get_uid (db, uid, &info, NULL))
+      _dbus_assert_not_reached ("didn't get uid");
+    cached = (DBusCachedUserInfo *) info;
+    cached->expires = 0;
+
+    if (!_dbus_user_database_get_uid (db, uid, &info, NULL))
+      _dbus_assert_not_reached ("didn't get uid");
+    cached = (DBusCachedUserInfo *) info;
+    _dbus_assert (!_dbus_user_database_is_expired (cached->expires,
+                                                   DBUS_USERDB_CACHE_TTL_SECONDS));
+
+    /* A user that doesn't exist is remembered as such */
+    missing_uid = 0x7ffffff0;
+    while (_dbus_user_database_get_uid (db, missing_uid, &info, NULL))
+      ++missing_uid;
+
+    missing = _dbus_hash_table_lookup_uintptr (db->missing_users, missing_uid);
+    _dbus_assert (missing != NULL);
+
+    if (_dbus_user_database_get_uid (db, missing_uid, &info, &error))
+      _dbus_assert_not_reached ("missing user was found");
+    _dbus_assert (dbus_error_is_set (&error));
+    _dbus_assert (strcmp (error.message, missing->error_message) == 0);
+    dbus_error_free (&error);
+
+    /* ... but only for a while */
+    missing->expires = 0;
+    if (_dbus_user_database_get_uid (db, missing_uid, &info, NULL))
+      _dbus_assert_not_reached ("missing user was found");
+
+    missing = _dbus_hash_table_lookup_uintptr (db->missing_users, missing_uid);
+    _dbus_assert (missing != NULL);
+    _dbus_assert (!_dbus_user_database_is_expired (missing->expires,
+                                                   DBUS_USERDB_MISSING_TTL_SECONDS));
+
+    _dbus_user_database_unlock_system ();
+  }
+#endif /* DBUS_ENABLE_USERDB_CACHE */
+
   return TRUE;
 }
 #endif /* DBUS_BUILD_TESTS */
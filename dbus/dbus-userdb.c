@@ -91,6 +91,86 @@ _dbus_group_info_free (DBusGroupInfo    *info)
   dbus_free (info->groupname);
 }
 
+static void
+free_missing_user (DBusMissingUser *missing)
+{
+  if (missing == NULL) /* hash table will pass NULL */
+    return;
+
+  dbus_free (missing->username);
+  dbus_free (missing->error_name);
+  dbus_free (missing->error_message);
+  dbus_free (missing);
+}
+
+/**
+ * Checks whether a cache entry should be looked up again. An entry
+ * further in the future than its TTL allows is also treated as
+ * expired, so that setting the clock back can't keep it alive.
+ *
+ * @param expires when the entry expires
+ * @param ttl how long the entry was cached for
+ * @returns #TRUE if the entry should no longer be used
+ */
+dbus_bool_t
+_dbus_user_database_is_expired (long expires,
+                                long ttl)
+{
+  long now;
+
+  _dbus_get_current_time (&now, NULL);
+
+  return now >= expires || expires - now > ttl;
+}
+
+#ifdef DBUS_ENABLE_USERDB_CACHE
+/* Remembers that looking up uid or username failed with the given
+ * error. This is only an optimization, so running out of memory
+ * just means the user will be looked up again next time.
+ */
+static void
+remember_missing_user (DBusUserDatabase *db,
+                       dbus_uid_t        uid,
+                       const DBusString *username,
+                       const DBusError  *error)
+{
+  DBusMissingUser *missing;
+  long now;
+
+  missing = dbus_new0 (DBusMissingUser, 1);
+  if (missing == NULL)
+    return;
+
+  _dbus_get_current_time (&now, NULL);
+  missing->expires = now + DBUS_USERDB_MISSING_TTL_SECONDS;
+
+  missing->error_name = _dbus_strdup (error->name);
+  missing->error_message = _dbus_strdup (error->message);
+  if (missing->error_name == NULL || missing->error_message == NULL)
+    goto failed;
+
+  if (uid != DBUS_UID_UNSET)
+    {
+      if (!_dbus_hash_table_insert_uintptr (db->missing_users, uid, missing))
+        goto failed;
+    }
+  else
+    {
+      if (!_dbus_string_copy_data (username, &missing->username))
+        goto failed;
+
+      if (!_dbus_hash_table_insert_string (db->missing_users_by_name,
+                                           missing->username, missing))
+        goto failed;
+    }
+
+  return;
+
+ failed:
+  free_missing_user (missing);
+}
+#endif /* DBUS_ENABLE_USERDB_CACHE */
+
 /**
  * Checks if a given string is actually a number 
  * and converts it if it is 
@@ -131,6 +211,9 @@ _dbus_user_database_lookup (DBusUserDatabase *db,
                             DBusError        *error)
 {
   DBusUserInfo *info;
+  DBusCachedUserInfo *cached;
+  DBusError tmp_error;
+  long now;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
   _dbus_assert (uid != DBUS_UID_UNSET || username != NULL);
@@ -150,6 +233,54 @@ _dbus_user_database_lookup (DBusUserDatabase *db,
   else
     info = _dbus_hash_table_lookup_string (db->users_by_name, _dbus_string_get_const_data (username));
 
+  if (info &&
+      _dbus_user_database_is_expired (((DBusCachedUserInfo *) info)->expires,
+                                      DBUS_USERDB_CACHE_TTL_SECONDS))
+    {
+      _dbus_verbose ("Cached UID "DBUS_UID_FORMAT" information has expired\n",
+                     info->uid);
+
+      /* Callers copy what they need before dropping the database
+       * lock, so nothing can still be using the old entry.
+       */
+      if (_dbus_hash_table_lookup_string (db->users_by_name,
+                                          info->username) == info)
+        _dbus_hash_table_remove_string (db->users_by_name, info->username);
+      _dbus_hash_table_remove_uintptr (db->users, info->uid);
+      info = NULL;
+    }
+
+  if (info == NULL)
+    {
+      DBusMissingUser *missing;
+
+      if (uid != DBUS_UID_UNSET)
+        missing = _dbus_hash_table_lookup_uintptr (db->missing_users, uid);
+      else
+        missing = _dbus_hash_table_lookup_string (db->missing_users_by_name,
+                                                  _dbus_string_get_const_data (username));
+
+      if (missing != NULL &&
+          !_dbus_user_database_is_expired (missing->expires,
+                                           DBUS_USERDB_MISSING_TTL_SECONDS))
+        {
+          _dbus_verbose ("Using cached failure to look up user: %s\n",
+                         missing->error_message);
+          dbus_set_error (error, missing->error_name, "%s",
+                          missing->error_message);
+          return NULL;
+        }
+
+      if (missing != NULL)
+        {
+          if (uid != DBUS_UID_UNSET)
+            _dbus_hash_table_remove_uintptr (db->missing_users, uid);
+          else
+            _dbus_hash_table_remove_string (db->missing_users_by_name,
+                                            _dbus_string_get_const_data (username));
+        }
+    }
+
   if (info)
     {
       _dbus_verbose ("Using cache for UID "DBUS_UID_FORMAT" information\n",
@@ -168,32 +299,31 @@ _dbus_user_database_lookup (DBusUserDatabase *db,
 	_dbus_verbose ("No cache for user \"%s\"\n",
 		       _dbus_string_get_const_data (username));
       
-      info = dbus_new0 (DBusUserInfo, 1);
-      if (info == NULL)
+      cached = dbus_new0 (DBusCachedUserInfo, 1);
+      if (cached == NULL)
         {
           dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
           return NULL;
         }
+      info = &cached->info;
+
+      /* callers may not want the error, but we need it to cache failures */
+      dbus_error_init (&tmp_error);
 
       if (uid != DBUS_UID_UNSET)
         {
-          if (!_dbus_user_info_fill_uid (info, uid, error))
-            {
-              _DBUS_ASSERT_ERROR_IS_SET (error);
-              _dbus_user_info_free_allocated (info);
-              return NULL;
-            }
+          if (!_dbus_user_info_fill_uid (info, uid, &tmp_error))
+            goto failed;
         }
       else
         {
-          if (!_dbus_user_info_fill (info, username, error))
-            {
-              _DBUS_ASSERT_ERROR_IS_SET (error);
-              _dbus_user_info_free_allocated (info);
-              return NULL;
-            }
+          if (!_dbus_user_info_fill (info, username, &tmp_error))
+            goto failed;
         }
 
+      _dbus_get_current_time (&now, NULL);
+      cached->expires = now + DBUS_USERDB_CACHE_TTL_SECONDS;
+
       /* be sure we don't use these after here */
       uid = DBUS_UID_UNSET;
       username = NULL;
@@ -216,6 +346,16 @@ _dbus_user_database_lookup (DBusUserDatabase *db,
         }
       
       return info;
+
+    failed:
+      _DBUS_ASSERT_ERROR_IS_SET (&tmp_error);
+#ifdef DBUS_ENABLE_USERDB_CACHE
+      if (!dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY))
+        remember_missing_user (db, uid, username, &tmp_error);
+#endif
+      dbus_move_error (&tmp_error, error);
+      _dbus_user_info_free_allocated (info);
+      return NULL;
     }
 }
 
@@ -559,6 +699,16 @@ _dbus_user_database_new (void)
                                              NULL, NULL);
   if (db->groups_by_name == NULL)
     goto failed;
+
+  db->missing_users = _dbus_hash_table_new (DBUS_HASH_UINTPTR,
+                                            NULL, (DBusFreeFunction) free_missing_user);
+  if (db->missing_users == NULL)
+    goto failed;
+
+  db->missing_users_by_name = _dbus_hash_table_new (DBUS_HASH_STRING,
+                                                    NULL, (DBusFreeFunction) free_missing_user);
+  if (db->missing_users_by_name == NULL)
+    goto failed;
   
   return db;
   
@@ -577,6 +727,8 @@ _dbus_user_database_flush (DBusUserDatabase *db)
   _dbus_hash_table_remove_all(db->groups_by_name);
   _dbus_hash_table_remove_all(db->users);
   _dbus_hash_table_remove_all(db->groups);
+  _dbus_hash_table_remove_all(db->missing_users);
+  _dbus_hash_table_remove_all(db->missing_users_by_name);
 }
 
 #ifdef DBUS_BUILD_TESTS
@@ -619,6 +771,12 @@ _dbus_user_database_unref (DBusUserDatabase  *db)
 
       if (db->groups_by_name)
         _dbus_hash_table_unref (db->groups_by_name);
+
+      if (db->missing_users)
+        _dbus_hash_table_unref (db->missing_users);
+
+      if (db->missing_users_by_name)
+        _dbus_hash_table_unref (db->missing_users_by_name);
       
       dbus_free (db);
     }
@@ -48,9 +48,48 @@ struct DBusUserDatabase
   DBusHashTable *groups; /**< Groups in the database by GID */
   DBusHashTable *users_by_name; /**< Users in the database by name */
   DBusHashTable *groups_by_name; /**< Groups in the database by name */
+  DBusHashTable *missing_users; /**< Users known not to exist, by UID */
+  DBusHashTable *missing_users_by_name; /**< Users known not to exist, by name */
 
 };
 
+/** How long a user or group is cached before it is looked up again */
+#define DBUS_USERDB_CACHE_TTL_SECONDS (60 * 10)
+/** How long a failed user lookup is remembered */
+#define DBUS_USERDB_MISSING_TTL_SECONDS 60
+
+/**
+ * A user in the database; info comes first, so the block can be
+ * freed with _dbus_user_info_free_allocated().
+ */
+typedef struct
+{
+  DBusUserInfo info; /**< The user */
+  long expires;      /**< Time after which the user is looked up again */
+} DBusCachedUserInfo;
+
+/**
+ * A group in the database; info comes first, so the block can be
+ * freed with _dbus_group_info_free_allocated().
+ */
+typedef struct
+{
+  DBusGroupInfo info; /**< The group */
+  long expires;       /**< Time after which the group is looked up again */
+} DBusCachedGroupInfo;
+
+/**
+ * A user lookup that failed, remembered so that the same unknown
+ * user doesn't hit the system password database every time.
+ */
+typedef struct
+{
+  char *username;      /**< Name looked up, or #NULL if looked up by UID */
+  char *error_name;    /**< Name of the error the lookup failed with */
+  char *error_message; /**< Message of the error the lookup failed with */
+  long expires;        /**< Time after which the user is looked up again */
+} DBusMissingUser;
+
 
 DBusUserDatabase* _dbus_user_database_new           (void);
 DBusUserDatabase* _dbus_user_database_ref           (DBusUserDatabase     *db);
@@ -83,6 +122,8 @@ DBusGroupInfo* _dbus_user_database_lookup_group (DBusUserDatabase *db,
                                                  DBusError        *error);
 void           _dbus_user_info_free_allocated   (DBusUserInfo     *info);
 void           _dbus_group_info_free_allocated  (DBusGroupInfo    *info);
+dbus_bool_t    _dbus_user_database_is_expired   (long              expires,
+                                                 long              ttl);
 #endif /* DBUS_USERDB_INCLUDES_PRIVATE */
 
 DBusUserDatabase* _dbus_user_database_get_system    (void);
@@ -50,6 +50,7 @@ struct DBusWatch
   void *data;                          /**< Application data. */
   DBusFreeFunction free_data_function; /**< Free the application data. */
   unsigned int enabled : 1;            /**< Whether it's enabled. */
+  unsigned int priority : 1;           /**< Whether to handle it before others. */
 };
 
 dbus_bool_t
@@ -58,6 +59,19 @@ _dbus_watch_get_enabled (DBusWatch *watch)
   return watch->enabled;
 }
 
+/**
+ * Gets whether a main loop should handle this watch before watches
+ * that don't have this set, see _dbus_watch_list_set_priority().
+ *
+ * @param watch the watch
+ * @returns #TRUE if the watch has priority
+ */
+dbus_bool_t
+_dbus_watch_get_priority (DBusWatch *watch)
+{
+  return watch->priority;
+}
+
 /**
  * Creates a new DBusWatch. Used to add a file descriptor to be polled
  * by a main loop.
@@ -203,6 +217,8 @@ struct DBusWatchList
   DBusWatchToggledFunction watch_toggled_function; /**< Callback on toggling enablement */
   void *watch_data;                           /**< Data for watch callbacks */
   DBusFreeFunction watch_free_data_function;  /**< Free function for watch callback data */
+
+  unsigned int priority : 1;                  /**< Whether watches added have priority */
 };
 
 /**
@@ -362,6 +378,7 @@ _dbus_watch_list_add_watch (DBusWatchList *watch_list,
     return FALSE;
   
   _dbus_watch_ref (watch);
+  watch->priority = watch_list->priority;
 
   if (watch_list->add_watch_function != NULL)
     {
@@ -436,6 +453,43 @@ _dbus_watch_list_toggle_watch (DBusWatchList           *watch_list,
     }
 }
 
+/**
+ * Sets whether the watches in the list, and those added to it later,
+ * have priority over other watches in a main loop that honours it,
+ * such as the one in dbus-mainloop.c. The application's
+ * DBusWatchToggledFunction is invoked for each watch that changes,
+ * as for a change in its enabled state, so the main loop notices.
+ *
+ * @param watch_list the watch list.
+ * @param priority #TRUE to give the watches priority
+ */
+void
+_dbus_watch_list_set_priority (DBusWatchList *watch_list,
+                               dbus_bool_t    priority)
+{
+  DBusList *link;
+
+  priority = !!priority;
+
+  if (priority == watch_list->priority)
+    return;
+
+  watch_list->priority = priority;
+
+  for (link = _dbus_list_get_first_link (&watch_list->watches);
+       link != NULL;
+       link = _dbus_list_get_next_link (&watch_list->watches, link))
+    {
+      DBusWatch *watch = link->data;
+
+      watch->priority = priority;
+
+      if (watch_list->watch_toggled_function != NULL)
+        (* watch_list->watch_toggled_function) (watch,
+                                                watch_list->watch_data);
+    }
+}
+
 /**
  * Sets the handler for the watch.
  *
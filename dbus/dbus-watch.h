@@ -75,6 +75,9 @@ void           _dbus_watch_list_toggle_watch  (DBusWatchList           *watch_li
                                                DBusWatch               *watch,
                                                dbus_bool_t              enabled);
 dbus_bool_t    _dbus_watch_get_enabled        (DBusWatch              *watch);
+void           _dbus_watch_list_set_priority  (DBusWatchList           *watch_list,
+                                               dbus_bool_t              priority);
+dbus_bool_t    _dbus_watch_get_priority       (DBusWatch               *watch);
 
 /** @} */
 
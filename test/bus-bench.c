@@ -0,0 +1,814 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* bus-bench.c  Message bus throughput and latency benchmark
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* bus-bench starts a private dbus-daemon (or uses an existing bus),
+ * forks client processes that all start sending at the same moment,
+ * and prints one line of results:
+ *
+ *   mode=ping clients=4 listeners=0 messages=40000 payload=0 seconds=1.52
+ *   msgs_per_sec=26315 p50_usec=140 p99_usec=420 p999_usec=1210
+ *
+ * (on one line). The modes are
+ *
+ *   ping       each client makes blocking method calls to an echo service
+ *   broadcast  each client emits signals that every listener has a
+ *              match rule for; latency is measured at the listeners
+ *   payload    ping, but carrying a 1 MiB byte array by default
+ *
+ * Clients are processes rather than threads so that neither libdbus
+ * locking nor one client's dispatching skews another's numbers.
+ */
+
+#include <config.h>
+#include "test-utils.h"
+
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define BENCH_SERVICE "org.freedesktop.DBus.Benchmark"
+#define BENCH_PATH "/org/freedesktop/DBus/Benchmark"
+#define BENCH_INTERFACE "org.freedesktop.DBus.Benchmark"
+
+/* a listener that hears nothing for this long gives up */
+#define LISTENER_IDLE_TIMEOUT_MSEC 10000
+
+typedef enum
+{
+  MODE_PING,
+  MODE_BROADCAST,
+  MODE_PAYLOAD
+} BenchMode;
+
+typedef struct
+{
+  BenchMode   mode;
+  const char *address;
+  int         n_clients;
+  int         n_listeners;
+  int         n_messages;   /**< per client */
+  int         payload_size;
+} BenchOptions;
+
+/* What each child sends back to the parent when it's done */
+typedef struct
+{
+  long start_usec;
+  long end_usec;
+  int  n_samples;
+} ChildResult;
+
+typedef struct
+{
+  pid_t pid;
+  int   result_fd;
+} Child;
+
+static void
+die (const char *message)
+{
+  fprintf (stderr, "*** bus-bench: %s\n", message);
+  exit (1);
+}
+
+static long
+now_usec (void)
+{
+  long tv_sec, tv_usec;
+
+  _dbus_get_current_time (&tv_sec, &tv_usec);
+  return tv_sec * 1000000 + tv_usec;
+}
+
+static void
+write_all (int         fd,
+           const void *data,
+           size_t      len)
+{
+  const char *p = data;
+
+  while (len > 0)
+    {
+      ssize_t n = write (fd, p, len);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        die ("write to parent failed");
+
+      p += n;
+      len -= n;
+    }
+}
+
+static dbus_bool_t
+read_all (int     fd,
+          void   *data,
+          size_t  len)
+{
+  char *p = data;
+
+  while (len > 0)
+    {
+      ssize_t n = read (fd, p, len);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return FALSE;
+
+      p += n;
+      len -= n;
+    }
+
+  return TRUE;
+}
+
+static DBusConnection *
+connect_to_bus (const char *address)
+{
+  DBusConnection *connection;
+  DBusError error;
+
+  dbus_error_init (&error);
+
+  connection = dbus_connection_open_private (address, &error);
+  if (connection == NULL || !dbus_bus_register (connection, &error))
+    {
+      fprintf (stderr, "*** bus-bench: failed to connect to %s: %s\n",
+               address, error.message);
+      exit (1);
+    }
+
+  dbus_connection_set_exit_on_disconnect (connection, FALSE);
+
+  return connection;
+}
+
+/* Tells the parent this child is ready, then waits for the parent to
+ * close go_fd, so that all clients start at once.
+ */
+static void
+wait_for_go (int ready_fd,
+             int go_fd)
+{
+  char c = 'r';
+
+  write_all (ready_fd, &c, 1);
+  close (ready_fd);
+
+  while (read (go_fd, &c, 1) < 0 && errno == EINTR)
+    ;
+  close (go_fd);
+}
+
+static DBusMessage *
+new_payload_message (DBusMessage   *message,
+                     unsigned char *payload,
+                     int            payload_size)
+{
+  dbus_int64_t stamp;
+
+  if (message == NULL)
+    die ("no memory");
+
+  stamp = now_usec ();
+
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_INT64, &stamp,
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE,
+                                 &payload, payload_size,
+                                 DBUS_TYPE_INVALID))
+    die ("no memory");
+
+  return message;
+}
+
+/* -- echo service ------------------------------------------------------ */
+
+static DBusHandlerResult
+echo_message_function (DBusConnection *connection,
+                       DBusMessage    *message,
+                       void           *user_data)
+{
+  DBusMessage *reply;
+  DBusMessageIter iter, reply_iter;
+
+  if (!dbus_message_is_method_call (message, BENCH_INTERFACE, "Echo"))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  reply = dbus_message_new_method_return (message);
+  if (reply == NULL)
+    die ("no memory");
+
+  /* hand the stamp and payload straight back */
+  dbus_message_iter_init (message, &iter);
+  dbus_message_iter_init_append (reply, &reply_iter);
+  if (dbus_message_iter_get_arg_type (&iter) != DBUS_TYPE_INVALID)
+    {
+      dbus_int64_t stamp;
+      DBusMessageIter array_iter, reply_array_iter;
+      const unsigned char *bytes;
+      int n_bytes;
+
+      dbus_message_iter_get_basic (&iter, &stamp);
+      dbus_message_iter_next (&iter);
+      dbus_message_iter_recurse (&iter, &array_iter);
+      dbus_message_iter_get_fixed_array (&array_iter, &bytes, &n_bytes);
+
+      if (!dbus_message_iter_append_basic (&reply_iter, DBUS_TYPE_INT64,
+                                           &stamp) ||
+          !dbus_message_iter_open_container (&reply_iter, DBUS_TYPE_ARRAY,
+                                             DBUS_TYPE_BYTE_AS_STRING,
+                                             &reply_array_iter) ||
+          !dbus_message_iter_append_fixed_array (&reply_array_iter,
+                                                 DBUS_TYPE_BYTE, &bytes,
+                                                 n_bytes) ||
+          !dbus_message_iter_close_container (&reply_iter, &reply_array_iter))
+        die ("no memory");
+    }
+
+  if (!dbus_connection_send (connection, reply, NULL))
+    die ("no memory");
+  dbus_message_unref (reply);
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static DBusObjectPathVTable echo_vtable = {
+  NULL,
+  echo_message_function,
+  NULL,
+};
+
+static DBusHandlerResult
+quit_on_disconnect_filter (DBusConnection *connection,
+                           DBusMessage    *message,
+                           void           *user_data)
+{
+  if (dbus_message_is_signal (message, DBUS_INTERFACE_LOCAL, "Disconnected"))
+    {
+      _dbus_loop_quit (user_data);
+      return DBUS_HANDLER_RESULT_HANDLED;
+    }
+
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/* Runs until the parent kills it or the bus goes away */
+static void
+run_echo_service (const BenchOptions *options,
+                  int                 ready_fd)
+{
+  DBusConnection *connection;
+  DBusLoop *loop;
+  DBusError error;
+  char c = 'r';
+
+  connection = connect_to_bus (options->address);
+
+  loop = _dbus_loop_new ();
+  if (loop == NULL || !test_connection_setup (loop, connection))
+    die ("no memory");
+
+  if (!dbus_connection_add_filter (connection, quit_on_disconnect_filter,
+                                   loop, NULL) ||
+      !dbus_connection_register_object_path (connection, BENCH_PATH,
+                                             &echo_vtable, NULL))
+    die ("no memory");
+
+  dbus_error_init (&error);
+  if (dbus_bus_request_name (connection, BENCH_SERVICE,
+                             DBUS_NAME_FLAG_DO_NOT_QUEUE, &error) !=
+      DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+    die ("could not own " BENCH_SERVICE);
+
+  write_all (ready_fd, &c, 1);
+  close (ready_fd);
+
+  _dbus_loop_run (loop);
+
+  test_connection_shutdown (loop, connection);
+  dbus_connection_close (connection);
+  dbus_connection_unref (connection);
+  _dbus_loop_unref (loop);
+}
+
+/* -- clients ----------------------------------------------------------- */
+
+static void
+send_results (int               result_fd,
+              const ChildResult *result,
+              const dbus_uint32_t *samples)
+{
+  write_all (result_fd, result, sizeof (*result));
+  write_all (result_fd, samples, result->n_samples * sizeof (dbus_uint32_t));
+  close (result_fd);
+}
+
+static void
+run_caller (const BenchOptions *options,
+            int                 ready_fd,
+            int                 go_fd,
+            int                 result_fd)
+{
+  DBusConnection *connection;
+  DBusError error;
+  ChildResult result;
+  dbus_uint32_t *samples;
+  unsigned char *payload;
+  int i;
+
+  connection = connect_to_bus (options->address);
+
+  samples = dbus_new (dbus_uint32_t, options->n_messages);
+  payload = dbus_malloc0 (MAX (options->payload_size, 1));
+  if (samples == NULL || payload == NULL)
+    die ("no memory");
+
+  dbus_error_init (&error);
+
+  wait_for_go (ready_fd, go_fd);
+
+  result.start_usec = now_usec ();
+
+  for (i = 0; i < options->n_messages; i++)
+    {
+      DBusMessage *message, *reply;
+      long sent;
+
+      message = new_payload_message (dbus_message_new_method_call (BENCH_SERVICE,
+                                                                   BENCH_PATH,
+                                                                   BENCH_INTERFACE,
+                                                                   "Echo"),
+                                     payload, options->payload_size);
+
+      sent = now_usec ();
+      reply = dbus_connection_send_with_reply_and_block (connection, message,
+                                                         -1, &error);
+      if (reply == NULL)
+        {
+          fprintf (stderr, "*** bus-bench: Echo failed: %s\n", error.message);
+          exit (1);
+        }
+      samples[i] = now_usec () - sent;
+
+      dbus_message_unref (reply);
+      dbus_message_unref (message);
+    }
+
+  result.end_usec = now_usec ();
+  result.n_samples = options->n_messages;
+
+  send_results (result_fd, &result, samples);
+
+  dbus_connection_close (connection);
+  dbus_connection_unref (connection);
+  dbus_free (samples);
+  dbus_free (payload);
+}
+
+static void
+run_broadcaster (const BenchOptions *options,
+                 int                 ready_fd,
+                 int                 go_fd,
+                 int                 result_fd)
+{
+  DBusConnection *connection;
+  ChildResult result;
+  unsigned char *payload;
+  int i;
+
+  connection = connect_to_bus (options->address);
+
+  payload = dbus_malloc0 (MAX (options->payload_size, 1));
+  if (payload == NULL)
+    die ("no memory");
+
+  wait_for_go (ready_fd, go_fd);
+
+  result.start_usec = now_usec ();
+
+  for (i = 0; i < options->n_messages; i++)
+    {
+      DBusMessage *message;
+
+      message = new_payload_message (dbus_message_new_signal (BENCH_PATH,
+                                                              BENCH_INTERFACE,
+                                                              "Tick"),
+                                     payload, options->payload_size);
+
+      if (!dbus_connection_send (connection, message, NULL))
+        die ("no memory");
+      dbus_message_unref (message);
+    }
+
+  dbus_connection_flush (connection);
+
+  /* the listeners' samples are the ones that matter */
+  result.end_usec = now_usec ();
+  result.n_samples = 0;
+
+  send_results (result_fd, &result, NULL);
+
+  dbus_connection_close (connection);
+  dbus_connection_unref (connection);
+  dbus_free (payload);
+}
+
+typedef struct
+{
+  dbus_uint32_t *samples;
+  int            n_samples;
+  int            n_expected;
+  long           end_usec;
+} ListenerData;
+
+static DBusHandlerResult
+listener_filter (DBusConnection *connection,
+                 DBusMessage    *message,
+                 void           *user_data)
+{
+  ListenerData *data = user_data;
+  dbus_int64_t stamp;
+  DBusMessageIter iter;
+
+  if (!dbus_message_is_signal (message, BENCH_INTERFACE, "Tick"))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  data->end_usec = now_usec ();
+
+  dbus_message_iter_init (message, &iter);
+  dbus_message_iter_get_basic (&iter, &stamp);
+
+  if (data->n_samples < data->n_expected)
+    data->samples[data->n_samples++] = data->end_usec - stamp;
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static void
+run_listener (const BenchOptions *options,
+              int                 ready_fd,
+              int                 go_fd,
+              int                 result_fd)
+{
+  DBusConnection *connection;
+  DBusError error;
+  ListenerData data;
+  ChildResult result;
+  long idle_since;
+
+  connection = connect_to_bus (options->address);
+
+  data.n_expected = options->n_clients * options->n_messages;
+  data.n_samples = 0;
+  data.samples = dbus_new (dbus_uint32_t, data.n_expected);
+  if (data.samples == NULL)
+    die ("no memory");
+
+  if (!dbus_connection_add_filter (connection, listener_filter, &data, NULL))
+    die ("no memory");
+
+  dbus_error_init (&error);
+  dbus_bus_add_match (connection,
+                      "type='signal',interface='" BENCH_INTERFACE "'",
+                      &error);
+  if (dbus_error_is_set (&error))
+    die ("could not add match rule");
+
+  wait_for_go (ready_fd, go_fd);
+
+  result.start_usec = now_usec ();
+  data.end_usec = result.start_usec;
+
+  idle_since = now_usec ();
+  while (data.n_samples < data.n_expected &&
+         now_usec () - idle_since < LISTENER_IDLE_TIMEOUT_MSEC * 1000)
+    {
+      int before = data.n_samples;
+
+      if (!dbus_connection_read_write_dispatch (connection, 100))
+        break;
+
+      if (data.n_samples != before)
+        idle_since = now_usec ();
+    }
+
+  if (data.n_samples < data.n_expected)
+    fprintf (stderr, "*** bus-bench: listener got %d of %d signals\n",
+             data.n_samples, data.n_expected);
+
+  result.end_usec = data.end_usec;
+  result.n_samples = data.n_samples;
+
+  send_results (result_fd, &result, data.samples);
+
+  dbus_connection_close (connection);
+  dbus_connection_unref (connection);
+  dbus_free (data.samples);
+}
+
+/* -- parent ------------------------------------------------------------ */
+
+typedef void (* ChildFunction) (const BenchOptions *options,
+                                int                 ready_fd,
+                                int                 go_fd,
+                                int                 result_fd);
+
+static Child
+spawn_child (const BenchOptions *options,
+             ChildFunction       function,
+             int                 ready_fd,
+             int                 go_fd,
+             int                 go_write_fd)
+{
+  Child child;
+  int result_pipe[2];
+
+  if (pipe (result_pipe) < 0)
+    die ("pipe failed");
+
+  child.pid = fork ();
+  if (child.pid < 0)
+    die ("fork failed");
+
+  if (child.pid == 0)
+    {
+      close (result_pipe[0]);
+      close (go_write_fd);
+      (* function) (options, ready_fd, go_fd, result_pipe[1]);
+      _exit (0);
+    }
+
+  close (result_pipe[1]);
+  child.result_fd = result_pipe[0];
+
+  return child;
+}
+
+static int
+compare_samples (const void *a,
+                 const void *b)
+{
+  dbus_uint32_t x = *(const dbus_uint32_t *) a;
+  dbus_uint32_t y = *(const dbus_uint32_t *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static dbus_uint32_t
+percentile (const dbus_uint32_t *sorted,
+            int                  n,
+            int                  per_thousand)
+{
+  if (n == 0)
+    return 0;
+
+  return sorted[MIN (n - 1, (long) n * per_thousand / 1000)];
+}
+
+static void
+usage (void)
+{
+  fprintf (stderr,
+           "Usage: bus-bench [--address=ADDRESS | --config-file=FILE]\n"
+           "                 [--daemon=PATH] [--clients=N] [--listeners=M]\n"
+           "                 [--messages=K] [--payload=BYTES]\n"
+           "                 ping|broadcast|payload\n");
+  exit (1);
+}
+
+static int
+int_arg (const char *arg,
+         const char *prefix)
+{
+  return atoi (arg + strlen (prefix));
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  BenchOptions options;
+  const char *config_file;
+  const char *daemon;
+  const char *mode_name;
+  char *daemon_address;
+  pid_t daemon_pid;
+  Child *children;
+  int n_children;
+  Child echo_service;
+  int ready_pipe[2], go_pipe[2];
+  dbus_uint32_t *samples;
+  long start_usec, end_usec;
+  int n_samples, total_messages;
+  double seconds;
+  char c;
+  int i;
+
+  options.mode = MODE_PING;
+  options.address = NULL;
+  options.n_clients = 1;
+  options.n_listeners = 1;
+  options.n_messages = 10000;
+  options.payload_size = -1;
+  config_file = NULL;
+  daemon = getenv ("DBUS_TEST_DAEMON");
+  if (daemon == NULL)
+    daemon = "dbus-daemon";
+  mode_name = "ping";
+
+  for (i = 1; i < argc; i++)
+    {
+      const char *arg = argv[i];
+
+      if (strncmp (arg, "--address=", 10) == 0)
+        options.address = arg + 10;
+      else if (strncmp (arg, "--config-file=", 14) == 0)
+        config_file = arg + 14;
+      else if (strncmp (arg, "--daemon=", 9) == 0)
+        daemon = arg + 9;
+      else if (strncmp (arg, "--clients=", 10) == 0)
+        options.n_clients = int_arg (arg, "--clients=");
+      else if (strncmp (arg, "--listeners=", 12) == 0)
+        options.n_listeners = int_arg (arg, "--listeners=");
+      else if (strncmp (arg, "--messages=", 11) == 0)
+        options.n_messages = int_arg (arg, "--messages=");
+      else if (strncmp (arg, "--payload=", 10) == 0)
+        options.payload_size = int_arg (arg, "--payload=");
+      else if (strcmp (arg, "ping") == 0)
+        options.mode = MODE_PING;
+      else if (strcmp (arg, "broadcast") == 0)
+        options.mode = MODE_BROADCAST;
+      else if (strcmp (arg, "payload") == 0)
+        options.mode = MODE_PAYLOAD;
+      else
+        usage ();
+
+      if (arg[0] != '-')
+        mode_name = arg;
+    }
+
+  if (options.n_clients < 1 || options.n_messages < 1 ||
+      (options.mode == MODE_BROADCAST && options.n_listeners < 1))
+    usage ();
+
+  if (options.payload_size < 0)
+    options.payload_size = options.mode == MODE_PAYLOAD ? 1024 * 1024 : 0;
+
+  if (options.mode != MODE_BROADCAST)
+    options.n_listeners = 0;
+
+  daemon_pid = 0;
+  daemon_address = NULL;
+  if (config_file != NULL)
+    {
+      daemon_address = test_daemon_spawn (daemon, config_file, &daemon_pid);
+      if (daemon_address == NULL)
+        die ("dbus-daemon did not print an address");
+      options.address = daemon_address;
+    }
+  else if (options.address == NULL)
+    options.address = getenv ("DBUS_SESSION_BUS_ADDRESS");
+
+  if (options.address == NULL)
+    usage ();
+
+  if (pipe (ready_pipe) < 0 || pipe (go_pipe) < 0)
+    die ("pipe failed");
+
+  echo_service.pid = 0;
+  if (options.mode != MODE_BROADCAST)
+    {
+      echo_service.pid = fork ();
+      if (echo_service.pid < 0)
+        die ("fork failed");
+      if (echo_service.pid == 0)
+        {
+          close (ready_pipe[0]);
+          close (go_pipe[0]);
+          close (go_pipe[1]);
+          run_echo_service (&options, ready_pipe[1]);
+          _exit (0);
+        }
+
+      if (!read_all (ready_pipe[0], &c, 1))
+        die ("echo service failed to start");
+    }
+
+  n_children = options.n_clients + options.n_listeners;
+  children = dbus_new (Child, n_children);
+  if (children == NULL)
+    die ("no memory");
+
+  for (i = 0; i < options.n_listeners; i++)
+    children[i] = spawn_child (&options, run_listener,
+                               ready_pipe[1], go_pipe[0], go_pipe[1]);
+
+  for (i = options.n_listeners; i < n_children; i++)
+    children[i] = spawn_child (&options,
+                               options.mode == MODE_BROADCAST ?
+                               run_broadcaster : run_caller,
+                               ready_pipe[1], go_pipe[0], go_pipe[1]);
+
+  close (ready_pipe[1]);
+  close (go_pipe[0]);
+
+  for (i = 0; i < n_children; i++)
+    {
+      if (!read_all (ready_pipe[0], &c, 1))
+        die ("a client failed to start");
+    }
+  close (ready_pipe[0]);
+
+  /* go */
+  close (go_pipe[1]);
+
+  samples = NULL;
+  n_samples = 0;
+  start_usec = 0;
+  end_usec = 0;
+
+  for (i = 0; i < n_children; i++)
+    {
+      ChildResult result;
+      dbus_uint32_t *new_samples;
+
+      if (!read_all (children[i].result_fd, &result, sizeof (result)))
+        die ("a client exited without reporting results");
+
+      new_samples = dbus_realloc (samples, (n_samples + result.n_samples + 1) *
+                                  sizeof (dbus_uint32_t));
+      if (new_samples == NULL)
+        die ("no memory");
+      samples = new_samples;
+
+      if (!read_all (children[i].result_fd, samples + n_samples,
+                     result.n_samples * sizeof (dbus_uint32_t)))
+        die ("a client exited without reporting results");
+      n_samples += result.n_samples;
+
+      if (i == 0 || result.start_usec < start_usec)
+        start_usec = result.start_usec;
+      if (result.end_usec > end_usec)
+        end_usec = result.end_usec;
+
+      close (children[i].result_fd);
+      waitpid (children[i].pid, NULL, 0);
+    }
+
+  if (echo_service.pid > 0)
+    {
+      kill (echo_service.pid, SIGTERM);
+      waitpid (echo_service.pid, NULL, 0);
+    }
+
+  if (daemon_pid > 0)
+    {
+      kill (daemon_pid, SIGTERM);
+      waitpid (daemon_pid, NULL, 0);
+    }
+
+  qsort (samples, n_samples, sizeof (dbus_uint32_t), compare_samples);
+
+  /* a broadcast is one message however many listeners it reaches */
+  total_messages = options.n_clients * options.n_messages;
+  seconds = MAX (end_usec - start_usec, 1) / 1000000.0;
+
+  printf ("mode=%s clients=%d listeners=%d messages=%d payload=%d "
+          "seconds=%.3f msgs_per_sec=%.0f p50_usec=%u p99_usec=%u "
+          "p999_usec=%u\n",
+          mode_name, options.n_clients, options.n_listeners, total_messages,
+          options.payload_size, seconds, total_messages / seconds,
+          percentile (samples, n_samples, 500),
+          percentile (samples, n_samples, 990),
+          percentile (samples, n_samples, 999));
+
+  dbus_free (samples);
+  dbus_free (children);
+  dbus_free (daemon_address);
+
+  return 0;
+}
@@ -0,0 +1,720 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* bus-replay.c  Replay a dbus-monitor --pcap capture against a bus
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* bus-replay reads a capture written by "dbus-monitor --pcap", opens
+ * one connection to a private dbus-daemon (or an existing bus) for
+ * every unique name seen in it, and sends each captured message again
+ * from the connection standing in for its original sender, either at
+ * the recorded pace, N times faster, or as fast as possible. It prints
+ * one line of results:
+ *
+ *   peers=12 messages=48210 skipped=3 seconds=4.87 msgs_per_sec=9899
+ *
+ * Unique names in destinations are rewritten to the stand-ins' names,
+ * and method returns and errors are sent with the serial of the call
+ * as it was replayed, so the daemon sees the same conversations it saw
+ * the first time. Well-known names are claimed up front by whichever
+ * stand-in answered calls to them or was announced as their owner.
+ *
+ * Messages the bus driver sent are not replayed, since the daemon
+ * sends them itself in response to the replayed calls; nor is Hello,
+ * which each stand-in has already sent. That means match rules are
+ * only recreated when the AddMatch calls are in the capture, so
+ * captures meant for replay should be started before the clients.
+ */
+
+#include <config.h>
+#include "test-utils.h"
+
+#include <string.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define DBUS_COMPILATION /* cheat and use the hash table and list */
+#include <dbus/dbus-hash.h>
+#include <dbus/dbus-list.h>
+#include <dbus/dbus-timeout.h>
+#undef DBUS_COMPILATION
+
+/* What dbus-monitor --pcap writes */
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_MAGIC_SWAPPED 0xd4c3b2a1
+#define PCAP_LINKTYPE_DBUS 231
+
+/* At maximum speed, how many messages to send before letting the
+ * main loop read and write again
+ */
+#define MAX_SPEED_BATCH 64
+
+typedef struct
+{
+  long         stamp_usec;
+  DBusMessage *message;
+} ReplayRecord;
+
+/* The connection standing in for one unique name in the capture */
+typedef struct
+{
+  char           *name;
+  DBusConnection *connection;
+  DBusHashTable  *serials;     /**< serial in the capture -> serial sent */
+  DBusList       *owned_names; /**< well-known names to claim first */
+} ReplayPeer;
+
+typedef struct
+{
+  DBusLoop      *loop;
+  DBusTimeout   *timeout;
+  ReplayRecord  *records;
+  int            n_records;
+  int            next;
+  double         speed;        /**< 0 for as fast as possible */
+  long           start_usec;
+  long           end_usec;
+  DBusHashTable *peers;        /**< unique name -> ReplayPeer */
+  int            n_peers;
+  int            n_sent;
+  int            n_skipped;
+} ReplayState;
+
+static void
+die (const char *message)
+{
+  fprintf (stderr, "*** bus-replay: %s\n", message);
+  exit (1);
+}
+
+static long
+now_usec (void)
+{
+  long tv_sec, tv_usec;
+
+  _dbus_get_current_time (&tv_sec, &tv_usec);
+  return tv_sec * 1000000 + tv_usec;
+}
+
+static dbus_uint32_t
+swap_uint32 (dbus_uint32_t value,
+             dbus_bool_t   swapped)
+{
+  if (!swapped)
+    return value;
+
+  return ((value & 0x000000ff) << 24) |
+         ((value & 0x0000ff00) << 8) |
+         ((value & 0x00ff0000) >> 8) |
+         ((value & 0xff000000) >> 24);
+}
+
+/* -- reading the capture ----------------------------------------------- */
+
+static void
+read_capture (FILE          *file,
+              ReplayRecord **records_p,
+              int           *n_records_p)
+{
+  dbus_uint32_t file_header[6];
+  dbus_uint32_t header[4];
+  ReplayRecord *records;
+  int n_records, n_allocated;
+  dbus_bool_t swapped;
+  char *blob;
+  DBusError error;
+
+  if (fread (file_header, sizeof (file_header), 1, file) != 1)
+    die ("capture is too short to be a pcap file");
+
+  if (file_header[0] == PCAP_MAGIC)
+    swapped = FALSE;
+  else if (file_header[0] == PCAP_MAGIC_SWAPPED)
+    swapped = TRUE;
+  else
+    die ("capture is not a pcap file");
+
+  if (swap_uint32 (file_header[5], swapped) != PCAP_LINKTYPE_DBUS)
+    die ("capture does not contain D-Bus messages");
+
+  dbus_error_init (&error);
+
+  records = NULL;
+  n_records = 0;
+  n_allocated = 0;
+
+  /* seconds, microseconds, bytes captured, length on the wire */
+  while (fread (header, sizeof (header), 1, file) == 1)
+    {
+      dbus_uint32_t len;
+      DBusMessage *message;
+
+      len = swap_uint32 (header[2], swapped);
+      if (len != swap_uint32 (header[3], swapped) ||
+          len > DBUS_MAXIMUM_MESSAGE_LENGTH)
+        die ("capture contains a truncated message");
+
+      blob = dbus_malloc (MAX (len, 1));
+      if (blob == NULL)
+        die ("no memory");
+
+      if (fread (blob, 1, len, file) != len)
+        die ("capture ends in the middle of a message");
+
+      message = dbus_message_demarshal (blob, len, &error);
+      dbus_free (blob);
+
+      if (message == NULL)
+        {
+          fprintf (stderr, "*** bus-replay: ignoring a bad message: %s\n",
+                   error.message);
+          dbus_error_free (&error);
+          continue;
+        }
+
+      if (n_records == n_allocated)
+        {
+          ReplayRecord *bigger;
+
+          n_allocated = MAX (n_allocated * 2, 256);
+          bigger = dbus_realloc (records, n_allocated * sizeof (ReplayRecord));
+          if (bigger == NULL)
+            die ("no memory");
+          records = bigger;
+        }
+
+      records[n_records].stamp_usec =
+        (long) swap_uint32 (header[0], swapped) * 1000000 +
+        swap_uint32 (header[1], swapped);
+      records[n_records].message = message;
+      n_records++;
+    }
+
+  *records_p = records;
+  *n_records_p = n_records;
+}
+
+/* -- the stand-ins ----------------------------------------------------- */
+
+static void
+peer_free (void *data)
+{
+  ReplayPeer *peer = data;
+
+  if (peer->connection != NULL)
+    {
+      dbus_connection_close (peer->connection);
+      dbus_connection_unref (peer->connection);
+    }
+
+  _dbus_hash_table_unref (peer->serials);
+  _dbus_list_clear (&peer->owned_names);
+  dbus_free (peer->name);
+  dbus_free (peer);
+}
+
+static ReplayPeer *
+ensure_peer (ReplayState *state,
+             const char  *name)
+{
+  ReplayPeer *peer;
+
+  peer = _dbus_hash_table_lookup_string (state->peers, name);
+  if (peer != NULL)
+    return peer;
+
+  peer = dbus_new0 (ReplayPeer, 1);
+  if (peer == NULL)
+    die ("no memory");
+
+  peer->name = _dbus_strdup (name);
+  peer->serials = _dbus_hash_table_new (DBUS_HASH_UINTPTR, NULL, NULL);
+  if (peer->name == NULL || peer->serials == NULL ||
+      !_dbus_hash_table_insert_string (state->peers, peer->name, peer))
+    die ("no memory");
+
+  state->n_peers++;
+
+  return peer;
+}
+
+static dbus_bool_t
+is_unique_name (const char *name)
+{
+  return name != NULL && name[0] == ':';
+}
+
+static void
+set_owner (DBusHashTable *owners,
+           const char    *name,
+           ReplayPeer    *peer)
+{
+  /* the first owner seen is the one the capture started with */
+  if (is_unique_name (name) ||
+      _dbus_hash_table_lookup_string (owners, name) != NULL)
+    return;
+
+  if (!_dbus_hash_table_insert_string (owners, (char *) name, peer) ||
+      !_dbus_list_append (&peer->owned_names, (char *) name))
+    die ("no memory");
+}
+
+/* Creates a peer for every unique name in the capture, and works out
+ * which of them owned each well-known name called in it
+ */
+static void
+find_peers (ReplayState *state)
+{
+  DBusHashTable *owners;
+  DBusHashTable *calls;
+  char key[128];
+  int i;
+
+  owners = _dbus_hash_table_new (DBUS_HASH_STRING, NULL, NULL);
+  calls = _dbus_hash_table_new (DBUS_HASH_STRING, dbus_free, NULL);
+  if (owners == NULL || calls == NULL)
+    die ("no memory");
+
+  for (i = 0; i < state->n_records; i++)
+    {
+      DBusMessage *message = state->records[i].message;
+      const char *sender = dbus_message_get_sender (message);
+      const char *destination = dbus_message_get_destination (message);
+      const char *well_known;
+
+      if (is_unique_name (sender))
+        ensure_peer (state, sender);
+      if (is_unique_name (destination))
+        ensure_peer (state, destination);
+
+      switch (dbus_message_get_type (message))
+        {
+        case DBUS_MESSAGE_TYPE_METHOD_CALL:
+          if (!is_unique_name (sender) || destination == NULL ||
+              is_unique_name (destination) ||
+              strcmp (destination, DBUS_SERVICE_DBUS) == 0)
+            break;
+
+          snprintf (key, sizeof (key), "%s/%u", sender,
+                    dbus_message_get_serial (message));
+          if (_dbus_hash_table_lookup_string (calls, key) == NULL)
+            {
+              char *copy = _dbus_strdup (key);
+
+              if (copy == NULL ||
+                  !_dbus_hash_table_insert_string (calls, copy,
+                                                   (char *) destination))
+                die ("no memory");
+            }
+          break;
+
+        case DBUS_MESSAGE_TYPE_METHOD_RETURN:
+        case DBUS_MESSAGE_TYPE_ERROR:
+          if (!is_unique_name (sender) || destination == NULL)
+            break;
+
+          snprintf (key, sizeof (key), "%s/%u", destination,
+                    dbus_message_get_reply_serial (message));
+          well_known = _dbus_hash_table_lookup_string (calls, key);
+          if (well_known != NULL)
+            set_owner (owners, well_known, ensure_peer (state, sender));
+          break;
+
+        case DBUS_MESSAGE_TYPE_SIGNAL:
+          if (sender != NULL && strcmp (sender, DBUS_SERVICE_DBUS) == 0 &&
+              dbus_message_is_signal (message, DBUS_INTERFACE_DBUS,
+                                      "NameOwnerChanged"))
+            {
+              const char *name, *old_owner, *new_owner;
+
+              if (dbus_message_get_args (message, NULL,
+                                         DBUS_TYPE_STRING, &name,
+                                         DBUS_TYPE_STRING, &old_owner,
+                                         DBUS_TYPE_STRING, &new_owner,
+                                         DBUS_TYPE_INVALID) &&
+                  is_unique_name (new_owner))
+                set_owner (owners, name, ensure_peer (state, new_owner));
+            }
+          break;
+        }
+    }
+
+  _dbus_hash_table_unref (calls);
+  _dbus_hash_table_unref (owners);
+}
+
+/* Stand-ins never answer anything; they only exist so that the daemon
+ * has someone to route to
+ */
+static DBusHandlerResult
+swallow_filter (DBusConnection *connection,
+                DBusMessage    *message,
+                void           *user_data)
+{
+  if (dbus_message_is_signal (message, DBUS_INTERFACE_LOCAL, "Disconnected"))
+    fprintf (stderr, "*** bus-replay: %s was disconnected\n",
+             (const char *) user_data);
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static void
+connect_peers (ReplayState *state,
+               const char  *address)
+{
+  DBusHashIter iter;
+  DBusError error;
+
+  dbus_error_init (&error);
+
+  _dbus_hash_iter_init (state->peers, &iter);
+  while (_dbus_hash_iter_next (&iter))
+    {
+      ReplayPeer *peer = _dbus_hash_iter_get_value (&iter);
+      DBusList *link;
+
+      peer->connection = dbus_connection_open_private (address, &error);
+      if (peer->connection == NULL ||
+          !dbus_bus_register (peer->connection, &error))
+        {
+          fprintf (stderr, "*** bus-replay: failed to connect to %s: %s\n",
+                   address, error.message);
+          exit (1);
+        }
+
+      dbus_connection_set_exit_on_disconnect (peer->connection, FALSE);
+
+      if (!dbus_connection_add_filter (peer->connection, swallow_filter,
+                                       peer->name, NULL) ||
+          !test_connection_setup (state->loop, peer->connection))
+        die ("no memory");
+
+      for (link = _dbus_list_get_first_link (&peer->owned_names);
+           link != NULL;
+           link = _dbus_list_get_next_link (&peer->owned_names, link))
+        {
+          if (dbus_bus_request_name (peer->connection, link->data,
+                                     DBUS_NAME_FLAG_DO_NOT_QUEUE, &error) !=
+              DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+            {
+              fprintf (stderr, "*** bus-replay: could not own %s%s%s\n",
+                       (const char *) link->data,
+                       dbus_error_is_set (&error) ? ": " : "",
+                       dbus_error_is_set (&error) ? error.message : "");
+              if (dbus_error_is_set (&error))
+                dbus_error_free (&error);
+            }
+        }
+    }
+}
+
+/* -- replaying --------------------------------------------------------- */
+
+static void
+replay_record (ReplayState  *state,
+               ReplayRecord *record)
+{
+  DBusMessage *message = record->message;
+  const char *sender = dbus_message_get_sender (message);
+  const char *destination = dbus_message_get_destination (message);
+  int type = dbus_message_get_type (message);
+  ReplayPeer *peer;
+  dbus_uint32_t original_serial, serial;
+
+  /* the daemon regenerates its own messages, and Hello was sent
+   * when the stand-in connected */
+  if (!is_unique_name (sender) ||
+      dbus_message_is_method_call (message, DBUS_INTERFACE_DBUS, "Hello"))
+    return;
+
+  peer = _dbus_hash_table_lookup_string (state->peers, sender);
+
+  if (type == DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+      type == DBUS_MESSAGE_TYPE_ERROR)
+    {
+      ReplayPeer *caller;
+      void *reply_serial;
+
+      caller = is_unique_name (destination) ?
+        _dbus_hash_table_lookup_string (state->peers, destination) : NULL;
+      reply_serial = caller == NULL ? NULL :
+        _dbus_hash_table_lookup_uintptr (caller->serials,
+                                         dbus_message_get_reply_serial (message));
+
+      /* the call was before the capture started */
+      if (reply_serial == NULL)
+        {
+          state->n_skipped++;
+          return;
+        }
+
+      _dbus_hash_table_remove_uintptr (caller->serials,
+                                       dbus_message_get_reply_serial (message));
+      if (!dbus_message_set_reply_serial (message,
+                                          _DBUS_POINTER_TO_INT (reply_serial)))
+        die ("no memory");
+    }
+
+  if (is_unique_name (destination))
+    {
+      ReplayPeer *recipient;
+
+      recipient = _dbus_hash_table_lookup_string (state->peers, destination);
+      if (!dbus_message_set_destination (message,
+                                         dbus_bus_get_unique_name (recipient->connection)))
+        die ("no memory");
+    }
+
+  original_serial = dbus_message_get_serial (message);
+
+  /* let the connection number it, as it would have the first time */
+  dbus_message_set_serial (message, 0);
+  if (!dbus_message_set_sender (message, NULL) ||
+      !dbus_connection_send (peer->connection, message, &serial))
+    die ("no memory");
+
+  if (type == DBUS_MESSAGE_TYPE_METHOD_CALL &&
+      !dbus_message_get_no_reply (message) &&
+      !_dbus_hash_table_insert_uintptr (peer->serials, original_serial,
+                                        _DBUS_INT_TO_POINTER (serial)))
+    die ("no memory");
+
+  state->n_sent++;
+}
+
+static dbus_bool_t
+replay_due_records (void *data)
+{
+  ReplayState *state = data;
+  long first_stamp;
+  long elapsed;
+  long due;
+  int batch;
+
+  first_stamp = state->records[0].stamp_usec;
+  elapsed = now_usec () - state->start_usec;
+
+  for (batch = 0; state->next < state->n_records; batch++)
+    {
+      ReplayRecord *record = &state->records[state->next];
+
+      if (state->speed == 0 ?
+          batch >= MAX_SPEED_BATCH :
+          (record->stamp_usec - first_stamp) / state->speed > elapsed)
+        break;
+
+      replay_record (state, record);
+      dbus_message_unref (record->message);
+      record->message = NULL;
+      state->next++;
+    }
+
+  if (state->next == state->n_records)
+    {
+      DBusHashIter iter;
+
+      _dbus_hash_iter_init (state->peers, &iter);
+      while (_dbus_hash_iter_next (&iter))
+        {
+          ReplayPeer *peer = _dbus_hash_iter_get_value (&iter);
+
+          dbus_connection_flush (peer->connection);
+        }
+
+      state->end_usec = now_usec ();
+
+      _dbus_timeout_set_enabled (state->timeout, FALSE);
+      _dbus_loop_toggle_timeout (state->loop, state->timeout);
+      _dbus_loop_quit (state->loop);
+      return TRUE;
+    }
+
+  /* the main loop measures the interval from when we last fired */
+  if (state->speed == 0)
+    due = 0;
+  else
+    due = (state->records[state->next].stamp_usec - first_stamp) /
+      state->speed - (now_usec () - state->start_usec);
+
+  _dbus_timeout_set_interval (state->timeout, MAX (due / 1000, 0));
+  _dbus_loop_toggle_timeout (state->loop, state->timeout);
+
+  return TRUE;
+}
+
+static void
+replay_timeout_callback (DBusTimeout *timeout,
+                         void        *data)
+{
+  dbus_timeout_handle (timeout);
+}
+
+static void
+usage (void)
+{
+  fprintf (stderr,
+           "Usage: bus-replay [--address=ADDRESS | --config-file=FILE]\n"
+           "                  [--daemon=PATH] [--speed=FACTOR|max]\n"
+           "                  [CAPTURE]\n");
+  exit (1);
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  ReplayState state;
+  const char *address;
+  const char *config_file;
+  const char *daemon;
+  const char *capture;
+  char *daemon_address;
+  pid_t daemon_pid;
+  FILE *file;
+  double seconds;
+  int i;
+
+  memset (&state, 0, sizeof (state));
+  state.speed = 1.0;
+  address = NULL;
+  config_file = NULL;
+  capture = NULL;
+  daemon = getenv ("DBUS_TEST_DAEMON");
+  if (daemon == NULL)
+    daemon = "dbus-daemon";
+
+  for (i = 1; i < argc; i++)
+    {
+      const char *arg = argv[i];
+
+      if (strncmp (arg, "--address=", 10) == 0)
+        address = arg + 10;
+      else if (strncmp (arg, "--config-file=", 14) == 0)
+        config_file = arg + 14;
+      else if (strncmp (arg, "--daemon=", 9) == 0)
+        daemon = arg + 9;
+      else if (strcmp (arg, "--speed=max") == 0)
+        state.speed = 0;
+      else if (strncmp (arg, "--speed=", 8) == 0)
+        {
+          state.speed = atof (arg + 8);
+          if (state.speed <= 0)
+            usage ();
+        }
+      else if (arg[0] == '-' && arg[1] != '\0')
+        usage ();
+      else if (capture == NULL)
+        capture = arg;
+      else
+        usage ();
+    }
+
+  if (capture == NULL || strcmp (capture, "-") == 0)
+    file = stdin;
+  else
+    file = fopen (capture, "rb");
+
+  if (file == NULL)
+    {
+      fprintf (stderr, "*** bus-replay: could not open %s\n", capture);
+      exit (1);
+    }
+
+  read_capture (file, &state.records, &state.n_records);
+  if (file != stdin)
+    fclose (file);
+
+  if (state.n_records == 0)
+    die ("capture contains no messages");
+
+  state.peers = _dbus_hash_table_new (DBUS_HASH_STRING, NULL, peer_free);
+  state.loop = _dbus_loop_new ();
+  if (state.peers == NULL || state.loop == NULL)
+    die ("no memory");
+
+  find_peers (&state);
+
+  daemon_pid = 0;
+  daemon_address = NULL;
+  if (config_file != NULL)
+    {
+      daemon_address = test_daemon_spawn (daemon, config_file, &daemon_pid);
+      if (daemon_address == NULL)
+        die ("dbus-daemon did not print an address");
+      address = daemon_address;
+    }
+  else if (address == NULL)
+    address = getenv ("DBUS_SESSION_BUS_ADDRESS");
+
+  if (address == NULL)
+    usage ();
+
+  connect_peers (&state, address);
+
+  state.timeout = _dbus_timeout_new (0, replay_due_records, &state, NULL);
+  if (state.timeout == NULL ||
+      !_dbus_loop_add_timeout (state.loop, state.timeout,
+                               replay_timeout_callback, &state, NULL))
+    die ("no memory");
+
+  state.start_usec = now_usec ();
+  _dbus_loop_run (state.loop);
+
+  seconds = MAX (state.end_usec - state.start_usec, 1) / 1000000.0;
+
+  printf ("peers=%d messages=%d skipped=%d seconds=%.3f msgs_per_sec=%.0f\n",
+          state.n_peers, state.n_sent, state.n_skipped, seconds,
+          state.n_sent / seconds);
+
+  _dbus_loop_remove_timeout (state.loop, state.timeout,
+                             replay_timeout_callback, &state);
+  _dbus_timeout_unref (state.timeout);
+
+  {
+    DBusHashIter iter;
+
+    _dbus_hash_iter_init (state.peers, &iter);
+    while (_dbus_hash_iter_next (&iter))
+      {
+        ReplayPeer *peer = _dbus_hash_iter_get_value (&iter);
+
+        test_connection_shutdown (state.loop, peer->connection);
+      }
+  }
+  _dbus_hash_table_unref (state.peers);
+
+  for (i = 0; i < state.n_records; i++)
+    {
+      if (state.records[i].message != NULL)
+        dbus_message_unref (state.records[i].message);
+    }
+  dbus_free (state.records);
+
+  _dbus_loop_unref (state.loop);
+
+  if (daemon_pid > 0)
+    {
+      kill (daemon_pid, SIGTERM);
+      waitpid (daemon_pid, NULL, 0);
+    }
+
+  dbus_free (daemon_address);
+
+  return 0;
+}
@@ -5,6 +5,7 @@
 <busconfig>
   <listen>@TEST_LISTEN@</listen>
   <servicedir>@TEST_VALID_SERVICE_DIR@</servicedir>
+  <priority_name>org.freedesktop.DBus.TestSuitePriority</priority_name>
   <policy context="default">
     <allow send_interface="*"/>
     <allow receive_interface="*"/>
@@ -0,0 +1,154 @@
+/**
+* Test to make sure the name owner cache of a bus connection follows
+* NameOwnerChanged, and stops answering once the connection is gone.
+**/
+
+#include <config.h>
+#include <dbus/dbus.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_NAME "org.freedesktop.DBus.TestSuite.NameOwnerCache"
+
+static void
+die (const char *message)
+{
+  fprintf (stderr, "*** test-name-owner-cache: %s", message);
+  exit (1);
+}
+
+static DBusHandlerResult
+count_name_owner_changes (DBusConnection *connection,
+                          DBusMessage    *message,
+                          void           *user_data)
+{
+  int *n_changes = user_data;
+  const char *name, *old_owner, *new_owner;
+
+  if (dbus_message_is_signal (message, DBUS_INTERFACE_DBUS,
+                              "NameOwnerChanged") &&
+      dbus_message_get_args (message, NULL,
+                             DBUS_TYPE_STRING, &name,
+                             DBUS_TYPE_STRING, &old_owner,
+                             DBUS_TYPE_STRING, &new_owner,
+                             DBUS_TYPE_INVALID) &&
+      strcmp (name, TEST_NAME) == 0)
+    *n_changes += 1;
+
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/* Dispatches until the cache's filter has seen the next change */
+static void
+wait_for_change (DBusConnection *connection,
+                 int            *n_changes)
+{
+  int n = *n_changes;
+
+  while (*n_changes == n)
+    {
+      if (!dbus_connection_read_write_dispatch (connection, -1))
+        die ("Disconnected while waiting for NameOwnerChanged\n");
+    }
+}
+
+static DBusConnection *
+connect_private (void)
+{
+  DBusConnection *connection;
+  DBusError error;
+
+  dbus_error_init (&error);
+
+  connection = dbus_bus_get_private (DBUS_BUS_SESSION, &error);
+  if (connection == NULL)
+    {
+      fprintf (stderr, "*** Failed to open connection to session bus: %s\n",
+               error.message);
+      dbus_error_free (&error);
+      exit (1);
+    }
+
+  dbus_connection_set_exit_on_disconnect (connection, FALSE);
+
+  return connection;
+}
+
+int
+main (int    argc,
+      char **argv)
+{
+  DBusConnection *watcher, *owner;
+  DBusError error;
+  int n_changes;
+
+  dbus_error_init (&error);
+
+  watcher = connect_private ();
+  owner = connect_private ();
+
+  n_changes = 0;
+  if (!dbus_connection_add_filter (watcher, count_name_owner_changes,
+                                   &n_changes, NULL) ||
+      !dbus_bus_set_name_owner_cache (watcher, TRUE))
+    die ("No memory\n");
+
+  if (dbus_bus_name_has_owner (watcher, TEST_NAME, &error))
+    die ("Name has an owner before anyone asked for it\n");
+  if (dbus_error_is_set (&error))
+    die ("Could not ask whether the name has an owner\n");
+
+  if (dbus_bus_request_name (owner, TEST_NAME, 0, &error) !=
+      DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+    die ("Could not get the name\n");
+
+  wait_for_change (watcher, &n_changes);
+  if (!dbus_bus_name_has_owner (watcher, TEST_NAME, &error))
+    die ("Cache missed the name being taken\n");
+
+  if (dbus_bus_release_name (owner, TEST_NAME, &error) !=
+      DBUS_RELEASE_NAME_REPLY_RELEASED)
+    die ("Could not release the name\n");
+
+  /* the answer comes from the cache until the watcher hears about it */
+  if (!dbus_bus_name_has_owner (watcher, TEST_NAME, &error))
+    die ("Name was asked of the bus rather than the cache\n");
+
+  wait_for_change (watcher, &n_changes);
+  if (dbus_bus_name_has_owner (watcher, TEST_NAME, &error))
+    die ("Cache missed the name being released\n");
+
+  if (dbus_bus_request_name (owner, TEST_NAME, 0, &error) !=
+      DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+    die ("Could not get the name again\n");
+
+  wait_for_change (watcher, &n_changes);
+  if (!dbus_bus_name_has_owner (watcher, TEST_NAME, &error))
+    die ("Cache missed the name being taken again\n");
+
+  /* cut off, the cached owner is no answer */
+  dbus_connection_close (watcher);
+
+  if (dbus_bus_name_has_owner (watcher, TEST_NAME, &error) ||
+      !dbus_error_is_set (&error))
+    die ("Disconnected connection answered from the cache\n");
+  dbus_error_free (&error);
+
+  while (dbus_connection_read_write_dispatch (watcher, -1))
+    ;
+
+  if (dbus_bus_name_has_owner (watcher, TEST_NAME, &error) ||
+      !dbus_error_is_set (&error))
+    die ("Cache survived the connection going away\n");
+  dbus_error_free (&error);
+
+  dbus_connection_unref (watcher);
+
+  dbus_connection_close (owner);
+  dbus_connection_unref (owner);
+
+  dbus_shutdown ();
+
+  return 0;
+}
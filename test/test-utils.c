@@ -1,6 +1,13 @@
 #include <config.h>
 #include "test-utils.h"
 
+#ifdef DBUS_UNIX
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#endif
+
 typedef struct
 {
   DBusLoop *loop;
@@ -38,6 +45,15 @@ remove_watch (DBusWatch *watch,
                            watch, connection_watch_callback, cd);  
 }
 
+static void
+toggle_watch (DBusWatch  *watch,
+              void       *data)
+{
+  CData *cd = data;
+
+  _dbus_loop_toggle_watch (cd->loop, watch);
+}
+
 static void
 connection_timeout_callback (DBusTimeout   *timeout,
                              void          *data)
@@ -66,6 +82,15 @@ remove_timeout (DBusTimeout *timeout,
                              timeout, connection_timeout_callback, cd);
 }
 
+static void
+toggle_timeout (DBusTimeout *timeout,
+                void        *data)
+{
+  CData *cd = data;
+
+  _dbus_loop_toggle_timeout (cd->loop, timeout);
+}
+
 static void
 dispatch_status_function (DBusConnection    *connection,
                           DBusDispatchStatus new_status,
@@ -133,7 +158,7 @@ test_connection_setup (DBusLoop       *loop,
   if (!dbus_connection_set_watch_functions (connection,
                                             add_watch,
                                             remove_watch,
-                                            NULL,
+                                            toggle_watch,
                                             cd, cdata_free))
     goto nomem;
 
@@ -145,7 +170,7 @@ test_connection_setup (DBusLoop       *loop,
   if (!dbus_connection_set_timeout_functions (connection,
                                               add_timeout,
                                               remove_timeout,
-                                              NULL,
+                                              toggle_timeout,
                                               cd, cdata_free))
     goto nomem;
 
@@ -259,6 +284,15 @@ remove_server_watch (DBusWatch  *watch,
                            watch, server_watch_callback, context);
 }
 
+static void
+toggle_server_watch (DBusWatch  *watch,
+                     void       *data)
+{
+  ServerData *context = data;
+
+  _dbus_loop_toggle_watch (context->loop, watch);
+}
+
 static void
 server_timeout_callback (DBusTimeout   *timeout,
                          void          *data)
@@ -287,6 +321,15 @@ remove_server_timeout (DBusTimeout *timeout,
                              timeout, server_timeout_callback, context);
 }
 
+static void
+toggle_server_timeout (DBusTimeout *timeout,
+                       void        *data)
+{
+  ServerData *context = data;
+
+  _dbus_loop_toggle_timeout (context->loop, timeout);
+}
+
 dbus_bool_t
 test_server_setup (DBusLoop      *loop,
                    DBusServer    *server)
@@ -300,7 +343,7 @@ test_server_setup (DBusLoop      *loop,
   if (!dbus_server_set_watch_functions (server,
                                         add_server_watch,
                                         remove_server_watch,
-                                        NULL,
+                                        toggle_server_watch,
                                         sd,
                                         serverdata_free))
     {
@@ -310,7 +353,7 @@ test_server_setup (DBusLoop      *loop,
   if (!dbus_server_set_timeout_functions (server,
                                           add_server_timeout,
                                           remove_server_timeout,
-                                          NULL,
+                                          toggle_server_timeout,
                                           sd, serverdata_free))
     {
       return FALSE;
@@ -342,3 +385,82 @@ test_server_shutdown (DBusLoop         *loop,
                                           NULL))
     _dbus_assert_not_reached ("setting timeout functions to NULL failed");  
 }
+
+#ifdef DBUS_UNIX
+/**
+ * Starts a private dbus-daemon with the given config file and reads
+ * back the address it listens on.
+ *
+ * @param daemon the dbus-daemon binary, looked up in PATH
+ * @param config_file the config file to pass it
+ * @param pid_p return location for the daemon's pid
+ * @returns the daemon's address, to be freed with dbus_free(), or #NULL
+ */
+char *
+test_daemon_spawn (const char *daemon,
+                   const char *config_file,
+                   pid_t      *pid_p)
+{
+  int address_pipe[2];
+  char address[1024];
+  char fd_arg[64];
+  char *config_arg;
+  int len;
+  pid_t pid;
+
+  if (pipe (address_pipe) < 0)
+    return NULL;
+
+  config_arg = dbus_malloc (strlen (config_file) + sizeof ("--config-file="));
+  if (config_arg == NULL)
+    {
+      close (address_pipe[0]);
+      close (address_pipe[1]);
+      return NULL;
+    }
+  strcpy (config_arg, "--config-file=");
+  strcat (config_arg, config_file);
+
+  snprintf (fd_arg, sizeof (fd_arg), "--print-address=%d", address_pipe[1]);
+
+  pid = fork ();
+  if (pid < 0)
+    {
+      close (address_pipe[0]);
+      close (address_pipe[1]);
+      dbus_free (config_arg);
+      return NULL;
+    }
+
+  if (pid == 0)
+    {
+      close (address_pipe[0]);
+      execlp (daemon, daemon, "--nofork", fd_arg, config_arg, NULL);
+      fprintf (stderr, "could not run %s: %s\n", daemon, strerror (errno));
+      _exit (1);
+    }
+
+  close (address_pipe[1]);
+  dbus_free (config_arg);
+
+  len = 0;
+  while (len < (int) sizeof (address) - 1)
+    {
+      ssize_t n = read (address_pipe[0], address + len, 1);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0 || address[len] == '\n')
+        break;
+      len++;
+    }
+  address[len] = '\0';
+  close (address_pipe[0]);
+
+  if (len == 0)
+    return NULL;
+
+  *pid_p = pid;
+  return _dbus_strdup (address);
+}
+#endif /* DBUS_UNIX */
@@ -10,6 +10,10 @@
 #include <dbus/dbus-internals.h>
 #undef DBUS_COMPILATION
 
+#ifdef DBUS_UNIX
+#include <sys/types.h>
+#endif
+
 dbus_bool_t test_connection_setup                 (DBusLoop       *loop,
                                                    DBusConnection *connection);
 void        test_connection_shutdown              (DBusLoop       *loop,
@@ -22,4 +26,10 @@ dbus_bool_t test_server_setup                     (DBusLoop      *loop,
 void        test_server_shutdown                  (DBusLoop      *loop,
                                                    DBusServer    *server);
 
+#ifdef DBUS_UNIX
+char *      test_daemon_spawn                     (const char    *daemon,
+                                                   const char    *config_file,
+                                                   pid_t         *pid_p);
+#endif
+
 #endif
@@ -36,6 +36,9 @@
 #include <signal.h>
 #include <stdarg.h>
 #include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stddef.h>
 #include <time.h>
 
 #ifdef DBUS_BUILD_X11
@@ -140,7 +143,7 @@ verbose (const char *format,
 static void
 usage (int ecode)
 {
-  fprintf (stderr, "dbus-launch [--version] [--help] [--sh-syntax] [--csh-syntax] [--auto-syntax] [--exit-with-session]\n");
+  fprintf (stderr, "dbus-launch [--version] [--help] [--sh-syntax] [--csh-syntax] [--auto-syntax] [--exit-with-session] [--socket-activation]\n");
   exit (ecode);
 }
 
@@ -743,6 +746,156 @@ oom:
 
 #define READ_END  0
 #define WRITE_END 1
+#define MAX_PID_LEN 64
+
+#ifdef HAVE_ABSTRACT_SOCKETS
+/* Creates the session bus socket in the abstract namespace, under a
+ * random name like the daemon's own "unix:tmpdir=/tmp" would pick,
+ * and writes the address clients should use into address.
+ */
+static int
+listen_session_socket (char   *address,
+                       size_t  address_len)
+{
+  static const char letters[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789";
+  struct sockaddr_un addr;
+  unsigned char random_bytes[10];
+  char path[sizeof ("/tmp/dbus-") + sizeof (random_bytes)];
+  int attempt;
+  int fd;
+  int i;
+
+  for (attempt = 0; attempt < 8; attempt++)
+    {
+      int random_fd;
+
+      random_fd = open ("/dev/urandom", O_RDONLY);
+      if (random_fd < 0 ||
+          read (random_fd, random_bytes, sizeof (random_bytes)) !=
+          sizeof (random_bytes))
+        {
+          srand (time (NULL) ^ getpid () ^ attempt);
+          for (i = 0; i < (int) sizeof (random_bytes); i++)
+            random_bytes[i] = rand ();
+        }
+      if (random_fd >= 0)
+        close (random_fd);
+
+      strcpy (path, "/tmp/dbus-");
+      for (i = 0; i < (int) sizeof (random_bytes); i++)
+        path[strlen ("/tmp/dbus-") + i] =
+          letters[random_bytes[i] % (sizeof (letters) - 1)];
+      path[strlen ("/tmp/dbus-") + i] = '\0';
+
+      fd = socket (PF_UNIX, SOCK_STREAM, 0);
+      if (fd < 0)
+        return -1;
+
+      memset (&addr, 0, sizeof (addr));
+      addr.sun_family = AF_UNIX;
+      strcpy (addr.sun_path + 1, path);
+
+      if (bind (fd, (struct sockaddr *) &addr,
+                offsetof (struct sockaddr_un, sun_path) + 1 + strlen (path)) == 0 &&
+          listen (fd, 30 /* backlog */) == 0)
+        {
+          snprintf (address, address_len, "unix:abstract=%s", path);
+          return fd;
+        }
+
+      close (fd);
+
+      if (errno != EADDRINUSE)
+        return -1;
+    }
+
+  return -1;
+}
+#endif /* HAVE_ABSTRACT_SOCKETS */
+
+/* Runs the bus daemon on an already-listening socket, handed over the
+ * same way systemd would, so that nobody has to wait for it to parse
+ * its configuration before they can connect. The socket becomes fd 3.
+ */
+static void
+exec_daemon_with_socket (int         listen_fd,
+                         const char *config_file)
+{
+  char pid_str[64];
+  int dev_null_fd;
+  const char *s;
+
+  if (listen_fd != 3)
+    {
+      if (dup2 (listen_fd, 3) < 0)
+        {
+          fprintf (stderr, "Failed to pass socket to bus daemon: %s\n",
+                   strerror (errno));
+          exit (1);
+        }
+      close (listen_fd);
+    }
+
+  sprintf (pid_str, "%lu", (unsigned long) getpid ());
+  setenv ("LISTEN_PID", pid_str, TRUE);
+  setenv ("LISTEN_FDS", "1", TRUE);
+
+  /* what "dbus-daemon --fork" would otherwise do for itself */
+  setsid ();
+  if (chdir ("/") < 0)
+    {
+      fprintf (stderr, "Could not change to root directory: %s\n",
+               strerror (errno));
+      exit (1);
+    }
+
+  dev_null_fd = open ("/dev/null", O_RDWR);
+  if (dev_null_fd >= 0)
+    {
+      dup2 (dev_null_fd, 0);
+      dup2 (dev_null_fd, 1);
+      s = getenv ("DBUS_DEBUG_OUTPUT");
+      if (s == NULL || *s == '\0')
+        dup2 (dev_null_fd, 2);
+      if (dev_null_fd > 3)
+        close (dev_null_fd);
+    }
+
+#ifdef DBUS_BUILD_TESTS
+  if (getenv ("DBUS_USE_TEST_BINARY") != NULL)
+    {
+      execl (TEST_BUS_BINARY,
+             TEST_BUS_BINARY,
+             "--nofork",
+             "--address=systemd:",
+             config_file ? "--config-file" : "--session",
+             config_file, /* has to be last in this varargs list */
+             NULL);
+    }
+#endif /* DBUS_BUILD_TESTS */
+
+  execl (DBUS_DAEMONDIR"/dbus-daemon",
+         DBUS_DAEMONDIR"/dbus-daemon",
+         "--nofork",
+         "--address=systemd:",
+         config_file ? "--config-file" : "--session",
+         config_file, /* has to be last in this varargs list */
+         NULL);
+
+  execlp ("dbus-daemon",
+          "dbus-daemon",
+          "--nofork",
+          "--address=systemd:",
+          config_file ? "--config-file" : "--session",
+          config_file, /* has to be last in this varargs list */
+          NULL);
+
+  fprintf (stderr,
+           "Failed to execute message bus daemon: %s\n",
+           strerror (errno));
+  exit (1);
+}
 
 int
 main (int argc, char **argv)
@@ -765,6 +918,9 @@ main (int argc, char **argv)
   int bus_pid_to_babysitter_pipe[2];
   int bus_address_to_launcher_pipe[2];
   char *config_file;
+  int socket_activation = FALSE;
+  int listen_fd = -1;
+  char listen_address[MAX_ADDR_LEN];
   
   exit_with_session = FALSE;
   config_file = NULL;
@@ -795,6 +951,8 @@ main (int argc, char **argv)
         exit_with_session = TRUE;
       else if (strcmp (arg, "--close-stderr") == 0)
         close_stderr = TRUE;
+      else if (strcmp (arg, "--socket-activation") == 0)
+        socket_activation = TRUE;
       else if (strstr (arg, "--autolaunch=") == arg)
         {
           const char *s;
@@ -954,6 +1112,17 @@ main (int argc, char **argv)
 #endif
     }
 
+  if (socket_activation)
+    {
+#ifdef HAVE_ABSTRACT_SOCKETS
+      listen_fd = listen_session_socket (listen_address, MAX_ADDR_LEN);
+      if (listen_fd < 0)
+        verbose ("Could not create the bus socket (%s), letting the daemon do it\n",
+                 strerror (errno));
+#else
+      verbose ("--socket-activation needs abstract sockets, ignoring it\n");
+#endif
+    }
 
   if (pipe (bus_pid_to_launcher_pipe) < 0 ||
       pipe (bus_address_to_launcher_pipe) < 0 ||
@@ -1009,6 +1178,8 @@ main (int argc, char **argv)
           close (bus_address_to_launcher_pipe[READ_END]);
           close (bus_address_to_launcher_pipe[WRITE_END]);
           close (bus_pid_to_babysitter_pipe[WRITE_END]);
+          if (listen_fd >= 0)
+            close (listen_fd);
 
           /* babysit() will fork *again*
            * and will also reap the pre-forked bus
@@ -1029,6 +1200,34 @@ main (int argc, char **argv)
       close (bus_pid_to_babysitter_pipe[READ_END]);
       close (bus_pid_to_babysitter_pipe[WRITE_END]);
 
+      if (listen_fd >= 0)
+        {
+          char pid_str[MAX_PID_LEN];
+
+          /* Fork the daemon ourselves, so its pid is known without
+           * waiting for it to start up
+           */
+          ret = fork ();
+          if (ret < 0)
+            {
+              fprintf (stderr, "Failed to fork: %s\n",
+                       strerror (errno));
+              exit (1);
+            }
+
+          if (ret > 0)
+            {
+              sprintf (pid_str, "%ld\n", (long) ret);
+              do_write (bus_pid_to_launcher_pipe[WRITE_END],
+                        pid_str, strlen (pid_str));
+              exit (0);
+            }
+
+          close (bus_pid_to_launcher_pipe[WRITE_END]);
+          close (bus_address_to_launcher_pipe[WRITE_END]);
+          exec_daemon_with_socket (listen_fd, config_file);
+        }
+
       sprintf (write_pid_fd_as_string,
                "%d", bus_pid_to_launcher_pipe[WRITE_END]);
 
@@ -1092,7 +1291,6 @@ main (int argc, char **argv)
   else
     {
       /* Parent */
-#define MAX_PID_LEN 64
       pid_t bus_pid;  
       char bus_address[MAX_ADDR_LEN];
       char buf[MAX_PID_LEN];
@@ -1119,23 +1317,33 @@ main (int argc, char **argv)
           exit (1);
         }
 
-      verbose ("Reading address from bus\n");
-      
-      /* Read the pipe data, print, and exit */
-      switch (read_line (bus_address_to_launcher_pipe[READ_END],
-                         bus_address, MAX_ADDR_LEN))
+      if (listen_fd >= 0)
         {
-        case READ_STATUS_OK:
-          break;
-        case READ_STATUS_EOF:
-          fprintf (stderr, "EOF in dbus-launch reading address from bus daemon\n");
-          exit (1);
-          break;
-        case READ_STATUS_ERROR:
-          fprintf (stderr, "Error in dbus-launch reading address from bus daemon: %s\n",
-                   strerror (errno));
-          exit (1);
-          break;
+          /* the daemon is still starting, but connections to the
+           * socket will wait for it */
+          close (listen_fd);
+          strcpy (bus_address, listen_address);
+        }
+      else
+        {
+          verbose ("Reading address from bus\n");
+      
+          /* Read the pipe data, print, and exit */
+          switch (read_line (bus_address_to_launcher_pipe[READ_END],
+                             bus_address, MAX_ADDR_LEN))
+            {
+            case READ_STATUS_OK:
+              break;
+            case READ_STATUS_EOF:
+              fprintf (stderr, "EOF in dbus-launch reading address from bus daemon\n");
+              exit (1);
+              break;
+            case READ_STATUS_ERROR:
+              fprintf (stderr, "Error in dbus-launch reading address from bus daemon: %s\n",
+                       strerror (errno));
+              exit (1);
+              break;
+            }
         }
         
       close (bus_address_to_launcher_pipe[READ_END]);
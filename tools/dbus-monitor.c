@@ -26,6 +26,8 @@
 
 #ifdef DBUS_WIN
 #include <winsock2.h>
+#include <io.h>
+#include <fcntl.h>
 #undef interface
 #else
 #include <sys/time.h>
@@ -204,10 +206,561 @@ profile_filter_func (DBusConnection	*connection,
   return DBUS_HANDLER_RESULT_HANDLED;
 }
 
+/* --top keeps counters in memory and prints the busiest senders,
+ * destinations and members every few seconds, rather than a line per
+ * message that has to be added up afterwards.
+ */
+#define TOP_TABLE_SIZE 257
+#define TOP_MAX_PENDING 65536
+#define TOP_N_SIZE_BUCKETS 6
+
+typedef struct TopEntry TopEntry;
+
+struct TopEntry
+{
+  TopEntry *next;
+  char *key;
+  unsigned long messages;
+  unsigned long bytes;
+  unsigned long replies;        /* method calls answered, for members */
+  unsigned long total_usec;     /* time from those calls to their replies */
+  unsigned long max_usec;
+};
+
+typedef struct
+{
+  TopEntry *buckets[TOP_TABLE_SIZE];
+  unsigned long n_entries;
+} TopTable;
+
+/* A method call we saw go by and expect to see the reply to, which
+ * will have the caller as its destination and the call's serial as
+ * its reply serial
+ */
+typedef struct TopPending TopPending;
+
+struct TopPending
+{
+  TopPending *next;
+  char *caller;
+  dbus_uint32_t serial;
+  struct timeval sent;
+  char *member;
+};
+
+static struct
+{
+  TopTable senders;
+  TopTable destinations;
+  TopTable members;
+  unsigned long sizes[TOP_N_SIZE_BUCKETS];
+  unsigned long messages;
+  unsigned long bytes;
+  TopPending *pending[TOP_TABLE_SIZE];
+  unsigned long n_pending;
+  unsigned long n_untracked;
+  struct timeval last_report;
+} top;
+
+static int top_interval = 5;
+static int top_count = 10;
+
+static const char * const top_size_labels[TOP_N_SIZE_BUCKETS] =
+  { "< 256", "< 1K", "< 4K", "< 16K", "< 64K", ">= 64K" };
+
+static void
+top_oom (void)
+{
+  fprintf (stderr, "dbus-monitor: out of memory\n");
+  exit (1);
+}
+
+static unsigned int
+top_hash (const char *str)
+{
+  unsigned int h = 0;
+
+  while (*str != '\0')
+    h = (h * 31) + (unsigned char) *str++;
+
+  return h;
+}
+
+static TopEntry *
+top_table_lookup (TopTable   *table,
+                  const char *key)
+{
+  unsigned int b = top_hash (key) % TOP_TABLE_SIZE;
+  TopEntry *entry;
+
+  for (entry = table->buckets[b]; entry != NULL; entry = entry->next)
+    {
+      if (strcmp (entry->key, key) == 0)
+        return entry;
+    }
+
+  entry = calloc (1, sizeof (TopEntry));
+  if (entry == NULL || (entry->key = strdup (key)) == NULL)
+    top_oom ();
+
+  entry->next = table->buckets[b];
+  table->buckets[b] = entry;
+  table->n_entries += 1;
+
+  return entry;
+}
+
+static void
+top_table_clear (TopTable *table)
+{
+  int b;
+
+  for (b = 0; b < TOP_TABLE_SIZE; b++)
+    {
+      while (table->buckets[b] != NULL)
+        {
+          TopEntry *entry = table->buckets[b];
+
+          table->buckets[b] = entry->next;
+          free (entry->key);
+          free (entry);
+        }
+    }
+
+  table->n_entries = 0;
+}
+
+static int
+top_compare_messages (const void *a,
+                      const void *b)
+{
+  const TopEntry *ea = *(const TopEntry * const *) a;
+  const TopEntry *eb = *(const TopEntry * const *) b;
+
+  if (ea->messages != eb->messages)
+    return ea->messages < eb->messages ? 1 : -1;
+
+  return ea->bytes < eb->bytes ? 1 : ea->bytes > eb->bytes ? -1 : 0;
+}
+
+static void
+top_print_table (const char *title,
+                 TopTable   *table,
+                 dbus_bool_t with_latency)
+{
+  TopEntry **sorted;
+  unsigned long i, n;
+  int b;
+
+  if (table->n_entries == 0)
+    return;
+
+  sorted = malloc (table->n_entries * sizeof (TopEntry *));
+  if (sorted == NULL)
+    top_oom ();
+
+  n = 0;
+  for (b = 0; b < TOP_TABLE_SIZE; b++)
+    {
+      TopEntry *entry;
+
+      for (entry = table->buckets[b]; entry != NULL; entry = entry->next)
+        sorted[n++] = entry;
+    }
+
+  qsort (sorted, n, sizeof (TopEntry *), top_compare_messages);
+
+  if (with_latency)
+    printf ("%-48s %9s %11s %8s %10s %10s\n", title,
+            "messages", "bytes", "replies", "avg usec", "max usec");
+  else
+    printf ("%-48s %9s %11s\n", title, "messages", "bytes");
+
+  for (i = 0; i < n && i < (unsigned long) top_count; i++)
+    {
+      printf ("  %-46s %9lu %11lu", sorted[i]->key,
+              sorted[i]->messages, sorted[i]->bytes);
+
+      if (with_latency && sorted[i]->replies > 0)
+        printf (" %8lu %10lu %10lu", sorted[i]->replies,
+                sorted[i]->total_usec / sorted[i]->replies,
+                sorted[i]->max_usec);
+
+      printf ("\n");
+    }
+
+  free (sorted);
+}
+
+static void
+top_report (void)
+{
+  int i;
+
+  printf ("--- %lu messages, %lu bytes in %d s; %lu calls awaiting a reply",
+          top.messages, top.bytes, top_interval, top.n_pending);
+  if (top.n_untracked > 0)
+    printf (", %lu more not tracked", top.n_untracked);
+  printf (" ---\n");
+
+  top_print_table ("senders", &top.senders, FALSE);
+  top_print_table ("destinations", &top.destinations, FALSE);
+  top_print_table ("interface.member", &top.members, TRUE);
+
+  if (top.messages > 0)
+    {
+      printf ("%-48s %9s\n", "message sizes", "messages");
+      for (i = 0; i < TOP_N_SIZE_BUCKETS; i++)
+        printf ("  %-46s %9lu\n", top_size_labels[i], top.sizes[i]);
+    }
+
+  printf ("\n");
+  fflush (stdout);
+
+  top_table_clear (&top.senders);
+  top_table_clear (&top.destinations);
+  top_table_clear (&top.members);
+  memset (top.sizes, 0, sizeof (top.sizes));
+  top.messages = 0;
+  top.bytes = 0;
+  top.n_untracked = 0;
+}
+
+/* Returns how long to wait for messages before the next report is due */
+static int
+top_report_if_due (void)
+{
+  struct timeval now;
+  long elapsed;
+
+  if (gettimeofday (&now, NULL) < 0)
+    return top_interval * 1000;
+
+  if (top.last_report.tv_sec == 0)
+    top.last_report = now;
+
+  elapsed = (now.tv_sec - top.last_report.tv_sec) * 1000 +
+    (now.tv_usec - top.last_report.tv_usec) / 1000;
+
+  if (elapsed >= top_interval * 1000)
+    {
+      top_report ();
+      top.last_report = now;
+      elapsed = 0;
+    }
+
+  return top_interval * 1000 - elapsed;
+}
+
+static void
+top_add (TopTable    *table,
+         const char  *key,
+         int          size)
+{
+  TopEntry *entry = top_table_lookup (table, TRAP_NULL_STRING (key));
+
+  entry->messages += 1;
+  entry->bytes += size;
+}
+
+static void
+top_call_sent (DBusMessage    *message,
+               const char     *member,
+               struct timeval *now)
+{
+  TopPending *pending;
+  unsigned int b;
+
+  if (dbus_message_get_no_reply (message) ||
+      dbus_message_get_sender (message) == NULL)
+    return;
+
+  /* Calls whose replies we never see, because of the watch
+   * expressions or because the callee went away, would otherwise
+   * pile up forever
+   */
+  if (top.n_pending >= TOP_MAX_PENDING)
+    {
+      top.n_untracked += 1;
+      return;
+    }
+
+  pending = calloc (1, sizeof (TopPending));
+  if (pending == NULL ||
+      (pending->caller = strdup (dbus_message_get_sender (message))) == NULL ||
+      (pending->member = strdup (member)) == NULL)
+    top_oom ();
+
+  pending->serial = dbus_message_get_serial (message);
+  pending->sent = *now;
+
+  b = (top_hash (pending->caller) ^ pending->serial) % TOP_TABLE_SIZE;
+  pending->next = top.pending[b];
+  top.pending[b] = pending;
+  top.n_pending += 1;
+}
+
+static void
+top_reply_sent (DBusMessage    *message,
+                struct timeval *now)
+{
+  const char *caller = dbus_message_get_destination (message);
+  dbus_uint32_t serial = dbus_message_get_reply_serial (message);
+  TopPending **p;
+  unsigned int b;
+
+  if (caller == NULL)
+    return;
+
+  b = (top_hash (caller) ^ serial) % TOP_TABLE_SIZE;
+
+  for (p = &top.pending[b]; *p != NULL; p = &(*p)->next)
+    {
+      TopPending *pending = *p;
+
+      if (pending->serial == serial && strcmp (pending->caller, caller) == 0)
+        {
+          TopEntry *entry = top_table_lookup (&top.members, pending->member);
+          long usec = (now->tv_sec - pending->sent.tv_sec) * 1000000L +
+            (now->tv_usec - pending->sent.tv_usec);
+
+          if (usec < 0)
+            usec = 0;
+
+          entry->replies += 1;
+          entry->total_usec += usec;
+          if ((unsigned long) usec > entry->max_usec)
+            entry->max_usec = usec;
+
+          *p = pending->next;
+          free (pending->caller);
+          free (pending->member);
+          free (pending);
+          top.n_pending -= 1;
+          return;
+        }
+    }
+}
+
+static DBusHandlerResult
+top_filter_func (DBusConnection     *connection,
+                 DBusMessage        *message,
+                 void               *user_data)
+{
+  struct timeval now;
+  char *blob;
+  int size, bucket;
+
+  if (dbus_message_is_signal (message,
+                              DBUS_INTERFACE_LOCAL,
+                              "Disconnected"))
+    {
+      top_report ();
+      exit (0);
+    }
+
+  /* There's no cheaper way to learn the size of a message */
+  if (!dbus_message_marshal (message, &blob, &size))
+    top_oom ();
+  dbus_free (blob);
+
+  if (gettimeofday (&now, NULL) < 0)
+    {
+      now.tv_sec = 0;
+      now.tv_usec = 0;
+    }
+
+  top.messages += 1;
+  top.bytes += size;
+
+  for (bucket = 0; bucket < TOP_N_SIZE_BUCKETS - 1; bucket++)
+    {
+      if (size < (256 << (2 * bucket)))
+        break;
+    }
+  top.sizes[bucket] += 1;
+
+  top_add (&top.senders, dbus_message_get_sender (message), size);
+  top_add (&top.destinations, dbus_message_get_destination (message), size);
+
+  switch (dbus_message_get_type (message))
+    {
+      case DBUS_MESSAGE_TYPE_METHOD_CALL:
+      case DBUS_MESSAGE_TYPE_SIGNAL:
+        {
+          /* Interface and member names are at most 255 bytes each */
+          char member[520];
+
+          snprintf (member, sizeof (member), "%s.%s",
+                    TRAP_NULL_STRING (dbus_message_get_interface (message)),
+                    TRAP_NULL_STRING (dbus_message_get_member (message)));
+          top_add (&top.members, member, size);
+
+          if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_METHOD_CALL)
+            top_call_sent (message, member, &now);
+        }
+        break;
+      case DBUS_MESSAGE_TYPE_METHOD_RETURN:
+      case DBUS_MESSAGE_TYPE_ERROR:
+        top_reply_sent (message, &now);
+        break;
+      default:
+        break;
+    }
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+/* The link-layer type registered with tcpdump.org for D-Bus messages,
+ * so that libpcap-based tools such as Wireshark can decode the capture
+ */
+#define PCAP_LINKTYPE_DBUS 231
+
+static void
+pcap_write (const void *data, size_t len)
+{
+  if (fwrite (data, 1, len, stdout) != len)
+    {
+      perror ("dbus-monitor: write");
+      exit (1);
+    }
+}
+
+static void
+pcap_write_file_header (void)
+{
+  /* magic, major and minor version, GMT offset, timestamp accuracy,
+   * snapshot length, link-layer type; all in host byte order, which
+   * readers work out from the magic number
+   */
+  dbus_uint32_t magic = 0xa1b2c3d4;
+  dbus_uint16_t version[2] = { 2, 4 };
+  dbus_uint32_t rest[4] = { 0, 0, DBUS_MAXIMUM_MESSAGE_LENGTH,
+                            PCAP_LINKTYPE_DBUS };
+
+  pcap_write (&magic, sizeof (magic));
+  pcap_write (version, sizeof (version));
+  pcap_write (rest, sizeof (rest));
+}
+
+/* Writes each message out exactly as it came off the wire, behind a
+ * timestamped pcap record header, and leaves decoding it to whoever
+ * reads the capture later; that keeps the monitor cheap enough not to
+ * fall behind on a busy bus.
+ */
+static DBusHandlerResult
+pcap_filter_func (DBusConnection     *connection,
+                  DBusMessage        *message,
+                  void               *user_data)
+{
+  struct timeval t;
+  dbus_uint32_t header[4];
+  char *blob;
+  int len;
+
+  if (!dbus_message_marshal (message, &blob, &len))
+    {
+      fprintf (stderr, "dbus-monitor: out of memory\n");
+      exit (1);
+    }
+
+  if (gettimeofday (&t, NULL) < 0)
+    {
+      t.tv_sec = 0;
+      t.tv_usec = 0;
+    }
+
+  /* seconds, microseconds, bytes captured, length on the wire */
+  header[0] = t.tv_sec;
+  header[1] = t.tv_usec;
+  header[2] = len;
+  header[3] = len;
+
+  pcap_write (header, sizeof (header));
+  pcap_write (blob, len);
+  dbus_free (blob);
+
+  if (dbus_message_is_signal (message,
+                              DBUS_INTERFACE_LOCAL,
+                              "Disconnected"))
+    exit (0);
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+/* Asks the bus to make us a monitor, which is cheaper for the bus than
+ * eavesdropping match rules and never slows other clients down when we
+ * fall behind. Older buses, and unprivileged users, get FALSE.
+ */
+static dbus_bool_t
+become_monitor (DBusConnection *connection,
+                char          **filters,
+                int             num_filters)
+{
+  DBusError error = DBUS_ERROR_INIT;
+  DBusMessage *m;
+  DBusMessage *r;
+  dbus_uint32_t zero = 0;
+  DBusMessageIter appender, array_appender;
+  int i;
+
+  m = dbus_message_new_method_call (DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+                                    "org.freedesktop.DBus.Monitoring",
+                                    "BecomeMonitor");
+  if (m == NULL)
+    {
+      fprintf (stderr, "dbus-monitor: out of memory\n");
+      exit (1);
+    }
+
+  dbus_message_iter_init_append (m, &appender);
+
+  if (!dbus_message_iter_open_container (&appender, DBUS_TYPE_ARRAY, "s",
+                                         &array_appender))
+    {
+      fprintf (stderr, "dbus-monitor: out of memory\n");
+      exit (1);
+    }
+
+  for (i = 0; i < num_filters; i++)
+    {
+      if (!dbus_message_iter_append_basic (&array_appender, DBUS_TYPE_STRING,
+                                           &filters[i]))
+        {
+          fprintf (stderr, "dbus-monitor: out of memory\n");
+          exit (1);
+        }
+    }
+
+  if (!dbus_message_iter_close_container (&appender, &array_appender) ||
+      !dbus_message_iter_append_basic (&appender, DBUS_TYPE_UINT32, &zero))
+    {
+      fprintf (stderr, "dbus-monitor: out of memory\n");
+      exit (1);
+    }
+
+  r = dbus_connection_send_with_reply_and_block (connection, m, -1, &error);
+  dbus_message_unref (m);
+
+  if (r != NULL)
+    {
+      dbus_message_unref (r);
+      return TRUE;
+    }
+
+  if (!dbus_error_has_name (&error, DBUS_ERROR_UNKNOWN_METHOD))
+    fprintf (stderr, "dbus-monitor: unable to enable new-style monitoring: "
+             "%s: \"%s\". Falling back to eavesdropping.\n",
+             error.name, error.message);
+
+  dbus_error_free (&error);
+  return FALSE;
+}
+
 static void
 usage (char *name, int ecode)
 {
-  fprintf (stderr, "Usage: %s [--system | --session | --address ADDRESS] [--monitor | --profile ] [watch expressions]\n", name);
+  fprintf (stderr, "Usage: %s [--system | --session | --address ADDRESS] [--monitor | --profile | --pcap | --top [--top-interval SECONDS] [--top-count N]] [watch expressions]\n", name);
   exit (ecode);
 }
 
@@ -266,6 +819,24 @@ main (int argc, char *argv[])
 	filter_func = monitor_filter_func;
       else if (!strcmp (arg, "--profile"))
 	filter_func = profile_filter_func;
+      else if (!strcmp (arg, "--pcap"))
+	filter_func = pcap_filter_func;
+      else if (!strcmp (arg, "--top"))
+	filter_func = top_filter_func;
+      else if (!strcmp (arg, "--top-interval") ||
+               !strcmp (arg, "--top-count"))
+	{
+	  int value;
+
+	  if (i+1 >= argc || (value = atoi (argv[i+1])) <= 0)
+	    usage (argv[0], 1);
+
+	  if (!strcmp (arg, "--top-interval"))
+	    top_interval = value;
+	  else
+	    top_count = value;
+	  i++;
+	}
       else if (!strcmp (arg, "--"))
 	continue;
       else if (arg[0] == '-')
@@ -279,6 +850,18 @@ main (int argc, char *argv[])
       }
     }
 
+  if (filter_func == pcap_filter_func)
+    {
+      /* Captures are written a buffer at a time and flushed whenever we
+       * have caught up with the bus, rather than a line at a time
+       */
+#ifdef DBUS_WIN
+      _setmode (_fileno (stdout), _O_BINARY);
+#endif
+      setvbuf (stdout, NULL, _IOFBF, BUFSIZ);
+      pcap_write_file_header ();
+    }
+
   dbus_error_init (&error);
   
   if (address != NULL)
@@ -323,7 +906,17 @@ main (int argc, char *argv[])
       exit (1);
     }
 
-  if (numFilters)
+  if (!dbus_connection_add_filter (connection, filter_func, NULL, NULL)) {
+    fprintf (stderr, "Couldn't add filter!\n");
+    exit (1);
+  }
+
+  if (become_monitor (connection, filters, numFilters))
+    {
+      for (i = 0; i < j; i++)
+        free (filters[i]);
+    }
+  else if (numFilters)
     {
       for (i = 0; i < j; i++)
         {
@@ -362,13 +955,19 @@ main (int argc, char *argv[])
         goto lose;
     }
 
-  if (!dbus_connection_add_filter (connection, filter_func, NULL, NULL)) {
-    fprintf (stderr, "Couldn't add filter!\n");
-    exit (1);
-  }
+  if (filter_func == top_filter_func)
+    {
+      while (dbus_connection_read_write_dispatch (connection,
+                                                  top_report_if_due ()))
+        ;
+    }
 
   while (dbus_connection_read_write_dispatch(connection, -1))
-    ;
+    {
+      if (filter_func == pcap_filter_func &&
+          dbus_connection_get_dispatch_status (connection) == DBUS_DISPATCH_COMPLETE)
+        fflush (stdout);
+    }
   exit (0);
  lose:
   fprintf (stderr, "Error: %s\n", error.message);
@@ -52,6 +52,7 @@ static void
 usage (int ecode)
 {
   fprintf (stderr, "Usage: %s [--help] [--system | --session | --address=ADDRESS] [--dest=NAME] [--type=TYPE] [--print-reply=(literal)] [--reply-timeout=MSEC] <destination object path> <message name> [contents ...]\n", appname);
+  fprintf (stderr, "       %s [--help] [--system | --session | --address=ADDRESS] [--dest=NAME] [--type=TYPE] [--print-reply=(literal)] [--reply-timeout=MSEC] [--pipeline=N] --stdin\n", appname);
   exit (ecode);
 }
 
@@ -223,133 +224,20 @@ type_from_name (const char *arg)
   return type;
 }
 
-int
-main (int argc, char *argv[])
+/* Builds a message from an object path, a dotted member name and
+ * contents arguments, which are modified in place
+ */
+static DBusMessage *
+build_message (int         message_type,
+               const char *dest,
+               const char *path,
+               char       *name,
+               int         n_contents,
+               char      **contents)
 {
-  DBusConnection *connection;
-  DBusError error;
   DBusMessage *message;
-  int print_reply;
-  int print_reply_literal;
-  int reply_timeout;
   DBusMessageIter iter;
   int i;
-  DBusBusType type = DBUS_BUS_SESSION;
-  const char *dest = NULL;
-  const char *name = NULL;
-  const char *path = NULL;
-  int message_type = DBUS_MESSAGE_TYPE_SIGNAL;
-  const char *type_str = NULL;
-  const char *address = NULL;
-  int session_or_system = FALSE;
-
-  appname = argv[0];
-  
-  if (argc < 3)
-    usage (1);
-
-  print_reply = FALSE;
-  print_reply_literal = FALSE;
-  reply_timeout = -1;
-  
-  for (i = 1; i < argc && name == NULL; i++)
-    {
-      char *arg = argv[i];
-
-      if (strcmp (arg, "--system") == 0)
-        {
-	  type = DBUS_BUS_SYSTEM;
-          session_or_system = TRUE;
-        }
-      else if (strcmp (arg, "--session") == 0)
-        {
-	  type = DBUS_BUS_SESSION;
-          session_or_system = TRUE;
-        }
-      else if (strstr (arg, "--address") == arg)
-        {
-          address = strchr (arg, '=');
-
-          if (address == NULL) 
-            {
-              fprintf (stderr, "\"--address=\" requires an ADDRESS\n");
-              usage (1);
-            }
-          else
-            {
-              address = address + 1;
-            }
-        }
-      else if (strncmp (arg, "--print-reply", 13) == 0)
-	{
-	  print_reply = TRUE;
-	  message_type = DBUS_MESSAGE_TYPE_METHOD_CALL;
-	  if (*(arg + 13) != '\0')
-	    print_reply_literal = TRUE;
-	}
-      else if (strstr (arg, "--reply-timeout=") == arg)
-	{
-	  reply_timeout = strtol (strchr (arg, '=') + 1,
-				  NULL, 10);
-	}
-      else if (strstr (arg, "--dest=") == arg)
-	dest = strchr (arg, '=') + 1;
-      else if (strstr (arg, "--type=") == arg)
-	type_str = strchr (arg, '=') + 1;
-      else if (!strcmp(arg, "--help"))
-	usage (0);
-      else if (arg[0] == '-')
-	usage (1);
-      else if (path == NULL)
-        path = arg;
-      else if (name == NULL)
-        name = arg;
-      else
-        usage (1);
-    }
-
-  if (name == NULL)
-    usage (1);
-
-  if (session_or_system &&
-      (address != NULL))
-    {
-      fprintf (stderr, "\"--address\" may not be used with \"--system\" or \"--session\"\n");
-      usage (1);
-    }
-
-  if (type_str != NULL)
-    {
-      message_type = dbus_message_type_from_string (type_str);
-      if (!(message_type == DBUS_MESSAGE_TYPE_METHOD_CALL ||
-            message_type == DBUS_MESSAGE_TYPE_SIGNAL))
-        {
-          fprintf (stderr, "Message type \"%s\" is not supported\n",
-                   type_str);
-          exit (1);
-        }
-    }
-  
-  dbus_error_init (&error);
-
-  if (address != NULL)
-    {
-      connection = dbus_connection_open (address, &error);
-    }
-  else
-    {
-      connection = dbus_bus_get (type, &error);
-    }
-
-  if (connection == NULL)
-    {
-      fprintf (stderr, "Failed to open connection to \"%s\" message bus: %s\n",
-               (address != NULL) ? address :
-                 ((type == DBUS_BUS_SYSTEM) ? "system" : "session"),
-               error.message);
-      dbus_error_free (&error);
-      exit (1);
-    }
 
   if (message_type == DBUS_MESSAGE_TYPE_METHOD_CALL)
     {
@@ -368,7 +256,8 @@ main (int argc, char *argv[])
                                               path,
                                               name,
                                               last_dot + 1);
-      dbus_message_set_auto_start (message, TRUE);
+      if (message != NULL)
+        dbus_message_set_auto_start (message, TRUE);
     }
   else if (message_type == DBUS_MESSAGE_TYPE_SIGNAL)
     {
@@ -405,7 +294,7 @@ main (int argc, char *argv[])
   
   dbus_message_iter_init_append (message, &iter);
 
-  while (i < argc)
+  for (i = 0; i < n_contents; i++)
     {
       char *arg;
       char *c;
@@ -416,12 +305,12 @@ main (int argc, char *argv[])
       DBusMessageIter container_iter;
 
       type = DBUS_TYPE_INVALID;
-      arg = argv[i++];
+      arg = contents[i];
       c = strchr (arg, ':');
 
       if (c == NULL)
 	{
-	  fprintf (stderr, "%s: Data item \"%s\" is badly formed\n", argv[0], arg);
+	  fprintf (stderr, "%s: Data item \"%s\" is badly formed\n", appname, arg);
 	  exit (1);
 	}
 
@@ -442,7 +331,7 @@ main (int argc, char *argv[])
 	  c = strchr (arg, ':');
 	  if (c == NULL)
 	    {
-	      fprintf (stderr, "%s: Data item \"%s\" is badly formed\n", argv[0], arg);
+	      fprintf (stderr, "%s: Data item \"%s\" is badly formed\n", appname, arg);
 	      exit (1);
 	    }
 	  *(c++) = 0;
@@ -460,7 +349,7 @@ main (int argc, char *argv[])
 	  c = strchr (c, ':');
 	  if (c == NULL)
 	    {
-	      fprintf (stderr, "%s: Data item \"%s\" is badly formed\n", argv[0], arg);
+	      fprintf (stderr, "%s: Data item \"%s\" is badly formed\n", appname, arg);
 	      exit (1);
 	    }
 	  *(c++) = 0;
@@ -508,6 +397,399 @@ main (int argc, char *argv[])
 	}
     }
 
+  return message;
+}
+
+/* Prints the reply to a call, or its error; returns FALSE for an error */
+static dbus_bool_t
+print_reply_or_error (DBusMessage *reply,
+                      int          print_reply_literal)
+{
+  DBusError error;
+
+  dbus_error_init (&error);
+
+  if (dbus_set_error_from_message (&error, reply))
+    {
+      fprintf (stderr, "Error %s: %s\n",
+               error.name,
+               error.message);
+      dbus_error_free (&error);
+      return FALSE;
+    }
+
+  print_message (reply, print_reply_literal);
+  return TRUE;
+}
+
+/* Reads a line of any length from stdin, without its newline, into a
+ * buffer that is reused from one call to the next; NULL at the end
+ */
+static char *
+read_line (char **buf,
+           size_t *size)
+{
+  size_t len;
+
+  if (*buf == NULL)
+    {
+      *size = 256;
+      *buf = malloc (*size);
+      if (*buf == NULL)
+        {
+          fprintf (stderr, "Not enough memory\n");
+          exit (1);
+        }
+    }
+
+  len = 0;
+  while (fgets (*buf + len, *size - len, stdin) != NULL)
+    {
+      len += strlen (*buf + len);
+
+      if (len > 0 && (*buf)[len - 1] == '\n')
+        {
+          (*buf)[--len] = '\0';
+          return *buf;
+        }
+
+      if (len == *size - 1)
+        {
+          char *bigger;
+
+          bigger = realloc (*buf, *size * 2);
+          if (bigger == NULL)
+            {
+              fprintf (stderr, "Not enough memory\n");
+              exit (1);
+            }
+          *buf = bigger;
+          *size *= 2;
+        }
+    }
+
+  /* a last line with no newline still counts */
+  return len > 0 ? *buf : NULL;
+}
+
+/* Sends one message per line of stdin over the one connection. Each
+ * line is "[--dest=NAME] [--type=TYPE] <path> <name> [contents ...]",
+ * split on whitespace, with the command line's options as defaults.
+ * Method calls that want a reply are sent up to pipeline at a time,
+ * and their replies printed in the order the lines were read.
+ * Returns FALSE if any call failed.
+ */
+static dbus_bool_t
+send_from_stdin (DBusConnection *connection,
+                 int             default_message_type,
+                 const char     *default_dest,
+                 int             print_reply,
+                 int             print_reply_literal,
+                 int             reply_timeout,
+                 int             pipeline)
+{
+  DBusPendingCall **in_flight;
+  int first_in_flight;
+  int n_in_flight;
+  char *line;
+  char *buf;
+  size_t size;
+  char **words;
+  int max_words;
+  dbus_bool_t ok;
+
+  in_flight = malloc (sizeof (DBusPendingCall *) * pipeline);
+  max_words = 16;
+  words = malloc (sizeof (char *) * max_words);
+  if (in_flight == NULL || words == NULL)
+    {
+      fprintf (stderr, "Not enough memory\n");
+      exit (1);
+    }
+
+  first_in_flight = 0;
+  n_in_flight = 0;
+  buf = NULL;
+  size = 0;
+  ok = TRUE;
+
+  while (TRUE)
+    {
+      DBusMessage *message;
+      DBusPendingCall *pending;
+      int message_type;
+      const char *dest;
+      char *path;
+      char *name;
+      int n_words;
+      int i;
+
+      /* Wait for the oldest reply once the pipeline is full, and for
+       * all of them at the end */
+      line = read_line (&buf, &size);
+
+      while (n_in_flight > 0 && (n_in_flight == pipeline || line == NULL))
+        {
+          DBusMessage *reply;
+
+          pending = in_flight[first_in_flight];
+          first_in_flight = (first_in_flight + 1) % pipeline;
+          n_in_flight -= 1;
+
+          dbus_pending_call_block (pending);
+          reply = dbus_pending_call_steal_reply (pending);
+          dbus_pending_call_unref (pending);
+
+          if (reply != NULL)
+            {
+              if (!print_reply_or_error (reply, print_reply_literal))
+                ok = FALSE;
+              dbus_message_unref (reply);
+            }
+        }
+
+      if (line == NULL)
+        break;
+
+      n_words = 0;
+      for (name = strtok (line, " \t"); name != NULL; name = strtok (NULL, " \t"))
+        {
+          if (n_words == max_words)
+            {
+              max_words *= 2;
+              words = realloc (words, sizeof (char *) * max_words);
+              if (words == NULL)
+                {
+                  fprintf (stderr, "Not enough memory\n");
+                  exit (1);
+                }
+            }
+          words[n_words++] = name;
+        }
+
+      /* blank lines and comments */
+      if (n_words == 0 || words[0][0] == '#')
+        continue;
+
+      message_type = default_message_type;
+      dest = default_dest;
+      path = NULL;
+      name = NULL;
+
+      for (i = 0; i < n_words && name == NULL; i++)
+        {
+          if (strstr (words[i], "--dest=") == words[i])
+            dest = strchr (words[i], '=') + 1;
+          else if (strstr (words[i], "--type=") == words[i])
+            {
+              message_type = dbus_message_type_from_string (strchr (words[i], '=') + 1);
+              if (!(message_type == DBUS_MESSAGE_TYPE_METHOD_CALL ||
+                    message_type == DBUS_MESSAGE_TYPE_SIGNAL))
+                {
+                  fprintf (stderr, "Message type \"%s\" is not supported\n",
+                           strchr (words[i], '=') + 1);
+                  exit (1);
+                }
+            }
+          else if (path == NULL)
+            path = words[i];
+          else
+            name = words[i];
+        }
+
+      if (name == NULL)
+        {
+          fprintf (stderr, "%s: Line needs an object path and a message name\n",
+                   appname);
+          exit (1);
+        }
+
+      message = build_message (message_type, dest, path, name,
+                               n_words - i, words + i);
+
+      if (print_reply && message_type == DBUS_MESSAGE_TYPE_METHOD_CALL)
+        {
+          if (!dbus_connection_send_with_reply (connection, message,
+                                                &pending, reply_timeout) ||
+              pending == NULL)
+            {
+              fprintf (stderr, "Not enough memory, or disconnected\n");
+              exit (1);
+            }
+
+          in_flight[(first_in_flight + n_in_flight) % pipeline] = pending;
+          n_in_flight += 1;
+        }
+      else
+        {
+          dbus_message_set_no_reply (message, TRUE);
+          dbus_connection_send (connection, message, NULL);
+        }
+
+      dbus_message_unref (message);
+    }
+
+  dbus_connection_flush (connection);
+
+  free (buf);
+  free (words);
+  free (in_flight);
+
+  return ok;
+}
+
+int
+main (int argc, char *argv[])
+{
+  DBusConnection *connection;
+  DBusError error;
+  DBusMessage *message;
+  int print_reply;
+  int print_reply_literal;
+  int reply_timeout;
+  int i;
+  DBusBusType type = DBUS_BUS_SESSION;
+  const char *dest = NULL;
+  char *name = NULL;
+  const char *path = NULL;
+  int message_type = DBUS_MESSAGE_TYPE_SIGNAL;
+  const char *type_str = NULL;
+  const char *address = NULL;
+  int session_or_system = FALSE;
+  int from_stdin = FALSE;
+  int pipeline = 1;
+
+  appname = argv[0];
+  
+  if (argc < 2)
+    usage (1);
+
+  print_reply = FALSE;
+  print_reply_literal = FALSE;
+  reply_timeout = -1;
+  
+  for (i = 1; i < argc && name == NULL; i++)
+    {
+      char *arg = argv[i];
+
+      if (strcmp (arg, "--system") == 0)
+        {
+	  type = DBUS_BUS_SYSTEM;
+          session_or_system = TRUE;
+        }
+      else if (strcmp (arg, "--session") == 0)
+        {
+	  type = DBUS_BUS_SESSION;
+          session_or_system = TRUE;
+        }
+      else if (strstr (arg, "--address") == arg)
+        {
+          address = strchr (arg, '=');
+
+          if (address == NULL) 
+            {
+              fprintf (stderr, "\"--address=\" requires an ADDRESS\n");
+              usage (1);
+            }
+          else
+            {
+              address = address + 1;
+            }
+        }
+      else if (strncmp (arg, "--print-reply", 13) == 0)
+	{
+	  print_reply = TRUE;
+	  message_type = DBUS_MESSAGE_TYPE_METHOD_CALL;
+	  if (*(arg + 13) != '\0')
+	    print_reply_literal = TRUE;
+	}
+      else if (strstr (arg, "--reply-timeout=") == arg)
+	{
+	  reply_timeout = strtol (strchr (arg, '=') + 1,
+				  NULL, 10);
+	}
+      else if (strstr (arg, "--pipeline=") == arg)
+	{
+	  pipeline = strtol (strchr (arg, '=') + 1, NULL, 10);
+	  if (pipeline < 1)
+	    usage (1);
+	}
+      else if (strcmp (arg, "--stdin") == 0)
+	from_stdin = TRUE;
+      else if (strstr (arg, "--dest=") == arg)
+	dest = strchr (arg, '=') + 1;
+      else if (strstr (arg, "--type=") == arg)
+	type_str = strchr (arg, '=') + 1;
+      else if (!strcmp(arg, "--help"))
+	usage (0);
+      else if (arg[0] == '-')
+	usage (1);
+      else if (from_stdin)
+        usage (1);
+      else if (path == NULL)
+        path = arg;
+      else if (name == NULL)
+        name = arg;
+      else
+        usage (1);
+    }
+
+  if (name == NULL && !from_stdin)
+    usage (1);
+
+  if (session_or_system &&
+      (address != NULL))
+    {
+      fprintf (stderr, "\"--address\" may not be used with \"--system\" or \"--session\"\n");
+      usage (1);
+    }
+
+  if (type_str != NULL)
+    {
+      message_type = dbus_message_type_from_string (type_str);
+      if (!(message_type == DBUS_MESSAGE_TYPE_METHOD_CALL ||
+            message_type == DBUS_MESSAGE_TYPE_SIGNAL))
+        {
+          fprintf (stderr, "Message type \"%s\" is not supported\n",
+                   type_str);
+          exit (1);
+        }
+    }
+  
+  dbus_error_init (&error);
+
+  if (address != NULL)
+    {
+      connection = dbus_connection_open (address, &error);
+    }
+  else
+    {
+      connection = dbus_bus_get (type, &error);
+    }
+
+  if (connection == NULL)
+    {
+      fprintf (stderr, "Failed to open connection to \"%s\" message bus: %s\n",
+               (address != NULL) ? address :
+                 ((type == DBUS_BUS_SYSTEM) ? "system" : "session"),
+               error.message);
+      dbus_error_free (&error);
+      exit (1);
+    }
+
+  if (from_stdin)
+    {
+      dbus_bool_t ok;
+
+      ok = send_from_stdin (connection, message_type, dest, print_reply,
+                            print_reply_literal, reply_timeout, pipeline);
+      dbus_connection_unref (connection);
+      exit (ok ? 0 : 1);
+    }
+
+  message = build_message (message_type, dest, path, name,
+                           argc - i, argv + i);
+
   if (print_reply)
     {
       DBusMessage *reply;